@@ -0,0 +1,258 @@
+#!/usr/bin/env python
+# Copyright (c) 2014 The Bitcoin Core developers
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+# Performance regression suite: builds a regtest chain of a configurable
+# size and times block connection, mempool acceptance, getblocktemplate,
+# wallet rescans and relay between nodes. The results are printed (and
+# optionally written) as JSON, to be compared between builds.
+
+# Add python-bitcoinrpc to module search path:
+import os
+import sys
+sys.path.append(os.path.join(os.path.dirname(os.path.abspath(__file__)), "python-bitcoinrpc"))
+
+import json
+import shutil
+import subprocess
+import tempfile
+import time
+import traceback
+
+from bitcoinrpc.authproxy import AuthServiceProxy, JSONRPCException
+from util import *
+
+# Nodes 0-2 build and relay the chain; node 3 starts empty and syncs it
+NUM_NODES = 3
+# Enough propagation events for every transaction and block of a run
+PROPTRACE_EVENTS = 1000000
+# Outputs of each fan-out transaction, to keep it standard
+MAX_FANOUT = 500
+FEE = Decimal("0.001")
+
+
+def generate_chain(nodes, num_blocks):
+    """
+    Mine num_blocks on node 0 and wait for the others to have them
+    """
+    start = time.time()
+    left = num_blocks
+    while left > 0:
+        n = min(left, 100)
+        nodes[0].setgenerate(True, n)
+        left -= n
+    height = nodes[0].getblockcount()
+    for node in nodes[1:]:
+        wait_for_height(node, height)
+    return { "blocks": num_blocks, "seconds": time.time()-start }
+
+def fan_out(node, num_outputs):
+    """
+    Split node's coins into num_outputs confirmed outputs of its own,
+    returned as (txid, vout, amount)
+    """
+    amount = (node.getbalance()/2/num_outputs).quantize(Decimal("0.0001"))
+    amount = min(amount, Decimal(1))
+    if amount <= FEE:
+        raise AssertionError("not enough coins for %d transactions; use more --blocks"%num_outputs)
+    txids = []
+    left = num_outputs
+    while left > 0:
+        n = min(left, MAX_FANOUT)
+        outputs = {}
+        for i in range(n):
+            outputs[node.getnewaddress()] = amount
+        txids.append(node.sendmany("", outputs))
+        left -= n
+    node.setgenerate(True, 1)
+    utxos = []
+    for utxo in node.listunspent():
+        if utxo["txid"] in txids and utxo["amount"] == amount:
+            utxos.append((utxo["txid"], utxo["vout"], utxo["amount"]))
+    return utxos[:num_outputs]
+
+def make_spends(node, utxos):
+    """
+    Signed transactions spending each utxo back to node, not sent
+    """
+    txs = []
+    for (txid, vout, amount) in utxos:
+        raw = node.createrawtransaction([ { "txid": txid, "vout": vout } ],
+                                        { node.getnewaddress(): amount-FEE })
+        signed = node.signrawtransaction(raw)
+        assert(signed["complete"])
+        txs.append(signed["hex"])
+    return txs
+
+def measure_mempool_accept(node, txs):
+    samples = []
+    txids = []
+    start = time.time()
+    for tx in txs:
+        t = time.time()
+        txids.append(node.sendrawtransaction(tx))
+        samples.append(time.time()-t)
+    elapsed = time.time()-start
+    result = { "txs": len(txs), "seconds": elapsed,
+               "txs_per_sec": len(txs)/elapsed if elapsed > 0 else 0,
+               "latency": summarize(samples) }
+    return (result, txids)
+
+def measure_getblocktemplate(node, num_calls):
+    # The first call builds the template; later ones find it unchanged
+    t = time.time()
+    template = node.getblocktemplate()
+    first = time.time()-t
+    samples = []
+    for i in range(num_calls):
+        t = time.time()
+        node.getblocktemplate()
+        samples.append(time.time()-t)
+    return { "mempool_txs": len(node.getrawmempool()),
+             "template_txs": len(template["transactions"]),
+             "first_ms": 1000.0*first,
+             "latency": summarize(samples) }
+
+def relay_latencies(source, source_event, nodes, hashes):
+    # All nodes run on this host, so their clocks agree
+    samples = []
+    for hash in hashes:
+        sent = first_event(source, hash, source_event)
+        if sent is None:
+            continue
+        for node in nodes:
+            received = first_event(node, hash, "validate")
+            if received is not None:
+                samples.append(received-sent)
+    return summarize(samples)
+
+def measure_block_relay(nodes, num_blocks):
+    hashes = []
+    for i in range(num_blocks):
+        height = nodes[0].getblockcount()+1
+        nodes[0].setgenerate(True, 1)
+        hashes.append(nodes[0].getbestblockhash())
+        for node in nodes[1:]:
+            wait_for_height(node, height)
+    return relay_latencies(nodes[0], "validate", nodes[1:], hashes)
+
+def measure_rescan(node_from, node_to):
+    """
+    Time importing a key of node_from, with a rescan of the whole chain,
+    into node_to
+    """
+    address = node_from.listunspent()[0]["address"]
+    key = node_from.dumpprivkey(address)
+    t = time.time()
+    node_to.importprivkey(key, "perf", True)
+    return { "blocks": node_to.getblockcount(), "seconds": time.time()-t }
+
+def measure_connect(dir, nodes):
+    """
+    Start an empty node and time it syncing the chain of node 0
+    """
+    n = len(nodes)
+    initialize_datadir(dir, n)
+    node = start_node(n, dir)
+    nodes.append(node)
+    height = nodes[0].getblockcount()
+    t = time.time()
+    connect_nodes(node, 0)
+    wait_for_height(node, height, 3600)
+    elapsed = time.time()-t
+    return { "blocks": height, "seconds": elapsed,
+             "blocks_per_sec": height/elapsed if elapsed > 0 else 0 }
+
+def run_test(nodes, options):
+    results = { "time": int(time.time()),
+                "version": nodes[0].getinfo()["version"] }
+
+    results["chain"] = generate_chain(nodes, options.blocks)
+
+    utxos = fan_out(nodes[0], options.txs)
+    for node in nodes[1:]:
+        wait_for_height(node, nodes[0].getblockcount())
+    txs = make_spends(nodes[0], utxos)
+
+    (results["mempool_accept"], txids) = measure_mempool_accept(nodes[0], txs)
+    results["getblocktemplate"] = measure_getblocktemplate(nodes[0], options.gbtcalls)
+
+    # Let the transactions reach the other nodes before tracing them
+    sync_mempools(nodes)
+    results["relay"] = { "tx": relay_latencies(nodes[0], "relay", nodes[1:], txids),
+                         "block": measure_block_relay(nodes, options.relayblocks) }
+
+    results["rescan"] = measure_rescan(nodes[0], nodes[1])
+    results["connect"] = measure_connect(options.tmpdir, nodes)
+    return results
+
+def main():
+    import optparse
+
+    parser = optparse.OptionParser(usage="%prog [options]")
+    parser.add_option("--nocleanup", dest="nocleanup", default=False, action="store_true",
+                      help="Leave bitcoinds and test.* datadir on exit or error")
+    parser.add_option("--srcdir", dest="srcdir", default="../../src",
+                      help="Source directory containing digitalcoind/digitalcoin-cli (default: %default)")
+    parser.add_option("--tmpdir", dest="tmpdir", default=tempfile.mkdtemp(prefix="perf"),
+                      help="Root directory for datadirs")
+    parser.add_option("--blocks", dest="blocks", type="int", default=500,
+                      help="Blocks to generate (default: %default)")
+    parser.add_option("--txs", dest="txs", type="int", default=1000,
+                      help="Transactions to send to the mempool (default: %default)")
+    parser.add_option("--gbtcalls", dest="gbtcalls", type="int", default=20,
+                      help="getblocktemplate calls to time (default: %default)")
+    parser.add_option("--relayblocks", dest="relayblocks", type="int", default=10,
+                      help="Blocks to time relaying (default: %default)")
+    parser.add_option("--output", dest="output", default=None,
+                      help="Also write the JSON results to this file")
+    (options, args) = parser.parse_args()
+
+    os.environ['PATH'] = options.srcdir+":"+os.environ['PATH']
+
+    check_json_precision()
+
+    success = False
+    nodes = []
+    try:
+        print("Initializing test directory "+options.tmpdir)
+        # A fresh chain rather than the cache, so its size can be chosen
+        for i in range(NUM_NODES):
+            initialize_datadir(options.tmpdir, i)
+        nodes = start_nodes(NUM_NODES, options.tmpdir,
+                            [ [ "-proptrace=%d"%PROPTRACE_EVENTS ] ]*NUM_NODES)
+        for i in range(1, NUM_NODES):
+            connect_nodes(nodes[i], 0)
+        wait_for_connections(nodes[0], NUM_NODES-1)
+
+        results = run_test(nodes, options)
+        text = json.dumps(results, indent=2, sort_keys=True, default=float)
+        print(text)
+        if options.output:
+            with open(options.output, 'w') as f:
+                f.write(text+"\n")
+
+        success = True
+
+    except AssertionError as e:
+        print("Assertion failed: "+str(e))
+    except Exception as e:
+        print("Unexpected exception caught during testing: "+str(e))
+        traceback.print_tb(sys.exc_info()[2])
+
+    if not options.nocleanup:
+        print("Cleaning up")
+        stop_nodes(nodes)
+        wait_bitcoinds()
+        shutil.rmtree(options.tmpdir)
+
+    if success:
+        print("Tests successful")
+        sys.exit(0)
+    else:
+        print("Failed")
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()
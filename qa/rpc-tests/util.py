@@ -22,6 +22,9 @@ from util import *
 START_P2P_PORT=11000
 START_RPC_PORT=11100
 
+BITCOIND="digitalcoind"
+BITCOIN_CLI="digitalcoin-cli"
+
 def check_json_precision():
     """Make sure json library being used does not lose precision converting BTC values"""
     n = Decimal("20000000.00000003")
@@ -57,30 +60,38 @@ def sync_mempools(rpc_connections):
 
 bitcoind_processes = []
 
+def initialize_datadir(dir, n):
+    """
+    Create an empty regtest data directory for node n, with
+    its ports and RPC credentials set in the config file.
+    """
+    datadir = os.path.join(dir, "node"+str(n))
+    os.makedirs(datadir)
+    with open(os.path.join(datadir, "digitalcoin.conf"), 'w') as f:
+        f.write("regtest=1\n");
+        f.write("rpcuser=rt\n");
+        f.write("rpcpassword=rt\n");
+        f.write("port="+str(START_P2P_PORT+n)+"\n");
+        f.write("rpcport="+str(START_RPC_PORT+n)+"\n");
+    return datadir
+
 def initialize_chain(test_dir):
     """
     Create (or copy from cache) a 200-block-long chain and
     4 wallets.
-    bitcoind and bitcoin-cli must be in search path.
+    digitalcoind and digitalcoin-cli must be in search path.
     """
 
     if not os.path.isdir(os.path.join("cache", "node0")):
         devnull = open("/dev/null", "w+")
         # Create cache directories, run bitcoinds:
         for i in range(4):
-            datadir = os.path.join("cache", "node"+str(i))
-            os.makedirs(datadir)
-            with open(os.path.join(datadir, "bitcoin.conf"), 'w') as f:
-                f.write("regtest=1\n");
-                f.write("rpcuser=rt\n");
-                f.write("rpcpassword=rt\n");
-                f.write("port="+str(START_P2P_PORT+i)+"\n");
-                f.write("rpcport="+str(START_RPC_PORT+i)+"\n");
-            args = [ "bitcoind", "-keypool=1", "-datadir="+datadir ]
+            datadir = initialize_datadir("cache", i)
+            args = [ BITCOIND, "-keypool=1", "-datadir="+datadir ]
             if i > 0:
                 args.append("-connect=127.0.0.1:"+str(START_P2P_PORT))
             bitcoind_processes.append(subprocess.Popen(args))
-            subprocess.check_call([ "bitcoin-cli", "-datadir="+datadir,
+            subprocess.check_call([ BITCOIN_CLI, "-datadir="+datadir,
                                     "-rpcwait", "getblockcount"], stdout=devnull)
         devnull.close()
         rpcs = []
@@ -112,21 +123,29 @@ def initialize_chain(test_dir):
         to_dir = os.path.join(test_dir,  "node"+str(i))
         shutil.copytree(from_dir, to_dir)
 
-def start_nodes(num_nodes, dir):
-    # Start bitcoinds, and wait for RPC interface to be up and running:
+def start_node(i, dir, extra_args=None):
+    """
+    Start bitcoind i, with extra command-line arguments if given, wait
+    for its RPC interface to be up and running and return a connection
+    """
     devnull = open("/dev/null", "w+")
-    for i in range(num_nodes):
-        datadir = os.path.join(dir, "node"+str(i))
-        args = [ "bitcoind", "-datadir="+datadir ]
-        bitcoind_processes.append(subprocess.Popen(args))
-        subprocess.check_call([ "bitcoin-cli", "-datadir="+datadir,
-                                  "-rpcwait", "getblockcount"], stdout=devnull)
+    datadir = os.path.join(dir, "node"+str(i))
+    args = [ BITCOIND, "-datadir="+datadir ]
+    if extra_args is not None:
+        args.extend(extra_args)
+    bitcoind_processes.append(subprocess.Popen(args))
+    subprocess.check_call([ BITCOIN_CLI, "-datadir="+datadir,
+                              "-rpcwait", "getblockcount"], stdout=devnull)
     devnull.close()
-    # Create&return JSON-RPC connections
+    url = "http://rt:rt@127.0.0.1:%d"%(START_RPC_PORT+i,)
+    return AuthServiceProxy(url)
+
+def start_nodes(num_nodes, dir, extra_args=None):
+    # Start bitcoinds, and wait for RPC interface to be up and running;
+    # extra_args, if given, has a list of arguments for each node
     rpc_connections = []
     for i in range(num_nodes):
-        url = "http://rt:rt@127.0.0.1:%d"%(START_RPC_PORT+i,)
-        rpc_connections.append(AuthServiceProxy(url))
+        rpc_connections.append(start_node(i, dir, extra_args[i] if extra_args else None))
     return rpc_connections
 
 def debug_log(dir, n_node):
@@ -147,6 +166,43 @@ def connect_nodes(from_connection, node_num):
     ip_port = "127.0.0.1:"+str(START_P2P_PORT+node_num)
     from_connection.addnode(ip_port, "onetry")
 
+def wait_for_height(node, height, timeout=600):
+    # Finer grained than sync_blocks, which polls once a second
+    deadline = time.time()+timeout
+    while node.getblockcount() < height:
+        if time.time() > deadline:
+            raise AssertionError("timeout waiting for height %d"%height)
+        time.sleep(0.05)
+
+def wait_for_connections(node, count):
+    while node.getconnectioncount() < count:
+        time.sleep(0.1)
+
+def summarize(samples):
+    """
+    Count, mean and quantiles of a list of durations in seconds, in
+    milliseconds
+    """
+    if not samples:
+        return { "count": 0 }
+    s = sorted(samples)
+    return { "count": len(s),
+             "mean_ms": 1000.0*sum(s)/len(s),
+             "min_ms": 1000.0*s[0],
+             "median_ms": 1000.0*s[len(s)//2],
+             "p90_ms": 1000.0*s[min(len(s)-1, int(len(s)*0.9))],
+             "max_ms": 1000.0*s[-1] }
+
+def first_event(node, hash, event):
+    """
+    Time in seconds of the first propagation event of a kind for hash
+    on node (started with -proptrace), None if there was none
+    """
+    for entry in node.getpropagationtrace(hash)["events"]:
+        if entry["event"] == event:
+            return entry["time_us"]/1000000.0
+    return None
+
 def assert_equal(thing1, thing2):
     if thing1 != thing2:
         raise AssertionError("%s != %s"%(str(thing1),str(thing2)))
@@ -0,0 +1,367 @@
+#!/usr/bin/env python
+# Copyright (c) 2014 The Bitcoin Core developers
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+# Synthetic wallet and mempool workload: drives a regtest node with bursts
+# of wallet sends, transactions with many inputs and outputs, chains of
+# unconfirmed spends, stealth payments and sendopreturn traffic, over RPC
+# and relayed over P2P, and reports their throughput and latency as JSON.
+# The same --seed gives the same mix of transactions.
+
+# Add python-bitcoinrpc to module search path:
+import os
+import sys
+sys.path.append(os.path.join(os.path.dirname(os.path.abspath(__file__)), "python-bitcoinrpc"))
+
+import json
+import random
+import shutil
+import string
+import tempfile
+import time
+import traceback
+
+from bitcoinrpc.authproxy import AuthServiceProxy, JSONRPCException
+from util import *
+
+# Node 0 takes the load; node 1 holds the coins of the raw transactions and
+# relays them to node 0 in the P2P phase
+NUM_NODES = 2
+PROPTRACE_EVENTS = 1000000
+MAX_FANOUT = 500
+FEE = Decimal("0.001")
+# Value of each output of node 1's pool
+POOL_AMOUNT = Decimal("0.1")
+
+class Timer(object):
+    """Client side latency of the calls of a phase"""
+    def __init__(self):
+        self.samples = []
+        self.start = time.time()
+
+    def call(self, fn, *args):
+        t = time.time()
+        result = fn(*args)
+        self.samples.append(time.time()-t)
+        return result
+
+    def result(self):
+        elapsed = time.time()-self.start
+        return { "calls": len(self.samples), "seconds": elapsed,
+                 "calls_per_sec": len(self.samples)/elapsed if elapsed > 0 else 0,
+                 "latency": summarize(self.samples) }
+
+def server_stats(node):
+    """
+    Time node spent in each RPC method since the last call, from
+    getrpcstats, which this resets
+    """
+    stats = {}
+    for method in node.getrpcstats(True)["methods"]:
+        if method["count"] == 0 or method["method"] == "getrpcstats":
+            continue
+        stats[method["method"]] = { "calls": method["count"],
+                                    "errors": method["errors"],
+                                    "mean_ms": method["total_us"]/1000.0/method["count"],
+                                    "max_ms": method["max_us"]/1000.0,
+                                    "lockwait_ms": method["lockwait_us"]/1000.0 }
+    return stats
+
+def make_pool(nodes, num_outputs):
+    """
+    Confirmed outputs of POOL_AMOUNT from node 0 to node 1, as
+    [(txid, vout)]. Node 1 never spends them from its wallet, so raw
+    transactions can use them without conflicts.
+    """
+    txids = []
+    left = num_outputs
+    while left > 0:
+        n = min(left, MAX_FANOUT)
+        outputs = {}
+        for i in range(n):
+            outputs[nodes[1].getnewaddress()] = POOL_AMOUNT
+        txids.append(nodes[0].sendmany("", outputs))
+        left -= n
+    confirm(nodes)
+    pool = []
+    for utxo in nodes[1].listunspent():
+        if utxo["txid"] in txids and utxo["amount"] == POOL_AMOUNT:
+            pool.append((utxo["txid"], utxo["vout"]))
+    return pool
+
+def confirm(nodes):
+    """Mine the mempool of node 0 and wait for node 1 to have it"""
+    nodes[0].setgenerate(True, 1)
+    wait_for_height(nodes[1], nodes[0].getblockcount())
+
+def take(pool, n):
+    if len(pool) < n:
+        raise AssertionError("pool of outputs exhausted; use more --pool")
+    taken = pool[:n]
+    del pool[:n]
+    return taken
+
+def split(rng, total, num_outputs):
+    """total less FEE in num_outputs random amounts, at least 0.001 each"""
+    left = total-FEE
+    amounts = []
+    for i in range(num_outputs-1):
+        share = (left/(num_outputs-i)*Decimal(rng.uniform(0.5, 1.5))).quantize(Decimal("0.00000001"))
+        share = min(max(share, Decimal("0.001")), left-Decimal("0.001")*(num_outputs-1-i))
+        amounts.append(share)
+        left -= share
+    amounts.append(left)
+    return amounts
+
+def sign(node, raw, prevtxs=None):
+    signed = node.signrawtransaction(raw, prevtxs) if prevtxs else node.signrawtransaction(raw)
+    assert(signed["complete"])
+    return signed["hex"]
+
+def make_many_inputs(nodes, rng, pool, count, max_inputs, max_outputs):
+    """
+    Signed, unsent transactions of node 1 each spending 1 to max_inputs
+    pool outputs to 1 to max_outputs new ones
+    """
+    txs = []
+    for i in range(count):
+        inputs = take(pool, rng.randint(1, max_inputs))
+        amounts = split(rng, POOL_AMOUNT*len(inputs), rng.randint(1, max_outputs))
+        outputs = {}
+        for amount in amounts:
+            outputs[nodes[1].getnewaddress()] = amount
+        raw = nodes[1].createrawtransaction([ { "txid": txid, "vout": vout } for (txid, vout) in inputs ],
+                                            outputs)
+        txs.append(sign(nodes[1], raw))
+    return txs
+
+def make_chain(nodes, pool, length):
+    """
+    A chain of length signed, unsent transactions of node 1, each spending
+    the only output of the one before
+    """
+    (txid, vout) = take(pool, 1)[0]
+    amount = POOL_AMOUNT
+    prevtxs = None
+    txs = []
+    for i in range(length):
+        amount -= FEE
+        if amount <= 0:
+            break
+        raw = nodes[1].createrawtransaction([ { "txid": txid, "vout": vout } ],
+                                            { nodes[1].getnewaddress(): amount })
+        tx = sign(nodes[1], raw, prevtxs)
+        txs.append(tx)
+        decoded = nodes[1].decoderawtransaction(tx)
+        (txid, vout) = (decoded["txid"], 0)
+        prevtxs = [ { "txid": txid, "vout": 0,
+                      "scriptPubKey": decoded["vout"][0]["scriptPubKey"]["hex"] } ]
+    return txs
+
+def measure_template(node):
+    """CreateNewBlock with the current mempool, from a cold getblocktemplate"""
+    t = time.time()
+    template = node.getblocktemplate()
+    return { "mempool_txs": len(node.getrawmempool()),
+             "template_txs": len(template["transactions"]),
+             "ms": 1000.0*(time.time()-t) }
+
+def run_phase(nodes, name, fn, results):
+    """
+    Run one phase of load against node 0, then time a block template of
+    the mempool it left and confirm it
+    """
+    server_stats(nodes[0])
+    result = fn()
+    result["server"] = server_stats(nodes[0])
+    result["createnewblock"] = measure_template(nodes[0])
+    confirm(nodes)
+    results[name] = result
+    print("Finished phase "+name)
+
+def phase_wallet(nodes, rng, options):
+    """Bursts of sendmany and sendtoaddress: CWallet::CreateTransaction and commit"""
+    addresses = [ nodes[1].getnewaddress() for i in range(options.maxoutputs) ]
+    sendmany = Timer()
+    sendtoaddress = Timer()
+    for burst in range(options.bursts):
+        for i in range(options.burstsize):
+            if rng.random() < 0.5:
+                outputs = {}
+                for address in rng.sample(addresses, rng.randint(1, options.maxoutputs)):
+                    outputs[address] = Decimal(rng.randint(10, 1000))/10000
+                sendmany.call(nodes[0].sendmany, "", outputs)
+            else:
+                sendtoaddress.call(nodes[0].sendtoaddress, rng.choice(addresses),
+                                   Decimal(rng.randint(1, 1000))/1000)
+        time.sleep(options.burstpause)
+    return { "sendmany": sendmany.result(), "sendtoaddress": sendtoaddress.result() }
+
+def submit_raw(node, txs):
+    """sendrawtransaction of each of txs: AcceptToMemoryPool"""
+    timer = Timer()
+    for tx in txs:
+        timer.call(node.sendrawtransaction, tx)
+    return { "sendrawtransaction": timer.result() }
+
+def phase_many_inputs(nodes, rng, pool, options):
+    txs = make_many_inputs(nodes, rng, pool, options.txs, options.maxinputs, options.maxoutputs)
+    return submit_raw(nodes[0], txs)
+
+def phase_chains(nodes, pool, options):
+    txs = []
+    for i in range(options.chains):
+        txs.extend(make_chain(nodes, pool, options.chainlength))
+    return submit_raw(nodes[0], txs)
+
+def phase_stealth(nodes, options):
+    address = nodes[1].getnewstealthaddress("workload")
+    timer = Timer()
+    for i in range(options.txs):
+        timer.call(nodes[0].sendtostealthaddress, address, Decimal("0.01"))
+    return { "sendtostealthaddress": timer.result() }
+
+def phase_opreturn(nodes, rng, options):
+    address = nodes[1].getnewaddress()
+    timer = Timer()
+    for i in range(options.txs):
+        data = "".join(rng.choice(string.ascii_letters) for j in range(rng.randint(1, 80)))
+        timer.call(nodes[0].sendopreturn, address, Decimal("0.01"), data)
+    return { "sendopreturn": timer.result() }
+
+def phase_p2p(nodes, rng, pool, options):
+    """
+    Transactions sent to node 1 and relayed to node 0: the time node 0 took
+    to accept each one it received, and from sending it to node 1
+    """
+    txs = make_many_inputs(nodes, rng, pool, options.txs, options.maxinputs, options.maxoutputs)
+    timer = Timer()
+    sent = {}
+    for tx in txs:
+        t = time.time()
+        txid = timer.call(nodes[1].sendrawtransaction, tx)
+        sent[txid] = t
+    deadline = time.time()+options.timeout
+    while not set(sent).issubset(set(nodes[0].getrawmempool())):
+        if time.time() > deadline:
+            break
+        time.sleep(0.05)
+    elapsed = time.time()-timer.start
+    accept = []
+    end_to_end = []
+    for txid in sent:
+        received = first_event(nodes[0], txid, "receive")
+        validated = first_event(nodes[0], txid, "validate")
+        if received is not None and validated is not None:
+            accept.append(validated-received)
+            end_to_end.append(validated-sent[txid])
+    return { "sendrawtransaction": timer.result(),
+             "txs_per_sec": len(end_to_end)/elapsed if elapsed > 0 else 0,
+             "accept": summarize(accept),
+             "relay": summarize(end_to_end) }
+
+def run_test(nodes, options):
+    rng = random.Random(options.seed)
+    results = { "time": int(time.time()),
+                "version": nodes[0].getinfo()["version"],
+                "seed": options.seed }
+
+    nodes[0].setgenerate(True, options.blocks)
+    wait_for_height(nodes[1], nodes[0].getblockcount())
+    pool = make_pool(nodes, options.pool)
+
+    run_phase(nodes, "wallet", lambda: phase_wallet(nodes, rng, options), results)
+    run_phase(nodes, "many_inputs", lambda: phase_many_inputs(nodes, rng, pool, options), results)
+    run_phase(nodes, "chains", lambda: phase_chains(nodes, pool, options), results)
+    run_phase(nodes, "stealth", lambda: phase_stealth(nodes, options), results)
+    run_phase(nodes, "opreturn", lambda: phase_opreturn(nodes, rng, options), results)
+    run_phase(nodes, "p2p", lambda: phase_p2p(nodes, rng, pool, options), results)
+    return results
+
+def main():
+    import optparse
+
+    parser = optparse.OptionParser(usage="%prog [options]")
+    parser.add_option("--nocleanup", dest="nocleanup", default=False, action="store_true",
+                      help="Leave bitcoinds and test.* datadir on exit or error")
+    parser.add_option("--srcdir", dest="srcdir", default="../../src",
+                      help="Source directory containing digitalcoind/digitalcoin-cli (default: %default)")
+    parser.add_option("--tmpdir", dest="tmpdir", default=tempfile.mkdtemp(prefix="workload"),
+                      help="Root directory for datadirs")
+    parser.add_option("--seed", dest="seed", type="int", default=1,
+                      help="Random seed of the workload (default: %default)")
+    parser.add_option("--blocks", dest="blocks", type="int", default=300,
+                      help="Blocks to generate for coins (default: %default)")
+    parser.add_option("--pool", dest="pool", type="int", default=5000,
+                      help="Outputs for the raw transactions (default: %default)")
+    parser.add_option("--txs", dest="txs", type="int", default=200,
+                      help="Transactions of each phase (default: %default)")
+    parser.add_option("--bursts", dest="bursts", type="int", default=5,
+                      help="Bursts of wallet sends (default: %default)")
+    parser.add_option("--burstsize", dest="burstsize", type="int", default=50,
+                      help="Wallet sends per burst (default: %default)")
+    parser.add_option("--burstpause", dest="burstpause", type="float", default=1.0,
+                      help="Seconds between bursts (default: %default)")
+    parser.add_option("--maxinputs", dest="maxinputs", type="int", default=20,
+                      help="Most inputs of a raw transaction (default: %default)")
+    parser.add_option("--maxoutputs", dest="maxoutputs", type="int", default=20,
+                      help="Most outputs of a transaction (default: %default)")
+    parser.add_option("--chains", dest="chains", type="int", default=10,
+                      help="Chains of unconfirmed spends (default: %default)")
+    parser.add_option("--chainlength", dest="chainlength", type="int", default=25,
+                      help="Transactions per chain (default: %default)")
+    parser.add_option("--timeout", dest="timeout", type="int", default=60,
+                      help="Seconds to wait for relayed transactions (default: %default)")
+    parser.add_option("--output", dest="output", default=None,
+                      help="Also write the JSON results to this file")
+    (options, args) = parser.parse_args()
+
+    os.environ['PATH'] = options.srcdir+":"+os.environ['PATH']
+
+    check_json_precision()
+
+    success = False
+    nodes = []
+    try:
+        print("Initializing test directory "+options.tmpdir)
+        for i in range(NUM_NODES):
+            initialize_datadir(options.tmpdir, i)
+        nodes = start_nodes(NUM_NODES, options.tmpdir,
+                            [ [ "-proptrace=%d"%PROPTRACE_EVENTS ] ]*NUM_NODES)
+        connect_nodes(nodes[1], 0)
+        wait_for_connections(nodes[0], 1)
+
+        results = run_test(nodes, options)
+        text = json.dumps(results, indent=2, sort_keys=True, default=float)
+        print(text)
+        if options.output:
+            with open(options.output, 'w') as f:
+                f.write(text+"\n")
+
+        success = True
+
+    except AssertionError as e:
+        print("Assertion failed: "+str(e))
+    except JSONRPCException as e:
+        print("JSONRPC error: "+e.error['message'])
+        traceback.print_tb(sys.exc_info()[2])
+    except Exception as e:
+        print("Unexpected exception caught during testing: "+str(e))
+        traceback.print_tb(sys.exc_info()[2])
+
+    if not options.nocleanup:
+        print("Cleaning up")
+        stop_nodes(nodes)
+        wait_bitcoinds()
+        shutil.rmtree(options.tmpdir)
+
+    if success:
+        print("Tests successful")
+        sys.exit(0)
+    else:
+        print("Failed")
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,118 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addressindex.h"
+
+#include "core.h"
+#include "main.h"
+
+using namespace std;
+
+bool GetAddressIndexKey(const CScript& script, char& chType, uint160& hashAddress)
+{
+    CTxDestination dest;
+    if (!ExtractDestination(script, dest))
+        return false;
+    if (const CKeyID* pkeyID = boost::get<CKeyID>(&dest)) {
+        chType = ADDRESS_INDEX_PUBKEYHASH;
+        hashAddress = *pkeyID;
+        return true;
+    }
+    if (const CScriptID* pscriptID = boost::get<CScriptID>(&dest)) {
+        chType = ADDRESS_INDEX_SCRIPTHASH;
+        hashAddress = *pscriptID;
+        return true;
+    }
+    return false;
+}
+
+// Blocks read back from disk to be disconnected have no merkle tree
+static uint256 GetBlockTxHash(const CBlock& block, unsigned int i)
+{
+    return block.vMerkleTree.empty() ? block.vtx[i].GetHash() : block.GetTxHash(i);
+}
+
+void CAddressIndexUpdate::AddBlock(const CBlock& block, const CBlockUndo& blockundo, int nHeight, bool fDisconnect)
+{
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction &tx = block.vtx[i];
+        uint256 hash = GetBlockTxHash(block, i);
+
+        CAddressIndexKey key;
+        key.nHeight = nHeight;
+        key.nTxIndex = i;
+        key.txhash = hash;
+
+        // Outputs paid to an address
+        for (unsigned int o = 0; o < tx.vout.size(); o++) {
+            const CTxOut &txout = tx.vout[o];
+            if (txout.scriptPubKey.IsUnspendable() || !GetAddressIndexKey(txout.scriptPubKey, key.chType, key.hashAddress))
+                continue;
+            key.nIndex = o;
+            key.fSpending = false;
+
+            CAddressUnspentKey keyUnspent;
+            keyUnspent.chType = key.chType;
+            keyUnspent.hashAddress = key.hashAddress;
+            keyUnspent.txhash = hash;
+            keyUnspent.nIndex = o;
+            if (fDisconnect) {
+                vHistoryErased.push_back(key);
+                vUnspentErased.push_back(keyUnspent);
+            } else {
+                vHistory.push_back(make_pair(key, txout.nValue));
+                vUnspent.push_back(make_pair(keyUnspent, CAddressUnspentValue(txout.nValue, txout.scriptPubKey, nHeight)));
+            }
+        }
+
+        // Inputs spending from an address, with the outputs they spend in
+        // the undo data
+        if (tx.IsCoinBase() || i - 1 >= blockundo.vtxundo.size())
+            continue;
+        const CTxUndo &txundo = blockundo.vtxundo[i - 1];
+        for (unsigned int j = 0; j < tx.vin.size() && j < txundo.vprevout.size(); j++) {
+            const CTxInUndo &undo = txundo.vprevout[j];
+            if (!GetAddressIndexKey(undo.txout.scriptPubKey, key.chType, key.hashAddress))
+                continue;
+            key.nIndex = j;
+            key.fSpending = true;
+
+            CAddressUnspentKey keyUnspent;
+            keyUnspent.chType = key.chType;
+            keyUnspent.hashAddress = key.hashAddress;
+            keyUnspent.txhash = tx.vin[j].prevout.hash;
+            keyUnspent.nIndex = tx.vin[j].prevout.n;
+            if (fDisconnect) {
+                vHistoryErased.push_back(key);
+                vUnspent.push_back(make_pair(keyUnspent, CAddressUnspentValue(undo.txout.nValue, undo.txout.scriptPubKey, undo.nHeight)));
+            } else {
+                vHistory.push_back(make_pair(key, -undo.txout.nValue));
+                vUnspentErased.push_back(keyUnspent);
+            }
+        }
+    }
+}
+
+void CAddressIndexUpdate::AddSpentOutputs(const CBlock& block, const CBlockUndo& blockundo, int nHeight, bool fDisconnect)
+{
+    for (unsigned int i = 1; i < block.vtx.size() && i - 1 < blockundo.vtxundo.size(); i++) {
+        const CTransaction &tx = block.vtx[i];
+        const CTxUndo &txundo = blockundo.vtxundo[i - 1];
+        for (unsigned int j = 0; j < tx.vin.size() && j < txundo.vprevout.size(); j++) {
+            if (fDisconnect) {
+                vSpentErased.push_back(tx.vin[j].prevout);
+                continue;
+            }
+            const CTxOut &txout = txundo.vprevout[j].txout;
+            CSpentIndexValue value;
+            value.txid = GetBlockTxHash(block, i);
+            value.nInputIndex = j;
+            value.nHeight = nHeight;
+            value.nValue = txout.nValue;
+            if (!GetAddressIndexKey(txout.scriptPubKey, value.chType, value.hashAddress))
+                value.chType = 0;
+            vSpent.push_back(make_pair(tx.vin[j].prevout, value));
+        }
+    }
+}
@@ -0,0 +1,173 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_ADDRESSINDEX_H
+#define BITCOIN_ADDRESSINDEX_H
+
+#include "core.h"
+#include "script.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <utility>
+#include <vector>
+
+class CBlockUndo;
+
+// With -addressindex, the block tree database keeps the history and the
+// unspent outputs of each address of the active chain, so that explorers
+// and payment processors can look them up instead of replaying blocks.
+// With -spentindex, it keeps the input spending each output of the chain.
+
+// Address types, as the first byte after the record type of the keys
+static const char ADDRESS_INDEX_PUBKEYHASH = 1;
+static const char ADDRESS_INDEX_SCRIPTHASH = 2;
+
+/** A 32-bit number serialized big-endian, so that keys sort by it */
+class CBigEndian32
+{
+protected:
+    uint32_t &n;
+public:
+    CBigEndian32(uint32_t &nIn) : n(nIn) { }
+
+    unsigned int GetSerializeSize(int, int) const
+    {
+        return 4;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int, int) const
+    {
+        unsigned char buf[4] = { (unsigned char)(n >> 24), (unsigned char)(n >> 16), (unsigned char)(n >> 8), (unsigned char)n };
+        s.write((char*)buf, 4);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int, int)
+    {
+        unsigned char buf[4];
+        s.read((char*)buf, 4);
+        n = ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | buf[3];
+    }
+};
+
+#define BIGENDIAN32(obj) REF(CBigEndian32(REF(obj)))
+
+/** An output paid to an address, or spent from it, in the history of the
+ *  address; sorted by height and position in the block */
+class CAddressIndexKey
+{
+public:
+    char chType;
+    uint160 hashAddress;
+    uint32_t nHeight;
+    uint32_t nTxIndex;
+    uint256 txhash;
+    uint32_t nIndex;  // of the output, or of the spending input
+    bool fSpending;
+
+    CAddressIndexKey() : chType(0), nHeight(0), nTxIndex(0), nIndex(0), fSpending(false) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(chType);
+        READWRITE(hashAddress);
+        READWRITE(BIGENDIAN32(nHeight));
+        READWRITE(BIGENDIAN32(nTxIndex));
+        READWRITE(txhash);
+        READWRITE(BIGENDIAN32(nIndex));
+        READWRITE(fSpending);
+    )
+};
+
+/** An unspent output of an address */
+class CAddressUnspentKey
+{
+public:
+    char chType;
+    uint160 hashAddress;
+    uint256 txhash;
+    uint32_t nIndex;
+
+    CAddressUnspentKey() : chType(0), nIndex(0) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(chType);
+        READWRITE(hashAddress);
+        READWRITE(txhash);
+        READWRITE(BIGENDIAN32(nIndex));
+    )
+};
+
+class CAddressUnspentValue
+{
+public:
+    int64_t nValue;
+    CScript script;
+    int nHeight;
+
+    CAddressUnspentValue() : nValue(0), nHeight(0) {}
+    CAddressUnspentValue(int64_t nValueIn, const CScript& scriptIn, int nHeightIn) : nValue(nValueIn), script(scriptIn), nHeight(nHeightIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nValue);
+        READWRITE(script);
+        READWRITE(nHeight);
+    )
+};
+
+/** The input spending an output, and what it spent */
+class CSpentIndexValue
+{
+public:
+    uint256 txid;
+    uint32_t nInputIndex;
+    int nHeight;
+    int64_t nValue;
+    char chType;  // of the address of the spent output, 0 if none
+    uint160 hashAddress;
+
+    CSpentIndexValue() : nInputIndex(0), nHeight(0), nValue(0), chType(0) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(txid);
+        READWRITE(nInputIndex);
+        READWRITE(nHeight);
+        READWRITE(nValue);
+        READWRITE(chType);
+        READWRITE(hashAddress);
+    )
+};
+
+/** What connecting or disconnecting a block writes to and erases from the
+ *  address and spent indexes; the history entries are signed amounts */
+class CAddressIndexUpdate
+{
+public:
+    std::vector<std::pair<CAddressIndexKey, int64_t> > vHistory;
+    std::vector<CAddressIndexKey> vHistoryErased;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+    std::vector<CAddressUnspentKey> vUnspentErased;
+    std::vector<std::pair<COutPoint, CSpentIndexValue> > vSpent;
+    std::vector<COutPoint> vSpentErased;
+
+    // The changes of connecting block at nHeight, or of disconnecting it
+    // with fDisconnect. blockundo holds the outputs spent by its inputs.
+    void AddBlock(const CBlock& block, const CBlockUndo& blockundo, int nHeight, bool fDisconnect);
+    // The same for the spent index
+    void AddSpentOutputs(const CBlock& block, const CBlockUndo& blockundo, int nHeight, bool fDisconnect);
+
+    bool IsEmpty() const
+    {
+        return vHistory.empty() && vHistoryErased.empty() && vUnspent.empty() && vUnspentErased.empty() && vSpent.empty() && vSpentErased.empty();
+    }
+};
+
+// The address type and hash of the key or script a script pays to, if any
+bool GetAddressIndexKey(const CScript& script, char& chType, uint160& hashAddress);
+
+#endif
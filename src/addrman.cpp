@@ -77,6 +77,14 @@ double CAddrInfo::GetChance(int64_t nNow) const
     for (int n=0; n<nAttempts; n++)
         fChance /= 1.5;
 
+    // favor nodes that answered and delivered blocks quickly, by up to 2x
+    // each; nodes never measured count as average
+    int64_t nLatency = GetLatencyUsec();
+    if (nLatency > 0)
+        fChance *= 2.0 * ADDRMAN_LATENCY_REFERENCE / (ADDRMAN_LATENCY_REFERENCE + nLatency);
+    if (nBlockUsec > 0)
+        fChance *= 2.0 * ADDRMAN_BLOCK_REFERENCE / (ADDRMAN_BLOCK_REFERENCE + nBlockUsec);
+
     return fChance;
 }
 
@@ -170,6 +178,7 @@ int CAddrMan::ShrinkNew(int nUBucket)
                 nNew--;
             }
             vNew.erase(it);
+            UpdateNewOccupied(nUBucket);
             return 0;
         }
     }
@@ -199,10 +208,54 @@ int CAddrMan::ShrinkNew(int nUBucket)
         nNew--;
     }
     vNew.erase(nOldest);
+    UpdateNewOccupied(nUBucket);
 
     return 1;
 }
 
+// Keep vOccupied listing the non-empty buckets, with vPos the position of
+// each bucket in it
+static void UpdateOccupiedBuckets(std::vector<int>& vOccupied, std::vector<int>& vPos, int nBucket, bool fOccupied)
+{
+    if (fOccupied && vPos[nBucket] == -1)
+    {
+        vPos[nBucket] = vOccupied.size();
+        vOccupied.push_back(nBucket);
+    }
+    else if (!fOccupied && vPos[nBucket] != -1)
+    {
+        // move the last one into its place
+        int nLast = vOccupied.back();
+        vOccupied[vPos[nBucket]] = nLast;
+        vPos[nLast] = vPos[nBucket];
+        vOccupied.pop_back();
+        vPos[nBucket] = -1;
+    }
+}
+
+void CAddrMan::UpdateTriedOccupied(int nKBucket)
+{
+    UpdateOccupiedBuckets(vTriedOccupied, vTriedOccupiedPos, nKBucket, !vvTried[nKBucket].empty());
+}
+
+void CAddrMan::UpdateNewOccupied(int nUBucket)
+{
+    UpdateOccupiedBuckets(vNewOccupied, vNewOccupiedPos, nUBucket, !vvNew[nUBucket].empty());
+}
+
+void CAddrMan::RebuildOccupied()
+{
+    vTriedOccupied.clear();
+    vTriedOccupiedPos.assign(vvTried.size(), -1);
+    for (unsigned int n = 0; n < vvTried.size(); n++)
+        UpdateTriedOccupied(n);
+
+    vNewOccupied.clear();
+    vNewOccupiedPos.assign(vvNew.size(), -1);
+    for (unsigned int n = 0; n < vvNew.size(); n++)
+        UpdateNewOccupied(n);
+}
+
 void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
 {
     assert(vvNew[nOrigin].count(nId) == 1);
@@ -211,7 +264,10 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
     for (std::vector<std::set<int> >::iterator it = vvNew.begin(); it != vvNew.end(); it++)
     {
         if ((*it).erase(nId))
+        {
             info.nRefCount--;
+            UpdateNewOccupied(it - vvNew.begin());
+        }
     }
     nNew--;
 
@@ -225,6 +281,7 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
     if (vTried.size() < ADDRMAN_TRIED_BUCKET_SIZE)
     {
         vTried.push_back(nId);
+        UpdateTriedOccupied(nKBucket);
         nTried++;
         info.fInTried = true;
         return;
@@ -249,9 +306,11 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
     {
         // if so, move it back there
         vNew.insert(vTried[nPos]);
+        UpdateNewOccupied(nUBucket);
     } else {
         // otherwise, move it to the new bucket nId came from (there is certainly place there)
         vvNew[nOrigin].insert(vTried[nPos]);
+        UpdateNewOccupied(nOrigin);
     }
     nNew++;
 
@@ -363,6 +422,7 @@ bool CAddrMan::Add_(const CAddress &addr, const CNetAddr& source, int64_t nTimeP
         if (vNew.size() == ADDRMAN_NEW_BUCKET_SIZE)
             ShrinkNew(nUBucket);
         vvNew[nUBucket].insert(nId);
+        UpdateNewOccupied(nUBucket);
     }
     return fNew;
 }
@@ -388,20 +448,25 @@ void CAddrMan::Attempt_(const CService &addr, int64_t nTime)
 
 CAddress CAddrMan::Select_(int nUnkBias)
 {
-    if (size() == 0)
+    if (size() == 0 || (vTriedOccupied.empty() && vNewOccupied.empty()))
         return CAddress();
 
     double nCorTried = sqrt(nTried) * (100.0 - nUnkBias);
     double nCorNew = sqrt(nNew) * nUnkBias;
-    if ((nCorTried + nCorNew)*GetRandInt(1<<30)/(1<<30) < nCorTried)
+    bool fTried = (nCorTried + nCorNew)*GetRandInt(1<<30)/(1<<30) < nCorTried;
+    // with one table empty, which nUnkBias may have chosen, use the other
+    if (vNewOccupied.empty())
+        fTried = true;
+    if (vTriedOccupied.empty())
+        fTried = false;
+    if (fTried)
     {
         // use a tried node
         double fChanceFactor = 1.0;
         while(1)
         {
-            int nKBucket = GetRandInt(vvTried.size());
+            int nKBucket = vTriedOccupied[GetRandInt(vTriedOccupied.size())];
             std::vector<int> &vTried = vvTried[nKBucket];
-            if (vTried.size() == 0) continue;
             int nPos = GetRandInt(vTried.size());
             assert(mapInfo.count(vTried[nPos]) == 1);
             CAddrInfo &info = mapInfo[vTried[nPos]];
@@ -414,9 +479,8 @@ CAddress CAddrMan::Select_(int nUnkBias)
         double fChanceFactor = 1.0;
         while(1)
         {
-            int nUBucket = GetRandInt(vvNew.size());
+            int nUBucket = vNewOccupied[GetRandInt(vNewOccupied.size())];
             std::set<int> &vNew = vvNew[nUBucket];
-            if (vNew.size() == 0) continue;
             int nPos = GetRandInt(vNew.size());
             std::set<int>::iterator it = vNew.begin();
             while (nPos--)
@@ -465,6 +529,8 @@ int CAddrMan::Check_()
     for (int n=0; n<vvTried.size(); n++)
     {
         std::vector<int> &vTried = vvTried[n];
+        if ((vTriedOccupiedPos[n] == -1) != vTried.empty()) return -16;
+        if (vTriedOccupiedPos[n] != -1 && vTriedOccupied[vTriedOccupiedPos[n]] != n) return -16;
         for (std::vector<int>::iterator it = vTried.begin(); it != vTried.end(); it++)
         {
             if (!setTried.count(*it)) return -11;
@@ -475,6 +541,8 @@ int CAddrMan::Check_()
     for (int n=0; n<vvNew.size(); n++)
     {
         std::set<int> &vNew = vvNew[n];
+        if ((vNewOccupiedPos[n] == -1) != vNew.empty()) return -17;
+        if (vNewOccupiedPos[n] != -1 && vNewOccupied[vNewOccupiedPos[n]] != n) return -17;
         for (std::set<int>::iterator it = vNew.begin(); it != vNew.end(); it++)
         {
             if (!mapNew.count(*it)) return -12;
@@ -525,3 +593,31 @@ void CAddrMan::Connected_(const CService &addr, int64_t nTime)
     if (nTime - info.nTime > nUpdateInterval)
         info.nTime = nTime;
 }
+
+// Moving average that weighs a new sample by 1/4, or the sample alone at first
+static int64_t AverageMetric(int64_t nAverage, int64_t nSample)
+{
+    if (nSample <= 0)
+        return nAverage;
+    return nAverage ? (nAverage * 3 + nSample) / 4 : nSample;
+}
+
+void CAddrMan::UpdateMetrics_(const CService &addr, int64_t nConnectUsec, int64_t nPingUsec, int64_t nBlockUsec)
+{
+    CAddrInfo *pinfo = Find(addr);
+
+    // if not found, bail out
+    if (!pinfo)
+        return;
+
+    CAddrInfo &info = *pinfo;
+
+    // check whether we are talking about the exact same CService (including same port)
+    if (info != addr)
+        return;
+
+    // update info
+    info.nConnectUsec = AverageMetric(info.nConnectUsec, nConnectUsec);
+    info.nPingUsec = AverageMetric(info.nPingUsec, nPingUsec);
+    info.nBlockUsec = AverageMetric(info.nBlockUsec, nBlockUsec);
+}
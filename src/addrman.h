@@ -17,6 +17,9 @@
 
 #include <openssl/rand.h>
 
+// peers.dat version from which every entry carries its connection metrics
+#define ADDRMAN_VERSION_METRICS 1
+
 /** Extended statistics about a CAddress */
 class CAddrInfo : public CAddress
 {
@@ -33,6 +36,12 @@ private:
     // connection attempts since last successful attempt
     int nAttempts;
 
+    // moving averages over our outbound connections, in microseconds, 0 until measured:
+    // round trip of the version handshake, ping, and time per requested block
+    int64_t nConnectUsec;
+    int64_t nPingUsec;
+    int64_t nBlockUsec;
+
     // reference count in new sets (memory only)
     int nRefCount;
 
@@ -52,6 +61,13 @@ public:
         READWRITE(source);
         READWRITE(nLastSuccess);
         READWRITE(nAttempts);
+        // nVersion is CAddrMan's format version here, not the client's
+        if (nVersion >= ADDRMAN_VERSION_METRICS)
+        {
+            READWRITE(nConnectUsec);
+            READWRITE(nPingUsec);
+            READWRITE(nBlockUsec);
+        }
     )
 
     void Init()
@@ -59,6 +75,9 @@ public:
         nLastSuccess = 0;
         nLastTry = 0;
         nAttempts = 0;
+        nConnectUsec = 0;
+        nPingUsec = 0;
+        nBlockUsec = 0;
         nRefCount = 0;
         fInTried = false;
         nRandomPos = -1;
@@ -92,6 +111,12 @@ public:
     // Calculate the relative chance this entry should be given when selecting nodes to connect to
     double GetChance(int64_t nNow = GetAdjustedTime()) const;
 
+    // Round trip to this node: its ping, else its handshake, 0 if never measured
+    int64_t GetLatencyUsec() const
+    {
+        return nPingUsec ? nPingUsec : nConnectUsec;
+    }
+
 };
 
 // Stochastic address manager
@@ -162,6 +187,12 @@ public:
 // the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+// round trip (in microseconds) at which latency neither raises nor lowers the chance of selection
+#define ADDRMAN_LATENCY_REFERENCE 200000
+
+// time per requested block (in microseconds) at which delivery speed neither raises nor lowers it
+#define ADDRMAN_BLOCK_REFERENCE 1000000
+
 /** Stochastical (IP) address manager */
 class CAddrMan
 {
@@ -196,6 +227,16 @@ private:
     // list of "new" buckets
     std::vector<std::set<int> > vvNew;
 
+    // the non-empty "tried" and "new" buckets, so Select_ does not probe
+    // empty ones, and where each bucket is in them (-1 when empty)
+    std::vector<int> vTriedOccupied;
+    std::vector<int> vTriedOccupiedPos;
+    std::vector<int> vNewOccupied;
+    std::vector<int> vNewOccupiedPos;
+
+    // count of changes, to skip writing peers.dat when nothing changed
+    uint64_t nModifications;
+
 protected:
 
     // Find an entry.
@@ -216,6 +257,13 @@ protected:
     // They are never deleted while in the "tried" table, only possibly evicted back to the "new" table.
     int ShrinkNew(int nUBucket);
 
+    // Bring the occupied bucket lists up to date after a bucket changed.
+    void UpdateTriedOccupied(int nKBucket);
+    void UpdateNewOccupied(int nUBucket);
+
+    // Rebuild the occupied bucket lists from scratch.
+    void RebuildOccupied();
+
     // Move an entry from the "new" table(s) to the "tried" table
     // @pre vvUnkown[nOrigin].count(nId) != 0
     void MakeTried(CAddrInfo& info, int nId, int nOrigin);
@@ -244,12 +292,15 @@ protected:
     // Mark an entry as currently-connected-to.
     void Connected_(const CService &addr, int64_t nTime);
 
+    // Fold new connection metrics into an entry.
+    void UpdateMetrics_(const CService &addr, int64_t nConnectUsec, int64_t nPingUsec, int64_t nBlockUsec);
+
 public:
 
     IMPLEMENT_SERIALIZE
     (({
         // serialized format:
-        // * version byte (currently 0)
+        // * version byte (currently 1, ADDRMAN_VERSION_METRICS)
         // * nKey
         // * nNew
         // * nTried
@@ -270,7 +321,8 @@ public:
         // changes to the ADDRMAN_ parameters without breaking the on-disk structure.
         {
             LOCK(cs);
-            unsigned char nVersion = 0;
+            // Shadows the stream version, so the addrinfos below see this one
+            unsigned char nVersion = ADDRMAN_VERSION_METRICS;
             READWRITE(nVersion);
             READWRITE(nKey);
             READWRITE(nNew);
@@ -376,11 +428,13 @@ public:
                         }
                     }
                 }
+                am->RebuildOccupied();
             }
         }
     });)
 
-    CAddrMan() : vRandom(0), vvTried(ADDRMAN_TRIED_BUCKET_COUNT, std::vector<int>(0)), vvNew(ADDRMAN_NEW_BUCKET_COUNT, std::set<int>())
+    CAddrMan() : vRandom(0), vvTried(ADDRMAN_TRIED_BUCKET_COUNT, std::vector<int>(0)), vvNew(ADDRMAN_NEW_BUCKET_COUNT, std::set<int>()),
+                 vTriedOccupiedPos(ADDRMAN_TRIED_BUCKET_COUNT, -1), vNewOccupiedPos(ADDRMAN_NEW_BUCKET_COUNT, -1)
     {
          nKey.resize(32);
          RAND_bytes(&nKey[0], 32);
@@ -388,6 +442,7 @@ public:
          nIdCount = 0;
          nTried = 0;
          nNew = 0;
+         nModifications = 0;
     }
 
     // Return the number of (unique) addresses in all tables.
@@ -396,6 +451,13 @@ public:
         return vRandom.size();
     }
 
+    // Changes so far; equal values mean nothing changed in between
+    uint64_t GetModifications()
+    {
+        LOCK(cs);
+        return nModifications;
+    }
+
     // Consistency check
     void Check()
     {
@@ -417,6 +479,7 @@ public:
             LOCK(cs);
             Check();
             fRet |= Add_(addr, source, nTimePenalty);
+            nModifications++;
             Check();
         }
         if (fRet)
@@ -433,6 +496,7 @@ public:
             Check();
             for (std::vector<CAddress>::const_iterator it = vAddr.begin(); it != vAddr.end(); it++)
                 nAdd += Add_(*it, source, nTimePenalty) ? 1 : 0;
+            nModifications++;
             Check();
         }
         if (nAdd)
@@ -447,6 +511,7 @@ public:
             LOCK(cs);
             Check();
             Good_(addr, nTime);
+            nModifications++;
             Check();
         }
     }
@@ -458,6 +523,7 @@ public:
             LOCK(cs);
             Check();
             Attempt_(addr, nTime);
+            nModifications++;
             Check();
         }
     }
@@ -496,9 +562,33 @@ public:
             LOCK(cs);
             Check();
             Connected_(addr, nTime);
+            nModifications++;
+            Check();
+        }
+    }
+
+    // Record what an outbound connection to an entry measured; zero
+    // arguments leave that metric as it was.
+    void UpdateMetrics(const CService &addr, int64_t nConnectUsec, int64_t nPingUsec, int64_t nBlockUsec)
+    {
+        {
+            LOCK(cs);
+            Check();
+            UpdateMetrics_(addr, nConnectUsec, nPingUsec, nBlockUsec);
+            nModifications++;
             Check();
         }
     }
+
+    // Round trip last measured to an address, 0 if unknown.
+    int64_t GetLatencyUsec(const CService &addr)
+    {
+        LOCK(cs);
+        CAddrInfo *pinfo = Find(addr);
+        if (!pinfo || *pinfo != addr)
+            return 0;
+        return pinfo->GetLatencyUsec();
+    }
 };
 
 #endif
@@ -4,6 +4,10 @@
 
 #include "allocators.h"
 
+#include "util.h"
+
+#include <algorithm>
+
 #ifdef WIN32
 #ifdef _WIN32_WINNT
 #undef _WIN32_WINNT
@@ -26,6 +30,8 @@
 
 LockedPageManager* LockedPageManager::_instance = NULL;
 boost::once_flag LockedPageManager::init_flag = BOOST_ONCE_INIT;
+LockedPool* LockedPool::_instance = NULL;
+boost::once_flag LockedPool::init_flag = BOOST_ONCE_INIT;
 
 /** Determine system page size in bytes */
 static inline size_t GetSystemPageSize()
@@ -65,3 +71,70 @@ LockedPageManager::LockedPageManager() : LockedPageManagerBase<MemoryPageLocker>
 {
 }
 
+static void LockedPoolFailed(size_t arena_size)
+{
+    LogPrintf("Warning: could not lock a %u KiB arena of memory for keys; keys beyond the locked pages may be swapped to disk. Raise the locked memory limit (ulimit -l) to avoid this.\n", arena_size >> 10);
+}
+
+LockedPool::LockedPool() : LockedPoolBase<MemoryPageLocker>(GetSystemPageSize(), ARENA_SIZE, LockedPoolFailed)
+{
+}
+
+LockedArena::LockedArena(void *base_in, size_t size, size_t alignment):
+    base(static_cast<char*>(base_in)), end(static_cast<char*>(base_in) + size), alignment(alignment), used(0)
+{
+    assert(!(alignment & (alignment-1))); // alignment must be power of two
+    free_chunks.insert(std::make_pair(base, size));
+}
+
+void* LockedArena::Alloc(size_t size)
+{
+    // Keep every chunk aligned by rounding sizes up; zero-sized requests still get a distinct chunk
+    if (size > (size_t)(end - base))
+        return NULL;
+    size = (std::max(size, (size_t)1) + alignment - 1) & ~(alignment - 1);
+    for (ChunkMap::iterator it = free_chunks.begin(); it != free_chunks.end(); ++it)
+    {
+        if (it->second < size)
+            continue;
+        char *p = it->first;
+        const size_t left = it->second - size;
+        free_chunks.erase(it++);
+        if (left)
+            free_chunks.insert(it, std::make_pair(p + size, left));
+        used_chunks.insert(std::make_pair(p, size));
+        used += size;
+        return p;
+    }
+    return NULL;
+}
+
+void LockedArena::Free(void *p)
+{
+    ChunkMap::iterator it_used = used_chunks.find(static_cast<char*>(p));
+    assert(it_used != used_chunks.end()); // Cannot free memory that was not allocated here
+    char *chunk = it_used->first;
+    size_t size = it_used->second;
+    used_chunks.erase(it_used);
+    used -= size;
+
+    // Merge with the free chunk after and the one before, if they touch
+    ChunkMap::iterator it_next = free_chunks.lower_bound(chunk);
+    if (it_next != free_chunks.end() && chunk + size == it_next->first)
+    {
+        size += it_next->second;
+        free_chunks.erase(it_next++);
+    }
+    if (it_next != free_chunks.begin())
+    {
+        ChunkMap::iterator it_prev = it_next;
+        --it_prev;
+        if (it_prev->first + it_prev->second == chunk)
+        {
+            it_prev->second += size;
+            return;
+        }
+    }
+    free_chunks.insert(it_next, std::make_pair(chunk, size));
+}
+
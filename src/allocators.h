@@ -9,6 +9,7 @@
 #include <map>
 #include <string>
 #include <string.h>
+#include <vector>
 
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/once.hpp>
@@ -160,6 +161,188 @@ private:
     static boost::once_flag init_flag;
 };
 
+/**
+ * First-fit allocator over one fixed block of memory, used by LockedPoolBase
+ * to hand out pieces of a block that is locked once as a whole.
+ *
+ * Free chunks are kept ordered by address, so a freed chunk merges with the
+ * free chunks on either side of it. Not thread-safe.
+ */
+class LockedArena
+{
+public:
+    LockedArena(void *base, size_t size, size_t alignment);
+
+    /** Allocate size bytes, rounded up to the alignment; NULL if no free chunk is large enough */
+    void* Alloc(size_t size);
+    /** Free memory returned by Alloc */
+    void Free(void *p);
+
+    bool Contains(const void *p) const { return p >= base && p < end; }
+    size_t GetUsed() const { return used; }
+    size_t GetFreeChunkCount() const { return free_chunks.size(); }
+
+private:
+    // map of chunk address to chunk size
+    typedef std::map<char*,size_t> ChunkMap;
+    ChunkMap free_chunks;
+    ChunkMap used_chunks;
+    char *base, *end;
+    size_t alignment;
+    size_t used;
+};
+
+/**
+ * Thread-safe pool of locked memory for small allocations.
+ *
+ * Locking every allocation through LockedPageManager costs an mlock() and
+ * munlock() syscall each, which adds up when a wallet unlock or a signing
+ * run creates thousands of short-lived keys. Instead this class locks whole
+ * arenas of arena_size bytes once, and serves allocations from them with a
+ * LockedArena. Allocations larger than an arena are not served: the caller
+ * falls back to locking their pages individually.
+ *
+ * If an arena cannot be locked, as when it exceeds RLIMIT_MEMLOCK, it is
+ * given up and no further arenas are tried: allocations the existing arenas
+ * have no room for are left to the caller as well, whose per-page locking
+ * still locks pages up to the limit. lock_failed_cb is called the first time.
+ *
+ * Arenas are only released when the pool is destroyed.
+ */
+template <class Locker> class LockedPoolBase
+{
+public:
+    LockedPoolBase(size_t page_size, size_t arena_size, void (*lock_failed_cb)(size_t) = NULL):
+        page_size(page_size), arena_size((arena_size + page_size - 1) & ~(page_size - 1)),
+        lock_failed(false), lock_failed_cb(lock_failed_cb)
+    {
+        assert(!(page_size & (page_size-1))); // size must be power of two
+    }
+
+    ~LockedPoolBase()
+    {
+        for (typename std::vector<Region>::iterator it = regions.begin(); it != regions.end(); ++it)
+        {
+            locker.Unlock(it->locked, arena_size);
+            delete it->arena;
+            delete[] it->allocated;
+        }
+    }
+
+    // Allocate size bytes from an arena, adding one if none has room; NULL if
+    // size is larger than an arena or no arena could be locked
+    void* Alloc(size_t size)
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        if (size > arena_size)
+            return NULL;
+        for (typename std::vector<Region>::iterator it = regions.begin(); it != regions.end(); ++it)
+        {
+            void *p = it->arena->Alloc(size);
+            if (p != NULL)
+                return p;
+        }
+        if (lock_failed)
+            return NULL;
+        // Page-align the arena, so that locking it covers no one else's memory
+        Region region;
+        region.allocated = new char[arena_size + page_size];
+        region.locked = reinterpret_cast<char*>((reinterpret_cast<size_t>(region.allocated) + page_size - 1) & ~(page_size - 1));
+        if (!locker.Lock(region.locked, arena_size))
+        {
+            delete[] region.allocated;
+            lock_failed = true;
+            if (lock_failed_cb)
+                lock_failed_cb(arena_size);
+            return NULL;
+        }
+        region.arena = new LockedArena(region.locked, arena_size, ALIGNMENT);
+        regions.push_back(region);
+        return region.arena->Alloc(size);
+    }
+
+    // Free memory returned by Alloc; false if p is not from this pool
+    bool Free(void *p)
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        for (typename std::vector<Region>::iterator it = regions.begin(); it != regions.end(); ++it)
+        {
+            if (it->arena->Contains(p))
+            {
+                it->arena->Free(p);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Get number of arenas for diagnostics
+    int GetArenaCount()
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        return regions.size();
+    }
+
+    // Get number of bytes allocated, with their alignment, for diagnostics
+    size_t GetUsed()
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        size_t used = 0;
+        for (typename std::vector<Region>::iterator it = regions.begin(); it != regions.end(); ++it)
+            used += it->arena->GetUsed();
+        return used;
+    }
+
+    // Alignment of the allocations, enough for any type
+    static const size_t ALIGNMENT = 16;
+
+private:
+    struct Region
+    {
+        char *allocated; // as returned by new[]
+        char *locked;    // page-aligned start of the arena within it
+        LockedArena *arena;
+    };
+
+    Locker locker;
+    boost::mutex mutex;
+    size_t page_size, arena_size;
+    std::vector<Region> regions;
+    bool lock_failed;
+    void (*lock_failed_cb)(size_t);
+};
+
+/**
+ * Singleton pool of locked memory for secure_allocator.
+ *
+ * Unlike LockedPageManager it is never destroyed: secure objects that are
+ * static themselves may be freed after any static pool would be, and the
+ * arenas go away with the process anyway.
+ */
+class LockedPool: public LockedPoolBase<MemoryPageLocker>
+{
+public:
+    // Bytes locked at a time
+    static const size_t ARENA_SIZE = 256 * 1024;
+
+    static LockedPool& Instance()
+    {
+        boost::call_once(LockedPool::CreateInstance, LockedPool::init_flag);
+        return *LockedPool::_instance;
+    }
+
+private:
+    LockedPool();
+
+    static void CreateInstance()
+    {
+        LockedPool::_instance = new LockedPool();
+    }
+
+    static LockedPool* _instance;
+    static boost::once_flag init_flag;
+};
+
 //
 // Functions for directly locking/unlocking memory objects.
 // Intended for non-dynamically allocated structures.
@@ -199,7 +382,12 @@ struct secure_allocator : public std::allocator<T>
 
     T* allocate(std::size_t n, const void *hint = 0)
     {
-        T *p;
+        T *p = NULL;
+        if (n <= base::max_size())
+            p = static_cast<T*>(LockedPool::Instance().Alloc(sizeof(T) * n));
+        if (p != NULL)
+            return p;
+        // Too large for the pool: lock the pages of a plain allocation
         p = std::allocator<T>::allocate(n, hint);
         if (p != NULL)
             LockedPageManager::Instance().LockRange(p, sizeof(T) * n);
@@ -211,6 +399,8 @@ struct secure_allocator : public std::allocator<T>
         if (p != NULL)
         {
             OPENSSL_cleanse(p, sizeof(T) * n);
+            if (LockedPool::Instance().Free(p))
+                return;
             LockedPageManager::Instance().UnlockRange(p, sizeof(T) * n);
         }
         std::allocator<T>::deallocate(p, n);
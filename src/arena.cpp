@@ -0,0 +1,121 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "arena.h"
+
+#include <stdlib.h>
+#include <algorithm>
+#include <new>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+// Values of the first header byte
+static const char ARENA_FROM_HEAP = 0;
+static const char ARENA_FROM_ARENA = 1;
+
+// Scopes active in any thread. Only written under cs_nArenaScopes; a thread
+// that opened a scope always sees its own update, and for the others a
+// stale value costs at most a needless lookup of their (empty) arena.
+static boost::mutex cs_nArenaScopes;
+static volatile int nArenaScopes = 0;
+
+// The arena of each thread is not owned by it
+static void ArenaNoCleanup(CDeserializeArena*) {}
+
+static boost::thread_specific_ptr<CDeserializeArena>& CurrentArena()
+{
+    // Constructed on first use rather than during static initialization
+    static boost::thread_specific_ptr<CDeserializeArena> parena(ArenaNoCleanup);
+    return parena;
+}
+
+const size_t CDeserializeArena::CHUNK_SIZE;
+
+CDeserializeArena::CDeserializeArena() : nChunk(0), nUsed(0)
+{
+}
+
+CDeserializeArena::~CDeserializeArena()
+{
+    for (unsigned int i = 0; i < vChunks.size(); i++)
+        free(vChunks[i].first);
+}
+
+void* CDeserializeArena::Allocate(size_t nSize)
+{
+    nSize = (nSize + ARENA_HEADER_SIZE - 1) & ~(ARENA_HEADER_SIZE - 1);
+    while (nChunk < vChunks.size() && nUsed + nSize > vChunks[nChunk].second) {
+        nChunk++;
+        nUsed = 0;
+    }
+    if (nChunk == vChunks.size()) {
+        size_t nChunkSize = std::max(nSize, CHUNK_SIZE);
+        char* pchunk = static_cast<char*>(malloc(nChunkSize));
+        if (!pchunk)
+            throw std::bad_alloc();
+        vChunks.push_back(std::make_pair(pchunk, nChunkSize));
+        nUsed = 0;
+    }
+    void* p = vChunks[nChunk].first + nUsed;
+    nUsed += nSize;
+    return p;
+}
+
+void CDeserializeArena::Reset()
+{
+    nChunk = 0;
+    nUsed = 0;
+}
+
+size_t CDeserializeArena::GetUsage() const
+{
+    size_t nUsage = nUsed;
+    for (unsigned int i = 0; i < nChunk && i < vChunks.size(); i++)
+        nUsage += vChunks[i].second;
+    return nUsage;
+}
+
+CDeserializeArena::Scope::Scope(CDeserializeArena& arena)
+{
+    {
+        boost::mutex::scoped_lock lock(cs_nArenaScopes);
+        nArenaScopes++;
+    }
+    pprev = CurrentArena().get();
+    CurrentArena().reset(&arena);
+}
+
+CDeserializeArena::Scope::~Scope()
+{
+    CurrentArena().reset(pprev);
+    boost::mutex::scoped_lock lock(cs_nArenaScopes);
+    nArenaScopes--;
+}
+
+void* ArenaAllocate(size_t nSize)
+{
+    CDeserializeArena* parena = nArenaScopes > 0 ? CurrentArena().get() : NULL;
+    char* p;
+    if (parena) {
+        p = static_cast<char*>(parena->Allocate(ARENA_HEADER_SIZE + nSize));
+        p[0] = ARENA_FROM_ARENA;
+    } else {
+        p = static_cast<char*>(malloc(ARENA_HEADER_SIZE + nSize));
+        if (!p)
+            throw std::bad_alloc();
+        p[0] = ARENA_FROM_HEAP;
+    }
+    return p + ARENA_HEADER_SIZE;
+}
+
+void ArenaFree(void* p)
+{
+    if (!p)
+        return;
+    char* pch = static_cast<char*>(p) - ARENA_HEADER_SIZE;
+    // Arena memory goes back with the arena
+    if (pch[0] == ARENA_FROM_HEAP)
+        free(pch);
+}
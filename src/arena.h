@@ -0,0 +1,105 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_ARENA_H
+#define BITCOIN_ARENA_H
+
+#include <stddef.h>
+#include <memory>
+#include <utility>
+#include <vector>
+
+/** Bytes in front of every allocation made through arena_allocator, telling
+ *  whether it came from an arena. Keeps the alignment malloc gives. */
+static const size_t ARENA_HEADER_SIZE = 16;
+
+/** Monotonic buffer for the objects of a deserialized block.
+ *
+ *  Deserializing a block otherwise allocates the inputs and outputs of
+ *  every transaction one by one, only to free them all once the block is
+ *  processed. While a Scope is active, the current thread takes such
+ *  allocations from the arena instead; freeing them does nothing, and the
+ *  memory goes back at once when the arena is reset or destroyed.
+ *
+ *  The objects deserialized into an arena must be destroyed before it is
+ *  reset or destroyed: declare the arena before them. Copies made outside
+ *  a Scope are allocated normally.
+ */
+class CDeserializeArena
+{
+private:
+    static const size_t CHUNK_SIZE = 256 * 1024;
+
+    // Chunks and their sizes, kept for reuse across resets
+    std::vector<std::pair<char*, size_t> > vChunks;
+    size_t nChunk; // chunk allocations are taken from
+    size_t nUsed;  // bytes taken from it
+
+    // Not copyable
+    CDeserializeArena(const CDeserializeArena&);
+    CDeserializeArena& operator=(const CDeserializeArena&);
+
+public:
+    CDeserializeArena();
+    ~CDeserializeArena();
+
+    void* Allocate(size_t nSize);
+
+    // Makes all the memory available again
+    void Reset();
+
+    // Bytes handed out since the last reset
+    size_t GetUsage() const;
+
+    /** Makes an arena the one the current thread allocates from, for as
+     *  long as the Scope lives. Scopes nest. */
+    class Scope
+    {
+    private:
+        CDeserializeArena* pprev;
+
+    public:
+        explicit Scope(CDeserializeArena& arena);
+        ~Scope();
+    };
+};
+
+// Allocate from the arena of the current thread, if any, or from the heap
+void* ArenaAllocate(size_t nSize);
+void ArenaFree(void* p);
+
+/** Allocator for the containers filled by deserialization, taking memory
+ *  from the arena of the current thread while a CDeserializeArena::Scope
+ *  is active. It has no state, so all instances compare equal. */
+template<typename T>
+struct arena_allocator : public std::allocator<T>
+{
+    typedef std::allocator<T> base;
+    typedef typename base::size_type size_type;
+    typedef typename base::difference_type  difference_type;
+    typedef typename base::pointer pointer;
+    typedef typename base::const_pointer const_pointer;
+    typedef typename base::reference reference;
+    typedef typename base::const_reference const_reference;
+    typedef typename base::value_type value_type;
+    arena_allocator() throw() {}
+    arena_allocator(const arena_allocator& a) throw() : base(a) {}
+    template <typename U>
+    arena_allocator(const arena_allocator<U>& a) throw() : base(a) {}
+    ~arena_allocator() throw() {}
+    template<typename _Other> struct rebind
+    { typedef arena_allocator<_Other> other; };
+
+    T* allocate(std::size_t n, const void *hint = 0)
+    {
+        return static_cast<T*>(ArenaAllocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        ArenaFree(p);
+    }
+};
+
+#endif // BITCOIN_ARENA_H
@@ -0,0 +1,102 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "util.h"
+
+#include <limits>
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+namespace benchmark {
+
+State::State(const string &strNameIn, int64_t nMaxMicrosIn) :
+    strName(strNameIn), nMaxMicros(nMaxMicrosIn), nBeginMicros(0), nLastMicros(0),
+    nCount(0), nCountMask(0), dMin(numeric_limits<double>::max()), dMax(0) {}
+
+bool State::KeepRunning()
+{
+    if (nCount & nCountMask) {
+        nCount++;
+        return true;
+    }
+
+    int64_t nNow = GetTimeMicros();
+    if (nCount == 0) {
+        nBeginMicros = nNow;
+    } else {
+        int64_t nElapsed = nNow - nLastMicros;
+        if (nElapsed * 128 < nMaxMicros && nCountMask < (1ULL << 40)) {
+            // Far too short a batch to time, and it includes the overhead
+            // of reading the clock: start over with batches eight times
+            // as long.
+            nCountMask = (nCountMask << 3) | 7;
+            nCount = 0;
+            dMin = numeric_limits<double>::max();
+            dMax = 0;
+            nLastMicros = nBeginMicros = GetTimeMicros();
+            nCount++;
+            return true;
+        }
+        double dOne = (double)nElapsed / (nCountMask + 1);
+        dMin = std::min(dMin, dOne);
+        dMax = std::max(dMax, dOne);
+    }
+    nLastMicros = nNow;
+    if (nNow - nBeginMicros < nMaxMicros) {
+        nCount++;
+        return true;
+    }
+    return false;
+}
+
+CResult State::GetResult() const
+{
+    CResult result;
+    result.strName = strName;
+    result.nIterations = nCount;
+    result.nMinNanos = nCount ? (int64_t)(dMin * 1000 + 0.5) : 0;
+    result.nMaxNanos = nCount ? (int64_t)(dMax * 1000 + 0.5) : 0;
+    result.nAvgNanos = nCount ? (int64_t)((nLastMicros - nBeginMicros) * 1000.0 / nCount + 0.5) : 0;
+    return result;
+}
+
+map<string, BenchFunction> &BenchRunner::Benchmarks()
+{
+    static map<string, BenchFunction> benchmarks;
+    return benchmarks;
+}
+
+BenchRunner::BenchRunner(const string &strName, BenchFunction func)
+{
+    Benchmarks().insert(make_pair(strName, func));
+}
+
+vector<CResult> BenchRunner::RunAll(const string &strFilter, int64_t nMaxMicros)
+{
+    vector<CResult> vResults;
+    typedef pair<string, BenchFunction> BenchPair;
+    BOOST_FOREACH(const BenchPair &bench, Benchmarks()) {
+        if (bench.first.find(strFilter) == string::npos)
+            continue;
+        State state(bench.first, nMaxMicros);
+        bench.second(state);
+        vResults.push_back(state.GetResult());
+    }
+    return vResults;
+}
+
+vector<string> BenchRunner::List()
+{
+    vector<string> vNames;
+    typedef pair<string, BenchFunction> BenchPair;
+    BOOST_FOREACH(const BenchPair &bench, Benchmarks())
+        vNames.push_back(bench.first);
+    return vNames;
+}
+
+}
@@ -0,0 +1,83 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BENCH_BENCH_H
+#define BITCOIN_BENCH_BENCH_H
+
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/preprocessor/cat.hpp>
+#include <boost/preprocessor/stringize.hpp>
+
+/** Micro-benchmarks of the validation primitives.
+ *
+ *  A benchmark is a function that does its setup, then repeats the code to
+ *  time for as long as KeepRunning() returns true:
+ *
+ *  static void HashSomething(benchmark::State& state)
+ *  {
+ *      ... setup ...
+ *      while (state.KeepRunning()) {
+ *          ... code to time ...
+ *      }
+ *  }
+ *  BENCHMARK(HashSomething);
+ */
+namespace benchmark {
+
+/** Result of one benchmark; times are per iteration, in nanoseconds */
+struct CResult
+{
+    std::string strName;
+    uint64_t nIterations;
+    int64_t nMinNanos;
+    int64_t nMaxNanos;
+    int64_t nAvgNanos;
+};
+
+class State
+{
+private:
+    std::string strName;
+    int64_t nMaxMicros;   // how long to keep running
+    int64_t nBeginMicros;
+    int64_t nLastMicros;
+    uint64_t nCount;
+    // The clock is only read once every nCountMask + 1 iterations, so
+    // fast code is timed in batches long enough to measure.
+    uint64_t nCountMask;
+    double dMin, dMax;    // per iteration, in microseconds
+
+public:
+    State(const std::string &strNameIn, int64_t nMaxMicrosIn);
+
+    bool KeepRunning();
+
+    CResult GetResult() const;
+};
+
+typedef void (*BenchFunction)(State&);
+
+class BenchRunner
+{
+private:
+    static std::map<std::string, BenchFunction> &Benchmarks();
+
+public:
+    BenchRunner(const std::string &strName, BenchFunction func);
+
+    // Run the benchmarks whose name contains strFilter, for about
+    // nMaxMicros each, in the order of their names
+    static std::vector<CResult> RunAll(const std::string &strFilter, int64_t nMaxMicros);
+    static std::vector<std::string> List();
+};
+
+}
+
+#define BENCHMARK(n) \
+    static benchmark::BenchRunner BOOST_PP_CAT(bench_, BOOST_PP_CAT(__LINE__, n))(BOOST_PP_STRINGIZE(n), n);
+
+#endif // BITCOIN_BENCH_BENCH_H
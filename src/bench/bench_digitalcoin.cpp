@@ -0,0 +1,65 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "hashx11.h"
+#include "sha256.h"
+#include "util.h"
+
+#include <stdio.h>
+
+#include <boost/foreach.hpp>
+#include "json/json_spirit_writer_template.h"
+
+using namespace std;
+using namespace json_spirit;
+
+// Usage: bench_digitalcoin [-filter=<substring>] [-time=<ms>] [-list]
+//
+// The results are written to stdout as JSON, in the order of the names:
+// {"version": ..., "benchmarks": [{"name", "iterations", "min_ns",
+// "max_ns", "avg_ns"}, ...]}, with the times per iteration.
+int main(int argc, char *argv[])
+{
+    ParseParameters(argc, argv);
+    fPrintToDebugLog = false;
+
+    if (mapArgs.count("-list")) {
+        BOOST_FOREACH(const string &strName, benchmark::BenchRunner::List())
+            printf("%s\n", strName.c_str());
+        return 0;
+    }
+
+    if (!X11EngineInit(GetArg("-x11engine", "auto"))) {
+        fprintf(stderr, "Error: unsupported -x11engine\n");
+        return 1;
+    }
+
+    if (!SHA256EngineInit(GetArg("-sha256engine", "auto"))) {
+        fprintf(stderr, "Error: unsupported -sha256engine\n");
+        return 1;
+    }
+
+    int64_t nMaxMicros = GetArg("-time", 1000) * 1000;
+    vector<benchmark::CResult> vResults = benchmark::BenchRunner::RunAll(GetArg("-filter", ""), nMaxMicros);
+
+    Array benchmarks;
+    BOOST_FOREACH(const benchmark::CResult &result, vResults) {
+        Object obj;
+        obj.push_back(Pair("name", result.strName));
+        obj.push_back(Pair("iterations", (boost::int64_t)result.nIterations));
+        obj.push_back(Pair("min_ns", result.nMinNanos));
+        obj.push_back(Pair("max_ns", result.nMaxNanos));
+        obj.push_back(Pair("avg_ns", result.nAvgNanos));
+        benchmarks.push_back(obj);
+    }
+    Object output;
+    output.push_back(Pair("version", FormatFullVersion()));
+    output.push_back(Pair("x11engine", X11EngineName(X11EngineActive())));
+    output.push_back(Pair("sha256engine", SHA256EngineName(SHA256EngineActive())));
+    output.push_back(Pair("benchmarks", benchmarks));
+    printf("%s\n", write_string(Value(output), true).c_str());
+    return 0;
+}
@@ -0,0 +1,90 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "core.h"
+#include "script.h"
+#include "serialize.h"
+#include "util.h"
+#include "version.h"
+
+#include <assert.h>
+#include <string>
+#include <vector>
+
+// A block of 1000 transactions with an input and two outputs each, as
+// typical pay-to-pubkey-hash payments are
+static CBlock MakeBlock()
+{
+    CBlock block;
+    block.nVersion = 2;
+    block.hashPrevBlock = GetRandHash();
+    block.nTime = 1400000000;
+    block.nBits = 0x1d00ffff;
+    for (unsigned int i = 0; i < 1000; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), i % 3);
+        tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(72, i) << std::vector<unsigned char>(33, i);
+        tx.vout.resize(2);
+        for (unsigned int j = 0; j < 2; j++) {
+            tx.vout[j].nValue = 100000 * (i + j + 1);
+            tx.vout[j].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, i + j) << OP_EQUALVERIFY << OP_CHECKSIG;
+        }
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+static void BlockSerialize(benchmark::State& state)
+{
+    CBlock block = MakeBlock();
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    while (state.KeepRunning()) {
+        ss.clear();
+        ss << block;
+    }
+}
+
+static void BlockDeserialize(benchmark::State& state)
+{
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << MakeBlock();
+    while (state.KeepRunning()) {
+        CDataStream ss(ssBlock);
+        CBlock block;
+        ss >> block;
+    }
+}
+
+// Deserializing in place, as from a mapped block file
+static void BlockDeserializeSpan(benchmark::State& state)
+{
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << MakeBlock();
+    std::string strBlock = ssBlock.str();
+    while (state.KeepRunning()) {
+        CSpanReader reader(strBlock.data(), strBlock.data() + strBlock.size(), SER_NETWORK, PROTOCOL_VERSION);
+        CBlock block;
+        reader >> block;
+    }
+}
+
+// The size of a block, from the sizes its transactions cache
+static void BlockSerializeSize(benchmark::State& state)
+{
+    CBlock block = MakeBlock();
+    while (state.KeepRunning()) {
+        unsigned int nSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+        assert(nSize > 0);
+    }
+}
+
+BENCHMARK(BlockSerialize);
+BENCHMARK(BlockDeserialize);
+BENCHMARK(BlockDeserializeSpan);
+BENCHMARK(BlockSerializeSize);
@@ -0,0 +1,50 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "bloom.h"
+#include "core.h"
+#include "util.h"
+
+#include <vector>
+
+static const unsigned int NUM_ELEMENTS = 10000;
+
+// A filter as a wallet with NUM_ELEMENTS keys and outpoints would load
+static CBloomFilter MakeFilter(std::vector<uint256> &vHashes)
+{
+    CBloomFilter filter(NUM_ELEMENTS, 0.0001, 0, BLOOM_UPDATE_ALL);
+    for (unsigned int i = 0; i < NUM_ELEMENTS; i++) {
+        vHashes.push_back(GetRandHash());
+        filter.insert(vHashes.back());
+    }
+    return filter;
+}
+
+static void BloomContainsHit(benchmark::State& state)
+{
+    std::vector<uint256> vHashes;
+    CBloomFilter filter = MakeFilter(vHashes);
+    unsigned int i = 0;
+    while (state.KeepRunning()) {
+        filter.contains(vHashes[i]);
+        i = (i + 1) % NUM_ELEMENTS;
+    }
+}
+
+// Most of what a filter is matched against is not in it
+static void BloomContainsMiss(benchmark::State& state)
+{
+    std::vector<uint256> vHashes;
+    CBloomFilter filter = MakeFilter(vHashes);
+    COutPoint outpoint(GetRandHash(), 0);
+    while (state.KeepRunning()) {
+        filter.contains(outpoint);
+        outpoint.n++;
+    }
+}
+
+BENCHMARK(BloomContainsHit);
+BENCHMARK(BloomContainsMiss);
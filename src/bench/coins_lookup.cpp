@@ -0,0 +1,75 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "coins.h"
+#include "script.h"
+#include "util.h"
+
+#include <vector>
+
+static const unsigned int NUM_COINS = 100000;
+
+// A cache holding NUM_COINS ordinary outputs, over an empty view
+static void FillCache(CCoinsViewCache &cache, std::vector<COutPoint> &vOutPoints)
+{
+    for (unsigned int i = 0; i < NUM_COINS; i++) {
+        COutPoint outpoint(GetRandHash(), i % 4);
+        CTxOut out(1000 + i, CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, i) << OP_EQUALVERIFY << OP_CHECKSIG);
+        cache.AddCoin(outpoint, CCoin(out, 1 + i / 1000, false), false);
+        vOutPoints.push_back(outpoint);
+    }
+}
+
+static void CoinsCacheHit(benchmark::State& state)
+{
+    CCoinsView base;
+    CCoinsViewCache cache(base);
+    std::vector<COutPoint> vOutPoints;
+    FillCache(cache, vOutPoints);
+    unsigned int i = 0;
+    while (state.KeepRunning()) {
+        cache.AccessCoin(vOutPoints[i]);
+        i = (i + 7919) % NUM_COINS;
+    }
+}
+
+// Outpoints in neither the cache nor its base
+static void CoinsCacheMiss(benchmark::State& state)
+{
+    CCoinsView base;
+    CCoinsViewCache cache(base);
+    std::vector<COutPoint> vOutPoints;
+    FillCache(cache, vOutPoints);
+    COutPoint outpoint(GetRandHash(), 0);
+    while (state.KeepRunning()) {
+        cache.HaveCoin(outpoint);
+        outpoint.n++;
+    }
+}
+
+// A block's view over the tip: the coins come from the parent cache
+static void CoinsCacheFetchFromParent(benchmark::State& state)
+{
+    CCoinsView base;
+    CCoinsViewCache cacheTip(base);
+    std::vector<COutPoint> vOutPoints;
+    FillCache(cacheTip, vOutPoints);
+    unsigned int i = 0;
+    CCoinsViewCache *pview = new CCoinsViewCache(cacheTip);
+    while (state.KeepRunning()) {
+        pview->AccessCoin(vOutPoints[i]);
+        i = (i + 7919) % NUM_COINS;
+        if (i == 0) {
+            delete pview;
+            pview = new CCoinsViewCache(cacheTip);
+        }
+    }
+    delete pview;
+}
+
+BENCHMARK(CoinsCacheHit);
+BENCHMARK(CoinsCacheMiss);
+BENCHMARK(CoinsCacheFetchFromParent);
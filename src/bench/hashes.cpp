@@ -0,0 +1,109 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "hash.h"
+#include "hashx11.h"
+#include "scrypt.h"
+#include "sha256.h"
+#include "uint256.h"
+#include "util.h"
+
+#include <vector>
+
+// Block headers are 80 bytes
+static void HashX11Header(benchmark::State& state)
+{
+    std::vector<unsigned char> vchHeader(80, 0x5a);
+    uint256 hash;
+    while (state.KeepRunning()) {
+        hash = HashX11(vchHeader.begin(), vchHeader.end());
+        vchHeader[76] = hash.GetLow64();
+    }
+}
+
+// The same with the engine selected by -x11engine
+static void HashX11FastHeader(benchmark::State& state)
+{
+    std::vector<unsigned char> vchHeader(80, 0x5a);
+    uint256 hash;
+    while (state.KeepRunning()) {
+        hash = HashX11Fast(vchHeader.begin(), vchHeader.end());
+        vchHeader[76] = hash.GetLow64();
+    }
+}
+
+static void ScryptHeader(benchmark::State& state)
+{
+    char header[80] = {0};
+    char output[32];
+    while (state.KeepRunning()) {
+        scrypt_1024_1_1_256(header, output);
+        header[76] = output[0];
+    }
+}
+
+static void ScryptGenericHeader(benchmark::State& state)
+{
+    char header[80] = {0};
+    char output[32];
+    std::vector<char> scratchpad(SCRYPT_SCRATCHPAD_SIZE);
+    while (state.KeepRunning()) {
+        scrypt_1024_1_1_256_sp_generic(header, output, &scratchpad[0]);
+        header[76] = output[0];
+    }
+}
+
+// An iteration hashes as many headers as the widest interleaved path takes
+static void ScryptMultiHeaders(benchmark::State& state)
+{
+    int nWays = scrypt_best_ways();
+    std::vector<char> vHeaders(80 * nWays, 0), vOutputs(32 * nWays);
+    char *scratchpad = scrypt_buffer_alloc(nWays);
+    while (state.KeepRunning()) {
+        scrypt_1024_1_1_256_sp_multi(nWays, &vHeaders[0], &vOutputs[0], scratchpad);
+        vHeaders[76] = vOutputs[0];
+    }
+    scrypt_buffer_free(scratchpad);
+}
+
+// Double SHA256 of a transaction sized buffer, and of a hash (merkle tree)
+static void HashSha256d1K(benchmark::State& state)
+{
+    std::vector<unsigned char> vch(1024, 0xa5);
+    uint256 hash;
+    while (state.KeepRunning()) {
+        hash = Hash(vch.begin(), vch.end());
+        vch[0] = hash.GetLow64();
+    }
+}
+
+static void HashSha256d64(benchmark::State& state)
+{
+    uint256 hash1 = 1, hash2 = 2;
+    while (state.KeepRunning())
+        hash1 = Hash(BEGIN(hash1), END(hash1), BEGIN(hash2), END(hash2));
+}
+
+// A merkle tree level of 1024 pairs through the batched double hash
+static void HashSha256d64Batch(benchmark::State& state)
+{
+    std::vector<uint256> vIn(2048), vOut(1024);
+    for (unsigned int i = 0; i < vIn.size(); i++)
+        vIn[i] = i;
+    while (state.KeepRunning()) {
+        SHA256D64((unsigned char*)&vOut[0], (const unsigned char*)&vIn[0], vOut.size());
+        vIn[0] = vOut[0];
+    }
+}
+
+BENCHMARK(HashX11Header);
+BENCHMARK(HashX11FastHeader);
+BENCHMARK(ScryptHeader);
+BENCHMARK(ScryptGenericHeader);
+BENCHMARK(ScryptMultiHeaders);
+BENCHMARK(HashSha256d1K);
+BENCHMARK(HashSha256d64);
+BENCHMARK(HashSha256d64Batch);
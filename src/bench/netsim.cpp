@@ -0,0 +1,554 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "core.h"
+#include "key.h"
+#include "keystore.h"
+#include "main.h"
+#include "miner.h"
+#include "net.h"
+#include "netbase.h"
+#include "script.h"
+#include "txdb.h"
+#include "util.h"
+#include "version.h"
+
+#include <algorithm>
+#include <deque>
+#include <errno.h>
+#include <limits>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/resource.h>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
+#include "json/json_spirit_writer_template.h"
+
+#if !defined(HAVE_MSG_NOSIGNAL) && !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
+using namespace std;
+using namespace json_spirit;
+
+extern void noui_connect();
+
+// Usage: netsim_digitalcoin [-peers=<n>] [-latency=<ms>] [-jitter=<ms>]
+//        [-bandwidth=<kB/s>] [-txs=<n>] [-blocks=<n>] [-idle=<s>]
+//        [-timeout=<s>] [-fetch=0] [-msgthreads=<n>]
+//
+// Runs one regtest node in this process with -peers simulated peers. Each
+// peer is the far end of a socket pair the node serves as an inbound
+// connection, through the same socket handler and message threads as real
+// ones. The first peer sends the node -txs transactions and then -blocks
+// blocks, one at a time, and the others record when each is announced to
+// them. Their links have a one-way latency of -latency plus up to -jitter
+// milliseconds and -bandwidth each way (0 for unlimited); with -fetch, the
+// default, they also request the transactions announced to them.
+//
+// The results are written to stdout as JSON: the announcement delays from
+// the node receiving each transaction or block to each peer seeing it, and
+// the CPU time the node took per peer while idle and while relaying.
+
+/** A simulated peer. Messages it sends reach the node after crossing its
+ *  link, and messages from the node are timed as arriving after crossing
+ *  it the other way; the sockets themselves carry them without delay. */
+struct CSimPeer
+{
+    SOCKET hSocket;
+    CNode* pnode;
+    int64_t nLatencyMicros;
+    int64_t nBytesPerSec;     // 0 for unlimited
+    int64_t nUpFreeMicros;    // when the link towards the node is free
+    int64_t nDownFreeMicros;  // when the link from the node is free
+    CPlainSerializeData vRecv;
+    // Messages to the node by delivery time, the first partly sent
+    deque<pair<int64_t, CSharedMessage> > vSendQueue;
+    size_t nSendOffset;
+    bool fVerack;
+    // When each block or transaction was first announced, and when each
+    // transaction requested arrived
+    map<uint256, int64_t> mapAnnounced;
+    map<uint256, int64_t> mapReceived;
+
+    CSimPeer() : hSocket(INVALID_SOCKET), pnode(NULL), nLatencyMicros(0), nBytesPerSec(0),
+                 nUpFreeMicros(0), nDownFreeMicros(0), nSendOffset(0), fVerack(false) {}
+};
+
+static vector<CSimPeer> vPeers;
+static bool fFetch = true;
+
+static int64_t TransferMicros(const CSimPeer& peer, size_t nBytes)
+{
+    return peer.nBytesPerSec > 0 ? (int64_t)nBytes * 1000000 / peer.nBytesPerSec : 0;
+}
+
+// Queue a message from the peer, sent at nNow; returns when it reaches the
+// node
+static int64_t SimSend(CSimPeer& peer, const CSharedMessage& pmsg, int64_t nNow)
+{
+    peer.nUpFreeMicros = max(nNow, peer.nUpFreeMicros) + TransferMicros(peer, pmsg->size());
+    int64_t nDeliver = peer.nUpFreeMicros + peer.nLatencyMicros;
+    peer.vSendQueue.push_back(make_pair(nDeliver, pmsg));
+    return nDeliver;
+}
+
+template<typename T>
+static int64_t SimSend(CSimPeer& peer, const char* pszCommand, const T& obj, int64_t nNow)
+{
+    return SimSend(peer, CNode::MakeSharedMessage(pszCommand, obj), nNow);
+}
+
+static int64_t SimSendVersion(CSimPeer& peer, int64_t nNow)
+{
+    int nHeight;
+    {
+        LOCK(cs_main);
+        nHeight = chainActive.Height();
+    }
+    uint64_t nNonce = GetRand(std::numeric_limits<uint64_t>::max());
+    // Read by the node before it knows our version
+    CDataStream ss(SER_NETWORK, INIT_PROTO_VERSION);
+    ss << PROTOCOL_VERSION << (uint64_t)NODE_NETWORK << GetTime() << CAddress(CService("0.0.0.0", 0))
+       << peer.pnode->addr << nNonce << FormatSubVersion("netsim", CLIENT_VERSION, vector<string>())
+       << nHeight << true;
+    return SimSend(peer, CNode::MakeSharedMessage("version", &ss[0], ss.size()), nNow);
+}
+
+// Handle a message from the node, arriving at the peer at nTime
+static void SimProcessMessage(CSimPeer& peer, const string& strCommand, CDataStream& vRecv, int64_t nTime)
+{
+    if (strCommand == "version")
+        SimSend(peer, CNode::MakeSharedMessage("verack", NULL, 0), nTime);
+    else if (strCommand == "verack")
+        peer.fVerack = true;
+    else if (strCommand == "ping" && !vRecv.empty())
+    {
+        uint64_t nNonce;
+        vRecv >> nNonce;
+        SimSend(peer, "pong", nNonce, nTime);
+    }
+    else if (strCommand == "inv")
+    {
+        vector<CInv> vInv;
+        vRecv >> vInv;
+        vector<CInv> vGetData;
+        BOOST_FOREACH(const CInv& inv, vInv)
+        {
+            if (!peer.mapAnnounced.insert(make_pair(inv.hash, nTime)).second)
+                continue;
+            if (fFetch && inv.type == MSG_TX)
+                vGetData.push_back(inv);
+        }
+        if (!vGetData.empty())
+            SimSend(peer, "getdata", vGetData, nTime);
+    }
+    else if (strCommand == "cmpctblock")
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        peer.mapAnnounced.insert(make_pair(cmpctblock.header.GetHash(), nTime));
+    }
+    else if (strCommand == "tx")
+    {
+        CTransaction tx;
+        vRecv >> tx;
+        peer.mapReceived.insert(make_pair(tx.GetHash(), nTime));
+    }
+}
+
+// Read what the node sent; false once it disconnected
+static bool SimReceive(CSimPeer& peer, int64_t nNow)
+{
+    char pchBuf[0x10000];
+    while (true)
+    {
+        int nBytes = recv(peer.hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+        if (nBytes == 0)
+            return false;
+        if (nBytes < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        peer.vRecv.insert(peer.vRecv.end(), pchBuf, pchBuf + nBytes);
+
+        while (peer.vRecv.size() >= CMessageHeader::HEADER_SIZE)
+        {
+            CMessageHeader hdr;
+            CDataStream ssHeader(&peer.vRecv[0], &peer.vRecv[0] + CMessageHeader::HEADER_SIZE, SER_NETWORK, PROTOCOL_VERSION);
+            ssHeader >> hdr;
+            size_t nSize = CMessageHeader::HEADER_SIZE + hdr.nMessageSize;
+            if (peer.vRecv.size() < nSize)
+                break;
+            // Messages cross the link one after the other
+            peer.nDownFreeMicros = max(nNow, peer.nDownFreeMicros) + TransferMicros(peer, nSize);
+            CDataStream vMsg(&peer.vRecv[0] + CMessageHeader::HEADER_SIZE, &peer.vRecv[0] + nSize, SER_NETWORK, PROTOCOL_VERSION);
+            SimProcessMessage(peer, hdr.GetCommand(), vMsg, peer.nDownFreeMicros + peer.nLatencyMicros);
+            peer.vRecv.erase(peer.vRecv.begin(), peer.vRecv.begin() + nSize);
+        }
+    }
+}
+
+// Write the messages due by nNow; false once the node disconnected
+static bool SimFlush(CSimPeer& peer, int64_t nNow)
+{
+    while (!peer.vSendQueue.empty() && peer.vSendQueue.front().first <= nNow)
+    {
+        const CPlainSerializeData& data = *peer.vSendQueue.front().second;
+        int nBytes = send(peer.hSocket, &data[peer.nSendOffset], data.size() - peer.nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (nBytes < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        peer.nSendOffset += nBytes;
+        if (peer.nSendOffset < data.size())
+            return true;
+        peer.vSendQueue.pop_front();
+        peer.nSendOffset = 0;
+    }
+    return true;
+}
+
+static void SimDisconnect(CSimPeer& peer)
+{
+    if (peer.hSocket != INVALID_SOCKET)
+        closesocket(peer.hSocket);
+    peer.hSocket = INVALID_SOCKET;
+}
+
+// Serve the peers until fDone returns true or nMaxMicros passed; returns
+// whether fDone did
+static bool PumpUntil(const boost::function<bool()>& fDone, int64_t nMaxMicros)
+{
+    int64_t nEnd = GetTimeMicros() + nMaxMicros;
+    vector<struct pollfd> vPoll(vPeers.size());
+    while (true)
+    {
+        if (fDone())
+            return true;
+        int64_t nNow = GetTimeMicros();
+        if (nNow >= nEnd)
+            return false;
+
+        int64_t nWait = min(nEnd - nNow, (int64_t)10000);
+        for (unsigned int i = 0; i < vPeers.size(); i++)
+        {
+            const CSimPeer& peer = vPeers[i];
+            vPoll[i].fd = peer.hSocket;
+            vPoll[i].events = POLLIN;
+            vPoll[i].revents = 0;
+            if (peer.hSocket == INVALID_SOCKET || peer.vSendQueue.empty())
+                continue;
+            if (peer.nSendOffset > 0)
+                vPoll[i].events |= POLLOUT;
+            else
+                nWait = min(nWait, max(peer.vSendQueue.front().first - nNow, (int64_t)0));
+        }
+        poll(&vPoll[0], vPoll.size(), (int)((nWait + 999) / 1000));
+
+        nNow = GetTimeMicros();
+        for (unsigned int i = 0; i < vPeers.size(); i++)
+        {
+            CSimPeer& peer = vPeers[i];
+            if (peer.hSocket == INVALID_SOCKET)
+                continue;
+            if ((vPoll[i].revents & (POLLIN | POLLHUP | POLLERR)) && !SimReceive(peer, nNow))
+                SimDisconnect(peer);
+            else if (!SimFlush(peer, nNow))
+                SimDisconnect(peer);
+        }
+    }
+}
+
+static bool Never()
+{
+    return false;
+}
+
+static bool AllConnected()
+{
+    BOOST_FOREACH(const CSimPeer& peer, vPeers)
+        if (peer.hSocket != INVALID_SOCKET && (!peer.fVerack || !peer.pnode->fSuccessfullyConnected))
+            return false;
+    return true;
+}
+
+// Whether every peer but the first saw hash announced and, for a block,
+// the node connected it
+static bool AllAnnounced(const uint256& hash, bool fBlock)
+{
+    for (unsigned int i = 1; i < vPeers.size(); i++)
+        if (vPeers[i].hSocket != INVALID_SOCKET && !vPeers[i].mapAnnounced.count(hash))
+            return false;
+    if (fBlock)
+    {
+        LOCK(cs_main);
+        return chainActive.Tip()->GetBlockHash() == hash;
+    }
+    return true;
+}
+
+// Delays from nSent to when each peer but the first saw hash
+static void CollectDelays(const map<uint256, int64_t> CSimPeer::*pmap, const uint256& hash, int64_t nSent, vector<int64_t>& vDelays, int& nMissed)
+{
+    for (unsigned int i = 1; i < vPeers.size(); i++)
+    {
+        const map<uint256, int64_t>& mapTimes = vPeers[i].*pmap;
+        map<uint256, int64_t>::const_iterator it = mapTimes.find(hash);
+        if (it == mapTimes.end())
+            nMissed++;
+        else
+            vDelays.push_back(it->second - nSent);
+    }
+}
+
+static Object Summarize(vector<int64_t> vMicros, int nMissed)
+{
+    Object obj;
+    obj.push_back(Pair("count", (int)vMicros.size()));
+    obj.push_back(Pair("missed", nMissed));
+    if (vMicros.empty())
+        return obj;
+    sort(vMicros.begin(), vMicros.end());
+    int64_t nSum = 0;
+    BOOST_FOREACH(int64_t n, vMicros)
+        nSum += n;
+    size_t nSize = vMicros.size();
+    obj.push_back(Pair("mean_ms", nSum / 1000.0 / nSize));
+    obj.push_back(Pair("min_ms", vMicros[0] / 1000.0));
+    obj.push_back(Pair("median_ms", vMicros[nSize / 2] / 1000.0));
+    obj.push_back(Pair("p90_ms", vMicros[min(nSize - 1, nSize * 9 / 10)] / 1000.0));
+    obj.push_back(Pair("max_ms", vMicros[nSize - 1] / 1000.0));
+    return obj;
+}
+
+static int64_t RUsageMicros(int nWho)
+{
+    struct rusage usage;
+    if (getrusage(nWho, &usage) != 0)
+        return 0;
+    return (int64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// CPU time of the node's threads: the process but the simulator's thread,
+// where the system can tell them apart
+static int64_t NodeCPUMicros()
+{
+    int64_t nMicros = RUsageMicros(RUSAGE_SELF);
+#ifdef RUSAGE_THREAD
+    nMicros -= RUsageMicros(RUSAGE_THREAD);
+#endif
+    return nMicros;
+}
+
+// A scrypt block on the tip paying to scriptPubKey, with the transactions of
+// the mempool, not processed
+static bool MineBlock(const CScript& scriptPubKey, CBlock& block)
+{
+    LOCK(cs_main);
+    boost::scoped_ptr<CBlockTemplate> pblocktemplate(CreateNewBlock(scriptPubKey, ALGO_SCRYPT));
+    if (!pblocktemplate)
+        return false;
+    block = pblocktemplate->block;
+    unsigned int nExtraNonce = 0;
+    IncrementExtraNonce(&block, chainActive.Tip(), nExtraNonce);
+    while (!CheckProofOfWork(block.GetPoWHash(ALGO_SCRYPT), block.nBits, ALGO_SCRYPT))
+        block.nNonce++;
+    return true;
+}
+
+static double PerPeer(int64_t nMicros, double dUnits)
+{
+    return dUnits > 0 && vPeers.size() > 0 ? nMicros / dUnits / vPeers.size() : 0;
+}
+
+static int RunSimulation(Object& output)
+{
+    int nPeers = max((int)GetArg("-peers", 50), 2);
+    int64_t nLatencyMicros = GetArg("-latency", 50) * 1000;
+    int64_t nJitterMicros = GetArg("-jitter", 0) * 1000;
+    int64_t nBytesPerSec = GetArg("-bandwidth", 1000) * 1000;
+    int nTxs = max((int)GetArg("-txs", 20), 0);
+    int nBlocks = max((int)GetArg("-blocks", 5), 0);
+    int64_t nTimeoutMicros = GetArg("-timeout", 30) * 1000000;
+    fFetch = GetBoolArg("-fetch", true);
+
+    // Coinbases to spend, one per transaction
+    CKey key;
+    key.MakeNewKey(true);
+    CBasicKeyStore keystore;
+    keystore.AddKey(key);
+    CScript scriptPubKey = CScript() << key.GetPubKey() << OP_CHECKSIG;
+    vector<CTransaction> vCoinbases;
+    for (int i = 0; i < nTxs + COINBASE_MATURITY; i++)
+    {
+        CBlock block;
+        CValidationState state;
+        if (!MineBlock(scriptPubKey, block) || !ProcessBlock(state, NULL, &block))
+        {
+            fprintf(stderr, "Error: could not mine the chain\n");
+            return 1;
+        }
+        vCoinbases.push_back(block.vtx[0]);
+    }
+
+    // Connect the peers
+    int64_t nStart = GetTimeMicros();
+    vPeers.resize(nPeers);
+    for (int i = 0; i < nPeers; i++)
+    {
+        CSimPeer& peer = vPeers[i];
+        SOCKET hSocketNode;
+        if (!CreateSocketPair(hSocketNode, peer.hSocket))
+        {
+            fprintf(stderr, "Error: could not create a socket pair\n");
+            return 1;
+        }
+        CAddress addr(CService(strprintf("10.%d.%d.%d", (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff), Params().GetDefaultPort()));
+        peer.pnode = AddConnectedNode(hSocketNode, addr, "", true);
+        // Ours until the end, past its disconnection
+        peer.pnode->AddRef();
+        peer.nLatencyMicros = nLatencyMicros + (nJitterMicros > 0 ? GetRand(nJitterMicros + 1) : 0);
+        peer.nBytesPerSec = nBytesPerSec;
+        SimSendVersion(peer, GetTimeMicros());
+    }
+    if (!PumpUntil(&AllConnected, nTimeoutMicros))
+    {
+        fprintf(stderr, "Error: timeout connecting the peers\n");
+        return 1;
+    }
+    output.push_back(Pair("connect_ms", (GetTimeMicros() - nStart) / 1000.0));
+
+    // Idle: pings only
+    int64_t nIdleMicros = GetArg("-idle", 5) * 1000000;
+    int64_t nCPU = NodeCPUMicros();
+    PumpUntil(&Never, nIdleMicros);
+    Object idle;
+    idle.push_back(Pair("seconds", nIdleMicros / 1000000.0));
+    idle.push_back(Pair("cpu_us_per_peer_per_sec", PerPeer(NodeCPUMicros() - nCPU, nIdleMicros / 1000000.0)));
+    output.push_back(Pair("idle", idle));
+
+    // Transactions, each spending a coinbase, sent by the first peer
+    vector<int64_t> vAnnounced, vReceived;
+    int nMissedAnnounced = 0, nMissedReceived = 0;
+    nCPU = NodeCPUMicros();
+    for (int i = 0; i < nTxs; i++)
+    {
+        const CTransaction& txPrev = vCoinbases[i];
+        CMutableTransaction txNew;
+        txNew.vin.push_back(CTxIn(COutPoint(txPrev.GetHash(), 0)));
+        txNew.vout.push_back(CTxOut(txPrev.vout[0].nValue - 10 * CTransaction::nMinRelayTxFee, scriptPubKey));
+        if (!SignSignature(keystore, txPrev, txNew, 0))
+        {
+            fprintf(stderr, "Error: could not sign a transaction\n");
+            return 1;
+        }
+        CTransaction tx(txNew);
+        int64_t nSent = SimSend(vPeers[0], "tx", tx, GetTimeMicros());
+        PumpUntil(boost::bind(&AllAnnounced, tx.GetHash(), false), nTimeoutMicros);
+        CollectDelays(&CSimPeer::mapAnnounced, tx.GetHash(), nSent, vAnnounced, nMissedAnnounced);
+        if (fFetch)
+            CollectDelays(&CSimPeer::mapReceived, tx.GetHash(), nSent, vReceived, nMissedReceived);
+    }
+    Object txs;
+    txs.push_back(Pair("count", nTxs));
+    txs.push_back(Pair("announce", Summarize(vAnnounced, nMissedAnnounced)));
+    if (fFetch)
+        txs.push_back(Pair("receive", Summarize(vReceived, nMissedReceived)));
+    txs.push_back(Pair("cpu_us_per_peer_per_tx", PerPeer(NodeCPUMicros() - nCPU, nTxs)));
+    output.push_back(Pair("tx", txs));
+
+    // Blocks, mined here with the transactions above and sent by the first
+    // peer
+    vAnnounced.clear();
+    nMissedAnnounced = 0;
+    nCPU = NodeCPUMicros();
+    int64_t nMiningMicros = 0;
+    for (int i = 0; i < nBlocks; i++)
+    {
+        int64_t nMineStart = GetTimeMicros();
+        CBlock block;
+        if (!MineBlock(scriptPubKey, block))
+        {
+            fprintf(stderr, "Error: could not mine a block\n");
+            return 1;
+        }
+        nMiningMicros += GetTimeMicros() - nMineStart;
+        int64_t nSent = SimSend(vPeers[0], "block", block, GetTimeMicros());
+        PumpUntil(boost::bind(&AllAnnounced, block.GetHash(), true), nTimeoutMicros);
+        CollectDelays(&CSimPeer::mapAnnounced, block.GetHash(), nSent, vAnnounced, nMissedAnnounced);
+    }
+    Object blocks;
+    blocks.push_back(Pair("count", nBlocks));
+    blocks.push_back(Pair("announce", Summarize(vAnnounced, nMissedAnnounced)));
+#ifndef RUSAGE_THREAD
+    // Mining was counted as the node's
+    nCPU += nMiningMicros;
+#endif
+    blocks.push_back(Pair("cpu_us_per_peer_per_block", PerPeer(NodeCPUMicros() - nCPU, nBlocks)));
+    output.push_back(Pair("block", blocks));
+
+    int nDisconnected = 0;
+    BOOST_FOREACH(const CSimPeer& peer, vPeers)
+        if (peer.hSocket == INVALID_SOCKET)
+            nDisconnected++;
+    output.push_back(Pair("disconnected", nDisconnected));
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    ParseParameters(argc, argv);
+    fPrintToDebugLog = false;
+    noui_connect();
+    SelectParams(CChainParams::REGTEST);
+
+    // Only the simulated peers
+    SoftSetBoolArg("-dnsseed", false);
+    SoftSetBoolArg("-upnp", false);
+    fDiscover = false;
+
+    boost::filesystem::path pathTemp = GetTempPath() / strprintf("netsim_digitalcoin_%lu_%i", (unsigned long)GetTime(), (int)(GetRand(100000)));
+    boost::filesystem::create_directories(pathTemp);
+    mapArgs["-datadir"] = pathTemp.string();
+    pblocktree = new CBlockTreeDB(1 << 20, true);
+    CCoinsViewDB* pcoinsdbview = new CCoinsViewDB(1 << 23, true);
+    pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+    InitBlockIndex();
+
+    boost::thread_group threadGroup;
+    nScriptCheckThreads = 3;
+    for (int i = 0; i < nScriptCheckThreads - 1; i++)
+        threadGroup.create_thread(&ThreadScriptCheck);
+    RegisterNodeSignals(GetNodeSignals());
+    StartNode(threadGroup);
+
+    Object output;
+    output.push_back(Pair("version", FormatFullVersion()));
+    output.push_back(Pair("peers", (int)max(GetArg("-peers", 50), (int64_t)2)));
+    output.push_back(Pair("latency_ms", (int)GetArg("-latency", 50)));
+    output.push_back(Pair("jitter_ms", (int)GetArg("-jitter", 0)));
+    output.push_back(Pair("bandwidth_kBps", (int)GetArg("-bandwidth", 1000)));
+    int nRet = RunSimulation(output);
+    if (nRet == 0)
+        printf("%s\n", write_string(Value(output), true).c_str());
+
+    BOOST_FOREACH(CSimPeer& peer, vPeers)
+    {
+        SimDisconnect(peer);
+        if (peer.pnode)
+            peer.pnode->Release();
+    }
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+    StopNode();
+    UnregisterNodeSignals(GetNodeSignals());
+    delete pcoinsTip;
+    delete pcoinsdbview;
+    delete pblocktree;
+    boost::filesystem::remove_all(pathTemp);
+    return nRet;
+}
@@ -0,0 +1,101 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "core.h"
+#include "key.h"
+#include "script.h"
+
+#include <vector>
+
+extern uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+
+// Leave the signature cache out, so every iteration verifies
+static const unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC | SCRIPT_VERIFY_NOCACHE;
+
+static void VerifyECDSA(benchmark::State& state)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    uint256 hash = 1;
+    std::vector<unsigned char> vchSig;
+    key.Sign(hash, vchSig);
+    while (state.KeepRunning())
+        pubkey.Verify(hash, vchSig);
+}
+
+// Without the cache of parsed public keys
+static void VerifyECDSAOpenSSL(benchmark::State& state)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    uint256 hash = 1;
+    std::vector<unsigned char> vchSig;
+    key.Sign(hash, vchSig);
+    while (state.KeepRunning())
+        pubkey.VerifyOpenSSL(hash, vchSig);
+}
+
+// A transaction spending one output with scriptPubKey
+static CTransaction MakeSpend(const CScript &scriptPubKey)
+{
+    CMutableTransaction txFrom;
+    txFrom.vout.resize(1);
+    txFrom.vout[0].scriptPubKey = scriptPubKey;
+    CMutableTransaction txTo;
+    txTo.vin.resize(1);
+    txTo.vin[0].prevout = COutPoint(txFrom.GetHash(), 0);
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = 1;
+    return txTo;
+}
+
+static std::vector<unsigned char> SignInput(const CKey &key, const CScript &scriptCode, const CTransaction &txTo)
+{
+    uint256 hash = SignatureHash(scriptCode, txTo, 0, SIGHASH_ALL);
+    std::vector<unsigned char> vchSig;
+    key.Sign(hash, vchSig);
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    return vchSig;
+}
+
+static void VerifyScriptP2PKH(benchmark::State& state)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    CTransaction txTo = MakeSpend(scriptPubKey);
+    CScript scriptSig = CScript() << SignInput(key, scriptPubKey, txTo) << key.GetPubKey();
+    while (state.KeepRunning())
+        VerifyScript(scriptSig, scriptPubKey, txTo, 0, flags, 0);
+}
+
+// 2 of 3 multisig, in pay to script hash
+static void VerifyScriptP2SHMultisig(benchmark::State& state)
+{
+    CKey keys[3];
+    std::vector<CPubKey> pubkeys;
+    for (int i = 0; i < 3; i++) {
+        keys[i].MakeNewKey(true);
+        pubkeys.push_back(keys[i].GetPubKey());
+    }
+    CScript scriptRedeem;
+    scriptRedeem.SetMultisig(2, pubkeys);
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(scriptRedeem.GetID());
+    CTransaction txTo = MakeSpend(scriptPubKey);
+    CScript scriptSig = CScript() << OP_0 << SignInput(keys[0], scriptRedeem, txTo) << SignInput(keys[1], scriptRedeem, txTo);
+    scriptSig << ToByteVector(scriptRedeem);
+    while (state.KeepRunning())
+        VerifyScript(scriptSig, scriptPubKey, txTo, 0, flags, 0);
+}
+
+BENCHMARK(VerifyECDSA);
+BENCHMARK(VerifyECDSAOpenSSL);
+BENCHMARK(VerifyScriptP2PKH);
+BENCHMARK(VerifyScriptP2SHMultisig);
@@ -0,0 +1,151 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "hash.h"
+#include "main.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <boost/unordered_map.hpp>
+
+using namespace std;
+
+// Smallest possible serialized transaction, to bound the count a compact
+// block may claim
+static const unsigned int MIN_TRANSACTION_SIZE = 60;
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) :
+        nNonce(GetRand(std::numeric_limits<uint64_t>::max())),
+        vShortTxIDs(block.vtx.size() - 1), vPrefilledTxn(1)
+{
+    header = block.GetBlockHeader();
+    FillShortIDKey();
+
+    // The coinbase is never in a mempool
+    vPrefilledTxn[0].nIndex = 0;
+    vPrefilledTxn[0].tx = block.vtx[0];
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        vShortTxIDs[i - 1] = CShortTxID(GetShortID(block.vtx[i].GetHash()));
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortIDKey()
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << header << nNonce;
+    uint256 hash = Hash(ss.begin(), ss.end());
+    nShortIDKey0 = hash.GetLow64();
+    nShortIDKey1 = (hash >> 64).GetLow64();
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    return SipHashUint256(nShortIDKey0, nShortIDKey1, txhash) & 0xffffffffffffULL;
+}
+
+ReadStatus CPartialBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool)
+{
+    if (cmpctblock.header.IsNull() || (cmpctblock.vShortTxIDs.empty() && cmpctblock.vPrefilledTxn.empty()))
+        return READ_STATUS_INVALID;
+    if (cmpctblock.BlockTxCount() > MAX_BLOCK_SIZE / MIN_TRANSACTION_SIZE)
+        return READ_STATUS_INVALID;
+
+    header = cmpctblock.header;
+    vtx.assign(cmpctblock.BlockTxCount(), CTransaction());
+    vHave.assign(cmpctblock.BlockTxCount(), false);
+
+    int64_t nLastIndex = -1;
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.vPrefilledTxn)
+    {
+        nLastIndex += (int64_t)prefilled.nIndex + 1;
+        if (nLastIndex >= (int64_t)vtx.size() || prefilled.tx.IsNull())
+            return READ_STATUS_INVALID;
+        vtx[nLastIndex] = prefilled.tx;
+        vHave[nLastIndex] = true;
+    }
+
+    // Positions left for the short ids, in order
+    boost::unordered_map<uint64_t, uint32_t> mapShortIDs;
+    uint32_t nIndex = 0;
+    BOOST_FOREACH(const CShortTxID& shortid, cmpctblock.vShortTxIDs)
+    {
+        while (vHave[nIndex])
+            nIndex++;
+        // Two transactions of the block with the same short id can not be
+        // told apart
+        if (!mapShortIDs.insert(make_pair(shortid.nID, nIndex)).second)
+            return READ_STATUS_FAILED;
+        nIndex++;
+    }
+
+    // A mempool transaction matching a short id already taken collides;
+    // that position is left for getblocktxn
+    vector<bool> vCollision(vtx.size(), false);
+    size_t nFound = 0;
+    {
+        LOCK(pool.cs);
+        for (CTxMemPoolMap::const_iterator it = pool.mapTx.begin(); it != pool.mapTx.end() && nFound < mapShortIDs.size(); it++)
+        {
+            boost::unordered_map<uint64_t, uint32_t>::const_iterator mi = mapShortIDs.find(cmpctblock.GetShortID(it->first));
+            if (mi == mapShortIDs.end() || vCollision[mi->second])
+                continue;
+            if (vHave[mi->second])
+            {
+                vHave[mi->second] = false;
+                vCollision[mi->second] = true;
+                nFound--;
+                continue;
+            }
+            vtx[mi->second] = it->second.GetTx();
+            vHave[mi->second] = true;
+            nFound++;
+        }
+    }
+
+    LogPrint("net", "compact block %s: %u of %u transactions found in the mempool\n",
+             header.GetHash().ToString(), nFound, mapShortIDs.size());
+    return READ_STATUS_OK;
+}
+
+bool CPartialBlock::IsTxAvailable(size_t nIndex) const
+{
+    assert(!header.IsNull());
+    assert(nIndex < vHave.size());
+    return vHave[nIndex];
+}
+
+void CPartialBlock::GetMissing(std::vector<uint32_t>& vIndexes) const
+{
+    vIndexes.clear();
+    for (uint32_t i = 0; i < vHave.size(); i++)
+        if (!vHave[i])
+            vIndexes.push_back(i);
+}
+
+ReadStatus CPartialBlock::FillBlock(CBlock& block, const std::vector<CTransaction>& vMissing) const
+{
+    assert(!header.IsNull());
+    block = CBlock(header);
+    block.vtx = vtx;
+
+    size_t nMissing = 0;
+    for (size_t i = 0; i < vtx.size(); i++)
+    {
+        if (vHave[i])
+            continue;
+        if (nMissing >= vMissing.size())
+            return READ_STATUS_INVALID;
+        block.vtx[i] = vMissing[nMissing++];
+    }
+    if (nMissing != vMissing.size())
+        return READ_STATUS_INVALID;
+
+    // A mempool transaction with the short id of another one ends up here;
+    // so would a peer answering with the wrong transactions
+    if (block.BuildMerkleTree() != header.hashMerkleRoot)
+        return READ_STATUS_FAILED;
+
+    return READ_STATUS_OK;
+}
@@ -0,0 +1,150 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "core.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <vector>
+
+class CTxMemPool;
+
+// Compact blocks (as in BIP 152): a new block is announced by its header and
+// a short id per transaction, and the receiver rebuilds it from its mempool.
+// Only the transactions it cannot find are fetched, with a getblocktxn /
+// blocktxn round trip.
+
+// Compact blocks are only served for blocks this close to the tip; older
+// ones are unlikely to match anything in the requester's mempool
+static const int MAX_CMPCTBLOCK_DEPTH = 10;
+
+/** A short transaction id: the low 6 bytes of a SipHash-2-4 of the txid,
+ *  keyed by the block header and the nonce of the compact block */
+class CShortTxID
+{
+public:
+    uint64_t nID;
+
+    CShortTxID() : nID(0) {}
+    CShortTxID(uint64_t nIDIn) : nID(nIDIn & 0xffffffffffffULL) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        uint32_t nLow = nID & 0xffffffff;
+        uint16_t nHigh = (nID >> 32) & 0xffff;
+        READWRITE(nLow);
+        READWRITE(nHigh);
+        if (fRead)
+            const_cast<CShortTxID*>(this)->nID = ((uint64_t)nHigh << 32) | nLow;
+    )
+};
+
+/** A transaction sent in full within a compact block. On the wire nIndex is
+ *  the distance from the previous prefilled transaction, less one. */
+class CPrefilledTransaction
+{
+public:
+    uint32_t nIndex;
+    CTransaction tx;
+
+    CPrefilledTransaction() : nIndex(0) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(VARINT(nIndex));
+        READWRITE(tx);
+    )
+};
+
+/** A block as its header, the short ids of its transactions and the ones
+ *  the receiver cannot have yet, which is its coinbase ("cmpctblock") */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    uint64_t nShortIDKey0, nShortIDKey1;
+
+    void FillShortIDKey();
+
+public:
+    CBlockHeader header;
+    uint64_t nNonce;
+    std::vector<CShortTxID> vShortTxIDs;
+    std::vector<CPrefilledTransaction> vPrefilledTxn;
+
+    CBlockHeaderAndShortTxIDs() : nShortIDKey0(0), nShortIDKey1(0), nNonce(0) {}
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return vShortTxIDs.size() + vPrefilledTxn.size(); }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header);
+        READWRITE(nNonce);
+        READWRITE(vShortTxIDs);
+        READWRITE(vPrefilledTxn);
+        if (fRead)
+            const_cast<CBlockHeaderAndShortTxIDs*>(this)->FillShortIDKey();
+    )
+};
+
+/** The positions of the transactions of a compact block the receiver is
+ *  missing ("getblocktxn") */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<uint32_t> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vIndexes);
+    )
+};
+
+/** The reply to getblocktxn, in the order requested ("blocktxn") */
+class CBlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vtx);
+    )
+};
+
+enum ReadStatus
+{
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, // the peer sent something malformed
+    READ_STATUS_FAILED,  // could not rebuild it; fetch the full block instead
+};
+
+/** A compact block being rebuilt from the mempool and a blocktxn reply */
+class CPartialBlock
+{
+private:
+    CBlockHeader header;
+    std::vector<CTransaction> vtx;
+    std::vector<bool> vHave;
+
+public:
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool);
+
+    const CBlockHeader& GetHeader() const { return header; }
+    bool IsTxAvailable(size_t nIndex) const;
+    void GetMissing(std::vector<uint32_t>& vIndexes) const;
+
+    // Complete the block with the missing transactions, in GetMissing order
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vMissing) const;
+};
+
+#endif
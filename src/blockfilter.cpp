@@ -0,0 +1,245 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "core.h"
+#include "hash.h"
+#include "main.h"
+#include "script.h"
+
+#include <algorithm>
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+// The high 64 bits of x * n, mapping a uniform x onto [0, n) without a
+// division
+static uint64_t MapIntoRange(uint64_t x, uint64_t n)
+{
+    uint64_t x_hi = x >> 32, x_lo = x & 0xffffffff;
+    uint64_t n_hi = n >> 32, n_lo = n & 0xffffffff;
+    uint64_t ac = x_hi * n_hi;
+    uint64_t ad = x_hi * n_lo;
+    uint64_t bc = x_lo * n_hi;
+    uint64_t bd = x_lo * n_lo;
+    uint64_t mid = (bd >> 32) + (ad & 0xffffffff) + (bc & 0xffffffff);
+    return ac + (ad >> 32) + (bc >> 32) + (mid >> 32);
+}
+
+// Bits appended most significant first; the last byte is padded with zeros
+class CBitWriter
+{
+private:
+    vector<unsigned char>& vData;
+    unsigned char nBuffer;
+    int nBits;
+
+public:
+    CBitWriter(vector<unsigned char>& vDataIn) : vData(vDataIn), nBuffer(0), nBits(0) {}
+
+    void Write(uint64_t nValue, int nCount)
+    {
+        while (nCount > 0)
+        {
+            int nTake = min(8 - nBits, nCount);
+            nBuffer |= ((nValue >> (nCount - nTake)) & ((1 << nTake) - 1)) << (8 - nBits - nTake);
+            nBits += nTake;
+            nCount -= nTake;
+            if (nBits == 8)
+                Flush();
+        }
+    }
+
+    void Flush()
+    {
+        if (nBits == 0)
+            return;
+        vData.push_back(nBuffer);
+        nBuffer = 0;
+        nBits = 0;
+    }
+};
+
+class CBitReader
+{
+private:
+    const vector<unsigned char>& vData;
+    size_t nPos;
+    int nBit; // of vData[nPos], from the top
+
+public:
+    CBitReader(const vector<unsigned char>& vDataIn, size_t nPosIn) : vData(vDataIn), nPos(nPosIn), nBit(0) {}
+
+    bool ReadBit()
+    {
+        if (nPos >= vData.size())
+            throw std::ios_base::failure("CBitReader::ReadBit() : end of data");
+        bool fBit = (vData[nPos] >> (7 - nBit)) & 1;
+        if (++nBit == 8)
+        {
+            nBit = 0;
+            nPos++;
+        }
+        return fBit;
+    }
+
+    uint64_t Read(int nCount)
+    {
+        uint64_t nValue = 0;
+        while (nCount-- > 0)
+            nValue = (nValue << 1) | ReadBit();
+        return nValue;
+    }
+};
+
+static void GolombRiceEncode(CBitWriter& writer, uint64_t nValue)
+{
+    // The quotient in unary, then a zero and the remainder
+    uint64_t nQuotient = nValue >> BLOCK_FILTER_BASIC_P;
+    while (nQuotient >= 64)
+    {
+        writer.Write(~(uint64_t)0, 64);
+        nQuotient -= 64;
+    }
+    writer.Write(((uint64_t)1 << nQuotient) - 1, nQuotient);
+    writer.Write(0, 1);
+    writer.Write(nValue, BLOCK_FILTER_BASIC_P);
+}
+
+static uint64_t GolombRiceDecode(CBitReader& reader)
+{
+    uint64_t nQuotient = 0;
+    while (reader.ReadBit())
+        nQuotient++;
+    return (nQuotient << BLOCK_FILTER_BASIC_P) + reader.Read(BLOCK_FILTER_BASIC_P);
+}
+
+void CBlockFilter::SetKey()
+{
+    // The first 16 bytes of the block hash
+    nSipKey0 = hashBlock.GetLow64();
+    nSipKey1 = (hashBlock >> 64).GetLow64();
+}
+
+uint64_t CBlockFilter::HashToRange(const vector<unsigned char>& vElement) const
+{
+    uint64_t nHash = SipHash(nSipKey0, nSipKey1, vElement.empty() ? NULL : &vElement[0], vElement.size());
+    return MapIntoRange(nHash, nElements * BLOCK_FILTER_BASIC_M);
+}
+
+CBlockFilter::CBlockFilter(const uint256& hashBlockIn, const CBlockFilterElementSet& elements) :
+        hashBlock(hashBlockIn), nElements(elements.size())
+{
+    SetKey();
+
+    vector<uint64_t> vValues;
+    vValues.reserve(elements.size());
+    BOOST_FOREACH(const vector<unsigned char>& vElement, elements)
+        vValues.push_back(HashToRange(vElement));
+    sort(vValues.begin(), vValues.end());
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    WriteCompactSize(ss, nElements);
+    vEncoded.assign(ss.begin(), ss.end());
+
+    CBitWriter writer(vEncoded);
+    uint64_t nLast = 0;
+    BOOST_FOREACH(uint64_t nValue, vValues)
+    {
+        GolombRiceEncode(writer, nValue - nLast);
+        nLast = nValue;
+    }
+    writer.Flush();
+}
+
+CBlockFilter::CBlockFilter(const CBlock& block, const CBlockUndo& blockundo)
+{
+    *this = CBlockFilter(block.GetHash(), BasicElements(block, blockundo));
+}
+
+CBlockFilter::CBlockFilter(const uint256& hashBlockIn, const vector<unsigned char>& vEncodedIn) :
+        hashBlock(hashBlockIn), vEncoded(vEncodedIn)
+{
+    SetKey();
+    CDataStream ss(vEncoded, SER_NETWORK, PROTOCOL_VERSION);
+    nElements = ReadCompactSize(ss);
+}
+
+bool CBlockFilter::MatchSorted(const vector<uint64_t>& vQueries) const
+{
+    if (vQueries.empty())
+        return false;
+
+    CBitReader reader(vEncoded, GetSizeOfCompactSize(nElements));
+    vector<uint64_t>::const_iterator it = vQueries.begin();
+    uint64_t nValue = 0;
+    for (uint64_t i = 0; i < nElements; i++)
+    {
+        nValue += GolombRiceDecode(reader);
+        while (*it < nValue)
+            if (++it == vQueries.end())
+                return false;
+        if (*it == nValue)
+            return true;
+    }
+    return false;
+}
+
+bool CBlockFilter::Match(const vector<unsigned char>& vElement) const
+{
+    if (nElements == 0)
+        return false;
+    return MatchSorted(vector<uint64_t>(1, HashToRange(vElement)));
+}
+
+bool CBlockFilter::MatchAny(const CBlockFilterElementSet& elements) const
+{
+    if (nElements == 0)
+        return false;
+    vector<uint64_t> vQueries;
+    vQueries.reserve(elements.size());
+    BOOST_FOREACH(const vector<unsigned char>& vElement, elements)
+        vQueries.push_back(HashToRange(vElement));
+    sort(vQueries.begin(), vQueries.end());
+    return MatchSorted(vQueries);
+}
+
+uint256 CBlockFilter::GetHash() const
+{
+    return Hash(vEncoded.begin(), vEncoded.end());
+}
+
+uint256 CBlockFilter::ComputeHeader(const uint256& hashPrevHeader) const
+{
+    uint256 hashFilter = GetHash();
+    return Hash(BEGIN(hashFilter), END(hashFilter), BEGIN(hashPrevHeader), END(hashPrevHeader));
+}
+
+CBlockFilterElementSet CBlockFilter::BasicElements(const CBlock& block, const CBlockUndo& blockundo)
+{
+    CBlockFilterElementSet elements;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        {
+            const CScript& script = txout.scriptPubKey;
+            if (script.empty() || script[0] == OP_RETURN)
+                continue;
+            elements.insert(vector<unsigned char>(script.begin(), script.end()));
+        }
+    }
+    BOOST_FOREACH(const CTxUndo& txundo, blockundo.vtxundo)
+    {
+        BOOST_FOREACH(const CTxInUndo& prevout, txundo.vprevout)
+        {
+            const CScript& script = prevout.txout.scriptPubKey;
+            if (script.empty())
+                continue;
+            elements.insert(vector<unsigned char>(script.begin(), script.end()));
+        }
+    }
+    return elements;
+}
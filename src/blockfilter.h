@@ -0,0 +1,91 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKFILTER_H
+#define BITCOIN_BLOCKFILTER_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <set>
+#include <vector>
+
+class CBlock;
+class CBlockUndo;
+
+// Compact block filters (as in BIP 157/158): a Golomb-coded set of the
+// scripts a block pays to and spends from, which light clients download and
+// test locally instead of having each block scanned for them by a peer.
+
+// Filter types; only the basic one is defined
+static const uint8_t BLOCK_FILTER_BASIC = 0;
+
+// Golomb-Rice parameters of the basic filter: P bits of remainder, and one
+// false positive in M on average
+static const int BLOCK_FILTER_BASIC_P = 19;
+static const uint64_t BLOCK_FILTER_BASIC_M = 784931;
+
+// Most filters sent in reply to one getcfilters, and filter hashes in one
+// cfheaders; cfcheckpt has a header every BLOCK_FILTER_CHECKPOINT_INTERVAL
+static const unsigned int MAX_GETCFILTERS_SIZE = 1000;
+static const unsigned int MAX_GETCFHEADERS_SIZE = 2000;
+static const int BLOCK_FILTER_CHECKPOINT_INTERVAL = 1000;
+
+typedef std::set<std::vector<unsigned char> > CBlockFilterElementSet;
+
+/** The basic filter of a block. Its elements are hashed into [0, N * M)
+ *  with SipHash keyed by the block hash, sorted, and their differences
+ *  written as Golomb-Rice codes after N. */
+class CBlockFilter
+{
+private:
+    uint256 hashBlock;
+    uint64_t nSipKey0, nSipKey1;
+    uint64_t nElements;
+    std::vector<unsigned char> vEncoded; // N as a compact size, then the codes
+
+    void SetKey();
+    uint64_t HashToRange(const std::vector<unsigned char>& vElement) const;
+    bool MatchSorted(const std::vector<uint64_t>& vQueries) const;
+
+public:
+    CBlockFilter() : nSipKey0(0), nSipKey1(0), nElements(0) {}
+    CBlockFilter(const uint256& hashBlockIn, const CBlockFilterElementSet& elements);
+    // The output scripts of the block, and the scripts it spends from
+    CBlockFilter(const CBlock& block, const CBlockUndo& blockundo);
+    // A filter as encoded, e.g. read back from the index; throws on a
+    // malformed count
+    CBlockFilter(const uint256& hashBlockIn, const std::vector<unsigned char>& vEncodedIn);
+
+    const uint256& GetBlockHash() const { return hashBlock; }
+    const std::vector<unsigned char>& GetEncoded() const { return vEncoded; }
+    uint64_t GetElementCount() const { return nElements; }
+
+    // A false positive once in BLOCK_FILTER_BASIC_M on average
+    bool Match(const std::vector<unsigned char>& vElement) const;
+    bool MatchAny(const CBlockFilterElementSet& elements) const;
+
+    uint256 GetHash() const;
+    // Commits to this filter and, through it, to the ones before
+    uint256 ComputeHeader(const uint256& hashPrevHeader) const;
+
+    static CBlockFilterElementSet BasicElements(const CBlock& block, const CBlockUndo& blockundo);
+};
+
+/** What the block tree database keeps for a block with -blockfilterindex */
+class CBlockFilterIndexEntry
+{
+public:
+    std::vector<unsigned char> vFilter;
+    uint256 hashFilter;
+    uint256 hashHeader;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(vFilter);
+        READWRITE(hashFilter);
+        READWRITE(hashHeader);
+    )
+};
+
+#endif
@@ -0,0 +1,294 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockimport.h"
+
+#include "blockstore.h"
+#include "chainparams.h"
+#include "core.h"
+#include "main.h"
+#include "sync.h"
+#include "txdb.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "workpool.h"
+
+#include <deque>
+#include <stdio.h>
+#include <string.h>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+using namespace boost::interprocess;
+
+static CCriticalSection cs_importProgress;
+static CImportProgress importProgress;
+
+namespace {
+
+/** A block record (network magic, size, block) found by the scan */
+struct CImportRecord
+{
+    unsigned int nPos; // offset of the block itself
+    unsigned int nSize;
+
+    CImportRecord(unsigned int nPosIn, unsigned int nSizeIn) : nPos(nPosIn), nSize(nSizeIn) {}
+};
+
+struct CScannedFile
+{
+    CImportFile file;
+    uint64_t nStartByte; // part already indexed by an interrupted reindex
+    uint64_t nFileSize;
+    boost::shared_ptr<mapped_region> region;
+    std::vector<CImportRecord> vRecords;
+    bool fDone;
+
+    CScannedFile(const CImportFile &fileIn) : file(fileIn), nStartByte(0), nFileSize(0), fDone(false) {}
+};
+
+struct CImportedBlock
+{
+    CBlock block;
+    CDiskBlockPos pos;
+    CRawBlock raw;
+    bool fValid; // deserialized and passed CheckBlock
+    bool fDone;
+
+    CImportedBlock() : fValid(false), fDone(false) {}
+};
+
+void ScanFile(CWorkPool *pool, CScannedFile *pfile)
+{
+    try {
+        // Address space is scarce on 32-bit systems
+        if (pfile->nFileSize > 0 && (sizeof(void*) > 4 || pfile->nFileSize <= (MAX_BLOCKFILE_SIZE + BLOCKFILE_CHUNK_SIZE))) {
+            file_mapping mapping(pfile->file.path.string().c_str(), read_only);
+            pfile->region.reset(new mapped_region(mapping, read_only));
+        }
+    } catch (std::exception &e) {
+        LogPrintf("Unable to map %s: %s\n", pfile->file.path.string(), e.what());
+        pfile->region.reset();
+    }
+
+    if (pfile->region) {
+        // Same search as LoadExternalBlockFile: skip to the next possible
+        // start of a record whenever something does not look like one.
+        const char *pchBegin = (const char*)pfile->region->get_address();
+        uint64_t nSize = pfile->region->get_size();
+        uint64_t nPos = pfile->nStartByte;
+        const char chMagic = Params().MessageStart()[0];
+        while (nPos + 8 <= nSize) {
+            const char *pch = (const char*)memchr(pchBegin + nPos, chMagic, nSize - nPos);
+            if (!pch)
+                break;
+            nPos = pch - pchBegin;
+            if (nPos + 8 > nSize)
+                break;
+            unsigned int nBlockSize;
+            memcpy(&nBlockSize, pch + MESSAGE_START_SIZE, sizeof(nBlockSize));
+            if (memcmp(pch, Params().MessageStart(), MESSAGE_START_SIZE) != 0 ||
+                nBlockSize < 80 || nBlockSize > MAX_BLOCK_SIZE || nPos + 8 + nBlockSize > nSize) {
+                nPos++;
+                continue;
+            }
+            pfile->vRecords.push_back(CImportRecord(nPos + 8, nBlockSize));
+            nPos += 8 + nBlockSize;
+        }
+    }
+    pool->MarkDone(pfile->fDone);
+}
+
+void CheckRecord(CWorkPool *pool, CImportedBlock *pimported)
+{
+    try {
+        CDataStream ssBlock(pimported->raw.begin(), pimported->raw.end(), SER_DISK, CLIENT_VERSION);
+        ssBlock >> pimported->block;
+        CValidationState state;
+        pimported->fValid = CheckBlock(pimported->block, state);
+    } catch (std::exception &e) {
+        LogPrintf("%s : Deserialize error - %s\n", __func__, e.what());
+    }
+    // The block is no longer needed in serialized form
+    pimported->raw = CRawBlock();
+    pool->MarkDone(pimported->fDone);
+}
+
+/** Hand the checked blocks to ProcessBlock in order: those that are done,
+ *  and beyond that as many as needed to leave at most nMaxQueued behind. */
+bool ConnectBlocks(CWorkPool &pool, std::deque<CImportedBlock> &queueBlocks, unsigned int nMaxQueued, int &nLoaded)
+{
+    while (!queueBlocks.empty()) {
+        CImportedBlock &imported = queueBlocks.front();
+        if (queueBlocks.size() <= nMaxQueued && !pool.IsDone(imported.fDone))
+            break;
+        pool.WaitDone(imported.fDone);
+
+        bool fLoaded = false;
+        if (imported.fValid) {
+            LOCK(cs_main);
+            CValidationState state;
+            fLoaded = ProcessBlock(state, NULL, &imported.block, imported.pos.IsNull() ? NULL : &imported.pos, true);
+            if (state.IsError())
+                return false;
+        }
+        if (fLoaded)
+            nLoaded++;
+
+        {
+            LOCK(cs_importProgress);
+            if (fLoaded)
+                importProgress.nBlocksLoaded++;
+            if (!imported.fValid)
+                importProgress.nBlocksInvalid++;
+        }
+        queueBlocks.pop_front();
+    }
+    return true;
+}
+
+void ReportProgress(int &nLastPercent)
+{
+    int nPercent;
+    {
+        LOCK(cs_importProgress);
+        if (importProgress.nBytes == 0)
+            return;
+        nPercent = std::max(1, std::min(99, (int)(importProgress.nBytesDone * 100 / importProgress.nBytes)));
+    }
+    if (nPercent != nLastPercent) {
+        uiInterface.ShowProgress(_("Importing blocks..."), nPercent);
+        nLastPercent = nPercent;
+    }
+}
+
+}
+
+bool ImportBlockFiles(const std::vector<CImportFile> &vFiles)
+{
+    int64_t nStart = GetTimeMillis();
+
+    std::vector<CScannedFile> vScanned;
+    vScanned.reserve(vFiles.size());
+    uint64_t nBytes = 0;
+    BOOST_FOREACH(const CImportFile &file, vFiles) {
+        vScanned.push_back(CScannedFile(file));
+        CScannedFile &scanned = vScanned.back();
+        boost::system::error_code ec;
+        scanned.nFileSize = boost::filesystem::file_size(file.path, ec);
+        if (ec)
+            scanned.nFileSize = 0;
+        if (file.nFile >= 0) {
+            // (try to) skip already indexed part
+            CBlockFileInfo info;
+            if (pblocktree->ReadBlockFileInfo(file.nFile, info))
+                scanned.nStartByte = info.nSize;
+        }
+        nBytes += scanned.nFileSize;
+    }
+    {
+        LOCK(cs_importProgress);
+        importProgress = CImportProgress();
+        importProgress.fActive = true;
+        importProgress.nFiles = vFiles.size();
+        importProgress.nBytes = nBytes;
+        importProgress.nStartTime = GetTime();
+    }
+
+    // The blocks being checked and connected; their addresses stay valid
+    // while the deque grows and shrinks at its ends.
+    std::deque<CImportedBlock> queueBlocks;
+
+    int nThreads = std::max(nScriptCheckThreads, 1);
+    unsigned int nMaxQueued = 4 * nThreads + 8;
+    int nLoaded = 0;
+    int nLastPercent = 0;
+    bool fOk = true;
+    {
+        // Declared after what its jobs refer to, so it is destroyed first
+        CWorkPool pool(TASK_VALIDATION);
+
+        // Scan a few files ahead of the one being connected
+        unsigned int nNextScan = 0;
+        for (; nNextScan < vScanned.size() && nNextScan < (unsigned int)nThreads; nNextScan++)
+            pool.Submit(boost::bind(&ScanFile, &pool, &vScanned[nNextScan]));
+
+        uint64_t nBytesBefore = 0;
+        for (unsigned int i = 0; i < vScanned.size() && fOk; i++) {
+            CScannedFile &scanned = vScanned[i];
+            pool.WaitDone(scanned.fDone);
+            if (nNextScan < vScanned.size()) {
+                pool.Submit(boost::bind(&ScanFile, &pool, &vScanned[nNextScan]));
+                nNextScan++;
+            }
+            LogPrintf("Importing blocks from %s (%u records)...\n", scanned.file.path.string(), (unsigned int)scanned.vRecords.size());
+            {
+                LOCK(cs_importProgress);
+                importProgress.strFile = scanned.file.path.filename().string();
+            }
+
+            if (!scanned.region) {
+                // Connect what is queued first, to keep the order
+                fOk = ConnectBlocks(pool, queueBlocks, 0, nLoaded);
+                if (!fOk)
+                    break;
+                FILE *file = fopen(scanned.file.path.string().c_str(), "rb");
+                if (file) {
+                    CDiskBlockPos pos(scanned.file.nFile, 0);
+                    if (LoadExternalBlockFile(file, scanned.file.nFile >= 0 ? &pos : NULL))
+                        nLoaded++;
+                }
+            } else {
+                const char *pchBegin = (const char*)scanned.region->get_address();
+                BOOST_FOREACH(const CImportRecord &record, scanned.vRecords) {
+                    boost::this_thread::interruption_point();
+                    queueBlocks.push_back(CImportedBlock());
+                    CImportedBlock &imported = queueBlocks.back();
+                    imported.raw = CRawBlock(scanned.region, pchBegin + record.nPos, record.nSize);
+                    if (scanned.file.nFile >= 0)
+                        imported.pos = CDiskBlockPos(scanned.file.nFile, record.nPos);
+                    pool.Submit(boost::bind(&CheckRecord, &pool, &imported));
+
+                    fOk = ConnectBlocks(pool, queueBlocks, nMaxQueued, nLoaded);
+                    if (!fOk)
+                        break;
+                    {
+                        LOCK(cs_importProgress);
+                        importProgress.nBytesDone = nBytesBefore + record.nPos;
+                    }
+                    ReportProgress(nLastPercent);
+                }
+                // The queued records keep the mapping alive as long as needed
+                scanned.region.reset();
+                std::vector<CImportRecord>().swap(scanned.vRecords);
+            }
+            nBytesBefore += scanned.nFileSize;
+            {
+                LOCK(cs_importProgress);
+                importProgress.nFilesDone = i + 1;
+            }
+        }
+        if (fOk)
+            fOk = ConnectBlocks(pool, queueBlocks, 0, nLoaded);
+    }
+
+    {
+        LOCK(cs_importProgress);
+        importProgress.fActive = false;
+        importProgress.nBytesDone = nBytes;
+    }
+    uiInterface.ShowProgress("", 100);
+    if (nLoaded > 0)
+        LogPrintf("Loaded %i blocks from %u files in %dms\n", nLoaded, (unsigned int)vFiles.size(), GetTimeMillis() - nStart);
+    return nLoaded > 0;
+}
+
+CImportProgress GetImportProgress()
+{
+    LOCK(cs_importProgress);
+    return importProgress;
+}
@@ -0,0 +1,51 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKIMPORT_H
+#define BITCOIN_BLOCKIMPORT_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+/** A file to import blocks from */
+struct CImportFile
+{
+    boost::filesystem::path path;
+    int nFile; // number of the block file being reindexed, or -1 for other files
+
+    CImportFile(const boost::filesystem::path &pathIn, int nFileIn = -1) : path(pathIn), nFile(nFileIn) {}
+};
+
+/** Progress of the last block import (-reindex, bootstrap.dat or -loadblock) */
+struct CImportProgress
+{
+    bool fActive;
+    std::string strFile;     // file whose blocks are being connected
+    unsigned int nFiles;
+    unsigned int nFilesDone;
+    uint64_t nBytes;         // total size of the files
+    uint64_t nBytesDone;     // size of what has been connected
+    uint64_t nBlocksLoaded;  // blocks accepted by ProcessBlock
+    uint64_t nBlocksInvalid; // records that were no valid block
+    int64_t nStartTime;
+
+    CImportProgress() : fActive(false), nFiles(0), nFilesDone(0), nBytes(0), nBytesDone(0), nBlocksLoaded(0), nBlocksInvalid(0), nStartTime(0) {}
+};
+
+/** Import the blocks from a list of files, in order.
+ *
+ *  The import is pipelined: files are memory-mapped and scanned for block
+ *  records ahead of time, the blocks are deserialized and checked
+ *  (CheckBlock, which includes the proof of work) by a pool of threads,
+ *  and a single stage hands them to ProcessBlock in the order they are
+ *  stored. Files that cannot be mapped are loaded with
+ *  LoadExternalBlockFile instead. Returns whether any block was loaded.
+ */
+bool ImportBlockFiles(const std::vector<CImportFile> &vFiles);
+
+CImportProgress GetImportProgress();
+
+#endif // BITCOIN_BLOCKIMPORT_H
@@ -0,0 +1,55 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockprofile.h"
+
+#include "sync.h"
+
+using namespace std;
+
+static CCriticalSection cs_blockprofile;
+// Written in order from nBlockProfileNext, wrapping around once full
+static vector<CBlockProfile> vBlockProfiles;
+static size_t nBlockProfileNext = 0;
+static bool fBlockProfileFull = false;
+
+void SetBlockProfileSize(unsigned int nEntries)
+{
+    LOCK(cs_blockprofile);
+    vector<CBlockProfile>(nEntries).swap(vBlockProfiles);
+    nBlockProfileNext = 0;
+    fBlockProfileFull = false;
+}
+
+bool IsBlockProfileEnabled()
+{
+    LOCK(cs_blockprofile);
+    return !vBlockProfiles.empty();
+}
+
+void RecordBlockProfile(const CBlockProfile& profile)
+{
+    LOCK(cs_blockprofile);
+    if (vBlockProfiles.empty())
+        return;
+    vBlockProfiles[nBlockProfileNext] = profile;
+    if (++nBlockProfileNext == vBlockProfiles.size()) {
+        nBlockProfileNext = 0;
+        fBlockProfileFull = true;
+    }
+}
+
+vector<CBlockProfile> GetBlockProfiles(const uint256& hash)
+{
+    vector<CBlockProfile> vRet;
+    LOCK(cs_blockprofile);
+    size_t nEntries = fBlockProfileFull ? vBlockProfiles.size() : nBlockProfileNext;
+    size_t nFirst = fBlockProfileFull ? nBlockProfileNext : 0;
+    for (size_t i = 0; i < nEntries; i++) {
+        const CBlockProfile& profile = vBlockProfiles[(nFirst + i) % vBlockProfiles.size()];
+        if (hash == 0 || profile.hash == hash)
+            vRet.push_back(profile);
+    }
+    return vRet;
+}
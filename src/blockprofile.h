@@ -0,0 +1,46 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKPROFILE_H
+#define BITCOIN_BLOCKPROFILE_H
+
+#include "main.h"
+#include "uint256.h"
+
+#include <stdint.h>
+#include <vector>
+
+/** Default number of blocks whose connection profile is kept */
+static const unsigned int DEFAULT_BLOCK_PROFILES = 1000;
+
+/** Where the time went connecting one block to the tip, in microseconds.
+ *  ConnectTip keeps the last -blockprofiles of them in a ring buffer,
+ *  returned by getblockprofile. */
+struct CBlockProfile
+{
+    uint256 hash;
+    int nHeight;
+    int64_t nTime;          // when it was connected
+    unsigned int nTx;
+    unsigned int nInputs;
+    unsigned int nSize;
+    int64_t nRead;          // reading and deserializing it from disk
+    CBlockConnectTimings timings;
+    int64_t nChainState;    // writing the chain state, when due
+    int64_t nMempool;       // removing its transactions and their conflicts from the mempool
+    int64_t nWallet;        // queuing the wallet notifications
+    int64_t nTotal;         // all of ConnectTip
+
+    CBlockProfile() : nHeight(0), nTime(0), nTx(0), nInputs(0), nSize(0), nRead(0), nChainState(0), nMempool(0), nWallet(0), nTotal(0) {}
+};
+
+// Size the ring buffer to nEntries blocks, 0 to disable it; clears it
+void SetBlockProfileSize(unsigned int nEntries);
+bool IsBlockProfileEnabled();
+void RecordBlockProfile(const CBlockProfile& profile);
+// The buffered profiles oldest first, only those of one block unless hash
+// is 0
+std::vector<CBlockProfile> GetBlockProfiles(const uint256& hash);
+
+#endif // BITCOIN_BLOCKPROFILE_H
@@ -0,0 +1,445 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include "bitcoin-config.h"
+#endif
+
+#include "blockstore.h"
+
+#include "chainparams.h"
+#include "core.h"
+#include "main.h"
+#include "util.h"
+
+#include <string.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+using namespace boost::interprocess;
+
+// The first byte of a compressed record names its format
+static const unsigned char DISK_RECORD_ZSTD = 1;
+
+bool CanCompressDiskRecords()
+{
+#ifdef USE_ZSTD
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool CompressDiskRecord(const char *pch, size_t nSize, int nLevel, std::vector<char> &vchOut)
+{
+#ifdef USE_ZSTD
+    if (nLevel <= 0)
+        return false;
+    vchOut.resize(1 + ZSTD_compressBound(nSize));
+    vchOut[0] = DISK_RECORD_ZSTD;
+    size_t nOut = ZSTD_compress(&vchOut[1], vchOut.size() - 1, pch, nSize, nLevel);
+    if (ZSTD_isError(nOut) || 1 + nOut >= nSize) {
+        vchOut.clear();
+        return false;
+    }
+    vchOut.resize(1 + nOut);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool DecompressDiskRecord(const char *pch, size_t nSize, std::vector<char> &vchOut)
+{
+    if (nSize == 0 || (unsigned char)pch[0] != DISK_RECORD_ZSTD)
+        return error("DecompressDiskRecord() : unknown record format");
+#ifdef USE_ZSTD
+    unsigned long long nContentSize = ZSTD_getFrameContentSize(pch + 1, nSize - 1);
+    if (nContentSize == ZSTD_CONTENTSIZE_UNKNOWN || nContentSize == ZSTD_CONTENTSIZE_ERROR || nContentSize > MAX_SIZE)
+        return error("DecompressDiskRecord() : invalid record");
+    vchOut.resize(nContentSize);
+    size_t nOut = ZSTD_decompress(vchOut.empty() ? NULL : &vchOut[0], vchOut.size(), pch + 1, nSize - 1);
+    if (ZSTD_isError(nOut))
+        return error("DecompressDiskRecord() : %s", ZSTD_getErrorName(nOut));
+    if (nOut != nContentSize)
+        return error("DecompressDiskRecord() : truncated record");
+    return true;
+#else
+    return error("DecompressDiskRecord() : compressed block files need a build with zstd support");
+#endif
+}
+
+bool WriteDiskRecord(CAutoFile &fileout, const CDiskRecord &record, unsigned int &nPos)
+{
+    fileout << FLATDATA(Params().MessageStart()) << record.nSizeField;
+    long fileOutPos = ftell(fileout);
+    if (fileOutPos < 0)
+        return error("WriteDiskRecord() : ftell failed");
+    nPos = (unsigned int)fileOutPos;
+    if (!record.vch.empty())
+        fileout.write(&record.vch[0], record.vch.size());
+    return true;
+}
+
+bool ReadDiskRecord(FILE *file, unsigned int nMaxSize, std::vector<char> &vchOut)
+{
+    char header[MESSAGE_START_SIZE + 4];
+    if (fread(header, 1, sizeof(header), file) != sizeof(header))
+        return error("ReadDiskRecord() : failed to read the record header");
+    if (memcmp(header, Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+        return error("ReadDiskRecord() : no record header");
+    unsigned int nSize;
+    memcpy(&nSize, header + MESSAGE_START_SIZE, sizeof(nSize));
+    bool fCompressed = (nSize & DISK_RECORD_COMPRESSED) != 0;
+    nSize &= ~DISK_RECORD_COMPRESSED;
+    if (nSize > nMaxSize)
+        return error("ReadDiskRecord() : invalid record size %u", nSize);
+
+    std::vector<char> vch(nSize);
+    if (nSize > 0 && fread(&vch[0], 1, nSize, file) != nSize)
+        return error("ReadDiskRecord() : truncated record");
+    if (!fCompressed) {
+        vchOut.swap(vch);
+        return true;
+    }
+    if (!DecompressDiskRecord(vch.empty() ? NULL : &vch[0], vch.size(), vchOut))
+        return false;
+    if (vchOut.size() > nMaxSize)
+        return error("ReadDiskRecord() : invalid record size %u", (unsigned int)vchOut.size());
+    return true;
+}
+
+void CBlockFileMapper::SetMaxFiles(unsigned int nMaxFilesIn)
+{
+    LOCK(cs);
+    nMaxFiles = nMaxFilesIn;
+    while (listLRU.size() > nMaxFiles) {
+        mapFiles.erase(listLRU.back());
+        listLRU.pop_back();
+    }
+}
+
+bool CBlockFileMapper::IsEnabled()
+{
+    LOCK(cs);
+    return nMaxFiles > 0;
+}
+
+boost::shared_ptr<mapped_region> CBlockFileMapper::Map(int nFile, unsigned int nMinSize)
+{
+    LOCK(cs);
+    std::map<int, CMappedFile>::iterator it = mapFiles.find(nFile);
+    if (it != mapFiles.end()) {
+        listLRU.splice(listLRU.begin(), listLRU, it->second.itLRU);
+        if (it->second.region->get_size() >= nMinSize)
+            return it->second.region;
+        // The file has grown since it was mapped.
+        listLRU.erase(it->second.itLRU);
+        mapFiles.erase(it);
+    }
+    if (nMaxFiles == 0)
+        return boost::shared_ptr<mapped_region>();
+
+    boost::filesystem::path path = GetDataDir() / "blocks" / strprintf("blk%05u.dat", nFile);
+    boost::shared_ptr<mapped_region> region;
+    try {
+        if (!boost::filesystem::exists(path) || boost::filesystem::file_size(path) < nMinSize)
+            return region;
+        file_mapping mapping(path.string().c_str(), read_only);
+        region.reset(new mapped_region(mapping, read_only));
+    } catch (std::exception &e) {
+        LogPrintf("Unable to map %s: %s\n", path.string(), e.what());
+        return boost::shared_ptr<mapped_region>();
+    }
+
+    listLRU.push_front(nFile);
+    CMappedFile &file = mapFiles[nFile];
+    file.region = region;
+    file.itLRU = listLRU.begin();
+    while (listLRU.size() > nMaxFiles) {
+        mapFiles.erase(listLRU.back());
+        listLRU.pop_back();
+    }
+    return region;
+}
+
+bool CBlockFileMapper::Read(const CDiskBlockPos &pos, CRawBlock &raw)
+{
+    // A block is preceded by the network magic and its size.
+    if (pos.IsNull() || pos.nPos < 8)
+        return false;
+    boost::shared_ptr<mapped_region> region = Map(pos.nFile, pos.nPos);
+    if (!region)
+        return false;
+
+    const char *pchHeader = (const char*)region->get_address() + pos.nPos - 8;
+    if (memcmp(pchHeader, Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+        return error("CBlockFileMapper::Read() : no block at %d:%u", pos.nFile, pos.nPos);
+    unsigned int nSize;
+    memcpy(&nSize, pchHeader + MESSAGE_START_SIZE, sizeof(nSize));
+    bool fCompressed = (nSize & DISK_RECORD_COMPRESSED) != 0;
+    nSize &= ~DISK_RECORD_COMPRESSED;
+    if ((!fCompressed && nSize < 80) || nSize > MAX_BLOCK_SIZE)
+        return error("CBlockFileMapper::Read() : invalid block size %u at %d:%u", nSize, pos.nFile, pos.nPos);
+
+    if ((uint64_t)pos.nPos + nSize > region->get_size()) {
+        region = Map(pos.nFile, pos.nPos + nSize);
+        if (!region)
+            return false;
+    }
+    const char *pchBlock = (const char*)region->get_address() + pos.nPos;
+    if (fCompressed) {
+        // The mapping is not needed past decompressing the block
+        boost::shared_ptr<std::vector<char> > pvch(new std::vector<char>());
+        if (!DecompressDiskRecord(pchBlock, nSize, *pvch) || pvch->size() < 80 || pvch->size() > MAX_BLOCK_SIZE)
+            return error("CBlockFileMapper::Read() : invalid compressed block at %d:%u", pos.nFile, pos.nPos);
+        raw = CRawBlock(pvch, &(*pvch)[0], pvch->size());
+        return true;
+    }
+    raw = CRawBlock(region, pchBlock, nSize);
+    return true;
+}
+
+void CBlockFileMapper::Invalidate(int nFile)
+{
+    LOCK(cs);
+    std::map<int, CMappedFile>::iterator it = mapFiles.find(nFile);
+    if (it == mapFiles.end())
+        return;
+    listLRU.erase(it->second.itLRU);
+    mapFiles.erase(it);
+}
+
+void CBlockCache::Trim()
+{
+    while (nUsage > nMaxUsage && !listLRU.empty()) {
+        std::map<uint256, CCachedBlock>::iterator it = mapBlocks.find(listLRU.back());
+        nUsage -= it->second.nUsage;
+        mapBlocks.erase(it);
+        listLRU.pop_back();
+    }
+}
+
+void CBlockCache::SetMaxUsage(size_t nMaxUsageIn)
+{
+    LOCK(cs);
+    nMaxUsage = nMaxUsageIn;
+    Trim();
+}
+
+void CBlockCache::Add(const CBlock &block)
+{
+    uint256 hash = block.GetHash();
+    {
+        LOCK(cs);
+        if (nMaxUsage == 0)
+            return;
+        std::map<uint256, CCachedBlock>::iterator it = mapBlocks.find(hash);
+        if (it != mapBlocks.end()) {
+            listLRU.splice(listLRU.begin(), listLRU, it->second.itLRU);
+            return;
+        }
+    }
+
+    // Serialize outside the lock
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << block;
+    CCachedBlock entry;
+    entry.block.reset(new CBlock(block));
+    entry.raw.reset(new std::vector<char>(ssBlock.begin(), ssBlock.end()));
+    std::vector<uint256> *pvTxid = new std::vector<uint256>();
+    entry.txids.reset(pvTxid);
+    pvTxid->reserve(block.vtx.size());
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        pvTxid->push_back(block.vtx[i].GetHash());
+    // The serialized copy, plus the deserialized block at about twice that
+    entry.nUsage = 3 * ssBlock.size() + pvTxid->size() * sizeof(uint256);
+
+    LOCK(cs);
+    if (mapBlocks.count(hash))
+        return;
+    listLRU.push_front(hash);
+    entry.itLRU = listLRU.begin();
+    mapBlocks[hash] = entry;
+    nUsage += entry.nUsage;
+    Trim();
+}
+
+bool CBlockCache::Get(const uint256 &hash, CBlock &block)
+{
+    boost::shared_ptr<const CBlock> pblock;
+    {
+        LOCK(cs);
+        std::map<uint256, CCachedBlock>::iterator it = mapBlocks.find(hash);
+        if (it == mapBlocks.end())
+            return false;
+        listLRU.splice(listLRU.begin(), listLRU, it->second.itLRU);
+        pblock = it->second.block;
+    }
+    block = *pblock;
+    return true;
+}
+
+bool CBlockCache::GetRaw(const uint256 &hash, CRawBlock &raw)
+{
+    LOCK(cs);
+    std::map<uint256, CCachedBlock>::iterator it = mapBlocks.find(hash);
+    if (it == mapBlocks.end())
+        return false;
+    listLRU.splice(listLRU.begin(), listLRU, it->second.itLRU);
+    const boost::shared_ptr<const std::vector<char> > &vch = it->second.raw;
+    raw = CRawBlock(vch, &(*vch)[0], vch->size());
+    return true;
+}
+
+bool CBlockCache::GetTxids(const uint256 &hash, std::vector<uint256> &vTxid)
+{
+    boost::shared_ptr<const std::vector<uint256> > ptxids;
+    {
+        LOCK(cs);
+        std::map<uint256, CCachedBlock>::iterator it = mapBlocks.find(hash);
+        if (it == mapBlocks.end())
+            return false;
+        listLRU.splice(listLRU.begin(), listLRU, it->second.itLRU);
+        ptxids = it->second.txids;
+    }
+    vTxid = *ptxids;
+    return true;
+}
+
+size_t CBlockCache::GetUsage()
+{
+    LOCK(cs);
+    return nUsage;
+}
+
+unsigned int CBlockCache::GetCount()
+{
+    LOCK(cs);
+    return mapBlocks.size();
+}
+
+void CTxCache::Trim()
+{
+    while (nUsage > nMaxUsage && !listLRU.empty()) {
+        std::map<uint256, CCachedTx>::iterator it = mapTxs.find(listLRU.back());
+        nUsage -= it->second.nUsage;
+        mapTxs.erase(it);
+        listLRU.pop_back();
+    }
+}
+
+void CTxCache::SetMaxUsage(size_t nMaxUsageIn)
+{
+    LOCK(cs);
+    nMaxUsage = nMaxUsageIn;
+    Trim();
+}
+
+void CTxCache::Add(const uint256 &hash, const CTransaction &tx, const uint256 &hashBlock)
+{
+    CCachedTx entry;
+    entry.tx.reset(new CTransaction(tx));
+    entry.hashBlock = hashBlock;
+    // The deserialized transaction at about twice its serialized size
+    entry.nUsage = 2 * ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION) + sizeof(CCachedTx) + 2 * sizeof(uint256);
+
+    LOCK(cs);
+    if (nMaxUsage == 0)
+        return;
+    std::map<uint256, CCachedTx>::iterator it = mapTxs.find(hash);
+    if (it != mapTxs.end()) {
+        listLRU.splice(listLRU.begin(), listLRU, it->second.itLRU);
+        it->second.hashBlock = hashBlock;
+        return;
+    }
+    listLRU.push_front(hash);
+    entry.itLRU = listLRU.begin();
+    mapTxs[hash] = entry;
+    nUsage += entry.nUsage;
+    Trim();
+}
+
+bool CTxCache::Get(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
+{
+    boost::shared_ptr<const CTransaction> ptx;
+    {
+        LOCK(cs);
+        std::map<uint256, CCachedTx>::iterator it = mapTxs.find(hash);
+        if (it == mapTxs.end())
+            return false;
+        listLRU.splice(listLRU.begin(), listLRU, it->second.itLRU);
+        ptx = it->second.tx;
+        hashBlock = it->second.hashBlock;
+    }
+    tx = *ptx;
+    return true;
+}
+
+void CTxCache::Clear()
+{
+    LOCK(cs);
+    mapTxs.clear();
+    listLRU.clear();
+    nUsage = 0;
+}
+
+void CTxidCache::Trim()
+{
+    while (nUsage > nMaxUsage && !listLRU.empty()) {
+        std::map<uint256, CCachedTxids>::iterator it = mapBlocks.find(listLRU.back());
+        nUsage -= it->second.nUsage;
+        mapBlocks.erase(it);
+        listLRU.pop_back();
+    }
+}
+
+void CTxidCache::SetMaxUsage(size_t nMaxUsageIn)
+{
+    LOCK(cs);
+    nMaxUsage = nMaxUsageIn;
+    Trim();
+}
+
+void CTxidCache::Add(const uint256 &hashBlock, const std::vector<uint256> &vTxid)
+{
+    CCachedTxids entry;
+    entry.txids.reset(new std::vector<uint256>(vTxid));
+    entry.nUsage = vTxid.size() * sizeof(uint256) + sizeof(CCachedTxids) + 2 * sizeof(uint256);
+
+    LOCK(cs);
+    if (nMaxUsage == 0)
+        return;
+    std::map<uint256, CCachedTxids>::iterator it = mapBlocks.find(hashBlock);
+    if (it != mapBlocks.end()) {
+        listLRU.splice(listLRU.begin(), listLRU, it->second.itLRU);
+        return;
+    }
+    listLRU.push_front(hashBlock);
+    entry.itLRU = listLRU.begin();
+    mapBlocks[hashBlock] = entry;
+    nUsage += entry.nUsage;
+    Trim();
+}
+
+bool CTxidCache::Get(const uint256 &hashBlock, std::vector<uint256> &vTxid)
+{
+    boost::shared_ptr<const std::vector<uint256> > ptxids;
+    {
+        LOCK(cs);
+        std::map<uint256, CCachedTxids>::iterator it = mapBlocks.find(hashBlock);
+        if (it == mapBlocks.end())
+            return false;
+        listLRU.splice(listLRU.begin(), listLRU, it->second.itLRU);
+        ptxids = it->second.txids;
+    }
+    vTxid = *ptxids;
+    return true;
+}
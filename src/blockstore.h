@@ -0,0 +1,264 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKSTORE_H
+#define BITCOIN_BLOCKSTORE_H
+
+#include "serialize.h"
+#include "sync.h"
+#include "uint256.h"
+#include "version.h"
+
+#include <algorithm>
+#include <ios>
+#include <list>
+#include <map>
+#include <vector>
+
+#include <string.h>
+
+#include <boost/shared_ptr.hpp>
+
+namespace boost { namespace interprocess { class mapped_region; } }
+
+class CBlock;
+class CDiskBlockPos;
+class CTransaction;
+
+// -blockmapfiles default: number of block files kept mapped
+static const unsigned int DEFAULT_BLOCK_MAP_FILES = sizeof(void*) > 4 ? 64 : 4;
+// -blockcachemb default: memory for recently connected blocks (MiB)
+static const unsigned int DEFAULT_BLOCK_CACHE_MB = 16;
+// -txcachemb default: memory for recently looked up transactions (MiB)
+static const unsigned int DEFAULT_TX_CACHE_MB = 4;
+// -txidcachemb default: memory for the txids of blocks asked for proofs (MiB)
+static const unsigned int DEFAULT_TXID_CACHE_MB = 2;
+// -blockcompression default: zstd level of new block and undo records (0: off)
+static const int DEFAULT_BLOCK_COMPRESSION = 0;
+// Highest -blockcompression level
+static const int MAX_BLOCK_COMPRESSION = 19;
+
+// Set in the size field of the file header of a block or undo record that
+// is stored compressed
+static const unsigned int DISK_RECORD_COMPRESSED = 0x80000000;
+
+// Whether this build can compress records, and read compressed ones
+bool CanCompressDiskRecords();
+// Compress a serialized record at nLevel; false if that does not make it smaller
+bool CompressDiskRecord(const char *pch, size_t nSize, int nLevel, std::vector<char> &vchOut);
+// Get the serialization of a record back from its compressed form
+bool DecompressDiskRecord(const char *pch, size_t nSize, std::vector<char> &vchOut);
+
+/** A block or undo record serialized for the block files: the bytes
+ *  following its file header, compressed if nLevel is set and that makes
+ *  them smaller, and the size field of the header. */
+class CDiskRecord
+{
+public:
+    std::vector<char> vch;
+    unsigned int nSizeField;
+
+    CDiskRecord(const char *pch, size_t nSize, int nLevel) { Set(pch, nSize, nLevel); }
+
+    template<typename T>
+    CDiskRecord(const T &obj, int nLevel)
+    {
+        CPlainDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << obj;
+        Set(ss.empty() ? NULL : &ss[0], ss.size(), nLevel);
+    }
+
+    // Bytes taken in the file, including the header
+    unsigned int GetDiskSize() const { return 8 + vch.size(); }
+
+private:
+    void Set(const char *pch, size_t nSize, int nLevel)
+    {
+        if (CompressDiskRecord(pch, nSize, nLevel, vch)) {
+            nSizeField = vch.size() | DISK_RECORD_COMPRESSED;
+        } else {
+            vch.assign(pch, pch + nSize);
+            nSizeField = nSize;
+        }
+    }
+};
+
+// Append a record with its file header, and set nPos to where the record starts
+bool WriteDiskRecord(CAutoFile &fileout, const CDiskRecord &record, unsigned int &nPos);
+// Read the record whose file header is at the current position of file,
+// and return its serialization
+bool ReadDiskRecord(FILE *file, unsigned int nMaxSize, std::vector<char> &vchOut);
+
+/** The serialized bytes of a block. Refers into a memory mapping of its
+ *  block file, into the block cache or to a decompressed copy, and keeps
+ *  that memory alive while it exists. */
+class CRawBlock
+{
+private:
+    boost::shared_ptr<const void> owner;
+    const char *pch;
+    unsigned int nSize;
+
+public:
+    CRawBlock() : pch(NULL), nSize(0) {}
+    CRawBlock(const boost::shared_ptr<const void> &ownerIn, const char *pchIn, unsigned int nSizeIn) :
+        owner(ownerIn), pch(pchIn), nSize(nSizeIn) {}
+
+    const char *begin() const { return pch; }
+    const char *end() const { return pch + nSize; }
+    unsigned int size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+};
+
+/** Deserializes objects straight from the bytes of a CRawBlock, such as one
+ *  transaction of a block, without copying the rest of the block */
+class CRawBlockReader : public CSpanReader
+{
+public:
+    CRawBlockReader(const CRawBlock &raw, unsigned int nOffset, int nTypeIn, int nVersionIn) :
+        CSpanReader(raw.begin() + std::min(nOffset, raw.size()), raw.end(), nTypeIn, nVersionIn) {}
+};
+
+/** Read-only access to the block files (blk?????.dat) through memory
+ *  mappings, instead of opening, seeking and reading a file per block.
+ *
+ *  The most recently used files stay mapped; a file that has grown since
+ *  it was mapped is mapped again. Mappings still referenced by a CRawBlock
+ *  outlive their eviction.
+ */
+class CBlockFileMapper
+{
+private:
+    struct CMappedFile
+    {
+        boost::shared_ptr<boost::interprocess::mapped_region> region;
+        std::list<int>::iterator itLRU;
+    };
+
+    CCriticalSection cs;
+    std::map<int, CMappedFile> mapFiles;
+    std::list<int> listLRU; // most recently used first
+    unsigned int nMaxFiles; // 0 disables the mappings
+
+    boost::shared_ptr<boost::interprocess::mapped_region> Map(int nFile, unsigned int nMinSize);
+
+public:
+    CBlockFileMapper(unsigned int nMaxFilesIn = DEFAULT_BLOCK_MAP_FILES) : nMaxFiles(nMaxFilesIn) {}
+
+    void SetMaxFiles(unsigned int nMaxFilesIn);
+    bool IsEnabled();
+
+    // Get the block stored at pos, checking its block file header
+    bool Read(const CDiskBlockPos &pos, CRawBlock &raw);
+
+    // Drop the mapping of a file, before it is truncated
+    void Invalidate(int nFile);
+};
+
+/** The most recently connected blocks, kept both deserialized and
+ *  serialized, so reorganizations, peers asking for new blocks, RPC and
+ *  wallets need no disk reads for them. Least recently used blocks are
+ *  dropped once the cache uses more than its maximum size.
+ */
+class CBlockCache
+{
+private:
+    struct CCachedBlock
+    {
+        boost::shared_ptr<const CBlock> block;
+        boost::shared_ptr<const std::vector<char> > raw;
+        boost::shared_ptr<const std::vector<uint256> > txids;
+        size_t nUsage;
+        std::list<uint256>::iterator itLRU;
+    };
+
+    CCriticalSection cs;
+    std::map<uint256, CCachedBlock> mapBlocks;
+    std::list<uint256> listLRU; // most recently used first
+    size_t nUsage;
+    size_t nMaxUsage;
+
+    void Trim();
+
+public:
+    CBlockCache(size_t nMaxUsageIn = DEFAULT_BLOCK_CACHE_MB << 20) : nUsage(0), nMaxUsage(nMaxUsageIn) {}
+
+    void SetMaxUsage(size_t nMaxUsageIn);
+
+    void Add(const CBlock &block);
+    bool Get(const uint256 &hash, CBlock &block);
+    bool GetRaw(const uint256 &hash, CRawBlock &raw);
+    // The txids of the block's transactions, hashed when it was added
+    bool GetTxids(const uint256 &hash, std::vector<uint256> &vTxid);
+
+    size_t GetUsage();
+    unsigned int GetCount();
+};
+
+/** Confirmed transactions recently looked up by GetTransaction, with the
+ *  hash of their block, so that indexers fetching the same transactions
+ *  again need no disk reads. Cleared when a block is disconnected, as its
+ *  transactions may end up in another block.
+ */
+class CTxCache
+{
+private:
+    struct CCachedTx
+    {
+        boost::shared_ptr<const CTransaction> tx;
+        uint256 hashBlock;
+        size_t nUsage;
+        std::list<uint256>::iterator itLRU;
+    };
+
+    CCriticalSection cs;
+    std::map<uint256, CCachedTx> mapTxs;
+    std::list<uint256> listLRU; // most recently used first
+    size_t nUsage;
+    size_t nMaxUsage;
+
+    void Trim();
+
+public:
+    CTxCache(size_t nMaxUsageIn = DEFAULT_TX_CACHE_MB << 20) : nUsage(0), nMaxUsage(nMaxUsageIn) {}
+
+    void SetMaxUsage(size_t nMaxUsageIn);
+
+    void Add(const uint256 &hash, const CTransaction &tx, const uint256 &hashBlock);
+    bool Get(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
+    void Clear();
+};
+
+/** The txids of blocks that merkle proofs were recently built for, by block
+ *  hash, so that further proofs from the same blocks need neither a read nor
+ *  the hashing of their transactions. A block's txids never change, so
+ *  entries stay valid across reorganizations.
+ */
+class CTxidCache
+{
+private:
+    struct CCachedTxids
+    {
+        boost::shared_ptr<const std::vector<uint256> > txids;
+        size_t nUsage;
+        std::list<uint256>::iterator itLRU;
+    };
+
+    CCriticalSection cs;
+    std::map<uint256, CCachedTxids> mapBlocks;
+    std::list<uint256> listLRU; // most recently used first
+    size_t nUsage;
+    size_t nMaxUsage;
+
+    void Trim();
+
+public:
+    CTxidCache(size_t nMaxUsageIn = DEFAULT_TXID_CACHE_MB << 20) : nUsage(0), nMaxUsage(nMaxUsageIn) {}
+
+    void SetMaxUsage(size_t nMaxUsageIn);
+
+    void Add(const uint256 &hashBlock, const std::vector<uint256> &vTxid);
+    bool Get(const uint256 &hashBlock, std::vector<uint256> &vTxid);
+};
+
+#endif // BITCOIN_BLOCKSTORE_H
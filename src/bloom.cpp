@@ -5,8 +5,11 @@
 #include "bloom.h"
 
 #include "core.h"
+#include "hash.h"
 #include "script.h"
+#include "util.h"
 
+#include <limits>
 #include <math.h>
 #include <stdlib.h>
 
@@ -31,25 +34,41 @@ nFlags(nFlagsIn)
 {
 }
 
-inline unsigned int CBloomFilter::Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const
+// 0xFBA4C795 chosen as it guarantees a reasonable bit difference between nHashNum values.
+static const uint32_t BLOOM_SEED_STEP = 0xFBA4C795;
+
+inline unsigned int CBloomFilter::Hash(unsigned int nHashNum, const CMurmurHash3Input& key) const
 {
-    // 0xFBA4C795 chosen as it guarantees a reasonable bit difference between nHashNum values.
-    return MurmurHash3(nHashNum * 0xFBA4C795 + nTweak, vDataToHash) % (vData.size() * 8);
+    return key.Hash(nHashNum * BLOOM_SEED_STEP + nTweak) % (vData.size() * 8);
 }
 
-void CBloomFilter::insert(const vector<unsigned char>& vKey)
+void CBloomFilter::insert(const CMurmurHash3Input& key)
 {
     if (isFull)
         return;
-    for (unsigned int i = 0; i < nHashFuncs; i++)
+    // All of them are needed, so they are computed together
+    uint32_t vHashes[MAX_HASH_FUNCS];
+    unsigned int nDone = 0;
+    while (nDone < nHashFuncs)
     {
-        unsigned int nIndex = Hash(i, vKey);
-        // Sets bit nIndex of vData
-        vData[nIndex >> 3] |= (1 << (7 & nIndex));
+        unsigned int nCount = min(nHashFuncs - nDone, MAX_HASH_FUNCS);
+        key.HashMany(nDone * BLOOM_SEED_STEP + nTweak, BLOOM_SEED_STEP, nCount, vHashes);
+        for (unsigned int i = 0; i < nCount; i++)
+        {
+            unsigned int nIndex = vHashes[i] % (vData.size() * 8);
+            // Sets bit nIndex of vData
+            vData[nIndex >> 3] |= (1 << (7 & nIndex));
+        }
+        nDone += nCount;
     }
     isEmpty = false;
 }
 
+void CBloomFilter::insert(const vector<unsigned char>& vKey)
+{
+    insert(CMurmurHash3Input(vKey));
+}
+
 void CBloomFilter::insert(const COutPoint& outpoint)
 {
     CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
@@ -64,15 +83,16 @@ void CBloomFilter::insert(const uint256& hash)
     insert(data);
 }
 
-bool CBloomFilter::contains(const vector<unsigned char>& vKey) const
+bool CBloomFilter::contains(const CMurmurHash3Input& key) const
 {
     if (isFull)
         return true;
     if (isEmpty)
         return false;
+    // Most lookups miss after a hash or two, so they are computed one by one
     for (unsigned int i = 0; i < nHashFuncs; i++)
     {
-        unsigned int nIndex = Hash(i, vKey);
+        unsigned int nIndex = Hash(i, key);
         // Checks bit nIndex of vData
         if (!(vData[nIndex >> 3] & (1 << (7 & nIndex))))
             return false;
@@ -80,6 +100,11 @@ bool CBloomFilter::contains(const vector<unsigned char>& vKey) const
     return true;
 }
 
+bool CBloomFilter::contains(const vector<unsigned char>& vKey) const
+{
+    return contains(CMurmurHash3Input(vKey));
+}
+
 bool CBloomFilter::contains(const COutPoint& outpoint) const
 {
     CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
@@ -99,7 +124,59 @@ bool CBloomFilter::IsWithinSizeConstraints() const
     return vData.size() <= MAX_BLOOM_FILTER_SIZE && nHashFuncs <= MAX_HASH_FUNCS;
 }
 
+// The data pushes of a script, up to where it stops parsing
+static void GetScriptPushes(const CScript& script, vector<CMurmurHash3Input>& vPushes)
+{
+    CScript::const_iterator pc = script.begin();
+    vector<unsigned char> data;
+    while (pc < script.end())
+    {
+        opcodetype opcode;
+        if (!script.GetOp(pc, opcode, data))
+            break;
+        if (data.size() != 0)
+            vPushes.push_back(CMurmurHash3Input(data));
+    }
+}
+
+static CMurmurHash3Input GetOutPointKey(const COutPoint& outpoint)
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << outpoint;
+    return CMurmurHash3Input(vector<unsigned char>(stream.begin(), stream.end()));
+}
+
+CBloomTxElements::CBloomTxElements(const CTransaction& tx, const uint256& hashIn) :
+    hash(hashIn), txid(vector<unsigned char>(hashIn.begin(), hashIn.end())),
+    vOutputPushes(tx.vout.size()), vOutputPubKey(tx.vout.size(), false), vInputPushes(tx.vin.size())
+{
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        GetScriptPushes(tx.vout[i].scriptPubKey, vOutputPushes[i]);
+        txnouttype type;
+        vector<vector<unsigned char> > vSolutions;
+        vOutputPubKey[i] = Solver(tx.vout[i].scriptPubKey, type, vSolutions) &&
+                           (type == TX_PUBKEY || type == TX_MULTISIG);
+    }
+
+    vPrevouts.reserve(tx.vin.size());
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    {
+        vPrevouts.push_back(GetOutPointKey(tx.vin[i].prevout));
+        GetScriptPushes(tx.vin[i].scriptSig, vInputPushes[i]);
+    }
+}
+
 bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx, const uint256& hash)
+{
+    if (isFull)
+        return true;
+    if (isEmpty)
+        return false;
+    return IsRelevantAndUpdate(CBloomTxElements(tx, hash));
+}
+
+bool CBloomFilter::IsRelevantAndUpdate(const CBloomTxElements& elements)
 {
     bool fFound = false;
     // Match if the filter contains the hash of tx
@@ -108,36 +185,24 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx, const uint256& ha
         return true;
     if (isEmpty)
         return false;
-    if (contains(hash))
+    if (contains(elements.txid))
         fFound = true;
 
-    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    for (unsigned int i = 0; i < elements.vOutputPushes.size(); i++)
     {
-        const CTxOut& txout = tx.vout[i];
         // Match if the filter contains any arbitrary script data element in any scriptPubKey in tx
         // If this matches, also add the specific output that was matched.
         // This means clients don't have to update the filter themselves when a new relevant tx 
         // is discovered in order to find spending transactions, which avoids round-tripping and race conditions.
-        CScript::const_iterator pc = txout.scriptPubKey.begin();
-        vector<unsigned char> data;
-        while (pc < txout.scriptPubKey.end())
+        BOOST_FOREACH(const CMurmurHash3Input& data, elements.vOutputPushes[i])
         {
-            opcodetype opcode;
-            if (!txout.scriptPubKey.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
+            if (contains(data))
             {
                 fFound = true;
                 if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_ALL)
-                    insert(COutPoint(hash, i));
-                else if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY)
-                {
-                    txnouttype type;
-                    vector<vector<unsigned char> > vSolutions;
-                    if (Solver(txout.scriptPubKey, type, vSolutions) &&
-                            (type == TX_PUBKEY || type == TX_MULTISIG))
-                        insert(COutPoint(hash, i));
-                }
+                    insert(COutPoint(elements.hash, i));
+                else if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY && elements.vOutputPubKey[i])
+                    insert(COutPoint(elements.hash, i));
                 break;
             }
         }
@@ -146,23 +211,16 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx, const uint256& ha
     if (fFound)
         return true;
 
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    for (unsigned int i = 0; i < elements.vPrevouts.size(); i++)
     {
         // Match if the filter contains an outpoint tx spends
-        if (contains(txin.prevout))
+        if (contains(elements.vPrevouts[i]))
             return true;
 
         // Match if the filter contains any arbitrary script data element in any scriptSig in tx
-        CScript::const_iterator pc = txin.scriptSig.begin();
-        vector<unsigned char> data;
-        while (pc < txin.scriptSig.end())
-        {
-            opcodetype opcode;
-            if (!txin.scriptSig.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
+        BOOST_FOREACH(const CMurmurHash3Input& data, elements.vInputPushes[i])
+            if (contains(data))
                 return true;
-        }
     }
 
     return false;
@@ -180,3 +238,79 @@ void CBloomFilter::UpdateEmptyFull()
     isFull = full;
     isEmpty = empty;
 }
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double nFPRate)
+{
+    double dLogFPRate = log(nFPRate);
+    // The optimal number of hash functions for the fp rate, with each one
+    // filling half the bits
+    nHashFuncs = max(1, min((int)(dLogFPRate / log(0.5) + 0.5), (int)MAX_HASH_FUNCS));
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    unsigned int nMaxElements = nEntriesPerGeneration * 3;
+    // For nMaxElements in the filter the fp rate is
+    // (1 - exp(-nHashFuncs * nMaxElements / nFilterBits)) ^ nHashFuncs
+    unsigned int nFilterBits = (unsigned int)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(dLogFPRate / nHashFuncs)));
+    data.resize(((nFilterBits + 63) / 64) << 1);
+    reset();
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration)
+    {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4)
+            nGeneration = 1;
+        uint64_t nGenerationMask1 = -(uint64_t)(nGeneration & 1);
+        uint64_t nGenerationMask2 = -(uint64_t)(nGeneration >> 1);
+        // Wipe the entries of the generation number about to be reused
+        for (unsigned int p = 0; p < data.size(); p += 2)
+        {
+            uint64_t p1 = data[p], p2 = data[p + 1];
+            uint64_t mask = (p1 ^ nGenerationMask1) | (p2 ^ nGenerationMask2);
+            data[p] = p1 & mask;
+            data[p + 1] = p2 & mask;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    // Double hashing: the positions are h1 + n * h2
+    uint64_t h = SipHashUint256(nKey0, nKey1, hash);
+    uint32_t h1 = h & 0xffffffff, h2 = (h >> 32) | 1;
+    for (unsigned int n = 0; n < nHashFuncs; n++)
+    {
+        uint32_t hn = h1 + n * h2;
+        int bit = hn & 0x3f;
+        // The lowest bit of pos is ignored: the even word holds the low bit
+        // of the generation, the odd word the high bit
+        uint32_t pos = (hn >> 6) % data.size();
+        data[pos & ~1] = (data[pos & ~1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration & 1)) << bit;
+        data[pos | 1] = (data[pos | 1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration >> 1)) << bit;
+    }
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    uint64_t h = SipHashUint256(nKey0, nKey1, hash);
+    uint32_t h1 = h & 0xffffffff, h2 = (h >> 32) | 1;
+    for (unsigned int n = 0; n < nHashFuncs; n++)
+    {
+        uint32_t hn = h1 + n * h2;
+        int bit = hn & 0x3f;
+        uint32_t pos = (hn >> 6) % data.size();
+        // Any generation counts
+        if (!(((data[pos & ~1] | data[pos | 1]) >> bit) & 1))
+            return false;
+    }
+    return true;
+}
+
+void CRollingBloomFilter::reset()
+{
+    nKey0 = GetRand(std::numeric_limits<uint64_t>::max());
+    nKey1 = GetRand(std::numeric_limits<uint64_t>::max());
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    std::fill(data.begin(), data.end(), 0);
+}
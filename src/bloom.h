@@ -5,13 +5,16 @@
 #ifndef BITCOIN_BLOOM_H
 #define BITCOIN_BLOOM_H
 
+#include "hash.h"
+#include "memusage.h"
 #include "serialize.h"
+#include "uint256.h"
 
+#include <stdint.h>
 #include <vector>
 
 class COutPoint;
 class CTransaction;
-class uint256;
 
 // 20,000 items with fp rate < 0.1% or 10,000 items and <0.0001%
 static const unsigned int MAX_BLOOM_FILTER_SIZE = 36000; // bytes
@@ -28,6 +31,28 @@ enum bloomflags
     BLOOM_UPDATE_MASK = 3,
 };
 
+/**
+ * The data elements of a transaction that bloom filters match it by: its
+ * hash, the data pushes of its scripts and the outpoints it spends.
+ * Extracted once, they are matched against the filters of any number of
+ * peers.
+ */
+class CBloomTxElements
+{
+public:
+    uint256 hash;
+    CMurmurHash3Input txid;
+    // Per output: the data pushes of its scriptPubKey, and whether it pays
+    // to a pubkey or multisig (for BLOOM_UPDATE_P2PUBKEY_ONLY)
+    std::vector<std::vector<CMurmurHash3Input> > vOutputPushes;
+    std::vector<bool> vOutputPubKey;
+    // Per input: the outpoint it spends and the data pushes of its scriptSig
+    std::vector<CMurmurHash3Input> vPrevouts;
+    std::vector<std::vector<CMurmurHash3Input> > vInputPushes;
+
+    CBloomTxElements(const CTransaction& tx, const uint256& hashIn);
+};
+
 /**
  * BloomFilter is a probabilistic filter which SPV clients provide
  * so that we can filter the transactions we sends them.
@@ -49,7 +74,10 @@ private:
     unsigned int nTweak;
     unsigned char nFlags;
 
-    unsigned int Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const;
+    unsigned int Hash(unsigned int nHashNum, const CMurmurHash3Input& key) const;
+
+    void insert(const CMurmurHash3Input& key);
+    bool contains(const CMurmurHash3Input& key) const;
 
 public:
     // Creates a new bloom filter which will provide the given fp rate when filled with the given number of elements
@@ -84,9 +112,41 @@ public:
 
     // Also adds any outputs which match the filter to the filter (to match their spending txes)
     bool IsRelevantAndUpdate(const CTransaction& tx, const uint256& hash);
+    bool IsRelevantAndUpdate(const CBloomTxElements& elements);
 
     // Checks for empty and full filters to avoid wasting cpu
     void UpdateEmptyFull();
 };
 
+/**
+ * RollingBloomFilter is a probabilistic "keep track of most recently inserted"
+ * set of hashes, used for the inventory each peer is known to have.
+ *
+ * It remembers at least the last nElements inserted (and up to half as many
+ * more), with at most the given false positive rate, in constant memory.
+ * Entries are tagged with one of three generations; starting a new generation
+ * wipes the entries of the oldest.
+ */
+class CRollingBloomFilter
+{
+private:
+    unsigned int nEntriesPerGeneration;
+    unsigned int nEntriesThisGeneration;
+    unsigned int nGeneration;
+    std::vector<uint64_t> data; // two words per 64 positions: the low and high bit of the generation
+    unsigned int nHashFuncs;
+    uint64_t nKey0, nKey1;
+
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const uint256& hash);
+    bool contains(const uint256& hash) const;
+
+    // Forget everything, with new hash keys
+    void reset();
+
+    size_t DynamicMemoryUsage() const { return memusage::DynamicUsage(data); }
+};
+
 #endif /* BITCOIN_BLOOM_H */
@@ -5,16 +5,32 @@
 #ifndef CHECKQUEUE_H
 #define CHECKQUEUE_H
 
+#include "util.h"
+
 #include <algorithm>
+#include <deque>
 #include <vector>
 
 #include <boost/foreach.hpp>
+#include <boost/scoped_array.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
 
 template<typename T> class CCheckQueueControl;
 
+/** Statistics of one round of verifications (from the first Add to the end
+ *  of Wait), for -benchmark */
+struct CCheckQueueStats
+{
+    unsigned int nChecks;  // verifications performed
+    unsigned int nSteals;  // batches taken from another thread's queue
+    int64_t nVerifyMicros; // time spent in verifications, summed over all threads
+    int64_t nWaitMicros;   // time the master waited for the workers
+
+    CCheckQueueStats() : nChecks(0), nSteals(0), nVerifyMicros(0), nWaitMicros(0) {}
+};
+
 /** Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
   * operator(), returning a bool.
@@ -23,10 +39,22 @@ template<typename T> class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every thread has a queue of its own, with its own lock. The master
+  * spreads new verifications over these queues; a thread takes batches
+  * from the front of its own queue and, once that is empty, steals from
+  * the back of the others. The shared lock is only taken to add work and
+  * when a thread runs out of work, to report what it did and to sleep.
   */
 template<typename T> class CCheckQueue {
 private:
-    // Mutex to protect the inner state
+    // A thread's own queue of elements to be processed
+    struct CWorkerQueue {
+        boost::mutex mutex;
+        std::deque<T> queue;
+    };
+
+    // Mutex to protect the shared state below
     boost::mutex mutex;
 
     // Worker threads block on this when out of work
@@ -35,9 +63,12 @@ private:
     // Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    // The queue of elements to be processed.
-    // As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    // The queues: the master's first, then one per worker thread.
+    boost::scoped_array<CWorkerQueue> vQueues;
+
+    // The maximum and the current number of worker threads.
+    unsigned int nMaxWorkers;
+    unsigned int nWorkers;
 
     // The number of workers (including the master) that are idle.
     int nIdle;
@@ -49,8 +80,8 @@ private:
     bool fAllOk;
 
     // Number of verifications that haven't completed yet.
-    // This includes elements that are not anymore in queue, but still in
-    // worker's own batches.
+    // This includes elements that are not anymore in a queue, but still in
+    // a thread's batch, or done but not reported yet.
     unsigned int nTodo;
 
     // Whether we're shutting down.
@@ -59,70 +90,128 @@ private:
     // The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    // Counts the calls to Add, so a thread about to sleep notices work
+    // added while it was looking at the queues.
+    uint64_t nAdded;
+
+    // The queue the next verifications are added to first
+    unsigned int nNext;
+
+    // Statistics of the current round, and of the last completed one.
+    CCheckQueueStats stats;
+    CCheckQueueStats statsLast;
+
+    // Move a batch of elements from queue nQueue into vChecks. A thread's
+    // own queue is used from the front, one being stolen from the back.
+    bool Take(unsigned int nQueue, bool fSteal, std::vector<T> &vChecks) {
+        CWorkerQueue &worker = vQueues[nQueue];
+        boost::unique_lock<boost::mutex> lock(worker.mutex);
+        if (worker.queue.empty())
+            return false;
+        // Take at most half of what is left, so the others can share in the
+        // rest and all threads finish approximately simultaneously.
+        unsigned int nNow = std::max(1U, std::min(nBatchSize, (unsigned int)worker.queue.size() / 2));
+        vChecks.resize(nNow);
+        for (unsigned int i = 0; i < nNow; i++) {
+            // Swap instead of copying, to keep the lock short.
+            if (fSteal) {
+                vChecks[i].swap(worker.queue.back());
+                worker.queue.pop_back();
+            } else {
+                vChecks[i].swap(worker.queue.front());
+                worker.queue.pop_front();
+            }
+        }
+        return true;
+    }
+
     // Internal function that does bulk of the verification work.
     bool Loop(bool fMaster = false) {
         boost::condition_variable &cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
+        unsigned int nQueue, nQueues;
+        uint64_t nAddedSeen;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (fMaster) {
+                nQueue = 0;
+            } else {
+                assert(nWorkers < nMaxWorkers);
+                nQueue = ++nWorkers;
+            }
+            nTotal++;
+            nQueues = nWorkers + 1;
+            nAddedSeen = nAdded;
+        }
+        // Work done since the last report
+        CCheckQueueStats done;
         bool fOk = true;
         do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master he can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                     // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                     // queue to the local batch vector instead of copying.
-                     vChecks[i].swap(queue.back());
-                     queue.pop_back();
+            bool fFound = Take(nQueue, false, vChecks);
+            for (unsigned int i = 1; !fFound && i < nQueues; i++)
+                if ((fFound = Take((nQueue + i) % nQueues, true, vChecks)))
+                    done.nSteals++;
+            if (fFound) {
+                // execute work
+                int64_t nStart = GetTimeMicros();
+                BOOST_FOREACH(T &check, vChecks)
+                    if (fOk)
+                        fOk = check();
+                done.nVerifyMicros += GetTimeMicros() - nStart;
+                done.nChecks += vChecks.size();
+                vChecks.clear();
+                continue;
+            }
+
+            // Out of work: report what was done, then finish or sleep.
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (done.nChecks) {
+                fAllOk &= fOk;
+                nTodo -= done.nChecks;
+                stats.nChecks += done.nChecks;
+                stats.nSteals += done.nSteals;
+                stats.nVerifyMicros += done.nVerifyMicros;
+                if (nTodo == 0 && !fMaster)
+                    // We processed the last element; inform the master he can exit and return the result
+                    condMaster.notify_one();
+                done = CCheckQueueStats();
+            }
+            // A report only carries the failures seen since the last one;
+            // the round may already be over, and fAllOk reset for the next.
+            fOk = true;
+            if ((fMaster || fQuit) && nTodo == 0) {
+                nTotal--;
+                bool fRet = fAllOk;
+                // reset the status for new work later
+                if (fMaster) {
+                    fAllOk = true;
+                    statsLast = stats;
+                    stats = CCheckQueueStats();
                 }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+                // return the current status
+                return fRet;
+            }
+            // Sleep, unless work was added since the queues were searched.
+            if (nAdded == nAddedSeen) {
+                int64_t nStart = GetTimeMicros();
+                nIdle++;
+                cond.wait(lock); // wait
+                nIdle--;
+                if (fMaster)
+                    stats.nWaitMicros += GetTimeMicros() - nStart;
             }
-            // execute work
-            BOOST_FOREACH(T &check, vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
+            nQueues = nWorkers + 1;
+            nAddedSeen = nAdded;
         } while(true);
     }
 
 public:
     // Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) :
-        nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    CCheckQueue(unsigned int nBatchSizeIn, unsigned int nMaxWorkersIn = 64) :
+        vQueues(new CWorkerQueue[nMaxWorkersIn + 1]), nMaxWorkers(nMaxWorkersIn), nWorkers(0),
+        nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn),
+        nAdded(0), nNext(0) {}
 
     // Worker thread
     void Thread() {
@@ -136,18 +225,42 @@ public:
 
     // Add a batch of checks to the queue
     void Add(std::vector<T> &vChecks) {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH(T &check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
+        if (vChecks.empty())
+            return;
+        unsigned int nQueues, nFirst;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nTodo += vChecks.size();
+            nQueues = nWorkers + 1;
+            nFirst = nNext % nQueues;
+        }
+        // Give each queue a contiguous part, starting where the last call
+        // stopped so small batches do not all land in the same queue.
+        unsigned int nPerQueue = (vChecks.size() + nQueues - 1) / nQueues;
+        unsigned int nUsed = 0;
+        for (unsigned int i = 0; i < vChecks.size(); i += nPerQueue, nUsed++) {
+            CWorkerQueue &worker = vQueues[(nFirst + nUsed) % nQueues];
+            boost::unique_lock<boost::mutex> lock(worker.mutex);
+            for (unsigned int j = i; j < std::min(i + nPerQueue, (unsigned int)vChecks.size()); j++) {
+                worker.queue.push_back(T());
+                vChecks[j].swap(worker.queue.back());
+            }
         }
-        nTodo += vChecks.size();
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nNext = nFirst + nUsed;
+        nAdded++;
         if (vChecks.size() == 1)
             condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        else
             condWorker.notify_all();
     }
 
+    // Statistics of the last round that the master waited for
+    CCheckQueueStats GetLastStats() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return statsLast;
+    }
+
     ~CCheckQueue() {
     }
 
@@ -164,9 +277,9 @@ private:
 
 public:
     CCheckQueueControl(CCheckQueue<T> *pqueueIn) : pqueue(pqueueIn), fDone(false) {
-        // passed queue is supposed to be unused, or NULL
+        // passed queue is supposed to be unused, or NULL. Workers may still
+        // be looking for work left from the last round.
         if (pqueue != NULL) {
-            assert(pqueue->nTotal == pqueue->nIdle);
             assert(pqueue->nTodo == 0);
             assert(pqueue->fAllOk == true);
         }
@@ -185,6 +298,13 @@ public:
             pqueue->Add(vChecks);
     }
 
+    // Statistics of the verifications, once Wait returned
+    CCheckQueueStats GetStats() {
+        if (pqueue == NULL)
+            return CCheckQueueStats();
+        return pqueue->GetLastStats();
+    }
+
     ~CCheckQueueControl() {
         if (!fDone)
             Wait();
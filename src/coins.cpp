@@ -4,110 +4,178 @@
 
 #include "coins.h"
 
-#include <assert.h>
-
-// calculate number of bytes for the bitmask, and its number of non-zero bytes
-// each bit in the bitmask represents the availability of one output, but the
-// availabilities of the first two outputs are encoded separately
-void CCoins::CalcMaskSize(unsigned int &nBytes, unsigned int &nNonzeroBytes) const {
-    unsigned int nLastUsedByte = 0;
-    for (unsigned int b = 0; 2+b*8 < vout.size(); b++) {
-        bool fZero = true;
-        for (unsigned int i = 0; i < 8 && 2+b*8+i < vout.size(); i++) {
-            if (!vout[2+b*8+i].IsNull()) {
-                fZero = false;
-                continue;
-            }
-        }
-        if (!fZero) {
-            nLastUsedByte = b + 1;
-            nNonzeroBytes++;
-        }
-    }
-    nBytes += nLastUsedByte;
-}
-
-bool CCoins::Spend(const COutPoint &out, CTxInUndo &undo) {
-    if (out.n >= vout.size())
-        return false;
-    if (vout[out.n].IsNull())
-        return false;
-    undo = CTxInUndo(vout[out.n]);
-    vout[out.n].SetNull();
-    Cleanup();
-    if (vout.size() == 0) {
-        undo.nHeight = nHeight;
-        undo.fCoinBase = fCoinBase;
-        undo.nVersion = this->nVersion;
-    }
-    return true;
-}
+#include "hash.h"
+#include "util.h"
 
-bool CCoins::Spend(int nPos) {
-    CTxInUndo undo;
-    COutPoint out(0, nPos);
-    return Spend(out, undo);
-}
+#include <assert.h>
 
+// Upper bound on the number of outputs a transaction can have: a block of
+// 1MB cannot hold more than this many minimal (9 byte) outputs.
+static const unsigned int MAX_OUTPUTS_PER_TX = 1000000 / 9;
 
-bool CCoinsView::GetCoins(const uint256 &txid, CCoins &coins) { return false; }
-bool CCoinsView::SetCoins(const uint256 &txid, const CCoins &coins) { return false; }
-bool CCoinsView::HaveCoins(const uint256 &txid) { return false; }
+bool CCoinsView::GetCoin(const COutPoint &outpoint, CCoin &coin) { return false; }
+bool CCoinsView::HaveCoin(const COutPoint &outpoint) { return false; }
 uint256 CCoinsView::GetBestBlock() { return uint256(0); }
 bool CCoinsView::SetBestBlock(const uint256 &hashBlock) { return false; }
-bool CCoinsView::BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock) { return false; }
+bool CCoinsView::BatchWrite(const CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsTotals &totalsDelta) { return false; }
+bool CCoinsView::BatchMove(CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsTotals &totalsDelta) { return BatchWrite(mapCoins, hashBlock, totalsDelta); }
 bool CCoinsView::GetStats(CCoinsStats &stats) { return false; }
 
 
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView &viewIn) : base(&viewIn) { }
-bool CCoinsViewBacked::GetCoins(const uint256 &txid, CCoins &coins) { return base->GetCoins(txid, coins); }
-bool CCoinsViewBacked::SetCoins(const uint256 &txid, const CCoins &coins) { return base->SetCoins(txid, coins); }
-bool CCoinsViewBacked::HaveCoins(const uint256 &txid) { return base->HaveCoins(txid); }
+bool CCoinsViewBacked::GetCoin(const COutPoint &outpoint, CCoin &coin) { return base->GetCoin(outpoint, coin); }
+bool CCoinsViewBacked::HaveCoin(const COutPoint &outpoint) { return base->HaveCoin(outpoint); }
 uint256 CCoinsViewBacked::GetBestBlock() { return base->GetBestBlock(); }
 bool CCoinsViewBacked::SetBestBlock(const uint256 &hashBlock) { return base->SetBestBlock(hashBlock); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock) { return base->BatchWrite(mapCoins, hashBlock); }
+bool CCoinsViewBacked::BatchWrite(const CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsTotals &totalsDelta) { return base->BatchWrite(mapCoins, hashBlock, totalsDelta); }
+bool CCoinsViewBacked::BatchMove(CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsTotals &totalsDelta) { return base->BatchMove(mapCoins, hashBlock, totalsDelta); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) { return base->GetStats(stats); }
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), hashBlock(0) { }
+static uint256 CoinHash(const COutPoint &outpoint, const CCoin &coin) {
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << outpoint << coin;
+    return ss.GetHash();
+}
 
-bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) {
-    if (cacheCoins.count(txid)) {
-        coins = cacheCoins[txid];
-        return true;
-    }
-    if (base->GetCoins(txid, coins)) {
-        cacheCoins[txid] = coins;
-        return true;
-    }
-    return false;
+// Size of the database record of a coin: 'C', the txid, VARINT(n) and the coin.
+static int64_t CoinRecordSize(const COutPoint &outpoint, const CCoin &coin) {
+    return 1 + 32 + GetSizeOfVarInt(outpoint.n) + coin.GetSerializeSize(SER_DISK, CLIENT_VERSION);
+}
+
+void CCoinsTotals::Add(const COutPoint &outpoint, const CCoin &coin) {
+    nOutputs++;
+    nAmount += coin.out.nValue;
+    nSerializedSize += CoinRecordSize(outpoint, coin);
+    hashSet += CoinHash(outpoint, coin);
 }
 
-std::map<uint256,CCoins>::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = cacheCoins.lower_bound(txid);
-    if (it != cacheCoins.end() && it->first == txid)
+void CCoinsTotals::Remove(const COutPoint &outpoint, const CCoin &coin) {
+    nOutputs--;
+    nAmount -= coin.out.nValue;
+    nSerializedSize -= CoinRecordSize(outpoint, coin);
+    hashSet -= CoinHash(outpoint, coin);
+}
+
+COutPointHasher::COutPointHasher() : salt(GetRandHash()) {}
+
+CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), hashBlock(0), cachedCoinsUsage(0), nDirty(0), nCacheHits(0), nCacheMisses(0) { }
+
+CCoinsMap::iterator CCoinsViewCache::FetchCoin(const COutPoint &outpoint) {
+    CCoinsMap::iterator it = cacheCoins.find(outpoint);
+    if (it != cacheCoins.end()) {
+        nCacheHits++;
         return it;
-    CCoins tmp;
-    if (!base->GetCoins(txid,tmp))
+    }
+    nCacheMisses++;
+    CCoin tmp;
+    if (!base->GetCoin(outpoint, tmp))
         return cacheCoins.end();
-    std::map<uint256,CCoins>::iterator ret = cacheCoins.insert(it, std::make_pair(txid, CCoins()));
-    tmp.swap(ret->second);
+    CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(outpoint, CCoinsCacheEntry())).first;
+    tmp.swap(ret->second.coin);
+    if (ret->second.coin.IsSpent()) {
+        // The parent only has an empty entry for this outpoint; we can consider
+        // our version as fresh.
+        ret->second.flags = CCoinsCacheEntry::FRESH;
+    }
+    cachedCoinsUsage += ret->second.coin.DynamicMemoryUsage();
     return ret;
 }
 
-CCoins &CCoinsViewCache::GetCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = FetchCoins(txid);
-    assert(it != cacheCoins.end());
-    return it->second;
+bool CCoinsViewCache::GetCoin(const COutPoint &outpoint, CCoin &coin) {
+    CCoinsMap::iterator it = FetchCoin(outpoint);
+    if (it != cacheCoins.end()) {
+        coin = it->second.coin;
+        return !coin.IsSpent();
+    }
+    return false;
 }
 
-bool CCoinsViewCache::SetCoins(const uint256 &txid, const CCoins &coins) {
-    cacheCoins[txid] = coins;
-    return true;
+bool CCoinsViewCache::HaveCoin(const COutPoint &outpoint) {
+    CCoinsMap::iterator it = FetchCoin(outpoint);
+    return (it != cacheCoins.end() && !it->second.coin.IsSpent());
+}
+
+bool CCoinsViewCache::HaveCoinInCache(const COutPoint &outpoint) const {
+    CCoinsMap::const_iterator it = cacheCoins.find(outpoint);
+    return (it != cacheCoins.end() && !it->second.coin.IsSpent());
 }
 
-bool CCoinsViewCache::HaveCoins(const uint256 &txid) {
-    return FetchCoins(txid) != cacheCoins.end();
+void CCoinsViewCache::GetCachedOutPoints(std::vector<COutPoint> &vOutPoints, size_t nMax) const {
+    for (CCoinsMap::const_iterator it = cacheCoins.begin(); it != cacheCoins.end() && vOutPoints.size() < nMax; ++it)
+        if (!it->second.coin.IsSpent())
+            vOutPoints.push_back(it->first);
+}
+
+static const CCoin coinEmpty;
+
+const CCoin &CCoinsViewCache::AccessCoin(const COutPoint &outpoint) {
+    CCoinsMap::const_iterator it = FetchCoin(outpoint);
+    if (it == cacheCoins.end())
+        return coinEmpty;
+    return it->second.coin;
+}
+
+void CCoinsViewCache::AddCoin(const COutPoint &outpoint, const CCoin &coin, bool fPossibleOverwrite) {
+    assert(!coin.IsSpent());
+    if (coin.out.scriptPubKey.IsUnspendable())
+        return;
+    // A coin that may be overwritten has to be known, to keep the totals right.
+    if (fPossibleOverwrite)
+        FetchCoin(outpoint);
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(outpoint, CCoinsCacheEntry()));
+    CCoinsCacheEntry &entry = ret.first->second;
+    bool fFresh = false;
+    if (!ret.second) {
+        cachedCoinsUsage -= entry.coin.DynamicMemoryUsage();
+        if (!entry.coin.IsSpent())
+            totalsDelta.Remove(outpoint, entry.coin);
+    }
+    if (!fPossibleOverwrite) {
+        // Adding a coin over an unspent one would lose the old one.
+        assert(entry.coin.IsSpent());
+        // If the entry is spent but dirty, the parent still has the old
+        // unspent version and has to be told about the new one.
+        fFresh = !(entry.flags & CCoinsCacheEntry::DIRTY);
+    }
+    entry.coin = coin;
+    if (!(entry.flags & CCoinsCacheEntry::DIRTY))
+        nDirty++;
+    entry.flags |= CCoinsCacheEntry::DIRTY | (fFresh ? CCoinsCacheEntry::FRESH : 0);
+    cachedCoinsUsage += entry.coin.DynamicMemoryUsage();
+    totalsDelta.Add(outpoint, coin);
+}
+
+void CCoinsViewCache::AddFetchedCoin(const COutPoint &outpoint, const CCoin &coin) {
+    if (coin.IsSpent())
+        return;
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(outpoint, CCoinsCacheEntry()));
+    if (!ret.second)
+        return;
+    // Same as the base view, so neither dirty nor fresh.
+    ret.first->second.coin = coin;
+    cachedCoinsUsage += coin.DynamicMemoryUsage();
+}
+
+bool CCoinsViewCache::SpendCoin(const COutPoint &outpoint, CCoin *pcoinOut) {
+    CCoinsMap::iterator it = FetchCoin(outpoint);
+    if (it == cacheCoins.end() || it->second.coin.IsSpent())
+        return false;
+    cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
+    totalsDelta.Remove(outpoint, it->second.coin);
+    if (pcoinOut)
+        it->second.coin.swap(*pcoinOut);
+    if (it->second.flags & CCoinsCacheEntry::FRESH) {
+        // Created and spent in this cache: the parent never needs to know.
+        cacheCoins.erase(it);
+        nDirty--;
+    } else {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            nDirty++;
+        it->second.flags |= CCoinsCacheEntry::DIRTY;
+        it->second.coin.Clear();
+    }
+    return true;
 }
 
 uint256 CCoinsViewCache::GetBestBlock() {
@@ -121,29 +189,139 @@ bool CCoinsViewCache::SetBestBlock(const uint256 &hashBlockIn) {
     return true;
 }
 
-bool CCoinsViewCache::BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlockIn) {
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        cacheCoins[it->first] = it->second;
+void CCoinsViewCache::MergeCoin(const COutPoint &outpoint, CCoin &coin, unsigned char flags) {
+    CCoinsMap::iterator itUs = cacheCoins.find(outpoint);
+    if (itUs == cacheCoins.end()) {
+        if (!(flags & CCoinsCacheEntry::FRESH && coin.IsSpent())) {
+            // The parent cache does not have an entry, while the child does.
+            // Move the data up, and mark it as dirty (and fresh if the child
+            // says so: then neither layer's parent has it).
+            CCoinsCacheEntry &entry = cacheCoins[outpoint];
+            entry.coin.swap(coin);
+            entry.flags = CCoinsCacheEntry::DIRTY | (flags & CCoinsCacheEntry::FRESH);
+            cachedCoinsUsage += entry.coin.DynamicMemoryUsage();
+            nDirty++;
+        }
+    } else {
+        // The child may only consider an entry fresh if we have it spent.
+        assert(!(flags & CCoinsCacheEntry::FRESH) || itUs->second.coin.IsSpent());
+        if ((itUs->second.flags & CCoinsCacheEntry::FRESH) && coin.IsSpent()) {
+            // The grandparent does not have an entry, and the child is
+            // modified and being pruned. This means we can just delete
+            // it from the parent.
+            cachedCoinsUsage -= itUs->second.coin.DynamicMemoryUsage();
+            cacheCoins.erase(itUs);
+            nDirty--;
+        } else {
+            // A normal modification. A FRESH flag on the child is not
+            // copied: our spent entry may still have to reach our parent.
+            cachedCoinsUsage -= itUs->second.coin.DynamicMemoryUsage();
+            itUs->second.coin.swap(coin);
+            if (!(itUs->second.flags & CCoinsCacheEntry::DIRTY))
+                nDirty++;
+            itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+            cachedCoinsUsage += itUs->second.coin.DynamicMemoryUsage();
+        }
+    }
+}
+
+bool CCoinsViewCache::BatchWrite(const CCoinsMap &mapCoins, const uint256 &hashBlockIn, const CCoinsTotals &totalsDeltaIn) {
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY)) // Ignore non-dirty entries (optimization).
+            continue;
+        CCoin coin(it->second.coin);
+        MergeCoin(it->first, coin, it->second.flags);
+    }
     hashBlock = hashBlockIn;
+    totalsDelta += totalsDeltaIn;
+    return true;
+}
+
+bool CCoinsViewCache::BatchMove(CCoinsMap &mapCoins, const uint256 &hashBlockIn, const CCoinsTotals &totalsDeltaIn) {
+    if (cacheCoins.empty()) {
+        // Nothing to merge with: adopt the child's map wholesale, minus
+        // the entries it has no need to pass on.
+        cacheCoins.swap(mapCoins);
+        cachedCoinsUsage = 0;
+        nDirty = 0;
+        for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); ) {
+            unsigned char flags = it->second.flags;
+            if (!(flags & CCoinsCacheEntry::DIRTY) || ((flags & CCoinsCacheEntry::FRESH) && it->second.coin.IsSpent())) {
+                it = cacheCoins.erase(it);
+                continue;
+            }
+            it->second.flags = CCoinsCacheEntry::DIRTY | (flags & CCoinsCacheEntry::FRESH);
+            cachedCoinsUsage += it->second.coin.DynamicMemoryUsage();
+            nDirty++;
+            it++;
+        }
+    } else {
+        for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+            if (it->second.flags & CCoinsCacheEntry::DIRTY)
+                MergeCoin(it->first, it->second.coin, it->second.flags);
+        }
+    }
+    hashBlock = hashBlockIn;
+    totalsDelta += totalsDeltaIn;
+    return true;
+}
+
+bool CCoinsViewCache::GetStats(CCoinsStats &stats) {
+    if (!base->GetStats(stats))
+        return false;
+    CCoinsTotals totals;
+    totals.nOutputs = stats.nTransactionOutputs;
+    totals.nAmount = stats.nTotalAmount;
+    totals.nSerializedSize = stats.nSerializedSize;
+    totals.hashSet = stats.hashSet;
+    totals += totalsDelta;
+    stats.SetTotals(totals);
+    stats.hashBlock = GetBestBlock();
+    // Transactions are only counted by full scans of the database.
+    stats.nTransactions = 0;
     return true;
 }
 
-bool CCoinsViewCache::Flush() {
-    bool fOk = base->BatchWrite(cacheCoins, hashBlock);
-    if (fOk)
+bool CCoinsViewCache::Flush(bool fRetain) {
+    // Without fRetain the entries are dropped below, so the base may take them.
+    bool fOk = fRetain ? base->BatchWrite(cacheCoins, hashBlock, totalsDelta)
+                       : base->BatchMove(cacheCoins, hashBlock, totalsDelta);
+    if (!fOk)
+        return false;
+    totalsDelta = CCoinsTotals();
+    nDirty = 0;
+    if (fRetain) {
+        // Everything is in the parent now: keep what is still unspent as
+        // clean entries and drop the rest.
+        for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); ) {
+            if (it->second.coin.IsSpent()) {
+                cachedCoinsUsage -= it->second.coin.DynamicMemoryUsage();
+                it = cacheCoins.erase(it);
+            } else {
+                it->second.flags = 0;
+                it++;
+            }
+        }
+    } else {
         cacheCoins.clear();
-    return fOk;
+        cachedCoinsUsage = 0;
+    }
+    return true;
 }
 
 unsigned int CCoinsViewCache::GetCacheSize() {
     return cacheCoins.size();
 }
 
+size_t CCoinsViewCache::DynamicMemoryUsage() {
+    return memusage::DynamicUsage(cacheCoins) + cachedCoinsUsage;
+}
+
 const CTxOut &CCoinsViewCache::GetOutputFor(const CTxIn& input)
 {
-    const CCoins &coins = GetCoins(input.prevout.hash);
-    assert(coins.IsAvailable(input.prevout.n));
-    return coins.vout[input.prevout.n];
+    const CCoin &coin = AccessCoin(input.prevout);
+    assert(!coin.IsSpent());
+    return coin.out;
 }
 
 int64_t CCoinsViewCache::GetValueIn(const CTransaction& tx)
@@ -161,18 +339,8 @@ int64_t CCoinsViewCache::GetValueIn(const CTransaction& tx)
 bool CCoinsViewCache::HaveInputs(const CTransaction& tx)
 {
     if (!tx.IsCoinBase()) {
-        // first check whether information about the prevout hash is available
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
-            const COutPoint &prevout = tx.vin[i].prevout;
-            if (!HaveCoins(prevout.hash))
-                return false;
-        }
-
-        // then check whether the actual outputs are available
-        for (unsigned int i = 0; i < tx.vin.size(); i++) {
-            const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins &coins = GetCoins(prevout.hash);
-            if (!coins.IsAvailable(prevout.n))
+            if (!HaveCoin(tx.vin[i].prevout))
                 return false;
         }
     }
@@ -186,11 +354,34 @@ double CCoinsViewCache::GetPriority(const CTransaction &tx, int nHeight)
     double dResult = 0.0;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
     {
-        const CCoins &coins = GetCoins(txin.prevout.hash);
-        if (!coins.IsAvailable(txin.prevout.n)) continue;
-        if (coins.nHeight < nHeight) {
-            dResult += coins.vout[txin.prevout.n].nValue * (nHeight-coins.nHeight);
+        const CCoin &coin = AccessCoin(txin.prevout);
+        if (coin.IsSpent()) continue;
+        if (coin.nHeight < (unsigned int)nHeight) {
+            dResult += coin.out.nValue * (nHeight-coin.nHeight);
         }
     }
     return tx.ComputePriority(dResult);
 }
+
+void AddCoins(CCoinsViewCache &cache, const CTransaction &tx, int nHeight)
+{
+    bool fCoinBase = tx.IsCoinBase();
+    const uint256 &txid = tx.GetHash();
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        // Coinbases may have been duplicated before BIP30, so they are
+        // allowed to overwrite.
+        cache.AddCoin(COutPoint(txid, i), CCoin(tx.vout[i], nHeight, fCoinBase), fCoinBase);
+    }
+}
+
+const CCoin &AccessByTxid(CCoinsViewCache &cache, const uint256 &txid)
+{
+    COutPoint iter(txid, 0);
+    while (iter.n < MAX_OUTPUTS_PER_TX) {
+        const CCoin &alternate = cache.AccessCoin(iter);
+        if (!alternate.IsSpent())
+            return alternate;
+        ++iter.n;
+    }
+    return coinEmpty;
+}
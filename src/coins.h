@@ -6,6 +6,7 @@
 #define BITCOIN_COINS_H
 
 #include "core.h"
+#include "memusage.h"
 #include "serialize.h"
 #include "uint256.h"
 
@@ -13,230 +14,178 @@
 #include <stdint.h>
 
 #include <boost/foreach.hpp>
+#include <boost/unordered_map.hpp>
 
-/** pruned version of CTransaction: only retains metadata and unspent transaction outputs
+/** A single unspent transaction output, with the metadata of the transaction
+ *  that created it.
  *
  * Serialized format:
- * - VARINT(nVersion)
- * - VARINT(nCode)
- * - unspentness bitvector, for vout[2] and further; least significant byte first
- * - the non-spent CTxOuts (via CTxOutCompressor)
- * - VARINT(nHeight)
+ * - VARINT(nHeight * 2 + fCoinBase)
+ * - the non-spent CTxOut (via CTxOutCompressor)
  *
- * The nCode value consists of:
- * - bit 1: IsCoinBase()
- * - bit 2: vout[0] is not spent
- * - bit 4: vout[1] is not spent
- * - The higher bits encode N, the number of non-zero bytes in the following bitvector.
- *   - In case both bit 2 and bit 4 are unset, they encode N-1, as there must be at
- *     least one non-spent output).
+ * Example: 97f23c835800816115944e077fe7c803cfa57f29b36bf87c1d35
+ *          <----><------------------------------------------>
+ *          code                   txout
  *
- * Example: 0104835800816115944e077fe7c803cfa57f29b36bf87c1d358bb85e
- *          <><><--------------------------------------------><---->
- *          |  \                  |                             /
- *    version   code             vout[1]                  height
- *
- *    - version = 1
- *    - code = 4 (vout[1] is not spent, and 0 non-zero bytes of bitvector follow)
- *    - unspentness bitvector: as 0 non-zero bytes follow, it has length 0
- *    - vout[1]: 835800816115944e077fe7c803cfa57f29b36bf87c1d35
- *               * 8358: compact amount representation for 60000000000 (600 BTC)
- *               * 00: special txout type pay-to-pubkey-hash
- *               * 816115944e077fe7c803cfa57f29b36bf87c1d35: address uint160
- *    - height = 203998
- *
- *
- * Example: 0109044086ef97d5790061b01caab50f1b8e9c50a5057eb43c2d9563a4eebbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa486af3b
- *          <><><--><--------------------------------------------------><----------------------------------------------><---->
- *         /  \   \                     |                                                           |                     /
- *  version  code  unspentness       vout[4]                                                     vout[16]           height
- *
- *  - version = 1
- *  - code = 9 (coinbase, neither vout[0] or vout[1] are unspent,
- *                2 (1, +1 because both bit 2 and bit 4 are unset) non-zero bitvector bytes follow)
- *  - unspentness bitvector: bits 2 (0x04) and 14 (0x4000) are set, so vout[2+2] and vout[14+2] are unspent
- *  - vout[4]: 86ef97d5790061b01caab50f1b8e9c50a5057eb43c2d9563a4ee
- *             * 86ef97d579: compact amount representation for 234925952 (2.35 BTC)
+ *    - code = 407996 = 203998 * 2 + 0 (VARINT 97f23c): height 203998, not coinbase
+ *    - txout: 835800816115944e077fe7c803cfa57f29b36bf87c1d35
+ *             * 8358: compact amount representation for 60000000000 (600 BTC)
  *             * 00: special txout type pay-to-pubkey-hash
- *             * 61b01caab50f1b8e9c50a5057eb43c2d9563a4ee: address uint160
- *  - vout[16]: bbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa4
- *              * bbd123: compact amount representation for 110397 (0.001 BTC)
- *              * 00: special txout type pay-to-pubkey-hash
- *              * 8c988f1a4a4de2161e0f50aac7f17e7f9555caa4: address uint160
- *  - height = 120891
+ *             * 816115944e077fe7c803cfa57f29b36bf87c1d35: address uint160
  */
-class CCoins
+class CCoin
 {
 public:
-    // whether transaction is a coinbase
-    bool fCoinBase;
+    // unspent transaction output; .IsNull() if spent
+    CTxOut out;
 
-    // unspent transaction outputs; spent outputs are .IsNull(); spent outputs at the end of the array are dropped
-    std::vector<CTxOut> vout;
+    // whether the containing transaction was a coinbase
+    bool fCoinBase;
 
-    // at which height this transaction was included in the active block chain
-    int nHeight;
+    // at which height the containing transaction was included in the active block chain
+    unsigned int nHeight;
 
-    // version of the CTransaction; accesses to this value should probably check for nHeight as well,
-    // as new tx version will probably only be introduced at certain heights
-    int nVersion;
+    CCoin(const CTxOut &outIn, unsigned int nHeightIn, bool fCoinBaseIn) : out(outIn), fCoinBase(fCoinBaseIn), nHeight(nHeightIn) { }
 
-    // construct a CCoins from a CTransaction, at a given height
-    CCoins(const CTransaction &tx, int nHeightIn) : fCoinBase(tx.IsCoinBase()), vout(tx.vout), nHeight(nHeightIn), nVersion(tx.nVersion) {
-        ClearUnspendable();
+    // empty constructor
+    CCoin() : out(), fCoinBase(false), nHeight(0) { }
+
+    void Clear() {
+        out.SetNull();
+        // release the script memory as well
+        CScript().swap(out.scriptPubKey);
+        fCoinBase = false;
+        nHeight = 0;
     }
 
-    // empty constructor
-    CCoins() : fCoinBase(false), vout(0), nHeight(0), nVersion(0) { }
-
-    // remove spent outputs at the end of vout
-    void Cleanup() {
-        while (vout.size() > 0 && vout.back().IsNull())
-            vout.pop_back();
-        if (vout.empty())
-            std::vector<CTxOut>().swap(vout);
+    bool IsCoinBase() const {
+        return fCoinBase;
     }
 
-    void ClearUnspendable() {
-        BOOST_FOREACH(CTxOut &txout, vout) {
-            if (txout.scriptPubKey.IsUnspendable())
-                txout.SetNull();
-        }
-        Cleanup();
+    bool IsSpent() const {
+        return out.IsNull();
     }
 
-    void swap(CCoins &to) {
+    void swap(CCoin &to) {
+        // swap the script buffers rather than copying the whole output
+        std::swap(to.out.nValue, out.nValue);
+        to.out.scriptPubKey.swap(out.scriptPubKey);
         std::swap(to.fCoinBase, fCoinBase);
-        to.vout.swap(vout);
         std::swap(to.nHeight, nHeight);
-        std::swap(to.nVersion, nVersion);
     }
 
-    // equality test
-    friend bool operator==(const CCoins &a, const CCoins &b) {
-         // Empty CCoins objects are always equal.
-         if (a.IsPruned() && b.IsPruned())
-             return true;
-         return a.fCoinBase == b.fCoinBase &&
-                a.nHeight == b.nHeight &&
-                a.nVersion == b.nVersion &&
-                a.vout == b.vout;
+    friend bool operator==(const CCoin &a, const CCoin &b) {
+        // Spent coins are always equal.
+        if (a.IsSpent() && b.IsSpent())
+            return true;
+        return a.fCoinBase == b.fCoinBase &&
+               a.nHeight == b.nHeight &&
+               a.out == b.out;
     }
-    friend bool operator!=(const CCoins &a, const CCoins &b) {
+    friend bool operator!=(const CCoin &a, const CCoin &b) {
         return !(a == b);
     }
 
-    void CalcMaskSize(unsigned int &nBytes, unsigned int &nNonzeroBytes) const;
-
-    bool IsCoinBase() const {
-        return fCoinBase;
-    }
-
     unsigned int GetSerializeSize(int nType, int nVersion) const {
-        unsigned int nSize = 0;
-        unsigned int nMaskSize = 0, nMaskCode = 0;
-        CalcMaskSize(nMaskSize, nMaskCode);
-        bool fFirst = vout.size() > 0 && !vout[0].IsNull();
-        bool fSecond = vout.size() > 1 && !vout[1].IsNull();
-        assert(fFirst || fSecond || nMaskCode);
-        unsigned int nCode = 8*(nMaskCode - (fFirst || fSecond ? 0 : 1)) + (fCoinBase ? 1 : 0) + (fFirst ? 2 : 0) + (fSecond ? 4 : 0);
-        // version
-        nSize += ::GetSerializeSize(VARINT(this->nVersion), nType, nVersion);
-        // size of header code
-        nSize += ::GetSerializeSize(VARINT(nCode), nType, nVersion);
-        // spentness bitmask
-        nSize += nMaskSize;
-        // txouts themself
-        for (unsigned int i = 0; i < vout.size(); i++)
-            if (!vout[i].IsNull())
-                nSize += ::GetSerializeSize(CTxOutCompressor(REF(vout[i])), nType, nVersion);
-        // height
-        nSize += ::GetSerializeSize(VARINT(nHeight), nType, nVersion);
-        return nSize;
+        unsigned int nCode = nHeight * 2 + (fCoinBase ? 1 : 0);
+        return ::GetSerializeSize(VARINT(nCode), nType, nVersion) +
+               ::GetSerializeSize(CTxOutCompressor(REF(out)), nType, nVersion);
     }
 
     template<typename Stream>
     void Serialize(Stream &s, int nType, int nVersion) const {
-        unsigned int nMaskSize = 0, nMaskCode = 0;
-        CalcMaskSize(nMaskSize, nMaskCode);
-        bool fFirst = vout.size() > 0 && !vout[0].IsNull();
-        bool fSecond = vout.size() > 1 && !vout[1].IsNull();
-        assert(fFirst || fSecond || nMaskCode);
-        unsigned int nCode = 8*(nMaskCode - (fFirst || fSecond ? 0 : 1)) + (fCoinBase ? 1 : 0) + (fFirst ? 2 : 0) + (fSecond ? 4 : 0);
-        // version
-        ::Serialize(s, VARINT(this->nVersion), nType, nVersion);
-        // header code
+        assert(!IsSpent());
+        unsigned int nCode = nHeight * 2 + (fCoinBase ? 1 : 0);
         ::Serialize(s, VARINT(nCode), nType, nVersion);
-        // spentness bitmask
-        for (unsigned int b = 0; b<nMaskSize; b++) {
-            unsigned char chAvail = 0;
-            for (unsigned int i = 0; i < 8 && 2+b*8+i < vout.size(); i++)
-                if (!vout[2+b*8+i].IsNull())
-                    chAvail |= (1 << i);
-            ::Serialize(s, chAvail, nType, nVersion);
-        }
-        // txouts themself
-        for (unsigned int i = 0; i < vout.size(); i++) {
-            if (!vout[i].IsNull())
-                ::Serialize(s, CTxOutCompressor(REF(vout[i])), nType, nVersion);
-        }
-        // coinbase height
-        ::Serialize(s, VARINT(nHeight), nType, nVersion);
+        ::Serialize(s, CTxOutCompressor(REF(out)), nType, nVersion);
     }
 
     template<typename Stream>
     void Unserialize(Stream &s, int nType, int nVersion) {
         unsigned int nCode = 0;
-        // version
-        ::Unserialize(s, VARINT(this->nVersion), nType, nVersion);
-        // header code
         ::Unserialize(s, VARINT(nCode), nType, nVersion);
+        nHeight = nCode / 2;
         fCoinBase = nCode & 1;
-        std::vector<bool> vAvail(2, false);
-        vAvail[0] = nCode & 2;
-        vAvail[1] = nCode & 4;
-        unsigned int nMaskCode = (nCode / 8) + ((nCode & 6) != 0 ? 0 : 1);
-        // spentness bitmask
-        while (nMaskCode > 0) {
-            unsigned char chAvail = 0;
-            ::Unserialize(s, chAvail, nType, nVersion);
-            for (unsigned int p = 0; p < 8; p++) {
-                bool f = (chAvail & (1 << p)) != 0;
-                vAvail.push_back(f);
-            }
-            if (chAvail != 0)
-                nMaskCode--;
-        }
-        // txouts themself
-        vout.assign(vAvail.size(), CTxOut());
-        for (unsigned int i = 0; i < vAvail.size(); i++) {
-            if (vAvail[i])
-                ::Unserialize(s, REF(CTxOutCompressor(vout[i])), nType, nVersion);
-        }
-        // coinbase height
-        ::Unserialize(s, VARINT(nHeight), nType, nVersion);
-        Cleanup();
+        ::Unserialize(s, REF(CTxOutCompressor(out)), nType, nVersion);
+    }
+
+    // heap memory owned by this object (the output script)
+    size_t DynamicMemoryUsage() const {
+        return memusage::DynamicUsage(out.scriptPubKey);
+    }
+};
+
+class COutPointHasher
+{
+private:
+    uint256 salt;
+
+public:
+    COutPointHasher();
+
+    // This must return size_t: with some Boost versions on 32-bit systems
+    // unordered_map misbehaves when the hasher returns a wider type.
+    size_t operator()(const COutPoint& outpoint) const {
+        return outpoint.hash.GetHash(salt, outpoint.n);
     }
+};
+
+struct CCoinsCacheEntry
+{
+    CCoin coin; // The actual cached data.
+    unsigned char flags;
+
+    enum Flags {
+        DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
+        FRESH = (1 << 1), // The parent view does not have this entry (or it is spent).
+    };
+
+    CCoinsCacheEntry() : coin(), flags(0) {}
+};
 
-    // mark an outpoint spent, and construct undo information
-    bool Spend(const COutPoint &out, CTxInUndo &undo);
+typedef boost::unordered_map<COutPoint, CCoinsCacheEntry, COutPointHasher> CCoinsMap;
 
-    // mark a vout spent
-    bool Spend(int nPos);
 
-    // check whether a particular output is still available
-    bool IsAvailable(unsigned int nPos) const {
-        return (nPos < vout.size() && !vout[nPos].IsNull());
+/** Running totals over a set of unspent outputs, or a change to them.
+ *
+ * They are updated with every coin added or spent, and stored next to the
+ * coins in the database, so statistics of the whole set need no scan.
+ * hashSet is the sum modulo 2^256 of the hashes of all (outpoint, coin)
+ * pairs: independent of order and cheap to update, which makes it a good
+ * checksum, but unlike a serialized hash it is no cryptographic commitment.
+ */
+class CCoinsTotals
+{
+public:
+    int64_t nOutputs;
+    int64_t nAmount;
+    int64_t nSerializedSize; // as stored in the database, keys included
+    uint256 hashSet;
+
+    CCoinsTotals() : nOutputs(0), nAmount(0), nSerializedSize(0), hashSet(0) { }
+
+    void Add(const COutPoint &outpoint, const CCoin &coin);
+    void Remove(const COutPoint &outpoint, const CCoin &coin);
+
+    CCoinsTotals& operator+=(const CCoinsTotals &delta) {
+        nOutputs += delta.nOutputs;
+        nAmount += delta.nAmount;
+        nSerializedSize += delta.nSerializedSize;
+        hashSet += delta.hashSet;
+        return *this;
     }
 
-    // check whether the entire CCoins is spent
-    // note that only !IsPruned() CCoins can be serialized
-    bool IsPruned() const {
-        BOOST_FOREACH(const CTxOut &out, vout)
-            if (!out.IsNull())
-                return false;
-        return true;
+    friend bool operator==(const CCoinsTotals &a, const CCoinsTotals &b) {
+        return a.nOutputs == b.nOutputs && a.nAmount == b.nAmount &&
+               a.nSerializedSize == b.nSerializedSize && a.hashSet == b.hashSet;
     }
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(nOutputs);
+        READWRITE(nAmount);
+        READWRITE(nSerializedSize);
+        READWRITE(hashSet);
+    )
 };
 
 
@@ -244,13 +193,20 @@ struct CCoinsStats
 {
     int nHeight;
     uint256 hashBlock;
-    uint64_t nTransactions;
+    uint64_t nTransactions; // only known after a full scan
     uint64_t nTransactionOutputs;
     uint64_t nSerializedSize;
-    uint256 hashSerialized;
+    uint256 hashSet;
     int64_t nTotalAmount;
 
-    CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
+    CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSet(0), nTotalAmount(0) {}
+
+    void SetTotals(const CCoinsTotals &totals) {
+        nTransactionOutputs = totals.nOutputs;
+        nTotalAmount = totals.nAmount;
+        nSerializedSize = totals.nSerializedSize;
+        hashSet = totals.hashSet;
+    }
 };
 
 
@@ -258,15 +214,11 @@ struct CCoinsStats
 class CCoinsView
 {
 public:
-    // Retrieve the CCoins (unspent transaction outputs) for a given txid
-    virtual bool GetCoins(const uint256 &txid, CCoins &coins);
+    // Retrieve the unspent output for a given outpoint
+    virtual bool GetCoin(const COutPoint &outpoint, CCoin &coin);
 
-    // Modify the CCoins for a given txid
-    virtual bool SetCoins(const uint256 &txid, const CCoins &coins);
-
-    // Just check whether we have data for a given txid.
-    // This may (but cannot always) return true for fully spent transactions
-    virtual bool HaveCoins(const uint256 &txid);
+    // Just check whether a given outpoint is unspent
+    virtual bool HaveCoin(const COutPoint &outpoint);
 
     // Retrieve the block hash whose state this CCoinsView currently represents
     virtual uint256 GetBestBlock();
@@ -274,10 +226,16 @@ public:
     // Modify the currently active block hash
     virtual bool SetBestBlock(const uint256 &hashBlock);
 
-    // Do a bulk modification (multiple SetCoins + one SetBestBlock)
-    virtual bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock);
+    // Do a bulk modification (multiple coin changes + one SetBestBlock).
+    // Only entries flagged DIRTY are applied; totalsDelta is the change
+    // they make to the totals of the set.
+    virtual bool BatchWrite(const CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsTotals &totalsDelta);
+
+    // Same as BatchWrite, but the view may take the coins out of mapCoins
+    // instead of copying them. The caller discards mapCoins afterwards.
+    virtual bool BatchMove(CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsTotals &totalsDelta);
 
-    // Calculate statistics about the unspent transaction output set
+    // Statistics about the unspent transaction output set, from its totals
     virtual bool GetStats(CCoinsStats &stats);
 
     // As we use CCoinsViews polymorphically, have a virtual destructor
@@ -293,47 +251,93 @@ protected:
 
 public:
     CCoinsViewBacked(CCoinsView &viewIn);
-    bool GetCoins(const uint256 &txid, CCoins &coins);
-    bool SetCoins(const uint256 &txid, const CCoins &coins);
-    bool HaveCoins(const uint256 &txid);
+    bool GetCoin(const COutPoint &outpoint, CCoin &coin);
+    bool HaveCoin(const COutPoint &outpoint);
     uint256 GetBestBlock();
     bool SetBestBlock(const uint256 &hashBlock);
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock);
+    bool BatchWrite(const CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsTotals &totalsDelta);
+    bool BatchMove(CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsTotals &totalsDelta);
     bool GetStats(CCoinsStats &stats);
 };
 
 
-/** CCoinsView that adds a memory cache for transactions to another CCoinsView */
+/** CCoinsView that adds a memory cache for transaction outputs to another CCoinsView */
 class CCoinsViewCache : public CCoinsViewBacked
 {
 protected:
     uint256 hashBlock;
-    std::map<uint256,CCoins> cacheCoins;
+    CCoinsMap cacheCoins;
+
+    // Heap memory used by the coins in cacheCoins
+    size_t cachedCoinsUsage;
+
+    // Number of entries in cacheCoins flagged DIRTY, which a flush writes
+    size_t nDirty;
+
+    // Change to the totals of the base view made by this cache
+    CCoinsTotals totalsDelta;
+
+    // Lookups answered from cacheCoins, and lookups that went to the base view
+    uint64_t nCacheHits;
+    uint64_t nCacheMisses;
 
 public:
     CCoinsViewCache(CCoinsView &baseIn, bool fDummy = false);
 
     // Standard CCoinsView methods
-    bool GetCoins(const uint256 &txid, CCoins &coins);
-    bool SetCoins(const uint256 &txid, const CCoins &coins);
-    bool HaveCoins(const uint256 &txid);
+    bool GetCoin(const COutPoint &outpoint, CCoin &coin);
+    bool HaveCoin(const COutPoint &outpoint);
     uint256 GetBestBlock();
     bool SetBestBlock(const uint256 &hashBlock);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock);
+    bool BatchWrite(const CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsTotals &totalsDelta);
+    bool BatchMove(CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsTotals &totalsDelta);
+    bool GetStats(CCoinsStats &stats);
+
+    // Check whether an unspent outpoint is already in this cache, without
+    // querying the base view.
+    bool HaveCoinInCache(const COutPoint &outpoint) const;
+
+    // Append the outpoints of up to nMax unspent coins in this cache to vOutPoints
+    void GetCachedOutPoints(std::vector<COutPoint> &vOutPoints, size_t nMax) const;
+
+    // Return a reference to a coin in the cache, or a spent coin if not found.
+    // The reference is only valid until the next modification of the cache.
+    const CCoin &AccessCoin(const COutPoint &outpoint);
 
-    // Return a modifiable reference to a CCoins. Check HaveCoins first.
-    // Many methods explicitly require a CCoinsViewCache because of this method, to reduce
-    // copying.
-    CCoins &GetCoins(const uint256 &txid);
+    // Add a coin. Unless fPossibleOverwrite, the caller guarantees that the
+    // outpoint is not unspent in the base view (see BIP30), which lets the
+    // entry be dropped again without a database write if it is spent before
+    // the next flush.
+    void AddCoin(const COutPoint &outpoint, const CCoin &coin, bool fPossibleOverwrite);
+
+    // Cache a coin that was read from the base view by the caller, unless an
+    // entry for the outpoint exists already. Used to prefetch block inputs.
+    void AddFetchedCoin(const COutPoint &outpoint, const CCoin &coin);
+
+    // Spend a coin, optionally moving its data into *pcoinOut (for undo data).
+    bool SpendCoin(const COutPoint &outpoint, CCoin *pcoinOut = NULL);
 
     // Push the modifications applied to this cache to its base.
     // Failure to call this method before destruction will cause the changes to be forgotten.
-    bool Flush();
+    // With fRetain the unspent entries stay cached (as clean) instead of being dropped;
+    // otherwise the coins are moved into the base rather than copied.
+    bool Flush(bool fRetain = false);
 
-    // Calculate the size of the cache (in number of transactions)
+    // Calculate the size of the cache (in number of outputs)
     unsigned int GetCacheSize();
 
+    // Number of outputs the next flush writes to the base view
+    size_t GetDirtyCount() const { return nDirty; }
+
+    // Lookups since the cache was created that found, or did not find, the
+    // outpoint already cached
+    uint64_t GetCacheHits() const { return nCacheHits; }
+    uint64_t GetCacheMisses() const { return nCacheMisses; }
+
+    // Calculate the memory used by the cache, in bytes
+    size_t DynamicMemoryUsage();
+
     /** Amount of bitcoins coming in to a transaction
         Note that lightweight clients may not know anything besides the hash of previous transactions,
         so may not be able to calculate this.
@@ -352,7 +356,16 @@ public:
     const CTxOut &GetOutputFor(const CTxIn& input);
 
 private:
-    std::map<uint256,CCoins>::iterator FetchCoins(const uint256 &txid);
+    CCoinsMap::iterator FetchCoin(const COutPoint &outpoint);
+    // Apply a dirty entry of a child cache, taking the data of coin
+    void MergeCoin(const COutPoint &outpoint, CCoin &coin, unsigned char flags);
 };
 
+// Add all spendable outputs of a transaction to a cache
+void AddCoins(CCoinsViewCache &cache, const CTransaction &tx, int nHeight);
+
+// Find any unspent output of a transaction in a view. This probes the output
+// indexes one by one, so it is only meant for RPC and wallet lookups.
+const CCoin &AccessByTxid(CCoinsViewCache &cache, const uint256 &txid);
+
 #endif
@@ -72,11 +72,37 @@ void CTxOut::print() const
     LogPrintf("%s\n", ToString());
 }
 
-uint256 CTransaction::GetHash() const
+CMutableTransaction::CMutableTransaction() : nVersion(CTransaction::CURRENT_VERSION), nLockTime(0) {}
+CMutableTransaction::CMutableTransaction(const CTransaction& tx) : nVersion(tx.nVersion), vin(tx.vin.begin(), tx.vin.end()), vout(tx.vout.begin(), tx.vout.end()), nLockTime(tx.nLockTime) {}
+
+uint256 CMutableTransaction::GetHash() const
 {
     return SerializeHash(*this);
 }
 
+void CTransaction::UpdateHash() const
+{
+    *const_cast<unsigned int*>(&nTxSize) = 0;
+    *const_cast<unsigned int*>(&nTxSize) = ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION);
+    *const_cast<uint256*>(&hash) = SerializeHash(*this);
+}
+
+CTransaction::CTransaction() : hash(0), nTxSize(0), nVersion(CTransaction::CURRENT_VERSION), vin(), vout(), nLockTime(0) { }
+
+CTransaction::CTransaction(const CMutableTransaction &tx) : nTxSize(0), nVersion(tx.nVersion), vin(tx.vin.begin(), tx.vin.end()), vout(tx.vout.begin(), tx.vout.end()), nLockTime(tx.nLockTime) {
+    UpdateHash();
+}
+
+CTransaction& CTransaction::operator=(const CTransaction &tx) {
+    *const_cast<int*>(&nVersion) = tx.nVersion;
+    *const_cast<CTxInVector*>(&vin) = tx.vin;
+    *const_cast<CTxOutVector*>(&vout) = tx.vout;
+    *const_cast<unsigned int*>(&nLockTime) = tx.nLockTime;
+    *const_cast<uint256*>(&hash) = tx.hash;
+    *const_cast<unsigned int*>(&nTxSize) = tx.nTxSize;
+    return *this;
+}
+
 bool CTransaction::IsNewerThan(const CTransaction& old) const
 {
     if (vin.size() != old.vin.size())
@@ -217,23 +243,55 @@ uint256 CBlockHeader::GetHash() const
     return Hash(BEGIN(nVersion), END(nNonce));
 }
 
-uint256 CBlock::BuildMerkleTree() const
+uint256 BuildMerkleTreeLevels(std::vector<uint256>& vTree, bool* pfMutated)
+{
+    bool fMutated = false;
+    int j = 0;
+    for (int nSize = vTree.size(); nSize > 1; nSize = (nSize + 1) / 2)
+    {
+        // Adjacent hashes form the 64-byte inputs of the level above, which
+        // are double hashed as one batch; an odd last hash pairs with itself
+        vTree.resize(j + nSize + (nSize + 1) / 2);
+        for (int i = 0; i + 1 < nSize && !fMutated; i += 2)
+            fMutated = (vTree[j+i] == vTree[j+i+1]);
+        SHA256D64((unsigned char*)&vTree[j+nSize], (const unsigned char*)&vTree[j], nSize / 2);
+        if (nSize & 1)
+            vTree[j+nSize+nSize/2] = Hash(BEGIN(vTree[j+nSize-1]), END(vTree[j+nSize-1]),
+                                          BEGIN(vTree[j+nSize-1]), END(vTree[j+nSize-1]));
+        j += nSize;
+    }
+    if (pfMutated)
+        *pfMutated = fMutated;
+    return (vTree.empty() ? 0 : vTree.back());
+}
+
+uint256 CBlock::BuildMerkleTree(bool* pfMutated) const
+{
+    // The txids are cached in the transactions, so the leaves are copies
+    vMerkleTree.resize(vtx.size());
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        vMerkleTree[i] = vtx[i].GetHash();
+    return BuildMerkleTreeLevels(vMerkleTree, pfMutated);
+}
+
+uint256 CBlock::UpdateMerkleTreeCoinbase() const
 {
-    vMerkleTree.clear();
-    BOOST_FOREACH(const CTransaction& tx, vtx)
-        vMerkleTree.push_back(tx.GetHash());
+    // The tree must have the shape BuildMerkleTree gives these transactions
+    size_t nTreeSize = vtx.size();
+    for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+        nTreeSize += (nSize + 1) / 2;
+    if (vtx.empty() || vMerkleTree.size() != nTreeSize)
+        return BuildMerkleTree();
+
+    vMerkleTree[0] = vtx[0].GetHash();
     int j = 0;
     for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
     {
-        for (int i = 0; i < nSize; i += 2)
-        {
-            int i2 = std::min(i+1, nSize-1);
-            vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                       BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
-        }
+        vMerkleTree[j+nSize] = Hash(BEGIN(vMerkleTree[j]), END(vMerkleTree[j]),
+                                    BEGIN(vMerkleTree[j+1]), END(vMerkleTree[j+1]));
         j += nSize;
     }
-    return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
+    return vMerkleTree.back();
 }
 
 std::vector<uint256> CBlock::GetMerkleBranch(int nIndex) const
@@ -6,20 +6,14 @@
 #ifndef BITCOIN_CORE_H
 #define BITCOIN_CORE_H
 
+#include "arena.h"
+#include "powhash.h"
 #include "script.h"
 #include "serialize.h"
 #include "uint256.h"
-#include "scrypt.h"
-#include "hashx11.h"
 
 #include <stdint.h>
 
-enum {
-    ALGO_SHA256D = 0,
-    ALGO_SCRYPT  = 1,
-    ALGO_X11     = 2,
-    NUM_ALGOS };
-
 enum
 {
     // primary version
@@ -230,48 +224,78 @@ public:
 };
 
 
+struct CMutableTransaction;
+
+// The inputs and outputs of a transaction, taken from the arena of the block
+// being deserialized, if any
+typedef std::vector<CTxIn, arena_allocator<CTxIn> > CTxInVector;
+typedef std::vector<CTxOut, arena_allocator<CTxOut> > CTxOutVector;
+
 /** The basic transaction that is broadcasted on the network and contained in
  * blocks.  A transaction can contain multiple inputs and outputs.
+ *
+ * Transactions are immutable once constructed, so their hash is computed
+ * once and cached; build or modify one through CMutableTransaction.
  */
 class CTransaction
 {
+private:
+    /** Memory only. */
+    const uint256 hash;
+    const unsigned int nTxSize;
+    void UpdateHash() const;
+
 public:
     static int64_t nMinTxFee;
     static int64_t nMinRelayTxFee;
     static const int CURRENT_VERSION=1;
-    int nVersion;
-    std::vector<CTxIn> vin;
-    std::vector<CTxOut> vout;
-    unsigned int nLockTime;
 
-    CTransaction()
-    {
-        SetNull();
-    }
+    // The local variables are made const to prevent unintended modification
+    // without updating the cached hash value. However, CTransaction is not
+    // actually immutable; deserialization and assignment are implemented,
+    // and bypass the constness. This is safe, as they update the entire
+    // structure, including the hash.
+    const int nVersion;
+    const CTxInVector vin;
+    const CTxOutVector vout;
+    const unsigned int nLockTime;
+
+    /** Construct a CTransaction that qualifies as IsNull() */
+    CTransaction();
+
+    /** Convert a CMutableTransaction into a CTransaction. */
+    CTransaction(const CMutableTransaction &tx);
+
+    CTransaction& operator=(const CTransaction& tx);
 
     IMPLEMENT_SERIALIZE
     (
-        READWRITE(this->nVersion);
-        nVersion = this->nVersion;
-        READWRITE(vin);
-        READWRITE(vout);
-        READWRITE(nLockTime);
+        // The size does not depend on the serialization type or version,
+        // so it is cached along with the hash
+        if (fGetSize && nTxSize != 0)
+            nSerSize = nTxSize;
+        else
+        {
+            READWRITE(*const_cast<int*>(&this->nVersion));
+            nVersion = this->nVersion;
+            READWRITE(*const_cast<CTxInVector*>(&vin));
+            READWRITE(*const_cast<CTxOutVector*>(&vout));
+            READWRITE(*const_cast<unsigned int*>(&nLockTime));
+        }
+        if (fRead)
+            UpdateHash();
     )
 
-    void SetNull()
+    bool IsNull() const
     {
-        nVersion = CTransaction::CURRENT_VERSION;
-        vin.clear();
-        vout.clear();
-        nLockTime = 0;
+        return (vin.empty() && vout.empty());
     }
 
-    bool IsNull() const
+    const uint256& GetHash() const
     {
-        return (vin.empty() && vout.empty());
+        return hash;
     }
 
-    uint256 GetHash() const;
     bool IsNewerThan(const CTransaction& old) const;
 
     // Return sum of txouts.
@@ -289,15 +313,12 @@ public:
 
     friend bool operator==(const CTransaction& a, const CTransaction& b)
     {
-        return (a.nVersion  == b.nVersion &&
-                a.vin       == b.vin &&
-                a.vout      == b.vout &&
-                a.nLockTime == b.nLockTime);
+        return a.hash == b.hash;
     }
 
     friend bool operator!=(const CTransaction& a, const CTransaction& b)
     {
-        return !(a == b);
+        return a.hash != b.hash;
     }
 
 
@@ -305,6 +326,32 @@ public:
     void print() const;
 };
 
+/** A mutable version of CTransaction, for the wallet, miner and tests to build transactions with. */
+struct CMutableTransaction
+{
+    int nVersion;
+    std::vector<CTxIn> vin;
+    std::vector<CTxOut> vout;
+    unsigned int nLockTime;
+
+    CMutableTransaction();
+    CMutableTransaction(const CTransaction& tx);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(this->nVersion);
+        nVersion = this->nVersion;
+        READWRITE(vin);
+        READWRITE(vout);
+        READWRITE(nLockTime);
+    )
+
+    /** Compute the hash of this CMutableTransaction. This is computed on the
+     * fly, as opposed to GetHash() in CTransaction, which uses a cached result.
+     */
+    uint256 GetHash() const;
+};
+
 /** wrapper for CTxOut that provides a more compact serialization */
 class CTxOutCompressor
 {
@@ -447,19 +494,20 @@ public:
         switch (algo)
         {
             case ALGO_SHA256D:
-                return GetHash();
+                return GetPoWHash<ALGO_SHA256D>();
             case ALGO_SCRYPT:
-            {
-                uint256 thash;
-                // Caution: scrypt_1024_1_1_256 assumes fixed length of 80 bytes
-                scrypt_1024_1_1_256(BEGIN(nVersion), BEGIN(thash));
-                return thash;
-            }
+                return GetPoWHash<ALGO_SCRYPT>();
             case ALGO_X11:
-                return HashX11(BEGIN(nVersion), END(nNonce));
+                return GetPoWHash<ALGO_X11>();
         }
         return GetHash();
     }
+    // For callers that know the algo at compile time
+    template<int algo>
+    uint256 GetPoWHash() const
+    {
+        return CPowHasher<algo>::Hash(BEGIN(nVersion));
+    }
     int64_t GetBlockTime() const
     {
         return (int64_t)nTime;
@@ -467,6 +515,13 @@ public:
 };
 
 
+/** Append the levels of a merkle tree above its leaves, which are all of
+ *  vTree on entry; an odd last hash of a level pairs with itself. Returns
+ *  the root, 0 without leaves. *pfMutated, if given, is set when a level
+ *  pairs two equal hashes: a list of transactions with some duplicated
+ *  has the same root as without them (CVE-2012-2459). */
+uint256 BuildMerkleTreeLevels(std::vector<uint256>& vTree, bool* pfMutated = NULL);
+
 class CBlock : public CBlockHeader
 {
 public:
@@ -512,7 +567,10 @@ public:
         return block;
     }
 
-    uint256 BuildMerkleTree() const;
+    uint256 BuildMerkleTree(bool* pfMutated = NULL) const;
+    // The merkle root after only vtx[0] changed, from the tree built before:
+    // just the hashes on the path of the coinbase are computed again
+    uint256 UpdateMerkleTreeCoinbase() const;
 
     const uint256 &GetTxHash(unsigned int nIndex) const {
         assert(vMerkleTree.size() > 0); // BuildMerkleTree must have been called first
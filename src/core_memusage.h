@@ -0,0 +1,25 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CORE_MEMUSAGE_H
+#define BITCOIN_CORE_MEMUSAGE_H
+
+#include "core.h"
+#include "memusage.h"
+
+#include <boost/foreach.hpp>
+
+// Dynamic memory usage of a transaction: its inputs and outputs and their
+// scripts, not counting the CTransaction object itself.
+static inline size_t RecursiveDynamicUsage(const CTransaction& tx)
+{
+    size_t nUsage = memusage::DynamicUsage(tx.vin) + memusage::DynamicUsage(tx.vout);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += memusage::DynamicUsage(txin.scriptSig);
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += memusage::DynamicUsage(txout.scriptPubKey);
+    return nUsage;
+}
+
+#endif // BITCOIN_CORE_MEMUSAGE_H
@@ -127,6 +127,7 @@ bool CCryptoKeyStore::SetCrypted()
         return true;
     if (!mapKeys.empty())
         return false;
+    WRITE_LOCK(cs_KeyStoreMaps);
     fUseCrypto = true;
     return true;
 }
@@ -138,6 +139,7 @@ bool CCryptoKeyStore::Lock()
 
     {
         LOCK(cs_KeyStore);
+        WRITE_LOCK(cs_KeyStoreMaps);
         vMasterKey.clear();
     }
 
@@ -168,6 +170,7 @@ bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
                 break;
             return false;
         }
+        WRITE_LOCK(cs_KeyStoreMaps);
         vMasterKey = vMasterKeyIn;
     }
     NotifyStatusChanged(this);
@@ -203,6 +206,7 @@ bool CCryptoKeyStore::AddCryptedKey(const CPubKey &vchPubKey, const std::vector<
         if (!SetCrypted())
             return false;
 
+        WRITE_LOCK(cs_KeyStoreMaps);
         mapCryptedKeys[vchPubKey.GetID()] = make_pair(vchPubKey, vchCryptedSecret);
     }
     return true;
@@ -211,9 +215,15 @@ bool CCryptoKeyStore::AddCryptedKey(const CPubKey &vchPubKey, const std::vector<
 bool CCryptoKeyStore::GetKey(const CKeyID &address, CKey& keyOut) const
 {
     {
-        LOCK(cs_KeyStore);
-        if (!IsCrypted())
-            return CBasicKeyStore::GetKey(address, keyOut);
+        READ_LOCK(cs_KeyStoreMaps);
+        if (!fUseCrypto)
+        {
+            KeyMap::const_iterator mi = mapKeys.find(address);
+            if (mi == mapKeys.end())
+                return false;
+            keyOut = mi->second;
+            return true;
+        }
 
         CryptedKeyMap::const_iterator mi = mapCryptedKeys.find(address);
         if (mi != mapCryptedKeys.end())
@@ -235,9 +245,15 @@ bool CCryptoKeyStore::GetKey(const CKeyID &address, CKey& keyOut) const
 bool CCryptoKeyStore::GetPubKey(const CKeyID &address, CPubKey& vchPubKeyOut) const
 {
     {
-        LOCK(cs_KeyStore);
-        if (!IsCrypted())
-            return CKeyStore::GetPubKey(address, vchPubKeyOut);
+        READ_LOCK(cs_KeyStoreMaps);
+        if (!fUseCrypto)
+        {
+            KeyMap::const_iterator mi = mapKeys.find(address);
+            if (mi == mapKeys.end())
+                return false;
+            vchPubKeyOut = mi->second.GetPubKey();
+            return true;
+        }
 
         CryptedKeyMap::const_iterator mi = mapCryptedKeys.find(address);
         if (mi != mapCryptedKeys.end())
@@ -256,7 +272,10 @@ bool CCryptoKeyStore::EncryptKeys(CKeyingMaterial& vMasterKeyIn)
         if (!mapCryptedKeys.empty() || IsCrypted())
             return false;
 
-        fUseCrypto = true;
+        {
+            WRITE_LOCK(cs_KeyStoreMaps);
+            fUseCrypto = true;
+        }
         BOOST_FOREACH(KeyMap::value_type& mKey, mapKeys)
         {
             const CKey &key = mKey.second;
@@ -268,6 +287,7 @@ bool CCryptoKeyStore::EncryptKeys(CKeyingMaterial& vMasterKeyIn)
             if (!AddCryptedKey(vchPubKey, vchCryptedSecret))
                 return false;
         }
+        WRITE_LOCK(cs_KeyStoreMaps);
         mapKeys.clear();
     }
     return true;
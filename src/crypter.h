@@ -116,6 +116,7 @@ private:
 
     // if fUseCrypto is true, mapKeys must be empty
     // if fUseCrypto is false, vMasterKey must be empty
+    // Both are guarded like the maps, by cs_KeyStoreMaps
     bool fUseCrypto;
 
 protected:
@@ -141,14 +142,8 @@ public:
 
     bool IsLocked() const
     {
-        if (!IsCrypted())
-            return false;
-        bool result;
-        {
-            LOCK(cs_KeyStore);
-            result = vMasterKey.empty();
-        }
-        return result;
+        READ_LOCK(cs_KeyStoreMaps);
+        return fUseCrypto && vMasterKey.empty();
     }
 
     bool Lock();
@@ -157,24 +152,23 @@ public:
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey);
     bool HaveKey(const CKeyID &address) const
     {
-        {
-            LOCK(cs_KeyStore);
-            if (!IsCrypted())
-                return CBasicKeyStore::HaveKey(address);
-            return mapCryptedKeys.count(address) > 0;
-        }
-        return false;
+        READ_LOCK(cs_KeyStoreMaps);
+        if (!fUseCrypto)
+            return mapKeys.count(address) > 0;
+        return mapCryptedKeys.count(address) > 0;
     }
     bool GetKey(const CKeyID &address, CKey& keyOut) const;
     bool GetPubKey(const CKeyID &address, CPubKey& vchPubKeyOut) const;
     void GetKeys(std::set<CKeyID> &setAddress) const
     {
-        if (!IsCrypted())
+        setAddress.clear();
+        READ_LOCK(cs_KeyStoreMaps);
+        if (!fUseCrypto)
         {
-            CBasicKeyStore::GetKeys(setAddress);
+            for (KeyMap::const_iterator mi = mapKeys.begin(); mi != mapKeys.end(); ++mi)
+                setAddress.insert((*mi).first);
             return;
         }
-        setAddress.clear();
         CryptedKeyMap::const_iterator mi = mapCryptedKeys.begin();
         while (mi != mapCryptedKeys.end())
         {
@@ -7,6 +7,7 @@
 
 #include "addrman.h"
 #include "hash.h"
+#include "leveldbwrapper.h"
 #include "protocol.h"
 #include "util.h"
 
@@ -26,6 +27,15 @@ using namespace boost;
 
 unsigned int nWalletDBUpdated;
 
+/** Writes of a transaction on a store, seen by the reads of its handles and
+ *  applied in one write of the store when it is committed */
+class CDBStoreTxn
+{
+public:
+    // serialized key -> whether it is erased, and the serialized value written
+    std::map<std::string, std::pair<bool, std::string> > mapWrites;
+};
+
 
 
 //
@@ -56,6 +66,8 @@ CDBEnv::CDBEnv() : dbenv(DB_CXX_NO_EXCEPTIONS)
 CDBEnv::~CDBEnv()
 {
     EnvShutdown();
+    for (map<string, CLevelDBWrapper*>::iterator mi = mapStore.begin(); mi != mapStore.end(); mi++)
+        delete mi->second;
 }
 
 void CDBEnv::Close()
@@ -80,10 +92,18 @@ bool CDBEnv::Open(const boost::filesystem::path& pathIn)
     if (GetBoolArg("-privdb", true))
         nEnvFlags |= DB_PRIVATE;
 
+    // The defaults should be enough for just the wallet; a log file must
+    // hold at least four log buffers
+    int64_t nCacheMiB = std::max(GetArg("-walletdbcache", DEFAULT_WALLET_DB_CACHE), (int64_t)1);
+    int64_t nLogBufferKiB = std::max(GetArg("-walletdblogbuffer", DEFAULT_WALLET_DB_LOG_BUFFER), (int64_t)32);
+    nCacheMiB = std::min(nCacheMiB, (int64_t)1024);
+    nLogBufferKiB = std::min(nLogBufferKiB, (int64_t)16384);
+    LogPrintf("CDBEnv::Open : Cache %d MiB, log buffer %d KiB\n", nCacheMiB, nLogBufferKiB);
+
     dbenv.set_lg_dir(pathLogDir.string().c_str());
-    dbenv.set_cachesize(0, 0x100000, 1); // 1 MiB should be enough for just the wallet
-    dbenv.set_lg_bsize(0x10000);
-    dbenv.set_lg_max(1048576);
+    dbenv.set_cachesize(0, nCacheMiB << 20, 1);
+    dbenv.set_lg_bsize(nLogBufferKiB << 10);
+    dbenv.set_lg_max(std::max((int64_t)1048576, nLogBufferKiB << 12));
     dbenv.set_lk_max_locks(40000);
     dbenv.set_lk_max_objects(40000);
     dbenv.set_errfile(fopen(pathErrorFile.string().c_str(), "a")); /// debug
@@ -220,9 +240,31 @@ void CDBEnv::CheckpointLSN(std::string strFile)
     dbenv.lsn_reset(strFile.c_str(), 0);
 }
 
+bool CDBEnv::FlushFile(const std::string& strFile, int64_t& nCheckpointMicros, int64_t& nDetachMicros)
+{
+    // Write the log and the dirty pages of every file while handles stay
+    // in use, which leaves little for the detach below
+    int64_t nStart = GetTimeMicros();
+    dbenv.txn_checkpoint(0, 0, 0);
+    nCheckpointMicros = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    {
+        LOCK(cs_db);
+        map<string, int>::iterator mi = mapFileUseCount.find(strFile);
+        if (mi == mapFileUseCount.end() || mi->second != 0)
+            return false;
+        CloseDb(strFile);
+        CheckpointLSN(strFile);
+        mapFileUseCount.erase(mi);
+    }
+    nDetachMicros = GetTimeMicros() - nStart;
+    return true;
+}
+
 
 CDB::CDB(const char *pszFile, const char* pszMode) :
-    pdb(NULL), activeTxn(NULL)
+    pdb(NULL), pldb(NULL), activeTxn(NULL), pstoreTxn(NULL), fBatched(false), fWritten(false)
 {
     int ret;
     if (pszFile == NULL)
@@ -236,13 +278,17 @@ CDB::CDB(const char *pszFile, const char* pszMode) :
 
     {
         LOCK(bitdb.cs_db);
-        if (!bitdb.Open(GetDataDir()))
+        map<string, CLevelDBWrapper*>::iterator mis = bitdb.mapStore.find(pszFile);
+        if (mis != bitdb.mapStore.end())
+            pldb = mis->second;
+        else if (!bitdb.Open(GetDataDir()))
             throw runtime_error("CDB : Failed to open database environment.");
 
         strFile = pszFile;
         ++bitdb.mapFileUseCount[strFile];
-        pdb = bitdb.mapDb[strFile];
-        if (pdb == NULL)
+        if (!pldb)
+            pdb = bitdb.mapDb[strFile];
+        if (!pldb && pdb == NULL)
         {
             pdb = new Db(&bitdb.dbenv, 0);
 
@@ -281,14 +327,37 @@ CDB::CDB(const char *pszFile, const char* pszMode) :
 
             bitdb.mapDb[strFile] = pdb;
         }
+
+        map<string, pair<boost::thread::id, CDB*> >::iterator mi = bitdb.mapBatchTxn.find(strFile);
+        if (mi != bitdb.mapBatchTxn.end() && mi->second.first == boost::this_thread::get_id())
+        {
+            activeTxn = mi->second.second->activeTxn;
+            pstoreTxn = mi->second.second->pstoreTxn;
+            fBatched = true;
+        }
     }
 }
 
 void CDB::Flush()
 {
-    if (activeTxn)
+    if (activeTxn || pstoreTxn)
         return;
 
+    // Sync the log of a store, if this handle appended to it
+    if (pldb)
+    {
+        if (fWritten)
+        {
+            try {
+                pldb->Sync();
+            } catch (leveldb_error &e) {
+                LogPrintf("CDB::Flush : Failed to sync %s: %s\n", strFile, e.what());
+            }
+            fWritten = false;
+        }
+        return;
+    }
+
     // Flush database activity from memory pool to disk log
     unsigned int nMinutes = 0;
     if (fReadOnly)
@@ -299,14 +368,21 @@ void CDB::Flush()
 
 void CDB::Close()
 {
-    if (!pdb)
+    if (!pdb && !pldb)
         return;
-    if (activeTxn)
+    if (activeTxn && !fBatched)
         activeTxn->abort();
+    if (pstoreTxn && !fBatched)
+        delete pstoreTxn;
     activeTxn = NULL;
-    pdb = NULL;
+    pstoreTxn = NULL;
 
-    Flush();
+    // Checkpointed once the batch is committed
+    if (!fBatched)
+        Flush();
+    fBatched = false;
+    pdb = NULL;
+    pldb = NULL;
 
     {
         LOCK(bitdb.cs_db);
@@ -314,6 +390,215 @@ void CDB::Close()
     }
 }
 
+CDBCursor::~CDBCursor()
+{
+    if (pdbc)
+        pdbc->close();
+    delete piter;
+}
+
+CDBCursor* CDB::GetCursor()
+{
+    if (pldb)
+        return new CDBCursor(pldb->NewIterator());
+    if (!pdb)
+        return NULL;
+    Dbc* pcursor = NULL;
+    int ret = pdb->cursor(activeTxn, &pcursor, 0);
+    if (ret != 0)
+        return NULL;
+    return new CDBCursor(pcursor);
+}
+
+bool CDB::TxnBegin()
+{
+    if (fBatched)
+        return true;
+    if (pldb)
+    {
+        if (pstoreTxn)
+            return false;
+        pstoreTxn = new CDBStoreTxn();
+        return true;
+    }
+    if (!pdb || activeTxn)
+        return false;
+    DbTxn* ptxn = bitdb.TxnBegin();
+    if (!ptxn)
+        return false;
+    activeTxn = ptxn;
+    return true;
+}
+
+bool CDB::TxnCommit()
+{
+    if (fBatched)
+        return true;
+    if (pldb)
+    {
+        if (!pstoreTxn)
+            return false;
+        CLevelDBBatch batch;
+        for (map<string, pair<bool, string> >::const_iterator mi = pstoreTxn->mapWrites.begin(); mi != pstoreTxn->mapWrites.end(); mi++)
+        {
+            if (mi->second.first)
+                batch.EraseRaw(mi->first);
+            else
+                batch.WriteRaw(mi->first, mi->second.second);
+        }
+        delete pstoreTxn;
+        pstoreTxn = NULL;
+        try {
+            return pldb->WriteBatch(batch, true);
+        } catch (leveldb_error &e) {
+            return error("CDB::TxnCommit : Failed to write %s: %s", strFile, e.what());
+        }
+    }
+    if (!pdb || !activeTxn)
+        return false;
+    int ret = activeTxn->commit(0);
+    activeTxn = NULL;
+    return (ret == 0);
+}
+
+bool CDB::TxnAbort()
+{
+    if (fBatched)
+        return false;
+    if (pldb)
+    {
+        if (!pstoreTxn)
+            return false;
+        delete pstoreTxn;
+        pstoreTxn = NULL;
+        return true;
+    }
+    if (!pdb || !activeTxn)
+        return false;
+    int ret = activeTxn->abort();
+    activeTxn = NULL;
+    return (ret == 0);
+}
+
+bool CDB::ReadStore(const CDataStream& ssKey, CDataStream& ssValue)
+{
+    string strKey(ssKey.begin(), ssKey.end());
+    string strValue;
+    map<string, pair<bool, string> >::const_iterator mi;
+    if (pstoreTxn && (mi = pstoreTxn->mapWrites.find(strKey)) != pstoreTxn->mapWrites.end())
+    {
+        if (mi->second.first)
+            return false;
+        strValue = mi->second.second;
+    }
+    else
+    {
+        try {
+            if (!pldb->ReadRaw(strKey, strValue))
+                return false;
+        } catch (leveldb_error &e) {
+            return false;
+        }
+    }
+    ssValue.write(strValue.data(), strValue.size());
+    return true;
+}
+
+bool CDB::WriteStore(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite)
+{
+    if (!fOverwrite)
+    {
+        CDataStream ssExisting(SER_DISK, CLIENT_VERSION);
+        if (ReadStore(ssKey, ssExisting))
+            return false;
+    }
+    string strKey(ssKey.begin(), ssKey.end());
+    string strValue(ssValue.begin(), ssValue.end());
+    if (pstoreTxn)
+    {
+        pstoreTxn->mapWrites[strKey] = make_pair(false, strValue);
+        return true;
+    }
+    CLevelDBBatch batch;
+    batch.WriteRaw(strKey, strValue);
+    try {
+        pldb->WriteBatch(batch);
+    } catch (leveldb_error &e) {
+        return error("CDB::WriteStore : Failed to write %s: %s", strFile, e.what());
+    }
+    fWritten = true;
+    return true;
+}
+
+bool CDB::EraseStore(const CDataStream& ssKey)
+{
+    string strKey(ssKey.begin(), ssKey.end());
+    if (pstoreTxn)
+    {
+        pstoreTxn->mapWrites[strKey] = make_pair(true, string());
+        return true;
+    }
+    CLevelDBBatch batch;
+    batch.EraseRaw(strKey);
+    try {
+        pldb->WriteBatch(batch);
+    } catch (leveldb_error &e) {
+        return error("CDB::EraseStore : Failed to write %s: %s", strFile, e.what());
+    }
+    fWritten = true;
+    return true;
+}
+
+int CDB::ReadAtStoreCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags)
+{
+    leveldb::Iterator* piter = pcursor->piter;
+    if (fFlags == DB_SET_RANGE)
+        piter->Seek(leveldb::Slice(&ssKey[0], ssKey.size()));
+    else if (fFlags == DB_FIRST || (fFlags == DB_NEXT && !pcursor->fPositioned))
+        piter->SeekToFirst();
+    else if (fFlags == DB_NEXT && piter->Valid())
+        piter->Next();
+    else if (fFlags != DB_NEXT)
+        return EINVAL;
+    pcursor->fPositioned = true;
+    if (!piter->Valid())
+        return piter->status().ok() ? DB_NOTFOUND : 99999;
+
+    // Convert to streams
+    leveldb::Slice slKey = piter->key();
+    leveldb::Slice slValue = piter->value();
+    ssKey.SetType(SER_DISK);
+    ssKey.clear();
+    ssKey.write(slKey.data(), slKey.size());
+    ssValue.SetType(SER_DISK);
+    ssValue.clear();
+    ssValue.write(slValue.data(), slValue.size());
+    return 0;
+}
+
+CDBBatch::CDBBatch(const char* pszFile) : CDB(pszFile, "r+"), fOwner(false)
+{
+    if ((!pdb && !pldb) || fBatched)
+        return;
+    if (!TxnBegin())
+        throw runtime_error(strprintf("CDBBatch : Failed to begin a transaction on %s", strFile));
+    fOwner = true;
+    LOCK(bitdb.cs_db);
+    bitdb.mapBatchTxn[strFile] = make_pair(boost::this_thread::get_id(), (CDB*)this);
+}
+
+CDBBatch::~CDBBatch()
+{
+    if (!fOwner)
+        return;
+    {
+        LOCK(bitdb.cs_db);
+        bitdb.mapBatchTxn.erase(strFile);
+    }
+    if (!TxnCommit())
+        LogPrintf("CDBBatch : Failed to commit the transaction on %s\n", strFile);
+}
+
 void CDBEnv::CloseDb(const string& strFile)
 {
     {
@@ -340,6 +625,9 @@ bool CDBEnv::RemoveDb(const string& strFile)
 
 bool CDB::Rewrite(const string& strFile, const char* pszSkip)
 {
+    if (bitdb.IsStore(strFile))
+        return RewriteStore(strFile, pszSkip);
+
     while (true)
     {
         {
@@ -370,7 +658,7 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                         fSuccess = false;
                     }
 
-                    Dbc* pcursor = db.GetCursor();
+                    CDBCursor* pcursor = db.GetCursor();
                     if (pcursor)
                         while (fSuccess)
                         {
@@ -379,12 +667,12 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                             int ret = db.ReadAtCursor(pcursor, ssKey, ssValue, DB_NEXT);
                             if (ret == DB_NOTFOUND)
                             {
-                                pcursor->close();
+                                delete pcursor;
                                 break;
                             }
                             else if (ret != 0)
                             {
-                                pcursor->close();
+                                delete pcursor;
                                 fSuccess = false;
                                 break;
                             }
@@ -431,10 +719,160 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
     return false;
 }
 
+// A store is rewritten in place: the skipped records are erased, and the
+// compaction of the store drops the earlier values of all records from its
+// files, as the rewrite of a Berkeley DB file does
+bool CDB::RewriteStore(const string& strFile, const char* pszSkip)
+{
+    LogPrintf("CDB::Rewrite : Compacting %s...\n", strFile);
+    CDB db(strFile.c_str(), "r+");
+    bool fSuccess = db.TxnBegin();
+    CDBCursor* pcursor = fSuccess ? db.GetCursor() : NULL;
+    while (pcursor && pszSkip)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        int ret = db.ReadAtCursor(pcursor, ssKey, ssValue, DB_NEXT);
+        if (ret == DB_NOTFOUND)
+            break;
+        else if (ret != 0)
+        {
+            fSuccess = false;
+            break;
+        }
+        if (strncmp(&ssKey[0], pszSkip, std::min(ssKey.size(), strlen(pszSkip))) == 0)
+            db.EraseStore(ssKey);
+    }
+    delete pcursor;
+    if (fSuccess)
+        fSuccess = db.WriteVersion(CLIENT_VERSION) && db.TxnCommit();
+    if (fSuccess)
+    {
+        try {
+            db.pldb->Compact();
+        } catch (leveldb_error &e) {
+            fSuccess = false;
+        }
+    }
+    if (!fSuccess)
+        LogPrintf("CDB::Rewrite : Failed to compact %s\n", strFile);
+    return fSuccess;
+}
+
+bool CDB::CopyToStore(const string& strFile, const boost::filesystem::path& pathStore)
+{
+    unsigned int nRecords = 0;
+    try {
+        CLevelDBWrapper store("walletstore", pathStore, WALLET_STORE_CACHE_SIZE, false, true);
+        CDB db(strFile.c_str(), "r");
+        CDBCursor* pcursor = db.GetCursor();
+        if (!pcursor)
+            return error("CDB::CopyToStore : Cannot get a cursor on %s", strFile);
+        CLevelDBBatch batch;
+        while (true)
+        {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            int ret = db.ReadAtCursor(pcursor, ssKey, ssValue, DB_NEXT);
+            if (ret == DB_NOTFOUND)
+                break;
+            else if (ret != 0)
+            {
+                delete pcursor;
+                return error("CDB::CopyToStore : Error %d reading %s", ret, strFile);
+            }
+            batch.WriteRaw(string(ssKey.begin(), ssKey.end()), string(ssValue.begin(), ssValue.end()));
+
+            // Bound the memory used by the copy of a large file
+            if (++nRecords % 1000 == 0)
+            {
+                store.WriteBatch(batch);
+                batch = CLevelDBBatch();
+            }
+        }
+        delete pcursor;
+        store.WriteBatch(batch, true);
+    } catch (std::exception &e) {
+        return error("CDB::CopyToStore : Failed to copy %s to %s: %s", strFile, pathStore.string(), e.what());
+    }
+    LogPrintf("CDB::CopyToStore : Copied %u records of %s to %s\n", nRecords, strFile, pathStore.string());
+    return true;
+}
+
+
+boost::filesystem::path CDBEnv::StorePath(const string& strFile)
+{
+    return GetDataDir() / (strFile + ".ldb");
+}
+
+bool CDBEnv::OpenStore(const string& strFile)
+{
+    LOCK(cs_db);
+    if (mapStore.count(strFile))
+        return true;
+    assert(mapFileUseCount.count(strFile) == 0);
+
+    // The new store is only put in place once it is complete, so that an
+    // interrupted migration starts over from the Berkeley DB file. That file
+    // is kept afterwards, out of the way, as a backup.
+    filesystem::path pathStore = StorePath(strFile);
+    if (!filesystem::exists(pathStore) && filesystem::exists(GetDataDir() / strFile))
+    {
+        LogPrintf("CDBEnv::OpenStore : Migrating %s to %s\n", strFile, pathStore.string());
+        filesystem::path pathTmp = GetDataDir() / (strFile + ".ldb.tmp");
+        if (!CDB::CopyToStore(strFile, pathTmp))
+            return false;
+        CloseDb(strFile);
+        CheckpointLSN(strFile);
+        mapFileUseCount.erase(strFile);
+        try {
+            filesystem::rename(pathTmp, pathStore);
+        } catch (const filesystem::filesystem_error &e) {
+            return error("CDBEnv::OpenStore : Failed to move %s to %s: %s", pathTmp.string(), pathStore.string(), e.what());
+        }
+        string strFileBak = strFile + ".bdb";
+        int ret = dbenv.dbrename(NULL, strFile.c_str(), NULL, strFileBak.c_str(), DB_AUTO_COMMIT);
+        if (ret != 0)
+            return error("CDBEnv::OpenStore : Error %d moving %s to %s", ret, strFile, strFileBak);
+        LogPrintf("CDBEnv::OpenStore : Moved %s to %s\n", strFile, strFileBak);
+    }
+
+    try {
+        CLevelDBWrapper* pstore = new CLevelDBWrapper("walletstore", pathStore, WALLET_STORE_CACHE_SIZE);
+        if (!pstore->Exists(string("version")))
+            pstore->Write(string("version"), CLIENT_VERSION, true);
+        mapStore[strFile] = pstore;
+    } catch (std::exception &e) {
+        return error("CDBEnv::OpenStore : Failed to open %s: %s", pathStore.string(), e.what());
+    }
+    return true;
+}
+
+void CDBEnv::CloseStores()
+{
+    LOCK(cs_db);
+    map<string, CLevelDBWrapper*>::iterator mi = mapStore.begin();
+    while (mi != mapStore.end())
+    {
+        if (mapFileUseCount.count(mi->first) && mapFileUseCount[mi->first] > 0)
+        {
+            mi++;
+            continue;
+        }
+        LogPrint("db", "CDBEnv::CloseStores : Closing %s\n", mi->first);
+        delete mi->second;
+        mapFileUseCount.erase(mi->first);
+        mapStore.erase(mi++);
+    }
+}
+
 
 void CDBEnv::Flush(bool fShutdown)
 {
     int64_t nStart = GetTimeMillis();
+    if (fShutdown)
+        CloseStores();
+
     // Flush log data to the actual data file on all files that are not in use
     LogPrint("db", "CDBEnv::Flush : Flush(%s)%s\n", fShutdown ? "true" : "false", fDbEnvInit ? "" : " database not started");
     if (!fDbEnvInit)
@@ -447,7 +885,9 @@ void CDBEnv::Flush(bool fShutdown)
             string strFile = (*mi).first;
             int nRefCount = (*mi).second;
             LogPrint("db", "CDBEnv::Flush : Flushing %s (refcount = %d)...\n", strFile, nRefCount);
-            if (nRefCount == 0)
+            if (nRefCount == 0 && mapStore.count(strFile))
+                mi++;
+            else if (nRefCount == 0)
             {
                 // Move log data to the dat file
                 CloseDb(strFile);
@@ -15,12 +15,24 @@
 #include <vector>
 
 #include <boost/filesystem/path.hpp>
+#include <boost/thread/thread.hpp>
 #include <db_cxx.h>
 
 class CAddrMan;
 struct CBlockLocator;
+class CDB;
+class CDBStoreTxn;
 class CDiskBlockIndex;
+class CLevelDBWrapper;
 class COutPoint;
+namespace leveldb { class Iterator; }
+
+// Cache of the LevelDB store of a wallet file, see -walletleveldb
+static const size_t WALLET_STORE_CACHE_SIZE = 4 << 20;
+// Cache and log buffer of the wallet environment, in MiB and KiB, see
+// -walletdbcache and -walletdblogbuffer
+static const int DEFAULT_WALLET_DB_CACHE = 1;
+static const int DEFAULT_WALLET_DB_LOG_BUFFER = 64;
 
 extern unsigned int nWalletDBUpdated;
 
@@ -41,6 +53,10 @@ public:
     DbEnv dbenv;
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
+    // The handle of the write batch open on a file, and its thread
+    std::map<std::string, std::pair<boost::thread::id, CDB*> > mapBatchTxn;
+    // Files kept in a LevelDB store instead of Berkeley DB
+    std::map<std::string, CLevelDBWrapper*> mapStore;
 
     CDBEnv();
     ~CDBEnv();
@@ -69,10 +85,34 @@ public:
     void Close();
     void Flush(bool fShutdown);
     void CheckpointLSN(std::string strFile);
+    /*
+     * Move the log data of strFile into it, if no handle uses it, so the
+     * file is self contained. The environment is checkpointed without
+     * holding cs_db, so handles only wait for strFile to be detached.
+     * Returns false if strFile was in use; otherwise sets how long the
+     * checkpoint and the detach took.
+     */
+    bool FlushFile(const std::string& strFile, int64_t& nCheckpointMicros, int64_t& nDetachMicros);
 
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
 
+    /*
+     * Keep strFile in a LevelDB store, <strFile>.ldb in the data directory,
+     * instead of Berkeley DB. Writes to a store are appended to its log, and
+     * there is no environment to checkpoint. An existing strFile is migrated
+     * into a new store first, and kept as <strFile>.bdb.
+     * This must be called BEFORE strFile is opened.
+     */
+    bool OpenStore(const std::string& strFile);
+    void CloseStores();
+    bool IsStore(const std::string& strFile)
+    {
+        LOCK(cs_db);
+        return mapStore.count(strFile) > 0;
+    }
+    static boost::filesystem::path StorePath(const std::string& strFile);
+
     DbTxn *TxnBegin(int flags=DB_TXN_WRITE_NOSYNC)
     {
         DbTxn* ptxn = NULL;
@@ -86,14 +126,38 @@ public:
 extern CDBEnv bitdb;
 
 
-/** RAII class that provides access to a Berkeley database */
+/** Cursor over the records of a database file, from CDB::GetCursor. Deleting
+ *  it closes it. */
+class CDBCursor
+{
+public:
+    Dbc* pdbc;                  // on a Berkeley DB file
+    leveldb::Iterator* piter;   // on a LevelDB store
+    bool fPositioned;           // piter was positioned by an earlier read
+
+    explicit CDBCursor(Dbc* pdbcIn) : pdbc(pdbcIn), piter(NULL), fPositioned(false) {}
+    explicit CDBCursor(leveldb::Iterator* piterIn) : pdbc(NULL), piter(piterIn), fPositioned(false) {}
+    ~CDBCursor();
+
+private:
+    CDBCursor(const CDBCursor&);
+    void operator=(const CDBCursor&);
+};
+
+
+/** RAII class that provides access to a Berkeley database, or to the LevelDB
+ *  store that replaces it */
 class CDB
 {
 protected:
     Db* pdb;
+    CLevelDBWrapper* pldb;  // instead of pdb for a store
     std::string strFile;
     DbTxn *activeTxn;
+    CDBStoreTxn *pstoreTxn; // instead of activeTxn for a store
     bool fReadOnly;
+    bool fBatched;    // activeTxn is the one of a CDBBatch of this thread
+    bool fWritten;    // the store was written outside of a transaction
 
     explicit CDB(const char* pszFile, const char* pszMode="r+");
     ~CDB() { Close(); }
@@ -105,16 +169,37 @@ private:
     void operator=(const CDB&);
 
 protected:
+    // Serialized records of a store, as seen by its pending transaction
+    bool ReadStore(const CDataStream& ssKey, CDataStream& ssValue);
+    bool WriteStore(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite);
+    bool EraseStore(const CDataStream& ssKey);
+    int ReadAtStoreCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags);
+    bool static RewriteStore(const std::string& strFile, const char* pszSkip);
+
     template<typename K, typename T>
     bool Read(const K& key, T& value)
     {
-        if (!pdb)
+        if (!pdb && !pldb)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (pldb)
+        {
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            if (!ReadStore(ssKey, ssValue))
+                return false;
+            try {
+                ssValue >> value;
+            }
+            catch (std::exception &e) {
+                return false;
+            }
+            return true;
+        }
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Read
@@ -143,7 +228,7 @@ protected:
     template<typename K, typename T>
     bool Write(const K& key, const T& value, bool fOverwrite=true)
     {
-        if (!pdb)
+        if (!pdb && !pldb)
             return false;
         if (fReadOnly)
             assert(!"Write called on database in read-only mode");
@@ -152,12 +237,14 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
         // Value
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(10000);
         ssValue << value;
+        if (pldb)
+            return WriteStore(ssKey, ssValue, fOverwrite);
+        Dbt datKey(&ssKey[0], ssKey.size());
         Dbt datValue(&ssValue[0], ssValue.size());
 
         // Write
@@ -172,7 +259,7 @@ protected:
     template<typename K>
     bool Erase(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !pldb)
             return false;
         if (fReadOnly)
             assert(!"Erase called on database in read-only mode");
@@ -181,6 +268,8 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+        if (pldb)
+            return EraseStore(ssKey);
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Erase
@@ -194,13 +283,18 @@ protected:
     template<typename K>
     bool Exists(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !pldb)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+        if (pldb)
+        {
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            return ReadStore(ssKey, ssValue);
+        }
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Exists
@@ -212,19 +306,14 @@ protected:
     }
 
 public:
-    Dbc* GetCursor()
-    {
-        if (!pdb)
-            return NULL;
-        Dbc* pcursor = NULL;
-        int ret = pdb->cursor(NULL, &pcursor, 0);
-        if (ret != 0)
-            return NULL;
-        return pcursor;
-    }
+    // The cursor of a store does not see the writes of a pending transaction
+    CDBCursor* GetCursor();
 
-    int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT)
+    int ReadAtCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT)
     {
+        if (pcursor->piter)
+            return ReadAtStoreCursor(pcursor, ssKey, ssValue, fFlags);
+
         // Read at cursor
         Dbt datKey;
         if (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE)
@@ -240,7 +329,7 @@ public:
         }
         datKey.set_flags(DB_DBT_MALLOC);
         datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pcursor->get(&datKey, &datValue, fFlags);
+        int ret = pcursor->pdbc->get(&datKey, &datValue, fFlags);
         if (ret != 0)
             return ret;
         else if (datKey.get_data() == NULL || datValue.get_data() == NULL)
@@ -262,34 +351,10 @@ public:
         return 0;
     }
 
-    bool TxnBegin()
-    {
-        if (!pdb || activeTxn)
-            return false;
-        DbTxn* ptxn = bitdb.TxnBegin();
-        if (!ptxn)
-            return false;
-        activeTxn = ptxn;
-        return true;
-    }
-
-    bool TxnCommit()
-    {
-        if (!pdb || !activeTxn)
-            return false;
-        int ret = activeTxn->commit(0);
-        activeTxn = NULL;
-        return (ret == 0);
-    }
-
-    bool TxnAbort()
-    {
-        if (!pdb || !activeTxn)
-            return false;
-        int ret = activeTxn->abort();
-        activeTxn = NULL;
-        return (ret == 0);
-    }
+    // Within a batch these join its transaction, which cannot be aborted
+    bool TxnBegin();
+    bool TxnCommit();
+    bool TxnAbort();
 
     bool ReadVersion(int& nVersion)
     {
@@ -303,6 +368,28 @@ public:
     }
 
     bool static Rewrite(const std::string& strFile, const char* pszSkip = NULL);
+    // Copy all records of strFile into a new store at pathStore
+    bool static CopyToStore(const std::string& strFile, const boost::filesystem::path& pathStore);
+};
+
+
+/** Groups the writes that this thread makes to a database file while it
+ *  exists, through any CDB opened on the file, into one transaction. That
+ *  transaction is committed without a sync when the batch goes out of
+ *  scope, and the log checkpointed once, instead of once per closed handle.
+ *  Writes of other threads to the file wait for the commit: the writers of
+ *  a wallet hold its lock for the lifetime of the batch. A batch opened
+ *  within another one of the same file joins it. A NULL file name makes a
+ *  batch that does nothing. On a store, the batch is one synced write.
+ */
+class CDBBatch : public CDB
+{
+private:
+    bool fOwner;
+
+public:
+    explicit CDBBatch(const char* pszFile);
+    ~CDBBatch();
 };
 
 #endif // BITCOIN_DB_H
@@ -1,5 +1,8 @@
 #include "hash.h"
 
+#include <algorithm>
+#include <string.h>
+
 inline uint32_t ROTL32 ( uint32_t x, int8_t r )
 {
     return (x << r) | (x >> (32 - r));
@@ -57,6 +60,181 @@ unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char
     return h1;
 }
 
+CMurmurHash3Input::CMurmurHash3Input(const std::vector<unsigned char>& vDataToHash) : nTail(0), nSize(vDataToHash.size())
+{
+    const uint32_t c1 = 0xcc9e2d51;
+    const uint32_t c2 = 0x1b873593;
+
+    const int nblocks = vDataToHash.size() / 4;
+    vBlocks.resize(nblocks);
+    for (int i = 0; i < nblocks; i++)
+    {
+        uint32_t k1;
+        memcpy(&k1, &vDataToHash[i * 4], 4);
+        k1 *= c1;
+        k1 = ROTL32(k1,15);
+        k1 *= c2;
+        vBlocks[i] = k1;
+    }
+
+    if (vDataToHash.size() & 3)
+    {
+        const uint8_t * tail = (const uint8_t*)(&vDataToHash[0] + nblocks*4);
+        uint32_t k1 = 0;
+        switch(vDataToHash.size() & 3)
+        {
+        case 3: k1 ^= tail[2] << 16;
+        case 2: k1 ^= tail[1] << 8;
+        case 1: k1 ^= tail[0];
+                k1 *= c1; k1 = ROTL32(k1,15); k1 *= c2; nTail = k1;
+        };
+    }
+}
+
+static inline uint32_t MurmurHash3Finalize(uint32_t h1, uint32_t nSize)
+{
+    h1 ^= nSize;
+    h1 ^= h1 >> 16;
+    h1 *= 0x85ebca6b;
+    h1 ^= h1 >> 13;
+    h1 *= 0xc2b2ae35;
+    h1 ^= h1 >> 16;
+    return h1;
+}
+
+uint32_t CMurmurHash3Input::Hash(uint32_t nHashSeed) const
+{
+    uint32_t h1 = nHashSeed;
+    for (std::vector<uint32_t>::const_iterator it = vBlocks.begin(); it != vBlocks.end(); ++it)
+    {
+        h1 ^= *it;
+        h1 = ROTL32(h1,13);
+        h1 = h1*5+0xe6546b64;
+    }
+    h1 ^= nTail;
+    return MurmurHash3Finalize(h1, nSize);
+}
+
+void CMurmurHash3Input::HashMany(uint32_t nSeed0, uint32_t nSeedStep, unsigned int nCount, uint32_t* pnHashes) const
+{
+    // A fixed number of lanes, so the compiler can keep them in vector
+    // registers; lanes past nCount are computed and dropped
+    static const unsigned int LANES = 8;
+    for (unsigned int nStart = 0; nStart < nCount; nStart += LANES)
+    {
+        uint32_t h[LANES];
+        for (unsigned int j = 0; j < LANES; j++)
+            h[j] = nSeed0 + (nStart + j) * nSeedStep;
+        for (std::vector<uint32_t>::const_iterator it = vBlocks.begin(); it != vBlocks.end(); ++it)
+        {
+            const uint32_t k1 = *it;
+            for (unsigned int j = 0; j < LANES; j++)
+            {
+                h[j] ^= k1;
+                h[j] = ROTL32(h[j],13);
+                h[j] = h[j]*5+0xe6546b64;
+            }
+        }
+        for (unsigned int j = 0; j < LANES; j++)
+            h[j] = MurmurHash3Finalize(h[j] ^ nTail, nSize);
+
+        unsigned int nLanes = std::min(LANES, nCount - nStart);
+        for (unsigned int j = 0; j < nLanes; j++)
+            pnHashes[nStart + j] = h[j];
+    }
+}
+
+#define SIPROUND do { \
+    v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; \
+    v0 = ROTL64(v0, 32); \
+    v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; \
+    v2 = ROTL64(v2, 32); \
+} while (0)
+
+inline uint64_t ROTL64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t ReadLE64(const unsigned char* p)
+{
+    uint64_t n = 0;
+    for (int i = 7; i >= 0; i--)
+        n = (n << 8) | p[i];
+    return n;
+}
+
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val)
+{
+    // SipHash-2-4 (https://131002.net/siphash/), unrolled for a 32 byte message
+    const unsigned char* p = val.begin();
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+    for (int i = 0; i < 4; i++)
+    {
+        uint64_t m = ReadLE64(p + 8 * i);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    // Final block: only the message length
+    uint64_t b = ((uint64_t)32) << 56;
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+uint64_t SipHash(uint64_t k0, uint64_t k1, const unsigned char* pch, size_t nSize)
+{
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+    const unsigned char* pend = pch + (nSize & ~(size_t)7);
+    for (; pch != pend; pch += 8)
+    {
+        uint64_t m = ReadLE64(pch);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    // Final block: the remaining bytes under the low byte of the length
+    uint64_t b = ((uint64_t)nSize) << 56;
+    for (size_t i = 0; i < (nSize & 7); i++)
+        b |= ((uint64_t)pch[i]) << (8 * i);
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#undef SIPROUND
+
 int HMAC_SHA512_Init(HMAC_SHA512_CTX *pctx, const void *pkey, size_t len)
 {
     unsigned char key[128];
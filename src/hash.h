@@ -7,6 +7,7 @@
 #define BITCOIN_HASH_H
 
 #include "serialize.h"
+#include "sha256.h"
 #include "uint256.h"
 #include "version.h"
 
@@ -20,23 +21,23 @@ inline uint256 Hash(const T1 pbegin, const T1 pend)
 {
     static unsigned char pblank[1];
     uint256 hash1;
-    SHA256((pbegin == pend ? pblank : (unsigned char*)&pbegin[0]), (pend - pbegin) * sizeof(pbegin[0]), (unsigned char*)&hash1);
+    CSHA256().Write((pbegin == pend ? pblank : (unsigned char*)&pbegin[0]), (pend - pbegin) * sizeof(pbegin[0])).Finalize((unsigned char*)&hash1);
     uint256 hash2;
-    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+    CSHA256().Write((unsigned char*)&hash1, sizeof(hash1)).Finalize((unsigned char*)&hash2);
     return hash2;
 }
 
 class CHashWriter
 {
 private:
-    SHA256_CTX ctx;
+    CSHA256 ctx;
 
 public:
     int nType;
     int nVersion;
 
     void Init() {
-        SHA256_Init(&ctx);
+        ctx.Reset();
     }
 
     CHashWriter(int nTypeIn, int nVersionIn) : nType(nTypeIn), nVersion(nVersionIn) {
@@ -44,16 +45,16 @@ public:
     }
 
     CHashWriter& write(const char *pch, size_t size) {
-        SHA256_Update(&ctx, pch, size);
+        ctx.Write((const unsigned char*)pch, size);
         return (*this);
     }
 
     // invalidates the object
     uint256 GetHash() {
         uint256 hash1;
-        SHA256_Final((unsigned char*)&hash1, &ctx);
+        ctx.Finalize((unsigned char*)&hash1);
         uint256 hash2;
-        SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+        CSHA256().Write((unsigned char*)&hash1, sizeof(hash1)).Finalize((unsigned char*)&hash2);
         return hash2;
     }
 
@@ -72,13 +73,12 @@ inline uint256 Hash(const T1 p1begin, const T1 p1end,
 {
     static unsigned char pblank[1];
     uint256 hash1;
-    SHA256_CTX ctx;
-    SHA256_Init(&ctx);
-    SHA256_Update(&ctx, (p1begin == p1end ? pblank : (unsigned char*)&p1begin[0]), (p1end - p1begin) * sizeof(p1begin[0]));
-    SHA256_Update(&ctx, (p2begin == p2end ? pblank : (unsigned char*)&p2begin[0]), (p2end - p2begin) * sizeof(p2begin[0]));
-    SHA256_Final((unsigned char*)&hash1, &ctx);
+    CSHA256 ctx;
+    ctx.Write((p1begin == p1end ? pblank : (unsigned char*)&p1begin[0]), (p1end - p1begin) * sizeof(p1begin[0]));
+    ctx.Write((p2begin == p2end ? pblank : (unsigned char*)&p2begin[0]), (p2end - p2begin) * sizeof(p2begin[0]));
+    ctx.Finalize((unsigned char*)&hash1);
     uint256 hash2;
-    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+    CSHA256().Write((unsigned char*)&hash1, sizeof(hash1)).Finalize((unsigned char*)&hash2);
     return hash2;
 }
 
@@ -89,14 +89,13 @@ inline uint256 Hash(const T1 p1begin, const T1 p1end,
 {
     static unsigned char pblank[1];
     uint256 hash1;
-    SHA256_CTX ctx;
-    SHA256_Init(&ctx);
-    SHA256_Update(&ctx, (p1begin == p1end ? pblank : (unsigned char*)&p1begin[0]), (p1end - p1begin) * sizeof(p1begin[0]));
-    SHA256_Update(&ctx, (p2begin == p2end ? pblank : (unsigned char*)&p2begin[0]), (p2end - p2begin) * sizeof(p2begin[0]));
-    SHA256_Update(&ctx, (p3begin == p3end ? pblank : (unsigned char*)&p3begin[0]), (p3end - p3begin) * sizeof(p3begin[0]));
-    SHA256_Final((unsigned char*)&hash1, &ctx);
+    CSHA256 ctx;
+    ctx.Write((p1begin == p1end ? pblank : (unsigned char*)&p1begin[0]), (p1end - p1begin) * sizeof(p1begin[0]));
+    ctx.Write((p2begin == p2end ? pblank : (unsigned char*)&p2begin[0]), (p2end - p2begin) * sizeof(p2begin[0]));
+    ctx.Write((p3begin == p3end ? pblank : (unsigned char*)&p3begin[0]), (p3end - p3begin) * sizeof(p3begin[0]));
+    ctx.Finalize((unsigned char*)&hash1);
     uint256 hash2;
-    SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+    CSHA256().Write((unsigned char*)&hash1, sizeof(hash1)).Finalize((unsigned char*)&hash2);
     return hash2;
 }
 
@@ -113,7 +112,7 @@ inline uint160 Hash160(const T1 pbegin, const T1 pend)
 {
     static unsigned char pblank[1];
     uint256 hash1;
-    SHA256((pbegin == pend ? pblank : (unsigned char*)&pbegin[0]), (pend - pbegin) * sizeof(pbegin[0]), (unsigned char*)&hash1);
+    CSHA256().Write((pbegin == pend ? pblank : (unsigned char*)&pbegin[0]), (pend - pbegin) * sizeof(pbegin[0])).Finalize((unsigned char*)&hash1);
     uint160 hash2;
     RIPEMD160((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
     return hash2;
@@ -126,6 +125,33 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+/** One input to MurmurHash3 hashed under many seeds, as bloom filters do.
+ *  The mixing of its blocks does not depend on the seed and is done once,
+ *  leaving each seed only the chaining and finalization. */
+class CMurmurHash3Input
+{
+private:
+    std::vector<uint32_t> vBlocks; // mixed body blocks
+    uint32_t nTail;                // mixed tail, 0 without one
+    uint32_t nSize;
+
+public:
+    explicit CMurmurHash3Input(const std::vector<unsigned char>& vDataToHash);
+
+    // Same as MurmurHash3(nHashSeed, vDataToHash)
+    uint32_t Hash(uint32_t nHashSeed) const;
+
+    // The hashes under the seeds nSeed0 + i * nSeedStep for i < nCount,
+    // computed side by side
+    void HashMany(uint32_t nSeed0, uint32_t nSeedStep, unsigned int nCount, uint32_t* pnHashes) const;
+};
+
+// SipHash-2-4 of a 256-bit value (as its 32 little-endian bytes), keyed by k0 and k1
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+
+// SipHash-2-4 of nSize bytes at pch, keyed by k0 and k1
+uint64_t SipHash(uint64_t k0, uint64_t k1, const unsigned char* pch, size_t nSize);
+
 typedef struct
 {
     SHA512_CTX ctxInner;
@@ -0,0 +1,1034 @@
+// Copyright (c) 2014 The Digitalcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "hashx11.h"
+
+#include "util.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_X11_AESNI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+typedef void (*X11HashFunc)(const void* pdata, size_t nLen, void* pout);
+
+/** Portable chain: the same sph_* calls as HashX11, without the uint512 scratch array */
+static void X11Hash_generic(const void* pdata, size_t nLen, void* pout)
+{
+    union
+    {
+        sph_blake512_context    blake;
+        sph_bmw512_context      bmw;
+        sph_groestl512_context  groestl;
+        sph_skein512_context    skein;
+        sph_jh512_context       jh;
+        sph_keccak512_context   keccak;
+        sph_luffa512_context    luffa;
+        sph_cubehash512_context cubehash;
+        sph_shavite512_context  shavite;
+        sph_simd512_context     simd;
+        sph_echo512_context     echo;
+    } ctx;
+    unsigned char hash[2][64];
+
+    sph_blake512_init(&ctx.blake);
+    sph_blake512(&ctx.blake, pdata, nLen);
+    sph_blake512_close(&ctx.blake, hash[0]);
+
+    sph_bmw512_init(&ctx.bmw);
+    sph_bmw512(&ctx.bmw, hash[0], 64);
+    sph_bmw512_close(&ctx.bmw, hash[1]);
+
+    sph_groestl512_init(&ctx.groestl);
+    sph_groestl512(&ctx.groestl, hash[1], 64);
+    sph_groestl512_close(&ctx.groestl, hash[0]);
+
+    sph_skein512_init(&ctx.skein);
+    sph_skein512(&ctx.skein, hash[0], 64);
+    sph_skein512_close(&ctx.skein, hash[1]);
+
+    sph_jh512_init(&ctx.jh);
+    sph_jh512(&ctx.jh, hash[1], 64);
+    sph_jh512_close(&ctx.jh, hash[0]);
+
+    sph_keccak512_init(&ctx.keccak);
+    sph_keccak512(&ctx.keccak, hash[0], 64);
+    sph_keccak512_close(&ctx.keccak, hash[1]);
+
+    sph_luffa512_init(&ctx.luffa);
+    sph_luffa512(&ctx.luffa, hash[1], 64);
+    sph_luffa512_close(&ctx.luffa, hash[0]);
+
+    sph_cubehash512_init(&ctx.cubehash);
+    sph_cubehash512(&ctx.cubehash, hash[0], 64);
+    sph_cubehash512_close(&ctx.cubehash, hash[1]);
+
+    sph_shavite512_init(&ctx.shavite);
+    sph_shavite512(&ctx.shavite, hash[1], 64);
+    sph_shavite512_close(&ctx.shavite, hash[0]);
+
+    sph_simd512_init(&ctx.simd);
+    sph_simd512(&ctx.simd, hash[0], 64);
+    sph_simd512_close(&ctx.simd, hash[1]);
+
+    sph_echo512_init(&ctx.echo);
+    sph_echo512(&ctx.echo, hash[1], 64);
+    sph_echo512_close(&ctx.echo, hash[0]);
+
+    memcpy(pout, hash[0], 32);
+}
+
+#ifdef USE_X11_AESNI
+//
+// Groestl-512 and Echo-512 for the fixed 64-byte inputs of the X11 chain, using
+// AESENC/AESENCLAST for the AES S-box and round function. Every X11 stage after
+// Blake hashes exactly one 512-bit value, so both fit in a single padded block.
+//
+#define X11_AESNI __attribute__((target("aes,ssse3,sse4.1")))
+
+/** GF(2^8) doubling of 16 bytes at once */
+X11_AESNI static inline __m128i aesni_mul2(__m128i x)
+{
+    __m128i mask = _mm_and_si128(_mm_cmplt_epi8(x, _mm_setzero_si128()), _mm_set1_epi8(0x1b));
+    return _mm_xor_si128(_mm_add_epi8(x, x), mask);
+}
+
+// pshufb masks mapping a left rotation of a 16-byte Groestl row by n columns onto
+// the input of AESENCLAST, so that its built-in ShiftRows cancels out and only
+// SubBytes and the Groestl ShiftBytes remain.
+static const unsigned char pchGroestlShift[12][16] =
+{
+    { 0x00, 0x0d, 0x0a, 0x07, 0x04, 0x01, 0x0e, 0x0b, 0x08, 0x05, 0x02, 0x0f, 0x0c, 0x09, 0x06, 0x03 },
+    { 0x01, 0x0e, 0x0b, 0x08, 0x05, 0x02, 0x0f, 0x0c, 0x09, 0x06, 0x03, 0x00, 0x0d, 0x0a, 0x07, 0x04 },
+    { 0x02, 0x0f, 0x0c, 0x09, 0x06, 0x03, 0x00, 0x0d, 0x0a, 0x07, 0x04, 0x01, 0x0e, 0x0b, 0x08, 0x05 },
+    { 0x03, 0x00, 0x0d, 0x0a, 0x07, 0x04, 0x01, 0x0e, 0x0b, 0x08, 0x05, 0x02, 0x0f, 0x0c, 0x09, 0x06 },
+    { 0x04, 0x01, 0x0e, 0x0b, 0x08, 0x05, 0x02, 0x0f, 0x0c, 0x09, 0x06, 0x03, 0x00, 0x0d, 0x0a, 0x07 },
+    { 0x05, 0x02, 0x0f, 0x0c, 0x09, 0x06, 0x03, 0x00, 0x0d, 0x0a, 0x07, 0x04, 0x01, 0x0e, 0x0b, 0x08 },
+    { 0x06, 0x03, 0x00, 0x0d, 0x0a, 0x07, 0x04, 0x01, 0x0e, 0x0b, 0x08, 0x05, 0x02, 0x0f, 0x0c, 0x09 },
+    { 0x07, 0x04, 0x01, 0x0e, 0x0b, 0x08, 0x05, 0x02, 0x0f, 0x0c, 0x09, 0x06, 0x03, 0x00, 0x0d, 0x0a },
+    { 0x08, 0x05, 0x02, 0x0f, 0x0c, 0x09, 0x06, 0x03, 0x00, 0x0d, 0x0a, 0x07, 0x04, 0x01, 0x0e, 0x0b },
+    { 0x09, 0x06, 0x03, 0x00, 0x0d, 0x0a, 0x07, 0x04, 0x01, 0x0e, 0x0b, 0x08, 0x05, 0x02, 0x0f, 0x0c },
+    { 0x0a, 0x07, 0x04, 0x01, 0x0e, 0x0b, 0x08, 0x05, 0x02, 0x0f, 0x0c, 0x09, 0x06, 0x03, 0x00, 0x0d },
+    { 0x0b, 0x08, 0x05, 0x02, 0x0f, 0x0c, 0x09, 0x06, 0x03, 0x00, 0x0d, 0x0a, 0x07, 0x04, 0x01, 0x0e },
+};
+
+// ShiftBytes rotation per row for the 1024-bit permutations
+static const int nGroestlShiftP[8] = { 0, 1, 2, 3, 4, 5, 6, 11 };
+static const int nGroestlShiftQ[8] = { 1, 3, 5, 11, 0, 2, 4, 6 };
+
+// MixBytes with B = circ(02,02,03,04,05,03,05,07), split as X ^ 2 * (Y ^ 2 * Z)
+#define GROESTL_MIX_ROW(o, a, i) do { \
+        __m128i X = _mm_xor_si128(_mm_xor_si128(a[((i) + 2) & 7], a[((i) + 4) & 7]), \
+            _mm_xor_si128(_mm_xor_si128(a[((i) + 5) & 7], a[((i) + 6) & 7]), a[((i) + 7) & 7])); \
+        __m128i Y = _mm_xor_si128(_mm_xor_si128(a[(i)], a[((i) + 1) & 7]), \
+            _mm_xor_si128(_mm_xor_si128(a[((i) + 2) & 7], a[((i) + 5) & 7]), a[((i) + 7) & 7])); \
+        __m128i Z = _mm_xor_si128(_mm_xor_si128(a[((i) + 3) & 7], a[((i) + 4) & 7]), \
+            _mm_xor_si128(a[((i) + 6) & 7], a[((i) + 7) & 7])); \
+        o[i] = _mm_xor_si128(X, aesni_mul2(_mm_xor_si128(Y, aesni_mul2(Z)))); \
+    } while (0)
+
+#define GROESTL_SUB_SHIFT(a, i, shift) \
+    a[i] = _mm_aesenclast_si128(_mm_shuffle_epi8(a[i], _mm_loadu_si128((const __m128i*)pchGroestlShift[shift[i]])), zero)
+
+/** Groestl P (fQ=false) or Q (fQ=true) permutation on a state held as 8 rows of 16 columns */
+X11_AESNI static inline __attribute__((always_inline)) void aesni_groestl_perm(__m128i a[8], bool fQ)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi8((char)0xff);
+    const __m128i col = _mm_set_epi8((char)0xf0, (char)0xe0, (char)0xd0, (char)0xc0, (char)0xb0, (char)0xa0, (char)0x90, (char)0x80,
+                                     0x70, 0x60, 0x50, 0x40, 0x30, 0x20, 0x10, 0x00);
+    const int* shift = fQ ? nGroestlShiftQ : nGroestlShiftP;
+    __m128i o[8];
+
+    for (int r = 0; r < 14; r++)
+    {
+        // AddRoundConstant
+        const __m128i rc = _mm_xor_si128(col, _mm_set1_epi8((char)r));
+        if (fQ)
+        {
+            a[0] = _mm_xor_si128(a[0], ones); a[1] = _mm_xor_si128(a[1], ones);
+            a[2] = _mm_xor_si128(a[2], ones); a[3] = _mm_xor_si128(a[3], ones);
+            a[4] = _mm_xor_si128(a[4], ones); a[5] = _mm_xor_si128(a[5], ones);
+            a[6] = _mm_xor_si128(a[6], ones); a[7] = _mm_xor_si128(a[7], _mm_xor_si128(rc, ones));
+        }
+        else
+            a[0] = _mm_xor_si128(a[0], rc);
+
+        // SubBytes + ShiftBytes
+        GROESTL_SUB_SHIFT(a, 0, shift); GROESTL_SUB_SHIFT(a, 1, shift);
+        GROESTL_SUB_SHIFT(a, 2, shift); GROESTL_SUB_SHIFT(a, 3, shift);
+        GROESTL_SUB_SHIFT(a, 4, shift); GROESTL_SUB_SHIFT(a, 5, shift);
+        GROESTL_SUB_SHIFT(a, 6, shift); GROESTL_SUB_SHIFT(a, 7, shift);
+
+        // MixBytes
+        GROESTL_MIX_ROW(o, a, 0); GROESTL_MIX_ROW(o, a, 1);
+        GROESTL_MIX_ROW(o, a, 2); GROESTL_MIX_ROW(o, a, 3);
+        GROESTL_MIX_ROW(o, a, 4); GROESTL_MIX_ROW(o, a, 5);
+        GROESTL_MIX_ROW(o, a, 6); GROESTL_MIX_ROW(o, a, 7);
+        for (int i = 0; i < 8; i++)
+            a[i] = o[i];
+    }
+}
+
+X11_AESNI static void aesni_groestl512_64(const unsigned char* pin, unsigned char* pout)
+{
+    unsigned char block[128];
+    unsigned char rows[8][16];
+    __m128i h[8], m[8], p[8];
+
+    // One padded block: message, 0x80, zeros, 64-bit big endian block count (1)
+    memcpy(block, pin, 64);
+    memset(block + 64, 0, 64);
+    block[64] = 0x80;
+    block[127] = 0x01;
+
+    // The state matrix is filled column by column; keep it as rows
+    for (int j = 0; j < 16; j++)
+        for (int i = 0; i < 8; i++)
+            rows[i][j] = block[8 * j + i];
+
+    for (int i = 0; i < 8; i++)
+    {
+        m[i] = _mm_loadu_si128((const __m128i*)rows[i]);
+        // IV: output size 512 as a big endian number in the last column
+        h[i] = (i == 6) ? _mm_set_epi8(0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0) : _mm_setzero_si128();
+        p[i] = _mm_xor_si128(h[i], m[i]);
+    }
+
+    // Compression: h = P(h ^ m) ^ Q(m) ^ h
+    aesni_groestl_perm(p, false);
+    aesni_groestl_perm(m, true);
+    for (int i = 0; i < 8; i++)
+    {
+        h[i] = _mm_xor_si128(h[i], _mm_xor_si128(p[i], m[i]));
+        p[i] = h[i];
+    }
+
+    // Output transformation: trunc512(P(h) ^ h)
+    aesni_groestl_perm(p, false);
+    for (int i = 0; i < 8; i++)
+        _mm_storeu_si128((__m128i*)rows[i], _mm_xor_si128(p[i], h[i]));
+    for (int j = 8; j < 16; j++)
+        for (int i = 0; i < 8; i++)
+            pout[8 * (j - 8) + i] = rows[i][j];
+}
+
+X11_AESNI static void aesni_echo512_64(const unsigned char* pin, unsigned char* pout)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set_epi32(0, 0, 0, 1);
+    // Chaining value words start as the output size; the counter is the 512 message bits
+    const __m128i iv = _mm_set_epi32(0, 0, 0, 512);
+    __m128i k = iv;
+    __m128i W[16], M[4];
+
+    for (int i = 0; i < 4; i++)
+        M[i] = _mm_loadu_si128((const __m128i*)pin + i);
+    for (int i = 0; i < 8; i++)
+        W[i] = iv;
+    for (int i = 0; i < 4; i++)
+        W[8 + i] = M[i];
+    // Padding: 0x80, zeros, 16-bit output size, 128-bit message bit count
+    W[12] = _mm_set_epi32(0, 0, 0, 0x80);
+    W[13] = zero;
+    W[14] = _mm_set_epi32(0x02000000, 0, 0, 0);
+    W[15] = iv;
+
+    for (int r = 0; r < 10; r++)
+    {
+        // BIG.SubWords: two AES rounds per word, keyed by the counter and the (zero) salt
+        for (int i = 0; i < 16; i++)
+        {
+            W[i] = _mm_aesenc_si128(_mm_aesenc_si128(W[i], k), zero);
+            k = _mm_add_epi32(k, one);
+        }
+
+        // BIG.ShiftRows
+        __m128i t;
+        t = W[1]; W[1] = W[5]; W[5] = W[9]; W[9] = W[13]; W[13] = t;
+        t = W[2]; W[2] = W[10]; W[10] = t;
+        t = W[6]; W[6] = W[14]; W[14] = t;
+        t = W[15]; W[15] = W[11]; W[11] = W[7]; W[7] = W[3]; W[3] = t;
+
+        // BIG.MixColumns: AES MixColumns applied bytewise across the four words of a column
+        for (int i = 0; i < 16; i += 4)
+        {
+            __m128i a = W[i], b = W[i + 1], c = W[i + 2], d = W[i + 3];
+            __m128i ab = _mm_xor_si128(a, b), bc = _mm_xor_si128(b, c), cd = _mm_xor_si128(c, d);
+            __m128i abx = aesni_mul2(ab), bcx = aesni_mul2(bc), cdx = aesni_mul2(cd);
+            W[i]     = _mm_xor_si128(abx, _mm_xor_si128(bc, d));
+            W[i + 1] = _mm_xor_si128(bcx, _mm_xor_si128(a, cd));
+            W[i + 2] = _mm_xor_si128(cdx, _mm_xor_si128(ab, d));
+            W[i + 3] = _mm_xor_si128(_mm_xor_si128(abx, bcx), _mm_xor_si128(cdx, _mm_xor_si128(ab, c)));
+        }
+    }
+
+    // BIG.Final for the first 512 bits of the chaining value
+    for (int i = 0; i < 4; i++)
+        _mm_storeu_si128((__m128i*)pout + i, _mm_xor_si128(_mm_xor_si128(iv, M[i]), _mm_xor_si128(W[i], W[i + 8])));
+}
+
+static void X11Hash_aesni(const void* pdata, size_t nLen, void* pout)
+{
+    union
+    {
+        sph_blake512_context    blake;
+        sph_bmw512_context      bmw;
+        sph_skein512_context    skein;
+        sph_jh512_context       jh;
+        sph_keccak512_context   keccak;
+        sph_luffa512_context    luffa;
+        sph_cubehash512_context cubehash;
+        sph_shavite512_context  shavite;
+        sph_simd512_context     simd;
+    } ctx;
+    unsigned char hash[2][64];
+
+    sph_blake512_init(&ctx.blake);
+    sph_blake512(&ctx.blake, pdata, nLen);
+    sph_blake512_close(&ctx.blake, hash[0]);
+
+    sph_bmw512_init(&ctx.bmw);
+    sph_bmw512(&ctx.bmw, hash[0], 64);
+    sph_bmw512_close(&ctx.bmw, hash[1]);
+
+    aesni_groestl512_64(hash[1], hash[0]);
+
+    sph_skein512_init(&ctx.skein);
+    sph_skein512(&ctx.skein, hash[0], 64);
+    sph_skein512_close(&ctx.skein, hash[1]);
+
+    sph_jh512_init(&ctx.jh);
+    sph_jh512(&ctx.jh, hash[1], 64);
+    sph_jh512_close(&ctx.jh, hash[0]);
+
+    sph_keccak512_init(&ctx.keccak);
+    sph_keccak512(&ctx.keccak, hash[0], 64);
+    sph_keccak512_close(&ctx.keccak, hash[1]);
+
+    sph_luffa512_init(&ctx.luffa);
+    sph_luffa512(&ctx.luffa, hash[1], 64);
+    sph_luffa512_close(&ctx.luffa, hash[0]);
+
+    sph_cubehash512_init(&ctx.cubehash);
+    sph_cubehash512(&ctx.cubehash, hash[0], 64);
+    sph_cubehash512_close(&ctx.cubehash, hash[1]);
+
+    sph_shavite512_init(&ctx.shavite);
+    sph_shavite512(&ctx.shavite, hash[1], 64);
+    sph_shavite512_close(&ctx.shavite, hash[0]);
+
+    sph_simd512_init(&ctx.simd);
+    sph_simd512(&ctx.simd, hash[0], 64);
+    sph_simd512_close(&ctx.simd, hash[1]);
+
+    aesni_echo512_64(hash[1], hash[0]);
+
+    memcpy(pout, hash[0], 32);
+}
+
+static bool CPUHasAESNI()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    return (ecx & bit_AES) && (ecx & bit_SSSE3) && (ecx & bit_SSE4_1);
+}
+#endif // USE_X11_AESNI
+
+//
+// Blake-512 of an 80-byte header is a single padded block, and the column step
+// of round 0 only reads the first 64 bytes; CX11HeaderMidstate caches the state
+// up to there so miners only redo the part of the compression the nonce reaches.
+//
+static const unsigned char nBlakeSigma[10][16] =
+{
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+    { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+    {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+    {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+    {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+    { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+    { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+    {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+    { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 }
+};
+
+static const uint64_t nBlakeCB[16] =
+{
+    0x243F6A8885A308D3ULL, 0x13198A2E03707344ULL, 0xA4093822299F31D0ULL, 0x082EFA98EC4E6C89ULL,
+    0x452821E638D01377ULL, 0xBE5466CF34E90C6CULL, 0xC0AC29B7C97C50DDULL, 0x3F84D5B5B5470917ULL,
+    0x9216D5D98979FB1BULL, 0xD1310BA698DFB5ACULL, 0x2FFD72DBD01ADFB7ULL, 0xB8E1AFED6A267E96ULL,
+    0xBA7C9045F12C7F99ULL, 0x24A19947B3916CF7ULL, 0x0801F2E2858EFC16ULL, 0x636920D871574E69ULL
+};
+
+static const uint64_t nBlakeIV512[8] =
+{
+    0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL, 0x3C6EF372FE94F82BULL, 0xA54FF53A5F1D36F1ULL,
+    0x510E527FADE682D1ULL, 0x9B05688C2B3E6C1FULL, 0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL
+};
+
+// Blake-512 G function, for uint64_t or x11v4 state words (scalars broadcast)
+#define BLAKE_G(m, r, i, a, b, c, d) do { \
+    unsigned int s0 = nBlakeSigma[(r) % 10][2 * (i)], s1 = nBlakeSigma[(r) % 10][2 * (i) + 1]; \
+    a = a + b + (m[s0] ^ nBlakeCB[s1]); d = d ^ a; d = (d >> 32) | (d << 32); \
+    c = c + d; b = b ^ c; b = (b >> 25) | (b << 39); \
+    a = a + b + (m[s1] ^ nBlakeCB[s0]); d = d ^ a; d = (d >> 16) | (d << 48); \
+    c = c + d; b = b ^ c; b = (b >> 11) | (b << 53); \
+} while (0)
+
+#define BLAKE_COLUMNS(m, r, v) do { \
+    BLAKE_G(m, r, 0, v[0], v[4], v[ 8], v[12]); \
+    BLAKE_G(m, r, 1, v[1], v[5], v[ 9], v[13]); \
+    BLAKE_G(m, r, 2, v[2], v[6], v[10], v[14]); \
+    BLAKE_G(m, r, 3, v[3], v[7], v[11], v[15]); \
+} while (0)
+
+#define BLAKE_DIAGONALS(m, r, v) do { \
+    BLAKE_G(m, r, 4, v[0], v[5], v[10], v[15]); \
+    BLAKE_G(m, r, 5, v[1], v[6], v[11], v[12]); \
+    BLAKE_G(m, r, 6, v[2], v[7], v[ 8], v[13]); \
+    BLAKE_G(m, r, 7, v[3], v[4], v[ 9], v[14]); \
+} while (0)
+
+static inline uint64_t ReadBE64(const unsigned char* p)
+{
+    return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) | ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+           ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) | ((uint64_t)p[6] << 8) | (uint64_t)p[7];
+}
+
+static inline uint64_t ReadLE64(const unsigned char* p)
+{
+    uint64_t x;
+    memcpy(&x, p, 8);
+    return x;
+}
+
+/** Blake-512 message words of a single padded 80-byte block, and the state before round 0 */
+static void blake512_80_init(const unsigned char* pheader, uint64_t m[16], uint64_t v[16])
+{
+    for (int i = 0; i < 10; i++)
+        m[i] = ReadBE64(pheader + 8 * i);
+    m[10] = 0x8000000000000000ULL;
+    m[11] = 0;
+    m[12] = 0;
+    m[13] = 1;
+    m[14] = 0;
+    m[15] = 640;
+    for (int i = 0; i < 8; i++)
+        v[i] = nBlakeIV512[i];
+    for (int i = 0; i < 8; i++)
+        v[i + 8] = nBlakeCB[i];
+    v[12] ^= 640;
+    v[13] ^= 640;
+}
+
+void X11PrepareHeader(CX11HeaderMidstate& mid, const void* pheader)
+{
+    memcpy(mid.header, pheader, sizeof(mid.header));
+    blake512_80_init(mid.header, mid.m, mid.v);
+    // The column step of round 0 only reads m[0..7]; everything up to the
+    // first diagonal G is the same for every nonce.
+    BLAKE_COLUMNS(mid.m, 0, mid.v);
+}
+
+
+#ifdef USE_X11_AESNI
+//
+// Four-lane X11 for batches of 80-byte headers. Blake-512, BMW-512, Skein-512
+// and Keccak-512 are pure 64-bit add/xor/rotate designs, so each AVX2 register
+// carries the same state word of four candidates. Groestl, JH, Luffa, CubeHash,
+// SHAvite, SIMD and Echo run lane by lane through the AES-NI chain.
+//
+#define X11_AVX2 __attribute__((target("avx2")))
+
+typedef uint64_t x11v4 __attribute__((vector_size(32)));
+
+#define V4(c)           ((x11v4){ (c), (c), (c), (c) })
+#define V4_ROTL(x, n)   (((x) << (n)) | ((x) >> (64 - (n))))
+
+static const uint64_t nBMWIV512[16] =
+{
+    0x8081828384858687ULL, 0x88898A8B8C8D8E8FULL, 0x9091929394959697ULL, 0x98999A9B9C9D9E9FULL,
+    0xA0A1A2A3A4A5A6A7ULL, 0xA8A9AAABACADAEAFULL, 0xB0B1B2B3B4B5B6B7ULL, 0xB8B9BABBBCBDBEBFULL,
+    0xC0C1C2C3C4C5C6C7ULL, 0xC8C9CACBCCCDCECFULL, 0xD0D1D2D3D4D5D6D7ULL, 0xD8D9DADBDCDDDEDFULL,
+    0xE0E1E2E3E4E5E6E7ULL, 0xE8E9EAEBECEDEEEFULL, 0xF0F1F2F3F4F5F6F7ULL, 0xF8F9FAFBFCFDFEFFULL
+};
+
+static const uint64_t nKeccakRC[24] =
+{
+    0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808AULL, 0x8000000080008000ULL,
+    0x000000000000808BULL, 0x0000000080000001ULL, 0x8000000080008081ULL, 0x8000000000008009ULL,
+    0x000000000000008AULL, 0x0000000000000088ULL, 0x0000000080008009ULL, 0x000000008000000AULL,
+    0x000000008000808BULL, 0x800000000000008BULL, 0x8000000000008089ULL, 0x8000000000008003ULL,
+    0x8000000000008002ULL, 0x8000000000000080ULL, 0x000000000000800AULL, 0x800000008000000AULL,
+    0x8000000080008081ULL, 0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL
+};
+
+static const uint64_t nSkeinIV512[8] =
+{
+    0x4903ADFF749C51CEULL, 0x0D95DE399746DF03ULL, 0x8FD1934127C79BCEULL, 0x9A255629FF352CB1ULL,
+    0x5DB62599DF6CA7B0ULL, 0xEABE394CA9D5C3F4ULL, 0x991112C71A75B523ULL, 0xAE18A40B660FCC33ULL
+};
+
+/** Rest of the Blake-512 compression from the first diagonal step of round 0 */
+X11_AVX2 static void blake512_4way_finish(x11v4 v[16], const x11v4 m[16], x11v4 h[8])
+{
+    BLAKE_DIAGONALS(m, 0, v);
+    for (int r = 1; r < 16; r++)
+    {
+        BLAKE_COLUMNS(m, r, v);
+        BLAKE_DIAGONALS(m, r, v);
+    }
+    for (int i = 0; i < 8; i++)
+        h[i] = V4(nBlakeIV512[i]) ^ v[i] ^ v[i + 8];
+}
+
+/** Byte-swap each 64-bit lane: Blake is big-endian, the rest of the chain little-endian */
+X11_AVX2 static inline x11v4 v4_bswap(x11v4 x)
+{
+    const __m256i mask = _mm256_set_epi8(8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7,
+                                         8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+    return (x11v4)_mm256_shuffle_epi8((__m256i)x, mask);
+}
+
+X11_AVX2 static inline x11v4 v4_rotl(x11v4 x, int n)
+{
+    return (x << n) | (x >> (64 - n));
+}
+
+/** BMW-512 compression function f0..f2 */
+X11_AVX2 static void bmw512_4way_compress(const x11v4 M[16], const x11v4 H[16], x11v4 dH[16])
+{
+    x11v4 x[16], W[16], q[32];
+    for (int i = 0; i < 16; i++)
+        x[i] = M[i] ^ H[i];
+
+    W[ 0] = x[ 5] - x[ 7] + x[10] + x[13] + x[14];
+    W[ 1] = x[ 6] - x[ 8] + x[11] + x[14] - x[15];
+    W[ 2] = x[ 0] + x[ 7] + x[ 9] - x[12] + x[15];
+    W[ 3] = x[ 0] - x[ 1] + x[ 8] - x[10] + x[13];
+    W[ 4] = x[ 1] + x[ 2] + x[ 9] - x[11] - x[14];
+    W[ 5] = x[ 3] - x[ 2] + x[10] - x[12] + x[15];
+    W[ 6] = x[ 4] - x[ 0] - x[ 3] - x[11] + x[13];
+    W[ 7] = x[ 1] - x[ 4] - x[ 5] - x[12] - x[14];
+    W[ 8] = x[ 2] - x[ 5] - x[ 6] + x[13] - x[15];
+    W[ 9] = x[ 0] - x[ 3] + x[ 6] - x[ 7] + x[14];
+    W[10] = x[ 8] - x[ 1] - x[ 4] - x[ 7] + x[15];
+    W[11] = x[ 8] - x[ 0] - x[ 2] - x[ 5] + x[ 9];
+    W[12] = x[ 1] + x[ 3] - x[ 6] - x[ 9] + x[10];
+    W[13] = x[ 2] + x[ 4] + x[ 7] + x[10] + x[11];
+    W[14] = x[ 3] - x[ 5] + x[ 8] - x[11] - x[12];
+    W[15] = x[12] - x[ 4] - x[ 6] - x[ 9] + x[13];
+
+#define BMW_S0(x) (((x) >> 1) ^ ((x) << 3) ^ V4_ROTL(x,  4) ^ V4_ROTL(x, 37))
+#define BMW_S1(x) (((x) >> 1) ^ ((x) << 2) ^ V4_ROTL(x, 13) ^ V4_ROTL(x, 43))
+#define BMW_S2(x) (((x) >> 2) ^ ((x) << 1) ^ V4_ROTL(x, 19) ^ V4_ROTL(x, 53))
+#define BMW_S3(x) (((x) >> 2) ^ ((x) << 2) ^ V4_ROTL(x, 28) ^ V4_ROTL(x, 59))
+#define BMW_S4(x) (((x) >> 1) ^ (x))
+#define BMW_S5(x) (((x) >> 2) ^ (x))
+
+    for (int i = 0; i < 15; i += 5)
+    {
+        q[i + 0] = BMW_S0(W[i + 0]) + H[i + 1];
+        q[i + 1] = BMW_S1(W[i + 1]) + H[i + 2];
+        q[i + 2] = BMW_S2(W[i + 2]) + H[i + 3];
+        q[i + 3] = BMW_S3(W[i + 3]) + H[i + 4];
+        q[i + 4] = BMW_S4(W[i + 4]) + H[i + 5];
+    }
+    q[15] = BMW_S0(W[15]) + H[0];
+
+    for (int i = 16; i < 32; i++)
+    {
+        int j = i - 16;
+        x11v4 t = (v4_rotl(M[j & 15], (j & 15) + 1) + v4_rotl(M[(j + 3) & 15], ((j + 3) & 15) + 1) -
+                   v4_rotl(M[(j + 10) & 15], ((j + 10) & 15) + 1) + V4((uint64_t)i * 0x0555555555555555ULL)) ^ H[(j + 7) & 15];
+        if (i < 18)
+        {
+            for (int k = 0; k < 16; k += 4)
+                t += BMW_S1(q[j + k]) + BMW_S2(q[j + k + 1]) + BMW_S3(q[j + k + 2]) + BMW_S0(q[j + k + 3]);
+        }
+        else
+        {
+            t += q[j +  0] + V4_ROTL(q[j +  1],  5) + q[j +  2] + V4_ROTL(q[j +  3], 11) +
+                 q[j +  4] + V4_ROTL(q[j +  5], 27) + q[j +  6] + V4_ROTL(q[j +  7], 32) +
+                 q[j +  8] + V4_ROTL(q[j +  9], 37) + q[j + 10] + V4_ROTL(q[j + 11], 43) +
+                 q[j + 12] + V4_ROTL(q[j + 13], 53) + BMW_S4(q[j + 14]) + BMW_S5(q[j + 15]);
+        }
+        q[i] = t;
+    }
+#undef BMW_S0
+#undef BMW_S1
+#undef BMW_S2
+#undef BMW_S3
+#undef BMW_S4
+#undef BMW_S5
+
+    x11v4 xl = q[16] ^ q[17] ^ q[18] ^ q[19] ^ q[20] ^ q[21] ^ q[22] ^ q[23];
+    x11v4 xh = xl ^ q[24] ^ q[25] ^ q[26] ^ q[27] ^ q[28] ^ q[29] ^ q[30] ^ q[31];
+    dH[ 0] = ((xh <<  5) ^ (q[16] >>  5) ^ M[ 0]) + (xl ^ q[24] ^ q[ 0]);
+    dH[ 1] = ((xh >>  7) ^ (q[17] <<  8) ^ M[ 1]) + (xl ^ q[25] ^ q[ 1]);
+    dH[ 2] = ((xh >>  5) ^ (q[18] <<  5) ^ M[ 2]) + (xl ^ q[26] ^ q[ 2]);
+    dH[ 3] = ((xh >>  1) ^ (q[19] <<  5) ^ M[ 3]) + (xl ^ q[27] ^ q[ 3]);
+    dH[ 4] = ((xh >>  3) ^  q[20]        ^ M[ 4]) + (xl ^ q[28] ^ q[ 4]);
+    dH[ 5] = ((xh <<  6) ^ (q[21] >>  6) ^ M[ 5]) + (xl ^ q[29] ^ q[ 5]);
+    dH[ 6] = ((xh >>  4) ^ (q[22] <<  6) ^ M[ 6]) + (xl ^ q[30] ^ q[ 6]);
+    dH[ 7] = ((xh >> 11) ^ (q[23] <<  2) ^ M[ 7]) + (xl ^ q[31] ^ q[ 7]);
+    dH[ 8] = V4_ROTL(dH[4],  9) + (xh ^ q[24] ^ M[ 8]) + ((xl << 8) ^ q[23] ^ q[ 8]);
+    dH[ 9] = V4_ROTL(dH[5], 10) + (xh ^ q[25] ^ M[ 9]) + ((xl >> 6) ^ q[16] ^ q[ 9]);
+    dH[10] = V4_ROTL(dH[6], 11) + (xh ^ q[26] ^ M[10]) + ((xl << 6) ^ q[17] ^ q[10]);
+    dH[11] = V4_ROTL(dH[7], 12) + (xh ^ q[27] ^ M[11]) + ((xl << 4) ^ q[18] ^ q[11]);
+    dH[12] = V4_ROTL(dH[0], 13) + (xh ^ q[28] ^ M[12]) + ((xl >> 3) ^ q[19] ^ q[12]);
+    dH[13] = V4_ROTL(dH[1], 14) + (xh ^ q[29] ^ M[13]) + ((xl >> 4) ^ q[20] ^ q[13]);
+    dH[14] = V4_ROTL(dH[2], 15) + (xh ^ q[30] ^ M[14]) + ((xl >> 7) ^ q[21] ^ q[14]);
+    dH[15] = V4_ROTL(dH[3], 16) + (xh ^ q[31] ^ M[15]) + ((xl >> 2) ^ q[22] ^ q[15]);
+}
+
+/** BMW-512 of four 64-byte messages, as little-endian words */
+X11_AVX2 static void bmw512_4way_64(const x11v4 in[8], x11v4 out[8])
+{
+    x11v4 M[16], H[16], h2[16], h1[16];
+    for (int i = 0; i < 8; i++)
+        M[i] = in[i];
+    M[8] = V4(0x80);
+    for (int i = 9; i < 15; i++)
+        M[i] = V4(0);
+    M[15] = V4(512);
+    for (int i = 0; i < 16; i++)
+        H[i] = V4(nBMWIV512[i]);
+    bmw512_4way_compress(M, H, h2);
+
+    // Final compression with the constant chaining value 0xaaaaaaaaaaaaaaa0 + i
+    for (int i = 0; i < 16; i++)
+        H[i] = V4(0xaaaaaaaaaaaaaaa0ULL + i);
+    bmw512_4way_compress(h2, H, h1);
+    for (int i = 0; i < 8; i++)
+        out[i] = h1[i + 8];
+}
+
+/** Skein-512-512 of four 64-byte messages: one message UBI block and one output block */
+X11_AVX2 static void skein512_4way_64(const x11v4 in[8], x11v4 out[8])
+{
+    // The key schedule is repeated out to k[26] so subkey s is simply k[s..s+7]
+    x11v4 k[27], p[8], msg[8];
+    uint64_t t[21];
+
+#define SKEIN_MIX(a, b, r) do { p[a] += p[b]; p[b] = V4_ROTL(p[b], r) ^ p[a]; } while (0)
+#define SKEIN_MIX8(w0, w1, w2, w3, w4, w5, w6, w7, r0, r1, r2, r3) do { \
+    SKEIN_MIX(w0, w1, r0); SKEIN_MIX(w2, w3, r1); SKEIN_MIX(w4, w5, r2); SKEIN_MIX(w6, w7, r3); \
+} while (0)
+#define SKEIN_ADDKEY(s) do { \
+    p[0] += k[(s) + 0]; p[1] += k[(s) + 1]; p[2] += k[(s) + 2]; p[3] += k[(s) + 3]; \
+    p[4] += k[(s) + 4]; p[5] += k[(s) + 5] + V4(t[(s)]); p[6] += k[(s) + 6] + V4(t[(s) + 1]); \
+    p[7] += k[(s) + 7] + V4((uint64_t)(s)); \
+} while (0)
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        uint64_t t0, t1;
+        if (pass == 0)
+        {
+            for (int i = 0; i < 8; i++)
+            {
+                k[i] = V4(nSkeinIV512[i]);
+                msg[i] = in[i];
+            }
+            t0 = 64;
+            t1 = 0xF000000000000000ULL;  // first | final | message
+        }
+        else
+        {
+            for (int i = 0; i < 8; i++)
+                msg[i] = V4(0);
+            t0 = 8;
+            t1 = 0xFF00000000000000ULL;  // first | final | output
+        }
+        k[8] = V4(0x1BD11BDAA9FC1A22ULL) ^ k[0] ^ k[1] ^ k[2] ^ k[3] ^ k[4] ^ k[5] ^ k[6] ^ k[7];
+        for (int i = 9; i < 27; i++)
+            k[i] = k[i - 9];
+        for (int i = 0; i < 21; i += 3)
+        {
+            t[i] = t0;
+            t[i + 1] = t1;
+            t[i + 2] = t0 ^ t1;
+        }
+        for (int i = 0; i < 8; i++)
+            p[i] = msg[i];
+
+        for (int s = 0; s < 18; s += 2)
+        {
+            SKEIN_ADDKEY(s);
+            SKEIN_MIX8(0, 1, 2, 3, 4, 5, 6, 7, 46, 36, 19, 37);
+            SKEIN_MIX8(2, 1, 4, 7, 6, 5, 0, 3, 33, 27, 14, 42);
+            SKEIN_MIX8(4, 1, 6, 3, 0, 5, 2, 7, 17, 49, 36, 39);
+            SKEIN_MIX8(6, 1, 0, 7, 2, 5, 4, 3, 44,  9, 54, 56);
+            SKEIN_ADDKEY(s + 1);
+            SKEIN_MIX8(0, 1, 2, 3, 4, 5, 6, 7, 39, 30, 34, 24);
+            SKEIN_MIX8(2, 1, 4, 7, 6, 5, 0, 3, 13, 50, 10, 17);
+            SKEIN_MIX8(4, 1, 6, 3, 0, 5, 2, 7, 25, 29, 39, 43);
+            SKEIN_MIX8(6, 1, 0, 7, 2, 5, 4, 3,  8, 35, 56, 22);
+        }
+        SKEIN_ADDKEY(18);
+        for (int i = 0; i < 8; i++)
+            k[i] = p[i] ^ msg[i];
+    }
+#undef SKEIN_MIX
+#undef SKEIN_MIX8
+#undef SKEIN_ADDKEY
+
+    for (int i = 0; i < 8; i++)
+        out[i] = k[i];
+}
+
+/** Keccak-512 of four 64-byte messages: a single 72-byte rate block */
+X11_AVX2 static void keccak512_4way_64(const x11v4 in[8], x11v4 out[8])
+{
+    x11v4 A[25], B[25], C[5], D;
+    for (int i = 0; i < 8; i++)
+        A[i] = in[i];
+    A[8] = V4(0x8000000000000001ULL);
+    for (int i = 9; i < 25; i++)
+        A[i] = V4(0);
+
+#define KECCAK_THETA(x) do { \
+    D = C[((x) + 4) % 5] ^ V4_ROTL(C[((x) + 1) % 5], 1); \
+    A[(x)] ^= D; A[(x) + 5] ^= D; A[(x) + 10] ^= D; A[(x) + 15] ^= D; A[(x) + 20] ^= D; \
+} while (0)
+#define KECCAK_CHI(y) do { \
+    A[(y) + 0] = B[(y) + 0] ^ (~B[(y) + 1] & B[(y) + 2]); \
+    A[(y) + 1] = B[(y) + 1] ^ (~B[(y) + 2] & B[(y) + 3]); \
+    A[(y) + 2] = B[(y) + 2] ^ (~B[(y) + 3] & B[(y) + 4]); \
+    A[(y) + 3] = B[(y) + 3] ^ (~B[(y) + 4] & B[(y) + 0]); \
+    A[(y) + 4] = B[(y) + 4] ^ (~B[(y) + 0] & B[(y) + 1]); \
+} while (0)
+
+    for (int r = 0; r < 24; r++)
+    {
+        for (int x = 0; x < 5; x++)
+            C[x] = A[x] ^ A[x + 5] ^ A[x + 10] ^ A[x + 15] ^ A[x + 20];
+        KECCAK_THETA(0); KECCAK_THETA(1); KECCAK_THETA(2); KECCAK_THETA(3); KECCAK_THETA(4);
+
+        // rho and pi
+        B[ 0] = A[ 0]; B[ 1] = V4_ROTL(A[ 6], 44); B[ 2] = V4_ROTL(A[12], 43); B[ 3] = V4_ROTL(A[18], 21); B[ 4] = V4_ROTL(A[24], 14);
+        B[ 5] = V4_ROTL(A[ 3], 28); B[ 6] = V4_ROTL(A[ 9], 20); B[ 7] = V4_ROTL(A[10],  3); B[ 8] = V4_ROTL(A[16], 45); B[ 9] = V4_ROTL(A[22], 61);
+        B[10] = V4_ROTL(A[ 1],  1); B[11] = V4_ROTL(A[ 7],  6); B[12] = V4_ROTL(A[13], 25); B[13] = V4_ROTL(A[19],  8); B[14] = V4_ROTL(A[20], 18);
+        B[15] = V4_ROTL(A[ 4], 27); B[16] = V4_ROTL(A[ 5], 36); B[17] = V4_ROTL(A[11], 10); B[18] = V4_ROTL(A[17], 15); B[19] = V4_ROTL(A[23], 56);
+        B[20] = V4_ROTL(A[ 2], 62); B[21] = V4_ROTL(A[ 8], 55); B[22] = V4_ROTL(A[14], 39); B[23] = V4_ROTL(A[15], 41); B[24] = V4_ROTL(A[21],  2);
+
+        KECCAK_CHI(0); KECCAK_CHI(5); KECCAK_CHI(10); KECCAK_CHI(15); KECCAK_CHI(20);
+        A[0] ^= V4(nKeccakRC[r]);
+    }
+#undef KECCAK_THETA
+#undef KECCAK_CHI
+
+    for (int i = 0; i < 8; i++)
+        out[i] = A[i];
+}
+
+X11_AVX2 static void v4_store(const x11v4 v[8], unsigned char hash[4][64])
+{
+    for (int i = 0; i < 8; i++)
+        for (int j = 0; j < 4; j++)
+            memcpy(hash[j] + 8 * i, (const uint64_t*)&v[i] + j, 8);
+}
+
+X11_AVX2 static void v4_load(x11v4 v[8], const unsigned char hash[4][64])
+{
+    for (int i = 0; i < 8; i++)
+        v[i] = (x11v4){ ReadLE64(hash[0] + 8 * i), ReadLE64(hash[1] + 8 * i),
+                        ReadLE64(hash[2] + 8 * i), ReadLE64(hash[3] + 8 * i) };
+}
+
+/** X11 of four headers, given the Blake-512 state after the column step of round 0 */
+X11_AVX2 static void X11Hash4_avx2(x11v4 v[16], const x11v4 m[16], uint256* phash)
+{
+    union
+    {
+        sph_jh512_context       jh;
+        sph_luffa512_context    luffa;
+        sph_cubehash512_context cubehash;
+        sph_shavite512_context  shavite;
+        sph_simd512_context     simd;
+    } ctx;
+    unsigned char hash[2][4][64];
+    x11v4 a[8], b[8];
+
+    blake512_4way_finish(v, m, a);
+    for (int i = 0; i < 8; i++)
+        a[i] = v4_bswap(a[i]);
+    bmw512_4way_64(a, b);
+    v4_store(b, hash[0]);
+    for (int j = 0; j < 4; j++)
+        aesni_groestl512_64(hash[0][j], hash[1][j]);
+    v4_load(a, hash[1]);
+    skein512_4way_64(a, b);
+    v4_store(b, hash[0]);
+    for (int j = 0; j < 4; j++)
+    {
+        sph_jh512_init(&ctx.jh);
+        sph_jh512(&ctx.jh, hash[0][j], 64);
+        sph_jh512_close(&ctx.jh, hash[1][j]);
+    }
+    v4_load(a, hash[1]);
+    keccak512_4way_64(a, b);
+    v4_store(b, hash[0]);
+
+    for (int j = 0; j < 4; j++)
+    {
+        sph_luffa512_init(&ctx.luffa);
+        sph_luffa512(&ctx.luffa, hash[0][j], 64);
+        sph_luffa512_close(&ctx.luffa, hash[1][j]);
+
+        sph_cubehash512_init(&ctx.cubehash);
+        sph_cubehash512(&ctx.cubehash, hash[1][j], 64);
+        sph_cubehash512_close(&ctx.cubehash, hash[0][j]);
+
+        sph_shavite512_init(&ctx.shavite);
+        sph_shavite512(&ctx.shavite, hash[0][j], 64);
+        sph_shavite512_close(&ctx.shavite, hash[1][j]);
+
+        sph_simd512_init(&ctx.simd);
+        sph_simd512(&ctx.simd, hash[1][j], 64);
+        sph_simd512_close(&ctx.simd, hash[0][j]);
+
+        aesni_echo512_64(hash[0][j], hash[1][j]);
+        memcpy(&phash[j], hash[1][j], 32);
+    }
+}
+
+/** Four nonces of one header: the Blake-512 state is broadcast from the midstate */
+X11_AVX2 static void X11HashNonces4_avx2(const CX11HeaderMidstate& mid, const unsigned int* pnNonce, uint256* phash)
+{
+    x11v4 v[16], m[16];
+    for (int i = 0; i < 16; i++)
+    {
+        v[i] = V4(mid.v[i]);
+        m[i] = V4(mid.m[i]);
+    }
+    // m[9] is nBits || nNonce, big-endian
+    uint64_t nHigh = mid.m[9] & 0xFFFFFFFF00000000ULL;
+    m[9] = (x11v4){ nHigh | __builtin_bswap32(pnNonce[0]), nHigh | __builtin_bswap32(pnNonce[1]),
+                    nHigh | __builtin_bswap32(pnNonce[2]), nHigh | __builtin_bswap32(pnNonce[3]) };
+    X11Hash4_avx2(v, m, phash);
+}
+
+/** Four unrelated 80-byte headers */
+X11_AVX2 static void X11HashHeaders4_avx2(const unsigned char* pheaders, uint256* phash)
+{
+    uint64_t ms[4][16], vs[4][16];
+    for (int j = 0; j < 4; j++)
+    {
+        blake512_80_init(pheaders + 80 * j, ms[j], vs[j]);
+        BLAKE_COLUMNS(ms[j], 0, vs[j]);
+    }
+    x11v4 v[16], m[16];
+    for (int i = 0; i < 16; i++)
+    {
+        v[i] = (x11v4){ vs[0][i], vs[1][i], vs[2][i], vs[3][i] };
+        m[i] = (x11v4){ ms[0][i], ms[1][i], ms[2][i], ms[3][i] };
+    }
+    X11Hash4_avx2(v, m, phash);
+}
+
+#endif // USE_X11_AESNI
+
+static X11HashFunc GetEngineFunc(int nEngine)
+{
+    switch (nEngine)
+    {
+        case X11_ENGINE_GENERIC:
+            return &X11Hash_generic;
+#ifdef USE_X11_AESNI
+        case X11_ENGINE_AESNI:
+        case X11_ENGINE_AVX2:
+            return &X11Hash_aesni;
+#endif
+    }
+    return NULL;
+}
+
+static X11HashFunc pX11Hash = &X11Hash_generic;
+static int nX11Engine = X11_ENGINE_GENERIC;
+
+std::string X11EngineName(int nEngine)
+{
+    switch (nEngine)
+    {
+        case X11_ENGINE_GENERIC:
+            return std::string("generic");
+        case X11_ENGINE_AESNI:
+            return std::string("aesni");
+        case X11_ENGINE_AVX2:
+            return std::string("avx2");
+    }
+    return std::string("unknown");
+}
+
+bool X11EngineSupported(int nEngine)
+{
+    switch (nEngine)
+    {
+        case X11_ENGINE_GENERIC:
+            return true;
+#ifdef USE_X11_AESNI
+        case X11_ENGINE_AESNI:
+            return CPUHasAESNI();
+        case X11_ENGINE_AVX2:
+            return CPUHasAESNI() && CPUHasAVX2();
+#endif
+    }
+    return false;
+}
+
+bool X11EngineSelfTest(int nEngine)
+{
+    X11HashFunc func = GetEngineFunc(nEngine);
+    if (func == NULL || !X11EngineSupported(nEngine))
+        return false;
+
+    // Block headers are what we hash in practice, but cover other lengths too
+    unsigned char data[160];
+    for (unsigned int i = 0; i < sizeof(data); i++)
+        data[i] = (unsigned char)(i * 7 + 3);
+    static const size_t nLengths[] = { 0, 1, 64, 80, 128, 160 };
+    for (unsigned int n = 0; n < sizeof(nLengths) / sizeof(nLengths[0]); n++)
+    {
+        for (int nRound = 0; nRound < 4; nRound++)
+        {
+            data[nRound] ^= 0x5a;
+            uint256 hashExpected = HashX11(data, data + nLengths[n]);
+            uint256 hash;
+            func(data, nLengths[n], &hash);
+            if (hash != hashExpected)
+                return false;
+        }
+    }
+
+#ifdef USE_X11_AESNI
+    if (nEngine == X11_ENGINE_AVX2)
+    {
+        // Lanes must not bleed into each other: give each one a different nonce
+        // and, for the multi-header path, a different prefix as well
+        unsigned char headers[4][80];
+        uint256 hashes[4];
+        for (int j = 0; j < 4; j++)
+        {
+            memcpy(headers[j], data, 80);
+            headers[j][j * 17] ^= 0xa5;
+            headers[j][76] = (unsigned char)j;
+            headers[j][79] = (unsigned char)(0xff - j);
+        }
+        X11HashHeaders4_avx2(&headers[0][0], hashes);
+        for (int j = 0; j < 4; j++)
+            if (hashes[j] != HashX11(headers[j], headers[j] + 80))
+                return false;
+
+        CX11HeaderMidstate mid;
+        X11PrepareHeader(mid, headers[0]);
+        unsigned int nNonces[4] = { 0, 1, 0x7fffffff, 0xfffffffe };
+        X11HashNonces4_avx2(mid, nNonces, hashes);
+        for (int j = 0; j < 4; j++)
+        {
+            memcpy(&headers[0][76], &nNonces[j], 4);
+            if (hashes[j] != HashX11(headers[0], headers[0] + 80))
+                return false;
+        }
+    }
+#endif
+    return true;
+}
+
+bool X11EngineInit(const std::string& strEngine)
+{
+    if (strEngine != "auto")
+    {
+        for (int nEngine = 0; nEngine < NUM_X11_ENGINES; nEngine++)
+        {
+            if (X11EngineName(nEngine) != strEngine)
+                continue;
+            if (!X11EngineSelfTest(nEngine))
+                return false;
+            pX11Hash = GetEngineFunc(nEngine);
+            nX11Engine = nEngine;
+            LogPrintf("Using X11 engine %s\n", X11EngineName(nEngine));
+            return true;
+        }
+        return false;
+    }
+
+    // Pick the most capable engine that passes its self-test
+    for (int nEngine = NUM_X11_ENGINES - 1; nEngine >= 0; nEngine--)
+    {
+        if (!X11EngineSupported(nEngine))
+            continue;
+        if (!X11EngineSelfTest(nEngine))
+        {
+            LogPrintf("X11 engine %s failed self-test, not using it\n", X11EngineName(nEngine));
+            continue;
+        }
+        pX11Hash = GetEngineFunc(nEngine);
+        nX11Engine = nEngine;
+        LogPrintf("Using X11 engine %s\n", X11EngineName(nEngine));
+        return true;
+    }
+    return false;
+}
+
+int X11EngineActive()
+{
+    return nX11Engine;
+}
+
+void X11EngineHash(int nEngine, const void* pdata, size_t nLen, void* pout)
+{
+    X11HashFunc func = GetEngineFunc(nEngine);
+    if (func == NULL)
+        func = &X11Hash_generic;
+    func(pdata, nLen, pout);
+}
+
+void X11Hash(const void* pdata, size_t nLen, void* pout)
+{
+    pX11Hash(pdata, nLen, pout);
+}
+
+unsigned int X11LaneCount()
+{
+    return nX11Engine == X11_ENGINE_AVX2 ? 4 : 1;
+}
+
+void X11HashNonces(const CX11HeaderMidstate& mid, const unsigned int* pnNonce, unsigned int nCount, uint256* phash)
+{
+#ifdef USE_X11_AESNI
+    if (nX11Engine == X11_ENGINE_AVX2)
+    {
+        for (; nCount >= 4; nCount -= 4, pnNonce += 4, phash += 4)
+            X11HashNonces4_avx2(mid, pnNonce, phash);
+    }
+#endif
+    unsigned char header[80];
+    memcpy(header, mid.header, sizeof(header));
+    for (unsigned int i = 0; i < nCount; i++)
+    {
+        memcpy(header + 76, &pnNonce[i], 4);
+        pX11Hash(header, sizeof(header), &phash[i]);
+    }
+}
+
+void X11HashHeaders(const unsigned char* pheaders, unsigned int nCount, uint256* phash)
+{
+#ifdef USE_X11_AESNI
+    if (nX11Engine == X11_ENGINE_AVX2)
+    {
+        for (; nCount >= 4; nCount -= 4, pheaders += 4 * 80, phash += 4)
+            X11HashHeaders4_avx2(pheaders, phash);
+    }
+#endif
+    for (unsigned int i = 0; i < nCount; i++)
+        pX11Hash(pheaders + 80 * i, 80, &phash[i]);
+}
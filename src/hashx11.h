@@ -18,9 +18,7 @@
 #include <openssl/ripemd.h>
 #include <vector>
 
-#ifndef QT_NO_DEBUG
 #include <string>
-#endif
 
 #ifdef GLOBALDEFINED
 #define GLOBAL
@@ -133,6 +131,61 @@ inline uint256 HashX11(const T1 pbegin, const T1 pend)
     return hash[10].trim256();
 }
 
+/** X11 engine implementations, selected once at startup by X11EngineInit() */
+enum X11EngineType
+{
+    X11_ENGINE_GENERIC = 0, // portable sph_* chain
+    X11_ENGINE_AESNI   = 1, // AES-NI/SSE4.1 Groestl and Echo, sph_* for the other stages
+    X11_ENGINE_AVX2    = 2, // as aesni, plus 4-lane AVX2 Blake/BMW/Skein/Keccak for batches
+    NUM_X11_ENGINES
+};
+
+/** Detect CPU features, self-test the best supported engine and make it active.
+ *  strEngine may be "auto" or the name of an engine to force.
+ *  @return false if a forced engine is unknown, unsupported or fails its self-test
+ */
+bool X11EngineInit(const std::string& strEngine = "auto");
+/** Whether this binary and CPU can run the given engine */
+bool X11EngineSupported(int nEngine);
+/** Compare the given engine against the sph reference path (HashX11) */
+bool X11EngineSelfTest(int nEngine);
+std::string X11EngineName(int nEngine);
+int X11EngineActive();
+
+/** Hash with a specific engine; pout receives the 32-byte X11 digest */
+void X11EngineHash(int nEngine, const void* pdata, size_t nLen, void* pout);
+/** Hash with the active engine */
+void X11Hash(const void* pdata, size_t nLen, void* pout);
+
+/** Number of candidates the active engine hashes side by side; batch sizes
+ *  that are a multiple of this avoid a scalar tail */
+unsigned int X11LaneCount();
+
+/** An 80-byte block header plus the part of its Blake-512 compression that
+ *  does not depend on nNonce (see X11PrepareHeader) */
+struct CX11HeaderMidstate
+{
+    unsigned char header[80];
+    uint64_t m[16];   // Blake-512 message words
+    uint64_t v[16];   // Blake-512 state after the column step of round 0
+};
+
+/** Fill mid from a serialized 80-byte header; its nNonce field is ignored */
+void X11PrepareHeader(CX11HeaderMidstate& mid, const void* pheader);
+/** X11 of mid's header with each of nCount nonces: phash[i] gets the hash for pnNonce[i] */
+void X11HashNonces(const CX11HeaderMidstate& mid, const unsigned int* pnNonce, unsigned int nCount, uint256* phash);
+/** X11 of nCount consecutive serialized 80-byte headers */
+void X11HashHeaders(const unsigned char* pheaders, unsigned int nCount, uint256* phash);
+
+template<typename T1>
+inline uint256 HashX11Fast(const T1 pbegin, const T1 pend)
+{
+    static unsigned char pblank[1];
+    uint256 hash;
+    X11Hash((pbegin == pend ? pblank : static_cast<const void*>(&pbegin[0])), (pend - pbegin) * sizeof(pbegin[0]), &hash);
+    return hash;
+}
+
 
 
 
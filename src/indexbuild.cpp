@@ -0,0 +1,165 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "indexbuild.h"
+
+#include "addressindex.h"
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+// Guarded by cs_main
+static CIndexBuildState indexBuild;
+static int nIndexBuildHeight = 0;
+
+bool LoadIndexBuildState()
+{
+    LOCK(cs_main);
+    indexBuild = CIndexBuildState();
+    nIndexBuildHeight = 0;
+    if (!pblocktree->ReadIndexBuild(indexBuild))
+        return true;
+    BlockMap::iterator mi = mapBlockIndex.find(indexBuild.hashCursor);
+    if (mi != mapBlockIndex.end())
+        nIndexBuildHeight = mi->second->nHeight;
+    LogPrintf("LoadIndexBuildState(): indexes %x built up to height %d\n", indexBuild.nIndexes, nIndexBuildHeight);
+    return true;
+}
+
+bool StartIndexBuild(int nIndexes)
+{
+    LOCK(cs_main);
+    indexBuild.nIndexes |= nIndexes;
+    indexBuild.hashCursor = 0;
+    nIndexBuildHeight = 0;
+    // The build state goes first, so that an index is never taken for
+    // complete after a crash
+    if (!pblocktree->WriteIndexBuild(indexBuild))
+        return false;
+    if (nIndexes & INDEX_BUILD_TX) {
+        fTxIndex = true;
+        pblocktree->WriteFlag("txindex", true);
+    }
+    if (nIndexes & INDEX_BUILD_ADDRESS) {
+        fAddressIndex = true;
+        pblocktree->WriteFlag("addressindex", true);
+    }
+    if (nIndexes & INDEX_BUILD_SPENT) {
+        fSpentIndex = true;
+        pblocktree->WriteFlag("spentindex", true);
+    }
+    LogPrintf("StartIndexBuild(): building indexes %x in the background\n", indexBuild.nIndexes);
+    return true;
+}
+
+bool IsIndexBuilding(int nIndexes, int *pnHeight)
+{
+    LOCK(cs_main);
+    if (pnHeight)
+        *pnHeight = nIndexBuildHeight;
+    return (indexBuild.nIndexes & nIndexes) != 0;
+}
+
+// The first block of the active chain after the cursor. Blocks above the
+// fork of a disconnected cursor had their entries erased by DisconnectTip.
+static CBlockIndex *GetIndexBuildNext()
+{
+    AssertLockHeld(cs_main);
+    CBlockIndex *pindex = NULL;
+    BlockMap::iterator mi = mapBlockIndex.find(indexBuild.hashCursor);
+    if (mi != mapBlockIndex.end())
+        pindex = mi->second;
+    while (pindex && !chainActive.Contains(pindex))
+        pindex = pindex->pprev;
+    // The genesis block has no transactions to index
+    return pindex ? chainActive.Next(pindex) : chainActive[1];
+}
+
+// The entries of one block, as ConnectBlock writes them
+static bool AddBlockIndexes(const CBlockIndex *pindex, int nIndexes, vector<pair<uint256, CDiskTxPos> > &vPos, CAddressIndexUpdate &update)
+{
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex))
+        return error("AddBlockIndexes() : failed to read block %s", pindex->GetBlockHash().ToString());
+
+    if (nIndexes & INDEX_BUILD_TX) {
+        CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
+        BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+            vPos.push_back(make_pair(tx.GetHash(), pos));
+            pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+        }
+    }
+
+    if (nIndexes & (INDEX_BUILD_ADDRESS | INDEX_BUILD_SPENT)) {
+        CBlockUndo blockundo;
+        CDiskBlockPos pos = pindex->GetUndoPos();
+        if (pos.IsNull() || !blockundo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+            return error("AddBlockIndexes() : failed to read undo data of block %s", pindex->GetBlockHash().ToString());
+        if (nIndexes & INDEX_BUILD_ADDRESS)
+            update.AddBlock(block, blockundo, pindex->nHeight, false);
+        if (nIndexes & INDEX_BUILD_SPENT)
+            update.AddSpentOutputs(block, blockundo, pindex->nHeight, false);
+    }
+    return true;
+}
+
+void ThreadBuildIndexes()
+{
+    RenameThread("bitcoin-idxbuild");
+    int64_t nStart = GetTimeMillis();
+
+    while (true) {
+        boost::this_thread::interruption_point();
+
+        // The next blocks of the active chain, read without holding cs_main
+        vector<CBlockIndex*> vBlocks;
+        CIndexBuildState state;
+        {
+            LOCK(cs_main);
+            state = indexBuild;
+            if (state.nIndexes == 0)
+                return;
+            for (CBlockIndex *pindex = GetIndexBuildNext(); pindex && (int)vBlocks.size() < INDEX_BUILD_BATCH_BLOCKS; pindex = chainActive.Next(pindex))
+                vBlocks.push_back(pindex);
+            if (vBlocks.empty()) {
+                // The blocks from here on are indexed by ConnectBlock
+                indexBuild = CIndexBuildState();
+                if (!pblocktree->WriteIndexBuild(indexBuild))
+                    error("ThreadBuildIndexes() : failed to write the index build state");
+                LogPrintf("ThreadBuildIndexes(): indexes %x built up to height %d in %ds\n", state.nIndexes, nIndexBuildHeight, (GetTimeMillis() - nStart) / 1000);
+                return;
+            }
+        }
+
+        vector<pair<uint256, CDiskTxPos> > vPos;
+        CAddressIndexUpdate update;
+        BOOST_FOREACH(const CBlockIndex *pindex, vBlocks) {
+            boost::this_thread::interruption_point();
+            if (!AddBlockIndexes(pindex, state.nIndexes, vPos, update)) {
+                LogPrintf("ThreadBuildIndexes(): stopped at height %d, the build resumes on the next start\n", nIndexBuildHeight);
+                return;
+            }
+        }
+
+        // Written with the cursor in one batch, unless a reorganization
+        // disconnected the blocks in the meantime or the build started over
+        LOCK(cs_main);
+        if (!chainActive.Contains(vBlocks.back()) || indexBuild.nIndexes != state.nIndexes || indexBuild.hashCursor != state.hashCursor)
+            continue;
+        state.hashCursor = vBlocks.back()->GetBlockHash();
+        if (!pblocktree->WriteTxIndex(vPos, update, &state)) {
+            error("ThreadBuildIndexes() : failed to write the indexes");
+            return;
+        }
+        indexBuild = state;
+        nIndexBuildHeight = vBlocks.back()->nHeight;
+        if (nIndexBuildHeight % 10000 < INDEX_BUILD_BATCH_BLOCKS)
+            LogPrintf("ThreadBuildIndexes(): indexes built up to height %d\n", nIndexBuildHeight);
+    }
+}
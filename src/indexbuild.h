@@ -0,0 +1,54 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_INDEXBUILD_H
+#define BITCOIN_INDEXBUILD_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+// Indexes that can be built for the blocks connected before they were
+// enabled, without a -reindex
+enum
+{
+    INDEX_BUILD_TX      = (1 << 0),
+    INDEX_BUILD_ADDRESS = (1 << 1),
+    INDEX_BUILD_SPENT   = (1 << 2),
+};
+
+// Number of blocks whose index entries are written in one batch
+static const int INDEX_BUILD_BATCH_BLOCKS = 100;
+
+/** Progress of the background build of indexes, kept in the block tree
+ *  database so that it resumes after a restart. New blocks are indexed by
+ *  ConnectBlock as soon as the build starts; the build indexes the blocks
+ *  of the active chain from the genesis block up to the tip. */
+class CIndexBuildState
+{
+public:
+    int nIndexes;        // INDEX_BUILD_* flags of the indexes being built
+    uint256 hashCursor;  // last block indexed, 0 if none yet
+
+    CIndexBuildState() : nIndexes(0), hashCursor(0) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nIndexes);
+        READWRITE(hashCursor);
+    )
+};
+
+// Start building the given indexes: enable them (and store them as enabled),
+// from the genesis block on. Indexes already being built start over.
+bool StartIndexBuild(int nIndexes);
+
+// Whether some index (of the INDEX_BUILD_* flags) is still being built, and
+// the height up to which it is complete
+bool IsIndexBuilding(int nIndexes, int *pnHeight = NULL);
+
+// Load the stored state of the build
+bool LoadIndexBuildState();
+
+void ThreadBuildIndexes();
+
+#endif // BITCOIN_INDEXBUILD_H
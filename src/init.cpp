@@ -10,13 +10,21 @@
 #include "init.h"
 
 #include "addrman.h"
+#include "blockimport.h"
+#include "blockprofile.h"
 #include "checkpoints.h"
+#include "indexbuild.h"
 #include "key.h"
 #include "main.h"
 #include "miner.h"
+#include "miner_opencl.h"
 #include "net.h"
+#include "proptrace.h"
 #include "rpcserver.h"
+#include "scheduler.h"
+#include "stratum.h"
 #include "txdb.h"
+#include "txoutset.h"
 #include "ui_interface.h"
 #include "util.h"
 #ifdef ENABLE_WALLET
@@ -93,6 +101,10 @@ enum BindFlags {
 //
 
 volatile bool fRequestShutdown = false;
+// Set once mempool.dat is loaded, so a shutdown before does not overwrite it
+static bool fDumpMempoolLater = false;
+// Set once the chain state is loaded, so there is a coins cache to dump
+static bool fDumpCoinsCacheLater = false;
 
 void StartShutdown()
 {
@@ -103,8 +115,6 @@ bool ShutdownRequested()
     return fRequestShutdown;
 }
 
-static CCoinsViewDB *pcoinsdbview;
-
 void Shutdown()
 {
     LogPrintf("Shutdown : In progress...\n");
@@ -115,6 +125,7 @@ void Shutdown()
     RenameThread("bitcoin-shutoff");
     mempool.AddTransactionsUpdated(1);
     StopRPCThreads();
+    StopStratum();
     ShutdownRPCMining();
 #ifdef ENABLE_WALLET
     if (pwalletMain)
@@ -123,6 +134,12 @@ void Shutdown()
 #endif
     StopNode();
     UnregisterNodeSignals(GetNodeSignals());
+    // Let the wallets see the blocks connected before the threads stopped
+    SyncWalletNotifications();
+    if (fDumpMempoolLater)
+        DumpMempool();
+    if (fDumpCoinsCacheLater)
+        DumpCoinsCache();
     {
         LOCK(cs_main);
 #ifdef ENABLE_WALLET
@@ -131,15 +148,29 @@ void Shutdown()
 #endif
         if (pblocktree)
             pblocktree->Flush();
-        if (pcoinsTip)
+        // Only the modified outputs are written; their number is kept below
+        // -dbmaxdirty by the writes while running
+        if (pcoinsTip) {
+            int64_t nStart = GetTimeMillis();
+            size_t nDirty = pcoinsTip->GetDirtyCount();
+            uiInterface.InitMessage(strprintf(_("Writing %u modified outputs..."), nDirty));
+            LogPrintf("Shutdown : writing %u modified outputs of %u cached\n", nDirty, pcoinsTip->GetCacheSize());
             pcoinsTip->Flush();
+            if (pcoinsAsync)
+                pcoinsAsync->Sync();
+            LogPrintf("Shutdown : chainstate written in %dms\n", GetTimeMillis() - nStart);
+        }
         delete pcoinsTip; pcoinsTip = NULL;
+        delete pcoinsAsync; pcoinsAsync = NULL;
         delete pcoinsdbview; pcoinsdbview = NULL;
         delete pblocktree; pblocktree = NULL;
     }
 #ifdef ENABLE_WALLET
-    if (pwalletMain)
+    if (pwalletMain) {
+        int64_t nStart = GetTimeMillis();
         bitdb.Flush(true);
+        LogPrintf("Shutdown : wallet environment closed in %dms\n", GetTimeMillis() - nStart);
+    }
 #endif
     boost::filesystem::remove(GetPidFile());
     UnregisterAllWallets();
@@ -147,7 +178,9 @@ void Shutdown()
     if (pwalletMain)
         delete pwalletMain;
 #endif
+    taskScheduler.Stop();
     LogPrintf("Shutdown : done\n");
+    StopDebugLogWriter();
 }
 
 //
@@ -194,8 +227,10 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -?                     " + _("This help message") + "\n";
     strUsage += "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)") + "\n";
     strUsage += "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n";
+    strUsage += "  -blockpipeline=<n>     " + strprintf(_("Check up to <n> received blocks while an earlier one is connected (0 to %d, default: %d)"), MAX_BLOCKS_IN_TRANSIT_PER_PEER, DEFAULT_BLOCK_PIPELINE_DEPTH) + "\n";
     strUsage += "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 288, 0 = all)") + "\n";
     strUsage += "  -checklevel=<n>        " + _("How thorough the block verification of -checkblocks is (0-4, default: 3)") + "\n";
+    strUsage += "  -backgroundverify      " + _("Verify the -checkblocks blocks once started rather than before (default: 1)") + "\n";
     strUsage += "  -conf=<file>           " + _("Specify configuration file (default: digitalcoin.conf)") + "\n";
     if (hmm == HMM_BITCOIND)
     {
@@ -203,16 +238,47 @@ std::string HelpMessage(HelpMessageMode hmm)
         strUsage += "  -daemon                " + _("Run in the background as a daemon and accept commands") + "\n";
 #endif
     }
+    strUsage += "  -addressindex          " + _("Maintain an index of the history and unspent outputs of each address, for getaddresstxids, getaddressutxos and getaddressbalance (default: 0)") + "\n";
+    strUsage += "  -assumevalid=<hex>     " + _("Skip the script checks of this block and its ancestors, 0 to check all scripts (default: 0)") + "\n";
+    strUsage += "  -blockcachemb=<n>      " + strprintf(_("Keep up to <n> MiB of recently connected blocks in memory (default: %u)"), DEFAULT_BLOCK_CACHE_MB) + "\n";
+    strUsage += "  -blockcompression=<n>  " + strprintf(_("Compress new block and undo data with zstd at level <n> (0 to %d, 0 = disabled, default: %d)"), MAX_BLOCK_COMPRESSION, DEFAULT_BLOCK_COMPRESSION) + "\n";
+    strUsage += "  -blockfilterindex      " + _("Maintain an index of compact block filters and serve them to peers (default: 0)") + "\n";
+    strUsage += "  -blockmapfiles=<n>     " + strprintf(_("Keep up to <n> block files memory-mapped for reading blocks, 0 to disable (default: %u)"), DEFAULT_BLOCK_MAP_FILES) + "\n";
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -dbcache=<n>           " + strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache) + "\n";
+    strUsage += "  -dbflushinterval=<n>   " + strprintf(_("Write the chain state to disk at least every <n> seconds during initial block download (default: %u)"), DEFAULT_DB_FLUSH_INTERVAL) + "\n";
+    strUsage += "  -dbmaxdirty=<n>        " + strprintf(_("Write the chain state to disk once <n> outputs are modified, which bounds the time shutdown takes (default: %u)"), DEFAULT_DB_MAX_DIRTY) + "\n";
+    strUsage += "  -<db>.writebuffer=<n>  " + _("Set the LevelDB write buffer of database <db> (chainstate or blockindex) in KiB (default: a quarter of its cache)") + "\n";
+    strUsage += "  -<db>.blocksize=<n>    " + _("Set the LevelDB table block size of database <db> in KiB (default: 4)") + "\n";
+    strUsage += "  -<db>.maxopenfiles=<n> " + _("Keep at most <n> table files of database <db> open (default: 64)") + "\n";
+    strUsage += "  -<db>.compression      " + _("Compress the tables of database <db> (default: 0)") + "\n";
+    strUsage += "  -<db>.bloombits=<n>    " + _("Use <n> bits per key in the bloom filter of database <db>, 0 to disable (default: 10)") + "\n";
     strUsage += "  -keypool=<n>           " + _("Set key pool size to <n> (default: 100)") + "\n";
+    strUsage += "  -headersfirst          " + strprintf(_("Sync headers first, verifying their proof of work in parallel, then fetch blocks from several peers (default: %u)"), DEFAULT_HEADERS_FIRST) + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + " " + _("on startup") + "\n";
-    strUsage += "  -maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
+    strUsage += "  -loadtxoutset=<file>   " + _("Start from a snapshot of the unspent output set written by dumptxoutset instead of downloading the blocks up to it, on an empty data directory (requires -prune)") + "\n";
+    strUsage += "  -limitancestorcount=<n> " + strprintf(_("Do not accept transactions with <n> or more unconfirmed ancestors in the memory pool (default: %u)"), DEFAULT_ANCESTOR_LIMIT) + "\n";
+    strUsage += "  -limitancestorsize=<n> " + strprintf(_("Do not accept transactions whose size with their unconfirmed ancestors exceeds <n> kB (default: %u)"), DEFAULT_ANCESTOR_SIZE_LIMIT) + "\n";
+    strUsage += "  -limitdescendantcount=<n> " + strprintf(_("Do not accept transactions that would give an unconfirmed one <n> or more descendants in the memory pool (default: %u)"), DEFAULT_DESCENDANT_LIMIT) + "\n";
+    strUsage += "  -limitdescendantsize=<n> " + strprintf(_("Do not accept transactions that would give an unconfirmed one more than <n> kB of descendants (default: %u)"), DEFAULT_DESCENDANT_SIZE_LIMIT) + "\n";
+    strUsage += "  -maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
+    strUsage += "  -maxorphanblocksize=<n> " + strprintf(_("Keep at most <n> megabytes of unconnectable blocks in memory, and the others on disk (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS_SIZE) + "\n";
     strUsage += "  -maxorphantx=<n>       " + strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS) + "\n";
+    strUsage += "  -maxorphantxsize=<n>   " + strprintf(_("Keep at most <n> kilobytes of unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE) + "\n";
+    strUsage += "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n";
     strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
+    strUsage += "  -schedulerthreads=<n>  " + strprintf(_("Set the number of worker threads shared by block import, wallet rescans and loading, and signing (up to %d, 0 = one per core, <0 = leave that many cores free, default: %d)"), MAX_SCHEDULER_THREADS, DEFAULT_SCHEDULER_THREADS) + "\n";
+    strUsage += "  -scheduleraffinity     " + _("Bind the shared worker threads to the NUMA nodes of the machine (default: 0)") + "\n";
+    strUsage += "  -persistcoinscache     " + _("Save which coins are cached on shutdown and read them back into the cache in the background on startup (default: 1)") + "\n";
+    strUsage += "  -persistmempool        " + _("Save the memory pool on shutdown and load it on startup (default: 1)") + "\n";
     strUsage += "  -pid=<file>            " + _("Specify pid file (default: bitcoind.pid)") + "\n";
+    strUsage += "  -prune=<n>             " + strprintf(_("Delete the oldest block and undo files to keep them below <n> MiB, keeping the last %d blocks (incompatible with -txindex, -addressindex and -spentindex, 0 = disabled, minimum: %u)"), MIN_BLOCKS_TO_KEEP, MIN_DISK_SPACE_FOR_BLOCK_FILES >> 20) + "\n";
+    strUsage += "  -recompressblocks      " + _("With -blockcompression, also rewrite the existing block and undo files compressed, in the background once synced (default: 1)") + "\n";
     strUsage += "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + " " + _("on startup") + "\n";
-    strUsage += "  -txindex               " + _("Maintain a full transaction index (default: 0)") + "\n";
+    strUsage += "  -spentindex            " + _("Maintain an index of the input spending each output, for getspentinfo (default: 0)") + "\n";
+    strUsage += "  -txcachemb=<n>         " + strprintf(_("Keep up to <n> MiB of recently looked up transactions in memory (default: %u)"), DEFAULT_TX_CACHE_MB) + "\n";
+    strUsage += "  -txidcachemb=<n>       " + strprintf(_("Keep up to <n> MiB of the txids of blocks recently asked for merkle proofs in memory (default: %u)"), DEFAULT_TXID_CACHE_MB) + "\n";
+    strUsage += "  -txindex               " + _("Maintain a full transaction index, built in the background when enabled on an existing chain (default: 0)") + "\n";
 
     strUsage += "\n" + _("Connection options:") + "\n";
     strUsage += "  -addnode=<ip>          " + _("Add a node to connect to and attempt to keep the connection open") + "\n";
@@ -229,6 +295,9 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -maxconnections=<n>    " + _("Maintain at most <n> connections to peers (default: 125)") + "\n";
     strUsage += "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n";
     strUsage += "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n";
+    strUsage += "  -maxuploadrate=<n>     " + _("Limit uploading to all peers together to <n> KB per second, 0 for no limit (default: 0)") + "\n";
+    strUsage += "  -maxuploadtarget=<n>   " + _("Try to keep uploading below <n> MiB per 24h; historical blocks stop being served first, 0 for no target (default: 0)") + "\n";
+    strUsage += "  -msgthreads=<n>        " + strprintf(_("Number of threads processing peer messages, 1 to %d (default: %d)"), MAX_MESSAGE_HANDLER_THREADS, DEFAULT_MESSAGE_HANDLER_THREADS) + "\n";
     strUsage += "  -onion=<ip:port>       " + _("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: -proxy)") + "\n";
     strUsage += "  -onlynet=<net>         " + _("Only connect to nodes in network <net> (IPv4, IPv6 or Tor)") + "\n";
     strUsage += "  -port=<port>           " + _("Listen for connections on <port> (default: 8333 or testnet: 18333)") + "\n";
@@ -248,12 +317,17 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "\n" + _("Wallet options:") + "\n";
     strUsage += "  -disablewallet         " + _("Do not load the wallet and disable wallet RPC calls") + "\n";
     strUsage += "  -keypool=<n>           " + _("Set key pool size to <n> (default: 100)") + "\n";
+    strUsage += "  -lazyunlock            " + _("Derive the keys of stealth payments received while the wallet was locked when they are used, instead of on unlock (default: 0)") + "\n";
     strUsage += "  -paytxfee=<amt>        " + _("Fee per kB to add to transactions you send") + "\n";
     strUsage += "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + " " + _("on startup") + "\n";
     strUsage += "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + " " + _("on startup") + "\n";
     strUsage += "  -spendzeroconfchange   " + _("Spend unconfirmed change when sending transactions (default: 1)") + "\n";
     strUsage += "  -upgradewallet         " + _("Upgrade wallet to latest format") + " " + _("on startup") + "\n";
+    strUsage += "  -usehd                 " + strprintf(_("Derive the keys of a new wallet from one seed after BIP32, so that a backup of the wallet covers all its future keys (default: %u)"), DEFAULT_USE_HD_WALLET) + "\n";
     strUsage += "  -wallet=<file>         " + _("Specify wallet file (within data directory)") + " " + _("(default: wallet.dat)") + "\n";
+    strUsage += "  -walletdbcache=<n>     " + strprintf(_("Set the wallet database cache size in megabytes (default: %d)"), DEFAULT_WALLET_DB_CACHE) + "\n";
+    strUsage += "  -walletdblogbuffer=<n> " + strprintf(_("Set the wallet database log buffer size in kilobytes (default: %d)"), DEFAULT_WALLET_DB_LOG_BUFFER) + "\n";
+    strUsage += "  -walletleveldb         " + _("Keep the wallet in a LevelDB store, <file>.ldb, migrating an existing wallet file to it (default: 0)") + "\n";
     strUsage += "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n";
     strUsage += "  -zapwallettxes         " + _("Clear list of wallet transactions (diagnostic tool; implies -rescan)") + "\n";
 #endif
@@ -269,24 +343,35 @@ std::string HelpMessage(HelpMessageMode hmm)
         strUsage += "  -dropmessagestest=<n>  " + _("Randomly drop 1 of every <n> network messages") + "\n";
         strUsage += "  -fuzzmessagestest=<n>  " + _("Randomly fuzz 1 of every <n> network messages") + "\n";
         strUsage += "  -flushwallet           " + _("Run a thread to flush wallet periodically (default: 1)") + "\n";
+        strUsage += "  -x11engine=<engine>    " + _("X11 hash implementation: auto, generic, aesni or avx2 (default: auto)") + "\n";
+        strUsage += "  -sha256engine=<engine> " + _("SHA-256 implementation: auto, generic, sse4, avx2 or shani (default: auto)") + "\n";
     }
     strUsage += "  -debug=<category>      " + _("Output debugging information (default: 0, supplying <category> is optional)") + "\n";
     strUsage += "                         " + _("If <category> is not supplied, output all debugging information.") + "\n";
     strUsage += "                         " + _("<category> can be:");
-    strUsage +=                                 " addrman, alert, coindb, db, lock, rand, rpc, selectcoins, mempool, net"; // Don't translate these and qt below
+    strUsage +=                                 " addrman, alert, coindb, db, lock, rand, rpc, selectcoins, mempool, net, retarget, stratum"; // Don't translate these and qt below
     if (hmm == HMM_BITCOIN_QT)
         strUsage += ", qt";
     strUsage += ".\n";
 #ifdef ENABLE_WALLET
     strUsage += "  -gen                   " + _("Generate coins (default: 0)") + "\n";
     strUsage += "  -genproclimit=<n>      " + _("Set the processor limit for when generation is on (-1 = unlimited, default: -1)") + "\n";
+    strUsage += "  -genalgothreads=<spec> " + _("Mine several algorithms at once with per-algorithm thread counts, e.g. sha256d:2,scrypt:4,x11:8 (overrides -algo and -genproclimit)") + "\n";
+    strUsage += "  -genpin                " + _("Pin each miner thread to its own CPU (default: 0)") + "\n";
+    strUsage += "  -opencl                " + _("Also mine scrypt on OpenCL devices when generating coins (default: 0)") + "\n";
+    strUsage += "  -openclbatch=<n>       " + strprintf(_("Nonces each OpenCL device hashes per launch, each taking 128 KiB of its memory (default: %u)"), DEFAULT_OPENCL_BATCH) + "\n";
+    strUsage += "  -opencldevices=<n,...> " + _("Mine on these OpenCL devices, numbered across platforms as logged at startup (default: every GPU)") + "\n";
 #endif
     strUsage += "  -help-debug            " + _("Show all debugging options (usage: --help -help-debug)") + "\n";
+    strUsage += "  -logratelimit=<n>      " + strprintf(_("Stop logging messages from a place in the code after <n> KiB in an hour, 0 = unlimited; -debug categories are exempt (default: %u)"), DEFAULT_LOG_RATE_LIMIT) + "\n";
     strUsage += "  -logtimestamps         " + _("Prepend debug output with timestamp (default: 1)") + "\n";
     if (GetBoolArg("-help-debug", false))
     {
         strUsage += "  -limitfreerelay=<n>    " + _("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default:15)") + "\n";
-        strUsage += "  -maxsigcachesize=<n>   " + _("Limit size of signature cache to <n> entries (default: 50000)") + "\n";
+        strUsage += "  -lockprofile           " + _("Record lock wait and hold times per lock site, see getlockstats (default: 0)") + "\n";
+        strUsage += "  -proptrace=<n>         " + _("Record the last <n> block and transaction propagation events, see getpropagationtrace (default: 0)") + "\n";
+        strUsage += "  -blockprofiles=<n>     " + strprintf(_("Keep where the time went connecting the last <n> blocks, see getblockprofile (default: %u)"), DEFAULT_BLOCK_PROFILES) + "\n";
+        strUsage += "  -maxsigcachesize=<n>   " + strprintf(_("Limit size of signature cache to <n> MiB (default: %u)"), DEFAULT_MAX_SIG_CACHE_SIZE) + "\n";
     }
     strUsage += "  -mintxfee=<amt>        " + _("Fees smaller than this are considered zero fee (for transaction creation) (default:") + " " + FormatMoney(CTransaction::nMinTxFee) + ")" + "\n";
     strUsage += "  -minrelaytxfee=<amt>   " + _("Fees smaller than this are considered zero fee (for relaying) (default:") + " " + FormatMoney(CTransaction::nMinRelayTxFee) + ")" + "\n";
@@ -309,8 +394,18 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -blockmaxsize=<n>      " + strprintf(_("Set maximum block size in bytes (default: %d)"), DEFAULT_BLOCK_MAX_SIZE) + "\n";
     strUsage += "  -blockprioritysize=<n> " + strprintf(_("Set maximum size of high-priority/low-fee transactions in bytes (default: %d)"), DEFAULT_BLOCK_PRIORITY_SIZE) + "\n";
     strUsage += "  -algo=<algo>           " + _("Mining algorithm: sha256d, scrypt, x11") + "\n";
+
+    strUsage += "\n" + _("Stratum server options:") + "\n";
+    strUsage += "  -stratum               " + _("Accept Stratum mining connections, one port per algorithm (default: 0)") + "\n";
+    strUsage += "  -stratumbind=<addr>    " + _("Listen for Stratum connections on <addr> (default: 127.0.0.1)") + "\n";
+    strUsage += "  -stratumport=<port>    " + _("Listen for Stratum connections on <port> for sha256d, <port>+1 for scrypt and <port>+2 for x11 (default: 3333 or testnet: 13333)") + "\n";
+    strUsage += "  -stratumaddress=<addr> " + _("Pay blocks found by Stratum miners to <addr> (default: a wallet key)") + "\n";
+    strUsage += "  -stratumdiff=<n>       " + _("Share difficulty new Stratum connections start at (default: 1)") + "\n";
+    strUsage += "  -stratumsharetime=<n>  " + _("Seconds between shares the Stratum difficulty is adjusted for (default: 15)") + "\n";
     strUsage += "\n" + _("RPC server options:") + "\n";
     strUsage += "  -server                " + _("Accept command line and JSON-RPC commands") + "\n";
+    strUsage += "  -rest                  " + _("Accept public REST requests on the RPC port, without authorization (default: 0)") + "\n";
+    strUsage += "  -metrics               " + _("Serve Prometheus metrics at /metrics on the RPC port without authorization (default: 0)") + "\n";
     strUsage += "  -rpcuser=<user>        " + _("Username for JSON-RPC connections") + "\n";
     strUsage += "  -rpcpassword=<pw>      " + _("Password for JSON-RPC connections") + "\n";
     strUsage += "  -rpcport=<port>        " + _("Listen for JSON-RPC connections on <port> (default: 8332 or testnet: 18332)") + "\n";
@@ -339,6 +434,94 @@ struct CImportingNow
     }
 };
 
+// Startup phases and how long each took, logged together once AppInit2 is done
+static std::vector<std::pair<std::string, int64_t> > vStartupPhases;
+
+static void LogStartupPhase(const std::string& strPhase, int64_t nTime)
+{
+    LogPrintf(" %-11s %15dms\n", strPhase, nTime);
+    vStartupPhases.push_back(std::make_pair(strPhase, nTime));
+}
+
+/** A phase of AppInit2 that runs on a thread of its own while the phases it
+ *  does not depend on go on. It is joined before the first phase that needs
+ *  its result, or when AppInit2 returns before that.
+ */
+class CStartupPhase
+{
+public:
+    CStartupPhase() : nTime(0), fStarted(false) {}
+    ~CStartupPhase() { Join(); }
+
+    void Start(const std::string& strNameIn, const boost::function<void()>& func)
+    {
+        strName = strNameIn;
+        fStarted = true;
+        thread = boost::thread(boost::bind(&CStartupPhase::Run, this, func));
+    }
+
+    void Join()
+    {
+        if (!fStarted)
+            return;
+        thread.join();
+        fStarted = false;
+        LogStartupPhase(strName + " *", nTime);
+    }
+
+private:
+    std::string strName;
+    int64_t nTime;
+    bool fStarted;
+    boost::thread thread;
+
+    void Run(boost::function<void()> func)
+    {
+        RenameThread(("bitcoin-init-" + strName).c_str());
+        int64_t nStart = GetTimeMillis();
+        func();
+        nTime = GetTimeMillis() - nStart;
+    }
+};
+
+static void LoadPeers()
+{
+    CAddrDB adb;
+    if (!adb.Read(addrman))
+        LogPrintf("Invalid or missing peers.dat; recreating\n");
+}
+
+#ifdef ENABLE_WALLET
+// The part of step 8 that only reads the wallet file, and so does not wait
+// for the block index
+static void LoadWalletDB(bool fZap, DBErrors& nZapRet, DBErrors& nLoadRet, bool& fFirstRun)
+{
+    if (fZap) {
+        CWallet* pwalletZap = new CWallet(strWalletFile);
+        nZapRet = pwalletZap->ZapWalletTx();
+        delete pwalletZap;
+        if (nZapRet != DB_LOAD_OK)
+            return;
+    }
+    nLoadRet = pwalletMain->LoadWallet(fFirstRun);
+}
+#endif
+
+// -backgroundverify: check the last blocks while the node already runs, and
+// shut it down if they are corrupted
+static void ThreadVerifyDB(int nCheckLevel, int nCheckDepth)
+{
+    RenameThread("bitcoin-verifydb");
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+
+    if (!VerifyDBBackground(nCheckLevel, nCheckDepth)) {
+        uiInterface.ThreadSafeMessageBox(
+            _("Corrupted block database detected") + ".\n\n" + _("Please restart with -reindex to rebuild the block database."),
+            "", CClientUIInterface::MSG_ERROR);
+        StartShutdown();
+    }
+}
+
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
 {
     RenameThread("bitcoin-loadblk");
@@ -346,16 +529,15 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
     // -reindex
     if (fReindex) {
         CImportingNow imp;
-        int nFile = 0;
+        std::vector<CImportFile> vFiles;
         while (true) {
-            CDiskBlockPos pos(nFile, 0);
-            FILE *file = OpenBlockFile(pos, true);
-            if (!file)
+            filesystem::path path = GetDataDir() / "blocks" / strprintf("blk%05u.dat", vFiles.size());
+            if (!filesystem::exists(path))
                 break;
-            LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
-            LoadExternalBlockFile(file, &pos);
-            nFile++;
+            vFiles.push_back(CImportFile(path, vFiles.size()));
         }
+        LogPrintf("Reindexing %u block files...\n", (unsigned int)vFiles.size());
+        ImportBlockFiles(vFiles);
         pblocktree->WriteReindexing(false);
         fReindex = false;
         LogPrintf("Reindexing finished\n");
@@ -366,28 +548,31 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
     // hardcoded $DATADIR/bootstrap.dat
     filesystem::path pathBootstrap = GetDataDir() / "bootstrap.dat";
     if (filesystem::exists(pathBootstrap)) {
-        FILE *file = fopen(pathBootstrap.string().c_str(), "rb");
-        if (file) {
-            CImportingNow imp;
-            filesystem::path pathBootstrapOld = GetDataDir() / "bootstrap.dat.old";
-            LogPrintf("Importing bootstrap.dat...\n");
-            LoadExternalBlockFile(file);
-            RenameOver(pathBootstrap, pathBootstrapOld);
-        } else {
-            LogPrintf("Warning: Could not open bootstrap file %s\n", pathBootstrap.string());
-        }
+        CImportingNow imp;
+        filesystem::path pathBootstrapOld = GetDataDir() / "bootstrap.dat.old";
+        LogPrintf("Importing bootstrap.dat...\n");
+        ImportBlockFiles(std::vector<CImportFile>(1, CImportFile(pathBootstrap)));
+        RenameOver(pathBootstrap, pathBootstrapOld);
     }
 
     // -loadblock=
+    std::vector<CImportFile> vFiles;
     BOOST_FOREACH(boost::filesystem::path &path, vImportFiles) {
-        FILE *file = fopen(path.string().c_str(), "rb");
-        if (file) {
-            CImportingNow imp;
-            LogPrintf("Importing blocks file %s...\n", path.string());
-            LoadExternalBlockFile(file);
-        } else {
+        if (filesystem::exists(path))
+            vFiles.push_back(CImportFile(path));
+        else
             LogPrintf("Warning: Could not open blocks file %s\n", path.string());
-        }
+    }
+    if (!vFiles.empty()) {
+        CImportingNow imp;
+        LogPrintf("Importing %u blocks files...\n", (unsigned int)vFiles.size());
+        ImportBlockFiles(vFiles);
+    }
+
+    // The transactions of the last run, checked against the chain as it is now
+    if (GetBoolArg("-persistmempool", true)) {
+        LoadMempool();
+        fDumpMempoolLater = !ShutdownRequested();
     }
 }
 
@@ -403,6 +588,16 @@ bool InitSanityCheck(void)
         return false;
     }
 
+    if (!X11EngineInit(GetArg("-x11engine", "auto"))) {
+        InitError(strprintf("X11 engine %s is not supported by this CPU or failed its self-test", GetArg("-x11engine", "auto")));
+        return false;
+    }
+
+    if (!SHA256EngineInit(GetArg("-sha256engine", "auto"))) {
+        InitError(strprintf("SHA-256 engine %s is not supported by this CPU or failed its self-test", GetArg("-sha256engine", "auto")));
+        return false;
+    }
+
     // TODO: remaining sanity checks, see #4081
 
     return true;
@@ -413,6 +608,8 @@ bool InitSanityCheck(void)
  */
 bool AppInit2(boost::thread_group& threadGroup)
 {
+    int64_t nStartAppInit = GetTimeMillis();
+
     // ********************************************************* Step 1: setup
 #ifdef _MSC_VER
     // Turn off Microsoft heap dump noise
@@ -528,11 +725,35 @@ bool AppInit2(boost::thread_group& threadGroup)
         miningAlgo = ALGO_X11;
     else
         miningAlgo = ALGO_SCRYPT;
+#ifdef ENABLE_WALLET
+    if (mapArgs.count("-genalgothreads"))
+    {
+        std::map<int, int> mapAlgoThreads;
+        if (!ParseGenAlgoThreads(mapArgs["-genalgothreads"], mapAlgoThreads))
+            return InitError(strprintf(_("Invalid -genalgothreads: '%s'"), mapArgs["-genalgothreads"]));
+    }
+    if (GetBoolArg("-opencl", false))
+    {
+        if (!HaveOpenCL())
+            return InitError(_("-opencl requires a build configured --with-opencl"));
+        std::vector<int> vDevices;
+        if (mapArgs.count("-opencldevices") && !ParseOpenCLDevices(mapArgs["-opencldevices"], vDevices))
+            return InitError(strprintf(_("Invalid -opencldevices: '%s'"), mapArgs["-opencldevices"]));
+        BOOST_FOREACH(const COpenCLDeviceInfo& info, ListOpenCLDevices())
+            LogPrintf("OpenCL device %d: %s on %s%s, %d MiB\n", info.nIndex, info.strName, info.strPlatform,
+                      info.fGPU ? " (GPU)" : "", info.nGlobalMemBytes >> 20);
+    }
+#endif
 
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+#if !defined(HAVE_SYS_EPOLL_H) && !defined(HAVE_SYS_EVENT_H)
+    // Only select() is available to wait on sockets, which cannot watch
+    // descriptors beyond FD_SETSIZE
+    nMaxConnections = std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS));
+#endif
+    nMaxConnections = std::max(nMaxConnections, 0);
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -552,8 +773,30 @@ bool AppInit2(boost::thread_group& threadGroup)
         InitWarning(_("Warning: Deprecated argument -debugnet ignored, use -debug=net"));
 
     fBenchmark = GetBoolArg("-benchmark", false);
+    fLockProfile = GetBoolArg("-lockprofile", false);
+    SetPropTraceSize(std::max(GetArg("-proptrace", 0), (int64_t)0));
+    SetBlockProfileSize(std::max(GetArg("-blockprofiles", DEFAULT_BLOCK_PROFILES), (int64_t)0));
+    fHeadersFirst = GetBoolArg("-headersfirst", DEFAULT_HEADERS_FIRST);
+    nDbFlushInterval = std::max(GetArg("-dbflushinterval", DEFAULT_DB_FLUSH_INTERVAL), (int64_t)1);
+    nDbMaxDirty = std::max(GetArg("-dbmaxdirty", DEFAULT_DB_MAX_DIRTY), (int64_t)1);
+    blockcache.SetMaxUsage(std::max(GetArg("-blockcachemb", DEFAULT_BLOCK_CACHE_MB), (int64_t)0) << 20);
+    txcache.SetMaxUsage(std::max(GetArg("-txcachemb", DEFAULT_TX_CACHE_MB), (int64_t)0) << 20);
+    txidcache.SetMaxUsage(std::max(GetArg("-txidcachemb", DEFAULT_TXID_CACHE_MB), (int64_t)0) << 20);
+    SetSignatureCacheSize(std::max(GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE), (int64_t)0) << 20);
+    blockfilemapper.SetMaxFiles(std::max(GetArg("-blockmapfiles", DEFAULT_BLOCK_MAP_FILES), (int64_t)0));
+    nBlockCompression = std::max(0, std::min((int)GetArg("-blockcompression", DEFAULT_BLOCK_COMPRESSION), MAX_BLOCK_COMPRESSION));
+    if (nBlockCompression > 0 && !CanCompressDiskRecords())
+        return InitError(_("This build does not support compressed block files (-blockcompression)."));
     mempool.setSanityCheck(GetBoolArg("-checkmempool", RegTest()));
     Checkpoints::fEnabled = GetBoolArg("-checkpoints", true);
+    if (mapArgs.count("-assumevalid")) {
+        std::string strAssumeValid = GetArg("-assumevalid", "0");
+        if (strAssumeValid != "0" && (strAssumeValid.size() != 64 || !IsHex(strAssumeValid)))
+            return InitError(strprintf(_("Invalid block hash for -assumevalid=<hex>: '%s'"), strAssumeValid));
+        hashAssumeValid = uint256(strAssumeValid);
+        if (hashAssumeValid != 0)
+            LogPrintf("Assuming the scripts of block %s and its ancestors are valid\n", hashAssumeValid.ToString());
+    }
 
     // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
     nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
@@ -564,9 +807,12 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    nBlockPipelineDepth = std::max(0, std::min((int)GetArg("-blockpipeline", DEFAULT_BLOCK_PIPELINE_DEPTH), MAX_BLOCKS_IN_TRANSIT_PER_PEER));
+
     fServer = GetBoolArg("-server", false);
     fPrintToConsole = GetBoolArg("-printtoconsole", false);
     fLogTimestamps = GetBoolArg("-logtimestamps", true);
+    nLogRateLimit = GetArg("-logratelimit", DEFAULT_LOG_RATE_LIMIT) * 1024;
     setvbuf(stdout, NULL, _IOLBF, 0);
 #ifdef ENABLE_WALLET
     bool fDisableWallet = GetBoolArg("-disablewallet", false);
@@ -579,6 +825,11 @@ bool AppInit2(boost::thread_group& threadGroup)
             nConnectTimeout = nNewTimeout;
     }
 
+    if (mapArgs.count("-maxuploadtarget"))
+        CNode::SetMaxOutboundTarget(std::max((int64_t)0, GetArg("-maxuploadtarget", 0)) * 1024 * 1024);
+    if (mapArgs.count("-maxuploadrate"))
+        CNode::SetMaxUploadRate(std::max((int64_t)0, GetArg("-maxuploadrate", 0)) * 1000);
+
     // Continue to put "/P2SH/" in the coinbase to monitor
     // BIP16 support.
     // This can be removed eventually...
@@ -607,6 +858,28 @@ bool AppInit2(boost::thread_group& threadGroup)
         else
             return InitError(strprintf(_("Invalid amount for -minrelaytxfee=<amount>: '%s'"), mapArgs["-minrelaytxfee"]));
     }
+    if (GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) < 1)
+        return InitError(strprintf(_("Invalid -maxmempool: '%s'"), mapArgs["-maxmempool"]));
+
+    // Pruned block files leave nothing for the indexes of block positions to point to
+    if (GetArg("-prune", 0) < 0)
+        return InitError(_("Prune cannot be configured with a negative value."));
+    nPruneTarget = (uint64_t)GetArg("-prune", 0) << 20;
+    if (nPruneTarget) {
+        if (nPruneTarget < MIN_DISK_SPACE_FOR_BLOCK_FILES)
+            return InitError(strprintf(_("Prune configured below the minimum of %d MiB.  Please use a higher number."), MIN_DISK_SPACE_FOR_BLOCK_FILES >> 20));
+        if (GetBoolArg("-txindex", false))
+            return InitError(_("Prune mode is incompatible with -txindex."));
+        if (GetBoolArg("-addressindex", false))
+            return InitError(_("Prune mode is incompatible with -addressindex."));
+        if (GetBoolArg("-spentindex", false))
+            return InitError(_("Prune mode is incompatible with -spentindex."));
+        LogPrintf("Prune configured to target %u MiB of block files on disk\n", nPruneTarget >> 20);
+        fPruneMode = true;
+    }
+    // A node started from a snapshot has no blocks below it
+    if (mapArgs.count("-loadtxoutset") && !fPruneMode)
+        return InitError(_("Loading a snapshot with -loadtxoutset requires -prune."));
 
 #ifdef ENABLE_WALLET
     if (mapArgs.count("-paytxfee"))
@@ -641,6 +914,7 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     if (GetBoolArg("-shrinkdebugfile", !fDebug))
         ShrinkDebugFile();
+    StartDebugLogWriter();
     LogPrintf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     LogPrintf("Digitalcoin version %s (%s)\n", FormatFullVersion(), CLIENT_DATE);
     LogPrintf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
@@ -655,20 +929,33 @@ bool AppInit2(boost::thread_group& threadGroup)
     std::ostringstream strErrors;
 
     if (nScriptCheckThreads) {
-        LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
-        for (int i=0; i<nScriptCheckThreads-1; i++)
+        LogPrintf("Using %u threads for script and header verification and input prefetching\n", nScriptCheckThreads);
+        for (int i=0; i<nScriptCheckThreads-1; i++) {
             threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadPoWCheck);
+            threadGroup.create_thread(&ThreadPrefetchCoins);
+        }
     }
 
+    // The thread asking for parallel work helps with it, so 0 workers still works
+    int nSchedulerThreads = GetArg("-schedulerthreads", DEFAULT_SCHEDULER_THREADS);
+    if (nSchedulerThreads <= 0)
+        nSchedulerThreads += boost::thread::hardware_concurrency();
+    nSchedulerThreads = std::max(0, std::min(nSchedulerThreads, MAX_SCHEDULER_THREADS));
+    taskScheduler.Start(nSchedulerThreads, GetBoolArg("-scheduleraffinity", false));
+
     int64_t nStart;
 
     // ********************************************************* Step 5: verify wallet database integrity
 #ifdef ENABLE_WALLET
     if (!fDisableWallet) {
+        nStart = GetTimeMillis();
         LogPrintf("Using wallet %s\n", strWalletFile);
         uiInterface.InitMessage(_("Verifying wallet..."));
 
-        if (!bitdb.Open(GetDataDir()))
+        // A wallet that was migrated to a store keeps using it
+        bool fWalletStore = filesystem::exists(CDBEnv::StorePath(strWalletFile));
+        if (!fWalletStore && !bitdb.Open(GetDataDir()))
         {
             // try moving the database env out of the way
             boost::filesystem::path pathDatabase = GetDataDir() / "database";
@@ -688,14 +975,14 @@ bool AppInit2(boost::thread_group& threadGroup)
             }
         }
 
-        if (GetBoolArg("-salvagewallet", false))
+        if (!fWalletStore && GetBoolArg("-salvagewallet", false))
         {
             // Recover readable keypairs:
             if (!CWalletDB::Recover(bitdb, strWalletFile, true))
                 return false;
         }
 
-        if (filesystem::exists(GetDataDir() / strWalletFile))
+        if (!fWalletStore && filesystem::exists(GetDataDir() / strWalletFile))
         {
             CDBEnv::VerifyResult r = bitdb.Verify(strWalletFile, CWalletDB::Recover);
             if (r == CDBEnv::RECOVER_OK)
@@ -709,6 +996,14 @@ bool AppInit2(boost::thread_group& threadGroup)
             if (r == CDBEnv::RECOVER_FAIL)
                 return InitError(_("wallet.dat corrupt, salvage failed"));
         }
+
+        if (fWalletStore || GetBoolArg("-walletleveldb", false))
+        {
+            uiInterface.InitMessage(_("Opening wallet store..."));
+            if (!bitdb.OpenStore(strWalletFile))
+                return InitError(strprintf(_("Error opening wallet store %s"), CDBEnv::StorePath(strWalletFile).string()));
+        }
+        LogStartupPhase("verify wallet", GetTimeMillis() - nStart);
     } // (!fDisableWallet)
 #endif // ENABLE_WALLET
     // ********************************************************* Step 6: network initialization
@@ -844,12 +1139,30 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nTotalCache > (nMaxDbCache << 20))
         nTotalCache = (nMaxDbCache << 20); // total cache cannot be greater than nMaxDbCache
     size_t nBlockTreeDBCache = nTotalCache / 8;
-    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false))
+    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false) && !GetBoolArg("-addressindex", false) && !GetBoolArg("-spentindex", false))
         nBlockTreeDBCache = (1 << 21); // block tree db cache shouldn't be larger than 2 MiB
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    nCoinCacheUsage = nTotalCache; // the rest goes to the in-memory coins cache, measured in bytes
+
+    // Phases marked * in the log run while the block index loads, as they do
+    // not need it: reading peers.dat, and reading the wallet file. The mempool
+    // is reloaded by ThreadImport once the node runs.
+    CStartupPhase phasePeers;
+    phasePeers.Start("peers", &LoadPeers);
+#ifdef ENABLE_WALLET
+    bool fZapWallet = GetBoolArg("-zapwallettxes", false);
+    DBErrors nZapWalletRet = DB_LOAD_OK;
+    DBErrors nLoadWalletRet = DB_LOAD_OK;
+    bool fFirstRun = true;
+    CStartupPhase phaseWallet;
+    if (!fDisableWallet) {
+        pwalletMain = new CWallet(strWalletFile);
+        phaseWallet.Start("wallet", boost::bind(&LoadWalletDB, fZapWallet, boost::ref(nZapWalletRet),
+                                                boost::ref(nLoadWalletRet), boost::ref(fFirstRun)));
+    }
+#endif
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -863,12 +1176,20 @@ bool AppInit2(boost::thread_group& threadGroup)
             try {
                 UnloadBlockIndex();
                 delete pcoinsTip;
+                delete pcoinsAsync;
                 delete pcoinsdbview;
                 delete pblocktree;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
-                pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+                pcoinsAsync = new CCoinsViewAsyncDB(*pcoinsdbview, &SyncBlockStorage);
+                pcoinsTip = new CCoinsViewCache(*pcoinsAsync);
+
+                // Convert a pre-existing per-transaction chainstate to per-output records.
+                if (!pcoinsdbview->Upgrade()) {
+                    strLoadError = _("Error upgrading chainstate database");
+                    break;
+                }
 
                 if (fReindex)
                     pblocktree->WriteReindexing(true);
@@ -889,18 +1210,82 @@ bool AppInit2(boost::thread_group& threadGroup)
                     break;
                 }
 
+                // Indexes enabled since the last start are built in the
+                // background; disabling one needs a reindex
+                if (!LoadIndexBuildState()) {
+                    strLoadError = _("Error loading block database");
+                    break;
+                }
+                int nBuildIndexes = 0;
+
+                // A snapshot takes the place of the blocks up to it; the block
+                // index is loaded again with its entries
+                if (mapArgs.count("-loadtxoutset") && !fReindex && chainActive.Height() == 0) {
+                    uiInterface.InitMessage(_("Loading coin snapshot..."));
+                    if (!pcoinsTip->Flush() || !pcoinsAsync->Sync() || !LoadTxOutSet(GetArg("-loadtxoutset", ""))) {
+                        strLoadError = _("Error loading the coin snapshot");
+                        break;
+                    }
+                    delete pcoinsTip;
+                    pcoinsTip = new CCoinsViewCache(*pcoinsAsync);
+                    UnloadBlockIndex();
+                    if (!LoadBlockIndex()) {
+                        strLoadError = _("Error loading block database");
+                        break;
+                    }
+                }
+
                 // Check for changed -txindex state
-                if (fTxIndex != GetBoolArg("-txindex", false)) {
+                if (fTxIndex && !GetBoolArg("-txindex", false)) {
                     strLoadError = _("You need to rebuild the database using -reindex to change -txindex");
                     break;
                 }
+                if (!fTxIndex && GetBoolArg("-txindex", false))
+                    nBuildIndexes |= INDEX_BUILD_TX;
+
+                // Check for changed -blockfilterindex state
+                if (fBlockFilterIndex != GetBoolArg("-blockfilterindex", false)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -blockfilterindex");
+                    break;
+                }
+
+                // Check for changed -addressindex state
+                if (fAddressIndex && !GetBoolArg("-addressindex", false)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -addressindex");
+                    break;
+                }
+                if (!fAddressIndex && GetBoolArg("-addressindex", false))
+                    nBuildIndexes |= INDEX_BUILD_ADDRESS;
+
+                // Check for changed -spentindex state
+                if (fSpentIndex && !GetBoolArg("-spentindex", false)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -spentindex");
+                    break;
+                }
+                if (!fSpentIndex && GetBoolArg("-spentindex", false))
+                    nBuildIndexes |= INDEX_BUILD_SPENT;
+
+                // Pruned blocks are only back after downloading them again
+                if (fHavePruned && !fPruneMode) {
+                    strLoadError = _("You need to rebuild the database using -reindex to go back to unpruned mode.  This will redownload the entire blockchain");
+                    break;
+                }
 
-                uiInterface.InitMessage(_("Verifying blocks..."));
-                if (!VerifyDB(GetArg("-checklevel", 3),
-                              GetArg("-checkblocks", 288))) {
-                    strLoadError = _("Corrupted block database detected");
+                if (nBuildIndexes != 0 && !StartIndexBuild(nBuildIndexes)) {
+                    strLoadError = _("Error writing to the block database");
                     break;
                 }
+
+                if (!GetBoolArg("-backgroundverify", true)) {
+                    uiInterface.InitMessage(_("Verifying blocks..."));
+                    int64_t nStartVerify = GetTimeMillis();
+                    if (!VerifyDB(GetArg("-checklevel", 3),
+                                  GetArg("-checkblocks", 288))) {
+                        strLoadError = _("Corrupted block database detected");
+                        break;
+                    }
+                    LogStartupPhase("verify db", GetTimeMillis() - nStartVerify);
+                }
             } catch(std::exception &e) {
                 if (fDebug) LogPrintf("%s\n", e.what());
                 strLoadError = _("Error opening block database");
@@ -937,7 +1322,7 @@ bool AppInit2(boost::thread_group& threadGroup)
         LogPrintf("Shutdown requested. Exiting.\n");
         return false;
     }
-    LogPrintf(" block index %15dms\n", GetTimeMillis() - nStart);
+    LogStartupPhase("block index", GetTimeMillis() - nStart);
 
     if (GetBoolArg("-printblockindex", false) || GetBoolArg("-printblocktree", false))
     {
@@ -949,7 +1334,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -974,26 +1359,13 @@ bool AppInit2(boost::thread_group& threadGroup)
         pwalletMain = NULL;
         LogPrintf("Wallet disabled!\n");
     } else {
-        if (GetBoolArg("-zapwallettxes", false)) {
-            uiInterface.InitMessage(_("Zapping all transactions from wallet..."));
-
-            pwalletMain = new CWallet(strWalletFile);
-            DBErrors nZapWalletRet = pwalletMain->ZapWalletTx();
-            if (nZapWalletRet != DB_LOAD_OK) {
-                uiInterface.InitMessage(_("Error loading wallet.dat: Wallet corrupted"));
-                return false;
-            }
-
-            delete pwalletMain;
-            pwalletMain = NULL;
+        uiInterface.InitMessage(fZapWallet ? _("Zapping all transactions from wallet...") : _("Loading wallet..."));
+        phaseWallet.Join();
+        if (fZapWallet && nZapWalletRet != DB_LOAD_OK) {
+            uiInterface.InitMessage(_("Error loading wallet.dat: Wallet corrupted"));
+            return false;
         }
 
-        uiInterface.InitMessage(_("Loading wallet..."));
-
-        nStart = GetTimeMillis();
-        bool fFirstRun = true;
-        pwalletMain = new CWallet(strWalletFile);
-        DBErrors nLoadWalletRet = pwalletMain->LoadWallet(fFirstRun);
         if (nLoadWalletRet != DB_LOAD_OK)
         {
             if (nLoadWalletRet == DB_CORRUPT)
@@ -1037,6 +1409,14 @@ bool AppInit2(boost::thread_group& threadGroup)
             // Create new keyUser and set as default key
             RandAddSeedPerfmon();
 
+            if (GetBoolArg("-usehd", DEFAULT_USE_HD_WALLET) && !pwalletMain->IsHDEnabled())
+            {
+                CKey seed;
+                seed.MakeNewKey(true);
+                if (!pwalletMain->SetHDMasterKey(seed))
+                    return InitError(_("Error: Storing the HD seed failed"));
+            }
+
             CPubKey newDefaultKey;
             if (pwalletMain->GetKeyFromPool(newDefaultKey)) {
                 pwalletMain->SetDefaultKey(newDefaultKey);
@@ -1046,9 +1426,14 @@ bool AppInit2(boost::thread_group& threadGroup)
 
             pwalletMain->SetBestChain(chainActive.GetLocator());
         }
+        else if (mapArgs.count("-usehd") && GetBoolArg("-usehd", DEFAULT_USE_HD_WALLET) != pwalletMain->IsHDEnabled())
+        {
+            if (pwalletMain->IsHDEnabled())
+                return InitError(_("Error: HD key derivation cannot be disabled on an existing HD wallet"));
+            return InitError(_("Error: HD key derivation can only be enabled when a wallet is created"));
+        }
 
         LogPrintf("%s", strErrors.str());
-        LogPrintf(" wallet      %15dms\n", GetTimeMillis() - nStart);
 
         RegisterWallet(pwalletMain);
 
@@ -1066,11 +1451,20 @@ bool AppInit2(boost::thread_group& threadGroup)
         }
         if (chainActive.Tip() && chainActive.Tip() != pindexRescan)
         {
+            // The rescan needs the blocks from there on
+            if (fHavePruned) {
+                CBlockIndex *pindex = chainActive.Tip();
+                while (pindex != pindexRescan && pindex->pprev && (pindex->pprev->nStatus & BLOCK_HAVE_DATA))
+                    pindex = pindex->pprev;
+                if (pindex != pindexRescan)
+                    return InitError(_("Prune: last wallet synchronisation goes beyond pruned data. You need to -reindex (download the whole blockchain again in case of pruned node)"));
+            }
+
             uiInterface.InitMessage(_("Rescanning..."));
             LogPrintf("Rescanning last %i blocks (from block %i)...\n", chainActive.Height() - pindexRescan->nHeight, pindexRescan->nHeight);
             nStart = GetTimeMillis();
             pwalletMain->ScanForWalletTransactions(pindexRescan, true);
-            LogPrintf(" rescan      %15dms\n", GetTimeMillis() - nStart);
+            LogStartupPhase("rescan", GetTimeMillis() - nStart);
             pwalletMain->SetBestChain(chainActive.GetLocator());
             nWalletDBUpdated++;
         }
@@ -1084,6 +1478,8 @@ bool AppInit2(boost::thread_group& threadGroup)
     CValidationState state;
     if (!ActivateBestChain(state))
         strErrors << "Failed to connect best block";
+    if (fPruneMode)
+        PruneBlockFiles();
 
     std::vector<boost::filesystem::path> vImportFiles;
     if (mapArgs.count("-loadblock"))
@@ -1091,22 +1487,29 @@ bool AppInit2(boost::thread_group& threadGroup)
         BOOST_FOREACH(string strFile, mapMultiArgs["-loadblock"])
             vImportFiles.push_back(strFile);
     }
+    // From here on, chain state writes no longer block block connection.
+    threadGroup.create_thread(&ThreadFlushChainState);
+    if (nBlockPipelineDepth > 0)
+        threadGroup.create_thread(&ThreadConnectBlocks);
+
+    // A reindex rebuilds the chain state, so the coins of the last run are of no use
+    if (GetBoolArg("-persistcoinscache", true)) {
+        if (!fReindex)
+            threadGroup.create_thread(&ThreadWarmCoinsCache);
+        fDumpCoinsCacheLater = true;
+    }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
+    if (IsIndexBuilding(INDEX_BUILD_TX | INDEX_BUILD_ADDRESS | INDEX_BUILD_SPENT))
+        threadGroup.create_thread(&ThreadBuildIndexes);
+    if (nBlockCompression > 0 && GetBoolArg("-recompressblocks", true))
+        threadGroup.create_thread(&ThreadRecompressBlockFiles);
 
     // ********************************************************* Step 10: load peers
 
     uiInterface.InitMessage(_("Loading addresses..."));
 
-    nStart = GetTimeMillis();
-
-    {
-        CAddrDB adb;
-        if (!adb.Read(addrman))
-            LogPrintf("Invalid or missing peers.dat; recreating\n");
-    }
-
-    LogPrintf("Loaded %i addresses from peers.dat  %dms\n",
-           addrman.size(), GetTimeMillis() - nStart);
+    phasePeers.Join();
+    LogPrintf("Loaded %i addresses from peers.dat\n", addrman.size());
 
     // ********************************************************* Step 11: start node
 
@@ -1127,7 +1530,15 @@ bool AppInit2(boost::thread_group& threadGroup)
     LogPrintf("mapAddressBook.size() = %u\n",  pwalletMain ? pwalletMain->mapAddressBook.size() : 0);
 #endif
 
+    if (fBlockFilterIndex)
+        nLocalServices |= NODE_COMPACT_FILTERS;
+    // A pruned node can not serve the whole block chain
+    if (fPruneMode)
+        nLocalServices &= ~NODE_NETWORK;
+
     StartNode(threadGroup);
+    if (GetBoolArg("-backgroundverify", true) && !fReindex)
+        threadGroup.create_thread(boost::bind(&ThreadVerifyDB, GetArg("-checklevel", 3), GetArg("-checkblocks", 288)));
     // InitRPCMining is needed here so getwork/getblocktemplate in the GUI debug console works properly.
     InitRPCMining();
     if (fServer)
@@ -1139,10 +1550,19 @@ bool AppInit2(boost::thread_group& threadGroup)
         GenerateBitcoins(GetBoolArg("-gen", false), pwalletMain, GetArg("-genproclimit", -1));
 #endif
 
+    std::string strStratumError;
+    if (!StartStratum(strStratumError))
+        return InitError(strStratumError);
+
     // ********************************************************* Step 12: finished
 
     uiInterface.InitMessage(_("Done loading"));
 
+    std::string strPhases;
+    for (unsigned int i = 0; i < vStartupPhases.size(); i++)
+        strPhases += strprintf(" %s=%dms", vStartupPhases[i].first, vStartupPhases[i].second);
+    LogPrintf("Startup took %dms:%s\n", GetTimeMillis() - nStartAppInit, strPhases);
+
 #ifdef ENABLE_WALLET
     if (pwalletMain) {
         // Add wallet transactions that aren't already in a block to mapTransactions
@@ -1150,6 +1570,12 @@ bool AppInit2(boost::thread_group& threadGroup)
 
         // Run a thread to flush wallet periodically
         threadGroup.create_thread(boost::bind(&ThreadFlushWalletDB, boost::ref(pwalletMain->strWalletFile)));
+
+        // Run a thread to refill the key pool in the background
+        threadGroup.create_thread(boost::bind(&ThreadKeyPoolRefill, pwalletMain));
+
+        // From here on, wallets are told about transactions off the validation path
+        threadGroup.create_thread(&ThreadWalletNotify);
     }
 #endif
 
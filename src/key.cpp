@@ -2,6 +2,10 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#if defined(HAVE_CONFIG_H)
+#include "bitcoin-config.h"
+#endif
+
 #include "key.h"
 
 #include <openssl/bn.h>
@@ -9,6 +13,19 @@
 #include <openssl/obj_mac.h>
 #include <openssl/rand.h>
 
+#include <map>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+#ifdef USE_SECP256K1
+#include <secp256k1.h>
+#endif
+#ifdef USE_SECP256K1_RECOVERY
+#include <secp256k1_recovery.h>
+#endif
+
 // anonymous namespace with local implementation code (OpenSSL interaction)
 namespace {
 
@@ -199,6 +216,15 @@ public:
         return o2i_ECPublicKey(&pkey, &pbegin, pubkey.size());
     }
 
+    // The public key as a point, to set it without parsing it again
+    EC_POINT *DupPublicPoint() const {
+        return EC_POINT_dup(EC_KEY_get0_public_key(pkey), EC_KEY_get0_group(pkey));
+    }
+
+    bool SetPublicPoint(const EC_POINT *point) {
+        return EC_KEY_set_public_key(pkey, point);
+    }
+
     bool Sign(const uint256 &hash, std::vector<unsigned char>& vchSig) {
         vchSig.clear();
         ECDSA_SIG *sig = ECDSA_do_sign((unsigned char*)&hash, sizeof(hash), pkey);
@@ -332,6 +358,212 @@ public:
     }
 };
 
+#ifdef USE_SECP256K1
+// The libsecp256k1 context for verification, created once
+class CSecp256k1Verify {
+public:
+    secp256k1_context *ctx;
+
+    CSecp256k1Verify() {
+        ctx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
+        assert(ctx != NULL);
+    }
+
+    ~CSecp256k1Verify() {
+        secp256k1_context_destroy(ctx);
+    }
+};
+
+CSecp256k1Verify secp256k1verify;
+
+// Read an integer of a DER signature at pos, with a length in any form, as
+// OpenSSL does. Returns false if the input ends first.
+bool ParseLaxDERInteger(const unsigned char *input, size_t inputlen, size_t &pos, size_t &ipos, size_t &ilen) {
+    if (pos == inputlen || input[pos] != 0x02)
+        return false;
+    pos++;
+    if (pos == inputlen)
+        return false;
+    size_t lenbyte = input[pos++];
+    if (lenbyte & 0x80) {
+        lenbyte -= 0x80;
+        if (lenbyte > inputlen - pos)
+            return false;
+        while (lenbyte > 0 && input[pos] == 0) {
+            pos++;
+            lenbyte--;
+        }
+        if (lenbyte >= sizeof(size_t))
+            return false;
+        ilen = 0;
+        while (lenbyte > 0) {
+            ilen = (ilen << 8) + input[pos];
+            pos++;
+            lenbyte--;
+        }
+    } else {
+        ilen = lenbyte;
+    }
+    if (ilen > inputlen - pos)
+        return false;
+    ipos = pos;
+    pos += ilen;
+    return true;
+}
+
+// Parse a signature the way the OpenSSL versions Bitcoin was deployed with
+// accept them (BER lengths, padding, trailing data), as libsecp256k1 only
+// takes strict DER. Signature checks are consensus critical: what OpenSSL
+// rejects has to be rejected here. Returns false for signatures that
+// cannot be valid.
+bool ParseLaxDERSignature(const unsigned char *input, size_t inputlen, secp256k1_ecdsa_signature &sig) {
+    size_t pos = 0;
+    // Sequence tag and length; the length is not checked
+    if (pos == inputlen || input[pos] != 0x30)
+        return false;
+    pos++;
+    if (pos == inputlen)
+        return false;
+    size_t lenbyte = input[pos++];
+    if (lenbyte & 0x80) {
+        lenbyte -= 0x80;
+        if (lenbyte > inputlen - pos)
+            return false;
+        pos += lenbyte;
+    }
+
+    size_t rpos, rlen, spos, slen;
+    if (!ParseLaxDERInteger(input, inputlen, pos, rpos, rlen) ||
+        !ParseLaxDERInteger(input, inputlen, pos, spos, slen))
+        return false;
+
+    // OpenSSL reads integers with the top bit set as negative numbers,
+    // which are never valid in a signature.
+    if ((rlen > 0 && (input[rpos] & 0x80)) || (slen > 0 && (input[spos] & 0x80)))
+        return false;
+    while (rlen > 0 && input[rpos] == 0) {
+        rlen--;
+        rpos++;
+    }
+    while (slen > 0 && input[spos] == 0) {
+        slen--;
+        spos++;
+    }
+    if (rlen > 32 || slen > 32)
+        return false;
+
+    unsigned char compact[64];
+    memset(compact, 0, sizeof(compact));
+    memcpy(compact + 32 - rlen, input + rpos, rlen);
+    memcpy(compact + 64 - slen, input + spos, slen);
+    // Fails if R or S is not below the group order
+    return secp256k1_ecdsa_signature_parse_compact(secp256k1verify.ctx, &sig, compact) == 1;
+}
+#endif
+
+// A public key parsed by the signature verification backend. Parsing
+// a compressed key computes a square root, so this is worth keeping for
+// keys that sign many inputs.
+class CParsedPubKey {
+private:
+#ifdef USE_SECP256K1
+    secp256k1_pubkey pubkey;
+#else
+    EC_POINT *point;
+#endif
+
+    // not copyable
+    CParsedPubKey(const CParsedPubKey &);
+    CParsedPubKey &operator=(const CParsedPubKey &);
+
+public:
+#ifdef USE_SECP256K1
+    CParsedPubKey() {}
+
+    bool Parse(const CPubKey &vchPubKey) {
+        // Parsing accepts the same encodings as OpenSSL, hybrid ones included
+        return secp256k1_ec_pubkey_parse(secp256k1verify.ctx, &pubkey, vchPubKey.begin(), vchPubKey.size()) == 1;
+    }
+
+    bool Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
+        secp256k1_ecdsa_signature sig;
+        if (vchSig.empty() || !ParseLaxDERSignature(&vchSig[0], vchSig.size(), sig))
+            return false;
+        // libsecp256k1 only verifies low S signatures; OpenSSL takes both
+        secp256k1_ecdsa_signature_normalize(secp256k1verify.ctx, &sig, &sig);
+        return secp256k1_ecdsa_verify(secp256k1verify.ctx, &sig, hash.begin(), &pubkey) == 1;
+    }
+#else
+    CParsedPubKey() : point(NULL) {}
+
+    ~CParsedPubKey() {
+        if (point)
+            EC_POINT_free(point);
+    }
+
+    bool Parse(const CPubKey &vchPubKey) {
+        CECKey key;
+        if (!key.SetPubKey(vchPubKey))
+            return false;
+        point = key.DupPublicPoint();
+        return point != NULL;
+    }
+
+    bool Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
+        CECKey key;
+        if (!key.SetPublicPoint(point))
+            return false;
+        return key.Verify(hash, vchSig);
+    }
+#endif
+};
+
+// Recently used public keys, parsed, for all signature checking threads.
+// Split in independently locked shards; when a shard is full, the key
+// following a new one makes room for it.
+class CPubKeyParseCache {
+private:
+    static const unsigned int NUM_SHARDS = 16;
+    static const unsigned int MAX_SHARD_ENTRIES = 1024;
+
+    struct CShard {
+        boost::mutex cs;
+        std::map<CPubKey, boost::shared_ptr<const CParsedPubKey> > mapKeys;
+    };
+
+    CShard shards[NUM_SHARDS];
+
+public:
+    // Returns NULL if the key cannot be parsed. Call with valid keys only.
+    boost::shared_ptr<const CParsedPubKey> Get(const CPubKey &pubkey) {
+        // The byte after the header is part of the X coordinate
+        CShard &shard = shards[pubkey.begin()[1] % NUM_SHARDS];
+        {
+            boost::unique_lock<boost::mutex> lock(shard.cs);
+            std::map<CPubKey, boost::shared_ptr<const CParsedPubKey> >::const_iterator it = shard.mapKeys.find(pubkey);
+            if (it != shard.mapKeys.end())
+                return it->second;
+        }
+
+        // Parse outside the lock
+        boost::shared_ptr<CParsedPubKey> parsed(new CParsedPubKey());
+        if (!parsed->Parse(pubkey))
+            return boost::shared_ptr<const CParsedPubKey>();
+
+        boost::unique_lock<boost::mutex> lock(shard.cs);
+        if (shard.mapKeys.size() >= MAX_SHARD_ENTRIES) {
+            std::map<CPubKey, boost::shared_ptr<const CParsedPubKey> >::iterator it = shard.mapKeys.upper_bound(pubkey);
+            if (it == shard.mapKeys.end())
+                it = shard.mapKeys.begin();
+            shard.mapKeys.erase(it);
+        }
+        shard.mapKeys.insert(std::make_pair(pubkey, parsed));
+        return parsed;
+    }
+};
+
+CPubKeyParseCache pubkeyparsecache;
+
 }; // end of anonymous namespace
 
 bool CKey::Check(const unsigned char *vch) {
@@ -435,6 +667,15 @@ bool CKey::Load(CPrivKey &privkey, CPubKey &vchPubKey, bool fSkipCheck=false) {
 }
 
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
+    if (!IsValid())
+        return false;
+    boost::shared_ptr<const CParsedPubKey> parsed = pubkeyparsecache.Get(*this);
+    if (!parsed)
+        return false;
+    return parsed->Verify(hash, vchSig);
+}
+
+bool CPubKey::VerifyOpenSSL(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
     if (!IsValid())
         return false;
     CECKey key;
@@ -445,14 +686,43 @@ bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchS
     return true;
 }
 
+#ifdef USE_SECP256K1
+bool CPubKey::VerifySecp256k1(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
+    if (!IsValid())
+        return false;
+    CParsedPubKey parsed;
+    return parsed.Parse(*this) && parsed.Verify(hash, vchSig);
+}
+#endif
+
 bool CPubKey::RecoverCompact(const uint256 &hash, const std::vector<unsigned char>& vchSig) {
     if (vchSig.size() != 65)
         return false;
+#ifdef USE_SECP256K1_RECOVERY
+    // Header byte: 27 + recovery id, plus 4 for a compressed key
+    int nRecId = (vchSig[0] - 27) & ~4;
+    if (nRecId < 0 || nRecId > 3)
+        return false;
+    secp256k1_ecdsa_recoverable_signature sig;
+    if (!secp256k1_ecdsa_recoverable_signature_parse_compact(secp256k1verify.ctx, &sig, &vchSig[1], nRecId))
+        return false;
+    secp256k1_pubkey pubkey;
+    if (!secp256k1_ecdsa_recover(secp256k1verify.ctx, &pubkey, &sig, hash.begin()))
+        return false;
+    unsigned char pub[65];
+    size_t publen = sizeof(pub);
+    bool fCompressed = ((vchSig[0] - 27) & 4) != 0;
+    secp256k1_ec_pubkey_serialize(secp256k1verify.ctx, pub, &publen, &pubkey,
+                                  fCompressed ? SECP256K1_EC_COMPRESSED : SECP256K1_EC_UNCOMPRESSED);
+    Set(pub, pub + publen);
+    return true;
+#else
     CECKey key;
     if (!key.Recover(hash, &vchSig[1], (vchSig[0] - 27) & ~4))
         return false;
     key.GetPubKey(*this, (vchSig[0] - 27) & 4);
     return true;
+#endif
 }
 
 bool CPubKey::VerifyCompact(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
@@ -155,8 +155,16 @@ public:
 
     // Verify a DER signature (~72 bytes).
     // If this public key is not fully valid, the return value will be false.
+    // Uses libsecp256k1 when built with it, OpenSSL otherwise.
     bool Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const;
 
+    // Verify a DER signature with a given implementation, to compare them.
+    // These parse the key every time; Verify keeps recently used keys parsed.
+    bool VerifyOpenSSL(const uint256 &hash, const std::vector<unsigned char>& vchSig) const;
+#ifdef USE_SECP256K1
+    bool VerifySecp256k1(const uint256 &hash, const std::vector<unsigned char>& vchSig) const;
+#endif
+
     // Verify a compact signature (~65 bytes).
     // See CKey::SignCompact.
     bool VerifyCompact(const uint256 &hash, const std::vector<unsigned char>& vchSig) const;
@@ -275,6 +283,9 @@ public:
     bool Load(CPrivKey &privkey, CPubKey &vchPubKey, bool fSkipCheck);
 };
 
+// Child numbers from here on derive hardened keys, from the private key only
+const unsigned int BIP32_HARDENED_KEY_LIMIT = 0x80000000;
+
 struct CExtPubKey {
     unsigned char nDepth;
     unsigned char vchFingerprint[4];
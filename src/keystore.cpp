@@ -10,6 +10,7 @@
 #include "script.h"
 
 #include <boost/foreach.hpp>
+#include <boost/functional/hash.hpp>
 
 bool CKeyStore::GetPubKey(const CKeyID &address, CPubKey &vchPubKeyOut) const
 {
@@ -27,6 +28,7 @@ bool CKeyStore::AddKey(const CKey &key) {
 bool CBasicKeyStore::AddKeyPubKey(const CKey& key, const CPubKey &pubkey)
 {
     LOCK(cs_KeyStore);
+    WRITE_LOCK(cs_KeyStoreMaps);
     mapKeys[pubkey.GetID()] = key;
     return true;
 }
@@ -37,19 +39,20 @@ bool CBasicKeyStore::AddCScript(const CScript& redeemScript)
         return error("CBasicKeyStore::AddCScript() : redeemScripts > %i bytes are invalid", MAX_SCRIPT_ELEMENT_SIZE);
 
     LOCK(cs_KeyStore);
+    WRITE_LOCK(cs_KeyStoreMaps);
     mapScripts[redeemScript.GetID()] = redeemScript;
     return true;
 }
 
 bool CBasicKeyStore::HaveCScript(const CScriptID& hash) const
 {
-    LOCK(cs_KeyStore);
+    READ_LOCK(cs_KeyStoreMaps);
     return mapScripts.count(hash) > 0;
 }
 
 bool CBasicKeyStore::GetCScript(const CScriptID &hash, CScript& redeemScriptOut) const
 {
-    LOCK(cs_KeyStore);
+    READ_LOCK(cs_KeyStoreMaps);
     ScriptMap::const_iterator mi = mapScripts.find(hash);
     if (mi != mapScripts.end())
     {
@@ -59,3 +62,31 @@ bool CBasicKeyStore::GetCScript(const CScriptID &hash, CScript& redeemScriptOut)
     return false;
 }
 
+
+size_t CScriptHasher::operator()(const CScript& script) const
+{
+    return boost::hash_range(script.begin(), script.end());
+}
+
+bool CBasicKeyStore::AddWatchOnly(const CScript &dest)
+{
+    LOCK(cs_KeyStore);
+    WRITE_LOCK(cs_KeyStoreMaps);
+    setWatchOnly.insert(dest);
+    return true;
+}
+
+bool CBasicKeyStore::HaveWatchOnly(const CScript &dest) const
+{
+    READ_LOCK(cs_KeyStoreMaps);
+    // Most wallets watch nothing, and need not hash every script they see
+    if (setWatchOnly.empty())
+        return false;
+    return setWatchOnly.count(dest) > 0;
+}
+
+bool CBasicKeyStore::HaveWatchOnly() const
+{
+    READ_LOCK(cs_KeyStoreMaps);
+    return !setWatchOnly.empty();
+}
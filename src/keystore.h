@@ -10,6 +10,8 @@
 #include "sync.h"
 
 #include <boost/signals2/signal.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
 
 class CScript;
 
@@ -17,7 +19,13 @@ class CScript;
 class CKeyStore
 {
 protected:
+    // Held by writers, and by code that reads the maps together with state
+    // of its own
     mutable CCriticalSection cs_KeyStore;
+    // Guards the maps themselves, so that IsMine and signing threads look
+    // keys up side by side. Writers take it exclusively while holding
+    // cs_KeyStore, hence readers holding cs_KeyStore need not take it.
+    mutable CSharedCriticalSection cs_KeyStoreMaps;
 
 public:
     virtual ~CKeyStore() {}
@@ -36,10 +44,30 @@ public:
     virtual bool AddCScript(const CScript& redeemScript) =0;
     virtual bool HaveCScript(const CScriptID &hash) const =0;
     virtual bool GetCScript(const CScriptID &hash, CScript& redeemScriptOut) const =0;
+
+    // Scripts whose outputs are tracked without a key to spend them
+    virtual bool AddWatchOnly(const CScript &dest) =0;
+    virtual bool HaveWatchOnly(const CScript &dest) const =0;
+    virtual bool HaveWatchOnly() const =0;
+};
+
+/** Hasher for the keystore maps. Key and script IDs are hashes of what the
+ * wallet itself holds, so their low bits are used as they are. */
+struct CKeyIDHasher
+{
+    size_t operator()(const uint160& id) const { return id.GetLow64(); }
 };
 
-typedef std::map<CKeyID, CKey> KeyMap;
-typedef std::map<CScriptID, CScript > ScriptMap;
+typedef boost::unordered_map<CKeyID, CKey, CKeyIDHasher> KeyMap;
+typedef boost::unordered_map<CScriptID, CScript, CKeyIDHasher> ScriptMap;
+
+/** Hasher for the watch-only scripts, by their bytes */
+struct CScriptHasher
+{
+    size_t operator()(const CScript& script) const;
+};
+
+typedef boost::unordered_set<CScript, CScriptHasher> WatchOnlySet;
 
 /** Basic key store, that keeps keys in an address->secret map */
 class CBasicKeyStore : public CKeyStore
@@ -47,23 +75,20 @@ class CBasicKeyStore : public CKeyStore
 protected:
     KeyMap mapKeys;
     ScriptMap mapScripts;
+    WatchOnlySet setWatchOnly;
 
 public:
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey);
     bool HaveKey(const CKeyID &address) const
     {
-        bool result;
-        {
-            LOCK(cs_KeyStore);
-            result = (mapKeys.count(address) > 0);
-        }
-        return result;
+        READ_LOCK(cs_KeyStoreMaps);
+        return mapKeys.count(address) > 0;
     }
     void GetKeys(std::set<CKeyID> &setAddress) const
     {
         setAddress.clear();
         {
-            LOCK(cs_KeyStore);
+            READ_LOCK(cs_KeyStoreMaps);
             KeyMap::const_iterator mi = mapKeys.begin();
             while (mi != mapKeys.end())
             {
@@ -75,7 +100,7 @@ public:
     bool GetKey(const CKeyID &address, CKey &keyOut) const
     {
         {
-            LOCK(cs_KeyStore);
+            READ_LOCK(cs_KeyStoreMaps);
             KeyMap::const_iterator mi = mapKeys.find(address);
             if (mi != mapKeys.end())
             {
@@ -88,9 +113,13 @@ public:
     virtual bool AddCScript(const CScript& redeemScript);
     virtual bool HaveCScript(const CScriptID &hash) const;
     virtual bool GetCScript(const CScriptID &hash, CScript& redeemScriptOut) const;
+
+    virtual bool AddWatchOnly(const CScript &dest);
+    virtual bool HaveWatchOnly(const CScript &dest) const;
+    virtual bool HaveWatchOnly() const;
 };
 
 typedef std::vector<unsigned char, secure_allocator<unsigned char> > CKeyingMaterial;
-typedef std::map<CKeyID, std::pair<CPubKey, std::vector<unsigned char> > > CryptedKeyMap;
+typedef boost::unordered_map<CKeyID, std::pair<CPubKey, std::vector<unsigned char> >, CKeyIDHasher> CryptedKeyMap;
 
 #endif
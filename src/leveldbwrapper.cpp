@@ -25,23 +25,29 @@ void HandleError(const leveldb::Status &status) throw(leveldb_error) {
     throw leveldb_error("Unknown database error");
 }
 
-static leveldb::Options GetOptions(size_t nCacheSize) {
+// Each database can be tuned with -<name>.<option> arguments (or <option>
+// in a [<name>] section of the configuration file).
+static leveldb::Options GetOptions(const std::string &strName, size_t nCacheSize, int &nBloomBits) {
+    std::string strPrefix = "-" + strName + ".";
     leveldb::Options options;
     options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    // up to two write buffers may be held in memory simultaneously
+    options.write_buffer_size = std::max(GetArg(strPrefix + "writebuffer", (nCacheSize / 4) >> 10), (int64_t)64) << 10;
+    options.max_open_files = std::max((int)GetArg(strPrefix + "maxopenfiles", 64), 20);
+    options.block_size = std::max(GetArg(strPrefix + "blocksize", options.block_size >> 10), (int64_t)1) << 10;
+    options.compression = GetBoolArg(strPrefix + "compression", false) ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    nBloomBits = std::max((int)GetArg(strPrefix + "bloombits", 10), 0);
+    options.filter_policy = nBloomBits ? leveldb::NewBloomFilterPolicy(nBloomBits) : NULL;
     return options;
 }
 
-CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path &path, size_t nCacheSize, bool fMemory, bool fWipe) {
+CLevelDBWrapper::CLevelDBWrapper(const std::string &strNameIn, const boost::filesystem::path &path, size_t nCacheSize, bool fMemory, bool fWipe) : strName(strNameIn) {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(strName, nCacheSize, nBloomBits);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -56,7 +62,9 @@ CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path &path, size_t nCa
     }
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     HandleError(status);
-    LogPrintf("Opened LevelDB successfully\n");
+    LogPrintf("Opened LevelDB successfully (write buffer %u KiB, block size %u KiB, %d open files, %s, bloom filter %d bits)\n",
+        (unsigned int)(options.write_buffer_size >> 10), (unsigned int)(options.block_size >> 10), options.max_open_files,
+        options.compression == leveldb::kNoCompression ? "uncompressed" : "compressed", nBloomBits);
 }
 
 CLevelDBWrapper::~CLevelDBWrapper() {
@@ -71,7 +79,39 @@ CLevelDBWrapper::~CLevelDBWrapper() {
 }
 
 bool CLevelDBWrapper::WriteBatch(CLevelDBBatch &batch, bool fSync) throw(leveldb_error) {
+    int64_t nStart = GetTimeMicros();
     leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
+    int64_t nTime = GetTimeMicros() - nStart;
+    {
+        LOCK(cs_stats);
+        stats.nWrites++;
+        stats.nWriteMicros += nTime;
+        stats.nMaxWriteMicros = std::max(stats.nMaxWriteMicros, nTime);
+        // LevelDB delays writes by at least 1ms while compaction falls
+        // behind; unsynced writes are much faster than that otherwise.
+        if (!fSync && nTime >= 1000) {
+            stats.nStalls++;
+            stats.nStallMicros += nTime;
+        }
+    }
     HandleError(status);
     return true;
 }
+
+CLevelDBStats CLevelDBWrapper::GetDBStats() {
+    CLevelDBStats ret;
+    {
+        LOCK(cs_stats);
+        ret = stats;
+    }
+    ret.strName = strName;
+    pdb->GetProperty("leveldb.stats", &ret.strStats);
+    leveldb::Range range("", "\xff\xff\xff\xff");
+    pdb->GetApproximateSizes(&range, 1, &ret.nApproximateSize);
+    ret.nWriteBufferSize = options.write_buffer_size;
+    ret.nMaxOpenFiles = options.max_open_files;
+    ret.nBlockSize = options.block_size;
+    ret.fCompression = options.compression != leveldb::kNoCompression;
+    ret.nBloomBits = nBloomBits;
+    return ret;
+}
@@ -6,6 +6,7 @@
 #define BITCOIN_LEVELDBWRAPPER_H
 
 #include "serialize.h"
+#include "sync.h"
 #include "util.h"
 #include "version.h"
 
@@ -31,12 +32,12 @@ private:
 
 public:
     template<typename K, typename V> void Write(const K& key, const V& value) {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        CPlainDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        CPlainDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(ssValue.GetSerializeSize(value));
         ssValue << value;
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
@@ -45,18 +46,55 @@ public:
     }
 
     template<typename K> void Erase(const K& key) {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        CPlainDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         batch.Delete(slKey);
     }
+
+    // Of keys and values serialized already
+    void WriteRaw(const std::string& strKey, const std::string& strValue) {
+        batch.Put(strKey, strValue);
+    }
+
+    void EraseRaw(const std::string& strKey) {
+        batch.Delete(strKey);
+    }
+};
+
+/** Statistics and effective options of a CLevelDBWrapper, for getdbstats */
+struct CLevelDBStats
+{
+    std::string strName;
+    std::string strStats;        // LevelDB's "leveldb.stats" property
+    uint64_t nApproximateSize;   // approximate on-disk size of all keys
+    uint64_t nWrites;            // number of batches written
+    int64_t nWriteMicros;        // total time spent writing batches
+    int64_t nMaxWriteMicros;     // duration of the slowest write
+    uint64_t nStalls;            // unsynced writes held up by compaction (taking 1ms or more)
+    int64_t nStallMicros;        // total duration of those writes
+
+    size_t nWriteBufferSize;
+    int nMaxOpenFiles;
+    size_t nBlockSize;
+    bool fCompression;
+    int nBloomBits;
+
+    CLevelDBStats() : nApproximateSize(0), nWrites(0), nWriteMicros(0), nMaxWriteMicros(0), nStalls(0), nStallMicros(0),
+                      nWriteBufferSize(0), nMaxOpenFiles(0), nBlockSize(0), fCompression(false), nBloomBits(0) {}
 };
 
 class CLevelDBWrapper
 {
 private:
+    // name of the database, used for its -<name>.<option> tuning arguments
+    std::string strName;
+
+    // bits per key of the bloom filter (0 if none)
+    int nBloomBits;
+
     // custom environment this database is using (may be NULL in case of default environment)
     leveldb::Env *penv;
 
@@ -78,18 +116,25 @@ private:
     // the database itself
     leveldb::DB *pdb;
 
+    // write statistics
+    CCriticalSection cs_stats;
+    CLevelDBStats stats;
+
 public:
-    CLevelDBWrapper(const boost::filesystem::path &path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CLevelDBWrapper(const std::string &strNameIn, const boost::filesystem::path &path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
     ~CLevelDBWrapper();
 
-    template<typename K, typename V> bool Read(const K& key, V& value) throw(leveldb_error) {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    // Read as of the snapshot, or the current state if NULL
+    template<typename K, typename V> bool Read(const K& key, V& value, const leveldb::Snapshot *psnapshot = NULL) throw(leveldb_error) {
+        CPlainDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
+        leveldb::ReadOptions options = readoptions;
+        options.snapshot = psnapshot;
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        leveldb::Status status = pdb->Get(options, slKey, &strValue);
         if (!status.ok()) {
             if (status.IsNotFound())
                 return false;
@@ -97,7 +142,7 @@ public:
             HandleError(status);
         }
         try {
-            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            CSpanReader ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
             ssValue >> value;
         } catch(std::exception &e) {
             return false;
@@ -105,6 +150,17 @@ public:
         return true;
     }
 
+    bool ReadRaw(const std::string& strKey, std::string& strValue) throw(leveldb_error) {
+        leveldb::Status status = pdb->Get(readoptions, strKey, &strValue);
+        if (!status.ok()) {
+            if (status.IsNotFound())
+                return false;
+            LogPrintf("LevelDB read failure: %s\n", status.ToString().c_str());
+            HandleError(status);
+        }
+        return true;
+    }
+
     template<typename K, typename V> bool Write(const K& key, const V& value, bool fSync = false) throw(leveldb_error) {
         CLevelDBBatch batch;
         batch.Write(key, value);
@@ -112,7 +168,7 @@ public:
     }
 
     template<typename K> bool Exists(const K& key) throw(leveldb_error) {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        CPlainDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
@@ -146,10 +202,33 @@ public:
         return WriteBatch(batch, true);
     }
 
+    // Rewrite all files, dropping overwritten and erased values
+    void Compact() {
+        pdb->CompactRange(NULL, NULL);
+    }
+
+    CLevelDBStats GetDBStats();
+
     // not exactly clean encapsulation, but it's easiest for now
     leveldb::Iterator *NewIterator() {
         return pdb->NewIterator(iteroptions);
     }
+
+    // Iterate over a consistent view of the database, as of the snapshot
+    leveldb::Iterator *NewIterator(const leveldb::Snapshot *psnapshot) {
+        leveldb::ReadOptions options = iteroptions;
+        options.snapshot = psnapshot;
+        return pdb->NewIterator(options);
+    }
+
+    // A snapshot has to be released again with ReleaseSnapshot()
+    const leveldb::Snapshot *GetSnapshot() {
+        return pdb->GetSnapshot();
+    }
+
+    void ReleaseSnapshot(const leveldb::Snapshot *psnapshot) {
+        pdb->ReleaseSnapshot(psnapshot);
+    }
 };
 
 #endif // BITCOIN_LEVELDBWRAPPER_H
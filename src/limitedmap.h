@@ -5,94 +5,87 @@
 #ifndef BITCOIN_LIMITEDMAP_H
 #define BITCOIN_LIMITEDMAP_H
 
-#include <assert.h> // TODO: remove
-#include <map>
+#include <list>
+#include <utility>
 
-/** STL-like map container that only keeps the N elements with the highest value. */
-template <typename K, typename V> class limitedmap
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
+
+/** STL-like map container that only keeps the N elements most recently
+ * inserted or updated.
+ *
+ * Elements are kept in a list in the order they were last written, and found
+ * through a hash table of list positions, so that insert, update, erase and
+ * evicting the oldest element are O(1). Iteration is oldest first.
+ */
+template <typename K, typename V, typename Hash = boost::hash<K> > class limitedmap
 {
 public:
     typedef K key_type;
     typedef V mapped_type;
     typedef std::pair<const key_type, mapped_type> value_type;
-    typedef typename std::map<K, V>::const_iterator const_iterator;
-    typedef typename std::map<K, V>::size_type size_type;
+    typedef typename std::list<value_type>::const_iterator const_iterator;
+    typedef typename std::list<value_type>::size_type size_type;
 
 protected:
-    std::map<K, V> map;
-    typedef typename std::map<K, V>::iterator iterator;
-    std::multimap<V, iterator> rmap;
-    typedef typename std::multimap<V, iterator>::iterator rmap_iterator;
+    std::list<value_type> list;
+    typedef typename std::list<value_type>::iterator iterator;
+    boost::unordered_map<K, iterator, Hash> index;
+    typedef typename boost::unordered_map<K, iterator, Hash>::iterator index_iterator;
     size_type nMaxSize;
 
+    void evict()
+    {
+        index.erase(list.front().first);
+        list.pop_front();
+    }
+
 public:
     limitedmap(size_type nMaxSizeIn = 0) { nMaxSize = nMaxSizeIn; }
-    const_iterator begin() const { return map.begin(); }
-    const_iterator end() const { return map.end(); }
-    size_type size() const { return map.size(); }
-    bool empty() const { return map.empty(); }
-    const_iterator find(const key_type& k) const { return map.find(k); }
-    size_type count(const key_type& k) const { return map.count(k); }
+    const_iterator begin() const { return list.begin(); }
+    const_iterator end() const { return list.end(); }
+    size_type size() const { return index.size(); }
+    bool empty() const { return index.empty(); }
+    const_iterator find(const key_type& k) const
+    {
+        typename boost::unordered_map<K, iterator, Hash>::const_iterator it = index.find(k);
+        if (it == index.end())
+            return list.end();
+        return it->second;
+    }
+    size_type count(const key_type& k) const { return index.count(k); }
     void insert(const value_type& x)
     {
-        std::pair<iterator, bool> ret = map.insert(x);
-        if (ret.second)
-        {
-            if (nMaxSize && map.size() == nMaxSize)
-            {
-                map.erase(rmap.begin()->second);
-                rmap.erase(rmap.begin());
-            }
-            rmap.insert(make_pair(x.second, ret.first));
-        }
-        return;
+        if (index.count(x.first))
+            return;
+        if (nMaxSize && index.size() == nMaxSize)
+            evict();
+        list.push_back(x);
+        index.insert(std::make_pair(x.first, --list.end()));
     }
     void erase(const key_type& k)
     {
-        iterator itTarget = map.find(k);
-        if (itTarget == map.end())
+        index_iterator it = index.find(k);
+        if (it == index.end())
             return;
-        std::pair<rmap_iterator, rmap_iterator> itPair = rmap.equal_range(itTarget->second);
-        for (rmap_iterator it = itPair.first; it != itPair.second; ++it)
-            if (it->second == itTarget)
-            {
-                rmap.erase(it);
-                map.erase(itTarget);
-                return;
-            }
-        // Shouldn't ever get here
-        assert(0); //TODO remove me
-        map.erase(itTarget);
+        list.erase(it->second);
+        index.erase(it);
     }
     void update(const_iterator itIn, const mapped_type& v)
     {
-        //TODO: When we switch to C++11, use map.erase(itIn, itIn) to get the non-const iterator
-        iterator itTarget = map.find(itIn->first);
-        if (itTarget == map.end())
+        index_iterator it = index.find(itIn->first);
+        if (it == index.end())
             return;
-        std::pair<rmap_iterator, rmap_iterator> itPair = rmap.equal_range(itTarget->second);
-        for (rmap_iterator it = itPair.first; it != itPair.second; ++it)
-            if (it->second == itTarget)
-            {
-                rmap.erase(it);
-                itTarget->second = v;
-                rmap.insert(make_pair(v, itTarget));
-                return;
-            }
-        // Shouldn't ever get here
-        assert(0); //TODO remove me
-        itTarget->second = v;
-        rmap.insert(make_pair(v, itTarget));
+        it->second->second = v;
+        // Move it to the newest end
+        list.splice(list.end(), list, it->second);
     }
     size_type max_size() const { return nMaxSize; }
     size_type max_size(size_type s)
     {
         if (s)
-            while (map.size() > s)
-            {
-                map.erase(rmap.begin()->second);
-                rmap.erase(rmap.begin());
-            }
+            while (index.size() > s)
+                evict();
         nMaxSize = s;
         return nMaxSize;
     }
@@ -6,17 +6,29 @@
 #include "main.h"
 
 #include "addrman.h"
+#include "addressindex.h"
 #include "alert.h"
+#include "arena.h"
+#include "blockencodings.h"
+#include "blockfilter.h"
+#include "blockprofile.h"
+#include "bloom.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "core_memusage.h"
+#include "indexbuild.h"
 #include "init.h"
+#include "metrics.h"
 #include "net.h"
+#include "proptrace.h"
 #include "txdb.h"
 #include "txmempool.h"
 #include "ui_interface.h"
 #include "util.h"
 
+#include <deque>
+#include <math.h>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
@@ -35,19 +47,39 @@ using namespace boost;
 //
 
 CCriticalSection cs_main;
+CCriticalSection cs_chainview;
 
 CTxMemPool mempool;
-
-map<uint256, CBlockIndex*> mapBlockIndex;
+CWaitableCriticalSection csBestBlock;
+CConditionVariable cvBlockChange;
+CBlockFileMapper blockfilemapper;
+CBlockCache blockcache;
+CTxCache txcache;
+CTxidCache txidcache;
+
+BlockMap mapBlockIndex;
+set<CBlockIndex*> setChainTips;
 CChain chainActive;
 CChain chainMostWork;
 int64_t nTimeBestReceived = 0;
 int nScriptCheckThreads = 0;
+int nBlockPipelineDepth = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
+bool fHeadersFirst = DEFAULT_HEADERS_FIRST;
 bool fTxIndex = false;
-unsigned int nCoinCacheSize = 5000;
+bool fBlockFilterIndex = false;
+bool fAddressIndex = false;
+bool fSpentIndex = false;
+bool fPruneMode = false;
+bool fHavePruned = false;
+uint64_t nPruneTarget = 0;
+int nBlockCompression = DEFAULT_BLOCK_COMPRESSION;
+size_t nCoinCacheUsage = 5000 * 300;
+int64_t nDbFlushInterval = DEFAULT_DB_FLUSH_INTERVAL;
+int64_t nDbMaxDirty = DEFAULT_DB_MAX_DIRTY;
+uint256 hashAssumeValid = 0;
 uint256 hashGenesisBlock("0x7497ea1b465eb39f1c8f507bc877078fe016d6fcb6dfad3a64c98dcc6e1e8496");
 
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
@@ -57,22 +89,85 @@ int64_t CTransaction::nMinRelayTxFee = 20000;
 
 static CMedianFilter<int> cPeerBlockCounts(8, 0); // Amount of blocks that other nodes claim to have
 
+/** Block index entries are allocated in chunks rather than one by one, as
+ *  there are millions of them and none is freed while the node runs. */
+class CBlockIndexArena
+{
+private:
+    static const size_t CHUNK_SIZE = 4096;
+    std::vector<CBlockIndex*> vChunks;
+    size_t nUsed; // entries handed out of the last chunk
+
+public:
+    CBlockIndexArena() : nUsed(CHUNK_SIZE) {}
+    ~CBlockIndexArena() { Clear(); }
+
+    CBlockIndex* Allocate()
+    {
+        if (nUsed == CHUNK_SIZE) {
+            vChunks.push_back(new CBlockIndex[CHUNK_SIZE]);
+            nUsed = 0;
+        }
+        return &vChunks.back()[nUsed++];
+    }
+
+    size_t DynamicMemoryUsage() const
+    {
+        return vChunks.size() * memusage::MallocUsage(CHUNK_SIZE * sizeof(CBlockIndex)) + memusage::DynamicUsage(vChunks);
+    }
+
+    // Frees every entry handed out
+    void Clear()
+    {
+        BOOST_FOREACH(CBlockIndex* pchunk, vChunks)
+            delete[] pchunk;
+        vChunks.clear();
+        nUsed = CHUNK_SIZE;
+    }
+};
+
+static CBlockIndexArena blockIndexArena;
+
+// Number of block index entries written together when upgrading them at startup
+static const size_t BLOCK_INDEX_WRITE_BATCH = 50000;
+
 struct COrphanBlock {
     uint256 hashBlock;
     uint256 hashPrev;
-    vector<unsigned char> vchBlock;
+    unsigned int nSize;
+    vector<unsigned char> vchBlock; // Empty when the block waits on disk
 };
 map<uint256, COrphanBlock*> mapOrphanBlocks;
 multimap<uint256, COrphanBlock*> mapOrphanBlocksByPrev;
+// Bytes of the orphan blocks held in vchBlock
+uint64_t nOrphanBlocksMemory = 0;
 
 struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nSize;
+    unsigned int nRandomIndex; // Position in vOrphanTransactionsRandom
 };
 map<uint256, COrphanTx> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+// The orphans by the peer that sent them, by expiry time, and in an array
+// to pick random ones from, so each orphan evicted costs O(log n).
+map<NodeId, set<uint256> > mapOrphanTransactionsByPeer;
+set<pair<int64_t, uint256> > setOrphanTransactionsByExpiry;
+vector<uint256> vOrphanTransactionsRandom;
+uint64_t nOrphanTransactionsSize = 0;
 void EraseOrphansFor(NodeId peer);
 
+// Transactions that failed validation since the tip last changed, and
+// transactions confirmed since the last reorganization, so that AlreadyHave
+// answers for them without asking the coins cache and without fetching and
+// validating them again. False positives only delay a transaction until it
+// is announced after the next block.
+CRollingBloomFilter recentRejects(120000, 0.000001);
+uint256 hashRecentRejectsChainTip;
+CRollingBloomFilter recentConfirmed(48000, 0.000001);
+
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
 
@@ -111,6 +206,8 @@ namespace {
     CCriticalSection cs_LastBlockFile;
     CBlockFileInfo infoLastBlockFile;
     int nLastBlockFile = 0;
+    // Set when a block file is finished, for PruneBlockFiles
+    bool fCheckForPruning = false;
 
     // Every received block is assigned a unique and increasing identifier, so we
     // know which one to give priority in case of a fork.
@@ -131,6 +228,23 @@ namespace {
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
     map<uint256, pair<NodeId, list<uint256>::iterator> > mapBlocksToDownload;
+
+    // Headers-first sync state. Protected by cs_main.
+    // Headers whose proof of work has been verified, but whose block is not in mapBlockIndex yet.
+    set<uint256> setHeadersVerified;
+    // Verified headers whose blocks have not been assigned to a peer yet, in chain order.
+    std::deque<uint256> queueHeadersToFetch;
+    // The peer headers are requested from, the last header it sent, and whether it may have more.
+    NodeId nodeHeadersSync = -1;
+    uint256 hashHeadersLast;
+    bool fHeadersMore = false;
+    bool fHeadersRequested = false;
+    // Height of hashHeadersLast, or -1 if not known.
+    int nHeadersLastHeight = -1;
+    // Headers from the sync peer up to hashHeadersLast, below the last checkpoint,
+    // whose proof of work is not checked: they are accepted once the header at the
+    // next checkpoint height matches, as its hash commits to all of them.
+    vector<CBlockHeader> vHeadersPending;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -154,6 +268,8 @@ struct CMainSignals {
     boost::signals2::signal<void (const uint256 &)> Inventory;
     // Tells listeners to broadcast their data.
     boost::signals2::signal<void ()> Broadcast;
+    // Asks listeners to add the heap memory they hold.
+    boost::signals2::signal<void (size_t &)> MemoryUsage;
 } g_signals;
 }
 
@@ -164,9 +280,11 @@ void RegisterWallet(CWalletInterface* pwalletIn) {
     g_signals.SetBestChain.connect(boost::bind(&CWalletInterface::SetBestChain, pwalletIn, _1));
     g_signals.Inventory.connect(boost::bind(&CWalletInterface::Inventory, pwalletIn, _1));
     g_signals.Broadcast.connect(boost::bind(&CWalletInterface::ResendWalletTransactions, pwalletIn));
+    g_signals.MemoryUsage.connect(boost::bind(&CWalletInterface::AddMemoryUsage, pwalletIn, _1));
 }
 
 void UnregisterWallet(CWalletInterface* pwalletIn) {
+    g_signals.MemoryUsage.disconnect(boost::bind(&CWalletInterface::AddMemoryUsage, pwalletIn, _1));
     g_signals.Broadcast.disconnect(boost::bind(&CWalletInterface::ResendWalletTransactions, pwalletIn));
     g_signals.Inventory.disconnect(boost::bind(&CWalletInterface::Inventory, pwalletIn, _1));
     g_signals.SetBestChain.disconnect(boost::bind(&CWalletInterface::SetBestChain, pwalletIn, _1));
@@ -176,6 +294,7 @@ void UnregisterWallet(CWalletInterface* pwalletIn) {
 }
 
 void UnregisterAllWallets() {
+    g_signals.MemoryUsage.disconnect_all_slots();
     g_signals.Broadcast.disconnect_all_slots();
     g_signals.Inventory.disconnect_all_slots();
     g_signals.SetBestChain.disconnect_all_slots();
@@ -184,8 +303,103 @@ void UnregisterAllWallets() {
     g_signals.SyncTransaction.disconnect_all_slots();
 }
 
+namespace {
+    // Wallet notifications in the order validation made them. They are run on
+    // the notification thread while it runs, so that connecting blocks does
+    // not wait for the wallets, and right away otherwise.
+    boost::mutex csWalletNotify;
+    boost::condition_variable condWalletNotify;
+    std::deque<boost::function<void ()> > queueWalletNotify;
+    // Notifications taken off the queue and still running
+    int nWalletNotifyRunning = 0;
+    bool fWalletNotifyThread = false;
+}
+
+static void QueueWalletNotification(const boost::function<void ()>& func)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(csWalletNotify);
+        queueWalletNotify.push_back(func);
+        if (fWalletNotifyThread) {
+            condWalletNotify.notify_all();
+            return;
+        }
+    }
+    SyncWalletNotifications();
+}
+
+void SyncWalletNotifications()
+{
+    boost::unique_lock<boost::mutex> lock(csWalletNotify);
+    while (fWalletNotifyThread && (!queueWalletNotify.empty() || nWalletNotifyRunning > 0))
+        condWalletNotify.wait(lock);
+    // Without the thread, or left behind when it stopped: run them here
+    while (!fWalletNotifyThread && !queueWalletNotify.empty()) {
+        boost::function<void ()> func = queueWalletNotify.front();
+        queueWalletNotify.pop_front();
+        lock.unlock();
+        func();
+        lock.lock();
+    }
+}
+
+void ThreadWalletNotify()
+{
+    RenameThread("bitcoin-walletnotify");
+    boost::unique_lock<boost::mutex> lock(csWalletNotify);
+    fWalletNotifyThread = true;
+    try {
+        while (true) {
+            while (queueWalletNotify.empty())
+                condWalletNotify.wait(lock);
+            boost::function<void ()> func = queueWalletNotify.front();
+            queueWalletNotify.pop_front();
+            nWalletNotifyRunning++;
+            lock.unlock();
+            try {
+                func();
+            } catch (std::exception& e) {
+                PrintExceptionContinue(&e, "ThreadWalletNotify()");
+            }
+            lock.lock();
+            nWalletNotifyRunning--;
+            condWalletNotify.notify_all();
+        }
+    } catch (boost::thread_interrupted&) {
+        fWalletNotifyThread = false;
+        condWalletNotify.notify_all();
+        throw;
+    }
+}
+
+static void NotifyTransaction(const uint256 &hash, const CTransaction &tx, boost::shared_ptr<const CBlock> pblock) {
+    g_signals.SyncTransaction(hash, tx, pblock.get());
+}
+
+static void NotifyBlockTransactions(boost::shared_ptr<const CBlock> pblock, bool fConnected) {
+    for (unsigned int i = 0; i < pblock->vtx.size(); i++)
+        g_signals.SyncTransaction(pblock->GetTxHash(i), pblock->vtx[i], fConnected ? pblock.get() : NULL);
+}
+
+static void NotifySetBestChain(const CBlockLocator &locator) {
+    g_signals.SetBestChain(locator);
+}
+
+static void NotifyUpdatedTransaction(const uint256 &hash) {
+    g_signals.UpdatedTransaction(hash);
+}
+
 void SyncWithWallets(const uint256 &hash, const CTransaction &tx, const CBlock *pblock) {
-    g_signals.SyncTransaction(hash, tx, pblock);
+    boost::shared_ptr<const CBlock> pblockCopy;
+    if (pblock)
+        pblockCopy.reset(new CBlock(*pblock));
+    QueueWalletNotification(boost::bind(&NotifyTransaction, hash, tx, pblockCopy));
+}
+
+// Tell the wallets about all transactions of a block, copying it once
+static void SyncBlockWithWallets(const CBlock &block, bool fConnected) {
+    boost::shared_ptr<const CBlock> pblock(new CBlock(block));
+    QueueWalletNotification(boost::bind(&NotifyBlockTransactions, pblock, fConnected));
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -220,6 +434,14 @@ struct CNodeState {
     int nBlocksToDownload;
     int64_t nLastBlockReceive;
     int64_t nLastBlockProcess;
+    // Moving average of the time this peer takes per requested block, once
+    // the block reaches the front of its queue, in microseconds. 0 until
+    // the first block arrives.
+    int64_t nBlockServiceUsec;
+    // Headers-first fetching skips this peer until then, after it stalled.
+    int64_t nNoFetchBefore;
+    // Compact block from this peer waiting for its blocktxn reply.
+    boost::shared_ptr<CPartialBlock> pPartialBlock;
 
     CNodeState() {
         nMisbehavior = 0;
@@ -228,6 +450,8 @@ struct CNodeState {
         nBlocksInFlight = 0;
         nLastBlockReceive = 0;
         nLastBlockProcess = 0;
+        nBlockServiceUsec = 0;
+        nNoFetchBefore = 0;
     }
 };
 
@@ -244,7 +468,7 @@ CNodeState *State(NodeId pnode) {
 
 int GetHeight()
 {
-    LOCK(cs_main);
+    LOCK(cs_chainview);
     return chainActive.Height();
 }
 
@@ -258,10 +482,24 @@ void FinalizeNode(NodeId nodeid) {
     LOCK(cs_main);
     CNodeState *state = State(nodeid);
 
-    BOOST_FOREACH(const QueuedBlock& entry, state->vBlocksInFlight)
+    // Blocks found through headers-first sync go back to the front of the
+    // fetch queue, to be requested from another peer
+    vector<uint256> vRefetch;
+    BOOST_FOREACH(const QueuedBlock& entry, state->vBlocksInFlight) {
         mapBlocksInFlight.erase(entry.hash);
-    BOOST_FOREACH(const uint256& hash, state->vBlocksToDownload)
+        if (setHeadersVerified.count(entry.hash))
+            vRefetch.push_back(entry.hash);
+    }
+    BOOST_FOREACH(const uint256& hash, state->vBlocksToDownload) {
         mapBlocksToDownload.erase(hash);
+        if (setHeadersVerified.count(hash))
+            vRefetch.push_back(hash);
+    }
+    queueHeadersToFetch.insert(queueHeadersToFetch.begin(), vRefetch.begin(), vRefetch.end());
+    if (nodeid == nodeHeadersSync) {
+        nodeHeadersSync = -1;
+        vHeadersPending.clear();
+    }
     EraseOrphansFor(nodeid);
 
     mapNodeState.erase(nodeid);
@@ -280,15 +518,58 @@ void MarkBlockAsReceived(const uint256 &hash, NodeId nodeFrom = -1) {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState *state = State(itInFlight->second.first);
+        if (itInFlight->second.first == nodeFrom) {
+            // Measure from when the peer could start on the block: its
+            // request, or the previous block it delivered
+            int64_t nNow = GetTimeMicros();
+            int64_t nService = nNow - max(itInFlight->second.second->nTime, state->nLastBlockReceive);
+            state->nBlockServiceUsec = state->nBlockServiceUsec ? (state->nBlockServiceUsec * 7 + nService) / 8 : nService;
+            state->nLastBlockReceive = nNow;
+        }
         state->vBlocksInFlight.erase(itInFlight->second.second);
         state->nBlocksInFlight--;
-        if (itInFlight->second.first == nodeFrom)
-            state->nLastBlockReceive = GetTimeMicros();
         mapBlocksInFlight.erase(itInFlight);
     }
 
 }
 
+// Blocks to keep requested from a peer: as many as it delivers in a quarter
+// of the download timeout at its measured rate. Requires cs_main.
+int GetBlockDownloadTarget(const CNodeState &state) {
+    if (state.nBlockServiceUsec <= 0)
+        return BLOCK_DOWNLOAD_TARGET_INITIAL;
+    int64_t nTarget = (BLOCK_DOWNLOAD_TIMEOUT * 1000000 / 4) / state.nBlockServiceUsec;
+    int64_t nMax = min(MAX_BLOCKS_IN_TRANSIT_PER_PEER, (int)BLOCK_DOWNLOAD_WINDOW / 2);
+    return (int)max((int64_t)4, min(nTarget, nMax));
+}
+
+// Take back the headers-first requests a peer is late on, so the next
+// peers asked for blocks pick them up. A block may be late by the timeout
+// plus the time the peer needs for the requests queued before it.
+// Returns how many were reassigned. Requires cs_main.
+int ReassignStalledBlocks(NodeId nodeid, int64_t nNow) {
+    CNodeState &state = *State(nodeid);
+    int64_t nPerBlock = state.nBlockServiceUsec ? state.nBlockServiceUsec : 1000000;
+    vector<uint256> vReassign;
+    BOOST_FOREACH(const QueuedBlock& entry, state.vBlocksInFlight) {
+        if (nNow > entry.nTime + BLOCK_DOWNLOAD_TIMEOUT * 1000000 + entry.nQueuedBefore * nPerBlock &&
+            setHeadersVerified.count(entry.hash))
+            vReassign.push_back(entry.hash);
+    }
+    if (vReassign.empty())
+        return 0;
+
+    BOOST_FOREACH(const uint256& hash, vReassign)
+        MarkBlockAsReceived(hash);
+    queueHeadersToFetch.insert(queueHeadersToFetch.begin(), vReassign.begin(), vReassign.end());
+
+    // Fall back to the smallest share, and leave the queue to others for a while
+    state.nBlockServiceUsec = max(state.nBlockServiceUsec, (int64_t)BLOCK_DOWNLOAD_TIMEOUT * 1000000 / 16);
+    state.nNoFetchBefore = nNow + BLOCK_DOWNLOAD_TIMEOUT * 1000000 / 2;
+    LogPrint("net", "Peer %s is late on %u blocks, reassigning them\n", state.name, vReassign.size());
+    return vReassign.size();
+}
+
 // Requires cs_main.
 bool AddBlockToQueue(NodeId nodeid, const uint256 &hash) {
     if (mapBlocksToDownload.count(hash) || mapBlocksInFlight.count(hash))
@@ -330,9 +611,42 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     if (state == NULL)
         return false;
     stats.nMisbehavior = state->nMisbehavior;
+    stats.nBlocksInFlight = state->nBlocksInFlight;
+    stats.nBlockDownloadTarget = GetBlockDownloadTarget(*state);
+    stats.nBlockServiceUsec = state->nBlockServiceUsec;
     return true;
 }
 
+void GetMemoryUsageStats(CMemoryUsageStats &stats) {
+    {
+        LOCK(cs_main);
+        stats.nCoinsCache = pcoinsTip ? pcoinsTip->DynamicMemoryUsage() : 0;
+        stats.nBlockIndex = blockIndexArena.DynamicMemoryUsage() + memusage::DynamicUsage(mapBlockIndex) +
+            memusage::DynamicUsage(setBlockIndexValid) + memusage::DynamicUsage(setHeadersVerified) +
+            memusage::DynamicUsage(setChainTips) +
+            chainActive.DynamicMemoryUsage();
+
+        stats.nOrphanTransactions = memusage::DynamicUsage(mapOrphanTransactions) +
+            memusage::DynamicUsage(mapOrphanTransactionsByPrev) + memusage::DynamicUsage(mapOrphanTransactionsByPeer) +
+            memusage::DynamicUsage(setOrphanTransactionsByExpiry) + memusage::DynamicUsage(vOrphanTransactionsRandom);
+        for (map<uint256, COrphanTx>::const_iterator it = mapOrphanTransactions.begin(); it != mapOrphanTransactions.end(); ++it)
+            stats.nOrphanTransactions += RecursiveDynamicUsage(it->second.tx);
+        for (map<uint256, set<uint256> >::const_iterator it = mapOrphanTransactionsByPrev.begin(); it != mapOrphanTransactionsByPrev.end(); ++it)
+            stats.nOrphanTransactions += memusage::DynamicUsage(it->second);
+        for (map<NodeId, set<uint256> >::const_iterator it = mapOrphanTransactionsByPeer.begin(); it != mapOrphanTransactionsByPeer.end(); ++it)
+            stats.nOrphanTransactions += memusage::DynamicUsage(it->second);
+
+        stats.nOrphanBlocks = memusage::DynamicUsage(mapOrphanBlocks) + memusage::DynamicUsage(mapOrphanBlocksByPrev) +
+            mapOrphanBlocks.size() * memusage::MallocUsage(sizeof(COrphanBlock));
+        for (map<uint256, COrphanBlock*>::const_iterator it = mapOrphanBlocks.begin(); it != mapOrphanBlocks.end(); ++it)
+            stats.nOrphanBlocks += memusage::DynamicUsage(it->second->vchBlock);
+    }
+    stats.nMempool = mempool.DynamicMemoryUsage();
+    stats.nPeers = GetPeersMemoryUsage();
+    stats.nSignatureCache = GetSignatureCacheStats().nUsage;
+    g_signals.MemoryUsage(stats.nWallet);
+}
+
 void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.GetHeight.connect(&GetHeight);
@@ -383,12 +697,13 @@ CBlockLocator CChain::GetLocator(const CBlockIndex *pindex) const {
             break;
         // Exponentially larger steps back, plus the genesis block.
         int nHeight = std::max(pindex->nHeight - nStep, 0);
-        // In case pindex is not in this chain, iterate pindex->pprev to find blocks.
-        while (pindex->nHeight > nHeight && !Contains(pindex))
-            pindex = pindex->pprev;
-        // If pindex is in this chain, use direct height-based access.
-        if (pindex->nHeight > nHeight)
+        if (Contains(pindex)) {
+            // Use O(1) CChain index if possible.
             pindex = (*this)[nHeight];
+        } else {
+            // Otherwise, use O(log n) skiplist.
+            pindex = pindex->GetAncestor(nHeight);
+        }
         if (vHave.size() > 10)
             nStep *= 2;
     }
@@ -399,7 +714,7 @@ CBlockLocator CChain::GetLocator(const CBlockIndex *pindex) const {
 CBlockIndex *CChain::FindFork(const CBlockLocator &locator) const {
     // Find the first block the caller has in the main chain
     BOOST_FOREACH(const uint256& hash, locator.vHave) {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
         if (mi != mapBlockIndex.end())
         {
             CBlockIndex* pindex = (*mi).second;
@@ -410,7 +725,86 @@ CBlockIndex *CChain::FindFork(const CBlockLocator &locator) const {
     return Genesis();
 }
 
+CBlockIndex *CChain::FindFork(const CBlockIndex *pindex) const {
+    if (pindex == NULL || vChain.empty() || !Contains(pindex->GetAncestor(0)))
+        return NULL;
+    // The ancestors of pindex in this chain are exactly those up to the fork,
+    // so bisect on the height; each probe is a skip list lookup
+    int nLow = 0;
+    int nHigh = std::min(pindex->nHeight, Height());
+    if (Contains(pindex->GetAncestor(nHigh)))
+        return vChain[nHigh];
+    while (nHigh - nLow > 1) {
+        int nMid = (nLow + nHigh) / 2;
+        if (Contains(pindex->GetAncestor(nMid)))
+            nLow = nMid;
+        else
+            nHigh = nMid;
+    }
+    return vChain[nLow];
+}
+
+// A new entry replaces its parent as a tip
+static void UpdateChainTips(CBlockIndex* pindexNew)
+{
+    if (pindexNew->pprev)
+        setChainTips.erase(pindexNew->pprev);
+    setChainTips.insert(pindexNew);
+}
+
+/** Turn the lowest '1' bit in the binary representation of a number into a '0'. */
+int static inline InvertLowestOne(int n) { return n & (n - 1); }
+
+/** Compute what height to jump back to with the CBlockIndex::pskip pointer. */
+int static inline GetSkipHeight(int height) {
+    if (height < 2)
+        return 0;
+
+    // Determine which height to jump back to. Any number strictly lower than height is acceptable,
+    // but the following expression seems to perform well in simulations (max 110 steps to go back
+    // up to 2**18 blocks).
+    return (height & 1) ? InvertLowestOne(InvertLowestOne(height - 1)) + 1 : InvertLowestOne(height);
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int height)
+{
+    if (height > nHeight || height < 0)
+        return NULL;
+
+    CBlockIndex* pindexWalk = this;
+    int heightWalk = nHeight;
+    while (heightWalk > height) {
+        int heightSkip = GetSkipHeight(heightWalk);
+        int heightSkipPrev = GetSkipHeight(heightWalk - 1);
+        if (pindexWalk->pskip != NULL &&
+            (heightSkip == height ||
+             (heightSkip > height && !(heightSkipPrev < heightSkip - 2 &&
+                                       heightSkipPrev >= height)))) {
+            // Only follow pskip if pprev->pskip isn't better than pskip->pprev.
+            pindexWalk = pindexWalk->pskip;
+            heightWalk = heightSkip;
+        } else {
+            pindexWalk = pindexWalk->pprev;
+            heightWalk--;
+        }
+    }
+    return pindexWalk;
+}
+
+const CBlockIndex* CBlockIndex::GetAncestor(int height) const
+{
+    return const_cast<CBlockIndex*>(this)->GetAncestor(height);
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
+}
+
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewDB *pcoinsdbview = NULL;
+CCoinsViewAsyncDB *pcoinsAsync = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
@@ -438,10 +832,18 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer)
         return false;
     }
 
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
+    COrphanTx &orphan = mapOrphanTransactions[hash];
+    orphan.tx = tx;
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nSize = sz;
+    orphan.nRandomIndex = vOrphanTransactionsRandom.size();
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
         mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+    mapOrphanTransactionsByPeer[peer].insert(hash);
+    setOrphanTransactionsByExpiry.insert(make_pair(orphan.nTimeExpire, hash));
+    vOrphanTransactionsRandom.push_back(hash);
+    nOrphanTransactionsSize += sz;
 
     LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
              mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
@@ -462,37 +864,49 @@ void static EraseOrphanTx(uint256 hash)
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+    const COrphanTx &orphan = it->second;
+    map<NodeId, set<uint256> >::iterator itPeer = mapOrphanTransactionsByPeer.find(orphan.fromPeer);
+    if (itPeer != mapOrphanTransactionsByPeer.end()) {
+        itPeer->second.erase(hash);
+        if (itPeer->second.empty())
+            mapOrphanTransactionsByPeer.erase(itPeer);
+    }
+    setOrphanTransactionsByExpiry.erase(make_pair(orphan.nTimeExpire, hash));
+    // Move the last one into the gap
+    const uint256 &hashLast = vOrphanTransactionsRandom.back();
+    mapOrphanTransactions[hashLast].nRandomIndex = orphan.nRandomIndex;
+    vOrphanTransactionsRandom[orphan.nRandomIndex] = hashLast;
+    vOrphanTransactionsRandom.pop_back();
+    nOrphanTransactionsSize -= orphan.nSize;
     mapOrphanTransactions.erase(it);
 }
 
 void EraseOrphansFor(NodeId peer)
 {
-    int nErased = 0;
-    map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end())
-    {
-        map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer)
-        {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
-            ++nErased;
-        }
-    }
-    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
+    map<NodeId, set<uint256> >::iterator itPeer = mapOrphanTransactionsByPeer.find(peer);
+    if (itPeer == mapOrphanTransactionsByPeer.end())
+        return;
+    // EraseOrphanTx removes the peer's entry with its last orphan
+    vector<uint256> vErase(itPeer->second.begin(), itPeer->second.end());
+    BOOST_FOREACH(const uint256 &hash, vErase)
+        EraseOrphanTx(hash);
+    LogPrint("mempool", "Erased %d orphan tx from peer %d\n", vErase.size(), peer);
 }
 
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, uint64_t nMaxBytes)
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+    // The expired ones first, their parents are not coming
+    int64_t nNow = GetTime();
+    while (!setOrphanTransactionsByExpiry.empty() && setOrphanTransactionsByExpiry.begin()->first <= nNow) {
+        EraseOrphanTx(setOrphanTransactionsByExpiry.begin()->second);
+        ++nEvicted;
+    }
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTransactionsSize > nMaxBytes)
     {
         // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+        EraseOrphanTx(vOrphanTransactionsRandom[GetRand(vOrphanTransactionsRandom.size())]);
         ++nEvicted;
     }
     return nEvicted;
@@ -504,7 +918,100 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
 
 
 
+// Legacy sigops of an output script Solver matched: the templates fix them,
+// except for data outputs, whose pushes may be any opcode
+bool static GetTemplateSigOpCount(txnouttype whichType, unsigned int& nSigOps)
+{
+    switch (whichType)
+    {
+    case TX_PUBKEY:
+    case TX_PUBKEYHASH:
+        nSigOps = 1;
+        return true;
+    case TX_SCRIPTHASH:
+        nSigOps = 0;
+        return true;
+    case TX_MULTISIG:
+        nSigOps = 20; // Counted as the most keys, not accurately
+        return true;
+    default:
+        return false;
+    }
+}
+
+void AnalyzeTransaction(const CTransaction& tx, CTxAnalysis& analysis)
+{
+    analysis.nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    analysis.nLegacySigOps = 0;
+    analysis.nP2SHSigOps = 0;
+    analysis.fPushOnly = true;
+    analysis.pszScriptSigReason = NULL;
+
+    // What IsPushOnly, HasCanonicalPushes and GetSigOpCount(false) find, in
+    // one walk over each scriptSig
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        const CScript& scriptSig = txin.scriptSig;
+        bool fPushOnly = true;
+        bool fCanonical = true;
+        CScript::const_iterator pc = scriptSig.begin();
+        std::vector<unsigned char> data;
+        while (pc < scriptSig.end())
+        {
+            opcodetype opcode;
+            if (!scriptSig.GetOp(pc, opcode, data)) {
+                fPushOnly = fCanonical = false;
+                break;
+            }
+            if (opcode > OP_16) {
+                fPushOnly = false;
+                if (opcode == OP_CHECKSIG || opcode == OP_CHECKSIGVERIFY)
+                    analysis.nLegacySigOps++;
+                else if (opcode == OP_CHECKMULTISIG || opcode == OP_CHECKMULTISIGVERIFY)
+                    analysis.nLegacySigOps += 20;
+            } else if ((opcode < OP_PUSHDATA1 && opcode > OP_0 && (data.size() == 1 && data[0] <= 16)) ||
+                       (opcode == OP_PUSHDATA1 && data.size() < OP_PUSHDATA1) ||
+                       (opcode == OP_PUSHDATA2 && data.size() <= 0xFF) ||
+                       (opcode == OP_PUSHDATA4 && data.size() <= 0xFFFF)) {
+                fCanonical = false;
+            }
+        }
+        if (!fPushOnly)
+            analysis.fPushOnly = false;
+        if (analysis.pszScriptSigReason == NULL) {
+            // See IsStandardTx
+            if (scriptSig.size() > 1650)
+                analysis.pszScriptSigReason = "scriptsig-size";
+            else if (!fPushOnly)
+                analysis.pszScriptSigReason = "scriptsig-not-pushonly";
+            else if (!fCanonical)
+                analysis.pszScriptSigReason = "scriptsig-non-canonical-push";
+        }
+    }
+
+    analysis.vOutTypes.resize(tx.vout.size());
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        const CScript& scriptPubKey = tx.vout[i].scriptPubKey;
+        vector<vector<unsigned char> > vSolutions;
+        txnouttype whichType;
+        Solver(scriptPubKey, whichType, vSolutions);
+        unsigned int nSigOps;
+        if (!GetTemplateSigOpCount(whichType, nSigOps))
+            nSigOps = scriptPubKey.GetSigOpCount(false);
+        analysis.nLegacySigOps += nSigOps;
+        analysis.vOutTypes[i] = IsStandard(whichType, vSolutions) ? whichType : TX_NONSTANDARD;
+    }
+}
+
 bool IsStandardTx(const CTransaction& tx, string& reason)
+{
+    CTxAnalysis analysis;
+    AnalyzeTransaction(tx, analysis);
+    return IsStandardTx(tx, analysis, reason);
+}
+
+bool IsStandardTx(const CTransaction& tx, const CTxAnalysis& analysis, string& reason)
 {
     AssertLockHeld(cs_main);
     if (tx.nVersion > CTransaction::CURRENT_VERSION || tx.nVersion < 1) {
@@ -538,40 +1045,30 @@ bool IsStandardTx(const CTransaction& tx, string& reason)
     // almost as much to process as they cost the sender in fees, because
     // computing signature hashes is O(ninputs*txsize). Limiting transactions
     // to MAX_STANDARD_TX_SIZE mitigates CPU exhaustion attacks.
-    unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
-    if (sz >= MAX_STANDARD_TX_SIZE) {
+    if (analysis.nSize >= MAX_STANDARD_TX_SIZE) {
         reason = "tx-size";
         return false;
     }
 
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
-    {
-        // Biggest 'standard' txin is a 15-of-15 P2SH multisig with compressed
-        // keys. (remember the 520 byte limit on redeemScript size) That works
-        // out to a (15*(33+1))+3=513 byte redeemScript, 513+1+15*(73+1)=1624
-        // bytes of scriptSig, which we round off to 1650 bytes for some minor
-        // future-proofing. That's also enough to spend a 20-of-20
-        // CHECKMULTISIG scriptPubKey, though such a scriptPubKey is not
-        // considered standard)
-        if (txin.scriptSig.size() > 1650) {
-            reason = "scriptsig-size";
-            return false;
-        }
-        if (!txin.scriptSig.IsPushOnly()) {
-            reason = "scriptsig-not-pushonly";
-            return false;
-        }
-        if (!txin.scriptSig.HasCanonicalPushes()) {
-            reason = "scriptsig-non-canonical-push";
-            return false;
-        }
+    // Biggest 'standard' txin is a 15-of-15 P2SH multisig with compressed
+    // keys. (remember the 520 byte limit on redeemScript size) That works
+    // out to a (15*(33+1))+3=513 byte redeemScript, 513+1+15*(73+1)=1624
+    // bytes of scriptSig, which we round off to 1650 bytes for some minor
+    // future-proofing. That's also enough to spend a 20-of-20
+    // CHECKMULTISIG scriptPubKey, though such a scriptPubKey is not
+    // considered standard). Their scriptSigs must also only push data, each
+    // push in its shortest form.
+    if (analysis.pszScriptSigReason != NULL) {
+        reason = analysis.pszScriptSigReason;
+        return false;
     }
 
     unsigned int nDataOut = 0;
     unsigned int nTxnOut = 0;
-    txnouttype whichType;
-    BOOST_FOREACH(const CTxOut& txout, tx.vout) {
-        if (!::IsStandard(txout.scriptPubKey, whichType)) {
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        const CTxOut& txout = tx.vout[i];
+        txnouttype whichType = analysis.vOutTypes[i];
+        if (whichType == TX_NONSTANDARD) {
             reason = "scriptpubkey";
             return false;
         }
@@ -598,12 +1095,13 @@ bool IsStandardTx(const CTransaction& tx, string& reason)
 
 bool IsFinalTx(const CTransaction &tx, int nBlockHeight, int64_t nBlockTime)
 {
-    AssertLockHeld(cs_main);
     // Time based nLockTime implemented in 0.1.6
     if (tx.nLockTime == 0)
         return true;
-    if (nBlockHeight == 0)
+    if (nBlockHeight == 0) {
+        LOCK(cs_chainview);
         nBlockHeight = chainActive.Height();
+    }
     if (nBlockTime == 0)
         nBlockTime = GetAdjustedTime();
     if ((int64_t)tx.nLockTime < ((int64_t)tx.nLockTime < LOCKTIME_THRESHOLD ? (int64_t)nBlockHeight : nBlockTime))
@@ -627,6 +1125,14 @@ bool IsFinalTx(const CTransaction &tx, int nBlockHeight, int64_t nBlockTime)
 //
 bool AreInputsStandard(const CTransaction& tx, CCoinsViewCache& mapInputs)
 {
+    CTxAnalysis analysis;
+    AnalyzeTransaction(tx, analysis);
+    return AreInputsStandard(tx, mapInputs, analysis);
+}
+
+bool AreInputsStandard(const CTransaction& tx, CCoinsViewCache& mapInputs, CTxAnalysis& analysis)
+{
+    analysis.nP2SHSigOps = 0;
     if (tx.IsCoinBase())
         return true; // Coinbases don't use vin normally
 
@@ -670,6 +1176,17 @@ bool AreInputsStandard(const CTransaction& tx, CCoinsViewCache& mapInputs)
             if (tmpExpected < 0)
                 return false;
             nArgsExpected += tmpExpected;
+
+            // The count of GetP2SHSigOpCount: the last push of a push-only
+            // scriptSig is the subscript, and Solver fixes its sigops
+            unsigned int nSigOps;
+            if (!analysis.fPushOnly)
+                nSigOps = prevScript.GetSigOpCount(tx.vin[i].scriptSig);
+            else if (whichType2 == TX_MULTISIG)
+                nSigOps = vSolutions2.back()[0];
+            else if (!GetTemplateSigOpCount(whichType2, nSigOps))
+                nSigOps = subscript.GetSigOpCount(true);
+            analysis.nP2SHSigOps += nSigOps;
         }
 
         if (stack.size() != (unsigned int)nArgsExpected)
@@ -714,9 +1231,9 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     CBlock blockTmp;
 
     if (pblock == NULL) {
-        CCoins coins;
-        if (pcoinsTip->GetCoins(GetHash(), coins)) {
-            CBlockIndex *pindex = chainActive[coins.nHeight];
+        const CCoin &coin = AccessByTxid(*pcoinsTip, GetHash());
+        if (!coin.IsSpent()) {
+            CBlockIndex *pindex = chainActive[coin.nHeight];
             if (pindex) {
                 if (!ReadBlockFromDisk(blockTmp, pindex))
                     return 0;
@@ -746,7 +1263,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -792,14 +1309,17 @@ bool CheckTransaction(const CTransaction& tx, CValidationState &state)
                              REJECT_INVALID, "bad-txns-txouttotal-toolarge");
     }
 
-    // Check for duplicate inputs
-    set<COutPoint> vInOutPoints;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    // Check for duplicate inputs, sorted next to each other
+    if (tx.vin.size() > 1)
     {
-        if (vInOutPoints.count(txin.prevout))
+        vector<COutPoint> vInOutPoints;
+        vInOutPoints.reserve(tx.vin.size());
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            vInOutPoints.push_back(txin.prevout);
+        sort(vInOutPoints.begin(), vInOutPoints.end());
+        if (adjacent_find(vInOutPoints.begin(), vInOutPoints.end()) != vInOutPoints.end())
             return state.DoS(100, error("CheckTransaction() : duplicate inputs"),
                              REJECT_INVALID, "bad-txns-inputs-duplicate");
-        vInOutPoints.insert(txin.prevout);
     }
 
     if (tx.IsCoinBase())
@@ -847,9 +1367,10 @@ int64_t GetMinFee(const CTransaction& tx, unsigned int nBytes, bool fAllowFree,
     return nMinFee;
 }
 
+bool static CheckInputsParallel(const CTransaction& tx, CValidationState &state, CCoinsViewCache &view, unsigned int flags);
 
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectInsaneFee)
+                        bool* pfMissingInputs, bool fRejectInsaneFee, int64_t nAcceptTime)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -864,8 +1385,10 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                          REJECT_INVALID, "coinbase");
 
     // Rather not work on nonstandard transactions (unless -testnet/-regtest)
+    CTxAnalysis analysis;
+    AnalyzeTransaction(tx, analysis);
     string reason;
-    if (Params().NetworkID() == CChainParams::MAIN && !IsStandardTx(tx, reason))
+    if (Params().NetworkID() == CChainParams::MAIN && !IsStandardTx(tx, analysis, reason))
         return state.DoS(0,
                          error("AcceptToMemoryPool : nonstandard transaction: %s", reason),
                          REJECT_NONSTANDARD, reason);
@@ -898,26 +1421,23 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         CCoinsViewMemPool viewMemPool(*pcoinsTip, pool);
         view.SetBackend(viewMemPool);
 
-        // do we already have it?
-        if (view.HaveCoins(hash))
-            return false;
-
         // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // only helps filling in pfMissingInputs (to determine missing vs spent).
+        // Spent and missing inputs look the same in the per-output UTXO set,
+        // so report them as missing and let the orphan logic sort it out.
         BOOST_FOREACH(const CTxIn txin, tx.vin) {
-            if (!view.HaveCoins(txin.prevout.hash)) {
+            if (!view.HaveCoin(txin.prevout)) {
+                // do we already have it? Only ask the cache, a confirmed
+                // transaction has its outputs there in almost all cases.
+                for (unsigned int i = 0; i < tx.vout.size(); i++) {
+                    if (pcoinsTip->HaveCoinInCache(COutPoint(hash, i)))
+                        return false;
+                }
                 if (pfMissingInputs)
                     *pfMissingInputs = true;
                 return false;
             }
         }
 
-        // are the actual inputs available?
-        if (!view.HaveInputs(tx))
-            return state.Invalid(error("AcceptToMemoryPool : inputs already spent"),
-                                 REJECT_DUPLICATE, "bad-txns-inputs-spent");
-
         // Bring the best block into scope
         view.GetBestBlock();
 
@@ -925,9 +1445,13 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         view.SetBackend(dummy);
         }
 
-        // Check for non-standard pay-to-script-hash in inputs
-        if (Params().NetworkID() == CChainParams::MAIN && !AreInputsStandard(tx, view))
-            return error("AcceptToMemoryPool: : nonstandard transaction input");
+        // Check for non-standard pay-to-script-hash in inputs, counting their
+        // sigops for block templates and ConnectBlock
+        if (Params().NetworkID() == CChainParams::MAIN) {
+            if (!AreInputsStandard(tx, view, analysis))
+                return error("AcceptToMemoryPool: : nonstandard transaction input");
+        } else
+            analysis.nP2SHSigOps = GetP2SHSigOpCount(tx, view);
 
         // Note: if you modify this code to accept non-standard transactions, then
         // you should add code here to check that the transaction does a
@@ -938,7 +1462,8 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         int64_t nFees = nValueIn-nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime ? nAcceptTime : GetTime(), dPriority, chainActive.Height(),
+                              analysis.nSize, analysis.nLegacySigOps, analysis.nP2SHSigOps);
         unsigned int nSize = entry.GetTxSize();
 
         // Don't accept it if it can't get into a block
@@ -948,6 +1473,26 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                                       hash.ToString(), nFees, txMinFee),
                              REJECT_INSUFFICIENTFEE, "insufficient fee");
 
+        // A full pool only takes transactions paying more than what it evicted
+        size_t nMaxMempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+        double dMempoolMinFee = pool.GetMinFee(nMaxMempool);
+        if (fLimitFree && nFees < dMempoolMinFee * nSize / 1000)
+            return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %.0f",
+                                      hash.ToString(), nFees, dMempoolMinFee * nSize / 1000),
+                             REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
+        // Keep chains of unconfirmed transactions short, so adding to them,
+        // removing from them and selecting them for blocks stays cheap
+        string strPackageReason;
+        if (!pool.CheckPackageLimits(tx, nSize,
+                                     GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT),
+                                     GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000,
+                                     GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT),
+                                     GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000,
+                                     strPackageReason))
+            return state.DoS(0, error("AcceptToMemoryPool : %s, %s", strPackageReason, hash.ToString()),
+                             REJECT_NONSTANDARD, "too-long-mempool-chain");
+
         // Continuously rate-limit free transactions
         // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
         // be annoying or make others' transactions take longer to confirm.
@@ -979,15 +1524,25 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC))
+        unsigned int nScriptFlags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC;
+        if (!CheckInputsParallel(tx, state, view, nScriptFlags))
         {
             return error("AcceptToMemoryPool: : ConnectInputs failed %s", hash.ToString());
         }
+        // Remember the scripts are valid, so ConnectBlock need not check them again
+        entry.SetScriptFlags(nScriptFlags);
         // Store transaction in memory
         pool.addUnchecked(hash, entry);
+
+        // Keep the pool within its memory limit; the new transaction may be
+        // the one that has to go.
+        pool.TrimToSize(nMaxMempool);
+        if (!pool.exists(hash))
+            return state.DoS(0, error("AcceptToMemoryPool : mempool full, %s not kept", hash.ToString()),
+                             REJECT_INSUFFICIENTFEE, "mempool full");
     }
 
-    g_signals.SyncTransaction(hash, tx, NULL);
+    SyncWithWallets(hash, tx);
 
     return true;
 }
@@ -997,15 +1552,20 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
 {
     if (hashBlock == 0 || nIndex == -1)
         return 0;
-    AssertLockHeld(cs_main);
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
-    if (mi == mapBlockIndex.end())
-        return 0;
-    CBlockIndex* pindex = (*mi).second;
-    if (!pindex || !chainActive.Contains(pindex))
-        return 0;
+    CBlockIndex* pindex;
+    int nHeight;
+    {
+        LOCK(cs_chainview);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+        if (mi == mapBlockIndex.end())
+            return 0;
+        pindex = (*mi).second;
+        if (!pindex || !chainActive.Contains(pindex))
+            return 0;
+        nHeight = chainActive.Height();
+    }
 
     // Make sure the merkle branch connects to this block
     if (!fMerkleVerified)
@@ -1016,12 +1576,11 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
     }
 
     pindexRet = pindex;
-    return chainActive.Height() - pindex->nHeight + 1;
+    return nHeight - pindex->nHeight + 1;
 }
 
 int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const
 {
-    AssertLockHeld(cs_main);
     int nResult = GetDepthInMainChainINTERNAL(pindexRet);
     if (nResult == 0 && !mempool.exists(GetHash()))
         return -1; // Not in chain, not in mempool
@@ -1044,49 +1603,197 @@ bool CMerkleTx::AcceptToMemoryPool(bool fLimitFree)
 }
 
 
-// Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock
-bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow)
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+bool DumpMempool()
 {
-    CBlockIndex *pindexSlow = NULL;
+    int64_t nStart = GetTimeMillis();
+
+    // Parents before their children, so they can be accepted in file order
+    std::vector<std::pair<unsigned int, const CTxMemPoolEntry*> > vSorted;
+    std::vector<std::pair<CTransaction, int64_t> > vEntries;
     {
+        LOCK(mempool.cs);
+        vSorted.reserve(mempool.mapTx.size());
+        for (CTxMemPoolMap::const_iterator it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it)
+            vSorted.push_back(std::make_pair(it->second.GetCountWithAncestors(), &it->second));
+        std::sort(vSorted.begin(), vSorted.end());
+        vEntries.reserve(vSorted.size());
+        for (unsigned int i = 0; i < vSorted.size(); i++)
+            vEntries.push_back(std::make_pair(vSorted[i].second->GetTx(), vSorted[i].second->GetTime()));
+    }
+
+    boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("DumpMempool : Failed to open file %s", pathTmp.string());
+    try {
+        fileout << MEMPOOL_DUMP_VERSION;
+        fileout << vEntries;
+    } catch (std::exception &e) {
+        return error("DumpMempool : Serialize or I/O error - %s", e.what());
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+    if (!RenameOver(pathTmp, GetDataDir() / "mempool.dat"))
+        return error("DumpMempool : Rename-into-place failed");
+
+    LogPrintf("Dumped %u mempool transactions in %dms\n", (unsigned int)vEntries.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool LoadMempool()
+{
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    FILE *file = fopen(path.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein) {
+        LogPrintf("No mempool.dat to load\n");
+        return false;
+    }
+
+    std::vector<std::pair<CTransaction, int64_t> > vEntries;
+    try {
+        uint64_t nVersion;
+        filein >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("LoadMempool : Unknown mempool.dat version %u", nVersion);
+        filein >> vEntries;
+    } catch (std::exception &e) {
+        return error("LoadMempool : Deserialize or I/O error - %s", e.what());
+    }
+    filein.fclose();
+
+    // In batches, so the node keeps processing blocks and messages while the
+    // signatures of the next batch are checked by all script threads.
+    static const unsigned int nBatchSize = 100;
+    unsigned int nAccepted = 0, nFailed = 0;
+    for (unsigned int nFirst = 0; nFirst < vEntries.size() && !ShutdownRequested(); nFirst += nBatchSize) {
+        unsigned int nEnd = std::min((unsigned int)vEntries.size(), nFirst + nBatchSize);
+        std::vector<CTransaction> vtx;
+        for (unsigned int i = nFirst; i < nEnd; i++)
+            vtx.push_back(vEntries[i].first);
+
         LOCK(cs_main);
-        {
-            if (mempool.lookup(hash, txOut))
-            {
-                return true;
-            }
+        PrecheckTransactionScripts(vtx);
+        for (unsigned int i = nFirst; i < nEnd; i++) {
+            CValidationState state;
+            if (AcceptToMemoryPool(mempool, state, vEntries[i].first, false, NULL, false, vEntries[i].second))
+                nAccepted++;
+            else
+                nFailed++;
         }
+    }
 
-        if (fTxIndex) {
-            CDiskTxPos postx;
-            if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-                CBlockHeader header;
-                try {
-                    file >> header;
-                    fseek(file, postx.nTxOffset, SEEK_CUR);
-                    file >> txOut;
-                } catch (std::exception &e) {
-                    return error("%s : Deserialize or I/O error - %s", __func__, e.what());
-                }
-                hashBlock = header.GetHash();
-                if (txOut.GetHash() != hash)
-                    return error("%s : txid mismatch", __func__);
-                return true;
-            }
+    LogPrintf("Loaded %u mempool transactions (%u no longer valid) from mempool.dat in %dms\n",
+              nAccepted, nFailed, GetTimeMillis() - nStart);
+    return true;
+}
+
+
+static bool ReadBlockFromFile(const CDiskBlockPos& pos, CRawBlock& raw);
+
+bool ReadTxFromDisk(const CDiskTxPos &postx, CTransaction &tx, uint256 &hashBlock)
+{
+    CBlockHeader header;
+    CRawBlock raw;
+    if (!blockfilemapper.Read(postx, raw) && !ReadBlockFromFile(postx, raw))
+        return false;
+    // Only the header and the transaction are deserialized
+    try {
+        CRawBlockReader reader(raw, 0, SER_DISK, CLIENT_VERSION);
+        reader >> header;
+        CRawBlockReader readerTx(raw, 80 + postx.nTxOffset, SER_DISK, CLIENT_VERSION);
+        readerTx >> tx;
+    } catch (std::exception &e) {
+        return error("%s : Deserialize error - %s", __func__, e.what());
+    }
+    hashBlock = header.GetHash();
+    return true;
+}
+
+// Transaction index positions in block file order
+struct CTxPosCompare
+{
+    bool operator()(const std::pair<CDiskTxPos, unsigned int> &a, const std::pair<CDiskTxPos, unsigned int> &b) const
+    {
+        if (a.first.nFile != b.first.nFile)
+            return a.first.nFile < b.first.nFile;
+        if (a.first.nPos != b.first.nPos)
+            return a.first.nPos < b.first.nPos;
+        return a.first.nTxOffset < b.first.nTxOffset;
+    }
+};
+
+void GetTransactions(const std::vector<uint256> &vHash, std::vector<CTransaction> &vTx, std::vector<uint256> &vHashBlock, std::vector<bool> &vFound)
+{
+    vTx.assign(vHash.size(), CTransaction());
+    vHashBlock.assign(vHash.size(), uint256(0));
+    vFound.assign(vHash.size(), false);
+
+    // Those of the memory pool and the cache first, then those of the
+    // transaction index, sorted so that the block files are read in order
+    std::vector<std::pair<CDiskTxPos, unsigned int> > vPos;
+    for (unsigned int i = 0; i < vHash.size(); i++) {
+        if (mempool.lookup(vHash[i], vTx[i]) || txcache.Get(vHash[i], vTx[i], vHashBlock[i])) {
+            vFound[i] = true;
+            continue;
         }
+        CDiskTxPos postx;
+        if (fTxIndex && pblocktree->ReadTxIndex(vHash[i], postx))
+            vPos.push_back(std::make_pair(postx, i));
+    }
+    std::sort(vPos.begin(), vPos.end(), CTxPosCompare());
+    for (unsigned int j = 0; j < vPos.size(); j++) {
+        unsigned int i = vPos[j].second;
+        if (ReadTxFromDisk(vPos[j].first, vTx[i], vHashBlock[i]) && vTx[i].GetHash() == vHash[i]) {
+            txcache.Add(vHash[i], vTx[i], vHashBlock[i]);
+            vFound[i] = true;
+        }
+    }
 
-        if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
-            int nHeight = -1;
-            {
-                CCoinsViewCache &view = *pcoinsTip;
-                CCoins coins;
-                if (view.GetCoins(hash, coins))
-                    nHeight = coins.nHeight;
-            }
-            if (nHeight > 0)
-                pindexSlow = chainActive[nHeight];
+    // The others through the coin database
+    for (unsigned int i = 0; i < vHash.size(); i++)
+        if (!vFound[i])
+            vFound[i] = GetTransaction(vHash[i], vTx[i], vHashBlock[i], true);
+}
+
+// Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock
+bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow)
+{
+    // The mempool and the transaction index have locks of their own, and
+    // block files are only appended to; only the coins need cs_main
+    if (mempool.lookup(hash, txOut))
+        return true;
+
+    if (txcache.Get(hash, txOut, hashBlock))
+        return true;
+
+    CBlockIndex *pindexSlow = NULL;
+    if (fTxIndex) {
+        CDiskTxPos postx;
+        if (pblocktree->ReadTxIndex(hash, postx)) {
+            if (!ReadTxFromDisk(postx, txOut, hashBlock))
+                return false;
+            if (txOut.GetHash() != hash)
+                return error("%s : txid mismatch", __func__);
+            txcache.Add(hash, txOut, hashBlock);
+            return true;
+        }
+    }
+
+    if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
+        LOCK(cs_main);
+        int nHeight = -1;
+        {
+            const CCoin &coin = AccessByTxid(*pcoinsTip, hash);
+            if (!coin.IsSpent())
+                nHeight = coin.nHeight;
         }
+        if (nHeight > 0)
+            pindexSlow = chainActive[nHeight];
     }
 
     if (pindexSlow) {
@@ -1096,6 +1803,7 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
                 if (tx.GetHash() == hash) {
                     txOut = tx;
                     hashBlock = pindexSlow->GetBlockHash();
+                    txcache.Add(hash, txOut, hashBlock);
                     return true;
                 }
             }
@@ -1115,23 +1823,16 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
 // CBlock and CBlockIndex
 //
 
-bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos)
+bool WriteBlockToDisk(const CDiskRecord& record, CDiskBlockPos& pos)
 {
     // Open history file to append
     CAutoFile fileout = CAutoFile(OpenBlockFile(pos), SER_DISK, CLIENT_VERSION);
     if (!fileout)
         return error("WriteBlockToDisk : OpenBlockFile failed");
 
-    // Write index header
-    unsigned int nSize = fileout.GetSerializeSize(block);
-    fileout << FLATDATA(Params().MessageStart()) << nSize;
-
-    // Write block
-    long fileOutPos = ftell(fileout);
-    if (fileOutPos < 0)
-        return error("WriteBlockToDisk : ftell failed");
-    pos.nPos = (unsigned int)fileOutPos;
-    fileout << block;
+    // Write index header and block
+    if (!WriteDiskRecord(fileout, record, pos.nPos))
+        return error("WriteBlockToDisk : failed to write block");
 
     // Flush stdio buffers and commit to disk before returning
     fflush(fileout);
@@ -1141,39 +1842,124 @@ bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos)
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
+// Read the serialized block at pos from its block file, when the file is
+// not mapped, decompressing it if it is stored compressed
+static bool ReadBlockFromFile(const CDiskBlockPos& pos, CRawBlock& raw)
 {
-    block.SetNull();
-
-    // Open history file to read
-    CAutoFile filein = CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+    // Open history file to read, at the index header
+    if (pos.nPos < 8)
+        return error("%s : invalid position %d:%u", __func__, pos.nFile, pos.nPos);
+    CAutoFile filein = CAutoFile(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - 8), true), SER_DISK, CLIENT_VERSION);
     if (!filein)
-        return error("ReadBlockFromDisk : OpenBlockFile failed");
-
-    // Read block
-    try {
-        filein >> block;
-    }
-    catch (std::exception &e) {
-        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
-    }
-
-    // Check the header
-    if (!CheckProofOfWork(block.GetPoWHash(block.GetAlgo()), block.nBits, block.GetAlgo()))
-        return error("ReadBlockFromDisk : Errors in block header");
+        return error("%s : OpenBlockFile failed", __func__);
 
+    boost::shared_ptr<std::vector<char> > pvch(new std::vector<char>());
+    if (!ReadDiskRecord(filein, MAX_BLOCK_SIZE, *pvch) || pvch->size() < 80)
+        return error("%s : no block at %d:%u", __func__, pos.nFile, pos.nPos);
+    raw = CRawBlock(pvch, &(*pvch)[0], pvch->size());
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
+// The bytes the block record at pos takes in its file, index header included
+static bool GetBlockRecordSize(const CDiskBlockPos& pos, unsigned int& nDiskSize)
 {
-    if (!ReadBlockFromDisk(block, pindex->GetBlockPos()))
+    if (pos.nPos < 8)
         return false;
-    if (block.GetHash() != pindex->GetBlockHash())
-        return error("ReadBlockFromDisk(CBlock&, CBlockIndex*) : GetHash() doesn't match index");
-    return true;
-}
-
+    CAutoFile filein = CAutoFile(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - 8), true), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return false;
+    unsigned char buf[MESSAGE_START_SIZE];
+    unsigned int nSize;
+    try {
+        filein >> FLATDATA(buf) >> nSize;
+    } catch (std::exception &e) {
+        return false;
+    }
+    if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+        return false;
+    nDiskSize = 8 + (nSize & ~DISK_RECORD_COMPRESSED);
+    return true;
+}
+
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, bool fCheckPOW)
+{
+    block.SetNull();
+
+    // Read block from the mapped file, or else from the file itself
+    CRawBlock raw;
+    if (!blockfilemapper.Read(pos, raw) && !ReadBlockFromFile(pos, raw))
+        return false;
+    try {
+        CSpanReader ssBlock(raw.begin(), raw.end(), SER_DISK, CLIENT_VERSION);
+        ssBlock >> block;
+    }
+    catch (std::exception &e) {
+        return error("%s : Deserialize error - %s", __func__, e.what());
+    }
+
+    // Check the header
+    if (fCheckPOW && !CheckProofOfWork(block.GetPoWHash(block.GetAlgo()), block.nBits, block.GetAlgo()))
+        return error("ReadBlockFromDisk : Errors in block header");
+
+    return true;
+}
+
+bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
+{
+    if (blockcache.Get(pindex->GetBlockHash(), block))
+        return true;
+    // A block matching the hash of an index entry whose proof of work was
+    // checked has the same header, so its proof of work holds as well
+    if (!ReadBlockFromDisk(block, pindex->GetBlockPos(), !(pindex->nStatus & BLOCK_POW_CHECKED)))
+        return false;
+    if (block.GetHash() != pindex->GetBlockHash())
+        return error("ReadBlockFromDisk(CBlock&, CBlockIndex*) : GetHash() doesn't match index");
+    return true;
+}
+
+bool GetBlockTxids(vector<uint256>& vTxid, const CBlockIndex* pindex)
+{
+    uint256 hash = pindex->GetBlockHash();
+    if (txidcache.Get(hash, vTxid))
+        return true;
+    if (!blockcache.GetTxids(hash, vTxid)) {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex))
+            return false;
+        vTxid.clear();
+        vTxid.reserve(block.vtx.size());
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            vTxid.push_back(tx.GetHash());
+    }
+    // Recently connected blocks may leave the block cache before the
+    // proofs of their transactions stop being asked for
+    txidcache.Add(hash, vTxid);
+    return true;
+}
+
+bool ReadRawBlockFromDisk(CRawBlock& raw, const CBlockIndex* pindex)
+{
+    if (blockcache.GetRaw(pindex->GetBlockHash(), raw))
+        return true;
+    if (!blockfilemapper.Read(pindex->GetBlockPos(), raw))
+        return false;
+
+    // Only the header is deserialized, to check it is the expected block
+    CBlockHeader header;
+    try {
+        CSpanReader ssHeader(raw.begin(), raw.begin() + std::min(80U, raw.size()), SER_DISK, CLIENT_VERSION);
+        ssHeader >> header;
+    }
+    catch (std::exception &e) {
+        return error("%s : Deserialize error - %s", __func__, e.what());
+    }
+    if (!(pindex->nStatus & BLOCK_POW_CHECKED) && !CheckProofOfWork(header.GetPoWHash(header.GetAlgo()), header.nBits, header.GetAlgo()))
+        return error("ReadRawBlockFromDisk : Errors in block header");
+    if (header.GetHash() != pindex->GetBlockHash())
+        return error("ReadRawBlockFromDisk : GetHash() doesn't match index");
+    return true;
+}
+
 uint256 static GetOrphanRoot(const uint256& hash)
 {
     map<uint256, COrphanBlock*>::iterator it = mapOrphanBlocks.find(hash);
@@ -1189,6 +1975,80 @@ uint256 static GetOrphanRoot(const uint256& hash)
     } while(true);
 }
 
+// Orphan blocks beyond -maxorphanblocksize wait in blocks/orphans, one file
+// each. They are written apart from the block files, whose sizes and order
+// -reindex relies on, and rewritten there if they ever connect.
+boost::filesystem::path static GetOrphanBlockPath(const uint256& hash)
+{
+    static bool fCleared = false;
+    boost::filesystem::path pathOrphans = GetDataDir() / "blocks" / "orphans";
+    if (!fCleared) {
+        // Left over from a previous run
+        boost::system::error_code ec;
+        boost::filesystem::remove_all(pathOrphans, ec);
+        boost::filesystem::create_directories(pathOrphans, ec);
+        fCleared = true;
+    }
+    return pathOrphans / (hash.ToString() + ".dat");
+}
+
+bool static StoreOrphanBlock(COrphanBlock* porphan, const CBlock& block)
+{
+    porphan->nSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+    uint64_t nMaxMemory = std::max((int64_t)0, GetArg("-maxorphanblocksize", DEFAULT_MAX_ORPHAN_BLOCKS_SIZE)) * 1000000;
+    if (nOrphanBlocksMemory + porphan->nSize <= nMaxMemory) {
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << block;
+        porphan->vchBlock = std::vector<unsigned char>(ss.begin(), ss.end());
+        nOrphanBlocksMemory += porphan->nSize;
+        return true;
+    }
+    boost::filesystem::path path = GetOrphanBlockPath(porphan->hashBlock);
+    CAutoFile fileout = CAutoFile(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("StoreOrphanBlock : cannot open %s", path.string());
+    try {
+        fileout << block;
+    }
+    catch (std::exception &e) {
+        return error("StoreOrphanBlock : I/O error - %s", e.what());
+    }
+    return true;
+}
+
+bool static ReadOrphanBlock(const COrphanBlock* porphan, CBlock& block)
+{
+    try {
+        if (!porphan->vchBlock.empty()) {
+            CDataStream ss(porphan->vchBlock, SER_DISK, CLIENT_VERSION);
+            ss >> block;
+        } else {
+            boost::filesystem::path path = GetOrphanBlockPath(porphan->hashBlock);
+            CAutoFile filein = CAutoFile(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+            if (!filein)
+                return error("ReadOrphanBlock : cannot open %s", path.string());
+            filein >> block;
+        }
+    }
+    catch (std::exception &e) {
+        return error("ReadOrphanBlock : Deserialize or I/O error - %s", e.what());
+    }
+    return true;
+}
+
+// Forget an orphan block; its entry in mapOrphanBlocksByPrev is the caller's
+void static EraseOrphanBlock(COrphanBlock* porphan)
+{
+    if (!porphan->vchBlock.empty()) {
+        nOrphanBlocksMemory -= porphan->nSize;
+    } else {
+        boost::system::error_code ec;
+        boost::filesystem::remove(GetOrphanBlockPath(porphan->hashBlock), ec);
+    }
+    mapOrphanBlocks.erase(porphan->hashBlock);
+    delete porphan;
+}
+
 // Remove a random orphan block (which does not have any dependent orphans).
 void static PruneOrphanBlocks()
 {
@@ -1208,29 +2068,117 @@ void static PruneOrphanBlocks()
         it = it2;
     } while(1);
 
-    uint256 hash = it->second->hashBlock;
-    delete it->second;
+    EraseOrphanBlock(it->second);
     mapOrphanBlocksByPrev.erase(it);
-    mapOrphanBlocks.erase(hash);
 }
 
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, int algo)
 {
-    while (pindex && pindex->pprev && (pindex->GetAlgo() != algo))
+    const CBlockIndex* pindexAlgo = GetLastBlockIndexForAlgo(pindex, algo);
+    if (pindexAlgo || !pindex)
+        return pindexAlgo;
+
+    // No block of this algo: fall back to the genesis block
+    if (chainActive.Genesis())
+        return chainActive.Genesis();
+    while (pindex->pprev)
         pindex = pindex->pprev;
     return pindex;
 }
 
 const CBlockIndex* GetLastBlockIndexForAlgo(const CBlockIndex* pindex, int algo)
 {
-    for (;;)
+    if (!pindex)
+        return NULL;
+    if (pindex->GetAlgo() == algo)
+        return pindex;
+    return pindex->GetPrevAlgo(algo);
+}
+
+double GetDifficultyFromBits(unsigned int nBits)
+{
+    int nShift = (nBits >> 24) & 0xff;
+
+    double dDiff =
+        (double)0x0000ffff / (double)(nBits & 0x00ffffff);
+
+    while (nShift < 29)
     {
-        if (!pindex)
-            return NULL;
-        if (pindex->GetAlgo() == algo)
-            return pindex;
-        pindex = pindex->pprev;
+        dDiff *= 256.0;
+        nShift++;
+    }
+    while (nShift > 29)
+    {
+        dDiff /= 256.0;
+        nShift--;
     }
+
+    return dDiff;
+}
+
+uint64_t EstimateAlgoHashRate(const CBlockIndex* pindex, int algo, int nLookup)
+{
+    const CBlockIndex *pb = pindex;
+    if (pb && pb->GetAlgo() != algo)
+        pb = GetLastBlockIndex(pb, algo); // Get last block of the algo
+
+    if (pb == NULL || !pb->nHeight)
+        return 0;
+
+    const CBlockIndex *pb0 = pb;
+    double mul = std::pow((double)2,(double)32); //crispy diff multiplier
+    uint64_t averageHash = 0;
+    for (int i = 0; i < nLookup; i++) {
+        const CBlockIndex *pb1 = pb0;
+        pb0 = GetLastBlockIndex(pb0->pprev, algo);
+        if (pb0 == NULL)
+            break;
+        double diff = (GetDifficultyFromBits(pb0->nBits) + GetDifficultyFromBits(pb1->nBits)) / 2; // calculate diff average of this and previous block
+        averageHash = ((diff * mul / 40) + averageHash) / 2;  //calculate hashrate average
+    }
+    return averageHash;
+}
+
+// Guarded by cs_main
+static CAlgoStats algoStats[NUM_ALGOS];
+static const CBlockIndex* pindexAlgoStats = NULL;
+
+void static UpdateAlgoStats()
+{
+    AssertLockHeld(cs_main);
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    for (int algo = 0; algo < NUM_ALGOS; algo++)
+    {
+        CAlgoStats stats;
+        stats.pindexLast = GetLastBlockIndexForAlgo(pindexTip, algo);
+        const CBlockIndex* pindexFirst = stats.pindexLast;
+        double dTotal = 0;
+        for (const CBlockIndex* pindex = stats.pindexLast; pindex && stats.nBlocks < ALGO_STATS_WINDOW; pindex = pindex->GetPrevAlgo(algo))
+        {
+            dTotal += GetDifficultyFromBits(pindex->nBits);
+            stats.nBlocks++;
+            pindexFirst = pindex;
+        }
+        if (stats.pindexLast)
+        {
+            stats.dDifficulty = GetDifficultyFromBits(stats.pindexLast->nBits);
+            stats.dAvgDifficulty = dTotal / stats.nBlocks;
+            if (stats.nBlocks > 1)
+                stats.nAvgSpacing = (stats.pindexLast->GetBlockTime() - pindexFirst->GetBlockTime()) / (stats.nBlocks - 1);
+        }
+        stats.nHashesPerSec = EstimateAlgoHashRate(pindexTip, algo, ALGO_STATS_WINDOW);
+        algoStats[algo] = stats;
+    }
+    pindexAlgoStats = pindexTip;
+}
+
+CAlgoStats GetAlgoStats(int algo)
+{
+    LOCK(cs_main);
+    // The tip is also set without UpdateTip while loading the block index
+    if (pindexAlgoStats != chainActive.Tip())
+        UpdateAlgoStats();
+    return algoStats[algo];
 }
 
 
@@ -1315,18 +2263,19 @@ static const int64_t nMaxActualTimespan = nAveragingTargetTimespan * (100 + nMax
 //
 unsigned int ComputeMinWork(unsigned int nBase, int64_t nTime)
 {
-    CBigNum bnProofOfWorkLimit = Params().ProofOfWorkLimit(ALGO_SCRYPT);
+    const uint256& bnProofOfWorkLimit = Params().PowLimit(ALGO_SCRYPT);
     // Testnet has min-difficulty blocks
     // after nTargetSpacing*2 time between blocks:
     if (TestNet() && nTime > nTargetSpacing*2)
         return bnProofOfWorkLimit.GetCompact();
 
-    CBigNum bnResult;
+    uint256 bnResult;
     bnResult.SetCompact(nBase);
     while (nTime > 0 && bnResult < bnProofOfWorkLimit)
     {
         // Maximum 400% adjustment...
-        bnResult *= 4;
+        // (cannot overflow, the limit is far below 2^254)
+        bnResult <<= 2;
         // ... in best-case exactly 4-times-normal target time
         nTime -= nTargetTimespan*4;
     }
@@ -1350,7 +2299,7 @@ unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHead
    }
    else if (!TestNet() && nHeight >= V3_FORK)
    {
-        LogPrintf("Switch to DigiShield");
+        LogPrint("retarget", "Switch to DigiShield\n");
         return GetNextWorkRequiredV2(pindexLast, pblock, algo);
    }
 
@@ -1411,25 +2360,27 @@ unsigned int GetNextWorkRequiredV1(const CBlockIndex* pindexLast, const CBlockHe
         nActualTimespan = nActualTimespanMax;
 
     // Retarget
-    CBigNum bnNew;
+    // (the target is at most the limit of 2^236 and the timespan below 2^17,
+    // so the product fits)
+    uint256 bnNew;
     bnNew.SetCompact(pindexLast->nBits);
-    bnNew *= nActualTimespan;
-    bnNew /= nTargetTimespanCurrent;
+    bnNew *= (uint32_t)nActualTimespan;
+    bnNew /= (uint32_t)nTargetTimespanCurrent;
 
-    if (bnNew > Params().ProofOfWorkLimit(algo))
-        bnNew = Params().ProofOfWorkLimit(algo);
+    if (bnNew > Params().PowLimit(algo))
+        bnNew = Params().PowLimit(algo);
 
     /// debug print
     LogPrintf("GetNextWorkRequired V1 RETARGET\n");
-    LogPrintf("Before: %08x %s\n", pindexLast->nBits, CBigNum().SetCompact(pindexLast->nBits).getuint256().ToString().c_str());
-    LogPrintf("After: %08x %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString().c_str());
+    LogPrintf("Before: %08x %s\n", pindexLast->nBits, uint256().SetCompact(pindexLast->nBits).ToString().c_str());
+    LogPrintf("After: %08x %s\n", bnNew.GetCompact(), bnNew.ToString().c_str());
     return bnNew.GetCompact();
 }
 
 unsigned int GetNextWorkRequiredV2(const CBlockIndex* pindexLast, const CBlockHeader *pblock, int algo)
 {
-    unsigned int nProofOfWorkLimit = Params().ProofOfWorkLimit(algo).GetCompact();
-    LogPrintf("Proof Of Work Limit For Algo %i, is % i", algo, nProofOfWorkLimit);
+    const uint256& powLimit = Params().PowLimit(algo);
+    unsigned int nProofOfWorkLimit = powLimit.GetCompact();
 
     // Genesis block
     if (pindexLast == NULL)
@@ -1437,11 +2388,7 @@ unsigned int GetNextWorkRequiredV2(const CBlockIndex* pindexLast, const CBlockHe
 
     // find first block in averaging interval
     // Go back by what we want to be nAveragingInterval blocks per algo
-    const CBlockIndex* pindexFirst = pindexLast;
-    for (int i = 0; pindexFirst && i < NUM_ALGOS * nAveragingInterval; i++)
-    {
-        pindexFirst = pindexFirst->pprev;
-    }
+    const CBlockIndex* pindexFirst = pindexLast->GetAncestor(pindexLast->nHeight - NUM_ALGOS * nAveragingInterval);
     const CBlockIndex* pindexPrevAlgo = GetLastBlockIndexForAlgo(pindexLast, algo);
     if (pindexPrevAlgo == NULL || pindexFirst == NULL)
         return nProofOfWorkLimit; // not enough blocks available
@@ -1450,17 +2397,18 @@ unsigned int GetNextWorkRequiredV2(const CBlockIndex* pindexLast, const CBlockHe
     // Use medians to prevent time-warp attacks
     int64_t nActualTimespan = pindexLast->GetMedianTimePast() - pindexFirst->GetMedianTimePast();
     nActualTimespan = nAveragingTargetTimespan + (nActualTimespan - nAveragingTargetTimespan)/6;
-    LogPrintf("  nActualTimespan = %d before bounds\n", nActualTimespan);
+    LogPrint("retarget", "  nActualTimespan = %d before bounds\n", nActualTimespan);
     if (nActualTimespan < nMinActualTimespan)
         nActualTimespan = nMinActualTimespan;
     if (nActualTimespan > nMaxActualTimespan)
         nActualTimespan = nMaxActualTimespan;
 
     // Global retarget
-    CBigNum bnNew;
+    // The previous target is at most powLimit (2^236), so this cannot overflow
+    uint256 bnNew;
     bnNew.SetCompact(pindexPrevAlgo->nBits);
-    bnNew *= nActualTimespan;
-    bnNew /= nAveragingTargetTimespan;
+    bnNew *= (uint32_t)nActualTimespan;
+    bnNew /= (uint32_t)nAveragingTargetTimespan;
 
     // Per-algo retarget
     int nAdjustments = pindexPrevAlgo->nHeight - pindexLast->nHeight + NUM_ALGOS - 1;
@@ -1468,42 +2416,49 @@ unsigned int GetNextWorkRequiredV2(const CBlockIndex* pindexLast, const CBlockHe
     {
         for (int i = 0; i < nAdjustments; i++)
         {
-            bnNew /= 100 + nLocalDifficultyAdjustment;
+            bnNew /= (uint32_t)(100 + nLocalDifficultyAdjustment);
             bnNew *= 100;
         }
     }
     if (nAdjustments < 0)
     {
-        for (int i = 0; i < -nAdjustments; i++)
+        // Each step only raises the target, so once it passes powLimit the
+        // result is powLimit; stopping there also keeps it inside 256 bits
+        for (int i = 0; i < -nAdjustments && bnNew <= powLimit; i++)
         {
-            bnNew *= 100 + nLocalDifficultyAdjustment;
+            bnNew *= (uint32_t)(100 + nLocalDifficultyAdjustment);
             bnNew /= 100;
         }
     }
 
-    if (bnNew > Params().ProofOfWorkLimit(algo))
-        bnNew = Params().ProofOfWorkLimit(algo);
+    if (bnNew > powLimit)
+        bnNew = powLimit;
 
     /// debug print
-    LogPrintf("GetNextWorkRequired RETARGET\n");
-    LogPrintf("nTargetTimespan = %d    nActualTimespan = %d\n", nTargetTimespan, nActualTimespan);
-    LogPrintf("Before: %08x  %s\n", pindexLast->nBits, CBigNum().SetCompact(pindexLast->nBits).getuint256().ToString());
-    LogPrintf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString());
+    if (LogAcceptCategory("retarget"))
+    {
+        LogPrintf("GetNextWorkRequired RETARGET\n");
+        LogPrintf("nTargetTimespan = %d    nActualTimespan = %d\n", nTargetTimespan, nActualTimespan);
+        LogPrintf("Before: %08x  %s\n", pindexLast->nBits, uint256().SetCompact(pindexLast->nBits).ToString());
+        LogPrintf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.ToString());
+    }
 
     return bnNew.GetCompact();
 }
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits, int algo)
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    bool fNegative;
+    bool fOverflow;
+    uint256 bnTarget;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
     // Check range
-    if (bnTarget <= 0 || bnTarget > Params().ProofOfWorkLimit(algo))
+    if (fNegative || bnTarget == 0 || fOverflow || bnTarget > Params().PowLimit(algo))
         return error("CheckProofOfWork(algo=%d) : nBits below minimum work", algo);
 
     // Check proof of work matches claimed amount
-    if (hash > bnTarget.getuint256())
+    if (hash > bnTarget)
         return error("CheckProofOfWork(algo=%d) : hash doesn't match nBits", algo);
 
     return true;
@@ -1517,7 +2472,7 @@ int GetNumBlocksOfPeers()
 
 bool IsInitialBlockDownload()
 {
-    LOCK(cs_main);
+    LOCK(cs_chainview);
     if (fImporting || fReindex || chainActive.Height() < Checkpoints::GetTotalBlocksEstimate())
         return true;
     static int64_t nLastUpdate;
@@ -1547,7 +2502,7 @@ void CheckForkWarningConditions()
     // of our head, drop it
     if (pindexBestForkTip && chainActive.Height() - pindexBestForkTip->nHeight >= 72)
         pindexBestForkTip = NULL;
-    if (pindexBestForkTip || (pindexBestInvalid && pindexBestInvalid->nChainWork > chainActive.Tip()->nChainWork + (chainActive.Tip()->GetBlockWorkAdjusted() * 6).getuint256() && (chainActive.Height() > pindexBestInvalid->nHeight + 3 || pindexBestInvalid->nHeight > chainActive.Height() + 3)))
+    if (pindexBestForkTip || (pindexBestInvalid && pindexBestInvalid->nChainWork > chainActive.Tip()->nChainWork + chainActive.Tip()->GetBlockWorkAdjusted() * 6 && (chainActive.Height() > pindexBestInvalid->nHeight + 3 || pindexBestInvalid->nHeight > chainActive.Height() + 3)))
     {
         if (!fLargeWorkForkFound)
         {
@@ -1584,16 +2539,7 @@ void CheckForkWarningConditionsOnNewFork(CBlockIndex* pindexNewForkTip)
 {
     AssertLockHeld(cs_main);
     // If we are on a fork that is sufficiently large, set a warning flag
-    CBlockIndex* pfork = pindexNewForkTip;
-    CBlockIndex* plonger = chainActive.Tip();
-    while (pfork && pfork != plonger)
-    {
-        while (plonger && plonger->nHeight > pfork->nHeight)
-            plonger = plonger->pprev;
-        if (pfork == plonger)
-            break;
-        pfork = pfork->pprev;
-    }
+    CBlockIndex* pfork = chainActive.FindFork(pindexNewForkTip);
 
     // We define a condition which we should warn the user about as a fork of at least 7 blocks
     // who's tip is within 72 blocks (+/- 12 hours if no one mines it) of ours
@@ -1603,7 +2549,7 @@ void CheckForkWarningConditionsOnNewFork(CBlockIndex* pindexNewForkTip)
     // We define it this way because it allows us to only store the highest fork tip (+ base) which meets
     // the 7-block condition and from this always have the most-likely-to-cause-warning fork
     if (pfork && (!pindexBestForkTip || (pindexBestForkTip && pindexNewForkTip->nHeight > pindexBestForkTip->nHeight)) &&
-            pindexNewForkTip->nChainWork - pfork->nChainWork > (pfork->GetBlockWorkAdjusted() * 20).getuint256() &&
+            pindexNewForkTip->nChainWork - pfork->nChainWork > pfork->GetBlockWorkAdjusted() * 20 &&
             chainActive.Height() - pindexNewForkTip->nHeight < 72)
     {
         pindexBestForkTip = pindexNewForkTip;
@@ -1619,6 +2565,8 @@ void Misbehaving(NodeId pnode, int howmuch)
     if (howmuch == 0)
         return;
 
+    // Called from the message handler threads outside of cs_main too
+    LOCK(cs_main);
     CNodeState *state = State(pnode);
     if (state == NULL)
         return;
@@ -1693,33 +2641,33 @@ void UpdateTime(CBlockHeader& block, const CBlockIndex* pindexPrev)
 
 void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCache &inputs, CTxUndo &txundo, int nHeight, const uint256 &txhash)
 {
-    bool ret;
     // mark inputs spent
     if (!tx.IsCoinBase()) {
+        txundo.vprevout.reserve(tx.vin.size());
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            CCoins &coins = inputs.GetCoins(txin.prevout.hash);
-            CTxInUndo undo;
-            ret = coins.Spend(txin.prevout, undo);
+            CCoin coin;
+            bool ret = inputs.SpendCoin(txin.prevout, &coin);
             assert(ret);
-            txundo.vprevout.push_back(undo);
+            // Every undo record carries the height, so disconnecting does
+            // not depend on the other outputs of the transaction.
+            txundo.vprevout.push_back(CTxInUndo(coin.out, coin.fCoinBase, coin.nHeight));
         }
     }
 
     // add outputs
-    ret = inputs.SetCoins(txhash, CCoins(tx, nHeight));
-    assert(ret);
+    AddCoins(inputs, tx, nHeight);
 }
 
 bool CScriptCheck::operator()() const {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, psighashcache.get()))
         return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString());
     return true;
 }
 
-bool VerifySignature(const CCoins& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool VerifySignature(const CCoin& coinFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
 {
-    return CScriptCheck(txFrom, txTo, nIn, flags, nHashType)();
+    return CScriptCheck(coinFrom, txTo, nIn, flags, nHashType)();
 }
 
 bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, std::vector<CScriptCheck> *pvChecks)
@@ -1743,19 +2691,20 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCach
         for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
             const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins &coins = inputs.GetCoins(prevout.hash);
+            const CCoin &coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
             // If prev is coinbase, check that it's matured
-            if (coins.IsCoinBase()) {
-                if (nSpendHeight - coins.nHeight < COINBASE_MATURITY)
+            if (coin.IsCoinBase()) {
+                if (nSpendHeight - (int)coin.nHeight < COINBASE_MATURITY)
                     return state.Invalid(
-                        error("CheckInputs() : tried to spend coinbase at depth %d", nSpendHeight - coins.nHeight),
+                        error("CheckInputs() : tried to spend coinbase at depth %d", nSpendHeight - (int)coin.nHeight),
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase");
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins.vout[prevout.n].nValue;
-            if (!MoneyRange(coins.vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, error("CheckInputs() : txin values out of range"),
                                  REJECT_INVALID, "bad-txns-inputvalues-outofrange");
 
@@ -1783,12 +2732,18 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCach
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
+            // Serialize the parts of the signature hash shared by the inputs once
+            boost::shared_ptr<const CSignatureHashCache> psighashcache;
+            if (tx.vin.size() > 1)
+                psighashcache.reset(new CSignatureHashCache(tx));
+
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
-                const CCoins &coins = inputs.GetCoins(prevout.hash);
+                const CCoin &coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(coins, tx, i, flags, 0);
+                CScriptCheck check(coin, tx, i, flags, 0, psighashcache);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1796,7 +2751,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCach
                     if (flags & SCRIPT_VERIFY_STRICTENC) {
                         // For now, check whether the failure was caused by non-canonical
                         // encodings or not; if so, don't trigger DoS protection.
-                        CScriptCheck check(coins, tx, i, flags & (~SCRIPT_VERIFY_STRICTENC), 0);
+                        CScriptCheck check(coin, tx, i, flags & (~SCRIPT_VERIFY_STRICTENC), 0, psighashcache);
                         if (check())
                             return state.Invalid(false, REJECT_NONSTANDARD, "non-canonical");
                     }
@@ -1811,7 +2766,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCach
 
 
 
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean, bool fUpdateIndexes)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
 
@@ -1836,54 +2791,41 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
         uint256 hash = tx.GetHash();
 
         // Check that all outputs are available and match the outputs in the block itself
-        // exactly. Note that transactions with only provably unspendable outputs won't
-        // have outputs available even in the block itself, so we handle that case
-        // specially with outsEmpty.
-        CCoins outsEmpty;
-        CCoins &outs = view.HaveCoins(hash) ? view.GetCoins(hash) : outsEmpty;
-        outs.ClearUnspendable();
-
-        CCoins outsBlock = CCoins(tx, pindex->nHeight);
-        // The CCoins serialization does not serialize negative numbers.
-        // No network rules currently depend on the version here, so an inconsistency is harmless
-        // but it must be corrected before txout nversion ever influences a network rule.
-        if (outsBlock.nVersion < 0)
-            outs.nVersion = outsBlock.nVersion;
-        if (outs != outsBlock)
-            fClean = fClean && error("DisconnectBlock() : added transaction mismatch? database corrupted");
-
-        // remove outputs
-        outs = CCoins();
+        // exactly. Provably unspendable outputs never made it into the UTXO set.
+        bool fCoinBase = tx.IsCoinBase();
+        for (unsigned int o = 0; o < tx.vout.size(); o++) {
+            if (tx.vout[o].scriptPubKey.IsUnspendable())
+                continue;
+            CCoin coin;
+            bool fSpent = view.SpendCoin(COutPoint(hash, o), &coin);
+            if (!fSpent || tx.vout[o] != coin.out || (unsigned int)pindex->nHeight != coin.nHeight || fCoinBase != coin.fCoinBase)
+                fClean = fClean && error("DisconnectBlock() : added transaction mismatch? database corrupted");
+        }
 
         // restore inputs
         if (i > 0) { // not coinbases
-            const CTxUndo &txundo = blockUndo.vtxundo[i-1];
+            CTxUndo &txundo = blockUndo.vtxundo[i-1];
             if (txundo.vprevout.size() != tx.vin.size())
                 return error("DisconnectBlock() : transaction and undo data inconsistent");
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint &out = tx.vin[j].prevout;
-                const CTxInUndo &undo = txundo.vprevout[j];
-                CCoins coins;
-                view.GetCoins(out.hash, coins); // this can fail if the prevout was already entirely spent
-                if (undo.nHeight != 0) {
-                    // undo data contains height: this is the last output of the prevout tx being spent
-                    if (!coins.IsPruned())
-                        fClean = fClean && error("DisconnectBlock() : undo data overwriting existing transaction");
-                    coins = CCoins();
-                    coins.fCoinBase = undo.fCoinBase;
-                    coins.nHeight = undo.nHeight;
-                    coins.nVersion = undo.nVersion;
-                } else {
-                    if (coins.IsPruned())
-                        fClean = fClean && error("DisconnectBlock() : undo data adding output to missing transaction");
+                CTxInUndo &undo = txundo.vprevout[j];
+                CCoin coin(undo.txout, undo.nHeight, undo.fCoinBase);
+                if (coin.nHeight == 0) {
+                    // Undo data written by older versions only carries the
+                    // metadata for the last spent output of a transaction, so
+                    // another output of it must still be unspent.
+                    const CCoin &alternate = AccessByTxid(view, out.hash);
+                    if (alternate.IsSpent())
+                        return error("DisconnectBlock() : undo data adding output to missing transaction");
+                    coin.nHeight = alternate.nHeight;
+                    coin.fCoinBase = alternate.fCoinBase;
+                    undo.nHeight = coin.nHeight;
                 }
-                if (coins.IsAvailable(out.n))
+                bool fOverwrite = view.HaveCoin(out);
+                if (fOverwrite)
                     fClean = fClean && error("DisconnectBlock() : undo data overwriting existing output");
-                if (coins.vout.size() < out.n+1)
-                    coins.vout.resize(out.n+1);
-                coins.vout[out.n] = undo.txout;
-                if (!view.SetCoins(out.hash, coins))
-                    return error("DisconnectBlock() : cannot restore coin inputs");
+                view.AddCoin(out, coin, fOverwrite);
             }
         }
     }
@@ -1891,6 +2833,16 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
     // move best block pointer to prevout block
     view.SetBestBlock(pindex->pprev->GetBlockHash());
 
+    if (fUpdateIndexes && (fAddressIndex || fSpentIndex)) {
+        CAddressIndexUpdate addressUpdate;
+        if (fAddressIndex)
+            addressUpdate.AddBlock(block, blockUndo, pindex->nHeight, true);
+        if (fSpentIndex)
+            addressUpdate.AddSpentOutputs(block, blockUndo, pindex->nHeight, true);
+        if (!pblocktree->WriteTxIndex(std::vector<std::pair<uint256, CDiskTxPos> >(), addressUpdate))
+            return state.Abort(_("Failed to write address index"));
+    }
+
     if (pfClean) {
         *pfClean = fClean;
         return true;
@@ -1905,6 +2857,10 @@ void static FlushBlockFile(bool fFinalize = false)
 
     CDiskBlockPos posOld(nLastBlockFile, 0);
 
+    // Some platforms cannot truncate a file that is mapped
+    if (fFinalize)
+        blockfilemapper.Invalidate(nLastBlockFile);
+
     FILE *fileOld = OpenBlockFile(posOld);
     if (fileOld) {
         if (fFinalize)
@@ -1931,12 +2887,333 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
-bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck)
+// CheckInputs for AcceptToMemoryPool, with the script checks of a
+// transaction with several inputs spread over the script check threads.
+// Callers hold cs_main, so this never shares the queue with ConnectBlock.
+bool static CheckInputsParallel(const CTransaction& tx, CValidationState &state, CCoinsViewCache &view, unsigned int flags)
 {
     AssertLockHeld(cs_main);
-    // Check it again in case a previous version let a bad block in
-    if (!CheckBlock(block, state, !fJustCheck, !fJustCheck))
+    if (!nScriptCheckThreads || tx.vin.size() < 2)
+        return CheckInputs(tx, state, view, true, flags);
+
+    std::vector<CScriptCheck> vChecks;
+    if (!CheckInputs(tx, state, view, true, flags, &vChecks))
         return false;
+    CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+    control.Add(vChecks);
+    if (control.Wait())
+        return true;
+    // Check again inline, so state tells non-canonical encodings from
+    // invalid signatures.
+    return CheckInputs(tx, state, view, true, flags);
+}
+
+void PrecheckTransactionScripts(const std::vector<CTransaction> &vtx)
+{
+    AssertLockHeld(cs_main);
+    if (!nScriptCheckThreads)
+        return;
+
+    std::vector<CScriptCheck> vChecks;
+    {
+        LOCK(mempool.cs);
+        CCoinsViewMemPool viewMemPool(*pcoinsTip, mempool);
+        BOOST_FOREACH(const CTransaction &tx, vtx) {
+            if (tx.IsCoinBase() || mempool.exists(tx.GetHash()))
+                continue;
+            // Transactions spending outputs of others in the batch are
+            // left to AcceptToMemoryPool.
+            unsigned int nChecks = vChecks.size();
+            boost::shared_ptr<const CSignatureHashCache> psighashcache;
+            if (tx.vin.size() > 1)
+                psighashcache.reset(new CSignatureHashCache(tx));
+            for (unsigned int i = 0; i < tx.vin.size(); i++) {
+                CCoin coin;
+                if (!viewMemPool.GetCoin(tx.vin[i].prevout, coin) || coin.IsSpent()) {
+                    vChecks.resize(nChecks);
+                    break;
+                }
+                vChecks.push_back(CScriptCheck(coin, tx, i, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, 0, psighashcache));
+            }
+        }
+    }
+
+    // Only the signature cache matters; invalid transactions are rejected
+    // by AcceptToMemoryPool.
+    int64_t nStart = GetTimeMicros();
+    CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+    control.Add(vChecks);
+    control.Wait();
+    if (fBenchmark)
+        LogPrintf("- Precheck %u txins of %u transactions: %.2fms\n", (unsigned int)vChecks.size(), (unsigned int)vtx.size(), (GetTimeMicros() - nStart) * 0.001);
+}
+
+/** Closure representing the proof-of-work check of one received header */
+class CPoWCheck
+{
+private:
+    CBlockHeader header;
+
+public:
+    CPoWCheck() {}
+    CPoWCheck(const CBlockHeader& headerIn) : header(headerIn) {}
+
+    bool operator()() const {
+        return CheckProofOfWork(header.GetPoWHash(header.GetAlgo()), header.nBits, header.GetAlgo());
+    }
+
+    void swap(CPoWCheck& check) {
+        std::swap(header, check.header);
+    }
+};
+
+static CCheckQueue<CPoWCheck> powcheckqueue(16);
+
+void ThreadPoWCheck() {
+    RenameThread("bitcoin-powcheck");
+    powcheckqueue.Thread();
+}
+
+/** Closure reading one coin from a thread-safe view, for PrefetchInputs */
+class CCoinPrefetch
+{
+private:
+    CCoinsView *pview;
+    COutPoint outpoint;
+    CCoin *pcoin;
+
+public:
+    CCoinPrefetch() : pview(NULL), pcoin(NULL) {}
+    CCoinPrefetch(CCoinsView *pviewIn, const COutPoint &outpointIn, CCoin *pcoinIn) :
+        pview(pviewIn), outpoint(outpointIn), pcoin(pcoinIn) {}
+
+    bool operator()() const {
+        if (!pview->GetCoin(outpoint, *pcoin))
+            pcoin->Clear();
+        return true;
+    }
+
+    void swap(CCoinPrefetch &check) {
+        std::swap(pview, check.pview);
+        std::swap(outpoint, check.outpoint);
+        std::swap(pcoin, check.pcoin);
+    }
+};
+
+static CCheckQueue<CCoinPrefetch> prefetchqueue(8);
+
+void ThreadPrefetchCoins() {
+    RenameThread("bitcoin-prefetch");
+    prefetchqueue.Thread();
+}
+
+// Read vOutPoints from viewBase (the thread-safe view below cache) on the
+// prefetch threads and add the unspent ones to cache; returns how many were
+// unspent. The caller holds cs_main, so the base does not change meanwhile.
+static unsigned int PrefetchCoins(const std::vector<COutPoint> &vOutPoints, CCoinsViewCache &cache, CCoinsView &viewBase)
+{
+    std::vector<CCoin> vCoins(vOutPoints.size());
+    std::vector<CCoinPrefetch> vChecks;
+    vChecks.reserve(vOutPoints.size());
+    for (unsigned int i = 0; i < vOutPoints.size(); i++)
+        vChecks.push_back(CCoinPrefetch(&viewBase, vOutPoints[i], &vCoins[i]));
+    {
+        CCheckQueueControl<CCoinPrefetch> control(&prefetchqueue);
+        control.Add(vChecks);
+        control.Wait();
+    }
+
+    unsigned int nFound = 0;
+    for (unsigned int i = 0; i < vOutPoints.size(); i++) {
+        if (vCoins[i].IsSpent())
+            continue;
+        cache.AddFetchedCoin(vOutPoints[i], vCoins[i]);
+        nFound++;
+    }
+    return nFound;
+}
+
+// Read the inputs of a block that are not cached yet in parallel, so
+// ConnectBlock finds them in memory instead of doing one database lookup
+// after another.
+void static PrefetchInputs(const CBlock &block, CCoinsViewCache &cache, CCoinsView &viewBase)
+{
+    // Inputs spending outputs of the same block are not filtered out; they
+    // simply miss in the database, which is cheaper than hashing every
+    // transaction of the block to recognize them.
+    std::vector<COutPoint> vOutPoints;
+    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn &txin, tx.vin)
+            if (!cache.HaveCoinInCache(txin.prevout))
+                vOutPoints.push_back(txin.prevout);
+    }
+    if (vOutPoints.size() < 2)
+        return;
+
+    unsigned int nFound = PrefetchCoins(vOutPoints, cache, viewBase);
+    if (fBenchmark)
+        LogPrintf("- Prefetched %u of %u block inputs\n", nFound, (unsigned int)vOutPoints.size());
+}
+
+static const uint64_t COINS_CACHE_DUMP_VERSION = 1;
+// At most this many outpoints are written to coinscache.dat
+static const size_t MAX_COINS_CACHE_DUMP = 300000;
+// Coins warmed per batch, and the pause in ms after each batch, so the
+// warm-up reads at most 10000 coins per second and holds cs_main briefly
+static const unsigned int COINS_WARM_BATCH = 1000;
+static const int64_t COINS_WARM_INTERVAL = 100;
+
+bool DumpCoinsCache()
+{
+    int64_t nStart = GetTimeMillis();
+    std::vector<COutPoint> vOutPoints;
+    {
+        LOCK2(cs_main, mempool.cs);
+        if (!pcoinsTip)
+            return false;
+        // The inputs of the mempool first: the next blocks are likely to spend them
+        for (CTxMemPoolMap::const_iterator it = mempool.mapTx.begin(); it != mempool.mapTx.end() && vOutPoints.size() < MAX_COINS_CACHE_DUMP; ++it)
+            BOOST_FOREACH(const CTxIn &txin, it->second.GetTx().vin)
+                if (!mempool.exists(txin.prevout.hash))
+                    vOutPoints.push_back(txin.prevout);
+        pcoinsTip->GetCachedOutPoints(vOutPoints, MAX_COINS_CACHE_DUMP);
+    }
+
+    boost::filesystem::path pathTmp = GetDataDir() / "coinscache.dat.new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("DumpCoinsCache : Failed to open file %s", pathTmp.string());
+    try {
+        fileout << COINS_CACHE_DUMP_VERSION;
+        fileout << vOutPoints;
+    } catch (std::exception &e) {
+        return error("DumpCoinsCache : Serialize or I/O error - %s", e.what());
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+    if (!RenameOver(pathTmp, GetDataDir() / "coinscache.dat"))
+        return error("DumpCoinsCache : Rename-into-place failed");
+
+    LogPrintf("Dumped %u coins cache outpoints in %dms\n", (unsigned int)vOutPoints.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+void ThreadWarmCoinsCache()
+{
+    RenameThread("bitcoin-warmcoins");
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path path = GetDataDir() / "coinscache.dat";
+    FILE *file = fopen(path.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return;
+
+    std::vector<COutPoint> vOutPoints;
+    try {
+        uint64_t nVersion;
+        filein >> nVersion;
+        if (nVersion != COINS_CACHE_DUMP_VERSION) {
+            error("ThreadWarmCoinsCache : Unknown coinscache.dat version %u", nVersion);
+            return;
+        }
+        filein >> vOutPoints;
+    } catch (std::exception &e) {
+        error("ThreadWarmCoinsCache : Deserialize or I/O error - %s", e.what());
+        return;
+    }
+    filein.fclose();
+
+    // Each batch is read under cs_main, like the inputs of a block, so no
+    // block is connected or flushed between reading a coin from the
+    // database and caching it.
+    unsigned int nRead = 0, nFound = 0;
+    for (unsigned int nFirst = 0; nFirst < vOutPoints.size(); nFirst += COINS_WARM_BATCH) {
+        unsigned int nEnd = std::min((unsigned int)vOutPoints.size(), nFirst + COINS_WARM_BATCH);
+        {
+            LOCK(cs_main);
+            if (!pcoinsTip || !pcoinsAsync || ShutdownRequested())
+                break;
+            // Leave room for the blocks being connected rather than make the next flush sooner
+            if (pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage / 2)
+                break;
+            std::vector<COutPoint> vMissing;
+            for (unsigned int i = nFirst; i < nEnd; i++)
+                if (!pcoinsTip->HaveCoinInCache(vOutPoints[i]))
+                    vMissing.push_back(vOutPoints[i]);
+            nRead += vMissing.size();
+            nFound += PrefetchCoins(vMissing, *pcoinsTip, *pcoinsAsync);
+        }
+        MilliSleep(COINS_WARM_INTERVAL);
+    }
+
+    LogPrintf("Warmed the coins cache with %u of %u coins read from coinscache.dat in %dms\n",
+              nFound, nRead, GetTimeMillis() - nStart);
+}
+
+void ThreadFlushChainState() {
+    RenameThread("bitcoin-flush");
+    pcoinsAsync->ThreadFlush();
+}
+
+bool SyncBlockStorage() {
+    FlushBlockFile();
+    return pblocktree->Sync();
+}
+
+// Filters are kept per block hash, so the ones of disconnected blocks stay
+// valid and nothing is undone on a reorganization
+static bool WriteBlockFilterIndex(CValidationState& state, const CBlock& block, const CBlockUndo& blockundo, CBlockIndex* pindex)
+{
+    CBlockFilterIndexEntry prev;
+    if (pindex->pprev && !pblocktree->ReadBlockFilter(pindex->pprev->GetBlockHash(), prev))
+        return state.Abort(_("Failed to read block filter index"));
+
+    CBlockFilter filter(block, blockundo);
+    CBlockFilterIndexEntry entry;
+    entry.vFilter = filter.GetEncoded();
+    entry.hashFilter = filter.GetHash();
+    entry.hashHeader = filter.ComputeHeader(prev.hashHeader);
+    if (!pblocktree->WriteBlockFilter(pindex->GetBlockHash(), entry))
+        return state.Abort(_("Failed to write block filter index"));
+    return true;
+}
+
+// Whether the scripts of pindex can be taken as valid because it is an ancestor
+// of the block given with -assumevalid. Proof of work, amounts and spent
+// outputs are still checked.
+static bool IsAssumedValid(const CBlockIndex* pindex)
+{
+    if (hashAssumeValid == 0)
+        return false;
+    BlockMap::const_iterator it = mapBlockIndex.find(hashAssumeValid);
+    if (it == mapBlockIndex.end())
+        return false;
+    const CBlockIndex* pindexAssumed = it->second;
+    if (pindexAssumed->nStatus & BLOCK_FAILED_MASK)
+        return false;
+    return pindexAssumed->GetAncestor(pindex->nHeight) == pindex;
+}
+
+bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck, CBlockConnectTimings *ptimings)
+{
+    AssertLockHeld(cs_main);
+    // Check it again in case a previous version let a bad block in. The
+    // proof of work first, on its own, to time it apart.
+    int64_t nCheckStart = GetTimeMicros();
+    if (!fJustCheck && !(pindex->nStatus & BLOCK_POW_CHECKED) &&
+        !CheckProofOfWork(block.GetPoWHash(block.GetAlgo()), block.nBits, block.GetAlgo()))
+        return state.DoS(50, error("ConnectBlock() : proof of work failed"),
+                         REJECT_INVALID, "high-hash");
+    int64_t nPoWDone = GetTimeMicros();
+    if (!CheckBlock(block, state, false, !fJustCheck))
+        return false;
+    if (ptimings) {
+        ptimings->nPoW += nPoWDone - nCheckStart;
+        ptimings->nCheck += GetTimeMicros() - nPoWDone;
+    }
 
     // verify that the view's current state corresponds to the previous block
     uint256 hashPrevBlock = pindex->pprev == NULL ? uint256(0) : pindex->pprev->GetBlockHash();
@@ -1945,11 +3222,13 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     // Special case for the genesis block, skipping connection of its transactions
     // (its coinbase is unspendable)
     if (block.GetHash() == Params().HashGenesisBlock()) {
+        if (!fJustCheck && fBlockFilterIndex && !WriteBlockFilterIndex(state, block, CBlockUndo(), pindex))
+            return false;
         view.SetBestBlock(pindex->GetBlockHash());
         return true;
     }
 
-    bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
+    bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate() && !IsAssumedValid(pindex);
 
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
@@ -1968,9 +3247,11 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     if (fEnforceBIP30) {
         for (unsigned int i = 0; i < block.vtx.size(); i++) {
             uint256 hash = block.GetTxHash(i);
-            if (view.HaveCoins(hash) && !view.GetCoins(hash).IsPruned())
-                return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"),
-                                 REJECT_INVALID, "bad-txns-BIP30");
+            for (unsigned int o = 0; o < block.vtx[i].vout.size(); o++) {
+                if (view.HaveCoin(COutPoint(hash, o)))
+                    return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"),
+                                     REJECT_INVALID, "bad-txns-BIP30");
+            }
         }
     }
 
@@ -1988,6 +3269,7 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     int64_t nStart = GetTimeMicros();
     int64_t nFees = 0;
     int nInputs = 0;
+    unsigned int nReused = 0;
     unsigned int nSigOps = 0;
     CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
@@ -1996,8 +3278,14 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     {
         const CTransaction &tx = block.vtx[i];
 
+        // The memory pool counted the sigops of its transactions already
+        unsigned int nTxSigOps = 0;
+        int nTxP2SHSigOps = -1;
+        if (tx.IsCoinBase() || !mempool.lookupSigOps(block.GetTxHash(i), nTxSigOps, nTxP2SHSigOps))
+            nTxSigOps = GetLegacySigOpCount(tx);
+
         nInputs += tx.vin.size();
-        nSigOps += GetLegacySigOpCount(tx);
+        nSigOps += nTxSigOps;
         if (nSigOps > MAX_BLOCK_SIGOPS)
             return state.DoS(100, error("ConnectBlock() : too many sigops"),
                              REJECT_INVALID, "bad-blk-sigops");
@@ -2013,7 +3301,7 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
                 // Add in sigops done by pay-to-script-hash inputs;
                 // this is to prevent a "rogue miner" from creating
                 // an incredibly-expensive-to-validate block.
-                nSigOps += GetP2SHSigOpCount(tx, view);
+                nSigOps += nTxP2SHSigOps >= 0 ? nTxP2SHSigOps : GetP2SHSigOpCount(tx, view);
                 if (nSigOps > MAX_BLOCK_SIGOPS)
                     return state.DoS(100, error("ConnectBlock() : too many sigops"),
                                      REJECT_INVALID, "bad-blk-sigops");
@@ -2021,8 +3309,16 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
 
             nFees += view.GetValueIn(tx)-tx.GetValueOut();
 
+            // Scripts verified when the transaction entered the memory pool,
+            // under at least this block's flags, are not verified again.
+            bool fTxScriptChecks = fScriptChecks;
+            if (fTxScriptChecks && mempool.hasValidScripts(block.GetTxHash(i), flags & ~SCRIPT_VERIFY_NOCACHE)) {
+                fTxScriptChecks = false;
+                nReused++;
+            }
+
             std::vector<CScriptCheck> vChecks;
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, nScriptCheckThreads ? &vChecks : NULL))
+            if (!CheckInputs(tx, state, view, fTxScriptChecks, flags, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
             control.Add(vChecks);
         }
@@ -2037,7 +3333,7 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     }
     int64_t nTime = GetTimeMicros() - nStart;
     if (fBenchmark)
-        LogPrintf("- Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin)\n", (unsigned)block.vtx.size(), 0.001 * nTime, 0.001 * nTime / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * nTime / (nInputs-1));
+        LogPrintf("- Connect %u transactions (%u verified in the memory pool): %.2fms (%.3fms/tx, %.3fms/txin)\n", (unsigned)block.vtx.size(), nReused, 0.001 * nTime, 0.001 * nTime / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * nTime / (nInputs-1));
 
     if (block.vtx[0].GetValueOut() > GetBlockValue(pindex->nHeight, nFees))
         return state.DoS(100,
@@ -2048,21 +3344,37 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     if (!control.Wait())
         return state.DoS(100, false);
     int64_t nTime2 = GetTimeMicros() - nStart;
-    if (fBenchmark)
+    CCheckQueueStats stats = control.GetStats();
+    if (ptimings) {
+        ptimings->nConnect += nTime;
+        ptimings->nScripts += nTime2 - nTime;
+        ptimings->nScriptChecks += stats.nChecks;
+        ptimings->nScriptVerify += stats.nVerifyMicros;
+    }
+    if (fBenchmark) {
         LogPrintf("- Verify %u txins: %.2fms (%.3fms/txin)\n", nInputs - 1, 0.001 * nTime2, nInputs <= 1 ? 0 : 0.001 * nTime2 / (nInputs-1));
+        if (stats.nChecks)
+            LogPrintf("- Script checks: %u in %.2fms of thread time (%.3fms/check), %u stolen batches, %.2fms waited\n",
+                      stats.nChecks, 0.001 * stats.nVerifyMicros, 0.001 * stats.nVerifyMicros / stats.nChecks, stats.nSteals, 0.001 * stats.nWaitMicros);
+    }
 
     if (fJustCheck)
         return true;
 
     // Write undo information to disk
+    int64_t nIndexStart = GetTimeMicros();
+    int64_t nUndoTime = 0;
     if (pindex->GetUndoPos().IsNull() || (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS)
     {
         if (pindex->GetUndoPos().IsNull()) {
+            int64_t nUndoStart = GetTimeMicros();
             CDiskBlockPos pos;
-            if (!FindUndoPos(state, pindex->nFile, pos, ::GetSerializeSize(blockundo, SER_DISK, CLIENT_VERSION) + 40))
+            CDiskRecord record(blockundo, nBlockCompression);
+            if (!FindUndoPos(state, pindex->nFile, pos, record.GetDiskSize() + 32))
                 return error("ConnectBlock() : FindUndoPos failed");
-            if (!blockundo.WriteToDisk(pos, pindex->pprev->GetBlockHash()))
+            if (!blockundo.WriteToDisk(record, pos, pindex->pprev->GetBlockHash()))
                 return state.Abort(_("Failed to write undo data"));
+            nUndoTime = GetTimeMicros() - nUndoStart;
 
             // update nUndoPos in block index
             pindex->nUndoPos = pos.nPos;
@@ -2076,36 +3388,51 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
             return state.Abort(_("Failed to write block index"));
     }
 
-    if (fTxIndex)
-        if (!pblocktree->WriteTxIndex(vPos))
+    if (fTxIndex || fAddressIndex || fSpentIndex) {
+        CAddressIndexUpdate addressUpdate;
+        if (fAddressIndex)
+            addressUpdate.AddBlock(block, blockundo, pindex->nHeight, false);
+        if (fSpentIndex)
+            addressUpdate.AddSpentOutputs(block, blockundo, pindex->nHeight, false);
+        if (!fTxIndex)
+            vPos.clear();
+        if (!pblocktree->WriteTxIndex(vPos, addressUpdate))
             return state.Abort(_("Failed to write transaction index"));
+    }
+
+    if (fBlockFilterIndex && !WriteBlockFilterIndex(state, block, blockundo, pindex))
+        return false;
+    if (ptimings) {
+        ptimings->nUndo += nUndoTime;
+        ptimings->nIndex += GetTimeMicros() - nIndexStart - nUndoTime;
+    }
 
     // add this block to the view's block chain
     bool ret;
     ret = view.SetBestBlock(pindex->GetBlockHash());
     assert(ret);
 
-    // Watch for transactions paying to me
-    for (unsigned int i = 0; i < block.vtx.size(); i++)
-        g_signals.SyncTransaction(block.GetTxHash(i), block.vtx[i], &block);
-
     return true;
 }
 
 // Update the on-disk chain state.
 bool static WriteChainState(CValidationState &state) {
     static int64_t nLastWrite = 0;
-    if (!IsInitialBlockDownload() || pcoinsTip->GetCacheSize() > nCoinCacheSize || GetTimeMicros() > nLastWrite + 600*1000000) {
-        // Typical CCoins structures on disk are around 100 bytes in size.
+    bool fCacheFull = pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage;
+    bool fManyDirty = (int64_t)pcoinsTip->GetDirtyCount() > nDbMaxDirty;
+    if (!IsInitialBlockDownload() || fCacheFull || fManyDirty || GetTimeMicros() > nLastWrite + nDbFlushInterval*1000000) {
+        // Typical coin records on disk are below 100 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
         // an overestimation, as most will delete an existing entry or
         // overwrite one. Still, use a conservative safety factor of 2.
         if (!CheckDiskSpace(100 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
-        FlushBlockFile();
-        pblocktree->Sync();
-        if (!pcoinsTip->Flush())
+        // Only modified coins are written; unless we are over the memory
+        // budget, keep the unspent ones cached for the next blocks. The
+        // write itself, preceded by syncing the block files and index,
+        // happens in the background (see CCoinsViewAsyncDB).
+        if (!pcoinsTip->Flush(!fCacheFull))
             return state.Abort(_("Failed to write to coin database"));
         nLastWrite = GetTimeMicros();
     }
@@ -2114,21 +3441,34 @@ bool static WriteChainState(CValidationState &state) {
 
 // Update chainActive and related internal data structures.
 void static UpdateTip(CBlockIndex *pindexNew) {
-    chainActive.SetTip(pindexNew);
+    {
+        LOCK(cs_chainview);
+        chainActive.SetTip(pindexNew);
+    }
 
     // Update best block in wallet (so we can detect restored wallets)
     bool fIsInitialDownload = IsInitialBlockDownload();
+    // During the initial download GetAlgoStats refreshes them when needed
+    if (!fIsInitialDownload)
+        UpdateAlgoStats();
     if ((chainActive.Height() % 20160) == 0 || (!fIsInitialDownload && (chainActive.Height() % 144) == 0))
-        g_signals.SetBestChain(chainActive.GetLocator());
+        QueueWalletNotification(boost::bind(&NotifySetBestChain, chainActive.GetLocator()));
 
     // New best block
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
-    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu algo=%u  date=%s progress=%f\n",
+
+    // Wake up getblocktemplate longpolls waiting on the old tip
+    {
+        boost::unique_lock<boost::mutex> lock(csBestBlock);
+        cvBlockChange.notify_all();
+    }
+    // Not rate limited: one line per block is expected during a sync
+    LogPrintStr(strprintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu algo=%u  date=%s progress=%f\n",
       chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble())/log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
       chainActive.Tip()->GetAlgo(),
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-      Checkpoints::GuessVerificationProgress(chainActive.Tip()));
+      Checkpoints::GuessVerificationProgress(chainActive.Tip())));
 
     // Check the version of the last 100 blocks to see if we need to upgrade:
     /*
@@ -2164,10 +3504,13 @@ bool static DisconnectTip(CValidationState &state) {
     int64_t nStart = GetTimeMicros();
     {
         CCoinsViewCache view(*pcoinsTip, true);
-        if (!DisconnectBlock(block, state, pindexDelete, view))
+        if (!DisconnectBlock(block, state, pindexDelete, view, NULL, true))
             return error("DisconnectTip() : DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
         assert(view.Flush());
     }
+    // Its transactions may be confirmed again in another block
+    txcache.Clear();
+    recentConfirmed.reset();
     if (fBenchmark)
         LogPrintf("- Disconnect: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
     // Write the chain state to disk, if necessary.
@@ -2187,9 +3530,7 @@ bool static DisconnectTip(CValidationState &state) {
     UpdateTip(pindexDelete->pprev);
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
-    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-        SyncWithWallets(tx.GetHash(), tx, NULL);
-    }
+    SyncBlockWithWallets(block, false);
     return true;
 }
 
@@ -2197,28 +3538,46 @@ bool static DisconnectTip(CValidationState &state) {
 bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew) {
     assert(pindexNew->pprev == chainActive.Tip());
     mempool.check(pcoinsTip);
+    CBlockProfile profile;
+    int64_t nReadStart = GetTimeMicros();
     // Read block from disk.
     CBlock block;
     if (!ReadBlockFromDisk(block, pindexNew))
         return state.Abort(_("Failed to read block"));
     // Apply the block atomically to the chain state.
+    CBlockConnectTimings &timings = profile.timings;
     int64_t nStart = GetTimeMicros();
+    profile.nRead = nStart - nReadStart;
+    // Read the inputs missing from the coins cache in parallel first.
+    if (nScriptCheckThreads && pcoinsAsync) {
+        PrefetchInputs(block, *pcoinsTip, *pcoinsAsync);
+        timings.nFetch = GetTimeMicros() - nStart;
+        if (fBenchmark)
+            LogPrintf("- Prefetch: %.2fms\n", timings.nFetch * 0.001);
+    }
     {
         CCoinsViewCache view(*pcoinsTip, true);
         CInv inv(MSG_BLOCK, pindexNew->GetBlockHash());
-        if (!ConnectBlock(block, state, pindexNew, view)) {
+        if (!ConnectBlock(block, state, pindexNew, view, false, &timings)) {
             if (state.IsInvalid())
                 InvalidBlockFound(pindexNew, state);
             return error("ConnectTip() : ConnectBlock %s failed", pindexNew->GetBlockHash().ToString());
         }
         mapBlockSource.erase(inv.hash);
+        int64_t nFlushStart = GetTimeMicros();
         assert(view.Flush());
+        timings.nFlush = GetTimeMicros() - nFlushStart;
     }
     if (fBenchmark)
         LogPrintf("- Connect: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
     // Write the chain state to disk, if necessary.
+    int64_t nChainStateStart = GetTimeMicros();
     if (!WriteChainState(state))
         return false;
+    int64_t nMempoolStart = GetTimeMicros();
+    profile.nChainState = nMempoolStart - nChainStateStart;
+    RecordBlockConnectMetrics(timings, nMempoolStart - nStart);
+    PROPTRACE(PROPTRACE_CONNECT, MSG_BLOCK, pindexNew->GetBlockHash(), -1);
     // Remove conflicting transactions from the mempool.
     list<CTransaction> txConflicted;
     BOOST_FOREACH(const CTransaction &tx, block.vtx) {
@@ -2226,17 +3585,35 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew) {
         mempool.remove(tx, unused);
         mempool.removeConflicts(tx, txConflicted);
     }
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        recentConfirmed.insert(block.GetTxHash(i));
+    profile.nMempool = GetTimeMicros() - nMempoolStart;
     mempool.check(pcoinsTip);
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
+    // Keep the block around for peers, wallets and reorganizations.
+    blockcache.Add(block);
+    int64_t nWalletStart = GetTimeMicros();
     // Tell wallet about transactions that went from mempool
     // to conflicted:
     BOOST_FOREACH(const CTransaction &tx, txConflicted) {
         SyncWithWallets(tx.GetHash(), tx, NULL);
     }
     // ... and about transactions that got confirmed:
-    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-        SyncWithWallets(tx.GetHash(), tx, &block);
+    SyncBlockWithWallets(block, true);
+    int64_t nEnd = GetTimeMicros();
+    profile.nWallet = nEnd - nWalletStart;
+
+    if (IsBlockProfileEnabled()) {
+        profile.hash = pindexNew->GetBlockHash();
+        profile.nHeight = pindexNew->nHeight;
+        profile.nTime = GetTime();
+        profile.nTx = block.vtx.size();
+        BOOST_FOREACH(const CTransaction &tx, block.vtx)
+            profile.nInputs += tx.vin.size();
+        profile.nSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+        profile.nTotal = nEnd - nReadStart;
+        RecordBlockProfile(profile);
     }
     return true;
 }
@@ -2331,6 +3708,9 @@ bool ActivateBestChain(CValidationState &state) {
         }
     }
 
+    if (fCheckForPruning)
+        PruneBlockFiles();
+
     if (chainActive.Tip() != pindexOldTip) {
         std::string strCmd = GetArg("-blocknotify", "");
         if (!IsInitialBlockDownload() && !strCmd.empty())
@@ -2343,7 +3723,94 @@ bool ActivateBestChain(CValidationState &state) {
     return true;
 }
 
-bool AddToBlockIndex(CBlock& block, CValidationState& state, const CDiskBlockPos& pos)
+// Fill in the memory-only ancestor links of a block whose pprev is already linked
+static void SetAncestorLinks(CBlockIndex* pindex)
+{
+    pindex->BuildSkip();
+
+    CBlockIndex* pprev = pindex->pprev;
+    for (int algo = 0; algo < NUM_ALGOS; algo++) {
+        if (!pprev)
+            pindex->nHeightPrevAlgo[algo] = -1;
+        else if (pprev->GetAlgo() == algo)
+            pindex->nHeightPrevAlgo[algo] = pprev->nHeight;
+        else
+            pindex->nHeightPrevAlgo[algo] = pprev->nHeightPrevAlgo[algo];
+    }
+}
+
+bool AddSnapshotBlockIndex(CBlockHeader& header, unsigned int nTx, CValidationState& state, CBlockIndex** ppindex)
+{
+    AssertLockHeld(cs_main);
+    uint256 hash = header.GetHash();
+    if (mapBlockIndex.count(hash))
+        return state.Invalid(error("AddSnapshotBlockIndex() : %s already exists", hash.ToString()), 0, "duplicate");
+    BlockMap::iterator miPrev = mapBlockIndex.find(header.hashPrevBlock);
+    if (miPrev == mapBlockIndex.end())
+        return state.DoS(100, error("AddSnapshotBlockIndex() : prev block %s not found", header.hashPrevBlock.ToString()));
+    CBlockIndex* pindexPrev = miPrev->second;
+    int nHeight = pindexPrev->nHeight + 1;
+
+    // The checks of AcceptBlock that only need the header
+    if (header.nBits != GetNextWorkRequired(pindexPrev, &header, header.GetAlgo()))
+        return state.DoS(100, error("AddSnapshotBlockIndex() : incorrect proof of work at %d", nHeight),
+                         REJECT_INVALID, "bad-diffbits");
+    if ((TestNet() || nHeight < V3_FORK) && header.GetAlgo() != ALGO_SCRYPT)
+        return state.Invalid(error("AddSnapshotBlockIndex() : incorrect hashing algo at %d", nHeight),
+                             REJECT_INVALID, "bad-hashalgo");
+    if (header.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+        return state.Invalid(error("AddSnapshotBlockIndex() : block's timestamp is too early at %d", nHeight),
+                             REJECT_INVALID, "time-too-old");
+    if (!Checkpoints::CheckBlock(nHeight, hash))
+        return state.DoS(100, error("AddSnapshotBlockIndex() : rejected by checkpoint lock-in at %d", nHeight),
+                         REJECT_CHECKPOINT, "checkpoint mismatch");
+
+    CBlockIndex* pindexNew = blockIndexArena.Allocate();
+    *pindexNew = CBlockIndex(header);
+    pindexNew->pprev = pindexPrev;
+    pindexNew->nHeight = nHeight;
+    SetAncestorLinks(pindexNew);
+    {
+        LOCK(cs_chainview);
+        BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+        pindexNew->phashBlock = &((*mi).first);
+    }
+    pindexNew->nTx = nTx;
+    pindexNew->nChainWork = pindexPrev->nChainWork + pindexNew->GetBlockWorkAdjusted();
+    pindexNew->nChainTx = pindexPrev->nChainTx + nTx;
+    // Valid as far as the snapshot is trusted; the block data is never stored
+    pindexNew->nStatus = BLOCK_VALID_SCRIPTS | BLOCK_POW_CHECKED | BLOCK_HAVE_WORK;
+    UpdateChainTips(pindexNew);
+    *ppindex = pindexNew;
+    return true;
+}
+
+// Switch to the most-work chain after new blocks, the last of them pindexNew
+bool static ActivateNewBlocks(CValidationState& state, CBlockIndex* pindexNew, const uint256& hashCoinBase)
+{
+    if (!ActivateBestChain(state))
+        return false;
+
+    LOCK(cs_main);
+    if (pindexNew == chainActive.Tip())
+    {
+        // Clear fork warning if its no longer applicable
+        CheckForkWarningConditions();
+        // Notify UI to display prev block's coinbase if it was ours
+        static uint256 hashPrevBestCoinBase;
+        QueueWalletNotification(boost::bind(&NotifyUpdatedTransaction, hashPrevBestCoinBase));
+        hashPrevBestCoinBase = hashCoinBase;
+    } else
+        CheckForkWarningConditionsOnNewFork(pindexNew);
+
+    if (!pblocktree->Flush())
+        return state.Abort(_("Failed to sync block index"));
+
+    uiInterface.NotifyBlocksChanged();
+    return true;
+}
+
+bool AddToBlockIndex(CBlock& block, CValidationState& state, const CDiskBlockPos& pos, bool fActivate)
 {
     // Check for duplicate
     uint256 hash = block.GetHash();
@@ -2351,53 +3818,42 @@ bool AddToBlockIndex(CBlock& block, CValidationState& state, const CDiskBlockPos
         return state.Invalid(error("AddToBlockIndex() : %s already exists", hash.ToString()), 0, "duplicate");
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = blockIndexArena.Allocate();
+    *pindexNew = CBlockIndex(block);
     {
          LOCK(cs_nBlockSequenceId);
          pindexNew->nSequenceId = nBlockSequenceId++;
     }
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
     }
+    SetAncestorLinks(pindexNew);
+    {
+        LOCK(cs_chainview);
+        BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+        pindexNew->phashBlock = &((*mi).first);
+    }
+    setHeadersVerified.erase(hash);
     pindexNew->nTx = block.vtx.size();
-    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWorkAdjusted().getuint256();
+    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWorkAdjusted();
     pindexNew->nChainTx = (pindexNew->pprev ? pindexNew->pprev->nChainTx : 0) + pindexNew->nTx;
     pindexNew->nFile = pos.nFile;
     pindexNew->nDataPos = pos.nPos;
     pindexNew->nUndoPos = 0;
-    pindexNew->nStatus = BLOCK_VALID_TRANSACTIONS | BLOCK_HAVE_DATA;
+    pindexNew->nStatus = BLOCK_VALID_TRANSACTIONS | BLOCK_HAVE_DATA | BLOCK_POW_CHECKED | BLOCK_HAVE_WORK;
     setBlockIndexValid.insert(pindexNew);
+    UpdateChainTips(pindexNew);
 
     if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindexNew)))
         return state.Abort(_("Failed to write block index"));
 
     // New best?
-    if (!ActivateBestChain(state))
-        return false;
-
-    LOCK(cs_main);
-    if (pindexNew == chainActive.Tip())
-    {
-        // Clear fork warning if its no longer applicable
-        CheckForkWarningConditions();
-        // Notify UI to display prev block's coinbase if it was ours
-        static uint256 hashPrevBestCoinBase;
-        g_signals.UpdatedTransaction(hashPrevBestCoinBase);
-        hashPrevBestCoinBase = block.GetTxHash(0);
-    } else
-        CheckForkWarningConditionsOnNewFork(pindexNew);
-
-    if (!pblocktree->Flush())
-        return state.Abort(_("Failed to sync block index"));
-
-    uiInterface.NotifyBlocksChanged();
-    return true;
+    if (!fActivate)
+        return true;
+    return ActivateNewBlocks(state, pindexNew, block.GetTxHash(0));
 }
 
 
@@ -2419,6 +3875,7 @@ bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAdd
             LogPrintf("Leaving block file %i: %s\n", nLastBlockFile, infoLastBlockFile.ToString());
             FlushBlockFile(true);
             nLastBlockFile++;
+            fCheckForPruning = fPruneMode;
             infoLastBlockFile.SetNull();
             pblocktree->ReadBlockFileInfo(nLastBlockFile, infoLastBlockFile); // check whether data for the new file somehow already exist; can fail just fine
             fUpdatedLast = true;
@@ -2496,6 +3953,313 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
 }
 
 
+uint64_t CalculateCurrentUsage()
+{
+    LOCK(cs_LastBlockFile);
+
+    uint64_t nUsage = infoLastBlockFile.nSize + infoLastBlockFile.nUndoSize;
+    for (int nFile = 0; nFile < nLastBlockFile; nFile++) {
+        CBlockFileInfo info;
+        if (pblocktree->ReadBlockFileInfo(nFile, info))
+            nUsage += info.nSize + info.nUndoSize;
+    }
+    return nUsage;
+}
+
+// Forget the blocks of a file in the block index and delete the file and its undo file
+static bool PruneOneBlockFile(int nFile)
+{
+    AssertLockHeld(cs_main);
+
+    // Readers of the block browser and RPC look entries up under cs_chainview alone
+    vector<CBlockIndex*> vPruned;
+    {
+        LOCK(cs_chainview);
+        for (BlockMap::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); ++it) {
+            CBlockIndex* pindex = it->second;
+            if (pindex->nFile != nFile || !(pindex->nStatus & BLOCK_HAVE_MASK))
+                continue;
+            pindex->nStatus &= ~BLOCK_HAVE_MASK;
+            pindex->nFile = 0;
+            pindex->nDataPos = 0;
+            pindex->nUndoPos = 0;
+            vPruned.push_back(pindex);
+        }
+    }
+
+    BOOST_FOREACH(CBlockIndex* pindex, vPruned) {
+        if (!chainActive.Contains(pindex))
+            setBlockIndexValid.erase(pindex);
+        if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex)))
+            return error("PruneOneBlockFile() : failed to write block index");
+    }
+
+    // An empty file info marks the file as pruned
+    if (!pblocktree->WriteBlockFileInfo(nFile, CBlockFileInfo()))
+        return error("PruneOneBlockFile() : failed to write block file info");
+
+    blockfilemapper.Invalidate(nFile);
+    boost::filesystem::path pathBlocks = GetDataDir() / "blocks";
+    boost::system::error_code ec;
+    boost::filesystem::remove(pathBlocks / strprintf("blk%05u.dat", nFile), ec);
+    boost::filesystem::remove(pathBlocks / strprintf("rev%05u.dat", nFile), ec);
+    return true;
+}
+
+void PruneBlockFiles()
+{
+    LOCK2(cs_main, cs_LastBlockFile);
+    fCheckForPruning = false;
+    if (!fPruneMode || chainActive.Tip() == NULL)
+        return;
+
+    // The open block file can still grow to its maximum size
+    uint64_t nUsage = CalculateCurrentUsage();
+    uint64_t nBuffer = MAX_BLOCKFILE_SIZE;
+    if (nUsage + nBuffer <= nPruneTarget)
+        return;
+
+    // Files with blocks above this height are kept for reorganizations
+    int nLastPrunable = chainActive.Height() - MIN_BLOCKS_TO_KEEP;
+    int nPruned = 0;
+    for (int nFile = 0; nFile < nLastBlockFile && nUsage + nBuffer > nPruneTarget; nFile++) {
+        CBlockFileInfo info;
+        if (!pblocktree->ReadBlockFileInfo(nFile, info) || info.nSize == 0)
+            continue;
+        if ((int)info.nHeightLast > nLastPrunable)
+            continue;
+        if (!PruneOneBlockFile(nFile))
+            return;
+        if (!fHavePruned) {
+            fHavePruned = true;
+            pblocktree->WriteFlag("prunedblockfiles", true);
+        }
+        nUsage -= info.nSize + info.nUndoSize;
+        nPruned++;
+        LogPrint("prune", "PruneBlockFiles() : pruned block file %d (%s)\n", nFile, info.ToString());
+    }
+    if (nPruned > 0)
+        LogPrintf("PruneBlockFiles() : pruned %d block files, %d MiB left (target %d MiB)\n", nPruned, nUsage >> 20, nPruneTarget >> 20);
+}
+
+// Where the rewritten block or undo file of a recompression is written
+// before it replaces the original
+static boost::filesystem::path GetRecompressedPath(const char *prefix, int nFile)
+{
+    return GetDataDir() / "blocks" / strprintf("%s%05u.dat.new", prefix, nFile);
+}
+
+// A block stored in a file being recompressed. Positions are 0 for data
+// the block does not have.
+struct CRecompressedBlock
+{
+    CBlockIndex *pindex;
+    unsigned int nDataPos;
+    unsigned int nUndoPos;
+    unsigned int nNewDataPos;
+    unsigned int nNewUndoPos;
+    std::vector<std::pair<uint256, CDiskTxPos> > vTxPos; // at the new position
+
+    bool operator<(const CRecompressedBlock &other) const { return nDataPos < other.nDataPos; }
+};
+
+// Rewrite a finished block file and its undo file with every record
+// compressed at -blockcompression, leaving out data no block refers to. The
+// new files are written without holding cs_main, and only replace the old
+// ones if nothing was added to the file meanwhile. The block index, the
+// transaction index and the file info are moved to the new positions in one
+// batch, together with the mark that lets a restart finish the swap.
+static bool RecompressBlockFile(int nFile)
+{
+    CBlockFileInfo info;
+    std::vector<CRecompressedBlock> vBlocks;
+    {
+        LOCK(cs_main);
+        if (!pblocktree->ReadBlockFileInfo(nFile, info))
+            return error("RecompressBlockFile() : no file info for block file %d", nFile);
+        for (BlockMap::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); ++it) {
+            CBlockIndex* pindex = it->second;
+            if (pindex->nFile != nFile || !(pindex->nStatus & BLOCK_HAVE_MASK))
+                continue;
+            CRecompressedBlock entry;
+            entry.pindex = pindex;
+            entry.nDataPos = (pindex->nStatus & BLOCK_HAVE_DATA) ? pindex->nDataPos : 0;
+            entry.nUndoPos = (pindex->nStatus & BLOCK_HAVE_UNDO) ? pindex->nUndoPos : 0;
+            entry.nNewDataPos = entry.nNewUndoPos = 0;
+            vBlocks.push_back(entry);
+        }
+    }
+    // Pruned files are gone
+    if (info.nSize == 0)
+        return pblocktree->WriteBlockFileRecompressed(nFile, NULL, std::vector<CBlockIndex*>(), std::vector<std::pair<uint256, CDiskTxPos> >());
+    std::sort(vBlocks.begin(), vBlocks.end());
+
+    boost::filesystem::path pathBlkNew = GetRecompressedPath("blk", nFile);
+    boost::filesystem::path pathRevNew = GetRecompressedPath("rev", nFile);
+    unsigned int nNewSize = 0, nNewUndoSize = 0;
+    try {
+        CAutoFile fileBlk(fopen(pathBlkNew.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        CAutoFile fileRev(fopen(pathRevNew.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        if (!fileBlk || !fileRev)
+            return error("RecompressBlockFile() : failed to create the files of block file %d", nFile);
+
+        BOOST_FOREACH(CRecompressedBlock &entry, vBlocks) {
+            boost::this_thread::interruption_point();
+            if (entry.nDataPos) {
+                CDiskBlockPos pos(nFile, entry.nDataPos);
+                CRawBlock raw;
+                if (!blockfilemapper.Read(pos, raw) && !ReadBlockFromFile(pos, raw))
+                    return error("RecompressBlockFile() : failed to read block %s", entry.pindex->GetBlockHash().ToString());
+                if (!WriteDiskRecord(fileBlk, CDiskRecord(raw.begin(), raw.size(), nBlockCompression), entry.nNewDataPos))
+                    return error("RecompressBlockFile() : failed to write block %s", entry.pindex->GetBlockHash().ToString());
+                if (fTxIndex) {
+                    CBlock block;
+                    CSpanReader ssBlock(raw.begin(), raw.end(), SER_DISK, CLIENT_VERSION);
+                    ssBlock >> block;
+                    CDiskTxPos posTx(CDiskBlockPos(nFile, entry.nNewDataPos), GetSizeOfCompactSize(block.vtx.size()));
+                    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+                        entry.vTxPos.push_back(make_pair(tx.GetHash(), posTx));
+                        posTx.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+                    }
+                }
+            }
+            if (entry.nUndoPos) {
+                // The checksum after the undo data is copied as it is
+                CAutoFile fileUndo(OpenUndoFile(CDiskBlockPos(nFile, entry.nUndoPos - 8), true), SER_DISK, CLIENT_VERSION);
+                std::vector<char> vchUndo;
+                uint256 hashChecksum;
+                if (!fileUndo || !ReadDiskRecord(fileUndo, MAX_SIZE, vchUndo) || vchUndo.empty())
+                    return error("RecompressBlockFile() : failed to read undo data of block %s", entry.pindex->GetBlockHash().ToString());
+                fileUndo >> hashChecksum;
+                if (!WriteDiskRecord(fileRev, CDiskRecord(&vchUndo[0], vchUndo.size(), nBlockCompression), entry.nNewUndoPos))
+                    return error("RecompressBlockFile() : failed to write undo data of block %s", entry.pindex->GetBlockHash().ToString());
+                fileRev << hashChecksum;
+            }
+        }
+
+        fflush(fileBlk);
+        fflush(fileRev);
+        FileCommit(fileBlk);
+        FileCommit(fileRev);
+        nNewSize = ftell(fileBlk);
+        nNewUndoSize = ftell(fileRev);
+    } catch (std::exception &e) {
+        return error("RecompressBlockFile() : %s", e.what());
+    }
+
+    boost::system::error_code ec;
+    if ((uint64_t)nNewSize + nNewUndoSize >= (uint64_t)info.nSize + info.nUndoSize) {
+        // Nothing to gain, for instance because the file was compressed already
+        boost::filesystem::remove(pathBlkNew, ec);
+        boost::filesystem::remove(pathRevNew, ec);
+        return pblocktree->WriteBlockFileRecompressed(nFile, NULL, std::vector<CBlockIndex*>(), std::vector<std::pair<uint256, CDiskTxPos> >());
+    }
+
+    LOCK2(cs_main, cs_LastBlockFile);
+    CBlockFileInfo infoNow;
+    bool fUnchanged = nFile < nLastBlockFile && pblocktree->ReadBlockFileInfo(nFile, infoNow) &&
+                      infoNow.nSize == info.nSize && infoNow.nUndoSize == info.nUndoSize;
+    BOOST_FOREACH(const CRecompressedBlock &entry, vBlocks) {
+        const CBlockIndex *pindex = entry.pindex;
+        fUnchanged = fUnchanged && pindex->nFile == nFile &&
+                     ((pindex->nStatus & BLOCK_HAVE_DATA) ? pindex->nDataPos : 0) == entry.nDataPos &&
+                     ((pindex->nStatus & BLOCK_HAVE_UNDO) ? pindex->nUndoPos : 0) == entry.nUndoPos;
+    }
+    if (!fUnchanged) {
+        // Try again after a restart
+        boost::filesystem::remove(pathBlkNew, ec);
+        boost::filesystem::remove(pathRevNew, ec);
+        LogPrintf("RecompressBlockFile() : block file %d changed while it was rewritten\n", nFile);
+        return true;
+    }
+
+    // Only the transactions of the active chain have index entries
+    std::vector<CBlockIndex*> vIndex;
+    std::vector<std::pair<uint256, CDiskTxPos> > vTxPos;
+    BOOST_FOREACH(CRecompressedBlock &entry, vBlocks) {
+        entry.pindex->nDataPos = entry.nNewDataPos;
+        entry.pindex->nUndoPos = entry.nNewUndoPos;
+        vIndex.push_back(entry.pindex);
+        if (chainActive.Contains(entry.pindex))
+            vTxPos.insert(vTxPos.end(), entry.vTxPos.begin(), entry.vTxPos.end());
+    }
+    infoNow.nSize = nNewSize;
+    infoNow.nUndoSize = nNewUndoSize;
+    if (!pblocktree->WriteBlockFileRecompressed(nFile, &infoNow, vIndex, vTxPos)) {
+        BOOST_FOREACH(CRecompressedBlock &entry, vBlocks) {
+            entry.pindex->nDataPos = entry.nDataPos;
+            entry.pindex->nUndoPos = entry.nUndoPos;
+        }
+        boost::filesystem::remove(pathBlkNew, ec);
+        boost::filesystem::remove(pathRevNew, ec);
+        return error("RecompressBlockFile() : failed to write the block index");
+    }
+
+    boost::filesystem::path pathBlocks = GetDataDir() / "blocks";
+    if (!RenameOver(pathBlkNew, pathBlocks / strprintf("blk%05u.dat", nFile)) ||
+        !RenameOver(pathRevNew, pathBlocks / strprintf("rev%05u.dat", nFile)))
+        return AbortNode(_("Error: failed to replace a recompressed block file"));
+    blockfilemapper.Invalidate(nFile);
+    LogPrintf("RecompressBlockFile() : block file %d now takes %u instead of %u bytes\n",
+              nFile, nNewSize + nNewUndoSize, info.nSize + info.nUndoSize);
+    return true;
+}
+
+// Finish the swap of a block file whose recompression was committed to the
+// block index before a shutdown, or drop the files of an unfinished one
+static bool FinishRecompressedBlockFile(int nFile)
+{
+    boost::filesystem::path pathBlkNew = GetRecompressedPath("blk", nFile);
+    boost::filesystem::path pathRevNew = GetRecompressedPath("rev", nFile);
+    bool fBlk = boost::filesystem::exists(pathBlkNew);
+    bool fRev = boost::filesystem::exists(pathRevNew);
+    if (!fBlk && !fRev)
+        return true;
+
+    bool fRecompressed = false;
+    pblocktree->ReadBlockFileRecompressed(nFile, fRecompressed);
+    if (fRecompressed) {
+        boost::filesystem::path pathBlocks = GetDataDir() / "blocks";
+        if (fBlk && !RenameOver(pathBlkNew, pathBlocks / strprintf("blk%05u.dat", nFile)))
+            return error("FinishRecompressedBlockFile() : failed to replace blk%05u.dat", nFile);
+        if (fRev && !RenameOver(pathRevNew, pathBlocks / strprintf("rev%05u.dat", nFile)))
+            return error("FinishRecompressedBlockFile() : failed to replace rev%05u.dat", nFile);
+        LogPrintf("FinishRecompressedBlockFile() : finished recompressing block file %d\n", nFile);
+    } else {
+        boost::system::error_code ec;
+        boost::filesystem::remove(pathBlkNew, ec);
+        boost::filesystem::remove(pathRevNew, ec);
+    }
+    return true;
+}
+
+void ThreadRecompressBlockFiles()
+{
+    RenameThread("bitcoin-recompress");
+    int nFile = 0;
+    while (true) {
+        boost::this_thread::interruption_point();
+
+        // Files are only rewritten once the node is synced, as the initial
+        // download and index builds read blocks without holding cs_main
+        int nLast;
+        {
+            LOCK(cs_LastBlockFile);
+            nLast = nLastBlockFile;
+        }
+        if (nFile >= nLast || IsInitialBlockDownload() || IsIndexBuilding(INDEX_BUILD_TX | INDEX_BUILD_ADDRESS | INDEX_BUILD_SPENT)) {
+            MilliSleep(60 * 1000);
+            continue;
+        }
+
+        bool fRecompressed = false;
+        pblocktree->ReadBlockFileRecompressed(nFile, fRecompressed);
+        if (!fRecompressed && !RecompressBlockFile(nFile))
+            LogPrintf("ThreadRecompressBlockFiles() : failed to recompress block file %d\n", nFile);
+        nFile++;
+    }
+}
+
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot)
 {
     // These are checks that are independent of context
@@ -2533,15 +4297,20 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     // Build the merkle tree already. We need it anyway later, and it makes the
     // block cache the transaction hashes, which means they don't need to be
     // recalculated many times during this block's validation.
-    block.BuildMerkleTree();
+    bool fMutated;
+    block.BuildMerkleTree(&fMutated);
 
     // Check for duplicate txids. This is caught by ConnectInputs(),
-    // but catching it earlier avoids a potential DoS attack:
-    set<uint256> uniqueTx;
-    for (unsigned int i = 0; i < block.vtx.size(); i++) {
-        uniqueTx.insert(block.GetTxHash(i));
-    }
-    if (uniqueTx.size() != block.vtx.size())
+    // but catching it earlier avoids a potential DoS attack. Duplicates
+    // that keep the merkle root show as equal siblings in the tree; others
+    // are found in a sorted copy of the txids.
+    bool fDuplicate = fMutated;
+    if (!fDuplicate) {
+        vector<uint256> vTxid(block.vMerkleTree.begin(), block.vMerkleTree.begin() + block.vtx.size());
+        sort(vTxid.begin(), vTxid.end());
+        fDuplicate = (adjacent_find(vTxid.begin(), vTxid.end()) != vTxid.end());
+    }
+    if (fDuplicate)
         return state.DoS(100, error("CheckBlock() : duplicate transaction"),
                          REJECT_INVALID, "bad-txns-duplicate", true);
 
@@ -2562,7 +4331,74 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     return true;
 }
 
-bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
+bool CheckBlockHeaderOnParent(const CBlockHeader& block, CBlockIndex* pindexPrev, CValidationState& state)
+{
+    uint256 hash = block.GetHash();
+    int nHeight = pindexPrev->nHeight + 1;
+
+    // Check count of sequence of the same algorithm
+    if (TestNet() || (nHeight > V3_FORK))
+    {
+        int nAlgo = block.GetAlgo();
+        int nAlgoCount = 1;
+        CBlockIndex* piPrev = pindexPrev;
+        while (piPrev && (nAlgoCount <= MAX_BLOCK_ALGO_COUNT))
+        {
+            if (piPrev->GetAlgo() != nAlgo)
+                break;
+            nAlgoCount++;
+            piPrev = piPrev->pprev;
+        }
+        if (nAlgoCount > MAX_BLOCK_ALGO_COUNT)
+            return state.DoS(100, error("CheckBlockHeaderOnParent() : Too Many Blocks From the Same Algo"), REJECT_INVALID, "algo-toomany");
+    }
+
+    // Check proof of work
+    if (block.nBits != GetNextWorkRequired(pindexPrev, &block, block.GetAlgo()))
+        return state.DoS(100, error("CheckBlockHeaderOnParent() : incorrect proof of work"),
+                         REJECT_INVALID, "bad-diffbits");
+
+    if (TestNet() && block.GetAlgo() != ALGO_SCRYPT)
+        return state.Invalid(error("CheckBlockHeaderOnParent() : incorrect hasing algo, only scrypt accepted until block %u", V3_FORK),
+                             REJECT_INVALID, "bad-hashalgo");
+    else if (!TestNet() && nHeight < V3_FORK && block.GetAlgo() != ALGO_SCRYPT)
+        return state.Invalid(error("CheckBlockHeaderOnParent() : incorrect hasing algo, only scrypt accepted until block %u", V3_FORK),
+                             REJECT_INVALID, "bad-hashalgo");
+
+    // Check timestamp against prev
+    if (block.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+        return state.Invalid(error("CheckBlockHeaderOnParent() : block's timestamp is too early"),
+                             REJECT_INVALID, "time-too-old");
+
+    // Check that the block chain matches the known block chain up to a checkpoint
+    if (!Checkpoints::CheckBlock(nHeight, hash))
+        return state.DoS(100, error("CheckBlockHeaderOnParent() : rejected by checkpoint lock-in at %d", nHeight),
+                         REJECT_CHECKPOINT, "checkpoint mismatch");
+
+    // Don't accept any forks from the main chain prior to last checkpoint
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint();
+    if (pcheckpoint && nHeight < pcheckpoint->nHeight)
+        return state.DoS(100, error("CheckBlockHeaderOnParent() : forked chain older than last checkpoint (height %d)", nHeight));
+
+    return true;
+}
+
+// Announce a block that became the tip, but not old ones during initial block download
+void static RelayTipBlock(const uint256& hash)
+{
+    int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
+    if (chainActive.Tip()->GetBlockHash() == hash)
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate)) {
+                pnode->PushInventory(CInv(MSG_BLOCK, hash));
+                PROPTRACE(PROPTRACE_RELAY, MSG_BLOCK, hash, pnode->GetId());
+            }
+    }
+}
+
+bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp, bool fActivate)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
@@ -2575,53 +4411,19 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
     int nHeight = 0;
     if (hash != Params().HashGenesisBlock()) {
 	// Check Previous Block
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
         if (mi == mapBlockIndex.end())
             return state.DoS(10, error("AcceptBlock() : prev block not found"), 0, "bad-prevblk");
         pindexPrev = (*mi).second;
         nHeight = pindexPrev->nHeight+1;
 
-	// Check count of sequence of the same algorithm
-	if (TestNet() || (nHeight > V3_FORK))
-	{
-		int nAlgo = block.GetAlgo();
-		int nAlgoCount = 1;
-		CBlockIndex* piPrev = pindexPrev;
-		while (piPrev && (nAlgoCount <= MAX_BLOCK_ALGO_COUNT))
-		{
-			if (piPrev->GetAlgo() != nAlgo)
-				break;
-			nAlgoCount++;
-			piPrev = piPrev->pprev;
-		}
-		if (nAlgoCount > MAX_BLOCK_ALGO_COUNT)
-		{
-			return state.DoS(100, error("AcceptBlock() : Too Many Blocks From the Same Algo"), REJECT_INVALID, "algo-toomany");
-		}
-	}
-
         LogPrintf("Checking Block %d with Algo %d \n", nHeight, block.GetAlgo());
         if (block.GetAlgo() == ALGO_SCRYPT)  { LogPrintf("Algo is Scrypt \n ");}
         if (block.GetAlgo() == ALGO_SHA256D) { LogPrintf("Algo is SHA256 \n");}
         if (block.GetAlgo() == ALGO_X11)     { LogPrintf("Algo is X11 \n");}
 
-        // Check proof of work
-        if (block.nBits != GetNextWorkRequired(pindexPrev, &block, block.GetAlgo()))
-            return state.DoS(100, error("AcceptBlock() : incorrect proof of work"),
-                             REJECT_INVALID, "bad-diffbits");
-
-	 if (TestNet() && block.GetAlgo() != ALGO_SCRYPT )
-            return state.Invalid(error("AcceptBlock() : incorrect hasing algo, only scrypt accepted until block %u", V3_FORK),
-			    REJECT_INVALID, "bad-hashalgo");
-
-	 else if(!TestNet() && nHeight < V3_FORK && block.GetAlgo() != ALGO_SCRYPT)
-               return state.Invalid(error("AcceptBlock() : incorrect hasing algo, only scrypt accepted until block %u", V3_FORK),
-                           REJECT_INVALID, "bad-hashalgo");
-
-        // Check timestamp against prev
-        if (block.GetBlockTime() <= pindexPrev->GetMedianTimePast())
-            return state.Invalid(error("AcceptBlock() : block's timestamp is too early"),
-                                 REJECT_INVALID, "time-too-old");
+        if (!CheckBlockHeaderOnParent(block, pindexPrev, state))
+            return error("AcceptBlock() : CheckBlockHeaderOnParent FAILED");
 
         // Check that all transactions are finalized
         BOOST_FOREACH(const CTransaction& tx, block.vtx)
@@ -2629,16 +4431,6 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
                 return state.DoS(10, error("AcceptBlock() : contains a non-final transaction"),
                                  REJECT_INVALID, "bad-txns-nonfinal");
 
-        // Check that the block chain matches the known block chain up to a checkpoint
-        if (!Checkpoints::CheckBlock(nHeight, hash))
-            return state.DoS(100, error("AcceptBlock() : rejected by checkpoint lock-in at %d", nHeight),
-                             REJECT_CHECKPOINT, "checkpoint mismatch");
-
-        // Don't accept any forks from the main chain prior to last checkpoint
-        CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
-        if (pcheckpoint && nHeight < pcheckpoint->nHeight)
-            return state.DoS(100, error("AcceptBlock() : forked chain older than last checkpoint (height %d)", nHeight));
-
 	/* Multi Algo uses a custom block version number to identify the algorithm, therefore the V2 block version rule cannot apply
 
         // Reject block.nVersion=1 blocks when 95% (75% on testnet) of the network has upgraded:
@@ -2671,31 +4463,30 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
 
     // Write block to history file
     try {
-        unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
         CDiskBlockPos blockPos;
-        if (dbp != NULL)
+        if (dbp != NULL) {
+            // A block found by -reindex takes the space of its record, which
+            // may be compressed
             blockPos = *dbp;
-        if (!FindBlockPos(state, blockPos, nBlockSize+8, nHeight, block.nTime, dbp != NULL))
-            return error("AcceptBlock() : FindBlockPos failed");
-        if (dbp == NULL)
-            if (!WriteBlockToDisk(block, blockPos))
-                return state.Abort(_("Failed to write block"));
-        if (!AddToBlockIndex(block, state, blockPos))
-            return error("AcceptBlock() : AddToBlockIndex failed");
-    } catch(std::runtime_error &e) {
-        return state.Abort(_("System error: ") + e.what());
-    }
-
-    // Relay inventory, but don't relay old inventory during initial block download
-    int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
-    if (chainActive.Tip()->GetBlockHash() == hash)
-    {
-        LOCK(cs_vNodes);
-        BOOST_FOREACH(CNode* pnode, vNodes)
-            if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                pnode->PushInventory(CInv(MSG_BLOCK, hash));
+            unsigned int nDiskSize;
+            if (!GetBlockRecordSize(blockPos, nDiskSize))
+                return error("AcceptBlock() : no block record at %d:%u", blockPos.nFile, blockPos.nPos);
+            if (!FindBlockPos(state, blockPos, nDiskSize, nHeight, block.nTime, true))
+                return error("AcceptBlock() : FindBlockPos failed");
+        } else {
+            CDiskRecord record(block, nBlockCompression);
+            if (!FindBlockPos(state, blockPos, record.GetDiskSize(), nHeight, block.nTime))
+                return error("AcceptBlock() : FindBlockPos failed");
+            if (!WriteBlockToDisk(record, blockPos))
+                return state.Abort(_("Failed to write block"));
+        }
+        if (!AddToBlockIndex(block, state, blockPos, fActivate))
+            return error("AcceptBlock() : AddToBlockIndex failed");
+    } catch(std::runtime_error &e) {
+        return state.Abort(_("System error: ") + e.what());
     }
 
+    RelayTipBlock(hash);
     return true;
 }
 
@@ -2737,7 +4528,7 @@ void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
     pnode->PushMessage("getblocks", chainActive.GetLocator(pindexBegin), hashEnd);
 }
 
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp, bool fChecked)
 {
     AssertLockHeld(cs_main);
 
@@ -2748,11 +4539,12 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
     if (mapOrphanBlocks.count(hash))
         return state.Invalid(error("ProcessBlock() : already have block (orphan) %s", hash.ToString()), 0, "duplicate");
 
-    // Preliminary checks
-    if (!CheckBlock(*pblock, state))
+    // Preliminary checks; headers-first sync has already checked the proof of work
+    bool fHeaderVerified = setHeadersVerified.count(hash) > 0;
+    if (!fChecked && !CheckBlock(*pblock, state, !fHeaderVerified))
         return error("ProcessBlock() : CheckBlock FAILED");
 
-    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint();
     if (pcheckpoint && pblock->hashPrevBlock != (chainActive.Tip() ? chainActive.Tip()->GetBlockHash() : uint256(0)))
     {
         // Extra checks to prevent "fill up memory by spamming with bogus blocks"
@@ -2762,9 +4554,9 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
             return state.DoS(100, error("ProcessBlock() : block with timestamp before last checkpoint"),
                              REJECT_CHECKPOINT, "time-too-old");
         }
-        CBigNum bnNewBlock;
+        uint256 bnNewBlock;
         bnNewBlock.SetCompact(pblock->nBits);
-        CBigNum bnRequired;
+        uint256 bnRequired;
         bnRequired.SetCompact(ComputeMinWork(pcheckpoint->nBits, deltaTime));
         if (bnNewBlock > bnRequired)
         {
@@ -2783,18 +4575,19 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
         if (pfrom) {
             PruneOrphanBlocks();
             COrphanBlock* pblock2 = new COrphanBlock();
-            {
-                CDataStream ss(SER_DISK, CLIENT_VERSION);
-                ss << *pblock;
-                pblock2->vchBlock = std::vector<unsigned char>(ss.begin(), ss.end());
-            }
             pblock2->hashBlock = hash;
             pblock2->hashPrev = pblock->hashPrevBlock;
+            if (!StoreOrphanBlock(pblock2, *pblock)) {
+                delete pblock2;
+                return true;
+            }
             mapOrphanBlocks.insert(make_pair(hash, pblock2));
             mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrev, pblock2));
 
-            // Ask this guy to fill in what we're missing
-            PushGetBlocks(pfrom, chainActive.Tip(), GetOrphanRoot(hash));
+            // Ask this guy to fill in what we're missing, unless the parents
+            // are already being fetched by headers-first sync
+            if (!fHeaderVerified)
+                PushGetBlocks(pfrom, chainActive.Tip(), GetOrphanRoot(hash));
         }
         return true;
     }
@@ -2802,10 +4595,14 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
     // Store to disk
     if (!AcceptBlock(*pblock, state, dbp))
         return error("ProcessBlock() : AcceptBlock FAILED");
+    PROPTRACE(PROPTRACE_VALIDATE, MSG_BLOCK, hash, pfrom ? pfrom->GetId() : -1);
 
-    // Recursively process any orphan blocks that depended on this one
+    // Process any orphan blocks that depended on this one, adding the whole
+    // tree of them to the block index before switching the chain once
     vector<uint256> vWorkQueue;
     vWorkQueue.push_back(hash);
+    CBlockIndex* pindexLast = NULL;
+    uint256 hashLastCoinBase;
     for (unsigned int i = 0; i < vWorkQueue.size(); i++)
     {
         uint256 hashPrev = vWorkQueue[i];
@@ -2814,20 +4611,27 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
              ++mi)
         {
             CBlock block;
-            {
-                CDataStream ss(mi->second->vchBlock, SER_DISK, CLIENT_VERSION);
-                ss >> block;
+            if (ReadOrphanBlock(mi->second, block)) {
+                block.BuildMerkleTree();
+                // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan resolution (that is, feeding people an invalid block based on LegitBlockX in order to get anyone relaying LegitBlockX banned)
+                CValidationState stateDummy;
+                if (AcceptBlock(block, stateDummy, NULL, false)) {
+                    PROPTRACE(PROPTRACE_VALIDATE, MSG_BLOCK, mi->second->hashBlock, -1);
+                    vWorkQueue.push_back(mi->second->hashBlock);
+                    pindexLast = mapBlockIndex[mi->second->hashBlock];
+                    hashLastCoinBase = block.GetTxHash(0);
+                }
             }
-            block.BuildMerkleTree();
-            // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan resolution (that is, feeding people an invalid block based on LegitBlockX in order to get anyone relaying LegitBlockX banned)
-            CValidationState stateDummy;
-            if (AcceptBlock(block, stateDummy))
-                vWorkQueue.push_back(mi->second->hashBlock);
-            mapOrphanBlocks.erase(mi->second->hashBlock);
-            delete mi->second;
+            EraseOrphanBlock(mi->second);
         }
         mapOrphanBlocksByPrev.erase(hashPrev);
     }
+    if (pindexLast) {
+        // An invalid orphan is marked as such, and does not fail this block
+        CValidationState stateDummy;
+        if (ActivateNewBlocks(stateDummy, pindexLast, hashLastCoinBase))
+            RelayTipBlock(chainActive.Tip()->GetBlockHash());
+    }
 
     LogPrintf("ProcessBlock: ACCEPTED\n");
     return true;
@@ -2842,6 +4646,38 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
 
 CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
 {
+    vector<CBloomTxElements> vElements;
+    vElements.reserve(block.vtx.size());
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        vElements.push_back(CBloomTxElements(tx, tx.GetHash()));
+    Build(block, filter, vElements);
+}
+
+CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter, const vector<CBloomTxElements>& vElements)
+{
+    Build(block, filter, vElements);
+}
+
+CMerkleBlock::CMerkleBlock(const CBlockHeader& headerIn, const vector<uint256>& vTxid, const set<uint256>& setTxids)
+{
+    header = headerIn;
+
+    vector<bool> vMatch;
+    vMatch.reserve(vTxid.size());
+    for (unsigned int i = 0; i < vTxid.size(); i++)
+    {
+        bool fMatch = setTxids.count(vTxid[i]) > 0;
+        if (fMatch)
+            vMatchedTxn.push_back(make_pair(i, vTxid[i]));
+        vMatch.push_back(fMatch);
+    }
+
+    txn = CPartialMerkleTree(vTxid, vMatch);
+}
+
+void CMerkleBlock::Build(const CBlock& block, CBloomFilter& filter, const vector<CBloomTxElements>& vElements)
+{
+    assert(vElements.size() == block.vtx.size());
     header = block.GetBlockHeader();
 
     vector<bool> vMatch;
@@ -2852,8 +4688,8 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
 
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
-        uint256 hash = block.vtx[i].GetHash();
-        if (filter.IsRelevantAndUpdate(block.vtx[i], hash))
+        const uint256& hash = vElements[i].hash;
+        if (filter.IsRelevantAndUpdate(vElements[i]))
         {
             vMatch.push_back(true);
             vMatchedTxn.push_back(make_pair(i, hash));
@@ -2873,24 +4709,15 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
 
 
 
-uint256 CPartialMerkleTree::CalcHash(int height, unsigned int pos, const std::vector<uint256> &vTxid) {
-    if (height == 0) {
-        // hash at height 0 is the txids themself
-        return vTxid[pos];
-    } else {
-        // calculate left hash
-        uint256 left = CalcHash(height-1, pos*2, vTxid), right;
-        // calculate right hash if not beyong the end of the array - copy left hash otherwise1
-        if (pos*2+1 < CalcTreeWidth(height-1))
-            right = CalcHash(height-1, pos*2+1, vTxid);
-        else
-            right = left;
-        // combine subhashes
-        return Hash(BEGIN(left), END(left), BEGIN(right), END(right));
-    }
+uint256 CPartialMerkleTree::CalcHash(int height, unsigned int pos, const std::vector<uint256> &vTree) {
+    // the levels are stored one after another, starting with the txids
+    unsigned int nOffset = 0;
+    for (int h = 0; h < height; h++)
+        nOffset += CalcTreeWidth(h);
+    return vTree[nOffset + pos];
 }
 
-void CPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch) {
+void CPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vTree, const std::vector<bool> &vMatch) {
     // determine whether this node is the parent of at least one matched txid
     bool fParentOfMatch = false;
     for (unsigned int p = pos << height; p < (pos+1) << height && p < nTransactions; p++)
@@ -2899,12 +4726,12 @@ void CPartialMerkleTree::TraverseAndBuild(int height, unsigned int pos, const st
     vBits.push_back(fParentOfMatch);
     if (height==0 || !fParentOfMatch) {
         // if at height 0, or nothing interesting below, store hash and stop
-        vHash.push_back(CalcHash(height, pos, vTxid));
+        vHash.push_back(CalcHash(height, pos, vTree));
     } else {
         // otherwise, don't store any hash, but descend into the subtrees
-        TraverseAndBuild(height-1, pos*2, vTxid, vMatch);
+        TraverseAndBuild(height-1, pos*2, vTree, vMatch);
         if (pos*2+1 < CalcTreeWidth(height-1))
-            TraverseAndBuild(height-1, pos*2+1, vTxid, vMatch);
+            TraverseAndBuild(height-1, pos*2+1, vTree, vMatch);
     }
 }
 
@@ -2948,8 +4775,13 @@ CPartialMerkleTree::CPartialMerkleTree(const std::vector<uint256> &vTxid, const
     while (CalcTreeWidth(nHeight) > 1)
         nHeight++;
 
+    // hash the whole tree once, level by level, rather than the subtree
+    // under each node stored
+    std::vector<uint256> vTree(vTxid);
+    BuildMerkleTreeLevels(vTree);
+
     // traverse the partial tree
-    TraverseAndBuild(nHeight, 0, vTxid, vMatch);
+    TraverseAndBuild(nHeight, 0, vTree, vMatch);
 }
 
 CPartialMerkleTree::CPartialMerkleTree() : nTransactions(0), fBad(true) {}
@@ -3049,14 +4881,13 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = blockIndexArena.Allocate();
+    LOCK(cs_chainview);
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
@@ -3070,32 +4901,58 @@ bool static LoadBlockIndexDB()
 
     boost::this_thread::interruption_point();
 
-    // Calculate nChainWork
+    // Calculate the ancestor links, and nChainWork where it was not stored, parents first
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    for (BlockMap::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); ++it)
     {
-        CBlockIndex* pindex = item.second;
+        CBlockIndex* pindex = it->second;
         vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
     }
     sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    vector<CBlockIndex*> vWorkAdded;
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWorkAdjusted().getuint256();
+        SetAncestorLinks(pindex);
+        UpdateChainTips(pindex);
+        // Entries written before BLOCK_POW_CHECKED existed were checked on acceptance too
+        if (pindex->nStatus & BLOCK_HAVE_DATA)
+            pindex->nStatus |= BLOCK_POW_CHECKED;
+        if (!(pindex->nStatus & BLOCK_HAVE_WORK)) {
+            pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWorkAdjusted();
+            pindex->nStatus |= BLOCK_HAVE_WORK;
+            vWorkAdded.push_back(pindex);
+        }
         pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
-        if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
+        // Pruned blocks can no longer be connected
+        if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK) && (pindex->nStatus & BLOCK_HAVE_DATA))
             setBlockIndexValid.insert(pindex);
         if (pindex->nStatus & BLOCK_FAILED_MASK && (!pindexBestInvalid || pindex->nChainWork > pindexBestInvalid->nChainWork))
             pindexBestInvalid = pindex;
     }
 
+    // Store the work that had to be computed, so that the next start need not
+    for (size_t i = 0; i < vWorkAdded.size(); i += BLOCK_INDEX_WRITE_BATCH) {
+        size_t nEnd = std::min(i + BLOCK_INDEX_WRITE_BATCH, vWorkAdded.size());
+        vector<CBlockIndex*> vBatch(vWorkAdded.begin() + i, vWorkAdded.begin() + nEnd);
+        if (!pblocktree->WriteBlockIndexes(vBatch))
+            return error("LoadBlockIndexDB() : failed to store the chain work of the block index");
+    }
+    if (!vWorkAdded.empty())
+        LogPrintf("LoadBlockIndexDB(): stored the chain work of %u block index entries\n", vWorkAdded.size());
+
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
     LogPrintf("LoadBlockIndexDB(): last block file = %i\n", nLastBlockFile);
     if (pblocktree->ReadBlockFileInfo(nLastBlockFile, infoLastBlockFile))
         LogPrintf("LoadBlockIndexDB(): last block file info: %s\n", infoLastBlockFile.ToString());
 
+    // Block files being recompressed when the node stopped
+    for (int nFile = 0; nFile < nLastBlockFile; nFile++)
+        if (!FinishRecompressedBlockFile(nFile))
+            return false;
+
     // Check whether we need to continue reindexing
     bool fReindexing = false;
     pblocktree->ReadReindexing(fReindexing);
@@ -3105,11 +4962,31 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("txindex", fTxIndex);
     LogPrintf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
 
+    // Check whether we have a block filter index
+    pblocktree->ReadFlag("blockfilterindex", fBlockFilterIndex);
+    LogPrintf("LoadBlockIndexDB(): block filter index %s\n", fBlockFilterIndex ? "enabled" : "disabled");
+
+    // Check whether we have an address index
+    pblocktree->ReadFlag("addressindex", fAddressIndex);
+    LogPrintf("LoadBlockIndexDB(): address index %s\n", fAddressIndex ? "enabled" : "disabled");
+
+    // Check whether we have a spent index
+    pblocktree->ReadFlag("spentindex", fSpentIndex);
+    LogPrintf("LoadBlockIndexDB(): spent index %s\n", fSpentIndex ? "enabled" : "disabled");
+
+    // Check whether block files were ever pruned
+    pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
+    if (fHavePruned)
+        LogPrintf("LoadBlockIndexDB(): block files were pruned, some blocks are missing\n");
+
     // Load pointer to end of best chain
-    std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
+    BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
         return true;
-    chainActive.SetTip(it->second);
+    {
+        LOCK(cs_chainview);
+        chainActive.SetTip(it->second);
+    }
     LogPrintf("LoadBlockIndexDB(): hashBestChain=%s height=%d date=%s progress=%f\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(),
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
@@ -3118,50 +4995,66 @@ bool static LoadBlockIndexDB()
     return true;
 }
 
-bool VerifyDB(int nCheckLevel, int nCheckDepth)
+// Verify the blocks up to nCheckDepth below pindexTip against viewBase, the
+// coins as of pindexTip. In the background the view is a database snapshot of
+// its own and cs_main is not held: level 3 is bounded by the memory of the
+// view alone, level 4 takes cs_main per block and only checks, and blocks
+// pruned meanwhile end the check rather than fail it.
+static bool VerifyDBFrom(CCoinsView& viewBase, CBlockIndex* pindexTip, int nCheckLevel, int nCheckDepth, bool fBackground)
 {
-    LOCK(cs_main);
-    if (chainActive.Tip() == NULL || chainActive.Tip()->pprev == NULL)
+    if (pindexTip == NULL || pindexTip->pprev == NULL)
         return true;
 
     // Verify blocks in the best chain
     if (nCheckDepth <= 0)
         nCheckDepth = 1000000000; // suffices until the year 19000
-    if (nCheckDepth > chainActive.Height())
-        nCheckDepth = chainActive.Height();
+    if (nCheckDepth > pindexTip->nHeight)
+        nCheckDepth = pindexTip->nHeight;
     nCheckLevel = std::max(0, std::min(4, nCheckLevel));
-    LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
-    CCoinsViewCache coins(*pcoinsTip, true);
-    CBlockIndex* pindexState = chainActive.Tip();
+    LogPrintf("Verifying last %i blocks at level %i%s\n", nCheckDepth, nCheckLevel, fBackground ? " in the background" : "");
+    CCoinsViewCache coins(viewBase, true);
+    CBlockIndex* pindexState = pindexTip;
     CBlockIndex* pindexFailure = NULL;
     int nGoodTransactions = 0;
     CValidationState state;
-    for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->pprev; pindex = pindex->pprev)
+    for (CBlockIndex* pindex = pindexTip; pindex && pindex->pprev; pindex = pindex->pprev)
     {
         boost::this_thread::interruption_point();
-        if (pindex->nHeight < chainActive.Height()-nCheckDepth)
+        if (pindex->nHeight < pindexTip->nHeight-nCheckDepth)
+            break;
+        if (fHavePruned && !(pindex->nStatus & BLOCK_HAVE_DATA))
             break;
         CBlock block;
         // check level 0: read from disk
-        if (!ReadBlockFromDisk(block, pindex))
+        if (!ReadBlockFromDisk(block, pindex)) {
+            if (fBackground && !(pindex->nStatus & BLOCK_HAVE_DATA))
+                break;
             return error("VerifyDB() : *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+        }
         // check level 1: verify block validity
-        if (nCheckLevel >= 1 && !CheckBlock(block, state))
+        if (nCheckLevel >= 1 && !CheckBlock(block, state, !(pindex->nStatus & BLOCK_POW_CHECKED)))
             return error("VerifyDB() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
         // check level 2: verify undo validity
         if (nCheckLevel >= 2 && pindex) {
             CBlockUndo undo;
             CDiskBlockPos pos = pindex->GetUndoPos();
             if (!pos.IsNull()) {
-                if (!undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+                if (!undo.ReadFromDisk(pos, pindex->pprev->GetBlockHash())) {
+                    if (fBackground && !(pindex->nStatus & BLOCK_HAVE_UNDO))
+                        break;
                     return error("VerifyDB() : *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+                }
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= 2*nCoinCacheSize + 32000) {
+        size_t nMemoryUsage = coins.DynamicMemoryUsage() + (fBackground ? 0 : pcoinsTip->DynamicMemoryUsage());
+        if (nCheckLevel >= 3 && pindex == pindexState && nMemoryUsage <= nCoinCacheUsage) {
             bool fClean = true;
-            if (!DisconnectBlock(block, state, pindex, coins, &fClean))
+            if (!DisconnectBlock(block, state, pindex, coins, &fClean)) {
+                if (fBackground && !(pindex->nStatus & BLOCK_HAVE_UNDO))
+                    break;
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+            }
             pindexState = pindex->pprev;
             if (!fClean) {
                 nGoodTransactions = 0;
@@ -3171,32 +5064,187 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
         }
     }
     if (pindexFailure)
-        return error("VerifyDB() : *** coin database inconsistencies found (last %i blocks, %i good transactions before that)\n", chainActive.Height() - pindexFailure->nHeight + 1, nGoodTransactions);
+        return error("VerifyDB() : *** coin database inconsistencies found (last %i blocks, %i good transactions before that)\n", pindexTip->nHeight - pindexFailure->nHeight + 1, nGoodTransactions);
 
     // check level 4: try reconnecting blocks
     if (nCheckLevel >= 4) {
         CBlockIndex *pindex = pindexState;
-        while (pindex != chainActive.Tip()) {
+        while (pindex != pindexTip) {
             boost::this_thread::interruption_point();
-            pindex = chainActive.Next(pindex);
+            pindex = pindexTip->GetAncestor(pindex->nHeight + 1);
             CBlock block;
             if (!ReadBlockFromDisk(block, pindex))
                 return error("VerifyDB() : *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
-            if (!ConnectBlock(block, state, pindex, coins))
+            LOCK(cs_main);
+            if (!ConnectBlock(block, state, pindex, coins, fBackground))
                 return error("VerifyDB() : *** found unconnectable block at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+            // a block only checked is not applied to the view
+            if (fBackground)
+                coins.SetBestBlock(pindex->GetBlockHash());
         }
     }
 
-    LogPrintf("No coin database inconsistencies in last %i blocks (%i transactions)\n", chainActive.Height() - pindexState->nHeight, nGoodTransactions);
+    LogPrintf("No coin database inconsistencies in last %i blocks (%i transactions)\n", pindexTip->nHeight - pindexState->nHeight, nGoodTransactions);
+
+    return true;
+}
+
+bool VerifyDB(int nCheckLevel, int nCheckDepth)
+{
+    LOCK(cs_main);
+    return VerifyDBFrom(*pcoinsTip, chainActive.Tip(), nCheckLevel, nCheckDepth, false);
+}
+
+bool VerifyDBBackground(int nCheckLevel, int nCheckDepth)
+{
+    // The coins as of the block the database is at, whatever the node
+    // connects meanwhile
+    CCoinsViewDBSnapshot viewSnapshot(*pcoinsdbview);
+    CBlockIndex* pindexTip = NULL;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(viewSnapshot.GetBestBlock());
+        if (mi != mapBlockIndex.end())
+            pindexTip = mi->second;
+    }
+    if (pindexTip == NULL)
+        return true;
+    return VerifyDBFrom(viewSnapshot, pindexTip, nCheckLevel, nCheckDepth, true);
+}
+
+// Index in vStats of the difficulty rules period a height belongs to
+static unsigned int GetReplayPeriod(int nHeight, std::vector<CBlockReplayStats> &vStats)
+{
+    int nRulesHeight = 0;
+    if (nHeight >= V3_FORK)
+        nRulesHeight = V3_FORK;
+    else if (nHeight >= DIFF2_SWITCH_HEIGHT)
+        nRulesHeight = DIFF2_SWITCH_HEIGHT;
+    else if (nHeight >= DIFF_SWITCH_HEIGHT)
+        nRulesHeight = DIFF_SWITCH_HEIGHT;
+    if (vStats.empty() || vStats.back().nRulesHeight != nRulesHeight) {
+        vStats.push_back(CBlockReplayStats());
+        vStats.back().nRulesHeight = nRulesHeight;
+        vStats.back().nFirstHeight = nHeight;
+    }
+    return vStats.size() - 1;
+}
+
+// Connect one block of ReplayBlocks the way ConnectTip does, into a view on
+// top of coins, appending its undo data to fileUndo instead of the rev files.
+static bool ReplayConnectBlock(CBlockIndex *pindex, CCoinsViewCache &coins, CAutoFile &fileUndo, CBlockReplayStats &stats)
+{
+    CBlockConnectTimings &timings = stats.timings;
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex))
+        return error("ReplayBlocks() : *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+    // The block's own undo data is what connecting it produces again
+    CBlockUndo blockundo;
+    if (!blockundo.ReadFromDisk(pindex->GetUndoPos(), pindex->pprev->GetBlockHash()))
+        return error("ReplayBlocks() : *** failure reading undo data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
 
+    CValidationState state;
+    CCoinsViewCache view(coins, true);
+    int64_t nStart = GetTimeMicros();
+    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn &txin, tx.vin)
+            view.HaveCoin(txin.prevout);
+        stats.nInputs += tx.vin.size();
+    }
+    timings.nFetch += GetTimeMicros() - nStart;
+
+    if (!ConnectBlock(block, state, pindex, view, true, &timings))
+        return error("ReplayBlocks() : *** ConnectBlock %s failed", pindex->GetBlockHash().ToString());
+    view.SetBestBlock(pindex->GetBlockHash());
+
+    nStart = GetTimeMicros();
+    CDiskBlockPos pos;
+    CDiskRecord record(blockundo, nBlockCompression);
+    if (!blockundo.WriteToFile(fileUndo, record, pos, pindex->pprev->GetBlockHash(), true))
+        return error("ReplayBlocks() : failed to write undo data");
+    int64_t nFlushStart = GetTimeMicros();
+    timings.nUndo += nFlushStart - nStart;
+
+    assert(view.Flush());
+    timings.nFlush += GetTimeMicros() - nFlushStart;
     return true;
 }
 
+bool ReplayBlocks(int nBlocks, std::vector<CBlockReplayStats> &vStats)
+{
+    LOCK(cs_main);
+    vStats.clear();
+    if (chainActive.Tip() == NULL || chainActive.Tip()->pprev == NULL)
+        return true;
+
+    if (nBlocks <= 0 || nBlocks > chainActive.Height())
+        nBlocks = chainActive.Height();
+    LogPrintf("Replaying last %i blocks\n", nBlocks);
+
+    // Nothing of the replay reaches pcoinsTip or the databases: all changes
+    // are made in this view, which is thrown away at the end.
+    CCoinsViewCache coins(*pcoinsTip, true);
+    CValidationState state;
+    std::vector<CBlockIndex*> vBlocks;
+    std::vector<int64_t> vDisconnect;
+    for (CBlockIndex* pindex = chainActive.Tip(); pindex->pprev && (int)vBlocks.size() < nBlocks; pindex = pindex->pprev)
+    {
+        boost::this_thread::interruption_point();
+        if (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage) {
+            LogPrintf("ReplayBlocks() : coins cache full after %u blocks\n", (unsigned int)vBlocks.size());
+            break;
+        }
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex))
+            return error("ReplayBlocks() : *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+        int64_t nStart = GetTimeMicros();
+        {
+            CCoinsViewCache view(coins, true);
+            if (!DisconnectBlock(block, state, pindex, view))
+                return error("ReplayBlocks() : *** DisconnectBlock %s failed", pindex->GetBlockHash().ToString());
+            assert(view.Flush());
+        }
+        vDisconnect.push_back(GetTimeMicros() - nStart);
+        vBlocks.push_back(pindex);
+    }
+
+    boost::filesystem::path pathUndo = GetDataDir() / "replay.tmp";
+    CAutoFile fileUndo(fopen(pathUndo.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (!fileUndo)
+        return error("ReplayBlocks() : cannot create %s", pathUndo.string());
+
+    bool fOk = true;
+    for (int i = vBlocks.size() - 1; i >= 0; i--) {
+        boost::this_thread::interruption_point();
+        CBlockIndex *pindex = vBlocks[i];
+        CBlockReplayStats &stats = vStats[GetReplayPeriod(pindex->nHeight, vStats)];
+        if (!ReplayConnectBlock(pindex, coins, fileUndo, stats)) {
+            fOk = false;
+            break;
+        }
+        stats.nLastHeight = pindex->nHeight;
+        stats.nBlocks++;
+        stats.nTransactions += pindex->nTx;
+        stats.nDisconnect += vDisconnect[i];
+    }
+    fileUndo.fclose();
+    boost::filesystem::remove(pathUndo);
+    return fOk;
+}
+
 void UnloadBlockIndex()
 {
-    mapBlockIndex.clear();
+    {
+        LOCK(cs_chainview);
+        mapBlockIndex.clear();
+        chainActive.SetTip(NULL);
+    }
+    blockIndexArena.Clear();
     setBlockIndexValid.clear();
-    chainActive.SetTip(NULL);
+    setChainTips.clear();
+    chainMostWork.SetTip(NULL);
     pindexBestInvalid = NULL;
 }
 
@@ -3218,6 +5266,12 @@ bool InitBlockIndex() {
     // Use the provided setting for -txindex in the new database
     fTxIndex = GetBoolArg("-txindex", false);
     pblocktree->WriteFlag("txindex", fTxIndex);
+    fBlockFilterIndex = GetBoolArg("-blockfilterindex", false);
+    pblocktree->WriteFlag("blockfilterindex", fBlockFilterIndex);
+    fAddressIndex = GetBoolArg("-addressindex", false);
+    pblocktree->WriteFlag("addressindex", fAddressIndex);
+    fSpentIndex = GetBoolArg("-spentindex", false);
+    pblocktree->WriteFlag("spentindex", fSpentIndex);
     LogPrintf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -3225,12 +5279,12 @@ bool InitBlockIndex() {
         try {
             CBlock &block = const_cast<CBlock&>(Params().GenesisBlock());
             // Start new block file
-            unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+            CDiskRecord record(block, nBlockCompression);
             CDiskBlockPos blockPos;
             CValidationState state;
-            if (!FindBlockPos(state, blockPos, nBlockSize+8, 0, block.nTime))
+            if (!FindBlockPos(state, blockPos, record.GetDiskSize(), 0, block.nTime))
                 return error("LoadBlockIndex() : FindBlockPos failed");
-            if (!WriteBlockToDisk(block, blockPos))
+            if (!WriteBlockToDisk(record, blockPos))
                 return error("LoadBlockIndex() : writing genesis block to disk failed");
             if (!AddToBlockIndex(block, state, blockPos))
                 return error("LoadBlockIndex() : genesis block not accepted");
@@ -3249,7 +5303,7 @@ void PrintBlockTree()
     AssertLockHeld(cs_main);
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -3330,6 +5384,8 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
             }
         }
         uint64_t nRewind = blkdat.GetPos();
+        // Reused for every block, which is gone by the time of the next
+        CDeserializeArena arena;
         while (blkdat.good() && !blkdat.eof()) {
             boost::this_thread::interruption_point();
 
@@ -3337,6 +5393,7 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
             nRewind++; // start one byte further next time, in case of failure
             blkdat.SetLimit(); // remove former limit
             unsigned int nSize = 0;
+            bool fCompressed = false;
             try {
                 // locate a header
                 unsigned char buf[MESSAGE_START_SIZE];
@@ -3347,7 +5404,9 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                     continue;
                 // read size
                 blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                fCompressed = (nSize & DISK_RECORD_COMPRESSED) != 0;
+                nSize &= ~DISK_RECORD_COMPRESSED;
+                if (nSize < (fCompressed ? 1 : 80) || nSize > MAX_BLOCK_SIZE)
                     continue;
             } catch (std::exception &e) {
                 // no valid block header found; don't complain
@@ -3357,8 +5416,21 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                 // read block
                 uint64_t nBlockPos = blkdat.GetPos();
                 blkdat.SetLimit(nBlockPos + nSize);
+                arena.Reset();
                 CBlock block;
-                blkdat >> block;
+                {
+                    CDeserializeArena::Scope scope(arena);
+                    if (fCompressed) {
+                        std::vector<char> vchRecord(nSize), vchBlock;
+                        blkdat.read(&vchRecord[0], nSize);
+                        if (!DecompressDiskRecord(&vchRecord[0], nSize, vchBlock) || vchBlock.size() < 80)
+                            throw std::runtime_error("invalid compressed block");
+                        CSpanReader ssBlock(&vchBlock[0], &vchBlock[0] + vchBlock.size(), SER_DISK, CLIENT_VERSION);
+                        ssBlock >> block;
+                    } else {
+                        blkdat >> block;
+                    }
+                }
                 nRewind = blkdat.GetPos();
 
                 // process block
@@ -3470,10 +5542,21 @@ bool static AlreadyHave(const CInv& inv)
     {
     case MSG_TX:
         {
+            // A rejection may be down to the chain state, so it only
+            // stands until the tip changes
+            if (chainActive.Tip() && chainActive.Tip()->GetBlockHash() != hashRecentRejectsChainTip) {
+                hashRecentRejectsChainTip = chainActive.Tip()->GetBlockHash();
+                recentRejects.reset();
+            }
+            if (recentRejects.contains(inv.hash) || recentConfirmed.contains(inv.hash))
+                return true;
             bool txInMap = false;
             txInMap = mempool.exists(inv.hash);
+            // Only the first two outputs are probed; nearly every confirmed
+            // transaction still has one of them unspent in the cache.
             return txInMap || mapOrphanTransactions.count(inv.hash) ||
-                pcoinsTip->HaveCoins(inv.hash);
+                pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) ||
+                pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
         }
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash) ||
@@ -3484,6 +5567,150 @@ bool static AlreadyHave(const CInv& inv)
 }
 
 
+// Deserialize a block from its stored bytes
+bool static ReadBlockFromRaw(CBlock& block, const CRawBlock& raw)
+{
+    try {
+        CSpanReader ssBlock(raw.begin(), raw.end(), SER_NETWORK, PROTOCOL_VERSION);
+        ssBlock >> block;
+    }
+    catch (std::exception &e) {
+        return error("%s : Deserialize error - %s", __func__, e.what());
+    }
+    return true;
+}
+
+// Offsets of the transactions within the serialized block, followed by its size
+void static GetTxOffsets(const CBlock& block, std::vector<unsigned int>& vOffsets)
+{
+    unsigned int nOffset = ::GetSerializeSize(*(CBlockHeader*)&block, SER_NETWORK, PROTOCOL_VERSION) + GetSizeOfCompactSize(block.vtx.size());
+    vOffsets.clear();
+    vOffsets.reserve(block.vtx.size() + 1);
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        vOffsets.push_back(nOffset);
+        nOffset += ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    }
+    vOffsets.push_back(nOffset);
+}
+
+// Recently served blocks as finished messages, newest last. A new block is
+// requested by most peers right after it is announced, and with several algos
+// more than one can be in demand at once; each is serialized and hashed once.
+// Protected by cs_main.
+static const unsigned int MAX_BLOCK_MESSAGE_CACHE = 4;
+static deque<pair<uint256, CSharedMessage> > vBlockMessageCache;
+
+static CSharedMessage GetBlockMessage(CBlockIndex* pindex)
+{
+    const uint256 hash = pindex->GetBlockHash();
+    for (deque<pair<uint256, CSharedMessage> >::iterator it = vBlockMessageCache.begin(); it != vBlockMessageCache.end(); it++)
+        if (it->first == hash)
+            return it->second;
+
+    // Send block from disk, as stored there if possible:
+    // the disk and network serializations are the same
+    CSharedMessage pmsg;
+    CRawBlock raw;
+    if (ReadRawBlockFromDisk(raw, pindex))
+        pmsg = CNode::MakeSharedMessage("block", raw.begin(), raw.size());
+    else
+    {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex))
+            return pmsg;
+        pmsg = CNode::MakeSharedMessage("block", block);
+    }
+
+    vBlockMessageCache.push_back(make_pair(hash, pmsg));
+    if (vBlockMessageCache.size() > MAX_BLOCK_MESSAGE_CACHE)
+        vBlockMessageCache.pop_front();
+    return pmsg;
+}
+
+// The last compact block served. Its short ids are keyed by a random nonce,
+// so one encoding is shared by every peer. Protected by cs_main.
+static uint256 hashCompactBlockMessage;
+static CSharedMessage pCompactBlockMessage;
+
+static CSharedMessage GetCompactBlockMessage(CBlockIndex* pindex)
+{
+    if (pCompactBlockMessage && hashCompactBlockMessage == pindex->GetBlockHash())
+        return pCompactBlockMessage;
+
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex))
+        return CSharedMessage();
+    pCompactBlockMessage = CNode::MakeSharedMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+    hashCompactBlockMessage = pindex->GetBlockHash();
+    return pCompactBlockMessage;
+}
+
+void AnnounceNewBlock(const CBlock& block)
+{
+    AssertLockHeld(cs_main);
+    uint256 hash = block.GetHash();
+    if (IsInitialBlockDownload() || mapBlockIndex.count(hash) ||
+        block.hashPrevBlock != chainActive.Tip()->GetBlockHash())
+        return;
+    // Peers would drop a block AcceptBlock rejects, and hold it against us
+    CValidationState state;
+    if (!CheckBlockHeaderOnParent(block, chainActive.Tip(), state))
+        return;
+
+    // Kept for the peers that ask for it with getdata later
+    pCompactBlockMessage = CNode::MakeSharedMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+    hashCompactBlockMessage = hash;
+
+    CInv inv(MSG_BLOCK, hash);
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        if (pnode->fDisconnect || !pnode->fSuccessfullyConnected || pnode->nVersion < COMPACT_BLOCKS_VERSION)
+            continue;
+        pnode->PushSharedMessage(pCompactBlockMessage);
+        PROPTRACE(PROPTRACE_RELAY, MSG_BLOCK, hash, pnode->GetId());
+        // No inv for it once connected
+        pnode->AddInventoryKnown(inv);
+    }
+    LogPrint("net", "announced new block %s before connecting it\n", hash.ToString());
+}
+
+// The bloom filter elements of the transactions of the last block served
+// as a merkleblock, for the other filtered peers that ask for it too.
+// Requires cs_main.
+static uint256 hashBlockBloomElements;
+static vector<CBloomTxElements> vBlockBloomElements;
+
+static const vector<CBloomTxElements>& GetBlockBloomElements(const CBlock& block)
+{
+    uint256 hash = block.GetHash();
+    if (hash != hashBlockBloomElements)
+    {
+        vBlockBloomElements.clear();
+        vBlockBloomElements.reserve(block.vtx.size());
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            vBlockBloomElements.push_back(CBloomTxElements(tx, tx.GetHash()));
+        hashBlockBloomElements = hash;
+    }
+    return vBlockBloomElements;
+}
+
+// Whether a block is far enough behind the tip to be served last.
+// Requires cs_main.
+static bool IsHistoricalBlock(const CBlockIndex* pindex)
+{
+    return chainActive.Tip() && pindex->GetBlockTime() < chainActive.Tip()->GetBlockTime() - HISTORICAL_BLOCK_AGE;
+}
+
+// Requires cs_main.
+static bool IsHistoricalBlockRequest(const CInv& inv)
+{
+    if (inv.type != MSG_BLOCK && inv.type != MSG_FILTERED_BLOCK && inv.type != MSG_CMPCT_BLOCK)
+        return false;
+    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+    return mi != mapBlockIndex.end() && IsHistoricalBlock(mi->second);
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -3497,21 +5724,26 @@ void static ProcessGetData(CNode* pfrom)
         if (pfrom->nSendSize >= SendBufferSize())
             break;
 
+        // Historical blocks wait while uploads are paced, so new blocks and
+        // transactions go out first
+        if (IsHistoricalBlockRequest(*it) && CNode::UploadThrottled())
+            break;
+
         const CInv &inv = *it;
         {
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = false;
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
                     // If the requested block is at a height below our last
                     // checkpoint, only serve it if it's in the checkpointed chain
                     int nHeight = mi->second->nHeight;
-                    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+                    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint();
                     if (pcheckpoint && nHeight < pcheckpoint->nHeight) {
                         if (!chainActive.Contains(mi->second))
                         {
@@ -3523,19 +5755,53 @@ void static ProcessGetData(CNode* pfrom)
                         send = true;
                     }
                 }
+                // With the upload target nearly used up, what is left of it
+                // is kept for the tip; the peer can get history elsewhere
+                // Pruned blocks are not served; without NODE_NETWORK the
+                // peer should not have asked
+                if (send && !(mi->second->nStatus & BLOCK_HAVE_DATA))
+                {
+                    LogPrint("net", "ignoring request from peer=%d for pruned block %s\n", pfrom->GetId(), inv.hash.ToString());
+                    send = false;
+                }
+                if (send && IsHistoricalBlock(mi->second) && CNode::OutboundTargetReached(true))
+                {
+                    LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+                    pfrom->fDisconnect = true;
+                    send = false;
+                }
                 if (send)
                 {
-                    // Send block from disk
-                    CBlock block;
-                    ReadBlockFromDisk(block, (*mi).second);
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    // Compact blocks only help with blocks the peer can
+                    // have the transactions of
+                    bool fCompact = inv.type == MSG_CMPCT_BLOCK && pfrom->nVersion >= COMPACT_BLOCKS_VERSION &&
+                                    (*mi).second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+                    if (fCompact)
+                    {
+                        CSharedMessage pmsg = GetCompactBlockMessage((*mi).second);
+                        if (pmsg)
+                            pfrom->PushSharedMessage(pmsg);
+                    }
+                    else if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK)
+                    {
+                        CSharedMessage pmsg = GetBlockMessage((*mi).second);
+                        if (pmsg)
+                            pfrom->PushSharedMessage(pmsg);
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+                            CRawBlock raw;
+                            bool fRaw = ReadRawBlockFromDisk(raw, (*mi).second);
+                            CBlock block;
+                            if (!fRaw || !ReadBlockFromRaw(block, raw))
+                            {
+                                fRaw = false;
+                                ReadBlockFromDisk(block, (*mi).second);
+                            }
+                            CMerkleBlock merkleBlock(block, *pfrom->pfilter, GetBlockBloomElements(block));
                             pfrom->PushMessage("merkleblock", merkleBlock);
                             // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
                             // This avoids hurting performance by pointlessly requiring a round-trip
@@ -3543,10 +5809,22 @@ void static ProcessGetData(CNode* pfrom)
                             // they must either disconnect and retry or request the full block.
                             // Thus, the protocol spec specified allows for us to provide duplicate txn here,
                             // however we MUST always provide at least what the remote peer needs
+                            std::vector<unsigned int> vTxOffsets;
+                            if (fRaw)
+                            {
+                                GetTxOffsets(block, vTxOffsets);
+                                fRaw = vTxOffsets.back() == raw.size();
+                            }
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
-                                    pfrom->PushMessage("tx", block.vtx[pair.first]);
+                                if (!pfrom->HasInventoryKnown(CInv(MSG_TX, pair.second)))
+                                {
+                                    // Slice the transaction out of the stored block
+                                    if (fRaw)
+                                        pfrom->PushRawMessage("tx", raw.begin() + vTxOffsets[pair.first], vTxOffsets[pair.first + 1] - vTxOffsets[pair.first]);
+                                    else
+                                        pfrom->PushMessage("tx", block.vtx[pair.first]);
+                                }
                         }
                         // else
                             // no response
@@ -3571,19 +5849,19 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSharedMessage>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushSharedMessage((*mi).second);
                         pushed = true;
                     }
                 }
                 if (!pushed && inv.type == MSG_TX) {
                     CTransaction tx;
                     if (mempool.lookup(inv.hash, tx)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << tx;
-                        pfrom->PushMessage("tx", ss);
+                        // Keep it for the other peers asking for it
+                        CSharedMessage pmsg = CNode::MakeSharedMessage("tx", tx);
+                        AddRelayMessage(inv, pmsg);
+                        pfrom->PushSharedMessage(pmsg);
                         pushed = true;
                     }
                 }
@@ -3592,25 +5870,357 @@ void static ProcessGetData(CNode* pfrom)
                 }
             }
 
-            // Track requests for our stuff.
-            g_signals.Inventory(inv.hash);
+            // Track requests for our stuff.
+            g_signals.Inventory(inv.hash);
+
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+                break;
+        }
+    }
+
+    pfrom->vRecvGetData.erase(pfrom->vRecvGetData.begin(), it);
+
+    if (!vNotFound.empty()) {
+        // Let the peer know that we didn't find what it asked for, so it doesn't
+        // have to wait around forever. Currently only SPV clients actually care
+        // about this message: it's needed when they are recursively walking the
+        // dependencies of relevant unconfirmed transactions. SPV clients want to
+        // do that because they want to know about (and store and rebroadcast and
+        // risk analyze) the dependencies of transactions relevant to them, without
+        // having to download the entire memory pool.
+        pfrom->PushMessage("notfound", vNotFound);
+    }
+}
+
+// Ask the headers sync peer for the headers following the last one it sent. Requires cs_main.
+void static PushGetHeaders(CNode* pnode)
+{
+    CBlockLocator locator = chainActive.GetLocator();
+    if (!mapBlockIndex.count(hashHeadersLast))
+        locator.vHave.insert(locator.vHave.begin(), hashHeadersLast);
+    pnode->PushMessage("getheaders", locator, uint256(0));
+    fHeadersRequested = true;
+}
+
+// Queue the blocks of headers whose proof of work is verified for download. Requires cs_main.
+void static QueueHeadersToFetch(const vector<uint256>& vHashes)
+{
+    BOOST_FOREACH(const uint256& hash, vHashes)
+    {
+        setHeadersVerified.insert(hash);
+        queueHeadersToFetch.push_back(hash);
+    }
+}
+
+// Run proof of work checks on the verification threads, if there are any
+bool static CheckHeadersPoW(vector<CPoWCheck>& vChecks)
+{
+    if (nScriptCheckThreads)
+    {
+        CCheckQueueControl<CPoWCheck> control(&powcheckqueue);
+        control.Add(vChecks);
+        return control.Wait();
+    }
+    BOOST_FOREACH(const CPoWCheck& check, vChecks)
+        if (!check())
+            return false;
+    return true;
+}
+
+// Verify the proof of work of the headers waiting for a checkpoint after all,
+// when the sync peer has no more to send. Requires cs_main.
+bool static FlushHeadersPending(CNode* pfrom)
+{
+    vector<CPoWCheck> vChecks;
+    vector<uint256> vHashes;
+    BOOST_FOREACH(const CBlockHeader& header, vHeadersPending)
+    {
+        vChecks.push_back(CPoWCheck(header));
+        vHashes.push_back(header.GetHash());
+    }
+    vHeadersPending.clear();
+    if (!CheckHeadersPoW(vChecks))
+    {
+        Misbehaving(pfrom->GetId(), 100);
+        return error("ProcessHeaders() : headers with invalid proof of work from %s", pfrom->addr.ToString());
+    }
+    QueueHeadersToFetch(vHashes);
+    return true;
+}
+
+// Verify the proof of work of a batch of headers on the verification threads,
+// and queue the blocks of the valid ones for download.
+// Headers from the sync peer below the last checkpoint are only linked by
+// hash: the header at the next checkpoint height commits to all of them,
+// which saves hashing each with scrypt or X11. Requires cs_main.
+bool static ProcessHeaders(CNode* pfrom, const vector<CBlock>& vHeaders)
+{
+    bool fSyncPeer = (pfrom->GetId() == nodeHeadersSync);
+    if (fSyncPeer)
+        fHeadersRequested = false;
+    if (vHeaders.empty())
+    {
+        if (fSyncPeer)
+        {
+            fHeadersMore = false;
+            return FlushHeadersPending(pfrom);
+        }
+        return true;
+    }
+
+    // The headers must form a chain off a block or header we already know,
+    // or off the headers waiting for a checkpoint
+    uint256 hashPrev = vHeaders[0].hashPrevBlock;
+    bool fExtendsSync = fSyncPeer && (vHeadersPending.empty() || hashPrev == hashHeadersLast);
+    if (!mapBlockIndex.count(hashPrev) && !setHeadersVerified.count(hashPrev) &&
+        !(fExtendsSync && !vHeadersPending.empty()))
+    {
+        LogPrint("net", "headers from %s do not connect, ignoring\n", pfrom->addr.ToString());
+        return true;
+    }
+
+    // Heights are only followed along the sync peer's chain
+    int nHeight = -1;
+    if (fExtendsSync)
+    {
+        BlockMap::iterator mi = mapBlockIndex.find(hashPrev);
+        if (mi != mapBlockIndex.end())
+            nHeight = mi->second->nHeight;
+        else if (hashPrev == hashHeadersLast)
+            nHeight = nHeadersLastHeight;
+    }
+    int nLastCheckpoint = Checkpoints::GetTotalBlocksEstimate();
+
+    vector<CPoWCheck> vChecks;
+    vector<uint256> vHashes;
+    vChecks.reserve(vHeaders.size());
+    vHashes.reserve(vHeaders.size());
+    BOOST_FOREACH(const CBlock& header, vHeaders)
+    {
+        if (header.hashPrevBlock != hashPrev)
+        {
+            Misbehaving(pfrom->GetId(), 20);
+            return error("ProcessHeaders() : non-continuous headers sequence");
+        }
+        hashPrev = header.GetHash();
+        if (nHeight >= 0)
+            nHeight++;
+        if (mapBlockIndex.count(hashPrev) || setHeadersVerified.count(hashPrev))
+            continue;
+        if (nHeight >= 0 && nHeight <= nLastCheckpoint)
+        {
+            vHeadersPending.push_back(header.GetBlockHeader());
+            uint256 hashCheckpoint;
+            if (Checkpoints::GetCheckpoint(nHeight, hashCheckpoint))
+            {
+                if (hashPrev != hashCheckpoint)
+                {
+                    vHeadersPending.clear();
+                    Misbehaving(pfrom->GetId(), 100);
+                    return error("ProcessHeaders() : header at checkpoint %d does not match from %s", nHeight, pfrom->addr.ToString());
+                }
+                vector<uint256> vCommitted;
+                vCommitted.reserve(vHeadersPending.size());
+                BOOST_FOREACH(const CBlockHeader& pending, vHeadersPending)
+                    vCommitted.push_back(pending.GetHash());
+                QueueHeadersToFetch(vCommitted);
+                vHeadersPending.clear();
+            }
+            continue;
+        }
+        vChecks.push_back(CPoWCheck(header));
+        vHashes.push_back(hashPrev);
+    }
+
+    if (!CheckHeadersPoW(vChecks))
+    {
+        Misbehaving(pfrom->GetId(), 100);
+        return error("ProcessHeaders() : headers with invalid proof of work from %s", pfrom->addr.ToString());
+    }
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
-                break;
+    QueueHeadersToFetch(vHashes);
+    if (fExtendsSync)
+    {
+        hashHeadersLast = hashPrev;
+        nHeadersLastHeight = nHeight;
+        fHeadersMore = (vHeaders.size() == MAX_HEADERS_RESULTS);
+        if (!fHeadersMore && !FlushHeadersPending(pfrom))
+            return false;
+    }
+    LogPrint("net", "received %u headers (%u new, %u waiting for a checkpoint) from %s, %u blocks to fetch\n",
+             vHeaders.size(), vHashes.size(), vHeadersPending.size(), pfrom->addr.ToString(), queueHeadersToFetch.size());
+    return true;
+}
+
+// Process a block received in full or rebuilt from a compact block.
+// Requires cs_main.
+void static ProcessReceivedBlock(CNode* pfrom, CBlock& block, bool fChecked = false)
+{
+    uint256 hash = block.GetHash();
+    // Remember who we got this block from.
+    mapBlockSource[hash] = pfrom->GetId();
+    MarkBlockAsReceived(hash, pfrom->GetId());
+
+    bool fNew = !mapBlockIndex.count(hash);
+    CValidationState state;
+    if (ProcessBlock(state, pfrom, &block, NULL, fChecked) && fNew && mapBlockIndex.count(hash))
+        pfrom->nLastBlockTime = GetTime();
+}
+
+// Received blocks that passed the context-free checks on a message handler
+// thread, in the order ThreadConnectBlocks is to process them. The checks of
+// the next blocks overlap the connection of the current one. Each entry holds
+// a reference to its node.
+struct CCheckedBlock {
+    CNode* pfrom;
+    boost::shared_ptr<CDeserializeArena> parena; // Outlives the block
+    boost::shared_ptr<CBlock> pblock;
+};
+static CWaitableCriticalSection csCheckedBlocks;
+static CConditionVariable condCheckedBlocks;
+static std::deque<CCheckedBlock> queueCheckedBlocks;
+static bool fConnectBlocksThread = false;
+
+// Check a received block without cs_main, then queue it once fewer than
+// nBlockPipelineDepth blocks wait ahead of it
+void static PipelineReceivedBlock(CNode* pfrom, boost::shared_ptr<CDeserializeArena> parena, boost::shared_ptr<CBlock> pblock)
+{
+    // Headers-first sync has checked the proof of work of most blocks; while
+    // a block is being connected, checking it again beats waiting for cs_main
+    bool fHeaderVerified = false;
+    {
+        TRY_LOCK(cs_main, lockMain);
+        if (lockMain)
+            fHeaderVerified = setHeadersVerified.count(pblock->GetHash()) > 0;
+    }
+    CValidationState state;
+    bool fChecked = CheckBlock(*pblock, state, !fHeaderVerified);
+
+    {
+        boost::unique_lock<boost::mutex> lock(csCheckedBlocks);
+        while (fChecked && fConnectBlocksThread && (int)queueCheckedBlocks.size() >= nBlockPipelineDepth)
+            condCheckedBlocks.wait(lock);
+        if (fChecked && fConnectBlocksThread) {
+            CCheckedBlock checked;
+            checked.pfrom = pfrom->AddRef();
+            checked.parena = parena;
+            checked.pblock = pblock;
+            queueCheckedBlocks.push_back(checked);
+            condCheckedBlocks.notify_all();
+            return;
         }
     }
 
-    pfrom->vRecvGetData.erase(pfrom->vRecvGetData.begin(), it);
+    // Failed blocks take the usual path, to be rejected there
+    LOCK(cs_main);
+    ProcessReceivedBlock(pfrom, *pblock);
+}
 
-    if (!vNotFound.empty()) {
-        // Let the peer know that we didn't find what it asked for, so it doesn't
-        // have to wait around forever. Currently only SPV clients actually care
-        // about this message: it's needed when they are recursively walking the
-        // dependencies of relevant unconfirmed transactions. SPV clients want to
-        // do that because they want to know about (and store and rebroadcast and
-        // risk analyze) the dependencies of transactions relevant to them, without
-        // having to download the entire memory pool.
-        pfrom->PushMessage("notfound", vNotFound);
+void ThreadConnectBlocks()
+{
+    RenameThread("bitcoin-connect");
+    boost::unique_lock<boost::mutex> lock(csCheckedBlocks);
+    fConnectBlocksThread = true;
+    CNode* pfromConnecting = NULL;
+    try {
+        while (true) {
+            while (queueCheckedBlocks.empty())
+                condCheckedBlocks.wait(lock);
+            CCheckedBlock checked = queueCheckedBlocks.front();
+            queueCheckedBlocks.pop_front();
+            condCheckedBlocks.notify_all();
+            lock.unlock();
+            pfromConnecting = checked.pfrom;
+            try {
+                LOCK(cs_main);
+                ProcessReceivedBlock(checked.pfrom, *checked.pblock, true);
+            } catch (std::exception& e) {
+                PrintExceptionContinue(&e, "ThreadConnectBlocks()");
+            }
+            pfromConnecting = NULL;
+            checked.pfrom->Release();
+            lock.lock();
+        }
+    } catch (boost::thread_interrupted&) {
+        if (pfromConnecting)
+            pfromConnecting->Release();
+        if (!lock.owns_lock())
+            lock.lock();
+        fConnectBlocksThread = false;
+        // Blocks still queued are dropped, with the references to their nodes
+        BOOST_FOREACH(CCheckedBlock& checked, queueCheckedBlocks)
+            checked.pfrom->Release();
+        queueCheckedBlocks.clear();
+        condCheckedBlocks.notify_all();
+        throw;
+    }
+}
+
+// Fall back to a getdata for the whole block, when a compact block can not be
+// rebuilt. It stays marked in flight from this peer.
+void static RequestFullBlock(CNode* pfrom, const uint256& hash)
+{
+    LogPrint("net", "requesting full block %s from %s\n", hash.ToString(), pfrom->addrName);
+    vector<CInv> vGetData(1, CInv(MSG_BLOCK, hash));
+    pfrom->PushMessage("getdata", vGetData);
+}
+
+// The blocks from nStartHeight up to and including hashStop, for a
+// getcfilters or getcfheaders of at most nMaxSize of them
+static bool GetBlockFilterRange(uint8_t nFilterType, uint32_t nStartHeight, const uint256& hashStop, unsigned int nMaxSize, vector<CBlockIndex*>& vBlocks)
+{
+    AssertLockHeld(cs_main);
+    if (!fBlockFilterIndex || nFilterType != BLOCK_FILTER_BASIC)
+        return false;
+    BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+    if (mi == mapBlockIndex.end())
+        return false;
+    CBlockIndex* pindex = (*mi).second;
+    if (nStartHeight > (uint32_t)pindex->nHeight || pindex->nHeight - nStartHeight >= nMaxSize)
+        return false;
+
+    vBlocks.resize(pindex->nHeight - nStartHeight + 1);
+    for (int i = vBlocks.size() - 1; i >= 0; i--)
+    {
+        vBlocks[i] = pindex;
+        pindex = pindex->pprev;
+    }
+    return true;
+}
+
+// Relay addresses to a limited number of other nodes each. The nodes come
+// from a keyed hash of the address, the day and the node id, so an address
+// goes to the same nodes for 24 hours and their setAddrKnowns prevent repeats;
+// one SipHash per node and address keeps this cheap under address floods.
+static void RelayAddresses(const vector<CAddress>& vAddr)
+{
+    static uint256 hashSalt;
+    if (hashSalt == 0)
+        hashSalt = GetRandHash();
+    uint64_t nKey0 = hashSalt.GetLow64(), nKey1 = (hashSalt >> 64).GetLow64();
+    int64_t nNow = GetTime();
+
+    LOCK(cs_vNodes);
+    vector<pair<uint64_t, CNode*> > vMix;
+    vMix.reserve(vNodes.size());
+    BOOST_FOREACH(const CAddress& addr, vAddr)
+    {
+        uint64_t data[3];
+        data[0] = addr.GetHash();
+        data[1] = (nNow + data[0]) / (24 * 60 * 60);
+        vMix.clear();
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->nVersion < CADDR_TIME_VERSION)
+                continue;
+            data[2] = pnode->GetId();
+            vMix.push_back(make_pair(SipHash(nKey0, nKey1, (const unsigned char*)data, sizeof(data)), pnode));
+        }
+        // limited relaying of addresses outside our network(s)
+        unsigned int nRelayNodes = min(IsReachable(addr) ? 2 : 1, (int)vMix.size());
+        partial_sort(vMix.begin(), vMix.begin() + nRelayNodes, vMix.end());
+        for (unsigned int i = 0; i < nRelayNodes; i++)
+            vMix[i].second->PushAddress(addr);
     }
 }
 
@@ -3625,8 +6235,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
     {
-        LOCK(cs_main);
-        State(pfrom->GetId())->nLastBlockProcess = GetTimeMicros();
+        // Only a hint for stall detection, so messages that need no
+        // validation do not wait for cs_main just to set it
+        TRY_LOCK(cs_main, lockMain);
+        if (lockMain)
+            State(pfrom->GetId())->nLastBlockProcess = GetTimeMicros();
     }
 
 
@@ -3711,8 +6324,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             {
                 pfrom->PushMessage("getaddr");
                 pfrom->fGetAddr = true;
+                // The reply is solicited, let all of it through
+                pfrom->dAddrTokenBucket += MAX_ADDR_PROCESSING_TOKEN_BUCKET;
             }
             addrman.Good(pfrom->addr);
+            if (pfrom->nTimeVersionSent)
+                addrman.UpdateMetrics(pfrom->addr, GetTimeMicros() - pfrom->nTimeVersionSent, 0, 0);
         } else {
             if (((CNetAddr)pfrom->addr) == (CNetAddr)addrFrom)
             {
@@ -3765,51 +6382,50 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             return error("message addr size() = %u", vAddr.size());
         }
 
-        // Store the new addresses
+        // Refill the peer's token bucket for the time since its last addr
+        int64_t nTimeMicros = GetTimeMicros();
+        if (pfrom->dAddrTokenBucket < MAX_ADDR_PROCESSING_TOKEN_BUCKET)
+        {
+            double dIncrement = MAX_ADDR_RATE_PER_SECOND * (nTimeMicros - pfrom->nAddrTokenTimestamp) / 1000000.0;
+            pfrom->dAddrTokenBucket = min(pfrom->dAddrTokenBucket + dIncrement, (double)MAX_ADDR_PROCESSING_TOKEN_BUCKET);
+        }
+        pfrom->nAddrTokenTimestamp = nTimeMicros;
+
+        // Store the new addresses, in one addrman call, and relay them at once
         vector<CAddress> vAddrOk;
+        vector<CAddress> vAddrRelay;
         int64_t nNow = GetAdjustedTime();
         int64_t nSince = nNow - 10 * 60;
+        uint64_t nRateLimited = 0;
         BOOST_FOREACH(CAddress& addr, vAddr)
         {
             boost::this_thread::interruption_point();
 
+            // Drop what the peer sends beyond its share, without looking at it
+            if (pfrom->dAddrTokenBucket < 1.0)
+            {
+                nRateLimited++;
+                continue;
+            }
+            pfrom->dAddrTokenBucket -= 1.0;
+
             if (addr.nTime <= 100000000 || addr.nTime > nNow + 10 * 60)
                 addr.nTime = nNow - 5 * 24 * 60 * 60;
             pfrom->AddAddressKnown(addr);
-            bool fReachable = IsReachable(addr);
             if (addr.nTime > nSince && !pfrom->fGetAddr && vAddr.size() <= 10 && addr.IsRoutable())
-            {
-                // Relay to a limited number of other nodes
-                {
-                    LOCK(cs_vNodes);
-                    // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint64_t hashAddr = addr.GetHash();
-                    uint256 hashRand = hashSalt ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60));
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    multimap<uint256, CNode*> mapMix;
-                    BOOST_FOREACH(CNode* pnode, vNodes)
-                    {
-                        if (pnode->nVersion < CADDR_TIME_VERSION)
-                            continue;
-                        unsigned int nPointer;
-                        memcpy(&nPointer, &pnode, sizeof(nPointer));
-                        uint256 hashKey = hashRand ^ nPointer;
-                        hashKey = Hash(BEGIN(hashKey), END(hashKey));
-                        mapMix.insert(make_pair(hashKey, pnode));
-                    }
-                    int nRelayNodes = fReachable ? 2 : 1; // limited relaying of addresses outside our network(s)
-                    for (multimap<uint256, CNode*>::iterator mi = mapMix.begin(); mi != mapMix.end() && nRelayNodes-- > 0; ++mi)
-                        ((*mi).second)->PushAddress(addr);
-                }
-            }
+                vAddrRelay.push_back(addr);
             // Do not store addresses outside our network
-            if (fReachable)
+            if (IsReachable(addr))
                 vAddrOk.push_back(addr);
         }
+        pfrom->nAddrProcessed += vAddr.size() - nRateLimited;
+        pfrom->nAddrRateLimited += nRateLimited;
+        if (nRateLimited > 0)
+            LogPrint("net", "Received addr: %u addresses (%u processed, %u rate-limited) peer=%d\n",
+                     vAddr.size(), vAddr.size() - nRateLimited, nRateLimited, pfrom->GetId());
+
+        if (!vAddrRelay.empty())
+            RelayAddresses(vAddrRelay);
         addrman.Add(vAddrOk, pfrom->addr, 2 * 60 * 60);
         if (vAddr.size() < 1000)
             pfrom->fGetAddr = false;
@@ -3836,6 +6452,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
             boost::this_thread::interruption_point();
             pfrom->AddInventoryKnown(inv);
+            PROPTRACE(PROPTRACE_INV, inv.type, inv.hash, pfrom->GetId());
 
             bool fAlreadyHave = AlreadyHave(inv);
             LogPrint("net", "  got inventory: %s  %s\n", inv.ToString(), fAlreadyHave ? "have" : "new");
@@ -3877,6 +6494,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if ((fDebug && vInv.size() > 0) || (vInv.size() == 1))
             LogPrint("net", "received getdata for: %s\n", vInv[0].ToString());
 
+        if (fPropTrace)
+            BOOST_FOREACH(const CInv& inv, vInv)
+                PropTraceRecord(PROPTRACE_GETDATA, inv.type, inv.hash, pfrom->GetId());
+
         pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(), vInv.end());
         ProcessGetData(pfrom);
     }
@@ -3930,7 +6551,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3945,7 +6566,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
         vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         LogPrint("net", "getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString());
         for (; pindex; pindex = chainActive.Next(pindex))
         {
@@ -3957,15 +6578,30 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "headers" && fHeadersFirst)
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+
+        LOCK(cs_main);
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            Misbehaving(pfrom->GetId(), 20);
+            return error("message headers size() = %u", vHeaders.size());
+        }
+        ProcessHeaders(pfrom, vHeaders);
+    }
+
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
         vRecv >> tx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
+        PROPTRACE(PROPTRACE_RECEIVE, MSG_TX, inv.hash, pfrom->GetId());
 
         LOCK(cs_main);
 
@@ -3973,11 +6609,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CValidationState state;
         if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
         {
+            PROPTRACE(PROPTRACE_VALIDATE, MSG_TX, inv.hash, pfrom->GetId());
+            pfrom->nLastTXTime = GetTime();
             mempool.check(pcoinsTip);
             RelayTransaction(tx, inv.hash);
             mapAlreadyAskedFor.erase(inv);
             vWorkQueue.push_back(inv.hash);
-            vEraseQueue.push_back(inv.hash);
+            EraseOrphanTx(inv.hash);
 
 
             LogPrint("mempool", "AcceptToMemoryPool: %s %s : accepted %s (poolsz %u)\n",
@@ -3985,19 +6623,33 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 tx.GetHash().ToString(),
                 mempool.mapTx.size());
 
-            // Recursively process any orphan transactions that depended on this one
+            // Process the orphan transactions that depended on this one, a
+            // generation at a time: the scripts of each are checked on all
+            // script threads at once before they are accepted in turn.
             set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+            while (!vWorkQueue.empty())
             {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
+                vector<uint256> vOrphans;
+                set<uint256> setOrphans;
+                BOOST_FOREACH(const uint256 &hashParent, vWorkQueue) {
+                    map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(hashParent);
+                    if (itByPrev == mapOrphanTransactionsByPrev.end())
+                        continue;
+                    BOOST_FOREACH(const uint256 &orphanHash, itByPrev->second)
+                        if (setOrphans.insert(orphanHash).second)
+                            vOrphans.push_back(orphanHash);
+                }
+                vWorkQueue.clear();
+                // Copies, as accepted orphans are erased right away
+                vector<CTransaction> vtxOrphans;
+                BOOST_FOREACH(const uint256 &orphanHash, vOrphans)
+                    vtxOrphans.push_back(mapOrphanTransactions[orphanHash].tx);
+                PrecheckTransactionScripts(vtxOrphans);
+
+                for (unsigned int i = 0; i < vOrphans.size(); i++)
                 {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
+                    const uint256& orphanHash = vOrphans[i];
+                    const CTransaction& orphanTx = vtxOrphans[i];
                     NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
                     bool fMissingInputs2 = false;
                     // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
@@ -4005,16 +6657,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                     // anyone relaying LegitTxX banned)
                     CValidationState stateDummy;
 
-                    vEraseQueue.push_back(orphanHash);
-
-                    if (setMisbehaving.count(fromPeer))
+                    if (setMisbehaving.count(fromPeer)) {
+                        EraseOrphanTx(orphanHash);
                         continue;
+                    }
                     if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
                     {
                         LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+                        PROPTRACE(PROPTRACE_VALIDATE, MSG_TX, orphanHash, fromPeer);
                         RelayTransaction(orphanTx, orphanHash);
                         mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanHash));
                         vWorkQueue.push_back(orphanHash);
+                        EraseOrphanTx(orphanHash);
                     }
                     else if (!fMissingInputs2)
                     {
@@ -4028,13 +6682,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                         }
                         // too-little-fee orphan
                         LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                        recentRejects.insert(orphanHash);
+                        EraseOrphanTx(orphanHash);
                     }
+                    // Otherwise it is still missing another parent, and stays
                     mempool.check(pcoinsTip);
                 }
             }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
         }
         else if (fMissingInputs)
         {
@@ -4042,13 +6696,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
             unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+            uint64_t nMaxOrphanBytes = std::max((int64_t)0, GetArg("-maxorphantxsize", DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE)) * 1000;
+            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx, nMaxOrphanBytes);
             if (nEvicted > 0)
                 LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
         }
         int nDoS = 0;
         if (state.IsInvalid(nDoS))
         {
+            recentRejects.insert(inv.hash);
             LogPrint("mempool", "%s from %s %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
                 pfrom->addr.ToString(), pfrom->cleanSubVer,
                 state.GetRejectReason());
@@ -4062,28 +6718,228 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
     {
-        CBlock block;
-        vRecv >> block;
+        // Outlives the block, whose transactions are deserialized into it
+        boost::shared_ptr<CDeserializeArena> parena(new CDeserializeArena());
+        boost::shared_ptr<CBlock> pblock(new CBlock());
+        CBlock& block = *pblock;
+        {
+            CDeserializeArena::Scope scope(*parena);
+            vRecv >> block;
+        }
 
         LogPrint("net", "received block %s\n", block.GetHash().ToString());
         // block.print();
 
-        CInv inv(MSG_BLOCK, block.GetHash());
-        pfrom->AddInventoryKnown(inv);
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, block.GetHash()));
+        PROPTRACE(PROPTRACE_RECEIVE, MSG_BLOCK, block.GetHash(), pfrom->GetId());
+
+        if (nBlockPipelineDepth > 0) {
+            PipelineReceivedBlock(pfrom, parena, pblock);
+        } else {
+            LOCK(cs_main);
+            ProcessReceivedBlock(pfrom, block);
+        }
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex)
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        const CBlockHeader& header = cmpctblock.header;
+        uint256 hash = header.GetHash();
+        LogPrint("net", "received compact block %s\n", hash.ToString());
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hash));
+        PROPTRACE(PROPTRACE_RECEIVE, MSG_BLOCK, hash, pfrom->GetId());
+
+        LOCK(cs_main);
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+        {
+            MarkBlockAsReceived(hash, pfrom->GetId());
+            return true;
+        }
+        // Check the work before touching the mempool for it
+        if (!CheckProofOfWork(header.GetPoWHash(header.GetAlgo()), header.nBits, header.GetAlgo()))
+        {
+            Misbehaving(pfrom->GetId(), 50);
+            return error("compact block %s : proof of work failed", hash.ToString());
+        }
+        // Orphans go through the usual path
+        if (!mapBlockIndex.count(header.hashPrevBlock))
+        {
+            RequestFullBlock(pfrom, hash);
+            return true;
+        }
+
+        boost::shared_ptr<CPartialBlock> partial(new CPartialBlock());
+        ReadStatus status = partial->InitData(cmpctblock, mempool);
+        if (status == READ_STATUS_INVALID)
+        {
+            Misbehaving(pfrom->GetId(), 100);
+            return error("compact block %s : invalid encoding", hash.ToString());
+        }
+        if (status == READ_STATUS_FAILED)
+        {
+            RequestFullBlock(pfrom, hash);
+            return true;
+        }
+
+        CBlockTransactionsRequest req;
+        req.blockhash = hash;
+        partial->GetMissing(req.vIndexes);
+        if (req.vIndexes.empty())
+        {
+            CBlock block;
+            if (partial->FillBlock(block, vector<CTransaction>()) != READ_STATUS_OK)
+                RequestFullBlock(pfrom, hash);
+            else
+                ProcessReceivedBlock(pfrom, block);
+        }
+        else
+        {
+            State(pfrom->GetId())->pPartialBlock = partial;
+            pfrom->PushMessage("getblocktxn", req);
+        }
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
 
         LOCK(cs_main);
-        // Remember who we got this block from.
-        mapBlockSource[inv.hash] = pfrom->GetId();
-        MarkBlockAsReceived(inv.hash, pfrom->GetId());
+        BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !((*mi).second->nStatus & BLOCK_HAVE_DATA))
+            return true;
 
-        CValidationState state;
-        ProcessBlock(state, pfrom, &block);
+        CBlock block;
+        if (!ReadBlockFromDisk(block, (*mi).second))
+            return error("getblocktxn : failed to read block %s", req.blockhash.ToString());
+
+        CBlockTransactions resp;
+        resp.blockhash = req.blockhash;
+        BOOST_FOREACH(uint32_t nIndex, req.vIndexes)
+        {
+            if (nIndex >= block.vtx.size())
+            {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("getblocktxn : index %u out of range for block %s", nIndex, req.blockhash.ToString());
+            }
+            resp.vtx.push_back(block.vtx[nIndex]);
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "getcfilters" || strCommand == "getcfheaders")
+    {
+        uint8_t nFilterType;
+        uint32_t nStartHeight;
+        uint256 hashStop;
+        vRecv >> nFilterType >> nStartHeight >> hashStop;
+
+        LOCK(cs_main);
+        vector<CBlockIndex*> vBlocks;
+        unsigned int nMaxSize = strCommand == "getcfilters" ? MAX_GETCFILTERS_SIZE : MAX_GETCFHEADERS_SIZE;
+        if (!GetBlockFilterRange(nFilterType, nStartHeight, hashStop, nMaxSize, vBlocks))
+        {
+            LogPrint("net", "%s for unserved filters from peer=%d, disconnecting\n", strCommand, pfrom->GetId());
+            pfrom->fDisconnect = true;
+            return true;
+        }
+
+        if (strCommand == "getcfilters")
+        {
+            BOOST_FOREACH(CBlockIndex* pindex, vBlocks)
+            {
+                CBlockFilterIndexEntry entry;
+                if (!pblocktree->ReadBlockFilter(pindex->GetBlockHash(), entry))
+                    break;
+                pfrom->PushMessage("cfilter", nFilterType, pindex->GetBlockHash(), entry.vFilter);
+            }
+        }
+        else
+        {
+            CBlockFilterIndexEntry prev;
+            if (vBlocks[0]->pprev && !pblocktree->ReadBlockFilter(vBlocks[0]->pprev->GetBlockHash(), prev))
+                return true;
+            vector<uint256> vFilterHashes;
+            BOOST_FOREACH(CBlockIndex* pindex, vBlocks)
+            {
+                CBlockFilterIndexEntry entry;
+                if (!pblocktree->ReadBlockFilter(pindex->GetBlockHash(), entry))
+                    return true;
+                vFilterHashes.push_back(entry.hashFilter);
+            }
+            pfrom->PushMessage("cfheaders", nFilterType, hashStop, prev.hashHeader, vFilterHashes);
+        }
+    }
+
+
+    else if (strCommand == "getcfcheckpt")
+    {
+        uint8_t nFilterType;
+        uint256 hashStop;
+        vRecv >> nFilterType >> hashStop;
+
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+        if (!fBlockFilterIndex || nFilterType != BLOCK_FILTER_BASIC || mi == mapBlockIndex.end())
+        {
+            LogPrint("net", "getcfcheckpt for unserved filters from peer=%d, disconnecting\n", pfrom->GetId());
+            pfrom->fDisconnect = true;
+            return true;
+        }
+
+        vector<uint256> vHeaders;
+        for (int nHeight = BLOCK_FILTER_CHECKPOINT_INTERVAL; nHeight <= (*mi).second->nHeight; nHeight += BLOCK_FILTER_CHECKPOINT_INTERVAL)
+        {
+            CBlockFilterIndexEntry entry;
+            if (!pblocktree->ReadBlockFilter((*mi).second->GetAncestor(nHeight)->GetBlockHash(), entry))
+                return true;
+            vHeaders.push_back(entry.hashHeader);
+        }
+        pfrom->PushMessage("cfcheckpt", nFilterType, hashStop, vHeaders);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex)
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        LOCK(cs_main);
+        CNodeState *state = State(pfrom->GetId());
+        if (!state->pPartialBlock || state->pPartialBlock->GetHeader().GetHash() != resp.blockhash)
+        {
+            LogPrint("net", "ignoring unrequested blocktxn for %s\n", resp.blockhash.ToString());
+            return true;
+        }
+        boost::shared_ptr<CPartialBlock> partial;
+        partial.swap(state->pPartialBlock);
+
+        CBlock block;
+        ReadStatus status = partial->FillBlock(block, resp.vtx);
+        if (status == READ_STATUS_INVALID)
+        {
+            Misbehaving(pfrom->GetId(), 100);
+            return error("blocktxn : wrong transaction count for block %s", resp.blockhash.ToString());
+        }
+        if (status == READ_STATUS_FAILED)
+            RequestFullBlock(pfrom, resp.blockhash);
+        else
+            ProcessReceivedBlock(pfrom, block);
     }
 
 
     else if (strCommand == "getaddr")
     {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_inventory);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -4157,6 +7013,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                     if (pingUsecTime > 0) {
                         // Successful ping time measurement, replace previous
                         pfrom->nPingUsecTime = pingUsecTime;
+                        // Remember how fast this address answers and serves blocks,
+                        // for picking outbound peers in later sessions
+                        if (!pfrom->fInbound) {
+                            CNodeStateStats stats;
+                            int64_t nBlockUsec = GetNodeStateStats(pfrom->GetId(), stats) ? stats.nBlockServiceUsec : 0;
+                            addrman.UpdateMetrics(pfrom->addr, 0, pingUsecTime, nBlockUsec);
+                        }
                     } else {
                         // This should never happen
                         sProblem = "Timing mishap";
@@ -4200,12 +7063,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         vRecv >> alert;
 
         uint256 alertHash = alert.GetHash();
-        if (pfrom->setKnown.count(alertHash) == 0)
+        bool fKnown;
+        {
+            LOCK(pfrom->cs_inventory);
+            fKnown = pfrom->setKnown.count(alertHash) != 0;
+        }
+        if (!fKnown)
         {
             if (alert.ProcessAlert())
             {
                 // Relay
-                pfrom->setKnown.insert(alertHash);
+                {
+                    LOCK(pfrom->cs_inventory);
+                    pfrom->setKnown.insert(alertHash);
+                }
                 {
                     LOCK(cs_vNodes);
                     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -4255,10 +7126,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         {
             Misbehaving(pfrom->GetId(), 100);
         } else {
-            LOCK(pfrom->cs_filter);
-            if (pfrom->pfilter)
-                pfrom->pfilter->insert(vData);
-            else
+            bool fHaveFilter;
+            {
+                LOCK(pfrom->cs_filter);
+                fHaveFilter = pfrom->pfilter != NULL;
+                if (fHaveFilter)
+                    pfrom->pfilter->insert(vData);
+            }
+            // cs_main is taken before cs_filter elsewhere
+            if (!fHaveFilter)
                 Misbehaving(pfrom->GetId(), 100);
         }
     }
@@ -4384,6 +7260,7 @@ bool ProcessMessages(CNode* pfrom)
 
         // Process message
         bool fRet = false;
+        int64_t nProcessStart = GetTimeMicros();
         try
         {
             fRet = ProcessMessage(pfrom, strCommand, vRecv);
@@ -4415,6 +7292,7 @@ bool ProcessMessages(CNode* pfrom)
         } catch (...) {
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
+        pfrom->RecordMessageProcessed(strCommand, CMessageHeader::HEADER_SIZE + nMessageSize, GetTimeMicros() - nProcessStart);
 
         if (!fRet)
             LogPrintf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand, nMessageSize);
@@ -4430,6 +7308,13 @@ bool ProcessMessages(CNode* pfrom)
 }
 
 
+// The time of the next event of a Poisson process with the given average
+// interval in seconds, in microseconds
+static int64_t PoissonNextSend(int64_t nNow, double dAverageInterval)
+{
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * dAverageInterval * -1000000.0 + 0.5);
+}
+
 bool SendMessages(CNode* pto, bool fSendTrickle)
 {
     {
@@ -4481,7 +7366,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 {
                     // Periodically clear setAddrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
+                    {
+                        LOCK(pnode->cs_inventory);
                         pnode->setAddrKnown.clear();
+                    }
 
                     // Rebroadcast our address
                     if (!fNoListen)
@@ -4500,25 +7388,24 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle)
         {
-            vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+            vector<CAddress> vAddrNew;
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                LOCK(pto->cs_inventory);
+                vAddrNew.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
-                    {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
-                    }
+                    // returns true if wasn't already contained in the set
+                    if (pto->setAddrKnown.insert(addr).second)
+                        vAddrNew.push_back(addr);
                 }
+                pto->vAddrToSend.clear();
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
+            // receiver rejects addr messages larger than 1000
+            for (unsigned int i = 0; i < vAddrNew.size(); i += 1000)
+            {
+                vector<CAddress> vAddr(vAddrNew.begin() + i, vAddrNew.begin() + min(i + 1000, (unsigned int)vAddrNew.size()));
                 pto->PushMessage("addr", vAddr);
+            }
         }
 
         CNodeState &state = *State(pto->GetId());
@@ -4539,9 +7426,22 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Start block sync
         if (pto->fStartSync && !fImporting && !fReindex) {
             pto->fStartSync = false;
-            PushGetBlocks(pto, chainActive.Tip(), uint256(0));
+            if (fHeadersFirst) {
+                nodeHeadersSync = pto->GetId();
+                hashHeadersLast = chainActive.Tip()->GetBlockHash();
+                nHeadersLastHeight = chainActive.Height();
+                vHeadersPending.clear();
+                fHeadersMore = true;
+                fHeadersRequested = false;
+            } else
+                PushGetBlocks(pto, chainActive.Tip(), uint256(0));
         }
 
+        // Keep the headers sync peer a few batches ahead of the block download
+        if (pto->GetId() == nodeHeadersSync && fHeadersMore && !fHeadersRequested &&
+            queueHeadersToFetch.size() < 4 * MAX_HEADERS_RESULTS)
+            PushGetHeaders(pto);
+
         // Resend wallet transactions that haven't gotten in a block yet
         // Except during reindex, importing and IBD, when old wallet
         // transactions become unconfirmed and spams other nodes.
@@ -4557,46 +7457,40 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         vector<CInv> vInvWait;
         {
             LOCK(pto->cs_inventory);
+            // Transactions go out in batches, at random intervals per peer,
+            // to protect privacy; blocks go out right away
+            bool fSendTxInv = false;
+            int64_t nNowInv = GetTimeMicros();
+            if (pto->nNextInvSend < nNowInv)
+            {
+                fSendTxInv = true;
+                pto->nNextInvSend = PoissonNextSend(nNowInv, pto->fInbound ? INVENTORY_BROADCAST_INTERVAL : INVENTORY_BROADCAST_INTERVAL / 2.0);
+            }
+
             vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
 
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
+                if (inv.type == MSG_TX && !fSendTxInv)
                 {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    if (fTrickleWait)
-                    {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
+                    vInvWait.push_back(inv);
+                    continue;
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
-                {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
-                }
+                // also skips duplicates queued since the last batch
+                pto->filterInventoryKnown.insert(inv.hash);
+                vInv.push_back(inv);
             }
-            pto->vInventoryToSend = vInvWait;
+            pto->vInventoryToSend.swap(vInvWait);
+        }
+        // in messages of at most 1000 entries
+        for (unsigned int i = 0; i < vInv.size(); i += 1000)
+        {
+            vector<CInv> vInvPart(vInv.begin() + i, vInv.begin() + min(i + 1000, (unsigned int)vInv.size()));
+            pto->PushMessage("inv", vInvPart);
         }
-        if (!vInv.empty())
-            pto->PushMessage("inv", vInv);
 
 
         // Detect stalled peers. Require that blocks are in flight, we haven't
@@ -4611,14 +7505,37 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             pto->fDisconnect = true;
         }
 
+        if (!pto->fDisconnect && state.nBlocksInFlight)
+            ReassignStalledBlocks(pto->GetId(), nNow);
+
+        // Take a few verified headers from the fetch queue, so consecutive
+        // ranges are downloaded from different peers in parallel, each peer
+        // keeping as many requested as its rate allows. The total
+        // outstanding is bounded so that early arrivals fit in the orphan pool.
+        int nFetch = 0;
+        int nTarget = GetBlockDownloadTarget(state);
+        while (!pto->fDisconnect && !pto->fClient && pto->nStartingHeight > chainActive.Height() &&
+               nNow >= state.nNoFetchBefore && !queueHeadersToFetch.empty() && nFetch < 16 &&
+               state.nBlocksToDownload + state.nBlocksInFlight < nTarget &&
+               mapBlocksToDownload.size() + mapBlocksInFlight.size() + mapOrphanBlocks.size() < BLOCK_DOWNLOAD_WINDOW) {
+            uint256 hash = queueHeadersToFetch.front();
+            queueHeadersToFetch.pop_front();
+            if (!mapBlockIndex.count(hash) && !mapOrphanBlocks.count(hash) && AddBlockToQueue(pto->GetId(), hash))
+                nFetch++;
+        }
+
         //
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
+        // New blocks can mostly be rebuilt from the mempool; during the
+        // initial download it has nothing for them
+        int nBlockType = (pto->nVersion >= COMPACT_BLOCKS_VERSION && !IsInitialBlockDownload()) ? MSG_CMPCT_BLOCK : MSG_BLOCK;
         while (!pto->fDisconnect && state.nBlocksToDownload && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
             uint256 hash = state.vBlocksToDownload.front();
-            vGetData.push_back(CInv(MSG_BLOCK, hash));
+            vGetData.push_back(CInv(nBlockType, hash));
             MarkBlockAsInFlight(pto->GetId(), hash);
+            PROPTRACE(PROPTRACE_REQUEST, MSG_BLOCK, hash, pto->GetId());
             LogPrint("net", "Requesting block %s from %s\n", hash.ToString().c_str(), state.name.c_str());
             if (vGetData.size() >= 1000)
             {
@@ -4638,6 +7555,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 if (fDebug)
                     LogPrint("net", "sending getdata: %s\n", inv.ToString());
                 vGetData.push_back(inv);
+                PROPTRACE(PROPTRACE_REQUEST, inv.type, inv.hash, pto->GetId());
                 if (vGetData.size() >= 1000)
                 {
                     pto->PushMessage("getdata", vGetData);
@@ -4664,12 +7582,11 @@ public:
     CMainCleanup() {}
     ~CMainCleanup() {
         // block headers
-        std::map<uint256, CBlockIndex*>::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        blockIndexArena.Clear();
 
         // orphan blocks
+        // (those on disk are removed on the next start)
         std::map<uint256, COrphanBlock*>::iterator it2 = mapOrphanBlocks.begin();
         for (; it2 != mapOrphanBlocks.end(); it2++)
             delete (*it2).second;
@@ -11,6 +11,7 @@
 #endif
 
 #include "bignum.h"
+#include "blockstore.h"
 #include "chainparams.h"
 #include "coins.h"
 #include "core.h"
@@ -29,10 +30,21 @@
 #include <utility>
 #include <vector>
 
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+
 class CBlockIndex;
 class CBloomFilter;
 class CInv;
 
+// Block hashes satisfy a proof of work, so their low bits are as good as random
+struct BlockHasher
+{
+    size_t operator()(const uint256& hash) const { return hash.GetLow64(); }
+};
+
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+
 /** The maximum allowed size for a serialized block, in bytes (network rule) */
 static const unsigned int MAX_BLOCK_SIZE = 1000000;
 /** Default for -blockmaxsize and -blockminsize, which control the range of sizes the mining code will create **/
@@ -54,11 +66,29 @@ static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** Number of blocks below the tip whose block and undo files are kept with -prune, for reorganizations */
+static const int MIN_BLOCKS_TO_KEEP = 288;
+/** Smallest -prune target: the kept blocks, the open block file and the undo data */
+static const uint64_t MIN_DISK_SPACE_FOR_BLOCK_FILES = 550 * 1024 * 1024;
 /** Coinbase transaction outputs can only be spent after this number of new blocks (network rule) */
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
-/** Default for -maxorphanblocks, maximum number of orphan blocks kept in memory */
+/** Default for -maxorphantxsize, maximum kilobytes of orphan transactions kept in memory */
+static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE = 500;
+/** Seconds an orphan transaction is kept waiting for its parents */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Default for -maxorphanblocks, maximum number of orphan blocks kept */
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 750;
+/** Default for -maxorphanblocksize, maximum megabytes of orphan blocks kept in memory; the others wait on disk */
+static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS_SIZE = 32;
+/** Default for -maxmempool, maximum megabytes of memory used by the transaction memory pool */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Defaults for -limitancestorcount and -limitancestorsize (in kB): the most a memory pool transaction may have with its in-pool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Defaults for -limitdescendantcount and -limitdescendantsize (in kB): the most a memory pool transaction may have with its in-pool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
 static const int COINBASE_MATURITY = 5;
 
 /** DGC V3 Hard Fork Block */
@@ -78,8 +108,24 @@ static const int MAX_SCRIPTCHECK_THREADS = 16;
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 500;
+/** -blockpipeline default (received blocks checked ahead of the one being connected, 0 = none) */
+static const int DEFAULT_BLOCK_PIPELINE_DEPTH = 16;
 /** Timeout in seconds before considering a block download peer unresponsive. */
 static const unsigned int BLOCK_DOWNLOAD_TIMEOUT = 60;
+/** Maximum number of headers sent in one "headers" message. */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Blocks headers-first sync may have requested but not yet connected; kept below the orphan block limit. */
+static const unsigned int BLOCK_DOWNLOAD_WINDOW = 512;
+/** Blocks kept requested from a peer whose download rate is not known yet. */
+static const int BLOCK_DOWNLOAD_TARGET_INITIAL = 16;
+/** Default for -headersfirst */
+static const bool DEFAULT_HEADERS_FIRST = true;
+/** Default for -dbflushinterval, maximum seconds between chainstate writes during initial block download */
+static const int64_t DEFAULT_DB_FLUSH_INTERVAL = 600;
+/** Default for -dbmaxdirty, modified outputs after which the chainstate is
+ *  written even during initial block download; this bounds the write at
+ *  shutdown */
+static const int64_t DEFAULT_DB_MAX_DIRTY = 250000;
 
 #ifdef USE_UPNP
 static const int fHaveUPnP = true;
@@ -100,8 +146,26 @@ static const unsigned char REJECT_CHECKPOINT = 0x43;
 
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
+/** Guards mapBlockIndex and chainActive for readers outside validation.
+ *  Both only change with cs_main and cs_chainview held, so holding either
+ *  is enough to read them. cs_chainview is held briefly and no other lock
+ *  is taken under it, so the wallet, RPC and the GUI may take it under
+ *  their own locks without waiting for block validation. The block index
+ *  entries' hash, height, header fields and ancestor links never change
+ *  once inserted, and may be read without any lock. */
+extern CCriticalSection cs_chainview;
 extern CTxMemPool mempool;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern CWaitableCriticalSection csBestBlock;
+extern CConditionVariable cvBlockChange;
+extern CBlockFileMapper blockfilemapper;
+extern CBlockCache blockcache;
+extern CTxCache txcache;
+extern CTxidCache txidcache;
+extern BlockMap mapBlockIndex;
+/** Block index entries no other entry builds on: the tip of the active chain
+ *  and of every fork. Kept up to date as entries are added, so listing forks
+ *  does not scan mapBlockIndex. Protected by cs_main. */
+extern std::set<CBlockIndex*> setChainTips;
 extern uint64_t nLastBlockTx;
 extern uint64_t nLastBlockSize;
 extern const std::string strMessageMagic;
@@ -109,9 +173,21 @@ extern int64_t nTimeBestReceived;
 extern bool fImporting;
 extern bool fReindex;
 extern bool fBenchmark;
+extern bool fHeadersFirst;
 extern int nScriptCheckThreads;
+extern int nBlockPipelineDepth;
 extern bool fTxIndex;
-extern unsigned int nCoinCacheSize;
+extern bool fBlockFilterIndex;
+extern bool fAddressIndex;
+extern bool fSpentIndex;
+extern bool fPruneMode;
+extern bool fHavePruned;
+extern uint64_t nPruneTarget;
+extern int nBlockCompression;
+extern size_t nCoinCacheUsage;
+extern int64_t nDbFlushInterval;
+extern int64_t nDbMaxDirty;
+extern uint256 hashAssumeValid;
 extern int miningAlgo;
 
 
@@ -120,13 +196,19 @@ static const uint64_t nMinDiskSpace = 52428800;
 
 
 class CCoinsDB;
+class CCoinsViewAsyncDB;
+class CCoinsViewDB;
 class CBlockTreeDB;
 struct CDiskBlockPos;
+struct CDiskTxPos;
 class CTxUndo;
 class CScriptCheck;
 class CValidationState;
 class CWalletInterface;
 struct CNodeStateStats;
+struct CMemoryUsageStats;
+struct CBlockConnectTimings;
+struct CBlockReplayStats;
 
 struct CBlockTemplate;
 
@@ -138,6 +220,10 @@ void UnregisterWallet(CWalletInterface* pwalletIn);
 void UnregisterAllWallets();
 /** Push an updated transaction to all registered wallets */
 void SyncWithWallets(const uint256 &hash, const CTransaction& tx, const CBlock* pblock = NULL);
+/** Tell the wallets about transactions and the best chain on this thread, in the order validation queues them */
+void ThreadWalletNotify();
+/** Wait until the wallets have been told everything queued so far. Not to be called with cs_main held. */
+void SyncWalletNotifications();
 
 /** Register with a network node to receive its signals */
 void RegisterNodeSignals(CNodeSignals& nodeSignals);
@@ -146,14 +232,21 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals);
 
 void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd);
 
-/** Process an incoming block */
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL);
+/** Send a block whose transactions are known to be valid on the tip as a
+ *  compact block to the peers taking them, ahead of connecting it. Requires cs_main. */
+void AnnounceNewBlock(const CBlock& block);
+/** Process an incoming block; fChecked tells that it passed CheckBlock already */
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL, bool fChecked = false);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64_t nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
 FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 /** Open an undo file (rev?????.dat) */
 FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
+/** Total size of the block and undo files on disk */
+uint64_t CalculateCurrentUsage();
+/** With -prune, delete the oldest block and undo files while they use more than the target */
+void PruneBlockFiles();
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
 /** Initialize a new block tree database + block data on disk */
@@ -164,6 +257,12 @@ bool LoadBlockIndex();
 void UnloadBlockIndex();
 /** Verify consistency of the block and coin databases */
 bool VerifyDB(int nCheckLevel, int nCheckDepth);
+/** The same, on a snapshot of the coin database without holding cs_main, so
+ *  the node can run meanwhile */
+bool VerifyDBBackground(int nCheckLevel, int nCheckDepth);
+/** Disconnect the last nBlocks blocks of the active chain in memory and connect
+ *  them again, timing each phase; see CBlockReplayStats */
+bool ReplayBlocks(int nBlocks, std::vector<CBlockReplayStats> &vStats);
 /** Print the loaded block tree */
 void PrintBlockTree();
 /** Process protocol messages received from a given node */
@@ -172,6 +271,18 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the header proof-of-work verification thread */
+void ThreadPoWCheck();
+/** Run an instance of the block input prefetching thread */
+void ThreadPrefetchCoins();
+/** Run the background writer of the chain state */
+void ThreadFlushChainState();
+/** Run the thread connecting the received blocks checked on the message handler threads */
+void ThreadConnectBlocks();
+/** Run the background rewriting of finished block files with compressed records */
+void ThreadRecompressBlockFiles();
+/** Make block and undo data and the block index durable, before the chain state may refer to them */
+bool SyncBlockStorage();
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
 bool CheckProofOfWork(uint256 hash, unsigned int nBits, int algo);
 /** Calculate the minimum amount of work a received block needs, without knowing its direct parent */
@@ -184,6 +295,11 @@ bool IsInitialBlockDownload();
 std::string GetWarnings(std::string strFor);
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock, bool fAllowSlow = false);
+/** Retrieve several transactions as GetTransaction with fAllowSlow does, reading those
+ *  of the transaction index in block file order; vFound tells which were found */
+void GetTransactions(const std::vector<uint256> &vHash, std::vector<CTransaction> &vTx, std::vector<uint256> &vHashBlock, std::vector<bool> &vFound);
+/** Read the transaction at a transaction index position, and the hash of its block */
+bool ReadTxFromDisk(const CDiskTxPos &postx, CTransaction &tx, uint256 &hashBlock);
 /** Find the best known block, and make it the tip of the block chain */
 bool ActivateBestChain(CValidationState &state);
 int64_t GetBlockValue(int nHeight, int64_t nFees);
@@ -196,18 +312,33 @@ void UpdateTime(CBlockHeader& block, const CBlockIndex* pindexPrev);
 /** Create a new block index entry for a given block hash */
 CBlockIndex * InsertBlockIndex(uint256 hash);
 /** Verify a signature */
-bool VerifySignature(const CCoins& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+bool VerifySignature(const CCoin& coinFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
 /** Abort with a message */
 bool AbortNode(const std::string &msg);
 /** Get statistics from node state */
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
+/** Measure the memory held by the node's larger structures */
+void GetMemoryUsageStats(CMemoryUsageStats &stats);
 /** Increase a node's misbehavior score. */
 void Misbehaving(NodeId nodeid, int howmuch);
 
 
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectInsaneFee=false);
+                        bool* pfMissingInputs, bool fRejectInsaneFee=false, int64_t nAcceptTime=0);
+/** Write the memory pool to mempool.dat, for LoadMempool after a restart */
+bool DumpMempool();
+/** Re-validate the transactions of mempool.dat into the memory pool */
+bool LoadMempool();
+/** Write the outpoints of the coins cache and of the mempool inputs to
+ *  coinscache.dat, for ThreadWarmCoinsCache after a restart */
+bool DumpCoinsCache();
+/** Read the coins listed in coinscache.dat into the coins cache, a batch at a time */
+void ThreadWarmCoinsCache();
+/** Verify the scripts of transactions about to be passed to AcceptToMemoryPool
+ *  in parallel, so the signature cache has their valid signatures and the
+ *  acceptance one after the other is quick. */
+void PrecheckTransactionScripts(const std::vector<CTransaction> &vtx);
 
 
 
@@ -218,6 +349,78 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
 
 struct CNodeStateStats {
     int nMisbehavior;
+    int nBlocksInFlight;
+    int nBlockDownloadTarget;
+    int64_t nBlockServiceUsec;
+};
+
+/** Approximate heap memory of the node's larger structures, in bytes */
+struct CMemoryUsageStats {
+    size_t nCoinsCache;
+    size_t nMempool;
+    size_t nBlockIndex;     // entries, hash map, candidate tips and active chain
+    size_t nOrphanTransactions;
+    size_t nOrphanBlocks;
+    size_t nPeers;          // receive and send queues, known inventory and addresses
+    size_t nSignatureCache;
+    size_t nWallet;         // the registered wallets
+
+    CMemoryUsageStats() : nCoinsCache(0), nMempool(0), nBlockIndex(0), nOrphanTransactions(0),
+                          nOrphanBlocks(0), nPeers(0), nSignatureCache(0), nWallet(0) {}
+
+    size_t GetTotal() const {
+        return nCoinsCache + nMempool + nBlockIndex + nOrphanTransactions + nOrphanBlocks +
+               nPeers + nSignatureCache + nWallet;
+    }
+};
+
+/** Time spent connecting blocks, by phase, in microseconds */
+struct CBlockConnectTimings
+{
+    int64_t nPoW;     // checking the proof of work, if not done on receipt
+    int64_t nCheck;   // the other context-free checks of CheckBlock
+    int64_t nFetch;   // reading the inputs into the block's coins view
+    int64_t nConnect; // checking the inputs and updating the coins, with the scripts queued
+    int64_t nScripts; // waiting for the script checks to finish
+    int64_t nUndo;    // writing the undo data
+    int64_t nIndex;   // writing the block, transaction, address and filter indexes
+    int64_t nFlush;   // flushing the block's coins view into its parent
+    unsigned int nScriptChecks;  // script checks queued
+    int64_t nScriptVerify;       // time the checks took, summed over the threads
+
+    CBlockConnectTimings() : nPoW(0), nCheck(0), nFetch(0), nConnect(0), nScripts(0), nUndo(0), nIndex(0), nFlush(0),
+                             nScriptChecks(0), nScriptVerify(0) {}
+
+    CBlockConnectTimings &operator+=(const CBlockConnectTimings &other) {
+        nPoW += other.nPoW;
+        nCheck += other.nCheck;
+        nFetch += other.nFetch;
+        nConnect += other.nConnect;
+        nScripts += other.nScripts;
+        nUndo += other.nUndo;
+        nIndex += other.nIndex;
+        nFlush += other.nFlush;
+        nScriptChecks += other.nScriptChecks;
+        nScriptVerify += other.nScriptVerify;
+        return *this;
+    }
+};
+
+/** Timings of the blocks replayed by ReplayBlocks that fall in one period of
+ *  the difficulty rules (starting at 0, DIFF_SWITCH_HEIGHT, DIFF2_SWITCH_HEIGHT
+ *  or V3_FORK) */
+struct CBlockReplayStats
+{
+    int nRulesHeight;      // height the period starts at
+    int nFirstHeight;      // first and last block replayed
+    int nLastHeight;
+    unsigned int nBlocks;
+    uint64_t nTransactions;
+    uint64_t nInputs;
+    int64_t nDisconnect;   // disconnecting the blocks, in microseconds
+    CBlockConnectTimings timings;
+
+    CBlockReplayStats() : nRulesHeight(0), nFirstHeight(0), nLastHeight(0), nBlocks(0), nTransactions(0), nInputs(0), nDisconnect(0) {}
 };
 
 struct CDiskBlockPos
@@ -295,11 +498,29 @@ int64_t GetMinFee(const CTransaction& tx, unsigned int nBytes, bool fAllowFree,
 //   DUP CHECKSIG DROP ... repeated 100 times... OP_1
 //
 
+/** What the standardness and sigop checks need of a transaction's scripts,
+    found in one pass over them, so that the memory pool, block templates and
+    block connection need not parse them again
+*/
+struct CTxAnalysis
+{
+    unsigned int nSize; // Serialized size
+    unsigned int nLegacySigOps; // As GetLegacySigOpCount
+    unsigned int nP2SHSigOps; // As GetP2SHSigOpCount, once AreInputsStandard has the inputs
+    bool fPushOnly; // Whether every scriptSig only pushes data
+    const char* pszScriptSigReason; // Why the first non-standard scriptSig is, or NULL
+    std::vector<txnouttype> vOutTypes; // Type of each output, TX_NONSTANDARD unless IsStandard
+};
+
+void AnalyzeTransaction(const CTransaction& tx, CTxAnalysis& analysis);
+
 /** Check for standard transaction types
     @param[in] mapInputs    Map of previous transactions that have outputs we're spending
     @return True if all inputs (scriptSigs) use only standard transaction forms
 */
 bool AreInputsStandard(const CTransaction& tx, CCoinsViewCache& mapInputs);
+/** The same, counting the pay-to-script-hash sigops into analysis on success */
+bool AreInputsStandard(const CTransaction& tx, CCoinsViewCache& mapInputs, CTxAnalysis& analysis);
 
 /** Count ECDSA signature operations the old-fashioned (pre-0.6) way
     @return number of sigops this transaction's outputs will produce when spent
@@ -340,6 +561,7 @@ bool CheckTransaction(const CTransaction& tx, CValidationState& state);
     @return True if all outputs (scriptPubKeys) use only standard transaction forms
 */
 bool IsStandardTx(const CTransaction& tx, std::string& reason);
+bool IsStandardTx(const CTransaction& tx, const CTxAnalysis& analysis, std::string& reason);
 
 bool IsFinalTx(const CTransaction &tx, int nBlockHeight = 0, int64_t nBlockTime = 0);
 
@@ -353,23 +575,22 @@ public:
         READWRITE(vtxundo);
     )
 
-    bool WriteToDisk(CDiskBlockPos &pos, const uint256 &hashBlock)
+    // Write the undo data, serialized as record, and its checksum
+    bool WriteToDisk(const CDiskRecord &record, CDiskBlockPos &pos, const uint256 &hashBlock)
     {
         // Open history file to append
         CAutoFile fileout = CAutoFile(OpenUndoFile(pos), SER_DISK, CLIENT_VERSION);
         if (!fileout)
             return error("CBlockUndo::WriteToDisk : OpenUndoFile failed");
+        return WriteToFile(fileout, record, pos, hashBlock, !IsInitialBlockDownload());
+    }
 
-        // Write index header
-        unsigned int nSize = fileout.GetSerializeSize(*this);
-        fileout << FLATDATA(Params().MessageStart()) << nSize;
-
-        // Write undo data
-        long fileOutPos = ftell(fileout);
-        if (fileOutPos < 0)
-            return error("CBlockUndo::WriteToDisk : ftell failed");
-        pos.nPos = (unsigned int)fileOutPos;
-        fileout << *this;
+    // Append the undo record to an open file, and set pos.nPos to its offset
+    bool WriteToFile(CAutoFile &fileout, const CDiskRecord &record, CDiskBlockPos &pos, const uint256 &hashBlock, bool fCommit)
+    {
+        // Write index header and undo data
+        if (!WriteDiskRecord(fileout, record, pos.nPos))
+            return error("CBlockUndo::WriteToDisk : failed to write undo data");
 
         // calculate & write checksum
         CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
@@ -379,7 +600,7 @@ public:
 
         // Flush stdio buffers and commit to disk before returning
         fflush(fileout);
-        if (!IsInitialBlockDownload())
+        if (fCommit)
             FileCommit(fileout);
 
         return true;
@@ -387,15 +608,21 @@ public:
 
     bool ReadFromDisk(const CDiskBlockPos &pos, const uint256 &hashBlock)
     {
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+        // Open history file to read, at the index header
+        if (pos.nPos < 8)
+            return error("CBlockUndo::ReadFromDisk : invalid position");
+        CAutoFile filein = CAutoFile(OpenUndoFile(CDiskBlockPos(pos.nFile, pos.nPos - 8), true), SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CBlockUndo::ReadFromDisk : OpenBlockFile failed");
 
-        // Read block
+        // Read undo data, which may be compressed
+        std::vector<char> vch;
+        if (!ReadDiskRecord(filein, MAX_SIZE, vch))
+            return error("CBlockUndo::ReadFromDisk : failed to read undo data");
         uint256 hashChecksum;
         try {
-            filein >> *this;
+            CSpanReader ssUndo(vch.empty() ? NULL : &vch[0], vch.empty() ? NULL : &vch[0] + vch.size(), SER_DISK, CLIENT_VERSION);
+            ssUndo >> *this;
             filein >> hashChecksum;
         }
         catch (std::exception &e) {
@@ -424,12 +651,15 @@ private:
     unsigned int nIn;
     unsigned int nFlags;
     int nHashType;
+    // shared by the checks of the inputs of ptxTo
+    boost::shared_ptr<const CSignatureHashCache> psighashcache;
 
 public:
     CScriptCheck() {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
-        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+    CScriptCheck(const CCoin& coinFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn,
+                 const boost::shared_ptr<const CSignatureHashCache> &psighashcacheIn = boost::shared_ptr<const CSignatureHashCache>()) :
+        scriptPubKey(coinFromIn.out.scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn), psighashcache(psighashcacheIn) { }
 
     bool operator()() const;
 
@@ -439,6 +669,7 @@ public:
         std::swap(nIn, check.nIn);
         std::swap(nFlags, check.nFlags);
         std::swap(nHashType, check.nHashType);
+        psighashcache.swap(check.psighashcache);
     }
 };
 
@@ -556,11 +787,12 @@ protected:
         return (nTransactions+(1 << height)-1) >> height;
     }
 
-    // calculate the hash of a node in the merkle tree (at leaf level: the txid's themself)
-    uint256 CalcHash(int height, unsigned int pos, const std::vector<uint256> &vTxid);
+    // look up the hash of a node in the merkle tree (at leaf level: the txid's themself)
+    // in the levels built by BuildMerkleTreeLevels
+    uint256 CalcHash(int height, unsigned int pos, const std::vector<uint256> &vTree);
 
     // recursive function that traverses tree nodes, storing the data as bits and hashes
-    void TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vTxid, const std::vector<bool> &vMatch);
+    void TraverseAndBuild(int height, unsigned int pos, const std::vector<uint256> &vTree, const std::vector<bool> &vMatch);
 
     // recursive function that traverses tree nodes, consuming the bits and hashes produced by TraverseAndBuild.
     // it returns the hash of the respective node.
@@ -601,9 +833,15 @@ public:
 
 
 /** Functions for disk access for blocks */
-bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
+bool WriteBlockToDisk(const CDiskRecord& record, CDiskBlockPos& pos);
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, bool fCheckPOW = true);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Get the serialized bytes of a block from the block cache or straight from
+ *  its memory-mapped block file */
+bool ReadRawBlockFromDisk(CRawBlock& raw, const CBlockIndex* pindex);
+/** Get the txids of a block, in order, from the txid or block cache, or by
+ *  reading it once and keeping them in txidcache */
+bool GetBlockTxids(std::vector<uint256>& vTxid, const CBlockIndex* pindex);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -611,21 +849,33 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
  *  In case pfClean is provided, operation will try to be tolerant about errors, and *pfClean
  *  will be true if no problems were found. Otherwise, the return value will be false in case
- *  of problems. Note that in any case, coins may be modified. */
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL);
+ *  of problems. Note that in any case, coins may be modified. With fUpdateIndexes,
+ *  the block is also removed from the address and spent indexes. */
+bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL, bool fUpdateIndexes = false);
+
+// Apply the effects of this block (with given index) on the UTXO set represented by coins.
+// If ptimings is given, the time spent in its phases is added to it.
+bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck = false, CBlockConnectTimings *ptimings = NULL);
 
-// Apply the effects of this block (with given index) on the UTXO set represented by coins
-bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck = false);
+// Add this block to the block index, and if necessary, switch the active block chain to this.
+// Without fActivate the caller switches the chain, once for a batch of blocks.
+bool AddToBlockIndex(CBlock& block, CValidationState& state, const CDiskBlockPos& pos, bool fActivate = true);
 
-// Add this block to the block index, and if necessary, switch the active block chain to this
-bool AddToBlockIndex(CBlock& block, CValidationState& state, const CDiskBlockPos& pos);
+// Add the index entry of a block of a coin snapshot, whose data is never
+// stored, after the checks of its header against its parent. The proof of
+// work of the header itself is left to the caller.
+bool AddSnapshotBlockIndex(CBlockHeader& header, unsigned int nTx, CValidationState& state, CBlockIndex** ppindex);
 
 // Context-independent validity checks
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
 
+// Validity checks of a block header against its parent, the ones of
+// AcceptBlock that need no transactions
+bool CheckBlockHeaderOnParent(const CBlockHeader& block, CBlockIndex* pindexPrev, CValidationState& state);
+
 // Store block on disk
 // if dbp is provided, the file is known to already reside on disk
-bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp = NULL);
+bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp = NULL, bool fActivate = true);
 
 
 
@@ -697,7 +947,10 @@ enum BlockStatus {
 
     BLOCK_FAILED_VALID       =   32, // stage after last reached validness failed
     BLOCK_FAILED_CHILD       =   64, // descends from failed block
-    BLOCK_FAILED_MASK        =   96
+    BLOCK_FAILED_MASK        =   96,
+
+    BLOCK_POW_CHECKED        =  128, // header proof of work verified; blocks read back by hash need not be rehashed
+    BLOCK_HAVE_WORK          =  256  // nChainWork stored with the entry in the block tree database
 };
 
 const int64_t multiAlgoDiffChangeTarget = 960000; // block where multi-algo work weighting starts 145000
@@ -716,6 +969,9 @@ public:
     // pointer to the index of the predecessor of this block
     CBlockIndex* pprev;
 
+    // pointer to the index of some further predecessor of this block, see GetAncestor()
+    CBlockIndex* pskip;
+
     // height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
@@ -751,10 +1007,15 @@ public:
     // (memory only) Sequencial id assigned to distinguish order in which blocks are received.
     uint32_t nSequenceId;
 
+    // (memory only) Height of the most recent ancestor mined with each algo, -1 if
+    // there is none. Heights take half the memory of pointers; see GetPrevAlgo()
+    int nHeightPrevAlgo[NUM_ALGOS];
+
     CBlockIndex()
     {
         phashBlock = NULL;
         pprev = NULL;
+        pskip = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
@@ -764,6 +1025,8 @@ public:
         nChainTx = 0;
         nStatus = 0;
         nSequenceId = 0;
+        for (int algo = 0; algo < NUM_ALGOS; algo++)
+            nHeightPrevAlgo[algo] = -1;
 
         nVersion       = 0;
         hashMerkleRoot = 0;
@@ -776,6 +1039,7 @@ public:
     {
         phashBlock = NULL;
         pprev = NULL;
+        pskip = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
@@ -785,6 +1049,8 @@ public:
         nChainTx = 0;
         nStatus = 0;
         nSequenceId = 0;
+        for (int algo = 0; algo < NUM_ALGOS; algo++)
+            nHeightPrevAlgo[algo] = -1;
 
         nVersion       = block.nVersion;
         hashMerkleRoot = block.hashMerkleRoot;
@@ -795,6 +1061,10 @@ public:
 
     int GetAlgo() const { return ::GetAlgo(nVersion); }
 
+    // Most recent ancestor mined with algo, NULL if there is none
+    CBlockIndex* GetPrevAlgo(int algo) { return GetAncestor(nHeightPrevAlgo[algo]); }
+    const CBlockIndex* GetPrevAlgo(int algo) const { return GetAncestor(nHeightPrevAlgo[algo]); }
+
     CDiskBlockPos GetBlockPos() const {
         CDiskBlockPos ret;
         if (nStatus & BLOCK_HAVE_DATA) {
@@ -836,28 +1106,27 @@ public:
         return (int64_t)nTime;
     }
 
-    CBigNum GetPrevWorkForAlgo(int algo) const
+    uint256 GetPrevWorkForAlgo(int algo) const
     {
-        CBigNum nWork;
-        CBlockIndex* pindex = this->pprev;
-        while (pindex)
-        {
-            if (pindex->GetAlgo() == algo)
-            {
-                return pindex->GetBlockWork();
-            }
-            pindex = pindex->pprev;
-        }
-        return Params().ProofOfWorkLimit(algo);
+        const CBlockIndex* pindexPrevAlgo = GetPrevAlgo(algo);
+        if (pindexPrevAlgo)
+            return pindexPrevAlgo->GetBlockWork();
+        return Params().PowLimit(algo);
     }
 
-    CBigNum GetBlockWork() const
+    uint256 GetBlockWork() const
     {
-        CBigNum bnTarget;
-        bnTarget.SetCompact(nBits);
-        if (bnTarget <= 0)
+        uint256 bnTarget;
+        bool fNegative;
+        bool fOverflow;
+        bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
+        if (fNegative || fOverflow || bnTarget == 0)
             return 0;
-        return (CBigNum(1)<<256) / (bnTarget+1);
+        // 2**256 / (bnTarget+1) does not fit in a uint256, but it equals
+        // ~bnTarget / (bnTarget+1) + 1
+        uint256 bnWork = ~bnTarget / (bnTarget + 1);
+        bnWork += 1;
+        return bnWork;
     }
 
     int GetAlgoWorkFactor() const 
@@ -884,13 +1153,13 @@ public:
         }
     }
 
-    CBigNum GetBlockWorkAdjusted() const
+    uint256 GetBlockWorkAdjusted() const
     {
-        CBigNum bnRes;
+        uint256 bnRes;
 	if ((TestNet() && (nHeight >= 1)) || (!TestNet() && nHeight >= V3_FORK)) 
 	{
 		// Adjusted Block Work is the Sum of work of this block and the most recent work of one block of each algo
-		CBigNum nBlockWork = GetBlockWork();
+		uint256 nBlockWork = GetBlockWork();
 		int nAlgo = GetAlgo();
 		for (int algo = 0; algo < NUM_ALGOS; algo++)
 		{
@@ -954,11 +1223,41 @@ public:
     {
         LogPrintf("%s\n", ToString().c_str());
     }
+
+    // Build the skiplist pointer for this entry; pprev must already be linked
+    void BuildSkip();
+
+    // Efficiently find an ancestor of this block, or NULL if height is out of range
+    CBlockIndex* GetAncestor(int height);
+    const CBlockIndex* GetAncestor(int height) const;
 };
 
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, int algo);
 const CBlockIndex* GetLastBlockIndexForAlgo(const CBlockIndex* pindex, int algo);
 
+// Number of blocks of an algorithm its statistics are taken over
+static const int ALGO_STATS_WINDOW = 25;
+
+/** Statistics of the last blocks of one algorithm in the active chain,
+ *  refreshed by UpdateTip so that RPC and GUI calls do not walk the chain */
+struct CAlgoStats
+{
+    const CBlockIndex* pindexLast; // last block of the algorithm, NULL if none
+    int nBlocks;                   // blocks of the algorithm in the window
+    double dDifficulty;            // of the last block
+    double dAvgDifficulty;         // over the window
+    int64_t nAvgSpacing;           // seconds between blocks of the algorithm, over the window
+    uint64_t nHashesPerSec;        // network hash rate estimate, as getnetworkhashps
+
+    CAlgoStats() : pindexLast(NULL), nBlocks(0), dDifficulty(0), dAvgDifficulty(0), nAvgSpacing(0), nHashesPerSec(0) {}
+};
+
+// Difficulty of a target as a multiple of the minimum difficulty
+double GetDifficultyFromBits(unsigned int nBits);
+// Network hash rate of an algorithm at block pindex, averaged over nLookup blocks of the algorithm
+uint64_t EstimateAlgoHashRate(const CBlockIndex* pindex, int algo, int nLookup);
+CAlgoStats GetAlgoStats(int algo);
+
 /** Used to marshal pointers into hashes for db storage. */
 class CDiskBlockIndex : public CBlockIndex
 {
@@ -995,6 +1294,11 @@ public:
         READWRITE(nTime);
         READWRITE(nBits);
         READWRITE(nNonce);
+
+        // Appended so that older versions, which stop reading after the
+        // header, still load the entry
+        if (nStatus & BLOCK_HAVE_WORK)
+            READWRITE(nChainWork);
     )
 
     uint256 GetBlockHash() const
@@ -1136,6 +1440,11 @@ public:
         return vChain.size() - 1;
     }
 
+    /** Memory used by the entry pointers, not the entries */
+    size_t DynamicMemoryUsage() const {
+        return memusage::DynamicUsage(vChain);
+    }
+
     /** Set/initialize a chain with a given tip. Returns the forking point. */
     CBlockIndex *SetTip(CBlockIndex *pindex);
 
@@ -1144,6 +1453,10 @@ public:
 
     /** Find the last common block between this chain and a locator. */
     CBlockIndex *FindFork(const CBlockLocator &locator) const;
+
+    /** Find the last common block between this chain and a block index
+     *  entry, or NULL if they share none, in O(log^2(height)) steps. */
+    CBlockIndex *FindFork(const CBlockIndex *pindex) const;
 };
 
 /** The currently-connected chain of blocks. */
@@ -1155,6 +1468,12 @@ extern CChain chainMostWork;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the coins database */
+extern CCoinsViewDB *pcoinsdbview;
+
+/** Global variable that points to the background writer below pcoinsTip */
+extern CCoinsViewAsyncDB *pcoinsAsync;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
@@ -1189,6 +1508,19 @@ public:
     // Note that this will call IsRelevantAndUpdate on the filter for each transaction,
     // thus the filter will likely be modified.
     CMerkleBlock(const CBlock& block, CBloomFilter& filter);
+    // The same, with the bloom filter elements of each transaction of the
+    // block extracted already
+    CMerkleBlock(const CBlock& block, CBloomFilter& filter, const std::vector<CBloomTxElements>& vElements);
+    // Create from a header and the txids of its block, matching the
+    // transactions in setTxids, with no filter or transactions needed
+    CMerkleBlock(const CBlockHeader& headerIn, const std::vector<uint256>& vTxid, const std::set<uint256>& setTxids);
+
+    CMerkleBlock() {}
+
+private:
+    void Build(const CBlock& block, CBloomFilter& filter, const std::vector<CBloomTxElements>& vElements);
+
+public:
 
     IMPLEMENT_SERIALIZE
     (
@@ -1206,6 +1538,7 @@ protected:
     virtual void UpdatedTransaction(const uint256 &hash) =0;
     virtual void Inventory(const uint256 &hash) =0;
     virtual void ResendWalletTransactions() =0;
+    virtual void AddMemoryUsage(size_t &nUsage) =0;
     friend void ::RegisterWallet(CWalletInterface*);
     friend void ::UnregisterWallet(CWalletInterface*);
     friend void ::UnregisterAllWallets();
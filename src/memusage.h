@@ -0,0 +1,120 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MEMUSAGE_H
+#define BITCOIN_MEMUSAGE_H
+
+#include "arena.h"
+#include "prevector.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+
+namespace memusage
+{
+
+/** Compute the total memory used by allocating alloc bytes, including the
+ *  malloc bookkeeping and alignment padding (measured on glibc 2.19). */
+static inline size_t MallocUsage(size_t alloc)
+{
+    if (alloc == 0)
+        return 0;
+    if (sizeof(void*) == 8)
+        return ((alloc + 31) >> 4) << 4;
+    else if (sizeof(void*) == 4)
+        return ((alloc + 15) >> 3) << 3;
+    assert(0);
+    return 0;
+}
+
+/** Approximation of the node layout used by the red-black trees of std::map and std::set. */
+template<typename X>
+struct stl_tree_node
+{
+private:
+    int color;
+    void* parent;
+    void* left;
+    void* right;
+    X x;
+};
+
+/** Approximation of the node layout used by boost::unordered_map. */
+template<typename X>
+struct unordered_node : private X
+{
+private:
+    void* ptr;
+};
+
+// Dynamic memory usage of containers, not counting the container object
+// itself nor any memory owned by the elements.
+
+template<typename X>
+static inline size_t DynamicUsage(const std::vector<X>& v)
+{
+    return MallocUsage(v.capacity() * sizeof(X));
+}
+
+template<typename X>
+static inline size_t DynamicUsage(const std::vector<X, arena_allocator<X> >& v)
+{
+    if (v.capacity() == 0)
+        return 0;
+    return MallocUsage(ARENA_HEADER_SIZE + v.capacity() * sizeof(X));
+}
+
+template<unsigned int N, typename X>
+static inline size_t DynamicUsage(const prevector<N, X>& v)
+{
+    if (v.allocated_memory() == 0)
+        return 0;
+    return MallocUsage(ARENA_HEADER_SIZE + v.allocated_memory());
+}
+
+template<typename X, typename Y>
+static inline size_t DynamicUsage(const std::set<X, Y>& s)
+{
+    return MallocUsage(sizeof(stl_tree_node<X>)) * s.size();
+}
+
+template<typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const std::map<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(stl_tree_node<std::pair<const X, Y> >)) * m.size();
+}
+
+template<typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const std::multimap<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(stl_tree_node<std::pair<const X, Y> >)) * m.size();
+}
+
+template<typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
+}
+
+template<typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const boost::unordered_multimap<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
+}
+
+template<typename X, typename Y>
+static inline size_t DynamicUsage(const boost::unordered_set<X, Y>& s)
+{
+    return MallocUsage(sizeof(unordered_node<X>)) * s.size() + MallocUsage(sizeof(void*) * s.bucket_count());
+}
+
+}
+
+#endif
@@ -0,0 +1,333 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "metrics.h"
+
+#include "core.h"
+#include "main.h"
+#include "net.h"
+#include "sync.h"
+#include "txmempool.h"
+#include "util.h"
+#ifdef ENABLE_WALLET
+#include "miner.h"
+#endif
+
+#include <algorithm>
+#include <map>
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+// Counters and gauges for Prometheus, served as text on the RPC port. The
+// histograms recorded here are kept from startup, or for RPC calls from the
+// last getrpcstats reset; everything else is read from the structures that
+// already count it when /metrics is requested.
+
+static const int64_t METRICS_BUCKET_LIMITS[METRICS_BUCKETS - 1] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 10000000
+};
+
+CMetricsHistogram::CMetricsHistogram() : nCount(0), nSumMicros(0)
+{
+    for (unsigned int i = 0; i < METRICS_BUCKETS; i++)
+        vBuckets[i] = 0;
+}
+
+void CMetricsHistogram::Observe(int64_t nMicros)
+{
+    unsigned int nBucket = 0;
+    while (nBucket < METRICS_BUCKETS - 1 && nMicros > METRICS_BUCKET_LIMITS[nBucket])
+        nBucket++;
+    vBuckets[nBucket]++;
+    nCount++;
+    nSumMicros += nMicros;
+}
+
+int64_t CMetricsHistogram::BucketLimit(unsigned int nBucket)
+{
+    return nBucket < METRICS_BUCKETS - 1 ? METRICS_BUCKET_LIMITS[nBucket] : 0;
+}
+
+static CCriticalSection cs_metrics;
+static map<string, CMetricsHistogram> mapBlockConnectPhases;
+static map<string, CMetricsHistogram> mapWalletFlushPhases;
+static CRPCStatsMap mapRPCMethods;
+
+void RecordBlockConnectMetrics(const CBlockConnectTimings& timings, int64_t nTotalMicros)
+{
+    LOCK(cs_metrics);
+    mapBlockConnectPhases["pow"].Observe(timings.nPoW);
+    mapBlockConnectPhases["check"].Observe(timings.nCheck);
+    mapBlockConnectPhases["fetch"].Observe(timings.nFetch);
+    mapBlockConnectPhases["connect"].Observe(timings.nConnect);
+    mapBlockConnectPhases["scripts"].Observe(timings.nScripts);
+    mapBlockConnectPhases["undo"].Observe(timings.nUndo);
+    mapBlockConnectPhases["index"].Observe(timings.nIndex);
+    mapBlockConnectPhases["flush"].Observe(timings.nFlush);
+    mapBlockConnectPhases["total"].Observe(nTotalMicros);
+}
+
+void RecordWalletFlushMetrics(int64_t nCheckpointMicros, int64_t nDetachMicros)
+{
+    LOCK(cs_metrics);
+    mapWalletFlushPhases["checkpoint"].Observe(nCheckpointMicros);
+    mapWalletFlushPhases["detach"].Observe(nDetachMicros);
+}
+
+void RecordRPCStart(const string& strMethod)
+{
+    LOCK(cs_metrics);
+    CRPCMethodStats& stats = mapRPCMethods[strMethod];
+    stats.nActive++;
+    stats.nMaxActive = std::max(stats.nMaxActive, stats.nActive);
+}
+
+void RecordRPCFinish(const string& strMethod, int64_t nMicros, int64_t nLockWaitMicros, uint64_t nBytes, bool fError)
+{
+    LOCK(cs_metrics);
+    CRPCMethodStats& stats = mapRPCMethods[strMethod];
+    stats.latency.Observe(nMicros);
+    if (fError)
+        stats.nErrors++;
+    stats.nBytes += nBytes;
+    stats.nLockWaitMicros += nLockWaitMicros;
+    stats.nMaxMicros = std::max(stats.nMaxMicros, nMicros);
+    // Not below zero for the calls that started before a reset
+    if (stats.nActive > 0)
+        stats.nActive--;
+}
+
+CRPCStatsMap GetRPCStats(bool fReset)
+{
+    LOCK(cs_metrics);
+    CRPCStatsMap mapRet = mapRPCMethods;
+    if (fReset) {
+        for (CRPCStatsMap::iterator it = mapRPCMethods.begin(); it != mapRPCMethods.end(); ++it) {
+            CRPCMethodStats stats;
+            stats.nActive = stats.nMaxActive = it->second.nActive;
+            it->second = stats;
+        }
+    }
+    return mapRet;
+}
+
+// Label values are chosen by peers (message commands) or come from source
+// paths, so quote what the text format requires
+static string MetricsLabel(const string& strName, const string& strValue)
+{
+    string strEscaped;
+    BOOST_FOREACH(char c, strValue) {
+        if (c == '\\' || c == '"')
+            strEscaped += '\\';
+        if (c == '\n')
+            strEscaped += "\\n";
+        else
+            strEscaped += c;
+    }
+    return strName + "=\"" + strEscaped + "\"";
+}
+
+static string MetricsSeconds(int64_t nMicros)
+{
+    return strprintf("%.6f", nMicros * 0.000001);
+}
+
+static void MetricsHeader(string& strOut, const string& strName, const char* pszType, const char* pszHelp)
+{
+    strOut += "# HELP digitalcoin_" + strName + " " + pszHelp + "\n";
+    strOut += "# TYPE digitalcoin_" + strName + " " + pszType + "\n";
+}
+
+static void MetricsValue(string& strOut, const string& strName, const string& strLabels, const string& strValue)
+{
+    strOut += "digitalcoin_" + strName;
+    if (!strLabels.empty())
+        strOut += "{" + strLabels + "}";
+    strOut += " " + strValue + "\n";
+}
+
+static void MetricsValue(string& strOut, const string& strName, const string& strLabels, int64_t nValue)
+{
+    MetricsValue(strOut, strName, strLabels, strprintf("%d", nValue));
+}
+
+static void MetricsValue(string& strOut, const string& strName, const string& strLabels, uint64_t nValue)
+{
+    MetricsValue(strOut, strName, strLabels, strprintf("%u", nValue));
+}
+
+static void MetricsValue(string& strOut, const string& strName, const string& strLabels, double dValue)
+{
+    MetricsValue(strOut, strName, strLabels, strprintf("%.8g", dValue));
+}
+
+// Append one histogram series in seconds from per-bucket counts, where
+// limit(i) is the upper bound of bucket i in microseconds, 0 for the last
+template <typename T>
+static void MetricsHistogram(string& strOut, const string& strName, const string& strLabels,
+                             const T* vBuckets, unsigned int nBuckets, int64_t (*limit)(unsigned int),
+                             int64_t nSumMicros)
+{
+    string strPrefix = strLabels.empty() ? "" : strLabels + ",";
+    uint64_t nCumulative = 0;
+    for (unsigned int i = 0; i < nBuckets; i++) {
+        nCumulative += vBuckets[i];
+        int64_t nLimit = limit(i);
+        if (i < nBuckets - 1 && nLimit)
+            MetricsValue(strOut, strName + "_bucket", strPrefix + MetricsLabel("le", MetricsSeconds(nLimit)), nCumulative);
+    }
+    MetricsValue(strOut, strName + "_bucket", strPrefix + MetricsLabel("le", "+Inf"), nCumulative);
+    MetricsValue(strOut, strName + "_sum", strLabels, MetricsSeconds(nSumMicros));
+    MetricsValue(strOut, strName + "_count", strLabels, nCumulative);
+}
+
+static void MetricsHistograms(string& strOut, const string& strName, const string& strLabel,
+                              const map<string, CMetricsHistogram>& mapHistograms)
+{
+    for (map<string, CMetricsHistogram>::const_iterator it = mapHistograms.begin(); it != mapHistograms.end(); ++it)
+        MetricsHistogram(strOut, strName, MetricsLabel(strLabel, it->first), it->second.vBuckets, METRICS_BUCKETS,
+                         &CMetricsHistogram::BucketLimit, it->second.nSumMicros);
+}
+
+// Lock profile bucket 0 is under 1 microsecond and bucket i under 2^i
+static int64_t LockProfileBucketLimit(unsigned int nBucket)
+{
+    return nBucket < LOCKPROFILE_BUCKETS - 1 ? (int64_t)1 << nBucket : 0;
+}
+
+static void AppendNetMetrics(string& strOut)
+{
+    int nInbound = 0, nOutbound = 0;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(const CNode* pnode, vNodes) {
+            if (pnode->fInbound)
+                nInbound++;
+            else
+                nOutbound++;
+        }
+    }
+    MetricsHeader(strOut, "peers", "gauge", "Connected peers by direction.");
+    MetricsValue(strOut, "peers", MetricsLabel("direction", "inbound"), (int64_t)nInbound);
+    MetricsValue(strOut, "peers", MetricsLabel("direction", "outbound"), (int64_t)nOutbound);
+
+    CMessageStatsMap mapSend, mapRecv;
+    CNode::GetTotalMessageStats(mapSend, mapRecv);
+    MetricsHeader(strOut, "net_messages_total", "counter", "P2P messages by command and direction.");
+    BOOST_FOREACH(const CMessageStatsMap::value_type& item, mapSend)
+        MetricsValue(strOut, "net_messages_total", MetricsLabel("command", item.first) + "," + MetricsLabel("direction", "sent"), item.second.nMessages);
+    BOOST_FOREACH(const CMessageStatsMap::value_type& item, mapRecv)
+        MetricsValue(strOut, "net_messages_total", MetricsLabel("command", item.first) + "," + MetricsLabel("direction", "received"), item.second.nMessages);
+    MetricsHeader(strOut, "net_bytes_total", "counter", "P2P message bytes by command and direction.");
+    BOOST_FOREACH(const CMessageStatsMap::value_type& item, mapSend)
+        MetricsValue(strOut, "net_bytes_total", MetricsLabel("command", item.first) + "," + MetricsLabel("direction", "sent"), item.second.nBytes);
+    BOOST_FOREACH(const CMessageStatsMap::value_type& item, mapRecv)
+        MetricsValue(strOut, "net_bytes_total", MetricsLabel("command", item.first) + "," + MetricsLabel("direction", "received"), item.second.nBytes);
+    MetricsHeader(strOut, "net_message_process_seconds", "histogram", "Time spent processing received P2P messages, by command.");
+    BOOST_FOREACH(const CMessageStatsMap::value_type& item, mapRecv)
+        MetricsHistogram(strOut, "net_message_process_seconds", MetricsLabel("command", item.first), item.second.vLatency,
+                         MESSAGE_LATENCY_BUCKETS, &CMessageStats::LatencyBucketLimit, item.second.nTimeUsec);
+}
+
+static void AppendLockMetrics(string& strOut)
+{
+    if (!fLockProfile)
+        return;
+    vector<CLockSiteStats> vStats = GetLockProfile();
+    MetricsHeader(strOut, "lock_acquisitions_total", "counter", "Locks taken, by lock and site (-lockprofile).");
+    BOOST_FOREACH(const CLockSiteStats& stats, vStats)
+        MetricsValue(strOut, "lock_acquisitions_total", MetricsLabel("lock", stats.strName) + "," + MetricsLabel("site", strprintf("%s:%d", stats.strFile, stats.nLine)), stats.nLocks);
+    MetricsHeader(strOut, "lock_contended_total", "counter", "Locks found held by another thread, by lock and site (-lockprofile).");
+    BOOST_FOREACH(const CLockSiteStats& stats, vStats)
+        MetricsValue(strOut, "lock_contended_total", MetricsLabel("lock", stats.strName) + "," + MetricsLabel("site", strprintf("%s:%d", stats.strFile, stats.nLine)), stats.nContended);
+    MetricsHeader(strOut, "lock_hold_seconds_total", "counter", "Time locks were held, by lock and site (-lockprofile).");
+    BOOST_FOREACH(const CLockSiteStats& stats, vStats)
+        MetricsValue(strOut, "lock_hold_seconds_total", MetricsLabel("lock", stats.strName) + "," + MetricsLabel("site", strprintf("%s:%d", stats.strFile, stats.nLine)), MetricsSeconds(stats.nHoldMicros));
+    MetricsHeader(strOut, "lock_wait_seconds", "histogram", "Time spent waiting for locks, by lock and site (-lockprofile).");
+    BOOST_FOREACH(const CLockSiteStats& stats, vStats)
+        MetricsHistogram(strOut, "lock_wait_seconds", MetricsLabel("lock", stats.strName) + "," + MetricsLabel("site", strprintf("%s:%d", stats.strFile, stats.nLine)),
+                         stats.vWaitHistogram, LOCKPROFILE_BUCKETS, &LockProfileBucketLimit, stats.nWaitMicros);
+}
+
+string GetMetricsText()
+{
+    string strOut;
+    {
+        LOCK(cs_main);
+        MetricsHeader(strOut, "blocks", "gauge", "Height of the active chain.");
+        MetricsValue(strOut, "blocks", "", (int64_t)chainActive.Height());
+        MetricsHeader(strOut, "coins_cache_entries", "gauge", "Outputs in the coins cache.");
+        MetricsValue(strOut, "coins_cache_entries", "", (uint64_t)pcoinsTip->GetCacheSize());
+        MetricsHeader(strOut, "coins_cache_bytes", "gauge", "Memory used by the coins cache.");
+        MetricsValue(strOut, "coins_cache_bytes", "", (uint64_t)pcoinsTip->DynamicMemoryUsage());
+        MetricsHeader(strOut, "coins_cache_dirty_entries", "gauge", "Outputs the next coins cache flush writes.");
+        MetricsValue(strOut, "coins_cache_dirty_entries", "", (uint64_t)pcoinsTip->GetDirtyCount());
+        MetricsHeader(strOut, "coins_cache_lookups_total", "counter", "Coins cache lookups, by whether the cache had the output.");
+        MetricsValue(strOut, "coins_cache_lookups_total", MetricsLabel("result", "hit"), pcoinsTip->GetCacheHits());
+        MetricsValue(strOut, "coins_cache_lookups_total", MetricsLabel("result", "miss"), pcoinsTip->GetCacheMisses());
+    }
+
+    MetricsHeader(strOut, "mempool_transactions", "gauge", "Transactions in the memory pool.");
+    MetricsValue(strOut, "mempool_transactions", "", (uint64_t)mempool.size());
+    MetricsHeader(strOut, "mempool_bytes", "gauge", "Serialized size of the transactions in the memory pool.");
+    MetricsValue(strOut, "mempool_bytes", "", mempool.GetTotalTxSize());
+    MetricsHeader(strOut, "mempool_usage_bytes", "gauge", "Memory used by the memory pool.");
+    MetricsValue(strOut, "mempool_usage_bytes", "", (uint64_t)mempool.DynamicMemoryUsage());
+
+    CMemoryUsageStats memory;
+    GetMemoryUsageStats(memory);
+    MetricsHeader(strOut, "memory_usage_bytes", "gauge", "Approximate heap memory of the node's larger structures.");
+    MetricsValue(strOut, "memory_usage_bytes", MetricsLabel("structure", "coinscache"), (uint64_t)memory.nCoinsCache);
+    MetricsValue(strOut, "memory_usage_bytes", MetricsLabel("structure", "mempool"), (uint64_t)memory.nMempool);
+    MetricsValue(strOut, "memory_usage_bytes", MetricsLabel("structure", "blockindex"), (uint64_t)memory.nBlockIndex);
+    MetricsValue(strOut, "memory_usage_bytes", MetricsLabel("structure", "orphantransactions"), (uint64_t)memory.nOrphanTransactions);
+    MetricsValue(strOut, "memory_usage_bytes", MetricsLabel("structure", "orphanblocks"), (uint64_t)memory.nOrphanBlocks);
+    MetricsValue(strOut, "memory_usage_bytes", MetricsLabel("structure", "peers"), (uint64_t)memory.nPeers);
+    MetricsValue(strOut, "memory_usage_bytes", MetricsLabel("structure", "sigcache"), (uint64_t)memory.nSignatureCache);
+    MetricsValue(strOut, "memory_usage_bytes", MetricsLabel("structure", "wallet"), (uint64_t)memory.nWallet);
+
+    AppendNetMetrics(strOut);
+
+    MetricsHeader(strOut, "algo_difficulty", "gauge", "Difficulty of the last block of each algorithm.");
+    for (int algo = 0; algo < NUM_ALGOS; algo++)
+        MetricsValue(strOut, "algo_difficulty", MetricsLabel("algo", GetAlgoName(algo)), GetAlgoStats(algo).dDifficulty);
+    MetricsHeader(strOut, "algo_network_hashes_per_second", "gauge", "Estimated network hash rate of each algorithm.");
+    for (int algo = 0; algo < NUM_ALGOS; algo++)
+        MetricsValue(strOut, "algo_network_hashes_per_second", MetricsLabel("algo", GetAlgoName(algo)), GetAlgoStats(algo).nHashesPerSec);
+#ifdef ENABLE_WALLET
+    MetricsHeader(strOut, "algo_miner_hashes_per_second", "gauge", "Hash rate of the internal miner threads of each algorithm.");
+    for (int algo = 0; algo < NUM_ALGOS; algo++)
+        MetricsValue(strOut, "algo_miner_hashes_per_second", MetricsLabel("algo", GetAlgoName(algo)), GetMinerHashesPerSec(algo));
+#endif
+
+    AppendLockMetrics(strOut);
+
+    {
+        LOCK(cs_metrics);
+        MetricsHeader(strOut, "block_connect_seconds", "histogram", "Time spent connecting blocks to the tip, by phase.");
+        MetricsHistograms(strOut, "block_connect_seconds", "phase", mapBlockConnectPhases);
+        MetricsHeader(strOut, "wallet_flush_seconds", "histogram", "Time spent flushing the wallet file, by phase.");
+        MetricsHistograms(strOut, "wallet_flush_seconds", "phase", mapWalletFlushPhases);
+        MetricsHeader(strOut, "rpc_seconds", "histogram", "Time RPC calls took, by method.");
+        BOOST_FOREACH(const CRPCStatsMap::value_type& item, mapRPCMethods)
+            MetricsHistogram(strOut, "rpc_seconds", MetricsLabel("method", item.first), item.second.latency.vBuckets,
+                             METRICS_BUCKETS, &CMetricsHistogram::BucketLimit, item.second.latency.nSumMicros);
+        MetricsHeader(strOut, "rpc_errors_total", "counter", "RPC calls that failed, by method.");
+        BOOST_FOREACH(const CRPCStatsMap::value_type& item, mapRPCMethods)
+            MetricsValue(strOut, "rpc_errors_total", MetricsLabel("method", item.first), item.second.nErrors);
+        MetricsHeader(strOut, "rpc_result_bytes_total", "counter", "JSON result bytes returned, by method.");
+        BOOST_FOREACH(const CRPCStatsMap::value_type& item, mapRPCMethods)
+            MetricsValue(strOut, "rpc_result_bytes_total", MetricsLabel("method", item.first), item.second.nBytes);
+        MetricsHeader(strOut, "rpc_lock_wait_seconds_total", "counter", "Time RPC calls waited for cs_main and cs_wallet, by method.");
+        BOOST_FOREACH(const CRPCStatsMap::value_type& item, mapRPCMethods)
+            MetricsValue(strOut, "rpc_lock_wait_seconds_total", MetricsLabel("method", item.first), MetricsSeconds(item.second.nLockWaitMicros));
+        MetricsHeader(strOut, "rpc_active", "gauge", "RPC calls running, by method.");
+        BOOST_FOREACH(const CRPCStatsMap::value_type& item, mapRPCMethods)
+            MetricsValue(strOut, "rpc_active", MetricsLabel("method", item.first), (int64_t)item.second.nActive);
+    }
+    return strOut;
+}
@@ -0,0 +1,68 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_METRICS_H
+#define BITCOIN_METRICS_H
+
+#include <map>
+#include <stdint.h>
+#include <string>
+
+struct CBlockConnectTimings;
+
+/** Buckets of the metrics histograms: bucket i counts observations of at
+ *  most METRICS_BUCKET_LIMITS[i] microseconds, the last one the rest */
+static const unsigned int METRICS_BUCKETS = 16;
+
+/** Counts of durations in fixed buckets, with their count and sum, as a
+ *  Prometheus histogram. Not locked; see the functions below. */
+class CMetricsHistogram
+{
+public:
+    uint64_t vBuckets[METRICS_BUCKETS];
+    uint64_t nCount;
+    int64_t nSumMicros;
+
+    CMetricsHistogram();
+    void Observe(int64_t nMicros);
+
+    // Upper bound of a bucket in microseconds, 0 for the last one
+    static int64_t BucketLimit(unsigned int nBucket);
+};
+
+/** Calls of one RPC method since startup or the last reset */
+struct CRPCMethodStats
+{
+    CMetricsHistogram latency; // whole calls, including waiting for locks
+    uint64_t nErrors;          // calls that threw
+    uint64_t nBytes;           // JSON result text returned
+    int64_t nLockWaitMicros;   // waiting for cs_main and cs_wallet
+    int64_t nMaxMicros;
+    int nActive;               // calls running now
+    int nMaxActive;            // most calls running at once
+
+    CRPCMethodStats() : nErrors(0), nBytes(0), nLockWaitMicros(0), nMaxMicros(0), nActive(0), nMaxActive(0) {}
+};
+
+typedef std::map<std::string, CRPCMethodStats> CRPCStatsMap;
+
+// Time ConnectTip took on a block, by phase, with nTotalMicros its whole
+// connection including writing the chain state
+void RecordBlockConnectMetrics(const CBlockConnectTimings& timings, int64_t nTotalMicros);
+// Time the wallet flushing thread took to checkpoint the wallet environment
+// and to detach the wallet file
+void RecordWalletFlushMetrics(int64_t nCheckpointMicros, int64_t nDetachMicros);
+// An RPC call starting, and the same call finishing after nMicros with
+// nBytes of result, or with an error
+void RecordRPCStart(const std::string& strMethod);
+void RecordRPCFinish(const std::string& strMethod, int64_t nMicros, int64_t nLockWaitMicros, uint64_t nBytes, bool fError);
+// The statistics of every method called, optionally clearing them; calls
+// still running stay counted as active
+CRPCStatsMap GetRPCStats(bool fReset = false);
+
+/** The current metrics in the Prometheus text exposition format, served on
+ *  the RPC port at /metrics */
+std::string GetMetricsText();
+
+#endif // BITCOIN_METRICS_H
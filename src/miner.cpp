@@ -7,10 +7,20 @@
 
 #include "core.h"
 #include "main.h"
+#include "miner_opencl.h"
 #include "net.h"
+#include "powhash.h"
 #ifdef ENABLE_WALLET
 #include "wallet.h"
 #endif
+
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // BitcoinMiner
@@ -52,58 +62,266 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
         ((uint32_t*)pstate)[i] = ctx.h[i];
 }
 
-// Some explaining would be appreciated
-class COrphan
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+
+static bool CompareAncestorCount(const CTxMemPoolEntry *a, const CTxMemPoolEntry *b)
+{
+    return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+}
+
+// The memory pool transactions selected for a block on top of pindexPrev,
+// added a package (a transaction and the ancestors it needs) at a time.
+// The selection does not depend on the algo, so the templates of all algos
+// share it. The caller holds cs_main and mempool.cs.
+class CBlockAssembler
 {
+private:
+    CCoinsViewCache view; // pcoinsTip with the selected transactions applied
+    unsigned int nBlockMaxSize;
+    bool fPrintPriority;
+    std::set<uint256> setInBlock;
+
 public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
+    CBlockIndex *pindexPrev;
+    int nHeight;
+    int64_t nTime;     // when the selection was made
+    uint64_t nAdded;   // mempool.GetAdded() and GetRemoved() the selection covers
+    uint64_t nRemoved;
+    bool fFull;        // a package was left out for the size or sigop limits
+    bool fTested;      // a block with this selection passed ConnectBlock
+    bool fNonFinal;    // a transaction was left out for not being final yet
+
+    std::vector<CTransaction> vtx;
+    std::vector<int64_t> vTxFees;
+    std::vector<int64_t> vTxSigOps;
+    uint64_t nBlockSize;
+    unsigned int nBlockSigOps;
+    int64_t nFees;
+
+    CBlockAssembler(CBlockIndex *pindexPrevIn, unsigned int nBlockMaxSizeIn) :
+        view(*pcoinsTip, true), nBlockMaxSize(nBlockMaxSizeIn),
+        pindexPrev(pindexPrevIn), nHeight(pindexPrevIn->nHeight + 1), nTime(GetAdjustedTime()),
+        nAdded(mempool.GetAdded()), nRemoved(mempool.GetRemoved()),
+        fFull(false), fTested(false), fNonFinal(false), nBlockSize(1000), nBlockSigOps(100), nFees(0)
+    {
+        fPrintPriority = GetBoolArg("-printpriority", false);
+    }
 
-    COrphan(const CTransaction* ptxIn)
+    bool IsInBlock(const uint256 &hash) const
     {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
+        return setInBlock.count(hash) != 0;
     }
 
-    void print() const
+    // Whether tx spends from a pool transaction that is not in the block
+    bool HasMissingParents(const CTransaction &tx) const
     {
-        LogPrintf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString(), dPriority, dFeePerKb);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            LogPrintf("   setDependsOn %s\n", hash.ToString());
+        BOOST_FOREACH(const CTxIn &txin, tx.vin)
+            if (mempool.mapTx.count(txin.prevout.hash) && !IsInBlock(txin.prevout.hash))
+                return true;
+        return false;
     }
-};
 
+    // The transaction with its ancestors that are not in the block, parents
+    // before children (a transaction has more ancestors than any of its own)
+    void GetPackage(const uint256 &hash, std::vector<const CTxMemPoolEntry*> &vPackage) const
+    {
+        std::set<uint256> setPackage;
+        std::vector<uint256> vStack(1, hash);
+        setPackage.insert(hash);
+        while (!vStack.empty()) {
+            const CTxMemPoolEntry &entry = mempool.mapTx.find(vStack.back())->second;
+            vStack.pop_back();
+            vPackage.push_back(&entry);
+            BOOST_FOREACH(const CTxIn &txin, entry.GetTx().vin)
+                if (mempool.mapTx.count(txin.prevout.hash) && !IsInBlock(txin.prevout.hash) && setPackage.insert(txin.prevout.hash).second)
+                    vStack.push_back(txin.prevout.hash);
+        }
+        std::sort(vPackage.begin(), vPackage.end(), CompareAncestorCount);
+    }
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
+    // Add all transactions of a package to the block, or none
+    bool AddPackage(const std::vector<const CTxMemPoolEntry*> &vPackage)
+    {
+        // Limits that are known without looking at the inputs
+        uint64_t nPackageSize = 0;
+        unsigned int nPackageSigOps = 0;
+        BOOST_FOREACH(const CTxMemPoolEntry *pentry, vPackage) {
+            const CTransaction &tx = pentry->GetTx();
+            if (tx.IsCoinBase())
+                return false;
+            if (!IsFinalTx(tx, nHeight)) {
+                fNonFinal = true;
+                return false;
+            }
+            nPackageSize += pentry->GetTxSize();
+            nPackageSigOps += pentry->GetSigOps();
+        }
+        if (nBlockSize + nPackageSize >= nBlockMaxSize || nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS) {
+            fFull = true;
+            return false;
+        }
 
-// We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, const CTransaction*> TxPriority;
-class TxPriorityCompare
-{
-    bool byFee;
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
-    bool operator()(const TxPriority& a, const TxPriority& b)
+        CCoinsViewCache viewPackage(view, true);
+        std::vector<int64_t> vPackageFees;
+        std::vector<int64_t> vPackageSigOps;
+        BOOST_FOREACH(const CTxMemPoolEntry *pentry, vPackage) {
+            const CTransaction &tx = pentry->GetTx();
+            if (!viewPackage.HaveInputs(tx))
+                return false;
+
+            int64_t nTxFees = viewPackage.GetValueIn(tx)-tx.GetValueOut();
+
+            // Counted when the transaction entered the pool
+            unsigned int nP2SHSigOps = pentry->GetP2SHSigOps() >= 0 ? pentry->GetP2SHSigOps() : GetP2SHSigOpCount(tx, viewPackage);
+            nPackageSigOps += nP2SHSigOps;
+            if (nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS) {
+                fFull = true;
+                return false;
+            }
+
+            CValidationState state;
+            if (!CheckInputs(tx, state, viewPackage, true, SCRIPT_VERIFY_P2SH))
+                return false;
+
+            CTxUndo txundo;
+            UpdateCoins(tx, state, viewPackage, txundo, nHeight, tx.GetHash());
+            vPackageFees.push_back(nTxFees);
+            vPackageSigOps.push_back(pentry->GetSigOps() + nP2SHSigOps);
+        }
+        assert(viewPackage.Flush());
+
+        for (unsigned int i = 0; i < vPackage.size(); i++) {
+            const CTransaction &tx = vPackage[i]->GetTx();
+            vtx.push_back(tx);
+            vTxFees.push_back(vPackageFees[i]);
+            vTxSigOps.push_back(vPackageSigOps[i]);
+            setInBlock.insert(tx.GetHash());
+            nFees += vPackageFees[i];
+
+            if (fPrintPriority)
+            {
+                LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
+                       vPackage[i]->GetPriority(std::max((unsigned int)nHeight - 1, vPackage[i]->GetHeight())),
+                       vPackage[i]->GetFeeRate(), tx.GetHash().ToString());
+            }
+        }
+        nBlockSize += nPackageSize;
+        nBlockSigOps += nPackageSigOps;
+        fTested = false;
+        return true;
+    }
+
+    // The transactions with the highest priority, regardless of their fees,
+    // once their unconfirmed parents are in, of those that arrived in the
+    // pool since nFirstSequence
+    void AddByPriority(unsigned int nBlockPrioritySize, uint64_t nFirstSequence)
     {
-        if (byFee)
+        mempool.SetPriorityHeight(pindexPrev->nHeight);
+        std::set<CTxMemPoolIndexKey>::reverse_iterator it;
+        for (it = mempool.setByPriority.rbegin(); it != mempool.setByPriority.rend(); ++it)
         {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+            const CTxMemPoolEntry &entry = mempool.mapTx[it->hash];
+            if (!AllowFree(it->dScore) || nBlockSize + entry.GetTxSize() >= nBlockPrioritySize)
+                break;
+            if (entry.GetSequence() < nFirstSequence || IsInBlock(it->hash))
+                continue;
+            if (entry.GetCountWithAncestors() > 1 && HasMissingParents(entry.GetTx()))
+                continue;
+            AddPackage(std::vector<const CTxMemPoolEntry*>(1, &entry));
         }
-        else
+    }
+
+    // Transactions by the fee rate of themselves together with the ancestors
+    // they need, of those that arrived in the pool since nFirstSequence.
+    // Free transactions only fill the block up to the minimum size.
+    void AddByFeeRate(unsigned int nBlockMinSize, uint64_t nFirstSequence)
+    {
+        std::set<CTxMemPoolIndexKey>::reverse_iterator it;
+        for (it = mempool.setByAncestorFeeRate.rbegin(); it != mempool.setByAncestorFeeRate.rend(); ++it)
         {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+            if (IsInBlock(it->hash))
+                continue;
+            // Neither the package nor the transaction itself pay enough
+            bool fPastMinSize = nBlockSize >= nBlockMinSize;
+            if (fPastMinSize && it->dScore < CTransaction::nMinRelayTxFee && it->dTieBreak < CTransaction::nMinRelayTxFee)
+                continue;
+            if (mempool.mapTx[it->hash].GetSequence() < nFirstSequence)
+                continue;
+
+            std::vector<const CTxMemPoolEntry*> vPackage;
+            GetPackage(it->hash, vPackage);
+            uint64_t nPackageSize = 0;
+            int64_t nPackageFees = 0;
+            BOOST_FOREACH(const CTxMemPoolEntry *pentry, vPackage) {
+                nPackageSize += pentry->GetTxSize();
+                nPackageFees += pentry->GetFee();
+            }
+            double dFeePerKb = nPackageFees * 1000.0 / nPackageSize;
+            if ((dFeePerKb < CTransaction::nMinRelayTxFee) && (nBlockSize + nPackageSize >= nBlockMinSize))
+                continue;
+
+            AddPackage(vPackage);
         }
     }
 };
 
+// The last selection, guarded by cs_main
+static CBlockAssembler *passemblerLast = NULL;
+
+// The transaction selection for a block on top of pindexPrev. The last one
+// is reused while the pool only gained transactions, which are then added
+// to it; when they do not fit, or anything left the pool, it is made anew.
+// So is one that left out transactions that may have become final since.
+static CBlockAssembler &SelectTransactions(CBlockIndex *pindexPrev)
+{
+    // Largest block you're willing to create:
+    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
+
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+
+    // Minimum block size you want to create; block will be filled with free transactions
+    // until there are no more or the block reaches this size:
+    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+
+    CBlockAssembler *passembler = passemblerLast;
+    if (passembler && passembler->pindexPrev == pindexPrev && passembler->nHeight == pindexPrev->nHeight + 1 &&
+        passembler->nRemoved == mempool.GetRemoved() && !(passembler->fNonFinal && passembler->nTime != GetAdjustedTime()))
+    {
+        uint64_t nAdded = mempool.GetAdded();
+        if (passembler->nAdded == nAdded)
+            return *passembler;
+        passembler->fFull = false;
+        if (nBlockPrioritySize > 0)
+            passembler->AddByPriority(nBlockPrioritySize, passembler->nAdded);
+        passembler->AddByFeeRate(nBlockMinSize, passembler->nAdded);
+        passembler->nAdded = nAdded;
+        if (!passembler->fFull) {
+            nLastBlockTx = passembler->vtx.size();
+            nLastBlockSize = passembler->nBlockSize;
+            LogPrint("mempool", "CreateNewBlock(): updated selection, total size %u\n", passembler->nBlockSize);
+            return *passembler;
+        }
+    }
+
+    delete passemblerLast;
+    passemblerLast = passembler = new CBlockAssembler(pindexPrev, nBlockMaxSize);
+    if (nBlockPrioritySize > 0)
+        passembler->AddByPriority(nBlockPrioritySize, 0);
+    passembler->AddByFeeRate(nBlockMinSize, 0);
+
+    nLastBlockTx = passembler->vtx.size();
+    nLastBlockSize = passembler->nBlockSize;
+    LogPrintf("CreateNewBlock(): total size %u\n", passembler->nBlockSize);
+    return *passembler;
+}
+
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, int algo)
 {
     // Create new block
@@ -114,7 +332,6 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, int algo)
 
     // Set block version
     pblock->nVersion = BLOCK_VERSION_DEFAULT;
-    CBlockIndex* pindexPrev = chainActive.Tip();
 
     switch (algo)
     {
@@ -132,7 +349,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, int algo)
     }
 
     // Create coinbase tx
-    CTransaction txNew;
+    CMutableTransaction txNew;
     txNew.vin.resize(1);
     txNew.vin[0].prevout.SetNull();
     txNew.vout.resize(1);
@@ -143,204 +360,17 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, int algo)
     pblocktemplate->vTxFees.push_back(-1); // updated at end
     pblocktemplate->vTxSigOps.push_back(-1); // updated at end
 
-    // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
-    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
-
-    // How much of the block should be dedicated to high-priority transactions,
-    // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
-    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
-
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
-
     // Collect memory pool transactions into the block
-    int64_t nFees = 0;
     {
         LOCK2(cs_main, mempool.cs);
         CBlockIndex* pindexPrev = chainActive.Tip();
-        CCoinsViewCache view(*pcoinsTip, true);
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi)
-        {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || !IsFinalTx(tx, pindexPrev->nHeight + 1))
-                continue;
+        CBlockAssembler &selection = SelectTransactions(pindexPrev);
+        pblock->vtx.insert(pblock->vtx.end(), selection.vtx.begin(), selection.vtx.end());
+        pblocktemplate->vTxFees.insert(pblocktemplate->vTxFees.end(), selection.vTxFees.begin(), selection.vTxFees.end());
+        pblocktemplate->vTxSigOps.insert(pblocktemplate->vTxSigOps.end(), selection.vTxSigOps.begin(), selection.vTxSigOps.end());
+        int64_t nFees = selection.nFees;
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins &coins = view.GetCoins(txin.prevout.hash);
-
-                int64_t nValueIn = coins.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = pindexPrev->nHeight - coins.nHeight + 1;
-
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &mi->second.GetTx()));
-        }
-
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < CTransaction::nMinRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!view.HaveInputs(tx))
-                continue;
-
-            int64_t nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH))
-                continue;
-
-            CTxUndo txundo;
-            uint256 hash = tx.GetHash();
-            UpdateCoins(tx, state, view, txundo, pindexPrev->nHeight+1, hash);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fPrintPriority)
-            {
-                LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
-
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
-        LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
-
-        pblock->vtx[0].vout[0].nValue = GetBlockValue(pindexPrev->nHeight+1, nFees);
+        txNew.vout[0].nValue = GetBlockValue(pindexPrev->nHeight+1, nFees);
         pblocktemplate->vTxFees[0] = -nFees;
 
         // Fill in header
@@ -348,16 +378,22 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, int algo)
         UpdateTime(*pblock, pindexPrev);
         pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, algo);
         pblock->nNonce         = 0;
-        pblock->vtx[0].vin[0].scriptSig = CScript() << OP_0 << OP_0;
+        txNew.vin[0].scriptSig = CScript() << OP_0 << OP_0;
+        pblock->vtx[0] = txNew;
         pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
 
-        CBlockIndex indexDummy(*pblock);
-        indexDummy.pprev = pindexPrev;
-        indexDummy.nHeight = pindexPrev->nHeight + 1;
-        CCoinsViewCache viewNew(*pcoinsTip, true);
-        CValidationState state;
-        if (!ConnectBlock(*pblock, state, &indexDummy, viewNew, true))
-            throw std::runtime_error("CreateNewBlock() : ConnectBlock failed");
+        // The selection is checked once; the templates of the other algos
+        // only differ in the header and the coinbase.
+        if (!selection.fTested) {
+            CBlockIndex indexDummy(*pblock);
+            indexDummy.pprev = pindexPrev;
+            indexDummy.nHeight = pindexPrev->nHeight + 1;
+            CCoinsViewCache viewNew(*pcoinsTip, true);
+            CValidationState state;
+            if (!ConnectBlock(*pblock, state, &indexDummy, viewNew, true))
+                throw std::runtime_error("CreateNewBlock() : ConnectBlock failed");
+            selection.fTested = true;
+        }
     }
 
     return pblocktemplate.release();
@@ -374,10 +410,84 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     }
     ++nExtraNonce;
     unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
-    pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CScriptNum(nExtraNonce)) + COINBASE_FLAGS;
-    assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
+    CMutableTransaction txCoinbase(pblock->vtx[0]);
+    txCoinbase.vin[0].scriptSig = (CScript() << nHeight << CScriptNum(nExtraNonce)) + COINBASE_FLAGS;
+    assert(txCoinbase.vin[0].scriptSig.size() <= 100);
+
+    pblock->vtx[0] = txCoinbase;
 
-    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    // The other transactions of the template stay, so the tree is rebuilt
+    // only the first time
+    pblock->hashMerkleRoot = pblock->UpdateMerkleTreeCoinbase();
+}
+
+// Whether a block has the transactions of the template after its coinbase.
+// Their hashes are cached, so this hashes nothing.
+static bool HasTemplateTransactions(const CBlock& block, const CBlockTemplate& tmpl)
+{
+    const CBlock& blockTemplate = tmpl.block;
+    if (&block == &blockTemplate)
+        return true;
+    if (block.hashPrevBlock != blockTemplate.hashPrevBlock || block.vtx.size() != blockTemplate.vtx.size())
+        return false;
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        if (block.vtx[i].GetHash() != blockTemplate.vtx[i].GetHash())
+            return false;
+    return true;
+}
+
+// The checks of CheckBlock a block solved from a template can still fail:
+// CreateNewBlock has checked and connected the other transactions already
+static bool CheckBlockFromTemplate(const CBlock& block, const CBlockTemplate& tmpl, CValidationState& state)
+{
+    int algo = block.GetAlgo();
+    if (!CheckProofOfWork(block.GetPoWHash(algo), block.nBits, algo))
+        return state.DoS(50, error("CheckBlockFromTemplate() : proof of work failed"),
+                         REJECT_INVALID, "high-hash");
+
+    if (block.GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
+        return state.Invalid(error("CheckBlockFromTemplate() : block timestamp too far in the future"),
+                             REJECT_INVALID, "time-too-new");
+
+    const CTransaction& txCoinbase = block.vtx[0];
+    if (!txCoinbase.IsCoinBase())
+        return state.DoS(100, error("CheckBlockFromTemplate() : first tx is not coinbase"),
+                         REJECT_INVALID, "bad-cb-missing");
+    if (!CheckTransaction(txCoinbase, state))
+        return error("CheckBlockFromTemplate() : CheckTransaction failed");
+
+    if (::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
+        return state.DoS(100, error("CheckBlockFromTemplate() : size limits failed"),
+                         REJECT_INVALID, "bad-blk-length");
+    int64_t nSigOps = GetLegacySigOpCount(txCoinbase);
+    for (unsigned int i = 1; i < tmpl.vTxSigOps.size(); i++)
+        nSigOps += tmpl.vTxSigOps[i];
+    if (nSigOps > MAX_BLOCK_SIGOPS)
+        return state.DoS(100, error("CheckBlockFromTemplate() : out-of-bounds SigOpCount"),
+                         REJECT_INVALID, "bad-blk-sigops", true);
+
+    if (block.UpdateMerkleTreeCoinbase() != block.hashMerkleRoot)
+        return state.DoS(100, error("CheckBlockFromTemplate() : hashMerkleRoot mismatch"),
+                         REJECT_INVALID, "bad-txnmrklroot", true);
+    return true;
+}
+
+bool ProcessBlockFromTemplate(CValidationState& state, CBlock& block, const CBlockTemplate* ptemplate)
+{
+    AssertLockHeld(cs_main);
+    bool fChecked = false;
+    if (ptemplate && HasTemplateTransactions(block, *ptemplate))
+    {
+        // Only the coinbase path of the template's tree is hashed again
+        if (&block != &ptemplate->block)
+            block.vMerkleTree = ptemplate->block.vMerkleTree;
+        if (!CheckBlockFromTemplate(block, *ptemplate, state))
+            return false;
+        fChecked = true;
+        // Peers can fetch and check it while it is connected here
+        AnnounceNewBlock(block);
+    }
+    return ProcessBlock(state, NULL, &block, NULL, fChecked);
 }
 
 
@@ -426,13 +536,130 @@ void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash
     memcpy(phash1, &tmp.hash1, 64);
 }
 
+bool ParseGenAlgoThreads(const std::string& strSpec, std::map<int, int>& mapAlgoThreads)
+{
+    mapAlgoThreads.clear();
+    std::vector<std::string> vEntries;
+    boost::split(vEntries, strSpec, boost::is_any_of(","));
+    BOOST_FOREACH(const std::string& strEntry, vEntries)
+    {
+        size_t nColon = strEntry.find(':');
+        if (nColon == std::string::npos)
+            return false;
+        std::string strAlgo = strEntry.substr(0, nColon);
+        std::string strCount = strEntry.substr(nColon + 1);
+        if (strCount.empty() || strCount.size() > 4 || strCount.find_first_not_of("0123456789") != std::string::npos)
+            return false;
+
+        int algo = -1;
+        for (int i = 0; i < NUM_ALGOS; i++)
+            if (strAlgo == GetAlgoName(i))
+                algo = i;
+        if (algo < 0 || mapAlgoThreads.count(algo))
+            return false;
+        mapAlgoThreads[algo] = atoi(strCount);
+    }
+    return true;
+}
+
 #ifdef ENABLE_WALLET
 //////////////////////////////////////////////////////////////////////////////
 //
 // Internal miner
 //
-double dHashesPerSec = 0.0;
-int64_t nHPSTimerStart = 0;
+
+// Workers of the running miner threads; each thread holds its own reference
+// so a worker outlives its entry here when GenerateBitcoins() restarts them
+static std::vector<boost::shared_ptr<CMinerWorker> > vMinerWorkers;
+static CCriticalSection cs_minerWorkers;
+
+double GetMinerHashesPerSec(int algo)
+{
+    double dTotal = 0.0;
+    LOCK(cs_minerWorkers);
+    BOOST_FOREACH(const boost::shared_ptr<CMinerWorker>& worker, vMinerWorkers)
+        if (algo < 0 || worker->GetAlgo() == algo)
+            dTotal += worker->GetHashesPerSec();
+    return dTotal;
+}
+
+std::vector<CMinerDeviceStats> GetMinerDeviceStats()
+{
+    std::vector<CMinerDeviceStats> vStats;
+    LOCK(cs_minerWorkers);
+    BOOST_FOREACH(const boost::shared_ptr<CMinerWorker>& worker, vMinerWorkers)
+    {
+        unsigned int i = 0;
+        while (i < vStats.size() && (vStats[i].strDevice != worker->GetDeviceName() || vStats[i].algo != worker->GetAlgo()))
+            i++;
+        if (i == vStats.size())
+        {
+            CMinerDeviceStats stats;
+            stats.strDevice = worker->GetDeviceName();
+            stats.algo = worker->GetAlgo();
+            stats.nThreads = 0;
+            stats.dHashesPerSec = 0.0;
+            vStats.push_back(stats);
+        }
+        vStats[i].nThreads++;
+        vStats[i].dHashesPerSec += worker->GetHashesPerSec();
+    }
+    return vStats;
+}
+
+static void LogHashMeter()
+{
+    static int64_t nLogTime;
+    static CCriticalSection cs;
+    LOCK(cs);
+    if (GetTime() - nLogTime <= 30 * 60)
+        return;
+    nLogTime = GetTime();
+    for (int algo = 0; algo < NUM_ALGOS; algo++)
+    {
+        double dHashes = GetMinerHashesPerSec(algo);
+        if (dHashes > 0)
+            LogPrintf("hashmeter %s %6.0f khash/s\n", GetAlgoName(algo).c_str(), dHashes/1000.0);
+    }
+}
+
+CMinerWorker::CMinerWorker(int algoIn, int nIdIn, int nDeviceIn, const std::string& strDeviceIn) :
+    algo(algoIn), nId(nIdIn), nDevice(nDeviceIn), strDevice(strDeviceIn), nMeterStart(0), nMeterHashes(0), dHashesPerSec(0.0), nLastUpdate(0)
+{
+}
+
+void CMinerWorker::AddHashes(uint64_t nHashes)
+{
+    int64_t nNow = GetTimeMillis();
+    if (nMeterStart == 0)
+    {
+        nMeterStart = nNow;
+        nMeterHashes = 0;
+        return;
+    }
+    nMeterHashes += nHashes;
+    if (nNow - nMeterStart > 4000)
+    {
+        {
+            LOCK(cs);
+            dHashesPerSec = 1000.0 * nMeterHashes / (nNow - nMeterStart);
+            nLastUpdate = nNow;
+        }
+        nMeterStart = nNow;
+        nMeterHashes = 0;
+        LogHashMeter();
+    }
+}
+
+double CMinerWorker::GetHashesPerSec() const
+{
+    // A worker that has stopped reporting (stuck on a new template, or
+    // interrupted) no longer contributes to the total
+    LOCK(cs);
+    if (GetTimeMillis() - nLastUpdate > 8000)
+        return 0.0;
+    return dHashesPerSec;
+}
 
 //
 // ScanHash scans nonces looking for a hash with at least some zero bits.
@@ -469,6 +696,180 @@ unsigned int static ScanHash_CryptoPP(char* pmidstate, char* pdata, char* phash1
     }
 }
 
+#if defined(__GNUC__)
+//
+// ScanHash_SHA256d evaluates several nonces per pass, one per 32-bit vector
+// lane. The first 64 bytes of the header are already folded into pmidstate,
+// and rounds 0-2 of the second block plus W[16], W[17] don't read the nonce
+// either, so those are done once per call. The second SHA256 stops after the
+// round that fixes the last state word, which holds the top 32 bits of the
+// hash; the full hash is only worked out for lanes that pass that check.
+//
+typedef uint32_t sha256_v4 __attribute__((vector_size(16)));
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA256_SCAN_AVX2 1
+typedef uint32_t sha256_v8 __attribute__((vector_size(32)));
+#endif
+
+static const uint32_t pSHA256K[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA256_ROTR(x, n)   (((x) >> (n)) | ((x) << (32 - (n))))
+#define SHA256_S0(x)        (SHA256_ROTR(x,  2) ^ SHA256_ROTR(x, 13) ^ SHA256_ROTR(x, 22))
+#define SHA256_S1(x)        (SHA256_ROTR(x,  6) ^ SHA256_ROTR(x, 11) ^ SHA256_ROTR(x, 25))
+#define SHA256_s0(x)        (SHA256_ROTR(x,  7) ^ SHA256_ROTR(x, 18) ^ ((x) >>  3))
+#define SHA256_s1(x)        (SHA256_ROTR(x, 17) ^ SHA256_ROTR(x, 19) ^ ((x) >> 10))
+#define SHA256_CH(x, y, z)  ((z) ^ ((x) & ((y) ^ (z))))
+#define SHA256_MAJ(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+
+// One round on the state s[0..7] = a..h, for uint32_t or vector words
+#define SHA256_ROUND(T, s, k, w) do { \
+    T t1 = s[7] + SHA256_S1(s[4]) + SHA256_CH(s[4], s[5], s[6]) + (k) + (w); \
+    T t2 = SHA256_S0(s[0]) + SHA256_MAJ(s[0], s[1], s[2]); \
+    s[7] = s[6]; s[6] = s[5]; s[5] = s[4]; s[4] = s[3] + t1; \
+    s[3] = s[2]; s[2] = s[1]; s[1] = s[0]; s[0] = t1 + t2; \
+} while (0)
+
+/** Nonce-independent part of the first hash's second block */
+struct CSHA256ScanState
+{
+    uint32_t midstate[8];
+    uint32_t state[8];  // after rounds 0-2
+    uint32_t W[18];     // message schedule; W[3] is the nonce
+};
+
+static void SHA256ScanPrepare(CSHA256ScanState& scan, const uint32_t* pmidstate, const uint32_t* pdata)
+{
+    for (int i = 0; i < 16; i++)
+        scan.W[i] = pdata[i];
+    scan.W[16] = SHA256_s1(scan.W[14]) + scan.W[9] + SHA256_s0(scan.W[1]) + scan.W[0];
+    scan.W[17] = SHA256_s1(scan.W[15]) + scan.W[10] + SHA256_s0(scan.W[2]) + scan.W[1];
+    for (int i = 0; i < 8; i++)
+        scan.midstate[i] = scan.state[i] = pmidstate[i];
+    for (int i = 0; i < 3; i++)
+        SHA256_ROUND(uint32_t, scan.state, pSHA256K[i], scan.W[i]);
+}
+
+/** SHA256d of nonces nNonce..nNonce+N-1; lanes of *pmask are set where the top 32 bits of the hash are <= nTargetHigh */
+template<typename V, int N>
+static inline __attribute__((always_inline)) void SHA256dScanLanes(const CSHA256ScanState& scan, uint32_t nNonce, uint32_t nTargetHigh, V* pmask)
+{
+    V W[64], s[8];
+    const V zero = V();
+    for (int i = 0; i < 18; i++)
+        W[i] = zero + scan.W[i];
+    for (int l = 0; l < N; l++)
+        W[3][l] = nNonce + l;
+    for (int i = 18; i < 64; i++)
+        W[i] = SHA256_s1(W[i - 2]) + W[i - 7] + SHA256_s0(W[i - 15]) + W[i - 16];
+    for (int i = 0; i < 8; i++)
+        s[i] = zero + scan.state[i];
+    for (int i = 3; i < 64; i++)
+        SHA256_ROUND(V, s, pSHA256K[i], W[i]);
+
+    // Second hash over hash1, padded to one block
+    for (int i = 0; i < 8; i++)
+        W[i] = s[i] + scan.midstate[i];
+    W[8] = zero + 0x80000000;
+    for (int i = 9; i < 15; i++)
+        W[i] = zero;
+    W[15] = zero + 256;
+    for (int i = 16; i < 61; i++)
+        W[i] = SHA256_s1(W[i - 2]) + W[i - 7] + SHA256_s0(W[i - 15]) + W[i - 16];
+    for (int i = 0; i < 8; i++)
+        s[i] = zero + pSHA256InitState[i];
+    for (int i = 0; i < 60; i++)
+        SHA256_ROUND(V, s, pSHA256K[i], W[i]);
+
+    // Word 7 of the result is the e produced by round 60
+    V h7 = s[3] + s[7] + SHA256_S1(s[4]) + SHA256_CH(s[4], s[5], s[6]) + pSHA256K[60] + W[60] + pSHA256InitState[7];
+    V top = (h7 << 24) | ((h7 & 0xff00) << 8) | ((h7 >> 8) & 0xff00) | (h7 >> 24);
+    *pmask = (V)(top <= nTargetHigh);
+}
+
+/** Same contract as ScanHash_CryptoPP, but only returns nonces whose top hash word already meets nTargetHigh */
+template<typename V, int N>
+static inline __attribute__((always_inline)) unsigned int ScanHash_SHA256d_nway(char* pmidstate, char* pdata, char* phash1, char* phash, uint32_t nTargetHigh, unsigned int& nHashesDone)
+{
+    unsigned int& nNonce = *(unsigned int*)(pdata + 12);
+    CSHA256ScanState scan;
+    SHA256ScanPrepare(scan, (const uint32_t*)pmidstate, (const uint32_t*)pdata);
+    nHashesDone = 0;
+    for (;;)
+    {
+        unsigned int nFirst = nNonce + 1;
+        V mask;
+        SHA256dScanLanes<V, N>(scan, nFirst, nTargetHigh, &mask);
+        nHashesDone += N;
+        for (int l = 0; l < N; l++)
+        {
+            if (mask[l])
+            {
+                // Leave nNonce on the candidate and hand back its full hash
+                nNonce = nFirst + l;
+                SHA256Transform(phash1, pdata, pmidstate);
+                SHA256Transform(phash, phash1, pSHA256InitState);
+                return nNonce;
+            }
+        }
+        nNonce += N;
+
+        // Give up once we cross a multiple of 0x10000, like ScanHash_CryptoPP
+        if (((nFirst - 1) ^ nNonce) & ~0xffffu)
+            return (unsigned int) -1;
+        if (((nFirst - 1) ^ nNonce) & ~0xfffu)
+            boost::this_thread::interruption_point();
+    }
+}
+
+static unsigned int ScanHash_SHA256d_4way(char* pmidstate, char* pdata, char* phash1, char* phash, uint32_t nTargetHigh, unsigned int& nHashesDone)
+{
+    return ScanHash_SHA256d_nway<sha256_v4, 4>(pmidstate, pdata, phash1, phash, nTargetHigh, nHashesDone);
+}
+
+#if defined(SHA256_SCAN_AVX2)
+__attribute__((target("avx2"))) static unsigned int ScanHash_SHA256d_8way(char* pmidstate, char* pdata, char* phash1, char* phash, uint32_t nTargetHigh, unsigned int& nHashesDone)
+{
+    return ScanHash_SHA256d_nway<sha256_v8, 8>(pmidstate, pdata, phash1, phash, nTargetHigh, nHashesDone);
+}
+#endif
+#else
+static unsigned int ScanHash_SHA256d_generic(char* pmidstate, char* pdata, char* phash1, char* phash, uint32_t nTargetHigh, unsigned int& nHashesDone)
+{
+    return ScanHash_CryptoPP(pmidstate, pdata, phash1, phash, nHashesDone);
+}
+#endif
+
+typedef unsigned int (*ScanHashFunc)(char* pmidstate, char* pdata, char* phash1, char* phash, uint32_t nTargetHigh, unsigned int& nHashesDone);
+
+/** Widest SHA256d scanner this CPU can run */
+static ScanHashFunc GetSHA256dScanner(int& nLanes)
+{
+#if defined(SHA256_SCAN_AVX2)
+    if (CPUHasAVX2())
+    {
+        nLanes = 8;
+        return &ScanHash_SHA256d_8way;
+    }
+#endif
+#if defined(__GNUC__)
+    nLanes = 4;
+    return &ScanHash_SHA256d_4way;
+#else
+    nLanes = 1;
+    return &ScanHash_SHA256d_generic;
+#endif
+}
+
 CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey, int algo)
 {
     CPubKey pubkey;
@@ -479,11 +880,11 @@ CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey, int algo)
     return CreateNewBlock(scriptPubKey, algo);
 }
 
-bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
+bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey, const CBlockTemplate* ptemplate)
 {
     int algo = pblock->GetAlgo();
     uint256 hashPoW = pblock->GetPoWHash(algo);
-    uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+    uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
     if (hashPoW > hashTarget)
         return false;
@@ -496,7 +897,6 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
         hashBlock.GetHex(), 
         hashPoW.GetHex(), 
         hashTarget.GetHex());
-    pblock->print();
     LogPrintf("generated %s\n", FormatMoney(pblock->vtx[0].vout[0].nValue));
 
     // Found a solution
@@ -514,9 +914,10 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
             wallet.mapRequestCount[pblock->GetHash()] = 0;
         }
 
-        // Process this block the same as if we had received it from another node
+        // Process this block the same as if we had received it from another
+        // node, less the checks its template already passed
         CValidationState state;
-        if (!ProcessBlock(state, NULL, pblock))
+        if (!ProcessBlockFromTemplate(state, *pblock, ptemplate))
             return error("DigitalcoinMiner : ProcessBlock, block not accepted");
     }
 
@@ -537,7 +938,7 @@ void static MinerWaitOnline()
     }
 }
 
-void static BitcoinMiner(CWallet *pwallet)
+void static BitcoinMiner(CWallet *pwallet, CMinerWorker& worker)
 {
     LogPrintf("BitcoinMiner started\n");
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
@@ -547,6 +948,10 @@ void static BitcoinMiner(CWallet *pwallet)
     CReserveKey reservekey(pwallet);
     unsigned int nExtraNonce = 0;
 
+    int nScanLanes;
+    ScanHashFunc pScanHash = GetSHA256dScanner(nScanLanes);
+    LogPrintf("BitcoinMiner : scanning %d nonces per pass\n", nScanLanes);
+
     while(true)
     {
         MinerWaitOnline();
@@ -592,7 +997,8 @@ void static BitcoinMiner(CWallet *pwallet)
 				// Search
 				//
 				int64_t nStart = GetTime();
-				uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+				uint256 hashTarget = uint256().SetCompact(pblock->nBits);
+				uint32_t nTargetHigh = (uint32_t)(hashTarget >> 224).GetLow64();
 				uint256 hashbuf[2];
 				uint256& hash = *alignup<16>(hashbuf);
 				while (true)
@@ -600,9 +1006,8 @@ void static BitcoinMiner(CWallet *pwallet)
 					unsigned int nHashesDone = 0;
 					unsigned int nNonceFound;
 
-					// Crypto++ SHA256
-					nNonceFound = ScanHash_CryptoPP(pmidstate, pdata + 64, phash1,
-													(char*)&hash, nHashesDone);
+					nNonceFound = pScanHash(pmidstate, pdata + 64, phash1,
+											(char*)&hash, nTargetHigh, nHashesDone);
 
 					// Check if something found
 					if (nNonceFound != (unsigned int) -1)
@@ -617,7 +1022,7 @@ void static BitcoinMiner(CWallet *pwallet)
 							assert(hash == pblock->GetHash());
 
 							SetThreadPriority(THREAD_PRIORITY_NORMAL);
-							CheckWork(pblock, *pwallet, reservekey);
+							CheckWork(pblock, *pwallet, reservekey, pblocktemplate.get());
 							SetThreadPriority(THREAD_PRIORITY_LOWEST);
 
 							// In regression test mode, stop mining after a block is found. This
@@ -630,33 +1035,7 @@ void static BitcoinMiner(CWallet *pwallet)
 					}
 
 					// Meter hashes/sec
-					static int64_t nHashCounter;
-					if (nHPSTimerStart == 0)
-					{
-						nHPSTimerStart = GetTimeMillis();
-						nHashCounter = 0;
-					}
-					else
-						nHashCounter += nHashesDone;
-					if (GetTimeMillis() - nHPSTimerStart > 4000)
-					{
-						static CCriticalSection cs;
-						{
-							LOCK(cs);
-							if (GetTimeMillis() - nHPSTimerStart > 4000)
-							{
-								dHashesPerSec = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStart);
-								nHPSTimerStart = GetTimeMillis();
-								nHashCounter = 0;
-								static int64_t nLogTime;
-								if (GetTime() - nLogTime > 30 * 60)
-								{
-									nLogTime = GetTime();
-									LogPrintf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
-								}
-							}
-						}
-					}
+					worker.AddHashes(nHashesDone);
 
 					// Check for stop or if block needs to be rebuilt
 					boost::this_thread::interruption_point();
@@ -676,21 +1055,38 @@ void static BitcoinMiner(CWallet *pwallet)
 					{
 						// Changing pblock->nTime can change work required on testnet:
 						nBlockBits = ByteReverse(pblock->nBits);
-						hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+						hashTarget = uint256().SetCompact(pblock->nBits);
+						nTargetHigh = (uint32_t)(hashTarget >> 224).GetLow64();
 					}
 				}
 			}
 		}
+		catch (boost::thread_interrupted)
+		{
+			throw;
+		}
 		catch (...){}
 	}
 }
 
-void static ScryptMiner(CWallet *pwallet)
+void static OpenCLScryptMiner(CWallet *pwallet, CMinerWorker& worker)
 {
     // Each thread has its own key and counter
     CReserveKey reservekey(pwallet);
     unsigned int nExtraNonce = 0;
 
+    // ...and its own device, with the kernel built and scratchpads allocated
+    std::string strError;
+    std::auto_ptr<COpenCLScryptDevice> device(COpenCLScryptDevice::Create(worker.GetDevice(),
+        (unsigned int)std::max(GetArg("-openclbatch", DEFAULT_OPENCL_BATCH), (int64_t)1), strError));
+    if (!device.get())
+    {
+        LogPrintf("OpenCLScryptMiner : device %d: %s\n", worker.GetDevice(), strError);
+        return;
+    }
+    const unsigned int nBatch = device->GetBatch();
+    LogPrintf("OpenCLScryptMiner : hashing %u nonces per launch on %s\n", nBatch, device->GetName());
+
     while(true)
     {
         MinerWaitOnline();
@@ -707,97 +1103,51 @@ void static ScryptMiner(CWallet *pwallet)
         CBlock *pblock = &pblocktemplate->block;
         IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
 
-        LogPrintf("Running scrypt miner with %u transactions in block (%u bytes)\n", pblock->vtx.size(),
+        LogPrintf("Running OpenCL scrypt miner with %u transactions in block (%u bytes)\n", pblock->vtx.size(),
                ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
 
-        //
-        // Prebuild hash buffers
-        //
-        char pmidstatebuf[32+16]; char* pmidstate = alignup<16>(pmidstatebuf);
-        char pdatabuf[128+16];    char* pdata     = alignup<16>(pdatabuf);
-        char phash1buf[64+16];    char* phash1    = alignup<16>(phash1buf);
-
-        FormatHashBuffers(pblock, pmidstate, pdata, phash1);
-
-        unsigned int& nBlockTime = *(unsigned int*)(pdata + 64 + 4);
-        unsigned int& nBlockBits = *(unsigned int*)(pdata + 64 + 8);
-
         //
         // Search
         //
         int64_t nStart = GetTime();
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
+        std::vector<uint32_t> vNonces;
         while(true)
         {
-            unsigned int nHashesDone = 0;
-            uint256 thash;
-            char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
-            while(true)
+            // The device only checks the top 32 bits of the target
+            uint32_t nTargetHigh = (uint32_t)(hashTarget >> 224).GetLow64();
+            uint32_t nNonceBase = pblock->nNonce;
+            if (!device->Scan((const unsigned char*)BEGIN(pblock->nVersion), nNonceBase, nTargetHigh, vNonces))
+                return;
+
+            bool fFound = false;
+            BOOST_FOREACH(uint32_t nNonce, vNonces)
             {
-#if defined(USE_SSE2)
-                // Detection would work, but in cases where we KNOW it always has SSE2,
-                // it is faster to use directly than to use a function pointer or conditional.
-#if defined(_M_X64) || defined(__x86_64__) || defined(_M_AMD64) || (defined(MAC_OSX) && defined(__i386__))
-                // Always SSE2: x86_64 or Intel MacOS X
-                scrypt_1024_1_1_256_sp_sse2(BEGIN(pblock->nVersion), BEGIN(thash), scratchpad);
-#else
-                // Detect SSE2: 32bit x86 Linux or Windows
-                scrypt_1024_1_1_256_sp(BEGIN(pblock->nVersion), BEGIN(thash), scratchpad);
-#endif
-#else
-                // Generic scrypt
-                scrypt_1024_1_1_256_sp_generic(BEGIN(pblock->nVersion), BEGIN(thash), scratchpad);
-#endif
-
-                if (thash <= hashTarget)
+                pblock->nNonce = nNonce;
+                if (pblock->GetPoWHash<ALGO_SCRYPT>() <= hashTarget)
                 {
                     // Found a solution
                     SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                    CheckWork(pblock, *pwallet, reservekey);
+                    CheckWork(pblock, *pwallet, reservekey, pblocktemplate.get());
                     SetThreadPriority(THREAD_PRIORITY_LOWEST);
+                    fFound = true;
                     break;
                 }
-                pblock->nNonce += 1;
-                nHashesDone += 1;
-                if ((pblock->nNonce & 0xFF) == 0)
-                    break;
             }
+            if (fFound)
+                break;
+            pblock->nNonce = nNonceBase;
 
             // Meter hashes/sec
-            static int64_t nHashCounter;
-            if (nHPSTimerStart == 0)
-            {
-                nHPSTimerStart = GetTimeMillis();
-                nHashCounter = 0;
-            }
-            else
-                nHashCounter += nHashesDone;
-            if (GetTimeMillis() - nHPSTimerStart > 4000)
-            {
-                static CCriticalSection cs;
-                {
-                    LOCK(cs);
-                    if (GetTimeMillis() - nHPSTimerStart > 4000)
-                    {
-                        dHashesPerSec = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStart);
-                        nHPSTimerStart = GetTimeMillis();
-                        nHashCounter = 0;
-                        static int64_t nLogTime;
-                        if (GetTime() - nLogTime > 30 * 60)
-                        {
-                            nLogTime = GetTime();
-                            LogPrintf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
-                        }
-                    }
-                }
-            }
+            worker.AddHashes(nBatch);
 
             // Check for stop or if block needs to be rebuilt
             boost::this_thread::interruption_point();
             if (vNodes.empty() && Params().NetworkID() != CChainParams::REGTEST)
                 break;
-            if (pblock->nNonce >= 0xffff0000)
+            if (pblock->nNonce >= 0xffff0000 - nBatch)
                 break;
+            pblock->nNonce += nBatch;
             if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60)
                 break;
             if (pindexPrev != chainActive.Tip())
@@ -805,24 +1155,32 @@ void static ScryptMiner(CWallet *pwallet)
 
             // Update nTime every few seconds
             UpdateTime(*pblock, pindexPrev);
-            nBlockTime = ByteReverse(pblock->nTime);
             if (TestNet())
             {
                 // Changing pblock->nTime can change work required on testnet:
-                nBlockBits = ByteReverse(pblock->nBits);
-                hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+                hashTarget = uint256().SetCompact(pblock->nBits);
             }
-            
         }
     }
 }
 
-void static GenericMiner(CWallet *pwallet, int algo)
+// Mines with the algo's CPowHasher: each pass hashes runs of consecutive
+// nonces from the header midstate, so the hashing is specialized at compile
+// time and a new hasher needs no changes here
+template<int algo>
+void static GenericMiner(CWallet *pwallet, CMinerWorker& worker)
 {
     // Each thread has its own key and counter
     CReserveKey reservekey(pwallet);
     unsigned int nExtraNonce = 0;
 
+    // ...and its own hasher, with any scratch memory it needs
+    CPowHasher<algo> hasher;
+    const unsigned int nBatch = hasher.GetBatch();
+    LogPrintf("%s miner : hashing %u nonces per pass\n", GetAlgoName(algo).c_str(), nBatch);
+    std::vector<unsigned int> vNonces(nBatch);
+    std::vector<uint256> vHashes(nBatch);
+
     while(true)
     {
         MinerWaitOnline();
@@ -847,58 +1205,46 @@ void static GenericMiner(CWallet *pwallet, int algo)
         //
         // Search
         //
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
         int64_t nStart = GetTime();
-        uint256 hash;
         while(true)
         {
-            hash = pblock->GetPoWHash(algo);
-            if (hash <= hashTarget){
-                SetThreadPriority(THREAD_PRIORITY_NORMAL);
-
-                LogPrintf("proof-of-work found  \n  hash: %s  \ntarget: %s\n", hash.GetHex().c_str(), hashTarget.GetHex().c_str());
-                pblock->print();
-
-                CheckWork(pblock, *pwallet, reservekey);
-                SetThreadPriority(THREAD_PRIORITY_LOWEST);
-                break;
-            }
-            ++pblock->nNonce;
-            
-            // Meter hashes/sec
-            static int64_t nHashCounter;
-            if (nHPSTimerStart == 0)
-            {
-                nHPSTimerStart = GetTimeMillis();
-                nHashCounter = 0;
-            }
-            else
-                nHashCounter += 1;
-            if (GetTimeMillis() - nHPSTimerStart > 4000)
+            unsigned int nHashesDone = 0;
+            bool fFound = false;
+            hasher.SetHeader(BEGIN(pblock->nVersion));
+            while (!fFound && nHashesDone < 0x100)
             {
-                static CCriticalSection cs;
+                for (unsigned int i = 0; i < nBatch; i++)
+                    vNonces[i] = pblock->nNonce + i;
+                hasher.HashNonces(&vNonces[0], nBatch, &vHashes[0]);
+                nHashesDone += nBatch;
+                for (unsigned int i = 0; i < nBatch && !fFound; i++)
                 {
-                    LOCK(cs);
-                    if (GetTimeMillis() - nHPSTimerStart > 4000)
+                    if (vHashes[i] <= hashTarget)
                     {
-                        dHashesPerSec = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStart);
-                        nHPSTimerStart = GetTimeMillis();
-                        nHashCounter = 0;
-                        static int64_t nLogTime;
-                        if (GetTime() - nLogTime > 30 * 60)
-                        {
-                            nLogTime = GetTime();
-                            LogPrintf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
-                        }
+                        // Found a solution
+                        pblock->nNonce = vNonces[i];
+                        SetThreadPriority(THREAD_PRIORITY_NORMAL);
+                        LogPrintf("proof-of-work found  \n  hash: %s  \ntarget: %s\n", vHashes[i].GetHex().c_str(), hashTarget.GetHex().c_str());
+                        CheckWork(pblock, *pwallet, reservekey, pblocktemplate.get());
+                        SetThreadPriority(THREAD_PRIORITY_LOWEST);
+                        fFound = true;
                     }
                 }
+                if (!fFound)
+                    pblock->nNonce += nBatch;
             }
 
+            // Meter hashes/sec
+            worker.AddHashes(nHashesDone);
+            if (fFound)
+                break;
+
             // Check for stop or if block needs to be rebuilt
             boost::this_thread::interruption_point();
             if (vNodes.empty() && Params().NetworkID() != CChainParams::REGTEST)
                 break;
-            if (++pblock->nNonce >= 0xffff0000)
+            if (pblock->nNonce >= 0xffff0000)
                 break;
             if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60)
                 break;
@@ -907,41 +1253,98 @@ void static GenericMiner(CWallet *pwallet, int algo)
 
             // Update nTime every few seconds
             UpdateTime(*pblock, pindexPrev);
-            // nBlockTime = ByteReverse(pblock->nTime);
             if (TestNet())
             {
                 // Changing pblock->nTime can change work required on testnet:
-                // nBlockBits = ByteReverse(pblock->nBits);
-                // hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+                hashTarget = uint256().SetCompact(pblock->nBits);
             }
         }
     } 
 }
 
-void static ThreadBitcoinMiner(CWallet *pwallet)
+class CSHA256dMiningBackend : public CMiningBackend
+{
+public:
+    int GetAlgo() const { return ALGO_SHA256D; }
+    void Mine(CWallet* pwallet, CMinerWorker& worker) { BitcoinMiner(pwallet, worker); }
+};
+
+class CScryptMiningBackend : public CMiningBackend
+{
+public:
+    int GetAlgo() const { return ALGO_SCRYPT; }
+    void Mine(CWallet* pwallet, CMinerWorker& worker) { GenericMiner<ALGO_SCRYPT>(pwallet, worker); }
+};
+
+class CX11MiningBackend : public CMiningBackend
+{
+public:
+    int GetAlgo() const { return ALGO_X11; }
+    void Mine(CWallet* pwallet, CMinerWorker& worker) { GenericMiner<ALGO_X11>(pwallet, worker); }
+};
+
+class COpenCLScryptMiningBackend : public CMiningBackend
+{
+public:
+    int GetAlgo() const { return ALGO_SCRYPT; }
+    void Mine(CWallet* pwallet, CMinerWorker& worker) { OpenCLScryptMiner(pwallet, worker); }
+};
+
+CMiningBackend* GetMiningBackend(int algo)
 {
-    LogPrintf("Digitalcoin miner started\n");
+    static CSHA256dMiningBackend sha256dBackend;
+    static CScryptMiningBackend scryptBackend;
+    static CX11MiningBackend x11Backend;
+    switch (algo)
+    {
+        case ALGO_SHA256D:
+            return &sha256dBackend;
+        case ALGO_SCRYPT:
+            return &scryptBackend;
+        case ALGO_X11:
+            return &x11Backend;
+    }
+    return NULL;
+}
+
+CMiningBackend* GetOpenCLMiningBackend(int algo)
+{
+    static COpenCLScryptMiningBackend scryptBackend;
+    if (algo == ALGO_SCRYPT)
+        return &scryptBackend;
+    return NULL;
+}
+
+static void PinThreadToCPU(int nCPU)
+{
+#if defined(__linux__) && defined(CPU_SET)
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(nCPU, &cpuset);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) != 0)
+        LogPrintf("Digitalcoin miner : unable to pin thread to CPU %d\n", nCPU);
+#endif
+}
+
+void static ThreadBitcoinMiner(CWallet *pwallet, boost::shared_ptr<CMinerWorker> worker, int nCPU)
+{
+    LogPrintf("Digitalcoin miner %d started (%s)\n", worker->GetId(), GetAlgoName(worker->GetAlgo()).c_str());
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
     RenameThread("bitcoin-miner");
-    
-    try 
+    if (nCPU >= 0)
+        PinThreadToCPU(nCPU);
+
+    CMiningBackend* backend = worker->GetDevice() < 0 ? GetMiningBackend(worker->GetAlgo()) : GetOpenCLMiningBackend(worker->GetAlgo());
+    if (!backend)
+        return;
+
+    try
     {
-        switch (miningAlgo)
-        {
-            case ALGO_SHA256D:
-                BitcoinMiner(pwallet);
-                break;
-            case ALGO_SCRYPT:
-                ScryptMiner(pwallet);
-                break;
-            case ALGO_X11:
-                GenericMiner(pwallet, ALGO_X11);
-                break;
-        }
+        backend->Mine(pwallet, *worker);
     }
     catch (boost::thread_interrupted)
     {
-        LogPrintf("Digitalcoin miner terminated\n");
+        LogPrintf("Digitalcoin miner %d terminated\n", worker->GetId());
         throw;
     }
 }
@@ -963,13 +1366,80 @@ void GenerateBitcoins(bool fGenerate, CWallet* pwallet, int nThreads)
         delete minerThreads;
         minerThreads = NULL;
     }
+    {
+        LOCK(cs_minerWorkers);
+        vMinerWorkers.clear();
+    }
 
-    if (nThreads == 0 || !fGenerate)
+    if (!fGenerate)
         return;
 
+    // -genalgothreads mines several algorithms side by side and overrides
+    // the single-algorithm thread count
+    std::map<int, int> mapAlgoThreads;
+    if (mapArgs.count("-genalgothreads"))
+    {
+        if (!ParseGenAlgoThreads(mapArgs["-genalgothreads"], mapAlgoThreads))
+        {
+            LogPrintf("GenerateBitcoins : invalid -genalgothreads '%s'\n", mapArgs["-genalgothreads"]);
+            return;
+        }
+    }
+    else if (nThreads > 0)
+        mapAlgoThreads[miningAlgo] = nThreads;
+
+    // Workers are pinned to consecutive CPUs so each algorithm's pool stays
+    // on neighbouring cores
+    bool fPin = GetBoolArg("-genpin", false);
+    int nCPUs = std::max(1, (int)boost::thread::hardware_concurrency());
+
     minerThreads = new boost::thread_group();
-    for (int i = 0; i < nThreads; i++)
-        minerThreads->create_thread(boost::bind(&ThreadBitcoinMiner, pwallet));
+    int nWorker = 0;
+    for (std::map<int, int>::const_iterator it = mapAlgoThreads.begin(); it != mapAlgoThreads.end(); ++it)
+    {
+        for (int i = 0; i < it->second; i++, nWorker++)
+        {
+            boost::shared_ptr<CMinerWorker> worker(new CMinerWorker(it->first, nWorker));
+            {
+                LOCK(cs_minerWorkers);
+                vMinerWorkers.push_back(worker);
+            }
+            minerThreads->create_thread(boost::bind(&ThreadBitcoinMiner, pwallet, worker, fPin ? nWorker % nCPUs : -1));
+        }
+    }
+
+    // -opencl adds a scrypt miner thread for each OpenCL device, by
+    // default every GPU
+    if (GetBoolArg("-opencl", false))
+    {
+        std::vector<COpenCLDeviceInfo> vInfo = ListOpenCLDevices();
+        std::vector<int> vDevices;
+        if (mapArgs.count("-opencldevices"))
+            ParseOpenCLDevices(mapArgs["-opencldevices"], vDevices);
+        else
+        {
+            BOOST_FOREACH(const COpenCLDeviceInfo& info, vInfo)
+                if (info.fGPU)
+                    vDevices.push_back(info.nIndex);
+        }
+        if (vDevices.empty())
+            LogPrintf("GenerateBitcoins : no OpenCL device to mine on\n");
+        BOOST_FOREACH(int nDevice, vDevices)
+        {
+            if (nDevice >= (int)vInfo.size())
+            {
+                LogPrintf("GenerateBitcoins : no OpenCL device %d\n", nDevice);
+                continue;
+            }
+            std::string strDevice = strprintf("opencl%d (%s)", nDevice, vInfo[nDevice].strName);
+            boost::shared_ptr<CMinerWorker> worker(new CMinerWorker(ALGO_SCRYPT, nWorker++, nDevice, strDevice));
+            {
+                LOCK(cs_minerWorkers);
+                vMinerWorkers.push_back(worker);
+            }
+            minerThreads->create_thread(boost::bind(&ThreadBitcoinMiner, pwallet, worker, -1));
+        }
+    }
 }
 
 #endif
@@ -6,13 +6,19 @@
 #ifndef BITCOIN_MINER_H
 #define BITCOIN_MINER_H
 
+#include "sync.h"
+
+#include <map>
 #include <stdint.h>
+#include <string>
+#include <vector>
 
 class CBlock;
 class CBlockIndex;
 struct CBlockTemplate;
 class CReserveKey;
 class CScript;
+class CValidationState;
 class CWallet;
 
 /** Run the miner threads */
@@ -24,12 +30,72 @@ CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey, int algo);
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 /** Do mining precalculation */
 void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash1);
+/** Process a block solved from a template of CreateNewBlock. If it has the
+ *  template's transactions, only what the miner changed is checked again, and
+ *  it is announced to peers before being connected. Requires cs_main. */
+bool ProcessBlockFromTemplate(CValidationState& state, CBlock& block, const CBlockTemplate* ptemplate);
 /** Check mined block */
-bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
+bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey, const CBlockTemplate* ptemplate = NULL);
 /** Base sha256 mining transform */
 void SHA256Transform(void* pstate, void* pinput, const void* pinit);
 
-extern double dHashesPerSec;
-extern int64_t nHPSTimerStart;
+/** Parse a -genalgothreads spec ("sha256d:2,x11:4") into per-algo thread counts */
+bool ParseGenAlgoThreads(const std::string& strSpec, std::map<int, int>& mapAlgoThreads);
+/** Combined hash rate of the running miner threads, optionally of one algo only */
+double GetMinerHashesPerSec(int algo = -1);
+
+/** Running miner threads of one algo on one device */
+struct CMinerDeviceStats
+{
+    std::string strDevice;
+    int algo;
+    int nThreads;
+    double dHashesPerSec;
+};
+/** The miner threads by device and algo, for getmininginfo */
+std::vector<CMinerDeviceStats> GetMinerDeviceStats();
+
+/** Hash meter of one miner thread; only the owning thread calls AddHashes() */
+class CMinerWorker
+{
+public:
+    // nDevice is the OpenCL device the thread mines on, or -1 for the CPU
+    CMinerWorker(int algoIn, int nIdIn, int nDeviceIn = -1, const std::string& strDeviceIn = "cpu");
+
+    int GetAlgo() const { return algo; }
+    int GetId() const { return nId; }
+    int GetDevice() const { return nDevice; }
+    const std::string& GetDeviceName() const { return strDevice; }
+    void AddHashes(uint64_t nHashes);
+    double GetHashesPerSec() const;
+
+private:
+    const int algo;
+    const int nId;
+    const int nDevice;
+    const std::string strDevice;
+    // Only used by the worker's own thread
+    int64_t nMeterStart;
+    uint64_t nMeterHashes;
+    // Read by RPC and the GUI, protected by cs
+    mutable CCriticalSection cs;
+    double dHashesPerSec;
+    int64_t nLastUpdate;
+};
+
+/** Mining loop for one proof-of-work algorithm, run by each of its worker threads */
+class CMiningBackend
+{
+public:
+    virtual ~CMiningBackend() {}
+    virtual int GetAlgo() const = 0;
+    virtual void Mine(CWallet* pwallet, CMinerWorker& worker) = 0;
+};
+
+/** Backend mining the given algo, or NULL if there is none */
+CMiningBackend* GetMiningBackend(int algo);
+/** Backend mining the given algo on the OpenCL device of each worker, or
+ *  NULL if there is no kernel for it; only scrypt has one */
+CMiningBackend* GetOpenCLMiningBackend(int algo);
 
 #endif // BITCOIN_MINER_H
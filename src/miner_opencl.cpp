@@ -0,0 +1,451 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include "bitcoin-config.h"
+#endif
+
+#include "miner_opencl.h"
+
+#include "util.h"
+
+#include <algorithm>
+#include <memory>
+#include <string.h>
+
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/foreach.hpp>
+
+#ifdef USE_OPENCL
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+#endif
+
+bool ParseOpenCLDevices(const std::string& strSpec, std::vector<int>& vDevices)
+{
+    vDevices.clear();
+    std::vector<std::string> vItems;
+    boost::split(vItems, strSpec, boost::is_any_of(","));
+    BOOST_FOREACH(const std::string& strItem, vItems)
+    {
+        if (strItem.empty() || strItem.find_first_not_of("0123456789") != std::string::npos || strItem.size() > 4)
+            return false;
+        vDevices.push_back(atoi(strItem));
+    }
+    return !vDevices.empty();
+}
+
+#ifndef USE_OPENCL
+
+bool HaveOpenCL()
+{
+    return false;
+}
+
+std::vector<COpenCLDeviceInfo> ListOpenCLDevices()
+{
+    return std::vector<COpenCLDeviceInfo>();
+}
+
+struct COpenCLScryptContext
+{
+};
+
+COpenCLScryptDevice* COpenCLScryptDevice::Create(int nIndex, unsigned int nBatch, std::string& strError)
+{
+    strError = "built without OpenCL support";
+    return NULL;
+}
+
+COpenCLScryptDevice::~COpenCLScryptDevice()
+{
+}
+
+bool COpenCLScryptDevice::Scan(const unsigned char* pheader, uint32_t nNonceBase, uint32_t nTargetHigh, std::vector<uint32_t>& vNonces)
+{
+    return false;
+}
+
+#else
+
+// scrypt(1024,1,1) of 80-byte block headers, one nonce per work item. The
+// header words are read as little endian, as the devices mining are. The
+// scratchpads of all work items are interleaved word by word, so that
+// neighbouring work items read neighbouring words.
+static const char* pszScryptKernel =
+"#define ROTL(x, n) rotate((uint)(x), (uint)(n))\n"
+"#define ROTR(x, n) rotate((uint)(x), (uint)(32 - (n)))\n"
+"#define SWAP32(x) (((x) << 24) | (((x) & 0xff00) << 8) | (((x) >> 8) & 0xff00) | ((x) >> 24))\n"
+"#define S0(x) (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))\n"
+"#define S1(x) (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))\n"
+"#define s0(x) (ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))\n"
+"#define s1(x) (ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))\n"
+"#define CH(x, y, z) bitselect((z), (y), (x))\n"
+"#define MAJ(x, y, z) bitselect((x), (y), (z) ^ (x))\n"
+"\n"
+"__constant uint K[64] = {\n"
+"    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,\n"
+"    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,\n"
+"    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,\n"
+"    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,\n"
+"    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,\n"
+"    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,\n"
+"    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,\n"
+"    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2\n"
+"};\n"
+"\n"
+"void sha256_init(uint *state)\n"
+"{\n"
+"    state[0] = 0x6a09e667; state[1] = 0xbb67ae85; state[2] = 0x3c6ef372; state[3] = 0xa54ff53a;\n"
+"    state[4] = 0x510e527f; state[5] = 0x9b05688c; state[6] = 0x1f83d9ab; state[7] = 0x5be0cd19;\n"
+"}\n"
+"\n"
+"void sha256_block(uint *state, const uint *data)\n"
+"{\n"
+"    uint W[64];\n"
+"    uint s[8];\n"
+"    for (int i = 0; i < 16; i++)\n"
+"        W[i] = data[i];\n"
+"    for (int i = 16; i < 64; i++)\n"
+"        W[i] = s1(W[i - 2]) + W[i - 7] + s0(W[i - 15]) + W[i - 16];\n"
+"    for (int i = 0; i < 8; i++)\n"
+"        s[i] = state[i];\n"
+"    for (int i = 0; i < 64; i++) {\n"
+"        uint t1 = s[7] + S1(s[4]) + CH(s[4], s[5], s[6]) + K[i] + W[i];\n"
+"        uint t2 = S0(s[0]) + MAJ(s[0], s[1], s[2]);\n"
+"        s[7] = s[6]; s[6] = s[5]; s[5] = s[4]; s[4] = s[3] + t1;\n"
+"        s[3] = s[2]; s[2] = s[1]; s[1] = s[0]; s[0] = t1 + t2;\n"
+"    }\n"
+"    for (int i = 0; i < 8; i++)\n"
+"        state[i] += s[i];\n"
+"}\n"
+"\n"
+"// The last block of a message: its first nWords words, then the padding\n"
+"// of a message of nBytes bytes\n"
+"void sha256_final(uint *state, const uint *data, int nWords, uint nBytes)\n"
+"{\n"
+"    uint block[16];\n"
+"    for (int i = 0; i < 16; i++)\n"
+"        block[i] = i < nWords ? data[i] : 0;\n"
+"    block[nWords] = 0x80000000;\n"
+"    block[15] = nBytes * 8;\n"
+"    sha256_block(state, block);\n"
+"}\n"
+"\n"
+"void xor_salsa8(uint *B, const uint *Bx)\n"
+"{\n"
+"    uint x[16];\n"
+"    for (int i = 0; i < 16; i++)\n"
+"        x[i] = (B[i] ^= Bx[i]);\n"
+"    for (int i = 0; i < 8; i += 2) {\n"
+"        x[ 4] ^= ROTL(x[ 0] + x[12],  7);  x[ 9] ^= ROTL(x[ 5] + x[ 1],  7);\n"
+"        x[14] ^= ROTL(x[10] + x[ 6],  7);  x[ 3] ^= ROTL(x[15] + x[11],  7);\n"
+"        x[ 8] ^= ROTL(x[ 4] + x[ 0],  9);  x[13] ^= ROTL(x[ 9] + x[ 5],  9);\n"
+"        x[ 2] ^= ROTL(x[14] + x[10],  9);  x[ 7] ^= ROTL(x[ 3] + x[15],  9);\n"
+"        x[12] ^= ROTL(x[ 8] + x[ 4], 13);  x[ 1] ^= ROTL(x[13] + x[ 9], 13);\n"
+"        x[ 6] ^= ROTL(x[ 2] + x[14], 13);  x[11] ^= ROTL(x[ 7] + x[ 3], 13);\n"
+"        x[ 0] ^= ROTL(x[12] + x[ 8], 18);  x[ 5] ^= ROTL(x[ 1] + x[13], 18);\n"
+"        x[10] ^= ROTL(x[ 6] + x[ 2], 18);  x[15] ^= ROTL(x[11] + x[ 7], 18);\n"
+"        x[ 1] ^= ROTL(x[ 0] + x[ 3],  7);  x[ 6] ^= ROTL(x[ 5] + x[ 4],  7);\n"
+"        x[11] ^= ROTL(x[10] + x[ 9],  7);  x[12] ^= ROTL(x[15] + x[14],  7);\n"
+"        x[ 2] ^= ROTL(x[ 1] + x[ 0],  9);  x[ 7] ^= ROTL(x[ 6] + x[ 5],  9);\n"
+"        x[ 8] ^= ROTL(x[11] + x[10],  9);  x[13] ^= ROTL(x[12] + x[15],  9);\n"
+"        x[ 3] ^= ROTL(x[ 2] + x[ 1], 13);  x[ 4] ^= ROTL(x[ 7] + x[ 6], 13);\n"
+"        x[ 9] ^= ROTL(x[ 8] + x[11], 13);  x[14] ^= ROTL(x[13] + x[12], 13);\n"
+"        x[ 0] ^= ROTL(x[ 3] + x[ 2], 18);  x[ 5] ^= ROTL(x[ 4] + x[ 7], 18);\n"
+"        x[10] ^= ROTL(x[ 9] + x[ 8], 18);  x[15] ^= ROTL(x[14] + x[13], 18);\n"
+"    }\n"
+"    for (int i = 0; i < 16; i++)\n"
+"        B[i] += x[i];\n"
+"}\n"
+"\n"
+"__kernel void scrypt_1024_1_1(__global const uint *header, uint nonceBase, uint targetHigh,\n"
+"                              __global uint *V, __global uint *results)\n"
+"{\n"
+"    uint gid = get_global_id(0);\n"
+"    uint nThreads = get_global_size(0);\n"
+"    uint nonce = nonceBase + gid;\n"
+"\n"
+"    // The header as big endian words, for SHA-256\n"
+"    uint data[20];\n"
+"    for (int i = 0; i < 19; i++)\n"
+"        data[i] = SWAP32(header[i]);\n"
+"    data[19] = SWAP32(nonce);\n"
+"\n"
+"    // HMAC-SHA256 keyed with the header, longer than a block: the key is its hash\n"
+"    uint key[8], pad[16], istate[8], ostate[8];\n"
+"    sha256_init(key);\n"
+"    sha256_block(key, data);\n"
+"    sha256_final(key, data + 16, 4, 80);\n"
+"    for (int i = 0; i < 16; i++)\n"
+"        pad[i] = (i < 8 ? key[i] : 0) ^ 0x36363636;\n"
+"    sha256_init(istate);\n"
+"    sha256_block(istate, pad);\n"
+"    for (int i = 0; i < 16; i++)\n"
+"        pad[i] ^= 0x36363636 ^ 0x5c5c5c5c;\n"
+"    sha256_init(ostate);\n"
+"    sha256_block(ostate, pad);\n"
+"\n"
+"    // X = PBKDF2(header, header, 1, 128), as little endian words\n"
+"    uint inner[8], state[8], tail[5], X[32];\n"
+"    for (int i = 0; i < 8; i++)\n"
+"        inner[i] = istate[i];\n"
+"    sha256_block(inner, data);\n"
+"    for (int i = 0; i < 4; i++)\n"
+"        tail[i] = data[16 + i];\n"
+"    for (uint k = 0; k < 4; k++) {\n"
+"        tail[4] = k + 1;\n"
+"        for (int i = 0; i < 8; i++)\n"
+"            state[i] = inner[i];\n"
+"        sha256_final(state, tail, 5, 64 + 80 + 4);\n"
+"        uint outer[8];\n"
+"        for (int i = 0; i < 8; i++)\n"
+"            outer[i] = ostate[i];\n"
+"        sha256_final(outer, state, 8, 64 + 32);\n"
+"        for (int i = 0; i < 8; i++)\n"
+"            X[k * 8 + i] = SWAP32(outer[i]);\n"
+"    }\n"
+"\n"
+"    // ROMix with N = 1024 and r = 1\n"
+"    for (uint i = 0; i < 1024; i++) {\n"
+"        for (int k = 0; k < 32; k++)\n"
+"            V[(i * 32 + k) * nThreads + gid] = X[k];\n"
+"        xor_salsa8(X, X + 16);\n"
+"        xor_salsa8(X + 16, X);\n"
+"    }\n"
+"    for (uint i = 0; i < 1024; i++) {\n"
+"        uint j = X[16] & 1023;\n"
+"        for (int k = 0; k < 32; k++)\n"
+"            X[k] ^= V[(j * 32 + k) * nThreads + gid];\n"
+"        xor_salsa8(X, X + 16);\n"
+"        xor_salsa8(X + 16, X);\n"
+"    }\n"
+"\n"
+"    // The hash is PBKDF2(header, X, 1, 32)\n"
+"    uint block[16];\n"
+"    for (int i = 0; i < 8; i++)\n"
+"        state[i] = istate[i];\n"
+"    for (int i = 0; i < 16; i++)\n"
+"        block[i] = SWAP32(X[i]);\n"
+"    sha256_block(state, block);\n"
+"    for (int i = 0; i < 16; i++)\n"
+"        block[i] = SWAP32(X[16 + i]);\n"
+"    sha256_block(state, block);\n"
+"    block[0] = 1;\n"
+"    sha256_final(state, block, 1, 64 + 128 + 4);\n"
+"    sha256_final(ostate, state, 8, 64 + 32);\n"
+"\n"
+"    // Its top 32 bits are the last word, as little endian\n"
+"    if (SWAP32(ostate[7]) <= targetHigh) {\n"
+"        uint n = atomic_inc(&results[0]);\n"
+"        if (n < OPENCL_MAX_CANDIDATES)\n"
+"            results[n + 1] = nonce;\n"
+"    }\n"
+"}\n";
+
+bool HaveOpenCL()
+{
+    return true;
+}
+
+// Every device of every platform, in the order -opencldevices numbers them
+static void GetOpenCLDevices(std::vector<cl_device_id>& vDevices, std::vector<cl_platform_id>& vPlatforms)
+{
+    cl_uint nPlatforms = 0;
+    if (clGetPlatformIDs(0, NULL, &nPlatforms) != CL_SUCCESS || nPlatforms == 0)
+        return;
+    std::vector<cl_platform_id> vIDs(nPlatforms);
+    if (clGetPlatformIDs(nPlatforms, &vIDs[0], NULL) != CL_SUCCESS)
+        return;
+    BOOST_FOREACH(cl_platform_id platform, vIDs)
+    {
+        cl_uint nDevices = 0;
+        if (clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 0, NULL, &nDevices) != CL_SUCCESS || nDevices == 0)
+            continue;
+        std::vector<cl_device_id> vIDsDevices(nDevices);
+        if (clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, nDevices, &vIDsDevices[0], NULL) != CL_SUCCESS)
+            continue;
+        BOOST_FOREACH(cl_device_id device, vIDsDevices)
+        {
+            vDevices.push_back(device);
+            vPlatforms.push_back(platform);
+        }
+    }
+}
+
+static std::string GetOpenCLDeviceString(cl_device_id device, cl_device_info param)
+{
+    char buf[256];
+    if (clGetDeviceInfo(device, param, sizeof(buf), buf, NULL) != CL_SUCCESS)
+        return "";
+    buf[sizeof(buf) - 1] = 0;
+    return buf;
+}
+
+std::vector<COpenCLDeviceInfo> ListOpenCLDevices()
+{
+    std::vector<COpenCLDeviceInfo> vInfo;
+    std::vector<cl_device_id> vDevices;
+    std::vector<cl_platform_id> vPlatforms;
+    GetOpenCLDevices(vDevices, vPlatforms);
+    for (unsigned int i = 0; i < vDevices.size(); i++)
+    {
+        COpenCLDeviceInfo info;
+        info.nIndex = i;
+        info.strName = GetOpenCLDeviceString(vDevices[i], CL_DEVICE_NAME);
+        char buf[256];
+        info.strPlatform = clGetPlatformInfo(vPlatforms[i], CL_PLATFORM_NAME, sizeof(buf), buf, NULL) == CL_SUCCESS ? std::string(buf) : "";
+        cl_device_type type = 0;
+        clGetDeviceInfo(vDevices[i], CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+        info.fGPU = (type & CL_DEVICE_TYPE_GPU) != 0;
+        cl_ulong nMem = 0;
+        clGetDeviceInfo(vDevices[i], CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(nMem), &nMem, NULL);
+        info.nGlobalMemBytes = nMem;
+        vInfo.push_back(info);
+    }
+    return vInfo;
+}
+
+struct COpenCLScryptContext
+{
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel kernel;
+    cl_mem header;
+    cl_mem scratchpad;
+    cl_mem results;
+
+    COpenCLScryptContext() : context(NULL), queue(NULL), program(NULL), kernel(NULL), header(NULL), scratchpad(NULL), results(NULL) {}
+
+    ~COpenCLScryptContext()
+    {
+        if (results) clReleaseMemObject(results);
+        if (scratchpad) clReleaseMemObject(scratchpad);
+        if (header) clReleaseMemObject(header);
+        if (kernel) clReleaseKernel(kernel);
+        if (program) clReleaseProgram(program);
+        if (queue) clReleaseCommandQueue(queue);
+        if (context) clReleaseContext(context);
+    }
+};
+
+// Bytes of scratchpad each nonce of a batch takes
+static const uint64_t SCRYPT_SCRATCHPAD_BYTES = 1024 * 128;
+
+COpenCLScryptDevice* COpenCLScryptDevice::Create(int nIndex, unsigned int nBatch, std::string& strError)
+{
+    std::vector<cl_device_id> vDevices;
+    std::vector<cl_platform_id> vPlatforms;
+    GetOpenCLDevices(vDevices, vPlatforms);
+    if (nIndex < 0 || nIndex >= (int)vDevices.size())
+    {
+        strError = strprintf("no OpenCL device %d", nIndex);
+        return NULL;
+    }
+    cl_device_id device = vDevices[nIndex];
+
+    cl_bool fLittleEndian = CL_FALSE;
+    clGetDeviceInfo(device, CL_DEVICE_ENDIAN_LITTLE, sizeof(fLittleEndian), &fLittleEndian, NULL);
+    if (!fLittleEndian)
+    {
+        strError = "device is big endian";
+        return NULL;
+    }
+
+    // The scratchpads of a batch are one buffer, within the largest the
+    // device allocates
+    cl_ulong nMaxAlloc = 0;
+    clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(nMaxAlloc), &nMaxAlloc, NULL);
+    nBatch = std::max(1U, (unsigned int)std::min((uint64_t)nBatch, (uint64_t)nMaxAlloc / SCRYPT_SCRATCHPAD_BYTES));
+
+    std::auto_ptr<COpenCLScryptDevice> pdevice(new COpenCLScryptDevice());
+    pdevice->pcontext = new COpenCLScryptContext();
+    pdevice->strName = GetOpenCLDeviceString(device, CL_DEVICE_NAME);
+    pdevice->nBatch = nBatch;
+    COpenCLScryptContext& ctx = *pdevice->pcontext;
+
+    cl_int err = CL_SUCCESS;
+    ctx.context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+    if (err == CL_SUCCESS)
+        ctx.queue = clCreateCommandQueue(ctx.context, device, 0, &err);
+    if (err != CL_SUCCESS)
+    {
+        strError = strprintf("cannot create a context (error %d)", err);
+        return NULL;
+    }
+
+    ctx.program = clCreateProgramWithSource(ctx.context, 1, &pszScryptKernel, NULL, &err);
+    std::string strOptions = strprintf("-DOPENCL_MAX_CANDIDATES=%u", OPENCL_MAX_CANDIDATES);
+    if (err == CL_SUCCESS)
+        err = clBuildProgram(ctx.program, 1, &device, strOptions.c_str(), NULL, NULL);
+    if (err != CL_SUCCESS)
+    {
+        std::vector<char> vLog(16384);
+        if (ctx.program)
+            clGetProgramBuildInfo(ctx.program, device, CL_PROGRAM_BUILD_LOG, vLog.size() - 1, &vLog[0], NULL);
+        strError = strprintf("cannot build the scrypt kernel (error %d): %s", err, &vLog[0]);
+        return NULL;
+    }
+    ctx.kernel = clCreateKernel(ctx.program, "scrypt_1024_1_1", &err);
+    if (err == CL_SUCCESS)
+        ctx.header = clCreateBuffer(ctx.context, CL_MEM_READ_ONLY, 80, NULL, &err);
+    if (err == CL_SUCCESS)
+        ctx.scratchpad = clCreateBuffer(ctx.context, CL_MEM_READ_WRITE, SCRYPT_SCRATCHPAD_BYTES * nBatch, NULL, &err);
+    if (err == CL_SUCCESS)
+        ctx.results = clCreateBuffer(ctx.context, CL_MEM_READ_WRITE, 4 * (OPENCL_MAX_CANDIDATES + 1), NULL, &err);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(ctx.kernel, 0, sizeof(cl_mem), &ctx.header);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(ctx.kernel, 3, sizeof(cl_mem), &ctx.scratchpad);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(ctx.kernel, 4, sizeof(cl_mem), &ctx.results);
+    if (err != CL_SUCCESS)
+    {
+        strError = strprintf("cannot allocate %u scratchpads (error %d)", nBatch, err);
+        return NULL;
+    }
+    return pdevice.release();
+}
+
+COpenCLScryptDevice::~COpenCLScryptDevice()
+{
+    delete pcontext;
+}
+
+bool COpenCLScryptDevice::Scan(const unsigned char* pheader, uint32_t nNonceBase, uint32_t nTargetHigh, std::vector<uint32_t>& vNonces)
+{
+    COpenCLScryptContext& ctx = *pcontext;
+    unsigned char header[80];
+    memcpy(header, pheader, 76);
+    memset(header + 76, 0, 4);
+    uint32_t results[OPENCL_MAX_CANDIDATES + 1] = {0};
+    size_t nGlobal = nBatch;
+
+    cl_int err = clEnqueueWriteBuffer(ctx.queue, ctx.header, CL_FALSE, 0, sizeof(header), header, 0, NULL, NULL);
+    if (err == CL_SUCCESS)
+        err = clEnqueueWriteBuffer(ctx.queue, ctx.results, CL_FALSE, 0, sizeof(uint32_t), results, 0, NULL, NULL);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(ctx.kernel, 1, sizeof(cl_uint), &nNonceBase);
+    if (err == CL_SUCCESS)
+        err = clSetKernelArg(ctx.kernel, 2, sizeof(cl_uint), &nTargetHigh);
+    if (err == CL_SUCCESS)
+        err = clEnqueueNDRangeKernel(ctx.queue, ctx.kernel, 1, NULL, &nGlobal, NULL, 0, NULL, NULL);
+    if (err == CL_SUCCESS)
+        err = clEnqueueReadBuffer(ctx.queue, ctx.results, CL_TRUE, 0, sizeof(results), results, 0, NULL, NULL);
+    if (err != CL_SUCCESS)
+        return error("COpenCLScryptDevice::Scan : %s: OpenCL error %d", strName, err);
+
+    vNonces.clear();
+    for (unsigned int i = 0; i < std::min(results[0], OPENCL_MAX_CANDIDATES); i++)
+        vNonces.push_back(results[i + 1]);
+    return true;
+}
+
+#endif // USE_OPENCL
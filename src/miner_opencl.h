@@ -0,0 +1,65 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MINER_OPENCL_H
+#define BITCOIN_MINER_OPENCL_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Nonces hashed per kernel launch, see -openclbatch; each takes a 128 KiB
+// scrypt scratchpad in device memory
+static const unsigned int DEFAULT_OPENCL_BATCH = 2048;
+// Nonces a launch reports at most, whose hashes pass the top 32 bits of the target
+static const unsigned int OPENCL_MAX_CANDIDATES = 15;
+
+/** An OpenCL device, numbered across all platforms as in -opencldevices */
+struct COpenCLDeviceInfo
+{
+    int nIndex;
+    std::string strName;
+    std::string strPlatform;
+    bool fGPU;
+    uint64_t nGlobalMemBytes;
+};
+
+/** Whether this build can mine on OpenCL devices (configured --with-opencl) */
+bool HaveOpenCL();
+/** The OpenCL devices present, none without OpenCL support */
+std::vector<COpenCLDeviceInfo> ListOpenCLDevices();
+/** Parse -opencldevices ("0,2") into device indexes */
+bool ParseOpenCLDevices(const std::string& strSpec, std::vector<int>& vDevices);
+
+struct COpenCLScryptContext;
+
+/** An OpenCL device with the scrypt(1024,1,1) kernel built, hashing batches
+ *  of consecutive nonces of one block header. Used by one miner thread. */
+class COpenCLScryptDevice
+{
+public:
+    // NULL with strError set if the device is missing or the kernel fails to build
+    static COpenCLScryptDevice* Create(int nIndex, unsigned int nBatch, std::string& strError);
+    ~COpenCLScryptDevice();
+
+    const std::string& GetName() const { return strName; }
+    unsigned int GetBatch() const { return nBatch; }
+
+    // Hash the nonces nNonceBase to nNonceBase + GetBatch() - 1 of the
+    // header whose first 76 bytes are pheader. Returns the nonces whose
+    // hashes have their top 32 bits at most nTargetHigh, for the caller to
+    // check against the whole target.
+    bool Scan(const unsigned char* pheader, uint32_t nNonceBase, uint32_t nTargetHigh, std::vector<uint32_t>& vNonces);
+
+private:
+    COpenCLScryptContext* pcontext;
+    std::string strName;
+    unsigned int nBatch;
+
+    COpenCLScryptDevice() : pcontext(NULL), nBatch(0) {}
+    COpenCLScryptDevice(const COpenCLScryptDevice&);
+    COpenCLScryptDevice& operator=(const COpenCLScryptDevice&);
+};
+
+#endif // BITCOIN_MINER_OPENCL_H
@@ -5,60 +5,95 @@
 #ifndef BITCOIN_MRUSET_H
 #define BITCOIN_MRUSET_H
 
-#include <deque>
+#include "memusage.h"
+
+#include <algorithm>
 #include <set>
 #include <utility>
+#include <vector>
+
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_set.hpp>
 
-/** STL-like set container that only keeps the most recent N elements. */
-template <typename T> class mruset
+/** STL-like set container that only keeps the most recent N elements.
+ *
+ * Elements are found through a hash table, and kept in insertion order in a
+ * ring of at most N slots, so inserting and evicting are O(1).
+ */
+template <typename T, typename Hash = boost::hash<T> > class mruset
 {
 public:
     typedef T key_type;
     typedef T value_type;
-    typedef typename std::set<T>::iterator iterator;
-    typedef typename std::set<T>::const_iterator const_iterator;
-    typedef typename std::set<T>::size_type size_type;
+    typedef typename boost::unordered_set<T, Hash>::const_iterator iterator;
+    typedef typename boost::unordered_set<T, Hash>::const_iterator const_iterator;
+    typedef typename boost::unordered_set<T, Hash>::size_type size_type;
 
 protected:
-    std::set<T> set;
-    std::deque<T> queue;
+    boost::unordered_set<T, Hash> set;
+    // Elements oldest first from nHead on, once the ring is full
+    std::vector<T> ring;
+    size_type nHead;
     size_type nMaxSize;
 
+    // Reorder the ring oldest first from slot 0, dropping all but the newest s
+    void rebase(size_type s)
+    {
+        std::vector<T> ringNew;
+        ringNew.reserve(std::min(ring.size(), s));
+        for (size_type i = 0; i < ring.size(); i++)
+        {
+            const T& x = ring[(nHead + i) % ring.size()];
+            if (ring.size() - i > s)
+                set.erase(x);
+            else
+                ringNew.push_back(x);
+        }
+        ring.swap(ringNew);
+        nHead = 0;
+    }
+
 public:
-    mruset(size_type nMaxSizeIn = 0) { nMaxSize = nMaxSizeIn; }
+    mruset(size_type nMaxSizeIn = 0) : nHead(0), nMaxSize(nMaxSizeIn) { }
     iterator begin() const { return set.begin(); }
     iterator end() const { return set.end(); }
     size_type size() const { return set.size(); }
+    size_t DynamicMemoryUsage() const { return memusage::DynamicUsage(set) + memusage::DynamicUsage(ring); }
     bool empty() const { return set.empty(); }
     iterator find(const key_type& k) const { return set.find(k); }
     size_type count(const key_type& k) const { return set.count(k); }
-    void clear() { set.clear(); queue.clear(); }
-    bool inline friend operator==(const mruset<T>& a, const mruset<T>& b) { return a.set == b.set; }
-    bool inline friend operator==(const mruset<T>& a, const std::set<T>& b) { return a.set == b; }
-    bool inline friend operator<(const mruset<T>& a, const mruset<T>& b) { return a.set < b.set; }
+    void clear() { set.clear(); ring.clear(); nHead = 0; }
+    bool inline friend operator==(const mruset<T, Hash>& a, const mruset<T, Hash>& b) { return a.set == b.set; }
+    bool inline friend operator==(const mruset<T, Hash>& a, const std::set<T>& b)
+    {
+        if (a.set.size() != b.size())
+            return false;
+        for (typename std::set<T>::const_iterator it = b.begin(); it != b.end(); ++it)
+            if (!a.set.count(*it))
+                return false;
+        return true;
+    }
     std::pair<iterator, bool> insert(const key_type& x)
     {
         std::pair<iterator, bool> ret = set.insert(x);
         if (ret.second)
         {
-            if (nMaxSize && queue.size() == nMaxSize)
+            if (nMaxSize && ring.size() == nMaxSize)
             {
-                set.erase(queue.front());
-                queue.pop_front();
+                // Overwrite the oldest element
+                set.erase(ring[nHead]);
+                ring[nHead] = x;
+                nHead = (nHead + 1) % nMaxSize;
             }
-            queue.push_back(x);
+            else
+                ring.push_back(x);
         }
         return ret;
     }
     size_type max_size() const { return nMaxSize; }
     size_type max_size(size_type s)
     {
-        if (s)
-            while (queue.size() > s)
-            {
-                set.erase(queue.front());
-                queue.pop_front();
-            }
+        rebase(s ? s : ring.size());
         nMaxSize = s;
         return nMaxSize;
     }
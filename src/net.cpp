@@ -12,12 +12,20 @@
 #include "addrman.h"
 #include "chainparams.h"
 #include "core.h"
+#include "proptrace.h"
 #include "ui_interface.h"
 
 #ifdef WIN32
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
+#endif
+
+#if defined(HAVE_SYS_EPOLL_H)
+#include <sys/epoll.h>
+#elif defined(HAVE_SYS_EVENT_H)
+#include <sys/event.h>
 #endif
 
 #ifdef USE_UPNP
@@ -28,6 +36,8 @@
 #endif
 
 #include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 
 // Dump addresses to peers.dat every 15 minutes (900s)
 #define DUMP_ADDRESSES_INTERVAL 900
@@ -62,10 +72,10 @@ int nMaxConnections = 125;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSharedMessage> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
-limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
+limitedmap<CInv, int64_t, CInvHasher> mapAlreadyAskedFor(MAX_INV_SZ);
 
 static deque<string> vOneShots;
 CCriticalSection cs_vOneShots;
@@ -409,6 +419,15 @@ uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+CCriticalSection CNode::cs_totalMsgStats;
+CMessageStatsMap CNode::mapTotalSendStats;
+CMessageStatsMap CNode::mapTotalRecvStats;
+uint64_t CNode::nMaxOutboundLimit = 0;
+uint64_t CNode::nMaxOutboundTotalBytesSentInCycle = 0;
+uint64_t CNode::nMaxOutboundCycleStartTime = 0;
+uint64_t CNode::nMaxUploadRate = 0;
+int64_t CNode::nUploadTokens = 0;
+int64_t CNode::nUploadTokensTime = 0;
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -476,17 +495,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
             LogPrintf("ConnectSocket() : fcntl non-blocking setting failed, error %s\n", NetworkErrorString(errno));
 #endif
 
-        // Add node
-        CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
-        pnode->AddRef();
-
-        {
-            LOCK(cs_vNodes);
-            vNodes.push_back(pnode);
-        }
-
-        pnode->nTimeConnected = GetTime();
-        return pnode;
+        return AddConnectedNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
     }
     else
     {
@@ -494,6 +503,17 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
     }
 }
 
+CNode* AddConnectedNode(SOCKET hSocket, const CAddress& addr, const std::string& addrName, bool fInbound)
+{
+    CNode* pnode = new CNode(hSocket, addr, addrName, fInbound);
+    pnode->AddRef();
+    {
+        LOCK(cs_vNodes);
+        vNodes.push_back(pnode);
+    }
+    return pnode;
+}
+
 void CNode::CloseSocketDisconnect()
 {
     fDisconnect = true;
@@ -528,6 +548,7 @@ void CNode::PushVersion()
     CAddress addrYou = (addr.IsRoutable() && !IsProxy(addr) ? addr : CAddress(CService("0.0.0.0",0)));
     CAddress addrMe = GetLocalAddress(&addr);
     RAND_bytes((unsigned char*)&nLocalHostNonce, sizeof(nLocalHostNonce));
+    nTimeVersionSent = GetTimeMicros();
     LogPrint("net", "send version message: version %d, blocks=%d, us=%s, them=%s, peer=%s\n", PROTOCOL_VERSION, nBestHeight, addrMe.ToString(), addrYou.ToString(), addr.ToString());
     PushMessage("version", PROTOCOL_VERSION, nLocalServices, nTime, addrYou, addrMe,
                 nLocalHostNonce, FormatSubVersion(CLIENT_NAME, CLIENT_VERSION, std::vector<string>()), nBestHeight, true);
@@ -587,6 +608,8 @@ void CNode::copyStats(CNodeStats &stats)
     X(nStartingHeight);
     X(nSendBytes);
     X(nRecvBytes);
+    X(nAddrProcessed);
+    X(nAddrRateLimited);
     stats.fSyncNode = (this == pnodeSync);
 
     // It is common for nodes with good ping times to suddenly become lagged,
@@ -606,9 +629,37 @@ void CNode::copyStats(CNodeStats &stats)
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    LOCK(cs_msgStats);
+    X(mapSendStats);
+    X(mapRecvStats);
 }
 #undef X
 
+size_t CNode::DynamicMemoryUsage()
+{
+    size_t nUsage = 0;
+    {
+        // Also held while the peer's messages are processed, which fills vRecvGetData and setKnown
+        LOCK(cs_vRecvMsg);
+        BOOST_FOREACH(const CNetMessage& msg, vRecvMsg)
+            nUsage += sizeof(CNetMessage) + memusage::MallocUsage(msg.hdrbuf.size()) + memusage::MallocUsage(msg.vRecv.size());
+        nUsage += vRecvGetData.size() * sizeof(CInv) + memusage::DynamicUsage(setKnown);
+    }
+    {
+        // Messages shared with other peers or the relay cache count in full in each queue
+        LOCK(cs_vSend);
+        nUsage += memusage::MallocUsage(ssSend.size()) + vSendMsg.size() * sizeof(CSharedMessage) + nSendSize;
+    }
+    {
+        LOCK(cs_inventory);
+        nUsage += memusage::DynamicUsage(vAddrToSend) + setAddrKnown.DynamicMemoryUsage() +
+            filterInventoryKnown.DynamicMemoryUsage() + memusage::DynamicUsage(vInventoryToSend) +
+            memusage::DynamicUsage(mapAskFor);
+    }
+    return nUsage;
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
@@ -638,6 +689,54 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
     return true;
 }
 
+// Message data buffers kept for reuse. Every message would otherwise
+// allocate its own buffer and wipe it on free (CSerializeData clears memory
+// it releases), which adds up for blocks.
+static CCriticalSection cs_vRecvBufferPool;
+static std::vector<CSerializeData> vRecvBufferPool;
+static size_t nRecvBufferPoolBytes = 0;
+static const unsigned int MAX_RECV_BUFFER_POOL_COUNT = 32;
+static const size_t MAX_RECV_BUFFER_POOL_BYTES = 8 * 1024 * 1024;
+
+// Give vRecv the smallest pooled buffer that fits nSize bytes, if any
+static void AcquireRecvBuffer(CDataStream& vRecv, unsigned int nSize)
+{
+    LOCK(cs_vRecvBufferPool);
+    int nBest = -1;
+    for (unsigned int i = 0; i < vRecvBufferPool.size(); i++)
+        if (vRecvBufferPool[i].capacity() >= nSize &&
+            (nBest < 0 || vRecvBufferPool[i].capacity() < vRecvBufferPool[nBest].capacity()))
+            nBest = i;
+    if (nBest < 0)
+        return;
+    nRecvBufferPoolBytes -= vRecvBufferPool[nBest].capacity();
+    vRecv.swap(vRecvBufferPool[nBest]);
+    vRecvBufferPool.erase(vRecvBufferPool.begin() + nBest);
+}
+
+static void ReleaseRecvBuffer(CDataStream& vRecv)
+{
+    CSerializeData vch;
+    vRecv.swap(vch);
+    if (vch.capacity() == 0 || vch.capacity() > MAX_RECV_BUFFER_POOL_BYTES)
+        return;
+    vch.clear();
+
+    LOCK(cs_vRecvBufferPool);
+    if (vRecvBufferPool.size() < MAX_RECV_BUFFER_POOL_COUNT &&
+        nRecvBufferPoolBytes + vch.capacity() <= MAX_RECV_BUFFER_POOL_BYTES)
+    {
+        nRecvBufferPoolBytes += vch.capacity();
+        vRecvBufferPool.push_back(CSerializeData());
+        vRecvBufferPool.back().swap(vch);
+    }
+}
+
+CNetMessage::~CNetMessage()
+{
+    ReleaseRecvBuffer(vRecv);
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -665,6 +764,7 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 
     // switch state to reading message data
     in_data = true;
+    AcquireRecvBuffer(vRecv, hdr.nMessageSize);
     vRecv.resize(hdr.nMessageSize);
 
     return nCopy;
@@ -681,7 +781,19 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     return nCopy;
 }
 
+char* CNetMessage::GetDataBuffer(unsigned int& nSize)
+{
+    if (!in_data || complete())
+        return NULL;
+    nSize = hdr.nMessageSize - nDataPos;
+    return &vRecv[nDataPos];
+}
 
+void CNetMessage::ReceivedData(unsigned int nBytes)
+{
+    assert(nBytes <= hdr.nMessageSize - nDataPos);
+    nDataPos += nBytes;
+}
 
 
 
@@ -689,26 +801,97 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+
+
+unsigned int CNode::FinalizeMessage(CPlainDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+
+    return nSize;
+}
+
+CSharedMessage CNode::MakeSharedMessage(const char* pszCommand, const char* pch, size_t nSize)
+{
+    CPlainDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(CMessageHeader::HEADER_SIZE + nSize);
+    ss << CMessageHeader(pszCommand, 0);
+    ss.write(pch, nSize);
+    FinalizeMessage(ss);
+
+    boost::shared_ptr<CPlainSerializeData> pmsg(new CPlainSerializeData());
+    ss.swap(*pmsg);
+    return pmsg;
+}
+
+// Most messages are far smaller than the socket buffer, so several queued
+// ones are handed to the kernel in a single call
+static const int MAX_SEND_BATCH = 64;
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSharedMessage>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        assert((*it)->size() > pnode->nSendOffset);
+        // -maxuploadrate: what is left waits for the bucket to refill
+        size_t nAllowance = CNode::GetUploadAllowance();
+        if (nAllowance == 0)
+            break;
+#ifdef WIN32
+        const CPlainSerializeData &data = **it;
+        size_t nBatch = std::min(data.size() - pnode->nSendOffset, nAllowance);
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nBatch, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        struct iovec iov[MAX_SEND_BATCH];
+        int nIov = 0;
+        size_t nBatch = 0;
+        for (std::deque<CSharedMessage>::iterator itBatch = it; itBatch != pnode->vSendMsg.end() && nIov < MAX_SEND_BATCH && nBatch < nAllowance; ++itBatch, ++nIov) {
+            const CPlainSerializeData &data = **itBatch;
+            size_t nSkip = (nIov == 0 ? pnode->nSendOffset : 0);
+            iov[nIov].iov_base = (void*)&data[nSkip];
+            iov[nIov].iov_len = std::min(data.size() - nSkip, nAllowance - nBatch);
+            nBatch += iov[nIov].iov_len;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+
+            // Retire the messages that went out completely
+            size_t nLeft = nBytes;
+            while (nLeft > 0) {
+                size_t nRemaining = (*it)->size() - pnode->nSendOffset;
+                if (nLeft < nRemaining) {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nRemaining;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= (*it)->size();
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+            if ((size_t)nBytes < nBatch) {
+                // could not send everything; stop sending more
+                break;
+            }
+            if (nBatch == nAllowance) {
+                // paced; the next call picks up from here
                 break;
             }
         } else {
@@ -735,9 +918,361 @@ void SocketSendData(CNode *pnode)
 
 static list<CNode*> vNodesDisconnected;
 
+// Nodes with a complete message waiting, handed from ThreadSocketHandler to
+// the ThreadMessageHandler pool. Each queued node holds a reference.
+static CWaitableCriticalSection csMessageHandler;
+static CConditionVariable condMessageHandler;
+static std::deque<CNode*> vMessageHandlerReady;
+// Set while one of the threads walks all nodes, and when processing a node
+// may have queued inventory or addresses for others
+static bool fMessageHandlerSweeping = false;
+static bool fMessageHandlerSendPending = false;
+static int64_t nMessageHandlerLastSweep = 0;
+
+// How often ThreadMessageHandler visits every node even without new
+// messages, for SendMessages and for getdata held back by a full send buffer
+static const int64_t MESSAGE_HANDLER_SWEEP_MS = 100;
+
+// Queue pnode for ThreadMessageHandler and wake it up. A node that is being
+// handled right now is queued again once that thread is done with it.
+// requires LOCK(cs_vNodes)
+static void QueueForMessageHandler(CNode* pnode)
+{
+    boost::unique_lock<boost::mutex> lock(csMessageHandler);
+    if (pnode->fMessageHandlerQueued)
+        return;
+    pnode->fMessageHandlerQueued = true;
+    pnode->AddRef();
+    if (!pnode->fMessageHandlerBusy)
+    {
+        vMessageHandlerReady.push_back(pnode);
+        condMessageHandler.notify_one();
+    }
+}
+
+// Claim pnode for the calling message handler thread, unless another
+// thread has it or is about to take it from the queue.
+static bool ClaimForMessageHandler(CNode* pnode)
+{
+    boost::unique_lock<boost::mutex> lock(csMessageHandler);
+    if (pnode->fMessageHandlerBusy || pnode->fMessageHandlerQueued)
+        return false;
+    pnode->fMessageHandlerBusy = true;
+    return true;
+}
+
+// Give up a claimed node, moving it to the queue if it was queued meanwhile.
+static void UnclaimForMessageHandler(CNode* pnode)
+{
+    boost::unique_lock<boost::mutex> lock(csMessageHandler);
+    pnode->fMessageHandlerBusy = false;
+    if (pnode->fMessageHandlerQueued)
+    {
+        vMessageHandlerReady.push_back(pnode);
+        condMessageHandler.notify_one();
+    }
+}
+
+// Whether pnode has a message that ProcessMessages can handle right now.
+// requires LOCK(cs_vRecvMsg)
+static bool HasMessageWork(CNode* pnode)
+{
+    if (pnode->nSendSize >= SendBufferSize())
+        return false;
+    // getdata left over while uploads are paced is picked up by a sweep
+    return (!pnode->vRecvGetData.empty() && !CNode::UploadThrottled()) || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete());
+}
+
+#if defined(HAVE_SYS_EPOLL_H) || defined(HAVE_SYS_EVENT_H)
+// Kernel event queue used by ThreadSocketHandler (epoll or kqueue), or -1
+// if it could not be created and select() is used instead.
+static int hSocketEvents = -1;
+
+// Maximum number of events taken from the kernel per wakeup; the rest are
+// returned by the next wait.
+static const int MAX_SOCKET_EVENTS = 256;
+
+static bool SocketEventsInit()
+{
+#if defined(HAVE_SYS_EPOLL_H)
+    hSocketEvents = epoll_create(MAX_SOCKET_EVENTS);
+#else
+    hSocketEvents = kqueue();
+#endif
+    if (hSocketEvents == -1)
+    {
+        LogPrintf("Unable to create socket event queue (%s), falling back to select()\n", NetworkErrorString(errno));
+        return false;
+    }
+
+    // Listen sockets are level-triggered: one connection is accepted per
+    // pass, and the rest are reported again on the next wait.
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+    {
+#if defined(HAVE_SYS_EPOLL_H)
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (epoll_ctl(hSocketEvents, EPOLL_CTL_ADD, hListenSocket, &event) == -1)
+#else
+        struct kevent event;
+        EV_SET(&event, hListenSocket, EVFILT_READ, EV_ADD, 0, 0, NULL);
+        if (kevent(hSocketEvents, &event, 1, NULL, 0, NULL) == -1)
+#endif
+        {
+            LogPrintf("Unable to watch listen socket (%s), falling back to select()\n", NetworkErrorString(errno));
+            close(hSocketEvents);
+            hSocketEvents = -1;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Register a peer socket, edge-triggered for both directions. The kernel
+// drops the registration itself when the socket is closed.
+static void SocketEventsAdd(CNode* pnode)
+{
+    pnode->fSocketRegistered = true;
+#if defined(HAVE_SYS_EPOLL_H)
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hSocketEvents, EPOLL_CTL_ADD, pnode->hSocket, &event) == -1)
+#else
+    struct kevent events[2];
+    EV_SET(&events[0], pnode->hSocket, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, pnode);
+    EV_SET(&events[1], pnode->hSocket, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, pnode);
+    if (kevent(hSocketEvents, events, 2, NULL, 0, NULL) == -1)
+#endif
+    {
+        LogPrintf("Unable to watch socket for %s (%s)\n", pnode->addrName, NetworkErrorString(errno));
+        pnode->fDisconnect = true;
+    }
+}
+
+// Wait up to nTimeout milliseconds and mark the peers that became readable
+// or writable. Returns whether a listen socket has a connection waiting.
+static bool SocketEventsWait(int nTimeout)
+{
+    bool fListenReady = false;
+#if defined(HAVE_SYS_EPOLL_H)
+    struct epoll_event events[MAX_SOCKET_EVENTS];
+    int nEvents = epoll_wait(hSocketEvents, events, MAX_SOCKET_EVENTS, nTimeout);
+#else
+    struct kevent events[MAX_SOCKET_EVENTS];
+    struct timespec timeout;
+    timeout.tv_sec = nTimeout / 1000;
+    timeout.tv_nsec = (nTimeout % 1000) * 1000000;
+    int nEvents = kevent(hSocketEvents, NULL, 0, events, MAX_SOCKET_EVENTS, &timeout);
+#endif
+    if (nEvents == -1)
+    {
+        if (errno != EINTR)
+        {
+            LogPrintf("socket event wait error %s\n", NetworkErrorString(errno));
+            MilliSleep(nTimeout);
+        }
+        return false;
+    }
+
+    for (int i = 0; i < nEvents; i++)
+    {
+#if defined(HAVE_SYS_EPOLL_H)
+        CNode* pnode = (CNode*)events[i].data.ptr;
+        bool fRecv = events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+        bool fSend = events[i].events & EPOLLOUT;
+#else
+        CNode* pnode = (CNode*)events[i].udata;
+        bool fRecv = events[i].filter == EVFILT_READ || (events[i].flags & (EV_EOF | EV_ERROR));
+        bool fSend = events[i].filter == EVFILT_WRITE;
+#endif
+        if (pnode == NULL)
+            fListenReady = true;
+        else
+        {
+            // Errors and hangups are found by the next recv()
+            if (fRecv)
+                pnode->fRecvReady = true;
+            if (fSend)
+                pnode->fSendReady = true;
+        }
+    }
+    return fListenReady;
+}
+#endif
+
+// Whether ThreadSocketHandler should currently send to and receive from pnode.
+//
+// Implement the following logic:
+// * If there is data to send, wait for sending data. As this only
+//   happens when optimistic write failed, we choose to first drain the
+//   write buffer in this case before receiving more. This avoids
+//   needlessly queueing received data, if the remote peer is not themselves
+//   receiving data. This means properly utilizing TCP flow control signalling.
+// * Otherwise, if there is no (complete) message in the receive buffer,
+//   or there is space left in the buffer, wait for receiving data.
+// * (if neither of the above applies, there is certainly one message
+//   in the receiver buffer ready to be processed).
+// Together, that means that at least one of the following is always possible,
+// so we don't deadlock:
+// * We send some data.
+// * We wait for data to be received (and disconnect after timeout).
+// * We process a message in the buffer (message handler thread).
+static void GetSocketInterest(CNode* pnode, bool& fWantSend, bool& fWantRecv)
+{
+    fWantSend = false;
+    fWantRecv = false;
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend && !pnode->vSendMsg.empty()) {
+            // While uploads are paced there is nothing to wait for but time
+            fWantSend = !CNode::UploadThrottled();
+            return;
+        }
+    }
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv && (
+            pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+            pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+            fWantRecv = true;
+    }
+}
+
+// The network group of an address hashed with a secret salt, so an
+// attacker cannot predict which groups the eviction below protects
+static uint64_t GetKeyedNetGroup(const CNetAddr& addr)
+{
+    static uint256 hashSalt = GetRandHash();
+    std::vector<unsigned char> vchGroup = addr.GetGroup();
+    vchGroup.insert(vchGroup.end(), hashSalt.begin(), hashSalt.end());
+    return Hash(vchGroup.begin(), vchGroup.end()).GetLow64();
+}
+
+struct CEvictionCandidate
+{
+    CNode* pnode;
+    int64_t nTimeConnected;
+    int64_t nPingUsecTime;
+    int64_t nLastBlockTime;
+    int64_t nLastTXTime;
+    uint64_t nKeyedNetGroup;
+};
+
+static bool CompareNetGroupKeyed(const CEvictionCandidate& a, const CEvictionCandidate& b)
+{
+    return a.nKeyedNetGroup < b.nKeyedNetGroup;
+}
+
+// Slowest first; peers not pinged yet count as the slowest
+static bool ReversePingTime(const CEvictionCandidate& a, const CEvictionCandidate& b)
+{
+    int64_t nPingA = a.nPingUsecTime ? a.nPingUsecTime : std::numeric_limits<int64_t>::max();
+    int64_t nPingB = b.nPingUsecTime ? b.nPingUsecTime : std::numeric_limits<int64_t>::max();
+    return nPingA > nPingB;
+}
+
+static bool CompareBlockTime(const CEvictionCandidate& a, const CEvictionCandidate& b)
+{
+    return a.nLastBlockTime < b.nLastBlockTime;
+}
+
+static bool CompareTXTime(const CEvictionCandidate& a, const CEvictionCandidate& b)
+{
+    return a.nLastTXTime < b.nLastTXTime;
+}
+
+// Most recently connected first
+static bool ReverseTimeConnected(const CEvictionCandidate& a, const CEvictionCandidate& b)
+{
+    return a.nTimeConnected > b.nTimeConnected;
+}
+
+// Protect the nProtect candidates that sort last by comparator
+static void ProtectLast(std::vector<CEvictionCandidate>& vCandidates, unsigned int nProtect, bool (*comparator)(const CEvictionCandidate&, const CEvictionCandidate&))
+{
+    std::sort(vCandidates.begin(), vCandidates.end(), comparator);
+    vCandidates.erase(vCandidates.end() - std::min(nProtect, (unsigned int)vCandidates.size()), vCandidates.end());
+}
+
+/** With all inbound slots taken, make room for a new inbound peer by
+ *  disconnecting one of the current ones. Peers from a few random network
+ *  groups, the fastest to answer pings, the last to give us new blocks and
+ *  transactions, and the longest connected are protected, so an attacker
+ *  has to outdo honest peers on every count to take their slots. The
+ *  newest peer of the network group with the most of the rest goes. */
+static bool AttemptToEvictConnection()
+{
+    std::vector<CEvictionCandidate> vCandidates;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (!pnode->fInbound || pnode->fDisconnect)
+                continue;
+            CEvictionCandidate candidate;
+            candidate.pnode = pnode;
+            candidate.nTimeConnected = pnode->nTimeConnected;
+            candidate.nPingUsecTime = pnode->nPingUsecTime;
+            candidate.nLastBlockTime = pnode->nLastBlockTime;
+            candidate.nLastTXTime = pnode->nLastTXTime;
+            candidate.nKeyedNetGroup = GetKeyedNetGroup(pnode->addr);
+            vCandidates.push_back(candidate);
+        }
+    }
+
+    ProtectLast(vCandidates, 4, CompareNetGroupKeyed);
+    ProtectLast(vCandidates, 8, ReversePingTime);
+    ProtectLast(vCandidates, 4, CompareTXTime);
+    ProtectLast(vCandidates, 4, CompareBlockTime);
+    ProtectLast(vCandidates, vCandidates.size() / 2, ReverseTimeConnected);
+    if (vCandidates.empty())
+        return false;
+
+    // The network group with the most peers left; on a tie, the one whose
+    // newest peer connected last
+    std::map<uint64_t, std::vector<CEvictionCandidate> > mapNetGroups;
+    uint64_t nMostConnectionsGroup = 0;
+    unsigned int nMostConnections = 0;
+    int64_t nMostConnectionsTime = 0;
+    BOOST_FOREACH(const CEvictionCandidate& candidate, vCandidates)
+    {
+        std::vector<CEvictionCandidate>& vGroup = mapNetGroups[candidate.nKeyedNetGroup];
+        vGroup.push_back(candidate);
+        int64_t nGroupTime = vGroup[0].nTimeConnected;
+        if (vGroup.size() > nMostConnections || (vGroup.size() == nMostConnections && nGroupTime > nMostConnectionsTime))
+        {
+            nMostConnectionsGroup = candidate.nKeyedNetGroup;
+            nMostConnections = vGroup.size();
+            nMostConnectionsTime = nGroupTime;
+        }
+    }
+
+    // vCandidates is sorted newest first, and so is each group
+    const CEvictionCandidate& evict = mapNetGroups[nMostConnectionsGroup][0];
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        if (pnode == evict.pnode)
+        {
+            LogPrint("net", "evicting peer=%d %s for a new inbound connection\n", pnode->GetId(), pnode->addr.ToString());
+            pnode->fDisconnect = true;
+            return true;
+        }
+    }
+    return false;
+}
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+#if defined(HAVE_SYS_EPOLL_H) || defined(HAVE_SYS_EVENT_H)
+    // Set when a socket may still have data after this pass
+    bool fSocketWorkPending = false;
+    if (hSocketEvents == -1)
+        SocketEventsInit();
+#endif
     while (true)
     {
         //
@@ -808,82 +1343,105 @@ void ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
+        bool fListenReady = false;
+#if defined(HAVE_SYS_EPOLL_H) || defined(HAVE_SYS_EVENT_H)
+        if (hSocketEvents != -1)
         {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
             {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                    if (pnode->hSocket != INVALID_SOCKET && !pnode->fSocketRegistered)
+                        SocketEventsAdd(pnode);
+            }
+
+            // Readiness stays marked on the nodes, so only wait if the last
+            // pass left nothing to read
+            fListenReady = SocketEventsWait(fSocketWorkPending ? 0 : 50);
+            fSocketWorkPending = false;
+            boost::this_thread::interruption_point();
+        }
+        else
+#endif
+        {
+            struct timeval timeout;
+            timeout.tv_sec  = 0;
+            timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+
+            fd_set fdsetRecv;
+            fd_set fdsetSend;
+            fd_set fdsetError;
+            FD_ZERO(&fdsetRecv);
+            FD_ZERO(&fdsetSend);
+            FD_ZERO(&fdsetError);
+            SOCKET hSocketMax = 0;
+            bool have_fds = false;
 
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
+                FD_SET(hListenSocket, &fdsetRecv);
+                hSocketMax = max(hSocketMax, hListenSocket);
+                have_fds = true;
+            }
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
                 {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
+                    pnode->fRecvReady = false;
+                    pnode->fSendReady = false;
+                    if (pnode->hSocket == INVALID_SOCKET)
                         continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+#ifndef WIN32
+                    // Only reachable when the event queue failed to start
+                    if (pnode->hSocket >= FD_SETSIZE)
+                        continue;
+#endif
+                    FD_SET(pnode->hSocket, &fdsetError);
+                    hSocketMax = max(hSocketMax, pnode->hSocket);
+                    have_fds = true;
+
+                    bool fWantSend, fWantRecv;
+                    GetSocketInterest(pnode, fWantSend, fWantRecv);
+                    if (fWantSend)
+                        FD_SET(pnode->hSocket, &fdsetSend);
+                    if (fWantRecv)
                         FD_SET(pnode->hSocket, &fdsetRecv);
                 }
             }
-        }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
+            int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                                 &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+            boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
+            if (nSelect == SOCKET_ERROR)
             {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                if (have_fds)
+                {
+                    int nErr = WSAGetLastError();
+                    LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+                    for (unsigned int i = 0; i <= hSocketMax; i++)
+                        FD_SET(i, &fdsetRecv);
+                }
+                FD_ZERO(&fdsetSend);
+                FD_ZERO(&fdsetError);
+                MilliSleep(timeout.tv_usec/1000);
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
+
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                {
+                    if (pnode->hSocket == INVALID_SOCKET)
+                        continue;
+#ifndef WIN32
+                    if (pnode->hSocket >= FD_SETSIZE)
+                        continue;
+#endif
+                    pnode->fRecvReady = FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError);
+                    pnode->fSendReady = FD_ISSET(pnode->hSocket, &fdsetSend);
+                }
+            }
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+                if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+                    fListenReady = true;
         }
 
 
@@ -891,7 +1449,7 @@ void ThreadSocketHandler()
         // Accept new connections
         //
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        if (hListenSocket != INVALID_SOCKET && fListenReady)
         {
             struct sockaddr_storage sockaddr;
             socklen_t len = sizeof(sockaddr);
@@ -916,24 +1474,21 @@ void ThreadSocketHandler()
                 if (nErr != WSAEWOULDBLOCK)
                     LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
             }
-            else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+            else if (CNode::IsBanned(addr))
             {
+                LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
                 closesocket(hSocket);
             }
-            else if (CNode::IsBanned(addr))
+            // Only a connection that will be accepted may evict a peer
+            else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS && !AttemptToEvictConnection())
             {
-                LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+                LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
                 closesocket(hSocket);
             }
             else
             {
                 LogPrint("net", "accepted connection %s\n", addr.ToString());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
-                {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
-                }
+                AddConnectedNode(hSocket, addr, "", true);
             }
         }
 
@@ -942,6 +1497,7 @@ void ThreadSocketHandler()
         // Service each socket
         //
         vector<CNode*> vNodesCopy;
+        vector<CNode*> vNodesReady;
         {
             LOCK(cs_vNodes);
             vNodesCopy = vNodes;
@@ -952,27 +1508,53 @@ void ThreadSocketHandler()
         {
             boost::this_thread::interruption_point();
 
+            // With select() the interest was applied when building the fd
+            // sets; readiness from the event queue says nothing about it
+            bool fWantSend = true, fWantRecv = true;
+#if defined(HAVE_SYS_EPOLL_H) || defined(HAVE_SYS_EVENT_H)
+            if (hSocketEvents != -1 && (pnode->fRecvReady || pnode->fSendReady))
+                GetSocketInterest(pnode, fWantSend, fWantRecv);
+#endif
+
             //
             // Receive
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (pnode->fRecvReady && fWantRecv)
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
                 {
                     {
-                        // typical socket buffer is 8K-64K
+                        // typical socket buffer is 8K-64K. The data of a
+                        // message whose header is in goes straight into the
+                        // message.
                         char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                        unsigned int nDirect = 0;
+                        char* pchDirect = pnode->GetRecvBuffer(nDirect);
+                        int nBytes;
+                        if (pchDirect)
+                            nBytes = recv(pnode->hSocket, pchDirect, nDirect, MSG_DONTWAIT);
+                        else
+                            nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
                         if (nBytes > 0)
                         {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                            bool fOk = true;
+                            if (pchDirect)
+                                pnode->ReceivedMsgBuffer(nBytes);
+                            else
+                                fOk = pnode->ReceiveMsgBytes(pchBuf, nBytes);
+                            if (!fOk)
                                 pnode->CloseSocketDisconnect();
+                            else if (pnode->vRecvMsg.front().complete())
+                                vNodesReady.push_back(pnode);
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
                             pnode->RecordBytesRecv(nBytes);
+#if defined(HAVE_SYS_EPOLL_H) || defined(HAVE_SYS_EVENT_H)
+                            fSocketWorkPending = true;
+#endif
                         }
                         else if (nBytes == 0)
                         {
@@ -985,7 +1567,9 @@ void ThreadSocketHandler()
                         {
                             // error
                             int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fRecvReady = false;
+                            else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                             {
                                 if (!pnode->fDisconnect)
                                     LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
@@ -1001,11 +1585,17 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (pnode->fSendReady && fWantSend)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
+                {
                     SocketSendData(pnode);
+                    // Anything left over means the socket buffer is full,
+                    // unless sending stopped for -maxuploadrate
+                    if (!pnode->vSendMsg.empty() && !CNode::UploadThrottled())
+                        pnode->fSendReady = false;
+                }
             }
 
             //
@@ -1034,6 +1624,8 @@ void ThreadSocketHandler()
         }
         {
             LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesReady)
+                QueueForMessageHandler(pnode);
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 pnode->Release();
         }
@@ -1181,22 +1773,31 @@ void ThreadDNSAddressSeed()
 
     LogPrintf("Loading addresses from DNS seeds (could take a while)\n");
 
-    BOOST_FOREACH(const CDNSSeedData &seed, vSeeds) {
+    // Resolve all seeds at once, so a slow one only delays itself
+    vector<vector<CNetAddr> > vvIPs(vSeeds.size());
+    if (!HaveNameProxy()) {
+        boost::thread_group lookups;
+        for (unsigned int i = 0; i < vSeeds.size(); i++)
+            lookups.create_thread(boost::bind(&LookupHost, vSeeds[i].host.c_str(), boost::ref(vvIPs[i]), 0, true));
+        // the lookups write to vvIPs, so they must be done before it goes
+        boost::this_thread::disable_interruption di;
+        lookups.join_all();
+    }
+    boost::this_thread::interruption_point();
+
+    for (unsigned int i = 0; i < vSeeds.size(); i++) {
+        const CDNSSeedData &seed = vSeeds[i];
         if (HaveNameProxy()) {
             AddOneShot(seed.host);
         } else {
-            vector<CNetAddr> vIPs;
             vector<CAddress> vAdd;
-            if (LookupHost(seed.host.c_str(), vIPs))
+            BOOST_FOREACH(CNetAddr& ip, vvIPs[i])
             {
-                BOOST_FOREACH(CNetAddr& ip, vIPs)
-                {
-                    int nOneDay = 24*3600;
-                    CAddress addr = CAddress(CService(ip, Params().GetDefaultPort()));
-                    addr.nTime = GetTime() - 3*nOneDay - GetRand(4*nOneDay); // use a random age between 3 and 7 days old
-                    vAdd.push_back(addr);
-                    found++;
-                }
+                int nOneDay = 24*3600;
+                CAddress addr = CAddress(CService(ip, Params().GetDefaultPort()));
+                addr.nTime = GetTime() - 3*nOneDay - GetRand(4*nOneDay); // use a random age between 3 and 7 days old
+                vAdd.push_back(addr);
+                found++;
             }
             addrman.Add(vAdd, CNetAddr(seed.name, true));
         }
@@ -1218,10 +1819,22 @@ void ThreadDNSAddressSeed()
 
 void DumpAddresses()
 {
+    // peers.dat still holds what addrman has if nothing changed since the
+    // last successful write
+    static uint64_t nLastModifications = 0;
+    static bool fWritten = false;
+    uint64_t nModifications = addrman.GetModifications();
+    if (fWritten && nModifications == nLastModifications)
+        return;
+
     int64_t nStart = GetTimeMillis();
 
     CAddrDB adb;
-    adb.Write(addrman);
+    if (adb.Write(addrman))
+    {
+        nLastModifications = nModifications;
+        fWritten = true;
+    }
 
     LogPrint("net", "Flushed %d addresses to peers.dat  %dms\n",
            addrman.size(), GetTimeMillis() - nStart);
@@ -1245,6 +1858,45 @@ void static ProcessOneShot()
     }
 }
 
+// Outbound connections are attempted by a small pool of threads, so a few
+// dead addresses waiting out nConnectTimeout do not hold up the others
+static const int CONNECT_ATTEMPT_THREADS = 4;
+
+// Attempts handed from ThreadOpenConnections to the pool, each with the
+// outbound slot it is for, and the network groups of those queued or being
+// tried; at most CONNECT_ATTEMPT_THREADS in all
+static CWaitableCriticalSection csConnectAttempts;
+static CConditionVariable condConnectAttempts;
+static std::deque<std::pair<CAddress, CSemaphoreGrant*> > vConnectAttempts;
+static std::multiset<std::vector<unsigned char> > setConnectAttemptGroups;
+
+void ThreadConnectAttempts()
+{
+    while (true)
+    {
+        std::pair<CAddress, CSemaphoreGrant*> attempt;
+        {
+            boost::unique_lock<boost::mutex> lock(csConnectAttempts);
+            while (vConnectAttempts.empty())
+                condConnectAttempts.wait(lock);
+            attempt = vConnectAttempts.front();
+            vConnectAttempts.pop_front();
+        }
+
+        // The grant moves to the node if it connects and is released otherwise
+        {
+            boost::scoped_ptr<CSemaphoreGrant> pgrant(attempt.second);
+            OpenNetworkConnection(attempt.first, pgrant.get());
+        }
+
+        {
+            boost::unique_lock<boost::mutex> lock(csConnectAttempts);
+            setConnectAttemptGroups.erase(setConnectAttemptGroups.find(attempt.first.GetGroup()));
+            condConnectAttempts.notify_all();
+        }
+    }
+}
+
 void ThreadOpenConnections()
 {
     // Connect to specific addresses
@@ -1274,6 +1926,13 @@ void ThreadOpenConnections()
 
         MilliSleep(500);
 
+        // Wait for a thread to be free to try the next address
+        {
+            boost::unique_lock<boost::mutex> lock(csConnectAttempts);
+            while (setConnectAttemptGroups.size() >= CONNECT_ATTEMPT_THREADS)
+                condConnectAttempts.wait(lock);
+        }
+
         CSemaphoreGrant grant(*semOutbound);
         boost::this_thread::interruption_point();
 
@@ -1305,6 +1964,10 @@ void ThreadOpenConnections()
                 }
             }
         }
+        {
+            boost::unique_lock<boost::mutex> lock(csConnectAttempts);
+            setConnected.insert(setConnectAttemptGroups.begin(), setConnectAttemptGroups.end());
+        }
 
         int64_t nANow = GetAdjustedTime();
 
@@ -1341,7 +2004,14 @@ void ThreadOpenConnections()
         }
 
         if (addrConnect.IsValid())
-            OpenNetworkConnection(addrConnect, &grant);
+        {
+            CSemaphoreGrant* pgrant = new CSemaphoreGrant();
+            grant.MoveTo(*pgrant);
+            boost::unique_lock<boost::mutex> lock(csConnectAttempts);
+            vConnectAttempts.push_back(make_pair(addrConnect, pgrant));
+            setConnectAttemptGroups.insert(addrConnect.GetGroup());
+            condConnectAttempts.notify_all();
+        }
     }
 }
 
@@ -1447,10 +2117,16 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
-// for now, use a very simple selection metric: the node from which we received
-// most recently
+// sync from the node with the shortest round trip: its measured ping, else
+// what addrman remembers of its address; nodes with neither rank below all
+// measured ones, by whom we received from most recently
 static int64_t NodeSyncScore(const CNode *pnode) {
-    return pnode->nLastRecv;
+    int64_t nLatency = pnode->nPingUsecTime;
+    if (nLatency == 0 && !pnode->fInbound)
+        nLatency = addrman.GetLatencyUsec(pnode->addr);
+    if (nLatency > 0)
+        return -nLatency;
+    return std::numeric_limits<int64_t>::min() + pnode->nLastRecv;
 }
 
 void static StartSync(const vector<CNode*> &vNodes) {
@@ -1481,11 +2157,99 @@ void static StartSync(const vector<CNode*> &vNodes) {
     }
 }
 
+// Process and send the messages of a node claimed by the calling thread.
+// Returns whether the node has more messages to process.
+static bool HandleNodeMessages(CNode* pnode, bool fProcess, bool fSendTrickle)
+{
+    if (pnode->fDisconnect)
+        return false;
+
+    bool fMore = false;
+    if (fProcess)
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv)
+        {
+            if (!g_signals.ProcessMessages(pnode))
+                pnode->CloseSocketDisconnect();
+
+            fMore = HasMessageWork(pnode);
+        }
+        else
+            fMore = true;
+    }
+    boost::this_thread::interruption_point();
+
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+            g_signals.SendMessages(pnode, fSendTrickle);
+    }
+    boost::this_thread::interruption_point();
+
+    return fMore;
+}
+
 void ThreadMessageHandler()
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true)
     {
+        // Take a node from the queue. With none queued, walk all nodes if a
+        // sweep is due or processed messages may have relayed something,
+        // unless another thread is already doing so.
+        CNode* pnodeReady = NULL;
+        bool fSweep = false;
+        {
+            boost::unique_lock<boost::mutex> lock(csMessageHandler);
+            while (true)
+            {
+                if (!vMessageHandlerReady.empty())
+                {
+                    pnodeReady = vMessageHandlerReady.front();
+                    vMessageHandlerReady.pop_front();
+                    pnodeReady->fMessageHandlerQueued = false;
+                    pnodeReady->fMessageHandlerBusy = true;
+                    break;
+                }
+                int64_t nNow = GetTimeMillis();
+                int64_t nWait = MESSAGE_HANDLER_SWEEP_MS;
+                if (!fMessageHandlerSweeping)
+                {
+                    fSweep = nNow >= nMessageHandlerLastSweep + MESSAGE_HANDLER_SWEEP_MS;
+                    if (fSweep || fMessageHandlerSendPending)
+                    {
+                        if (fSweep)
+                            nMessageHandlerLastSweep = nNow;
+                        fMessageHandlerSweeping = true;
+                        fMessageHandlerSendPending = false;
+                        break;
+                    }
+                    nWait = nMessageHandlerLastSweep + MESSAGE_HANDLER_SWEEP_MS - nNow;
+                }
+                condMessageHandler.timed_wait(lock, boost::posix_time::milliseconds(nWait));
+            }
+        }
+
+        if (pnodeReady)
+        {
+            bool fMore = HandleNodeMessages(pnodeReady, true, false);
+            {
+                LOCK(cs_vNodes);
+                UnclaimForMessageHandler(pnodeReady);
+                if (fMore)
+                    QueueForMessageHandler(pnodeReady);
+                // the reference taken when it was queued
+                pnodeReady->Release();
+            }
+            {
+                boost::unique_lock<boost::mutex> lock(csMessageHandler);
+                fMessageHandlerSendPending = true;
+                condMessageHandler.notify_one();
+            }
+            continue;
+        }
+
         bool fHaveSyncNode = false;
 
         vector<CNode*> vNodesCopy;
@@ -1499,57 +2263,39 @@ void ThreadMessageHandler()
             }
         }
 
-        if (!fHaveSyncNode)
+        if (fSweep && !fHaveSyncNode)
             StartSync(vNodesCopy);
 
-        // Poll the connected nodes for messages
+        // Only sweeps pick a trickle node, so its rate does not depend on
+        // how often messages arrive
         CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
+        if (fSweep && !vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
 
-        bool fSleep = true;
-
+        // Every node is visited for SendMessages, so whatever the processed
+        // messages relayed goes out without waiting for the next sweep.
+        // Queued or busy nodes are left to the thread that has them.
+        vector<CNode*> vNodesMore;
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            if (pnode->fDisconnect)
+            if (!ClaimForMessageHandler(pnode))
                 continue;
-
-            // Receive messages
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    if (!g_signals.ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
-
-                    if (pnode->nSendSize < SendBufferSize())
-                    {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
-                    }
-                }
-            }
-            boost::this_thread::interruption_point();
-
-            // Send messages
-            {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle);
-            }
-            boost::this_thread::interruption_point();
+            if (HandleNodeMessages(pnode, fSweep, pnode == pnodeTrickle))
+                vNodesMore.push_back(pnode);
+            UnclaimForMessageHandler(pnode);
         }
 
         {
             LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesMore)
+                QueueForMessageHandler(pnode);
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 pnode->Release();
         }
-
-        if (fSleep)
-            MilliSleep(100);
+        {
+            boost::unique_lock<boost::mutex> lock(csMessageHandler);
+            fMessageHandlerSweeping = false;
+        }
     }
 }
 
@@ -1740,9 +2486,14 @@ void StartNode(boost::thread_group& threadGroup)
 
     // Initiate outbound connections
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
+    for (int i = 0; i < CONNECT_ATTEMPT_THREADS; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "connect", &ThreadConnectAttempts));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    int nMessageThreads = GetArg("-msgthreads", DEFAULT_MESSAGE_HANDLER_THREADS);
+    nMessageThreads = std::max(std::min(nMessageThreads, MAX_MESSAGE_HANDLER_THREADS), 1);
+    for (int i = 0; i < nMessageThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -1777,6 +2528,10 @@ public:
             if (hListenSocket != INVALID_SOCKET)
                 if (closesocket(hListenSocket) == SOCKET_ERROR)
                     LogPrintf("closesocket(hListenSocket) failed with error %s\n", NetworkErrorString(WSAGetLastError()));
+#if defined(HAVE_SYS_EPOLL_H) || defined(HAVE_SYS_EVENT_H)
+        if (hSocketEvents != -1)
+            close(hSocketEvents);
+#endif
 
         // clean up some globals (to help leak detection)
         BOOST_FOREACH(CNode *pnode, vNodes)
@@ -1804,42 +2559,106 @@ instance_of_cnetcleanup;
 
 
 
-void RelayTransaction(const CTransaction& tx, const uint256& hash)
+void AddRelayMessage(const CInv& inv, const CSharedMessage& pmsg)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, hash, ss);
+    LOCK(cs_mapRelay);
+    // Expire old relay messages
+    while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
+    {
+        mapRelay.erase(vRelayExpiration.front().second);
+        vRelayExpiration.pop_front();
+    }
+
+    mapRelay.insert(std::make_pair(inv, pmsg));
+    vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
 }
 
-void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss)
+size_t GetPeersMemoryUsage()
 {
-    CInv inv(MSG_TX, hash);
+    size_t nUsage = 0;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            nUsage += memusage::MallocUsage(sizeof(CNode)) + pnode->DynamicMemoryUsage();
+    }
     {
         LOCK(cs_mapRelay);
-        // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
+        nUsage += memusage::DynamicUsage(mapRelay) + vRelayExpiration.size() * sizeof(vRelayExpiration[0]);
+        for (map<CInv, CSharedMessage>::const_iterator it = mapRelay.begin(); it != mapRelay.end(); ++it)
+            nUsage += memusage::MallocUsage(it->second->capacity());
+    }
+    return nUsage;
+}
+
+static void RelayTransactionMessage(const CTransaction& tx, const uint256& hash, const CSharedMessage& pmsg)
+{
+    CInv inv(MSG_TX, hash);
+    AddRelayMessage(inv, pmsg);
+    // Extracted for the first filtered peer, shared by the rest
+    boost::scoped_ptr<CBloomTxElements> pelements;
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        if(!pnode->fRelayTxes)
+            continue;
+        LOCK(pnode->cs_filter);
+        if (pnode->pfilter)
         {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
+            if (!pelements)
+                pelements.reset(new CBloomTxElements(tx, hash));
+            if (!pnode->pfilter->IsRelevantAndUpdate(*pelements))
+                continue;
         }
+        pnode->PushInventory(inv);
+        PROPTRACE(PROPTRACE_RELAY, MSG_TX, hash, pnode->GetId());
+    }
+}
+
+void RelayTransaction(const CTransaction& tx, const uint256& hash)
+{
+    RelayTransactionMessage(tx, hash, CNode::MakeSharedMessage("tx", tx));
+}
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
+void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss)
+{
+    // Save original serialized message so newer versions are preserved
+    RelayTransactionMessage(tx, hash, CNode::MakeSharedMessage("tx", &ss[0], ss.size()));
+}
+
+void RelayTransactions(const std::vector<const CTransaction*>& vpTx)
+{
+    std::vector<CInv> vInv;
+    vInv.reserve(vpTx.size());
+    BOOST_FOREACH(const CTransaction* ptx, vpTx)
+    {
+        vInv.push_back(CInv(MSG_TX, ptx->GetHash()));
+        AddRelayMessage(vInv.back(), CNode::MakeSharedMessage("tx", *ptx));
     }
+    // Extracted for the first filtered peer, shared by the rest
+    std::vector<boost::shared_ptr<CBloomTxElements> > vElements(vpTx.size());
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
     {
         if(!pnode->fRelayTxes)
             continue;
-        LOCK(pnode->cs_filter);
-        if (pnode->pfilter)
+        std::vector<CInv> vInvNode;
         {
-            if (pnode->pfilter->IsRelevantAndUpdate(tx, hash))
-                pnode->PushInventory(inv);
-        } else
-            pnode->PushInventory(inv);
+            LOCK(pnode->cs_filter);
+            for (unsigned int i = 0; i < vpTx.size(); i++)
+            {
+                if (pnode->pfilter)
+                {
+                    if (!vElements[i])
+                        vElements[i].reset(new CBloomTxElements(*vpTx[i], vInv[i].hash));
+                    if (!pnode->pfilter->IsRelevantAndUpdate(*vElements[i]))
+                        continue;
+                }
+                vInvNode.push_back(vInv[i]);
+            }
+        }
+        pnode->PushInventory(vInvNode);
+        BOOST_FOREACH(const CInv& inv, vInvNode)
+            PROPTRACE(PROPTRACE_RELAY, MSG_TX, inv.hash, pnode->GetId());
     }
 }
 
@@ -1853,6 +2672,173 @@ void CNode::RecordBytesSent(uint64_t bytes)
 {
     LOCK(cs_totalBytesSent);
     nTotalBytesSent += bytes;
+    nUploadTokens -= bytes;
+
+    uint64_t now = GetTime();
+    if (nMaxOutboundCycleStartTime + MAX_UPLOAD_TARGET_TIMEFRAME < now)
+    {
+        // a new cycle begins
+        nMaxOutboundCycleStartTime = now;
+        nMaxOutboundTotalBytesSentInCycle = 0;
+    }
+    nMaxOutboundTotalBytesSentInCycle += bytes;
+}
+
+void CMessageStats::AddTimed(uint64_t nBytesIn, int64_t nUsec)
+{
+    Add(nBytesIn);
+    nTimeUsec += nUsec;
+
+    unsigned int nBucket = 0;
+    while (nBucket + 1 < MESSAGE_LATENCY_BUCKETS && nUsec >= LatencyBucketLimit(nBucket))
+        nBucket++;
+    vLatency[nBucket]++;
+}
+
+int64_t CMessageStats::LatencyBucketLimit(unsigned int nBucket)
+{
+    if (nBucket + 1 >= MESSAGE_LATENCY_BUCKETS)
+        return 0;
+    return (int64_t)16 << (2 * nBucket);
+}
+
+// The stats of a command, or of "*other*" once a peer has sent too many
+// different ones
+static CMessageStats& GetMessageStats(CMessageStatsMap& mapStats, const std::string& strCommand)
+{
+    if (mapStats.size() >= MAX_MESSAGE_STATS_COMMANDS && !mapStats.count(strCommand))
+        return mapStats["*other*"];
+    return mapStats[strCommand];
+}
+
+void CNode::RecordMessageSent(const CPlainSerializeData& msg)
+{
+    assert(msg.size() >= CMessageHeader::HEADER_SIZE);
+    const char* pszCommand = &msg[MESSAGE_START_SIZE];
+    std::string strCommand(pszCommand, std::find(pszCommand, pszCommand + CMessageHeader::COMMAND_SIZE, '\0'));
+    {
+        LOCK(cs_msgStats);
+        GetMessageStats(mapSendStats, strCommand).Add(msg.size());
+    }
+    {
+        LOCK(cs_totalMsgStats);
+        GetMessageStats(mapTotalSendStats, strCommand).Add(msg.size());
+    }
+}
+
+void CNode::RecordMessageProcessed(const std::string& strCommand, uint64_t nBytes, int64_t nUsec)
+{
+    {
+        LOCK(cs_msgStats);
+        GetMessageStats(mapRecvStats, strCommand).AddTimed(nBytes, nUsec);
+    }
+    {
+        LOCK(cs_totalMsgStats);
+        GetMessageStats(mapTotalRecvStats, strCommand).AddTimed(nBytes, nUsec);
+    }
+}
+
+void CNode::GetTotalMessageStats(CMessageStatsMap& mapSend, CMessageStatsMap& mapRecv)
+{
+    LOCK(cs_totalMsgStats);
+    mapSend = mapTotalSendStats;
+    mapRecv = mapTotalRecvStats;
+}
+
+void CNode::GetTotalMessageBytes(const std::string& strCommand, uint64_t& nSent, uint64_t& nRecv)
+{
+    LOCK(cs_totalMsgStats);
+    CMessageStatsMap::const_iterator it = mapTotalSendStats.find(strCommand);
+    nSent = it != mapTotalSendStats.end() ? it->second.nBytes : 0;
+    it = mapTotalRecvStats.find(strCommand);
+    nRecv = it != mapTotalRecvStats.end() ? it->second.nBytes : 0;
+}
+
+void CNode::SetMaxOutboundTarget(uint64_t limit)
+{
+    LOCK(cs_totalBytesSent);
+    nMaxOutboundLimit = limit;
+}
+
+uint64_t CNode::GetMaxOutboundTarget()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundLimit;
+}
+
+uint64_t CNode::GetMaxOutboundTimeLeftInCycle()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    if (nMaxOutboundCycleStartTime == 0)
+        return MAX_UPLOAD_TARGET_TIMEFRAME;
+
+    uint64_t cycleEndTime = nMaxOutboundCycleStartTime + MAX_UPLOAD_TARGET_TIMEFRAME;
+    uint64_t now = GetTime();
+    return (cycleEndTime < now) ? 0 : cycleEndTime - now;
+}
+
+bool CNode::OutboundTargetReached(bool fHistoricalBlockServingLimit)
+{
+    uint64_t timeLeftInCycle = GetMaxOutboundTimeLeftInCycle();
+
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return false;
+
+    if (fHistoricalBlockServingLimit)
+    {
+        // The reserve shrinks as the cycle runs out, so history gets what
+        // relay did not need
+        uint64_t buffer = nMaxOutboundLimit / 100 * UPLOAD_TARGET_TIP_RESERVE * timeLeftInCycle / MAX_UPLOAD_TARGET_TIMEFRAME;
+        if (buffer >= nMaxOutboundLimit || nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit - buffer)
+            return true;
+    }
+    else if (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit)
+        return true;
+
+    return false;
+}
+
+uint64_t CNode::GetOutboundTargetBytesLeft()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    return (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit) ? 0 : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
+}
+
+void CNode::SetMaxUploadRate(uint64_t rate)
+{
+    LOCK(cs_totalBytesSent);
+    nMaxUploadRate = rate;
+    nUploadTokens = rate;
+    nUploadTokensTime = GetTimeMillis();
+}
+
+uint64_t CNode::GetMaxUploadRate()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxUploadRate;
+}
+
+size_t CNode::GetUploadAllowance()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxUploadRate == 0)
+        return std::numeric_limits<size_t>::max();
+
+    // Token bucket holding at most one second worth of sending
+    int64_t nNow = GetTimeMillis();
+    if (nNow > nUploadTokensTime)
+    {
+        nUploadTokens = std::min((int64_t)nMaxUploadRate, nUploadTokens + (int64_t)(nMaxUploadRate * (nNow - nUploadTokensTime) / 1000));
+        nUploadTokensTime = nNow;
+    }
+    return nUploadTokens > 0 ? (size_t)nUploadTokens : 0;
 }
 
 uint64_t CNode::GetTotalBytesRecv()
@@ -1877,21 +2863,21 @@ void CNode::Fuzz(int nChance)
     case 0:
         // xor a random byte with a random value:
         if (!ssSend.empty()) {
-            CDataStream::size_type pos = GetRand(ssSend.size());
+            CPlainDataStream::size_type pos = GetRand(ssSend.size());
             ssSend[pos] ^= (unsigned char)(GetRand(256));
         }
         break;
     case 1:
         // delete a random byte:
         if (!ssSend.empty()) {
-            CDataStream::size_type pos = GetRand(ssSend.size());
+            CPlainDataStream::size_type pos = GetRand(ssSend.size());
             ssSend.erase(ssSend.begin()+pos);
         }
         break;
     case 2:
         // insert a random byte at a random position
         {
-            CDataStream::size_type pos = GetRand(ssSend.size());
+            CPlainDataStream::size_type pos = GetRand(ssSend.size());
             char ch = (char)GetRand(256);
             ssSend.insert(ssSend.begin()+pos, ch);
         }
@@ -18,6 +18,7 @@
 #include "util.h"
 
 #include <deque>
+#include <map>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -25,6 +26,7 @@
 #endif
 
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 #include <openssl/rand.h>
 
@@ -41,6 +43,26 @@ static const unsigned int MAX_INV_SZ = 50000;
 
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** Default number of threads processing peer messages (-msgthreads) */
+static const int DEFAULT_MESSAGE_HANDLER_THREADS = 2;
+/** Upper bound for -msgthreads */
+static const int MAX_MESSAGE_HANDLER_THREADS = 16;
+/** Inventory a peer is remembered to know about, at least this many of the latest */
+static const unsigned int INVENTORY_KNOWN_SIZE = 5000;
+/** Average seconds between transaction announcements to an inbound peer;
+ *  outbound peers get them twice as often */
+static const unsigned int INVENTORY_BROADCAST_INTERVAL = 5;
+/** Period over which -maxuploadtarget applies, in seconds */
+static const uint64_t MAX_UPLOAD_TARGET_TIMEFRAME = 60 * 60 * 24;
+/** Share of -maxuploadtarget that serving historical blocks may not eat
+ *  into, kept for relaying new blocks and transactions, in percent */
+static const uint64_t UPLOAD_TARGET_TIP_RESERVE = 25;
+/** Blocks older than this, in seconds before the tip, are historical */
+static const int64_t HISTORICAL_BLOCK_AGE = 7 * 24 * 60 * 60;
+/** Addresses per second a peer's addr messages are processed at, on average */
+static const double MAX_ADDR_RATE_PER_SECOND = 0.1;
+/** Addresses a peer may send in one burst; a getaddr we send allows this many more */
+static const unsigned int MAX_ADDR_PROCESSING_TOKEN_BUCKET = 1000;
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
@@ -52,6 +74,10 @@ void AddressCurrentlyConnected(const CService& addr);
 CNode* FindNode(const CNetAddr& ip);
 CNode* FindNode(const CService& ip);
 CNode* ConnectNode(CAddress addrConnect, const char *strDest = NULL);
+// Serve an already connected, non-blocking stream socket as a peer, like an
+// accepted (fInbound) or opened connection. The reference it is returned
+// with is released on disconnect for inbound nodes, by the caller otherwise.
+CNode* AddConnectedNode(SOCKET hSocket, const CAddress& addr, const std::string& addrName, bool fInbound);
 void MapPort(bool fUseUPnP);
 unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
@@ -61,6 +87,10 @@ void SocketSendData(CNode *pnode);
 
 typedef int NodeId;
 
+/** A finished message, header included. Send queues hold these by reference,
+ *  so a message relayed to many peers is serialized and hashed only once. */
+typedef boost::shared_ptr<const CPlainSerializeData> CSharedMessage;
+
 // Signals for message handling
 struct CNodeSignals
 {
@@ -108,10 +138,10 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSharedMessage> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
-extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
+extern limitedmap<CInv, int64_t, CInvHasher> mapAlreadyAskedFor;
 
 extern std::vector<std::string> vAddedNodes;
 extern CCriticalSection cs_vAddedNodes;
@@ -127,6 +157,43 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+/** Buckets of the processing time histogram: bucket i counts messages
+ *  handled in under 16 << (2 * i) microseconds, the last one the rest */
+static const unsigned int MESSAGE_LATENCY_BUCKETS = 8;
+/** Commands counted separately per peer; as peers choose them, any beyond
+ *  this many are counted together as "*other*" */
+static const unsigned int MAX_MESSAGE_STATS_COMMANDS = 32;
+
+/** Traffic of one message command */
+class CMessageStats
+{
+public:
+    uint64_t nMessages;
+    uint64_t nBytes;
+    // Time spent in ProcessMessage, for received messages only
+    int64_t nTimeUsec;
+    uint64_t vLatency[MESSAGE_LATENCY_BUCKETS];
+
+    CMessageStats() : nMessages(0), nBytes(0), nTimeUsec(0)
+    {
+        for (unsigned int i = 0; i < MESSAGE_LATENCY_BUCKETS; i++)
+            vLatency[i] = 0;
+    }
+
+    void Add(uint64_t nBytesIn)
+    {
+        nMessages++;
+        nBytes += nBytesIn;
+    }
+
+    void AddTimed(uint64_t nBytesIn, int64_t nUsec);
+
+    // Upper bound of a histogram bucket in microseconds, 0 for the last one
+    static int64_t LatencyBucketLimit(unsigned int nBucket);
+};
+
+typedef std::map<std::string, CMessageStats> CMessageStatsMap;
+
 class CNodeStats
 {
 public:
@@ -142,10 +209,14 @@ public:
     int nStartingHeight;
     uint64_t nSendBytes;
     uint64_t nRecvBytes;
+    uint64_t nAddrProcessed;
+    uint64_t nAddrRateLimited;
     bool fSyncNode;
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    CMessageStatsMap mapSendStats;
+    CMessageStatsMap mapRecvStats;
 };
 
 
@@ -169,6 +240,9 @@ public:
         nDataPos = 0;
     }
 
+    // Hands vRecv's buffer back to the receive buffer pool
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -184,6 +258,11 @@ public:
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    // The part of vRecv still to be received, for the socket to read into
+    // directly, and the accounting once it did
+    char* GetDataBuffer(unsigned int& nSize);
+    void ReceivedData(unsigned int nBytes);
 };
 
 
@@ -197,19 +276,37 @@ public:
     // socket
     uint64_t nServices;
     SOCKET hSocket;
-    CDataStream ssSend;
+    CPlainDataStream ssSend;
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSharedMessage> vSendMsg;
     CCriticalSection cs_vSend;
 
+    // Socket readiness, only touched by ThreadSocketHandler. With epoll or
+    // kqueue these stay set until a recv or send would block; with select()
+    // they are recomputed on every pass.
+    bool fSocketRegistered;
+    bool fRecvReady;
+    bool fSendReady;
+
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    // Whether the node is waiting in the message handler's ready queue, and
+    // whether a message handler thread is working on it. Only one thread
+    // handles a node at a time, which keeps its messages in order. Guarded
+    // by the queue's lock.
+    bool fMessageHandlerQueued;
+    bool fMessageHandlerBusy;
     uint64_t nRecvBytes;
     int nRecvVersion;
 
+    // Traffic per command
+    CCriticalSection cs_msgStats;
+    CMessageStatsMap mapSendStats;
+    CMessageStatsMap mapRecvStats;
+
     int64_t nLastSend;
     int64_t nLastRecv;
     int64_t nLastSendEmpty;
@@ -258,13 +355,14 @@ public:
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
-    mruset<CAddress> setAddrKnown;
+    mruset<CAddress, CServiceHasher> setAddrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
+    int64_t nNextInvSend;
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
 
@@ -273,8 +371,23 @@ public:
     int64_t nPingUsecStart;
     int64_t nPingUsecTime;
     bool fPingQueued;
-
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+    // When our version message went out, in microseconds, to time the handshake
+    int64_t nTimeVersionSent;
+
+    // Addresses this peer's addr messages may still have processed, refilled at
+    // MAX_ADDR_RATE_PER_SECOND since nAddrTokenTimestamp (microseconds); only
+    // the thread handling the peer's messages touches them
+    double dAddrTokenBucket;
+    int64_t nAddrTokenTimestamp;
+    uint64_t nAddrProcessed;
+    uint64_t nAddrRateLimited;
+
+    // When the peer last gave us a block or a transaction we did not have,
+    // which protects it from inbound eviction
+    int64_t nLastBlockTime;
+    int64_t nLastTXTime;
+
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000), filterInventoryKnown(INVENTORY_KNOWN_SIZE, 0.000001)
     {
         nServices = 0;
         hSocket = hSocketIn;
@@ -298,6 +411,11 @@ public:
         nRefCount = 0;
         nSendSize = 0;
         nSendOffset = 0;
+        fSocketRegistered = false;
+        fMessageHandlerQueued = false;
+        fMessageHandlerBusy = false;
+        fRecvReady = false;
+        fSendReady = false;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
@@ -305,12 +423,19 @@ public:
         fStartSync = false;
         fGetAddr = false;
         fRelayTxes = false;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
+        nNextInvSend = 0;
         pfilter = new CBloomFilter();
         nPingNonceSent = 0;
         nPingUsecStart = 0;
         nPingUsecTime = 0;
         fPingQueued = false;
+        nLastBlockTime = 0;
+        nLastTXTime = 0;
+        nTimeVersionSent = 0;
+        dAddrTokenBucket = 1.0; // room for the self-announcement of an inbound peer
+        nAddrTokenTimestamp = GetTimeMicros();
+        nAddrProcessed = 0;
+        nAddrRateLimited = 0;
 
         {
             LOCK(cs_nLastNodeId);
@@ -343,6 +468,20 @@ private:
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
 
+    // Upload budget (-maxuploadtarget) and pacing (-maxuploadrate), both
+    // protected by cs_totalBytesSent
+    // Traffic per command since startup, including disconnected peers
+    static CCriticalSection cs_totalMsgStats;
+    static CMessageStatsMap mapTotalSendStats;
+    static CMessageStatsMap mapTotalRecvStats;
+
+    static uint64_t nMaxOutboundLimit;
+    static uint64_t nMaxOutboundTotalBytesSentInCycle;
+    static uint64_t nMaxOutboundCycleStartTime;
+    static uint64_t nMaxUploadRate;
+    static int64_t nUploadTokens;
+    static int64_t nUploadTokensTime;
+
     CNode(const CNode&);
     void operator=(const CNode&);
 
@@ -370,6 +509,23 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    // Where the socket can receive the rest of a message whose header is
+    // in without copying it through ReceiveMsgBytes; NULL when the next
+    // bytes belong to a header.
+    // requires LOCK(cs_vRecvMsg)
+    char* GetRecvBuffer(unsigned int& nSize)
+    {
+        if (vRecvMsg.empty() || vRecvMsg.back().complete())
+            return NULL;
+        return vRecvMsg.back().GetDataBuffer(nSize);
+    }
+
+    // requires LOCK(cs_vRecvMsg)
+    void ReceivedMsgBuffer(unsigned int nBytes)
+    {
+        vRecvMsg.back().ReceivedData(nBytes);
+    }
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -391,8 +547,11 @@ public:
 
 
 
+    // Addresses are pushed to a node while other nodes' messages are being
+    // processed, so they share the inventory lock
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_inventory);
         setAddrKnown.insert(addr);
     }
 
@@ -401,16 +560,23 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_inventory);
         if (addr.IsValid() && !setAddrKnown.count(addr))
             vAddrToSend.push_back(addr);
     }
 
 
+    bool HasInventoryKnown(const CInv& inv)
+    {
+        LOCK(cs_inventory);
+        return filterInventoryKnown.contains(inv.hash);
+    }
+
     void AddInventoryKnown(const CInv& inv)
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
@@ -418,11 +584,19 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash))
                 vInventoryToSend.push_back(inv);
         }
     }
 
+    void PushInventory(const std::vector<CInv>& vInv)
+    {
+        LOCK(cs_inventory);
+        BOOST_FOREACH(const CInv& inv, vInv)
+            if (!filterInventoryKnown.contains(inv.hash))
+                vInventoryToSend.push_back(inv);
+    }
+
     void AskFor(const CInv& inv)
     {
         if (mapAskFor.size() > MAPASKFOR_MAX_SZ)
@@ -431,7 +605,7 @@ public:
         // We're using mapAskFor as a priority queue,
         // the key is the earliest time the request can be sent
         int64_t nRequestTime;
-        limitedmap<CInv, int64_t>::const_iterator it = mapAlreadyAskedFor.find(inv);
+        limitedmap<CInv, int64_t, CInvHasher>::const_iterator it = mapAlreadyAskedFor.find(inv);
         if (it != mapAlreadyAskedFor.end())
             nRequestTime = it->second;
         else
@@ -493,28 +667,54 @@ public:
         if (ssSend.size() == 0)
             return;
 
-        // Set the size
-        unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-        memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+        unsigned int nSize = FinalizeMessage(ssSend);
+        LogPrint("net", "(%d bytes)\n", nSize);
 
-        // Set the checksum
-        uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+        // Hand the buffer over rather than copying it
+        boost::shared_ptr<CPlainSerializeData> pmsg(new CPlainSerializeData());
+        ssSend.swap(*pmsg);
+        QueueMessage(pmsg);
 
-        LogPrint("net", "(%d bytes)\n", nSize);
+        LEAVE_CRITICAL_SECTION(cs_vSend);
+    }
+
+    // Fill in the size and checksum of a message whose header was written
+    // with a zero size. Returns the payload size.
+    static unsigned int FinalizeMessage(CPlainDataStream& ss);
+
+    // Build a finished message once, for PushSharedMessage to many peers
+    static CSharedMessage MakeSharedMessage(const char* pszCommand, const char* pch, size_t nSize);
+
+    // Serialize an object as a finished message, into a buffer sized for it
+    template<typename T>
+    static CSharedMessage MakeSharedMessage(const char* pszCommand, const T& obj)
+    {
+        boost::shared_ptr<CPlainSerializeData> pmsg(new CPlainSerializeData());
+        CPlainDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss.reserve(CMessageHeader::HEADER_SIZE + ss.GetSerializeSize(obj));
+        ss << CMessageHeader(pszCommand, 0) << obj;
+        FinalizeMessage(ss);
+        ss.swap(*pmsg);
+        return pmsg;
+    }
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+    // requires LOCK(cs_vSend)
+    void QueueMessage(const CSharedMessage& pmsg)
+    {
+        RecordMessageSent(*pmsg);
+        vSendMsg.push_back(pmsg);
+        nSendSize += pmsg->size();
 
         // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
+        if (vSendMsg.size() == 1)
             SocketSendData(this);
+    }
 
-        LEAVE_CRITICAL_SECTION(cs_vSend);
+    void PushSharedMessage(const CSharedMessage& pmsg)
+    {
+        LOCK(cs_vSend);
+        LogPrint("net", "sending: shared message (%d bytes)\n", pmsg->size() - CMessageHeader::HEADER_SIZE);
+        QueueMessage(pmsg);
     }
 
     void PushVersion();
@@ -534,6 +734,23 @@ public:
         }
     }
 
+    // Push a message whose payload is serialized already, such as a block
+    // read straight from its block file
+    void PushRawMessage(const char* pszCommand, const char* pch, size_t nSize)
+    {
+        try
+        {
+            BeginMessage(pszCommand);
+            ssSend.write(pch, nSize);
+            EndMessage();
+        }
+        catch (...)
+        {
+            AbortMessage();
+            throw;
+        }
+    }
+
     template<typename T1>
     void PushMessage(const char* pszCommand, const T1& a1)
     {
@@ -703,6 +920,8 @@ public:
     static bool IsBanned(CNetAddr ip);
     static bool Ban(const CNetAddr &ip);
     void copyStats(CNodeStats &stats);
+    // Approximate heap memory held for this peer
+    size_t DynamicMemoryUsage();
 
     // Network stats
     static void RecordBytesRecv(uint64_t bytes);
@@ -710,13 +929,43 @@ public:
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    // Count a finished message by the command in its header
+    void RecordMessageSent(const CPlainSerializeData& msg);
+    // Count a received message with the time ProcessMessage took on it
+    void RecordMessageProcessed(const std::string& strCommand, uint64_t nBytes, int64_t nUsec);
+    static void GetTotalMessageStats(CMessageStatsMap& mapSend, CMessageStatsMap& mapRecv);
+    // Bytes of one command over all peers, without copying the maps
+    static void GetTotalMessageBytes(const std::string& strCommand, uint64_t& nSent, uint64_t& nRecv);
+
+    // Bytes per MAX_UPLOAD_TARGET_TIMEFRAME, 0 for no target
+    static void SetMaxOutboundTarget(uint64_t limit);
+    static uint64_t GetMaxOutboundTarget();
+    // Whether the target is used up; with fHistoricalBlockServingLimit,
+    // whether only the part kept for relaying new blocks is left
+    static bool OutboundTargetReached(bool fHistoricalBlockServingLimit);
+    static uint64_t GetOutboundTargetBytesLeft();
+    static uint64_t GetMaxOutboundTimeLeftInCycle();
+
+    // Bytes per second over all peers, 0 for no limit
+    static void SetMaxUploadRate(uint64_t rate);
+    static uint64_t GetMaxUploadRate();
+    // How many bytes may be sent right now
+    static size_t GetUploadAllowance();
+    static bool UploadThrottled() { return GetUploadAllowance() == 0; }
 };
 
 
 
 class CTransaction;
+/** Keep a finished message for peers that request inv in the next 15 minutes */
+void AddRelayMessage(const CInv& inv, const CSharedMessage& pmsg);
 void RelayTransaction(const CTransaction& tx, const uint256& hash);
 void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss);
+/** Relay several transactions, queueing their announcements to each peer at once */
+void RelayTransactions(const std::vector<const CTransaction*>& vpTx);
+/** Approximate heap memory held for all peers and by the relay cache */
+size_t GetPeersMemoryUsage();
 
 /** Access to the (IP) address database (peers.dat) */
 class CAddrDB
@@ -32,6 +32,14 @@ bool fNameLookup = false;
 
 static const unsigned char pchIPv4[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
 
+// Names resolved by getaddrinfo are remembered for DNS_CACHE_TTL seconds,
+// as it does not tell the TTL of the records, so -addnode and the like do
+// not wait for the resolver on every retry
+static const int64_t DNS_CACHE_TTL = 10 * 60;
+static const size_t DNS_CACHE_MAX_SIZE = 1000;
+static std::map<std::string, std::pair<int64_t, std::vector<CNetAddr> > > mapLookupCache;
+static CCriticalSection cs_mapLookupCache;
+
 enum Network ParseNetwork(std::string net) {
     boost::to_lower(net);
     if (net == "ipv4") return NET_IPV4;
@@ -73,6 +81,25 @@ bool static LookupIntern(const char *pszName, std::vector<CNetAddr>& vIP, unsign
         }
     }
 
+    std::string strName(pszName);
+    boost::to_lower(strName);
+    if (fAllowLookup)
+    {
+        LOCK(cs_mapLookupCache);
+        std::map<std::string, std::pair<int64_t, std::vector<CNetAddr> > >::iterator it = mapLookupCache.find(strName);
+        if (it != mapLookupCache.end())
+        {
+            if (it->second.first > GetTime())
+            {
+                const std::vector<CNetAddr>& vCached = it->second.second;
+                size_t nSize = nMaxSolutions == 0 ? vCached.size() : std::min((size_t)nMaxSolutions, vCached.size());
+                vIP.assign(vCached.begin(), vCached.begin() + nSize);
+                return true;
+            }
+            mapLookupCache.erase(it);
+        }
+    }
+
     struct addrinfo aiHint;
     memset(&aiHint, 0, sizeof(struct addrinfo));
 
@@ -89,8 +116,9 @@ bool static LookupIntern(const char *pszName, std::vector<CNetAddr>& vIP, unsign
     if (nErr)
         return false;
 
+    // All of them go in the cache; vIP gets the first nMaxSolutions
     struct addrinfo *aiTrav = aiRes;
-    while (aiTrav != NULL && (nMaxSolutions == 0 || vIP.size() < nMaxSolutions))
+    while (aiTrav != NULL)
     {
         if (aiTrav->ai_family == AF_INET)
         {
@@ -109,6 +137,16 @@ bool static LookupIntern(const char *pszName, std::vector<CNetAddr>& vIP, unsign
 
     freeaddrinfo(aiRes);
 
+    if (fAllowLookup && !vIP.empty())
+    {
+        LOCK(cs_mapLookupCache);
+        if (mapLookupCache.size() >= DNS_CACHE_MAX_SIZE)
+            mapLookupCache.clear();
+        mapLookupCache[strName] = make_pair(GetTime() + DNS_CACHE_TTL, vIP);
+    }
+    if (nMaxSolutions > 0 && vIP.size() > nMaxSolutions)
+        vIP.resize(nMaxSolutions);
+
     return (vIP.size() > 0);
 }
 
@@ -538,6 +576,38 @@ bool ConnectSocketByName(CService &addr, SOCKET& hSocketRet, const char *pszDest
     return true;
 }
 
+bool CreateSocketPair(SOCKET& hSocket1Ret, SOCKET& hSocket2Ret)
+{
+#ifdef WIN32
+    return false;
+#else
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == SOCKET_ERROR)
+    {
+        LogPrintf("socketpair() failed: %s\n", NetworkErrorString(errno));
+        return false;
+    }
+    SOCKET hSockets[2] = { (SOCKET)fds[0], (SOCKET)fds[1] };
+    for (int i = 0; i < 2; i++)
+    {
+#ifdef SO_NOSIGPIPE
+        int set = 1;
+        setsockopt(hSockets[i], SOL_SOCKET, SO_NOSIGPIPE, (void*)&set, sizeof(int));
+#endif
+        if (fcntl(hSockets[i], F_SETFL, O_NONBLOCK) == SOCKET_ERROR)
+        {
+            LogPrintf("CreateSocketPair() : fcntl non-blocking setting failed, error %s\n", NetworkErrorString(errno));
+            closesocket(hSockets[0]);
+            closesocket(hSockets[1]);
+            return false;
+        }
+    }
+    hSocket1Ret = hSockets[0];
+    hSocket2Ret = hSockets[1];
+    return true;
+#endif
+}
+
 void CNetAddr::Init()
 {
     memset(ip, 0, sizeof(ip));
@@ -1040,6 +1110,15 @@ unsigned short CService::GetPort() const
     return port;
 }
 
+CServiceHasher::CServiceHasher() : salt(GetRandHash()) {}
+
+size_t CServiceHasher::operator()(const CService& addr) const
+{
+    uint256 key;
+    memcpy(key.begin(), addr.ip, sizeof(addr.ip));
+    return key.GetHash(salt, addr.port);
+}
+
 bool operator==(const CService& a, const CService& b)
 {
     return (CNetAddr)a == (CNetAddr)b && a.port == b.port;
@@ -11,6 +11,7 @@
 
 #include "compat.h"
 #include "serialize.h"
+#include "uint256.h"
 
 #include <stdint.h>
 #include <string>
@@ -113,6 +114,7 @@ class CService : public CNetAddr
         friend bool operator==(const CService& a, const CService& b);
         friend bool operator!=(const CService& a, const CService& b);
         friend bool operator<(const CService& a, const CService& b);
+        friend class CServiceHasher;
         std::vector<unsigned char> GetKey() const;
         std::string ToString() const;
         std::string ToStringPort() const;
@@ -133,6 +135,18 @@ class CService : public CNetAddr
             )
 };
 
+/** Salted hash of a CService for hash tables, so that peers cannot pick
+    addresses that all land in one bucket */
+class CServiceHasher
+{
+    private:
+        uint256 salt;
+
+    public:
+        CServiceHasher();
+        size_t operator()(const CService& addr) const;
+};
+
 typedef std::pair<CService, int> proxyType;
 
 enum Network ParseNetwork(std::string net);
@@ -149,6 +163,9 @@ bool Lookup(const char *pszName, std::vector<CService>& vAddr, int portDefault =
 bool LookupNumeric(const char *pszName, CService& addr, int portDefault = 0);
 bool ConnectSocket(const CService &addr, SOCKET& hSocketRet, int nTimeout = nConnectTimeout);
 bool ConnectSocketByName(CService &addr, SOCKET& hSocketRet, const char *pszDest, int portDefault = 0, int nTimeout = nConnectTimeout);
+/** Two connected, non-blocking local stream sockets, as an in-memory
+ *  transport for AddConnectedNode. Not supported on Windows. */
+bool CreateSocketPair(SOCKET& hSocket1Ret, SOCKET& hSocket2Ret);
 /** Return readable error string for a network error code */
 std::string NetworkErrorString(int err);
 
@@ -0,0 +1,206 @@
+// Copyright (c) 2014 The Digitalcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_POWHASH_H
+#define BITCOIN_POWHASH_H
+
+#include "hash.h"
+#include "hashx11.h"
+#include "scrypt.h"
+#include "sha256.h"
+#include "uint256.h"
+
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+
+enum {
+    ALGO_SHA256D = 0,
+    ALGO_SCRYPT  = 1,
+    ALGO_X11     = 2,
+    NUM_ALGOS };
+
+/** The proof-of-work hash of one algorithm, picked at compile time.
+ *
+ *  Every specialization has the same interface, so code templated on the
+ *  algorithm hashes without switching on it:
+ *    static uint256 Hash(const void* pheader)
+ *        hash one serialized 80-byte header
+ *    static void HashHeaders(const unsigned char* pheaders, unsigned int nCount, uint256* phash)
+ *        hash nCount consecutive 80-byte headers
+ *    void SetHeader(const void* pheader)
+ *        precompute the part of a header's hash that does not depend on nNonce
+ *    void HashNonces(const unsigned int* pnNonce, unsigned int nCount, uint256* phash)
+ *        hash SetHeader's header with each of nCount nonces
+ *    unsigned int GetBatch() const
+ *        nonces per HashNonces call that keep the implementation busy
+ *
+ *  An instance holds its header midstate and any scratch memory, so each
+ *  miner thread has its own. CBlockHeader::GetPoWHash(algo) is the one place
+ *  that maps a runtime algo to its hasher.
+ */
+template<int algo> class CPowHasher;
+
+template<>
+class CPowHasher<ALGO_SHA256D>
+{
+public:
+    static const int ALGO = ALGO_SHA256D;
+
+    CPowHasher() {}
+
+    static uint256 Hash(const void* pheader)
+    {
+        const unsigned char* p = (const unsigned char*)pheader;
+        return ::Hash(p, p + 80);
+    }
+
+    static void HashHeaders(const unsigned char* pheaders, unsigned int nCount, uint256* phash)
+    {
+        for (unsigned int i = 0; i < nCount; i++)
+            phash[i] = Hash(pheaders + 80 * i);
+    }
+
+    // The first 64 bytes fill one SHA-256 block; keep its state and the
+    // 12 bytes before nNonce
+    void SetHeader(const void* pheader)
+    {
+        const unsigned char* p = (const unsigned char*)pheader;
+        midstate.Reset().Write(p, 64);
+        memcpy(tail, p + 64, 12);
+    }
+
+    void HashNonces(const unsigned int* pnNonce, unsigned int nCount, uint256* phash) const
+    {
+        unsigned char block[16];
+        memcpy(block, tail, 12);
+        for (unsigned int i = 0; i < nCount; i++)
+        {
+            memcpy(block + 12, &pnNonce[i], 4);
+            uint256 hash1;
+            CSHA256(midstate).Write(block, 16).Finalize((unsigned char*)&hash1);
+            CSHA256().Write((unsigned char*)&hash1, sizeof(hash1)).Finalize((unsigned char*)&phash[i]);
+        }
+    }
+
+    unsigned int GetBatch() const { return 64; }
+
+private:
+    CSHA256 midstate;
+    unsigned char tail[12];
+};
+
+// Widest interleaving scrypt_best_ways() can ask for
+static const int SCRYPT_MAX_WAYS = 8;
+
+template<>
+class CPowHasher<ALGO_SCRYPT>
+{
+public:
+    static const int ALGO = ALGO_SCRYPT;
+
+    // Allocates a scratchpad for as many hashes as the CPU runs at once; if
+    // that fails, hashes one nonce at a time on the stack
+    CPowHasher() : nWays(std::min(scrypt_best_ways(), SCRYPT_MAX_WAYS)), pscratchpad(scrypt_buffer_alloc(nWays))
+    {
+        if (!pscratchpad)
+            nWays = 1;
+        memset(header, 0, sizeof(header));
+    }
+    ~CPowHasher()
+    {
+        if (pscratchpad)
+            scrypt_buffer_free(pscratchpad);
+    }
+
+    static uint256 Hash(const void* pheader)
+    {
+        uint256 hash;
+        // Caution: scrypt_1024_1_1_256 assumes fixed length of 80 bytes
+        scrypt_1024_1_1_256((const char*)pheader, (char*)&hash);
+        return hash;
+    }
+
+    static void HashHeaders(const unsigned char* pheaders, unsigned int nCount, uint256* phash)
+    {
+        for (unsigned int i = 0; i < nCount; i++)
+            phash[i] = Hash(pheaders + 80 * i);
+    }
+
+    // scrypt has no midstate worth keeping: PBKDF2 salts with the whole header
+    void SetHeader(const void* pheader)
+    {
+        memcpy(header, pheader, 76);
+    }
+
+    void HashNonces(const unsigned int* pnNonce, unsigned int nCount, uint256* phash)
+    {
+        char pheaders[SCRYPT_MAX_WAYS * 80];
+        while (nCount > 0)
+        {
+            unsigned int nPass = std::min(nCount, (unsigned int)nWays);
+            for (unsigned int i = 0; i < nPass; i++)
+            {
+                memcpy(pheaders + 80 * i, header, 76);
+                memcpy(pheaders + 80 * i + 76, &pnNonce[i], 4);
+            }
+            if (pscratchpad)
+                scrypt_1024_1_1_256_sp_multi(nPass, pheaders, (char*)phash, pscratchpad);
+            else
+                scrypt_1024_1_1_256(pheaders, (char*)phash);
+            pnNonce += nPass;
+            phash += nPass;
+            nCount -= nPass;
+        }
+    }
+
+    unsigned int GetBatch() const { return nWays; }
+
+private:
+    int nWays;
+    char* pscratchpad;
+    unsigned char header[76];
+
+    CPowHasher(const CPowHasher&);
+    CPowHasher& operator=(const CPowHasher&);
+};
+
+template<>
+class CPowHasher<ALGO_X11>
+{
+public:
+    static const int ALGO = ALGO_X11;
+
+    CPowHasher() {}
+
+    static uint256 Hash(const void* pheader)
+    {
+        uint256 hash;
+        X11Hash(pheader, 80, &hash);
+        return hash;
+    }
+
+    static void HashHeaders(const unsigned char* pheaders, unsigned int nCount, uint256* phash)
+    {
+        X11HashHeaders(pheaders, nCount, phash);
+    }
+
+    void SetHeader(const void* pheader)
+    {
+        X11PrepareHeader(mid, pheader);
+    }
+
+    void HashNonces(const unsigned int* pnNonce, unsigned int nCount, uint256* phash) const
+    {
+        X11HashNonces(mid, pnNonce, nCount, phash);
+    }
+
+    // A run of nonces lets the engine hash them side by side from one midstate
+    unsigned int GetBatch() const { return 64; }
+
+private:
+    CX11HeaderMidstate mid;
+};
+
+#endif // BITCOIN_POWHASH_H
@@ -0,0 +1,340 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_PREVECTOR_H
+#define BITCOIN_PREVECTOR_H
+
+#include "arena.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <iterator>
+
+#include <boost/type_traits/is_integral.hpp>
+
+#pragma pack(push, 1)
+/** A replacement for std::vector<T> which stores up to N elements in the
+ *  object itself, and only allocates memory for more.
+ *
+ *  Storage is either direct, in the object, or indirect, allocated with
+ *  ArenaAllocate so that it comes from the arena of a block being
+ *  deserialized like the other parts of its transactions. The size field
+ *  holds the number of elements when direct, and N + 1 more than it when
+ *  indirect, so no separate flag is needed.
+ *
+ *  Only for types copied with memcpy and needing no destructor, such as
+ *  unsigned char. Iterators are plain pointers, invalidated as those of
+ *  std::vector are; unlike std::vector, erasing or inserting elements of
+ *  the same prevector into itself is not supported.
+ */
+template<unsigned int N, typename T>
+class prevector
+{
+public:
+    typedef uint32_t size_type;
+    typedef int32_t difference_type;
+    typedef T value_type;
+    typedef value_type& reference;
+    typedef const value_type& const_reference;
+    typedef value_type* pointer;
+    typedef const value_type* const_pointer;
+    typedef T* iterator;
+    typedef const T* const_iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+private:
+    size_type _size;
+    union direct_or_indirect {
+        char direct[sizeof(T) * N];
+        struct {
+            size_type capacity;
+            char* indirect;
+        } heap;
+    } _union;
+
+    T* direct_ptr(difference_type pos) { return reinterpret_cast<T*>(_union.direct) + pos; }
+    const T* direct_ptr(difference_type pos) const { return reinterpret_cast<const T*>(_union.direct) + pos; }
+    T* indirect_ptr(difference_type pos) { return reinterpret_cast<T*>(_union.heap.indirect) + pos; }
+    const T* indirect_ptr(difference_type pos) const { return reinterpret_cast<const T*>(_union.heap.indirect) + pos; }
+    bool is_direct() const { return _size <= N; }
+
+    void change_capacity(size_type new_capacity)
+    {
+        if (new_capacity <= N) {
+            if (!is_direct()) {
+                T* indirect = indirect_ptr(0);
+                char* pold = _union.heap.indirect;
+                memcpy(direct_ptr(0), indirect, size() * sizeof(T));
+                ArenaFree(pold);
+                _size -= N + 1;
+            }
+        } else {
+            if (!is_direct()) {
+                char* pnew = static_cast<char*>(ArenaAllocate(((size_t)sizeof(T)) * new_capacity));
+                memcpy(pnew, _union.heap.indirect, size() * sizeof(T));
+                ArenaFree(_union.heap.indirect);
+                _union.heap.indirect = pnew;
+                _union.heap.capacity = new_capacity;
+            } else {
+                char* pnew = static_cast<char*>(ArenaAllocate(((size_t)sizeof(T)) * new_capacity));
+                memcpy(pnew, _union.direct, size() * sizeof(T));
+                _union.heap.indirect = pnew;
+                _union.heap.capacity = new_capacity;
+                _size += N + 1;
+            }
+        }
+    }
+
+    T* item_ptr(difference_type pos) { return is_direct() ? direct_ptr(pos) : indirect_ptr(pos); }
+    const T* item_ptr(difference_type pos) const { return is_direct() ? direct_ptr(pos) : indirect_ptr(pos); }
+
+    // Room for at least new_size elements, growing geometrically
+    void grow(size_type new_size)
+    {
+        if (capacity() < new_size)
+            change_capacity(std::max(new_size, size() + (size() >> 1)));
+    }
+
+    template<typename InputIterator>
+    void assign_dispatch(InputIterator first, InputIterator last, const boost::false_type&)
+    {
+        size_type n = std::distance(first, last);
+        clear();
+        if (capacity() < n)
+            change_capacity(n);
+        T* p = item_ptr(0);
+        for (; first != last; ++first)
+            *p++ = *first;
+        _size += n;
+    }
+
+    template<typename Integer>
+    void assign_dispatch(Integer n, Integer value, const boost::true_type&)
+    {
+        assign((size_type)n, (T)value);
+    }
+
+    template<typename InputIterator>
+    void insert_dispatch(iterator pos, InputIterator first, InputIterator last, const boost::false_type&)
+    {
+        size_type p = pos - item_ptr(0);
+        difference_type count = std::distance(first, last);
+        if (count == 0)
+            return;
+        grow(size() + count);
+        T* ptr = item_ptr(p);
+        memmove(ptr + count, ptr, (size() - p) * sizeof(T));
+        _size += count;
+        for (; first != last; ++first)
+            *ptr++ = *first;
+    }
+
+    template<typename Integer>
+    void insert_dispatch(iterator pos, Integer count, Integer value, const boost::true_type&)
+    {
+        insert(pos, (size_type)count, (T)value);
+    }
+
+public:
+    prevector() : _size(0) {}
+
+    explicit prevector(size_type n) : _size(0)
+    {
+        resize(n);
+    }
+
+    prevector(size_type n, const T& val) : _size(0)
+    {
+        assign(n, val);
+    }
+
+    template<typename InputIterator>
+    prevector(InputIterator first, InputIterator last) : _size(0)
+    {
+        assign_dispatch(first, last, boost::is_integral<InputIterator>());
+    }
+
+    prevector(const prevector& other) : _size(0)
+    {
+        change_capacity(other.size());
+        memcpy(item_ptr(0), other.item_ptr(0), other.size() * sizeof(T));
+        _size += other.size();
+    }
+
+    ~prevector()
+    {
+        if (!is_direct())
+            ArenaFree(_union.heap.indirect);
+    }
+
+    prevector& operator=(const prevector& other)
+    {
+        if (&other == this)
+            return *this;
+        assign(other.begin(), other.end());
+        return *this;
+    }
+
+    void assign(size_type n, const T& val)
+    {
+        clear();
+        if (capacity() < n)
+            change_capacity(n);
+        T* p = item_ptr(0);
+        for (size_type i = 0; i < n; i++)
+            p[i] = val;
+        _size += n;
+    }
+
+    template<typename InputIterator>
+    void assign(InputIterator first, InputIterator last)
+    {
+        assign_dispatch(first, last, boost::is_integral<InputIterator>());
+    }
+
+    size_type size() const { return is_direct() ? _size : _size - N - 1; }
+    bool empty() const { return size() == 0; }
+    size_type capacity() const { return is_direct() ? N : _union.heap.capacity; }
+    size_type max_size() const { return 0x7FFFFFFF / sizeof(T); }
+
+    iterator begin() { return item_ptr(0); }
+    const_iterator begin() const { return item_ptr(0); }
+    iterator end() { return item_ptr(size()); }
+    const_iterator end() const { return item_ptr(size()); }
+    reverse_iterator rbegin() { return reverse_iterator(end()); }
+    const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+    reverse_iterator rend() { return reverse_iterator(begin()); }
+    const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+    T& operator[](size_type pos) { return *item_ptr(pos); }
+    const T& operator[](size_type pos) const { return *item_ptr(pos); }
+    T& front() { return *item_ptr(0); }
+    const T& front() const { return *item_ptr(0); }
+    T& back() { return *item_ptr(size() - 1); }
+    const T& back() const { return *item_ptr(size() - 1); }
+    T* data() { return item_ptr(0); }
+    const T* data() const { return item_ptr(0); }
+
+    void reserve(size_type new_capacity)
+    {
+        if (new_capacity > capacity())
+            change_capacity(new_capacity);
+    }
+
+    void shrink_to_fit()
+    {
+        change_capacity(size());
+    }
+
+    void clear()
+    {
+        resize(0);
+    }
+
+    void resize(size_type new_size, const T& value = T())
+    {
+        size_type cur_size = size();
+        if (new_size > cur_size) {
+            grow(new_size);
+            T* p = item_ptr(0);
+            for (size_type i = cur_size; i < new_size; i++)
+                p[i] = value;
+        }
+        _size += new_size - cur_size;
+    }
+
+    iterator insert(iterator pos, const T& value)
+    {
+        size_type p = pos - item_ptr(0);
+        T copy = value;
+        grow(size() + 1);
+        T* ptr = item_ptr(p);
+        memmove(ptr + 1, ptr, (size() - p) * sizeof(T));
+        _size++;
+        *ptr = copy;
+        return ptr;
+    }
+
+    void insert(iterator pos, size_type count, const T& value)
+    {
+        size_type p = pos - item_ptr(0);
+        T copy = value;
+        grow(size() + count);
+        T* ptr = item_ptr(p);
+        memmove(ptr + count, ptr, (size() - p) * sizeof(T));
+        _size += count;
+        for (size_type i = 0; i < count; i++)
+            ptr[i] = copy;
+    }
+
+    template<typename InputIterator>
+    void insert(iterator pos, InputIterator first, InputIterator last)
+    {
+        insert_dispatch(pos, first, last, boost::is_integral<InputIterator>());
+    }
+
+    iterator erase(iterator pos)
+    {
+        return erase(pos, pos + 1);
+    }
+
+    iterator erase(iterator first, iterator last)
+    {
+        iterator p = first;
+        char* endp = (char*)end();
+        memmove(&(*first), &(*last), endp - ((char*)(&(*last))));
+        _size -= last - p;
+        return first;
+    }
+
+    void push_back(const T& value)
+    {
+        T copy = value;
+        grow(size() + 1);
+        *item_ptr(size()) = copy;
+        _size++;
+    }
+
+    void pop_back()
+    {
+        _size--;
+    }
+
+    void swap(prevector& other)
+    {
+        std::swap(_union, other._union);
+        std::swap(_size, other._size);
+    }
+
+    bool operator==(const prevector& other) const
+    {
+        if (other.size() != size())
+            return false;
+        return size() == 0 || memcmp(item_ptr(0), other.item_ptr(0), size() * sizeof(T)) == 0;
+    }
+
+    bool operator!=(const prevector& other) const
+    {
+        return !(*this == other);
+    }
+
+    bool operator<(const prevector& other) const
+    {
+        return std::lexicographical_compare(begin(), end(), other.begin(), other.end());
+    }
+
+    // Bytes allocated on the heap (or in an arena), not counting the header
+    size_t allocated_memory() const
+    {
+        if (is_direct())
+            return 0;
+        return ((size_t)sizeof(T)) * _union.heap.capacity;
+    }
+};
+#pragma pack(pop)
+
+#endif // BITCOIN_PREVECTOR_H
@@ -0,0 +1,75 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "proptrace.h"
+
+#include "sync.h"
+#include "util.h"
+
+using namespace std;
+
+bool fPropTrace = false;
+
+static CCriticalSection cs_proptrace;
+// Written in order from nPropTraceNext, wrapping around once full
+static vector<CPropTraceEntry> vPropTrace;
+static size_t nPropTraceNext = 0;
+static bool fPropTraceFull = false;
+
+static const char* const pszPropTraceEvents[PROPTRACE_EVENTS] = {
+    "inv", "request", "getdata", "receive", "validate", "connect", "relay"
+};
+
+void SetPropTraceSize(unsigned int nEntries)
+{
+    LOCK(cs_proptrace);
+    vector<CPropTraceEntry>(nEntries).swap(vPropTrace);
+    nPropTraceNext = 0;
+    fPropTraceFull = false;
+    fPropTrace = nEntries > 0;
+}
+
+void PropTraceRecord(PropTraceEvent event, int nType, const uint256& hash, int nPeer)
+{
+    int64_t nNow = GetTimeMicros();
+    LOCK(cs_proptrace);
+    if (vPropTrace.empty())
+        return;
+    CPropTraceEntry& entry = vPropTrace[nPropTraceNext];
+    entry.nTimeMicros = nNow;
+    entry.hash = hash;
+    entry.nPeer = nPeer;
+    entry.nType = nType;
+    entry.nEvent = event;
+    if (++nPropTraceNext == vPropTrace.size()) {
+        nPropTraceNext = 0;
+        fPropTraceFull = true;
+    }
+}
+
+vector<CPropTraceEntry> GetPropTrace(const uint256& hash)
+{
+    vector<CPropTraceEntry> vRet;
+    LOCK(cs_proptrace);
+    size_t nEntries = fPropTraceFull ? vPropTrace.size() : nPropTraceNext;
+    size_t nFirst = fPropTraceFull ? nPropTraceNext : 0;
+    for (size_t i = 0; i < nEntries; i++) {
+        const CPropTraceEntry& entry = vPropTrace[(nFirst + i) % vPropTrace.size()];
+        if (hash == 0 || entry.hash == hash)
+            vRet.push_back(entry);
+    }
+    return vRet;
+}
+
+void ClearPropTrace()
+{
+    LOCK(cs_proptrace);
+    nPropTraceNext = 0;
+    fPropTraceFull = false;
+}
+
+const char* PropTraceEventName(unsigned int nEvent)
+{
+    return nEvent < PROPTRACE_EVENTS ? pszPropTraceEvents[nEvent] : "unknown";
+}
@@ -0,0 +1,52 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_PROPTRACE_H
+#define BITCOIN_PROPTRACE_H
+
+#include "uint256.h"
+
+#include <stdint.h>
+#include <vector>
+
+/** Propagation tracing: when each block and transaction was announced,
+ *  requested, received, validated, connected and relayed, per peer, kept in
+ *  a ring buffer of the last -proptrace events and returned by
+ *  getpropagationtrace. When disabled, a trace point costs one test of
+ *  fPropTrace.
+ */
+enum PropTraceEvent
+{
+    PROPTRACE_INV = 0,   // a peer announced it
+    PROPTRACE_REQUEST,   // we asked a peer for it
+    PROPTRACE_GETDATA,   // a peer asked us for it
+    PROPTRACE_RECEIVE,   // a peer sent it (for blocks, also as a compact block)
+    PROPTRACE_VALIDATE,  // accepted to the mempool or stored as a valid block
+    PROPTRACE_CONNECT,   // connected to the tip
+    PROPTRACE_RELAY,     // announced to a peer
+    PROPTRACE_EVENTS
+};
+
+struct CPropTraceEntry
+{
+    int64_t nTimeMicros;
+    uint256 hash;
+    int nPeer;           // peer id, -1 for none
+    unsigned char nType; // MSG_TX or MSG_BLOCK
+    unsigned char nEvent;
+};
+
+extern bool fPropTrace;
+
+// Size the ring buffer to nEntries events, 0 to disable tracing; clears it
+void SetPropTraceSize(unsigned int nEntries);
+void PropTraceRecord(PropTraceEvent event, int nType, const uint256& hash, int nPeer);
+// The buffered events oldest first, only those of one hash unless it is 0
+std::vector<CPropTraceEntry> GetPropTrace(const uint256& hash);
+void ClearPropTrace();
+const char* PropTraceEventName(unsigned int nEvent);
+
+#define PROPTRACE(event, type, hash, peer) do { if (fPropTrace) PropTraceRecord(event, type, hash, peer); } while (0)
+
+#endif // BITCOIN_PROPTRACE_H
@@ -62,6 +62,8 @@ class CMessageHeader
 enum
 {
     NODE_NETWORK = (1 << 0),
+    // Serves compact block filters (getcfilters, getcfheaders, getcfcheckpt)
+    NODE_COMPACT_FILTERS = (1 << 6),
 };
 
 /** A CService with information about it as peer */
@@ -116,6 +118,7 @@ class CInv
         )
 
         friend bool operator<(const CInv& a, const CInv& b);
+        friend bool operator==(const CInv& a, const CInv& b);
 
         bool IsKnownType() const;
         const char* GetCommand() const;
@@ -128,6 +131,21 @@ class CInv
         uint256 hash;
 };
 
+/** Salted hash of a CInv for hash tables, so that peers cannot pick
+    inventory that all lands in one bucket */
+class CInvHasher
+{
+private:
+    uint256 salt;
+
+public:
+    CInvHasher();
+
+    size_t operator()(const CInv& inv) const {
+        return inv.hash.GetHash(salt, inv.type);
+    }
+};
+
 enum
 {
     MSG_TX = 1,
@@ -135,6 +153,9 @@ enum
     // Nodes may always request a MSG_FILTERED_BLOCK in a getdata, however,
     // MSG_FILTERED_BLOCK should not appear in any invs except as a part of getdata.
     MSG_FILTERED_BLOCK,
+    // Like MSG_FILTERED_BLOCK, only requested in getdata; answered with a
+    // cmpctblock to peers of COMPACT_BLOCKS_VERSION or later.
+    MSG_CMPCT_BLOCK,
 };
 
 #endif // __INCLUDED_PROTOCOL_H__
@@ -27,30 +27,63 @@ struct AddressTableEntry
 
     Type type;
     QString label;
-    QString address;
+    CTxDestination dest;
     bool stealth;
 
     AddressTableEntry() {}
-    AddressTableEntry(Type type, const QString &label, const QString &address, const bool &stealth = false):
-        type(type), label(label), address(address), stealth(stealth) {}
+    AddressTableEntry(Type type, const QString &label, const CTxDestination &dest, const QString &address = QString()):
+        type(type), label(label), dest(dest), stealth(dest.type() == typeid(CStealthAddress)), address(address) {}
+
+    /* Encoded address, computed the first time it is shown: encoding every
+     * entry of a large address book up front is what made loading slow */
+    const QString &getAddress() const
+    {
+        if(address.isEmpty())
+        {
+            if(stealth)
+                address = QString::fromStdString(boost::get<CStealthAddress>(dest).Encoded());
+            else
+                address = QString::fromStdString(CBitcoinAddress(dest).ToString());
+        }
+        return address;
+    }
+
+private:
+    mutable QString address;
 };
 
+// Entries are kept in the order of their destinations, which is the order of
+// mapAddressBook, so that loading needs no encoding
 struct AddressTableEntryLessThan
 {
     bool operator()(const AddressTableEntry &a, const AddressTableEntry &b) const
     {
-        return a.address < b.address;
+        return a.dest < b.dest;
     }
-    bool operator()(const AddressTableEntry &a, const QString &b) const
+    bool operator()(const AddressTableEntry &a, const CTxDestination &b) const
     {
-        return a.address < b;
+        return a.dest < b;
     }
-    bool operator()(const QString &a, const AddressTableEntry &b) const
+    bool operator()(const CTxDestination &a, const AddressTableEntry &b) const
     {
-        return a < b.address;
+        return a < b.dest;
     }
 };
 
+/* Decode an address as shown in the model, stealth or not */
+static CTxDestination DecodeAddress(const QString &address)
+{
+    std::string strAddress = address.toStdString();
+    if(IsStealthAddress(strAddress))
+    {
+        CStealthAddress sxAddr;
+        if(sxAddr.SetEncoded(strAddress))
+            return sxAddr;
+        return CNoDestination();
+    }
+    return CBitcoinAddress(strAddress).Get();
+}
+
 /* Determine address type from address purpose */
 static AddressTableEntry::Type translateTransactionType(const QString &strPurpose, bool isMine)
 {
@@ -81,16 +114,16 @@ public:
         cachedAddressTable.clear();
         {
             LOCK(wallet->cs_wallet);
+            cachedAddressTable.reserve(wallet->mapAddressBook.size() + wallet->stealthAddresses.size());
             BOOST_FOREACH(const PAIRTYPE(CTxDestination, CAddressBookData)& item, wallet->mapAddressBook)
             {
-                const CBitcoinAddress& address = item.first;
-                bool fMine = IsMine(*wallet, address.Get());
+                bool fMine = IsMine(*wallet, item.first);
                 AddressTableEntry::Type addressType = translateTransactionType(
                         QString::fromStdString(item.second.purpose), fMine);
                 const std::string& strName = item.second.name;
                 cachedAddressTable.append(AddressTableEntry(addressType,
                                   QString::fromStdString(strName),
-                                  QString::fromStdString(address.ToString())));
+                                  item.first));
             }
 
             std::set<CStealthAddress>::iterator it;
@@ -99,23 +132,42 @@ public:
                 bool fMine = !(it->scan_secret.size() < 1);
                 cachedAddressTable.append(AddressTableEntry(fMine ? AddressTableEntry::Receiving : AddressTableEntry::Sending,
                                   QString::fromStdString(it->label),
-                                  QString::fromStdString(it->Encoded()),
-                                  true));
+                                  CTxDestination(*it)));
             };
         }
-        // qLowerBound() and qUpperBound() require our cachedAddressTable list to be sorted in asc order
-        // Even though the map is already sorted this re-sorting step is needed because the originating map
-        // is sorted by binary address, not by base58() address.
-        qSort(cachedAddressTable.begin(), cachedAddressTable.end(), AddressTableEntryLessThan());
+        // qLowerBound() and qUpperBound() require our cachedAddressTable list to be sorted in asc order.
+        // Both sources are sorted already and stealth destinations order after all others, so this only
+        // matters if the address book itself holds stealth destinations.
+        if(!isSorted())
+            qStableSort(cachedAddressTable.begin(), cachedAddressTable.end(), AddressTableEntryLessThan());
+    }
+
+    bool isSorted() const
+    {
+        for(int i = 1; i < cachedAddressTable.size(); i++)
+            if(AddressTableEntryLessThan()(cachedAddressTable[i], cachedAddressTable[i-1]))
+                return false;
+        return true;
+    }
+
+    /* Row of an entry, -1 if it is not in the model */
+    int lookup(const CTxDestination &dest) const
+    {
+        QList<AddressTableEntry>::const_iterator it = qLowerBound(
+            cachedAddressTable.begin(), cachedAddressTable.end(), dest, AddressTableEntryLessThan());
+        if(it == cachedAddressTable.end() || !(it->dest == dest))
+            return -1;
+        return it - cachedAddressTable.begin();
     }
 
     void updateEntry(const QString &address, const QString &label, bool isMine, const QString &purpose, int status)
     {
         // Find address / label in model
+        CTxDestination dest = DecodeAddress(address);
         QList<AddressTableEntry>::iterator lower = qLowerBound(
-            cachedAddressTable.begin(), cachedAddressTable.end(), address, AddressTableEntryLessThan());
+            cachedAddressTable.begin(), cachedAddressTable.end(), dest, AddressTableEntryLessThan());
         QList<AddressTableEntry>::iterator upper = qUpperBound(
-            cachedAddressTable.begin(), cachedAddressTable.end(), address, AddressTableEntryLessThan());
+            cachedAddressTable.begin(), cachedAddressTable.end(), dest, AddressTableEntryLessThan());
         int lowerIndex = (lower - cachedAddressTable.begin());
         int upperIndex = (upper - cachedAddressTable.begin());
         bool inModel = (lower != upper);
@@ -130,7 +182,7 @@ public:
                 break;
             }
             parent->beginInsertRows(QModelIndex(), lowerIndex, lowerIndex);
-            cachedAddressTable.insert(lowerIndex, AddressTableEntry(newEntryType, label, address));
+            cachedAddressTable.insert(lowerIndex, AddressTableEntry(newEntryType, label, dest, address));
             parent->endInsertRows();
             break;
         case CT_UPDATED:
@@ -220,7 +272,7 @@ QVariant AddressTableModel::data(const QModelIndex &index, int role) const
                 return rec->label;
             }
         case Address:
-            return rec->address;
+            return rec->getAddress();
         }
     }
     else if (role == Qt::FontRole)
@@ -258,7 +310,7 @@ bool AddressTableModel::setData(const QModelIndex &index, const QVariant &value,
     if(role == Qt::EditRole)
     {
         LOCK(wallet->cs_wallet); /* For SetAddressBook / DelAddressBook */
-        CTxDestination curAddress = CBitcoinAddress(rec->address.toStdString()).Get();
+        CTxDestination curAddress = rec->stealth ? CTxDestination(CNoDestination()) : rec->dest;
         if(index.column() == Label)
         {
             // Do nothing, if old label == new label
@@ -267,7 +319,7 @@ bool AddressTableModel::setData(const QModelIndex &index, const QVariant &value,
                 editStatus = NO_CHANGES;
                 return false;
             }
-	    strTemp = rec->address.toStdString();
+	    strTemp = rec->getAddress().toStdString();
             if (IsStealthAddress(strTemp))
             {
                 strValue = value.toString().toStdString();
@@ -539,7 +591,7 @@ bool AddressTableModel::removeRows(int row, int count, const QModelIndex &parent
     }
     {
         LOCK(wallet->cs_wallet);
-        wallet->DelAddressBook(CBitcoinAddress(rec->address.toStdString()).Get());
+        wallet->DelAddressBook(rec->stealth ? CTxDestination(CNoDestination()) : rec->dest);
     }
     return true;
 }
@@ -578,16 +630,11 @@ QString AddressTableModel::labelForAddress(const QString &address) const
 
 int AddressTableModel::lookupAddress(const QString &address) const
 {
-    QModelIndexList lst = match(index(0, Address, QModelIndex()),
-                                Qt::EditRole, address, 1, Qt::MatchExactly);
-    if(lst.isEmpty())
-    {
+    // Searching the rows by their text would encode every address
+    CTxDestination dest = DecodeAddress(address);
+    if(boost::get<CNoDestination>(&dest))
         return -1;
-    }
-    else
-    {
-        return lst.at(0).row();
-    }
+    return priv->lookup(dest);
 }
 
 void AddressTableModel::emitDataChanged(int idx)
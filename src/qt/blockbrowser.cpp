@@ -7,170 +7,117 @@
 #include "rpcserver.h"
 #include "transactionrecord.h"
 
+#include <algorithm>
 #include <sstream>
 #include <string>
-double getBlockHardness(int64_t height)
-{
-    const CBlockIndex* blockindex = getBlockIndex(height);
 
-    int64_t nShift = (blockindex->nBits >> 24) & 0xff;
+#include <QCache>
+#include <QThread>
 
-    double dDiff =
-        (double)0x0000ffff / (double)(blockindex->nBits & 0x00ffffff);
+/** Blocks and transactions kept by the worker, most recently looked up */
+static const int BLOCK_CACHE_SIZE = 256;
+static const int TX_CACHE_SIZE = 256;
 
-    while (nShift < 29)
-    {
-        dDiff *= 256.0;
-        nShift++;
-    }
-    while (nShift > 29)
-    {
-        dDiff /= 256.0;
-        nShift--;
-    }
+const CBlockIndex* getBlockIndex(int64_t height)
+{
+    // Index entries are never freed, and their header fields never change
+    LOCK(cs_chainview);
+    if (height < 0 || height > chainActive.Height())
+        return NULL;
+    return chainActive[height];
+}
 
-    return dDiff;
+double getBlockHardness(int64_t height)
+{
+    const CBlockIndex* blockindex = getBlockIndex(height);
+    if (!blockindex)
+        return 0;
+    return GetDifficultyFromBits(blockindex->nBits);
 }
 
-const CBlockIndex* getBlockIndex(int64_t height)
+// Network hash rate of the algorithm of the block, at that block
+int64_t getBlockHashrate(int64_t height)
 {
-    std::string hex = getBlockHash(height);
-    uint256 hash(hex);
-    return mapBlockIndex[hash];
+    const CBlockIndex* blockindex;
+    bool fTip;
+    {
+        LOCK(cs_chainview);
+        if (height < 0 || height > chainActive.Height())
+            return 0;
+        blockindex = chainActive[height];
+        fTip = (blockindex == chainActive.Tip());
+    }
+    if (fTip)
+        return GetAlgoStats(blockindex->GetAlgo()).nHashesPerSec;
+    return EstimateAlgoHashRate(blockindex, blockindex->GetAlgo(), ALGO_STATS_WINDOW);
 }
 
 std::string getBlockHash(int64_t Height)
 {
-	
-	CBlockIndex* pindexBest = mapBlockIndex[chainActive.Tip()->GetBlockHash()];
-    if(Height > pindexBest->nHeight) { return ""; }
-    if(Height < 0) { return ""; }
-    int64_t desiredheight;
-    desiredheight = Height;
-    if (desiredheight < 0 || desiredheight > pindexBest->nHeight)
-        return 0;
-
-    CBlock block;
-    CBlockIndex* pblockindex =  mapBlockIndex[chainActive.Tip()->GetBlockHash()];
-    while (pblockindex->nHeight > desiredheight)
-        pblockindex = pblockindex->pprev;
-    return  pblockindex->GetBlockHash().GetHex(); // pblockindex->phashBlock->GetHex();
+    const CBlockIndex* pblockindex = getBlockIndex(Height);
+    if (!pblockindex)
+        return "";
+    return pblockindex->GetBlockHash().GetHex();
 }
 
 int64_t getBlockTime(int64_t Height)
 {
-    std::string strHash = getBlockHash(Height);
-    uint256 hash(strHash);
-
-    if (mapBlockIndex.count(hash) == 0)
+    const CBlockIndex* pblockindex = getBlockIndex(Height);
+    if (!pblockindex)
         return 0;
-
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
     return pblockindex->nTime;
 }
 
 std::string getBlockMerkle(int64_t Height)
 {
-    std::string strHash = getBlockHash(Height);
-    uint256 hash(strHash);
-
-    if (mapBlockIndex.count(hash) == 0)
-        return 0;
-
-    
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-    return pblockindex->hashMerkleRoot.ToString();//.substr(0,10).c_str();
+    const CBlockIndex* pblockindex = getBlockIndex(Height);
+    if (!pblockindex)
+        return "";
+    return pblockindex->hashMerkleRoot.ToString();
 }
 
 int64_t getBlocknBits(int64_t Height)
 {
-    std::string strHash = getBlockHash(Height);
-    uint256 hash(strHash);
-
-    if (mapBlockIndex.count(hash) == 0)
+    const CBlockIndex* pblockindex = getBlockIndex(Height);
+    if (!pblockindex)
         return 0;
-
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
     return pblockindex->nBits;
 }
 
 int64_t getBlockNonce(int64_t Height)
 {
-    std::string strHash = getBlockHash(Height);
-    uint256 hash(strHash);
-
-    if (mapBlockIndex.count(hash) == 0)
+    const CBlockIndex* pblockindex = getBlockIndex(Height);
+    if (!pblockindex)
         return 0;
-
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
     return pblockindex->nNonce;
 }
 
 std::string getBlockDebug(int64_t Height)
 {
-    std::string strHash = getBlockHash(Height);
-    uint256 hash(strHash);
-
-    if (mapBlockIndex.count(hash) == 0)
-        return 0;
-
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
+    const CBlockIndex* pblockindex = getBlockIndex(Height);
+    if (!pblockindex)
+        return "";
     return pblockindex->ToString();
 }
 
 int64_t blocksInPastHours(int64_t hours)
 {
-	CBlock block;
-	CBlockIndex* pindexBest = mapBlockIndex[chainActive.Tip()->GetBlockHash()];
-    int64_t wayback = hours * 3600;
-    bool check = true;
-    int64_t height = pindexBest->nHeight;
-    int64_t heightHour = pindexBest->nHeight;
-    int64_t utime = (int64_t)time(NULL);
-    int64_t target = utime - wayback;
-
-    while(check)
+    const CBlockIndex* pindexBest;
     {
-        if(getBlockTime(heightHour) < target)
-        {
-            check = false;
-            return height - heightHour;
-        } else {
-            heightHour = heightHour - 1;
-        }
+        LOCK(cs_chainview);
+        pindexBest = chainActive.Tip();
     }
-
-    return 0;
-}
-
-double getTxTotalValue(std::string txid)
-{
-    uint256 hash;
-    hash.SetHex(txid);
-
-    CTransaction tx;
-    uint256 hashBlock = 0;
-    if (!GetTransaction(hash, tx, hashBlock))
+    if (!pindexBest)
         return 0;
+    int64_t target = (int64_t)time(NULL) - hours * 3600;
 
-    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
-    ssTx << tx;
-
-    double value = 0;
-    double buffer = 0;
-    for (unsigned int i = 0; i < tx.vout.size(); i++)
-    {
-        const CTxOut& txout = tx.vout[i];
-
-        buffer = value + convertCoins(txout.nValue);
-        value = buffer;
-    }
-
-    return value;
+    // Ancestor links never change, so walk back from the tip
+    const CBlockIndex* pindex = pindexBest;
+    while (pindex && pindex->nTime >= target)
+        pindex = pindex->pprev;
+    if (!pindex)
+        return 0;
+    return pindexBest->nHeight - pindex->nHeight;
 }
 
 double convertCoins(int64_t amount)
@@ -178,147 +125,201 @@ double convertCoins(int64_t amount)
     return (double)amount / (double)COIN;
 }
 
-std::string getOutputs(std::string txid)
+static std::string formatTxOut(const CTxOut& txout)
 {
-    uint256 hash;
-    hash.SetHex(txid);
-
-    CTransaction tx;
-    uint256 hashBlock = 0;
-    if (!GetTransaction(hash, tx, hashBlock))
-        return "N/A";
-
-    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
-    ssTx << tx;
-
-    std::string str = "";
-    for (unsigned int i = 0; i < tx.vout.size(); i++)
-    {
-        const CTxOut& txout = tx.vout[i];
-        CTxDestination source;
-        ExtractDestination(txout.scriptPubKey, source);
-        CBitcoinAddress addressSource(source);
-        std::string addressStr = addressSource.ToString();
-        double buffer = convertCoins(txout.nValue);
-        std::string amount = boost::to_string(buffer);
-        str.append(addressStr);
-        str.append(": ");
-        str.append(amount);
-        str.append(" DGC");
-        str.append("\n");
-    }
-
+    CTxDestination dest;
+    ExtractDestination(txout.scriptPubKey, dest);
+    std::string str = CBitcoinAddress(dest).ToString();
+    str.append(": ");
+    str.append(boost::to_string(convertCoins(txout.nValue)));
+    str.append(" DGC");
+    str.append("\n");
     return str;
 }
 
-std::string getInputs(std::string txid)
+// Looks the transaction and each of its previous transactions up once
+static bool getTxDetails(const std::string& txid, BlockBrowserTx& details)
 {
+    details = BlockBrowserTx();
+    details.txid = QString::fromStdString(txid);
+    details.inputs = details.outputs = "N/A";
+
     uint256 hash;
     hash.SetHex(txid);
-
     CTransaction tx;
     uint256 hashBlock = 0;
     if (!GetTransaction(hash, tx, hashBlock))
-        return "N/A";
+        return false;
+    details.fFound = true;
 
-    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
-    ssTx << tx;
+    std::string outputs;
+    int64_t nValueOut = 0;
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+    {
+        nValueOut += txout.nValue;
+        outputs.append(formatTxOut(txout));
+    }
+    details.dValue = convertCoins(nValueOut);
+    details.outputs = QString::fromStdString(outputs);
 
-    std::string str = "";
-    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    std::string inputs;
+    int64_t nValueIn = 0;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
     {
-        uint256 hash;
-        const CTxIn& vin = tx.vin[i];
-        hash.SetHex(vin.prevout.hash.ToString());
-        CTransaction wtxPrev;
-        uint256 hashBlock = 0;
-        if (!GetTransaction(hash, wtxPrev, hashBlock))
-             return "N/A";
-
-        CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
-        ssTx << wtxPrev;
-
-        CTxDestination source;
-        ExtractDestination(wtxPrev.vout[vin.prevout.n].scriptPubKey, source);
-        CBitcoinAddress addressSource(source);
-        std::string inputStr = addressSource.ToString();
-        const CScript target = wtxPrev.vout[vin.prevout.n].scriptPubKey;
-        double buffer = convertCoins(getInputValue(wtxPrev, target));
-        std::string amount = boost::to_string(buffer);
-        str.append(inputStr);
-        str.append(": ");
-        str.append(amount);
-        str.append(" DGC");
-        str.append("\n");
+        CTransaction txPrev;
+        uint256 hashBlockPrev = 0;
+        if (!GetTransaction(txin.prevout.hash, txPrev, hashBlockPrev) || txin.prevout.n >= txPrev.vout.size())
+            return true; // coinbase, or previous transaction not indexed
+        const CTxOut& prevout = txPrev.vout[txin.prevout.n];
+        nValueIn += prevout.nValue;
+        inputs.append(formatTxOut(prevout));
     }
+    details.inputs = QString::fromStdString(inputs);
+    details.dFees = convertCoins(nValueIn - nValueOut);
+    return true;
+}
 
-    return str;
+double getTxTotalValue(std::string txid)
+{
+    BlockBrowserTx details;
+    getTxDetails(txid, details);
+    return details.dValue;
+}
+
+std::string getOutputs(std::string txid)
+{
+    BlockBrowserTx details;
+    getTxDetails(txid, details);
+    return details.outputs.toStdString();
+}
+
+std::string getInputs(std::string txid)
+{
+    BlockBrowserTx details;
+    getTxDetails(txid, details);
+    return details.inputs.toStdString();
 }
 
 int64_t getInputValue(CTransaction tx, CScript target)
 {
-    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
     {
-        const CTxOut& txout = tx.vout[i];
-        if(txout.scriptPubKey == target)
-        {
+        if (txout.scriptPubKey == target)
             return txout.nValue;
-        }
     }
     return 0;
 }
 
 double getTxFees(std::string txid)
 {
-    uint256 hash;
-    hash.SetHex(txid);
+    BlockBrowserTx details;
+    getTxDetails(txid, details);
+    return details.dFees;
+}
 
+static void getBlockDetails(const CBlockIndex* pindex, BlockBrowserBlock& details)
+{
+    details.fFound = true;
+    details.nHeight = pindex->nHeight;
+    details.hash = QString::fromStdString(pindex->GetBlockHash().GetHex());
+    details.merkle = QString::fromStdString(pindex->hashMerkleRoot.ToString());
+    details.nBits = pindex->nBits;
+    details.nNonce = pindex->nNonce;
+    details.nTime = pindex->nTime;
+    details.dHardness = GetDifficultyFromBits(pindex->nBits);
+    details.dHashrate = (double)EstimateAlgoHashRate(pindex, pindex->GetAlgo(), ALGO_STATS_WINDOW) / 1000000;
+}
 
-    CTransaction tx;
-    uint256 hashBlock = 0;
-    if (!GetTransaction(hash, tx, hashBlock))
-        return 0.0001;
+BlockBrowserBlock::BlockBrowserBlock() :
+    fFound(false), nHeight(0), nBits(0), nNonce(0), nTime(0), dHardness(0), dHashrate(0)
+{
+}
 
-    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
-    ssTx << tx;
+BlockBrowserTx::BlockBrowserTx() :
+    fFound(false), dValue(0), dFees(0)
+{
+}
+
+/** Looks blocks and transactions up on a thread of its own, so that the
+ * block browser does not block the GUI while reading block files.
+ */
+class BlockBrowserWorker : public QObject
+{
+    Q_OBJECT
 
-    double value = 0;
-    double buffer = 0;
-    for (unsigned int i = 0; i < tx.vout.size(); i++)
+public:
+    BlockBrowserWorker() :
+        blockCache(BLOCK_CACHE_SIZE), txCache(TX_CACHE_SIZE)
     {
-        const CTxOut& txout = tx.vout[i];
+    }
 
-        buffer = value + convertCoins(txout.nValue);
-        value = buffer;
+public slots:
+    void lookupBlock(int nHeight)
+    {
+        const CBlockIndex* pindex;
+        bool fTip;
+        {
+            LOCK(cs_chainview);
+            if (chainActive.Height() < 0)
+                return;
+            nHeight = std::max(0, std::min(nHeight, chainActive.Height()));
+            pindex = chainActive[nHeight];
+            fTip = (pindex == chainActive.Tip());
+        }
+
+        // Blocks are cached by hash, as the block at a height may change
+        QString hash = QString::fromStdString(pindex->GetBlockHash().GetHex());
+        if (BlockBrowserBlock* cached = blockCache.object(hash))
+        {
+            emit blockFound(*cached);
+            return;
+        }
+
+        BlockBrowserBlock details;
+        getBlockDetails(pindex, details);
+        if (fTip)
+        {
+            // The estimate for the tip is kept up to date as blocks arrive
+            details.dHashrate = (double)GetAlgoStats(pindex->GetAlgo()).nHashesPerSec / 1000000;
+        }
+        else
+        {
+            blockCache.insert(hash, new BlockBrowserBlock(details));
+        }
+        emit blockFound(details);
     }
 
-    double value0 = 0;
-    double buffer0 = 0;
-    double swp = 0;
-    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    void lookupTx(const QString& txid)
     {
-        uint256 hash0;
-        const CTxIn& vin = tx.vin[i];
-        hash0.SetHex(vin.prevout.hash.ToString());
-        CTransaction wtxPrev;
-        uint256 hashBlock0 = 0;
-        if (!GetTransaction(hash0, wtxPrev, hashBlock0))
-             return 0;
-        CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
-        ssTx << wtxPrev;
-        const CScript target = wtxPrev.vout[vin.prevout.n].scriptPubKey;
-        swp = convertCoins(getInputValue(wtxPrev, target));
-        buffer0 = value0 + convertCoins(getInputValue(wtxPrev, target));
-        value0 = buffer0;
+        if (BlockBrowserTx* cached = txCache.object(txid))
+        {
+            emit txFound(*cached);
+            return;
+        }
+
+        BlockBrowserTx details;
+        getTxDetails(txid.toStdString(), details);
+        // Not found may only mean not yet seen
+        if (details.fFound)
+            txCache.insert(txid, new BlockBrowserTx(details));
+        emit txFound(details);
     }
 
-    return value0 - value;
-}
+signals:
+    void blockFound(const BlockBrowserBlock& block);
+    void txFound(const BlockBrowserTx& tx);
+
+private:
+    QCache<QString, BlockBrowserBlock> blockCache;
+    QCache<QString, BlockBrowserTx> txCache;
+};
 
+#include "blockbrowser.moc"
 
 BlockBrowser::BlockBrowser(QWidget *parent) :
     QWidget(parent),
-    ui(new Ui::BlockBrowser)
+    ui(new Ui::BlockBrowser),
+    model(0)
 {
     ui->setupUi(this);
 
@@ -326,6 +327,18 @@ BlockBrowser::BlockBrowser(QWidget *parent) :
 
     connect(ui->blockButton, SIGNAL(pressed()), this, SLOT(blockClicked()));
     connect(ui->txButton, SIGNAL(pressed()), this, SLOT(txClicked()));
+
+    qRegisterMetaType<BlockBrowserBlock>("BlockBrowserBlock");
+    qRegisterMetaType<BlockBrowserTx>("BlockBrowserTx");
+
+    workerThread = new QThread();
+    worker = new BlockBrowserWorker();
+    worker->moveToThread(workerThread);
+    connect(this, SIGNAL(requestBlock(int)), worker, SLOT(lookupBlock(int)));
+    connect(this, SIGNAL(requestTx(QString)), worker, SLOT(lookupTx(QString)));
+    connect(worker, SIGNAL(blockFound(BlockBrowserBlock)), this, SLOT(showBlock(BlockBrowserBlock)));
+    connect(worker, SIGNAL(txFound(BlockBrowserTx)), this, SLOT(showTx(BlockBrowserTx)));
+    workerThread->start();
 }
 
 void BlockBrowser::updateExplorer(bool block)
@@ -364,39 +377,7 @@ void BlockBrowser::updateExplorer(bool block)
         ui->pawLabel->setTextInteractionFlags(Qt::TextSelectableByMouse);
         ui->pawBox->show();
         ui->pawBox->setTextInteractionFlags(Qt::TextSelectableByMouse);
-        int64_t height = ui->heightBox->value();
-		CBlock block;
-		CBlockIndex* pindexBest = mapBlockIndex[chainActive.Tip()->GetBlockHash()];
-        if (height > pindexBest->nHeight)
-        {
-            ui->heightBox->setValue(pindexBest->nHeight);
-            height = pindexBest->nHeight;
-        }
-        //int64_t Pawrate = getBlockHashrate(height); Wtf
-        //double Pawrate2 = 0.000;
-        //Pawrate2 = ((double)Pawrate / 1000000);
-        std::string hash = getBlockHash(height);
-        std::string merkle = getBlockMerkle(height);
-        int64_t nBits = getBlocknBits(height);
-        int64_t nNonce = getBlockNonce(height);
-        int64_t atime = getBlockTime(height);
-        double hardness = getBlockHardness(height);
-        QString QHeight = QString::number(height);
-        QString QHash = QString::fromUtf8(hash.c_str());
-        QString QMerkle = QString::fromUtf8(merkle.c_str());
-        QString QBits = QString::number(nBits);
-        QString QNonce = QString::number(nNonce);
-        QString QTime = QString::number(atime);
-        QString QHardness = QString::number(hardness, 'f', 6);
-        QString QPawrate = QString::number(0);
-        ui->heightLabelBE1->setText(QHeight);
-        ui->hashBox->setText(QHash);
-        ui->merkleBox->setText(QMerkle);
-        ui->bitsBox->setText(QBits);
-        ui->nonceBox->setText(QNonce);
-        ui->timeBox->setText(QTime);
-        ui->hardBox->setText(QHardness);
-        ui->pawBox->setText(QPawrate + " MH/s");
+        emit requestBlock(ui->heightBox->value());
     }
 
     if(block == false) {
@@ -420,24 +401,35 @@ void BlockBrowser::updateExplorer(bool block)
         ui->feesLabel->setTextInteractionFlags(Qt::TextSelectableByMouse);
         ui->feesBox->show();
         ui->feesBox->setTextInteractionFlags(Qt::TextSelectableByMouse);
-        std::string txid = ui->txBox->text().toUtf8().constData();
-        double value = getTxTotalValue(txid);
-        double fees = getTxFees(txid);
-        std::string outputs = getOutputs(txid);
-        std::string inputs = getInputs(txid);
-        QString QValue = QString::number(value, 'f', 6);
-        QString QID = QString::fromUtf8(txid.c_str());
-        QString QOutputs = QString::fromUtf8(outputs.c_str());
-        QString QInputs = QString::fromUtf8(inputs.c_str());
-        QString QFees = QString::number(fees, 'f', 6);
-        ui->valueBox->setText(QValue + " DGC");
-        ui->txID->setText(QID);
-        ui->outputBox->setText(QOutputs);
-        ui->inputBox->setText(QInputs);
-        ui->feesBox->setText(QFees + " DGC");
+        emit requestTx(ui->txBox->text().trimmed());
     }
 }
 
+void BlockBrowser::showBlock(const BlockBrowserBlock& block)
+{
+    if (!block.fFound)
+        return;
+    if (ui->heightBox->value() > block.nHeight)
+        ui->heightBox->setValue(block.nHeight);
+    ui->heightLabelBE1->setText(QString::number(block.nHeight));
+    ui->hashBox->setText(block.hash);
+    ui->merkleBox->setText(block.merkle);
+    ui->bitsBox->setText(QString::number(block.nBits));
+    ui->nonceBox->setText(QString::number(block.nNonce));
+    ui->timeBox->setText(QString::number(block.nTime));
+    ui->hardBox->setText(QString::number(block.dHardness, 'f', 6));
+    ui->pawBox->setText(QString::number(block.dHashrate, 'f', 3) + " MH/s");
+}
+
+void BlockBrowser::showTx(const BlockBrowserTx& tx)
+{
+    ui->valueBox->setText(QString::number(tx.dValue, 'f', 6) + " DGC");
+    ui->txID->setText(tx.txid);
+    ui->outputBox->setText(tx.outputs);
+    ui->inputBox->setText(tx.inputs);
+    ui->feesBox->setText(QString::number(tx.dFees, 'f', 6) + " DGC");
+}
+
 
 void BlockBrowser::txClicked()
 {
@@ -456,5 +448,9 @@ void BlockBrowser::setModel(ClientModel *model)
 
 BlockBrowser::~BlockBrowser()
 {
+    workerThread->quit();
+    workerThread->wait();
+    delete worker;
+    delete workerThread;
     delete ui;
 }
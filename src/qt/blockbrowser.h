@@ -16,6 +16,7 @@
 #include <QMap>
 #include <QSettings>
 #include <QSlider>
+#include <QMetaType>
 
 double getBlockHardness(int64_t);
 double getTxTotalValue(std::string);
@@ -34,11 +35,49 @@ bool addnode(std::string);
 const CBlockIndex* getBlockIndex(int64_t);
 int64_t getInputValue(CTransaction, CScript);
 
+/** What the block browser shows of a block */
+struct BlockBrowserBlock
+{
+    bool fFound;
+    int nHeight;
+    QString hash;
+    QString merkle;
+    int64_t nBits;
+    int64_t nNonce;
+    int64_t nTime;
+    double dHardness;
+    /** Network hash rate of the algorithm of the block, in MH/s */
+    double dHashrate;
+
+    BlockBrowserBlock();
+};
+
+/** What the block browser shows of a transaction */
+struct BlockBrowserTx
+{
+    bool fFound;
+    QString txid;
+    double dValue;
+    double dFees;
+    QString inputs;
+    QString outputs;
+
+    BlockBrowserTx();
+};
+
+Q_DECLARE_METATYPE(BlockBrowserBlock)
+Q_DECLARE_METATYPE(BlockBrowserTx)
+
 
 namespace Ui {
 class BlockBrowser;
 }
 class ClientModel;
+class BlockBrowserWorker;
+
+QT_BEGIN_NAMESPACE
+class QThread;
+QT_END_NAMESPACE
 
 class BlockBrowser : public QWidget
 {
@@ -57,10 +96,18 @@ public slots:
     void updateExplorer(bool);
 
 private slots:
+    void showBlock(const BlockBrowserBlock& block);
+    void showTx(const BlockBrowserTx& tx);
+
+signals:
+    void requestBlock(int nHeight);
+    void requestTx(const QString& txid);
 
 private:
     Ui::BlockBrowser *ui;
     ClientModel *model;
+    QThread *workerThread;
+    BlockBrowserWorker *worker;
 
 };
 
@@ -15,22 +15,32 @@
 
 #include <stdint.h>
 
+#include <QAtomicInt>
 #include <QDateTime>
 #include <QDebug>
 #include <QTimer>
 
 static const int64_t nClientStartupTime = GetTime();
 
+// A blocksChanged() call is queued and has not run yet
+static QAtomicInt fBlocksChangedQueued(0);
+
 ClientModel::ClientModel(OptionsModel *optionsModel, QObject *parent) :
     QObject(parent), optionsModel(optionsModel),
     cachedNumBlocks(0),
     cachedReindexing(0), cachedImporting(0),
-    numBlocksAtStartup(-1), pollTimer(0)
+    numBlocksAtStartup(-1), pollTimer(0), blocksTimer(0)
 {
     pollTimer = new QTimer(this);
     connect(pollTimer, SIGNAL(timeout()), this, SLOT(updateTimer()));
     pollTimer->start(MODEL_UPDATE_DELAY);
 
+    blocksTimer = new QTimer(this);
+    blocksTimer->setSingleShot(true);
+    blocksTimer->setInterval(MODEL_UPDATE_DELAY);
+    connect(blocksTimer, SIGNAL(timeout()), this, SLOT(updateNumBlocks()));
+    blocksTimer->start();
+
     subscribeToCoreSignals();
 }
 
@@ -55,7 +65,7 @@ int ClientModel::getNumConnections(unsigned int flags) const
 
 int ClientModel::getNumBlocks() const
 {
-    LOCK(cs_main);
+    LOCK(cs_chainview);
     return chainActive.Height();
 }
 
@@ -75,9 +85,22 @@ quint64 ClientModel::getTotalBytesSent() const
     return CNode::GetTotalBytesSent();
 }
 
+void ClientModel::getTotalMessageBytes(const std::string &command, quint64 &bytesRecv, quint64 &bytesSent) const
+{
+    uint64_t nSent, nRecv;
+    CNode::GetTotalMessageBytes(command, nSent, nRecv);
+    bytesRecv = nRecv;
+    bytesSent = nSent;
+}
+
+void ClientModel::getMemoryUsage(CMemoryUsageStats &stats) const
+{
+    GetMemoryUsageStats(stats);
+}
+
 QDateTime ClientModel::getLastBlockDate() const
 {
-    LOCK(cs_main);
+    LOCK(cs_chainview);
     if (chainActive.Tip())
         return QDateTime::fromTime_t(chainActive.Tip()->GetBlockTime());
     else
@@ -86,20 +109,31 @@ QDateTime ClientModel::getLastBlockDate() const
 
 double ClientModel::getVerificationProgress() const
 {
-    LOCK(cs_main);
+    LOCK(cs_chainview);
     return Checkpoints::GuessVerificationProgress(chainActive.Tip());
 }
 
 void ClientModel::updateTimer()
 {
-    // Get required lock upfront. This avoids the GUI from getting stuck on
-    // periodical polls if the core is holding the locks for a longer time -
-    // for example, during a wallet rescan.
-    TRY_LOCK(cs_main, lockMain);
-    if(!lockMain)
-        return;
-    // Some quantities (such as number of blocks) change so fast that we don't want to be notified for each change.
-    // Periodically check and update with a timer.
+    // Reindexing and importing may end without a block being connected
+    if (cachedReindexing != fReindex || cachedImporting != fImporting)
+        updateNumBlocks();
+
+    emit bytesChanged(getTotalBytesRecv(), getTotalBytesSent());
+}
+
+void ClientModel::blocksChanged()
+{
+    fBlocksChangedQueued.fetchAndStoreOrdered(0);
+    // The number of blocks changes so fast during sync that we don't want to
+    // update for each change; update once when the timer runs out.
+    if (!blocksTimer->isActive())
+        blocksTimer->start();
+}
+
+void ClientModel::updateNumBlocks()
+{
+    // Only takes cs_chainview, so this does not wait for block validation
     int newNumBlocks = getNumBlocks();
 
     // check for changed number of blocks we have, number of blocks peers claim to have, reindexing state and importing state
@@ -112,8 +146,6 @@ void ClientModel::updateTimer()
 
         emit numBlocksChanged(newNumBlocks);
     }
-
-    emit bytesChanged(getTotalBytesRecv(), getTotalBytesSent());
 }
 
 void ClientModel::updateNumConnections(int numConnections)
@@ -201,8 +233,9 @@ QString ClientModel::formatClientStartupTime() const
 // Handlers for core signals
 static void NotifyBlocksChanged(ClientModel *clientmodel)
 {
-    // This notification is too frequent. Don't trigger a signal.
-    // Don't remove it, though, as it might be useful later.
+    // Sent for every block connected; queue no more than one call at a time
+    if (fBlocksChangedQueued.testAndSetOrdered(0, 1))
+        QMetaObject::invokeMethod(clientmodel, "blocksChanged", Qt::QueuedConnection);
 }
 
 static void NotifyNumConnectionsChanged(ClientModel *clientmodel, int newNumConnections)
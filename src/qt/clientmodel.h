@@ -5,6 +5,8 @@
 #ifndef CLIENTMODEL_H
 #define CLIENTMODEL_H
 
+#include <string>
+
 #include <QObject>
 
 class AddressTableModel;
@@ -12,6 +14,7 @@ class OptionsModel;
 class TransactionTableModel;
 
 class CWallet;
+struct CMemoryUsageStats;
 
 QT_BEGIN_NAMESPACE
 class QDateTime;
@@ -50,6 +53,10 @@ public:
 
     quint64 getTotalBytesRecv() const;
     quint64 getTotalBytesSent() const;
+    //! Bytes of messages with the given command, received and sent
+    void getTotalMessageBytes(const std::string &command, quint64 &bytesRecv, quint64 &bytesSent) const;
+    //! Approximate heap memory of the node's larger structures
+    void getMemoryUsage(CMemoryUsageStats &stats) const;
 
     double getVerificationProgress() const;
     QDateTime getLastBlockDate() const;
@@ -79,6 +86,8 @@ private:
     int numBlocksAtStartup;
 
     QTimer *pollTimer;
+    /** Coalesces block notifications into at most one update per MODEL_UPDATE_DELAY */
+    QTimer *blocksTimer;
 
     void subscribeToCoreSignals();
     void unsubscribeFromCoreSignals();
@@ -94,6 +103,9 @@ signals:
 
 public slots:
     void updateTimer();
+    void updateNumBlocks();
+    /** The core connected or disconnected blocks */
+    void blocksChanged();
     void updateNumConnections(int numConnections);
     void updateAlert(const QString &hash, int status);
 };
@@ -10,14 +10,16 @@
 #include <QDialog>
 #include <QList>
 #include <QMenu>
+#include <QModelIndex>
 #include <QPoint>
 #include <QString>
-#include <QTreeWidgetItem>
 
 namespace Ui {
     class CoinControlDialog;
 }
+class CoinControlModel;
 class WalletModel;
+struct CoinControlTotals;
 class CCoinControl;
 
 class CoinControlDialog : public QDialog
@@ -32,6 +34,7 @@ public:
 
     // static because also called from sendcoinsdialog
     static void updateLabels(WalletModel*, QDialog*);
+    static void updateLabels(WalletModel*, QDialog*, const CoinControlTotals&);
     static QString getPriorityLabel(double);
 
     static QList<qint64> payAmounts;
@@ -40,60 +43,19 @@ public:
 private:
     Ui::CoinControlDialog *ui;
     WalletModel *model;
+    CoinControlModel *coinModel;
     int sortColumn;
     Qt::SortOrder sortOrder;
 
     QMenu *contextMenu;
-    QTreeWidgetItem *contextMenuItem;
+    QModelIndex contextMenuIndex;
     QAction *copyTransactionHashAction;
     QAction *lockAction;
     QAction *unlockAction;
 
-    QString strPad(QString, int, QString);
     void sortView(int, Qt::SortOrder);
     void updateView();
 
-    enum
-    {
-        COLUMN_CHECKBOX,
-        COLUMN_AMOUNT,
-        COLUMN_LABEL,
-        COLUMN_ADDRESS,
-        COLUMN_DATE,
-        COLUMN_CONFIRMATIONS,
-        COLUMN_PRIORITY,
-        COLUMN_TXHASH,
-        COLUMN_VOUT_INDEX,
-        COLUMN_AMOUNT_INT64,
-        COLUMN_PRIORITY_INT64,
-        COLUMN_DATE_INT64
-    };
-
-    // some columns have a hidden column containing the value used for sorting
-    int getMappedColumn(int column, bool fVisibleColumn = true)
-    {
-        if (fVisibleColumn)
-        {
-            if (column == COLUMN_AMOUNT_INT64)
-                return COLUMN_AMOUNT;
-            else if (column == COLUMN_PRIORITY_INT64)
-                return COLUMN_PRIORITY;
-            else if (column == COLUMN_DATE_INT64)
-                return COLUMN_DATE;
-        }
-        else
-        {
-            if (column == COLUMN_AMOUNT)
-                return COLUMN_AMOUNT_INT64;
-            else if (column == COLUMN_PRIORITY)
-                return COLUMN_PRIORITY_INT64;
-            else if (column == COLUMN_DATE)
-                return COLUMN_DATE_INT64;
-        }
-
-        return column;
-    }
-
 private slots:
     void showMenu(const QPoint &);
     void copyAmount();
@@ -112,7 +74,8 @@ private slots:
     void clipboardChange();
     void radioTreeMode(bool);
     void radioListMode(bool);
-    void viewItemChanged(QTreeWidgetItem*, int);
+    void viewLoaded();
+    void updateTotals();
     void headerSectionClicked(int);
     void buttonBoxClicked(QAbstractButton*);
     void buttonSelectAllClicked();
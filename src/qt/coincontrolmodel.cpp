@@ -0,0 +1,760 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coincontrolmodel.h"
+
+#include "bitcoinunits.h"
+#include "coincontroldialog.h"
+#include "guiutil.h"
+#include "optionsmodel.h"
+#include "walletmodel.h"
+
+#include "base58.h"
+#include "coincontrol.h"
+#include "main.h"
+#include "sync.h"
+#include "wallet.h"
+
+#include <algorithm>
+#include <set>
+
+#include <QIcon>
+#include <QMutex>
+#include <QStringList>
+#include <QThread>
+
+CoinControlTotals::CoinControlTotals() :
+    nQuantity(0), nAmount(0), dPriorityInputs(0), nBytesInputs(0), nQuantityUncompressed(0)
+{
+}
+
+void CoinControlTotals::Add(int64_t nValue, int nDepth, bool fUncompressed)
+{
+    nQuantity++;
+    nAmount += nValue;
+    dPriorityInputs += (double)nValue * (nDepth+1);
+    nBytesInputs += (fUncompressed ? 180 : 148);
+    if (fUncompressed)
+        nQuantityUncompressed++;
+}
+
+void CoinControlTotals::Remove(int64_t nValue, int nDepth, bool fUncompressed)
+{
+    if (nQuantity <= 1)
+    {
+        // No rounding errors left behind in the priority
+        *this = CoinControlTotals();
+        return;
+    }
+    nQuantity--;
+    nAmount -= nValue;
+    dPriorityInputs -= (double)nValue * (nDepth+1);
+    nBytesInputs -= (fUncompressed ? 180 : 148);
+    if (fUncompressed)
+        nQuantityUncompressed--;
+}
+
+CoinControlEntry::CoinControlEntry() :
+    n(0), nValue(0), nTime(0), nDepth(0), fChange(false), fUncompressed(false), fLocked(false), nGroup(0), nRow(0)
+{
+}
+
+double CoinControlEntry::GetPriority() const
+{
+    // 29 = 180 - 151 (public key is 180 bytes, priority free area is 151 bytes)
+    // 78 = 2 * 34 + 10
+    return ((double)nValue / ((fUncompressed ? 29 : 0) + 78)) * (nDepth+1);
+}
+
+CoinControlGroup::CoinControlGroup() :
+    nValue(0), dPriorityInputs(0), nInputSize(0), nChecked(0), nRow(0)
+{
+}
+
+double CoinControlGroup::GetPriority() const
+{
+    return dPriorityInputs / (nInputSize + 78);
+}
+
+static QString LookupLabel(const CWallet *wallet, const CTxDestination &dest)
+{
+    std::map<CTxDestination, CAddressBookData>::const_iterator mi = wallet->mapAddressBook.find(dest);
+    if (mi == wallet->mapAddressBook.end())
+        return QString();
+    return QString::fromStdString(mi->second.name);
+}
+
+/** Lists the unspent outputs of a wallet on a worker thread, so that the
+ * coin control dialog does not block the GUI while a large wallet is read.
+ */
+class CoinControlLoader : public QObject
+{
+    Q_OBJECT
+
+public:
+    CoinControlLoader(CWallet *wallet) :
+        wallet(wallet)
+    {
+    }
+
+    void takeEntries(std::vector<CoinControlEntry> &entriesOut, std::vector<CoinControlGroup> &groupsOut)
+    {
+        QMutexLocker locker(&mutex);
+        entriesOut.swap(entries);
+        groupsOut.swap(groups);
+    }
+
+public slots:
+    void load()
+    {
+        std::vector<CoinControlEntry> vEntries;
+        std::vector<CoinControlGroup> vGroups;
+        {
+            LOCK(wallet->cs_wallet); // ListLockedCoins, mapWallet, mapAddressBook
+            std::vector<COutput> vCoins;
+            wallet->AvailableCoins(vCoins);
+
+            // add locked coins
+            std::vector<COutPoint> vLockedCoins;
+            wallet->ListLockedCoins(vLockedCoins);
+            BOOST_FOREACH(const COutPoint& outpoint, vLockedCoins)
+            {
+                std::map<uint256, CWalletTx>::const_iterator mi = wallet->mapWallet.find(outpoint.hash);
+                if (mi == wallet->mapWallet.end()) continue;
+                int nDepth = mi->second.GetDepthInMainChain();
+                if (nDepth < 0) continue;
+                vCoins.push_back(COutput(&mi->second, outpoint.n, nDepth));
+            }
+
+            // group by wallet address, with change under the address it came from
+            std::map<QString, int> mapGroups;
+            vEntries.reserve(vCoins.size());
+            BOOST_FOREACH(const COutput& out, vCoins)
+            {
+                COutput cout = out;
+                while (wallet->IsChange(cout.tx->vout[cout.i]) && cout.tx->vin.size() > 0 && wallet->IsMine(cout.tx->vin[0]))
+                {
+                    std::map<uint256, CWalletTx>::const_iterator mi = wallet->mapWallet.find(cout.tx->vin[0].prevout.hash);
+                    if (mi == wallet->mapWallet.end()) break;
+                    cout = COutput(&mi->second, cout.tx->vin[0].prevout.n, 0);
+                }
+
+                CTxDestination walletAddress;
+                if (!ExtractDestination(cout.tx->vout[cout.i].scriptPubKey, walletAddress)) continue;
+                QString sWalletAddress = QString::fromStdString(CBitcoinAddress(walletAddress).ToString());
+                std::map<QString, int>::iterator mg = mapGroups.find(sWalletAddress);
+                if (mg == mapGroups.end())
+                {
+                    mg = mapGroups.insert(std::make_pair(sWalletAddress, (int)vGroups.size())).first;
+                    CoinControlGroup group;
+                    group.address = sWalletAddress;
+                    group.label = LookupLabel(wallet, walletAddress);
+                    vGroups.push_back(group);
+                }
+
+                CoinControlEntry entry;
+                entry.hash = out.tx->GetHash();
+                entry.n = out.i;
+                entry.nValue = out.tx->vout[out.i].nValue;
+                entry.nTime = out.tx->GetTxTime();
+                entry.nDepth = out.nDepth;
+                entry.nGroup = mg->second;
+
+                CTxDestination outputAddress;
+                if (ExtractDestination(out.tx->vout[out.i].scriptPubKey, outputAddress))
+                {
+                    entry.address = QString::fromStdString(CBitcoinAddress(outputAddress).ToString());
+                    entry.label = LookupLabel(wallet, outputAddress);
+
+                    CPubKey pubkey;
+                    CKeyID *keyid = boost::get<CKeyID>(&outputAddress);
+                    entry.fUncompressed = keyid && wallet->GetPubKey(*keyid, pubkey) && !pubkey.IsCompressed();
+                }
+                entry.fChange = (entry.address != sWalletAddress);
+                entry.fLocked = wallet->IsLockedCoin(entry.hash, entry.n);
+
+                CoinControlGroup &group = vGroups[entry.nGroup];
+                group.nValue += entry.nValue;
+                group.dPriorityInputs += (double)entry.nValue * (entry.nDepth+1);
+                group.nInputSize += (entry.fUncompressed ? 29 : 0);
+                group.vEntries.push_back(vEntries.size());
+                vEntries.push_back(entry);
+            }
+        }
+
+        {
+            QMutexLocker locker(&mutex);
+            entries.swap(vEntries);
+            groups.swap(vGroups);
+        }
+        emit entriesLoaded();
+    }
+
+signals:
+    void entriesLoaded();
+
+private:
+    CWallet *wallet;
+
+    QMutex mutex;
+    std::vector<CoinControlEntry> entries;
+    std::vector<CoinControlGroup> groups;
+};
+
+#include "coincontrolmodel.moc"
+
+// Orders entries or groups by the values shown in a column
+class CoinControlLessThan
+{
+public:
+    CoinControlLessThan(const std::vector<CoinControlEntry> &entries, const std::vector<CoinControlGroup> &groups,
+                        const QStringList &keys, int column, Qt::SortOrder order, bool fGroups) :
+        entries(entries), groups(groups), keys(keys), column(column), order(order), fGroups(fGroups)
+    {
+    }
+
+    bool operator()(int a, int b) const
+    {
+        return (order == Qt::AscendingOrder) ? lessThan(a, b) : lessThan(b, a);
+    }
+
+private:
+    const std::vector<CoinControlEntry> &entries;
+    const std::vector<CoinControlGroup> &groups;
+    const QStringList &keys;
+    int column;
+    Qt::SortOrder order;
+    bool fGroups;
+
+    bool lessThan(int a, int b) const
+    {
+        switch(column)
+        {
+        case CoinControlModel::Amount:
+            return fGroups ? groups[a].nValue < groups[b].nValue : entries[a].nValue < entries[b].nValue;
+        case CoinControlModel::Label:
+        case CoinControlModel::Address:
+            return keys[a] < keys[b];
+        case CoinControlModel::Date:
+            return fGroups ? false : entries[a].nTime < entries[b].nTime;
+        case CoinControlModel::Confirmations:
+            return fGroups ? false : entries[a].nDepth < entries[b].nDepth;
+        case CoinControlModel::Priority:
+            return fGroups ? groups[a].GetPriority() < groups[b].GetPriority() : entries[a].GetPriority() < entries[b].GetPriority();
+        }
+        return false;
+    }
+};
+
+CoinControlModel::CoinControlModel(CWallet *wallet, WalletModel *parent) :
+    QAbstractItemModel(parent),
+    wallet(wallet),
+    walletModel(parent),
+    coinControl(0),
+    loaderThread(0),
+    loader(0),
+    fTreeMode(true),
+    sortColumn(Amount),
+    sortOrder(Qt::DescendingOrder)
+{
+    connect(walletModel->getOptionsModel(), SIGNAL(displayUnitChanged(int)), this, SLOT(updateDisplayUnit()));
+}
+
+CoinControlModel::~CoinControlModel()
+{
+    stopLoader();
+}
+
+void CoinControlModel::refresh(CCoinControl *coinControl)
+{
+    stopLoader();
+    this->coinControl = coinControl;
+
+    loaderThread = new QThread();
+    loader = new CoinControlLoader(wallet);
+    loader->moveToThread(loaderThread);
+
+    connect(loader, SIGNAL(entriesLoaded()), this, SLOT(loadEntries()));
+    // Queued, so that it runs in the event loop of the thread and quit()
+    // takes effect once it returns
+    connect(loaderThread, SIGNAL(started()), loader, SLOT(load()), Qt::QueuedConnection);
+
+    loaderThread->start();
+}
+
+void CoinControlModel::stopLoader()
+{
+    if(!loaderThread)
+        return;
+    loaderThread->quit();
+    loaderThread->wait();
+    delete loader;
+    delete loaderThread;
+    loader = 0;
+    loaderThread = 0;
+}
+
+void CoinControlModel::loadEntries()
+{
+    if(!loader)
+        return;
+    std::vector<CoinControlEntry> newEntries;
+    std::vector<CoinControlGroup> newGroups;
+    loader->takeEntries(newEntries, newGroups);
+    stopLoader();
+
+    beginResetModel();
+    entries.swap(newEntries);
+    groups.swap(newGroups);
+
+    // Sum what is checked, and uncheck what can no longer be spent
+    totals = CoinControlTotals();
+    std::set<COutPoint> setListed;
+    for(unsigned int i = 0; i < entries.size(); i++)
+    {
+        CoinControlEntry &entry = entries[i];
+        COutPoint outpt(entry.hash, entry.n);
+        setListed.insert(outpt);
+        if(!coinControl->IsSelected(entry.hash, entry.n))
+            continue;
+        if(entry.fLocked)
+        {
+            coinControl->UnSelect(outpt);
+            continue;
+        }
+        totals.Add(entry.nValue, entry.nDepth, entry.fUncompressed);
+        groups[entry.nGroup].nChecked++;
+    }
+    std::vector<COutPoint> vSelected;
+    coinControl->ListSelected(vSelected);
+    BOOST_FOREACH(COutPoint& outpt, vSelected)
+        if(!setListed.count(outpt))
+            coinControl->UnSelect(outpt);
+
+    vGroupOrder.resize(groups.size());
+    for(unsigned int i = 0; i < groups.size(); i++)
+        vGroupOrder[i] = i;
+    vListOrder.resize(entries.size());
+    for(unsigned int i = 0; i < entries.size(); i++)
+        vListOrder[i] = i;
+    sortRows();
+    endResetModel();
+
+    emit loaded();
+    emit totalsChanged();
+}
+
+void CoinControlModel::sortRows()
+{
+    // Texts are compared as shown
+    QStringList entryKeys, groupKeys;
+    if(sortColumn == Label || sortColumn == Address)
+    {
+        for(unsigned int i = 0; i < entries.size(); i++)
+            entryKeys.append(entryText(entries[i], sortColumn));
+        for(unsigned int i = 0; i < groups.size(); i++)
+            groupKeys.append(sortColumn == Label ? labelText(groups[i].label) : groups[i].address);
+    }
+    if(fTreeMode)
+    {
+        std::stable_sort(vGroupOrder.begin(), vGroupOrder.end(), CoinControlLessThan(entries, groups, groupKeys, sortColumn, sortOrder, true));
+        for(unsigned int i = 0; i < vGroupOrder.size(); i++)
+        {
+            CoinControlGroup &group = groups[vGroupOrder[i]];
+            group.nRow = i;
+            std::stable_sort(group.vEntries.begin(), group.vEntries.end(), CoinControlLessThan(entries, groups, entryKeys, sortColumn, sortOrder, false));
+            for(unsigned int j = 0; j < group.vEntries.size(); j++)
+                entries[group.vEntries[j]].nRow = j;
+        }
+    }
+    else
+    {
+        std::stable_sort(vListOrder.begin(), vListOrder.end(), CoinControlLessThan(entries, groups, entryKeys, sortColumn, sortOrder, false));
+        for(unsigned int i = 0; i < vListOrder.size(); i++)
+            entries[vListOrder[i]].nRow = i;
+    }
+}
+
+QString CoinControlModel::labelText(const QString &label) const
+{
+    return label.isEmpty() ? tr("(no label)") : label;
+}
+
+QString CoinControlModel::entryText(const CoinControlEntry &entry, int column) const
+{
+    switch(column)
+    {
+    case Label:
+        // In tree mode, the label is shown for the address above
+        if(entry.fChange)
+            return tr("(change)");
+        return fTreeMode ? QString() : labelText(entry.label);
+    case Address:
+        // In tree mode, address is not shown again for direct wallet address outputs
+        return (fTreeMode && !entry.fChange) ? QString() : entry.address;
+    }
+    return QString();
+}
+
+void CoinControlModel::sort(int column, Qt::SortOrder order)
+{
+    if(column == Checkbox)
+        return;
+    sortColumn = column;
+    sortOrder = order;
+
+    emit layoutAboutToBeChanged();
+    // Remember what the persistent indexes (selection, current item) point at
+    QModelIndexList oldList = persistentIndexList();
+    std::vector<std::pair<int, int> > vItems; // entry or -(group + 1), column
+    foreach(const QModelIndex &index, oldList)
+    {
+        int nEntry = entryForIndex(index);
+        vItems.push_back(std::make_pair(nEntry >= 0 ? nEntry : -(groupForIndex(index) + 1), index.column()));
+    }
+    sortRows();
+    QModelIndexList newList;
+    for(unsigned int i = 0; i < vItems.size(); i++)
+    {
+        if(vItems[i].first >= 0)
+            newList.append(indexForEntry(vItems[i].first, vItems[i].second));
+        else
+            newList.append(indexForGroup(-vItems[i].first - 1, vItems[i].second));
+    }
+    changePersistentIndexList(oldList, newList);
+    emit layoutChanged();
+}
+
+void CoinControlModel::setTreeMode(bool fTreeMode)
+{
+    if(this->fTreeMode == fTreeMode)
+        return;
+    beginResetModel();
+    this->fTreeMode = fTreeMode;
+    sortRows();
+    endResetModel();
+}
+
+int CoinControlModel::entryForIndex(const QModelIndex &index) const
+{
+    if(!index.isValid())
+        return -1;
+    if(!fTreeMode)
+        return vListOrder[index.row()];
+    if(index.internalId() == 0)
+        return -1;
+    return groups[index.internalId() - 1].vEntries[index.row()];
+}
+
+int CoinControlModel::groupForIndex(const QModelIndex &index) const
+{
+    if(!index.isValid() || !fTreeMode || index.internalId() != 0)
+        return -1;
+    return vGroupOrder[index.row()];
+}
+
+QModelIndex CoinControlModel::indexForEntry(int nEntry, int column) const
+{
+    if(nEntry < 0)
+        return QModelIndex();
+    const CoinControlEntry &entry = entries[nEntry];
+    if(fTreeMode)
+        return createIndex(entry.nRow, column, entry.nGroup + 1);
+    return createIndex(entry.nRow, column);
+}
+
+QModelIndex CoinControlModel::indexForGroup(int nGroup, int column) const
+{
+    if(nGroup < 0 || !fTreeMode)
+        return QModelIndex();
+    return createIndex(groups[nGroup].nRow, column);
+}
+
+QModelIndex CoinControlModel::index(int row, int column, const QModelIndex &parent) const
+{
+    if(row < 0 || column < 0 || column >= columnCount())
+        return QModelIndex();
+    if(!parent.isValid())
+    {
+        if(row >= (fTreeMode ? (int)vGroupOrder.size() : (int)vListOrder.size()))
+            return QModelIndex();
+        return createIndex(row, column);
+    }
+    int nGroup = groupForIndex(parent);
+    if(nGroup < 0 || row >= (int)groups[nGroup].vEntries.size())
+        return QModelIndex();
+    return createIndex(row, column, nGroup + 1);
+}
+
+QModelIndex CoinControlModel::parent(const QModelIndex &index) const
+{
+    if(!index.isValid() || !fTreeMode || index.internalId() == 0)
+        return QModelIndex();
+    return indexForGroup(index.internalId() - 1, 0);
+}
+
+int CoinControlModel::rowCount(const QModelIndex &parent) const
+{
+    if(!parent.isValid())
+        return fTreeMode ? vGroupOrder.size() : vListOrder.size();
+    if(parent.column() != 0)
+        return 0;
+    int nGroup = groupForIndex(parent);
+    if(nGroup < 0)
+        return 0;
+    return groups[nGroup].vEntries.size();
+}
+
+int CoinControlModel::columnCount(const QModelIndex &parent) const
+{
+    Q_UNUSED(parent);
+    return Priority + 1;
+}
+
+QVariant CoinControlModel::data(const QModelIndex &index, int role) const
+{
+    if(!index.isValid())
+        return QVariant();
+    int nDisplayUnit = walletModel->getOptionsModel()->getDisplayUnit();
+
+    int nGroup = groupForIndex(index);
+    if(nGroup >= 0)
+    {
+        const CoinControlGroup &group = groups[nGroup];
+        QString sLabel = labelText(group.label);
+        switch(role)
+        {
+        case Qt::DisplayRole:
+            switch(index.column())
+            {
+            case Checkbox:
+                return "(" + QString::number(group.vEntries.size()) + ")";
+            case Amount:
+                return BitcoinUnits::format(nDisplayUnit, group.nValue);
+            case Label:
+                return sLabel;
+            case Address:
+                return group.address;
+            case Priority:
+                return CoinControlDialog::getPriorityLabel(group.GetPriority());
+            }
+            break;
+        case Qt::CheckStateRole:
+            if(index.column() == Checkbox)
+            {
+                if(group.nChecked == 0)
+                    return Qt::Unchecked;
+                return (group.nChecked == (int)group.vEntries.size()) ? Qt::Checked : Qt::PartiallyChecked;
+            }
+            break;
+        case TxHashRole:
+            return QString();
+        case AddressRole:
+            return group.address;
+        case LabelRole:
+            return sLabel;
+        case LockedRole:
+            return false;
+        }
+        return QVariant();
+    }
+
+    int nEntry = entryForIndex(index);
+    if(nEntry < 0)
+        return QVariant();
+    const CoinControlEntry &entry = entries[nEntry];
+    QString sLabel = entry.fChange ? tr("(change)") : labelText(entry.label);
+    switch(role)
+    {
+    case Qt::DisplayRole:
+        switch(index.column())
+        {
+        case Amount:
+            return BitcoinUnits::format(nDisplayUnit, entry.nValue);
+        case Label:
+        case Address:
+            return entryText(entry, index.column());
+        case Date:
+            return GUIUtil::dateTimeStr(entry.nTime);
+        case Confirmations:
+            return entry.nDepth;
+        case Priority:
+            return CoinControlDialog::getPriorityLabel(entry.GetPriority());
+        }
+        break;
+    case Qt::ToolTipRole:
+        if(index.column() == Label && entry.fChange)
+        {
+            // tooltip from where the change comes from
+            const CoinControlGroup &group = groups[entry.nGroup];
+            return tr("change from %1 (%2)").arg(labelText(group.label)).arg(group.address);
+        }
+        break;
+    case Qt::DecorationRole:
+        if(index.column() == Checkbox && entry.fLocked)
+            return QIcon(":/icons/lock_closed");
+        break;
+    case Qt::CheckStateRole:
+        if(index.column() == Checkbox)
+            return (coinControl && coinControl->IsSelected(entry.hash, entry.n)) ? Qt::Checked : Qt::Unchecked;
+        break;
+    case TxHashRole:
+        return QString::fromStdString(entry.hash.GetHex());
+    case VoutRole:
+        return entry.n;
+    case AddressRole:
+        return entry.address;
+    case LabelRole:
+        return sLabel;
+    case LockedRole:
+        return entry.fLocked;
+    }
+    return QVariant();
+}
+
+bool CoinControlModel::setData(const QModelIndex &index, const QVariant &value, int role)
+{
+    if(!index.isValid() || role != Qt::CheckStateRole || index.column() != Checkbox || !coinControl)
+        return false;
+    bool fChecked = (static_cast<Qt::CheckState>(value.toInt()) != Qt::Unchecked);
+
+    int nGroup = groupForIndex(index);
+    if(nGroup >= 0)
+    {
+        // Check or uncheck all outputs under the address
+        const CoinControlGroup &group = groups[nGroup];
+        bool fChanged = false;
+        BOOST_FOREACH(int nEntry, group.vEntries)
+            fChanged |= setEntryChecked(nEntry, fChecked);
+        if(!fChanged)
+            return false;
+        emit dataChanged(indexForGroup(nGroup, Checkbox), indexForGroup(nGroup, Priority));
+        if(!group.vEntries.empty())
+            emit dataChanged(this->index(0, Checkbox, index), this->index(group.vEntries.size() - 1, Priority, index));
+        emit totalsChanged();
+        return true;
+    }
+
+    int nEntry = entryForIndex(index);
+    if(nEntry < 0 || !setEntryChecked(nEntry, fChecked))
+        return false;
+    emitRowChanged(nEntry);
+    emit totalsChanged();
+    return true;
+}
+
+bool CoinControlModel::setEntryChecked(int nEntry, bool fChecked)
+{
+    CoinControlEntry &entry = entries[nEntry];
+    if(fChecked && entry.fLocked)
+        return false;
+    if(fChecked == coinControl->IsSelected(entry.hash, entry.n))
+        return false;
+
+    COutPoint outpt(entry.hash, entry.n);
+    if(fChecked)
+    {
+        coinControl->Select(outpt);
+        totals.Add(entry.nValue, entry.nDepth, entry.fUncompressed);
+        groups[entry.nGroup].nChecked++;
+    }
+    else
+    {
+        coinControl->UnSelect(outpt);
+        totals.Remove(entry.nValue, entry.nDepth, entry.fUncompressed);
+        groups[entry.nGroup].nChecked--;
+    }
+    return true;
+}
+
+void CoinControlModel::emitRowChanged(int nEntry)
+{
+    emit dataChanged(indexForEntry(nEntry, Checkbox), indexForEntry(nEntry, Priority));
+    if(fTreeMode)
+    {
+        int nGroup = entries[nEntry].nGroup;
+        emit dataChanged(indexForGroup(nGroup, Checkbox), indexForGroup(nGroup, Priority));
+    }
+}
+
+void CoinControlModel::setAllChecked(bool fChecked)
+{
+    if(!coinControl)
+        return;
+    for(unsigned int i = 0; i < entries.size(); i++)
+        setEntryChecked(i, fChecked);
+
+    // Every row may have changed
+    emit layoutAboutToBeChanged();
+    emit layoutChanged();
+    emit totalsChanged();
+}
+
+void CoinControlModel::setLocked(const QModelIndex &index, bool fLocked)
+{
+    int nEntry = entryForIndex(index);
+    if(nEntry < 0)
+        return;
+    CoinControlEntry &entry = entries[nEntry];
+    COutPoint outpt(entry.hash, entry.n);
+    if(fLocked)
+    {
+        if(coinControl && setEntryChecked(nEntry, false))
+            emit totalsChanged();
+        walletModel->lockCoin(outpt);
+    }
+    else
+    {
+        walletModel->unlockCoin(outpt);
+    }
+    entry.fLocked = fLocked;
+    emitRowChanged(nEntry);
+}
+
+Qt::ItemFlags CoinControlModel::flags(const QModelIndex &index) const
+{
+    if(!index.isValid())
+        return 0;
+    Qt::ItemFlags retval = Qt::ItemIsSelectable | Qt::ItemIsUserCheckable;
+    if(!data(index, LockedRole).toBool())
+        retval |= Qt::ItemIsEnabled;
+    return retval;
+}
+
+QVariant CoinControlModel::headerData(int section, Qt::Orientation orientation, int role) const
+{
+    if(orientation == Qt::Horizontal)
+    {
+        if(role == Qt::DisplayRole)
+        {
+            switch(section)
+            {
+            case Amount:
+                return tr("Amount");
+            case Label:
+                return tr("Label");
+            case Address:
+                return tr("Address");
+            case Date:
+                return tr("Date");
+            case Confirmations:
+                return tr("Confirmations");
+            case Priority:
+                return tr("Priority");
+            }
+        }
+        else if(role == Qt::ToolTipRole && section == Confirmations)
+        {
+            return tr("Confirmed");
+        }
+    }
+    return QVariant();
+}
+
+void CoinControlModel::updateDisplayUnit()
+{
+    // emit layoutChanged to update the Amount column of every row with the current unit
+    emit layoutAboutToBeChanged();
+    emit layoutChanged();
+}
@@ -0,0 +1,190 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef COINCONTROLMODEL_H
+#define COINCONTROLMODEL_H
+
+#include "uint256.h"
+
+#include <stdint.h>
+#include <vector>
+
+#include <QAbstractItemModel>
+#include <QString>
+
+class CoinControlLoader;
+class WalletModel;
+
+class CCoinControl;
+class CWallet;
+
+QT_BEGIN_NAMESPACE
+class QThread;
+QT_END_NAMESPACE
+
+/** Totals of the inputs selected with coin control, from which the
+ * dialogs estimate size, priority and fee.
+ */
+struct CoinControlTotals
+{
+    unsigned int nQuantity;
+    int64_t nAmount;
+    double dPriorityInputs;
+    unsigned int nBytesInputs;
+    int nQuantityUncompressed;
+
+    CoinControlTotals();
+
+    void Add(int64_t nValue, int nDepth, bool fUncompressed);
+    void Remove(int64_t nValue, int nDepth, bool fUncompressed);
+};
+
+/** An unspent output of the wallet, as listed by coin control */
+struct CoinControlEntry
+{
+    uint256 hash;
+    unsigned int n;
+    int64_t nValue;
+    int64_t nTime;
+    int nDepth;
+    /** Address and label of this output */
+    QString address;
+    QString label;
+    /** Change, listed under the address of the input it came from */
+    bool fChange;
+    /** Spent with an uncompressed public key */
+    bool fUncompressed;
+    bool fLocked;
+    /** Group of the address it is listed under, and its row in the current mode */
+    int nGroup;
+    int nRow;
+
+    CoinControlEntry();
+
+    double GetPriority() const;
+};
+
+/** The outputs listed under one address in tree mode */
+struct CoinControlGroup
+{
+    QString address;
+    QString label;
+    int64_t nValue;
+    double dPriorityInputs;
+    int nInputSize;
+    /** Outputs checked, in coin control */
+    int nChecked;
+    /** Outputs in their current order */
+    std::vector<int> vEntries;
+    int nRow;
+
+    CoinControlGroup();
+
+    double GetPriority() const;
+};
+
+/** Model of the unspent outputs of a wallet for the coin control dialog,
+ * grouped by address in tree mode and as a flat list otherwise.
+ *
+ * Outputs are enumerated on a worker thread by refresh(). Sorting is done by
+ * the model on the underlying values, and the totals of the outputs checked
+ * are kept as they are checked, rather than summed anew.
+ */
+class CoinControlModel : public QAbstractItemModel
+{
+    Q_OBJECT
+
+public:
+    explicit CoinControlModel(CWallet *wallet, WalletModel *parent = 0);
+    ~CoinControlModel();
+
+    enum ColumnIndex {
+        Checkbox = 0,
+        Amount = 1,
+        Label = 2,
+        Address = 3,
+        Date = 4,
+        Confirmations = 5,
+        Priority = 6
+    };
+
+    /** Roles to get specific information from a row.
+        These are independent of column.
+    */
+    enum RoleIndex {
+        /** Transaction hash, empty for an address in tree mode */
+        TxHashRole = Qt::UserRole,
+        /** Output index */
+        VoutRole,
+        /** Address of output or group */
+        AddressRole,
+        /** Label of address, or "(change)" */
+        LabelRole,
+        /** Is output locked? */
+        LockedRole
+    };
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const;
+    int columnCount(const QModelIndex &parent = QModelIndex()) const;
+    QVariant data(const QModelIndex &index, int role) const;
+    bool setData(const QModelIndex &index, const QVariant &value, int role);
+    QVariant headerData(int section, Qt::Orientation orientation, int role) const;
+    QModelIndex index(int row, int column, const QModelIndex &parent = QModelIndex()) const;
+    QModelIndex parent(const QModelIndex &index) const;
+    Qt::ItemFlags flags(const QModelIndex &index) const;
+    void sort(int column, Qt::SortOrder order = Qt::AscendingOrder);
+
+    /** Enumerate the outputs again on a worker thread, then emit loaded().
+        Outputs no longer available are removed from the coin control selection.
+    */
+    void refresh(CCoinControl *coinControl);
+    bool isLoading() const { return loader != 0; }
+
+    void setTreeMode(bool fTreeMode);
+    /** Check or uncheck all outputs that are not locked */
+    void setAllChecked(bool fChecked);
+    void setLocked(const QModelIndex &index, bool fLocked);
+
+    const CoinControlTotals &getTotals() const { return totals; }
+
+signals:
+    void loaded();
+    /** Outputs were checked or unchecked */
+    void totalsChanged();
+
+private:
+    CWallet *wallet;
+    WalletModel *walletModel;
+    CCoinControl *coinControl;
+    QThread *loaderThread;
+    CoinControlLoader *loader;
+
+    std::vector<CoinControlEntry> entries;
+    std::vector<CoinControlGroup> groups;
+    /** Top level rows in tree mode and in list mode */
+    std::vector<int> vGroupOrder;
+    std::vector<int> vListOrder;
+
+    bool fTreeMode;
+    int sortColumn;
+    Qt::SortOrder sortOrder;
+    CoinControlTotals totals;
+
+    void stopLoader();
+    void sortRows();
+    QString labelText(const QString &label) const;
+    QString entryText(const CoinControlEntry &entry, int column) const;
+    int entryForIndex(const QModelIndex &index) const;
+    int groupForIndex(const QModelIndex &index) const;
+    QModelIndex indexForEntry(int nEntry, int column) const;
+    QModelIndex indexForGroup(int nGroup, int column) const;
+    bool setEntryChecked(int nEntry, bool fChecked);
+    void emitRowChanged(int nEntry);
+
+private slots:
+    void loadEntries();
+    void updateDisplayUnit();
+};
+
+#endif // COINCONTROLMODEL_H
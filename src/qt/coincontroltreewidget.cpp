@@ -4,9 +4,10 @@
 
 #include "coincontroltreewidget.h"
 #include "coincontroldialog.h"
+#include "coincontrolmodel.h"
 
 CoinControlTreeWidget::CoinControlTreeWidget(QWidget *parent) :
-    QTreeWidget(parent)
+    QTreeView(parent)
 {
 
 }
@@ -16,8 +17,12 @@ void CoinControlTreeWidget::keyPressEvent(QKeyEvent *event)
     if (event->key() == Qt::Key_Space) // press spacebar -> select checkbox
     {
         event->ignore();
-        int COLUMN_CHECKBOX = 0;
-        this->currentItem()->setCheckState(COLUMN_CHECKBOX, ((this->currentItem()->checkState(COLUMN_CHECKBOX) == Qt::Checked) ? Qt::Unchecked : Qt::Checked));
+        QModelIndex index = this->currentIndex();
+        if (index.isValid() && model())
+        {
+            index = index.sibling(index.row(), CoinControlModel::Checkbox);
+            model()->setData(index, (index.data(Qt::CheckStateRole).toInt() == Qt::Checked) ? Qt::Unchecked : Qt::Checked, Qt::CheckStateRole);
+        }
     }
     else if (event->key() == Qt::Key_Escape) // press esc -> close dialog
     {
@@ -27,6 +32,6 @@ void CoinControlTreeWidget::keyPressEvent(QKeyEvent *event)
     }
     else
     {
-        this->QTreeWidget::keyPressEvent(event);
+        this->QTreeView::keyPressEvent(event);
     }
 }
\ No newline at end of file
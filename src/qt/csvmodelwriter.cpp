@@ -46,6 +46,19 @@ static void writeNewline(QTextStream &f)
     f << "\n";
 }
 
+void CSVModelWriter::writeRow(QTextStream &out, const QStringList &values)
+{
+    for(int i=0; i<values.size(); ++i)
+    {
+        if(i!=0)
+        {
+            writeSep(out);
+        }
+        writeValue(out, values[i]);
+    }
+    writeNewline(out);
+}
+
 bool CSVModelWriter::write()
 {
     QFile file(filename);
@@ -60,29 +73,23 @@ bool CSVModelWriter::write()
     }
 
     // Header row
+    QStringList values;
     for(int i=0; i<columns.size(); ++i)
     {
-        if(i!=0)
-        {
-            writeSep(out);
-        }
-        writeValue(out, columns[i].title);
+        values.append(columns[i].title);
     }
-    writeNewline(out);
+    writeRow(out, values);
 
     // Data rows
     for(int j=0; j<numRows; ++j)
     {
+        values.clear();
         for(int i=0; i<columns.size(); ++i)
         {
-            if(i!=0)
-            {
-                writeSep(out);
-            }
             QVariant data = model->index(j, columns[i].column).data(columns[i].role);
-            writeValue(out, data.toString());
+            values.append(data.toString());
         }
-        writeNewline(out);
+        writeRow(out, values);
     }
 
     file.close();
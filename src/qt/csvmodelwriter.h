@@ -7,9 +7,11 @@
 
 #include <QList>
 #include <QObject>
+#include <QStringList>
 
 QT_BEGIN_NAMESPACE
 class QAbstractItemModel;
+class QTextStream;
 QT_END_NAMESPACE
 
 /** Export a Qt table model to a CSV file. This is useful for analyzing or post-processing the data in
@@ -30,6 +32,9 @@ public:
     */
     bool write();
 
+    /** Write one row of values, quoted and escaped, and end the line. */
+    static void writeRow(QTextStream &out, const QStringList &values);
+
 private:
     QString filename;
     const QAbstractItemModel *model;
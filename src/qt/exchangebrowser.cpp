@@ -6,11 +6,14 @@
 #include "clientmodel.h"
 #include "rpcclient.h"
 
+#include <algorithm>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 
 #include <QDesktopServices>
 #include <QString>
+#include <QThread>
 
 using namespace json_spirit;
 
@@ -33,8 +36,191 @@ BittrexMarketSummary* _bittrexMarketSummary = new BittrexMarketSummary();
 BittrexTrades* _bittrexTrades = new BittrexTrades();
 BittrexOrders* _bittrexOrders = new BittrexOrders();
 
-ExchangeBrowser::ExchangeBrowser(QWidget* parent) : QWidget(parent), ui(new Ui::ExchangeBrowser)
+//Trades shown in the table and chart
+static const int BITTREX_TRADE_COUNT = 100;
+
+// Throws rather than asserts, so that a reply without some field is skipped
+static const mValue& GetPairValue(const mObject& obj, const std::string& name)
+{
+    mObject::const_iterator iter = obj.find(name);
+    if (iter == obj.end())
+        throw std::runtime_error("missing " + name);
+    return iter->second;
+}
+
+// Splits a Bittrex result array into objects that begin with firstKey
+static QStringList SplitBittrexObjects(QString apiResponse, const QString& firstKey)
+{
+    QStringList qslObjects = apiResponse.replace("},{", "}{").split("{", QString::SkipEmptyParts);
+    for (int i = 0; i < qslObjects.count(); i++)
+    {
+        //Fix missing leading brace caused by split string, otherwise it will not be recognized an an mObject
+        qslObjects[i].replace("\"" + firstKey, "{\"" + firstKey);
+
+        //json_spirit does not handle null so make it "null"
+        qslObjects[i].replace("null", "\"null\"");
+    }
+    return qslObjects;
+}
+
+static QList<BittrexOrders> ParseBittrexOrders(const QStringList& qslOrders, int depth, const std::string& orderType)
+{
+    QList<BittrexOrders> orders;
+    for (int i = 0; i < depth; i++)
+    {
+        mValue jsonResponse;
+        //Make sure the response is valid
+        if (!read_string(qslOrders[i].toStdString(), jsonResponse))
+            continue;
+        try
+        {
+            mObject jsonObject = jsonResponse.get_obj();
+            BittrexOrders order;
+            order.setQuantity(GetPairValue(jsonObject, "Quantity").get_real());
+            order.setPrice(GetPairValue(jsonObject, "Rate").get_real());
+            order.setOrderType(orderType);
+            orders.append(order);
+        }
+        catch (std::exception&) {} //API did not return all needed data so skip this order
+    }
+    return orders;
+}
+
+/** Parses the replies of the exchange APIs on a thread of its own, so that
+ * the GUI does not wait on it. The results are shown by ExchangeBrowser.
+ */
+class ExchangeParser : public QObject
 {
+    Q_OBJECT
+
+public slots:
+    void parseCoinbasePrice(const QByteArray& data)
+    {
+        mValue jsonResponse;
+        //Make sure the response is valid
+        if (!read_string(std::string(data.constData(), data.size()), jsonResponse))
+            return;
+        try
+        {
+            mObject jsonObject = jsonResponse.get_obj();
+            emit coinbasePriceParsed(QString::fromStdString(GetPairValue(jsonObject, "last").get_str()).toDouble());
+        }
+        catch (std::exception&) {}
+    }
+
+    void parseBittrexMarketSummary(const QByteArray& data)
+    {
+        QString apiResponse = QString::fromUtf8(data);
+        apiResponse = apiResponse.replace("{\"success\":true,\"message\":\"\",\"result\":[", "").replace("]}","");
+        QStringList qslApiResponse = SplitBittrexObjects(apiResponse, "MarketName");
+
+        for (int i = 0; i < qslApiResponse.count(); i++)
+        {
+            mValue jsonResponse;
+            //Make sure the response is valid
+            if (!read_string(qslApiResponse[i].toStdString(), jsonResponse))
+                continue;
+            try
+            {
+                mObject jsonObject = jsonResponse.get_obj();
+                if (GetPairValue(jsonObject, "MarketName").get_str() != "BTC-DGC")
+                    continue;
+
+                BittrexMarketSummary summary;
+                summary.setHighCurrent(GetPairValue(jsonObject, "High").get_real());
+                summary.setLowCurrent(GetPairValue(jsonObject, "Low").get_real());
+                summary.setVolumeCurrent(GetPairValue(jsonObject, "Volume").get_real());
+                summary.setLastCurrent(GetPairValue(jsonObject, "Last").get_real());
+                summary.setBaseVolumeCurrent(GetPairValue(jsonObject, "BaseVolume").get_real());
+                summary.setTimeStamp(GetPairValue(jsonObject, "TimeStamp").get_str());
+                summary.setBidCurrent(GetPairValue(jsonObject, "Bid").get_real());
+                summary.setAskCurrent(GetPairValue(jsonObject, "Ask").get_real());
+                summary.setPrevDayCurrent(GetPairValue(jsonObject, "PrevDay").get_real());
+                emit bittrexMarketSummaryParsed(summary);
+            }
+            catch (std::exception&) {} //API did not return all needed data so skip processing market summary
+            return;
+        }
+    }
+
+    void parseBittrexTrades(const QByteArray& data)
+    {
+        QString apiResponse = QString::fromUtf8(data);
+        apiResponse = apiResponse.replace("{\"success\":true,\"message\":\"\",\"result\":[", "").replace("]}","");
+        QStringList qslApiResponse = SplitBittrexObjects(apiResponse, "Id");
+
+        QList<BittrexTrades> trades;
+        for (int i = 0; i < qslApiResponse.count(); i++)
+        {
+            mValue jsonResponse;
+            //Make sure the response is valid
+            if (!read_string(qslApiResponse[i].toStdString(), jsonResponse))
+                continue;
+            try
+            {
+                mObject jsonObject = jsonResponse.get_obj();
+                BittrexTrades trade;
+                trade.setId(GetPairValue(jsonObject, "Id").get_real());
+                trade.setTimeStamp(GetPairValue(jsonObject, "TimeStamp").get_str());
+                trade.setQuantity(GetPairValue(jsonObject, "Quantity").get_real());
+                trade.setPrice(GetPairValue(jsonObject, "Price").get_real());
+                trade.setTotal(GetPairValue(jsonObject, "Total").get_real());
+                trade.setFillType(GetPairValue(jsonObject, "FillType").get_str());
+                trade.setOrderType(GetPairValue(jsonObject, "OrderType").get_str());
+                trades.append(trade);
+            }
+            catch (std::exception&) {} //API did not return all needed data so skip this trade
+        }
+        emit bittrexTradesParsed(trades);
+    }
+
+    void parseBittrexOrders(const QByteArray& data)
+    {
+        QString apiResponse = QString::fromUtf8(data);
+        apiResponse = apiResponse.replace("{\"success\":true,\"message\":\"\",\"result\":{\"buy\":[", "");
+        QStringList qslApiResponse = apiResponse.split("],\"sell\":[");
+        if (qslApiResponse.count() < 2)
+            return;
+
+        QStringList qslApiResponseBuys = SplitBittrexObjects(qslApiResponse[0], "Quantity");
+        QStringList qslApiResponseSells = SplitBittrexObjects(qslApiResponse[1].replace("]}}",""), "Quantity");
+
+        //Use shortest depth as limit, and no more than 50
+        int depth = std::min(std::min(qslApiResponseBuys.count(), qslApiResponseSells.count()), 50);
+
+        emit bittrexOrdersParsed(ParseBittrexOrders(qslApiResponseBuys, depth, "Buy"),
+                                 ParseBittrexOrders(qslApiResponseSells, depth, "Sell"));
+    }
+
+signals:
+    void coinbasePriceParsed(double price);
+    void bittrexMarketSummaryParsed(const BittrexMarketSummary& summary);
+    void bittrexTradesParsed(const QList<BittrexTrades>& trades);
+    void bittrexOrdersParsed(const QList<BittrexOrders>& buys, const QList<BittrexOrders>& sells);
+};
+
+#include "exchangebrowser.moc"
+
+ExchangeBrowser::ExchangeBrowser(QWidget* parent) : QWidget(parent), ui(new Ui::ExchangeBrowser),
+    model(0), dLastTradeId(0), nTradeKey(0)
+{
+    qRegisterMetaType<BittrexMarketSummary>("BittrexMarketSummary");
+    qRegisterMetaType<QList<BittrexTrades> >("QList<BittrexTrades>");
+    qRegisterMetaType<QList<BittrexOrders> >("QList<BittrexOrders>");
+
+    parserThread = new QThread();
+    parser = new ExchangeParser();
+    parser->moveToThread(parserThread);
+    connect(this, SIGNAL(parseCoinbasePrice(QByteArray)), parser, SLOT(parseCoinbasePrice(QByteArray)));
+    connect(this, SIGNAL(parseBittrexMarketSummary(QByteArray)), parser, SLOT(parseBittrexMarketSummary(QByteArray)));
+    connect(this, SIGNAL(parseBittrexTrades(QByteArray)), parser, SLOT(parseBittrexTrades(QByteArray)));
+    connect(this, SIGNAL(parseBittrexOrders(QByteArray)), parser, SLOT(parseBittrexOrders(QByteArray)));
+    connect(parser, SIGNAL(coinbasePriceParsed(double)), this, SLOT(showCoinbasePrice(double)));
+    connect(parser, SIGNAL(bittrexMarketSummaryParsed(BittrexMarketSummary)), this, SLOT(showBittrexMarketSummary(BittrexMarketSummary)));
+    connect(parser, SIGNAL(bittrexTradesParsed(QList<BittrexTrades>)), this, SLOT(showBittrexTrades(QList<BittrexTrades>)));
+    connect(parser, SIGNAL(bittrexOrdersParsed(QList<BittrexOrders>,QList<BittrexOrders>)), this, SLOT(showBittrexOrders(QList<BittrexOrders>,QList<BittrexOrders>)));
+    parserThread->start();
+
     //TODO: Complete multi-threading so we don't have to call this as a primer
     getRequest(apiCoinbasePrice);
 
@@ -43,11 +229,31 @@ ExchangeBrowser::ExchangeBrowser(QWidget* parent) : QWidget(parent), ui(new Ui::
 
     ui->qCustomPlotBittrexTrades->addGraph();
     ui->qCustomPlotBittrexTrades->setBackground(QBrush(QColor("#edf1f7")));
+    ui->qCustomPlotBittrexTrades->graph(0)->setPen(QPen(QColor(34, 177, 76)));
+    ui->qCustomPlotBittrexTrades->graph(0)->setBrush(QBrush(QColor(34, 177, 76, 20)));
+    ui->qCustomPlotBittrexTrades->graph(0)->setAdaptiveSampling(true);
 
     ui->qCustomPlotBittrexOrderDepth->addGraph();
     ui->qCustomPlotBittrexOrderDepth->addGraph();
     ui->qCustomPlotBittrexOrderDepth->setBackground(QBrush(QColor("#edf1f7")));
+    ui->qCustomPlotBittrexOrderDepth->graph(0)->setPen(QPen(QColor(34, 177, 76)));
+    ui->qCustomPlotBittrexOrderDepth->graph(0)->setBrush(QBrush(QColor(34, 177, 76, 20)));
+    ui->qCustomPlotBittrexOrderDepth->graph(0)->setAdaptiveSampling(true);
+    ui->qCustomPlotBittrexOrderDepth->graph(1)->setPen(QPen(QColor(237, 24, 35)));
+    ui->qCustomPlotBittrexOrderDepth->graph(1)->setBrush(QBrush(QColor(237, 24, 35, 20)));
+    ui->qCustomPlotBittrexOrderDepth->graph(1)->setAdaptiveSampling(true);
 
+    ui->tblBittrexTrades->setColumnWidth(0, 60);
+    ui->tblBittrexTrades->setColumnWidth(1, 110);
+    ui->tblBittrexTrades->setColumnWidth(2, 110);
+    ui->tblBittrexTrades->setColumnWidth(3, 100);
+    ui->tblBittrexTrades->setColumnWidth(4, 160);
+    ui->tblBittrexTrades->setSortingEnabled(false);
+
+    ui->qTreeWidgetBittrexBuy->sortByColumn(0, Qt::DescendingOrder);
+    ui->qTreeWidgetBittrexBuy->setSortingEnabled(true);
+    ui->qTreeWidgetBittrexSell->sortByColumn(0, Qt::AscendingOrder);
+    ui->qTreeWidgetBittrexSell->setSortingEnabled(true);
 
     QObject::connect(&m_nam, SIGNAL(finished(QNetworkReply*)), this, SLOT(parseNetworkResponse(QNetworkReply*)), Qt::AutoConnection);
 
@@ -144,15 +350,12 @@ void ExchangeBrowser::parseNetworkResponse(QNetworkReply* response)
  *************************************************************************************/
 void ExchangeBrowser::coinbasePrice(QNetworkReply* response)
 {
-    mValue jsonResponse = new mValue();
-    QString apiResponse = response->readAll();
-
-    //Make sure the response is valid
-    if(!read_string(apiResponse.toStdString(), jsonResponse)) { return; }
+    emit parseCoinbasePrice(response->readAll());
+}
 
-    mObject jsonObject = jsonResponse.get_obj();
-	
-    _dBtcPriceCurrent =  QString::fromStdString(getPairValue(jsonObject, "last").get_str()).toDouble();
+void ExchangeBrowser::showCoinbasePrice(double price)
+{
+    _dBtcPriceCurrent = price;
 
     _dBtcPriceLast = _dBtcPriceCurrent;
     _dScPriceLast = _dBtcPriceCurrent * _bittrexMarketSummary->getLastCurrent(double());
@@ -191,43 +394,22 @@ void ExchangeBrowser::coinbasePrice(QNetworkReply* response)
  *************************************************************************************/
 void ExchangeBrowser::bittrexMarketSummary(QNetworkReply* response)
 {
-    QString apiResponse = response->readAll();
-
-    apiResponse = apiResponse.replace("{\"success\":true,\"message\":\"\",\"result\":[", "").replace("]}","").replace("},{", "}{");
-
-    QStringList qslApiResponse = apiResponse.split("{", QString::SkipEmptyParts);
-
-    for(int i = 0; i < qslApiResponse.count(); i++){
-        mValue jsonResponse = new mValue();
-
-        //Fix missing leading brace caused by split string, otherwise it will not be recognized an an mObject
-        qslApiResponse[i].replace("\"MarketName", "{\"MarketName");
-
-        //json_spirit does not handle null so make it "null"
-        qslApiResponse[i].replace("null", "\"null\"");
-
-        //Make sure the response is valid
-        if(read_string(qslApiResponse[i].toStdString(), jsonResponse)) {
-            mObject jsonObject = jsonResponse.get_obj();
+    emit parseBittrexMarketSummary(response->readAll());
+}
 
-            if (getPairValue(jsonObject, "MarketName").get_str() == "BTC-DGC") {
-                try {
-                    _bittrexMarketSummary->setHighCurrent(getPairValue(jsonObject, "High").get_real());
-                    _bittrexMarketSummary->setLowCurrent(getPairValue(jsonObject, "Low").get_real());
-                    _bittrexMarketSummary->setVolumeCurrent(getPairValue(jsonObject, "Volume").get_real());
-                    _bittrexMarketSummary->setLastCurrent(getPairValue(jsonObject, "Last").get_real());
-                    _bittrexMarketSummary->setBaseVolumeCurrent(getPairValue(jsonObject, "BaseVolume").get_real());
-                    _bittrexMarketSummary->setTimeStamp(getPairValue(jsonObject, "TimeStamp").get_str());
-                    _bittrexMarketSummary->setBidCurrent(getPairValue(jsonObject, "Bid").get_real());
-                    _bittrexMarketSummary->setAskCurrent(getPairValue(jsonObject, "Ask").get_real());
-                    _bittrexMarketSummary->setPrevDayCurrent(getPairValue(jsonObject, "PrevDay").get_real());
-                }
-                catch (std::exception) {} //API did not return all needed data so skip processing market summary
-
-                break;
-            }
-        }
-    }
+void ExchangeBrowser::showBittrexMarketSummary(const BittrexMarketSummary& summary)
+{
+    //Keep the previous values, against which the labels show the change
+    BittrexMarketSummary current = summary;
+    current.setAskPrev(_bittrexMarketSummary->getAskPrev(double()));
+    current.setBaseVolumePrev(_bittrexMarketSummary->getBaseVolumePrev(double()));
+    current.setBidPrev(_bittrexMarketSummary->getBidPrev(double()));
+    current.setHighPrev(_bittrexMarketSummary->getHighPrev(double()));
+    current.setLowPrev(_bittrexMarketSummary->getLowPrev(double()));
+    current.setPrevDayPrev(_bittrexMarketSummary->getPrevDayPrev(double()));
+    current.setLastPrev(_bittrexMarketSummary->getLastPrev(double()));
+    current.setVolumePrev(_bittrexMarketSummary->getVolumePrev(double()));
+    *_bittrexMarketSummary = current;
 
     updateLabel(ui->lblBittrexHighBtc,
                 _bittrexMarketSummary->getHighCurrent(double()),
@@ -375,83 +557,46 @@ void ExchangeBrowser::bittrexMarketSummary(QNetworkReply* response)
  *************************************************************************************/
 void ExchangeBrowser::bittrexTrades(QNetworkReply* response)
 {
-    int z = 0;
-    double high, low = 100000;
-
-    ui->tblBittrexTrades->clear();
-    ui->tblBittrexTrades->setColumnWidth(0, 60);
-    ui->tblBittrexTrades->setColumnWidth(1, 110);
-    ui->tblBittrexTrades->setColumnWidth(2, 110);
-    ui->tblBittrexTrades->setColumnWidth(3, 100);
-    ui->tblBittrexTrades->setColumnWidth(4, 160);
-    ui->tblBittrexTrades->setSortingEnabled(false);
-
-    QString apiResponse = response->readAll();
-
-    apiResponse = apiResponse.replace("{\"success\":true,\"message\":\"\",\"result\":[", "").replace("]}","").replace("},{", "}{");
-
-    QStringList qslApiResponse = apiResponse.split("{", QString::SkipEmptyParts);
-
-    int tradeCount = qslApiResponse.count();
-    QVector<double> xAxis(tradeCount), yAxis(tradeCount);
-
-    for(int i = 0; i < tradeCount; i++){
-        mValue jsonResponse = new mValue();
-
-        //Fix missing leading brace caused by split string, otherwise it will not be recognized an an mObject
-        qslApiResponse[i].replace("\"Id", "{\"Id");
-
-        //json_spirit does not handle null so make it "null"
-        qslApiResponse[i].replace("null", "\"null\"");
-
-        //Make sure the response is valid
-        if(read_string(qslApiResponse[i].toStdString(), jsonResponse)) {
-            mObject jsonObject = jsonResponse.get_obj();
-
-            try
-            {
-                _bittrexTrades->setId(getPairValue(jsonObject, "Id").get_real());
-                _bittrexTrades->setTimeStamp(getPairValue(jsonObject, "TimeStamp").get_str());
-                _bittrexTrades->setQuantity(getPairValue(jsonObject, "Quantity").get_real());
-                _bittrexTrades->setPrice(getPairValue(jsonObject, "Price").get_real());
-                _bittrexTrades->setTotal(getPairValue(jsonObject, "Total").get_real());
-                _bittrexTrades->setFillType(getPairValue(jsonObject, "FillType").get_str());
-                _bittrexTrades->setOrderType(getPairValue(jsonObject, "OrderType").get_str());
-            }
-            catch (std::exception) {} //API did not return all needed data so skip this trade
+    emit parseBittrexTrades(response->readAll());
+}
 
-            QTreeWidgetItem * qtTrades = new QTreeWidgetItem();
+void ExchangeBrowser::showBittrexTrades(const QList<BittrexTrades>& trades)
+{
+    //Trades come newest first. Only those newer than the last shown are added,
+    //to the top of the table and the end of the chart.
+    int nNew = 0;
+    while (nNew < trades.count() && BittrexTrades(trades[nNew]).getId(double()) > dLastTradeId)
+        nNew++;
+    if (nNew == 0)
+        return;
+    dLastTradeId = BittrexTrades(trades[0]).getId(double());
 
-            qtTrades->setText(0, _bittrexTrades->getOrderType());
-            qtTrades->setText(1, _bittrexTrades->getPrice(QString()));
-            qtTrades->setText(2, _bittrexTrades->getQuantity(QString()));
-            qtTrades->setText(3, _bittrexTrades->getTotal(QString()));
-            qtTrades->setText(4, _bittrexTrades->getTimeStamp());
+    QCPGraph* graph = ui->qCustomPlotBittrexTrades->graph(0);
+    for (int i = nNew - 1; i >= 0; i--)
+    {
+        BittrexTrades trade = trades[i];
 
-            ui->tblBittrexTrades->addTopLevelItem(qtTrades);
+        QTreeWidgetItem * qtTrades = new QTreeWidgetItem();
 
-            xAxis[z] = tradeCount - z;
-            yAxis[z] = _bittrexTrades->getPrice(double()) * 100000000;
+        qtTrades->setText(0, trade.getOrderType());
+        qtTrades->setText(1, trade.getPrice(QString()));
+        qtTrades->setText(2, trade.getQuantity(QString()));
+        qtTrades->setText(3, trade.getTotal(QString()));
+        qtTrades->setText(4, trade.getTimeStamp());
 
-            high = _bittrexTrades->getPrice(double()) > high ? _bittrexTrades->getPrice(double()) : high;
-            low = _bittrexTrades->getPrice(double()) < low ? _bittrexTrades->getPrice(double()) : low;
+        ui->tblBittrexTrades->insertTopLevelItem(0, qtTrades);
 
-            z++;
-        }
+        graph->addData(++nTradeKey, trade.getPrice(double()) * 100000000);
     }
 
-    high *=  100000000;
-    low *=  100000000;
-
-    ui->qCustomPlotBittrexTrades->graph(0)->setData(xAxis, yAxis);
-    ui->qCustomPlotBittrexTrades->graph(0)->setPen(QPen(QColor(34, 177, 76)));
-    ui->qCustomPlotBittrexTrades->graph(0)->setBrush(QBrush(QColor(34, 177, 76, 20)));
-
-    ui->qCustomPlotBittrexTrades->xAxis->setRange(1, tradeCount);
-    ui->qCustomPlotBittrexTrades->yAxis->setRange(low, high);
+    while (ui->tblBittrexTrades->topLevelItemCount() > BITTREX_TRADE_COUNT)
+        delete ui->tblBittrexTrades->takeTopLevelItem(ui->tblBittrexTrades->topLevelItemCount() - 1);
 
-    ui->qCustomPlotBittrexTrades->replot();
+    graph->removeDataBefore(nTradeKey - BITTREX_TRADE_COUNT + 1);
+    ui->qCustomPlotBittrexTrades->xAxis->setRange(std::max(1, nTradeKey - BITTREX_TRADE_COUNT + 1), nTradeKey);
+    graph->rescaleValueAxis();
 
+    ui->qCustomPlotBittrexTrades->replot(QCustomPlot::rpQueued);
 }
 /*************************************************************************************
  * Method: ExchangeBrowser::bittrexOrders
@@ -493,139 +638,91 @@ void ExchangeBrowser::bittrexTrades(QNetworkReply* response)
  ************************************************************************************/
 void ExchangeBrowser::bittrexOrders(QNetworkReply* response)
 {
-    int z = 0;
-    double high = 0;
-    double low = 100000;
-    double sumBuys = 0;
-    double sumSells = 0;
-    double sumHighest = 0;
-
-    ui->qTreeWidgetBittrexBuy->clear();
-    ui->qTreeWidgetBittrexBuy->sortByColumn(0, Qt::DescendingOrder);
-    ui->qTreeWidgetBittrexBuy->setSortingEnabled(true);
-
-    ui->qTreeWidgetBittrexSell->clear();
-    ui->qTreeWidgetBittrexSell->sortByColumn(0, Qt::AscendingOrder);
-    ui->qTreeWidgetBittrexSell->setSortingEnabled(true);
-
-    QString apiResponse = response->readAll();
-
-    apiResponse = apiResponse.replace("{\"success\":true,\"message\":\"\",\"result\":{\"buy\":[", "");
-    QStringList qslApiResponse = apiResponse.split("],\"sell\":[");
-
-    QStringList qslApiResponseBuys = qslApiResponse[0].replace("},{", "}{").split("{", QString::SkipEmptyParts);
-    QStringList qslApiResponseSells = qslApiResponse[1].replace("]}}","").replace("},{", "}{").split("{", QString::SkipEmptyParts);
-
-    //Use shorest depth as limit and use buy length if they are the same
-    int depth = qslApiResponseBuys.length() > qslApiResponseSells.length()
-            ? qslApiResponseSells.length() : qslApiResponseSells.length() > qslApiResponseBuys.length()
-            ? qslApiResponseBuys.length() : qslApiResponseBuys.length();
-
-    //Prevent overflow by limiting depth to 50
-    //Also check for odd number of orders and drop the last one
-    //To avoid an overflow when there are less than 50 orders
-    depth = depth > 50
-            ? 50 : depth % 2 == 1
-            ? depth - 1 : depth;
-
-    QVector<double> xAxisBuys(depth), yAxisBuys(depth);
-    QVector<double> xAxisSells(depth), yAxisSells(depth);
-
-    for(int i = 0; i < depth; i++){
-        mValue jsonResponse = new mValue();
-
-        //Fix missing leading brace caused by split string, otherwise it will not be recognized an an mObject
-        qslApiResponseBuys[i].replace("\"Quantity", "{\"Quantity");
-        qslApiResponseSells[i].replace("\"Quantity", "{\"Quantity");
-
-        //json_spirit does not handle null so make it "null"
-        qslApiResponseBuys[i].replace("null", "\"null\"");
-        qslApiResponseSells[i].replace("null", "\"null\"");
-
-        //Make sure the response is valid
-        if(read_string(qslApiResponseBuys[i].toStdString(), jsonResponse)) {
-            mObject jsonObjectBuys = jsonResponse.get_obj();
-
-            try
-            {
-                _bittrexOrders->setQuantity(getPairValue(jsonObjectBuys, "Quantity").get_real());
-                _bittrexOrders->setPrice(getPairValue(jsonObjectBuys, "Rate").get_real());
-                _bittrexOrders->setOrderType("Buy");
-            }
-            catch (std::exception) {} //API did not return all needed data so skip this order
-
-            QTreeWidgetItem * qtBuys = new QTreeWidgetItem();
-
-            qtBuys->setText(0, _bittrexOrders->getPrice(QString()));
-            qtBuys->setText(1, _bittrexOrders->getQuantity(QString()));
-
-            ui->qTreeWidgetBittrexBuy->addTopLevelItem(qtBuys);
+    emit parseBittrexOrders(response->readAll());
+}
 
-            sumBuys += _bittrexOrders->getQuantity(double());
-            xAxisBuys[z] = _bittrexOrders->getPrice(double()) * 100000000;
-            yAxisBuys[z] = sumBuys;
+/** Brings the rows of an order book in line with orders, by price, touching
+ * only the rows that changed. Returns whether any did.
+ */
+static bool UpdateOrderTree(QTreeWidget* tree, QMap<QString, QTreeWidgetItem*>& rows, const QList<BittrexOrders>& orders)
+{
+    bool fChanged = false;
+    QMap<QString, QTreeWidgetItem*> rowsNew;
+    for (int i = 0; i < orders.count(); i++)
+    {
+        BittrexOrders order = orders[i];
+        QString price = order.getPrice(QString());
+        QString quantity = order.getQuantity(QString());
+
+        QTreeWidgetItem* item = rows.take(price);
+        if (!item)
+        {
+            item = new QTreeWidgetItem();
+            item->setText(0, price);
+            item->setText(1, quantity);
+            tree->addTopLevelItem(item);
+            fChanged = true;
         }
-
-        high = _bittrexOrders->getPrice(double()) > high ? _bittrexOrders->getPrice(double()) : high;
-        low = _bittrexOrders->getPrice(double()) < low ? _bittrexOrders->getPrice(double()) : low;
-
-        //Make sure the response is valid
-        if(read_string(qslApiResponseSells[i].toStdString(), jsonResponse)) {
-            mObject jsonObjectSells = jsonResponse.get_obj();
-
-            try
-            {
-                _bittrexOrders->setQuantity(getPairValue(jsonObjectSells, "Quantity").get_real());
-                _bittrexOrders->setPrice(getPairValue(jsonObjectSells, "Rate").get_real());
-                _bittrexOrders->setOrderType("Sell");
-            }
-            catch (std::exception) {} //API did not return all needed data so skip this order
-
-            QTreeWidgetItem * qtSells = new QTreeWidgetItem();
-
-            qtSells->setText(0, _bittrexOrders->getPrice(QString()));
-            qtSells->setText(1, _bittrexOrders->getQuantity(QString()));
-
-            ui->qTreeWidgetBittrexSell->addTopLevelItem(qtSells);
-
-            sumSells += _bittrexOrders->getQuantity(double());
-            xAxisSells[z] = _bittrexOrders->getPrice(double()) * 100000000;
-            yAxisSells[z] = sumSells;
+        else if (item->text(1) != quantity)
+        {
+            item->setText(1, quantity);
+            fChanged = true;
         }
+        rowsNew.insert(price, item);
+    }
 
-        high = _bittrexOrders->getPrice(double()) > high ? _bittrexOrders->getPrice(double()) : high;
-        low = _bittrexOrders->getPrice(double()) < low ? _bittrexOrders->getPrice(double()) : low;
+    //Whatever is left has been filled or cancelled
+    if (!rows.isEmpty())
+    {
+        qDeleteAll(rows);
+        fChanged = true;
+    }
+    rows = rowsNew;
+    return fChanged;
+}
 
-        z++;
+static void CumulativeDepth(const QList<BittrexOrders>& orders, QVector<double>& xAxis, QVector<double>& yAxis, double& sum)
+{
+    xAxis.resize(orders.count());
+    yAxis.resize(orders.count());
+    for (int i = 0; i < orders.count(); i++)
+    {
+        BittrexOrders order = orders[i];
+        sum += order.getQuantity(double());
+        xAxis[i] = order.getPrice(double()) * 100000000;
+        yAxis[i] = sum;
     }
+}
 
-    high *=  100000000;
-    low *=  100000000;
+void ExchangeBrowser::showBittrexOrders(const QList<BittrexOrders>& buys, const QList<BittrexOrders>& sells)
+{
+    bool fBuysChanged = UpdateOrderTree(ui->qTreeWidgetBittrexBuy, mapBittrexBuys, buys);
+    bool fSellsChanged = UpdateOrderTree(ui->qTreeWidgetBittrexSell, mapBittrexSells, sells);
 
-    sumHighest = sumBuys > sumSells ? sumBuys : sumBuys < sumSells ? sumSells : sumBuys;
+    //Depth is cumulative, so the curves are only computed again when the book changed
+    if (!fBuysChanged && !fSellsChanged)
+        return;
+
+    double sumBuys = 0;
+    double sumSells = 0;
+    QVector<double> xAxisBuys, yAxisBuys;
+    QVector<double> xAxisSells, yAxisSells;
+    CumulativeDepth(buys, xAxisBuys, yAxisBuys, sumBuys);
+    CumulativeDepth(sells, xAxisSells, yAxisSells, sumSells);
 
     ui->qCustomPlotBittrexOrderDepth->graph(0)->setData(xAxisBuys, yAxisBuys);
     ui->qCustomPlotBittrexOrderDepth->graph(1)->setData(xAxisSells, yAxisSells);
 
-    ui->qCustomPlotBittrexOrderDepth->graph(0)->setPen(QPen(QColor(34, 177, 76)));
-    ui->qCustomPlotBittrexOrderDepth->graph(0)->setBrush(QBrush(QColor(34, 177, 76, 20)));
-    ui->qCustomPlotBittrexOrderDepth->graph(1)->setPen(QPen(QColor(237, 24, 35)));
-    ui->qCustomPlotBittrexOrderDepth->graph(1)->setBrush(QBrush(QColor(237, 24, 35, 20)));
-
-    ui->qCustomPlotBittrexOrderDepth->xAxis->setRange(low, high);
-    ui->qCustomPlotBittrexOrderDepth->yAxis->setRange(low, sumHighest);
+    if (!buys.isEmpty() && !sells.isEmpty())
+        ui->qCustomPlotBittrexOrderDepth->xAxis->setRange(xAxisBuys.last(), xAxisSells.last());
+    ui->qCustomPlotBittrexOrderDepth->yAxis->setRange(0, std::max(sumBuys, sumSells));
 
-    ui->qCustomPlotBittrexOrderDepth->replot();
+    ui->qCustomPlotBittrexOrderDepth->replot(QCustomPlot::rpQueued);
 }
 
 const mValue& ExchangeBrowser::getPairValue(const mObject& obj, const std::string& name)
 {
-    mObject::const_iterator iter = obj.find(name);
-
-    assert(iter != obj.end());
-    assert(iter->first == name);
-
-    return iter->second;
+    return GetPairValue(obj, name);
 }
 
 void ExchangeBrowser::updateLabel(QLabel* qLabel, double d1, double d2, QString prefix, int decimalPlaces)
@@ -664,5 +761,10 @@ void ExchangeBrowser::setModel(ClientModel *model)
 
 ExchangeBrowser::~ExchangeBrowser()
 {
+    parserThread->quit();
+    parserThread->wait();
+    delete parser;
+    delete parserThread;
+
     delete ui;
 }
@@ -28,6 +28,14 @@ class ExchangeBrowser;
 }
 
 class ClientModel;
+class ExchangeParser;
+class BittrexMarketSummary;
+class BittrexTrades;
+class BittrexOrders;
+
+QT_BEGIN_NAMESPACE
+class QTreeWidgetItem;
+QT_END_NAMESPACE
 
 class ExchangeBrowser : public QWidget
 {
@@ -69,9 +77,20 @@ private:
 signals:
     void networkError(QNetworkReply::NetworkError err);
 
+    /** Replies are handed to the parser thread, which answers with the show slots */
+    void parseCoinbasePrice(const QByteArray& data);
+    void parseBittrexMarketSummary(const QByteArray& data);
+    void parseBittrexTrades(const QByteArray& data);
+    void parseBittrexOrders(const QByteArray& data);
+
 public slots:
     void parseNetworkResponse(QNetworkReply* response);
 
+    void showCoinbasePrice(double price);
+    void showBittrexMarketSummary(const BittrexMarketSummary& summary);
+    void showBittrexTrades(const QList<BittrexTrades>& trades);
+    void showBittrexOrders(const QList<BittrexOrders>& buys, const QList<BittrexOrders>& sells);
+
 private slots:
     void on_btnConvertSilkoin_clicked();
     void on_btnUpdateMarketData_clicked();
@@ -80,6 +99,16 @@ private:
     QNetworkAccessManager m_nam;
     Ui::ExchangeBrowser* ui;
     ClientModel* model;
+
+    QThread* parserThread;
+    ExchangeParser* parser;
+
+    /** Newest trade shown, and the chart key of it */
+    double dLastTradeId;
+    int nTradeKey;
+    /** Rows of the order books by price */
+    QMap<QString, QTreeWidgetItem*> mapBittrexBuys;
+    QMap<QString, QTreeWidgetItem*> mapBittrexSells;
 };
 
 class BittrexMarketSummary {
@@ -638,4 +667,8 @@ public:
     void setOrderType(std::string value) { _orderType = QString::fromStdString(value); }
 };
 
+Q_DECLARE_METATYPE(BittrexMarketSummary)
+Q_DECLARE_METATYPE(QList<BittrexTrades>)
+Q_DECLARE_METATYPE(QList<BittrexOrders>)
+
 #endif // POOLBROWSER_H
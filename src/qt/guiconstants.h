@@ -7,6 +7,8 @@
 
 /* Milliseconds between model updates */
 static const int MODEL_UPDATE_DELAY = 250;
+/* Milliseconds between wallet balance updates while catching up with the network */
+static const int MODEL_UPDATE_DELAY_SYNCING = 2000;
 
 /* AskPassphraseDialog -- Maximum passphrase length */
 static const int MAX_PASSPHRASE_SIZE = 1024;
@@ -14,11 +14,17 @@ RecentRequestsTableModel::RecentRequestsTableModel(CWallet *wallet, WalletModel
     Q_UNUSED(wallet);
     nReceiveRequestsMaxId = 0;
 
-    // Load entries from wallet
+    // Load entries from wallet. No view is attached yet, so they are added
+    // at once instead of being announced as inserted one row at a time.
     std::vector<std::string> vReceiveRequests;
     parent->loadReceiveRequests(vReceiveRequests);
+    list.reserve(vReceiveRequests.size());
     BOOST_FOREACH(const std::string& request, vReceiveRequests)
-        addNewRequest(request);
+    {
+        RecentRequestEntry entry;
+        if (readRequest(request, entry))
+            list.prepend(entry);
+    }
 
     /* These columns must match the indices in the ColumnIndex enumeration */
     columns << tr("Date") << tr("Label") << tr("Message") << tr("Amount");
@@ -153,22 +159,26 @@ void RecentRequestsTableModel::addNewRequest(const SendCoinsRecipient &recipient
     addNewRequest(newEntry);
 }
 
-// called from ctor when loading from wallet
-void RecentRequestsTableModel::addNewRequest(const std::string &recipient)
+bool RecentRequestsTableModel::readRequest(const std::string &recipient, RecentRequestEntry &entry)
 {
     std::vector<char> data(recipient.begin(), recipient.end());
     CDataStream ss(data, SER_DISK, CLIENT_VERSION);
 
-    RecentRequestEntry entry;
     ss >> entry;
 
     if (entry.id == 0) // should not happen
-        return;
+        return false;
 
     if (entry.id > nReceiveRequestsMaxId)
         nReceiveRequestsMaxId = entry.id;
+    return true;
+}
 
-    addNewRequest(entry);
+void RecentRequestsTableModel::addNewRequest(const std::string &recipient)
+{
+    RecentRequestEntry entry;
+    if (readRequest(recipient, entry))
+        addNewRequest(entry);
 }
 
 // actually add to table in GUI
@@ -97,6 +97,9 @@ private:
     QStringList columns;
     QList<RecentRequestEntry> list;
     int64_t nReceiveRequestsMaxId;
+
+    /** Deserialize a request stored in the wallet; false if it is unusable */
+    bool readRequest(const std::string &recipient, RecentRequestEntry &entry);
 };
 
 #endif
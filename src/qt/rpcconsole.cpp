@@ -7,6 +7,7 @@
 
 #include "clientmodel.h"
 #include "guiutil.h"
+#include "main.h"
 #include "util.h"
 
 #include "rpcserver.h"
@@ -441,6 +442,10 @@ void RPCConsole::on_tabWidget_currentChanged(int index)
     {
         ui->lineEdit->setFocus();
     }
+    else if(ui->tabWidget->widget(index) == ui->tab_memory)
+    {
+        updateMemoryUsage();
+    }
 }
 
 void RPCConsole::on_openDebugLogfileButton_clicked()
@@ -478,6 +483,14 @@ void RPCConsole::setTrafficGraphRange(int mins)
     ui->trafficGraph->setGraphRangeMins(mins);
     if(mins < 60) {
         ui->lblGraphRange->setText(QString(tr("%1 m")).arg(mins));
+    } else if(mins >= 24 * 60) {
+        int days = mins / (24 * 60);
+        int hoursLeft = mins % (24 * 60) / 60;
+        if(hoursLeft == 0) {
+            ui->lblGraphRange->setText(QString(tr("%1 d")).arg(days));
+        } else {
+            ui->lblGraphRange->setText(QString(tr("%1 d %2 h")).arg(days).arg(hoursLeft));
+        }
     } else {
         int hours = mins / 60;
         int minsLeft = mins % 60;
@@ -494,3 +507,35 @@ void RPCConsole::updateTrafficStats(quint64 totalBytesIn, quint64 totalBytesOut)
     ui->lblBytesIn->setText(FormatBytes(totalBytesIn));
     ui->lblBytesOut->setText(FormatBytes(totalBytesOut));
 }
+
+void RPCConsole::on_btnRefreshMemory_clicked()
+{
+    updateMemoryUsage();
+}
+
+void RPCConsole::updateMemoryUsage()
+{
+    if(!clientModel)
+        return;
+
+    CMemoryUsageStats stats;
+    clientModel->getMemoryUsage(stats);
+
+    const QString names[] = {
+        tr("Coins cache"), tr("Memory pool"), tr("Block index"), tr("Orphan transactions"),
+        tr("Orphan blocks"), tr("Peers"), tr("Signature cache"), tr("Wallet"), tr("Total")
+    };
+    const quint64 bytes[] = {
+        stats.nCoinsCache, stats.nMempool, stats.nBlockIndex, stats.nOrphanTransactions,
+        stats.nOrphanBlocks, stats.nPeers, stats.nSignatureCache, stats.nWallet, stats.GetTotal()
+    };
+
+    ui->memoryWidget->clear();
+    for(unsigned int i = 0; i < sizeof(bytes) / sizeof(bytes[0]); i++)
+    {
+        QTreeWidgetItem *item = new QTreeWidgetItem(ui->memoryWidget);
+        item->setText(0, names[i]);
+        item->setText(1, FormatBytes(bytes[i]));
+        item->setTextAlignment(1, Qt::AlignRight | Qt::AlignVCenter);
+    }
+}
@@ -44,6 +44,8 @@ private slots:
     void on_sldGraphRange_valueChanged(int value);
     /** update traffic statistics */
     void updateTrafficStats(quint64 totalBytesIn, quint64 totalBytesOut);
+    /** measure the memory usage again */
+    void on_btnRefreshMemory_clicked();
 
 public slots:
     void clear();
@@ -66,6 +68,7 @@ signals:
 private:
     static QString FormatBytes(quint64 bytes);
     void setTrafficGraphRange(int mins);
+    void updateMemoryUsage();
 
     Ui::RPCConsole *ui;
     ClientModel *clientModel;
@@ -9,6 +9,7 @@
 #include <QColor>
 #include <QTimer>
 
+#include <algorithm>
 #include <cmath>
 
 #define DESIRED_SAMPLES         800
@@ -16,18 +17,80 @@
 #define XMARGIN                 10
 #define YMARGIN                 10
 
+// Resolutions kept, and how many samples of each: an hour of seconds,
+// a week of minutes and 30 days of hours
+static const int TRAFFIC_TIERS[][2] = {
+    {1, 60 * 60},
+    {60, 7 * 24 * 60},
+    {60 * 60, 30 * 24}
+};
+
+TrafficSample::TrafficSample() :
+    in(0.0f), out(0.0f), blocksIn(0.0f), blocksOut(0.0f)
+{
+}
+
+void TrafficSample::add(const TrafficSample &sample)
+{
+    in += sample.in;
+    out += sample.out;
+    blocksIn += sample.blocksIn;
+    blocksOut += sample.blocksOut;
+}
+
+void TrafficSample::scale(float factor)
+{
+    in *= factor;
+    out *= factor;
+    blocksIn *= factor;
+    blocksOut *= factor;
+}
+
+TrafficRing::TrafficRing(int capacity) :
+    samples(capacity), head(0), count(0)
+{
+}
+
+void TrafficRing::push(const TrafficSample &sample)
+{
+    head = (head + 1) % samples.size();
+    samples[head] = sample;
+    if(count < (int)samples.size())
+        count++;
+}
+
+const TrafficSample &TrafficRing::at(int i) const
+{
+    return samples[(head - i + samples.size()) % samples.size()];
+}
+
+void TrafficRing::clear()
+{
+    head = 0;
+    count = 0;
+}
+
+TrafficTier::TrafficTier(int nSecsIn, int nCapacity) :
+    nSecs(nSecsIn), samples(nCapacity), sum(), nSummed(0)
+{
+}
+
 TrafficGraphWidget::TrafficGraphWidget(QWidget *parent) :
     QWidget(parent),
     timer(0),
-    fMax(0.0f),
     nMins(0),
-    vSamplesIn(),
-    vSamplesOut(),
+    vTiers(),
     nLastBytesIn(0),
     nLastBytesOut(0),
+    nLastBlockBytesIn(0),
+    nLastBlockBytesOut(0),
     clientModel(0)
 {
+    for(unsigned int i = 0; i < sizeof(TRAFFIC_TIERS) / sizeof(TRAFFIC_TIERS[0]); i++)
+        vTiers.push_back(TrafficTier(TRAFFIC_TIERS[i][0], TRAFFIC_TIERS[i][1]));
+
     timer = new QTimer(this);
+    timer->setInterval(1000);
     connect(timer, SIGNAL(timeout()), SLOT(updateRates()));
 }
 
@@ -37,6 +100,7 @@ void TrafficGraphWidget::setClientModel(ClientModel *model)
     if(model) {
         nLastBytesIn = model->getTotalBytesRecv();
         nLastBytesOut = model->getTotalBytesSent();
+        model->getTotalMessageBytes("block", nLastBlockBytesIn, nLastBlockBytesOut);
     }
 }
 
@@ -45,15 +109,23 @@ int TrafficGraphWidget::getGraphRangeMins() const
     return nMins;
 }
 
-void TrafficGraphWidget::paintPath(QPainterPath &path, QQueue<float> &samples)
+unsigned int TrafficGraphWidget::rangeTier() const
+{
+    for(unsigned int i = 0; i < vTiers.size(); i++)
+        if(vTiers[i].nSecs * vTiers[i].samples.capacity() >= nMins * 60)
+            return i;
+    return vTiers.size() - 1;
+}
+
+void TrafficGraphWidget::paintPath(QPainterPath &path, const std::vector<TrafficSample> &points, float TrafficSample::*rate, float fMax, int nPointSecs)
 {
     int h = height() - YMARGIN * 2, w = width() - XMARGIN * 2;
-    int sampleCount = samples.size(), x = XMARGIN + w, y;
+    int sampleCount = points.size(), x = XMARGIN + w, y;
     if(sampleCount > 0) {
         path.moveTo(x, YMARGIN + h);
         for(int i = 0; i < sampleCount; ++i) {
-            x = XMARGIN + w - w * i / DESIRED_SAMPLES;
-            y = YMARGIN + h - (int)(h * samples.at(i) / fMax);
+            x = XMARGIN + w - (int)((qint64)w * i * nPointSecs / (nMins * 60));
+            y = YMARGIN + h - (int)(h * points[i].*rate / fMax);
             path.lineTo(x, y);
         }
         path.lineTo(x, YMARGIN + h);
@@ -65,6 +137,25 @@ void TrafficGraphWidget::paintEvent(QPaintEvent *)
     QPainter painter(this);
     painter.fillRect(rect(), Qt::black);
 
+    if(nMins <= 0) return;
+
+    // Average the samples in range down to at most DESIRED_SAMPLES points
+    const TrafficTier &tier = vTiers[rangeTier()];
+    int nSamples = std::min(tier.samples.size(), (nMins * 60 + tier.nSecs - 1) / tier.nSecs);
+    int nPerPoint = std::max(1, (nSamples + DESIRED_SAMPLES - 1) / DESIRED_SAMPLES);
+    std::vector<TrafficSample> points;
+    points.reserve(nSamples / nPerPoint + 1);
+    float fMax = 0.0f;
+    for(int i = 0; i < nSamples; i += nPerPoint) {
+        int n = std::min(nPerPoint, nSamples - i);
+        TrafficSample point;
+        for(int j = 0; j < n; j++)
+            point.add(tier.samples.at(i + j));
+        point.scale(1.0f / n);
+        points.push_back(point);
+        fMax = std::max(fMax, std::max(point.in, point.out));
+    }
+
     if(fMax <= 0.0f) return;
 
     QColor axisCol(Qt::gray);
@@ -100,20 +191,59 @@ void TrafficGraphWidget::paintEvent(QPaintEvent *)
         }
     }
 
-    if(!vSamplesIn.empty()) {
+    int nPointSecs = nPerPoint * tier.nSecs;
+    if(!points.empty()) {
         QPainterPath p;
-        paintPath(p, vSamplesIn);
+        paintPath(p, points, &TrafficSample::in, fMax, nPointSecs);
         painter.fillPath(p, QColor(0, 255, 0, 128));
         painter.setPen(Qt::green);
         painter.drawPath(p);
+
+        // block messages, as a deeper fill under the total
+        QPainterPath pb;
+        paintPath(pb, points, &TrafficSample::blocksIn, fMax, nPointSecs);
+        painter.fillPath(pb, QColor(0, 255, 0, 96));
     }
-    if(!vSamplesOut.empty()) {
+    if(!points.empty()) {
         QPainterPath p;
-        paintPath(p, vSamplesOut);
+        paintPath(p, points, &TrafficSample::out, fMax, nPointSecs);
         painter.fillPath(p, QColor(255, 0, 0, 128));
         painter.setPen(Qt::red);
         painter.drawPath(p);
+
+        QPainterPath pb;
+        paintPath(pb, points, &TrafficSample::blocksOut, fMax, nPointSecs);
+        painter.fillPath(pb, QColor(255, 0, 0, 96));
+    }
+}
+
+void TrafficGraphWidget::addSample(const TrafficSample &sample)
+{
+    unsigned int nRangeTier = rangeTier();
+    bool fChanged = false;
+
+    // Each tier sums its samples towards one of the next
+    TrafficSample next = sample;
+    for(unsigned int i = 0; i < vTiers.size(); i++) {
+        TrafficTier &tier = vTiers[i];
+        tier.samples.push(next);
+        if(i == nRangeTier)
+            fChanged = true;
+        if(i + 1 == vTiers.size())
+            break;
+
+        tier.sum.add(next);
+        if(++tier.nSummed < vTiers[i + 1].nSecs / tier.nSecs)
+            break;
+        next = tier.sum;
+        next.scale(1.0f / tier.nSummed);
+        tier.sum = TrafficSample();
+        tier.nSummed = 0;
     }
+
+    // Ranges drawn from minutes or hours only change when one is complete
+    if(fChanged)
+        update();
 }
 
 void TrafficGraphWidget::updateRates()
@@ -122,52 +252,48 @@ void TrafficGraphWidget::updateRates()
 
     quint64 bytesIn = clientModel->getTotalBytesRecv(),
             bytesOut = clientModel->getTotalBytesSent();
-    float inRate = (bytesIn - nLastBytesIn) / 1024.0f * 1000 / timer->interval();
-    float outRate = (bytesOut - nLastBytesOut) / 1024.0f * 1000 / timer->interval();
-    vSamplesIn.push_front(inRate);
-    vSamplesOut.push_front(outRate);
+    quint64 blockBytesIn, blockBytesOut;
+    clientModel->getTotalMessageBytes("block", blockBytesIn, blockBytesOut);
+
+    float toRate = 1000.0f / 1024.0f / timer->interval();
+    TrafficSample sample;
+    sample.in = (bytesIn - nLastBytesIn) * toRate;
+    sample.out = (bytesOut - nLastBytesOut) * toRate;
+    // blocks received are counted once processed, so may trail the total
+    sample.blocksIn = std::min(sample.in, (blockBytesIn - nLastBlockBytesIn) * toRate);
+    sample.blocksOut = std::min(sample.out, (blockBytesOut - nLastBlockBytesOut) * toRate);
     nLastBytesIn = bytesIn;
     nLastBytesOut = bytesOut;
+    nLastBlockBytesIn = blockBytesIn;
+    nLastBlockBytesOut = blockBytesOut;
 
-    while(vSamplesIn.size() > DESIRED_SAMPLES) {
-        vSamplesIn.pop_back();
-    }
-    while(vSamplesOut.size() > DESIRED_SAMPLES) {
-        vSamplesOut.pop_back();
-    }
-
-    float tmax = 0.0f;
-    foreach(float f, vSamplesIn) {
-        if(f > tmax) tmax = f;
-    }
-    foreach(float f, vSamplesOut) {
-        if(f > tmax) tmax = f;
-    }
-    fMax = tmax;
-    update();
+    addSample(sample);
 }
 
 void TrafficGraphWidget::setGraphRangeMins(int mins)
 {
+    // History is kept for all ranges, so changing it only redraws
     nMins = mins;
-    int msecsPerSample = nMins * 60 * 1000 / DESIRED_SAMPLES;
-    timer->stop();
-    timer->setInterval(msecsPerSample);
-
-    clear();
+    if(!timer->isActive())
+        timer->start();
+    update();
 }
 
 void TrafficGraphWidget::clear()
 {
     timer->stop();
 
-    vSamplesOut.clear();
-    vSamplesIn.clear();
-    fMax = 0.0f;
+    for(unsigned int i = 0; i < vTiers.size(); i++) {
+        vTiers[i].samples.clear();
+        vTiers[i].sum = TrafficSample();
+        vTiers[i].nSummed = 0;
+    }
 
     if(clientModel) {
         nLastBytesIn = clientModel->getTotalBytesRecv();
         nLastBytesOut = clientModel->getTotalBytesSent();
+        clientModel->getTotalMessageBytes("block", nLastBlockBytesIn, nLastBlockBytesOut);
     }
+    update();
     timer->start();
 }
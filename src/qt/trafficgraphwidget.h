@@ -5,16 +5,70 @@
 #ifndef TRAFFICGRAPHWIDGET_H
 #define TRAFFICGRAPHWIDGET_H
 
+#include <vector>
+
 #include <QWidget>
-#include <QQueue>
 
 class ClientModel;
 
 QT_BEGIN_NAMESPACE
 class QPaintEvent;
+class QPainterPath;
 class QTimer;
 QT_END_NAMESPACE
 
+/** Traffic rates in KB/s over one sample period */
+struct TrafficSample
+{
+    float in;
+    float out;
+    /** Part of in and out that was block messages */
+    float blocksIn;
+    float blocksOut;
+
+    TrafficSample();
+
+    void add(const TrafficSample &sample);
+    void scale(float factor);
+};
+
+/** Fixed number of samples, the newest overwriting the oldest */
+class TrafficRing
+{
+public:
+    explicit TrafficRing(int capacity);
+
+    void push(const TrafficSample &sample);
+    /** Sample i periods before the newest one */
+    const TrafficSample &at(int i) const;
+    int size() const { return count; }
+    int capacity() const { return (int)samples.size(); }
+    void clear();
+
+private:
+    std::vector<TrafficSample> samples;
+    int head;
+    int count;
+};
+
+/** Samples of one resolution, and the ones summed towards the next */
+struct TrafficTier
+{
+    int nSecs;
+    TrafficRing samples;
+    TrafficSample sum;
+    int nSummed;
+
+    TrafficTier(int nSecsIn, int nCapacity);
+};
+
+/** Graph of network traffic over a range of up to 30 days.
+ *
+ * Samples are taken every second and kept at one second, one minute and one
+ * hour resolution, each in a ring of its own, so history costs the same
+ * memory however long the node runs. A range is drawn from the finest
+ * resolution that covers it, averaged down to at most DESIRED_SAMPLES points.
+ */
 class TrafficGraphWidget : public QWidget
 {
     Q_OBJECT
@@ -33,15 +87,18 @@ public slots:
     void clear();
 
 private:
-    void paintPath(QPainterPath &path, QQueue<float> &samples);
+    /** Tier the current range is drawn from */
+    unsigned int rangeTier() const;
+    void addSample(const TrafficSample &sample);
+    void paintPath(QPainterPath &path, const std::vector<TrafficSample> &points, float TrafficSample::*rate, float fMax, int nPointSecs);
 
     QTimer *timer;
-    float fMax;
     int nMins;
-    QQueue<float> vSamplesIn;
-    QQueue<float> vSamplesOut;
+    std::vector<TrafficTier> vTiers;
     quint64 nLastBytesIn;
     quint64 nLastBytesOut;
+    quint64 nLastBlockBytesIn;
+    quint64 nLastBlockBytesOut;
     ClientModel *clientModel;
 };
 
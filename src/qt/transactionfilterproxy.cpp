@@ -18,8 +18,9 @@ const QDateTime TransactionFilterProxy::MAX_DATE = QDateTime::fromTime_t(0xFFFFF
 
 TransactionFilterProxy::TransactionFilterProxy(QObject *parent) :
     QSortFilterProxyModel(parent),
-    dateFrom(MIN_DATE),
-    dateTo(MAX_DATE),
+    transactionModel(0),
+    timeFrom(MIN_DATE.toTime_t()),
+    timeTo(MAX_DATE.toTime_t()),
     addrPrefix(),
     typeFilter(ALL_TYPES),
     minAmount(0),
@@ -30,33 +31,44 @@ TransactionFilterProxy::TransactionFilterProxy(QObject *parent) :
 
 bool TransactionFilterProxy::filterAcceptsRow(int sourceRow, const QModelIndex &sourceParent) const
 {
-    QModelIndex index = sourceModel()->index(sourceRow, 0, sourceParent);
-
-    int type = index.data(TransactionTableModel::TypeRole).toInt();
-    QDateTime datetime = index.data(TransactionTableModel::DateRole).toDateTime();
-    QString address = index.data(TransactionTableModel::AddressRole).toString();
-    QString label = index.data(TransactionTableModel::LabelRole).toString();
-    qint64 amount = llabs(index.data(TransactionTableModel::AmountRole).toLongLong());
-    int status = index.data(TransactionTableModel::StatusRole).toInt();
-
-    if(!showInactive && status == TransactionStatus::Conflicted)
+    if(!transactionModel)
+        return true;
+    QModelIndex index = transactionModel->index(sourceRow, 0, sourceParent);
+    const TransactionRecord *rec = static_cast<const TransactionRecord*>(index.internalPointer());
+    if(!rec)
         return false;
-    if(!(TYPE(type) & typeFilter))
+
+    // Cheapest checks first; the address and label are only built when
+    // there is text to look for
+    if(!showInactive && rec->status.status == TransactionStatus::Conflicted)
         return false;
-    if(datetime < dateFrom || datetime > dateTo)
+    if(!(TYPE(rec->type) & typeFilter))
         return false;
-    if (!address.contains(addrPrefix, Qt::CaseInsensitive) && !label.contains(addrPrefix, Qt::CaseInsensitive))
+    qint64 time = static_cast<uint>(rec->time);
+    if(time < timeFrom || time > timeTo)
         return false;
-    if(amount < minAmount)
+    if(llabs(rec->credit + rec->debit) < minAmount)
         return false;
+    if(!addrPrefix.isEmpty())
+    {
+        if(!QString::fromStdString(rec->address).contains(addrPrefix, Qt::CaseInsensitive) &&
+           !transactionModel->labelForAddress(rec->address).contains(addrPrefix, Qt::CaseInsensitive))
+            return false;
+    }
 
     return true;
 }
 
+void TransactionFilterProxy::setSourceModel(QAbstractItemModel *sourceModel)
+{
+    transactionModel = qobject_cast<TransactionTableModel*>(sourceModel);
+    QSortFilterProxyModel::setSourceModel(sourceModel);
+}
+
 void TransactionFilterProxy::setDateRange(const QDateTime &from, const QDateTime &to)
 {
-    this->dateFrom = from;
-    this->dateTo = to;
+    this->timeFrom = from.toTime_t();
+    this->timeTo = to.toTime_t();
     invalidateFilter();
 }
 
@@ -8,7 +8,13 @@
 #include <QDateTime>
 #include <QSortFilterProxyModel>
 
-/** Filter the transaction list according to pre-specified rules. */
+class TransactionTableModel;
+
+/** Filter the transaction list according to pre-specified rules. The rules
+    are checked against the records of the TransactionTableModel directly,
+    rather than through formatted data, so that filtering a long history keeps
+    up with typing.
+ */
 class TransactionFilterProxy : public QSortFilterProxyModel
 {
     Q_OBJECT
@@ -40,13 +46,16 @@ public:
     void setShowInactive(bool showInactive);
 
     int rowCount(const QModelIndex &parent = QModelIndex()) const;
+    void setSourceModel(QAbstractItemModel *sourceModel);
 
 protected:
     bool filterAcceptsRow(int source_row, const QModelIndex & source_parent) const;
 
 private:
-    QDateTime dateFrom;
-    QDateTime dateTo;
+    TransactionTableModel *transactionModel;
+    // Date range as seconds since the epoch, as in TransactionRecord::time
+    qint64 timeFrom;
+    qint64 timeTo;
     QString addrPrefix;
     quint32 typeFilter;
     qint64 minAmount;
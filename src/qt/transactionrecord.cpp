@@ -21,6 +21,12 @@ bool TransactionRecord::showTransaction(const CWalletTx &wtx)
             return false;
         }
     }
+    // Transactions of watch-only addresses alone neither credit nor debit
+    // the wallet
+    else if (wtx.GetDebit() == 0 && wtx.GetCredit(true) == 0)
+    {
+        return false;
+    }
     return true;
 }
 
@@ -156,31 +162,35 @@ QList<TransactionRecord> TransactionRecord::decomposeTransaction(const CWallet *
 
 void TransactionRecord::updateStatus(const CWalletTx &wtx)
 {
-    AssertLockHeld(cs_main);
     // Determine transaction status
 
     // Find the block the tx is in
-    CBlockIndex* pindex = NULL;
-    std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(wtx.hashBlock);
-    if (mi != mapBlockIndex.end())
-        pindex = (*mi).second;
+    int nBlockHeight = std::numeric_limits<int>::max();
+    int numBlocks;
+    {
+        LOCK(cs_chainview);
+        BlockMap::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+        if (mi != mapBlockIndex.end() && mi->second)
+            nBlockHeight = mi->second->nHeight;
+        numBlocks = chainActive.Height();
+    }
 
     // Sort order, unrecorded transactions sort to the top
     status.sortKey = strprintf("%010d-%01d-%010u-%03d",
-        (pindex ? pindex->nHeight : std::numeric_limits<int>::max()),
+        nBlockHeight,
         (wtx.IsCoinBase() ? 1 : 0),
         wtx.nTimeReceived,
         idx);
     status.countsForBalance = wtx.IsTrusted() && !(wtx.GetBlocksToMaturity() > 0);
     status.depth = wtx.GetDepthInMainChain();
-    status.cur_num_blocks = chainActive.Height();
+    status.cur_num_blocks = numBlocks;
 
-    if (!IsFinalTx(wtx, chainActive.Height() + 1))
+    if (!IsFinalTx(wtx, numBlocks + 1))
     {
         if (wtx.nLockTime < LOCKTIME_THRESHOLD)
         {
             status.status = TransactionStatus::OpenUntilBlock;
-            status.open_for = wtx.nLockTime - chainActive.Height();
+            status.open_for = wtx.nLockTime - numBlocks;
         }
         else
         {
@@ -239,10 +249,9 @@ void TransactionRecord::updateStatus(const CWalletTx &wtx)
 
 }
 
-bool TransactionRecord::statusUpdateNeeded()
+bool TransactionRecord::statusUpdateNeeded(int numBlocks) const
 {
-    AssertLockHeld(cs_main);
-    return status.cur_num_blocks != chainActive.Height();
+    return status.cur_num_blocks != numBlocks;
 }
 
 QString TransactionRecord::getTxID() const
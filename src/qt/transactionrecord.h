@@ -127,13 +127,13 @@ public:
     /** Format subtransaction id */
     static QString formatSubTxId(const uint256 &hash, int vout);
 
-    /** Update status from core wallet tx.
+    /** Update status from core wallet tx. Requires the wallet lock, but not cs_main.
      */
     void updateStatus(const CWalletTx &wtx);
 
-    /** Return whether a status update is needed.
+    /** Return whether a status update is needed, given the height of the chain.
      */
-    bool statusUpdateNeeded();
+    bool statusUpdateNeeded(int numBlocks) const;
 };
 
 #endif // TRANSACTIONRECORD_H
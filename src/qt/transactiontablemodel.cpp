@@ -24,6 +24,8 @@
 #include <QDebug>
 #include <QIcon>
 #include <QList>
+#include <QMutex>
+#include <QThread>
 
 // Amount column is right-aligned it contains numbers
 static int column_alignments[] = {
@@ -51,14 +53,112 @@ struct TxLessThan
     }
 };
 
+// Number of wallet transactions decomposed per hold of the wallet lock
+static const int LOAD_BATCH_SIZE = 1000;
+
+/** Decomposes the transactions of a wallet into records on a worker thread,
+ * a batch at a time in order of hash, so that opening a large wallet does not
+ * block the GUI. Batches are picked up by the model with takeRecords().
+ */
+class TransactionTableLoader : public QObject
+{
+    Q_OBJECT
+
+public:
+    TransactionTableLoader(CWallet *wallet) :
+        wallet(wallet), fDone(false), fAbort(false)
+    {
+    }
+
+    /* Take the records loaded since the last call, with the hash of the last
+     * wallet transaction they cover. Returns whether all are loaded.
+     */
+    bool takeRecords(QList<TransactionRecord> &recordsOut, uint256 &hashLastOut)
+    {
+        QMutexLocker locker(&mutex);
+        recordsOut.append(records);
+        records.clear();
+        hashLastOut = hashLast;
+        return fDone;
+    }
+
+    void abort()
+    {
+        QMutexLocker locker(&mutex);
+        fAbort = true;
+    }
+
+public slots:
+    void load()
+    {
+        bool fFirst = true;
+        uint256 hashNext;
+        while (true)
+        {
+            {
+                QMutexLocker locker(&mutex);
+                if (fAbort)
+                    return;
+            }
+
+            QList<TransactionRecord> batch;
+            LOCK(wallet->cs_wallet);
+            std::map<uint256, CWalletTx>::iterator it = fFirst ? wallet->mapWallet.begin() : wallet->mapWallet.upper_bound(hashNext);
+            for (int n = 0; it != wallet->mapWallet.end() && n < LOAD_BATCH_SIZE; ++it, ++n)
+            {
+                if (TransactionRecord::showTransaction(it->second))
+                {
+                    QList<TransactionRecord> parts = TransactionRecord::decomposeTransaction(wallet, it->second);
+                    for (int i = 0; i < parts.size(); i++)
+                        parts[i].updateStatus(it->second);
+                    batch.append(parts);
+                }
+                hashNext = it->first;
+                fFirst = false;
+            }
+            bool fEnd = (it == wallet->mapWallet.end());
+            {
+                QMutexLocker locker(&mutex);
+                records.append(batch);
+                hashLast = hashNext;
+                fDone = fEnd;
+            }
+            // Emitted with the wallet locked, so that the model receives it
+            // before the notification of any later change to these transactions
+            emit recordsLoaded();
+            if (fEnd)
+                return;
+        }
+    }
+
+signals:
+    void recordsLoaded();
+
+private:
+    CWallet *wallet;
+
+    QMutex mutex;
+    QList<TransactionRecord> records;
+    uint256 hashLast;
+    bool fDone;
+    bool fAbort;
+};
+
+#include "transactiontablemodel.moc"
+
 // Private implementation
 class TransactionTablePriv
 {
 public:
     TransactionTablePriv(CWallet *wallet, TransactionTableModel *parent) :
         wallet(wallet),
-        parent(parent)
+        parent(parent),
+        cachedNumBlocks(0),
+        fLoading(true),
+        fLoadedAny(false)
     {
+        LOCK(cs_chainview);
+        cachedNumBlocks = chainActive.Height();
     }
 
     CWallet *wallet;
@@ -70,20 +170,43 @@ public:
      */
     QList<TransactionRecord> cachedWallet;
 
-    /* Query entire wallet anew from core.
+    /* Height of the chain when confirmations were last updated */
+    int cachedNumBlocks;
+
+    /* While the loader runs, transactions up to hashLoaded are in the model
+     * or in loadedRecords, and changes to later ones are picked up by the
+     * loader itself.
      */
-    void refreshWallet()
+    bool fLoading;
+    bool fLoadedAny;
+    uint256 hashLoaded;
+    QList<TransactionRecord> loadedRecords;
+
+    /* Add records from the loader. Their hashes all follow those in the
+     * model. Adding a few rows at a time to a sorted proxy costs time
+     * proportional to its size for each row, so the model is reset instead,
+     * each time the records waiting would at least double it.
+     */
+    void addLoaded(const QList<TransactionRecord> &records, const uint256 &hashLast, bool fDone)
     {
-        qDebug() << "TransactionTablePriv::refreshWallet";
-        cachedWallet.clear();
-        {
-            LOCK2(cs_main, wallet->cs_wallet);
-            for(std::map<uint256, CWalletTx>::iterator it = wallet->mapWallet.begin(); it != wallet->mapWallet.end(); ++it)
-            {
-                if(TransactionRecord::showTransaction(it->second))
-                    cachedWallet.append(TransactionRecord::decomposeTransaction(wallet, it->second));
-            }
-        }
+        loadedRecords.append(records);
+        hashLoaded = hashLast;
+        fLoadedAny = true;
+        if (fDone)
+            fLoading = false;
+        if (fDone || loadedRecords.size() >= std::max(LOAD_BATCH_SIZE, cachedWallet.size()))
+            publishLoaded();
+    }
+
+    void publishLoaded()
+    {
+        if (loadedRecords.isEmpty())
+            return;
+        qDebug() << "TransactionTablePriv::publishLoaded : " + QString::number(loadedRecords.size()) + " records";
+        parent->beginResetModel();
+        cachedWallet.append(loadedRecords);
+        loadedRecords.clear();
+        parent->endResetModel();
     }
 
     /* Update our model of the wallet incrementally, to synchronize our model of the wallet
@@ -94,8 +217,17 @@ public:
     void updateWallet(const uint256 &hash, int status)
     {
         qDebug() << "TransactionTablePriv::updateWallet : " + QString::fromStdString(hash.ToString()) + " " + QString::number(status);
+        if (fLoading)
         {
-            LOCK2(cs_main, wallet->cs_wallet);
+            if (!fLoadedAny || hashLoaded < hash)
+            {
+                qDebug() << "TransactionTablePriv::updateWallet : Not loaded yet";
+                return;
+            }
+            publishLoaded();
+        }
+        {
+            LOCK(wallet->cs_wallet);
 
             // Find transaction in wallet
             std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(hash);
@@ -147,8 +279,9 @@ public:
                     {
                         parent->beginInsertRows(QModelIndex(), lowerIndex, lowerIndex+toInsert.size()-1);
                         int insert_idx = lowerIndex;
-                        foreach(const TransactionRecord &rec, toInsert)
+                        foreach(TransactionRecord rec, toInsert)
                         {
+                            rec.updateStatus(mi->second);
                             cachedWallet.insert(insert_idx, rec);
                             insert_idx += 1;
                         }
@@ -168,46 +301,69 @@ public:
                 parent->endRemoveRows();
                 break;
             case CT_UPDATED:
-                // Miscellaneous updates -- nothing to do, status update will take care of this, and is only computed for
-                // visible transactions.
+                // Miscellaneous updates -- the status may have changed, for
+                // example when the transaction conflicts with another
+                if(inModel)
+                {
+                    for(QList<TransactionRecord>::iterator it = lower; it != upper; ++it)
+                        it->updateStatus(mi->second);
+                    emit parent->dataChanged(parent->index(lowerIndex, 0), parent->index(upperIndex-1, TransactionTableModel::Amount));
+                }
                 break;
             }
         }
     }
 
-    int size()
+    /* Bring records up to date with the chain in one pass under the wallet
+     * lock, and tell the views which rows changed. Confirmed records only
+     * change in their number of confirmations, which is updated when it is
+     * shown, so they are left out unless fAll is set. Returns false when the
+     * wallet is busy.
+     */
+    bool updateStatuses(bool fAll)
     {
-        return cachedWallet.size();
-    }
+        TRY_LOCK(wallet->cs_wallet, lockWallet);
+        if(!lockWallet)
+            return false;
 
-    TransactionRecord *index(int idx)
-    {
-        if(idx >= 0 && idx < cachedWallet.size())
+        int first = -1;
+        for(int i = 0; i <= cachedWallet.size(); i++)
         {
-            TransactionRecord *rec = &cachedWallet[idx];
-
-            // Get required locks upfront. This avoids the GUI from getting
-            // stuck if the core is holding the locks for a longer time - for
-            // example, during a wallet rescan.
-            //
-            // If a status update is needed (blocks came in since last check),
-            //  update the status of this transaction from the wallet. Otherwise,
-            // simply re-use the cached status.
-            TRY_LOCK(cs_main, lockMain);
-            if(lockMain)
+            bool update = false;
+            if(i < cachedWallet.size())
             {
-                TRY_LOCK(wallet->cs_wallet, lockWallet);
-                if(lockWallet && rec->statusUpdateNeeded())
+                TransactionRecord &rec = cachedWallet[i];
+                if(fAll || rec.status.status != TransactionStatus::Confirmed)
                 {
-                    std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(rec->hash);
-
+                    std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(rec.hash);
                     if(mi != wallet->mapWallet.end())
                     {
-                        rec->updateStatus(mi->second);
+                        rec.updateStatus(mi->second);
+                        update = true;
                     }
                 }
             }
-            return rec;
+            if(update && first < 0)
+                first = i;
+            else if(!update && first >= 0)
+            {
+                emit parent->dataChanged(parent->index(first, 0), parent->index(i-1, TransactionTableModel::Amount));
+                first = -1;
+            }
+        }
+        return true;
+    }
+
+    int size()
+    {
+        return cachedWallet.size();
+    }
+
+    TransactionRecord *index(int idx)
+    {
+        if(idx >= 0 && idx < cachedWallet.size())
+        {
+            return &cachedWallet[idx];
         }
         else
         {
@@ -215,6 +371,27 @@ public:
         }
     }
 
+    /* Update the status of a record if blocks came in since it was last
+     * updated. Try the lock only. This avoids the GUI from getting stuck if
+     * the core is holding it for a longer time - for example, during a
+     * wallet rescan - in which case the cached status is used.
+     */
+    void updateStatus(TransactionRecord *rec)
+    {
+        if(!rec->statusUpdateNeeded(cachedNumBlocks))
+            return;
+        TRY_LOCK(wallet->cs_wallet, lockWallet);
+        if(lockWallet)
+        {
+            std::map<uint256, CWalletTx>::iterator mi = wallet->mapWallet.find(rec->hash);
+
+            if(mi != wallet->mapWallet.end())
+            {
+                rec->updateStatus(mi->second);
+            }
+        }
+    }
+
     QString describe(TransactionRecord *rec, int unit)
     {
         {
@@ -233,20 +410,85 @@ TransactionTableModel::TransactionTableModel(CWallet* wallet, WalletModel *paren
         QAbstractTableModel(parent),
         wallet(wallet),
         walletModel(parent),
-        priv(new TransactionTablePriv(wallet, this))
+        priv(new TransactionTablePriv(wallet, this)),
+        loaderThread(0),
+        loader(0)
 {
     columns << QString() << tr("Date") << tr("Type") << tr("Address") << tr("Amount");
 
-    priv->refreshWallet();
+    startLoader();
 
     connect(walletModel->getOptionsModel(), SIGNAL(displayUnitChanged(int)), this, SLOT(updateDisplayUnit()));
+
+    AddressTableModel *addressModel = walletModel->getAddressTableModel();
+    connect(addressModel, SIGNAL(dataChanged(QModelIndex,QModelIndex)), this, SLOT(clearLabelCache()));
+    connect(addressModel, SIGNAL(rowsInserted(QModelIndex,int,int)), this, SLOT(clearLabelCache()));
+    connect(addressModel, SIGNAL(rowsRemoved(QModelIndex,int,int)), this, SLOT(clearLabelCache()));
+    connect(addressModel, SIGNAL(modelReset()), this, SLOT(clearLabelCache()));
 }
 
 TransactionTableModel::~TransactionTableModel()
 {
+    stopLoader();
     delete priv;
 }
 
+void TransactionTableModel::startLoader()
+{
+    loaderThread = new QThread();
+    loader = new TransactionTableLoader(wallet);
+    loader->moveToThread(loaderThread);
+
+    // Batches from the loader are added by this object
+    connect(loader, SIGNAL(recordsLoaded()), this, SLOT(loadRecords()));
+    // Queued, so that it runs in the event loop of the thread and quit()
+    // takes effect once it returns
+    connect(loaderThread, SIGNAL(started()), loader, SLOT(load()), Qt::QueuedConnection);
+
+    loaderThread->start();
+}
+
+void TransactionTableModel::stopLoader()
+{
+    if(!loaderThread)
+        return;
+    loader->abort();
+    loaderThread->quit();
+    loaderThread->wait();
+    delete loader;
+    delete loaderThread;
+    loader = 0;
+    loaderThread = 0;
+}
+
+void TransactionTableModel::loadRecords()
+{
+    if(!loader)
+        return;
+    QList<TransactionRecord> records;
+    uint256 hashLast;
+    bool fDone = loader->takeRecords(records, hashLast);
+    priv->addLoaded(records, hashLast, fDone);
+    if(fDone)
+        stopLoader();
+}
+
+void TransactionTableModel::clearLabelCache()
+{
+    cachedLabels.clear();
+}
+
+QString TransactionTableModel::labelForAddress(const std::string &address) const
+{
+    QString strAddress = QString::fromStdString(address);
+    QHash<QString, QString>::const_iterator it = cachedLabels.constFind(strAddress);
+    if(it != cachedLabels.constEnd())
+        return it.value();
+    QString label = walletModel->getAddressTableModel()->labelForAddress(strAddress);
+    cachedLabels.insert(strAddress, label);
+    return label;
+}
+
 void TransactionTableModel::updateTransaction(const QString &hash, int status)
 {
     uint256 updated;
@@ -258,9 +500,19 @@ void TransactionTableModel::updateTransaction(const QString &hash, int status)
 void TransactionTableModel::updateConfirmations()
 {
     // Blocks came in since last poll.
-    // Invalidate status (number of confirmations) and (possibly) description
-    //  for all rows. Qt is smart enough to only actually request the data for the
-    //  visible rows.
+    int numBlocks;
+    {
+        LOCK(cs_chainview);
+        numBlocks = chainActive.Height();
+    }
+    // After a reorganization any record may have changed
+    bool fReorganized = numBlocks < priv->cachedNumBlocks;
+    priv->cachedNumBlocks = numBlocks;
+    if(priv->updateStatuses(fReorganized))
+        return;
+
+    // Wallet busy: invalidate status (number of confirmations) and (possibly)
+    //  description for all rows, to be updated as they are requested.
     emit dataChanged(index(0, Status), index(priv->size()-1, Status));
     emit dataChanged(index(0, ToAddress), index(priv->size()-1, ToAddress));
 }
@@ -335,7 +587,7 @@ QString TransactionTableModel::formatTxDate(const TransactionRecord *wtx) const
  */
 QString TransactionTableModel::lookupAddress(const std::string &address, bool tooltip) const
 {
-    QString label = walletModel->getAddressTableModel()->labelForAddress(QString::fromStdString(address));
+    QString label = labelForAddress(address);
     QString description;
     if(!label.isEmpty())
     {
@@ -413,8 +665,7 @@ QVariant TransactionTableModel::addressColor(const TransactionRecord *wtx) const
     case TransactionRecord::SendToAddress:
     case TransactionRecord::Generated:
         {
-        QString label = walletModel->getAddressTableModel()->labelForAddress(QString::fromStdString(wtx->address));
-        if(label.isEmpty())
+        if(labelForAddress(wtx->address).isEmpty())
             return COLOR_BAREADDRESS;
         } break;
     case TransactionRecord::SendToSelf:
@@ -491,6 +742,11 @@ QVariant TransactionTableModel::data(const QModelIndex &index, int role) const
         return QVariant();
     TransactionRecord *rec = static_cast<TransactionRecord*>(index.internalPointer());
 
+    // Statuses are kept up to date by updateConfirmations(), except for the
+    // number of confirmations of confirmed transactions
+    if(role == Qt::ToolTipRole || rec->status.cur_num_blocks < 0)
+        priv->updateStatus(rec);
+
     switch(role)
     {
     case Qt::DecorationRole:
@@ -559,7 +815,7 @@ QVariant TransactionTableModel::data(const QModelIndex &index, int role) const
     case AddressRole:
         return QString::fromStdString(rec->address);
     case LabelRole:
-        return walletModel->getAddressTableModel()->labelForAddress(QString::fromStdString(rec->address));
+        return labelForAddress(rec->address);
     case AmountRole:
         return rec->credit + rec->debit;
     case TxIDRole:
@@ -613,7 +869,7 @@ QModelIndex TransactionTableModel::index(int row, int column, const QModelIndex
     TransactionRecord *data = priv->index(row);
     if(data)
     {
-        return createIndex(row, column, priv->index(row));
+        return createIndex(row, column, data);
     }
     else
     {
@@ -6,12 +6,18 @@
 #define TRANSACTIONTABLEMODEL_H
 
 #include <QAbstractTableModel>
+#include <QHash>
 #include <QStringList>
 
 class TransactionRecord;
+class TransactionTableLoader;
 class TransactionTablePriv;
 class WalletModel;
 
+QT_BEGIN_NAMESPACE
+class QThread;
+QT_END_NAMESPACE
+
 class CWallet;
 
 /** UI model for the transaction table of a wallet.
@@ -66,23 +72,40 @@ public:
     QVariant headerData(int section, Qt::Orientation orientation, int role) const;
     QModelIndex index(int row, int column, const QModelIndex & parent = QModelIndex()) const;
 
+    /** Label of an address in the address book, empty if it has none */
+    QString labelForAddress(const std::string &address) const;
+    QString formatTxType(const TransactionRecord *wtx) const;
+
 private:
     CWallet* wallet;
     WalletModel *walletModel;
     QStringList columns;
     TransactionTablePriv *priv;
+    QThread *loaderThread;
+    TransactionTableLoader *loader;
+    /* Labels looked up so far, by address; each lookup in the address book
+     * takes the wallet lock and decodes the address */
+    mutable QHash<QString, QString> cachedLabels;
+
+    void startLoader();
+    void stopLoader();
 
     QString lookupAddress(const std::string &address, bool tooltip) const;
     QVariant addressColor(const TransactionRecord *wtx) const;
     QString formatTxStatus(const TransactionRecord *wtx) const;
     QString formatTxDate(const TransactionRecord *wtx) const;
-    QString formatTxType(const TransactionRecord *wtx) const;
     QString formatTxToAddress(const TransactionRecord *wtx, bool tooltip) const;
     QString formatTxAmount(const TransactionRecord *wtx, bool showUnconfirmed=true) const;
     QString formatTooltip(const TransactionRecord *rec) const;
     QVariant txStatusDecoration(const TransactionRecord *wtx) const;
     QVariant txAddressDecoration(const TransactionRecord *wtx) const;
 
+private slots:
+    /** Add the records decomposed by the loader since the last call */
+    void loadRecords();
+    /** Forget the cached labels when the address book changes */
+    void clearLabelCache();
+
 public slots:
     void updateTransaction(const QString &hash, int status);
     void updateConfirmations();
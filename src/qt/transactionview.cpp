@@ -19,24 +19,120 @@
 #include "ui_interface.h"
 
 #include <QComboBox>
+#include <QDateTime>
 #include <QDateTimeEdit>
 #include <QDesktopServices>
 #include <QDoubleValidator>
+#include <QFile>
+#include <QHash>
 #include <QHBoxLayout>
 #include <QHeaderView>
 #include <QLabel>
 #include <QLineEdit>
 #include <QMenu>
+#include <QMutex>
 #include <QPoint>
+#include <QProgressDialog>
 #include <QScrollBar>
 #include <QSignalMapper>
 #include <QTableView>
+#include <QTextStream>
+#include <QThread>
 #include <QUrl>
 #include <QVBoxLayout>
 
+// Rows written between progress reports and checks for cancellation
+static const int EXPORT_PROGRESS_ROWS = 1000;
+
+/** Writes transaction records to a CSV file on a worker thread. It works on
+ * copies of the records shown, with their labels and type names looked up
+ * beforehand, so neither the models nor the wallet are touched while it runs.
+ */
+class TransactionExporter : public QObject
+{
+    Q_OBJECT
+
+public:
+    TransactionExporter(const QString &filename, const QList<TransactionRecord> &records,
+                        const QHash<QString, QString> &labels, const QHash<int, QString> &typeNames, int unit) :
+        filename(filename), records(records), labels(labels), typeNames(typeNames), unit(unit), fAbort(false)
+    {
+        header << tr("Confirmed") << tr("Date") << tr("Type") << tr("Label") << tr("Address") << tr("Amount") << tr("ID");
+    }
+
+    void abort()
+    {
+        QMutexLocker locker(&mutex);
+        fAbort = true;
+    }
+
+public slots:
+    void write()
+    {
+        QFile file(filename);
+        bool fSuccess = file.open(QIODevice::WriteOnly | QIODevice::Text);
+        if(fSuccess)
+        {
+            QTextStream out(&file);
+            CSVModelWriter::writeRow(out, header);
+            // Same formatting as the roles the model exported with
+            QStringList values;
+            for(int i = 0; i < records.size(); i++)
+            {
+                if(i % EXPORT_PROGRESS_ROWS == 0)
+                {
+                    if(aborted())
+                    {
+                        fSuccess = false;
+                        break;
+                    }
+                    emit progress(i);
+                }
+                const TransactionRecord &rec = records[i];
+                QString address = QString::fromStdString(rec.address);
+                values.clear();
+                values << QVariant(rec.status.countsForBalance).toString()
+                       << QDateTime::fromTime_t(static_cast<uint>(rec.time)).toString(Qt::ISODate)
+                       << typeNames.value(rec.type)
+                       << labels.value(address)
+                       << address
+                       << BitcoinUnits::format(unit, rec.credit + rec.debit)
+                       << rec.getTxID();
+                CSVModelWriter::writeRow(out, values);
+            }
+            out.flush();
+            file.close();
+            fSuccess = fSuccess && file.error() == QFile::NoError;
+        }
+        emit finished(fSuccess);
+    }
+
+signals:
+    void progress(int rows);
+    void finished(bool fSuccess);
+
+private:
+    QString filename;
+    QList<TransactionRecord> records;
+    QHash<QString, QString> labels;
+    QHash<int, QString> typeNames;
+    int unit;
+    QStringList header;
+    QMutex mutex;
+    bool fAbort;
+
+    bool aborted()
+    {
+        QMutexLocker locker(&mutex);
+        return fAbort;
+    }
+};
+
+#include "transactionview.moc"
+
 TransactionView::TransactionView(QWidget *parent) :
     QWidget(parent), model(0), transactionProxyModel(0),
-    transactionView(0)
+    transactionView(0), exportThread(0), exporter(0), exportProgress(0)
 {
     // Build filter row
     setContentsMargins(0,0,0,0);
@@ -162,6 +258,13 @@ TransactionView::TransactionView(QWidget *parent) :
     connect(showDetailsAction, SIGNAL(triggered()), this, SLOT(showDetails()));
 }
 
+TransactionView::~TransactionView()
+{
+    if(exporter)
+        exporter->abort();
+    stopExport();
+}
+
 void TransactionView::setModel(WalletModel *model)
 {
     this->model = model;
@@ -297,31 +400,94 @@ void TransactionView::exportClicked()
         tr("Export Transaction History"), QString(),
         tr("Comma separated file (*.csv)"), NULL);
 
-    if (filename.isNull())
+    if (filename.isNull() || exportThread)
         return;
 
-    CSVModelWriter writer(filename);
+    // Copy the rows shown, in the order shown. Labels and type names are
+    // looked up once per distinct value, here, as the models and the wallet
+    // may only be used from this thread.
+    TransactionTableModel *tableModel = model->getTransactionTableModel();
+    QList<TransactionRecord> records;
+    QHash<QString, QString> labels;
+    QHash<int, QString> typeNames;
+    int numRows = transactionProxyModel->rowCount();
+    records.reserve(numRows);
+    for(int i = 0; i < numRows; i++)
+    {
+        QModelIndex index = transactionProxyModel->mapToSource(transactionProxyModel->index(i, 0));
+        const TransactionRecord *rec = static_cast<const TransactionRecord*>(index.internalPointer());
+        if(!rec)
+            continue;
+        records.append(*rec);
+        QString address = QString::fromStdString(rec->address);
+        if(!labels.contains(address))
+            labels.insert(address, tableModel->labelForAddress(rec->address));
+        if(!typeNames.contains(rec->type))
+            typeNames.insert(rec->type, tableModel->formatTxType(rec));
+    }
+
+    exportFilename = filename;
+    exportProgress = new QProgressDialog(tr("Exporting transaction history..."), tr("Cancel"), 0, records.size(), this);
+    exportProgress->setWindowModality(Qt::WindowModal);
+    exportProgress->setAutoClose(false);
+    exportProgress->setAutoReset(false);
+    exportProgress->setMinimumDuration(500);
 
-    // name, column, role
-    writer.setModel(transactionProxyModel);
-    writer.addColumn(tr("Confirmed"), 0, TransactionTableModel::ConfirmedRole);
-    writer.addColumn(tr("Date"), 0, TransactionTableModel::DateRole);
-    writer.addColumn(tr("Type"), TransactionTableModel::Type, Qt::EditRole);
-    writer.addColumn(tr("Label"), 0, TransactionTableModel::LabelRole);
-    writer.addColumn(tr("Address"), 0, TransactionTableModel::AddressRole);
-    writer.addColumn(tr("Amount"), 0, TransactionTableModel::FormattedAmountRole);
-    writer.addColumn(tr("ID"), 0, TransactionTableModel::TxIDRole);
+    exportThread = new QThread();
+    exporter = new TransactionExporter(filename, records, labels, typeNames, model->getOptionsModel()->getDisplayUnit());
+    exporter->moveToThread(exportThread);
 
-    if(!writer.write()) {
-        emit message(tr("Exporting Failed"), tr("There was an error trying to save the transaction history to %1.").arg(filename),
+    connect(exporter, SIGNAL(progress(int)), exportProgress, SLOT(setValue(int)));
+    connect(exporter, SIGNAL(finished(bool)), this, SLOT(exportFinished(bool)));
+    connect(exportProgress, SIGNAL(canceled()), this, SLOT(exportCanceled()));
+    connect(exportThread, SIGNAL(started()), exporter, SLOT(write()), Qt::QueuedConnection);
+
+    exportThread->start();
+}
+
+void TransactionView::exportCanceled()
+{
+    if(exporter)
+        exporter->abort();
+}
+
+void TransactionView::exportFinished(bool fSuccess)
+{
+    bool fCanceled = exportProgress && exportProgress->wasCanceled();
+    stopExport();
+
+    if(fCanceled) {
+        QFile::remove(exportFilename);
+    }
+    else if(!fSuccess) {
+        emit message(tr("Exporting Failed"), tr("There was an error trying to save the transaction history to %1.").arg(exportFilename),
             CClientUIInterface::MSG_ERROR);
     }
     else {
-        emit message(tr("Exporting Successful"), tr("The transaction history was successfully saved to %1.").arg(filename),
+        emit message(tr("Exporting Successful"), tr("The transaction history was successfully saved to %1.").arg(exportFilename),
             CClientUIInterface::MSG_INFORMATION);
     }
 }
 
+void TransactionView::stopExport()
+{
+    if(!exportThread)
+        return;
+    exportThread->quit();
+    exportThread->wait();
+    delete exporter;
+    delete exportThread;
+    exporter = 0;
+    exportThread = 0;
+    if(exportProgress)
+    {
+        // May be called from within the dialog's own event processing
+        exportProgress->hide();
+        exportProgress->deleteLater();
+        exportProgress = 0;
+    }
+}
+
 void TransactionView::contextualMenu(const QPoint &point)
 {
     QModelIndex index = transactionView->indexAt(point);
@@ -9,6 +9,7 @@
 
 #include <QWidget>
 
+class TransactionExporter;
 class TransactionFilterProxy;
 class WalletModel;
 
@@ -19,8 +20,10 @@ class QFrame;
 class QLineEdit;
 class QMenu;
 class QModelIndex;
+class QProgressDialog;
 class QSignalMapper;
 class QTableView;
+class QThread;
 QT_END_NAMESPACE
 
 /** Widget showing the transaction list for a wallet, including a filter row.
@@ -32,6 +35,7 @@ class TransactionView : public QWidget
 
 public:
     explicit TransactionView(QWidget *parent = 0);
+    ~TransactionView();
 
     void setModel(WalletModel *model);
 
@@ -76,6 +80,14 @@ private:
 
     GUIUtil::TableViewLastColumnResizingFixer *columnResizingFixer;
 
+    // Export running in the background, if any
+    QThread *exportThread;
+    TransactionExporter *exporter;
+    QProgressDialog *exportProgress;
+    QString exportFilename;
+
+    void stopExport();
+
     virtual void resizeEvent(QResizeEvent* event);
 
 private slots:
@@ -88,6 +100,8 @@ private slots:
     void copyAmount();
     void copyTxID();
     void openThirdPartyTxUrl(QString url);
+    void exportCanceled();
+    void exportFinished(bool fSuccess);
 
 signals:
     void doubleClicked(const QModelIndex&);
@@ -5,6 +5,7 @@
 #include "walletmodel.h"
 
 #include "addresstablemodel.h"
+#include "coincontrolmodel.h"
 #include "guiconstants.h"
 #include "recentrequeststablemodel.h"
 #include "transactiontablemodel.h"
@@ -21,6 +22,7 @@
 
 #include <stdint.h>
 
+#include <QAtomicInt>
 #include <QDebug>
 #include <QSet>
 #include <QTimer>
@@ -29,19 +31,24 @@ WalletModel::WalletModel(CWallet *wallet, OptionsModel *optionsModel, QObject *p
     QObject(parent), wallet(wallet), optionsModel(optionsModel), addressTableModel(0),
     transactionTableModel(0),
     recentRequestsTableModel(0),
+    coinControlModel(0),
     cachedBalance(0), cachedUnconfirmedBalance(0), cachedImmatureBalance(0),
     cachedNumTransactions(0),
     cachedEncryptionStatus(Unencrypted),
-    cachedNumBlocks(0)
+    cachedNumBlocks(0),
+    fForceCheckBalance(false)
 {
     addressTableModel = new AddressTableModel(wallet, this);
     transactionTableModel = new TransactionTableModel(wallet, this);
     recentRequestsTableModel = new RecentRequestsTableModel(wallet, this);
+    coinControlModel = new CoinControlModel(wallet, this);
 
-    // This timer will be fired repeatedly to update the balance
+    // This timer is started when blocks or transactions change, to update the
+    // balance once for all the changes in the meantime
     pollTimer = new QTimer(this);
+    pollTimer->setSingleShot(true);
     connect(pollTimer, SIGNAL(timeout()), this, SLOT(pollBalanceChanged()));
-    pollTimer->start(MODEL_UPDATE_DELAY);
+    startPollTimer();
 	
     subscribeToCoreSignals();
 }
@@ -97,24 +104,48 @@ void WalletModel::updateStatus()
         emit encryptionStatusChanged(newEncryptionStatus);
 }
 
+void WalletModel::startPollTimer()
+{
+    if(pollTimer->isActive())
+        return;
+    // Each balance is a pass over the whole wallet, so while catching up
+    // with the network do it less often
+    pollTimer->start(IsInitialBlockDownload() ? MODEL_UPDATE_DELAY_SYNCING : MODEL_UPDATE_DELAY);
+}
+
+void WalletModel::blocksChanged()
+{
+    fWalletBlocksChangedQueued.fetchAndStoreOrdered(0);
+    startPollTimer();
+}
+
 void WalletModel::pollBalanceChanged()
 {
     // Get required locks upfront. This avoids the GUI from getting stuck on
-    // periodical polls if the core is holding the locks for a longer time -
-    // for example, during a wallet rescan.
-    TRY_LOCK(cs_main, lockMain);
-    if(!lockMain)
-        return;
+    // polls if the core is holding the locks for a longer time - for
+    // example, during a wallet rescan. The balance does not need cs_main.
     TRY_LOCK(wallet->cs_wallet, lockWallet);
     if(!lockWallet)
+    {
+        // Try again later
+        startPollTimer();
         return;
+    }
+    int numBlocks;
+    {
+        LOCK(cs_chainview);
+        numBlocks = chainActive.Height();
+    }
 
-    if(chainActive.Height() != cachedNumBlocks)
+    if(numBlocks != cachedNumBlocks || fForceCheckBalance)
     {
         // Balance and number of transactions might have changed
-        cachedNumBlocks = chainActive.Height();
-
+        fForceCheckBalance = false;
         checkBalanceChanged();
+    }
+    if(numBlocks != cachedNumBlocks)
+    {
+        cachedNumBlocks = numBlocks;
         if(transactionTableModel)
             transactionTableModel->updateConfirmations();
     }
@@ -140,8 +171,10 @@ void WalletModel::updateTransaction(const QString &hash, int status)
     if(transactionTableModel)
         transactionTableModel->updateTransaction(hash, status);
 
-    // Balance and number of transactions might have changed
-    checkBalanceChanged();
+    // Balance might have changed, check once for all transactions changed
+    // until the timer runs out
+    fForceCheckBalance = true;
+    startPollTimer();
 
     int newNumTransactions = getNumTransactions();
     if(cachedNumTransactions != newNumTransactions)
@@ -455,6 +488,11 @@ RecentRequestsTableModel *WalletModel::getRecentRequestsTableModel()
     return recentRequestsTableModel;
 }
 
+CoinControlModel *WalletModel::getCoinControlModel()
+{
+    return coinControlModel;
+}
+
 WalletModel::EncryptionStatus WalletModel::getEncryptionStatus() const
 {
     if(!wallet->IsCrypted())
@@ -516,6 +554,15 @@ bool WalletModel::backupWallet(const QString &filename)
 }
 
 // Handlers for core signals
+// A blocksChanged() call is queued and has not run yet
+static QAtomicInt fWalletBlocksChangedQueued(0);
+static void NotifyBlocksChanged(WalletModel *walletmodel)
+{
+    // Sent for every block connected; queue no more than one call at a time
+    if (fWalletBlocksChangedQueued.testAndSetOrdered(0, 1))
+        QMetaObject::invokeMethod(walletmodel, "blocksChanged", Qt::QueuedConnection);
+}
+
 static void NotifyKeyStoreStatusChanged(WalletModel *walletmodel, CCryptoKeyStore *wallet)
 {
     qDebug() << "NotifyKeyStoreStatusChanged";
@@ -595,6 +642,7 @@ static void ShowProgress(WalletModel *walletmodel, const std::string &title, int
 void WalletModel::subscribeToCoreSignals()
 {
     // Connect signals to wallet
+    uiInterface.NotifyBlocksChanged.connect(boost::bind(NotifyBlocksChanged, this));
     wallet->NotifyStatusChanged.connect(boost::bind(&NotifyKeyStoreStatusChanged, this, _1));
     wallet->NotifyAddressBookChanged.connect(boost::bind(NotifyAddressBookChanged, this, _1, _2, _3, _4, _5, _6));
     wallet->NotifyTransactionChanged.connect(boost::bind(NotifyTransactionChanged, this, _1, _2, _3));
@@ -604,6 +652,7 @@ void WalletModel::subscribeToCoreSignals()
 void WalletModel::unsubscribeFromCoreSignals()
 {
     // Disconnect signals from wallet
+    uiInterface.NotifyBlocksChanged.disconnect(boost::bind(NotifyBlocksChanged, this));
     wallet->NotifyStatusChanged.disconnect(boost::bind(&NotifyKeyStoreStatusChanged, this, _1));
     wallet->NotifyAddressBookChanged.disconnect(boost::bind(NotifyAddressBookChanged, this, _1, _2, _3, _4, _5, _6));
     wallet->NotifyTransactionChanged.disconnect(boost::bind(NotifyTransactionChanged, this, _1, _2, _3));
@@ -672,42 +721,6 @@ bool WalletModel::isSpent(const COutPoint& outpoint) const
     return wallet->IsSpent(outpoint.hash, outpoint.n);
 }
 
-// AvailableCoins + LockedCoins grouped by wallet address (put change in one group with wallet address)
-void WalletModel::listCoins(std::map<QString, std::vector<COutput> >& mapCoins) const
-{
-    std::vector<COutput> vCoins;
-    wallet->AvailableCoins(vCoins);
-
-    LOCK2(cs_main, wallet->cs_wallet); // ListLockedCoins, mapWallet
-    std::vector<COutPoint> vLockedCoins;
-    wallet->ListLockedCoins(vLockedCoins);
-
-    // add locked coins
-    BOOST_FOREACH(const COutPoint& outpoint, vLockedCoins)
-    {
-        if (!wallet->mapWallet.count(outpoint.hash)) continue;
-        int nDepth = wallet->mapWallet[outpoint.hash].GetDepthInMainChain();
-        if (nDepth < 0) continue;
-        COutput out(&wallet->mapWallet[outpoint.hash], outpoint.n, nDepth);
-        vCoins.push_back(out);
-    }
-
-    BOOST_FOREACH(const COutput& out, vCoins)
-    {
-        COutput cout = out;
-
-        while (wallet->IsChange(cout.tx->vout[cout.i]) && cout.tx->vin.size() > 0 && wallet->IsMine(cout.tx->vin[0]))
-        {
-            if (!wallet->mapWallet.count(cout.tx->vin[0].prevout.hash)) break;
-            cout = COutput(&wallet->mapWallet[cout.tx->vin[0].prevout.hash], cout.tx->vin[0].prevout.n, 0);
-        }
-
-        CTxDestination address;
-        if(!ExtractDestination(cout.tx->vout[cout.i].scriptPubKey, address)) continue;
-        mapCoins[CBitcoinAddress(address).ToString().c_str()].push_back(out);
-    }
-}
-
 bool WalletModel::isLockedCoin(uint256 hash, unsigned int n) const
 {
     LOCK2(cs_main, wallet->cs_wallet);
@@ -737,7 +750,7 @@ void WalletModel::loadReceiveRequests(std::vector<std::string>& vReceiveRequests
     LOCK(wallet->cs_wallet);
     BOOST_FOREACH(const PAIRTYPE(CTxDestination, CAddressBookData)& item, wallet->mapAddressBook)
         BOOST_FOREACH(const PAIRTYPE(std::string, std::string)& item2, item.second.destdata)
-            if (item2.first.size() > 2 && item2.first.substr(0,2) == "rr") // receive request
+            if (item2.first.size() > 2 && item2.first.compare(0, 2, "rr") == 0) // receive request
                 vReceiveRequests.push_back(item2.second);
 }
 
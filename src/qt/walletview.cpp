@@ -33,7 +33,10 @@
 WalletView::WalletView(QWidget *parent):
     QStackedWidget(parent),
     clientModel(0),
-    walletModel(0)
+    walletModel(0),
+    chatWindow(0),
+    exchangeBrowser(0),
+    blockBrowser(0)
 {
 
     // Create actions for the toolbar, menu bar and tray/dock icon
@@ -42,9 +45,7 @@ WalletView::WalletView(QWidget *parent):
 	//parent->setStyleSheet("#MainWindow{border-image: url(:/images/wallet) 0 0 0 0 stretch stretch;}");
     // Create tabs
     overviewPage = new OverviewPage();
-	chatWindow = new ChatWindow(this);
-	exchangeBrowser = new ExchangeBrowser(this);
-	blockBrowser = new BlockBrowser(this);
+    // Chat, exchange and block browser pages are created when first opened
 
     transactionsPage = new QWidget(this);
     QVBoxLayout *vbox = new QVBoxLayout();
@@ -68,9 +69,6 @@ WalletView::WalletView(QWidget *parent):
     addWidget(transactionsPage);
     addWidget(receiveCoinsPage);
     addWidget(sendCoinsPage);
-	addWidget(chatWindow);
-	addWidget(exchangeBrowser);
-	addWidget(blockBrowser);
 
 
     // Clicking on a transaction on the overview pre-selects the transaction on the transaction history page
@@ -195,17 +193,32 @@ void WalletView::gotoHistoryPage()
 
 void WalletView::gotoExchangeBrowserPage()
 {
+    if (!exchangeBrowser)
+    {
+        exchangeBrowser = new ExchangeBrowser(this);
+        addWidget(exchangeBrowser);
+    }
     setCurrentWidget(exchangeBrowser);
 }
 
 void WalletView::gotoChatPage()
 {
+    if (!chatWindow)
+    {
+        chatWindow = new ChatWindow(this);
+        addWidget(chatWindow);
+    }
     setCurrentWidget(chatWindow);
 }
 
 
 void WalletView::gotoBlockBrowserPage()
 {
+    if (!blockBrowser)
+    {
+        blockBrowser = new BlockBrowser(this);
+        addWidget(blockBrowser);
+    }
     setCurrentWidget(blockBrowser);
 }
 
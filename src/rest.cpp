@@ -0,0 +1,295 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpcserver.h"
+
+#include "blockstore.h"
+#include "core.h"
+#include "main.h"
+#include "util.h"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/foreach.hpp>
+
+using namespace std;
+using namespace json_spirit;
+
+// Read-only block and transaction data over plain HTTP GET, for indexers
+// that would otherwise go through getblock and getrawtransaction. Blocks are
+// sent as the bytes of their block file, without decoding them. The one
+// request that is not read-only, POST /rest/tx, submits a transaction as
+// sendrawtransaction does; anyone able to connect could relay it over P2P.
+
+extern void blockToJSON(CJSONWriter& writer, const CBlock& block, const CBlockIndex* blockindex, bool fTxDetails);
+extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry);
+extern bool DecodeTx(const CDataStream& ssTx, CTransaction& tx);
+extern bool DecodeHexTx(const std::string& strHex, CDataStream& ssTx, CTransaction& tx);
+extern int SubmitRawTransaction(const CTransaction &tx, const CDataStream *pssRaw, bool fOverrideFees, std::string &strError);
+
+enum RESTFormat
+{
+    REST_BIN,
+    REST_HEX,
+    REST_JSON,
+};
+
+static const struct
+{
+    RESTFormat format;
+    const char* name;
+    const char* contentType;
+} rfNames[] = {
+    { REST_BIN,  "bin",  "application/octet-stream" },
+    { REST_HEX,  "hex",  "text/plain" },
+    { REST_JSON, "json", "application/json" },
+};
+
+class CRESTError
+{
+public:
+    int nStatus;
+    string strMessage;
+
+    CRESTError(int nStatusIn, const string& strMessageIn) : nStatus(nStatusIn), strMessage(strMessageIn) {}
+};
+
+// Split "<param>.<format>" off the end of a path
+static string ParseFormat(const string& strPath, int& nFormat)
+{
+    size_t nDot = strPath.rfind('.');
+    if (nDot == string::npos)
+        throw CRESTError(HTTP_NOT_FOUND, "output format not found (available: bin, hex, json)");
+
+    string strFormat = strPath.substr(nDot + 1);
+    for (unsigned int i = 0; i < ARRAYLEN(rfNames); i++)
+        if (strFormat == rfNames[i].name)
+        {
+            nFormat = i;
+            return strPath.substr(0, nDot);
+        }
+    throw CRESTError(HTTP_NOT_FOUND, "output format not found (available: bin, hex, json)");
+}
+
+static uint256 ParseHashParam(const string& strHash)
+{
+    if (strHash.size() != 64 || !IsHex(strHash))
+        throw CRESTError(HTTP_BAD_REQUEST, "Invalid hash: " + strHash);
+    return uint256(strHash);
+}
+
+template<typename T>
+static string Serialized(const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << obj;
+    return string(ss.begin(), ss.end());
+}
+
+static string Reply(int nFormat, const string& strBytes, bool fKeepAlive)
+{
+    string strBody;
+    if (rfNames[nFormat].format == REST_HEX)
+        strBody = HexStr(strBytes.begin(), strBytes.end()) + "\n";
+    else
+        strBody = strBytes;
+    return HTTPReply(HTTP_OK, strBody, fKeepAlive, rfNames[nFormat].contentType);
+}
+
+static CBlockIndex* LookupBlockIndex(const uint256& hash)
+{
+    LOCK(cs_main);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi == mapBlockIndex.end())
+        throw CRESTError(HTTP_NOT_FOUND, hash.GetHex() + " not found");
+    return mi->second;
+}
+
+// /rest/block/<hash>.<format>
+static string RESTBlock(const string& strParam, bool fKeepAlive)
+{
+    int nFormat;
+    uint256 hash = ParseHashParam(ParseFormat(strParam, nFormat));
+    CBlockIndex* pblockindex = LookupBlockIndex(hash);
+    if (!(pblockindex->nStatus & BLOCK_HAVE_DATA))
+        throw CRESTError(HTTP_NOT_FOUND, hash.GetHex() + " not available");
+
+    // Index entries are never freed and block files are only appended to
+    // until pruning deletes them, which fails the read, so the block is read
+    // without holding cs_main
+    if (rfNames[nFormat].format != REST_JSON)
+    {
+        CRawBlock raw;
+        if (ReadRawBlockFromDisk(raw, pblockindex))
+            return Reply(nFormat, string(raw.begin(), raw.end()), fKeepAlive);
+    }
+
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pblockindex))
+        throw CRESTError(HTTP_NOT_FOUND, hash.GetHex() + " not found");
+    if (rfNames[nFormat].format != REST_JSON)
+        return Reply(nFormat, Serialized(block), fKeepAlive);
+
+    CJSONWriter writer;
+    blockToJSON(writer, block, pblockindex, false);
+    return HTTPReply(HTTP_OK, writer.str() + "\n", fKeepAlive, rfNames[nFormat].contentType);
+}
+
+// /rest/tx/<txid>.<format>
+static string RESTTx(const string& strParam, bool fKeepAlive)
+{
+    int nFormat;
+    uint256 hash = ParseHashParam(ParseFormat(strParam, nFormat));
+
+    CTransaction tx;
+    uint256 hashBlock = 0;
+    if (!GetTransaction(hash, tx, hashBlock, true))
+        throw CRESTError(HTTP_NOT_FOUND, hash.GetHex() + " not found");
+    if (rfNames[nFormat].format != REST_JSON)
+        return Reply(nFormat, Serialized(tx), fKeepAlive);
+
+    Object result;
+    {
+        LOCK(cs_main);
+        TxToJSON(tx, hashBlock, result);
+    }
+    return HTTPReply(HTTP_OK, write_string(Value(result), false) + "\n", fKeepAlive, rfNames[nFormat].contentType);
+}
+
+// /rest/headers/<count>/<hash>.<format>: up to count headers of the active
+// chain, from the given block on
+static string RESTHeaders(const string& strParam, bool fKeepAlive)
+{
+    int nFormat;
+    vector<string> vPath;
+    string strPath = ParseFormat(strParam, nFormat);
+    boost::split(vPath, strPath, boost::is_any_of("/"));
+    if (vPath.size() != 2)
+        throw CRESTError(HTTP_BAD_REQUEST, "No header count specified. Use /rest/headers/<count>/<hash>.<ext>.");
+
+    const string& strCount = vPath[0];
+    int64_t nCount = 0;
+    if (!strCount.empty() && strCount.size() <= 9 && strCount.find_first_not_of("0123456789") == string::npos)
+        nCount = atoi64(strCount);
+    if (nCount < 1 || nCount > (int64_t)MAX_REST_HEADERS_RESULTS)
+        throw CRESTError(HTTP_BAD_REQUEST, strprintf("Header count out of range: %s", strCount));
+    uint256 hash = ParseHashParam(vPath[1]);
+
+    vector<const CBlockIndex*> vHeaders;
+    vector<const CBlockIndex*> vNext;
+    int nTipHeight;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
+        const CBlockIndex* pindex = mi == mapBlockIndex.end() ? NULL : mi->second;
+        while (pindex != NULL && chainActive.Contains(pindex))
+        {
+            vHeaders.push_back(pindex);
+            pindex = chainActive.Next(pindex);
+            vNext.push_back(pindex);
+            if ((int64_t)vHeaders.size() == nCount)
+                break;
+        }
+        nTipHeight = chainActive.Height();
+    }
+
+    if (rfNames[nFormat].format != REST_JSON)
+    {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        BOOST_FOREACH(const CBlockIndex* pindex, vHeaders)
+            ss << pindex->GetBlockHeader();
+        return Reply(nFormat, string(ss.begin(), ss.end()), fKeepAlive);
+    }
+
+    CJSONWriter writer;
+    writer.BeginArray();
+    for (unsigned int i = 0; i < vHeaders.size(); i++)
+    {
+        const CBlockIndex* pindex = vHeaders[i];
+        writer.BeginObject();
+        writer.Pair("hash", pindex->GetBlockHash().GetHex());
+        writer.Pair("confirmations", nTipHeight - pindex->nHeight + 1);
+        writer.Pair("height", pindex->nHeight);
+        writer.Pair("version", pindex->nVersion);
+        writer.Pair("merkleroot", pindex->hashMerkleRoot.GetHex());
+        writer.Pair("time", (int64_t)pindex->nTime);
+        writer.Pair("nonce", (uint64_t)pindex->nNonce);
+        writer.Pair("bits", HexBits(pindex->nBits));
+        writer.Pair("chainwork", pindex->nChainWork.GetHex());
+        if (pindex->pprev)
+            writer.Pair("previousblockhash", pindex->pprev->GetBlockHash().GetHex());
+        if (vNext[i])
+            writer.Pair("nextblockhash", vNext[i]->GetBlockHash().GetHex());
+        writer.EndObject();
+    }
+    writer.EndArray();
+    return HTTPReply(HTTP_OK, writer.str() + "\n", fKeepAlive, rfNames[nFormat].contentType);
+}
+
+// POST /rest/tx.<bin|hex>: submit the transaction in the body, as raw bytes
+// or hex; the reply is its txid
+static string RESTSendTx(const string& strParam, const string& strBody, bool fKeepAlive)
+{
+    int nFormat;
+    if (!ParseFormat(strParam, nFormat).empty())
+        throw CRESTError(HTTP_NOT_FOUND, "");
+
+    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+    CTransaction tx;
+    bool fDecoded;
+    if (rfNames[nFormat].format == REST_BIN)
+    {
+        ssTx.insert(ssTx.end(), strBody.data(), strBody.data() + strBody.size());
+        fDecoded = DecodeTx(ssTx, tx);
+    }
+    else if (rfNames[nFormat].format == REST_HEX)
+        fDecoded = DecodeHexTx(boost::trim_copy(strBody), ssTx, tx);
+    else
+        throw CRESTError(HTTP_BAD_REQUEST, "transactions are submitted as bin or hex");
+    if (!fDecoded)
+        throw CRESTError(HTTP_BAD_REQUEST, "TX decode failed");
+
+    string strError;
+    if (SubmitRawTransaction(tx, &ssTx, false, strError))
+        throw CRESTError(HTTP_BAD_REQUEST, strError);
+    return HTTPReply(HTTP_OK, tx.GetHash().GetHex() + "\n", fKeepAlive, "text/plain");
+}
+
+static const struct
+{
+    const char* prefix;
+    string (*handler)(const string& strParam, bool fKeepAlive);
+} uri_prefixes[] = {
+    { "/rest/block/",   RESTBlock },
+    { "/rest/tx/",      RESTTx },
+    { "/rest/headers/", RESTHeaders },
+};
+
+string HTTPReplyREST(const string& strMethod, const string& strURI, const string& strBody, bool& fKeepAlive)
+{
+    try
+    {
+        string strURIPath = strURI.substr(0, strURI.find('?'));
+        if (strMethod == "POST" && boost::starts_with(strURIPath, "/rest/tx."))
+            return RESTSendTx(strURIPath.substr(strlen("/rest/tx")), strBody, fKeepAlive);
+        if (strMethod != "GET")
+            throw CRESTError(HTTP_BAD_REQUEST, "REST requests must be GET, except POST /rest/tx");
+
+        for (unsigned int i = 0; i < ARRAYLEN(uri_prefixes); i++)
+        {
+            if (boost::starts_with(strURIPath, uri_prefixes[i].prefix))
+                return uri_prefixes[i].handler(strURIPath.substr(strlen(uri_prefixes[i].prefix)), fKeepAlive);
+        }
+        throw CRESTError(HTTP_NOT_FOUND, "");
+    }
+    catch (CRESTError& re)
+    {
+        return HTTPReply(re.nStatus, re.strMessage.empty() ? "" : re.strMessage + "\r\n", fKeepAlive, "text/plain");
+    }
+    catch (std::exception& e)
+    {
+        LogPrint("rpc", "REST request for %s failed: %s\n", strURI, e.what());
+        fKeepAlive = false;
+        return HTTPReply(HTTP_INTERNAL_SERVER_ERROR, "", false, "text/plain");
+    }
+}
@@ -4,92 +4,103 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "rpcserver.h"
+#include "addressindex.h"
+#include "base58.h"
+#include "blockfilter.h"
+#include "blockimport.h"
+#include "blockprofile.h"
+#include "indexbuild.h"
 #include "main.h"
 #include "sync.h"
 #include "checkpoints.h"
+#include "txdb.h"
+#include "txoutset.h"
 
 #include <stdint.h>
 
+#include <boost/filesystem.hpp>
+
 #include "json/json_spirit_value.h"
 
 using namespace json_spirit;
 using namespace std;
 
 void ScriptPubKeyToJSON(const CScript& scriptPubKey, Object& out, bool fIncludeHex);
+void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry);
+
+// At most this many blocks per getblocks call
+static const int MAX_GETBLOCKS_COUNT = 1000;
 
 double GetDifficulty(const CBlockIndex* blockindex, int algo)
 {
-    unsigned int nBits;
     // Floating point number that is a multiple of the minimum difficulty,
     // minimum difficulty = 1.0.
-    if (blockindex == NULL)
-    {
-	CBlockIndex* tip = chainActive.Tip();
-        if (tip == NULL)
-            nBits = Params().ProofOfWorkLimit(ALGO_SHA256D).GetCompact();
-        else
-        {
-            blockindex = GetLastBlockIndexForAlgo(tip, algo);
-            if (blockindex == NULL)
-                nBits = Params().ProofOfWorkLimit(algo).GetCompact();
-            else
-                nBits = blockindex->nBits;
-        }
-    }
-    else
-        nBits = blockindex->nBits;
+    if (blockindex != NULL)
+        return GetDifficultyFromBits(blockindex->nBits);
+    if (chainActive.Tip() == NULL)
+        return GetDifficultyFromBits(Params().ProofOfWorkLimit(ALGO_SHA256D).GetCompact());
 
-    int nShift = (nBits >> 24) & 0xff;
+    CAlgoStats stats = GetAlgoStats(algo);
+    if (stats.pindexLast == NULL)
+        return GetDifficultyFromBits(Params().ProofOfWorkLimit(algo).GetCompact());
+    return stats.dDifficulty;
+}
 
-    double dDiff =
-        (double)0x0000ffff / (double)(nBits & 0x00ffffff);
 
-    while (nShift < 29)
-    {
-        dDiff *= 256.0;
-        nShift++;
-    }
-    while (nShift > 29)
+// Written as it goes, since the transactions are most of a large block's
+// output; only the fields that depend on the chain are read under cs_main.
+// With fTxDetails each transaction is decoded from block itself, without the
+// index lookup and block file read of getrawtransaction.
+void blockToJSON(CJSONWriter& writer, const CBlock& block, const CBlockIndex* blockindex, bool fTxDetails)
+{
+    int nConfirmations;
+    double dDifficulty;
+    const CBlockIndex* pnext;
     {
-        dDiff /= 256.0;
-        nShift--;
+        LOCK(cs_main);
+        CMerkleTx txGen(block.vtx[0]);
+        txGen.SetMerkleBranch(&block);
+        nConfirmations = txGen.GetDepthInMainChain();
+        dDifficulty = GetDifficulty(blockindex, miningAlgo);
+        pnext = chainActive.Next(blockindex);
     }
 
-    return dDiff;
-}
-
-
-Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex)
-{
-    Object result;
-    result.push_back(Pair("hash", block.GetHash().GetHex()));
-    CMerkleTx txGen(block.vtx[0]);
-    txGen.SetMerkleBranch(&block);
-    result.push_back(Pair("confirmations", (int)txGen.GetDepthInMainChain()));
-    result.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
-    result.push_back(Pair("height", blockindex->nHeight));
-    result.push_back(Pair("version", block.nVersion));
+    writer.BeginObject();
+    writer.Pair("hash", block.GetHash().GetHex());
+    writer.Pair("confirmations", nConfirmations);
+    writer.Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    writer.Pair("height", blockindex->nHeight);
+    writer.Pair("version", block.nVersion);
     int algo = block.GetAlgo();
-    result.push_back(Pair("pow_algo_id", algo));
-    result.push_back(Pair("pow_algo", GetAlgoName(algo)));
-    result.push_back(Pair("pow_hash", block.GetPoWHash(algo).GetHex()));
-    result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
-    Array txs;
+    writer.Pair("pow_algo_id", algo);
+    writer.Pair("pow_algo", GetAlgoName(algo));
+    writer.Pair("pow_hash", block.GetPoWHash(algo).GetHex());
+    writer.Pair("merkleroot", block.hashMerkleRoot.GetHex());
+    writer.Key("tx");
+    writer.BeginArray();
     BOOST_FOREACH(const CTransaction&tx, block.vtx)
-        txs.push_back(tx.GetHash().GetHex());
-    result.push_back(Pair("tx", txs));
-    result.push_back(Pair("time", block.GetBlockTime()));
-    result.push_back(Pair("nonce", (uint64_t)block.nNonce));
-    result.push_back(Pair("bits", HexBits(block.nBits)));
-    result.push_back(Pair("difficulty", GetDifficulty(blockindex, miningAlgo)));
-    result.push_back(Pair("chainwork", blockindex->nChainWork.GetHex()));
+    {
+        if (fTxDetails)
+        {
+            Object entry;
+            TxToJSON(tx, 0, entry);
+            writer.Write(entry);
+        }
+        else
+            writer.String(tx.GetHash().GetHex());
+    }
+    writer.EndArray();
+    writer.Pair("time", block.GetBlockTime());
+    writer.Pair("nonce", (uint64_t)block.nNonce);
+    writer.Pair("bits", HexBits(block.nBits));
+    writer.Pair("difficulty", dDifficulty);
+    writer.Pair("chainwork", blockindex->nChainWork.GetHex());
 
     if (blockindex->pprev)
-        result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
-    CBlockIndex *pnext = chainActive.Next(blockindex);
+        writer.Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex());
     if (pnext)
-        result.push_back(Pair("nextblockhash", pnext->GetBlockHash().GetHex()));
-    return result;
+        writer.Pair("nextblockhash", pnext->GetBlockHash().GetHex());
+    writer.EndObject();
 }
 
 
@@ -106,6 +117,7 @@ Value getblockcount(const Array& params, bool fHelp)
             + HelpExampleRpc("getblockcount", "")
         );
 
+    LOCK(cs_chainview);
     return chainActive.Height();
 }
 
@@ -122,6 +134,7 @@ Value getbestblockhash(const Array& params, bool fHelp)
             + HelpExampleRpc("getbestblockhash", "")
         );
 
+    LOCK(cs_chainview);
     return chainActive.Tip()->GetBlockHash().GetHex();
 }
 
@@ -142,7 +155,37 @@ Value getdifficulty(const Array& params, bool fHelp)
 }
 
 
-Value getrawmempool(const Array& params, bool fHelp)
+Value getmempoolinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolinfo\n"
+            "\nReturns details on the state of the memory pool.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"size\": xxxxx,          (numeric) number of transactions in the pool\n"
+            "  \"bytes\": xxxxx,         (numeric) sum of the transaction sizes\n"
+            "  \"usage\": xxxxx,         (numeric) memory used by the pool, in bytes\n"
+            "  \"maxmempool\": xxxxx,    (numeric) maximum memory usage of the pool (-maxmempool), in bytes\n"
+            "  \"mempoolminfee\": x.xxx  (numeric) minimum fee per kB for a transaction to be accepted, 0 unless the pool was full recently\n"
+            "}\n"
+            "\nExamples\n"
+            + HelpExampleCli("getmempoolinfo", "")
+            + HelpExampleRpc("getmempoolinfo", "")
+        );
+
+    size_t nMaxMempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    boost::shared_ptr<const CTxMemPoolSnapshot> psnapshot = mempool.GetSnapshot();
+    Object ret;
+    ret.push_back(Pair("size", (int64_t)psnapshot->mapEntries.size()));
+    ret.push_back(Pair("bytes", (int64_t)psnapshot->nTotalTxSize));
+    ret.push_back(Pair("usage", (int64_t)psnapshot->nUsage));
+    ret.push_back(Pair("maxmempool", (int64_t)nMaxMempool));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount((int64_t)mempool.GetMinFee(nMaxMempool))));
+    return ret;
+}
+
+void getrawmempool(const Array& params, bool fHelp, CJSONWriter& writer)
 {
     if (fHelp || params.size() > 1)
         throw runtime_error(
@@ -178,44 +221,43 @@ Value getrawmempool(const Array& params, bool fHelp)
     if (params.size() > 0)
         fVerbose = params[0].get_bool();
 
+    // From a snapshot, so block creation does not have to wait for this
+    boost::shared_ptr<const CTxMemPoolSnapshot> psnapshot = mempool.GetSnapshot();
     if (fVerbose)
     {
-        LOCK(mempool.cs);
-        Object o;
-        BOOST_FOREACH(const PAIRTYPE(uint256, CTxMemPoolEntry)& entry, mempool.mapTx)
+        int nHeight;
+        {
+            LOCK(cs_main);
+            nHeight = chainActive.Height();
+        }
+        writer.BeginObject();
+        BOOST_FOREACH(const PAIRTYPE(const uint256, CTxMemPoolSnapshot::Entry)& entry, psnapshot->mapEntries)
         {
             const uint256& hash = entry.first;
-            const CTxMemPoolEntry& e = entry.second;
-            Object info;
-            info.push_back(Pair("size", (int)e.GetTxSize()));
-            info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
-            info.push_back(Pair("time", e.GetTime()));
-            info.push_back(Pair("height", (int)e.GetHeight()));
-            info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
-            info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
-            const CTransaction& tx = e.GetTx();
-            set<string> setDepends;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                if (mempool.exists(txin.prevout.hash))
-                    setDepends.insert(txin.prevout.hash.ToString());
-            }
-            Array depends(setDepends.begin(), setDepends.end());
-            info.push_back(Pair("depends", depends));
-            o.push_back(Pair(hash.ToString(), info));
+            const CTxMemPoolSnapshot::Entry& e = entry.second;
+            writer.Key(hash.ToString());
+            writer.BeginObject();
+            writer.Pair("size", (int)e.nTxSize);
+            writer.Pair("fee", ValueFromAmount(e.nFee));
+            writer.Pair("time", e.nTime);
+            writer.Pair("height", (int)e.nHeight);
+            writer.Pair("startingpriority", e.dPriority);
+            writer.Pair("currentpriority", e.GetPriority(nHeight));
+            writer.Key("depends");
+            writer.BeginArray();
+            BOOST_FOREACH(const uint256& hashDepend, e.vDepends)
+                writer.String(hashDepend.ToString());
+            writer.EndArray();
+            writer.EndObject();
         }
-        return o;
+        writer.EndObject();
     }
     else
     {
-        vector<uint256> vtxid;
-        mempool.queryHashes(vtxid);
-
-        Array a;
-        BOOST_FOREACH(const uint256& hash, vtxid)
-            a.push_back(hash.ToString());
-
-        return a;
+        writer.BeginArray();
+        BOOST_FOREACH(const PAIRTYPE(const uint256, CTxMemPoolSnapshot::Entry)& entry, psnapshot->mapEntries)
+            writer.String(entry.first.ToString());
+        writer.EndArray();
     }
 }
 
@@ -235,6 +277,8 @@ Value getblockhash(const Array& params, bool fHelp)
         );
 
     int nHeight = params[0].get_int();
+
+    LOCK(cs_main);
     if (nHeight < 0 || nHeight > chainActive.Height())
         throw runtime_error("Block number out of range.");
 
@@ -242,17 +286,60 @@ Value getblockhash(const Array& params, bool fHelp)
     return pblockindex->GetBlockHash().GetHex();
 }
 
-Value getblock(const Array& params, bool fHelp)
+// getblock and getblocks take false or 0 for hex, true or 1 for an object
+// with the txids, and 2 for an object with the decoded transactions
+static int ParseVerbosity(const Value& value)
+{
+    if (value.type() == bool_type)
+        return value.get_bool() ? 1 : 0;
+    int nVerbosity = value.get_int();
+    if (nVerbosity < 0 || nVerbosity > 2)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Verbosity must be 0, 1 or 2");
+    return nVerbosity;
+}
+
+// Index entries are never freed and block files are only appended to until
+// pruning deletes them, which fails the read, so the block is read without
+// holding cs_main
+static void WriteBlock(CJSONWriter& writer, const CBlockIndex* pblockindex, int nVerbosity)
+{
+    if (nVerbosity == 0)
+    {
+        CRawBlock raw;
+        if (ReadRawBlockFromDisk(raw, pblockindex))
+        {
+            writer.String(HexStr(raw.begin(), raw.end()));
+            return;
+        }
+    }
+
+    CBlock block;
+    if(!ReadBlockFromDisk(block, pblockindex))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+
+    if (nVerbosity == 0)
+    {
+        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+        ssBlock << block;
+        writer.String(HexStr(ssBlock.begin(), ssBlock.end()));
+        return;
+    }
+
+    blockToJSON(writer, block, pblockindex, nVerbosity > 1);
+}
+
+void getblock(const Array& params, bool fHelp, CJSONWriter& writer)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
         throw runtime_error(
-            "getblock \"hash\" ( verbose )\n"
-            "\nIf verbose is false, returns a string that is serialized, hex-encoded data for block 'hash'.\n"
-            "If verbose is true, returns an Object with information about block <hash>.\n"
+            "getblock \"hash\" ( verbosity )\n"
+            "\nIf verbosity is 0, returns a string that is serialized, hex-encoded data for block 'hash'.\n"
+            "If verbosity is 1, returns an Object with information about block <hash>.\n"
+            "If verbosity is 2, returns an Object with information about block <hash> and about each of its transactions.\n"
             "\nArguments:\n"
             "1. \"hash\"          (string, required) The block hash\n"
-            "2. verbose           (boolean, optional, default=true) true for a json object, false for the hex encoded data\n"
-            "\nResult (for verbose = true):\n"
+            "2. verbosity         (numeric or boolean, optional, default=1) 0 (or false) for the hex encoded data, 1 (or true) for a json object, 2 for a json object with the transactions decoded\n"
+            "\nResult (for verbosity = 1):\n"
             "{\n"
             "  \"hash\" : \"hash\",     (string) the block hash (same as provided)\n"
             "  \"confirmations\" : n,   (numeric) The number of confirmations\n"
@@ -271,77 +358,573 @@ Value getblock(const Array& params, bool fHelp)
             "  \"previousblockhash\" : \"hash\",  (string) The hash of the previous block\n"
             "  \"nextblockhash\" : \"hash\"       (string) The hash of the next block\n"
             "}\n"
-            "\nResult (for verbose=false):\n"
+            "\nResult (for verbosity = 2):\n"
+            "As for verbosity = 1, with each element of \"tx\" an object as returned by decoderawtransaction.\n"
+            "\nResult (for verbosity = 0):\n"
             "\"data\"             (string) A string that is serialized, hex-encoded data for block 'hash'.\n"
             "\nExamples:\n"
             + HelpExampleCli("getblock", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\"")
+            + HelpExampleCli("getblock", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\" 2")
             + HelpExampleRpc("getblock", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\"")
         );
 
     std::string strHash = params[0].get_str();
     uint256 hash(strHash);
 
-    bool fVerbose = true;
+    int nVerbosity = 1;
     if (params.size() > 1)
-        fVerbose = params[1].get_bool();
+        nVerbosity = ParseVerbosity(params[1]);
+
+    CBlockIndex* pblockindex;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        pblockindex = mi->second;
+        if (!(pblockindex->nStatus & BLOCK_HAVE_DATA))
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
+    }
+
+    WriteBlock(writer, pblockindex, nVerbosity);
+}
+
+void getblocks(const Array& params, bool fHelp, CJSONWriter& writer)
+{
+    if (fHelp || params.size() < 2 || params.size() > 3)
+        throw runtime_error(
+            "getblocks height count ( verbosity )\n"
+            "\nReturns the blocks of the active chain from the given height on, as getblock does, in one call.\n"
+            "\nArguments:\n"
+            "1. height            (numeric, required) The height of the first block\n"
+            "2. count             (numeric, required) The number of blocks, at most " + strprintf("%d", MAX_GETBLOCKS_COUNT) + "; fewer are returned past the tip\n"
+            "3. verbosity         (numeric or boolean, optional, default=1) As for getblock\n"
+            "\nResult:\n"
+            "[                    (array) One element per block, as returned by getblock\n"
+            "  ...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblocks", "1000 100 2")
+            + HelpExampleRpc("getblocks", "1000, 100, 2")
+        );
 
+    int nHeight = params[0].get_int();
+    int nCount = params[1].get_int();
+    if (nCount < 0 || nCount > MAX_GETBLOCKS_COUNT)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Count must be between 0 and %d", MAX_GETBLOCKS_COUNT));
+    int nVerbosity = 1;
+    if (params.size() > 2)
+        nVerbosity = ParseVerbosity(params[2]);
+
+    // The blocks stay the ones of the chain at the time of the call, even if
+    // it is reorganized while they are read
+    vector<const CBlockIndex*> vIndex;
+    {
+        LOCK(cs_main);
+        if (nHeight < 0 || nHeight > chainActive.Height())
+            throw runtime_error("Block number out of range.");
+        for (int h = nHeight; h < nHeight + nCount && h <= chainActive.Height(); h++)
+        {
+            const CBlockIndex* pblockindex = chainActive[h];
+            if (!(pblockindex->nStatus & BLOCK_HAVE_DATA))
+                throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
+            vIndex.push_back(pblockindex);
+        }
+    }
+
+    writer.BeginArray();
+    BOOST_FOREACH(const CBlockIndex* pblockindex, vIndex)
+        WriteBlock(writer, pblockindex, nVerbosity);
+    writer.EndArray();
+}
+
+Value getblockfilter(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getblockfilter \"hash\"\n"
+            "\nReturns the basic compact filter of block 'hash' (needs -blockfilterindex).\n"
+            "\nArguments:\n"
+            "1. \"hash\"          (string, required) The block hash\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"filter\" : \"hex\",    (string) The serialized filter\n"
+            "  \"header\" : \"hash\"    (string) The filter header, committing to the filters of all blocks before\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockfilter", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\"")
+            + HelpExampleRpc("getblockfilter", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\"")
+        );
+
+    if (!fBlockFilterIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Block filter index not enabled, restart with -blockfilterindex and -reindex");
+
+    uint256 hash(params[0].get_str());
+    LOCK(cs_main);
     if (mapBlockIndex.count(hash) == 0)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
 
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
+    CBlockFilterIndexEntry entry;
+    if (!pblocktree->ReadBlockFilter(hash, entry))
+        throw JSONRPCError(RPC_MISC_ERROR, "No filter for this block, it has not been connected");
 
-    if(!ReadBlockFromDisk(block, pblockindex))
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+    Object result;
+    result.push_back(Pair("filter", HexStr(entry.vFilter.begin(), entry.vFilter.end())));
+    result.push_back(Pair("header", entry.hashHeader.GetHex()));
+    return result;
+}
+
+// The index keys of the addresses of an RPC parameter: an address, or an
+// array of them
+static vector<pair<char, uint160> > ParseIndexedAddresses(const Value& value)
+{
+    Array addresses;
+    if (value.type() == array_type)
+        addresses = value.get_array();
+    else
+        addresses.push_back(value);
 
-    if (!fVerbose)
+    vector<pair<char, uint160> > vAddresses;
+    BOOST_FOREACH(const Value& address, addresses)
     {
-        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
-        ssBlock << block;
-        std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
-        return strHex;
+        CBitcoinAddress addr(address.get_str());
+        CTxDestination dest = addr.Get();
+        if (const CKeyID* pkeyID = boost::get<CKeyID>(&dest))
+            vAddresses.push_back(make_pair(ADDRESS_INDEX_PUBKEYHASH, uint160(*pkeyID)));
+        else if (const CScriptID* pscriptID = boost::get<CScriptID>(&dest))
+            vAddresses.push_back(make_pair(ADDRESS_INDEX_SCRIPTHASH, uint160(*pscriptID)));
+        else
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address: " + address.get_str());
+    }
+    return vAddresses;
+}
+
+static string IndexedAddressToString(char chType, const uint160& hashAddress)
+{
+    if (chType == ADDRESS_INDEX_SCRIPTHASH)
+        return CBitcoinAddress(CScriptID(hashAddress)).ToString();
+    return CBitcoinAddress(CKeyID(hashAddress)).ToString();
+}
+
+static void CheckAddressIndex()
+{
+    int nHeight;
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled, restart with -addressindex");
+    if (IsIndexBuilding(INDEX_BUILD_ADDRESS, &nHeight))
+        throw JSONRPCError(RPC_MISC_ERROR, strprintf("Address index is being built, up to height %d so far", nHeight));
+}
+
+Value getaddresstxids(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "getaddresstxids \"address\"|[\"address\",...] ( start end )\n"
+            "\nReturns the txids of the confirmed transactions paying to or spending from the addresses (needs -addressindex).\n"
+            "\nArguments:\n"
+            "1. \"address\"       (string or array, required) An address, or a json array of addresses\n"
+            "2. start           (numeric, optional, default=0) The first block height\n"
+            "3. end             (numeric, optional, default=0) The last block height, 0 for the tip\n"
+            "\nResult:\n"
+            "[\n"
+            "  \"txid\"           (string) In block order\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddresstxids", "\"1D1ZrZNe3JUo7ZycKEYQQiQAWd9y54F4XZ\"")
+            + HelpExampleCli("getaddresstxids", "\"[\\\"1D1ZrZNe3JUo7ZycKEYQQiQAWd9y54F4XZ\\\"]\" 100000 200000")
+            + HelpExampleRpc("getaddresstxids", "\"1D1ZrZNe3JUo7ZycKEYQQiQAWd9y54F4XZ\"")
+        );
+
+    CheckAddressIndex();
+    vector<pair<char, uint160> > vAddresses = ParseIndexedAddresses(params[0]);
+    int nStart = params.size() > 1 ? params[1].get_int() : 0;
+    int nEnd = params.size() > 2 ? params[2].get_int() : 0;
+    if (nStart < 0 || nEnd < 0 || (nEnd > 0 && nEnd < nStart))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid block height range");
+
+    // Sorted by position in the chain, with a transaction listed once however
+    // many of its inputs and outputs are of the addresses
+    set<pair<pair<uint32_t, uint32_t>, uint256> > setTxids;
+    for (unsigned int i = 0; i < vAddresses.size(); i++)
+    {
+        vector<pair<CAddressIndexKey, int64_t> > vEntries;
+        if (!pblocktree->ReadAddressIndex(vAddresses[i].first, vAddresses[i].second, nStart, nEnd, vEntries))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read the address index");
+        for (unsigned int j = 0; j < vEntries.size(); j++)
+        {
+            const CAddressIndexKey& key = vEntries[j].first;
+            setTxids.insert(make_pair(make_pair(key.nHeight, key.nTxIndex), key.txhash));
+        }
+    }
+
+    Array result;
+    for (set<pair<pair<uint32_t, uint32_t>, uint256> >::const_iterator it = setTxids.begin(); it != setTxids.end(); it++)
+        result.push_back(it->second.GetHex());
+    return result;
+}
+
+Value getaddressutxos(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressutxos \"address\"|[\"address\",...]\n"
+            "\nReturns the unspent outputs of the addresses in the active chain (needs -addressindex).\n"
+            "\nArguments:\n"
+            "1. \"address\"       (string or array, required) An address, or a json array of addresses\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"address\" : \"address\",  (string) The address\n"
+            "    \"txid\" : \"txid\",        (string) The transaction id\n"
+            "    \"outputIndex\" : n,      (numeric) The output number\n"
+            "    \"script\" : \"hex\",       (string) The script of the output\n"
+            "    \"amount\" : x.xxx,       (numeric) The amount in btc\n"
+            "    \"height\" : n            (numeric) The height of the block of the transaction\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressutxos", "\"1D1ZrZNe3JUo7ZycKEYQQiQAWd9y54F4XZ\"")
+            + HelpExampleRpc("getaddressutxos", "\"1D1ZrZNe3JUo7ZycKEYQQiQAWd9y54F4XZ\"")
+        );
+
+    CheckAddressIndex();
+    vector<pair<char, uint160> > vAddresses = ParseIndexedAddresses(params[0]);
+
+    Array result;
+    for (unsigned int i = 0; i < vAddresses.size(); i++)
+    {
+        vector<pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+        if (!pblocktree->ReadAddressUnspent(vAddresses[i].first, vAddresses[i].second, vUnspent))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read the address index");
+        string strAddress = IndexedAddressToString(vAddresses[i].first, vAddresses[i].second);
+        for (unsigned int j = 0; j < vUnspent.size(); j++)
+        {
+            const CAddressUnspentKey& key = vUnspent[j].first;
+            const CAddressUnspentValue& value = vUnspent[j].second;
+            Object entry;
+            entry.push_back(Pair("address", strAddress));
+            entry.push_back(Pair("txid", key.txhash.GetHex()));
+            entry.push_back(Pair("outputIndex", (int)key.nIndex));
+            entry.push_back(Pair("script", HexStr(value.script.begin(), value.script.end())));
+            entry.push_back(Pair("amount", ValueFromAmount(value.nValue)));
+            entry.push_back(Pair("height", value.nHeight));
+            result.push_back(entry);
+        }
+    }
+    return result;
+}
+
+Value getaddressbalance(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance \"address\"|[\"address\",...]\n"
+            "\nReturns the confirmed balance of the addresses, and what they received in total (needs -addressindex).\n"
+            "\nArguments:\n"
+            "1. \"address\"       (string or array, required) An address, or a json array of addresses\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"balance\" : x.xxx,     (numeric) The balance in btc\n"
+            "  \"received\" : x.xxx     (numeric) The sum of all outputs paid to the addresses, spent or not\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressbalance", "\"1D1ZrZNe3JUo7ZycKEYQQiQAWd9y54F4XZ\"")
+            + HelpExampleRpc("getaddressbalance", "\"1D1ZrZNe3JUo7ZycKEYQQiQAWd9y54F4XZ\"")
+        );
+
+    CheckAddressIndex();
+    vector<pair<char, uint160> > vAddresses = ParseIndexedAddresses(params[0]);
+
+    int64_t nBalance = 0;
+    int64_t nReceived = 0;
+    for (unsigned int i = 0; i < vAddresses.size(); i++)
+    {
+        vector<pair<CAddressIndexKey, int64_t> > vEntries;
+        if (!pblocktree->ReadAddressIndex(vAddresses[i].first, vAddresses[i].second, 0, 0, vEntries))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read the address index");
+        for (unsigned int j = 0; j < vEntries.size(); j++)
+        {
+            nBalance += vEntries[j].second;
+            if (vEntries[j].second > 0)
+                nReceived += vEntries[j].second;
+        }
     }
 
-    return blockToJSON(block, pblockindex);
+    Object result;
+    result.push_back(Pair("balance", ValueFromAmount(nBalance)));
+    result.push_back(Pair("received", ValueFromAmount(nReceived)));
+    return result;
+}
+
+Value getspentinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "getspentinfo \"txid\" n\n"
+            "\nReturns the input of the active chain spending an output (needs -spentindex).\n"
+            "\nArguments:\n"
+            "1. \"txid\"          (string, required) The transaction id\n"
+            "2. n               (numeric, required) The output number\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"txid\" : \"txid\",     (string) The spending transaction\n"
+            "  \"index\" : n,         (numeric) The number of the spending input\n"
+            "  \"height\" : n,        (numeric) The height of the block of the spending transaction\n"
+            "  \"value\" : x.xxx,     (numeric) The value of the spent output in btc\n"
+            "  \"address\" : \"address\"  (string, optional) The address the spent output paid to\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getspentinfo", "\"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\" 0")
+            + HelpExampleRpc("getspentinfo", "\"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", 0")
+        );
+
+    int nHeight;
+    if (!fSpentIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Spent index not enabled, restart with -spentindex");
+    if (IsIndexBuilding(INDEX_BUILD_SPENT, &nHeight))
+        throw JSONRPCError(RPC_MISC_ERROR, strprintf("Spent index is being built, up to height %d so far", nHeight));
+
+    uint256 hash(params[0].get_str());
+    int n = params[1].get_int();
+    if (n < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid output number");
+
+    CSpentIndexValue value;
+    if (!pblocktree->ReadSpentIndex(COutPoint(hash, n), value))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
+
+    Object result;
+    result.push_back(Pair("txid", value.txid.GetHex()));
+    result.push_back(Pair("index", (int)value.nInputIndex));
+    result.push_back(Pair("height", value.nHeight));
+    result.push_back(Pair("value", ValueFromAmount(value.nValue)));
+    if (value.chType != 0)
+        result.push_back(Pair("address", IndexedAddressToString(value.chType, value.hashAddress)));
+    return result;
 }
 
 Value gettxoutsetinfo(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( full )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "They are kept up to date with every block, so this call is fast, unless a full scan is requested.\n"
+            "\nArguments:\n"
+            "1. full    (boolean, optional, default=false) Also scan the whole set, to count the transactions and verify the statistics\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
             "  \"bestblock\": \"hex\",   (string) the best block hash hex\n"
-            "  \"transactions\": n,      (numeric) The number of transactions\n"
+            "  \"transactions\": n,      (numeric) The number of transactions (only with full)\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
             "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
-            "  \"total_amount\": x.xxx          (numeric) The total amount\n"
+            "  \"hash_utxos\": \"hash\",  (string) Order independent hash of all unspent outputs (a checksum, not a commitment)\n"
+            "  \"total_amount\": x.xxx,         (numeric) The total amount\n"
+            "  \"verified\": true|false  (boolean) Whether the scan matched the statistics (only with full)\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", "true")
             + HelpExampleRpc("gettxoutsetinfo", "")
         );
 
+    bool fFull = false;
+    if (params.size() > 0)
+        fFull = params[0].get_bool();
+
     Object ret;
 
     CCoinsStats stats;
-    if (pcoinsTip->GetStats(stats)) {
-        ret.push_back(Pair("height", (int64_t)stats.nHeight));
-        ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
-        ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
+    int nHeight = 0;
+    const leveldb::Snapshot *psnapshot = NULL;
+    {
+        LOCK(cs_main);
+        if (!pcoinsTip->GetStats(stats))
+            return ret;
+        BlockMap::iterator mi = mapBlockIndex.find(stats.hashBlock);
+        if (mi != mapBlockIndex.end())
+            nHeight = mi->second->nHeight;
+        if (fFull) {
+            // Get the database to exactly this state, then scan a snapshot
+            // of it without holding up block processing.
+            if (!pcoinsTip->Flush(true) || (pcoinsAsync && !pcoinsAsync->Sync()))
+                throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to write the coin database");
+            psnapshot = pcoinsdbview->GetSnapshot();
+        }
+    }
+
+    ret.push_back(Pair("height", (int64_t)nHeight));
+    ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
+    if (fFull) {
+        CCoinsStats scan;
+        bool fScanned = pcoinsdbview->ScanStats(scan, psnapshot);
+        pcoinsdbview->ReleaseSnapshot(psnapshot);
+        if (!fScanned)
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read the coin database");
+        ret.push_back(Pair("transactions", (int64_t)scan.nTransactions));
+        ret.push_back(Pair("txouts", (int64_t)scan.nTransactionOutputs));
+        ret.push_back(Pair("bytes_serialized", (int64_t)scan.nSerializedSize));
+        ret.push_back(Pair("hash_utxos", scan.hashSet.GetHex()));
+        ret.push_back(Pair("total_amount", ValueFromAmount(scan.nTotalAmount)));
+        bool fVerified = scan.hashBlock == stats.hashBlock &&
+                         scan.nTransactionOutputs == stats.nTransactionOutputs &&
+                         scan.nSerializedSize == stats.nSerializedSize &&
+                         scan.hashSet == stats.hashSet &&
+                         scan.nTotalAmount == stats.nTotalAmount;
+        ret.push_back(Pair("verified", fVerified));
+    } else {
         ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
         ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
-        ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+        ret.push_back(Pair("hash_utxos", stats.hashSet.GetHex()));
         ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
     }
     return ret;
 }
 
+Value dumptxoutset(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset \"filename\"\n"
+            "\nWrites the unspent transaction output set as of the current best block to a snapshot file,\n"
+            "which a node on an empty data directory can start from with -loadtxoutset.\n"
+            "The set is read from a database snapshot, so blocks keep being processed in the meantime.\n"
+            "\nArguments:\n"
+            "1. \"filename\"    (string, required) The file to write, relative to the data directory unless absolute\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"path\": \"...\",          (string) the file written\n"
+            "  \"height\": n,            (numeric) the height of the block the set is as of\n"
+            "  \"bestblock\": \"hex\",     (string) the hash of that block\n"
+            "  \"transactions\": n,      (numeric) the number of transactions with unspent outputs\n"
+            "  \"txouts\": n,            (numeric) the number of unspent outputs\n"
+            "  \"hash_utxos\": \"hash\",   (string) order independent hash of all unspent outputs, as gettxoutsetinfo\n"
+            "  \"hash_file\": \"hash\"     (string) the checksum of the file\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("dumptxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("dumptxoutset", "\"utxo.dat\"")
+        );
+
+    boost::filesystem::path path(params[0].get_str());
+    if (!path.is_complete())
+        path = GetDataDir() / path;
+    if (boost::filesystem::exists(path))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, path.string() + " already exists");
+
+    CTxOutSetSnapshotHeader header;
+    uint64_t nTransactions;
+    uint256 hashFile;
+    if (!DumpTxOutSet(path, header, nTransactions, hashFile))
+        throw JSONRPCError(RPC_MISC_ERROR, "Failed to write the snapshot");
+
+    Object ret;
+    ret.push_back(Pair("path", path.string()));
+    ret.push_back(Pair("height", header.nHeight));
+    ret.push_back(Pair("bestblock", header.hashBlock.GetHex()));
+    ret.push_back(Pair("transactions", (int64_t)nTransactions));
+    ret.push_back(Pair("txouts", header.totals.nOutputs));
+    ret.push_back(Pair("hash_utxos", header.totals.hashSet.GetHex()));
+    ret.push_back(Pair("hash_file", hashFile.GetHex()));
+    return ret;
+}
+
+static Object DBStatsToJSON(const CLevelDBStats &stats)
+{
+    Object obj;
+    obj.push_back(Pair("approximatesize", (int64_t)stats.nApproximateSize));
+    obj.push_back(Pair("writes",          (int64_t)stats.nWrites));
+    obj.push_back(Pair("writetime",       stats.nWriteMicros * 0.000001));
+    obj.push_back(Pair("maxwritetime",    stats.nMaxWriteMicros * 0.000001));
+    obj.push_back(Pair("stalls",          (int64_t)stats.nStalls));
+    obj.push_back(Pair("stalltime",       stats.nStallMicros * 0.000001));
+    Object options;
+    options.push_back(Pair("writebuffer",  (int64_t)(stats.nWriteBufferSize >> 10)));
+    options.push_back(Pair("maxopenfiles", stats.nMaxOpenFiles));
+    options.push_back(Pair("blocksize",    (int64_t)(stats.nBlockSize >> 10)));
+    options.push_back(Pair("compression",  stats.fCompression));
+    options.push_back(Pair("bloombits",    stats.nBloomBits));
+    obj.push_back(Pair("options", options));
+    obj.push_back(Pair("stats", stats.strStats));
+    return obj;
+}
+
+Value getdbstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getdbstats\n"
+            "Returns statistics about the LevelDB databases used for the chain state and the block index.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"chainstate\": {             (json object) the chain state database\n"
+            "    \"approximatesize\": n,     (numeric) approximate size on disk in bytes\n"
+            "    \"writes\": n,              (numeric) number of batches written since startup\n"
+            "    \"writetime\": x.xxx,       (numeric) total time spent writing, in seconds\n"
+            "    \"maxwritetime\": x.xxx,    (numeric) duration of the slowest write, in seconds\n"
+            "    \"stalls\": n,              (numeric) number of writes held up by compaction\n"
+            "    \"stalltime\": x.xxx,       (numeric) total duration of those writes, in seconds\n"
+            "    \"options\": {              (json object) effective tuning, see -chainstate.<option>\n"
+            "      \"writebuffer\": n,       (numeric) write buffer size in KiB\n"
+            "      \"maxopenfiles\": n,      (numeric) maximum number of open files\n"
+            "      \"blocksize\": n,         (numeric) table block size in KiB\n"
+            "      \"compression\": true|false, (boolean) whether tables are compressed\n"
+            "      \"bloombits\": n          (numeric) bloom filter bits per key, 0 if disabled\n"
+            "    },\n"
+            "    \"stats\": \"...\"           (string) LevelDB's per-level compaction statistics\n"
+            "  },\n"
+            "  \"blockindex\": { ... }       (json object) the block index database, same fields\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getdbstats", "")
+            + HelpExampleRpc("getdbstats", "")
+        );
+
+    LOCK(cs_main);
+    Object ret;
+    if (pcoinsdbview)
+        ret.push_back(Pair("chainstate", DBStatsToJSON(pcoinsdbview->GetDBStats())));
+    if (pblocktree)
+        ret.push_back(Pair("blockindex", DBStatsToJSON(pblocktree->GetDBStats())));
+    return ret;
+}
+
+Value getsigcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "Returns statistics about the cache of verified signatures.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"entries\": n,      (numeric) number of cached signatures\n"
+            "  \"maxentries\": n,   (numeric) maximum number of cached signatures\n"
+            "  \"usage\": n,        (numeric) approximate memory used in bytes\n"
+            "  \"maxusage\": n,     (numeric) memory limit in bytes, see -maxsigcachesize\n"
+            "  \"hits\": n,         (numeric) number of signature checks answered by the cache\n"
+            "  \"misses\": n,       (numeric) number of signature checks not in the cache\n"
+            "  \"evictions\": n     (numeric) number of entries dropped to make room\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getsigcacheinfo", "")
+            + HelpExampleRpc("getsigcacheinfo", "")
+        );
+
+    CSigCacheStats stats = GetSignatureCacheStats();
+    Object ret;
+    ret.push_back(Pair("entries",    (int64_t)stats.nEntries));
+    ret.push_back(Pair("maxentries", (int64_t)stats.nMaxEntries));
+    ret.push_back(Pair("usage",      (int64_t)stats.nUsage));
+    ret.push_back(Pair("maxusage",   (int64_t)stats.nMaxUsage));
+    ret.push_back(Pair("hits",       (int64_t)stats.nHits));
+    ret.push_back(Pair("misses",     (int64_t)stats.nMisses));
+    ret.push_back(Pair("evictions",  (int64_t)stats.nEvictions));
+    return ret;
+}
+
 Value gettxout(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -367,7 +950,6 @@ Value gettxout(const Array& params, bool fHelp)
             "        ,...\n"
             "     ]\n"
             "  },\n"
-            "  \"version\" : n,            (numeric) The version\n"
             "  \"coinbase\" : true|false   (boolean) Coinbase or not\n"
             "}\n"
 
@@ -389,33 +971,33 @@ Value gettxout(const Array& params, bool fHelp)
     if (params.size() > 2)
         fMempool = params[2].get_bool();
 
-    CCoins coins;
+    if (n < 0)
+        return Value::null;
+    COutPoint out(hash, n);
+
+    CCoin coin;
     if (fMempool) {
         LOCK(mempool.cs);
         CCoinsViewMemPool view(*pcoinsTip, mempool);
-        if (!view.GetCoins(hash, coins))
+        if (!view.GetCoin(out, coin) || mempool.isSpent(out))
             return Value::null;
-        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
     } else {
-        if (!pcoinsTip->GetCoins(hash, coins))
+        if (!pcoinsTip->GetCoin(out, coin))
             return Value::null;
     }
-    if (n<0 || (unsigned int)n>=coins.vout.size() || coins.vout[n].IsNull())
-        return Value::null;
 
-    std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
+    BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     CBlockIndex *pindex = it->second;
     ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
-    if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
+    if (coin.nHeight == MEMPOOL_HEIGHT)
         ret.push_back(Pair("confirmations", 0));
     else
-        ret.push_back(Pair("confirmations", pindex->nHeight - coins.nHeight + 1));
-    ret.push_back(Pair("value", ValueFromAmount(coins.vout[n].nValue)));
+        ret.push_back(Pair("confirmations", pindex->nHeight - (int)coin.nHeight + 1));
+    ret.push_back(Pair("value", ValueFromAmount(coin.out.nValue)));
     Object o;
-    ScriptPubKeyToJSON(coins.vout[n].scriptPubKey, o, true);
+    ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
     ret.push_back(Pair("scriptPubKey", o));
-    ret.push_back(Pair("version", coins.nVersion));
-    ret.push_back(Pair("coinbase", coins.fCoinBase));
+    ret.push_back(Pair("coinbase", coin.fCoinBase));
 
     return ret;
 }
@@ -446,6 +1028,176 @@ Value verifychain(const Array& params, bool fHelp)
     return VerifyDB(nCheckLevel, nCheckDepth);
 }
 
+static Object ReplayStatsToJSON(const CBlockReplayStats &stats)
+{
+    const CBlockConnectTimings &timings = stats.timings;
+    Object obj;
+    obj.push_back(Pair("blocks", (int)stats.nBlocks));
+    obj.push_back(Pair("transactions", (int64_t)stats.nTransactions));
+    obj.push_back(Pair("inputs", (int64_t)stats.nInputs));
+    obj.push_back(Pair("disconnectms", 0.001 * stats.nDisconnect));
+    obj.push_back(Pair("fetchms", 0.001 * timings.nFetch));
+    obj.push_back(Pair("connectms", 0.001 * timings.nConnect));
+    obj.push_back(Pair("scriptsms", 0.001 * timings.nScripts));
+    obj.push_back(Pair("undoms", 0.001 * timings.nUndo));
+    obj.push_back(Pair("flushms", 0.001 * timings.nFlush));
+    int64_t nTotal = timings.nFetch + timings.nConnect + timings.nScripts + timings.nUndo + timings.nFlush;
+    obj.push_back(Pair("totalms", 0.001 * nTotal));
+    obj.push_back(Pair("msperblock", stats.nBlocks ? 0.001 * nTotal / stats.nBlocks : 0));
+    return obj;
+}
+
+Value replayblocks(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "replayblocks ( numblocks )\n"
+            "\nDisconnects the last blocks of the best chain and connects them again, in memory only,\n"
+            "and reports how long each phase of connecting them took. The chain state on disk is\n"
+            "not changed; the undo data is written to a scratch file in the data directory.\n"
+            "The blocks replayed are limited by the coins cache size (-dbcache).\n"
+            "\nArguments:\n"
+            "1. numblocks    (numeric, optional, default=144, 0=all) The number of blocks to replay.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"blocks\": n,            (numeric) number of blocks replayed\n"
+            "  \"transactions\": n,      (numeric) number of transactions in them\n"
+            "  \"inputs\": n,            (numeric) number of transaction inputs in them\n"
+            "  \"disconnectms\": x.xxx,  (numeric) time spent disconnecting the blocks\n"
+            "  \"fetchms\": x.xxx,       (numeric) time spent reading the inputs\n"
+            "  \"connectms\": x.xxx,     (numeric) time spent checking the inputs and updating the coins\n"
+            "  \"scriptsms\": x.xxx,     (numeric) time spent waiting for the script checks\n"
+            "  \"undoms\": x.xxx,        (numeric) time spent writing the undo data\n"
+            "  \"flushms\": x.xxx,       (numeric) time spent flushing the coins of each block\n"
+            "  \"totalms\": x.xxx,       (numeric) time spent connecting, all phases together\n"
+            "  \"msperblock\": x.xxx,    (numeric) the same, per block\n"
+            "  \"periods\": [            (array of json objects) the same figures per period of the difficulty rules\n"
+            "    {\n"
+            "      \"rulesheight\": n,   (numeric) height the rules of the period start at\n"
+            "      \"firstheight\": n,   (numeric) first block of the period replayed\n"
+            "      \"lastheight\": n,    (numeric) last block of the period replayed\n"
+            "      ...                 the figures above\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("replayblocks", "1000")
+            + HelpExampleRpc("replayblocks", "1000")
+        );
+
+    int nBlocks = 144;
+    if (params.size() > 0)
+        nBlocks = params[0].get_int();
+
+    std::vector<CBlockReplayStats> vStats;
+    if (!ReplayBlocks(nBlocks, vStats))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Replaying the blocks failed, see debug.log");
+
+    CBlockReplayStats total;
+    Array periods;
+    BOOST_FOREACH(const CBlockReplayStats &stats, vStats) {
+        Object period;
+        period.push_back(Pair("rulesheight", stats.nRulesHeight));
+        period.push_back(Pair("firstheight", stats.nFirstHeight));
+        period.push_back(Pair("lastheight", stats.nLastHeight));
+        Object figures = ReplayStatsToJSON(stats);
+        period.insert(period.end(), figures.begin(), figures.end());
+        periods.push_back(period);
+
+        total.nBlocks += stats.nBlocks;
+        total.nTransactions += stats.nTransactions;
+        total.nInputs += stats.nInputs;
+        total.nDisconnect += stats.nDisconnect;
+        total.timings += stats.timings;
+    }
+    Object ret = ReplayStatsToJSON(total);
+    ret.push_back(Pair("periods", periods));
+    return ret;
+}
+
+Value getblockprofile(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 2)
+        throw runtime_error(
+            "getblockprofile ( count \"blockhash\" )\n"
+            "\nReturns where the time went connecting the last blocks to the tip, newest first.\n"
+            "The last -blockprofiles blocks connected are kept.\n"
+            "\nArguments:\n"
+            "1. count        (numeric, optional, default=10, 0=all) The number of blocks to return\n"
+            "2. \"blockhash\"  (string, optional) Only this block, once per time it was connected\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"hash\": \"hash\",         (string) the block hash\n"
+            "    \"height\": n,            (numeric) its height\n"
+            "    \"time\": ttt,            (numeric) when it was connected, in seconds since epoch\n"
+            "    \"tx\": n,                (numeric) number of transactions\n"
+            "    \"inputs\": n,            (numeric) number of transaction inputs\n"
+            "    \"size\": n,              (numeric) block size in bytes\n"
+            "    \"readms\": x.xxx,        (numeric) reading and deserializing it from disk\n"
+            "    \"powms\": x.xxx,         (numeric) checking its proof of work, if not done on receipt\n"
+            "    \"checkms\": x.xxx,       (numeric) the other context-free checks (CheckBlock)\n"
+            "    \"fetchms\": x.xxx,       (numeric) reading the inputs into the coins cache\n"
+            "    \"connectms\": x.xxx,     (numeric) checking the inputs and updating the coins, queuing the scripts\n"
+            "    \"scriptsms\": x.xxx,     (numeric) waiting for the script checks\n"
+            "    \"scriptchecks\": n,      (numeric) script checks queued\n"
+            "    \"scriptverifyms\": x.xxx, (numeric) time the script checks took, summed over the threads\n"
+            "    \"undoms\": x.xxx,        (numeric) writing the undo data\n"
+            "    \"indexms\": x.xxx,       (numeric) writing the block, transaction, address and filter indexes\n"
+            "    \"flushms\": x.xxx,       (numeric) flushing its coins into the coins cache\n"
+            "    \"chainstatems\": x.xxx,  (numeric) writing the chain state to disk, when due\n"
+            "    \"mempoolms\": x.xxx,     (numeric) removing its transactions and their conflicts from the mempool\n"
+            "    \"walletms\": x.xxx,      (numeric) queuing the wallet notifications\n"
+            "    \"totalms\": x.xxx        (numeric) connecting it, from reading it to the wallet notifications\n"
+            "  }, ...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockprofile", "")
+            + HelpExampleCli("getblockprofile", "0 \"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\"")
+            + HelpExampleRpc("getblockprofile", "100")
+        );
+
+    unsigned int nCount = 10;
+    if (params.size() > 0)
+        nCount = std::max(params[0].get_int(), 0);
+    uint256 hash = 0;
+    if (params.size() > 1)
+        hash.SetHex(params[1].get_str());
+
+    std::vector<CBlockProfile> vProfiles = GetBlockProfiles(hash);
+    Array ret;
+    for (std::vector<CBlockProfile>::reverse_iterator it = vProfiles.rbegin(); it != vProfiles.rend(); ++it) {
+        if (nCount && ret.size() >= nCount)
+            break;
+        const CBlockProfile &profile = *it;
+        const CBlockConnectTimings &timings = profile.timings;
+        Object obj;
+        obj.push_back(Pair("hash", profile.hash.GetHex()));
+        obj.push_back(Pair("height", profile.nHeight));
+        obj.push_back(Pair("time", profile.nTime));
+        obj.push_back(Pair("tx", (int)profile.nTx));
+        obj.push_back(Pair("inputs", (int)profile.nInputs));
+        obj.push_back(Pair("size", (int)profile.nSize));
+        obj.push_back(Pair("readms", 0.001 * profile.nRead));
+        obj.push_back(Pair("powms", 0.001 * timings.nPoW));
+        obj.push_back(Pair("checkms", 0.001 * timings.nCheck));
+        obj.push_back(Pair("fetchms", 0.001 * timings.nFetch));
+        obj.push_back(Pair("connectms", 0.001 * timings.nConnect));
+        obj.push_back(Pair("scriptsms", 0.001 * timings.nScripts));
+        obj.push_back(Pair("scriptchecks", (int)timings.nScriptChecks));
+        obj.push_back(Pair("scriptverifyms", 0.001 * timings.nScriptVerify));
+        obj.push_back(Pair("undoms", 0.001 * timings.nUndo));
+        obj.push_back(Pair("indexms", 0.001 * timings.nIndex));
+        obj.push_back(Pair("flushms", 0.001 * timings.nFlush));
+        obj.push_back(Pair("chainstatems", 0.001 * profile.nChainState));
+        obj.push_back(Pair("mempoolms", 0.001 * profile.nMempool));
+        obj.push_back(Pair("walletms", 0.001 * profile.nWallet));
+        obj.push_back(Pair("totalms", 0.001 * profile.nTotal));
+        ret.push_back(obj);
+    }
+    return ret;
+}
+
 Value getblockchaininfo(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -459,7 +1211,35 @@ Value getblockchaininfo(const Array& params, bool fHelp)
             "  \"bestblockhash\": \"...\", (string) the hash of the currently best block\n"
             "  \"difficulty\": xxxxxx,     (numeric) the current difficulty\n"
             "  \"verificationprogress\": xxxx, (numeric) estimate of verification progress [0..1]\n"
-            "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"chainwork\": \"xxxx\",    (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"chainstateflush\": {     (json object) background writes of the chain state\n"
+            "    \"flushes\": n,          (numeric) number of completed writes\n"
+            "    \"outputs\": n,          (numeric) total number of changed outputs written\n"
+            "    \"pending\": true|false, (boolean) whether a write is queued or in progress\n"
+            "    \"lastms\": x.xxx,       (numeric) duration of the last write in milliseconds\n"
+            "    \"maxms\": x.xxx,        (numeric) duration of the slowest write in milliseconds\n"
+            "    \"avgms\": x.xxx,        (numeric) average duration of a write in milliseconds\n"
+            "    \"waitms\": x.xxx        (numeric) total time block connection waited for writes in milliseconds\n"
+            "  },\n"
+            "  \"import\": {              (json object) the last block import (-reindex, bootstrap.dat or -loadblock), if any\n"
+            "    \"active\": true|false,  (boolean) whether the import is still running\n"
+            "    \"file\": \"...\",         (string) the file being imported\n"
+            "    \"files\": n,            (numeric) number of files to import\n"
+            "    \"filesdone\": n,        (numeric) number of files imported\n"
+            "    \"progress\": x.xxx,     (numeric) fraction of the bytes imported [0..1]\n"
+            "    \"blocks\": n,           (numeric) number of blocks loaded\n"
+            "    \"invalid\": n,          (numeric) number of records that were no valid block\n"
+            "    \"elapsed\": n           (numeric) seconds since the import started\n"
+            "  },\n"
+            "  \"indexbuild\": {          (json object) the background build of indexes enabled on an existing chain, if running\n"
+            "    \"txindex\": true|false,      (boolean) whether the transaction index is being built\n"
+            "    \"addressindex\": true|false, (boolean) whether the address index is being built\n"
+            "    \"spentindex\": true|false,   (boolean) whether the spent index is being built\n"
+            "    \"height\": n                 (numeric) the height up to which the indexes are built\n"
+            "  },\n"
+            "  \"pruned\": true|false,     (boolean) whether block files are pruned (-prune)\n"
+            "  \"pruneheight\": n,         (numeric) the lowest height of the active chain with block data, if pruned\n"
+            "  \"prunetargetsize\": n      (numeric) the target size of the block and undo files in bytes, if pruned\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getblockchaininfo", "")
@@ -479,5 +1259,114 @@ Value getblockchaininfo(const Array& params, bool fHelp)
     obj.push_back(Pair("difficulty",    (double)GetDifficulty(NULL, miningAlgo)));
     obj.push_back(Pair("verificationprogress", Checkpoints::GuessVerificationProgress(chainActive.Tip())));
     obj.push_back(Pair("chainwork",     chainActive.Tip()->nChainWork.GetHex()));
+    if (pcoinsAsync) {
+        CCoinsFlushStats stats = pcoinsAsync->GetFlushStats();
+        Object flush;
+        flush.push_back(Pair("flushes", (int64_t)stats.nFlushes));
+        flush.push_back(Pair("outputs", (int64_t)stats.nEntries));
+        flush.push_back(Pair("pending", stats.fPending));
+        flush.push_back(Pair("lastms",  stats.nLastMicros * 0.001));
+        flush.push_back(Pair("maxms",   stats.nMaxMicros * 0.001));
+        flush.push_back(Pair("avgms",   stats.nFlushes ? stats.nTotalMicros * 0.001 / stats.nFlushes : 0.0));
+        flush.push_back(Pair("waitms",  stats.nWaitMicros * 0.001));
+        obj.push_back(Pair("chainstateflush", flush));
+    }
+    CImportProgress progress = GetImportProgress();
+    if (progress.nFiles > 0) {
+        Object import;
+        import.push_back(Pair("active",    progress.fActive));
+        import.push_back(Pair("file",      progress.strFile));
+        import.push_back(Pair("files",     (int)progress.nFiles));
+        import.push_back(Pair("filesdone", (int)progress.nFilesDone));
+        import.push_back(Pair("progress",  progress.nBytes ? (double)progress.nBytesDone / progress.nBytes : 1.0));
+        import.push_back(Pair("blocks",    (int64_t)progress.nBlocksLoaded));
+        import.push_back(Pair("invalid",   (int64_t)progress.nBlocksInvalid));
+        import.push_back(Pair("elapsed",   GetTime() - progress.nStartTime));
+        obj.push_back(Pair("import", import));
+    }
+    int nIndexHeight;
+    if (IsIndexBuilding(INDEX_BUILD_TX | INDEX_BUILD_ADDRESS | INDEX_BUILD_SPENT, &nIndexHeight)) {
+        Object build;
+        build.push_back(Pair("txindex",      IsIndexBuilding(INDEX_BUILD_TX)));
+        build.push_back(Pair("addressindex", IsIndexBuilding(INDEX_BUILD_ADDRESS)));
+        build.push_back(Pair("spentindex",   IsIndexBuilding(INDEX_BUILD_SPENT)));
+        build.push_back(Pair("height",       nIndexHeight));
+        obj.push_back(Pair("indexbuild", build));
+    }
+    obj.push_back(Pair("pruned", fPruneMode));
+    if (fPruneMode) {
+        CBlockIndex *pindex = chainActive.Tip();
+        while (pindex->pprev && (pindex->pprev->nStatus & BLOCK_HAVE_DATA))
+            pindex = pindex->pprev;
+        obj.push_back(Pair("pruneheight", pindex->nHeight));
+        obj.push_back(Pair("prunetargetsize", (int64_t)nPruneTarget));
+    }
     return obj;
 }
+
+// Highest tips first
+struct CompareTipsByHeight
+{
+    bool operator()(const CBlockIndex* a, const CBlockIndex* b) const
+    {
+        if (a->nHeight != b->nHeight)
+            return a->nHeight > b->nHeight;
+        return a < b;
+    }
+};
+
+Value getchaintips(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getchaintips\n"
+            "Return information about all known tips in the block tree, including the main chain as well as orphaned branches.\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"height\": xxxx,         (numeric) height of the chain tip\n"
+            "    \"hash\": \"xxxx\",         (string) block hash of the tip\n"
+            "    \"algo\": \"xxxx\",         (string) proof-of-work algorithm of the tip\n"
+            "    \"chainwork\": \"xxxx\",    (string) total amount of work up to the tip, in hexadecimal\n"
+            "    \"forkheight\": xxxx,     (numeric) height of the last block shared with the main chain\n"
+            "    \"branchlen\": xxxx,      (numeric) length of the branch connecting the tip to the main chain, 0 for the main chain\n"
+            "    \"status\": \"xxxx\"        (string) \"active\" for the main chain, \"invalid\" for a branch with an invalid block,\n"
+            "                              \"valid-fork\" for a branch that was fully validated, \"valid-headers\" otherwise\n"
+            "  },\n"
+            "  ...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getchaintips", "")
+            + HelpExampleRpc("getchaintips", "")
+        );
+
+    std::set<const CBlockIndex*, CompareTipsByHeight> setTips(setChainTips.begin(), setChainTips.end());
+
+    Array res;
+    BOOST_FOREACH(const CBlockIndex* pindex, setTips)
+    {
+        const CBlockIndex* pindexFork = chainActive.FindFork(pindex);
+
+        Object obj;
+        obj.push_back(Pair("height", pindex->nHeight));
+        obj.push_back(Pair("hash", pindex->GetBlockHash().GetHex()));
+        obj.push_back(Pair("algo", GetAlgoName(pindex->GetAlgo())));
+        obj.push_back(Pair("chainwork", pindex->nChainWork.GetHex()));
+        obj.push_back(Pair("forkheight", pindexFork ? pindexFork->nHeight : -1));
+        obj.push_back(Pair("branchlen", pindex->nHeight - (pindexFork ? pindexFork->nHeight : -1)));
+
+        std::string status;
+        if (chainActive.Contains(pindex))
+            status = "active";
+        else if (pindex->nStatus & BLOCK_FAILED_MASK)
+            status = "invalid";
+        else if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_SCRIPTS)
+            status = "valid-fork";
+        else
+            status = "valid-headers";
+        obj.push_back(Pair("status", status));
+
+        res.push_back(obj);
+    }
+    return res;
+}
@@ -113,6 +113,14 @@ void ConvertTo(Value& value, bool fAllowNull=false)
     }
 }
 
+// Parse a string as any JSON value, for parameters that take several types
+static void ConvertToAny(Value& value)
+{
+    Value value2;
+    if (value.type() == str_type && read_string(value.get_str(), value2))
+        value = value2;
+}
+
 // Convert strings to command-specific RPC representation
 Array RPCConvertValues(const std::string &strMethod, const std::vector<std::string> &strParams)
 {
@@ -126,7 +134,10 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     // Special case non-string parameter types
     //
     if (strMethod == "stop"                   && n > 0) ConvertTo<bool>(params[0]);
+    if (strMethod == "getlockstats"           && n > 0) ConvertTo<bool>(params[0]);
+    if (strMethod == "getrpcstats"            && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "getaddednodeinfo"       && n > 0) ConvertTo<bool>(params[0]);
+    if (strMethod == "getpropagationtrace"    && n > 1) ConvertTo<bool>(params[1]);
     if (strMethod == "setgenerate"            && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "setgenerate"            && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "getnetworkhashps"       && n > 0) ConvertTo<int64_t>(params[0]);
@@ -141,13 +152,18 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "listreceivedbyaccount"  && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "listreceivedbyaccount"  && n > 1) ConvertTo<bool>(params[1]);
     if (strMethod == "getbalance"             && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "getbalance"             && n > 2) ConvertTo<bool>(params[2]);
     if (strMethod == "getblockhash"           && n > 0) ConvertTo<int64_t>(params[0]);
+    if (strMethod == "getaddresstxids"        && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "getaddresstxids"        && n > 2) ConvertTo<int64_t>(params[2]);
+    if (strMethod == "getspentinfo"           && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "move"                   && n > 2) ConvertTo<double>(params[2]);
     if (strMethod == "move"                   && n > 3) ConvertTo<int64_t>(params[3]);
     if (strMethod == "sendfrom"               && n > 2) ConvertTo<double>(params[2]);
     if (strMethod == "sendfrom"               && n > 3) ConvertTo<int64_t>(params[3]);
     if (strMethod == "listtransactions"       && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "listtransactions"       && n > 2) ConvertTo<int64_t>(params[2]);
+    if (strMethod == "listtransactions"       && n > 3) ConvertTo<int64_t>(params[3]);
     if (strMethod == "listaccounts"           && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "walletpassphrase"       && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "getblocktemplate"       && n > 0) ConvertTo<Object>(params[0]);
@@ -161,20 +177,37 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "listunspent"            && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "listunspent"            && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "listunspent"            && n > 2) ConvertTo<Array>(params[2]);
-    if (strMethod == "getblock"               && n > 1) ConvertTo<bool>(params[1]);
+    if (strMethod == "getblock"               && n > 1) ConvertToAny(params[1]);
+    if (strMethod == "getblocks"              && n > 0) ConvertTo<int64_t>(params[0]);
+    if (strMethod == "getblocks"              && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "getblocks"              && n > 2) ConvertToAny(params[2]);
     if (strMethod == "getrawtransaction"      && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "getrawtransactions"     && n > 0) ConvertTo<Array>(params[0]);
+    if (strMethod == "getrawtransactions"     && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "gettxoutproof"          && n > 0) ConvertTo<Array>(params[0]);
     if (strMethod == "createrawtransaction"   && n > 0) ConvertTo<Array>(params[0]);
     if (strMethod == "createrawtransaction"   && n > 1) ConvertTo<Object>(params[1]);
     if (strMethod == "signrawtransaction"     && n > 1) ConvertTo<Array>(params[1], true);
     if (strMethod == "signrawtransaction"     && n > 2) ConvertTo<Array>(params[2], true);
     if (strMethod == "sendrawtransaction"     && n > 1) ConvertTo<bool>(params[1], true);
+    if (strMethod == "sendrawtransactions"    && n > 0) ConvertTo<Array>(params[0]);
+    if (strMethod == "verifymessages"         && n > 0) ConvertTo<Array>(params[0]);
+    if ((strMethod == "getaddresstxids" || strMethod == "getaddressutxos" || strMethod == "getaddressbalance")
+        && n > 0 && boost::starts_with(params[0].get_str(), "[")) ConvertTo<Array>(params[0]);
+    if (strMethod == "sendrawtransactions"    && n > 1) ConvertTo<bool>(params[1], true);
+    if (strMethod == "gettxoutsetinfo"        && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "gettxout"               && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "gettxout"               && n > 2) ConvertTo<bool>(params[2]);
     if (strMethod == "lockunspent"            && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "lockunspent"            && n > 1) ConvertTo<Array>(params[1]);
     if (strMethod == "importprivkey"          && n > 2) ConvertTo<bool>(params[2]);
+    if (strMethod == "importprivkeys"         && n > 0) ConvertTo<Array>(params[0]);
+    if (strMethod == "importprivkeys"         && n > 1) ConvertTo<bool>(params[1]);
+    if (strMethod == "importaddress"          && n > 2) ConvertTo<bool>(params[2]);
     if (strMethod == "verifychain"            && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "verifychain"            && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "replayblocks"           && n > 0) ConvertTo<int64_t>(params[0]);
+    if (strMethod == "getblockprofile"        && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "keypoolrefill"          && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "getrawmempool"          && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "sendtostealthaddress"   && n > 1) ConvertTo<double>(params[1]);
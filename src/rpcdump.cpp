@@ -8,11 +8,13 @@
 #include "main.h"
 #include "sync.h"
 #include "wallet.h"
+#include "workpool.h"
 
 #include <fstream>
 #include <stdint.h>
 
 #include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include "json/json_spirit_value.h"
 
@@ -97,6 +99,9 @@ Value importprivkey(const Array& params, bool fHelp)
     if (params.size() > 2)
         fRescan = params[2].get_bool();
 
+    if (fRescan && fHavePruned)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Rescan is disabled in pruned mode");
+
     CBitcoinSecret vchSecret;
     bool fGood = vchSecret.SetString(strSecret);
 
@@ -124,10 +129,225 @@ Value importprivkey(const Array& params, bool fHelp)
 
         // whenever a key is imported, we need to scan the whole chain
         pwalletMain->nTimeFirstKey = 1; // 0 would be considered 'no value'
+    }
+
+    if (fRescan) {
+        CBlockIndex *pindexGenesis;
+        {
+            LOCK(cs_main);
+            pindexGenesis = chainActive.Genesis();
+        }
+        pwalletMain->ScanForWalletTransactions(pindexGenesis, true);
+    }
+
+    return Value::null;
+}
+
+Value importprivkeys(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "importprivkeys [\"digitalcoinprivkey\",{\"privkey\":\"digitalcoinprivkey\",\"label\":\"label\",\"timestamp\":n},...] ( rescan )\n"
+            "\nAdds private keys (as returned by dumpprivkey) to your wallet in one database transaction,\n"
+            "then rescans the block chain once, from the earliest key birthday.\n"
+            "\nArguments:\n"
+            "1. keys                  (array, required) The keys, each a private key or an object with\n"
+            "     \"privkey\"           (string, required) The private key\n"
+            "     \"label\"             (string, optional) A label for its address\n"
+            "     \"timestamp\"         (numeric, optional) Creation time of the key, to rescan from; without it the whole chain is rescanned\n"
+            "2. rescan                (boolean, optional, default=true) Rescan the wallet for transactions\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"imported\" : n,        (numeric) Keys added to the wallet\n"
+            "  \"existing\" : n,        (numeric) Keys the wallet already had\n"
+            "  \"rescanned\" : n,       (numeric) Blocks rescanned\n"
+            "  \"transactions\" : n     (numeric) Wallet transactions the rescan added or updated\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("importprivkeys", "'[\"mykey1\",{\"privkey\":\"mykey2\",\"label\":\"testing\",\"timestamp\":1400000000}]'") +
+            "\nImport without rescan\n"
+            + HelpExampleCli("importprivkeys", "'[\"mykey1\",\"mykey2\"]' false") +
+            "\nAs a json rpc call\n"
+            + HelpExampleRpc("importprivkeys", "[\"mykey1\",\"mykey2\"], false")
+        );
+
+    EnsureWalletIsUnlocked();
+
+    const Array& keys = params[0].get_array();
+
+    // Whether to perform rescan after import
+    bool fRescan = true;
+    if (params.size() > 1)
+        fRescan = params[1].get_bool();
+
+    if (fRescan && fHavePruned)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Rescan is disabled in pruned mode");
+
+    // Decode every key first, so that a bad one imports none
+    vector<CKey> vKeys;
+    vector<string> vLabels;
+    vector<int64_t> vTimes;
+    BOOST_FOREACH(const Value& entry, keys)
+    {
+        string strSecret, strLabel;
+        int64_t nTime = 1; // 0 would be considered 'no value'
+        if (entry.type() == obj_type)
+        {
+            const Object& o = entry.get_obj();
+            strSecret = find_value(o, "privkey").get_str();
+            const Value& label = find_value(o, "label");
+            if (label.type() != null_type)
+                strLabel = label.get_str();
+            const Value& timestamp = find_value(o, "timestamp");
+            if (timestamp.type() != null_type)
+                nTime = std::max(timestamp.get_int64(), (int64_t)1);
+        }
+        else
+            strSecret = entry.get_str();
+
+        CBitcoinSecret vchSecret;
+        if (!vchSecret.SetString(strSecret))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid private key encoding");
+        CKey key = vchSecret.GetKey();
+        if (!key.IsValid())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Private key outside allowed range");
+        vKeys.push_back(key);
+        vLabels.push_back(strLabel);
+        vTimes.push_back(nTime);
+    }
+
+    int nImported = 0, nExisting = 0;
+    CBlockIndex *pindex = NULL;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+
+        pwalletMain->MarkDirty();
+        int64_t nTimeBegin = chainActive.Tip()->nTime;
+        {
+            // The keys and their labels are written in one database transaction
+            CDBBatch batch(pwalletMain->fFileBacked ? pwalletMain->strWalletFile.c_str() : NULL);
+            for (unsigned int i = 0; i < vKeys.size(); i++)
+            {
+                CPubKey pubkey = vKeys[i].GetPubKey();
+                CKeyID keyid = pubkey.GetID();
+                pwalletMain->SetAddressBook(keyid, vLabels[i], "receive");
+
+                // Don't throw error in case a key is already there
+                if (pwalletMain->HaveKey(keyid)) {
+                    nExisting++;
+                    continue;
+                }
+
+                pwalletMain->mapKeyMetadata[keyid].nCreateTime = vTimes[i];
+                if (!pwalletMain->AddKeyPubKey(vKeys[i], pubkey))
+                    throw JSONRPCError(RPC_WALLET_ERROR, "Error adding key to wallet");
+                nTimeBegin = std::min(nTimeBegin, vTimes[i]);
+                nImported++;
+            }
+        }
+
+        if (nImported > 0)
+        {
+            if (!pwalletMain->nTimeFirstKey || nTimeBegin < pwalletMain->nTimeFirstKey)
+                pwalletMain->nTimeFirstKey = nTimeBegin;
+
+            // Rescan from the earliest birthday (as adjusted for block time
+            // variability), or the whole chain for a key without one
+            pindex = chainActive.Tip();
+            while (pindex && pindex->pprev && pindex->nTime > nTimeBegin - 7200)
+                pindex = pindex->pprev;
+        }
+    }
+
+    Object result;
+    result.push_back(Pair("imported", nImported));
+    result.push_back(Pair("existing", nExisting));
+    int nRescanned = 0, nTransactions = 0;
+    if (fRescan && pindex) {
+        {
+            LOCK(cs_main);
+            nRescanned = chainActive.Height() - pindex->nHeight + 1;
+        }
+        LogPrintf("Rescanning last %i blocks for %d imported keys\n", nRescanned, nImported);
+        nTransactions = pwalletMain->ScanForWalletTransactions(pindex, true);
+    }
+    result.push_back(Pair("rescanned", nRescanned));
+    result.push_back(Pair("transactions", nTransactions));
+    return result;
+}
+
+Value importaddress(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "importaddress \"address\" ( \"label\" rescan )\n"
+            "\nAdds an address or script (in hex) that can be watched as if it were in your wallet but cannot be used to spend.\n"
+            "Its outputs are not part of the balance, and are listed by getbalance \"*\" with includeWatchonly.\n"
+            "\nArguments:\n"
+            "1. \"address\"          (string, required) The address or script\n"
+            "2. \"label\"            (string, optional, default=\"\") An optional label\n"
+            "3. rescan               (boolean, optional, default=true) Rescan the wallet for transactions\n"
+            "\nExamples:\n"
+            "\nImport an address with rescan\n"
+            + HelpExampleCli("importaddress", "\"myaddress\"") +
+            "\nImport using a label without rescan\n"
+            + HelpExampleCli("importaddress", "\"myaddress\" \"testing\" false") +
+            "\nAs a json rpc call\n"
+            + HelpExampleRpc("importaddress", "\"myaddress\", \"testing\", false")
+        );
+
+    CScript script;
+
+    CBitcoinAddress address(params[0].get_str());
+    if (address.IsValid()) {
+        script.SetDestination(address.Get());
+    } else if (IsHex(params[0].get_str())) {
+        std::vector<unsigned char> data(ParseHex(params[0].get_str()));
+        script = CScript(data.begin(), data.end());
+    } else {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Digitalcoin address or script");
+    }
 
-        if (fRescan) {
-            pwalletMain->ScanForWalletTransactions(chainActive.Genesis(), true);
+    string strLabel = "";
+    if (params.size() > 1)
+        strLabel = params[1].get_str();
+
+    // Whether to perform rescan after import
+    bool fRescan = true;
+    if (params.size() > 2)
+        fRescan = params[2].get_bool();
+
+    if (fRescan && fHavePruned)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Rescan is disabled in pruned mode");
+
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+
+        if (::IsMine(*pwalletMain, script))
+            throw JSONRPCError(RPC_WALLET_ERROR, "The wallet already contains the private key for this address or script");
+
+        // add to address book or update label
+        if (address.IsValid())
+            pwalletMain->SetAddressBook(address.Get(), strLabel, "receive");
+
+        // Don't throw error in case an address is already there
+        if (pwalletMain->HaveWatchOnly(script))
+            return Value::null;
+
+        pwalletMain->MarkDirty();
+
+        if (!pwalletMain->AddWatchOnly(script))
+            throw JSONRPCError(RPC_WALLET_ERROR, "Error adding address to wallet");
+    }
+
+    if (fRescan) {
+        CBlockIndex *pindexGenesis;
+        {
+            LOCK(cs_main);
+            pindexGenesis = chainActive.Genesis();
         }
+        pwalletMain->ScanForWalletTransactions(pindexGenesis, true);
+        pwalletMain->ReacceptWalletTransactions();
     }
 
     return Value::null;
@@ -150,78 +370,85 @@ Value importwallet(const Array& params, bool fHelp)
             + HelpExampleRpc("importwallet", "\"test\"")
         );
 
-    EnsureWalletIsUnlocked();
-
-    ifstream file;
-    file.open(params[0].get_str().c_str(), std::ios::in | std::ios::ate);
-    if (!file.is_open())
-        throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot open wallet dump file");
-
-    int64_t nTimeBegin = chainActive.Tip()->nTime;
-
+    CBlockIndex *pindex;
     bool fGood = true;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
 
-    int64_t nFilesize = std::max((int64_t)1, (int64_t)file.tellg());
-    file.seekg(0, file.beg);
-
-    pwalletMain->ShowProgress(_("Importing..."), 0); // show progress dialog in GUI
-    while (file.good()) {
-        pwalletMain->ShowProgress("", std::max(1, std::min(99, (int)(((double)file.tellg() / (double)nFilesize) * 100))));
-        std::string line;
-        std::getline(file, line);
-        if (line.empty() || line[0] == '#')
-            continue;
-
-        std::vector<std::string> vstr;
-        boost::split(vstr, line, boost::is_any_of(" "));
-        if (vstr.size() < 2)
-            continue;
-        CBitcoinSecret vchSecret;
-        if (!vchSecret.SetString(vstr[0]))
-            continue;
-        CKey key = vchSecret.GetKey();
-        CPubKey pubkey = key.GetPubKey();
-        CKeyID keyid = pubkey.GetID();
-        if (pwalletMain->HaveKey(keyid)) {
-            LogPrintf("Skipping import of %s (key already present)\n", CBitcoinAddress(keyid).ToString());
-            continue;
-        }
-        int64_t nTime = DecodeDumpTime(vstr[1]);
-        std::string strLabel;
-        bool fLabel = true;
-        for (unsigned int nStr = 2; nStr < vstr.size(); nStr++) {
-            if (boost::algorithm::starts_with(vstr[nStr], "#"))
-                break;
-            if (vstr[nStr] == "change=1")
-                fLabel = false;
-            if (vstr[nStr] == "reserve=1")
-                fLabel = false;
-            if (boost::algorithm::starts_with(vstr[nStr], "label=")) {
-                strLabel = DecodeDumpString(vstr[nStr].substr(6));
-                fLabel = true;
+        EnsureWalletIsUnlocked();
+
+        ifstream file;
+        file.open(params[0].get_str().c_str(), std::ios::in | std::ios::ate);
+        if (!file.is_open())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot open wallet dump file");
+
+        int64_t nTimeBegin = chainActive.Tip()->nTime;
+
+        int64_t nFilesize = std::max((int64_t)1, (int64_t)file.tellg());
+        file.seekg(0, file.beg);
+
+        pwalletMain->ShowProgress(_("Importing..."), 0); // show progress dialog in GUI
+        // The keys and their labels are written in one database transaction
+        CDBBatch batch(pwalletMain->fFileBacked ? pwalletMain->strWalletFile.c_str() : NULL);
+        while (file.good()) {
+            pwalletMain->ShowProgress("", std::max(1, std::min(99, (int)(((double)file.tellg() / (double)nFilesize) * 100))));
+            std::string line;
+            std::getline(file, line);
+            if (line.empty() || line[0] == '#')
+                continue;
+
+            std::vector<std::string> vstr;
+            boost::split(vstr, line, boost::is_any_of(" "));
+            if (vstr.size() < 2)
+                continue;
+            CBitcoinSecret vchSecret;
+            if (!vchSecret.SetString(vstr[0]))
+                continue;
+            CKey key = vchSecret.GetKey();
+            CPubKey pubkey = key.GetPubKey();
+            CKeyID keyid = pubkey.GetID();
+            if (pwalletMain->HaveKey(keyid)) {
+                LogPrintf("Skipping import of %s (key already present)\n", CBitcoinAddress(keyid).ToString());
+                continue;
             }
+            int64_t nTime = DecodeDumpTime(vstr[1]);
+            std::string strLabel;
+            bool fLabel = true;
+            for (unsigned int nStr = 2; nStr < vstr.size(); nStr++) {
+                if (boost::algorithm::starts_with(vstr[nStr], "#"))
+                    break;
+                if (vstr[nStr] == "change=1")
+                    fLabel = false;
+                if (vstr[nStr] == "reserve=1")
+                    fLabel = false;
+                if (boost::algorithm::starts_with(vstr[nStr], "label=")) {
+                    strLabel = DecodeDumpString(vstr[nStr].substr(6));
+                    fLabel = true;
+                }
+            }
+            LogPrintf("Importing %s...\n", CBitcoinAddress(keyid).ToString());
+            if (!pwalletMain->AddKeyPubKey(key, pubkey)) {
+                fGood = false;
+                continue;
+            }
+            pwalletMain->mapKeyMetadata[keyid].nCreateTime = nTime;
+            if (fLabel)
+                pwalletMain->SetAddressBook(keyid, strLabel, "receive");
+            nTimeBegin = std::min(nTimeBegin, nTime);
         }
-        LogPrintf("Importing %s...\n", CBitcoinAddress(keyid).ToString());
-        if (!pwalletMain->AddKeyPubKey(key, pubkey)) {
-            fGood = false;
-            continue;
-        }
-        pwalletMain->mapKeyMetadata[keyid].nCreateTime = nTime;
-        if (fLabel)
-            pwalletMain->SetAddressBook(keyid, strLabel, "receive");
-        nTimeBegin = std::min(nTimeBegin, nTime);
-    }
-    file.close();
-    pwalletMain->ShowProgress("", 100); // hide progress dialog in GUI
+        file.close();
+        pwalletMain->ShowProgress("", 100); // hide progress dialog in GUI
+
+        pindex = chainActive.Tip();
+        while (pindex && pindex->pprev && pindex->nTime > nTimeBegin - 7200)
+            pindex = pindex->pprev;
 
-    CBlockIndex *pindex = chainActive.Tip();
-    while (pindex && pindex->pprev && pindex->nTime > nTimeBegin - 7200)
-        pindex = pindex->pprev;
+        if (!pwalletMain->nTimeFirstKey || nTimeBegin < pwalletMain->nTimeFirstKey)
+            pwalletMain->nTimeFirstKey = nTimeBegin;
 
-    if (!pwalletMain->nTimeFirstKey || nTimeBegin < pwalletMain->nTimeFirstKey)
-        pwalletMain->nTimeFirstKey = nTimeBegin;
+        LogPrintf("Rescanning last %i blocks\n", chainActive.Height() - pindex->nHeight + 1);
+    }
 
-    LogPrintf("Rescanning last %i blocks\n", chainActive.Height() - pindex->nHeight + 1);
     pwalletMain->ScanForWalletTransactions(pindex);
     pwalletMain->MarkDirty();
 
@@ -264,6 +491,31 @@ Value dumpprivkey(const Array& params, bool fHelp)
 }
 
 
+// Keys read from the wallet per hold of cs_wallet while dumping
+static const unsigned int DUMP_CHUNK_KEYS = 1000;
+// Keys in a chunk worth encoding on the worker threads
+static const unsigned int PARALLEL_DUMP_MIN_KEYS = 64;
+
+// A key to dump, read under cs_wallet and encoded without it
+struct CDumpEntry
+{
+    CKeyID keyid;
+    CKey key;
+    int64_t nTime;
+    // "hdmaster=1", "label=<name>", "reserve=1" or "change=1"
+    std::string strTag;
+    std::string strLine;
+};
+
+static void EncodeDumpRange(std::vector<CDumpEntry>* pvEntries, unsigned int nBegin, unsigned int nEnd)
+{
+    for (unsigned int i = nBegin; i < nEnd; i++) {
+        CDumpEntry &entry = (*pvEntries)[i];
+        entry.strLine = strprintf("%s %s %s # addr=%s\n", CBitcoinSecret(entry.key).ToString(), EncodeDumpTime(entry.nTime),
+                                  entry.strTag, CBitcoinAddress(entry.keyid).ToString());
+    }
+}
+
 Value dumpwallet(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -277,47 +529,85 @@ Value dumpwallet(const Array& params, bool fHelp)
             + HelpExampleRpc("dumpwallet", "\"test\"")
         );
 
-    EnsureWalletIsUnlocked();
-
     ofstream file;
     file.open(params[0].get_str().c_str());
     if (!file.is_open())
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot open wallet dump file");
 
-    std::map<CKeyID, int64_t> mapKeyBirth;
+    // Take the keys to dump, sorted by time, and what the header shows
+    std::vector<std::pair<int64_t, CKeyID> > vKeyBirth;
     std::set<CKeyID> setKeyPool;
-    pwalletMain->GetKeyBirthTimes(mapKeyBirth);
-    pwalletMain->GetAllReserveKeys(setKeyPool);
+    int nHeight;
+    uint256 hashTip;
+    int64_t nTipTime;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        EnsureWalletIsUnlocked();
 
-    // sort time/key pairs
-    std::vector<std::pair<int64_t, CKeyID> > vKeyBirth;
-    for (std::map<CKeyID, int64_t>::const_iterator it = mapKeyBirth.begin(); it != mapKeyBirth.end(); it++) {
-        vKeyBirth.push_back(std::make_pair(it->second, it->first));
+        std::map<CKeyID, int64_t> mapKeyBirth;
+        pwalletMain->GetKeyBirthTimes(mapKeyBirth);
+        pwalletMain->GetAllReserveKeys(setKeyPool);
+
+        vKeyBirth.reserve(mapKeyBirth.size());
+        for (std::map<CKeyID, int64_t>::const_iterator it = mapKeyBirth.begin(); it != mapKeyBirth.end(); it++) {
+            vKeyBirth.push_back(std::make_pair(it->second, it->first));
+        }
+
+        nHeight = chainActive.Height();
+        hashTip = chainActive.Tip()->GetBlockHash();
+        nTipTime = chainActive.Tip()->nTime;
     }
-    mapKeyBirth.clear();
     std::sort(vKeyBirth.begin(), vKeyBirth.end());
 
     // produce output
     file << strprintf("# Wallet dump created by Digitalcoin %s (%s)\n", CLIENT_BUILD, CLIENT_DATE);
     file << strprintf("# * Created on %s\n", EncodeDumpTime(GetTime()));
-    file << strprintf("# * Best block at time of backup was %i (%s),\n", chainActive.Height(), chainActive.Tip()->GetBlockHash().ToString());
-    file << strprintf("#   mined on %s\n", EncodeDumpTime(chainActive.Tip()->nTime));
+    file << strprintf("# * Best block at time of backup was %i (%s),\n", nHeight, hashTip.ToString());
+    file << strprintf("#   mined on %s\n", EncodeDumpTime(nTipTime));
     file << "\n";
-    for (std::vector<std::pair<int64_t, CKeyID> >::const_iterator it = vKeyBirth.begin(); it != vKeyBirth.end(); it++) {
-        const CKeyID &keyid = it->second;
-        std::string strTime = EncodeDumpTime(it->first);
-        std::string strAddr = CBitcoinAddress(keyid).ToString();
-        CKey key;
-        if (pwalletMain->GetKey(keyid, key)) {
-            if (pwalletMain->mapAddressBook.count(keyid)) {
-                file << strprintf("%s %s label=%s # addr=%s\n", CBitcoinSecret(key).ToString(), strTime, EncodeDumpString(pwalletMain->mapAddressBook[keyid].name), strAddr);
-            } else if (setKeyPool.count(keyid)) {
-                file << strprintf("%s %s reserve=1 # addr=%s\n", CBitcoinSecret(key).ToString(), strTime, strAddr);
-            } else {
-                file << strprintf("%s %s change=1 # addr=%s\n", CBitcoinSecret(key).ToString(), strTime, strAddr);
+
+    // A chunk of keys at a time: read them under cs_wallet, then encode and
+    // write them with the lock released, so other wallet calls get through
+    std::vector<CDumpEntry> vEntries;
+    for (unsigned int nChunk = 0; nChunk < vKeyBirth.size(); nChunk += DUMP_CHUNK_KEYS) {
+        unsigned int nChunkEnd = std::min(nChunk + DUMP_CHUNK_KEYS, (unsigned int)vKeyBirth.size());
+        vEntries.clear();
+        {
+            LOCK(pwalletMain->cs_wallet);
+            // A partial dump must not look complete
+            if (pwalletMain->IsLocked())
+                throw JSONRPCError(RPC_WALLET_UNLOCK_NEEDED, "Error: The wallet was locked during the dump, which is incomplete.");
+            bool fHD = pwalletMain->IsHDEnabled();
+            for (unsigned int i = nChunk; i < nChunkEnd; i++) {
+                CDumpEntry entry;
+                entry.keyid = vKeyBirth[i].second;
+                entry.nTime = vKeyBirth[i].first;
+                if (!pwalletMain->GetKey(entry.keyid, entry.key))
+                    continue;
+                std::map<CTxDestination, CAddressBookData>::const_iterator mi;
+                if (fHD && entry.keyid == pwalletMain->GetHDChain().masterKeyID) {
+                    entry.strTag = "hdmaster=1";
+                } else if ((mi = pwalletMain->mapAddressBook.find(entry.keyid)) != pwalletMain->mapAddressBook.end()) {
+                    entry.strTag = "label=" + EncodeDumpString(mi->second.name);
+                } else if (setKeyPool.count(entry.keyid)) {
+                    entry.strTag = "reserve=1";
+                } else {
+                    entry.strTag = "change=1";
+                }
+                vEntries.push_back(entry);
             }
         }
+
+        if (nScriptCheckThreads == 0 || vEntries.size() < PARALLEL_DUMP_MIN_KEYS)
+            EncodeDumpRange(&vEntries, 0, vEntries.size());
+        else {
+            CWorkPool pool(TASK_RPC);
+            pool.ForEachRange(vEntries.size(), nScriptCheckThreads, boost::bind(EncodeDumpRange, &vEntries, _1, _2));
+        }
+        for (unsigned int i = 0; i < vEntries.size(); i++)
+            file << vEntries[i].strLine;
     }
+    vEntries.clear();
     file << "\n";
     file << "# End of dump\n";
     file.close();
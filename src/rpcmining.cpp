@@ -13,8 +13,12 @@
 #include "db.h"
 #include "wallet.h"
 #endif
+#include <deque>
 #include <stdint.h>
 
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+
 #include "json/json_spirit_utils.h"
 #include "json/json_spirit_value.h"
 
@@ -37,11 +41,49 @@ void InitRPCMining()
     pMiningKey = new CReserveKey(pwalletMain);
 }
 
+/** Maximum number of getwork units that can still be submitted */
+static const unsigned int MAX_GETWORK_UNITS = 10000;
+
+/** The block getwork currently hands out for one algo */
+struct CWorkTemplate
+{
+    boost::shared_ptr<CBlockTemplate> ptemplate;
+    unsigned int nTransactionsUpdated;
+    int64_t nStart;
+};
+
+/** What is needed to rebuild a block from a solved getwork: the template
+ *  and the coinbase scriptSig (extranonce) the unit was issued with */
+struct CWorkUnit
+{
+    boost::shared_ptr<CBlockTemplate> ptemplate;
+    CScript scriptSig;
+};
+
+typedef boost::unordered_map<uint256, CWorkUnit, CTxidHasher> CWorkUnitMap;
+
+// getwork state, guarded by cs_getwork. Units are looked up by merkle root
+// and expire oldest first; all of them are dropped when the tip changes.
+static CCriticalSection cs_getwork;
+static CBlockIndex* pindexWorkTip = NULL;
+static CWorkTemplate vWorkTemplate[NUM_ALGOS];
+static CWorkUnitMap mapWorkUnits;
+static std::deque<uint256> vWorkUnitsIssued;
+
 void ShutdownRPCMining()
 {
     if (!pMiningKey)
         return;
 
+    {
+        LOCK(cs_getwork);
+        mapWorkUnits.clear();
+        vWorkUnitsIssued.clear();
+        for (int i = 0; i < NUM_ALGOS; i++)
+            vWorkTemplate[i].ptemplate.reset();
+        pindexWorkTip = NULL;
+    }
+
     delete pMiningKey; pMiningKey = NULL;
 }
 #else
@@ -59,14 +101,6 @@ void ShutdownRPCMining()
 
 
 Value GetNetworkHashPS(int lookup, int height) {
-    const CBlockIndex *pb = chainActive.Tip();
-    
-    if(pb->GetAlgo() != miningAlgo)
-	pb = GetLastBlockIndex(pb, miningAlgo); // Get last block of current algo
-  
-    if (pb == NULL || !pb->nHeight)
-        return 0;
-
     // If lookup is -1, then watch at 25 previous blocks.
     if (lookup <= 0)
 	lookup = 25;
@@ -75,25 +109,14 @@ Value GetNetworkHashPS(int lookup, int height) {
     if (lookup > 100)
         lookup = 25;
 
-    const CBlockIndex *pb0 = pb;
-    
-    double mul = std::pow((double)2,(double)32); //crispy diff multiplier
-    uint64_t averageHash = 0; 
-    
-    const CBlockIndex *pb1 = pb0;
-
-    for (int i = 0; i < lookup; i++) {
-	pb1 = pb0;
-	
-        pb0 = GetLastBlockIndex(pb0->pprev, miningAlgo);
-	if(pb0 == NULL)
-	   break;
-	double diff = (GetDifficulty(pb0,miningAlgo) + GetDifficulty(pb1,miningAlgo)) / 2; // calculate diff average of this and previous block
-
-        averageHash = ((diff * mul / 40) + averageHash) / 2;  //calculate hashrate average
-    }
-   
-    return averageHash;
+    // The estimate at the tip over the default window is kept up to date
+    if ((height < 0 || height >= chainActive.Height()) && lookup == ALGO_STATS_WINDOW)
+        return GetAlgoStats(miningAlgo).nHashesPerSec;
+
+    const CBlockIndex *pb = chainActive.Tip();
+    if (height >= 0 && height < chainActive.Height())
+        pb = chainActive[height];
+    return EstimateAlgoHashRate(pb, miningAlgo, lookup);
 }
 
 Value getnetworkhashps(const Array& params, bool fHelp)
@@ -117,6 +140,54 @@ Value getnetworkhashps(const Array& params, bool fHelp)
     return GetNetworkHashPS(params.size() > 0 ? params[0].get_int() : 25, params.size() > 1 ? params[1].get_int() : -1);
 }
 
+Value getalgostats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getalgostats\n"
+            "\nReturns statistics of the last " + itostr(ALGO_STATS_WINDOW) + " blocks of each mining algorithm in the active chain.\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"pow_algo_id\": n,         (numeric) The algorithm id\n"
+            "    \"pow_algo\": \"name\",       (string) The algorithm name\n"
+            "    \"lastblock\": \"hash\",      (string, optional) The last block of the algorithm\n"
+            "    \"lastheight\": n,          (numeric, optional) The height of that block\n"
+            "    \"difficulty\": x.xxx,      (numeric) The difficulty of that block\n"
+            "    \"avgdifficulty\": x.xxx,   (numeric) The average difficulty over the blocks\n"
+            "    \"blocks\": n,              (numeric) The number of blocks averaged over\n"
+            "    \"avgspacing\": n,          (numeric) The average number of seconds between the blocks\n"
+            "    \"networkhashps\": n        (numeric) The estimated network hashes per second, as getnetworkhashps\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getalgostats", "")
+            + HelpExampleRpc("getalgostats", "")
+       );
+
+    Array result;
+    for (int algo = 0; algo < NUM_ALGOS; algo++)
+    {
+        CAlgoStats stats = GetAlgoStats(algo);
+        Object obj;
+        obj.push_back(Pair("pow_algo_id",   algo));
+        obj.push_back(Pair("pow_algo",      GetAlgoName(algo)));
+        if (stats.pindexLast)
+        {
+            obj.push_back(Pair("lastblock",  stats.pindexLast->GetBlockHash().GetHex()));
+            obj.push_back(Pair("lastheight", stats.pindexLast->nHeight));
+        }
+        obj.push_back(Pair("difficulty",    stats.dDifficulty));
+        obj.push_back(Pair("avgdifficulty", stats.dAvgDifficulty));
+        obj.push_back(Pair("blocks",        stats.nBlocks));
+        obj.push_back(Pair("avgspacing",    stats.nAvgSpacing));
+        obj.push_back(Pair("networkhashps", stats.nHashesPerSec));
+        result.push_back(obj);
+    }
+    return result;
+}
+
 #ifdef ENABLE_WALLET
 Value getgenerate(const Array& params, bool fHelp)
 {
@@ -218,21 +289,32 @@ Value setgenerate(const Array& params, bool fHelp)
 
 Value gethashespersec(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "gethashespersec\n"
+            "gethashespersec ( \"algo\" )\n"
             "\nReturns a recent hashes per second performance measurement while generating.\n"
             "See the getgenerate and setgenerate calls to turn generation on and off.\n"
+            "\nArguments:\n"
+            "1. \"algo\"     (string, optional) Only count miner threads of this algorithm (sha256d, scrypt or x11)\n"
             "\nResult:\n"
             "n            (numeric) The recent hashes per second when generation is on (will return 0 if generation is off)\n"
             "\nExamples:\n"
             + HelpExampleCli("gethashespersec", "")
+            + HelpExampleCli("gethashespersec", "\"x11\"")
             + HelpExampleRpc("gethashespersec", "")
         );
 
-    if (GetTimeMillis() - nHPSTimerStart > 8000)
-        return (int64_t)0;
-    return (int64_t)dHashesPerSec;
+    int algo = -1;
+    if (params.size() > 0)
+    {
+        const std::string& strAlgo = params[0].get_str();
+        for (int i = 0; i < NUM_ALGOS; i++)
+            if (strAlgo == GetAlgoName(i))
+                algo = i;
+        if (algo < 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown algorithm");
+    }
+    return (int64_t)GetMinerHashesPerSec(algo);
 }
 #endif
 
@@ -253,6 +335,17 @@ Value getmininginfo(const Array& params, bool fHelp)
             "  \"generate\": true|false     (boolean) If the generation is on or off (see getgenerate or setgenerate calls)\n"
             "  \"genproclimit\": n          (numeric) The processor limit for generation. -1 if no generation. (see getgenerate or setgenerate calls)\n"
             "  \"hashespersec\": n          (numeric) The hashes per second of the generation, or 0 if no generation.\n"
+            "  \"hashespersec_sha256d\": n  (numeric) The hashes per second of the sha256d miner threads\n"
+            "  \"hashespersec_scrypt\": n   (numeric) The hashes per second of the scrypt miner threads\n"
+            "  \"hashespersec_x11\": n      (numeric) The hashes per second of the x11 miner threads\n"
+            "  \"devices\": [              (array) The miner threads by device (cpu, or an OpenCL device) and algorithm\n"
+            "    {\n"
+            "      \"device\": \"name\",     (string) The device\n"
+            "      \"algo\": \"name\",       (string) The algorithm mined\n"
+            "      \"threads\": n,          (numeric) Miner threads on it\n"
+            "      \"hashespersec\": n      (numeric) Their hashes per second\n"
+            "    }, ...\n"
+            "  ]\n"
             "  \"pooledtx\": n              (numeric) The size of the mem pool\n"
             "  \"testnet\": true|false      (boolean) If using testnet or not\n"
             "}\n"
@@ -274,11 +367,25 @@ Value getmininginfo(const Array& params, bool fHelp)
     obj.push_back(Pair("errors",           GetWarnings("statusbar")));
     obj.push_back(Pair("genproclimit",     (int)GetArg("-genproclimit", -1)));
     obj.push_back(Pair("networkhashps",    getnetworkhashps(params, false)));
-    obj.push_back(Pair("pooledtx",         (uint64_t)mempool.size()));
+    obj.push_back(Pair("pooledtx",         (uint64_t)mempool.GetSnapshot()->mapEntries.size()));
     obj.push_back(Pair("testnet",          TestNet()));
 #ifdef ENABLE_WALLET
     obj.push_back(Pair("generate",         getgenerate(params, false)));
-    obj.push_back(Pair("hashespersec",     gethashespersec(params, false)));
+    obj.push_back(Pair("hashespersec",         (int64_t)GetMinerHashesPerSec()));
+    obj.push_back(Pair("hashespersec_sha256d", (int64_t)GetMinerHashesPerSec(ALGO_SHA256D)));
+    obj.push_back(Pair("hashespersec_scrypt",  (int64_t)GetMinerHashesPerSec(ALGO_SCRYPT)));
+    obj.push_back(Pair("hashespersec_x11",     (int64_t)GetMinerHashesPerSec(ALGO_X11)));
+    Array devices;
+    BOOST_FOREACH(const CMinerDeviceStats& stats, GetMinerDeviceStats())
+    {
+        Object device;
+        device.push_back(Pair("device",       stats.strDevice));
+        device.push_back(Pair("algo",         GetAlgoName(stats.algo)));
+        device.push_back(Pair("threads",      stats.nThreads));
+        device.push_back(Pair("hashespersec", (int64_t)stats.dHashesPerSec));
+        devices.push_back(device);
+    }
+    obj.push_back(Pair("devices",          devices));
 #endif
     return obj;
 }
@@ -291,9 +398,10 @@ Value getwork(const Array& params, bool fHelp)
         throw runtime_error(
             "getwork ( \"data\" )\n"
             "\nIf 'data' is not specified, it returns the formatted hash data to work on.\n"
+            "If 'data' is an algorithm name, it returns work for that algorithm instead of -algo.\n"
             "If 'data' is specified, tries to solve the block and returns true if it was successful.\n"
             "\nArguments:\n"
-            "1. \"data\"       (string, optional) The hex encoded data to solve\n"
+            "1. \"data\"       (string, optional) The hex encoded data to solve, or sha256d, scrypt or x11\n"
             "\nResult (when 'data' is not specified):\n"
             "{\n"
             "  \"midstate\" : \"xxxx\",   (string) The precomputed hash state after hashing the first half of the data (DEPRECATED)\n" // deprecated
@@ -314,58 +422,74 @@ Value getwork(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Digitalcoin is downloading blocks...");
 
-    typedef map<uint256, pair<CBlock*, CScript> > mapNewBlock_t;
-    static mapNewBlock_t mapNewBlock;    // FIXME: thread safety
-    static vector<CBlockTemplate*> vNewBlockTemplate;
+    int algo = miningAlgo;
+    if (params.size() > 0)
+    {
+        for (int i = 0; i < NUM_ALGOS; i++)
+            if (params[0].get_str() == GetAlgoName(i))
+                algo = i;
+    }
 
-    if (params.size() == 0)
+    if (params.size() == 0 || params[0].get_str() == GetAlgoName(algo))
     {
+        LOCK(cs_getwork);
+
         // Update block
-        static unsigned int nTransactionsUpdatedLast;
-        static CBlockIndex* pindexPrev;
-        static int64_t nStart;
-        static CBlockTemplate* pblocktemplate;
-        if (pindexPrev != chainActive.Tip() ||
-            (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60))
+        CBlockIndex* pindexTip;
         {
-            if (pindexPrev != chainActive.Tip())
-            {
-                // Deallocate old blocks since they're obsolete now
-                mapNewBlock.clear();
-                BOOST_FOREACH(CBlockTemplate* pblocktemplate, vNewBlockTemplate)
-                    delete pblocktemplate;
-                vNewBlockTemplate.clear();
-            }
-
-            // Clear pindexPrev so future getworks make a new block, despite any failures from here on
-            pindexPrev = NULL;
-
-            // Store the pindexBest used before CreateNewBlock, to avoid races
-            nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-            CBlockIndex* pindexPrevNew = chainActive.Tip();
-            nStart = GetTime();
+            LOCK(cs_main);
+            pindexTip = chainActive.Tip();
+        }
+        if (pindexTip != pindexWorkTip)
+        {
+            // Work on the old tip can no longer be accepted, for any algo
+            mapWorkUnits.clear();
+            vWorkUnitsIssued.clear();
+            for (int i = 0; i < NUM_ALGOS; i++)
+                vWorkTemplate[i].ptemplate.reset();
+            pindexWorkTip = pindexTip;
+        }
 
-            // Create new block
-            pblocktemplate = CreateNewBlockWithKey(*pMiningKey, miningAlgo);
-            if (!pblocktemplate)
+        CWorkTemplate& work = vWorkTemplate[algo];
+        if (!work.ptemplate ||
+            (mempool.GetTransactionsUpdated() != work.nTransactionsUpdated && GetTime() - work.nStart > 60))
+        {
+            // Store the counter used before CreateNewBlock, to avoid races
+            unsigned int nTransactionsUpdated = mempool.GetTransactionsUpdated();
+            int64_t nStart = GetTime();
+
+            // Create new block. Issued work units keep their template alive
+            // through their own reference.
+            boost::shared_ptr<CBlockTemplate> ptemplate(CreateNewBlockWithKey(*pMiningKey, algo));
+            if (!ptemplate)
                 throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-            vNewBlockTemplate.push_back(pblocktemplate);
+            if (ptemplate->block.hashPrevBlock != pindexWorkTip->GetBlockHash())
+                throw JSONRPCError(RPC_MISC_ERROR, "Best block changed, retry");
 
-            // Need to update only after we know CreateNewBlock succeeded
-            pindexPrev = pindexPrevNew;
+            work.ptemplate = ptemplate;
+            work.nTransactionsUpdated = nTransactionsUpdated;
+            work.nStart = nStart;
         }
-        CBlock* pblock = &pblocktemplate->block; // pointer for convenience
+        CBlock* pblock = &work.ptemplate->block; // pointer for convenience
 
         // Update nTime
-        UpdateTime(*pblock, pindexPrev);
+        UpdateTime(*pblock, pindexWorkTip);
         pblock->nNonce = 0;
 
         // Update nExtraNonce
         static unsigned int nExtraNonce = 0;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+        IncrementExtraNonce(pblock, pindexWorkTip, nExtraNonce);
 
-        // Save
-        mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, pblock->vtx[0].vin[0].scriptSig);
+        // Save, dropping the oldest work once the bound is reached
+        while (vWorkUnitsIssued.size() >= MAX_GETWORK_UNITS)
+        {
+            mapWorkUnits.erase(vWorkUnitsIssued.front());
+            vWorkUnitsIssued.pop_front();
+        }
+        CWorkUnit& unit = mapWorkUnits[pblock->hashMerkleRoot];
+        unit.ptemplate = work.ptemplate;
+        unit.scriptSig = pblock->vtx[0].vin[0].scriptSig;
+        vWorkUnitsIssued.push_back(pblock->hashMerkleRoot);
 
         // Pre-build hash buffers
         char pmidstate[32];
@@ -373,7 +497,7 @@ Value getwork(const Array& params, bool fHelp)
         char phash1[64];
         FormatHashBuffers(pblock, pmidstate, pdata, phash1);
 
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
         Object result;
         result.push_back(Pair("midstate", HexStr(BEGIN(pmidstate), END(pmidstate)))); // deprecated
@@ -394,22 +518,32 @@ Value getwork(const Array& params, bool fHelp)
         for (int i = 0; i < 128/4; i++)
             ((unsigned int*)pdata)[i] = ByteReverse(((unsigned int*)pdata)[i]);
 
-        // Get saved block
-        if (!mapNewBlock.count(pdata->hashMerkleRoot))
+        LOCK(cs_getwork);
+
+        // Get saved block. Units issued from one template share its block,
+        // so solve a copy rather than the template itself.
+        CWorkUnitMap::const_iterator it = mapWorkUnits.find(pdata->hashMerkleRoot);
+        if (it == mapWorkUnits.end())
             return false;
-        CBlock* pblock = mapNewBlock[pdata->hashMerkleRoot].first;
+        CBlock block(it->second.ptemplate->block);
 
-        pblock->nTime = pdata->nTime;
-        pblock->nNonce = pdata->nNonce;
-        pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
-        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+        block.nTime = pdata->nTime;
+        block.nNonce = pdata->nNonce;
+        CMutableTransaction txCoinbase(block.vtx[0]);
+        txCoinbase.vin[0].scriptSig = it->second.scriptSig;
+        block.vtx[0] = txCoinbase;
+        block.hashMerkleRoot = block.UpdateMerkleTreeCoinbase();
 
         assert(pwalletMain != NULL);
-        return CheckWork(pblock, *pwalletMain, *pMiningKey);
+        return CheckWork(&block, *pwalletMain, *pMiningKey, it->second.ptemplate.get());
     }
 }
 #endif
 
+// The last template getblocktemplate handed out for each algo, which
+// submitblock checks blocks against. Guarded by cs_main, which both run under.
+static CBlockTemplate* vpblocktemplate[NUM_ALGOS];
+
 Value getblocktemplate(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -423,10 +557,12 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "1. \"jsonrequestobject\"       (string, optional) A json object in the following spec\n"
             "     {\n"
             "       \"mode\":\"template\"    (string, optional) This must be set to \"template\" or omitted\n"
+            "       \"algo\":\"algo\"        (string, optional) The algorithm to mine with: sha256d, scrypt or x11 (default: -algo)\n"
             "       \"capabilities\":[       (array, optional) A list of strings\n"
             "           \"support\"           (string) client side supported feature, 'longpoll', 'coinbasetxn', 'coinbasevalue', 'proposal', 'serverlist', 'workid'\n"
             "           ,...\n"
-            "         ]\n"
+            "         ],\n"
+            "       \"longpollid\":\"id\"    (string, optional) wait until the template identified by this longpollid is outdated\n"
             "     }\n"
             "\n"
 
@@ -453,6 +589,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  },\n"
             "  \"coinbasevalue\" : n,               (numeric) maximum allowable input to coinbase transaction, including the generation award and transaction fees (in Satoshis)\n"
             "  \"coinbasetxn\" : { ... },           (json object) information for coinbase transaction\n"
+            "  \"coinbasebranch\" : [ \"hash\", ... ], (array of string) merkle branch of the coinbase, in internal byte order, to compute the merkle root from its hash\n"
             "  \"target\" : \"xxxx\",               (string) The hash target\n"
             "  \"mintime\" : xxx,                   (numeric) The minimum timestamp appropriate for next block time in seconds since epoch (Jan 1 1970 GMT)\n"
             "  \"mutable\" : [                      (array of string) list of ways the block template may be changed \n"
@@ -464,7 +601,8 @@ Value getblocktemplate(const Array& params, bool fHelp)
             "  \"sizelimit\" : n,                  (numeric) limit of block size\n"
             "  \"curtime\" : ttt,                  (numeric) current timestamp in seconds since epoch (Jan 1 1970 GMT)\n"
             "  \"bits\" : \"xxx\",                 (string) compressed target of next block\n"
-            "  \"height\" : n                      (numeric) The height of the next block\n"
+            "  \"height\" : n,                     (numeric) The height of the next block\n"
+            "  \"longpollid\" : \"xxxx\"            (string) id to pass back as 'longpollid' to wait for the next template\n"
             "}\n"
 
             "\nExamples:\n"
@@ -473,6 +611,8 @@ Value getblocktemplate(const Array& params, bool fHelp)
          );
 
     std::string strMode = "template";
+    int algo = miningAlgo;
+    Value lpval = Value::null;
     if (params.size() > 0)
     {
         const Object& oparam = params[0].get_obj();
@@ -485,6 +625,21 @@ Value getblocktemplate(const Array& params, bool fHelp)
         }
         else
             throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
+
+        const Value& algoval = find_value(oparam, "algo");
+        if (algoval.type() == str_type)
+        {
+            algo = -1;
+            for (int i = 0; i < NUM_ALGOS; i++)
+                if (algoval.get_str() == GetAlgoName(i))
+                    algo = i;
+            if (algo < 0)
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown algorithm");
+        }
+        else if (algoval.type() != null_type)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid algo");
+
+        lpval = find_value(oparam, "longpollid");
     }
 
     if (strMode != "template")
@@ -496,11 +651,63 @@ Value getblocktemplate(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Digitalcoin is downloading blocks...");
 
+    // There is a template per algo; CreateNewBlock shares the transaction
+    // selection between them.
+    static unsigned int vTransactionsUpdatedLast[NUM_ALGOS];
+    unsigned int &nTransactionsUpdatedLast = vTransactionsUpdatedLast[algo];
+
+    if (lpval.type() != null_type)
+    {
+        // Wait to respond until either the best block changes, OR a minute has passed and there are more transactions
+        uint256 hashWatchedChain;
+        unsigned int nTransactionsUpdatedLastLP;
+
+        if (lpval.type() == str_type)
+        {
+            // Format: <hashBestChain><nTransactionsUpdatedLast>
+            std::string lpstr = lpval.get_str();
+            if (lpstr.size() < 64)
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid longpollid");
+
+            hashWatchedChain.SetHex(lpstr.substr(0, 64));
+            nTransactionsUpdatedLastLP = atoi64(lpstr.substr(64));
+        }
+        else
+        {
+            // The spec does not cover a non-string longpollid; treat it as "wait for the template we have now"
+            hashWatchedChain = chainActive.Tip()->GetBlockHash();
+            nTransactionsUpdatedLastLP = nTransactionsUpdatedLast;
+        }
+
+        // Release the main lock while waiting, so the tip can actually move
+        LEAVE_CRITICAL_SECTION(cs_main);
+        {
+            boost::system_time checktxtime = boost::get_system_time() + boost::posix_time::minutes(1);
+
+            boost::unique_lock<boost::mutex> lock(csBestBlock);
+            while (chainActive.Tip()->GetBlockHash() == hashWatchedChain && !ShutdownRequested())
+            {
+                if (!cvBlockChange.timed_wait(lock, checktxtime))
+                {
+                    // Timeout: check transactions for update
+                    if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLastLP)
+                        break;
+                    checktxtime += boost::posix_time::seconds(10);
+                }
+            }
+        }
+        ENTER_CRITICAL_SECTION(cs_main);
+
+        if (ShutdownRequested())
+            throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
+    }
+
     // Update block
-    static unsigned int nTransactionsUpdatedLast;
-    static CBlockIndex* pindexPrev;
-    static int64_t nStart;
-    static CBlockTemplate* pblocktemplate;
+    static CBlockIndex* vpindexPrev[NUM_ALGOS];
+    static int64_t vStart[NUM_ALGOS];
+    CBlockIndex* &pindexPrev = vpindexPrev[algo];
+    int64_t &nStart = vStart[algo];
+    CBlockTemplate* &pblocktemplate = vpblocktemplate[algo];
     if (pindexPrev != chainActive.Tip() ||
         (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
     {
@@ -519,7 +726,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
             pblocktemplate = NULL;
         }
         CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = CreateNewBlock(scriptDummy, miningAlgo);
+        pblocktemplate = CreateNewBlock(scriptDummy, algo);
 
         if (!pblocktemplate)
             throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
@@ -570,7 +777,13 @@ Value getblocktemplate(const Array& params, bool fHelp)
     Object aux;
     aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
 
-    uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+    // The branch does not depend on the coinbase, and the tree is kept with
+    // the template
+    Array coinbaseBranch;
+    BOOST_FOREACH(const uint256& hash, pblock->GetMerkleBranch(0))
+        coinbaseBranch.push_back(HexStr(BEGIN(hash), END(hash)));
+
+    uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
     static Array aMutable;
     if (aMutable.empty())
@@ -586,6 +799,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("transactions", transactions));
     result.push_back(Pair("coinbaseaux", aux));
     result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].vout[0].nValue));
+    result.push_back(Pair("coinbasebranch", coinbaseBranch));
     result.push_back(Pair("target", hashTarget.GetHex()));
     result.push_back(Pair("mintime", (int64_t)pindexPrev->GetMedianTimePast()+1));
     result.push_back(Pair("mutable", aMutable));
@@ -595,6 +809,7 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("curtime", (int64_t)pblock->nTime));
     result.push_back(Pair("bits", HexBits(pblock->nBits)));
     result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
+    result.push_back(Pair("longpollid", chainActive.Tip()->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdatedLast)));
 
     return result;
 }
@@ -630,8 +845,12 @@ Value submitblock(const Array& params, bool fHelp)
         throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "Block decode failed");
     }
 
+    // A block solved from the last template only needs what the miner
+    // changed checked, and goes out to peers before it is connected
+    const CBlockTemplate* ptemplate = vpblocktemplate[pblock.GetAlgo()];
+
     CValidationState state;
-    bool fAccepted = ProcessBlock(state, NULL, &pblock);
+    bool fAccepted = ProcessBlockFromTemplate(state, pblock, ptemplate);
     if (!fAccepted)
         return "rejected"; // TODO: report validation state
 
@@ -4,16 +4,20 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "stealthaddress.h"
+#include "allocators.h"
 #include "base58.h"
 #include "init.h"
 #include "main.h"
+#include "metrics.h"
 #include "net.h"
 #include "netbase.h"
 #include "rpcserver.h"
+#include "sync.h"
 #include "util.h"
 #ifdef ENABLE_WALLET
 #include "wallet.h"
 #include "walletdb.h"
+#include "workpool.h"
 #endif
 
 #include <stdint.h>
@@ -154,10 +158,13 @@ Value validateaddress(const Array& params, bool fHelp)
             "  \"isvalid\" : true|false,            (boolean) If the address is valid or not. If not, this is the only property returned.\n"
             "  \"address\" : \"digitalcoinaddress\", (string) The digitalcoin address validated\n"
             "  \"ismine\" : true|false,             (boolean) If the address is yours or not\n"
+            "  \"iswatchonly\" : true|false,        (boolean) If the address is watched without its keys\n"
             "  \"isscript\" : true|false,           (boolean) If the key is a script\n"
             "  \"pubkey\" : \"publickeyhex\",       (string) The hex value of the raw public key\n"
             "  \"iscompressed\" : true|false,       (boolean) If the address is compressed\n"
             "  \"account\" : \"account\"            (string) The account associated with the address, \"\" is the default account\n"
+            "  \"hdkeypath\" : \"keypath\"          (string, optional) The BIP32 path of the key, if it was derived from the HD seed\n"
+            "  \"hdmasterkeyid\" : \"<hash160>\"    (string, optional) The Hash160 of the HD seed it was derived from\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("validateaddress", "\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"")
@@ -175,14 +182,42 @@ Value validateaddress(const Array& params, bool fHelp)
         string currentAddress = address.ToString();
         ret.push_back(Pair("address", currentAddress));
 #ifdef ENABLE_WALLET
-        bool fMine = pwalletMain ? IsMine(*pwalletMain, dest) : false;
+        // Only the keys and the address book are looked at, not the chain
+        bool fMine = false;
+        bool fWatchOnly = false;
+        string strAccount;
+        bool fHaveAccount = false;
+        CKeyMetadata meta;
+        if (pwalletMain)
+        {
+            LOCK(pwalletMain->cs_wallet);
+            fMine = IsMine(*pwalletMain, dest);
+            CScript scriptPubKey;
+            scriptPubKey.SetDestination(dest);
+            fWatchOnly = !fMine && pwalletMain->HaveWatchOnly(scriptPubKey);
+            map<CTxDestination, CAddressBookData>::const_iterator mi = pwalletMain->mapAddressBook.find(dest);
+            if (mi != pwalletMain->mapAddressBook.end())
+            {
+                strAccount = mi->second.name;
+                fHaveAccount = true;
+            }
+            CKeyID keyID;
+            if (fMine && address.GetKeyID(keyID) && pwalletMain->mapKeyMetadata.count(keyID))
+                meta = pwalletMain->mapKeyMetadata[keyID];
+        }
         ret.push_back(Pair("ismine", fMine));
+        ret.push_back(Pair("iswatchonly", fWatchOnly));
         if (fMine) {
             Object detail = boost::apply_visitor(DescribeAddressVisitor(), dest);
             ret.insert(ret.end(), detail.begin(), detail.end());
         }
-        if (pwalletMain && pwalletMain->mapAddressBook.count(dest))
-            ret.push_back(Pair("account", pwalletMain->mapAddressBook[dest].name));
+        if (fHaveAccount)
+            ret.push_back(Pair("account", strAccount));
+        if (!meta.hdKeypath.empty())
+        {
+            ret.push_back(Pair("hdkeypath", meta.hdKeypath));
+            ret.push_back(Pair("hdmasterkeyid", meta.hdMasterKeyID.GetHex()));
+        }
 #endif
     }
     return ret;
@@ -294,6 +329,44 @@ Value createmultisig(const Array& params, bool fHelp)
     return result;
 }
 
+// Check a message signed with signmessage. Returns 0, with whether the
+// signature is valid in fValid, or the RPC error code and strError if the
+// address or signature cannot be used at all.
+static int CheckSignedMessage(const string& strAddress, const string& strSign, const string& strMessage, bool& fValid, string& strError)
+{
+    fValid = false;
+
+    CBitcoinAddress addr(strAddress);
+    if (!addr.IsValid())
+    {
+        strError = "Invalid address";
+        return RPC_TYPE_ERROR;
+    }
+
+    CKeyID keyID;
+    if (!addr.GetKeyID(keyID))
+    {
+        strError = "Address does not refer to key";
+        return RPC_TYPE_ERROR;
+    }
+
+    bool fInvalid = false;
+    vector<unsigned char> vchSig = DecodeBase64(strSign.c_str(), &fInvalid);
+    if (fInvalid)
+    {
+        strError = "Malformed base64 encoding";
+        return RPC_INVALID_ADDRESS_OR_KEY;
+    }
+
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << strMessageMagic;
+    ss << strMessage;
+
+    CPubKey pubkey;
+    fValid = pubkey.RecoverCompact(ss.GetHash(), vchSig) && pubkey.GetID() == keyID;
+    return 0;
+}
+
 Value verifymessage(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 3)
@@ -321,27 +394,298 @@ Value verifymessage(const Array& params, bool fHelp)
     string strSign     = params[1].get_str();
     string strMessage  = params[2].get_str();
 
-    CBitcoinAddress addr(strAddress);
-    if (!addr.IsValid())
-        throw JSONRPCError(RPC_TYPE_ERROR, "Invalid address");
+    bool fValid;
+    string strError;
+    int nError = CheckSignedMessage(strAddress, strSign, strMessage, fValid, strError);
+    if (nError != 0)
+        throw JSONRPCError(nError, strError);
+    return fValid;
+}
 
-    CKeyID keyID;
-    if (!addr.GetKeyID(keyID))
-        throw JSONRPCError(RPC_TYPE_ERROR, "Address does not refer to key");
+// Verify messages on the scheduler threads from this many on
+static const unsigned int PARALLEL_VERIFY_MIN_MESSAGES = 16;
 
-    bool fInvalid = false;
-    vector<unsigned char> vchSig = DecodeBase64(strSign.c_str(), &fInvalid);
+struct CMessageVerification
+{
+    vector<string> vAddresses;
+    vector<string> vSignatures;
+    vector<string> vMessages;
+    // Not vector<bool>, which threads cannot write side by side
+    vector<char> vValid;
+};
 
-    if (fInvalid)
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Malformed base64 encoding");
+static void VerifyMessageRange(CMessageVerification* pverify, unsigned int nBegin, unsigned int nEnd)
+{
+    for (unsigned int i = nBegin; i < nEnd; i++)
+    {
+        bool fValid;
+        string strError;
+        if (CheckSignedMessage(pverify->vAddresses[i], pverify->vSignatures[i], pverify->vMessages[i], fValid, strError) == 0)
+            pverify->vValid[i] = fValid;
+    }
+}
 
-    CHashWriter ss(SER_GETHASH, 0);
-    ss << strMessageMagic;
-    ss << strMessage;
+Value verifymessages(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "verifymessages [[\"digitalcoinaddress\",\"signature\",\"message\"],...]\n"
+            "\nVerify many signed messages at once, as verifymessage does for one.\n"
+            "The signatures are checked in parallel, without taking the chain or wallet locks.\n"
+            "\nArguments:\n"
+            "1. \"messages\"     (array, required) The signed messages, each an array of\n"
+            "                    the address, the signature in base 64 and the message\n"
+            "\nResult:\n"
+            "[true|false,...]  (array) Whether each signature is verified, in the order given;\n"
+            "                  false also for an invalid address or malformed signature\n"
+            "\nExamples:\n"
+            + HelpExampleCli("verifymessages", "'[[\"1D1ZrZNe3JUo7ZycKEYQQiQAWd9y54F4XZ\",\"signature\",\"my message\"]]'") +
+            "\nAs json rpc\n"
+            + HelpExampleRpc("verifymessages", "[[\"1D1ZrZNe3JUo7ZycKEYQQiQAWd9y54F4XZ\", \"signature\", \"my message\"]]")
+        );
 
-    CPubKey pubkey;
-    if (!pubkey.RecoverCompact(ss.GetHash(), vchSig))
-        return false;
+    const Array& entries = params[0].get_array();
+    unsigned int nMessages = entries.size();
 
-    return (pubkey.GetID() == keyID);
+    CMessageVerification verify;
+    verify.vAddresses.resize(nMessages);
+    verify.vSignatures.resize(nMessages);
+    verify.vMessages.resize(nMessages);
+    verify.vValid.resize(nMessages, false);
+    for (unsigned int i = 0; i < nMessages; i++)
+    {
+        if (entries[i].type() != array_type)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Entry %u is not an array", i));
+        const Array& entry = entries[i].get_array();
+        if (entry.size() != 3 || entry[0].type() != str_type || entry[1].type() != str_type || entry[2].type() != str_type)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Entry %u is not [\"address\",\"signature\",\"message\"]", i));
+        verify.vAddresses[i] = entry[0].get_str();
+        verify.vSignatures[i] = entry[1].get_str();
+        verify.vMessages[i] = entry[2].get_str();
+    }
+
+    if (nScriptCheckThreads == 0 || nMessages < PARALLEL_VERIFY_MIN_MESSAGES)
+        VerifyMessageRange(&verify, 0, nMessages);
+    else
+    {
+        CWorkPool pool(TASK_RPC);
+        pool.ForEachRange(nMessages, nScriptCheckThreads, boost::bind(VerifyMessageRange, &verify, _1, _2));
+    }
+
+    Array result;
+    for (unsigned int i = 0; i < nMessages; i++)
+        result.push_back((bool)verify.vValid[i]);
+    return result;
+}
+
+static bool LockSiteWaitedLonger(const CLockSiteStats& a, const CLockSiteStats& b)
+{
+    return a.nWaitMicros > b.nWaitMicros;
+}
+
+static Array LockHistogramToJSON(const uint64_t* vHistogram)
+{
+    unsigned int nBuckets = LOCKPROFILE_BUCKETS;
+    while (nBuckets > 0 && vHistogram[nBuckets - 1] == 0)
+        nBuckets--;
+    Array ret;
+    for (unsigned int i = 0; i < nBuckets; i++)
+        ret.push_back((int64_t)vHistogram[i]);
+    return ret;
+}
+
+Value getlockstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getlockstats ( reset )\n"
+            "Returns how long threads waited for and held each lock, per place in the code that takes it.\n"
+            "Only recorded when started with -lockprofile.\n"
+            "\nArguments:\n"
+            "1. reset      (boolean, optional, default=false) Clear the statistics after returning them\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"enabled\": true|false,    (boolean) whether locks are being profiled\n"
+            "  \"sites\": [                (array) one entry per lock site, longest total wait first\n"
+            "    {\n"
+            "      \"lock\": \"name\",       (string) the locked expression, e.g. cs_main\n"
+            "      \"file\": \"file\",       (string) source file of the site\n"
+            "      \"line\": n,            (numeric) source line of the site\n"
+            "      \"count\": n,           (numeric) times the lock was taken there\n"
+            "      \"contended\": n,       (numeric) of which another thread held it first\n"
+            "      \"wait_us\": n,         (numeric) total time waited, in microseconds\n"
+            "      \"maxwait_us\": n,      (numeric) longest wait\n"
+            "      \"hold_us\": n,         (numeric) total time held\n"
+            "      \"maxhold_us\": n,      (numeric) longest hold\n"
+            "      \"wait_histogram\": [n,...],  (array) waits per bucket: under 1us, then 1-2us, 2-4us, ...\n"
+            "      \"hold_histogram\": [n,...]   (array) holds per bucket, as above\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getlockstats", "")
+            + HelpExampleCli("getlockstats", "true")
+            + HelpExampleRpc("getlockstats", "")
+        );
+
+    bool fReset = params.size() > 0 && params[0].get_bool();
+
+    std::vector<CLockSiteStats> vStats = GetLockProfile();
+    if (fReset)
+        ResetLockProfile();
+    std::sort(vStats.begin(), vStats.end(), LockSiteWaitedLonger);
+
+    Array sites;
+    BOOST_FOREACH(const CLockSiteStats& stats, vStats)
+    {
+        Object site;
+        site.push_back(Pair("lock",           stats.strName));
+        site.push_back(Pair("file",           stats.strFile));
+        site.push_back(Pair("line",           stats.nLine));
+        site.push_back(Pair("count",          (int64_t)stats.nLocks));
+        site.push_back(Pair("contended",      (int64_t)stats.nContended));
+        site.push_back(Pair("wait_us",        stats.nWaitMicros));
+        site.push_back(Pair("maxwait_us",     stats.nMaxWaitMicros));
+        site.push_back(Pair("hold_us",        stats.nHoldMicros));
+        site.push_back(Pair("maxhold_us",     stats.nMaxHoldMicros));
+        site.push_back(Pair("wait_histogram", LockHistogramToJSON(stats.vWaitHistogram)));
+        site.push_back(Pair("hold_histogram", LockHistogramToJSON(stats.vHoldHistogram)));
+        sites.push_back(site);
+    }
+
+    Object ret;
+    ret.push_back(Pair("enabled", fLockProfile));
+    ret.push_back(Pair("sites", sites));
+    return ret;
+}
+
+static bool RPCMethodTookLonger(const CRPCStatsMap::value_type* a, const CRPCStatsMap::value_type* b)
+{
+    return a->second.latency.nSumMicros > b->second.latency.nSumMicros;
+}
+
+Value getrpcstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getrpcstats ( reset )\n"
+            "Returns how many times each RPC method was called, how long the calls took and\n"
+            "waited for cs_main and cs_wallet, and how much JSON they returned.\n"
+            "\nArguments:\n"
+            "1. reset      (boolean, optional, default=false) Clear the statistics after returning them\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"buckets_us\": [n,...],    (array) upper bounds of the histogram buckets in microseconds; the last bucket has none\n"
+            "  \"methods\": [              (array) one entry per method called, longest total time first\n"
+            "    {\n"
+            "      \"method\": \"name\",     (string) the RPC method\n"
+            "      \"count\": n,           (numeric) finished calls\n"
+            "      \"errors\": n,          (numeric) of which returned an error\n"
+            "      \"active\": n,          (numeric) calls running now\n"
+            "      \"maxactive\": n,       (numeric) most calls running at once\n"
+            "      \"total_us\": n,        (numeric) total time of the calls, in microseconds\n"
+            "      \"max_us\": n,          (numeric) longest call\n"
+            "      \"lockwait_us\": n,     (numeric) total time waited for cs_main and cs_wallet\n"
+            "      \"bytes\": n,           (numeric) JSON result text returned\n"
+            "      \"histogram\": [n,...]  (array) calls per bucket of buckets_us\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getrpcstats", "")
+            + HelpExampleCli("getrpcstats", "true")
+            + HelpExampleRpc("getrpcstats", "")
+        );
+
+    bool fReset = params.size() > 0 && params[0].get_bool();
+
+    CRPCStatsMap mapStats = GetRPCStats(fReset);
+    std::vector<const CRPCStatsMap::value_type*> vMethods;
+    BOOST_FOREACH(const CRPCStatsMap::value_type& item, mapStats)
+        vMethods.push_back(&item);
+    std::sort(vMethods.begin(), vMethods.end(), RPCMethodTookLonger);
+
+    Array buckets;
+    for (unsigned int i = 0; i < METRICS_BUCKETS - 1; i++)
+        buckets.push_back(CMetricsHistogram::BucketLimit(i));
+
+    Array methods;
+    BOOST_FOREACH(const CRPCStatsMap::value_type* item, vMethods)
+    {
+        const CRPCMethodStats& stats = item->second;
+        unsigned int nBuckets = METRICS_BUCKETS;
+        while (nBuckets > 0 && stats.latency.vBuckets[nBuckets - 1] == 0)
+            nBuckets--;
+        Array histogram;
+        for (unsigned int i = 0; i < nBuckets; i++)
+            histogram.push_back((int64_t)stats.latency.vBuckets[i]);
+
+        Object method;
+        method.push_back(Pair("method",      item->first));
+        method.push_back(Pair("count",       (int64_t)stats.latency.nCount));
+        method.push_back(Pair("errors",      (int64_t)stats.nErrors));
+        method.push_back(Pair("active",      stats.nActive));
+        method.push_back(Pair("maxactive",   stats.nMaxActive));
+        method.push_back(Pair("total_us",    stats.latency.nSumMicros));
+        method.push_back(Pair("max_us",      stats.nMaxMicros));
+        method.push_back(Pair("lockwait_us", stats.nLockWaitMicros));
+        method.push_back(Pair("bytes",       (int64_t)stats.nBytes));
+        method.push_back(Pair("histogram",   histogram));
+        methods.push_back(method);
+    }
+
+    Object ret;
+    ret.push_back(Pair("buckets_us", buckets));
+    ret.push_back(Pair("methods", methods));
+    return ret;
+}
+
+Value getmemoryinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmemoryinfo\n"
+            "Returns the approximate heap memory held by the node's larger structures, in bytes.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"coinscache\": n,          (numeric) unspent outputs cached in memory\n"
+            "  \"mempool\": n,             (numeric) the transaction memory pool\n"
+            "  \"blockindex\": n,          (numeric) block index entries and the active chain\n"
+            "  \"orphantransactions\": n,  (numeric) transactions waiting for their inputs\n"
+            "  \"orphanblocks\": n,        (numeric) blocks waiting for their parent\n"
+            "  \"peers\": n,               (numeric) receive and send queues, known inventory and addresses of\n"
+            "                                 all peers, and relayed messages kept for them\n"
+            "  \"sigcache\": n,            (numeric) the signature cache\n"
+            "  \"wallet\": n,              (numeric) wallet transactions, keys and address book\n"
+            "  \"total\": n,               (numeric) all of the above\n"
+            "  \"locked\": {               (object) memory locked for keys and other secrets\n"
+            "    \"used\": n,              (numeric) bytes handed out\n"
+            "    \"locked\": n             (numeric) bytes locked\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getmemoryinfo", "")
+            + HelpExampleRpc("getmemoryinfo", "")
+        );
+
+    CMemoryUsageStats stats;
+    GetMemoryUsageStats(stats);
+
+    LockedPool& pool = LockedPool::Instance();
+    Object locked;
+    locked.push_back(Pair("used",   (uint64_t)pool.GetUsed()));
+    locked.push_back(Pair("locked", (uint64_t)(pool.GetArenaCount() * LockedPool::ARENA_SIZE)));
+
+    Object ret;
+    ret.push_back(Pair("coinscache",         (uint64_t)stats.nCoinsCache));
+    ret.push_back(Pair("mempool",            (uint64_t)stats.nMempool));
+    ret.push_back(Pair("blockindex",         (uint64_t)stats.nBlockIndex));
+    ret.push_back(Pair("orphantransactions", (uint64_t)stats.nOrphanTransactions));
+    ret.push_back(Pair("orphanblocks",       (uint64_t)stats.nOrphanBlocks));
+    ret.push_back(Pair("peers",              (uint64_t)stats.nPeers));
+    ret.push_back(Pair("sigcache",           (uint64_t)stats.nSignatureCache));
+    ret.push_back(Pair("wallet",             (uint64_t)stats.nWallet));
+    ret.push_back(Pair("total",              (uint64_t)stats.GetTotal()));
+    ret.push_back(Pair("locked",             locked));
+    return ret;
 }
@@ -7,6 +7,7 @@
 #include "main.h"
 #include "net.h"
 #include "netbase.h"
+#include "proptrace.h"
 #include "protocol.h"
 #include "sync.h"
 #include "util.h"
@@ -69,6 +70,29 @@ static void CopyNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
+// Per command counts and bytes, with the processing time of received ones
+static Object MessageStatsToJSON(const CMessageStatsMap& mapStats, bool fTimed)
+{
+    Object ret;
+    for (CMessageStatsMap::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it)
+    {
+        const CMessageStats& msgstats = it->second;
+        Object obj;
+        obj.push_back(Pair("count", msgstats.nMessages));
+        obj.push_back(Pair("bytes", msgstats.nBytes));
+        if (fTimed)
+        {
+            obj.push_back(Pair("processtime", msgstats.nTimeUsec / 1000000.0));
+            Array latency;
+            for (unsigned int i = 0; i < MESSAGE_LATENCY_BUCKETS; i++)
+                latency.push_back(msgstats.vLatency[i]);
+            obj.push_back(Pair("latency", latency));
+        }
+        ret.push_back(Pair(it->first, obj));
+    }
+    return ret;
+}
+
 Value getpeerinfo(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -92,8 +116,28 @@ Value getpeerinfo(const Array& params, bool fHelp)
             "    \"subver\": \"/Satoshi:0.8.5/\",  (string) The string version\n"
             "    \"inbound\": true|false,     (boolean) Inbound (true) or Outbound (false)\n"
             "    \"startingheight\": n,       (numeric) The starting height (block) of the peer\n"
+            "    \"addr_processed\": n,       (numeric) Addresses received from this peer and processed\n"
+            "    \"addr_rate_limited\": n,    (numeric) Addresses received from this peer and dropped by the rate limit\n"
             "    \"banscore\": n,              (numeric) The ban score (stats.nMisbehavior)\n"
-            "    \"syncnode\" : true|false     (booleamn) if sync node\n"
+            "    \"blocksinflight\": n,        (numeric) Blocks requested from this peer and not received yet\n"
+            "    \"blocktarget\": n,           (numeric) Blocks the download scheduler keeps requested from this peer\n"
+            "    \"blockservicetime\": n,      (numeric) Average seconds this peer takes per requested block\n"
+            "    \"syncnode\" : true|false,    (booleamn) if sync node\n"
+            "    \"sent_per_msg\": {         (object) Traffic sent per message command\n"
+            "      \"command\": {\n"
+            "        \"count\": n,             (numeric) Messages sent\n"
+            "        \"bytes\": n              (numeric) Bytes sent, headers included\n"
+            "      }, ...\n"
+            "    },\n"
+            "    \"recv_per_msg\": {         (object) Traffic received per message command\n"
+            "      \"command\": {\n"
+            "        \"count\": n,             (numeric) Messages received\n"
+            "        \"bytes\": n,             (numeric) Bytes received, headers included\n"
+            "        \"processtime\": n,       (numeric) Seconds spent processing them\n"
+            "        \"latency\": [n, ...]     (array) Messages processed in under 16, 64, 256, 1024, 4096,\n"
+            "                                16384, 65536 microseconds and in more\n"
+            "      }, ...\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "}\n"
@@ -131,10 +175,17 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("subver", stats.cleanSubVer));
         obj.push_back(Pair("inbound", stats.fInbound));
         obj.push_back(Pair("startingheight", stats.nStartingHeight));
+        obj.push_back(Pair("addr_processed", stats.nAddrProcessed));
+        obj.push_back(Pair("addr_rate_limited", stats.nAddrRateLimited));
         if (fStateStats) {
             obj.push_back(Pair("banscore", statestats.nMisbehavior));
+            obj.push_back(Pair("blocksinflight", statestats.nBlocksInFlight));
+            obj.push_back(Pair("blocktarget", statestats.nBlockDownloadTarget));
+            obj.push_back(Pair("blockservicetime", statestats.nBlockServiceUsec / 1000000.0));
         }
         obj.push_back(Pair("syncnode", stats.fSyncNode));
+        obj.push_back(Pair("sent_per_msg", MessageStatsToJSON(stats.mapSendStats, false)));
+        obj.push_back(Pair("recv_per_msg", MessageStatsToJSON(stats.mapRecvStats, true)));
 
         ret.push_back(obj);
     }
@@ -320,7 +371,17 @@ Value getnettotals(const Array& params, bool fHelp)
             "{\n"
             "  \"totalbytesrecv\": n,   (numeric) Total bytes received\n"
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
-            "  \"timemillis\": t        (numeric) Total cpu time\n"
+            "  \"timemillis\": t,       (numeric) Total cpu time\n"
+            "  \"uploadrate\": n,       (numeric) Upload rate limit in bytes per second, 0 for none (-maxuploadrate)\n"
+            "  \"uploadtarget\":        (object) The -maxuploadtarget budget\n"
+            "  {\n"
+            "    \"timeframe\": n,                (numeric) Length of the measuring timeframe in seconds\n"
+            "    \"target\": n,                   (numeric) Target in bytes, 0 for none\n"
+            "    \"target_reached\": true|false,  (boolean) True if the target is reached\n"
+            "    \"serve_historical_blocks\": true|false,  (boolean) True if historical blocks are still served\n"
+            "    \"bytes_left_in_cycle\": t,      (numeric) Bytes left in the current timeframe\n"
+            "    \"time_left_in_cycle\": t        (numeric) Seconds left in the current timeframe\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getnettotals", "")
@@ -331,6 +392,41 @@ Value getnettotals(const Array& params, bool fHelp)
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
+    obj.push_back(Pair("uploadrate", CNode::GetMaxUploadRate()));
+
+    Object outboundLimit;
+    outboundLimit.push_back(Pair("timeframe", MAX_UPLOAD_TARGET_TIMEFRAME));
+    outboundLimit.push_back(Pair("target", CNode::GetMaxOutboundTarget()));
+    outboundLimit.push_back(Pair("target_reached", CNode::OutboundTargetReached(false)));
+    outboundLimit.push_back(Pair("serve_historical_blocks", !CNode::OutboundTargetReached(true)));
+    outboundLimit.push_back(Pair("bytes_left_in_cycle", CNode::GetOutboundTargetBytesLeft()));
+    outboundLimit.push_back(Pair("time_left_in_cycle", CNode::GetMaxOutboundTimeLeftInCycle()));
+    obj.push_back(Pair("uploadtarget", outboundLimit));
+    return obj;
+}
+
+Value getnetstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getnetstats\n"
+            "\nReturns traffic per message command over all peers since startup.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"sent_per_msg\": { ... },   (object) As in getpeerinfo\n"
+            "  \"recv_per_msg\": { ... }    (object) As in getpeerinfo\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getnetstats", "")
+            + HelpExampleRpc("getnetstats", "")
+       );
+
+    CMessageStatsMap mapSend, mapRecv;
+    CNode::GetTotalMessageStats(mapSend, mapRecv);
+
+    Object obj;
+    obj.push_back(Pair("sent_per_msg", MessageStatsToJSON(mapSend, false)));
+    obj.push_back(Pair("recv_per_msg", MessageStatsToJSON(mapRecv, true)));
     return obj;
 }
 
@@ -384,3 +480,61 @@ Value getnetworkinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("localaddresses", localAddresses));
     return obj;
 }
+
+Value getpropagationtrace(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 2)
+        throw runtime_error(
+            "getpropagationtrace ( \"hash\" reset )\n"
+            "Returns when blocks and transactions were announced, requested, received, validated,\n"
+            "connected and relayed, per peer, oldest first.\n"
+            "Only recorded when started with -proptrace=<n>, which keeps the last n events.\n"
+            "\nArguments:\n"
+            "1. \"hash\"     (string, optional) Only the events of this block or transaction; \"\" for all\n"
+            "2. reset      (boolean, optional, default=false) Clear the events after returning them\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"enabled\": true|false,    (boolean) whether events are being recorded\n"
+            "  \"events\": [               (array)\n"
+            "    {\n"
+            "      \"time_us\": n,         (numeric) time of the event, in microseconds since the epoch\n"
+            "      \"event\": \"name\",      (string) inv, request, getdata, receive, validate, connect or relay\n"
+            "      \"type\": \"type\",       (string) tx, block, or the inventory type the peer used\n"
+            "      \"hash\": \"hash\",       (string) the block or transaction hash\n"
+            "      \"peer\": n             (numeric) the peer id as in getpeerinfo, -1 for none\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getpropagationtrace", "")
+            + HelpExampleCli("getpropagationtrace", "\"000000000019d6689c085ae165831e934ff763ae46a2a6c172b3f1b60a8ce26f\"")
+            + HelpExampleRpc("getpropagationtrace", "\"\", true")
+        );
+
+    uint256 hash = 0;
+    if (params.size() > 0 && !params[0].get_str().empty())
+        hash = ParseHashV(params[0], "hash");
+    bool fReset = params.size() > 1 && params[1].get_bool();
+
+    std::vector<CPropTraceEntry> vEntries = GetPropTrace(hash);
+    if (fReset)
+        ClearPropTrace();
+
+    Array events;
+    BOOST_FOREACH(const CPropTraceEntry& entry, vEntries)
+    {
+        CInv inv(entry.nType, entry.hash);
+        Object event;
+        event.push_back(Pair("time_us", entry.nTimeMicros));
+        event.push_back(Pair("event",   PropTraceEventName(entry.nEvent)));
+        event.push_back(Pair("type",    inv.IsKnownType() ? inv.GetCommand() : "unknown"));
+        event.push_back(Pair("hash",    entry.hash.GetHex()));
+        event.push_back(Pair("peer",    entry.nPeer));
+        events.push_back(event);
+    }
+
+    Object ret;
+    ret.push_back(Pair("enabled", fPropTrace));
+    ret.push_back(Pair("events", events));
+    return ret;
+}
@@ -54,7 +54,7 @@ static string rfc1123Time()
     return DateTimeStrFormat("%a, %d %b %Y %H:%M:%S +0000", GetTime());
 }
 
-string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
+string HTTPReply(int nStatus, const string& strMsg, bool keepalive, const char *contentType)
 {
     if (nStatus == HTTP_UNAUTHORIZED)
         return strprintf("HTTP/1.0 401 Authorization Required\r\n"
@@ -78,6 +78,7 @@ string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
     else if (nStatus == HTTP_BAD_REQUEST) cStatus = "Bad Request";
     else if (nStatus == HTTP_FORBIDDEN) cStatus = "Forbidden";
     else if (nStatus == HTTP_NOT_FOUND) cStatus = "Not Found";
+    else if (nStatus == HTTP_REQUEST_ENTITY_TOO_LARGE) cStatus = "Request Entity Too Large";
     else if (nStatus == HTTP_INTERNAL_SERVER_ERROR) cStatus = "Internal Server Error";
     else cStatus = "";
     return strprintf(
@@ -85,7 +86,7 @@ string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
             "Date: %s\r\n"
             "Connection: %s\r\n"
             "Content-Length: %u\r\n"
-            "Content-Type: application/json\r\n"
+            "Content-Type: %s\r\n"
             "Server: digitalcoin-json-rpc/%s\r\n"
             "\r\n"
             "%s",
@@ -94,6 +95,7 @@ string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
         rfc1123Time(),
         keepalive ? "keep-alive" : "close",
         strMsg.size(),
+        contentType,
         FormatFullVersion(),
         strMsg);
 }
@@ -207,6 +209,96 @@ int ReadHTTPMessage(std::basic_istream<char>& stream, map<string,
     return HTTP_OK;
 }
 
+void CJSONWriter::Separate()
+{
+    if (fAfterKey)
+    {
+        fAfterKey = false;
+        return;
+    }
+    if (vEmpty.empty())
+        return;
+    if (!vEmpty.back())
+        strOut += ',';
+    vEmpty.back() = false;
+}
+
+void CJSONWriter::BeginObject()
+{
+    Separate();
+    strOut += '{';
+    vEmpty.push_back(true);
+}
+
+void CJSONWriter::EndObject()
+{
+    assert(!vEmpty.empty() && !fAfterKey);
+    vEmpty.pop_back();
+    strOut += '}';
+}
+
+void CJSONWriter::BeginArray()
+{
+    Separate();
+    strOut += '[';
+    vEmpty.push_back(true);
+}
+
+void CJSONWriter::EndArray()
+{
+    assert(!vEmpty.empty() && !fAfterKey);
+    vEmpty.pop_back();
+    strOut += ']';
+}
+
+void CJSONWriter::Key(const string& strKey)
+{
+    Separate();
+    strOut += '"';
+    strOut += json_spirit::add_esc_chars(strKey);
+    strOut += "\":";
+    fAfterKey = true;
+}
+
+void CJSONWriter::String(const string& str)
+{
+    Separate();
+    strOut += '"';
+    strOut += json_spirit::add_esc_chars(str);
+    strOut += '"';
+}
+
+void CJSONWriter::Int(int64_t n)
+{
+    Separate();
+    strOut += strprintf("%d", n);
+}
+
+void CJSONWriter::Real(double d)
+{
+    // The fixed 8 decimals of the json_spirit writer
+    Separate();
+    strOut += strprintf("%.8f", d);
+}
+
+void CJSONWriter::Bool(bool f)
+{
+    Separate();
+    strOut += f ? "true" : "false";
+}
+
+void CJSONWriter::Null()
+{
+    Separate();
+    strOut += "null";
+}
+
+void CJSONWriter::Write(const Value& value)
+{
+    Separate();
+    strOut += write_string(value, false);
+}
+
 //
 // JSON-RPC protocol.  Bitcoin speaks version 1.0 for maximum compatibility,
 // but uses JSON-RPC 1.1/2.0 standards for parts of the 1.0 standard that were
@@ -244,6 +336,12 @@ string JSONRPCReply(const Value& result, const Value& error, const Value& id)
     return write_string(Value(reply), false) + "\n";
 }
 
+string JSONRPCReplyResultText(const string& strResult, const Value& id)
+{
+    // As JSONRPCReply, without parsing the result back into a Value
+    return "{\"result\":" + strResult + ",\"error\":null,\"id\":" + write_string(id, false) + "}\n";
+}
+
 Object JSONRPCError(int code, const string& message)
 {
     Object error;
@@ -10,6 +10,7 @@
 #include <map>
 #include <stdint.h>
 #include <string>
+#include <vector>
 #include <boost/iostreams/concepts.hpp>
 #include <boost/iostreams/stream.hpp>
 #include <boost/asio.hpp>
@@ -27,6 +28,7 @@ enum HTTPStatusCode
     HTTP_UNAUTHORIZED          = 401,
     HTTP_FORBIDDEN             = 403,
     HTTP_NOT_FOUND             = 404,
+    HTTP_REQUEST_ENTITY_TOO_LARGE = 413,
     HTTP_INTERNAL_SERVER_ERROR = 500,
 };
 
@@ -124,8 +126,50 @@ private:
     boost::asio::ssl::stream<typename Protocol::socket>& stream;
 };
 
+/**
+ * Writes JSON text as it goes, for results too large to build as a Value
+ * tree first. The output is the same as write_string of the equivalent
+ * Value; commas are placed for the caller, who only has to pair the Begin
+ * and End calls and precede each value in an object with its Key.
+ */
+class CJSONWriter
+{
+private:
+    std::string strOut;
+    std::vector<bool> vEmpty; // for each open object or array: nothing in it yet
+    bool fAfterKey;
+
+    void Separate();
+
+public:
+    CJSONWriter() : fAfterKey(false) {}
+
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+    void Key(const std::string& strKey);
+
+    void String(const std::string& str);
+    void Int(int64_t n);
+    void Real(double d);
+    void Bool(bool f);
+    void Null();
+    // Any value, through json_spirit; for the small parts of a result
+    void Write(const json_spirit::Value& value);
+
+    void Pair(const std::string& strKey, const json_spirit::Value& value)
+    {
+        Key(strKey);
+        Write(value);
+    }
+
+    const std::string& str() const { return strOut; }
+};
+
 std::string HTTPPost(const std::string& strMsg, const std::map<std::string,std::string>& mapRequestHeaders);
-std::string HTTPReply(int nStatus, const std::string& strMsg, bool keepalive);
+std::string HTTPReply(int nStatus, const std::string& strMsg, bool keepalive,
+                      const char *contentType = "application/json");
 bool ReadHTTPRequestLine(std::basic_istream<char>& stream, int &proto,
                          std::string& http_method, std::string& http_uri);
 int ReadHTTPStatus(std::basic_istream<char>& stream, int &proto);
@@ -135,6 +179,8 @@ int ReadHTTPMessage(std::basic_istream<char>& stream, std::map<std::string, std:
 std::string JSONRPCRequest(const std::string& strMethod, const json_spirit::Array& params, const json_spirit::Value& id);
 json_spirit::Object JSONRPCReplyObj(const json_spirit::Value& result, const json_spirit::Value& error, const json_spirit::Value& id);
 std::string JSONRPCReply(const json_spirit::Value& result, const json_spirit::Value& error, const json_spirit::Value& id);
+// The reply to a successful call whose result is already JSON text
+std::string JSONRPCReplyResultText(const std::string& strResult, const json_spirit::Value& id);
 json_spirit::Object JSONRPCError(int code, const std::string& message);
 
 #endif
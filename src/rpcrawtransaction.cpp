@@ -11,6 +11,7 @@
 #include "net.h"
 #include "rpcserver.h"
 #include "uint256.h"
+#include "workpool.h"
 #ifdef ENABLE_WALLET
 #include "wallet.h"
 #endif
@@ -92,7 +93,7 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
     if (hashBlock != 0)
     {
         entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end() && (*mi).second)
         {
             CBlockIndex* pindex = (*mi).second;
@@ -108,6 +109,40 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
     }
 }
 
+// Read exactly one transaction from the bytes of ssTx, leaving them in place,
+// so they can be relayed as received
+bool DecodeTx(const CDataStream& ssTx, CTransaction& tx)
+{
+    if (ssTx.empty())
+        return false;
+    CSpanReader reader(&ssTx[0], &ssTx[0] + ssTx.size(), SER_NETWORK, PROTOCOL_VERSION);
+    try {
+        reader >> tx;
+    }
+    catch (std::exception &e) {
+        return false;
+    }
+    return reader.empty();
+}
+
+// Decode hex straight into ssTx and read the transaction from there,
+// without the intermediate vector of ParseHex
+bool DecodeHexTx(const std::string& strHex, CDataStream& ssTx, CTransaction& tx)
+{
+    if (strHex.size() % 2 != 0)
+        return false;
+    ssTx.resize(strHex.size() / 2);
+    for (unsigned int i = 0; i < ssTx.size(); i++)
+    {
+        signed char c1 = HexDigit(strHex[2 * i]);
+        signed char c2 = HexDigit(strHex[2 * i + 1]);
+        if (c1 < 0 || c2 < 0)
+            return false;
+        ssTx[i] = (c1 << 4) | c2;
+    }
+    return DecodeTx(ssTx, tx);
+}
+
 Value getrawtransaction(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -191,12 +226,76 @@ Value getrawtransaction(const Array& params, bool fHelp)
 
     Object result;
     result.push_back(Pair("hex", strHex));
-    TxToJSON(tx, hashBlock, result);
+    {
+        LOCK(cs_main);
+        TxToJSON(tx, hashBlock, result);
+    }
+    return result;
+}
+
+Value getrawtransactions(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "getrawtransactions [\"txid\",...] ( verbose )\n"
+            "\nReturn the raw data of several transactions, as getrawtransaction does for one.\n"
+            "With -txindex, the transactions are read in the order of the block files.\n"
+            "\nArguments:\n"
+            "1. [\"txid\",...]  (array, required) The transaction ids\n"
+            "2. verbose       (numeric, optional, default=0) If 0, return strings, other return json objects\n"
+            "\nResult:\n"
+            "[\n"
+            "  \"data\"|{...}    (string or object) As getrawtransaction, in the order of the txids, or null if not found\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getrawtransactions", "\"[\\\"mytxid\\\",\\\"myothertxid\\\"]\"")
+            + HelpExampleCli("getrawtransactions", "\"[\\\"mytxid\\\",\\\"myothertxid\\\"]\" 1")
+            + HelpExampleRpc("getrawtransactions", "[\"mytxid\",\"myothertxid\"], 1")
+        );
+
+    Array txids = params[0].get_array();
+    vector<uint256> vHash;
+    vHash.reserve(txids.size());
+    for (unsigned int i = 0; i < txids.size(); i++)
+        vHash.push_back(ParseHashV(txids[i], "txid"));
+
+    bool fVerbose = false;
+    if (params.size() > 1)
+        fVerbose = (params[1].get_int() != 0);
+
+    vector<CTransaction> vTx;
+    vector<uint256> vHashBlock;
+    vector<bool> vFound;
+    GetTransactions(vHash, vTx, vHashBlock, vFound);
+
+    Array result;
+    LOCK(cs_main);
+    for (unsigned int i = 0; i < vHash.size(); i++)
+    {
+        if (!vFound[i])
+        {
+            result.push_back(Value::null);
+            continue;
+        }
+        CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+        ssTx << vTx[i];
+        string strHex = HexStr(ssTx.begin(), ssTx.end());
+        if (!fVerbose)
+        {
+            result.push_back(strHex);
+            continue;
+        }
+        Object entry;
+        entry.push_back(Pair("hex", strHex));
+        TxToJSON(vTx[i], vHashBlock[i], entry);
+        result.push_back(entry);
+    }
     return result;
 }
 
 #ifdef ENABLE_WALLET
-Value listunspent(const Array& params, bool fHelp)
+void listunspent(const Array& params, bool fHelp, CJSONWriter& writer)
 {
     if (fHelp || params.size() > 3)
         throw runtime_error(
@@ -259,10 +358,10 @@ Value listunspent(const Array& params, bool fHelp)
         }
     }
 
-    Array results;
     vector<COutput> vecOutputs;
     assert(pwalletMain != NULL);
     pwalletMain->AvailableCoins(vecOutputs, false);
+    writer.BeginArray();
     BOOST_FOREACH(const COutput& out, vecOutputs)
     {
         if (out.nDepth < nMinDepth || out.nDepth > nMaxDepth)
@@ -304,13 +403,126 @@ Value listunspent(const Array& params, bool fHelp)
         }
         entry.push_back(Pair("amount",ValueFromAmount(nValue)));
         entry.push_back(Pair("confirmations",out.nDepth));
-        results.push_back(entry);
+        writer.Write(entry);
     }
-
-    return results;
+    writer.EndArray();
 }
 #endif
 
+Value gettxoutproof(const Array& params, bool fHelp)
+{
+    if (fHelp || (params.size() != 1 && params.size() != 2))
+        throw runtime_error(
+            "gettxoutproof [\"txid\",...] ( \"blockhash\" )\n"
+            "\nReturns a hex-encoded proof that the given transactions were included in a block.\n"
+            "\nNOTE: By default this function only works if the transactions are in the transaction index\n"
+            "(-txindex), were recently looked up, or still have an unspent output. Otherwise the block\n"
+            "containing them must be given.\n"
+            "\nArguments:\n"
+            "1. \"txids\"       (string) A json array of txids to filter\n"
+            "    [\n"
+            "      \"txid\"     (string) A transaction hash\n"
+            "      ,...\n"
+            "    ]\n"
+            "2. \"blockhash\"   (string, optional) If specified, looks for txid in the block with this hash\n"
+            "\nResult:\n"
+            "\"data\"           (string) A string that is a serialized, hex-encoded merkle block, as relayed to\n"
+            "                   filtered peers, proving the transactions\n"
+            "\nExamples:\n"
+            + HelpExampleCli("gettxoutproof", "'[\"mytxid\"]'")
+            + HelpExampleCli("gettxoutproof", "'[\"mytxid\"]' \"myblockhash\"")
+            + HelpExampleRpc("gettxoutproof", "[\"mytxid\"], \"myblockhash\"")
+        );
+
+    set<uint256> setTxids;
+    uint256 oneTxid;
+    Array txids = params[0].get_array();
+    BOOST_FOREACH(const Value& txid, txids) {
+        uint256 hash = ParseHashV(txid, "txid");
+        if (!setTxids.insert(hash).second)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, string("Invalid parameter, duplicated txid: ") + txid.get_str());
+        oneTxid = hash;
+    }
+    if (setTxids.empty())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, no txids given");
+
+    uint256 hashBlock = 0;
+    if (params.size() > 1) {
+        hashBlock = ParseHashV(params[1], "blockhash");
+    } else {
+        CTransaction tx;
+        if (!GetTransaction(oneTxid, tx, hashBlock, true) || hashBlock == 0)
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not yet in block");
+    }
+
+    CBlockIndex* pblockindex;
+    {
+        LOCK(cs_chainview);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+        if (mi == mapBlockIndex.end())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        pblockindex = mi->second;
+        if (!(pblockindex->nStatus & BLOCK_HAVE_DATA))
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
+    }
+
+    // Only the txids of the block are needed, not its transactions
+    vector<uint256> vTxid;
+    if (!GetBlockTxids(vTxid, pblockindex))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+
+    CMerkleBlock mb(pblockindex->GetBlockHeader(), vTxid, setTxids);
+    if (mb.vMatchedTxn.size() != setTxids.size())
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "(Not all) transactions not found in specified block");
+
+    CDataStream ssMB(SER_NETWORK, PROTOCOL_VERSION);
+    ssMB << mb;
+    return HexStr(ssMB.begin(), ssMB.end());
+}
+
+Value verifytxoutproof(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "verifytxoutproof \"proof\"\n"
+            "\nVerifies that a proof points to a transaction in a block, returning the transaction it commits to\n"
+            "and throwing an RPC error if the block is not in our best chain\n"
+            "\nArguments:\n"
+            "1. \"proof\"    (string, required) The hex-encoded proof generated by gettxoutproof\n"
+            "\nResult:\n"
+            "[\"txid\"]      (array, strings) The txid(s) which the proof commits to, or empty array if the proof is invalid\n"
+            "\nExamples:\n"
+            + HelpExampleCli("verifytxoutproof", "\"proof\"")
+            + HelpExampleRpc("verifytxoutproof", "\"proof\"")
+        );
+
+    CDataStream ssMB(ParseHexV(params[0], "proof"), SER_NETWORK, PROTOCOL_VERSION);
+    CMerkleBlock merkleBlock;
+    try {
+        ssMB >> merkleBlock;
+    }
+    catch (std::exception &e) {
+        throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "Proof decode failed");
+    }
+
+    Array res;
+
+    vector<uint256> vMatch;
+    if (merkleBlock.txn.ExtractMatches(vMatch) != merkleBlock.header.hashMerkleRoot)
+        return res;
+
+    {
+        LOCK(cs_chainview);
+        BlockMap::iterator mi = mapBlockIndex.find(merkleBlock.header.GetHash());
+        if (mi == mapBlockIndex.end() || !chainActive.Contains(mi->second))
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found in chain");
+    }
+
+    BOOST_FOREACH(const uint256& hash, vMatch)
+        res.push_back(hash.GetHex());
+    return res;
+}
+
 Value createrawtransaction(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 2)
@@ -349,7 +561,7 @@ Value createrawtransaction(const Array& params, bool fHelp)
     Array inputs = params[0].get_array();
     Object sendTo = params[1].get_obj();
 
-    CTransaction rawTx;
+    CMutableTransaction rawTx;
 
     BOOST_FOREACH(const Value& input, inputs)
     {
@@ -443,15 +655,10 @@ Value decoderawtransaction(const Array& params, bool fHelp)
             + HelpExampleRpc("decoderawtransaction", "\"hexstring\"")
         );
 
-    vector<unsigned char> txData(ParseHexV(params[0], "argument"));
-    CDataStream ssData(txData, SER_NETWORK, PROTOCOL_VERSION);
+    CDataStream ssData(SER_NETWORK, PROTOCOL_VERSION);
     CTransaction tx;
-    try {
-        ssData >> tx;
-    }
-    catch (std::exception &e) {
+    if (!DecodeHexTx(params[0].get_str(), ssData, tx))
         throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "TX decode failed");
-    }
 
     Object result;
     TxToJSON(tx, 0, result);
@@ -500,6 +707,88 @@ Value decodescript(const Array& params, bool fHelp)
     return r;
 }
 
+namespace {
+
+// Copy from keystore into cache the keys and redeem scripts that can sign
+// scriptPubKey, so that inputs spending the same script parse it and look
+// up (or decrypt) its keys once
+void CacheSigningData(const CKeyStore& keystore, const CScript& scriptPubKey, CBasicKeyStore& cache)
+{
+    txnouttype whichType;
+    vector<vector<unsigned char> > vSolutions;
+    if (!Solver(scriptPubKey, whichType, vSolutions))
+        return;
+
+    CKey key;
+    switch (whichType)
+    {
+    case TX_PUBKEY:
+        if (keystore.GetKey(CPubKey(vSolutions[0]).GetID(), key))
+            cache.AddKey(key);
+        break;
+    case TX_PUBKEYHASH:
+        if (keystore.GetKey(CKeyID(uint160(vSolutions[0])), key))
+            cache.AddKey(key);
+        break;
+    case TX_MULTISIG:
+        for (unsigned int i = 1; i + 1 < vSolutions.size(); i++)
+            if (keystore.GetKey(CPubKey(vSolutions[i]).GetID(), key))
+                cache.AddKey(key);
+        break;
+    case TX_SCRIPTHASH:
+    {
+        CScript redeemScript;
+        if (keystore.GetCScript(uint160(vSolutions[0]), redeemScript) && !redeemScript.IsPayToScriptHash())
+        {
+            cache.AddCScript(redeemScript);
+            CacheSigningData(keystore, redeemScript, cache);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// The inputs of a transaction being signed by signrawtransaction, which
+// the jobs sign and merge into their own entries
+struct CRawTxSigning
+{
+    const CKeyStore* pkeystore;
+    const CTransaction* ptxConst;
+    const CSignatureHashCache* psighashcache;
+    const vector<CTransaction>* ptxVariants;
+    int nHashType;
+    vector<CScript> vPrevPubKeys;   // empty for an unknown previous output
+    vector<CScript> vScriptSigs;    // left as they were for those
+    vector<char> vComplete;
+};
+
+void SignRawInputRange(CRawTxSigning* psigning, unsigned int nBegin, unsigned int nEnd)
+{
+    const CTransaction& txConst = *psigning->ptxConst;
+    bool fHashSingle = ((psigning->nHashType & ~SIGHASH_ANYONECANPAY) == SIGHASH_SINGLE);
+    for (unsigned int i = nBegin; i < nEnd; i++)
+    {
+        const CScript& prevPubKey = psigning->vPrevPubKeys[i];
+        if (prevPubKey.empty())
+            continue;
+
+        CScript& scriptSig = psigning->vScriptSigs[i];
+        scriptSig.clear();
+        // Only sign SIGHASH_SINGLE if there's a corresponding output:
+        if (!fHashSingle || (i < txConst.vout.size()))
+            SignSignature(*psigning->pkeystore, prevPubKey, txConst, i, scriptSig, psigning->nHashType, psigning->psighashcache);
+
+        // ... and merge in other signatures:
+        BOOST_FOREACH(const CTransaction& txv, *psigning->ptxVariants)
+            scriptSig = CombineSignatures(prevPubKey, txConst, i, scriptSig, txv.vin[i].scriptSig);
+        psigning->vComplete[i] = VerifyScript(scriptSig, prevPubKey, txConst, i, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, 0, psigning->psighashcache);
+    }
+}
+
+}
+
 Value signrawtransaction(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 4)
@@ -572,22 +861,20 @@ Value signrawtransaction(const Array& params, bool fHelp)
 
     // mergedTx will end up with all the signatures; it
     // starts as a clone of the rawtx:
-    CTransaction mergedTx(txVariants[0]);
+    CMutableTransaction mergedTx(txVariants[0]);
     bool fComplete = true;
 
     // Fetch previous transactions (inputs):
     CCoinsView viewDummy;
     CCoinsViewCache view(viewDummy);
     {
-        LOCK(mempool.cs);
+        LOCK2(cs_main, mempool.cs);
         CCoinsViewCache &viewChain = *pcoinsTip;
         CCoinsViewMemPool viewMempool(viewChain, mempool);
         view.SetBackend(viewMempool); // temporarily switch cache backend to db+mempool view
 
         BOOST_FOREACH(const CTxIn& txin, mergedTx.vin) {
-            const uint256& prevHash = txin.prevout.hash;
-            CCoins coins;
-            view.GetCoins(prevHash, coins); // this is certainly allowed to fail
+            view.AccessCoin(txin.prevout); // this is certainly allowed to fail
         }
 
         view.SetBackend(viewDummy); // switch back to avoid locking mempool for too long
@@ -636,21 +923,16 @@ Value signrawtransaction(const Array& params, bool fHelp)
             vector<unsigned char> pkData(ParseHexO(prevOut, "scriptPubKey"));
             CScript scriptPubKey(pkData.begin(), pkData.end());
 
-            CCoins coins;
-            if (view.GetCoins(txid, coins)) {
-                if (coins.IsAvailable(nOut) && coins.vout[nOut].scriptPubKey != scriptPubKey) {
-                    string err("Previous output scriptPubKey mismatch:\n");
-                    err = err + coins.vout[nOut].scriptPubKey.ToString() + "\nvs:\n"+
-                        scriptPubKey.ToString();
-                    throw JSONRPCError(RPC_DESERIALIZATION_ERROR, err);
-                }
-                // what todo if txid is known, but the actual output isn't?
+            COutPoint out(txid, nOut);
+            const CCoin& coin = view.AccessCoin(out);
+            if (!coin.IsSpent() && coin.out.scriptPubKey != scriptPubKey) {
+                string err("Previous output scriptPubKey mismatch:\n");
+                err = err + coin.out.scriptPubKey.ToString() + "\nvs:\n"+
+                    scriptPubKey.ToString();
+                throw JSONRPCError(RPC_DESERIALIZATION_ERROR, err);
             }
-            if ((unsigned int)nOut >= coins.vout.size())
-                coins.vout.resize(nOut+1);
-            coins.vout[nOut].scriptPubKey = scriptPubKey;
-            coins.vout[nOut].nValue = 0; // we don't know the actual output value
-            view.SetCoins(txid, coins);
+            // we don't know the actual output value
+            view.AddCoin(out, CCoin(CTxOut(0, scriptPubKey), 1, false), true);
 
             // if redeemScript given and not using the local wallet (private keys
             // given), add redeemScript to the tempKeystore so it can be signed:
@@ -693,31 +975,51 @@ Value signrawtransaction(const Array& params, bool fHelp)
             throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid sighash param");
     }
 
-    bool fHashSingle = ((nHashType & ~SIGHASH_ANYONECANPAY) == SIGHASH_SINGLE);
-
-    // Sign what we can:
-    for (unsigned int i = 0; i < mergedTx.vin.size(); i++)
+    // Use CTransaction for the constant parts of the
+    // transaction to avoid rehashing. The signature hashes leave out all
+    // scriptSigs, so every input is signed and verified against it.
+    const CTransaction txConst(mergedTx);
+    CSignatureHashCache sighashcache(txConst);
+    unsigned int nInputs = mergedTx.vin.size();
+
+    CRawTxSigning signing;
+    signing.ptxConst = &txConst;
+    signing.psighashcache = &sighashcache;
+    signing.ptxVariants = &txVariants;
+    signing.nHashType = nHashType;
+    signing.vPrevPubKeys.resize(nInputs);
+    signing.vScriptSigs.resize(nInputs);
+    signing.vComplete.resize(nInputs, false);
+
+    // The keys and redeem scripts of each distinct previous script are
+    // gathered once; the inputs are then signed without any lock
+    CBasicKeyStore cacheKeystore;
+    set<CScript> setPrevPubKeys;
+    for (unsigned int i = 0; i < nInputs; i++)
     {
-        CTxIn& txin = mergedTx.vin[i];
-        CCoins coins;
-        if (!view.GetCoins(txin.prevout.hash, coins) || !coins.IsAvailable(txin.prevout.n))
-        {
-            fComplete = false;
+        signing.vScriptSigs[i] = mergedTx.vin[i].scriptSig;
+        const CCoin& coin = view.AccessCoin(mergedTx.vin[i].prevout);
+        if (coin.IsSpent())
             continue;
-        }
-        const CScript& prevPubKey = coins.vout[txin.prevout.n].scriptPubKey;
+        signing.vPrevPubKeys[i] = coin.out.scriptPubKey;
+        if (setPrevPubKeys.insert(coin.out.scriptPubKey).second)
+            CacheSigningData(keystore, coin.out.scriptPubKey, cacheKeystore);
+    }
+    signing.pkeystore = &cacheKeystore;
 
-        txin.scriptSig.clear();
-        // Only sign SIGHASH_SINGLE if there's a corresponding output:
-        if (!fHashSingle || (i < mergedTx.vout.size()))
-            SignSignature(keystore, prevPubKey, mergedTx, i, nHashType);
+    // Sign what we can:
+    if (nScriptCheckThreads == 0 || nInputs < PARALLEL_SIGN_MIN_INPUTS)
+        SignRawInputRange(&signing, 0, nInputs);
+    else
+    {
+        CWorkPool pool(TASK_RPC);
+        pool.ForEachRange(nInputs, nScriptCheckThreads, boost::bind(SignRawInputRange, &signing, _1, _2));
+    }
 
-        // ... and merge in other signatures:
-        BOOST_FOREACH(const CTransaction& txv, txVariants)
-        {
-            txin.scriptSig = CombineSignatures(prevPubKey, mergedTx, i, txin.scriptSig, txv.vin[i].scriptSig);
-        }
-        if (!VerifyScript(txin.scriptSig, prevPubKey, mergedTx, i, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, 0))
+    for (unsigned int i = 0; i < nInputs; i++)
+    {
+        mergedTx.vin[i].scriptSig = signing.vScriptSigs[i];
+        if (!signing.vComplete[i])
             fComplete = false;
     }
 
@@ -730,6 +1032,48 @@ Value signrawtransaction(const Array& params, bool fHelp)
     return result;
 }
 
+// Offer a transaction to the memory pool and relay it, as sendrawtransaction
+// does. Only the memory pool acceptance holds cs_main; the relay sends the
+// bytes of pssRaw, as received, if given. Returns the RPC error code, or 0
+// on success.
+int SubmitRawTransaction(const CTransaction &tx, const CDataStream *pssRaw, bool fOverrideFees, std::string &strError)
+{
+    uint256 hashTx = tx.GetHash();
+
+    {
+        LOCK(cs_main);
+        CCoinsViewCache &view = *pcoinsTip;
+        bool fHaveMempool = mempool.exists(hashTx);
+        bool fHaveChain = false;
+        for (unsigned int o = 0; !fHaveChain && o < tx.vout.size(); o++) {
+            const CCoin& existingCoin = view.AccessCoin(COutPoint(hashTx, o));
+            fHaveChain = !existingCoin.IsSpent();
+        }
+        if (!fHaveMempool && !fHaveChain) {
+            // push to local node and sync with wallets
+            CValidationState state;
+            if (AcceptToMemoryPool(mempool, state, tx, false, NULL, !fOverrideFees))
+                SyncWithWallets(hashTx, tx, NULL);
+            else {
+                if(state.IsInvalid()) {
+                    strError = strprintf("%i: %s", state.GetRejectCode(), state.GetRejectReason());
+                    return RPC_TRANSACTION_REJECTED;
+                }
+                strError = state.GetRejectReason();
+                return RPC_TRANSACTION_ERROR;
+            }
+        } else if (fHaveChain) {
+            strError = "transaction already in block chain";
+            return RPC_TRANSACTION_ALREADY_IN_CHAIN;
+        }
+    }
+    if (pssRaw)
+        RelayTransaction(tx, hashTx, *pssRaw);
+    else
+        RelayTransaction(tx, hashTx);
+    return 0;
+}
+
 Value sendrawtransaction(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -754,43 +1098,99 @@ Value sendrawtransaction(const Array& params, bool fHelp)
         );
 
 
-    // parse hex string from parameter
-    vector<unsigned char> txData(ParseHexV(params[0], "parameter"));
-    CDataStream ssData(txData, SER_NETWORK, PROTOCOL_VERSION);
+    bool fOverrideFees = false;
+    if (params.size() > 1)
+        fOverrideFees = params[1].get_bool();
+
+    // Decoded without cs_main, which is only taken to accept the transaction
+    CDataStream ssData(SER_NETWORK, PROTOCOL_VERSION);
     CTransaction tx;
+    if (!DecodeHexTx(params[0].get_str(), ssData, tx))
+        throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "TX decode failed");
+
+    std::string strError;
+    int nError = SubmitRawTransaction(tx, &ssData, fOverrideFees, strError);
+    if (nError)
+        throw JSONRPCError(nError, strError);
+
+    return tx.GetHash().GetHex();
+}
+
+Value sendrawtransactions(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "sendrawtransactions [\"hexstring\",...] ( allowhighfees )\n"
+            "\nSubmits many raw transactions (serialized, hex-encoded) to local node and network at once.\n"
+            "Their scripts are verified in parallel first, then they are accepted in the order given,\n"
+            "so a transaction may spend outputs of one before it.\n"
+            "\nArguments:\n"
+            "1. [\"hexstring\",...] (array, required) The hex strings of the raw transactions\n"
+            "2. allowhighfees    (boolean, optional, default=false) Allow high fees\n"
+            "\nResult:\n"
+            "[                   (array of json objects) one per transaction, in the same order\n"
+            "  {\n"
+            "    \"txid\": \"hex\",   (string) The transaction hash in hex, if it could be decoded\n"
+            "    \"accepted\": true|false, (boolean) Whether the transaction is in the memory pool and was relayed\n"
+            "    \"code\": n,       (numeric) The error code, if it was not\n"
+            "    \"error\": \"...\"  (string) Why it was not\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("sendrawtransactions", "\"[\\\"signedhex\\\",\\\"signedhex\\\"]\"") +
+            "\nAs a json rpc call\n"
+            + HelpExampleRpc("sendrawtransactions", "[\"signedhex\",\"signedhex\"]")
+        );
+
+    RPCTypeCheck(params, list_of(array_type)(bool_type));
+    Array inputs = params[0].get_array();
 
     bool fOverrideFees = false;
     if (params.size() > 1)
         fOverrideFees = params[1].get_bool();
 
-    // deserialize binary data stream
-    try {
-        ssData >> tx;
-    }
-    catch (std::exception &e) {
-        throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "TX decode failed");
+    // Decode everything first, so the scripts of the whole batch can be
+    // verified together.
+    std::vector<CTransaction> vtx;
+    std::vector<CDataStream> vssData;
+    std::vector<bool> vDecoded(inputs.size(), false);
+    for (unsigned int i = 0; i < inputs.size(); i++) {
+        if (inputs[i].type() != str_type)
+            continue;
+        CDataStream ssData(SER_NETWORK, PROTOCOL_VERSION);
+        CTransaction tx;
+        if (!DecodeHexTx(inputs[i].get_str(), ssData, tx))
+            continue;
+        vtx.push_back(tx);
+        vssData.push_back(ssData);
+        vDecoded[i] = true;
     }
-    uint256 hashTx = tx.GetHash();
 
-    CCoinsViewCache &view = *pcoinsTip;
-    CCoins existingCoins;
-    bool fHaveMempool = mempool.exists(hashTx);
-    bool fHaveChain = view.GetCoins(hashTx, existingCoins) && existingCoins.nHeight < 1000000000;
-    if (!fHaveMempool && !fHaveChain) {
-        // push to local node and sync with wallets
-        CValidationState state;
-        if (AcceptToMemoryPool(mempool, state, tx, false, NULL, !fOverrideFees))
-            SyncWithWallets(hashTx, tx, NULL);
-        else {
-            if(state.IsInvalid())
-                throw JSONRPCError(RPC_TRANSACTION_REJECTED, strprintf("%i: %s", state.GetRejectCode(), state.GetRejectReason()));
-            else
-                throw JSONRPCError(RPC_TRANSACTION_ERROR, state.GetRejectReason());
+    PrecheckTransactionScripts(vtx);
+
+    Array results;
+    unsigned int nTx = 0;
+    for (unsigned int i = 0; i < inputs.size(); i++) {
+        Object result;
+        if (!vDecoded[i]) {
+            result.push_back(Pair("accepted", false));
+            result.push_back(Pair("code", RPC_DESERIALIZATION_ERROR));
+            result.push_back(Pair("error", "TX decode failed"));
+            results.push_back(result);
+            continue;
+        }
+        const CDataStream &ssData = vssData[nTx];
+        const CTransaction &tx = vtx[nTx++];
+        std::string strError;
+        int nError = SubmitRawTransaction(tx, &ssData, fOverrideFees, strError);
+        result.push_back(Pair("txid", tx.GetHash().GetHex()));
+        result.push_back(Pair("accepted", nError == 0));
+        if (nError) {
+            result.push_back(Pair("code", nError));
+            result.push_back(Pair("error", strError));
         }
-    } else if (fHaveChain) {
-        throw JSONRPCError(RPC_TRANSACTION_ALREADY_IN_CHAIN, "transaction already in block chain");
+        results.push_back(result);
     }
-    RelayTransaction(tx, hashTx);
-
-    return hashTx.GetHex();
+    return results;
 }
@@ -8,9 +8,11 @@
 #include "base58.h"
 #include "init.h"
 #include "main.h"
+#include "metrics.h"
 #include "ui_interface.h"
 #include "util.h"
 #include "alert.h"
+#include "workpool.h"
 #ifdef ENABLE_WALLET
 #include "wallet.h"
 #endif
@@ -23,6 +25,7 @@
 #include <boost/foreach.hpp>
 #include <boost/iostreams/concepts.hpp>
 #include <boost/iostreams/stream.hpp>
+#include <boost/enable_shared_from_this.hpp>
 #include <boost/shared_ptr.hpp>
 #include "json/json_spirit_writer_template.h"
 
@@ -38,6 +41,7 @@ static asio::io_service* rpc_io_service = NULL;
 static map<string, boost::shared_ptr<deadline_timer> > deadlineTimers;
 static ssl::context* rpc_ssl_context = NULL;
 static boost::thread_group* rpc_worker_group = NULL;
+static CWorkPool* rpc_batch_pool = NULL;
 static boost::asio::io_service::work *rpc_dummy_work = NULL;
 static std::vector< boost::shared_ptr<ip::tcp::acceptor> > rpc_acceptors;
 
@@ -303,114 +307,140 @@ Value sendalert(const Array& params, bool fHelp)
 
 
 static const CRPCCommand vRPCCommands[] =
-{ //  name                      actor (function)         okSafeMode threadSafe reqWallet
-  //  ------------------------  -----------------------  ---------- ---------- ---------
+{ //  name                      actor (function)         okSafeMode lockMode         reqWallet streamActor
+  //  ------------------------  -----------------------  ---------- ---------------- --------- -----------
     /* Overall control/query calls */
-    { "getinfo",                &getinfo,                true,      false,      false }, /* uses wallet if enabled */
-    { "help",                   &help,                   true,      true,       false },
-    { "stop",                   &stop,                   true,      true,       false },
+    { "getinfo",                &getinfo,                true,      RPC_LOCK_WALLET, false }, /* uses wallet if enabled */
+    { "help",                   &help,                   true,      RPC_LOCK_NONE,   false },
+    { "stop",                   &stop,                   true,      RPC_LOCK_NONE,   false },
+    { "getlockstats",           &getlockstats,           true,      RPC_LOCK_NONE,   false },
+    { "getrpcstats",            &getrpcstats,            true,      RPC_LOCK_NONE,   false },
+    { "getmemoryinfo",          &getmemoryinfo,          true,      RPC_LOCK_NONE,   false },
 
     /* P2P networking */
-    { "getnetworkinfo",         &getnetworkinfo,         true,      false,      false },
-    { "addnode",                &addnode,                true,      true,       false },
-    { "getaddednodeinfo",       &getaddednodeinfo,       true,      true,       false },
-    { "getconnectioncount",     &getconnectioncount,     true,      false,      false },
-    { "getnettotals",           &getnettotals,           true,      true,       false },
-    { "getpeerinfo",            &getpeerinfo,            true,      false,      false },
-    { "ping",                   &ping,                   true,      false,      false },
+    { "getnetworkinfo",         &getnetworkinfo,         true,      RPC_LOCK_CHAIN,  false },
+    { "addnode",                &addnode,                true,      RPC_LOCK_NONE,   false },
+    { "getaddednodeinfo",       &getaddednodeinfo,       true,      RPC_LOCK_NONE,   false },
+    { "getconnectioncount",     &getconnectioncount,     true,      RPC_LOCK_CHAIN,  false },
+    { "getnetstats",            &getnetstats,            true,      RPC_LOCK_NONE,   false },
+    { "getnettotals",           &getnettotals,           true,      RPC_LOCK_NONE,   false },
+    { "getpeerinfo",            &getpeerinfo,            true,      RPC_LOCK_CHAIN,  false },
+    { "getpropagationtrace",    &getpropagationtrace,    true,      RPC_LOCK_NONE,   false },
+    { "ping",                   &ping,                   true,      RPC_LOCK_CHAIN,  false },
 
     /* Block chain and UTXO */
-    { "getblockchaininfo",      &getblockchaininfo,      true,      false,      false },
-    { "getbestblockhash",       &getbestblockhash,       true,      false,      false },
-    { "getblockcount",          &getblockcount,          true,      false,      false },
-    { "getblock",               &getblock,               false,     false,      false },
-    { "getblockhash",           &getblockhash,           false,     false,      false },
-    { "getdifficulty",          &getdifficulty,          true,      false,      false },
-    { "getrawmempool",          &getrawmempool,          true,      false,      false },
-    { "gettxout",               &gettxout,               true,      false,      false },
-    { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false,      false },
-    { "verifychain",            &verifychain,            true,      false,      false },
+    { "getblockchaininfo",      &getblockchaininfo,      true,      RPC_LOCK_CHAIN,  false },
+    { "getbestblockhash",       &getbestblockhash,       true,      RPC_LOCK_NONE,   false },
+    { "getchaintips",           &getchaintips,           true,      RPC_LOCK_CHAIN,  false },
+    { "getblockcount",          &getblockcount,          true,      RPC_LOCK_NONE,   false },
+    { "getblock",                &RPCStreamed<&getblock>, false, RPC_LOCK_NONE, false, &getblock },
+    { "getblocks",               &RPCStreamed<&getblocks>, false, RPC_LOCK_NONE, false, &getblocks },
+    { "getaddressbalance",      &getaddressbalance,      false,     RPC_LOCK_NONE,   false },
+    { "getaddresstxids",        &getaddresstxids,        false,     RPC_LOCK_NONE,   false },
+    { "getaddressutxos",        &getaddressutxos,        false,     RPC_LOCK_NONE,   false },
+    { "getblockfilter",         &getblockfilter,         false,     RPC_LOCK_NONE,   false },
+    { "getblockhash",           &getblockhash,           false,     RPC_LOCK_NONE,   false },
+    { "getdifficulty",          &getdifficulty,          true,      RPC_LOCK_CHAIN,  false },
+    { "getspentinfo",           &getspentinfo,           false,     RPC_LOCK_NONE,   false },
+    { "getrawmempool",           &RPCStreamed<&getrawmempool>, true, RPC_LOCK_NONE, false, &getrawmempool },
+    { "getmempoolinfo",         &getmempoolinfo,         true,      RPC_LOCK_NONE,   false },
+    { "gettxout",               &gettxout,               true,      RPC_LOCK_CHAIN,  false },
+    { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      RPC_LOCK_CHAIN,  false },
+    { "dumptxoutset",           &dumptxoutset,           true,      RPC_LOCK_NONE,   false },
+    { "getdbstats",             &getdbstats,             true,      RPC_LOCK_CHAIN,  false },
+    { "getsigcacheinfo",        &getsigcacheinfo,        true,      RPC_LOCK_NONE,   false },
+    { "verifychain",            &verifychain,            true,      RPC_LOCK_CHAIN,  false },
+    { "replayblocks",           &replayblocks,           false,     RPC_LOCK_CHAIN,  false },
+    { "getblockprofile",        &getblockprofile,        true,      RPC_LOCK_NONE,   false },
 
     /* Mining */
-    { "getblocktemplate",       &getblocktemplate,       true,      false,      false },
-    { "getmininginfo",          &getmininginfo,          true,      false,      false },
-    { "submitblock",            &submitblock,            false,     false,      false },
-    { "getnetworkhashps",       &getnetworkhashps,       true,      false,      false },
+    { "getblocktemplate",       &getblocktemplate,       true,      RPC_LOCK_CHAIN,  false },
+    { "getmininginfo",          &getmininginfo,          true,      RPC_LOCK_CHAIN,  false },
+    { "submitblock",            &submitblock,            false,     RPC_LOCK_CHAIN,  false },
+    { "getnetworkhashps",       &getnetworkhashps,       true,      RPC_LOCK_CHAIN,  false },
+    { "getalgostats",           &getalgostats,           true,      RPC_LOCK_CHAIN,  false },
 
 
     /* Raw transactions */
-    { "createrawtransaction",   &createrawtransaction,   false,     false,      false },
-    { "decoderawtransaction",   &decoderawtransaction,   false,     false,      false },
-    { "decodescript",           &decodescript,           false,     false,      false },
-    { "getrawtransaction",      &getrawtransaction,      false,     false,      false },
-    { "sendrawtransaction",     &sendrawtransaction,     false,     false,      false },
-    { "signrawtransaction",     &signrawtransaction,     false,     false,      false }, /* uses wallet if enabled */
+    { "createrawtransaction",   &createrawtransaction,   false,     RPC_LOCK_NONE,   false },
+    { "decoderawtransaction",   &decoderawtransaction,   false,     RPC_LOCK_NONE,   false },
+    { "decodescript",           &decodescript,           false,     RPC_LOCK_NONE,   false },
+    { "getrawtransaction",      &getrawtransaction,      false,     RPC_LOCK_NONE,   false },
+    { "getrawtransactions",     &getrawtransactions,     false,     RPC_LOCK_NONE,   false },
+    { "gettxoutproof",          &gettxoutproof,          false,     RPC_LOCK_NONE,   false },
+    { "verifytxoutproof",       &verifytxoutproof,       false,     RPC_LOCK_NONE,   false },
+    { "sendrawtransaction",     &sendrawtransaction,     false,     RPC_LOCK_NONE,   false },
+    { "sendrawtransactions",    &sendrawtransactions,    false,     RPC_LOCK_CHAIN,  false },
+    { "signrawtransaction",     &signrawtransaction,     false,     RPC_LOCK_NONE,   false }, /* uses wallet if enabled */
 
     /* Utility functions */
-    { "createmultisig",         &createmultisig,         true,      true ,      false },
-    { "validateaddress",        &validateaddress,        true,      false,      false }, /* uses wallet if enabled */
-    { "verifymessage",          &verifymessage,          false,     false,      false },
+    { "createmultisig",         &createmultisig,         true,      RPC_LOCK_NONE,   false },
+    { "validateaddress",        &validateaddress,        true,      RPC_LOCK_NONE,   false }, /* uses wallet if enabled */
+    { "verifymessage",          &verifymessage,          false,     RPC_LOCK_NONE,   false },
+    { "verifymessages",         &verifymessages,         false,     RPC_LOCK_NONE,   false },
 
 #ifdef ENABLE_WALLET
     /* Wallet */
-    { "addmultisigaddress",     &addmultisigaddress,     false,     false,      true },
-    { "backupwallet",           &backupwallet,           true,      false,      true },
-    { "dumpprivkey",            &dumpprivkey,            true,      false,      true },
-    { "dumpwallet",             &dumpwallet,             true,      false,      true },
-    { "encryptwallet",          &encryptwallet,          false,     false,      true },
-    { "getaccountaddress",      &getaccountaddress,      true,      false,      true },
-    { "getaccount",             &getaccount,             false,     false,      true },
-    { "getaddressesbyaccount",  &getaddressesbyaccount,  true,      false,      true },
-    { "getbalance",             &getbalance,             false,     false,      true },
-    { "getnewaddress",          &getnewaddress,          true,      false,      true },
-    { "getrawchangeaddress",    &getrawchangeaddress,    true,      false,      true },
-    { "getreceivedbyaccount",   &getreceivedbyaccount,   false,     false,      true },
-    { "getreceivedbyaddress",   &getreceivedbyaddress,   false,     false,      true },
-    { "gettransaction",         &gettransaction,         false,     false,      true },
-    { "getunconfirmedbalance",  &getunconfirmedbalance,  false,     false,      true },
-    { "getwalletinfo",          &getwalletinfo,          true,      false,      true },
-    { "importprivkey",          &importprivkey,          false,     false,      true },
-    { "importwallet",           &importwallet,           false,     false,      true },
-    { "keypoolrefill",          &keypoolrefill,          true,      false,      true },
-    { "listaccounts",           &listaccounts,           false,     false,      true },
-    { "listaddressgroupings",   &listaddressgroupings,   false,     false,      true },
-    { "listlockunspent",        &listlockunspent,        false,     false,      true },
-    { "listreceivedbyaccount",  &listreceivedbyaccount,  false,     false,      true },
-    { "listreceivedbyaddress",  &listreceivedbyaddress,  false,     false,      true },
-    { "listsinceblock",         &listsinceblock,         false,     false,      true },
-    { "listtransactions",       &listtransactions,       false,     false,      true },
-    { "listunspent",            &listunspent,            false,     false,      true },
-    { "lockunspent",            &lockunspent,            false,     false,      true },
-    { "move",                   &movecmd,                false,     false,      true },
-    { "sendfrom",               &sendfrom,               false,     false,      true },
-    { "sendmany",               &sendmany,               false,     false,      true },
-    { "sendtoaddress",          &sendtoaddress,          false,     false,      true },
-    { "setaccount",             &setaccount,             true,      false,      true },
-    { "settxfee",               &settxfee,               false,     false,      true },
-    { "signmessage",            &signmessage,            false,     false,      true },
-    { "walletlock",             &walletlock,             true,      false,      true },
-    { "walletpassphrasechange", &walletpassphrasechange, false,     false,      true },
-    { "walletpassphrase",       &walletpassphrase,       true,      false,      true },
+    { "addmultisigaddress",     &addmultisigaddress,     false,     RPC_LOCK_WALLET, true  },
+    { "backupwallet",           &backupwallet,           true,      RPC_LOCK_WALLET, true  },
+    { "dumpprivkey",            &dumpprivkey,            true,      RPC_LOCK_WALLET, true  },
+    { "dumpwallet",             &dumpwallet,             true,      RPC_LOCK_NONE,   true  },
+    { "encryptwallet",          &encryptwallet,          false,     RPC_LOCK_WALLET, true  },
+    { "getaccountaddress",      &getaccountaddress,      true,      RPC_LOCK_WALLET, true  },
+    { "getaccount",             &getaccount,             false,     RPC_LOCK_WALLET, true  },
+    { "getaddressesbyaccount",  &getaddressesbyaccount,  true,      RPC_LOCK_WALLET, true  },
+    { "getbalance",             &getbalance,             false,     RPC_LOCK_NONE,   true  },
+    { "getnewaddress",          &getnewaddress,          true,      RPC_LOCK_WALLET, true  },
+    { "getrawchangeaddress",    &getrawchangeaddress,    true,      RPC_LOCK_WALLET, true  },
+    { "getreceivedbyaccount",   &getreceivedbyaccount,   false,     RPC_LOCK_WALLET, true  },
+    { "getreceivedbyaddress",   &getreceivedbyaddress,   false,     RPC_LOCK_WALLET, true  },
+    { "gettransaction",         &gettransaction,         false,     RPC_LOCK_WALLET, true  },
+    { "getunconfirmedbalance",  &getunconfirmedbalance,  false,     RPC_LOCK_NONE,   true  },
+    { "getwalletinfo",          &getwalletinfo,          true,      RPC_LOCK_WALLET, true  },
+    { "importprivkey",          &importprivkey,          false,     RPC_LOCK_NONE,   true  },
+    { "importprivkeys",         &importprivkeys,         false,     RPC_LOCK_NONE,   true  },
+    { "importaddress",          &importaddress,          false,     RPC_LOCK_NONE,   true  },
+    { "importwallet",           &importwallet,           false,     RPC_LOCK_NONE,   true  },
+    { "keypoolrefill",          &keypoolrefill,          true,      RPC_LOCK_WALLET, true  },
+    { "listaccounts",           &listaccounts,           false,     RPC_LOCK_WALLET, true  },
+    { "listaddressgroupings",   &listaddressgroupings,   false,     RPC_LOCK_WALLET, true  },
+    { "listlockunspent",        &listlockunspent,        false,     RPC_LOCK_WALLET, true  },
+    { "listreceivedbyaccount",  &listreceivedbyaccount,  false,     RPC_LOCK_WALLET, true  },
+    { "listreceivedbyaddress",  &listreceivedbyaddress,  false,     RPC_LOCK_WALLET, true  },
+    { "listsinceblock",         &listsinceblock,         false,     RPC_LOCK_WALLET, true  },
+    { "listtransactions",        &RPCStreamed<&listtransactions>, false, RPC_LOCK_WALLET, true, &listtransactions },
+    { "listunspent",             &RPCStreamed<&listunspent>, false, RPC_LOCK_WALLET, true, &listunspent },
+    { "lockunspent",            &lockunspent,            false,     RPC_LOCK_WALLET, true  },
+    { "move",                   &movecmd,                false,     RPC_LOCK_WALLET, true  },
+    { "sendfrom",               &sendfrom,               false,     RPC_LOCK_WALLET, true  },
+    { "sendmany",               &sendmany,               false,     RPC_LOCK_WALLET, true  },
+    { "sendtoaddress",          &sendtoaddress,          false,     RPC_LOCK_WALLET, true  },
+    { "setaccount",             &setaccount,             true,      RPC_LOCK_WALLET, true  },
+    { "settxfee",               &settxfee,               false,     RPC_LOCK_WALLET, true  },
+    { "signmessage",            &signmessage,            false,     RPC_LOCK_WALLET, true  },
+    { "walletlock",             &walletlock,             true,      RPC_LOCK_WALLET, true  },
+    { "walletpassphrasechange", &walletpassphrasechange, false,     RPC_LOCK_WALLET, true  },
+    { "walletpassphrase",       &walletpassphrase,       true,      RPC_LOCK_WALLET, true  },
 
     /* Wallet-enabled mining */
-    { "getgenerate",            &getgenerate,            true,      false,      false },
-    { "gethashespersec",        &gethashespersec,        true,      false,      false },
-    { "getwork",                &getwork,                true,      false,      true  },
-    { "setgenerate",            &setgenerate,            true,      true,       false },
-    { "sendopreturn",           &sendopreturn,	         true,      true,       false },
+    { "getgenerate",            &getgenerate,            true,      RPC_LOCK_CHAIN,  false },
+    { "gethashespersec",        &gethashespersec,        true,      RPC_LOCK_CHAIN,  false },
+    { "getwork",                &getwork,                true,      RPC_LOCK_NONE,   true  },
+    { "setgenerate",            &setgenerate,            true,      RPC_LOCK_NONE,   false },
+    { "sendopreturn",           &sendopreturn,	         true,      RPC_LOCK_NONE,   false },
 
     /* Stealth */
-    { "getnewstealthaddress",   &getnewstealthaddress,   false,     false,      true},
-    { "liststealthaddresses",   &liststealthaddresses,   false,     false,      true},
-    { "importstealthaddress",   &importstealthaddress,   false,     false,      true},
-    { "sendtostealthaddress",   &sendtostealthaddress,   false,     false,      true},
-    { "clearwallettransactions",&clearwallettransactions,false,     false,      true},
-    { "scanforalltxns",         &scanforalltxns,         false,     false,      true},
-    { "scanforstealthtxns",     &scanforstealthtxns,     false,     false,      true},
+    { "getnewstealthaddress",   &getnewstealthaddress,   false,     RPC_LOCK_WALLET, true  },
+    { "liststealthaddresses",   &liststealthaddresses,   false,     RPC_LOCK_WALLET, true  },
+    { "importstealthaddress",   &importstealthaddress,   false,     RPC_LOCK_WALLET, true  },
+    { "sendtostealthaddress",   &sendtostealthaddress,   false,     RPC_LOCK_WALLET, true  },
+    { "clearwallettransactions",&clearwallettransactions,false,     RPC_LOCK_WALLET, true  },
+    { "scanforalltxns",         &scanforalltxns,         false,     RPC_LOCK_NONE,   true  },
+    { "scanforstealthtxns",     &scanforstealthtxns,     false,     RPC_LOCK_NONE,   true  },
 
 #endif // ENABLE_WALLET
-    { "makekeypair", &makekeypair, false, false, false },
-    { "sendalert", &sendalert, false, false, false },
+    { "makekeypair", &makekeypair, false, RPC_LOCK_CHAIN, false },
+    { "sendalert", &sendalert, false, RPC_LOCK_CHAIN, false },
 };
 
 CRPCTable::CRPCTable()
@@ -444,15 +474,15 @@ bool HTTPAuthorized(map<string, string>& mapHeaders)
     return TimingResistantEqual(strUserPass, strRPCUserColonPass);
 }
 
-void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
+string ErrorReply(const Object& objError, const Value& id, bool fKeepAlive)
 {
-    // Send error reply from json-rpc error object
+    // Error reply from json-rpc error object
     int nStatus = HTTP_INTERNAL_SERVER_ERROR;
     int code = find_value(objError, "code").get_int();
     if (code == RPC_INVALID_REQUEST) nStatus = HTTP_BAD_REQUEST;
     else if (code == RPC_METHOD_NOT_FOUND) nStatus = HTTP_NOT_FOUND;
     string strReply = JSONRPCReply(Value::null, objError, id);
-    stream << HTTPReply(nStatus, strReply, false) << std::flush;
+    return HTTPReply(nStatus, strReply, fKeepAlive);
 }
 
 bool ClientAllowed(const boost::asio::ip::address& address)
@@ -478,61 +508,229 @@ bool ClientAllowed(const boost::asio::ip::address& address)
     return false;
 }
 
-class AcceptedConnection
-{
-public:
-    virtual ~AcceptedConnection() {}
-
-    virtual std::iostream& stream() = 0;
-    virtual std::string peer_address_to_string() const = 0;
-    virtual void close() = 0;
-};
+// The reply to one request; fKeepAlive is cleared when the connection is to
+// be closed after it
+string ServiceRequest(const string& strMethod, const string& strURI, map<string, string>& mapHeaders,
+                      const string& strRequest, const string& strPeer, bool& fKeepAlive);
 
+/**
+ * An RPC client connection. It is read asynchronously, so an open keep-alive
+ * connection ties up no thread between requests; the requests it holds are
+ * handled in order, and the replies to pipelined ones written together.
+ * All handlers run through the strand, one at a time.
+ */
 template <typename Protocol>
-class AcceptedConnectionImpl : public AcceptedConnection
+class RPCConnection : public boost::enable_shared_from_this< RPCConnection<Protocol> >
 {
 public:
-    AcceptedConnectionImpl(
+    RPCConnection(
             asio::io_service& io_service,
             ssl::context &context,
-            bool fUseSSL) :
+            bool fUseSSLIn) :
         sslStream(io_service, context),
-        _d(sslStream, fUseSSL),
-        _stream(_d)
+        strand(io_service),
+        timer(io_service),
+        nTimerGeneration(0),
+        fUseSSL(fUseSSLIn),
+        fClose(false)
+    {
+    }
+
+    typename Protocol::endpoint peer;
+    asio::ssl::stream<typename Protocol::socket> sslStream;
+
+    void Start()
     {
+        ResetTimer();
+        if (fUseSSL)
+            sslStream.async_handshake(ssl::stream_base::server, strand.wrap(
+                boost::bind(&RPCConnection::HandleHandshake, this->shared_from_this(), asio::placeholders::error)));
+        else
+            ReadSome();
     }
 
-    virtual std::iostream& stream()
+    // Send a reply without reading any request, then close
+    void Refuse(int nStatus)
     {
-        return _stream;
+        strOut = HTTPReply(nStatus, "", false);
+        fClose = true;
+        Write();
     }
 
-    virtual std::string peer_address_to_string() const
+private:
+    asio::io_service::strand strand;
+    deadline_timer timer;
+    unsigned int nTimerGeneration;
+    bool fUseSSL;
+    bool fClose;                    // once the pending replies are written
+    string strIn;                   // received and not handled yet
+    string strOut;                  // replies being written
+    char pchRead[RPC_READ_SIZE];
+
+    void ResetTimer()
     {
-        return peer.address().to_string();
+        timer.expires_from_now(posix_time::seconds(RPC_IDLE_TIMEOUT));
+        timer.async_wait(strand.wrap(
+            boost::bind(&RPCConnection::HandleTimeout, this->shared_from_this(), asio::placeholders::error, ++nTimerGeneration)));
     }
 
-    virtual void close()
+    void HandleTimeout(const boost::system::error_code& error, unsigned int nGeneration)
     {
-        _stream.close();
+        // A wait that expired just before being reset still completes
+        if (!error && nGeneration == nTimerGeneration)
+            Close();
     }
 
-    typename Protocol::endpoint peer;
-    asio::ssl::stream<typename Protocol::socket> sslStream;
+    void HandleHandshake(const boost::system::error_code& error)
+    {
+        if (error)
+            Close();
+        else
+            ReadSome();
+    }
 
-private:
-    SSLIOStreamDevice<Protocol> _d;
-    iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
-};
+    void ReadSome()
+    {
+        ResetTimer();
+        if (fUseSSL)
+            sslStream.async_read_some(asio::buffer(pchRead), strand.wrap(
+                boost::bind(&RPCConnection::HandleRead, this->shared_from_this(), asio::placeholders::error, asio::placeholders::bytes_transferred)));
+        else
+            sslStream.next_layer().async_read_some(asio::buffer(pchRead), strand.wrap(
+                boost::bind(&RPCConnection::HandleRead, this->shared_from_this(), asio::placeholders::error, asio::placeholders::bytes_transferred)));
+    }
+
+    void HandleRead(const boost::system::error_code& error, size_t nBytes)
+    {
+        if (error)
+        {
+            Close();
+            return;
+        }
+        strIn.append(pchRead, nBytes);
+
+        while (!fClose && !ShutdownRequested() && HandleRequest())
+            ;
+        if (ShutdownRequested())
+            fClose = true;
+
+        if (!strOut.empty())
+            Write();
+        else if (fClose)
+            Close();
+        else
+            ReadSome();
+    }
+
+    void Write()
+    {
+        ResetTimer();
+        if (fUseSSL)
+            asio::async_write(sslStream, asio::buffer(strOut), strand.wrap(
+                boost::bind(&RPCConnection::HandleWrite, this->shared_from_this(), asio::placeholders::error)));
+        else
+            asio::async_write(sslStream.next_layer(), asio::buffer(strOut), strand.wrap(
+                boost::bind(&RPCConnection::HandleWrite, this->shared_from_this(), asio::placeholders::error)));
+    }
+
+    void HandleWrite(const boost::system::error_code& error)
+    {
+        strOut.clear();
+        if (error || fClose)
+            Close();
+        else
+            ReadSome();
+    }
+
+    // A reply that ends the connection, to a request that cannot be handled
+    void Fail(int nStatus)
+    {
+        strOut += HTTPReply(nStatus, "", false);
+        fClose = true;
+    }
+
+    // Take one request off strIn and queue its reply. Returns false until
+    // a whole request has been received.
+    bool HandleRequest()
+    {
+        // Empty lines between requests are ignored
+        size_t nStart = strIn.find_first_not_of("\r\n");
+        if (nStart == string::npos)
+        {
+            strIn.clear();
+            return false;
+        }
+        strIn.erase(0, nStart);
+
+        size_t nHeaderEnd = strIn.find("\r\n\r\n");
+        size_t nSeparator = 4;
+        size_t nHeaderEndLF = strIn.find("\n\n");
+        if (nHeaderEndLF < nHeaderEnd)
+        {
+            nHeaderEnd = nHeaderEndLF;
+            nSeparator = 2;
+        }
+        if (nHeaderEnd == string::npos)
+        {
+            if (strIn.size() > MAX_RPC_HEADERS_SIZE)
+            {
+                Fail(HTTP_BAD_REQUEST);
+                return true;
+            }
+            return false;
+        }
+        nHeaderEnd += nSeparator;
+        if (nHeaderEnd > MAX_RPC_HEADERS_SIZE)
+        {
+            Fail(HTTP_BAD_REQUEST);
+            return true;
+        }
+
+        int nProto = 0;
+        string strMethod, strURI;
+        map<string, string> mapHeaders;
+        std::istringstream ssHeader(strIn.substr(0, nHeaderEnd));
+        if (!ReadHTTPRequestLine(ssHeader, nProto, strMethod, strURI))
+        {
+            Fail(HTTP_BAD_REQUEST);
+            return true;
+        }
+        // Refused before its body is read
+        int nLen = ReadHTTPHeaders(ssHeader, mapHeaders);
+        if (nLen < 0 || (unsigned int)nLen > MAX_RPC_BODY_SIZE)
+        {
+            Fail(nLen < 0 ? HTTP_BAD_REQUEST : HTTP_REQUEST_ENTITY_TOO_LARGE);
+            return true;
+        }
+        if (strIn.size() < nHeaderEnd + nLen)
+            return false;
+
+        string strRequest = strIn.substr(nHeaderEnd, nLen);
+        strIn.erase(0, nHeaderEnd + nLen);
+
+        // HTTP/1.1 connections persist unless asked otherwise
+        const string& strConnection = mapHeaders["connection"];
+        bool fKeepAlive = strConnection == "keep-alive" || (strConnection != "close" && nProto >= 1);
+        strOut += ServiceRequest(strMethod, strURI, mapHeaders, strRequest, peer.address().to_string(), fKeepAlive);
+        if (!fKeepAlive)
+            fClose = true;
+        return true;
+    }
 
-void ServiceConnection(AcceptedConnection *conn);
+    void Close()
+    {
+        boost::system::error_code ec;
+        timer.cancel(ec);
+        sslStream.lowest_layer().close(ec);
+    }
+};
 
 // Forward declaration required for RPCListen
 template <typename Protocol, typename SocketAcceptorService>
 static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
                              ssl::context& context,
                              bool fUseSSL,
-                             boost::shared_ptr< AcceptedConnection > conn,
+                             boost::shared_ptr< RPCConnection<Protocol> > conn,
                              const boost::system::error_code& error);
 
 /**
@@ -544,7 +742,7 @@ static void RPCListen(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketA
                    const bool fUseSSL)
 {
     // Accept connection
-    boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn(new AcceptedConnectionImpl<Protocol>(acceptor->get_io_service(), context, fUseSSL));
+    boost::shared_ptr< RPCConnection<Protocol> > conn(new RPCConnection<Protocol>(acceptor->get_io_service(), context, fUseSSL));
 
     acceptor->async_accept(
             conn->sslStream.lowest_layer(),
@@ -565,34 +763,29 @@ template <typename Protocol, typename SocketAcceptorService>
 static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
                              ssl::context& context,
                              const bool fUseSSL,
-                             boost::shared_ptr< AcceptedConnection > conn,
+                             boost::shared_ptr< RPCConnection<Protocol> > conn,
                              const boost::system::error_code& error)
 {
     // Immediately start accepting new connections, except when we're cancelled or our socket is closed.
     if (error != asio::error::operation_aborted && acceptor->is_open())
         RPCListen(acceptor, context, fUseSSL);
 
-    AcceptedConnectionImpl<ip::tcp>* tcp_conn = dynamic_cast< AcceptedConnectionImpl<ip::tcp>* >(conn.get());
-
     if (error)
     {
         // TODO: Actually handle errors
         LogPrintf("%s: Error: %s\n", __func__, error.message());
     }
     // Restrict callers by IP.  It is important to
-    // do this before starting client thread, to filter out
+    // do this before reading anything, to filter out
     // certain DoS and misbehaving clients.
-    else if (tcp_conn && !ClientAllowed(tcp_conn->peer.address()))
+    else if (!ClientAllowed(conn->peer.address()))
     {
         // Only send a 403 if we're not using SSL to prevent a DoS during the SSL handshake.
         if (!fUseSSL)
-            conn->stream() << HTTPReply(HTTP_FORBIDDEN, "", false) << std::flush;
-        conn->close();
-    }
-    else {
-        ServiceConnection(conn.get());
-        conn->close();
+            conn->Refuse(HTTP_FORBIDDEN);
     }
+    else
+        conn->Start();
 }
 
 void StartRPCThreads()
@@ -710,9 +903,11 @@ void StartRPCThreads()
         return;
     }
 
+    int nThreads = GetArg("-rpcthreads", 32);
     rpc_worker_group = new boost::thread_group();
-    for (int i = 0; i < GetArg("-rpcthreads", 32); i++)
+    for (int i = 0; i < nThreads; i++)
         rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
+    rpc_batch_pool = new CWorkPool(TASK_RPC);
 }
 
 void StartDummyRPCThread()
@@ -752,8 +947,15 @@ void StopRPCThreads()
     deadlineTimers.clear();
 
     rpc_io_service->stop();
+    {
+        // Release any getblocktemplate longpolls so the workers can be joined
+        boost::unique_lock<boost::mutex> lock(csBestBlock);
+        cvBlockChange.notify_all();
+    }
     if (rpc_worker_group != NULL)
         rpc_worker_group->join_all();
+    // After the workers, which may still wait for the entries of a batch
+    delete rpc_batch_pool; rpc_batch_pool = NULL;
     delete rpc_dummy_work; rpc_dummy_work = NULL;
     delete rpc_worker_group; rpc_worker_group = NULL;
     delete rpc_ssl_context; rpc_ssl_context = NULL;
@@ -821,124 +1023,161 @@ void JSONRequest::parse(const Value& valRequest)
 }
 
 
-static Object JSONRPCExecOne(const Value& req)
+static string JSONRPCExecOne(const Value& req)
 {
-    Object rpc_result;
-
     JSONRequest jreq;
     try {
         jreq.parse(req);
 
-        Value result = tableRPC.execute(jreq.strMethod, jreq.params);
-        rpc_result = JSONRPCReplyObj(result, Value::null, jreq.id);
+        string strResult = tableRPC.executeJSON(jreq.strMethod, jreq.params);
+        return "{\"result\":" + strResult + ",\"error\":null,\"id\":" + write_string(jreq.id, false) + "}";
     }
     catch (Object& objError)
     {
-        rpc_result = JSONRPCReplyObj(Value::null, objError, jreq.id);
+        return write_string(Value(JSONRPCReplyObj(Value::null, objError, jreq.id)), false);
     }
     catch (std::exception& e)
     {
-        rpc_result = JSONRPCReplyObj(Value::null,
-                                     JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+        return write_string(Value(JSONRPCReplyObj(Value::null,
+                                                  JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id)), false);
     }
+}
 
-    return rpc_result;
+// Runs the given entries of a batch one after the other
+static void JSONRPCExecEntries(const Array *pvReq, const vector<unsigned int> *pvIdx, vector<string> *pvReply, bool *pfDone)
+{
+    BOOST_FOREACH(unsigned int nIdx, *pvIdx)
+        (*pvReply)[nIdx] = JSONRPCExecOne((*pvReq)[nIdx]);
+    if (pfDone)
+        rpc_batch_pool->MarkDone(*pfDone);
 }
 
+// The entries of a batch that take no lock run concurrently on the batch
+// pool. Those that lock cs_main would only queue up on it, so they run in
+// the order of the batch on this thread, in the meantime.
 static string JSONRPCExecBatch(const Array& vReq)
 {
-    Array ret;
+    vector<string> vReply(vReq.size());
+    vector<vector<unsigned int> > vUnlocked;
+    vector<unsigned int> vLocked;
     for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+    {
+        // Malformed entries and unknown methods fail without a lock
+        const CRPCCommand *pcmd = NULL;
+        if (vReq[reqIdx].type() == obj_type)
+        {
+            const Value& valMethod = find_value(vReq[reqIdx].get_obj(), "method");
+            if (valMethod.type() == str_type)
+                pcmd = tableRPC[valMethod.get_str()];
+        }
+        if (rpc_batch_pool && vReq.size() > 1 && (!pcmd || pcmd->lockMode == RPC_LOCK_NONE))
+            vUnlocked.push_back(vector<unsigned int>(1, reqIdx));
+        else
+            vLocked.push_back(reqIdx);
+    }
 
-    return write_string(Value(ret), false) + "\n";
-}
+    deque<bool> vDone;
+    for (unsigned int i = 0; i < vUnlocked.size(); i++)
+    {
+        vDone.push_back(false);
+        rpc_batch_pool->Submit(boost::bind(&JSONRPCExecEntries, &vReq, &vUnlocked[i], &vReply, &vDone.back()));
+    }
+    JSONRPCExecEntries(&vReq, &vLocked, &vReply, NULL);
+    for (unsigned int i = 0; i < vDone.size(); i++)
+        rpc_batch_pool->WaitDone(vDone[i]);
 
-void ServiceConnection(AcceptedConnection *conn)
-{
-    bool fRun = true;
-    while (fRun && !ShutdownRequested())
+    // Written in the order of the requests
+    string strReply = "[";
+    for (unsigned int reqIdx = 0; reqIdx < vReply.size(); reqIdx++)
     {
-        int nProto = 0;
-        map<string, string> mapHeaders;
-        string strRequest, strMethod, strURI;
+        if (reqIdx > 0)
+            strReply += ",";
+        strReply += vReply[reqIdx];
+    }
+    return strReply + "]\n";
+}
 
-        // Read HTTP request line
-        if (!ReadHTTPRequestLine(conn->stream(), nProto, strMethod, strURI))
-            break;
+string ServiceRequest(const string& strMethod, const string& strURI, map<string, string>& mapHeaders,
+                      const string& strRequest, const string& strPeer, bool& fKeepAlive)
+{
+    bool fREST = boost::starts_with(strURI, "/rest/");
+    bool fMetrics = (strURI == "/metrics");
+    if (strURI != "/" && !fREST && !fMetrics) {
+        fKeepAlive = false;
+        return HTTPReply(HTTP_NOT_FOUND, "", false);
+    }
 
-        // Read HTTP message headers and body
-        ReadHTTPMessage(conn->stream(), mapHeaders, strRequest, nProto);
+    // With -rest, the read-only REST interface is public; without it, it
+    // takes the same authorization as JSON-RPC. The same goes for the
+    // Prometheus metrics and -metrics.
+    if (fREST && GetBoolArg("-rest", false))
+        return HTTPReplyREST(strMethod, strURI, strRequest, fKeepAlive);
+    if (fMetrics && GetBoolArg("-metrics", false))
+        return HTTPReply(HTTP_OK, GetMetricsText(), fKeepAlive, "text/plain; version=0.0.4");
 
-        if (strURI != "/") {
-            conn->stream() << HTTPReply(HTTP_NOT_FOUND, "", false) << std::flush;
-            break;
-        }
+    // Check authorization
+    if (mapHeaders.count("authorization") == 0)
+    {
+        fKeepAlive = false;
+        return HTTPReply(HTTP_UNAUTHORIZED, "", false);
+    }
+    if (!HTTPAuthorized(mapHeaders))
+    {
+        LogPrintf("ThreadRPCServer incorrect password attempt from %s\n", strPeer);
+        /* Deter brute-forcing short passwords.
+           If this results in a DoS the user really
+           shouldn't have their RPC port exposed. */
+        if (mapArgs["-rpcpassword"].size() < 20)
+            MilliSleep(250);
+
+        fKeepAlive = false;
+        return HTTPReply(HTTP_UNAUTHORIZED, "", false);
+    }
 
-        // Check authorization
-        if (mapHeaders.count("authorization") == 0)
-        {
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
-        }
-        if (!HTTPAuthorized(mapHeaders))
-        {
-            LogPrintf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string());
-            /* Deter brute-forcing short passwords.
-               If this results in a DoS the user really
-               shouldn't have their RPC port exposed. */
-            if (mapArgs["-rpcpassword"].size() < 20)
-                MilliSleep(250);
-
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
-        }
-        if (mapHeaders["connection"] == "close")
-            fRun = false;
+    if (fREST)
+        return HTTPReplyREST(strMethod, strURI, strRequest, fKeepAlive);
+    if (fMetrics)
+        return HTTPReply(HTTP_OK, GetMetricsText(), fKeepAlive, "text/plain; version=0.0.4");
 
-        JSONRequest jreq;
-        try
-        {
-            // Parse request
-            Value valRequest;
-            if (!read_string(strRequest, valRequest))
-                throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+    JSONRequest jreq;
+    try
+    {
+        // Parse request
+        Value valRequest;
+        if (!read_string(strRequest, valRequest))
+            throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
 
-            string strReply;
+        string strReply;
 
-            // singleton request
-            if (valRequest.type() == obj_type) {
-                jreq.parse(valRequest);
+        // singleton request
+        if (valRequest.type() == obj_type) {
+            jreq.parse(valRequest);
 
-                Value result = tableRPC.execute(jreq.strMethod, jreq.params);
+            string strResult = tableRPC.executeJSON(jreq.strMethod, jreq.params);
 
-                // Send reply
-                strReply = JSONRPCReply(result, Value::null, jreq.id);
+            // Send reply
+            strReply = JSONRPCReplyResultText(strResult, jreq.id);
 
-            // array of requests
-            } else if (valRequest.type() == array_type)
-                strReply = JSONRPCExecBatch(valRequest.get_array());
-            else
-                throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+        // array of requests
+        } else if (valRequest.type() == array_type)
+            strReply = JSONRPCExecBatch(valRequest.get_array());
+        else
+            throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
 
-            conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
-        }
-        catch (Object& objError)
-        {
-            ErrorReply(conn->stream(), objError, jreq.id);
-            break;
-        }
-        catch (std::exception& e)
-        {
-            ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
-            break;
-        }
+        return HTTPReply(HTTP_OK, strReply, fKeepAlive);
+    }
+    catch (Object& objError)
+    {
+        return ErrorReply(objError, jreq.id, fKeepAlive);
+    }
+    catch (std::exception& e)
+    {
+        return ErrorReply(JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id, fKeepAlive);
     }
 }
 
-json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+static const CRPCCommand* FindCommand(const std::string &strMethod)
 {
-    // Find method
     const CRPCCommand *pcmd = tableRPC[strMethod];
     if (!pcmd)
         throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found");
@@ -952,30 +1191,58 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
     if (strWarning != "" && !GetBoolArg("-disablesafemode", false) &&
         !pcmd->okSafeMode)
         throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, string("Safe mode: ") + strWarning);
+    return pcmd;
+}
 
+// Accounts one call of a command in the RPC statistics (getrpcstats and
+// /metrics); a call that is not marked done counts as an error
+class CRPCCallStats
+{
+public:
+    int64_t nLockWaitMicros;
+    uint64_t nBytes;
+    bool fDone;
+
+    CRPCCallStats(const std::string& strMethodIn) : nLockWaitMicros(0), nBytes(0), fDone(false), strMethod(strMethodIn), nStart(GetTimeMicros())
+    {
+        RecordRPCStart(strMethod);
+    }
+
+    ~CRPCCallStats()
+    {
+        RecordRPCFinish(strMethod, GetTimeMicros() - nStart, nLockWaitMicros, nBytes, !fDone);
+    }
+
+private:
+    const std::string& strMethod;
+    int64_t nStart;
+};
+
+// Runs a command under the locks of its lockMode
+static void RunLocked(const CRPCCommand *pcmd, const boost::function<void(void)>& func, CRPCCallStats& call)
+{
+#ifdef ENABLE_WALLET
+    // Wallet calls see every block and transaction validated before them
+    if (pcmd->reqWallet)
+        SyncWalletNotifications();
+#endif
     try
     {
-        // Execute
-        Value result;
-        {
-            if (pcmd->threadSafe)
-                result = pcmd->actor(params, false);
+        int64_t nLockStart = GetTimeMicros();
+        if (pcmd->lockMode == RPC_LOCK_NONE)
+            func();
 #ifdef ENABLE_WALLET
-            else if (!pwalletMain) {
-                LOCK(cs_main);
-                result = pcmd->actor(params, false);
-            } else {
-                LOCK2(cs_main, pwalletMain->cs_wallet);
-                result = pcmd->actor(params, false);
-            }
-#else // ENABLE_WALLET
-            else {
-                LOCK(cs_main);
-                result = pcmd->actor(params, false);
-            }
-#endif // !ENABLE_WALLET
+        else if (pcmd->lockMode == RPC_LOCK_WALLET && pwalletMain) {
+            LOCK2(cs_main, pwalletMain->cs_wallet);
+            call.nLockWaitMicros = GetTimeMicros() - nLockStart;
+            func();
+        }
+#endif // ENABLE_WALLET
+        else {
+            LOCK(cs_main);
+            call.nLockWaitMicros = GetTimeMicros() - nLockStart;
+            func();
         }
-        return result;
     }
     catch (std::exception& e)
     {
@@ -983,6 +1250,48 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
     }
 }
 
+static void CallActor(const CRPCCommand *pcmd, const Array &params, Value &result)
+{
+    result = pcmd->actor(params, false);
+}
+
+static void CallStreamActor(const CRPCCommand *pcmd, const Array &params, CJSONWriter &writer)
+{
+    pcmd->streamActor(params, false, writer);
+}
+
+json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+{
+    const CRPCCommand *pcmd = FindCommand(strMethod);
+    CRPCCallStats call(pcmd->name);
+    Value result;
+    RunLocked(pcmd, boost::bind(&CallActor, pcmd, boost::cref(params), boost::ref(result)), call);
+    call.fDone = true;
+    return result;
+}
+
+std::string CRPCTable::executeJSON(const std::string &strMethod, const json_spirit::Array &params) const
+{
+    const CRPCCommand *pcmd = FindCommand(strMethod);
+    CRPCCallStats call(pcmd->name);
+    string strResult;
+    if (!pcmd->streamActor)
+    {
+        Value result;
+        RunLocked(pcmd, boost::bind(&CallActor, pcmd, boost::cref(params), boost::ref(result)), call);
+        strResult = write_string(result, false);
+    }
+    else
+    {
+        CJSONWriter writer;
+        RunLocked(pcmd, boost::bind(&CallStreamActor, pcmd, boost::cref(params), boost::ref(writer)), call);
+        strResult = writer.str();
+    }
+    call.nBytes = strResult.size();
+    call.fDone = true;
+    return strResult;
+}
+
 std::string HelpExampleCli(string methodname, string args){
     return "> digitalcoin-cli " + methodname + " " + args + "\n";
 }
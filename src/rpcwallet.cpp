@@ -96,9 +96,6 @@ Value getnewaddress(const Array& params, bool fHelp)
     if (params.size() > 0)
         strAccount = AccountFromValue(params[0]);
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
-
     // Generate a new key that is added to wallet
     CPubKey newKey;
     if (!pwalletMain->GetKeyFromPool(newKey))
@@ -191,9 +188,6 @@ Value getrawchangeaddress(const Array& params, bool fHelp)
             + HelpExampleRpc("getrawchangeaddress", "")
        );
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
-
     CReserveKey reservekey(pwalletMain);
     CPubKey vchPubKey;
     if (!reservekey.GetReservedKey(vchPubKey))
@@ -625,9 +619,9 @@ int64_t GetAccountBalance(const string& strAccount, int nMinDepth)
 
 Value getbalance(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() > 2)
+    if (fHelp || params.size() > 3)
         throw runtime_error(
-            "getbalance ( \"account\" minconf )\n"
+            "getbalance ( \"account\" minconf includeWatchonly )\n"
             "\nIf account is not specified, returns the server's total available balance.\n"
             "If account is specified, returns the balance in the account.\n"
             "Note that the account \"\" is not the same as leaving the parameter out.\n"
@@ -635,6 +629,7 @@ Value getbalance(const Array& params, bool fHelp)
             "\nArguments:\n"
             "1. \"account\"      (string, optional) The selected account, or \"*\" for entire wallet. It may be the default account using \"\".\n"
             "2. minconf          (numeric, optional, default=1) Only include transactions confirmed at least this many times.\n"
+            "3. includeWatchonly (bool, optional, default=false) Also include the unspent outputs of watch-only addresses (see 'importaddress'), with account \"*\"\n"
             "\nResult:\n"
             "amount              (numeric) The total amount in btc received for this account.\n"
             "\nExamples:\n"
@@ -650,12 +645,19 @@ Value getbalance(const Array& params, bool fHelp)
             + HelpExampleRpc("getbalance", "\"tabby\", 6")
         );
 
+    // The chain is only read through cs_chainview
+    LOCK(pwalletMain->cs_wallet);
     if (params.size() == 0)
         return  ValueFromAmount(pwalletMain->GetBalance());
 
     int nMinDepth = 1;
     if (params.size() > 1)
         nMinDepth = params[1].get_int();
+    bool fIncludeWatchOnly = false;
+    if (params.size() > 2)
+        fIncludeWatchOnly = params[2].get_bool();
+    if (fIncludeWatchOnly && params[0].get_str() != "*")
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "includeWatchonly is only supported for account \"*\"");
 
     if (params[0].get_str() == "*") {
         // Calculate total balance a different way from GetBalance()
@@ -682,6 +684,8 @@ Value getbalance(const Array& params, bool fHelp)
                 nBalance -= r.second;
             nBalance -= allFee;
         }
+        if (fIncludeWatchOnly)
+            nBalance += pwalletMain->GetWatchOnlyBalance(nMinDepth);
         return  ValueFromAmount(nBalance);
     }
 
@@ -762,6 +766,8 @@ Value movecmd(const Array& params, bool fHelp)
 
     if (!walletdb.TxnCommit())
         throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
+    pwalletMain->LoadAccountingEntry(debit);
+    pwalletMain->LoadAccountingEntry(credit);
 
     return true;
 }
@@ -1214,17 +1220,20 @@ void AcentryToJSON(const CAccountingEntry& acentry, const string& strAccount, Ar
     }
 }
 
-Value listtransactions(const Array& params, bool fHelp)
+void listtransactions(const Array& params, bool fHelp, CJSONWriter& writer)
 {
-    if (fHelp || params.size() > 3)
+    if (fHelp || params.size() > 4)
         throw runtime_error(
-            "listtransactions ( \"account\" count from )\n"
+            "listtransactions ( \"account\" count from before )\n"
             "\nReturns up to 'count' most recent transactions skipping the first 'from' transactions for account 'account'.\n"
             "\nArguments:\n"
             "1. \"account\"    (string, optional) The account name. If not included, it will list all transactions for all accounts.\n"
             "                                     If \"\" is set, it will list transactions for the default account.\n"
             "2. count          (numeric, optional, default=10) The number of transactions to return\n"
             "3. from           (numeric, optional, default=0) The number of transactions to skip\n"
+            "4. before         (numeric, optional) Only list the transactions ordered before this 'orderpos', which is\n"
+            "                                     the one of the oldest transaction of the previous page. The transaction\n"
+            "                                     at the start of the page is then listed whole, even if above 'count'.\n"
 
             "\nResult:\n"
             "[\n"
@@ -1256,6 +1265,7 @@ Value listtransactions(const Array& params, bool fHelp)
             "    \"otheraccount\": \"accountname\",  (string) For the 'move' category of transactions, the account the funds came \n"
             "                                          from (for receiving funds, positive amounts), or went to (for sending funds,\n"
             "                                          negative amounts).\n"
+            "    \"orderpos\": n,           (numeric) The position of the transaction in the wallet, for the 'before' argument.\n"
             "  }\n"
             "]\n"
 
@@ -1266,6 +1276,8 @@ Value listtransactions(const Array& params, bool fHelp)
             + HelpExampleCli("listtransactions", "\"tabby\"") +
             "\nList transactions 100 to 120 from the tabby account\n"
             + HelpExampleCli("listtransactions", "\"tabby\" 20 100") +
+            "\nList the 20 transactions of the tabby account before those at position 1000 and on\n"
+            + HelpExampleCli("listtransactions", "\"tabby\" 20 0 1000") +
             "\nAs a json rpc call\n"
             + HelpExampleRpc("listtransactions", "\"tabby\", 20, 100")
         );
@@ -1284,21 +1296,31 @@ Value listtransactions(const Array& params, bool fHelp)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative count");
     if (nFrom < 0)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative from");
+    bool fBefore = params.size() > 3;
+    int64_t nBefore = 0;
+    if (fBefore)
+        nBefore = params[3].get_int64();
 
     Array ret;
 
-    std::list<CAccountingEntry> acentries;
-    CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
-
     // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+    const CWallet::TxItems& txOrdered = pwalletMain->wtxOrdered;
+    CWallet::TxItems::const_reverse_iterator it(fBefore ? txOrdered.lower_bound(nBefore) : txOrdered.end());
+    for (; it != txOrdered.rend(); ++it)
     {
+        unsigned int nListed = ret.size();
         CWalletTx *const pwtx = (*it).second.first;
         if (pwtx != 0)
             ListTransactions(*pwtx, strAccount, 0, true, ret);
         CAccountingEntry *const pacentry = (*it).second.second;
         if (pacentry != 0)
             AcentryToJSON(*pacentry, strAccount, ret);
+        for (unsigned int i = nListed; i < ret.size(); i++)
+        {
+            Object entry = ret[i].get_obj();
+            entry.push_back(Pair("orderpos", (*it).first));
+            ret[i] = entry;
+        }
 
         if ((int)ret.size() >= (nCount+nFrom)) break;
     }
@@ -1306,19 +1328,14 @@ Value listtransactions(const Array& params, bool fHelp)
 
     if (nFrom > (int)ret.size())
         nFrom = ret.size();
-    if ((nFrom + nCount) > (int)ret.size())
+    if ((nFrom + nCount) > (int)ret.size() || fBefore)
         nCount = ret.size() - nFrom;
-    Array::iterator first = ret.begin();
-    std::advance(first, nFrom);
-    Array::iterator last = ret.begin();
-    std::advance(last, nFrom+nCount);
-
-    if (last != ret.end()) ret.erase(last, ret.end());
-    if (first != ret.begin()) ret.erase(ret.begin(), first);
 
-    std::reverse(ret.begin(), ret.end()); // Return oldest to newest
-
-    return ret;
+    // Written oldest to newest, without trimming and reversing ret first
+    writer.BeginArray();
+    for (int i = nFrom + nCount - 1; i >= nFrom; i--)
+        writer.Write(ret[i]);
+    writer.EndArray();
 }
 
 Value listaccounts(const Array& params, bool fHelp)
@@ -1435,7 +1452,7 @@ Value listsinceblock(const Array& params, bool fHelp)
         uint256 blockId = 0;
 
         blockId.SetHex(params[0].get_str());
-        std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(blockId);
+        BlockMap::iterator it = mapBlockIndex.find(blockId);
         if (it != mapBlockIndex.end())
             pindex = it->second;
     }
@@ -1452,12 +1469,17 @@ Value listsinceblock(const Array& params, bool fHelp)
 
     Array transactions;
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+    if (depth == -1)
     {
-        CWalletTx tx = (*it).second;
-
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", 0, true, transactions);
+        for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+            ListTransactions((*it).second, "*", 0, true, transactions);
+    }
+    else
+    {
+        std::map<uint256, const CWalletTx*> mapTx;
+        pwalletMain->GetTransactionsBelowDepth(depth, mapTx);
+        for (std::map<uint256, const CWalletTx*>::iterator it = mapTx.begin(); it != mapTx.end(); it++)
+            ListTransactions(*(*it).second, "*", 0, true, transactions);
     }
 
     CBlockIndex *pblockLast = chainActive[chainActive.Height() + 1 - target_confirms];
@@ -1641,7 +1663,8 @@ Value walletpassphrase(const Array& params, bool fHelp)
             "walletpassphrase <passphrase> <timeout>\n"
             "Stores the wallet decryption key in memory for <timeout> seconds.");
 
-    pwalletMain->TopUpKeyPool();
+    if (!pwalletMain->RequestKeyPoolRefill())
+        pwalletMain->TopUpKeyPool();
 
     int64_t nSleepTime = params[1].get_int64();
     LOCK(cs_nWalletUnlockTime);
@@ -2165,95 +2188,32 @@ Value clearwallettransactions(const Array& params, bool fHelp)
      {
          LOCK2(cs_main, pwalletMain->cs_wallet);
  
+         // The records are looked up first, as a cursor cannot be used to
+         // erase them on every wallet backend
          CWalletDB walletdb(pwalletMain->strWalletFile);
+         vector<uint256> vTxHash;
+         if (walletdb.FindWalletTx(pwalletMain, vTxHash) != DB_LOAD_OK)
+             throw runtime_error("Cannot read the wallet DB transactions");
+
          walletdb.TxnBegin();
-         Dbc* pcursor = walletdb.GetCursor();
-         if (!pcursor)
-             throw runtime_error("Cannot get wallet DB cursor");
- 
-         Dbt datKey;
-         Dbt datValue;
- 
-         datKey.set_flags(DB_DBT_USERMEM);
-         datValue.set_flags(DB_DBT_USERMEM);
- 
-         std::vector<unsigned char> vchKey;
-         std::vector<unsigned char> vchType;
-         std::vector<unsigned char> vchKeyData;
-         std::vector<unsigned char> vchValueData;
- 
-         vchKeyData.resize(100);
-         vchValueData.resize(100);
- 
-         datKey.set_ulen(vchKeyData.size());
-         datKey.set_data(&vchKeyData[0]);
-  
-         datValue.set_ulen(vchValueData.size());
-         datValue.set_data(&vchValueData[0]);
- 
-         unsigned int fFlags = DB_NEXT; // same as using DB_FIRST for new cursor
-         while (true)
+         BOOST_FOREACH(const uint256& hash, vTxHash)
          {
-             int ret = pcursor->get(&datKey, &datValue, fFlags);
- 
-             if (ret == ENOMEM || ret == DB_BUFFER_SMALL)
-             {
-                if (datKey.get_size() > datKey.get_ulen())
-                 {
-                     vchKeyData.resize(datKey.get_size());
-                     datKey.set_ulen(vchKeyData.size());
-                     datKey.set_data(&vchKeyData[0]);
-                 };
-
-                 if (datValue.get_size() > datValue.get_ulen())
-                 {
-                     vchValueData.resize(datValue.get_size());
-                     datValue.set_ulen(vchValueData.size());
-                     datValue.set_data(&vchValueData[0]);
-                 };
-                 // -- try once more, when DB_BUFFER_SMALL cursor is not expected to move
-                 ret = pcursor->get(&datKey, &datValue, fFlags);
-             };
- 
-             if (ret == DB_NOTFOUND)
-                 break;
-             else if (datKey.get_data() == NULL || datValue.get_data() == NULL || ret != 0)
+             if (!walletdb.EraseTx(hash))
              {
-                snprintf(cbuf, sizeof(cbuf), "wallet DB error %d, %s", ret, db_strerror(ret));
-                throw runtime_error(cbuf);
-             };
- 
-             CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-             ssValue.SetType(SER_DISK);
-             ssValue.clear();
-             ssValue.write((char*)datKey.get_data(), datKey.get_size());
-             ssValue >> vchType;
+                 LogPrintf("Delete transaction %s failed\n", hash.ToString());
+                 continue;
+             }
 
+             pwalletMain->UnindexWalletTx(hash);
+             pwalletMain->mapWallet.erase(hash);
+             pwalletMain->NotifyTransactionChanged(pwalletMain, hash, CT_DELETED);
 
-            std::string strType(vchType.begin(), vchType.end());
+             nTransactions++;
+         }
+         walletdb.TxnCommit();
 
-            //LogPrintf("strType %s\n", strType.c_str());
-
-            if (strType == "tx")
-            {
-                uint256 hash;
-                ssValue >> hash;
-
-                if ((ret = pcursor->del(0)) != 0)
-                {
-                    LogPrintf("Delete transaction failed %d, %s\n", ret, db_strerror(ret));
-                    continue;
-                };
-
-                pwalletMain->mapWallet.erase(hash);
-                pwalletMain->NotifyTransactionChanged(pwalletMain, hash, CT_DELETED);
-
-                nTransactions++;
-            };
-        };
-
-        pcursor->close();
-        walletdb.TxnCommit();
+        // Rebuild the balance totals without the removed transactions
+        pwalletMain->MarkDirty();
 
 
         //pwalletMain->mapWallet.clear();
@@ -2277,32 +2237,21 @@ Value scanforalltxns(const Array& params, bool fHelp)
     int32_t nFromHeight = 0;
 
 
-    CBlockIndex *pindex = chainActive.Genesis();
-
     if (params.size() > 0)
         nFromHeight = params[0].get_int();
 
-
-    if (nFromHeight > 0)
+    CBlockIndex *pindex;
     {
-        // pindex = mapBlockIndex[hashBestChain];
-        pindex = mapBlockIndex[chainActive.Tip()->GetBlockHash()];
-        while (pindex->nHeight > nFromHeight
-            && pindex->pprev)
-            pindex = pindex->pprev;
-    };
+        LOCK(cs_main);
+        pindex = chainActive[std::max(0, std::min(nFromHeight, chainActive.Height()))];
+    }
 
     if (pindex == NULL)
         throw runtime_error("Genesis block is not set.");
 
-    {
-        LOCK2(cs_main, pwalletMain->cs_wallet);
-
-        pwalletMain->MarkDirty();
-
-        pwalletMain->ScanForWalletTransactions(pindex, true);
-        pwalletMain->ReacceptWalletTransactions();
-    }
+    pwalletMain->MarkDirty();
+    pwalletMain->ScanForWalletTransactions(pindex, true);
+    pwalletMain->ReacceptWalletTransactions();
 
     result.push_back(Pair("result", "Scan complete."));
 
@@ -2322,51 +2271,30 @@ Value scanforstealthtxns(const Array& params, bool fHelp)
     uint32_t nTransactions = 0;
     int32_t nFromHeight = 0;
 
-    CBlockIndex *pindex = chainActive.Genesis();
-
-
     if (params.size() > 0)
         nFromHeight = params[0].get_int();
 
-    if (nFromHeight > 0)
+    CBlockIndex *pindex;
     {
-        // pindex = mapBlockIndex[hashBestChain];
-        pindex = mapBlockIndex[chainActive.Tip()->GetBlockHash()];
-        while (pindex->nHeight > nFromHeight
-            && pindex->pprev)
-            pindex = pindex->pprev;
-    };
+        LOCK(cs_main);
+        pindex = chainActive[std::max(0, std::min(nFromHeight, chainActive.Height()))];
+    }
 
     if (pindex == NULL)
         throw runtime_error("Genesis block is not set.");
 
-    // -- locks in AddToWalletIfInvolvingMe
-
     bool fUpdate = true; // todo: option?
 
-    pwalletMain->nStealth = 0;
-    pwalletMain->nFoundStealth = 0;
-
-    while (pindex)
     {
-        nBlocks++;
-        CBlock block;
-        ReadBlockFromDisk(block, pindex);
-
-        BOOST_FOREACH(CTransaction& tx, block.vtx)
-        {
-            string reason;
-            if (!IsStandardTx(tx, reason))
-                continue; // leave out coinbase and others
-            nTransactions++;
-
-            pwalletMain->AddToWalletIfInvolvingMe(tx.GetHash(), tx, &block, fUpdate);
-        };
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        pwalletMain->nStealth = 0;
+        pwalletMain->nFoundStealth = 0;
+        nBlocks = chainActive.Height() - pindex->nHeight + 1;
+    }
 
-        pindex = chainActive.Next(pindex);
-    };
+    nTransactions = pwalletMain->ScanForWalletTransactions(pindex, fUpdate);
 
-    LogPrintf("Scanned %u blocks, %u transactions\n", nBlocks, nTransactions);
+    LogPrintf("Scanned %u blocks, %u transactions added or updated\n", nBlocks, nTransactions);
     LogPrintf("Found %u stealth transactions in blockchain.\n", pwalletMain->nStealth);
     LogPrintf("Found %u new owned stealth transactions.\n", pwalletMain->nFoundStealth);
 
@@ -2393,6 +2321,7 @@ Value getwalletinfo(const Array& params, bool fHelp)
             "  \"keypoololdest\": xxxxxx,    (numeric) the timestamp (seconds since GMT epoch) of the oldest pre-generated key in the key pool\n"
             "  \"keypoolsize\": xxxx,        (numeric) how many new keys are pre-generated\n"
             "  \"unlocked_until\": ttt,      (numeric) the timestamp in seconds since epoch (midnight Jan 1 1970 GMT) that the wallet is unlocked for transfers, or 0 if the wallet is locked\n"
+            "  \"hdmasterkeyid\": \"<hash160>\", (string) the Hash160 of the HD seed, if keys are derived from one\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getwalletinfo", "")
@@ -2407,5 +2336,7 @@ Value getwalletinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("keypoolsize",   (int)pwalletMain->GetKeyPoolSize()));
     if (pwalletMain->IsCrypted())
         obj.push_back(Pair("unlocked_until", nWalletUnlockTime));
+    if (pwalletMain->IsHDEnabled())
+        obj.push_back(Pair("hdmasterkeyid", pwalletMain->GetHDChain().masterKeyID.GetHex()));
     return obj;
 }
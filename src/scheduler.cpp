@@ -0,0 +1,218 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "scheduler.h"
+
+#include "util.h"
+
+#include <stdlib.h>
+
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/foreach.hpp>
+
+#ifndef WIN32
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace std;
+
+CTaskScheduler taskScheduler;
+
+CTaskScheduler::CTaskScheduler() : fStop(false), nThreads(0)
+{
+}
+
+CTaskScheduler::~CTaskScheduler()
+{
+    Stop();
+}
+
+int CTaskScheduler::GetThreadCount()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return nThreads;
+}
+
+bool CTaskScheduler::PopTask(CTask& task, const void* pOwner)
+{
+    for (int nPriority = 0; nPriority < NUM_TASK_PRIORITIES; nPriority++)
+    {
+        deque<CTask>& q = queue[nPriority];
+        for (deque<CTask>::iterator it = q.begin(); it != q.end(); ++it)
+        {
+            if (pOwner && it->pOwner != pOwner)
+                continue;
+            task = *it;
+            q.erase(it);
+            mapRunning[task.pOwner]++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void CTaskScheduler::RunTask(const CTask& task)
+{
+    task.fn();
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (--mapRunning[task.pOwner] == 0)
+        mapRunning.erase(task.pOwner);
+    condFinished.notify_all();
+}
+
+static void BindThreadToCPUs(const vector<int>& vCPUs)
+{
+#if defined(__linux__) && defined(CPU_SET)
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    BOOST_FOREACH(int nCPU, vCPUs)
+        CPU_SET(nCPU, &cpuset);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) != 0)
+        LogPrintf("CTaskScheduler : unable to bind worker to its NUMA node\n");
+#endif
+}
+
+void CTaskScheduler::Worker(int nWorker, vector<int> vCPUs)
+{
+    RenameThread(strprintf("bitcoin-worker%d", nWorker).c_str());
+    if (!vCPUs.empty())
+        BindThreadToCPUs(vCPUs);
+    while (true)
+    {
+        CTask task;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fStop && !PopTask(task, NULL))
+                condWork.wait(lock);
+            if (fStop)
+                return;
+        }
+        RunTask(task);
+    }
+}
+
+void CTaskScheduler::Start(int nThreadsIn, bool fAffinity)
+{
+    vector<vector<int> > vNodes;
+    if (fAffinity)
+    {
+        vNodes = GetNUMANodeCPUs();
+        if (vNodes.size() < 2)
+        {
+            LogPrintf("CTaskScheduler : a single NUMA node, workers are not bound\n");
+            vNodes.clear();
+        }
+    }
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    fStop = false;
+    for (int i = 0; i < nThreadsIn; i++)
+    {
+        vector<int> vCPUs;
+        if (!vNodes.empty())
+            vCPUs = vNodes[i % vNodes.size()];
+        threads.create_thread(boost::bind(&CTaskScheduler::Worker, this, i, vCPUs));
+    }
+    nThreads += nThreadsIn;
+    LogPrintf("CTaskScheduler : %d worker threads%s\n", nThreads,
+        vNodes.empty() ? "" : strprintf(" over %u NUMA nodes", vNodes.size()));
+}
+
+void CTaskScheduler::Stop()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+        nThreads = 0;
+        condWork.notify_all();
+    }
+    threads.join_all();
+}
+
+void CTaskScheduler::Submit(const boost::function<void()>& fn, int nPriority, const void* pOwner)
+{
+    assert(nPriority >= 0 && nPriority < NUM_TASK_PRIORITIES);
+    CTask task;
+    task.fn = fn;
+    task.pOwner = pOwner;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    queue[nPriority].push_back(task);
+    condWork.notify_one();
+}
+
+bool CTaskScheduler::RunQueued(const void* pOwner)
+{
+    CTask task;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (!PopTask(task, pOwner))
+            return false;
+    }
+    RunTask(task);
+    return true;
+}
+
+void CTaskScheduler::Cancel(const void* pOwner)
+{
+    // Called from destructors, also while an interruption unwinds the stack
+    boost::this_thread::disable_interruption di;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    for (int nPriority = 0; nPriority < NUM_TASK_PRIORITIES; nPriority++)
+    {
+        deque<CTask>& q = queue[nPriority];
+        for (deque<CTask>::iterator it = q.begin(); it != q.end(); )
+        {
+            if (it->pOwner == pOwner)
+                it = q.erase(it);
+            else
+                ++it;
+        }
+    }
+    while (mapRunning.count(pOwner))
+        condFinished.wait(lock);
+}
+
+// Parse a sysfs CPU list such as "0-7,16-23"
+static vector<int> ParseCPUList(const string& strList)
+{
+    vector<int> vCPUs;
+    vector<string> vRanges;
+    boost::split(vRanges, strList, boost::is_any_of(","));
+    BOOST_FOREACH(const string& strRange, vRanges)
+    {
+        if (strRange.empty())
+            continue;
+        size_t nDash = strRange.find('-');
+        int nFirst = atoi(strRange.substr(0, nDash).c_str());
+        int nLast = (nDash == string::npos) ? nFirst : atoi(strRange.substr(nDash + 1).c_str());
+        for (int nCPU = nFirst; nCPU <= nLast; nCPU++)
+            vCPUs.push_back(nCPU);
+    }
+    return vCPUs;
+}
+
+vector<vector<int> > GetNUMANodeCPUs()
+{
+    vector<vector<int> > vNodes;
+#ifdef __linux__
+    for (int nNode = 0; ; nNode++)
+    {
+        boost::filesystem::ifstream file(strprintf("/sys/devices/system/node/node%d/cpulist", nNode));
+        if (!file.is_open())
+            break;
+        string strList;
+        getline(file, strList);
+        vector<int> vCPUs = ParseCPUList(strList);
+        // Memory-only nodes have no CPU to bind to
+        if (!vCPUs.empty())
+            vNodes.push_back(vCPUs);
+    }
+#endif
+    return vNodes;
+}
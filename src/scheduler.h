@@ -0,0 +1,89 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SCHEDULER_H
+#define BITCOIN_SCHEDULER_H
+
+#include <deque>
+#include <map>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+/** Priorities of the tasks run by the scheduler; a worker always takes the
+ *  oldest task of the most urgent priority that has any queued */
+enum TaskPriority
+{
+    TASK_VALIDATION = 0, // loading and connecting blocks
+    TASK_RELAY,          // transactions arriving from peers
+    TASK_RPC,            // work on behalf of an RPC call
+    TASK_BACKGROUND,     // wallet loading and rescans, snapshots
+    NUM_TASK_PRIORITIES
+};
+
+/** Threads to spread work on when -schedulerthreads is not given: 0 is one per core */
+static const int DEFAULT_SCHEDULER_THREADS = 0;
+/** At most this many scheduler threads */
+static const int MAX_SCHEDULER_THREADS = 64;
+
+/** The node's shared pool of worker threads. The parallel parts of block
+ *  import, wallet rescans and loading, signing and stealth key derivation
+ *  submit tasks to it through a CWorkPool, instead of each starting threads
+ *  of their own.
+ *
+ *  Each task belongs to an owner (its CWorkPool). A thread waiting for the
+ *  tasks of an owner runs the ones no worker took yet itself, so waiting
+ *  never depends on a worker being free: tasks may wait for other tasks,
+ *  and everything still completes without any worker, as in the unit tests.
+ */
+class CTaskScheduler
+{
+private:
+    struct CTask
+    {
+        boost::function<void()> fn;
+        const void* pOwner;
+    };
+
+    boost::mutex mutex;
+    boost::condition_variable condWork;
+    boost::condition_variable condFinished;
+    std::deque<CTask> queue[NUM_TASK_PRIORITIES];
+    // Tasks of each owner being run, which Cancel waits for
+    std::map<const void*, int> mapRunning;
+    bool fStop;
+    int nThreads;
+    boost::thread_group threads;
+
+    // Take the next task, of pOwner only unless it is NULL; mutex held
+    bool PopTask(CTask& task, const void* pOwner);
+    void RunTask(const CTask& task);
+    void Worker(int nWorker, std::vector<int> vCPUs);
+
+public:
+    CTaskScheduler();
+    ~CTaskScheduler();
+
+    /** Start nThreads workers. With fAffinity, worker i is bound to the CPUs
+     *  of NUMA node i modulo the number of nodes, so a task's memory stays
+     *  near the CPU running it. */
+    void Start(int nThreadsIn, bool fAffinity);
+    /** Stop the workers once their current task is done. Tasks still queued
+     *  are left for the threads waiting for them. */
+    void Stop();
+    int GetThreadCount();
+
+    void Submit(const boost::function<void()>& fn, int nPriority, const void* pOwner);
+    /** Run one queued task of pOwner on the calling thread; false if it has none queued */
+    bool RunQueued(const void* pOwner);
+    /** Drop the queued tasks of pOwner and wait for its running ones */
+    void Cancel(const void* pOwner);
+};
+
+extern CTaskScheduler taskScheduler;
+
+/** The CPUs of each NUMA node, from sysfs on Linux; empty if unknown */
+std::vector<std::vector<int> > GetNUMANodeCPUs();
+
+#endif // BITCOIN_SCHEDULER_H
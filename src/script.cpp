@@ -13,6 +13,8 @@
 #include "uint256.h"
 #include "util.h"
 
+#include <algorithm>
+
 #include <boost/foreach.hpp>
 #include <boost/tuple/tuple.hpp>
 #include <boost/tuple/tuple_comparison.hpp>
@@ -29,7 +31,8 @@ static const CScriptNum bnOne(1);
 static const CScriptNum bnFalse(0);
 static const CScriptNum bnTrue(1);
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags,
+              const CSignatureHashCache *psighashcache = NULL);
 
 bool CastToBool(const valtype& vch)
 {
@@ -61,6 +64,92 @@ static inline void popstack(vector<valtype>& stack)
     stack.pop_back();
 }
 
+namespace {
+/** The stack of the script interpreter. It works like vector<valtype>, but
+ *  popped elements keep their buffers, and pushes reuse them: evaluating a
+ *  script then allocates only for values larger than any before.
+ */
+class CScriptStack
+{
+private:
+    // The first nSize are on the stack, the others are spare buffers
+    vector<valtype> vItems;
+    unsigned int nSize;
+
+public:
+    typedef vector<valtype>::iterator iterator;
+
+    CScriptStack() : nSize(0) {}
+
+    unsigned int size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+    iterator begin() { return vItems.begin(); }
+    iterator end() { return vItems.begin() + nSize; }
+    valtype& back() { return vItems[nSize - 1]; }
+
+    valtype& at(unsigned int i) {
+        if (i >= nSize)
+            throw runtime_error("CScriptStack::at() : out of range");
+        return vItems[i];
+    }
+
+    void push_back(const valtype& vch) {
+        if (nSize == vItems.size())
+            vItems.push_back(vch);
+        else
+            vItems[nSize].assign(vch.begin(), vch.end());
+        nSize++;
+    }
+
+    void pop_back() {
+        if (nSize == 0)
+            throw runtime_error("CScriptStack::pop_back() : stack empty");
+        nSize--;
+    }
+
+    // Erasing and inserting rotate the buffers rather than copy the values
+    void erase(iterator first, iterator last) {
+        std::rotate(first, last, end());
+        nSize -= last - first;
+    }
+
+    void erase(iterator pos) {
+        erase(pos, pos + 1);
+    }
+
+    void insert(iterator pos, const valtype& vch) {
+        unsigned int nPos = pos - begin();
+        push_back(vch);
+        std::rotate(begin() + nPos, end() - 1, end());
+    }
+
+    // Move the elements of a vector onto the (empty) stack, or back
+    void Load(vector<valtype>& vStack) {
+        vItems.swap(vStack);
+        vStack.clear();
+        nSize = vItems.size();
+    }
+
+    void Store(vector<valtype>& vStack) {
+        vItems.resize(nSize);
+        vItems.swap(vStack);
+        vItems.clear();
+        nSize = 0;
+    }
+
+    CScriptStack& operator=(const CScriptStack& other) {
+        vItems.assign(other.vItems.begin(), other.vItems.begin() + other.nSize);
+        nSize = other.nSize;
+        return *this;
+    }
+};
+}
+
+static inline void popstack(CScriptStack& stack)
+{
+    stack.pop_back();
+}
+
 
 const char* GetTxnOutputType(txnouttype t)
 {
@@ -294,7 +383,8 @@ bool IsCanonicalSignature(const valtype &vchSig, unsigned int flags) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+static bool EvalScript(CScriptStack& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType,
+                       const CSignatureHashCache *psighashcache = NULL)
 {
     CScript::const_iterator pc = script.begin();
     CScript::const_iterator pend = script.end();
@@ -302,7 +392,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
     opcodetype opcode;
     valtype vchPushValue;
     vector<bool> vfExec;
-    vector<valtype> altstack;
+    CScriptStack altstack;
     if (script.size() > 10000)
         return false;
     int nOpCount = 0;
@@ -847,7 +937,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     scriptCode.FindAndDelete(CScript(vchSig));
 
                     bool fSuccess = IsCanonicalSignature(vchSig, flags) && IsCanonicalPubKey(vchPubKey, flags) &&
-                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, psighashcache);
 
                     popstack(stack);
                     popstack(stack);
@@ -908,7 +998,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                         // Check signature
                         bool fOk = IsCanonicalSignature(vchSig, flags) && IsCanonicalPubKey(vchPubKey, flags) &&
-                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, psighashcache);
 
                         if (fOk) {
                             isig++;
@@ -958,6 +1048,15 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
     return true;
 }
 
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+{
+    CScriptStack stackEval;
+    stackEval.Load(stack);
+    bool fRet = EvalScript(stackEval, script, txTo, nIn, flags, nHashType);
+    stackEval.Store(stack);
+    return fRet;
+}
+
 
 
 
@@ -1083,6 +1182,53 @@ uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsig
     return ss.GetHash();
 }
 
+// The serialization of an input with its script blanked out: the prevout,
+// an empty script and nSequence
+static const unsigned int BLANK_INPUT_SIZE = 32 + 4 + 1 + 4;
+
+CSignatureHashCache::CSignatureHashCache(const CTransaction &txToIn) : ptxTo(&txToIn)
+{
+    const CTransaction &txTo = *ptxTo;
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txTo.nVersion;
+    ::WriteCompactSize(ss, txTo.vin.size());
+
+    CDataStream ssInputs(SER_GETHASH, 0);
+    ssInputs.reserve(txTo.vin.size() * BLANK_INPUT_SIZE);
+    vMidstates.reserve(txTo.vin.size());
+    for (unsigned int i = 0; i < txTo.vin.size(); i++) {
+        vMidstates.push_back(ss);
+        unsigned int nPos = ssInputs.size();
+        ssInputs << txTo.vin[i].prevout << CScript() << txTo.vin[i].nSequence;
+        assert(ssInputs.size() - nPos == BLANK_INPUT_SIZE);
+        ss.write(&ssInputs[nPos], BLANK_INPUT_SIZE);
+    }
+    vchInputs.assign(ssInputs.begin(), ssInputs.end());
+
+    CDataStream ssOutputs(SER_GETHASH, 0);
+    ssOutputs << txTo.vout << txTo.nLockTime;
+    vchOutputs.assign(ssOutputs.begin(), ssOutputs.end());
+}
+
+bool CSignatureHashCache::SignatureHash(const CScript &scriptCode, const CTransaction &txTo, unsigned int nIn, int nHashType, uint256 &hashRet) const
+{
+    // Only SIGHASH_ALL serializes all inputs and outputs unchanged
+    if (&txTo != ptxTo || nIn >= vMidstates.size() ||
+        (nHashType & SIGHASH_ANYONECANPAY) || (nHashType & 0x1f) == SIGHASH_NONE || (nHashType & 0x1f) == SIGHASH_SINGLE)
+        return false;
+
+    CHashWriter ss(vMidstates[nIn]);
+    CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
+    txTmp.SerializeInput(ss, nIn, SER_GETHASH, 0);
+    unsigned int nRest = (vMidstates.size() - nIn - 1) * BLANK_INPUT_SIZE;
+    if (nRest)
+        ss.write((const char*)&vchInputs[(nIn + 1) * BLANK_INPUT_SIZE], nRest);
+    ss.write((const char*)&vchOutputs[0], vchOutputs.size());
+    ss << nHashType;
+    hashRet = ss.GetHash();
+    return true;
+}
+
 
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
@@ -1091,59 +1237,142 @@ uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsig
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    // Number of independently locked parts, so script check threads
+    // rarely wait for each other
+    static const unsigned int NUM_SHARDS = 16;
+    // Memory used per entry: the key and its tree node
+    static const size_t ENTRY_USAGE = sizeof(uint256) + 4 * sizeof(void*);
+
+    struct CShard
+    {
+        boost::mutex cs;
+        std::set<uint256> setValid;
+        size_t nMaxEntries;
+        uint64_t nHits;
+        uint64_t nMisses;
+        uint64_t nEvictions;
+
+        CShard() : nMaxEntries(0), nHits(0), nMisses(0), nEvictions(0) {}
+    };
+
+    // Entries are a hash of (signature hash, public key, signature) salted
+    // with this nonce, so which entries collide in a shard or get evicted
+    // cannot be predicted by peers
+    uint256 nonce;
+    CShard shards[NUM_SHARDS];
+
+    uint256 GetEntry(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+    {
+        CHashWriter ss(SER_GETHASH, 0);
+        ss << nonce << hash << pubKey << vchSig;
+        return ss.GetHash();
+    }
+
+    CShard &GetShard(const uint256 &entry)
+    {
+        return shards[entry.GetLow64() % NUM_SHARDS];
+    }
 
 public:
+    CSignatureCache()
+    {
+        nonce = GetRandHash();
+        SetMaxSize(DEFAULT_MAX_SIG_CACHE_SIZE << 20);
+    }
+
+    void SetMaxSize(size_t nBytes)
+    {
+        // An entry per shard at least, unless the cache is disabled
+        size_t nMaxEntries = nBytes / ENTRY_USAGE / NUM_SHARDS;
+        if (nBytes > 0 && nMaxEntries == 0)
+            nMaxEntries = 1;
+        for (unsigned int i = 0; i < NUM_SHARDS; i++) {
+            CShard &shard = shards[i];
+            boost::unique_lock<boost::mutex> lock(shard.cs);
+            shard.nMaxEntries = nMaxEntries;
+            while (shard.setValid.size() > nMaxEntries) {
+                shard.setValid.erase(shard.setValid.begin());
+                shard.nEvictions++;
+            }
+        }
+    }
+
     bool
     Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
+        uint256 entry = GetEntry(hash, vchSig, pubKey);
+        CShard &shard = GetShard(entry);
+        boost::unique_lock<boost::mutex> lock(shard.cs);
+        if (shard.setValid.count(entry)) {
+            shard.nHits++;
             return true;
+        }
+        shard.nMisses++;
         return false;
     }
 
     void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+        uint256 entry = GetEntry(hash, vchSig, pubKey);
+        CShard &shard = GetShard(entry);
+        boost::unique_lock<boost::mutex> lock(shard.cs);
+        if (shard.nMaxEntries == 0)
+            return;
 
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+        while (shard.setValid.size() >= shard.nMaxEntries)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
+            // Evict the entry following the new one. The entries are
+            // salted hashes, so this is as good as a random one, which
+            // foils would-be DoS attackers who might try to pre-generate
             // and re-use a set of valid signatures just-slightly-greater
             // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            std::set<uint256>::iterator it = shard.setValid.upper_bound(entry);
+            if (it == shard.setValid.end())
+                it = shard.setValid.begin();
+            shard.setValid.erase(it);
+            shard.nEvictions++;
         }
+        shard.setValid.insert(entry);
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+    CSigCacheStats GetStats()
+    {
+        CSigCacheStats stats;
+        for (unsigned int i = 0; i < NUM_SHARDS; i++) {
+            CShard &shard = shards[i];
+            boost::unique_lock<boost::mutex> lock(shard.cs);
+            stats.nEntries += shard.setValid.size();
+            stats.nMaxEntries += shard.nMaxEntries;
+            stats.nHits += shard.nHits;
+            stats.nMisses += shard.nMisses;
+            stats.nEvictions += shard.nEvictions;
+        }
+        stats.nUsage = stats.nEntries * ENTRY_USAGE;
+        stats.nMaxUsage = stats.nMaxEntries * ENTRY_USAGE;
+        return stats;
     }
 };
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
+static CSignatureCache &GetSignatureCache()
 {
     static CSignatureCache signatureCache;
+    return signatureCache;
+}
+
+void SetSignatureCacheSize(size_t nBytes)
+{
+    GetSignatureCache().SetMaxSize(nBytes);
+}
+
+CSigCacheStats GetSignatureCacheStats()
+{
+    return GetSignatureCache().GetStats();
+}
+
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSignatureHashCache *psighashcache)
+{
+    CSignatureCache &signatureCache = GetSignatureCache();
 
     CPubKey pubkey(vchPubKey);
     if (!pubkey.IsValid())
@@ -1158,7 +1387,9 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
         return false;
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash;
+    if (!psighashcache || !psighashcache->SignatureHash(scriptCode, txTo, nIn, nHashType, sighash))
+        sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
 
     if (signatureCache.Get(sighash, vchSig, pubkey))
         return true;
@@ -1180,28 +1411,34 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
 
 
 
+static multimap<txnouttype, CScript> BuildTemplates()
+{
+    multimap<txnouttype, CScript> mTemplates;
+
+    // Standard tx, sender provides pubkey, receiver adds signature
+    mTemplates.insert(make_pair(TX_PUBKEY, CScript() << OP_PUBKEY << OP_CHECKSIG));
+
+    // Bitcoin address tx, sender provides hash of pubkey, receiver provides signature and pubkey
+    mTemplates.insert(make_pair(TX_PUBKEYHASH, CScript() << OP_DUP << OP_HASH160 << OP_PUBKEYHASH << OP_EQUALVERIFY << OP_CHECKSIG));
+
+    // Sender provides N pubkeys, receivers provides M signatures
+    mTemplates.insert(make_pair(TX_MULTISIG, CScript() << OP_SMALLINTEGER << OP_PUBKEYS << OP_SMALLINTEGER << OP_CHECKMULTISIG));
+
+    // Empty, provably prunable, data-carrying output
+    mTemplates.insert(make_pair(TX_NULL_DATA, CScript() << OP_RETURN << OP_SMALLDATA));
+    mTemplates.insert(make_pair(TX_NULL_DATA, CScript() << OP_RETURN));
+
+    return mTemplates;
+}
+
 //
 // Return public keys or hashes from scriptPubKey, for 'standard' transaction types.
 //
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, vector<vector<unsigned char> >& vSolutionsRet)
 {
-    // Templates
-    static multimap<txnouttype, CScript> mTemplates;
-    if (mTemplates.empty())
-    {
-        // Standard tx, sender provides pubkey, receiver adds signature
-        mTemplates.insert(make_pair(TX_PUBKEY, CScript() << OP_PUBKEY << OP_CHECKSIG));
-
-        // Bitcoin address tx, sender provides hash of pubkey, receiver provides signature and pubkey
-        mTemplates.insert(make_pair(TX_PUBKEYHASH, CScript() << OP_DUP << OP_HASH160 << OP_PUBKEYHASH << OP_EQUALVERIFY << OP_CHECKSIG));
-
-        // Sender provides N pubkeys, receivers provides M signatures
-        mTemplates.insert(make_pair(TX_MULTISIG, CScript() << OP_SMALLINTEGER << OP_PUBKEYS << OP_SMALLINTEGER << OP_CHECKMULTISIG));
-
-        // Empty, provably prunable, data-carrying output
-        mTemplates.insert(make_pair(TX_NULL_DATA, CScript() << OP_RETURN << OP_SMALLDATA));
-        mTemplates.insert(make_pair(TX_NULL_DATA, CScript() << OP_RETURN));
-    }
+    // Templates, built on first use; the initialization of a local static
+    // is thread-safe, and script checks run Solver on several threads.
+    static const multimap<txnouttype, CScript> mTemplates = BuildTemplates();
 
     // Shortcut for pay-to-script-hash, which are more constrained than the other types:
     // it is always OP_HASH160 20 [20 byte hash] OP_EQUAL
@@ -1405,7 +1642,11 @@ bool IsStandard(const CScript& scriptPubKey, txnouttype& whichType)
     vector<valtype> vSolutions;
     if (!Solver(scriptPubKey, whichType, vSolutions))
         return false;
+    return IsStandard(whichType, vSolutions);
+}
 
+bool IsStandard(txnouttype whichType, const vector<valtype>& vSolutions)
+{
     if (whichType == TX_MULTISIG)
     {
         unsigned char m = vSolutions.front()[0];
@@ -1453,6 +1694,23 @@ bool IsMine(const CKeyStore &keystore, const CTxDestination &dest)
 
 bool IsMine(const CKeyStore &keystore, const CScript& scriptPubKey)
 {
+    // Nearly all outputs are one of these two, whose hash can be read off
+    // without the template matching of Solver
+    uint160 hash;
+    if (scriptPubKey.IsPayToPubKeyHash())
+    {
+        memcpy(hash.begin(), &scriptPubKey[3], 20);
+        return keystore.HaveKey(CKeyID(hash));
+    }
+    if (scriptPubKey.IsPayToScriptHash())
+    {
+        memcpy(hash.begin(), &scriptPubKey[2], 20);
+        CScript subscript;
+        if (!keystore.GetCScript(CScriptID(hash), subscript))
+            return false;
+        return IsMine(keystore, subscript);
+    }
+
     vector<valtype> vSolutions;
     txnouttype whichType;
     if (!Solver(scriptPubKey, whichType, vSolutions))
@@ -1590,15 +1848,165 @@ void ExtractAffectedKeys(const CKeyStore &keystore, const CScript& scriptPubKey,
     CAffectedKeysVisitor(keystore, vKeys).Process(scriptPubKey);
 }
 
+// Stacks deeper than this are left to the interpreter, which enforces the
+// limit on the stack size along the way.
+static const unsigned int MAX_TEMPLATE_STACK_SIZE = 100;
+
+// Evaluate a standard script (as recognized by Solver) without the
+// interpreter: returns false if script is not one, and otherwise sets
+// fResult to what EvalScript would have returned, leaving the same on
+// the stack if that is true.
+static bool EvalTemplate(CScriptStack& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn,
+                         unsigned int flags, int nHashType, const CSignatureHashCache *psighashcache, bool& fResult)
+{
+    if (stack.size() > MAX_TEMPLATE_STACK_SIZE)
+        return false;
+
+    txnouttype whichType;
+    vector<valtype> vSolutions;
+    if (script.size() == 25 && script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 20 &&
+        script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG)
+    {
+        // The usual encoding of pay-to-pubkey-hash, without the template scan
+        whichType = TX_PUBKEYHASH;
+        vSolutions.push_back(valtype(script.begin() + 3, script.begin() + 23));
+    }
+    else if (!Solver(script, whichType, vSolutions))
+        return false;
+
+    fResult = false;
+    switch (whichType)
+    {
+    case TX_PUBKEYHASH:
+    {
+        // <sig> <pubkey> -- OP_DUP OP_HASH160 <hash> OP_EQUALVERIFY OP_CHECKSIG
+        if (stack.size() < 2)
+            return true;
+        uint160 hash160 = Hash160(stack.at(stack.size() - 1));
+        if (memcmp(&hash160, &vSolutions[0][0], sizeof(hash160)) != 0)
+            return true;
+        valtype& vchSig    = stack.at(stack.size() - 2);
+        valtype& vchPubKey = stack.at(stack.size() - 1);
+        CScript scriptCode(script);
+        scriptCode.FindAndDelete(CScript(vchSig));
+        bool fSuccess = IsCanonicalSignature(vchSig, flags) && IsCanonicalPubKey(vchPubKey, flags) &&
+            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, psighashcache);
+        popstack(stack);
+        popstack(stack);
+        stack.push_back(fSuccess ? vchTrue : vchFalse);
+        fResult = true;
+        return true;
+    }
+
+    case TX_SCRIPTHASH:
+    {
+        // <script> -- OP_HASH160 <hash> OP_EQUAL
+        if (stack.empty())
+            return true;
+        uint160 hash160 = Hash160(stack.back());
+        bool fEqual = memcmp(&hash160, &vSolutions[0][0], sizeof(hash160)) == 0;
+        popstack(stack);
+        stack.push_back(fEqual ? vchTrue : vchFalse);
+        fResult = true;
+        return true;
+    }
+
+    case TX_PUBKEY:
+    {
+        // <sig> -- <pubkey> OP_CHECKSIG
+        if (stack.empty())
+            return true;
+        valtype& vchSig = stack.back();
+        const valtype& vchPubKey = vSolutions[0];
+        CScript scriptCode(script);
+        scriptCode.FindAndDelete(CScript(vchSig));
+        bool fSuccess = IsCanonicalSignature(vchSig, flags) && IsCanonicalPubKey(vchPubKey, flags) &&
+            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, psighashcache);
+        popstack(stack);
+        stack.push_back(fSuccess ? vchTrue : vchFalse);
+        fResult = true;
+        return true;
+    }
+
+    case TX_MULTISIG:
+    {
+        // <dummy> <sig>... -- m <pubkey>... n OP_CHECKMULTISIG
+        // Like the interpreter, match the signatures from the top of the
+        // stack with the keys from the last one.
+        int nSigsCount = vSolutions.front()[0];
+        int nKeysCount = vSolutions.back()[0];
+        if ((int)stack.size() < nSigsCount + 1)
+            return true;
+
+        CScript scriptCode(script);
+        for (int k = 0; k < nSigsCount; k++)
+            scriptCode.FindAndDelete(CScript(stack.at(stack.size() - 1 - k)));
+
+        int isig = stack.size() - 1;
+        int ikey = nKeysCount;
+        bool fSuccess = true;
+        while (fSuccess && nSigsCount > 0)
+        {
+            valtype& vchSig          = stack.at(isig);
+            const valtype& vchPubKey = vSolutions[ikey];
+
+            bool fOk = IsCanonicalSignature(vchSig, flags) && IsCanonicalPubKey(vchPubKey, flags) &&
+                CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, psighashcache);
+
+            if (fOk) {
+                isig--;
+                nSigsCount--;
+            }
+            ikey--;
+            nKeysCount--;
+
+            if (nSigsCount > nKeysCount)
+                fSuccess = false;
+        }
+
+        for (int i = vSolutions.front()[0] + 1; i > 0; i--)
+            popstack(stack);
+        stack.push_back(fSuccess ? vchTrue : vchFalse);
+        fResult = true;
+        return true;
+    }
+
+    case TX_NULL_DATA:
+        // OP_RETURN
+        return true;
+
+    case TX_NONSTANDARD:
+        break;
+    }
+    return false;
+}
+
+// EvalScript, with the fast path for standard scripts
+static bool EvalScriptFast(CScriptStack& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn,
+                           unsigned int flags, int nHashType, const CSignatureHashCache *psighashcache)
+{
+    bool fResult;
+    try
+    {
+        if (EvalTemplate(stack, script, txTo, nIn, flags, nHashType, psighashcache, fResult))
+            return fResult;
+    }
+    catch (...)
+    {
+        return false;
+    }
+    return EvalScript(stack, script, txTo, nIn, flags, nHashType, psighashcache);
+}
+
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  unsigned int flags, int nHashType)
+                  unsigned int flags, int nHashType, const CSignatureHashCache *psighashcache)
 {
-    vector<vector<unsigned char> > stack, stackCopy;
+    CScriptStack stack, stackCopy;
     if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType))
         return false;
     if (flags & SCRIPT_VERIFY_P2SH)
         stackCopy = stack;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+    if (!EvalScriptFast(stack, scriptPubKey, txTo, nIn, flags, nHashType, psighashcache))
         return false;
     if (stack.empty())
         return false;
@@ -1621,7 +2029,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType))
+        if (!EvalScriptFast(stackCopy, pubKey2, txTo, nIn, flags, nHashType, psighashcache))
             return false;
         if (stackCopy.empty())
             return false;
@@ -1632,17 +2040,19 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
 }
 
 
-bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, const CTransaction& txTo, unsigned int nIn, CScript& scriptSigRet,
+                   int nHashType, const CSignatureHashCache *psighashcache)
 {
     assert(nIn < txTo.vin.size());
-    CTxIn& txin = txTo.vin[nIn];
 
     // Leave out the signature from the hash, since a signature can't sign itself.
     // The checksig op will also drop the signatures from its hash.
-    uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
+    uint256 hash;
+    if (!psighashcache || !psighashcache->SignatureHash(fromPubKey, txTo, nIn, nHashType, hash))
+        hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
 
     txnouttype whichType;
-    if (!Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType))
+    if (!Solver(keystore, fromPubKey, hash, nHashType, scriptSigRet, whichType))
         return false;
 
     if (whichType == TX_SCRIPTHASH)
@@ -1650,24 +2060,33 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
         // Solver returns the subscript that need to be evaluated;
         // the final scriptSig is the signatures from that
         // and then the serialized subscript:
-        CScript subscript = txin.scriptSig;
+        CScript subscript = scriptSigRet;
 
         // Recompute txn hash using subscript in place of scriptPubKey:
-        uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType);
+        uint256 hash2;
+        if (!psighashcache || !psighashcache->SignatureHash(subscript, txTo, nIn, nHashType, hash2))
+            hash2 = SignatureHash(subscript, txTo, nIn, nHashType);
 
         txnouttype subType;
         bool fSolved =
-            Solver(keystore, subscript, hash2, nHashType, txin.scriptSig, subType) && subType != TX_SCRIPTHASH;
+            Solver(keystore, subscript, hash2, nHashType, scriptSigRet, subType) && subType != TX_SCRIPTHASH;
         // Append serialized subscript whether or not it is completely signed:
-        txin.scriptSig << static_cast<valtype>(subscript);
+        scriptSigRet << valtype(subscript.begin(), subscript.end());
         if (!fSolved) return false;
     }
 
     // Test solution
-    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, 0);
+    return VerifyScript(scriptSigRet, fromPubKey, txTo, nIn, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, 0, psighashcache);
 }
 
-bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CMutableTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    assert(nIn < txTo.vin.size());
+    CTransaction txToConst(txTo);
+    return SignSignature(keystore, fromPubKey, txToConst, nIn, txTo.vin[nIn].scriptSig, nHashType);
+}
+
+bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CMutableTransaction& txTo, unsigned int nIn, int nHashType)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
@@ -1852,9 +2271,20 @@ bool CScript::IsPayToScriptHash() const
 {
     // Extra-fast test for pay-to-script-hash CScripts:
     return (this->size() == 23 &&
-            this->at(0) == OP_HASH160 &&
-            this->at(1) == 0x14 &&
-            this->at(22) == OP_EQUAL);
+            (*this)[0] == OP_HASH160 &&
+            (*this)[1] == 0x14 &&
+            (*this)[22] == OP_EQUAL);
+}
+
+bool CScript::IsPayToPubKeyHash() const
+{
+    // Extra-fast test for pay-to-pubkey-hash CScripts:
+    return (this->size() == 25 &&
+            (*this)[0] == OP_DUP &&
+            (*this)[1] == OP_HASH160 &&
+            (*this)[2] == 0x14 &&
+            (*this)[23] == OP_EQUALVERIFY &&
+            (*this)[24] == OP_CHECKSIG);
 }
 
 bool CScript::IsPushOnly() const
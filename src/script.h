@@ -18,13 +18,16 @@
 #include <boost/foreach.hpp>
 #include <boost/variant.hpp>
 
-class CCoins;
 class CKeyStore;
 class CTransaction;
+struct CMutableTransaction;
 
 static const unsigned int MAX_SCRIPT_ELEMENT_SIZE = 520; // bytes
 static const unsigned int MAX_OP_RETURN_RELAY = 1024;      // bytes
 
+// -maxsigcachesize default: memory for the signature cache (MiB)
+static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 32;
+
 class scriptnum_error : public std::runtime_error
 {
 public:
@@ -398,8 +401,18 @@ inline std::string StackString(const std::vector<std::vector<unsigned char> >& v
 
 
 
-/** Serialized script, used inside transaction inputs and outputs */
-class CScript : public std::vector<unsigned char>
+// The bytes of a script or of anything else with begin() and end(), such as
+// for pushing a script onto another as data
+template<typename T>
+std::vector<unsigned char> ToByteVector(const T& in)
+{
+    return std::vector<unsigned char>(in.begin(), in.end());
+}
+
+/** Serialized script, used inside transaction inputs and outputs.
+ *  Scripts of up to 28 bytes, such as pay-to-pubkey-hash and
+ *  pay-to-script-hash outputs, are stored without allocating memory. */
+class CScript : public CScriptBase
 {
 protected:
     CScript& push_int64(int64_t n)
@@ -416,11 +429,9 @@ protected:
     }
 public:
     CScript() { }
-    CScript(const CScript& b) : std::vector<unsigned char>(b.begin(), b.end()) { }
-    CScript(const_iterator pbegin, const_iterator pend) : std::vector<unsigned char>(pbegin, pend) { }
-#ifndef _MSC_VER
-    CScript(const unsigned char* pbegin, const unsigned char* pend) : std::vector<unsigned char>(pbegin, pend) { }
-#endif
+    CScript(const CScript& b) : CScriptBase(b) { }
+    CScript(const_iterator pbegin, const_iterator pend) : CScriptBase(pbegin, pend) { }
+    CScript(std::vector<unsigned char>::const_iterator pbegin, std::vector<unsigned char>::const_iterator pend) : CScriptBase(pbegin, pend) { }
 
     CScript& operator+=(const CScript& b)
     {
@@ -654,6 +665,7 @@ public:
     unsigned int GetSigOpCount(const CScript& scriptSig) const;
 
     bool IsPayToScriptHash() const;
+    bool IsPayToPubKeyHash() const;
 
     // Called by IsStandardTx and P2SH VerifyScript (which makes it consensus-critical).
     bool IsPushOnly() const;
@@ -709,7 +721,7 @@ public:
 
     CScriptID GetID() const
     {
-        return CScriptID(Hash160(*this));
+        return CScriptID(Hash160(begin(), end()));
     }
 };
 
@@ -793,14 +805,65 @@ bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript&
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey, txnouttype& whichType);
+// The same, for a script Solver already returned whichType and vSolutions for
+bool IsStandard(txnouttype whichType, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsMine(const CKeyStore& keystore, const CScript& scriptPubKey);
 bool IsMine(const CKeyStore& keystore, const CTxDestination &dest);
 void ExtractAffectedKeys(const CKeyStore &keystore, const CScript& scriptPubKey, std::vector<CKeyID> &vKeys);
 bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet);
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
-bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+
+/** The parts of the SIGHASH_ALL signature hash of a transaction that do not
+ *  depend on the input being signed: the hash state before each input, the
+ *  inputs with their scripts blanked out, and the outputs. With it, checking
+ *  the inputs serializes the transaction once, instead of once per input.
+ */
+class CSignatureHashCache
+{
+private:
+    const CTransaction *ptxTo;
+    std::vector<CHashWriter> vMidstates;      // after the inputs before each one
+    std::vector<unsigned char> vchInputs;     // all inputs, blanked
+    std::vector<unsigned char> vchOutputs;    // the outputs and nLockTime
+
+public:
+    CSignatureHashCache(const CTransaction &txToIn);
+
+    // Compute the signature hash of input nIn of txTo, if the cache applies
+    // to txTo and nHashType
+    bool SignatureHash(const CScript &scriptCode, const CTransaction &txTo, unsigned int nIn, int nHashType, uint256 &hashRet) const;
+};
+
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType,
+                  const CSignatureHashCache *psighashcache = NULL);
+// Transactions with at least this many inputs are signed by several threads
+static const unsigned int PARALLEL_SIGN_MIN_INPUTS = 16;
+// Sign input nIn of txTo, which is left unchanged, into scriptSigRet. The
+// signature hashes leave out all scriptSigs, so the inputs of one transaction
+// may be signed from several threads at once against the same unsigned txTo,
+// sharing one cache built from it
+bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, const CTransaction& txTo, unsigned int nIn, CScript& scriptSigRet,
+                   int nHashType=SIGHASH_ALL, const CSignatureHashCache *psighashcache = NULL);
+bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CMutableTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
+bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CMutableTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
+
+/** Statistics of the signature cache, for getsigcacheinfo */
+struct CSigCacheStats
+{
+    uint64_t nEntries;
+    uint64_t nMaxEntries;
+    uint64_t nUsage;    // bytes
+    uint64_t nMaxUsage; // bytes
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nEvictions;
+
+    CSigCacheStats() : nEntries(0), nMaxEntries(0), nUsage(0), nMaxUsage(0), nHits(0), nMisses(0), nEvictions(0) {}
+};
+
+// Limit the memory used by the signature cache, 0 disables it
+void SetSignatureCacheSize(size_t nBytes);
+CSigCacheStats GetSignatureCacheStats();
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
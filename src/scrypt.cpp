@@ -321,3 +321,206 @@ void scrypt_1024_1_1_256(const char *input, char *output)
         scrypt_1024_1_1_256_sp_generic(input, output, scratchpad);
 #endif
 }
+
+/*
+ * N-way scrypt: nWays independent hashes run side by side, one per 32-bit
+ * vector lane. X[k] holds word k of every lane's state, and the scratchpad
+ * stores 1024 such interleaved 32-vector rows, so the sequential-write loop
+ * is plain vector stores and only the data-dependent reads go lane by lane.
+ */
+#if defined(__GNUC__)
+typedef uint32_t scrypt_v4 __attribute__((vector_size(16)));
+#if defined(__x86_64__) || defined(__i386__)
+#define SCRYPT_AVX2 1
+typedef uint32_t scrypt_v8 __attribute__((vector_size(32)));
+#endif
+
+#define VROTL(a, b) (((a) << (b)) | ((a) >> (32 - (b))))
+
+template<typename V>
+static inline __attribute__((always_inline)) void xor_salsa8_nway(V B[16], const V Bx[16])
+{
+	V x00,x01,x02,x03,x04,x05,x06,x07,x08,x09,x10,x11,x12,x13,x14,x15;
+	int i;
+
+	x00 = (B[ 0] ^= Bx[ 0]);
+	x01 = (B[ 1] ^= Bx[ 1]);
+	x02 = (B[ 2] ^= Bx[ 2]);
+	x03 = (B[ 3] ^= Bx[ 3]);
+	x04 = (B[ 4] ^= Bx[ 4]);
+	x05 = (B[ 5] ^= Bx[ 5]);
+	x06 = (B[ 6] ^= Bx[ 6]);
+	x07 = (B[ 7] ^= Bx[ 7]);
+	x08 = (B[ 8] ^= Bx[ 8]);
+	x09 = (B[ 9] ^= Bx[ 9]);
+	x10 = (B[10] ^= Bx[10]);
+	x11 = (B[11] ^= Bx[11]);
+	x12 = (B[12] ^= Bx[12]);
+	x13 = (B[13] ^= Bx[13]);
+	x14 = (B[14] ^= Bx[14]);
+	x15 = (B[15] ^= Bx[15]);
+	for (i = 0; i < 8; i += 2) {
+		/* Operate on columns. */
+		x04 ^= VROTL(x00 + x12,  7);  x09 ^= VROTL(x05 + x01,  7);
+		x14 ^= VROTL(x10 + x06,  7);  x03 ^= VROTL(x15 + x11,  7);
+
+		x08 ^= VROTL(x04 + x00,  9);  x13 ^= VROTL(x09 + x05,  9);
+		x02 ^= VROTL(x14 + x10,  9);  x07 ^= VROTL(x03 + x15,  9);
+
+		x12 ^= VROTL(x08 + x04, 13);  x01 ^= VROTL(x13 + x09, 13);
+		x06 ^= VROTL(x02 + x14, 13);  x11 ^= VROTL(x07 + x03, 13);
+
+		x00 ^= VROTL(x12 + x08, 18);  x05 ^= VROTL(x01 + x13, 18);
+		x10 ^= VROTL(x06 + x02, 18);  x15 ^= VROTL(x11 + x07, 18);
+
+		/* Operate on rows. */
+		x01 ^= VROTL(x00 + x03,  7);  x06 ^= VROTL(x05 + x04,  7);
+		x11 ^= VROTL(x10 + x09,  7);  x12 ^= VROTL(x15 + x14,  7);
+
+		x02 ^= VROTL(x01 + x00,  9);  x07 ^= VROTL(x06 + x05,  9);
+		x08 ^= VROTL(x11 + x10,  9);  x13 ^= VROTL(x12 + x15,  9);
+
+		x03 ^= VROTL(x02 + x01, 13);  x04 ^= VROTL(x07 + x06, 13);
+		x09 ^= VROTL(x08 + x11, 13);  x14 ^= VROTL(x13 + x12, 13);
+
+		x00 ^= VROTL(x03 + x02, 18);  x05 ^= VROTL(x04 + x07, 18);
+		x10 ^= VROTL(x09 + x08, 18);  x15 ^= VROTL(x14 + x13, 18);
+	}
+	B[ 0] += x00;
+	B[ 1] += x01;
+	B[ 2] += x02;
+	B[ 3] += x03;
+	B[ 4] += x04;
+	B[ 5] += x05;
+	B[ 6] += x06;
+	B[ 7] += x07;
+	B[ 8] += x08;
+	B[ 9] += x09;
+	B[10] += x10;
+	B[11] += x11;
+	B[12] += x12;
+	B[13] += x13;
+	B[14] += x14;
+	B[15] += x15;
+}
+
+template<typename V, int N>
+static inline __attribute__((always_inline)) void scrypt_core_nway(V X[32], V *Vp)
+{
+	uint32_t i, k;
+	int l;
+
+	for (i = 0; i < 1024; i++) {
+		memcpy(&Vp[i * 32], X, 32 * sizeof(V));
+		xor_salsa8_nway<V>(&X[0], &X[16]);
+		xor_salsa8_nway<V>(&X[16], &X[0]);
+	}
+	for (i = 0; i < 1024; i++) {
+		const uint32_t *row[N];
+		for (l = 0; l < N; l++)
+			row[l] = (const uint32_t *)&Vp[32 * (X[16][l] & 1023)] + l;
+		for (k = 0; k < 32; k++) {
+			V t;
+			for (l = 0; l < N; l++)
+				t[l] = row[l][k * N];
+			X[k] ^= t;
+		}
+		xor_salsa8_nway<V>(&X[0], &X[16]);
+		xor_salsa8_nway<V>(&X[16], &X[0]);
+	}
+}
+
+static void scrypt_core_4way(scrypt_v4 X[32], scrypt_v4 *V)
+{
+	scrypt_core_nway<scrypt_v4, 4>(X, V);
+}
+
+#if defined(SCRYPT_AVX2)
+__attribute__((target("avx2"))) static void scrypt_core_8way(scrypt_v8 X[32], scrypt_v8 *V)
+{
+	scrypt_core_nway<scrypt_v8, 8>(X, V);
+}
+#endif
+
+template<typename V, int N>
+static void scrypt_1024_1_1_256_sp_nway(const char *input, char *output, char *scratchpad, void (*core)(V *, V *))
+{
+	uint8_t B[N][128];
+	V X[32];
+	V *Vp;
+	int l, k;
+
+	Vp = (V *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+
+	for (l = 0; l < N; l++)
+		PBKDF2_SHA256((const uint8_t *)input + 80 * l, 80, (const uint8_t *)input + 80 * l, 80, 1, B[l], 128);
+	for (k = 0; k < 32; k++)
+		for (l = 0; l < N; l++)
+			X[k][l] = le32dec(&B[l][4 * k]);
+
+	core(X, Vp);
+
+	for (k = 0; k < 32; k++)
+		for (l = 0; l < N; l++)
+			le32enc(&B[l][4 * k], X[k][l]);
+	for (l = 0; l < N; l++)
+		PBKDF2_SHA256((const uint8_t *)input + 80 * l, 80, B[l], 128, 1, (uint8_t *)output + 32 * l, 32);
+}
+#endif
+
+int scrypt_best_ways()
+{
+#if defined(SCRYPT_AVX2)
+	static int nWays = CPUHasAVX2() ? 8 : 4;
+	return nWays;
+#elif defined(__GNUC__)
+	return 4;
+#else
+	return 1;
+#endif
+}
+
+void scrypt_1024_1_1_256_sp_multi(int nWays, const char *input, char *output, char *scratchpad)
+{
+#if defined(__GNUC__)
+#if defined(SCRYPT_AVX2)
+	if (nWays >= 8 && scrypt_best_ways() >= 8) {
+		for (; nWays >= 8; nWays -= 8, input += 8 * 80, output += 8 * 32)
+			scrypt_1024_1_1_256_sp_nway<scrypt_v8, 8>(input, output, scratchpad, &scrypt_core_8way);
+	}
+#endif
+	for (; nWays >= 4; nWays -= 4, input += 4 * 80, output += 4 * 32)
+		scrypt_1024_1_1_256_sp_nway<scrypt_v4, 4>(input, output, scratchpad, &scrypt_core_4way);
+#endif
+	for (; nWays > 0; nWays--, input += 80, output += 32)
+		scrypt_1024_1_1_256_sp_generic(input, output, scratchpad);
+}
+
+char *scrypt_buffer_alloc(int nWays)
+{
+	size_t nSize = scrypt_scratchpad_size(nWays);
+	void *p;
+#ifdef WIN32
+	p = VirtualAlloc(NULL, nSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+	/* Whole, aligned 2MB units so transparent huge pages can back the buffer */
+	static const size_t nHugePage = 2 * 1024 * 1024;
+	nSize = (nSize + nHugePage - 1) & ~(nHugePage - 1);
+	if (posix_memalign(&p, nHugePage, nSize) != 0)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	madvise(p, nSize, MADV_HUGEPAGE);
+#endif
+#endif
+	return (char *)p;
+}
+
+void scrypt_buffer_free(char *scratchpad)
+{
+#ifdef WIN32
+	if (scratchpad != NULL)
+		VirtualFree(scratchpad, 0, MEM_RELEASE);
+#else
+	free(scratchpad);
+#endif
+}
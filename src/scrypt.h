@@ -7,6 +7,20 @@ static const int SCRYPT_SCRATCHPAD_SIZE = 131072 + 63;
 void scrypt_1024_1_1_256(const char *input, char *output);
 void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scratchpad);
 
+/** Scratchpad bytes for nWays hashes run side by side, including alignment slack */
+static inline size_t scrypt_scratchpad_size(int nWays)
+{
+    return 131072 * (size_t)nWays + 63;
+}
+/** Widest set of interleaved hashes this CPU runs in one pass (8 with AVX2, 4 with SSE2/NEON, else 1) */
+int scrypt_best_ways();
+/** Hash nWays consecutive 80-byte inputs into nWays consecutive 32-byte outputs;
+ *  scratchpad must hold scrypt_scratchpad_size(nWays) bytes */
+void scrypt_1024_1_1_256_sp_multi(int nWays, const char *input, char *output, char *scratchpad);
+/** Page-aligned scratchpad for nWays lanes, backed by huge pages where the OS allows */
+char *scrypt_buffer_alloc(int nWays);
+void scrypt_buffer_free(char *scratchpad);
+
 #if defined(USE_SSE2)
 extern void scrypt_detect_sse2(unsigned int cpuid_edx);
 void scrypt_1024_1_1_256_sp_sse2(const char *input, char *output, char *scratchpad);
@@ -0,0 +1,513 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "sha256.h"
+
+#include "util.h"
+
+#include <string.h>
+
+#include <openssl/sha.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_SHA256_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+typedef void (*SHA256TransformFunc)(uint32_t* s, const unsigned char* chunk, size_t nBlocks);
+
+static const uint32_t nSHA256IV[8] =
+{
+    0x6a09e667ul, 0xbb67ae85ul, 0x3c6ef372ul, 0xa54ff53aul, 0x510e527ful, 0x9b05688cul, 0x1f83d9abul, 0x5be0cd19ul
+};
+
+static const uint32_t nSHA256K[64] =
+{
+    0x428a2f98ul, 0x71374491ul, 0xb5c0fbcful, 0xe9b5dba5ul, 0x3956c25bul, 0x59f111f1ul, 0x923f82a4ul, 0xab1c5ed5ul,
+    0xd807aa98ul, 0x12835b01ul, 0x243185beul, 0x550c7dc3ul, 0x72be5d74ul, 0x80deb1feul, 0x9bdc06a7ul, 0xc19bf174ul,
+    0xe49b69c1ul, 0xefbe4786ul, 0x0fc19dc6ul, 0x240ca1ccul, 0x2de92c6ful, 0x4a7484aaul, 0x5cb0a9dcul, 0x76f988daul,
+    0x983e5152ul, 0xa831c66dul, 0xb00327c8ul, 0xbf597fc7ul, 0xc6e00bf3ul, 0xd5a79147ul, 0x06ca6351ul, 0x14292967ul,
+    0x27b70a85ul, 0x2e1b2138ul, 0x4d2c6dfcul, 0x53380d13ul, 0x650a7354ul, 0x766a0abbul, 0x81c2c92eul, 0x92722c85ul,
+    0xa2bfe8a1ul, 0xa81a664bul, 0xc24b8b70ul, 0xc76c51a3ul, 0xd192e819ul, 0xd6990624ul, 0xf40e3585ul, 0x106aa070ul,
+    0x19a4c116ul, 0x1e376c08ul, 0x2748774cul, 0x34b0bcb5ul, 0x391c0cb3ul, 0x4ed8aa4aul, 0x5b9cca4ful, 0x682e6ff3ul,
+    0x748f82eeul, 0x78a5636ful, 0x84c87814ul, 0x8cc70208ul, 0x90befffaul, 0xa4506cebul, 0xbef9a3f7ul, 0xc67178f2ul
+};
+
+static inline uint32_t ReadBE32(const unsigned char* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void WriteBE32(unsigned char* p, uint32_t x)
+{
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+// The same expressions serve the scalar words and the GCC vectors of the multi-way paths
+#define SHA256_ROTR(x, n)   (((x) >> (n)) | ((x) << (32 - (n))))
+#define SHA256_SUM0(x)      (SHA256_ROTR(x, 2) ^ SHA256_ROTR(x, 13) ^ SHA256_ROTR(x, 22))
+#define SHA256_SUM1(x)      (SHA256_ROTR(x, 6) ^ SHA256_ROTR(x, 11) ^ SHA256_ROTR(x, 25))
+#define SHA256_SIG0(x)      (SHA256_ROTR(x, 7) ^ SHA256_ROTR(x, 18) ^ ((x) >> 3))
+#define SHA256_SIG1(x)      (SHA256_ROTR(x, 17) ^ SHA256_ROTR(x, 19) ^ ((x) >> 10))
+#define SHA256_CH(x, y, z)  ((z) ^ ((x) & ((y) ^ (z))))
+#define SHA256_MAJ(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+
+// One round on the working variables a..h, with k the round constant plus message word
+#define SHA256_ROUND(a, b, c, d, e, f, g, h, k) do { \
+    h += SHA256_SUM1(e) + SHA256_CH(e, f, g) + (k); \
+    d += h; \
+    h += SHA256_SUM0(a) + SHA256_MAJ(a, b, c); \
+} while (0)
+
+// Eight rounds starting at round i; the variables rotate instead of being moved
+#define SHA256_ROUNDS8(v, w, K, i) do { \
+    SHA256_ROUND(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], K((i) + 0) + w[((i) + 0) & 15]); \
+    SHA256_ROUND(v[7], v[0], v[1], v[2], v[3], v[4], v[5], v[6], K((i) + 1) + w[((i) + 1) & 15]); \
+    SHA256_ROUND(v[6], v[7], v[0], v[1], v[2], v[3], v[4], v[5], K((i) + 2) + w[((i) + 2) & 15]); \
+    SHA256_ROUND(v[5], v[6], v[7], v[0], v[1], v[2], v[3], v[4], K((i) + 3) + w[((i) + 3) & 15]); \
+    SHA256_ROUND(v[4], v[5], v[6], v[7], v[0], v[1], v[2], v[3], K((i) + 4) + w[((i) + 4) & 15]); \
+    SHA256_ROUND(v[3], v[4], v[5], v[6], v[7], v[0], v[1], v[2], K((i) + 5) + w[((i) + 5) & 15]); \
+    SHA256_ROUND(v[2], v[3], v[4], v[5], v[6], v[7], v[0], v[1], K((i) + 6) + w[((i) + 6) & 15]); \
+    SHA256_ROUND(v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[0], K((i) + 7) + w[((i) + 7) & 15]); \
+} while (0)
+
+// Extend the message schedule by the sixteen words used from round i on
+#define SHA256_EXPAND16(w) do { \
+    for (int j = 0; j < 16; j++) \
+        w[j] += SHA256_SIG1(w[(j + 14) & 15]) + w[(j + 9) & 15] + SHA256_SIG0(w[(j + 1) & 15]); \
+} while (0)
+
+// The 64 rounds on state s with the message words in w (which they consume)
+#define SHA256_COMPRESS(V, s, w, K) do { \
+    V v[8]; \
+    for (int j = 0; j < 8; j++) \
+        v[j] = s[j]; \
+    for (int i = 0; i < 64; i += 16) { \
+        if (i > 0) \
+            SHA256_EXPAND16(w); \
+        SHA256_ROUNDS8(v, w, K, i); \
+        SHA256_ROUNDS8(v, w, K, i + 8); \
+    } \
+    for (int j = 0; j < 8; j++) \
+        s[j] += v[j]; \
+} while (0)
+
+#define SHA256_K1(i) nSHA256K[i]
+
+/** Portable compression function; the reference the other engines are tested against */
+static void SHA256Transform_reference(uint32_t* s, const unsigned char* chunk, size_t nBlocks)
+{
+    for (; nBlocks > 0; nBlocks--, chunk += 64)
+    {
+        uint32_t w[16];
+        for (int j = 0; j < 16; j++)
+            w[j] = ReadBE32(chunk + 4 * j);
+        SHA256_COMPRESS(uint32_t, s, w, SHA256_K1);
+    }
+}
+
+/** OpenSSL's compression function, which has assembly for most CPUs */
+static void SHA256Transform_generic(uint32_t* s, const unsigned char* chunk, size_t nBlocks)
+{
+    SHA256_CTX ctx;
+    for (int j = 0; j < 8; j++)
+        ctx.h[j] = s[j];
+    for (; nBlocks > 0; nBlocks--, chunk += 64)
+        SHA256_Transform(&ctx, chunk);
+    for (int j = 0; j < 8; j++)
+        s[j] = ctx.h[j];
+}
+
+// The padding block of a 64-byte message, and the 32-byte hash plus padding
+// that the second SHA-256 of a double hash compresses
+static const unsigned char pchPad64[64] = { 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0 };
+
+/** Double SHA-256 of one 64-byte input with the given compression function */
+static void SHA256D64_1way(SHA256TransformFunc transform, unsigned char* pout, const unsigned char* pin)
+{
+    uint32_t s[8];
+    unsigned char buf[64];
+    memcpy(s, nSHA256IV, sizeof(s));
+    transform(s, pin, 1);
+    transform(s, pchPad64, 1);
+    for (int j = 0; j < 8; j++)
+        WriteBE32(buf + 4 * j, s[j]);
+    memset(buf + 32, 0, 32);
+    buf[32] = 0x80;
+    buf[62] = 1; // 256 bits
+    memcpy(s, nSHA256IV, sizeof(s));
+    transform(s, buf, 1);
+    for (int j = 0; j < 8; j++)
+        WriteBE32(pout + 4 * j, s[j]);
+}
+
+#ifdef USE_SHA256_X86
+//
+// Multi-way double SHA-256 of 64-byte inputs: each vector element carries the
+// same state word of a different input. Merkle tree levels and other batches
+// of hash pairs go through these.
+//
+#define SHA256_SSE41 __attribute__((target("sse4.1")))
+#define SHA256_AVX2 __attribute__((target("avx2")))
+
+typedef uint32_t sha256v4 __attribute__((vector_size(16)));
+typedef uint32_t sha256v8 __attribute__((vector_size(32)));
+
+#define SHA256_V4(c) ((sha256v4){ (c), (c), (c), (c) })
+#define SHA256_V8(c) ((sha256v8){ (c), (c), (c), (c), (c), (c), (c), (c) })
+#define SHA256_K4(i) SHA256_V4(nSHA256K[i])
+#define SHA256_K8(i) SHA256_V8(nSHA256K[i])
+
+SHA256_SSE41 static void SHA256D64_4way(unsigned char* pout, const unsigned char* pin)
+{
+    sha256v4 s[8], w[16];
+    for (int j = 0; j < 8; j++)
+        s[j] = SHA256_V4(nSHA256IV[j]);
+    for (int j = 0; j < 16; j++)
+        w[j] = (sha256v4){ ReadBE32(pin + 4 * j), ReadBE32(pin + 64 + 4 * j),
+                           ReadBE32(pin + 128 + 4 * j), ReadBE32(pin + 192 + 4 * j) };
+    SHA256_COMPRESS(sha256v4, s, w, SHA256_K4);
+
+    for (int j = 0; j < 16; j++)
+        w[j] = SHA256_V4(ReadBE32(pchPad64 + 4 * j));
+    SHA256_COMPRESS(sha256v4, s, w, SHA256_K4);
+
+    for (int j = 0; j < 8; j++)
+    {
+        w[j] = s[j];
+        s[j] = SHA256_V4(nSHA256IV[j]);
+    }
+    w[8] = SHA256_V4(0x80000000ul);
+    for (int j = 9; j < 15; j++)
+        w[j] = SHA256_V4(0);
+    w[15] = SHA256_V4(256);
+    SHA256_COMPRESS(sha256v4, s, w, SHA256_K4);
+
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 8; j++)
+            WriteBE32(pout + 32 * i + 4 * j, s[j][i]);
+}
+
+SHA256_AVX2 static void SHA256D64_8way(unsigned char* pout, const unsigned char* pin)
+{
+    sha256v8 s[8], w[16];
+    for (int j = 0; j < 8; j++)
+        s[j] = SHA256_V8(nSHA256IV[j]);
+    for (int j = 0; j < 16; j++)
+        w[j] = (sha256v8){ ReadBE32(pin + 4 * j), ReadBE32(pin + 64 + 4 * j),
+                           ReadBE32(pin + 128 + 4 * j), ReadBE32(pin + 192 + 4 * j),
+                           ReadBE32(pin + 256 + 4 * j), ReadBE32(pin + 320 + 4 * j),
+                           ReadBE32(pin + 384 + 4 * j), ReadBE32(pin + 448 + 4 * j) };
+    SHA256_COMPRESS(sha256v8, s, w, SHA256_K8);
+
+    for (int j = 0; j < 16; j++)
+        w[j] = SHA256_V8(ReadBE32(pchPad64 + 4 * j));
+    SHA256_COMPRESS(sha256v8, s, w, SHA256_K8);
+
+    for (int j = 0; j < 8; j++)
+    {
+        w[j] = s[j];
+        s[j] = SHA256_V8(nSHA256IV[j]);
+    }
+    w[8] = SHA256_V8(0x80000000ul);
+    for (int j = 9; j < 15; j++)
+        w[j] = SHA256_V8(0);
+    w[15] = SHA256_V8(256);
+    SHA256_COMPRESS(sha256v8, s, w, SHA256_K8);
+
+    for (int i = 0; i < 8; i++)
+        for (int j = 0; j < 8; j++)
+            WriteBE32(pout + 32 * i + 4 * j, s[j][i]);
+}
+
+//
+// Compression function with the SHA extensions. The state is kept as the
+// ABEF/CDGH register pair that SHA256RNDS2 works on; each quad round consumes
+// four message words, and SHA256MSG1/MSG2 extend the schedule four at a time.
+//
+#define SHA256_SHANI __attribute__((target("sha,sse4.1")))
+
+SHA256_SHANI static inline __attribute__((always_inline)) void shani_quad_round(__m128i& s0, __m128i& s1, __m128i m, int i)
+{
+    const __m128i msg = _mm_add_epi32(m, _mm_loadu_si128((const __m128i*)&nSHA256K[4 * i]));
+    s1 = _mm_sha256rnds2_epu32(s1, s0, msg);
+    s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(msg, 0x0e));
+}
+
+// m3 += sigma1 part of the next four words, given m0..m3 hold the last sixteen
+SHA256_SHANI static inline __attribute__((always_inline)) __m128i shani_next_words(__m128i m0, __m128i m1, __m128i m2, __m128i m3)
+{
+    // m0 already carries the sigma0 terms from SHA256MSG1
+    return _mm_sha256msg2_epu32(_mm_add_epi32(m0, _mm_alignr_epi8(m3, m2, 4)), m3);
+}
+
+SHA256_SHANI static void SHA256Transform_shani(uint32_t* s, const unsigned char* chunk, size_t nBlocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bull, 0x0405060700010203ull);
+
+    // Load the state as ABEF and CDGH
+    __m128i t0 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)s), 0xb1);        // CDAB
+    __m128i t1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(s + 4)), 0x1b);  // EFGH
+    __m128i s0 = _mm_alignr_epi8(t0, t1, 8);    // ABEF
+    __m128i s1 = _mm_blend_epi16(t1, t0, 0xf0); // CDGH
+
+    for (; nBlocks > 0; nBlocks--, chunk += 64)
+    {
+        const __m128i so0 = s0, so1 = s1;
+        __m128i m[4];
+        for (int j = 0; j < 4; j++)
+        {
+            m[j] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(chunk + 16 * j)), mask);
+            shani_quad_round(s0, s1, m[j], j);
+        }
+        // Words 16 to 63, four at a time: m[i & 3] is replaced by words 4i..4i+3
+        for (int i = 4; i < 16; i++)
+        {
+            __m128i& mn = m[i & 3];
+            mn = _mm_sha256msg1_epu32(mn, m[(i + 1) & 3]);
+            mn = shani_next_words(mn, m[(i + 1) & 3], m[(i + 2) & 3], m[(i + 3) & 3]);
+            shani_quad_round(s0, s1, mn, i);
+        }
+        s0 = _mm_add_epi32(s0, so0);
+        s1 = _mm_add_epi32(s1, so1);
+    }
+
+    // Back to ABCD and EFGH
+    t0 = _mm_shuffle_epi32(s0, 0x1b);  // FEBA
+    t1 = _mm_shuffle_epi32(s1, 0xb1);  // DCHG
+    _mm_storeu_si128((__m128i*)s, _mm_blend_epi16(t0, t1, 0xf0));           // DCBA
+    _mm_storeu_si128((__m128i*)(s + 4), _mm_alignr_epi8(t1, t0, 8));        // HGFE
+}
+
+static bool CPUHasSSE41()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    return (ecx & bit_SSE4_1) != 0;
+}
+
+static bool CPUHasSHANI()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!CPUHasSSE41() || __get_cpuid_max(0, NULL) < 7)
+        return false;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1 << 29)) != 0;
+}
+#endif // USE_SHA256_X86
+
+static SHA256TransformFunc GetTransformFunc(int nEngine)
+{
+    switch (nEngine)
+    {
+        case SHA256_ENGINE_GENERIC:
+        case SHA256_ENGINE_SSE4:
+        case SHA256_ENGINE_AVX2:
+            return &SHA256Transform_generic;
+#ifdef USE_SHA256_X86
+        case SHA256_ENGINE_SHANI:
+            return &SHA256Transform_shani;
+#endif
+    }
+    return NULL;
+}
+
+static SHA256TransformFunc pSHA256Transform = &SHA256Transform_generic;
+static int nSHA256Engine = SHA256_ENGINE_GENERIC;
+
+static void SHA256D64Engine(int nEngine, unsigned char* pout, const unsigned char* pin, size_t nBlocks)
+{
+#ifdef USE_SHA256_X86
+    if (nEngine == SHA256_ENGINE_AVX2)
+    {
+        for (; nBlocks >= 8; nBlocks -= 8, pout += 8 * 32, pin += 8 * 64)
+            SHA256D64_8way(pout, pin);
+    }
+    if (nEngine == SHA256_ENGINE_SSE4 || nEngine == SHA256_ENGINE_AVX2)
+    {
+        for (; nBlocks >= 4; nBlocks -= 4, pout += 4 * 32, pin += 4 * 64)
+            SHA256D64_4way(pout, pin);
+    }
+#endif
+    SHA256TransformFunc transform = GetTransformFunc(nEngine);
+    for (; nBlocks > 0; nBlocks--, pout += 32, pin += 64)
+        SHA256D64_1way(transform, pout, pin);
+}
+
+std::string SHA256EngineName(int nEngine)
+{
+    switch (nEngine)
+    {
+        case SHA256_ENGINE_GENERIC:
+            return std::string("generic");
+        case SHA256_ENGINE_SSE4:
+            return std::string("sse4");
+        case SHA256_ENGINE_AVX2:
+            return std::string("avx2");
+        case SHA256_ENGINE_SHANI:
+            return std::string("shani");
+    }
+    return std::string("unknown");
+}
+
+bool SHA256EngineSupported(int nEngine)
+{
+    switch (nEngine)
+    {
+        case SHA256_ENGINE_GENERIC:
+            return true;
+#ifdef USE_SHA256_X86
+        case SHA256_ENGINE_SSE4:
+            return CPUHasSSE41();
+        case SHA256_ENGINE_AVX2:
+            return CPUHasSSE41() && CPUHasAVX2();
+        case SHA256_ENGINE_SHANI:
+            return CPUHasSHANI();
+#endif
+    }
+    return false;
+}
+
+bool SHA256EngineSelfTest(int nEngine)
+{
+    SHA256TransformFunc transform = GetTransformFunc(nEngine);
+    if (transform == NULL || !SHA256EngineSupported(nEngine))
+        return false;
+
+    // SHA-256("abc"), a single padded block, checks the function itself
+    static const unsigned char pchABC[32] = {
+        0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+        0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad };
+    unsigned char block[64] = { 'a', 'b', 'c', 0x80 };
+    block[63] = 24;
+    uint32_t s[8];
+    memcpy(s, nSHA256IV, sizeof(s));
+    transform(s, block, 1);
+    for (int j = 0; j < 8; j++)
+        if (s[j] != ReadBE32(pchABC + 4 * j))
+            return false;
+
+    // Several blocks at once, and the double hashes of more inputs than the widest path takes
+    unsigned char data[17 * 64];
+    for (unsigned int i = 0; i < sizeof(data); i++)
+        data[i] = (unsigned char)(i * 13 + 7);
+    uint32_t sExpected[8];
+    memcpy(s, nSHA256IV, sizeof(s));
+    memcpy(sExpected, nSHA256IV, sizeof(sExpected));
+    transform(s, data, 17);
+    SHA256Transform_reference(sExpected, data, 17);
+    if (memcmp(s, sExpected, sizeof(s)) != 0)
+        return false;
+
+    unsigned char out[17 * 32], outExpected[17 * 32];
+    SHA256D64Engine(nEngine, out, data, 17);
+    for (int i = 0; i < 17; i++)
+        SHA256D64_1way(&SHA256Transform_reference, outExpected + 32 * i, data + 64 * i);
+    return memcmp(out, outExpected, sizeof(out)) == 0;
+}
+
+bool SHA256EngineInit(const std::string& strEngine)
+{
+    if (strEngine != "auto")
+    {
+        for (int nEngine = 0; nEngine < NUM_SHA256_ENGINES; nEngine++)
+        {
+            if (SHA256EngineName(nEngine) != strEngine)
+                continue;
+            if (!SHA256EngineSelfTest(nEngine))
+                return false;
+            pSHA256Transform = GetTransformFunc(nEngine);
+            nSHA256Engine = nEngine;
+            LogPrintf("Using SHA-256 engine %s\n", SHA256EngineName(nEngine));
+            return true;
+        }
+        return false;
+    }
+
+    // Pick the most capable engine that passes its self-test
+    for (int nEngine = NUM_SHA256_ENGINES - 1; nEngine >= 0; nEngine--)
+    {
+        if (!SHA256EngineSupported(nEngine))
+            continue;
+        if (!SHA256EngineSelfTest(nEngine))
+        {
+            LogPrintf("SHA-256 engine %s failed self-test, not using it\n", SHA256EngineName(nEngine));
+            continue;
+        }
+        pSHA256Transform = GetTransformFunc(nEngine);
+        nSHA256Engine = nEngine;
+        LogPrintf("Using SHA-256 engine %s\n", SHA256EngineName(nEngine));
+        return true;
+    }
+    return false;
+}
+
+int SHA256EngineActive()
+{
+    return nSHA256Engine;
+}
+
+void SHA256D64(unsigned char* pout, const unsigned char* pin, size_t nBlocks)
+{
+    SHA256D64Engine(nSHA256Engine, pout, pin, nBlocks);
+}
+
+CSHA256::CSHA256()
+{
+    Reset();
+}
+
+CSHA256& CSHA256::Reset()
+{
+    memcpy(s, nSHA256IV, sizeof(s));
+    bytes = 0;
+    return *this;
+}
+
+CSHA256& CSHA256::Write(const unsigned char* data, size_t len)
+{
+    size_t nBuf = bytes % 64;
+    bytes += len;
+    if (nBuf && nBuf + len >= 64)
+    {
+        // Complete the buffered block
+        memcpy(buf + nBuf, data, 64 - nBuf);
+        data += 64 - nBuf;
+        len -= 64 - nBuf;
+        pSHA256Transform(s, buf, 1);
+        nBuf = 0;
+    }
+    if (len >= 64 && nBuf == 0)
+    {
+        // Whole blocks straight from the input
+        size_t nBlocks = len / 64;
+        pSHA256Transform(s, data, nBlocks);
+        data += 64 * nBlocks;
+        len -= 64 * nBlocks;
+    }
+    if (len > 0)
+        memcpy(buf + nBuf, data, len);
+    return *this;
+}
+
+void CSHA256::Finalize(unsigned char hash[OUTPUT_SIZE])
+{
+    static const unsigned char pad[64] = { 0x80 };
+    unsigned char sizedesc[8];
+    uint64_t nBits = bytes << 3;
+    WriteBE32(sizedesc, nBits >> 32);
+    WriteBE32(sizedesc + 4, nBits);
+    Write(pad, 1 + ((119 - (bytes % 64)) % 64));
+    Write(sizedesc, 8);
+    for (int j = 0; j < 8; j++)
+        WriteBE32(hash + 4 * j, s[j]);
+}
@@ -0,0 +1,57 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SHA256_H
+#define BITCOIN_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+/** SHA-256 engine implementations, selected once at startup by SHA256EngineInit() */
+enum SHA256EngineType
+{
+    SHA256_ENGINE_GENERIC = 0, // OpenSSL's compression function
+    SHA256_ENGINE_SSE4    = 1, // as generic, plus 4-way SSE4.1 for 64-byte double hashes
+    SHA256_ENGINE_AVX2    = 2, // as generic, plus 8-way AVX2 (and 4-way SSE4.1) for 64-byte double hashes
+    SHA256_ENGINE_SHANI   = 3, // SHA-NI compression function, used for 64-byte double hashes too
+    NUM_SHA256_ENGINES
+};
+
+/** Detect CPU features, self-test the best supported engine and make it active.
+ *  strEngine may be "auto" or the name of an engine to force.
+ *  @return false if a forced engine is unknown, unsupported or fails its self-test
+ */
+bool SHA256EngineInit(const std::string& strEngine = "auto");
+/** Whether this binary and CPU can run the given engine */
+bool SHA256EngineSupported(int nEngine);
+/** Check the given engine against a known hash and a portable implementation */
+bool SHA256EngineSelfTest(int nEngine);
+std::string SHA256EngineName(int nEngine);
+int SHA256EngineActive();
+
+/** Streaming SHA-256 using the compression function of the active engine */
+class CSHA256
+{
+private:
+    uint32_t s[8];
+    unsigned char buf[64];
+    uint64_t bytes;
+
+public:
+    static const size_t OUTPUT_SIZE = 32;
+
+    CSHA256();
+    CSHA256& Write(const unsigned char* data, size_t len);
+    void Finalize(unsigned char hash[OUTPUT_SIZE]);
+    CSHA256& Reset();
+};
+
+/** Double SHA-256 of nBlocks consecutive 64-byte inputs, such as the pairs of
+ *  hashes of a merkle tree level: pout receives 32 bytes per input. pout may
+ *  not overlap pin. */
+void SHA256D64(unsigned char* pout, const unsigned char* pin, size_t nBlocks);
+
+#endif // BITCOIN_SHA256_H
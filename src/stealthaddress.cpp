@@ -11,6 +11,8 @@
 #include <openssl/ecdsa.h>
 #include <openssl/obj_mac.h>
 
+#include <boost/thread/once.hpp>
+
 //const uint8_t stealth_version_byte = 0x2a;
 const uint8_t stealth_version_byte = 0x28;
 
@@ -417,6 +419,91 @@ int StealthSecret(ec_secret& secret, ec_point& pubkey, const ec_point& pkSpend,
 };
 
 
+// secp256k1 with a table of multiples of its generator, only read once built
+static EC_GROUP* pStealthGroup = NULL;
+static boost::once_flag stealthGroupInitFlag = BOOST_ONCE_INIT;
+
+static void InitStealthGroup()
+{
+    pStealthGroup = EC_GROUP_new_by_curve_name(NID_secp256k1);
+    if (!pStealthGroup)
+        LogPrintf("InitStealthGroup(): EC_GROUP_new_by_curve_name failed.\n");
+    else if (!EC_GROUP_precompute_mult(pStealthGroup, NULL))
+        LogPrintf("InitStealthGroup(): EC_GROUP_precompute_mult failed.\n");
+}
+
+static const EC_GROUP* GetStealthGroup()
+{
+    boost::call_once(InitStealthGroup, stealthGroupInitFlag);
+    return pStealthGroup;
+}
+
+CStealthScanKey::CStealthScanKey(const CStealthAddress& sxAddr) : bnScan(NULL), R(NULL)
+{
+    const EC_GROUP* ecgrp = GetStealthGroup();
+    if (!ecgrp || sxAddr.scan_secret.size() != ec_secret_size || sxAddr.spend_pubkey.empty())
+        return;
+
+    BN_CTX* bnCtx = BN_CTX_new();
+    EC_POINT* pointR = EC_POINT_new(ecgrp);
+    if (bnCtx && pointR
+        && EC_POINT_oct2point(ecgrp, pointR, &sxAddr.spend_pubkey[0], sxAddr.spend_pubkey.size(), bnCtx)
+        && (bnScan = BN_bin2bn(&sxAddr.scan_secret[0], ec_secret_size, NULL)))
+    {
+        R = pointR;
+        pointR = NULL;
+    } else
+    {
+        LogPrintf("CStealthScanKey(): could not decode the stealth address.\n");
+    };
+
+    if (pointR)     EC_POINT_free(pointR);
+    if (bnCtx)      BN_CTX_free(bnCtx);
+};
+
+CStealthScanKey::~CStealthScanKey()
+{
+    if (R)          EC_POINT_free(R);
+    if (bnScan)     BN_clear_free(bnScan);
+};
+
+int CStealthScanKey::StealthSecret(const ec_point& ephemPubkey, ec_secret& sharedSOut, ec_point& pkOut) const
+{
+    if (!IsValid() || ephemPubkey.size() != ec_compressed_size)
+        return 1;
+
+    const EC_GROUP* ecgrp = GetStealthGroup();
+    int rv = 1;
+    std::vector<uint8_t> vchOutQ(ec_compressed_size);
+    BN_CTX* bnCtx   = BN_CTX_new();
+    EC_POINT* P     = EC_POINT_new(ecgrp);
+    EC_POINT* Rout  = EC_POINT_new(ecgrp);
+    BIGNUM* bnc     = NULL;
+
+    // -- c = H(dP), R' = cG + R, the generator multiple from the table
+    if (bnCtx && P && Rout
+        && EC_POINT_oct2point(ecgrp, P, &ephemPubkey[0], ec_compressed_size, bnCtx)
+        && EC_POINT_mul(ecgrp, P, NULL, P, bnScan, bnCtx)
+        && EC_POINT_point2oct(ecgrp, P, POINT_CONVERSION_COMPRESSED, &vchOutQ[0], ec_compressed_size, bnCtx) == ec_compressed_size)
+    {
+        SHA256(&vchOutQ[0], vchOutQ.size(), &sharedSOut.e[0]);
+
+        pkOut.resize(ec_compressed_size);
+        if ((bnc = BN_bin2bn(&sharedSOut.e[0], ec_secret_size, NULL))
+            && EC_POINT_mul(ecgrp, Rout, bnc, R, BN_value_one(), bnCtx)
+            && EC_POINT_point2oct(ecgrp, Rout, POINT_CONVERSION_COMPRESSED, &pkOut[0], ec_compressed_size, bnCtx) == ec_compressed_size)
+            rv = 0;
+    };
+
+    if (bnc)        BN_free(bnc);
+    if (Rout)       EC_POINT_free(Rout);
+    if (P)          EC_POINT_free(P);
+    if (bnCtx)      BN_CTX_free(bnCtx);
+
+    return rv;
+};
+
+
 int StealthSecretSpend(ec_secret& scanSecret, ec_point& ephemPubkey, ec_secret& spendSecret, ec_secret& secretOut)
 {
     /*
@@ -109,6 +109,33 @@ int GenerateRandomSecret(ec_secret& out);
 int SecretToPublicKey(const ec_secret& secret, ec_point& out);
 
 int StealthSecret(ec_secret& secret, ec_point& pubkey, const ec_point& pkSpend, ec_secret& sharedSOut, ec_point& pkOut);
+
+struct bignum_st;
+struct ec_point_st;
+
+/** The scan secret and spend public key of an owned stealth address, decoded
+ *  once to match many ephemeral keys against the address. Uses a curve group
+ *  shared by all scan keys, with the multiples of the generator precomputed
+ *  for the cG term. Safe to use from several threads at once.
+ */
+class CStealthScanKey
+{
+private:
+    bignum_st* bnScan;
+    ec_point_st* R;
+
+    CStealthScanKey(const CStealthScanKey&);
+    CStealthScanKey& operator=(const CStealthScanKey&);
+
+public:
+    CStealthScanKey(const CStealthAddress& sxAddr);
+    ~CStealthScanKey();
+
+    bool IsValid() const { return bnScan != NULL && R != NULL; }
+
+    // StealthSecret(scan_secret, ephemPubkey, spend_pubkey, ...) of the address
+    int StealthSecret(const ec_point& ephemPubkey, ec_secret& sharedSOut, ec_point& pkOut) const;
+};
 int StealthSecretSpend(ec_secret& scanSecret, ec_point& ephemPubkey, ec_secret& spendSecret, ec_secret& secretOut);
 int StealthSharedToSecretSpend(ec_secret& sharedS, ec_secret& spendSecret, ec_secret& secretOut);
 
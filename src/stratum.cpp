@@ -0,0 +1,847 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "stratum.h"
+
+#include "base58.h"
+#include "chainparams.h"
+#include "core.h"
+#include "init.h"
+#include "main.h"
+#include "miner.h"
+#include "sync.h"
+#include "ui_interface.h"
+#include "util.h"
+#ifdef ENABLE_WALLET
+#include "wallet.h"
+#endif
+
+#include <deque>
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_utils.h"
+#include "json/json_spirit_writer_template.h"
+
+using namespace boost::asio;
+using namespace json_spirit;
+using namespace std;
+
+/** Extranonce bytes in the coinbase: the first part is assigned to each
+ *  connection, the second is rolled by the miner */
+static const unsigned int STRATUM_EXTRANONCE1_SIZE = 4;
+static const unsigned int STRATUM_EXTRANONCE2_SIZE = 4;
+/** Jobs on the current tip still accepting shares */
+static const unsigned int STRATUM_MAX_JOBS = 8;
+/** Seconds before new mempool transactions make a new job */
+static const int64_t STRATUM_JOB_REFRESH = 30;
+/** Longest request line read, and most connections per port */
+static const size_t STRATUM_MAX_LINE = 16 * 1024;
+static const size_t STRATUM_MAX_CONNECTIONS = 1024;
+/** Seconds a connection may go without a request */
+static const int64_t STRATUM_IDLE_TIMEOUT = 600;
+/** Vardiff retargets after this many shares, or after this many share
+ *  times, by at most a factor of VARDIFF_MAX_STEP either way */
+static const unsigned int VARDIFF_SHARES = 24;
+static const int VARDIFF_SHARE_TIMES = 4;
+static const double VARDIFF_MAX_STEP = 4.0;
+static const double STRATUM_MIN_DIFF = 1.0 / 1024;
+static const double STRATUM_MAX_DIFF = 4294967296.0;
+
+static const int DEFAULT_STRATUM_PORT = 3333;
+static const int DEFAULT_STRATUM_SHARE_TIME = 15;
+
+class CStratumConnection;
+
+/** Work handed out to the miners of one algo: a block template, with its
+ *  coinbase split around the extranonce */
+struct CStratumJob
+{
+    string strId;
+    boost::shared_ptr<CBlockTemplate> ptemplate;
+    vector<unsigned char> vchCoinbase1;
+    vector<unsigned char> vchCoinbase2;
+    vector<uint256> vMerkleBranch;
+    unsigned int nMinTime;
+    // Headers of the shares accepted, to reject them when sent again
+    set<uint256> setShares;
+};
+
+/** Listening port of one algo, and the jobs and connections of its miners.
+ *  Only used on the Stratum thread once started. */
+class CStratumServer
+{
+public:
+    const int algo;
+    ip::tcp::acceptor acceptor;
+    set<boost::shared_ptr<CStratumConnection> > setConnections;
+    // Oldest first, all on pindexPrev
+    deque<boost::shared_ptr<CStratumJob> > vJobs;
+    CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdated;
+    int64_t nJobTime;
+
+    CStratumServer(io_service& io_service, int algoIn) :
+        algo(algoIn), acceptor(io_service), pindexPrev(NULL), nTransactionsUpdated(0), nJobTime(0) {}
+
+    void Listen();
+    void HandleAccept(boost::shared_ptr<CStratumConnection> conn, const boost::system::error_code& error);
+    /** Make a new job if the tip or the mempool changed, and notify the
+     *  miners of it. Returns whether it did. */
+    bool UpdateJob();
+    void CheckConnections();
+    boost::shared_ptr<CStratumJob> FindJob(const string& strId) const;
+    void Close();
+};
+
+/** Connection of one miner, speaking line delimited JSON */
+class CStratumConnection : public boost::enable_shared_from_this<CStratumConnection>
+{
+public:
+    ip::tcp::socket socket;
+
+    CStratumConnection(CStratumServer& serverIn, io_service& io_service, uint32_t nExtraNonce1);
+
+    void Start();
+    void Close();
+    bool IsReady() const { return fSubscribed && fAuthorized; }
+    void Notify(const CStratumJob& job, bool fClean);
+    void CheckVardiff(int64_t nNow);
+    bool IsIdle(int64_t nNow) const { return nNow - nLastRequest > STRATUM_IDLE_TIMEOUT; }
+
+private:
+    CStratumServer& server;
+    boost::asio::streambuf bufRead;
+    deque<string> vSendQueue;
+    bool fClosed;
+    bool fSubscribed;
+    bool fAuthorized;
+    vector<unsigned char> vchExtraNonce1;
+    string strWorker;
+    double dDiff;
+    // Difficulty each job was sent with
+    map<string, double> mapJobDiff;
+    int64_t nLastRequest;
+    int64_t nVardiffStart;
+    unsigned int nVardiffShares;
+
+    void Read();
+    void HandleRead(const boost::system::error_code& error, size_t nBytes);
+    void Write();
+    void HandleWrite(const boost::system::error_code& error);
+    void Send(const Object& obj);
+    void SendNotification(const string& strMethod, const Array& params);
+    void HandleRequest(const string& strLine);
+    void SetDifficulty(double dDiffNew);
+    void SendWork();
+    Value Submit(const Array& params);
+};
+
+// Created by StartStratum, destroyed in StopStratum
+static io_service* stratum_io_service = NULL;
+static deadline_timer* stratum_timer = NULL;
+static boost::thread* stratum_thread = NULL;
+static vector<boost::shared_ptr<CStratumServer> > vStratumServers;
+// Guards stratum_io_service for the block notifications
+static CCriticalSection cs_stratum;
+
+static CScript scriptStratumPayout;
+#ifdef ENABLE_WALLET
+static CReserveKey* pStratumKey = NULL;
+#endif
+static double dStratumInitialDiff = 1.0;
+static int64_t nStratumShareTime = DEFAULT_STRATUM_SHARE_TIME;
+static uint32_t nStratumExtraNonce1 = 0;
+static uint64_t nStratumJobId = 0;
+
+/** Stratum errors are sent as [code, message, traceback] */
+static Array StratumError(int nCode, const string& strMessage)
+{
+    Array error;
+    error.push_back(nCode);
+    error.push_back(strMessage);
+    error.push_back(Value::null);
+    return error;
+}
+
+/** Target of a share of difficulty 1. Scrypt shares are counted the way
+ *  scrypt pools and miners count them, 65536 times easier than the others. */
+static uint256 ShareTargetDiff1(int algo)
+{
+    return uint256().SetCompact(algo == ALGO_SCRYPT ? 0x1f00ffff : 0x1d00ffff);
+}
+
+static uint256 ShareTarget(int algo, double dDiff)
+{
+    uint256 nDiff = (uint64_t)(dDiff * 65536);
+    return ShareTargetDiff1(algo) / nDiff * 65536;
+}
+
+/** Previous block hash as stratum sends it: each 32-bit word of the
+ *  internal byte order byte swapped */
+static string StratumPrevHash(const uint256& hash)
+{
+    string str;
+    for (const unsigned char* p = hash.begin(); p < hash.end(); p += 4)
+    {
+        unsigned char vch[4] = { p[3], p[2], p[1], p[0] };
+        str += HexStr(vch, vch + 4);
+    }
+    return str;
+}
+
+static bool ParseStratumUInt32(const string& str, uint32_t& n)
+{
+    if (str.size() != 8 || !IsHex(str))
+        return false;
+    n = (uint32_t)strtoul(str.c_str(), NULL, 16);
+    return true;
+}
+
+static CBlockTemplate* CreateStratumTemplate(int algo)
+{
+#ifdef ENABLE_WALLET
+    if (pStratumKey)
+        return CreateNewBlockWithKey(*pStratumKey, algo);
+#endif
+    return CreateNewBlock(scriptStratumPayout, algo);
+}
+
+static void SubmitStratumBlock(int algo, const CStratumJob& job, const CBlockHeader& header, const vector<unsigned char>& vchCoinbase)
+{
+    CBlock block(job.ptemplate->block);
+    block.hashMerkleRoot = header.hashMerkleRoot;
+    block.nTime = header.nTime;
+    block.nNonce = header.nNonce;
+    CDataStream ssCoinbase(vchCoinbase, SER_NETWORK, PROTOCOL_VERSION);
+    CTransaction txCoinbase;
+    ssCoinbase >> txCoinbase;
+    block.vtx[0] = txCoinbase;
+
+    LogPrintf("Stratum: %s block found\n  block-hash: %s\n  pow-hash: %s\n", GetAlgoName(algo),
+        block.GetHash().GetHex(), block.GetPoWHash(algo).GetHex());
+
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        if (!ProcessBlockFromTemplate(state, block, job.ptemplate.get()))
+        {
+            LogPrintf("Stratum: ProcessBlock, block not accepted\n");
+            return;
+        }
+    }
+
+#ifdef ENABLE_WALLET
+    if (pStratumKey)
+    {
+        // Remove key from key pool, and track how many getdata requests
+        // this block gets
+        pStratumKey->KeepKey();
+        LOCK(pwalletMain->cs_wallet);
+        pwalletMain->mapRequestCount[block.GetHash()] = 0;
+    }
+#endif
+}
+
+void CStratumServer::Listen()
+{
+    boost::shared_ptr<CStratumConnection> conn(new CStratumConnection(*this, *stratum_io_service, nStratumExtraNonce1++));
+    acceptor.async_accept(conn->socket, boost::bind(&CStratumServer::HandleAccept, this, conn, placeholders::error));
+}
+
+void CStratumServer::HandleAccept(boost::shared_ptr<CStratumConnection> conn, const boost::system::error_code& error)
+{
+    if (error == boost::asio::error::operation_aborted || !acceptor.is_open())
+        return;
+    if (!error)
+    {
+        if (setConnections.size() < STRATUM_MAX_CONNECTIONS)
+        {
+            setConnections.insert(conn);
+            conn->Start();
+        }
+        else
+            conn->Close();
+    }
+    Listen();
+}
+
+bool CStratumServer::UpdateJob()
+{
+    // Nobody to give the work to
+    if (setConnections.empty() || IsInitialBlockDownload())
+        return false;
+
+    CBlockIndex* pindexTip;
+    {
+        LOCK(cs_main);
+        pindexTip = chainActive.Tip();
+    }
+    int64_t nNow = GetTime();
+    bool fClean = (pindexTip != pindexPrev);
+    if (!fClean && (mempool.GetTransactionsUpdated() == nTransactionsUpdated || nNow - nJobTime < STRATUM_JOB_REFRESH))
+        return false;
+
+    // Store the counter used before CreateNewBlock, to avoid races
+    unsigned int nTransactionsUpdatedNew = mempool.GetTransactionsUpdated();
+    boost::shared_ptr<CStratumJob> pjob(new CStratumJob());
+    pjob->ptemplate.reset(CreateStratumTemplate(algo));
+    if (!pjob->ptemplate)
+        return false;
+    CBlock& block = pjob->ptemplate->block;
+    if (block.hashPrevBlock != pindexTip->GetBlockHash())
+        return false;
+    UpdateTime(block, pindexTip);
+    block.nNonce = 0;
+
+    // Height first in coinbase, then the extranonce as one push
+    CScript scriptHeight = CScript() << (pindexTip->nHeight + 1);
+    CMutableTransaction txCoinbase(block.vtx[0]);
+    txCoinbase.vin[0].scriptSig = scriptHeight;
+    txCoinbase.vin[0].scriptSig << vector<unsigned char>(STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE, 0);
+    txCoinbase.vin[0].scriptSig += COINBASE_FLAGS;
+    assert(txCoinbase.vin[0].scriptSig.size() <= 100);
+    block.vtx[0] = txCoinbase;
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    // Split the serialized coinbase around the extranonce: version, one
+    // input, its prevout, the scriptSig size, the height and the push opcode
+    // come before it
+    CDataStream ssCoinbase(SER_NETWORK, PROTOCOL_VERSION);
+    ssCoinbase << block.vtx[0];
+    size_t nOffset = 4 + GetSizeOfCompactSize(1) + 36 +
+        GetSizeOfCompactSize(txCoinbase.vin[0].scriptSig.size()) + scriptHeight.size() + 1;
+    pjob->vchCoinbase1.assign(ssCoinbase.begin(), ssCoinbase.begin() + nOffset);
+    pjob->vchCoinbase2.assign(ssCoinbase.begin() + nOffset + STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE, ssCoinbase.end());
+    pjob->vMerkleBranch = block.GetMerkleBranch(0);
+    pjob->nMinTime = pindexTip->GetMedianTimePast() + 1;
+    pjob->strId = strprintf("%x", ++nStratumJobId);
+
+    if (fClean)
+        vJobs.clear();
+    vJobs.push_back(pjob);
+    while (vJobs.size() > STRATUM_MAX_JOBS)
+        vJobs.pop_front();
+    pindexPrev = pindexTip;
+    nTransactionsUpdated = nTransactionsUpdatedNew;
+    nJobTime = nNow;
+
+    LogPrint("stratum", "Stratum: new %s job %s at height %d\n", GetAlgoName(algo), pjob->strId, pindexTip->nHeight + 1);
+    BOOST_FOREACH(const boost::shared_ptr<CStratumConnection>& conn, setConnections)
+        if (conn->IsReady())
+            conn->Notify(*pjob, fClean);
+    return true;
+}
+
+void CStratumServer::CheckConnections()
+{
+    int64_t nNow = GetTime();
+    // Closing a connection removes it from the set
+    vector<boost::shared_ptr<CStratumConnection> > vConnections(setConnections.begin(), setConnections.end());
+    BOOST_FOREACH(const boost::shared_ptr<CStratumConnection>& conn, vConnections)
+    {
+        if (conn->IsIdle(nNow))
+            conn->Close();
+        else
+            conn->CheckVardiff(nNow);
+    }
+}
+
+boost::shared_ptr<CStratumJob> CStratumServer::FindJob(const string& strId) const
+{
+    BOOST_FOREACH(const boost::shared_ptr<CStratumJob>& pjob, vJobs)
+        if (pjob->strId == strId)
+            return pjob;
+    return boost::shared_ptr<CStratumJob>();
+}
+
+void CStratumServer::Close()
+{
+    boost::system::error_code ec;
+    acceptor.close(ec);
+    vector<boost::shared_ptr<CStratumConnection> > vConnections(setConnections.begin(), setConnections.end());
+    BOOST_FOREACH(const boost::shared_ptr<CStratumConnection>& conn, vConnections)
+        conn->Close();
+    vJobs.clear();
+}
+
+CStratumConnection::CStratumConnection(CStratumServer& serverIn, io_service& io_service, uint32_t nExtraNonce1) :
+    socket(io_service), server(serverIn), bufRead(STRATUM_MAX_LINE),
+    fClosed(false), fSubscribed(false), fAuthorized(false),
+    dDiff(dStratumInitialDiff), nLastRequest(GetTime()), nVardiffStart(0), nVardiffShares(0)
+{
+    vchExtraNonce1.resize(STRATUM_EXTRANONCE1_SIZE);
+    for (unsigned int i = 0; i < STRATUM_EXTRANONCE1_SIZE; i++)
+        vchExtraNonce1[i] = (nExtraNonce1 >> (8 * (STRATUM_EXTRANONCE1_SIZE - 1 - i))) & 0xff;
+}
+
+void CStratumConnection::Start()
+{
+    boost::system::error_code ec;
+    socket.set_option(ip::tcp::no_delay(true), ec);
+    LogPrint("stratum", "Stratum: %s connection from %s\n", GetAlgoName(server.algo), socket.remote_endpoint(ec).address().to_string());
+    Read();
+}
+
+void CStratumConnection::Close()
+{
+    if (fClosed)
+        return;
+    fClosed = true;
+    boost::system::error_code ec;
+    socket.close(ec);
+    // Handlers still pending hold their own reference
+    server.setConnections.erase(shared_from_this());
+}
+
+void CStratumConnection::Read()
+{
+    async_read_until(socket, bufRead, '\n',
+        boost::bind(&CStratumConnection::HandleRead, shared_from_this(), placeholders::error, placeholders::bytes_transferred));
+}
+
+void CStratumConnection::HandleRead(const boost::system::error_code& error, size_t nBytes)
+{
+    if (fClosed)
+        return;
+    // Also fails on a line longer than the buffer
+    if (error)
+    {
+        Close();
+        return;
+    }
+
+    istream stream(&bufRead);
+    string strLine;
+    getline(stream, strLine);
+    if (!strLine.empty() && strLine[strLine.size() - 1] == '\r')
+        strLine.erase(strLine.size() - 1);
+    if (!strLine.empty())
+        HandleRequest(strLine);
+    if (!fClosed)
+        Read();
+}
+
+void CStratumConnection::Write()
+{
+    async_write(socket, buffer(vSendQueue.front()),
+        boost::bind(&CStratumConnection::HandleWrite, shared_from_this(), placeholders::error));
+}
+
+void CStratumConnection::HandleWrite(const boost::system::error_code& error)
+{
+    if (fClosed)
+        return;
+    if (error)
+    {
+        Close();
+        return;
+    }
+    vSendQueue.pop_front();
+    if (!vSendQueue.empty())
+        Write();
+}
+
+void CStratumConnection::Send(const Object& obj)
+{
+    if (fClosed)
+        return;
+    vSendQueue.push_back(write_string(Value(obj), false) + "\n");
+    // One write at a time, the rest follow from HandleWrite
+    if (vSendQueue.size() == 1)
+        Write();
+}
+
+void CStratumConnection::SendNotification(const string& strMethod, const Array& params)
+{
+    Object notification;
+    notification.push_back(Pair("id", Value::null));
+    notification.push_back(Pair("method", strMethod));
+    notification.push_back(Pair("params", params));
+    Send(notification);
+}
+
+void CStratumConnection::HandleRequest(const string& strLine)
+{
+    nLastRequest = GetTime();
+
+    Value valRequest;
+    if (!read_string(strLine, valRequest) || valRequest.type() != obj_type)
+    {
+        LogPrint("stratum", "Stratum: parse error, closing connection\n");
+        Close();
+        return;
+    }
+    const Object& request = valRequest.get_obj();
+    Value id = find_value(request, "id");
+    Value valMethod = find_value(request, "method");
+    Value valParams = find_value(request, "params");
+    Array params;
+    if (valParams.type() == array_type)
+        params = valParams.get_array();
+
+    Value result = Value::null;
+    Value error = Value::null;
+    bool fSendWork = false;
+    try
+    {
+        if (valMethod.type() != str_type)
+            throw StratumError(20, "Invalid request");
+        const string& strMethod = valMethod.get_str();
+        if (strMethod == "mining.subscribe")
+        {
+            string strExtraNonce1 = HexStr(vchExtraNonce1);
+            Array subscriptions;
+            Array subDifficulty;
+            subDifficulty.push_back("mining.set_difficulty");
+            subDifficulty.push_back(strExtraNonce1);
+            subscriptions.push_back(subDifficulty);
+            Array subNotify;
+            subNotify.push_back("mining.notify");
+            subNotify.push_back(strExtraNonce1);
+            subscriptions.push_back(subNotify);
+
+            Array subscribed;
+            subscribed.push_back(subscriptions);
+            subscribed.push_back(strExtraNonce1);
+            subscribed.push_back((int)STRATUM_EXTRANONCE2_SIZE);
+            result = subscribed;
+            fSendWork = !fSubscribed && fAuthorized;
+            fSubscribed = true;
+        }
+        else if (strMethod == "mining.authorize")
+        {
+            // Blocks pay the node, so any worker name will do
+            if (params.size() > 0)
+                strWorker = params[0].get_str();
+            result = true;
+            fSendWork = fSubscribed && !fAuthorized;
+            fAuthorized = true;
+        }
+        else if (strMethod == "mining.submit")
+            result = Submit(params);
+        else if (strMethod == "mining.extranonce.subscribe")
+            result = false;
+        else
+            throw StratumError(20, "Method not found");
+    }
+    catch (Array& e)
+    {
+        error = e;
+    }
+    catch (std::exception& e)
+    {
+        error = StratumError(20, e.what());
+    }
+
+    Object reply;
+    reply.push_back(Pair("id", id));
+    reply.push_back(Pair("result", result));
+    reply.push_back(Pair("error", error));
+    Send(reply);
+
+    if (fSendWork)
+        SendWork();
+}
+
+void CStratumConnection::SendWork()
+{
+    nVardiffStart = GetTime();
+    nVardiffShares = 0;
+    Array params;
+    params.push_back(dDiff);
+    SendNotification("mining.set_difficulty", params);
+
+    // A new job goes to every miner ready, this one included
+    if (!server.UpdateJob() && !server.vJobs.empty())
+        Notify(*server.vJobs.back(), true);
+}
+
+void CStratumConnection::Notify(const CStratumJob& job, bool fClean)
+{
+    if (fClean)
+        mapJobDiff.clear();
+    else
+    {
+        for (map<string, double>::iterator it = mapJobDiff.begin(); it != mapJobDiff.end(); )
+        {
+            if (!server.FindJob(it->first))
+                mapJobDiff.erase(it++);
+            else
+                ++it;
+        }
+    }
+    // Sent again after a difficulty change, shares at either difficulty may
+    // be on their way
+    map<string, double>::iterator it = mapJobDiff.find(job.strId);
+    if (it == mapJobDiff.end())
+        mapJobDiff[job.strId] = dDiff;
+    else
+        it->second = min(it->second, dDiff);
+
+    const CBlock& block = job.ptemplate->block;
+    Array branch;
+    BOOST_FOREACH(const uint256& hash, job.vMerkleBranch)
+        branch.push_back(HexStr(BEGIN(hash), END(hash)));
+
+    Array params;
+    params.push_back(job.strId);
+    params.push_back(StratumPrevHash(block.hashPrevBlock));
+    params.push_back(HexStr(job.vchCoinbase1));
+    params.push_back(HexStr(job.vchCoinbase2));
+    params.push_back(branch);
+    params.push_back(strprintf("%08x", (uint32_t)block.nVersion));
+    params.push_back(strprintf("%08x", block.nBits));
+    params.push_back(strprintf("%08x", block.nTime));
+    params.push_back(fClean);
+    SendNotification("mining.notify", params);
+}
+
+void CStratumConnection::SetDifficulty(double dDiffNew)
+{
+    dDiffNew = max(STRATUM_MIN_DIFF, min(STRATUM_MAX_DIFF, dDiffNew));
+    if (dDiffNew == dDiff)
+        return;
+    LogPrint("stratum", "Stratum: %s worker %s difficulty %g -> %g\n", GetAlgoName(server.algo), strWorker, dDiff, dDiffNew);
+    dDiff = dDiffNew;
+
+    Array params;
+    params.push_back(dDiff);
+    SendNotification("mining.set_difficulty", params);
+    // Miners take the new difficulty from the next job
+    if (!server.vJobs.empty())
+        Notify(*server.vJobs.back(), false);
+}
+
+void CStratumConnection::CheckVardiff(int64_t nNow)
+{
+    if (!IsReady())
+        return;
+    int64_t nElapsed = nNow - nVardiffStart;
+    if (nVardiffShares < VARDIFF_SHARES && nElapsed < VARDIFF_SHARE_TIMES * nStratumShareTime)
+        return;
+
+    // Share rate against the one aimed for
+    double dRatio = (double)nVardiffShares * nStratumShareTime / max(nElapsed, (int64_t)1);
+    dRatio = max(1.0 / VARDIFF_MAX_STEP, min(VARDIFF_MAX_STEP, dRatio));
+    nVardiffStart = nNow;
+    nVardiffShares = 0;
+    // Leave it alone while close enough, shares come at random
+    if (dRatio > 0.5 && dRatio < 2.0)
+        return;
+    SetDifficulty(dDiff * dRatio);
+}
+
+Value CStratumConnection::Submit(const Array& params)
+{
+    if (!fAuthorized)
+        throw StratumError(24, "Unauthorized worker");
+    if (!fSubscribed)
+        throw StratumError(25, "Not subscribed");
+    if (params.size() < 5)
+        throw StratumError(20, "Invalid parameters");
+
+    const string& strJobId = params[1].get_str();
+    boost::shared_ptr<CStratumJob> pjob = server.FindJob(strJobId);
+    map<string, double>::const_iterator itDiff = mapJobDiff.find(strJobId);
+    if (!pjob || itDiff == mapJobDiff.end())
+        throw StratumError(21, "Job not found");
+    CStratumJob& job = *pjob;
+
+    const string& strExtraNonce2 = params[2].get_str();
+    if (strExtraNonce2.size() != 2 * STRATUM_EXTRANONCE2_SIZE || !IsHex(strExtraNonce2))
+        throw StratumError(20, "Invalid extranonce2");
+    uint32_t nTime, nNonce;
+    if (!ParseStratumUInt32(params[3].get_str(), nTime) || !ParseStratumUInt32(params[4].get_str(), nNonce))
+        throw StratumError(20, "Invalid ntime or nonce");
+    if (nTime < job.nMinTime || nTime > GetAdjustedTime() + 2 * 60 * 60)
+        throw StratumError(20, "ntime out of range");
+
+    // Coinbase with the extranonce, and the merkle root from its branch
+    vector<unsigned char> vchExtraNonce2 = ParseHex(strExtraNonce2);
+    vector<unsigned char> vchCoinbase(job.vchCoinbase1);
+    vchCoinbase.insert(vchCoinbase.end(), vchExtraNonce1.begin(), vchExtraNonce1.end());
+    vchCoinbase.insert(vchCoinbase.end(), vchExtraNonce2.begin(), vchExtraNonce2.end());
+    vchCoinbase.insert(vchCoinbase.end(), job.vchCoinbase2.begin(), job.vchCoinbase2.end());
+    uint256 hashMerkleRoot = Hash(vchCoinbase.begin(), vchCoinbase.end());
+    BOOST_FOREACH(const uint256& hash, job.vMerkleBranch)
+        hashMerkleRoot = Hash(BEGIN(hashMerkleRoot), END(hashMerkleRoot), BEGIN(hash), END(hash));
+
+    CBlockHeader header = job.ptemplate->block.GetBlockHeader();
+    header.hashMerkleRoot = hashMerkleRoot;
+    header.nTime = nTime;
+    header.nNonce = nNonce;
+
+    uint256 hashPoW = header.GetPoWHash(server.algo);
+    if (hashPoW > ShareTarget(server.algo, itDiff->second))
+        throw StratumError(23, "Low difficulty share");
+    if (!job.setShares.insert(header.GetHash()).second)
+        throw StratumError(22, "Duplicate share");
+
+    nVardiffShares++;
+    if (hashPoW <= uint256().SetCompact(header.nBits))
+        SubmitStratumBlock(server.algo, job, header, vchCoinbase);
+    CheckVardiff(GetTime());
+    return true;
+}
+
+static void StratumUpdateJobs()
+{
+    BOOST_FOREACH(const boost::shared_ptr<CStratumServer>& server, vStratumServers)
+    {
+        try
+        {
+            server->UpdateJob();
+        }
+        catch (std::exception& e)
+        {
+            LogPrintf("Stratum: %s job not updated: %s\n", GetAlgoName(server->algo), e.what());
+        }
+    }
+}
+
+static void StratumTimer(const boost::system::error_code& error)
+{
+    if (error)
+        return;
+    StratumUpdateJobs();
+    BOOST_FOREACH(const boost::shared_ptr<CStratumServer>& server, vStratumServers)
+        server->CheckConnections();
+    stratum_timer->expires_from_now(boost::posix_time::seconds(1));
+    stratum_timer->async_wait(&StratumTimer);
+}
+
+static void StratumNotifyBlocksChanged()
+{
+    // Push the new tip without waiting for the timer
+    LOCK(cs_stratum);
+    if (stratum_io_service)
+        stratum_io_service->post(&StratumUpdateJobs);
+}
+
+static void ThreadStratum()
+{
+    RenameThread("bitcoin-stratum");
+    stratum_io_service->run();
+}
+
+bool StartStratum(string& strError)
+{
+    if (!GetBoolArg("-stratum", false))
+        return true;
+
+    if (mapArgs.count("-stratumaddress"))
+    {
+        CBitcoinAddress address(mapArgs["-stratumaddress"]);
+        if (!address.IsValid())
+        {
+            strError = strprintf(_("Invalid -stratumaddress: '%s'"), mapArgs["-stratumaddress"]);
+            return false;
+        }
+        scriptStratumPayout.SetDestination(address.Get());
+    }
+    else
+    {
+#ifdef ENABLE_WALLET
+        if (pwalletMain)
+            pStratumKey = new CReserveKey(pwalletMain);
+#endif
+        bool fHaveKey = false;
+#ifdef ENABLE_WALLET
+        fHaveKey = (pStratumKey != NULL);
+#endif
+        if (!fHaveKey)
+        {
+            strError = _("-stratum needs -stratumaddress when the wallet is disabled");
+            return false;
+        }
+    }
+
+    dStratumInitialDiff = max(STRATUM_MIN_DIFF, min(STRATUM_MAX_DIFF, atof(GetArg("-stratumdiff", "1").c_str())));
+    nStratumShareTime = max((int64_t)1, GetArg("-stratumsharetime", DEFAULT_STRATUM_SHARE_TIME));
+    nStratumExtraNonce1 = (uint32_t)GetRand(0xffffffff);
+
+    boost::system::error_code ec;
+    ip::address bindAddress = ip::address::from_string(GetArg("-stratumbind", "127.0.0.1"), ec);
+    if (ec)
+    {
+        strError = strprintf(_("Invalid -stratumbind address: '%s'"), GetArg("-stratumbind", ""));
+        StopStratum();
+        return false;
+    }
+    int nPort = GetArg("-stratumport", TestNet() ? 10000 + DEFAULT_STRATUM_PORT : DEFAULT_STRATUM_PORT);
+
+    stratum_io_service = new io_service();
+    for (int algo = 0; algo < NUM_ALGOS; algo++)
+    {
+        boost::shared_ptr<CStratumServer> server(new CStratumServer(*stratum_io_service, algo));
+        ip::tcp::endpoint endpoint(bindAddress, nPort + algo);
+        try
+        {
+            server->acceptor.open(endpoint.protocol());
+            server->acceptor.set_option(ip::tcp::acceptor::reuse_address(true));
+            server->acceptor.bind(endpoint);
+            server->acceptor.listen(socket_base::max_connections);
+        }
+        catch (boost::system::system_error& e)
+        {
+            strError = strprintf(_("Unable to listen for Stratum connections on port %u: %s"), endpoint.port(), e.what());
+            vStratumServers.push_back(server);
+            StopStratum();
+            return false;
+        }
+        server->Listen();
+        vStratumServers.push_back(server);
+        LogPrintf("Stratum: %s on %s port %u\n", GetAlgoName(algo), bindAddress.to_string(), endpoint.port());
+    }
+
+    stratum_timer = new deadline_timer(*stratum_io_service);
+    stratum_timer->expires_from_now(boost::posix_time::seconds(1));
+    stratum_timer->async_wait(&StratumTimer);
+    uiInterface.NotifyBlocksChanged.connect(&StratumNotifyBlocksChanged);
+    stratum_thread = new boost::thread(&ThreadStratum);
+    return true;
+}
+
+void StopStratum()
+{
+    if (stratum_io_service == NULL)
+    {
+#ifdef ENABLE_WALLET
+        delete pStratumKey; pStratumKey = NULL;
+#endif
+        return;
+    }
+
+    uiInterface.NotifyBlocksChanged.disconnect(&StratumNotifyBlocksChanged);
+    stratum_io_service->stop();
+    if (stratum_thread)
+    {
+        stratum_thread->join();
+        delete stratum_thread; stratum_thread = NULL;
+    }
+
+    // The thread is gone, so nothing else uses the servers now
+    BOOST_FOREACH(const boost::shared_ptr<CStratumServer>& server, vStratumServers)
+        server->Close();
+    vStratumServers.clear();
+    delete stratum_timer; stratum_timer = NULL;
+    {
+        LOCK(cs_stratum);
+        delete stratum_io_service; stratum_io_service = NULL;
+    }
+#ifdef ENABLE_WALLET
+    delete pStratumKey; pStratumKey = NULL;
+#endif
+}
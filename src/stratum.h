@@ -0,0 +1,16 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_STRATUM_H
+#define BITCOIN_STRATUM_H
+
+#include <string>
+
+/** Start the Stratum v1 mining servers if -stratum is set, listening on one
+ *  port per algo. Returns false with strError set if they could not start. */
+bool StartStratum(std::string& strError);
+/** Stop the Stratum servers and close their connections */
+void StopStratum();
+
+#endif // BITCOIN_STRATUM_H
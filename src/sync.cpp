@@ -6,7 +6,133 @@
 
 #include "util.h"
 
+#include <map>
+
 #include <boost/foreach.hpp>
+#include <boost/thread/mutex.hpp>
+
+bool fLockProfile = false;
+
+CLockSiteStats::CLockSiteStats() : nLine(0), nLocks(0), nContended(0), nWaitMicros(0), nMaxWaitMicros(0), nHoldMicros(0), nMaxHoldMicros(0)
+{
+    for (unsigned int i = 0; i < LOCKPROFILE_BUCKETS; i++)
+        vWaitHistogram[i] = vHoldHistogram[i] = 0;
+}
+
+void CLockSiteStats::Add(const CLockSiteStats& other)
+{
+    nLocks += other.nLocks;
+    nContended += other.nContended;
+    nWaitMicros += other.nWaitMicros;
+    nMaxWaitMicros = std::max(nMaxWaitMicros, other.nMaxWaitMicros);
+    nHoldMicros += other.nHoldMicros;
+    nMaxHoldMicros = std::max(nMaxHoldMicros, other.nMaxHoldMicros);
+    for (unsigned int i = 0; i < LOCKPROFILE_BUCKETS; i++) {
+        vWaitHistogram[i] += other.vWaitHistogram[i];
+        vHoldHistogram[i] += other.vHoldHistogram[i];
+    }
+}
+
+int64_t LockProfileTime()
+{
+    return GetTimeMicros();
+}
+
+// Sites are keyed by the address of their __FILE__ string and their line,
+// and spread over shards so that threads recording different sites rarely
+// wait for each other.
+typedef std::pair<const char*, int> LockSiteKey;
+
+static const unsigned int LOCKPROFILE_SHARDS = 16;
+
+struct CLockProfileShard
+{
+    boost::mutex mutex;
+    std::map<LockSiteKey, CLockSiteStats> mapSites;
+};
+
+static CLockProfileShard* LockProfileShards()
+{
+    // Constructed on first use, locks may be taken during static initialization
+    static CLockProfileShard shards[LOCKPROFILE_SHARDS];
+    return shards;
+}
+
+static CLockProfileShard& LockProfileShard(const LockSiteKey& key)
+{
+    size_t nHash = (size_t)key.first / sizeof(void*) + key.second * 31;
+    return LockProfileShards()[nHash % LOCKPROFILE_SHARDS];
+}
+
+static unsigned int LockProfileBucket(int64_t nMicros)
+{
+    unsigned int nBucket = 0;
+    while (nMicros > 0 && nBucket < LOCKPROFILE_BUCKETS - 1) {
+        nMicros >>= 1;
+        nBucket++;
+    }
+    return nBucket;
+}
+
+void LockProfileRecord(const char* pszName, const char* pszFile, int nLine, int64_t nWaitMicros, int64_t nHoldMicros, bool fContended)
+{
+    // The clock may step backwards
+    nWaitMicros = std::max(nWaitMicros, (int64_t)0);
+    nHoldMicros = std::max(nHoldMicros, (int64_t)0);
+
+    LockSiteKey key(pszFile, nLine);
+    CLockProfileShard& shard = LockProfileShard(key);
+    boost::mutex::scoped_lock lock(shard.mutex);
+    CLockSiteStats& stats = shard.mapSites[key];
+    if (stats.nLocks == 0) {
+        stats.strName = pszName;
+        stats.strFile = pszFile;
+        stats.nLine = nLine;
+    }
+    stats.nLocks++;
+    if (fContended)
+        stats.nContended++;
+    stats.nWaitMicros += nWaitMicros;
+    stats.nMaxWaitMicros = std::max(stats.nMaxWaitMicros, nWaitMicros);
+    stats.nHoldMicros += nHoldMicros;
+    stats.nMaxHoldMicros = std::max(stats.nMaxHoldMicros, nHoldMicros);
+    stats.vWaitHistogram[LockProfileBucket(nWaitMicros)]++;
+    stats.vHoldHistogram[LockProfileBucket(nHoldMicros)]++;
+}
+
+std::vector<CLockSiteStats> GetLockProfile()
+{
+    // A site in a header has one __FILE__ string per translation unit
+    std::map<std::pair<std::string, int>, CLockSiteStats> mapMerged;
+    for (unsigned int i = 0; i < LOCKPROFILE_SHARDS; i++) {
+        CLockProfileShard& shard = LockProfileShards()[i];
+        boost::mutex::scoped_lock lock(shard.mutex);
+        for (std::map<LockSiteKey, CLockSiteStats>::const_iterator it = shard.mapSites.begin(); it != shard.mapSites.end(); ++it) {
+            CLockSiteStats& merged = mapMerged[std::make_pair(it->second.strFile, it->second.nLine)];
+            if (merged.nLocks == 0) {
+                merged.strName = it->second.strName;
+                merged.strFile = it->second.strFile;
+                merged.nLine = it->second.nLine;
+            }
+            merged.Add(it->second);
+        }
+    }
+
+    std::vector<CLockSiteStats> vStats;
+    vStats.reserve(mapMerged.size());
+    for (std::map<std::pair<std::string, int>, CLockSiteStats>::const_iterator it = mapMerged.begin(); it != mapMerged.end(); ++it)
+        vStats.push_back(it->second);
+    return vStats;
+}
+
+void ResetLockProfile()
+{
+    for (unsigned int i = 0; i < LOCKPROFILE_SHARDS; i++) {
+        CLockProfileShard& shard = LockProfileShards()[i];
+        boost::mutex::scoped_lock lock(shard.mutex);
+        shard.mapSites.clear();
+    }
+}
 
 #ifdef DEBUG_LOCKCONTENTION
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine)
@@ -8,10 +8,15 @@
 
 #include "threadsafety.h"
 
+#include <stdint.h>
+#include <string>
+#include <vector>
+
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/recursive_mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
 
 
 ////////////////////////////////////////////////
@@ -84,6 +89,14 @@ typedef AnnotatedMixin<boost::recursive_mutex> CCriticalSection;
 /** Wrapped boost mutex: supports waiting but not recursive locking */
 typedef AnnotatedMixin<boost::mutex> CWaitableCriticalSection;
 
+/** Wrapped boost shared mutex: many readers or one writer, recursive in
+ * neither mode. It is not seen by DEBUG_LOCKORDER or the lock profiler, so
+ * no other lock may be taken while it is held. */
+typedef boost::shared_mutex CSharedCriticalSection;
+
+/** Just a typedef for boost::condition_variable, can be wrapped later if desired */
+typedef boost::condition_variable CConditionVariable;
+
 #ifdef DEBUG_LOCKORDER
 void EnterCritical(const char* pszName, const char* pszFile, int nLine, void* cs, bool fTry = false);
 void LeaveCritical();
@@ -100,6 +113,42 @@ void static inline AssertLockHeldInternal(const char* pszName, const char* pszFi
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine);
 #endif
 
+/** Lock profiler, enabled with -lockprofile.
+ *
+ *  Records for each LOCK/LOCK2/TRY_LOCK site how long threads waited to
+ *  get the lock and how long they held it, in histograms with power-of-two
+ *  buckets: bucket 0 counts times under 1 microsecond, bucket i times from
+ *  2^(i-1) up to 2^i microseconds, and the last bucket everything longer.
+ *  When disabled, taking a lock costs one more test of fLockProfile.
+ */
+static const unsigned int LOCKPROFILE_BUCKETS = 24;
+
+extern bool fLockProfile;
+
+struct CLockSiteStats
+{
+    std::string strName; // lock expression, e.g. "cs_main"
+    std::string strFile;
+    int nLine;
+    uint64_t nLocks;      // times the lock was taken here
+    uint64_t nContended;  // of which it was held by another thread first
+    int64_t nWaitMicros;  // total
+    int64_t nMaxWaitMicros;
+    int64_t nHoldMicros;  // total
+    int64_t nMaxHoldMicros;
+    uint64_t vWaitHistogram[LOCKPROFILE_BUCKETS];
+    uint64_t vHoldHistogram[LOCKPROFILE_BUCKETS];
+
+    CLockSiteStats();
+    void Add(const CLockSiteStats& other);
+};
+
+int64_t LockProfileTime();
+void LockProfileRecord(const char* pszName, const char* pszFile, int nLine, int64_t nWaitMicros, int64_t nHoldMicros, bool fContended);
+// Statistics of every site that took a lock since startup or the last reset
+std::vector<CLockSiteStats> GetLockProfile();
+void ResetLockProfile();
+
 /** Wrapper around boost::unique_lock<Mutex> */
 template<typename Mutex>
 class CMutexLock
@@ -107,9 +156,42 @@ class CMutexLock
 private:
     boost::unique_lock<Mutex> lock;
 
+    // Site and times of this lock, if taken while the profiler was on
+    const char* pszProfileName;
+    const char* pszProfileFile;
+    int nProfileLine;
+    int64_t nWaitMicros;
+    int64_t nLockedMicros;
+    bool fContended;
+
+    void EnterProfiled(const char* pszName, const char* pszFile, int nLine)
+    {
+        if (lock.try_lock()) {
+            nLockedMicros = LockProfileTime();
+            nWaitMicros = 0;
+            fContended = false;
+        } else {
+#ifdef DEBUG_LOCKCONTENTION
+            PrintLockContention(pszName, pszFile, nLine);
+#endif
+            int64_t nStart = LockProfileTime();
+            lock.lock();
+            nLockedMicros = LockProfileTime();
+            nWaitMicros = nLockedMicros - nStart;
+            fContended = true;
+        }
+        pszProfileName = pszName;
+        pszProfileFile = pszFile;
+        nProfileLine = nLine;
+    }
+
     void Enter(const char* pszName, const char* pszFile, int nLine)
     {
         EnterCritical(pszName, pszFile, nLine, (void*)(lock.mutex()));
+        if (fLockProfile) {
+            EnterProfiled(pszName, pszFile, nLine);
+            return;
+        }
 #ifdef DEBUG_LOCKCONTENTION
         if (!lock.try_lock())
         {
@@ -127,11 +209,19 @@ private:
         lock.try_lock();
         if (!lock.owns_lock())
             LeaveCritical();
+        else if (fLockProfile) {
+            nLockedMicros = LockProfileTime();
+            nWaitMicros = 0;
+            fContended = false;
+            pszProfileName = pszName;
+            pszProfileFile = pszFile;
+            nProfileLine = nLine;
+        }
         return lock.owns_lock();
     }
 
 public:
-    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) : lock(mutexIn, boost::defer_lock)
+    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) : lock(mutexIn, boost::defer_lock), pszProfileName(NULL)
     {
         if (fTry)
             TryEnter(pszName, pszFile, nLine);
@@ -141,8 +231,15 @@ public:
 
     ~CMutexLock()
     {
-        if (lock.owns_lock())
+        if (lock.owns_lock()) {
             LeaveCritical();
+            if (pszProfileName) {
+                // Record after unlocking, so it does not add to the hold time
+                int64_t nHoldMicros = LockProfileTime() - nLockedMicros;
+                lock.unlock();
+                LockProfileRecord(pszProfileName, pszProfileFile, nProfileLine, nWaitMicros, nHoldMicros, fContended);
+            }
+        }
     }
 
     operator bool()
@@ -157,6 +254,9 @@ typedef CMutexLock<CCriticalSection> CCriticalBlock;
 #define LOCK2(cs1,cs2) CCriticalBlock criticalblock1(cs1, #cs1, __FILE__, __LINE__),criticalblock2(cs2, #cs2, __FILE__, __LINE__)
 #define TRY_LOCK(cs,name) CCriticalBlock name(cs, #cs, __FILE__, __LINE__, true)
 
+#define READ_LOCK(cs) boost::shared_lock<CSharedCriticalSection> readlock(cs)
+#define WRITE_LOCK(cs) boost::unique_lock<CSharedCriticalSection> writelock(cs)
+
 #define ENTER_CRITICAL_SECTION(cs) \
     { \
         EnterCritical(#cs, __FILE__, __LINE__, (void*)(&cs)); \
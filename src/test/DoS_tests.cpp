@@ -23,11 +23,22 @@
 #include <boost/test/unit_test.hpp>
 
 // Tests this internal-to-main.cpp method:
+struct COrphanTx {
+    CTransaction tx;
+    NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nSize;
+    unsigned int nRandomIndex;
+};
 extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-extern std::map<uint256, CTransaction> mapOrphanTransactions;
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, uint64_t nMaxBytes);
+extern std::map<uint256, COrphanTx> mapOrphanTransactions;
 extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern std::map<NodeId, std::set<uint256> > mapOrphanTransactionsByPeer;
+extern std::set<std::pair<int64_t, uint256> > setOrphanTransactionsByExpiry;
+extern std::vector<uint256> vOrphanTransactionsRandom;
+extern uint64_t nOrphanTransactionsSize;
 
 CService ip(uint32_t i)
 {
@@ -152,11 +163,11 @@ BOOST_AUTO_TEST_CASE(DoS_checknbits)
 
 CTransaction RandomOrphan()
 {
-    std::map<uint256, CTransaction>::iterator it;
+    std::map<uint256, COrphanTx>::iterator it;
     it = mapOrphanTransactions.lower_bound(GetRandHash());
     if (it == mapOrphanTransactions.end())
         it = mapOrphanTransactions.begin();
-    return it->second;
+    return it->second.tx;
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -169,7 +180,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     // 50 orphan transactions:
     for (int i = 0; i < 50; i++)
     {
-        CTransaction tx;
+        CMutableTransaction tx;
         tx.vin.resize(1);
         tx.vin[0].prevout.n = 0;
         tx.vin[0].prevout.hash = GetRandHash();
@@ -186,7 +197,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     {
         CTransaction txPrev = RandomOrphan();
 
-        CTransaction tx;
+        CMutableTransaction tx;
         tx.vin.resize(1);
         tx.vin[0].prevout.n = 0;
         tx.vin[0].prevout.hash = txPrev.GetHash();
@@ -203,7 +214,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     {
         CTransaction txPrev = RandomOrphan();
 
-        CTransaction tx;
+        CMutableTransaction tx;
         tx.vout.resize(1);
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
@@ -228,16 +239,42 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         size_t sizeBefore = mapOrphanTransactions.size();
         EraseOrphansFor(i);
         BOOST_CHECK(mapOrphanTransactions.size() < sizeBefore);
+        BOOST_CHECK(!mapOrphanTransactionsByPeer.count(i));
     }
+    BOOST_CHECK_EQUAL(vOrphanTransactionsRandom.size(), mapOrphanTransactions.size());
+    BOOST_CHECK_EQUAL(setOrphanTransactionsByExpiry.size(), mapOrphanTransactions.size());
 
     // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
+    LimitOrphanTxSize(40, 1000000);
     BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
+    LimitOrphanTxSize(10, 1000000);
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
+    BOOST_CHECK_EQUAL(vOrphanTransactionsRandom.size(), mapOrphanTransactions.size());
+    for (unsigned int i = 0; i < vOrphanTransactionsRandom.size(); i++)
+        BOOST_CHECK_EQUAL(mapOrphanTransactions[vOrphanTransactionsRandom[i]].nRandomIndex, i);
+    // ... by size
+    uint64_t nSize = nOrphanTransactionsSize;
+    LimitOrphanTxSize(10, nSize - 1);
+    BOOST_CHECK(nOrphanTransactionsSize < nSize);
+    BOOST_CHECK(mapOrphanTransactions.size() < 10);
+    LimitOrphanTxSize(0, 1000000);
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPeer.empty());
+    BOOST_CHECK(setOrphanTransactionsByExpiry.empty());
+    BOOST_CHECK_EQUAL(nOrphanTransactionsSize, 0);
+
+    // Orphans expire, whatever the limits
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1*CENT;
+    BOOST_CHECK(AddOrphanTx(tx, 0));
+    SetMockTime(GetTime() + ORPHAN_TX_EXPIRE_TIME);
+    LimitOrphanTxSize(100, 1000000);
+    SetMockTime(0);
+    BOOST_CHECK(mapOrphanTransactions.empty());
 }
 
 BOOST_AUTO_TEST_CASE(DoS_checkSig)
@@ -252,10 +289,10 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
 
     // 100 orphan transactions:
     static const int NPREV=100;
-    CTransaction orphans[NPREV];
+    CMutableTransaction orphans[NPREV];
     for (int i = 0; i < NPREV; i++)
     {
-        CTransaction& tx = orphans[i];
+        CMutableTransaction& tx = orphans[i];
         tx.vin.resize(1);
         tx.vin[0].prevout.n = 0;
         tx.vin[0].prevout.hash = GetRandHash();
@@ -268,7 +305,7 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
     }
 
     // Create a transaction that depends on orphans:
-    CTransaction tx;
+    CMutableTransaction tx;
     tx.vout.resize(1);
     tx.vout[0].nValue = 1*CENT;
     tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
@@ -291,40 +328,46 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
     // 2.8GHz machine, -g build: Sign takes ~760ms,
     // uncached Verify takes ~250ms, cached Verify takes ~50ms
     // (for 100 single-signature inputs)
+    uint64_t nHits = GetSignatureCacheStats().nHits;
     mst1 = boost::posix_time::microsec_clock::local_time();
     for (unsigned int i = 0; i < 5; i++)
         for (unsigned int j = 0; j < tx.vin.size(); j++)
-            BOOST_CHECK(VerifySignature(CCoins(orphans[j], MEMPOOL_HEIGHT), tx, j, flags, SIGHASH_ALL));
+            BOOST_CHECK(VerifySignature(CCoin(orphans[j].vout[0], MEMPOOL_HEIGHT, false), tx, j, flags, SIGHASH_ALL));
     mst2 = boost::posix_time::microsec_clock::local_time();
     msdiff = mst2 - mst1;
     long nManyValidate = msdiff.total_milliseconds();
     if (fDebug) printf("DoS_Checksig five: %ld\n", nManyValidate);
 
     BOOST_CHECK_MESSAGE(nManyValidate < nOneValidate, "Signature cache timing failed");
+    BOOST_CHECK(GetSignatureCacheStats().nHits >= nHits + 5 * tx.vin.size());
 
     // Empty a signature, validation should fail:
     CScript save = tx.vin[0].scriptSig;
     tx.vin[0].scriptSig = CScript();
-    BOOST_CHECK(!VerifySignature(CCoins(orphans[0], MEMPOOL_HEIGHT), tx, 0, flags, SIGHASH_ALL));
+    BOOST_CHECK(!VerifySignature(CCoin(orphans[0].vout[0], MEMPOOL_HEIGHT, false), tx, 0, flags, SIGHASH_ALL));
     tx.vin[0].scriptSig = save;
 
     // Swap signatures, validation should fail:
     std::swap(tx.vin[0].scriptSig, tx.vin[1].scriptSig);
-    BOOST_CHECK(!VerifySignature(CCoins(orphans[0], MEMPOOL_HEIGHT), tx, 0, flags, SIGHASH_ALL));
-    BOOST_CHECK(!VerifySignature(CCoins(orphans[1], MEMPOOL_HEIGHT), tx, 1, flags, SIGHASH_ALL));
+    BOOST_CHECK(!VerifySignature(CCoin(orphans[0].vout[0], MEMPOOL_HEIGHT, false), tx, 0, flags, SIGHASH_ALL));
+    BOOST_CHECK(!VerifySignature(CCoin(orphans[1].vout[0], MEMPOOL_HEIGHT, false), tx, 1, flags, SIGHASH_ALL));
     std::swap(tx.vin[0].scriptSig, tx.vin[1].scriptSig);
 
-    // Exercise -maxsigcachesize code:
-    mapArgs["-maxsigcachesize"] = "10";
+    // Exercise signature cache eviction, with one entry per shard:
+    SetSignatureCacheSize(1);
+    uint64_t nEvictions = GetSignatureCacheStats().nEvictions;
+    BOOST_CHECK(nEvictions > 0);
     // Generate a new, different signature for vin[0] to trigger cache clear:
     CScript oldSig = tx.vin[0].scriptSig;
     BOOST_CHECK(SignSignature(keystore, orphans[0], tx, 0));
     BOOST_CHECK(tx.vin[0].scriptSig != oldSig);
     for (unsigned int j = 0; j < tx.vin.size(); j++)
-        BOOST_CHECK(VerifySignature(CCoins(orphans[j], MEMPOOL_HEIGHT), tx, j, flags, SIGHASH_ALL));
-    mapArgs.erase("-maxsigcachesize");
+        BOOST_CHECK(VerifySignature(CCoin(orphans[j].vout[0], MEMPOOL_HEIGHT, false), tx, j, flags, SIGHASH_ALL));
+    BOOST_CHECK(GetSignatureCacheStats().nEvictions > nEvictions);
+    BOOST_CHECK(GetSignatureCacheStats().nEntries <= GetSignatureCacheStats().nMaxEntries);
+    SetSignatureCacheSize(DEFAULT_MAX_SIG_CACHE_SIZE << 20);
 
-    LimitOrphanTxSize(0);
+    LimitOrphanTxSize(0, 0);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
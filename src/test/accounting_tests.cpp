@@ -82,14 +82,22 @@ BOOST_AUTO_TEST_CASE(acc_orderupgrade)
     BOOST_CHECK(results[3].strComment.empty());
 
 
+    {
+        CMutableTransaction tx(wtx);
+        --tx.nLockTime;  // Just to change the hash :)
+        *static_cast<CTransaction*>(&wtx) = CTransaction(tx);
+    }
     wtx.mapValue["comment"] = "y";
-    --wtx.nLockTime;  // Just to change the hash :)
     pwalletMain->AddToWallet(wtx);
     vpwtx.push_back(&pwalletMain->mapWallet[wtx.GetHash()]);
     vpwtx[1]->nTimeReceived = (unsigned int)1333333336;
 
+    {
+        CMutableTransaction tx(wtx);
+        --tx.nLockTime;  // Just to change the hash :)
+        *static_cast<CTransaction*>(&wtx) = CTransaction(tx);
+    }
     wtx.mapValue["comment"] = "x";
-    --wtx.nLockTime;  // Just to change the hash :)
     pwalletMain->AddToWallet(wtx);
     vpwtx.push_back(&pwalletMain->mapWallet[wtx.GetHash()]);
     vpwtx[2]->nTimeReceived = (unsigned int)1333333329;
@@ -0,0 +1,116 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addressindex.h"
+
+#include "core.h"
+#include "main.h"
+#include "serialize.h"
+
+#include <string>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(addressindex_tests)
+
+static string SerializedKey(const CAddressIndexKey& key)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << make_pair('a', key);
+    return ss.str();
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_key_order)
+{
+    // The database iterates the entries of an address by height, then by
+    // position in the block
+    CAddressIndexKey key1, key2;
+    key1.chType = key2.chType = ADDRESS_INDEX_PUBKEYHASH;
+    key1.nHeight = 255;
+    key2.nHeight = 256;
+    BOOST_CHECK(SerializedKey(key1) < SerializedKey(key2));
+    key1.nHeight = 256;
+    key1.nTxIndex = 1;
+    key2.nTxIndex = 2;
+    BOOST_CHECK(SerializedKey(key1) < SerializedKey(key2));
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    key1.nIndex = 0x12345678;
+    ss << key1;
+    CAddressIndexKey read;
+    ss >> read;
+    BOOST_CHECK_EQUAL(read.nHeight, 256U);
+    BOOST_CHECK_EQUAL(read.nIndex, 0x12345678U);
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_block_update)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CKeyID keyID = key.GetPubKey().GetID();
+    CScript scriptPay;
+    scriptPay.SetDestination(keyID);
+
+    CBlock block;
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vout.resize(2);
+    coinbase.vout[0].scriptPubKey = scriptPay;
+    coinbase.vout[0].nValue = 50;
+    coinbase.vout[1].scriptPubKey = CScript() << OP_RETURN;
+    block.vtx.push_back(coinbase);
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 3);
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = 20;
+    block.vtx.push_back(tx);
+
+    CBlockUndo blockundo;
+    blockundo.vtxundo.resize(1);
+    CTxOut spent(30, scriptPay);
+    blockundo.vtxundo[0].vprevout.push_back(CTxInUndo(spent, false, 90));
+
+    // The coinbase output and the spent output are of the key, the other
+    // output of a script
+    CAddressIndexUpdate connect;
+    connect.AddBlock(block, blockundo, 100, false);
+    BOOST_CHECK_EQUAL(connect.vHistory.size(), 3U);
+    BOOST_CHECK_EQUAL(connect.vUnspent.size(), 2U);
+    BOOST_CHECK_EQUAL(connect.vUnspentErased.size(), 1U);
+    int64_t nBalance = 0;
+    for (unsigned int i = 0; i < connect.vHistory.size(); i++)
+        if (connect.vHistory[i].first.hashAddress == uint160(keyID))
+            nBalance += connect.vHistory[i].second;
+    BOOST_CHECK_EQUAL(nBalance, 20);
+    BOOST_CHECK(connect.vUnspentErased[0].txhash == tx.vin[0].prevout.hash);
+    BOOST_CHECK_EQUAL(connect.vUnspentErased[0].nIndex, 3U);
+
+    // Disconnecting undoes exactly that
+    CAddressIndexUpdate disconnect;
+    disconnect.AddBlock(block, blockundo, 100, true);
+    BOOST_CHECK_EQUAL(disconnect.vHistoryErased.size(), 3U);
+    BOOST_CHECK_EQUAL(disconnect.vUnspentErased.size(), 2U);
+    BOOST_CHECK_EQUAL(disconnect.vUnspent.size(), 1U);
+    BOOST_CHECK_EQUAL(disconnect.vUnspent[0].second.nValue, 30);
+    BOOST_CHECK_EQUAL(disconnect.vUnspent[0].second.nHeight, 90);
+
+    // The spent index records the input of the second transaction
+    CAddressIndexUpdate spentUpdate;
+    spentUpdate.AddSpentOutputs(block, blockundo, 100, false);
+    BOOST_CHECK_EQUAL(spentUpdate.vSpent.size(), 1U);
+    BOOST_CHECK(spentUpdate.vSpent[0].first == tx.vin[0].prevout);
+    BOOST_CHECK(spentUpdate.vSpent[0].second.txid == tx.GetHash());
+    BOOST_CHECK_EQUAL(spentUpdate.vSpent[0].second.nValue, 30);
+    BOOST_CHECK(spentUpdate.vSpent[0].second.hashAddress == uint160(keyID));
+    spentUpdate.AddSpentOutputs(block, blockundo, 100, true);
+    BOOST_CHECK_EQUAL(spentUpdate.vSpentErased.size(), 1U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
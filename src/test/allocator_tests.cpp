@@ -114,4 +114,112 @@ BOOST_AUTO_TEST_CASE(test_LockedPageManagerBase)
     BOOST_CHECK((last_unlock_len & (test_page_size-1)) == 0); // always unlock entire pages
 }
 
+BOOST_AUTO_TEST_CASE(test_LockedArena)
+{
+    static const size_t arena_size = 1024;
+    std::vector<char> buffer(arena_size);
+    LockedArena arena(&buffer[0], arena_size, 16);
+
+    /* Sizes are rounded up to the alignment */
+    char *a = static_cast<char*>(arena.Alloc(1));
+    char *b = static_cast<char*>(arena.Alloc(100));
+    char *c = static_cast<char*>(arena.Alloc(0));
+    BOOST_CHECK(a == &buffer[0]);
+    BOOST_CHECK(b == a + 16);
+    BOOST_CHECK(c == b + 112);
+    BOOST_CHECK(arena.GetUsed() == 16 + 112 + 16);
+    BOOST_CHECK(arena.Contains(c) && !arena.Contains(&buffer[0] + arena_size));
+
+    /* What does not fit is refused */
+    BOOST_CHECK(arena.Alloc(arena_size) == NULL);
+    BOOST_CHECK(arena.Alloc((size_t)-1) == NULL);
+
+    /* A freed chunk is reused, first fit */
+    arena.Free(b);
+    BOOST_CHECK(arena.GetFreeChunkCount() == 2);
+    BOOST_CHECK(arena.Alloc(50) == b);
+    char *d = static_cast<char*>(arena.Alloc(64));
+    BOOST_CHECK(d == c + 16);
+
+    /* Freeing everything merges the chunks back into one */
+    arena.Free(a);
+    arena.Free(d);
+    arena.Free(c);
+    arena.Free(b);
+    BOOST_CHECK(arena.GetFreeChunkCount() == 1);
+    BOOST_CHECK(arena.GetUsed() == 0);
+    BOOST_CHECK(arena.Alloc(arena_size) == &buffer[0]);
+}
+
+BOOST_AUTO_TEST_CASE(test_LockedPoolBase)
+{
+    const size_t test_page_size = 4096;
+    last_lock_addr = last_unlock_addr = 0;
+    last_lock_len = last_unlock_len = 0;
+    {
+        LockedPoolBase<TestLocker> pool(test_page_size, test_page_size * 2);
+        BOOST_CHECK(pool.GetArenaCount() == 0);
+
+        /* Allocations share an arena, locked once as a whole */
+        std::vector<void*> allocated;
+        for (int i = 0; i < 100; i++)
+            allocated.push_back(pool.Alloc(32));
+        BOOST_CHECK(pool.GetArenaCount() == 1);
+        BOOST_CHECK(last_lock_len == test_page_size * 2);
+        BOOST_CHECK((reinterpret_cast<size_t>(last_lock_addr) & (test_page_size-1)) == 0);
+        BOOST_CHECK(pool.GetUsed() == 100 * 32);
+
+        /* A new arena is added when the first is full */
+        allocated.push_back(pool.Alloc(test_page_size * 2 - 100 * 32));
+        BOOST_CHECK(pool.GetArenaCount() == 1);
+        allocated.push_back(pool.Alloc(1));
+        BOOST_CHECK(pool.GetArenaCount() == 2);
+        BOOST_CHECK(last_unlock_len == 0);
+
+        /* Larger than an arena is left to the caller */
+        BOOST_CHECK(pool.Alloc(test_page_size * 2 + 1) == NULL);
+
+        int dummy;
+        BOOST_CHECK(!pool.Free(&dummy));
+        for (unsigned int i = 0; i < allocated.size(); i++)
+            BOOST_CHECK(pool.Free(allocated[i]));
+        BOOST_CHECK(pool.GetUsed() == 0);
+    }
+    BOOST_CHECK(last_unlock_len == test_page_size * 2);
+}
+
+class FailingLocker
+{
+public:
+    bool Lock(const void *addr, size_t len) { return false; }
+    bool Unlock(const void *addr, size_t len) { return true; }
+};
+
+static int lock_failed_calls;
+static void CountLockFailed(size_t arena_size) { lock_failed_calls++; }
+
+BOOST_AUTO_TEST_CASE(test_LockedPoolBase_lock_failed)
+{
+    const size_t test_page_size = 4096;
+    lock_failed_calls = 0;
+    LockedPoolBase<FailingLocker> pool(test_page_size, test_page_size * 2, CountLockFailed);
+
+    /* An arena that cannot be locked is given up, and reported once */
+    BOOST_CHECK(pool.Alloc(32) == NULL);
+    BOOST_CHECK(pool.Alloc(32) == NULL);
+    BOOST_CHECK(pool.GetArenaCount() == 0);
+    BOOST_CHECK(lock_failed_calls == 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_secure_allocator)
+{
+    SecureString str("correct horse battery staple");
+    str += str;
+    BOOST_CHECK(str == "correct horse battery staplecorrect horse battery staple");
+
+    /* Larger than an arena, locked page by page */
+    std::vector<unsigned char, secure_allocator<unsigned char> > large(LockedPool::ARENA_SIZE + 1, 0xff);
+    BOOST_CHECK(large[LockedPool::ARENA_SIZE] == 0xff);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
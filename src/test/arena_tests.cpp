@@ -0,0 +1,109 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "arena.h"
+
+#include "core.h"
+#include "script.h"
+#include "serialize.h"
+#include "version.h"
+
+#include <string.h>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(arena_tests)
+
+BOOST_AUTO_TEST_CASE(arena_allocate)
+{
+    CDeserializeArena arena;
+    BOOST_CHECK_EQUAL(arena.GetUsage(), 0U);
+
+    // Aligned, and not overlapping
+    char* p1 = static_cast<char*>(arena.Allocate(1));
+    char* p2 = static_cast<char*>(arena.Allocate(100));
+    BOOST_CHECK_EQUAL((size_t)p1 % ARENA_HEADER_SIZE, 0U);
+    BOOST_CHECK_EQUAL((size_t)p2 % ARENA_HEADER_SIZE, 0U);
+    BOOST_CHECK(p2 >= p1 + 1);
+    BOOST_CHECK(arena.GetUsage() >= 101U);
+
+    // Larger than a chunk
+    char* pBig = static_cast<char*>(arena.Allocate(1024 * 1024));
+    memset(pBig, 1, 1024 * 1024);
+
+    // Reused after a reset
+    arena.Reset();
+    BOOST_CHECK_EQUAL(arena.GetUsage(), 0U);
+    BOOST_CHECK(arena.Allocate(1) == p1);
+}
+
+BOOST_AUTO_TEST_CASE(arena_scope)
+{
+    CDeserializeArena arena, arenaInner;
+    {
+        std::vector<int, arena_allocator<int> > vHeap(10, 1);
+        BOOST_CHECK_EQUAL(arena.GetUsage(), 0U);
+
+        CDeserializeArena::Scope scope(arena);
+        std::vector<int, arena_allocator<int> > vArena(10, 2);
+        BOOST_CHECK(arena.GetUsage() >= 10 * sizeof(int));
+        {
+            CDeserializeArena::Scope scopeInner(arenaInner);
+            std::vector<int, arena_allocator<int> > vInner(10, 3);
+            BOOST_CHECK(arenaInner.GetUsage() >= 10 * sizeof(int));
+        }
+        size_t nUsage = arena.GetUsage();
+        std::vector<int, arena_allocator<int> > vArena2(10, 4);
+        BOOST_CHECK(arena.GetUsage() > nUsage);
+
+        // Growing a vector from before the scope takes arena memory too
+        vHeap.resize(1000, 5);
+        BOOST_CHECK_EQUAL(vHeap[999], 5);
+    }
+
+    // Out of scope, allocations come from the heap again
+    size_t nUsage = arena.GetUsage();
+    std::vector<int, arena_allocator<int> > vHeap(10, 6);
+    BOOST_CHECK_EQUAL(arena.GetUsage(), nUsage);
+}
+
+BOOST_AUTO_TEST_CASE(arena_deserialize_block)
+{
+    CBlock block;
+    for (unsigned int i = 0; i < 50; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(2);
+        tx.vin[0].prevout.n = i;
+        tx.vin[1].scriptSig = CScript() << std::vector<unsigned char>(100, i);
+        tx.vout.resize(3);
+        tx.vout[2].nValue = i;
+        block.vtx.push_back(tx);
+    }
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+
+    std::vector<CTransaction> vtxCopy;
+    {
+        CDeserializeArena arena;
+        CBlock blockRead;
+        {
+            CDeserializeArena::Scope scope(arena);
+            ss >> blockRead;
+        }
+        BOOST_CHECK(arena.GetUsage() > 0);
+        BOOST_CHECK(blockRead.GetHash() == block.GetHash());
+        BOOST_CHECK(blockRead.BuildMerkleTree() == block.BuildMerkleTree());
+
+        // Copies made outside the scope outlive the arena
+        vtxCopy = blockRead.vtx;
+    }
+    BOOST_CHECK_EQUAL(vtxCopy.size(), block.vtx.size());
+    for (unsigned int i = 0; i < vtxCopy.size(); i++) {
+        BOOST_CHECK(vtxCopy[i].GetHash() == block.vtx[i].GetHash());
+        BOOST_CHECK_EQUAL(vtxCopy[i].vout[2].nValue, (int64_t)i);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
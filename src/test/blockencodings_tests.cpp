@@ -0,0 +1,127 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "core.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+// A block of a coinbase and three transactions spending it in a chain
+static CBlock BuildBlock()
+{
+    CBlock block;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.SetNull();
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = 50 * COIN;
+    block.vtx.push_back(tx);
+
+    for (int i = 0; i < 3; i++)
+    {
+        tx.vin[0].prevout = COutPoint(tx.GetHash(), 0);
+        tx.vin[0].scriptSig = CScript() << OP_11 << i;
+        tx.vout[0].nValue -= COIN;
+        block.vtx.push_back(tx);
+    }
+
+    block.nTime = 1400000000;
+    block.nBits = 0x207fffff;
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+static CBlockHeaderAndShortTxIDs RoundTrip(const CBlockHeaderAndShortTxIDs& cmpctblock)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    CBlockHeaderAndShortTxIDs result;
+    ss >> result;
+    BOOST_CHECK(ss.empty());
+    return result;
+}
+
+BOOST_AUTO_TEST_CASE(compact_block_from_mempool)
+{
+    CBlock block = BuildBlock();
+    CTxMemPool pool;
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        pool.addUnchecked(block.vtx[i].GetHash(), CTxMemPoolEntry(block.vtx[i], 1000, GetTime(), 0.0, 1));
+
+    CBlockHeaderAndShortTxIDs cmpctblock = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+    BOOST_CHECK_EQUAL(cmpctblock.BlockTxCount(), block.vtx.size());
+    BOOST_CHECK_EQUAL(cmpctblock.vPrefilledTxn.size(), 1);
+    BOOST_CHECK(cmpctblock.header.GetHash() == block.GetHash());
+
+    CPartialBlock partial;
+    BOOST_CHECK_EQUAL(partial.InitData(cmpctblock, pool), READ_STATUS_OK);
+    vector<uint32_t> vMissing;
+    partial.GetMissing(vMissing);
+    BOOST_CHECK(vMissing.empty());
+
+    CBlock rebuilt;
+    BOOST_CHECK_EQUAL(partial.FillBlock(rebuilt, vector<CTransaction>()), READ_STATUS_OK);
+    BOOST_CHECK(rebuilt.GetHash() == block.GetHash());
+    BOOST_CHECK(rebuilt.BuildMerkleTree() == block.hashMerkleRoot);
+}
+
+BOOST_AUTO_TEST_CASE(compact_block_missing_tx)
+{
+    CBlock block = BuildBlock();
+    CTxMemPool pool;
+    pool.addUnchecked(block.vtx[1].GetHash(), CTxMemPoolEntry(block.vtx[1], 1000, GetTime(), 0.0, 1));
+    pool.addUnchecked(block.vtx[3].GetHash(), CTxMemPoolEntry(block.vtx[3], 1000, GetTime(), 0.0, 1));
+
+    CBlockHeaderAndShortTxIDs cmpctblock = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+    CPartialBlock partial;
+    BOOST_CHECK_EQUAL(partial.InitData(cmpctblock, pool), READ_STATUS_OK);
+    BOOST_CHECK(partial.IsTxAvailable(0));
+    BOOST_CHECK(!partial.IsTxAvailable(2));
+
+    vector<uint32_t> vMissing;
+    partial.GetMissing(vMissing);
+    BOOST_REQUIRE_EQUAL(vMissing.size(), 1);
+    BOOST_CHECK_EQUAL(vMissing[0], 2);
+
+    // Too few or too many transactions in the reply
+    CBlock rebuilt;
+    BOOST_CHECK_EQUAL(partial.FillBlock(rebuilt, vector<CTransaction>()), READ_STATUS_INVALID);
+    BOOST_CHECK_EQUAL(partial.FillBlock(rebuilt, vector<CTransaction>(2, block.vtx[2])), READ_STATUS_INVALID);
+
+    // The wrong transaction does not match the merkle root
+    BOOST_CHECK_EQUAL(partial.FillBlock(rebuilt, vector<CTransaction>(1, block.vtx[1])), READ_STATUS_FAILED);
+
+    BOOST_CHECK_EQUAL(partial.FillBlock(rebuilt, vector<CTransaction>(1, block.vtx[2])), READ_STATUS_OK);
+    BOOST_CHECK(rebuilt.GetHash() == block.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(compact_block_invalid)
+{
+    CBlock block = BuildBlock();
+    CTxMemPool pool;
+
+    // A prefilled index past the end of the block
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    cmpctblock.vPrefilledTxn[0].nIndex = block.vtx.size();
+    CPartialBlock partial;
+    BOOST_CHECK_EQUAL(partial.InitData(RoundTrip(cmpctblock), pool), READ_STATUS_INVALID);
+
+    // Duplicate short ids can not be resolved
+    cmpctblock = CBlockHeaderAndShortTxIDs(block);
+    cmpctblock.vShortTxIDs[1] = cmpctblock.vShortTxIDs[0];
+    BOOST_CHECK_EQUAL(partial.InitData(RoundTrip(cmpctblock), pool), READ_STATUS_FAILED);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
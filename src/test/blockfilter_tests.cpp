@@ -0,0 +1,101 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "core.h"
+#include "main.h"
+#include "util.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockfilter_tests)
+
+BOOST_AUTO_TEST_CASE(blockfilter_bip158_vector)
+{
+    // The basic filter of the testnet genesis block, whose only element is
+    // the script of its coinbase output
+    uint256 hashBlock("000000000933ea01ad0ee984209779baaec3ced90fa3f408719526f8d77f4943");
+    CBlockFilterElementSet elements;
+    elements.insert(ParseHex("4104678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5fac"));
+
+    CBlockFilter filter(hashBlock, elements);
+    BOOST_CHECK_EQUAL(HexStr(filter.GetEncoded()), "019dfca8");
+    BOOST_CHECK_EQUAL(filter.ComputeHeader(uint256(0)).GetHex(), "21584579b7eb08997773e5aeff3a7f932700042d0ed2a6129012b7d7ae81b750");
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_match)
+{
+    uint256 hashBlock = GetRandHash();
+    CBlockFilterElementSet included, excluded;
+    for (int i = 0; i < 100; i++)
+    {
+        uint256 hash = GetRandHash();
+        vector<unsigned char> vElement(hash.begin(), hash.begin() + 20 + i % 13);
+        included.insert(vElement);
+        vElement[0] ^= 1;
+        excluded.insert(vElement);
+    }
+
+    CBlockFilter filter(hashBlock, included);
+    BOOST_CHECK_EQUAL(filter.GetElementCount(), 100U);
+    BOOST_FOREACH(const vector<unsigned char>& vElement, included)
+        BOOST_CHECK(filter.Match(vElement));
+    BOOST_CHECK(filter.MatchAny(included));
+
+    // One false positive in 784931 on average
+    unsigned int nFalsePositives = 0;
+    BOOST_FOREACH(const vector<unsigned char>& vElement, excluded)
+        nFalsePositives += filter.Match(vElement);
+    BOOST_CHECK(nFalsePositives <= 1);
+
+    CBlockFilterElementSet mixed = excluded;
+    mixed.insert(*included.rbegin());
+    BOOST_CHECK(filter.MatchAny(mixed));
+
+    // Decoded from its serialization, as read back from the index
+    CBlockFilter decoded(hashBlock, filter.GetEncoded());
+    BOOST_CHECK_EQUAL(decoded.GetElementCount(), 100U);
+    BOOST_CHECK(decoded.GetHash() == filter.GetHash());
+    BOOST_CHECK(decoded.MatchAny(included));
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_block_elements)
+{
+    CBlock block;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.SetNull();
+    tx.vout.resize(3);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[1].scriptPubKey = CScript() << OP_RETURN << OP_11;
+    tx.vout[2].scriptPubKey = CScript();
+    block.vtx.push_back(tx);
+
+    CBlockUndo blockundo;
+    blockundo.vtxundo.resize(1);
+    CTxOut spent;
+    spent.scriptPubKey = CScript() << OP_12 << OP_EQUAL;
+    blockundo.vtxundo[0].vprevout.push_back(CTxInUndo(spent));
+
+    // Outputs other than the empty and OP_RETURN ones, and the spent scripts
+    CBlockFilter filter(block, blockundo);
+    BOOST_CHECK_EQUAL(filter.GetElementCount(), 2U);
+    const CScript& script0 = tx.vout[0].scriptPubKey;
+    const CScript& script1 = tx.vout[1].scriptPubKey;
+    BOOST_CHECK(filter.Match(vector<unsigned char>(script0.begin(), script0.end())));
+    BOOST_CHECK(filter.Match(vector<unsigned char>(spent.scriptPubKey.begin(), spent.scriptPubKey.end())));
+    BOOST_CHECK(!filter.Match(vector<unsigned char>(script1.begin(), script1.end())));
+
+    // An empty filter is its count alone
+    CBlockFilter empty(block.GetHash(), CBlockFilterElementSet());
+    BOOST_CHECK_EQUAL(HexStr(empty.GetEncoded()), "00");
+    BOOST_CHECK(!empty.Match(vector<unsigned char>(script0.begin(), script0.end())));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
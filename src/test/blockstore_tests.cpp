@@ -0,0 +1,266 @@
+// Copyright (c) 2014 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockstore.h"
+
+#include "chainparams.h"
+#include "core.h"
+#include "main.h"
+#include "script.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+// Files far beyond the ones the test setup writes to
+static const int TEST_FILE = 90000;
+
+// Append a block record (magic, size, payload) to a test block file and
+// return the position of its payload.
+static CDiskBlockPos AppendRecord(int nFile, const std::string &payload)
+{
+    boost::filesystem::path path = GetDataDir() / "blocks" / strprintf("blk%05u.dat", nFile);
+    boost::filesystem::create_directories(path.parent_path());
+    FILE *file = fopen(path.string().c_str(), "ab");
+    BOOST_REQUIRE(file);
+    unsigned int nSize = payload.size();
+    fwrite(Params().MessageStart(), 1, MESSAGE_START_SIZE, file);
+    fwrite(&nSize, 1, sizeof(nSize), file);
+    CDiskBlockPos pos(nFile, ftell(file));
+    fwrite(payload.data(), 1, payload.size(), file);
+    fclose(file);
+    return pos;
+}
+
+BOOST_AUTO_TEST_SUITE(blockstore_tests)
+
+BOOST_AUTO_TEST_CASE(blockstore_read)
+{
+    CBlockFileMapper mapper(2);
+    CRawBlock raw;
+    std::string strFirst(100, 'a'), strSecond(200, 'b');
+
+    CDiskBlockPos posFirst = AppendRecord(TEST_FILE, strFirst);
+    BOOST_CHECK(mapper.Read(posFirst, raw));
+    BOOST_CHECK(std::string(raw.begin(), raw.end()) == strFirst);
+
+    // The file grows after it was mapped; the old view stays valid
+    CDiskBlockPos posSecond = AppendRecord(TEST_FILE, strSecond);
+    CRawBlock rawSecond;
+    BOOST_CHECK(mapper.Read(posSecond, rawSecond));
+    BOOST_CHECK(std::string(rawSecond.begin(), rawSecond.end()) == strSecond);
+    BOOST_CHECK(std::string(raw.begin(), raw.end()) == strFirst);
+
+    // Not a block record, and a missing file
+    BOOST_CHECK(!mapper.Read(CDiskBlockPos(TEST_FILE, posFirst.nPos + 1), raw));
+    BOOST_CHECK(!mapper.Read(CDiskBlockPos(TEST_FILE + 9, 8), raw));
+    BOOST_CHECK(!mapper.Read(CDiskBlockPos(), raw));
+}
+
+BOOST_AUTO_TEST_CASE(blockstore_eviction)
+{
+    CBlockFileMapper mapper(1);
+    std::string strPayload(150, 'c');
+    CDiskBlockPos pos1 = AppendRecord(TEST_FILE + 1, strPayload);
+    CDiskBlockPos pos2 = AppendRecord(TEST_FILE + 2, strPayload);
+
+    // A view outlives the eviction of its mapping
+    CRawBlock raw1, raw2;
+    BOOST_CHECK(mapper.Read(pos1, raw1));
+    BOOST_CHECK(mapper.Read(pos2, raw2));
+    BOOST_CHECK(std::string(raw1.begin(), raw1.end()) == strPayload);
+    BOOST_CHECK(mapper.Read(pos1, raw1));
+    mapper.Invalidate(TEST_FILE + 1);
+    BOOST_CHECK(std::string(raw1.begin(), raw1.end()) == strPayload);
+
+    // Disabled, nothing is mapped
+    mapper.SetMaxFiles(0);
+    BOOST_CHECK(!mapper.IsEnabled());
+    BOOST_CHECK(!mapper.Read(pos1, raw1));
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_lru)
+{
+    std::vector<CBlock> blocks(4);
+    for (unsigned int i = 0; i < blocks.size(); i++) {
+        CMutableTransaction tx;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = i;
+        tx.vout[0].scriptPubKey = CScript() << std::vector<unsigned char>(10000, i);
+        blocks[i].vtx.push_back(tx);
+        blocks[i].nNonce = i;
+    }
+    unsigned int nBlockSize = ::GetSerializeSize(blocks[0], SER_NETWORK, PROTOCOL_VERSION);
+
+    // Room for about two blocks
+    CBlockCache cache(7 * nBlockSize);
+    cache.Add(blocks[0]);
+    cache.Add(blocks[1]);
+    cache.Add(blocks[1]);
+    BOOST_CHECK_EQUAL(cache.GetCount(), 2U);
+
+    CBlock block;
+    BOOST_CHECK(cache.Get(blocks[1].GetHash(), block));
+    BOOST_CHECK(block.GetHash() == blocks[1].GetHash());
+    CRawBlock raw;
+    BOOST_CHECK(cache.GetRaw(blocks[1].GetHash(), raw));
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << blocks[1];
+    BOOST_CHECK(std::string(raw.begin(), raw.end()) == ss.str());
+    std::vector<uint256> vTxid;
+    BOOST_CHECK(cache.GetTxids(blocks[1].GetHash(), vTxid));
+    BOOST_CHECK(vTxid.size() == 1 && vTxid[0] == blocks[1].vtx[0].GetHash());
+
+    // Using block 0 makes block 1 the one to go
+    BOOST_CHECK(cache.Get(blocks[0].GetHash(), block));
+    cache.Add(blocks[2]);
+    BOOST_CHECK_EQUAL(cache.GetCount(), 2U);
+    BOOST_CHECK(!cache.Get(blocks[1].GetHash(), block));
+    BOOST_CHECK(cache.Get(blocks[0].GetHash(), block));
+    BOOST_CHECK(cache.Get(blocks[2].GetHash(), block));
+
+    // A view outlives the eviction of its block
+    cache.SetMaxUsage(0);
+    BOOST_CHECK_EQUAL(cache.GetCount(), 0U);
+    BOOST_CHECK(std::string(raw.begin(), raw.end()) == ss.str());
+    cache.Add(blocks[3]);
+    BOOST_CHECK_EQUAL(cache.GetUsage(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(rawblock_reader)
+{
+    // One transaction of a block, read at its offset after the header
+    CBlock block;
+    CMutableTransaction txOut;
+    txOut.vout.resize(1);
+    txOut.vout[0].nValue = 42;
+    block.vtx.resize(1);
+    block.vtx.push_back(txOut);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << block;
+    std::string strBlock = ss.str();
+    CRawBlock raw(boost::shared_ptr<const void>(), strBlock.data(), strBlock.size());
+
+    unsigned int nOffset = 80 + GetSizeOfCompactSize(2) + ::GetSerializeSize(block.vtx[0], SER_DISK, CLIENT_VERSION);
+    CRawBlockReader reader(raw, nOffset, SER_DISK, CLIENT_VERSION);
+    CTransaction tx;
+    reader >> tx;
+    BOOST_CHECK(tx.GetHash() == block.vtx[1].GetHash());
+
+    // Past the end of the block
+    CRawBlockReader readerEnd(raw, strBlock.size() - 2, SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK_THROW(readerEnd >> tx, std::ios_base::failure);
+}
+
+// Records written with and without compression read back the same, from the
+// file and through a mapping
+BOOST_AUTO_TEST_CASE(diskrecord_roundtrip)
+{
+    boost::filesystem::path path = GetDataDir() / "blocks" / strprintf("blk%05u.dat", TEST_FILE + 3);
+    boost::filesystem::create_directories(path.parent_path());
+    std::string strPayload(1000, 'd');
+    strPayload += std::string(80, 'e');
+
+    for (int nLevel = 0; nLevel <= 3; nLevel += 3) {
+        CDiskRecord record(strPayload.data(), strPayload.size(), nLevel);
+        bool fCompressed = nLevel > 0 && CanCompressDiskRecords();
+        BOOST_CHECK_EQUAL((record.nSizeField & DISK_RECORD_COMPRESSED) != 0, fCompressed);
+        BOOST_CHECK_EQUAL(record.GetDiskSize(), 8 + (record.nSizeField & ~DISK_RECORD_COMPRESSED));
+        if (!fCompressed)
+            BOOST_CHECK(std::string(record.vch.begin(), record.vch.end()) == strPayload);
+
+        CDiskBlockPos pos(TEST_FILE + 3, 0);
+        {
+            CAutoFile fileout(fopen(path.string().c_str(), "ab"), SER_DISK, CLIENT_VERSION);
+            BOOST_REQUIRE(!!fileout);
+            BOOST_CHECK(WriteDiskRecord(fileout, record, pos.nPos));
+        }
+
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(!!filein);
+        fseek(filein, pos.nPos - 8, SEEK_SET);
+        std::vector<char> vch;
+        BOOST_CHECK(ReadDiskRecord(filein, MAX_BLOCK_SIZE, vch));
+        BOOST_CHECK(std::string(vch.begin(), vch.end()) == strPayload);
+
+        CBlockFileMapper mapper(1);
+        CRawBlock raw;
+        BOOST_CHECK(mapper.Read(pos, raw));
+        BOOST_CHECK(std::string(raw.begin(), raw.end()) == strPayload);
+    }
+
+    // Too large for the limit
+    CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    std::vector<char> vch;
+    BOOST_CHECK(!ReadDiskRecord(filein, 100, vch));
+}
+
+BOOST_AUTO_TEST_CASE(txcache_lru)
+{
+    std::vector<CTransaction> txs;
+    for (unsigned int i = 0; i < 3; i++) {
+        CMutableTransaction tx;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << std::vector<unsigned char>(1000, i);
+        txs.push_back(tx);
+    }
+    unsigned int nTxSize = ::GetSerializeSize(txs[0], SER_NETWORK, PROTOCOL_VERSION);
+
+    // Room for about two transactions
+    CTxCache cache(5 * nTxSize);
+    uint256 hashBlock = GetRandHash();
+    cache.Add(txs[0].GetHash(), txs[0], hashBlock);
+    cache.Add(txs[1].GetHash(), txs[1], hashBlock);
+
+    CTransaction tx;
+    uint256 hashBlockRead;
+    BOOST_CHECK(cache.Get(txs[0].GetHash(), tx, hashBlockRead));
+    BOOST_CHECK(tx.GetHash() == txs[0].GetHash());
+    BOOST_CHECK(hashBlockRead == hashBlock);
+
+    // Using transaction 0 makes transaction 1 the one to go
+    cache.Add(txs[2].GetHash(), txs[2], hashBlock);
+    BOOST_CHECK(!cache.Get(txs[1].GetHash(), tx, hashBlockRead));
+    BOOST_CHECK(cache.Get(txs[0].GetHash(), tx, hashBlockRead));
+    BOOST_CHECK(cache.Get(txs[2].GetHash(), tx, hashBlockRead));
+
+    cache.Clear();
+    BOOST_CHECK(!cache.Get(txs[0].GetHash(), tx, hashBlockRead));
+}
+
+BOOST_AUTO_TEST_CASE(txidcache_lru)
+{
+    std::vector<std::vector<uint256> > txids(3);
+    std::vector<uint256> hashes;
+    for (unsigned int i = 0; i < txids.size(); i++) {
+        txids[i].resize(100);
+        for (unsigned int j = 0; j < txids[i].size(); j++)
+            txids[i][j] = GetRandHash();
+        hashes.push_back(GetRandHash());
+    }
+
+    // Room for about two blocks
+    CTxidCache cache(250 * sizeof(uint256));
+    cache.Add(hashes[0], txids[0]);
+    cache.Add(hashes[1], txids[1]);
+
+    std::vector<uint256> vTxid;
+    BOOST_CHECK(cache.Get(hashes[0], vTxid));
+    BOOST_CHECK(vTxid == txids[0]);
+
+    // Using block 0 makes block 1 the one to go
+    cache.Add(hashes[2], txids[2]);
+    BOOST_CHECK(!cache.Get(hashes[1], vTxid));
+    BOOST_CHECK(cache.Get(hashes[0], vTxid));
+    BOOST_CHECK(cache.Get(hashes[2], vTxid));
+    BOOST_CHECK(vTxid == txids[2]);
+
+    cache.SetMaxUsage(0);
+    BOOST_CHECK(!cache.Get(hashes[0], vTxid));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -451,4 +451,90 @@ BOOST_AUTO_TEST_CASE(merkle_block_4_test_update_none)
     BOOST_CHECK(!filter.contains(COutPoint(uint256("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"), 0)));
 }
 
+// A merkle block built from txids proves the same as one built by a filter
+// matching the same transactions
+BOOST_AUTO_TEST_CASE(merkle_block_from_txids)
+{
+    CBlock block;
+    vector<uint256> vTxid;
+    for (unsigned int i = 0; i < 7; i++) {
+        CMutableTransaction tx;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = i;
+        block.vtx.push_back(tx);
+        vTxid.push_back(block.vtx.back().GetHash());
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    set<uint256> setTxids;
+    setTxids.insert(vTxid[2]);
+    setTxids.insert(vTxid[6]);
+    CMerkleBlock merkleBlock(block.GetBlockHeader(), vTxid, setTxids);
+    BOOST_CHECK(merkleBlock.header.GetHash() == block.GetHash());
+    BOOST_CHECK(merkleBlock.vMatchedTxn.size() == 2);
+    BOOST_CHECK(merkleBlock.vMatchedTxn[0] == make_pair(2U, vTxid[2]));
+    BOOST_CHECK(merkleBlock.vMatchedTxn[1] == make_pair(6U, vTxid[6]));
+
+    vector<uint256> vMatched;
+    BOOST_CHECK(merkleBlock.txn.ExtractMatches(vMatched) == block.hashMerkleRoot);
+    BOOST_CHECK(vMatched.size() == 2);
+    BOOST_CHECK(vMatched[0] == vTxid[2] && vMatched[1] == vTxid[6]);
+
+    CBloomFilter filter(10, 0.000001, 0, BLOOM_UPDATE_NONE);
+    filter.insert(vTxid[2]);
+    filter.insert(vTxid[6]);
+    CMerkleBlock merkleBlockFilter(block, filter);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION), ssFilter(SER_NETWORK, PROTOCOL_VERSION);
+    ss << merkleBlock;
+    ssFilter << merkleBlockFilter;
+    BOOST_CHECK(ss.str() == ssFilter.str());
+
+    // A txid not in the block matches nothing
+    setTxids.clear();
+    setTxids.insert(GetRandHash());
+    BOOST_CHECK(CMerkleBlock(block.GetBlockHeader(), vTxid, setTxids).vMatchedTxn.empty());
+}
+
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    // Holds at least the latest 100 entries, and at most 150
+    CRollingBloomFilter rb(100, 0.01);
+
+    vector<uint256> vHashes;
+    for (int i = 0; i < 400; i++)
+        vHashes.push_back(GetRandHash());
+
+    for (int i = 0; i < 100; i++)
+        rb.insert(vHashes[i]);
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(rb.contains(vHashes[i]));
+
+    // With three generations of 50, the oldest are gone once 150 newer
+    // entries are in; the latest 100 always stay
+    for (int i = 100; i < 400; i++)
+    {
+        rb.insert(vHashes[i]);
+        for (int j = max(0, i - 99); j <= i; j++)
+            BOOST_CHECK(rb.contains(vHashes[j]));
+    }
+    int nFalsePositives = 0;
+    for (int i = 0; i < 200; i++)
+        if (rb.contains(vHashes[i]))
+            nFalsePositives++;
+    BOOST_CHECK(nFalsePositives < 20);
+
+    int nNew = 0;
+    for (int i = 0; i < 1000; i++)
+        if (rb.contains(GetRandHash()))
+            nNew++;
+    BOOST_CHECK(nNew < 50);
+
+    rb.reset();
+    int nAfterReset = 0;
+    for (int i = 300; i < 400; i++)
+        if (rb.contains(vHashes[i]))
+            nAfterReset++;
+    BOOST_CHECK_EQUAL(nAfterReset, 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,88 @@
+// Copyright (c) 2014 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+// Counts how often it is run, and fails if asked to
+class CCountingCheck
+{
+private:
+    boost::mutex *pmutex;
+    unsigned int *pnCount;
+    bool fResult;
+
+public:
+    CCountingCheck() : pmutex(NULL), pnCount(NULL), fResult(true) {}
+    CCountingCheck(boost::mutex *pmutexIn, unsigned int *pnCountIn, bool fResultIn = true) :
+        pmutex(pmutexIn), pnCount(pnCountIn), fResult(fResultIn) {}
+
+    bool operator()() {
+        boost::unique_lock<boost::mutex> lock(*pmutex);
+        (*pnCount)++;
+        return fResult;
+    }
+
+    void swap(CCountingCheck &check) {
+        std::swap(pmutex, check.pmutex);
+        std::swap(pnCount, check.pnCount);
+        std::swap(fResult, check.fResult);
+    }
+};
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+BOOST_AUTO_TEST_CASE(checkqueue_rounds)
+{
+    CCheckQueue<CCountingCheck> queue(16);
+    boost::thread_group threads;
+    for (int i = 0; i < 4; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CCountingCheck>::Thread, &queue));
+
+    boost::mutex mutex;
+    unsigned int nCount = 0;
+    for (unsigned int nRound = 0; nRound < 20; nRound++) {
+        unsigned int nChecks = 1 + nRound * 37;
+        {
+            CCheckQueueControl<CCountingCheck> control(&queue);
+            // Many small batches and a large one
+            for (unsigned int i = 0; i < nChecks; i++) {
+                std::vector<CCountingCheck> vChecks(1, CCountingCheck(&mutex, &nCount));
+                control.Add(vChecks);
+            }
+            std::vector<CCountingCheck> vChecks(nChecks, CCountingCheck(&mutex, &nCount));
+            control.Add(vChecks);
+            BOOST_CHECK(control.Wait());
+            BOOST_CHECK_EQUAL(control.GetStats().nChecks, 2 * nChecks);
+        }
+        boost::unique_lock<boost::mutex> lock(mutex);
+        BOOST_CHECK_EQUAL(nCount, 2 * nChecks);
+        nCount = 0;
+    }
+
+    // A failure is reported once, and does not carry over into the next round
+    {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        std::vector<CCountingCheck> vChecks(100, CCountingCheck(&mutex, &nCount));
+        vChecks[50] = CCountingCheck(&mutex, &nCount, false);
+        control.Add(vChecks);
+        BOOST_CHECK(!control.Wait());
+    }
+    {
+        CCheckQueueControl<CCountingCheck> control(&queue);
+        std::vector<CCountingCheck> vChecks(100, CCountingCheck(&mutex, &nCount));
+        control.Add(vChecks);
+        BOOST_CHECK(control.Wait());
+    }
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
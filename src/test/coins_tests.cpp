@@ -0,0 +1,404 @@
+// Copyright (c) 2014 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coins.h"
+
+#include "key.h"
+#include "script.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <map>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+namespace
+{
+class CCoinsViewTest : public CCoinsView
+{
+    uint256 hashBestBlock_;
+    std::map<COutPoint, CCoin> map_;
+    CCoinsTotals totals_;
+
+public:
+    size_t nWrites;
+
+    CCoinsViewTest() : hashBestBlock_(0), nWrites(0) {}
+
+    bool GetCoin(const COutPoint& outpoint, CCoin& coin)
+    {
+        std::map<COutPoint, CCoin>::const_iterator it = map_.find(outpoint);
+        if (it == map_.end())
+            return false;
+        coin = it->second;
+        // Randomly pretend spent entries do not exist.
+        if (coin.IsSpent() && insecure_rand() % 2 == 0)
+            return false;
+        return true;
+    }
+
+    bool HaveCoin(const COutPoint& outpoint)
+    {
+        CCoin coin;
+        return GetCoin(outpoint, coin) && !coin.IsSpent();
+    }
+
+    uint256 GetBestBlock() { return hashBestBlock_; }
+
+    bool GetStats(CCoinsStats& stats)
+    {
+        stats.hashBlock = hashBestBlock_;
+        stats.SetTotals(totals_);
+        return true;
+    }
+
+    bool BatchWrite(const CCoinsMap& mapCoins, const uint256& hashBlock, const CCoinsTotals& totalsDelta)
+    {
+        for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+            if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+                continue;
+            // Like CCoinsViewDB, skip entries we never had in the first place.
+            if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coin.IsSpent())
+                continue;
+            nWrites++;
+            map_[it->first] = it->second.coin;
+            // Randomly delete spent entries on write.
+            if (it->second.coin.IsSpent() && insecure_rand() % 3 == 0)
+                map_.erase(it->first);
+        }
+        if (hashBlock != 0)
+            hashBestBlock_ = hashBlock;
+        totals_ += totalsDelta;
+        return true;
+    }
+};
+
+// Lets the test hold up the writes of a CCoinsViewAsyncDB, and tells which
+// thread did the last one.
+boost::mutex csPrepare;
+boost::thread::id idPrepare;
+
+bool PrepareWrite()
+{
+    boost::unique_lock<boost::mutex> lock(csPrepare);
+    idPrepare = boost::this_thread::get_id();
+    return true;
+}
+}
+
+BOOST_AUTO_TEST_SUITE(coins_tests)
+
+static const unsigned int NUM_SIMULATION_ITERATIONS = 40000;
+
+// This is a large randomized test for CCoinsViewCache and its behaviour as a
+// stack of caches on top of a backing view. A reference map is kept next to
+// it, and every change is applied to both; after every step all caches must
+// agree with the reference, regardless of how entries were flushed.
+BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
+{
+    // A simple map to track what we expect the cache stack to represent.
+    std::map<COutPoint, CCoin> result;
+
+    // The cache stack.
+    CCoinsViewTest base; // A CCoinsViewTest at the bottom.
+    std::vector<CCoinsViewCache*> stack; // A stack of CCoinsViewCaches on top.
+    stack.push_back(new CCoinsViewCache(base, false)); // Start with one cache.
+
+    // Use a limited set of random outpoints, so we do test overwriting entries.
+    std::vector<COutPoint> outpoints;
+    outpoints.resize(NUM_SIMULATION_ITERATIONS / 8);
+    for (unsigned int i = 0; i < outpoints.size(); i++)
+        outpoints[i] = COutPoint(GetRandHash(), insecure_rand() % 4);
+
+    for (unsigned int i = 0; i < NUM_SIMULATION_ITERATIONS; i++) {
+        // Do a random modification.
+        {
+            const COutPoint& outpoint = outpoints[insecure_rand() % outpoints.size()]; // outpoint we're going to modify in this iteration.
+            CCoin& coin = result[outpoint];
+            const CCoin& entry = stack.back()->AccessCoin(outpoint);
+            BOOST_CHECK(coin == entry);
+            BOOST_CHECK_EQUAL(stack.back()->HaveCoin(outpoint), !coin.IsSpent());
+
+            if (coin.IsSpent()) {
+                CCoin newcoin;
+                newcoin.out.nValue = insecure_rand() % 1000000 + 1;
+                newcoin.out.scriptPubKey.assign(insecure_rand() % 64, 0x51);
+                newcoin.nHeight = insecure_rand() % 10000;
+                newcoin.fCoinBase = insecure_rand() % 2 == 0;
+                // Occasionally claim a possible overwrite even though the outpoint is unspent.
+                stack.back()->AddCoin(outpoint, newcoin, insecure_rand() % 4 == 0);
+                coin = newcoin;
+            } else if (insecure_rand() % 5 == 0) {
+                // Replace an unspent coin, as a duplicate coinbase would.
+                CCoin newcoin(coin.out, coin.nHeight + 1, true);
+                stack.back()->AddCoin(outpoint, newcoin, true);
+                coin = newcoin;
+            } else {
+                CCoin spent;
+                BOOST_CHECK(stack.back()->SpendCoin(outpoint, &spent));
+                BOOST_CHECK(spent == coin);
+                coin.Clear();
+            }
+        }
+
+        // Once every 1000 iterations and at the end, verify the full cache.
+        if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
+            for (std::map<COutPoint, CCoin>::iterator it = result.begin(); it != result.end(); it++) {
+                CCoin coin;
+                bool fHave = stack.back()->GetCoin(it->first, coin);
+                if (fHave)
+                    BOOST_CHECK(coin == it->second);
+                else
+                    BOOST_CHECK(it->second.IsSpent());
+            }
+        }
+
+        if (insecure_rand() % 100 == 0) {
+            // Every 100 iterations, flush an intermediate cache, either
+            // dropping or retaining its entries.
+            if (stack.size() > 1 && insecure_rand() % 2 == 0) {
+                unsigned int flushIndex = insecure_rand() % (stack.size() - 1);
+                BOOST_CHECK(stack[flushIndex]->Flush(insecure_rand() % 2 == 0));
+            }
+        }
+        if (insecure_rand() % 100 == 0) {
+            // Every 100 iterations, change the cache stack.
+            if (stack.size() > 0 && insecure_rand() % 2 == 0) {
+                BOOST_CHECK(stack.back()->Flush(insecure_rand() % 2 == 0));
+                delete stack.back();
+                stack.pop_back();
+            }
+            if (stack.size() == 0 || (stack.size() < 4 && insecure_rand() % 2)) {
+                CCoinsView* tip = &base;
+                if (stack.size() > 0)
+                    tip = stack.back();
+                stack.push_back(new CCoinsViewCache(*tip, false));
+            }
+        }
+    }
+
+    // The totals seen through the top cache must match the reference, both
+    // before and after everything has been flushed down to the base.
+    CCoinsTotals totals;
+    for (std::map<COutPoint, CCoin>::iterator it = result.begin(); it != result.end(); it++) {
+        if (!it->second.IsSpent())
+            totals.Add(it->first, it->second);
+    }
+    CCoinsStats stats;
+    BOOST_CHECK(stack.back()->GetStats(stats));
+    BOOST_CHECK(stats.nTransactionOutputs == (uint64_t)totals.nOutputs);
+    BOOST_CHECK(stats.nTotalAmount == totals.nAmount);
+    BOOST_CHECK(stats.nSerializedSize == (uint64_t)totals.nSerializedSize);
+    BOOST_CHECK(stats.hashSet == totals.hashSet);
+
+    // Clean up the stack.
+    while (stack.size() > 0) {
+        BOOST_CHECK(stack.back()->Flush());
+        delete stack.back();
+        stack.pop_back();
+    }
+    BOOST_CHECK(base.GetStats(stats));
+    BOOST_CHECK(stats.nTransactionOutputs == (uint64_t)totals.nOutputs);
+    BOOST_CHECK(stats.hashSet == totals.hashSet);
+}
+
+// Entries that are created and spent again within a cache, or that were
+// only read, must not be written to the parent view.
+BOOST_AUTO_TEST_CASE(coins_cache_flush_dirty_only)
+{
+    CCoinsViewTest base;
+    CCoin coin(CTxOut(1, CScript() << OP_TRUE), 1, false);
+
+    COutPoint outKept(GetRandHash(), 0);
+    COutPoint outSpent(GetRandHash(), 1);
+    {
+        CCoinsViewCache cache(base, false);
+        cache.AddCoin(outKept, coin, false);
+        cache.AddCoin(outSpent, coin, false);
+        BOOST_CHECK(cache.SpendCoin(outSpent));
+        BOOST_CHECK(!cache.SpendCoin(outSpent));
+        BOOST_CHECK(cache.Flush(true));
+        BOOST_CHECK_EQUAL(base.nWrites, 1U);
+
+        // The unspent entry is still cached and no longer dirty.
+        BOOST_CHECK_EQUAL(cache.GetCacheSize(), 1U);
+        BOOST_CHECK(cache.AccessCoin(outKept) == coin);
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK_EQUAL(base.nWrites, 1U);
+        BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0U);
+    }
+
+    CCoin result;
+    BOOST_CHECK(base.GetCoin(outKept, result));
+    BOOST_CHECK(result == coin);
+    BOOST_CHECK(!base.HaveCoin(outSpent));
+}
+
+// Prefetched coins are cached as clean entries and never replace what the
+// cache already knows about an outpoint.
+BOOST_AUTO_TEST_CASE(coins_cache_add_fetched)
+{
+    CCoinsViewTest base;
+    CCoin coin(CTxOut(1, CScript() << OP_TRUE), 1, false);
+    CCoin coinOther(CTxOut(2, CScript() << OP_TRUE), 2, false);
+
+    COutPoint outFetched(GetRandHash(), 0);
+    COutPoint outSpent(GetRandHash(), 0);
+    {
+        CCoinsViewCache cache(base, false);
+        cache.AddCoin(outSpent, coin, false);
+        BOOST_CHECK(cache.Flush(true));
+        BOOST_CHECK(cache.SpendCoin(outSpent));
+        size_t nWrites = base.nWrites;
+
+        cache.AddFetchedCoin(outFetched, coin);
+        cache.AddFetchedCoin(outFetched, coinOther);
+        cache.AddFetchedCoin(outSpent, coin);
+        BOOST_CHECK(cache.AccessCoin(outFetched) == coin);
+        BOOST_CHECK(!cache.HaveCoin(outSpent));
+
+        // Only the spend reaches the base view.
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK_EQUAL(base.nWrites, nWrites + 1);
+    }
+    BOOST_CHECK(!base.HaveCoin(outFetched));
+    BOOST_CHECK(!base.HaveCoin(outSpent));
+}
+
+// Flushing a child cache without retaining moves its coins into the parent,
+// both into an empty parent and when merging with existing entries.
+BOOST_AUTO_TEST_CASE(coins_cache_flush_move)
+{
+    CCoinsViewTest base;
+    CCoin coin(CTxOut(1, CScript() << OP_TRUE), 1, false);
+    CCoin coinOther(CTxOut(2, CScript() << OP_FALSE << OP_TRUE), 2, true);
+
+    CCoin swapped(coin);
+    swapped.swap(coinOther);
+    BOOST_CHECK(swapped.out.nValue == 2 && swapped.fCoinBase && swapped.nHeight == 2);
+    BOOST_CHECK(coinOther == coin);
+    swapped.swap(coinOther);
+
+    COutPoint outA(GetRandHash(), 0);
+    COutPoint outB(GetRandHash(), 0);
+    COutPoint outC(GetRandHash(), 0);
+    CCoinsViewCache parent(base, false);
+    {
+        CCoinsViewCache child(parent, false);
+        child.AddCoin(outA, coin, false);
+        child.AddCoin(outB, coin, false);
+        BOOST_CHECK(child.Flush());
+        BOOST_CHECK_EQUAL(child.GetCacheSize(), 0U);
+    }
+    BOOST_CHECK_EQUAL(parent.GetCacheSize(), 2U);
+    BOOST_CHECK_EQUAL(parent.GetDirtyCount(), 2U);
+    {
+        CCoinsViewCache child(parent, false);
+        BOOST_CHECK(child.SpendCoin(outA));
+        child.AddCoin(outC, coinOther, false);
+        BOOST_CHECK(child.AccessCoin(outB) == coin);
+        BOOST_CHECK(child.Flush());
+    }
+    // The spent entry was fresh in the parent, so it is gone altogether.
+    BOOST_CHECK_EQUAL(parent.GetCacheSize(), 2U);
+    BOOST_CHECK(!parent.HaveCoin(outA));
+    BOOST_CHECK(parent.AccessCoin(outB) == coin);
+    BOOST_CHECK(parent.AccessCoin(outC) == coinOther);
+
+    BOOST_CHECK(parent.Flush());
+    BOOST_CHECK(!base.HaveCoin(outA));
+    BOOST_CHECK(base.HaveCoin(outB));
+    BOOST_CHECK(base.HaveCoin(outC));
+}
+
+// Check the compact serialization of a single coin against a known encoding.
+BOOST_AUTO_TEST_CASE(coin_serialization)
+{
+    CDataStream ss(ParseHex("97f23c835800816115944e077fe7c803cfa57f29b36bf87c1d35"), SER_DISK, CLIENT_VERSION);
+    CCoin coin;
+    ss >> coin;
+    BOOST_CHECK_EQUAL(coin.IsCoinBase(), false);
+    BOOST_CHECK_EQUAL(coin.nHeight, 203998U);
+    BOOST_CHECK_EQUAL(coin.out.nValue, 60000000000LL);
+    CScript scriptExpected;
+    scriptExpected.SetDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35"))));
+    BOOST_CHECK(coin.out.scriptPubKey == scriptExpected);
+
+    CDataStream ssOut(SER_DISK, CLIENT_VERSION);
+    ssOut << coin;
+    BOOST_CHECK_EQUAL(HexStr(ssOut.begin(), ssOut.end()), "97f23c835800816115944e077fe7c803cfa57f29b36bf87c1d35");
+    BOOST_CHECK_EQUAL(::GetSerializeSize(coin, SER_DISK, CLIENT_VERSION), ssOut.size());
+}
+
+// Batches handed to CCoinsViewAsyncDB must remain visible while they are
+// being written in the background, and reach the base view afterwards.
+BOOST_AUTO_TEST_CASE(coins_async_flush)
+{
+    CCoinsViewTest base;
+    CCoinsViewAsyncDB async(base, &PrepareWrite);
+    boost::thread flusher(boost::bind(&CCoinsViewAsyncDB::ThreadFlush, &async));
+
+    // Wait until batches are written by the flusher thread.
+    CCoinsMap mapEmpty;
+    for (int i = 0; i < 1000 && idPrepare != flusher.get_id(); i++) {
+        BOOST_CHECK(async.BatchWrite(mapEmpty, uint256(0), CCoinsTotals()));
+        BOOST_CHECK(async.Sync());
+        if (idPrepare != flusher.get_id())
+            MilliSleep(1);
+    }
+    BOOST_CHECK(idPrepare == flusher.get_id());
+
+    COutPoint outpoint(GetRandHash(), 0);
+    CCoin coin(CTxOut(5, CScript() << OP_TRUE), 10, false);
+    uint256 hashBlock = GetRandHash();
+    {
+        boost::unique_lock<boost::mutex> lock(csPrepare);
+        CCoinsViewCache cache(async, false);
+        cache.AddCoin(outpoint, coin, false);
+        BOOST_CHECK(cache.SetBestBlock(hashBlock));
+        BOOST_CHECK(cache.Flush());
+
+        // The write is held up, but lookups already see the new state.
+        BOOST_CHECK(async.GetFlushStats().fPending);
+        BOOST_CHECK(!base.HaveCoin(outpoint));
+        CCoin result;
+        BOOST_CHECK(async.GetCoin(outpoint, result));
+        BOOST_CHECK(result == coin);
+        BOOST_CHECK(async.GetBestBlock() == hashBlock);
+    }
+    BOOST_CHECK(async.Sync());
+    BOOST_CHECK(!async.GetFlushStats().fPending);
+    BOOST_CHECK(base.HaveCoin(outpoint));
+    BOOST_CHECK(base.GetBestBlock() == hashBlock);
+
+    // Spending goes through the same path.
+    {
+        CCoinsViewCache cache(async, false);
+        BOOST_CHECK(cache.SpendCoin(outpoint));
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK(!async.HaveCoin(outpoint));
+    }
+    BOOST_CHECK(async.Sync());
+    BOOST_CHECK(!base.HaveCoin(outpoint));
+
+    flusher.interrupt();
+    flusher.join();
+
+    // Without the flusher thread, writes happen synchronously.
+    size_t nWrites = base.nWrites;
+    {
+        CCoinsViewCache cache(async, false);
+        cache.AddCoin(outpoint, coin, false);
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK_EQUAL(base.nWrites, nWrites + 1);
+    BOOST_CHECK(idPrepare == boost::this_thread::get_id());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -46,4 +46,41 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(murmurhash3_input)
+{
+    // Hashing an input under many seeds matches MurmurHash3 for every tail
+    // length and past the number of lanes
+    vector<unsigned char> vData;
+    for (unsigned int nSize = 0; nSize < 12; nSize++)
+    {
+        CMurmurHash3Input input(vData);
+        uint32_t vHashes[19];
+        input.HashMany(0x12345678, 0xFBA4C795, 19, vHashes);
+        for (unsigned int i = 0; i < 19; i++)
+        {
+            uint32_t nSeed = 0x12345678 + i * 0xFBA4C795;
+            BOOST_CHECK_EQUAL(input.Hash(nSeed), MurmurHash3(nSeed, vData));
+            BOOST_CHECK_EQUAL(vHashes[i], MurmurHash3(nSeed, vData));
+        }
+        vData.push_back(nSize * 37 + 1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    // The 32 byte vector of the SipHash-2-4 reference implementation:
+    // key 00..0f, message 00..1f
+    uint256 val("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100");
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, val), 0x7127512f72f27cceULL);
+    BOOST_CHECK_EQUAL(SipHashUint256(0, 0, val), SipHashUint256(0, 0, val));
+    BOOST_CHECK(SipHashUint256(0, 0, val) != SipHashUint256(1, 0, val));
+
+    // Arbitrary lengths: the reference vectors for the empty and one byte
+    // messages, and the 32 byte one through the generic path
+    const unsigned char* p = val.begin();
+    BOOST_CHECK_EQUAL(SipHash(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, p, 0), 0x726fdb47dd0e0e31ULL);
+    BOOST_CHECK_EQUAL(SipHash(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, p, 1), 0x74f839c593dc67fdULL);
+    BOOST_CHECK_EQUAL(SipHash(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, p, 32), 0x7127512f72f27cceULL);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
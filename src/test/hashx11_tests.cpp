@@ -0,0 +1,98 @@
+// Copyright (c) 2014 The Digitalcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "core.h"
+#include "hashx11.h"
+#include "util.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(hashx11_tests)
+
+BOOST_AUTO_TEST_CASE(x11_engines_match_reference)
+{
+    BOOST_CHECK(X11EngineSupported(X11_ENGINE_GENERIC));
+    for (int nEngine = 0; nEngine < NUM_X11_ENGINES; nEngine++)
+    {
+        if (!X11EngineSupported(nEngine))
+            continue;
+        BOOST_CHECK_MESSAGE(X11EngineSelfTest(nEngine), X11EngineName(nEngine));
+
+        CBlockHeader header;
+        header.nVersion = BLOCK_VERSION_DEFAULT | BLOCK_VERSION_X11;
+        header.hashPrevBlock = GetRandHash();
+        header.hashMerkleRoot = GetRandHash();
+        header.nTime = 1400000000;
+        header.nBits = 0x1e0fffff;
+        for (header.nNonce = 0; header.nNonce < 100; header.nNonce++)
+        {
+            uint256 hash;
+            X11EngineHash(nEngine, BEGIN(header.nVersion), 80, &hash);
+            BOOST_CHECK(hash == HashX11(BEGIN(header.nVersion), END(header.nNonce)));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(x11_engine_init)
+{
+    BOOST_CHECK(!X11EngineInit("nosuchengine"));
+    BOOST_CHECK(X11EngineInit("generic"));
+    BOOST_CHECK(X11EngineActive() == X11_ENGINE_GENERIC);
+    BOOST_CHECK(X11EngineInit("auto"));
+    BOOST_CHECK(X11EngineSupported(X11EngineActive()));
+
+    CBlockHeader header;
+    header.nVersion = BLOCK_VERSION_DEFAULT | BLOCK_VERSION_X11;
+    header.nNonce = 12345;
+    BOOST_CHECK(header.GetPoWHash(ALGO_X11) == HashX11(BEGIN(header.nVersion), END(header.nNonce)));
+}
+
+BOOST_AUTO_TEST_CASE(x11_batch_hashing)
+{
+    CBlockHeader header;
+    header.nVersion = BLOCK_VERSION_DEFAULT | BLOCK_VERSION_X11;
+    header.hashPrevBlock = GetRandHash();
+    header.hashMerkleRoot = GetRandHash();
+    header.nTime = 1400000000;
+    header.nBits = 0x1e0fffff;
+    header.nNonce = 0xdeadbeef;
+
+    // Odd count so the engines with lanes also exercise their scalar tail
+    static const unsigned int nCount = 11;
+    unsigned int nNonces[nCount];
+    uint256 hashes[nCount];
+    unsigned char headers[nCount][80];
+    for (int nEngine = 0; nEngine < NUM_X11_ENGINES; nEngine++)
+    {
+        if (!X11EngineSupported(nEngine))
+            continue;
+        BOOST_CHECK(X11EngineInit(X11EngineName(nEngine)));
+
+        CX11HeaderMidstate mid;
+        X11PrepareHeader(mid, BEGIN(header.nVersion));
+        for (unsigned int i = 0; i < nCount; i++)
+            nNonces[i] = i * 0x9e3779b9;
+        X11HashNonces(mid, nNonces, nCount, hashes);
+        for (unsigned int i = 0; i < nCount; i++)
+        {
+            CBlockHeader candidate = header;
+            candidate.nNonce = nNonces[i];
+            BOOST_CHECK_MESSAGE(hashes[i] == candidate.GetPoWHash(ALGO_X11), X11EngineName(nEngine));
+        }
+
+        for (unsigned int i = 0; i < nCount; i++)
+        {
+            CBlockHeader other = header;
+            other.hashMerkleRoot = GetRandHash();
+            other.nNonce = i;
+            memcpy(headers[i], BEGIN(other.nVersion), 80);
+        }
+        X11HashHeaders(&headers[0][0], nCount, hashes);
+        for (unsigned int i = 0; i < nCount; i++)
+            BOOST_CHECK_MESSAGE(hashes[i] == HashX11(headers[i], headers[i] + 80), X11EngineName(nEngine));
+    }
+    BOOST_CHECK(X11EngineInit("auto"));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -5,6 +5,7 @@
 #include "core.h"
 #include "main.h"
 
+#include <boost/thread.hpp>
 #include <boost/test/unit_test.hpp>
 
 BOOST_AUTO_TEST_SUITE(main_tests)
@@ -21,4 +22,57 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test)
     BOOST_CHECK(nSum == 2099999997690000ULL);
 }
 
+BOOST_AUTO_TEST_CASE(diskblockindex_work_test)
+{
+    CDiskBlockIndex index;
+    index.nHeight = 100;
+    index.nBits = 0x1d00ffff;
+    index.nChainWork = uint256(123456789);
+
+    // Without BLOCK_HAVE_WORK the work is not stored
+    CDataStream ssOld(SER_DISK, CLIENT_VERSION);
+    ssOld << index;
+    index.nStatus = BLOCK_HAVE_WORK;
+    CDataStream ssNew(SER_DISK, CLIENT_VERSION);
+    ssNew << index;
+    BOOST_CHECK_EQUAL(ssNew.size(), ssOld.size() + 32);
+
+    CDiskBlockIndex indexRead;
+    ssNew >> indexRead;
+    BOOST_CHECK(indexRead.nStatus & BLOCK_HAVE_WORK);
+    BOOST_CHECK(indexRead.nChainWork == uint256(123456789));
+    BOOST_CHECK_EQUAL(indexRead.nHeight, 100);
+
+    CDiskBlockIndex indexOld;
+    ssOld >> indexOld;
+    BOOST_CHECK(indexOld.nChainWork == 0);
+}
+
+static void ReadChainView(int* pnHeight, bool* pfInMainChain)
+{
+    {
+        LOCK(cs_chainview);
+        *pnHeight = chainActive.Height();
+    }
+    IsInitialBlockDownload();
+    CMerkleTx tx;
+    tx.hashBlock = uint256(1);
+    tx.nIndex = 0;
+    *pfInMainChain = tx.IsInMainChain();
+}
+
+BOOST_AUTO_TEST_CASE(chainview_without_cs_main)
+{
+    // Readers of the chain do not wait for validation to release cs_main
+    int nHeight = -2;
+    bool fInMainChain = true;
+    {
+        LOCK(cs_main);
+        boost::thread thread(boost::bind(&ReadChainView, &nHeight, &fInMainChain));
+        BOOST_REQUIRE(thread.timed_join(boost::posix_time::seconds(10)));
+        BOOST_CHECK_EQUAL(nHeight, chainActive.Height());
+    }
+    BOOST_CHECK(!fInMainChain);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,285 @@
+// Copyright (c) 2014 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txmempool.h"
+#include "util.h"
+
+#include <list>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+// A transaction with nOutputs outputs of nValue, spending the given outpoints
+static CTransaction MakeTx(const vector<COutPoint> &vPrevouts, unsigned int nOutputs, int64_t nValue)
+{
+    CMutableTransaction tx;
+    BOOST_FOREACH(const COutPoint &prevout, vPrevouts) {
+        tx.vin.push_back(CTxIn(prevout));
+        tx.vin.back().scriptSig = CScript() << OP_11;
+    }
+    tx.vout.resize(nOutputs);
+    BOOST_FOREACH(CTxOut &txout, tx.vout) {
+        txout.scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txout.nValue = nValue;
+    }
+    return tx;
+}
+
+static CTransaction MakeTx(const COutPoint &prevout, unsigned int nOutputs, int64_t nValue)
+{
+    return MakeTx(vector<COutPoint>(1, prevout), nOutputs, nValue);
+}
+
+static bool IsLast(const set<CTxMemPoolIndexKey> &setIndex, const uint256 &hash)
+{
+    return !setIndex.empty() && setIndex.rbegin()->hash == hash;
+}
+
+BOOST_AUTO_TEST_CASE(mempool_ancestor_index)
+{
+    CTxMemPool pool;
+    list<CTransaction> removed;
+
+    // parent <- child <- grandchild, and the grandchild also spends from
+    // the parent directly
+    CTransaction txParent = MakeTx(COutPoint(GetRandHash(), 0), 2, 10 * COIN);
+    uint256 hashParent = txParent.GetHash();
+    CTransaction txChild = MakeTx(COutPoint(hashParent, 0), 1, 9 * COIN);
+    uint256 hashChild = txChild.GetHash();
+    vector<COutPoint> vPrevouts;
+    vPrevouts.push_back(COutPoint(hashChild, 0));
+    vPrevouts.push_back(COutPoint(hashParent, 1));
+    CTransaction txGrandChild = MakeTx(vPrevouts, 1, 18 * COIN);
+    uint256 hashGrandChild = txGrandChild.GetHash();
+
+    CTxMemPoolEntry entryParent(txParent, 1000, GetTime(), 0.0, 1);
+    CTxMemPoolEntry entryChild(txChild, 50000, GetTime(), 0.0, 1);
+    CTxMemPoolEntry entryGrandChild(txGrandChild, 0, GetTime(), 0.0, 1);
+    pool.addUnchecked(hashParent, entryParent);
+    pool.addUnchecked(hashChild, entryChild);
+    pool.addUnchecked(hashGrandChild, entryGrandChild);
+
+    BOOST_CHECK_EQUAL(pool.mapTx[hashParent].GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashChild].GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashChild].GetFeesWithAncestors(), 51000);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashGrandChild].GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashGrandChild].GetFeesWithAncestors(), 51000);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashGrandChild].GetSizeWithAncestors(),
+                      entryParent.GetTxSize() + entryChild.GetTxSize() + entryGrandChild.GetTxSize());
+    BOOST_CHECK_EQUAL(pool.setByAncestorFeeRate.size(), 3);
+    BOOST_CHECK_EQUAL(pool.setByPriority.size(), 3);
+    // The child pays for its parent
+    BOOST_CHECK(IsLast(pool.setByAncestorFeeRate, hashChild));
+    BOOST_CHECK_EQUAL(pool.mapTx[hashParent].GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashParent].GetFeesWithDescendants(), 51000);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashChild].GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashGrandChild].GetCountWithDescendants(), 1);
+    BOOST_CHECK_EQUAL(pool.setByDescendantScore.size(), 3);
+
+    // mapTx is unordered; queryHashes still lists the txids in order
+    vector<uint256> vtxid;
+    pool.queryHashes(vtxid);
+    BOOST_CHECK_EQUAL(vtxid.size(), 3);
+    for (unsigned int i = 1; i < vtxid.size(); i++)
+        BOOST_CHECK(vtxid[i - 1] < vtxid[i]);
+
+    // The parent is confirmed: the others have fewer ancestors left
+    pool.remove(txParent, removed);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashChild].GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashChild].GetFeesWithAncestors(), 50000);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashGrandChild].GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(pool.setByAncestorFeeRate.size(), 2);
+
+    // ... and returns with a disconnected block
+    pool.addUnchecked(hashParent, entryParent);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashParent].GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashParent].GetSizeWithDescendants(),
+                      entryParent.GetTxSize() + entryChild.GetTxSize() + entryGrandChild.GetTxSize());
+    BOOST_CHECK_EQUAL(pool.mapTx[hashChild].GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashGrandChild].GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(pool.mapTx[hashGrandChild].GetFeesWithAncestors(), 51000);
+    BOOST_CHECK(IsLast(pool.setByAncestorFeeRate, hashChild));
+
+    // Removing it with its descendants empties the pool and the indexes
+    removed.clear();
+    pool.remove(txParent, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 3);
+    BOOST_CHECK(pool.mapTx.empty());
+    BOOST_CHECK(pool.setByAncestorFeeRate.empty());
+    BOOST_CHECK(pool.setByPriority.empty());
+    BOOST_CHECK(pool.setByDescendantScore.empty());
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_priority_index)
+{
+    CTxMemPool pool;
+
+    // A has the higher priority now, but B's inputs are worth more and it
+    // gains priority faster as they age.
+    CTransaction txA = MakeTx(COutPoint(GetRandHash(), 0), 1, COIN);
+    CTransaction txB = MakeTx(COutPoint(GetRandHash(), 0), 1, 100 * COIN);
+    CTxMemPoolEntry entryA(txA, 0, GetTime(), 1e9, 100);
+    CTxMemPoolEntry entryB(txB, 0, GetTime(), 1e8, 100);
+    pool.addUnchecked(txA.GetHash(), entryA);
+    pool.addUnchecked(txB.GetHash(), entryB);
+
+    pool.SetPriorityHeight(100);
+    BOOST_CHECK(IsLast(pool.setByPriority, txA.GetHash()));
+    BOOST_CHECK_EQUAL(pool.setByPriority.rbegin()->dScore, entryA.GetPriority(100));
+
+    pool.SetPriorityHeight(200);
+    BOOST_CHECK(IsLast(pool.setByPriority, txB.GetHash()));
+    BOOST_CHECK_EQUAL(pool.setByPriority.rbegin()->dScore, entryB.GetPriority(200));
+    BOOST_CHECK_EQUAL(pool.setByPriority.size(), 2);
+
+    pool.clear();
+    BOOST_CHECK(pool.setByPriority.empty());
+    BOOST_CHECK(pool.setByAncestorFeeRate.empty());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim)
+{
+    CTxMemPool pool;
+
+    // A pays well; B pays little, but its child C pays for it; D pays
+    // little and nobody pays for it.
+    CTransaction txA = MakeTx(COutPoint(GetRandHash(), 0), 1, COIN);
+    CTransaction txB = MakeTx(COutPoint(GetRandHash(), 0), 1, COIN);
+    CTransaction txC = MakeTx(COutPoint(txB.GetHash(), 0), 1, COIN);
+    CTransaction txD = MakeTx(COutPoint(GetRandHash(), 0), 1, COIN);
+    pool.addUnchecked(txA.GetHash(), CTxMemPoolEntry(txA, 50000, GetTime(), 0.0, 1));
+    pool.addUnchecked(txB.GetHash(), CTxMemPoolEntry(txB, 100, GetTime(), 0.0, 1));
+    pool.addUnchecked(txC.GetHash(), CTxMemPoolEntry(txC, 20000, GetTime(), 0.0, 1));
+    pool.addUnchecked(txD.GetHash(), CTxMemPoolEntry(txD, 200, GetTime(), 0.0, 1));
+    BOOST_CHECK(pool.setByDescendantScore.begin()->hash == txD.GetHash());
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1000000), 0);
+
+    size_t nUsage = pool.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage > pool.GetTotalTxSize());
+    BOOST_CHECK(nUsage < 4 * 1000);
+
+    // Room for three of the four: D goes, B and C stay together
+    pool.TrimToSize(nUsage - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+    BOOST_CHECK(!pool.exists(txD.GetHash()));
+    BOOST_CHECK(pool.exists(txB.GetHash()));
+    BOOST_CHECK(pool.DynamicMemoryUsage() < nUsage);
+    BOOST_CHECK(pool.GetMinFee(nUsage) >= CTransaction::nMinRelayTxFee);
+
+    // Room for one: B goes with its child
+    pool.TrimToSize(pool.DynamicMemoryUsage() / 2);
+    BOOST_CHECK_EQUAL(pool.size(), 1);
+    BOOST_CHECK(pool.exists(txA.GetHash()));
+    BOOST_CHECK(pool.GetMinFee(nUsage) > CTransaction::nMinRelayTxFee);
+
+    pool.TrimToSize(0);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_package_limits)
+{
+    CTxMemPool pool;
+    list<CTransaction> removed;
+
+    // A chain of five, each spending the one before
+    vector<CTransaction> vtx;
+    vtx.push_back(MakeTx(COutPoint(GetRandHash(), 0), 1, COIN));
+    for (int i = 1; i < 5; i++)
+        vtx.push_back(MakeTx(COutPoint(vtx.back().GetHash(), 0), 1, COIN));
+    size_t nTxSize = ::GetSerializeSize(vtx[0], SER_NETWORK, PROTOCOL_VERSION);
+    string strReason;
+    for (unsigned int i = 0; i < vtx.size(); i++) {
+        BOOST_CHECK(pool.CheckPackageLimits(vtx[i], nTxSize, 5, 100000, 5, 100000, strReason));
+        pool.addUnchecked(vtx[i].GetHash(), CTxMemPoolEntry(vtx[i], 1000 * (i + 1), GetTime(), 0.0, 1));
+    }
+    BOOST_CHECK_EQUAL(pool.mapTx[vtx[0].GetHash()].GetCountWithDescendants(), 5);
+    BOOST_CHECK_EQUAL(pool.mapTx[vtx[0].GetHash()].GetFeesWithDescendants(), 15000);
+    BOOST_CHECK_EQUAL(pool.mapTx[vtx[4].GetHash()].GetCountWithAncestors(), 5);
+
+    // A sixth has one ancestor too many, and the first one descendant too many
+    CTransaction txNext = MakeTx(COutPoint(vtx.back().GetHash(), 0), 1, COIN);
+    BOOST_CHECK(!pool.CheckPackageLimits(txNext, nTxSize, 5, 100000, 6, 100000, strReason));
+    BOOST_CHECK(!pool.CheckPackageLimits(txNext, nTxSize, 6, 100000, 5, 100000, strReason));
+    BOOST_CHECK(!pool.CheckPackageLimits(txNext, nTxSize, 6, 5 * nTxSize, 6, 100000, strReason));
+    BOOST_CHECK(!pool.CheckPackageLimits(txNext, nTxSize, 6, 100000, 6, 5 * nTxSize, strReason));
+    BOOST_CHECK(pool.CheckPackageLimits(txNext, nTxSize, 6, 6 * nTxSize, 6, 6 * nTxSize, strReason));
+
+    // The first is confirmed and the last evicted; the totals just lose them
+    pool.remove(vtx[0], removed);
+    pool.remove(vtx[4], removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    BOOST_CHECK_EQUAL(pool.mapTx[vtx[1].GetHash()].GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(pool.mapTx[vtx[1].GetHash()].GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(pool.mapTx[vtx[1].GetHash()].GetFeesWithDescendants(), 9000);
+    BOOST_CHECK_EQUAL(pool.mapTx[vtx[3].GetHash()].GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(pool.mapTx[vtx[3].GetHash()].GetFeesWithAncestors(), 9000);
+    BOOST_CHECK_EQUAL(pool.mapTx[vtx[3].GetHash()].GetSizeWithAncestors(), 3 * nTxSize);
+    BOOST_CHECK_EQUAL(pool.mapTx[vtx[3].GetHash()].GetCountWithDescendants(), 1);
+
+    // From the middle, with a descendant and an ancestor left: recomputed
+    pool.remove(vtx[2], removed);
+    BOOST_CHECK_EQUAL(pool.mapTx[vtx[1].GetHash()].GetCountWithDescendants(), 1);
+    BOOST_CHECK_EQUAL(pool.mapTx[vtx[3].GetHash()].GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(pool.setByDescendantScore.size(), 2);
+}
+
+// Adds a transaction and keeps holding the pool's lock until released
+struct CPoolLockHolder
+{
+    CTxMemPool &pool;
+    CTransaction tx;
+    volatile bool fAdded, fRelease;
+
+    CPoolLockHolder(CTxMemPool &poolIn, const CTransaction &txIn) : pool(poolIn), tx(txIn), fAdded(false), fRelease(false) {}
+
+    void operator()() {
+        LOCK(pool.cs);
+        pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 0, GetTime(), 0.0, 1));
+        fAdded = true;
+        while (!fRelease)
+            MilliSleep(1);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(mempool_snapshot)
+{
+    CTxMemPool pool;
+
+    CTransaction txA = MakeTx(COutPoint(GetRandHash(), 0), 2, COIN);
+    CTransaction txB = MakeTx(COutPoint(txA.GetHash(), 1), 1, COIN);
+    pool.addUnchecked(txA.GetHash(), CTxMemPoolEntry(txA, 1000, GetTime(), 0.0, 1));
+    boost::shared_ptr<const CTxMemPoolSnapshot> psnapshot = pool.GetSnapshot();
+    BOOST_CHECK_EQUAL(psnapshot->mapEntries.size(), 1);
+    BOOST_CHECK(pool.GetSnapshot() == psnapshot);
+
+    pool.addUnchecked(txB.GetHash(), CTxMemPoolEntry(txB, 2000, GetTime(), 0.0, 1));
+    boost::shared_ptr<const CTxMemPoolSnapshot> psnapshot2 = pool.GetSnapshot();
+    BOOST_CHECK_EQUAL(psnapshot->mapEntries.size(), 1);
+    BOOST_CHECK_EQUAL(psnapshot2->mapEntries.size(), 2);
+    BOOST_CHECK_EQUAL(psnapshot2->nTotalTxSize, pool.GetTotalTxSize());
+    const CTxMemPoolSnapshot::Entry &entryB = psnapshot2->mapEntries.find(txB.GetHash())->second;
+    BOOST_CHECK_EQUAL(entryB.nFee, 2000);
+    BOOST_CHECK_EQUAL(entryB.vDepends.size(), 1);
+    BOOST_CHECK(entryB.vDepends[0] == txA.GetHash());
+
+    // While another thread holds the lock, the last snapshot is returned
+    CPoolLockHolder holder(pool, MakeTx(COutPoint(GetRandHash(), 0), 1, COIN));
+    boost::thread thread(boost::ref(holder));
+    while (!holder.fAdded)
+        MilliSleep(1);
+    BOOST_CHECK(pool.GetSnapshot() == psnapshot2);
+    holder.fRelease = true;
+    thread.join();
+    BOOST_CHECK_EQUAL(pool.GetSnapshot()->mapEntries.size(), 3);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -53,7 +53,7 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
 {
     CScript scriptPubKey = CScript() << ParseHex("04678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5f") << OP_CHECKSIG;
     CBlockTemplate *pblocktemplate;
-    CTransaction tx,tx2;
+    CMutableTransaction tx,tx2;
     CScript script;
     uint256 hash;
 
@@ -70,10 +70,12 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
         CBlock *pblock = &pblocktemplate->block; // pointer for convenience
         pblock->nVersion = 1;
         pblock->nTime = chainActive.Tip()->GetMedianTimePast()+1;
-        pblock->vtx[0].vin[0].scriptSig = CScript();
-        pblock->vtx[0].vin[0].scriptSig.push_back(blockinfo[i].extranonce);
-        pblock->vtx[0].vin[0].scriptSig.push_back(chainActive.Height());
-        pblock->vtx[0].vout[0].scriptPubKey = CScript();
+        CMutableTransaction txCoinbase(pblock->vtx[0]);
+        txCoinbase.vin[0].scriptSig = CScript();
+        txCoinbase.vin[0].scriptSig.push_back(blockinfo[i].extranonce);
+        txCoinbase.vin[0].scriptSig.push_back(chainActive.Height());
+        txCoinbase.vout[0].scriptPubKey = CScript();
+        pblock->vtx[0] = CTransaction(txCoinbase);
         if (txFirst.size() < 2)
             txFirst.push_back(new CTransaction(pblock->vtx[0]));
         pblock->hashMerkleRoot = pblock->BuildMerkleTree();
@@ -174,7 +176,7 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     hash = tx.GetHash();
     mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 11, GetTime(), 111.0, 11));
     tx.vin[0].prevout.hash = hash;
-    tx.vin[0].scriptSig = CScript() << (std::vector<unsigned char>)script;
+    tx.vin[0].scriptSig = CScript() << ToByteVector(script);
     tx.vout[0].nValue -= 1000000;
     hash = tx.GetHash();
     mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 11, GetTime(), 111.0, 11));
@@ -253,6 +255,32 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
 
     chainActive.Tip()->nHeight--;
     SetMockTime(0);
+    mempool.clear();
+
+    // The templates of all algos share the transaction selection, which
+    // takes in transactions arriving in between
+    tx.vin[0].prevout.hash = txFirst[0]->GetHash();
+    tx.vin[0].nSequence = std::numeric_limits<unsigned int>::max();
+    tx.vout[0].nValue = 4900000000LL;
+    tx.nLockTime = 0;
+    hash = tx.GetHash();
+    mempool.addUnchecked(hash, CTxMemPoolEntry(tx, 11, GetTime(), 111.0, 11));
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey, ALGO_SCRYPT));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    delete pblocktemplate;
+    tx.vin[0].prevout.hash = hash;
+    tx.vout[0].nValue -= 1000000;
+    mempool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 11, GetTime(), 111.0, 11));
+    for (int algo = 0; algo < NUM_ALGOS; algo++)
+    {
+        BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey, algo));
+        BOOST_CHECK_EQUAL(GetAlgo(pblocktemplate->block.nVersion), algo);
+        BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+        BOOST_CHECK(pblocktemplate->block.vtx[1].GetHash() == hash);
+        BOOST_CHECK(pblocktemplate->block.vtx[2].GetHash() == tx.GetHash());
+        delete pblocktemplate;
+    }
+    mempool.clear();
 
     BOOST_FOREACH(CTransaction *tx, txFirst)
         delete tx;
@@ -285,4 +313,25 @@ BOOST_AUTO_TEST_CASE(sha256transform_equality)
     BOOST_CHECK(hash == hash_reference);
 }
 
+BOOST_AUTO_TEST_CASE(genalgothreads_parse)
+{
+    std::map<int, int> mapAlgoThreads;
+    BOOST_CHECK(ParseGenAlgoThreads("sha256d:2,scrypt:4,x11:8", mapAlgoThreads));
+    BOOST_CHECK_EQUAL(mapAlgoThreads.size(), 3U);
+    BOOST_CHECK_EQUAL(mapAlgoThreads[ALGO_SHA256D], 2);
+    BOOST_CHECK_EQUAL(mapAlgoThreads[ALGO_SCRYPT], 4);
+    BOOST_CHECK_EQUAL(mapAlgoThreads[ALGO_X11], 8);
+
+    BOOST_CHECK(ParseGenAlgoThreads("x11:0", mapAlgoThreads));
+    BOOST_CHECK_EQUAL(mapAlgoThreads.size(), 1U);
+    BOOST_CHECK_EQUAL(mapAlgoThreads[ALGO_X11], 0);
+
+    BOOST_CHECK(!ParseGenAlgoThreads("", mapAlgoThreads));
+    BOOST_CHECK(!ParseGenAlgoThreads("x11", mapAlgoThreads));
+    BOOST_CHECK(!ParseGenAlgoThreads("x11:", mapAlgoThreads));
+    BOOST_CHECK(!ParseGenAlgoThreads("x11:-1", mapAlgoThreads));
+    BOOST_CHECK(!ParseGenAlgoThreads("groestl:2", mapAlgoThreads));
+    BOOST_CHECK(!ParseGenAlgoThreads("x11:2,x11:4", mapAlgoThreads));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,72 @@
+// Copyright (c) 2014 The Digitalcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "core.h"
+#include "powhash.h"
+#include "util.h"
+
+#include <boost/test/unit_test.hpp>
+
+// Hash the same headers through every entry point of CPowHasher<algo> and
+// compare them with CBlockHeader::GetPoWHash(algo)
+template<int algo>
+static void CheckPowHasher()
+{
+    CBlockHeader header;
+    header.nVersion = BLOCK_VERSION_DEFAULT;
+    header.hashPrevBlock = GetRandHash();
+    header.hashMerkleRoot = GetRandHash();
+    header.nTime = 1400000000;
+    header.nBits = 0x1e0fffff;
+    header.nNonce = 0xdeadbeef;
+
+    CPowHasher<algo> hasher;
+    BOOST_CHECK(hasher.GetBatch() > 0);
+    hasher.SetHeader(BEGIN(header.nVersion));
+
+    // Odd count so batched implementations also run a partial pass
+    static const unsigned int nCount = 11;
+    unsigned int nNonces[nCount];
+    uint256 hashes[nCount];
+    unsigned char headers[nCount][80];
+    for (unsigned int i = 0; i < nCount; i++)
+        nNonces[i] = i * 0x9e3779b9;
+    hasher.HashNonces(nNonces, nCount, hashes);
+    for (unsigned int i = 0; i < nCount; i++)
+    {
+        CBlockHeader candidate = header;
+        candidate.nNonce = nNonces[i];
+        BOOST_CHECK_MESSAGE(hashes[i] == candidate.GetPoWHash(algo), GetAlgoName(algo));
+        BOOST_CHECK(candidate.GetPoWHash<algo>() == candidate.GetPoWHash(algo));
+        memcpy(headers[i], BEGIN(candidate.nVersion), 80);
+    }
+
+    uint256 hashesHeaders[nCount];
+    CPowHasher<algo>::HashHeaders(&headers[0][0], nCount, hashesHeaders);
+    for (unsigned int i = 0; i < nCount; i++)
+        BOOST_CHECK_MESSAGE(hashesHeaders[i] == hashes[i], GetAlgoName(algo));
+}
+
+BOOST_AUTO_TEST_SUITE(powhash_tests)
+
+BOOST_AUTO_TEST_CASE(powhash_sha256d)
+{
+    CheckPowHasher<ALGO_SHA256D>();
+
+    CBlockHeader header;
+    header.nNonce = 42;
+    BOOST_CHECK(header.GetPoWHash<ALGO_SHA256D>() == header.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(powhash_scrypt)
+{
+    CheckPowHasher<ALGO_SCRYPT>();
+}
+
+BOOST_AUTO_TEST_CASE(powhash_x11)
+{
+    CheckPowHasher<ALGO_X11>();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
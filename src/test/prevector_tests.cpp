@@ -0,0 +1,264 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "prevector.h"
+
+#include "arena.h"
+#include "script.h"
+#include "serialize.h"
+#include "util.h"
+#include "version.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(prevector_tests)
+
+typedef prevector<8, int> pretype;
+typedef std::vector<int> realtype;
+
+// Applies every operation to a prevector and a vector, and compares them
+class prevector_tester
+{
+private:
+    realtype real_vector;
+    pretype pre_vector;
+
+    void test()
+    {
+        const pretype& const_pre_vector = pre_vector;
+        BOOST_REQUIRE_EQUAL(real_vector.size(), pre_vector.size());
+        BOOST_CHECK_EQUAL(real_vector.empty(), pre_vector.empty());
+        BOOST_CHECK(pre_vector.capacity() >= pre_vector.size());
+        for (unsigned int i = 0; i < real_vector.size(); i++) {
+            BOOST_CHECK_EQUAL(real_vector[i], pre_vector[i]);
+            BOOST_CHECK_EQUAL(real_vector[i], const_pre_vector[i]);
+        }
+        unsigned int pos = 0;
+        for (pretype::const_iterator it = const_pre_vector.begin(); it != const_pre_vector.end(); ++it)
+            BOOST_CHECK_EQUAL(*it, real_vector[pos++]);
+        pos = real_vector.size();
+        for (pretype::const_reverse_iterator it = const_pre_vector.rbegin(); it != const_pre_vector.rend(); ++it)
+            BOOST_CHECK_EQUAL(*it, real_vector[--pos]);
+
+        // Copies compare equal and serialize the same
+        pretype pre_copy(pre_vector);
+        BOOST_CHECK(pre_copy == pre_vector);
+        CDataStream ss1(SER_DISK, 0), ss2(SER_DISK, 0);
+        ss1 << pre_vector;
+        ss2 << real_vector;
+        BOOST_CHECK(ss1.str() == ss2.str());
+        BOOST_CHECK_EQUAL(::GetSerializeSize(pre_vector, SER_DISK, 0), ss1.size());
+        pretype pre_read;
+        ss1 >> pre_read;
+        BOOST_CHECK(pre_read == pre_vector);
+    }
+
+public:
+    void resize(unsigned int s)
+    {
+        real_vector.resize(s);
+        pre_vector.resize(s);
+        test();
+    }
+
+    void reserve(unsigned int s)
+    {
+        real_vector.reserve(s);
+        pre_vector.reserve(s);
+        BOOST_CHECK(pre_vector.capacity() >= s);
+        test();
+    }
+
+    void insert(unsigned int position, int value)
+    {
+        real_vector.insert(real_vector.begin() + position, value);
+        pre_vector.insert(pre_vector.begin() + position, value);
+        test();
+    }
+
+    void insert(unsigned int position, unsigned int count, int value)
+    {
+        real_vector.insert(real_vector.begin() + position, count, value);
+        pre_vector.insert(pre_vector.begin() + position, count, value);
+        test();
+    }
+
+    void insert_range(unsigned int position, const std::vector<int>& values)
+    {
+        real_vector.insert(real_vector.begin() + position, values.begin(), values.end());
+        pre_vector.insert(pre_vector.begin() + position, values.begin(), values.end());
+        test();
+    }
+
+    void erase(unsigned int position)
+    {
+        real_vector.erase(real_vector.begin() + position);
+        pre_vector.erase(pre_vector.begin() + position);
+        test();
+    }
+
+    void erase(unsigned int first, unsigned int last)
+    {
+        real_vector.erase(real_vector.begin() + first, real_vector.begin() + last);
+        pre_vector.erase(pre_vector.begin() + first, pre_vector.begin() + last);
+        test();
+    }
+
+    void update(unsigned int pos, int value)
+    {
+        real_vector[pos] = value;
+        pre_vector[pos] = value;
+        test();
+    }
+
+    void push_back(int value)
+    {
+        real_vector.push_back(value);
+        pre_vector.push_back(value);
+        test();
+    }
+
+    void pop_back()
+    {
+        real_vector.pop_back();
+        pre_vector.pop_back();
+        test();
+    }
+
+    void clear()
+    {
+        real_vector.clear();
+        pre_vector.clear();
+        test();
+    }
+
+    void assign(unsigned int n, int value)
+    {
+        real_vector.assign(n, value);
+        pre_vector.assign(n, value);
+        test();
+    }
+
+    void shrink_to_fit()
+    {
+        pre_vector.shrink_to_fit();
+        test();
+    }
+
+    void swap()
+    {
+        realtype real_other(real_vector.rbegin(), real_vector.rend());
+        pretype pre_other(pre_vector.rbegin(), pre_vector.rend());
+        real_vector.swap(real_other);
+        pre_vector.swap(pre_other);
+        test();
+    }
+
+    unsigned int size() const
+    {
+        return real_vector.size();
+    }
+};
+
+BOOST_AUTO_TEST_CASE(prevector_random_operations)
+{
+    seed_insecure_rand(false);
+    for (int j = 0; j < 64; j++) {
+        prevector_tester test;
+        for (int i = 0; i < 1024; i++) {
+            int r = insecure_rand();
+            switch (r % 15) {
+            case 0:
+                test.insert(insecure_rand() % (test.size() + 1), insecure_rand());
+                break;
+            case 1:
+                test.resize(std::max(0, std::min(30, (int)test.size() + (int)(insecure_rand() % 5) - 2)));
+                break;
+            case 2:
+                test.insert(insecure_rand() % (test.size() + 1), 1 + (insecure_rand() % 2), insecure_rand());
+                break;
+            case 3:
+                if (test.size() > 0)
+                    test.erase(insecure_rand() % test.size());
+                break;
+            case 4:
+                if (test.size() > 0)
+                    test.update(insecure_rand() % test.size(), insecure_rand());
+                break;
+            case 5: {
+                unsigned int first = insecure_rand() % (test.size() + 1);
+                unsigned int last = first + insecure_rand() % (test.size() + 1 - first);
+                test.erase(first, last);
+                break;
+            }
+            case 6:
+                test.push_back(insecure_rand());
+                break;
+            case 7:
+                if (test.size() > 0)
+                    test.pop_back();
+                break;
+            case 8: {
+                std::vector<int> values(insecure_rand() % 10);
+                for (unsigned int k = 0; k < values.size(); k++)
+                    values[k] = insecure_rand();
+                test.insert_range(insecure_rand() % (test.size() + 1), values);
+                break;
+            }
+            case 9:
+                test.reserve(insecure_rand() % 32);
+                break;
+            case 10:
+                test.shrink_to_fit();
+                break;
+            case 11:
+                test.swap();
+                break;
+            case 12:
+                if ((insecure_rand() % 16) == 0)
+                    test.clear();
+                break;
+            case 13:
+                test.assign(insecure_rand() % 32, insecure_rand());
+                break;
+            default:
+                test.resize(insecure_rand() % 40);
+                break;
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(prevector_script_storage)
+{
+    // Pay-to-pubkey-hash outputs stay inline, longer scripts do not
+    CScript scriptP2PKH = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 1) << OP_EQUALVERIFY << OP_CHECKSIG;
+    BOOST_CHECK_EQUAL(scriptP2PKH.size(), 25U);
+    BOOST_CHECK_EQUAL(scriptP2PKH.allocated_memory(), 0U);
+    CScript scriptSig = CScript() << std::vector<unsigned char>(72, 2) << std::vector<unsigned char>(33, 3);
+    BOOST_CHECK(scriptSig.allocated_memory() >= scriptSig.size());
+
+    // Serialized as a vector of bytes is
+    CDataStream ss1(SER_NETWORK, PROTOCOL_VERSION), ss2(SER_NETWORK, PROTOCOL_VERSION);
+    ss1 << scriptSig;
+    ss2 << ToByteVector(scriptSig);
+    BOOST_CHECK(ss1.str() == ss2.str());
+    CScript scriptRead;
+    ss1 >> scriptRead;
+    BOOST_CHECK(scriptRead == scriptSig);
+
+    // Taken from the arena while one is in scope
+    CDeserializeArena arena;
+    CScript scriptArena;
+    {
+        CDeserializeArena::Scope scope(arena);
+        ss2 >> scriptArena;
+    }
+    BOOST_CHECK(arena.GetUsage() >= scriptSig.size());
+    BOOST_CHECK(scriptArena == scriptSig);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -6,6 +6,10 @@
 #include "rpcclient.h"
 
 #include "base58.h"
+#include "hash.h"
+#include "key.h"
+#include "main.h"
+#include "util.h"
 
 #include <boost/algorithm/string.hpp>
 #include <boost/test/unit_test.hpp>
@@ -138,4 +142,99 @@ BOOST_AUTO_TEST_CASE(rpc_parse_monetary_values)
     BOOST_CHECK(AmountFromValue(ValueFromString("20999999.99999999")) == 2099999999999999LL);
 }
 
+BOOST_AUTO_TEST_CASE(rpc_json_writer)
+{
+    // The writer produces what write_string does for the same Value
+    Object obj;
+    obj.push_back(Pair("hash", "00ff"));
+    obj.push_back(Pair("esc", "a\"b\\c\n"));
+    obj.push_back(Pair("n", -3));
+    obj.push_back(Pair("big", (int64_t)2099999999999999LL));
+    obj.push_back(Pair("amount", ValueFromAmount(17622195LL)));
+    obj.push_back(Pair("f", false));
+    obj.push_back(Pair("none", Value::null));
+    Array arr;
+    arr.push_back(1);
+    arr.push_back(Array());
+    arr.push_back(Object());
+    obj.push_back(Pair("arr", arr));
+
+    CJSONWriter writer;
+    writer.BeginObject();
+    writer.Key("hash");
+    writer.String("00ff");
+    writer.Key("esc");
+    writer.String("a\"b\\c\n");
+    writer.Key("n");
+    writer.Int(-3);
+    writer.Key("big");
+    writer.Int(2099999999999999LL);
+    writer.Key("amount");
+    writer.Real(0.17622195);
+    writer.Key("f");
+    writer.Bool(false);
+    writer.Key("none");
+    writer.Null();
+    writer.Key("arr");
+    writer.BeginArray();
+    writer.Write(1);
+    writer.BeginArray();
+    writer.EndArray();
+    writer.BeginObject();
+    writer.EndObject();
+    writer.EndArray();
+    writer.EndObject();
+    BOOST_CHECK_EQUAL(writer.str(), write_string(Value(obj), false));
+
+    BOOST_CHECK_EQUAL(JSONRPCReplyResultText(writer.str(), 7), JSONRPCReply(obj, Value::null, 7));
+}
+
+BOOST_AUTO_TEST_CASE(rpc_verifymessages)
+{
+    BOOST_CHECK_THROW(CallRPC("verifymessages"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("verifymessages not_array"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("verifymessages [1]"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("verifymessages [[\"a\",\"b\"]]"), runtime_error);
+    BOOST_CHECK(CallRPC("verifymessages []").get_array().empty());
+
+    CKey key;
+    key.MakeNewKey(true);
+    string strAddress = CBitcoinAddress(key.GetPubKey().GetID()).ToString();
+
+    // Every third message has the signature of another one
+    Array messages;
+    for (int i = 0; i < 20; i++)
+    {
+        string strMessage = strprintf("message %d", i);
+        CHashWriter ss(SER_GETHASH, 0);
+        ss << strMessageMagic;
+        ss << (i % 3 == 2 ? string("other message") : strMessage);
+        vector<unsigned char> vchSig;
+        BOOST_CHECK(key.SignCompact(ss.GetHash(), vchSig));
+
+        Array entry;
+        entry.push_back(strAddress);
+        entry.push_back(EncodeBase64(&vchSig[0], vchSig.size()));
+        entry.push_back(strMessage);
+        messages.push_back(entry);
+    }
+    Array invalid;
+    invalid.push_back("not an address");
+    invalid.push_back("");
+    invalid.push_back("message");
+    messages.push_back(invalid);
+
+    Array params;
+    params.push_back(messages);
+    Array result = verifymessages(params, false).get_array();
+    BOOST_CHECK_EQUAL(result.size(), 21U);
+    for (int i = 0; i < 20; i++)
+    {
+        BOOST_CHECK_EQUAL(result[i].get_bool(), i % 3 != 2);
+        Array single = messages[i].get_array();
+        BOOST_CHECK_EQUAL(verifymessage(single, false).get_bool(), i % 3 != 2);
+    }
+    BOOST_CHECK_EQUAL(result[20].get_bool(), false);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -22,7 +22,7 @@ extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsig
 static std::vector<unsigned char>
 Serialize(const CScript& s)
 {
-    std::vector<unsigned char> sSerialized(s);
+    std::vector<unsigned char> sSerialized(s.begin(), s.end());
     return sSerialized;
 }
 
@@ -30,11 +30,11 @@ static bool
 Verify(const CScript& scriptSig, const CScript& scriptPubKey, bool fStrict)
 {
     // Create dummy to/from transactions:
-    CTransaction txFrom;
+    CMutableTransaction txFrom;
     txFrom.vout.resize(1);
     txFrom.vout[0].scriptPubKey = scriptPubKey;
 
-    CTransaction txTo;
+    CMutableTransaction txTo;
     txTo.vin.resize(1);
     txTo.vout.resize(1);
     txTo.vin[0].prevout.n = 0;
@@ -78,7 +78,7 @@ BOOST_AUTO_TEST_CASE(sign)
         evalScripts[i].SetDestination(standardScripts[i].GetID());
     }
 
-    CTransaction txFrom;  // Funding transaction:
+    CMutableTransaction txFrom;  // Funding transaction:
     string reason;
     txFrom.vout.resize(8);
     for (int i = 0; i < 4; i++)
@@ -90,7 +90,7 @@ BOOST_AUTO_TEST_CASE(sign)
     }
     BOOST_CHECK(IsStandardTx(txFrom, reason));
 
-    CTransaction txTo[8]; // Spending transactions
+    CMutableTransaction txTo[8]; // Spending transactions
     for (int i = 0; i < 8; i++)
     {
         txTo[i].vin.resize(1);
@@ -111,7 +111,7 @@ BOOST_AUTO_TEST_CASE(sign)
         {
             CScript sigSave = txTo[i].vin[0].scriptSig;
             txTo[i].vin[0].scriptSig = txTo[j].vin[0].scriptSig;
-            bool sigOK = VerifySignature(CCoins(txFrom, 0), txTo[i], 0, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, 0);
+            bool sigOK = VerifySignature(CCoin(txFrom.vout[txTo[i].vin[0].prevout.n], 0, false), txTo[i], 0, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, 0);
             if (i == j)
                 BOOST_CHECK_MESSAGE(sigOK, strprintf("VerifySignature %d %d", i, j));
             else
@@ -173,7 +173,7 @@ BOOST_AUTO_TEST_CASE(set)
         keystore.AddCScript(inner[i]);
     }
 
-    CTransaction txFrom;  // Funding transaction:
+    CMutableTransaction txFrom;  // Funding transaction:
     string reason;
     txFrom.vout.resize(4);
     for (int i = 0; i < 4; i++)
@@ -183,7 +183,7 @@ BOOST_AUTO_TEST_CASE(set)
     }
     BOOST_CHECK(IsStandardTx(txFrom, reason));
 
-    CTransaction txTo[4]; // Spending transactions
+    CMutableTransaction txTo[4]; // Spending transactions
     for (int i = 0; i < 4; i++)
     {
         txTo[i].vin.resize(1);
@@ -230,6 +230,15 @@ BOOST_AUTO_TEST_CASE(is)
 
     not_p2sh.clear(); not_p2sh << OP_HASH160 << dummy << OP_CHECKSIG;
     BOOST_CHECK(!not_p2sh.IsPayToScriptHash());
+
+    // Test CScript::IsPayToPubKeyHash()
+    CScript p2pkh;
+    p2pkh << OP_DUP << OP_HASH160 << dummy << OP_EQUALVERIFY << OP_CHECKSIG;
+    BOOST_CHECK(p2pkh.IsPayToPubKeyHash());
+    BOOST_CHECK(!p2sh.IsPayToPubKeyHash());
+    CScript not_p2pkh;
+    not_p2pkh << OP_DUP << OP_HASH160 << dummy << OP_EQUAL << OP_CHECKSIG;
+    BOOST_CHECK(!not_p2pkh.IsPayToPubKeyHash());
 }
 
 BOOST_AUTO_TEST_CASE(switchover)
@@ -265,7 +274,7 @@ BOOST_AUTO_TEST_CASE(AreInputsStandard)
         keys.push_back(key[i].GetPubKey());
     }
 
-    CTransaction txFrom;
+    CMutableTransaction txFrom;
     txFrom.vout.resize(6);
 
     // First three are standard:
@@ -287,7 +296,7 @@ BOOST_AUTO_TEST_CASE(AreInputsStandard)
     txFrom.vout[3].scriptPubKey = empty;
     txFrom.vout[3].nValue = 4000;
     // Can't use SetPayToScriptHash, it checks for the empty Script. So:
-    txFrom.vout[4].scriptPubKey << OP_HASH160 << Hash160(empty) << OP_EQUAL;
+    txFrom.vout[4].scriptPubKey << OP_HASH160 << Hash160(empty.begin(), empty.end()) << OP_EQUAL;
     txFrom.vout[4].nValue = 5000;
     CScript oneOfEleven;
     oneOfEleven << OP_1;
@@ -297,9 +306,9 @@ BOOST_AUTO_TEST_CASE(AreInputsStandard)
     txFrom.vout[5].scriptPubKey.SetDestination(oneOfEleven.GetID());
     txFrom.vout[5].nValue = 6000;
 
-    coins.SetCoins(txFrom.GetHash(), CCoins(txFrom, 0));
+    AddCoins(coins, txFrom, 0);
 
-    CTransaction txTo;
+    CMutableTransaction txTo;
     txTo.vout.resize(1);
     txTo.vout[0].scriptPubKey.SetDestination(key[1].GetPubKey().GetID());
 
@@ -317,6 +326,16 @@ BOOST_AUTO_TEST_CASE(AreInputsStandard)
     BOOST_CHECK(::AreInputsStandard(txTo, coins));
     BOOST_CHECK_EQUAL(GetP2SHSigOpCount(txTo, coins), 1U);
 
+    // The counts of the single pass over the scripts are the same
+    CTxAnalysis analysis;
+    AnalyzeTransaction(txFrom, analysis);
+    BOOST_CHECK_EQUAL(analysis.nLegacySigOps, GetLegacySigOpCount(txFrom));
+    AnalyzeTransaction(txTo, analysis);
+    BOOST_CHECK_EQUAL(analysis.nLegacySigOps, GetLegacySigOpCount(txTo));
+    BOOST_CHECK(analysis.fPushOnly);
+    BOOST_CHECK(::AreInputsStandard(txTo, coins, analysis));
+    BOOST_CHECK_EQUAL(analysis.nP2SHSigOps, 1U);
+
     // Make sure adding crap to the scriptSigs makes them non-standard:
     for (int i = 0; i < 3; i++)
     {
@@ -326,7 +345,7 @@ BOOST_AUTO_TEST_CASE(AreInputsStandard)
         txTo.vin[i].scriptSig = t;
     }
 
-    CTransaction txToNonStd;
+    CMutableTransaction txToNonStd;
     txToNonStd.vout.resize(1);
     txToNonStd.vout[0].scriptPubKey.SetDestination(key[1].GetPubKey().GetID());
     txToNonStd.vout[0].nValue = 1000;
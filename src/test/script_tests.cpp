@@ -236,11 +236,11 @@ BOOST_AUTO_TEST_CASE(script_CHECKMULTISIG12)
     CScript scriptPubKey12;
     scriptPubKey12 << OP_1 << key1.GetPubKey() << key2.GetPubKey() << OP_2 << OP_CHECKMULTISIG;
 
-    CTransaction txFrom12;
+    CMutableTransaction txFrom12;
     txFrom12.vout.resize(1);
     txFrom12.vout[0].scriptPubKey = scriptPubKey12;
 
-    CTransaction txTo12;
+    CMutableTransaction txTo12;
     txTo12.vin.resize(1);
     txTo12.vout.resize(1);
     txTo12.vin[0].prevout.n = 0;
@@ -270,11 +270,11 @@ BOOST_AUTO_TEST_CASE(script_CHECKMULTISIG23)
     CScript scriptPubKey23;
     scriptPubKey23 << OP_2 << key1.GetPubKey() << key2.GetPubKey() << key3.GetPubKey() << OP_3 << OP_CHECKMULTISIG;
 
-    CTransaction txFrom23;
+    CMutableTransaction txFrom23;
     txFrom23.vout.resize(1);
     txFrom23.vout[0].scriptPubKey = scriptPubKey23;
 
-    CTransaction txTo23;
+    CMutableTransaction txTo23;
     txTo23.vin.resize(1);
     txTo23.vout.resize(1);
     txTo23.vin[0].prevout.n = 0;
@@ -341,11 +341,11 @@ BOOST_AUTO_TEST_CASE(script_combineSigs)
         keystore.AddKey(key);
     }
 
-    CTransaction txFrom;
+    CMutableTransaction txFrom;
     txFrom.vout.resize(1);
     txFrom.vout[0].scriptPubKey.SetDestination(keys[0].GetPubKey().GetID());
     CScript& scriptPubKey = txFrom.vout[0].scriptPubKey;
-    CTransaction txTo;
+    CMutableTransaction txTo;
     txTo.vin.resize(1);
     txTo.vout.resize(1);
     txTo.vin[0].prevout.n = 0;
@@ -383,7 +383,7 @@ BOOST_AUTO_TEST_CASE(script_combineSigs)
     combined = CombineSignatures(scriptPubKey, txTo, 0, scriptSigCopy, scriptSig);
     BOOST_CHECK(combined == scriptSigCopy || combined == scriptSig);
     // dummy scriptSigCopy with placeholder, should always choose non-placeholder:
-    scriptSigCopy = CScript() << OP_0 << static_cast<vector<unsigned char> >(pkSingle);
+    scriptSigCopy = CScript() << OP_0 << ToByteVector(pkSingle);
     combined = CombineSignatures(scriptPubKey, txTo, 0, scriptSigCopy, scriptSig);
     BOOST_CHECK(combined == scriptSig);
     combined = CombineSignatures(scriptPubKey, txTo, 0, scriptSig, scriptSigCopy);
@@ -442,6 +442,85 @@ BOOST_AUTO_TEST_CASE(script_combineSigs)
     BOOST_CHECK(combined == partial3c);
 }
 
+static vector<unsigned char> SignInput(const CKey &key, const CScript &scriptCode, const CTransaction &txTo)
+{
+    uint256 hash = SignatureHash(scriptCode, txTo, 0, SIGHASH_ALL);
+    vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    return vchSig;
+}
+
+// Standard scripts are evaluated without the interpreter, unless the stack
+// is deep; both must give the same result.
+static void CheckTemplate(const CScript &scriptSig, const CScript &scriptPubKey, const CTransaction &txTo, bool fExpected)
+{
+    BOOST_CHECK_EQUAL(VerifyScript(scriptSig, scriptPubKey, txTo, 0, flags, 0), fExpected);
+    CScript scriptDeep;
+    for (int i = 0; i < 150; i++)
+        scriptDeep << OP_1;
+    scriptDeep += scriptSig;
+    BOOST_CHECK_EQUAL(VerifyScript(scriptDeep, scriptPubKey, txTo, 0, flags, 0), fExpected);
+}
+
+BOOST_AUTO_TEST_CASE(script_templates)
+{
+    CKey key1, key2, key3;
+    key1.MakeNewKey(true);
+    key2.MakeNewKey(false);
+    key3.MakeNewKey(true);
+
+    CMutableTransaction txTo;
+    txTo.vin.resize(1);
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = 1;
+
+    // Pay to pubkey hash
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(key1.GetPubKey().GetID());
+    vector<unsigned char> vchSig1 = SignInput(key1, scriptPubKey, txTo);
+    vector<unsigned char> vchSig2 = SignInput(key2, scriptPubKey, txTo);
+    CheckTemplate(CScript() << vchSig1 << key1.GetPubKey(), scriptPubKey, txTo, true);
+    CheckTemplate(CScript() << vchSig2 << key1.GetPubKey(), scriptPubKey, txTo, false);
+    CheckTemplate(CScript() << vchSig2 << key2.GetPubKey(), scriptPubKey, txTo, false);
+    CheckTemplate(CScript() << key1.GetPubKey() << vchSig1, scriptPubKey, txTo, false);
+    CheckTemplate(CScript(), scriptPubKey, txTo, false);
+
+    // Pay to pubkey
+    scriptPubKey = CScript() << key2.GetPubKey() << OP_CHECKSIG;
+    vchSig1 = SignInput(key1, scriptPubKey, txTo);
+    vchSig2 = SignInput(key2, scriptPubKey, txTo);
+    CheckTemplate(CScript() << vchSig2, scriptPubKey, txTo, true);
+    CheckTemplate(CScript() << vchSig1, scriptPubKey, txTo, false);
+
+    // 2 of 3 multisig, bare and in pay to script hash
+    CScript scriptMultisig;
+    scriptMultisig << OP_2 << key1.GetPubKey() << key2.GetPubKey() << key3.GetPubKey() << OP_3 << OP_CHECKMULTISIG;
+    vector<CKey> keys;
+    keys.push_back(key1);
+    keys.push_back(key2);
+    CheckTemplate(sign_multisig(scriptMultisig, keys, txTo), scriptMultisig, txTo, true);
+    keys[1] = key3;
+    CheckTemplate(sign_multisig(scriptMultisig, keys, txTo), scriptMultisig, txTo, true);
+    keys[0] = key3;
+    keys[1] = key1;
+    CheckTemplate(sign_multisig(scriptMultisig, keys, txTo), scriptMultisig, txTo, false);
+    keys[0] = key1;
+    CheckTemplate(sign_multisig(scriptMultisig, keys, txTo), scriptMultisig, txTo, false);
+
+    scriptPubKey.SetDestination(scriptMultisig.GetID());
+    keys[1] = key2;
+    CScript scriptSig = sign_multisig(scriptMultisig, keys, txTo);
+    CheckTemplate(scriptSig << ToByteVector(scriptMultisig), scriptPubKey, txTo, true);
+    keys[0] = key2;
+    keys[1] = key1;
+    scriptSig = sign_multisig(scriptMultisig, keys, txTo);
+    CheckTemplate(scriptSig << ToByteVector(scriptMultisig), scriptPubKey, txTo, false);
+    CScript scriptOther = CScript() << key1.GetPubKey() << OP_CHECKSIG;
+    scriptSig = CScript() << SignInput(key1, scriptOther, txTo);
+    CheckTemplate(scriptSig << ToByteVector(scriptOther), scriptPubKey, txTo, false);
+}
+
 BOOST_AUTO_TEST_CASE(script_standard_push)
 {
     for (int i=0; i<1000; i++) {
@@ -0,0 +1,40 @@
+// Copyright (c) 2014 The Digitalcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "scrypt.h"
+#include "uint256.h"
+#include "util.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(scrypt_tests)
+
+BOOST_AUTO_TEST_CASE(scrypt_multi_matches_single)
+{
+    static const int nMaxWays = 19;
+    char input[nMaxWays * 80];
+    char output[nMaxWays * 32];
+    char expected[nMaxWays * 32];
+    for (unsigned int i = 0; i < sizeof(input); i++)
+        input[i] = (char)(i * 31 + 7);
+    for (int i = 0; i < nMaxWays; i++)
+        scrypt_1024_1_1_256(input + 80 * i, expected + 32 * i);
+
+    char* scratchpad = scrypt_buffer_alloc(nMaxWays);
+    BOOST_REQUIRE(scratchpad != NULL);
+    BOOST_CHECK(((uintptr_t)scratchpad & 63) == 0);
+
+    // Every count, so widths that split into 8-, 4- and 1-lane passes are all covered
+    for (int nWays = 1; nWays <= nMaxWays; nWays++)
+    {
+        memset(output, 0, sizeof(output));
+        scrypt_1024_1_1_256_sp_multi(nWays, input, output, scratchpad);
+        BOOST_CHECK_MESSAGE(memcmp(output, expected, 32 * nWays) == 0, strprintf("nWays=%d", nWays));
+    }
+    scrypt_buffer_free(scratchpad);
+
+    BOOST_CHECK(scrypt_best_ways() >= 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
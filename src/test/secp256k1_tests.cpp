@@ -0,0 +1,201 @@
+// Copyright (c) 2014 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Unit tests comparing the libsecp256k1 signature verification with OpenSSL's
+//
+
+#if defined(HAVE_CONFIG_H)
+#include "bitcoin-config.h"
+#endif
+
+#include "key.h"
+#include "uint256.h"
+#include "util.h"
+#include "data/sig_noncanonical.json.h"
+#include "data/sig_canonical.json.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+#include "json/json_spirit_writer_template.h"
+
+using namespace std;
+using namespace json_spirit;
+
+// In script_tests.cpp
+extern Array read_json(const std::string& jsondata);
+
+BOOST_AUTO_TEST_SUITE(secp256k1_tests)
+
+#ifdef USE_SECP256K1
+
+// The order of the secp256k1 group, big endian
+static const unsigned char order[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE,
+    0xBA, 0xAE, 0xDC, 0xE6, 0xAF, 0x48, 0xA0, 0x3B, 0xBF, 0xD2, 0x5E, 0x8C, 0xD0, 0x36, 0x41, 0x41
+};
+
+// Both implementations have to agree on every signature, valid or not.
+static bool CheckAgree(const CPubKey &pubkey, const uint256 &hash, const vector<unsigned char> &vchSig)
+{
+    bool fOpenSSL = pubkey.VerifyOpenSSL(hash, vchSig);
+    bool fSecp256k1 = pubkey.VerifySecp256k1(hash, vchSig);
+    BOOST_CHECK_MESSAGE(fOpenSSL == fSecp256k1, "implementations disagree on " + HexStr(vchSig) + " by " + HexStr(pubkey.begin(), pubkey.end()));
+    return fSecp256k1;
+}
+
+// Split a DER signature made by CKey::Sign into 32-byte R and S
+static void ParseSig(const vector<unsigned char> &vchSig, unsigned char r[32], unsigned char s[32])
+{
+    unsigned int nLenR = vchSig[3];
+    unsigned int nLenS = vchSig[5 + nLenR];
+    const unsigned char *pr = &vchSig[4], *ps = &vchSig[6 + nLenR];
+    for (; nLenR > 32; nLenR--) pr++;
+    for (; nLenS > 32; nLenS--) ps++;
+    memset(r, 0, 32);
+    memset(s, 0, 32);
+    memcpy(r + 32 - nLenR, pr, nLenR);
+    memcpy(s + 32 - nLenS, ps, nLenS);
+}
+
+// DER encoding of one integer; fPad false leaves out the zero byte that
+// keeps values with the top bit set positive
+static void AppendInteger(vector<unsigned char> &vch, const unsigned char n[32], bool fPad = true, bool fLongLength = false)
+{
+    unsigned int nSkip = 0;
+    while (nSkip < 31 && n[nSkip] == 0)
+        nSkip++;
+    vector<unsigned char> vchValue;
+    if (fPad && (n[nSkip] & 0x80))
+        vchValue.push_back(0);
+    vchValue.insert(vchValue.end(), n + nSkip, n + 32);
+    vch.push_back(0x02);
+    if (fLongLength)
+        vch.push_back(0x81);
+    vch.push_back(vchValue.size());
+    vch.insert(vch.end(), vchValue.begin(), vchValue.end());
+}
+
+static vector<unsigned char> EncodeSig(const unsigned char r[32], const unsigned char s[32], bool fPadR = true, bool fLongLength = false)
+{
+    vector<unsigned char> vchInts;
+    AppendInteger(vchInts, r, fPadR, fLongLength);
+    AppendInteger(vchInts, s, true, fLongLength);
+    vector<unsigned char> vch;
+    vch.push_back(0x30);
+    if (fLongLength)
+        vch.push_back(0x81);
+    vch.push_back(vchInts.size());
+    vch.insert(vch.end(), vchInts.begin(), vchInts.end());
+    return vch;
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_consistency)
+{
+    for (int i = 0; i < 32; i++) {
+        CKey key;
+        key.MakeNewKey(i % 2 == 0);
+        CPubKey pubkey = key.GetPubKey();
+        uint256 hash = GetRandHash();
+        vector<unsigned char> vchSig;
+        BOOST_CHECK(key.Sign(hash, vchSig));
+
+        // The signature, by the wrong key and for the wrong hash
+        BOOST_CHECK(CheckAgree(pubkey, hash, vchSig));
+        BOOST_CHECK(!CheckAgree(pubkey, GetRandHash(), vchSig));
+        CKey keyOther;
+        keyOther.MakeNewKey(true);
+        BOOST_CHECK(!CheckAgree(keyOther.GetPubKey(), hash, vchSig));
+
+        // High S, which OpenSSL accepts
+        unsigned char r[32], s[32], sHigh[32];
+        ParseSig(vchSig, r, s);
+        int nBorrow = 0;
+        for (int j = 31; j >= 0; j--) {
+            int n = order[j] - s[j] - nBorrow;
+            nBorrow = n < 0;
+            sHigh[j] = n & 0xFF;
+        }
+        BOOST_CHECK(CheckAgree(pubkey, hash, EncodeSig(r, sHigh)));
+
+        // R or S not below the group order
+        BOOST_CHECK(!CheckAgree(pubkey, hash, EncodeSig(order, s)));
+        BOOST_CHECK(!CheckAgree(pubkey, hash, EncodeSig(r, order)));
+
+        // A negative R, when its top bit is set
+        if (r[0] & 0x80)
+            BOOST_CHECK(!CheckAgree(pubkey, hash, EncodeSig(r, s, false)));
+
+        // Flipped bits in the values
+        for (int j = 0; j < 8; j++) {
+            unsigned char rFlip[32], sFlip[32];
+            memcpy(rFlip, r, 32);
+            memcpy(sFlip, s, 32);
+            unsigned int nBit = GetRand(512);
+            if (nBit < 256)
+                rFlip[nBit / 8] ^= 1 << (nBit % 8);
+            else
+                sFlip[nBit / 8 - 32] ^= 1 << (nBit % 8);
+            CheckAgree(pubkey, hash, EncodeSig(rFlip, sFlip));
+        }
+
+        // Encodings that OpenSSL accepted before 1.0.1j, and consensus still
+        // does (OpenSSL itself has rejected them since)
+        BOOST_CHECK(pubkey.VerifySecp256k1(hash, EncodeSig(r, s, true, true)));
+        vector<unsigned char> vchTrailing(vchSig);
+        vchTrailing.push_back(0);
+        BOOST_CHECK(pubkey.VerifySecp256k1(hash, vchTrailing));
+
+        // The same key in hybrid encoding
+        if (!pubkey.IsCompressed()) {
+            vector<unsigned char> vchHybrid(pubkey.begin(), pubkey.end());
+            vchHybrid[0] = 0x06 | (vchHybrid[64] & 1);
+            CPubKey pubkeyHybrid(vchHybrid);
+            BOOST_CHECK(CheckAgree(pubkeyHybrid, hash, vchSig));
+            vchHybrid[0] ^= 1;
+            CheckAgree(CPubKey(vchHybrid), hash, vchSig);
+        }
+
+        // Truncated signatures
+        for (unsigned int nLen = 0; nLen < vchSig.size(); nLen += 7)
+            BOOST_CHECK(!CheckAgree(pubkey, hash, vector<unsigned char>(vchSig.begin(), vchSig.begin() + nLen)));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(secp256k1_vectors)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    uint256 hash = GetRandHash();
+
+    // Canonical signatures are parsed alike. They are not made with this
+    // key, so both implementations reject them.
+    Array tests = read_json(std::string(json_tests::sig_canonical, json_tests::sig_canonical + sizeof(json_tests::sig_canonical)));
+    BOOST_FOREACH(Value &tv, tests) {
+        string test = tv.get_str();
+        if (IsHex(test)) {
+            vector<unsigned char> vchSig = ParseHex(test);
+            vchSig.pop_back(); // hash type
+            BOOST_CHECK(!CheckAgree(pubkey, hash, vchSig));
+        }
+    }
+
+    // Non-canonical ones must not be taken for valid either
+    tests = read_json(std::string(json_tests::sig_noncanonical, json_tests::sig_noncanonical + sizeof(json_tests::sig_noncanonical)));
+    BOOST_FOREACH(Value &tv, tests) {
+        string test = tv.get_str();
+        if (IsHex(test)) {
+            vector<unsigned char> vchSig = ParseHex(test);
+            BOOST_CHECK(!pubkey.VerifySecp256k1(hash, vchSig));
+        }
+    }
+}
+
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,9 @@
 
 #include "serialize.h"
 
+#include "core.h"
+#include "version.h"
+
 #include <stdint.h>
 
 #include <boost/test/unit_test.hpp>
@@ -160,4 +163,57 @@ BOOST_AUTO_TEST_CASE(insert_delete)
     BOOST_CHECK_EQUAL(ss.size(), 0);
 }
 
+BOOST_AUTO_TEST_CASE(plain_stream_and_span_reader)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    CPlainDataStream ssPlain(SER_NETWORK, PROTOCOL_VERSION);
+    std::string str("span");
+    ss << 1234567 << str << VARINT(42);
+    ssPlain << 1234567 << str << VARINT(42);
+    BOOST_CHECK(ss.str() == ssPlain.str());
+
+    // Read in place, leaving the data as it was
+    std::string strData = ssPlain.str();
+    CSpanReader reader(strData.data(), strData.data() + strData.size(), SER_NETWORK, PROTOCOL_VERSION);
+    int n;
+    std::string strRead;
+    unsigned int nVarInt;
+    reader >> n >> strRead >> VARINT(nVarInt);
+    BOOST_CHECK_EQUAL(n, 1234567);
+    BOOST_CHECK_EQUAL(strRead, str);
+    BOOST_CHECK_EQUAL(nVarInt, 42U);
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK(strData == ssPlain.str());
+
+    // Past the end
+    BOOST_CHECK_THROW(reader >> n, std::ios_base::failure);
+    CSpanReader readerShort(strData.data(), strData.data() + 2, SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK_THROW(readerShort >> n, std::ios_base::failure);
+    BOOST_CHECK_EQUAL(readerShort.size(), 2U);
+}
+
+BOOST_AUTO_TEST_CASE(transaction_size_cache)
+{
+    CMutableTransaction txMut;
+    txMut.vin.resize(2);
+    txMut.vin[1].scriptSig = CScript() << std::vector<unsigned char>(300, 1);
+    txMut.vout.resize(1);
+    txMut.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    const CTransaction tx(txMut);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << tx;
+    BOOST_CHECK_EQUAL(::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION), ss.size());
+    BOOST_CHECK_EQUAL(::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION), ss.size());
+    BOOST_CHECK_EQUAL(::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION), ::GetSerializeSize(txMut, SER_NETWORK, PROTOCOL_VERSION));
+
+    // Deserialized and assigned transactions carry the size along
+    CTransaction txRead;
+    BOOST_CHECK_EQUAL(::GetSerializeSize(txRead, SER_NETWORK, PROTOCOL_VERSION), ::GetSerializeSize(CMutableTransaction(), SER_NETWORK, PROTOCOL_VERSION));
+    ss >> txRead;
+    BOOST_CHECK_EQUAL(::GetSerializeSize(txRead, SER_NETWORK, PROTOCOL_VERSION), ::GetSerializeSize(txMut, SER_NETWORK, PROTOCOL_VERSION));
+    txRead = CTransaction();
+    BOOST_CHECK_EQUAL(::GetSerializeSize(txRead, SER_NETWORK, PROTOCOL_VERSION), ::GetSerializeSize(CMutableTransaction(), SER_NETWORK, PROTOCOL_VERSION));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,163 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "core.h"
+#include "hash.h"
+#include "sha256.h"
+#include "util.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(sha256_tests)
+
+static std::string SHA256Hex(const std::string& str)
+{
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write((const unsigned char*)str.data(), str.size()).Finalize(hash);
+    return HexStr(hash, hash + sizeof(hash));
+}
+
+BOOST_AUTO_TEST_CASE(sha256_engines_match_reference)
+{
+    BOOST_CHECK(SHA256EngineSupported(SHA256_ENGINE_GENERIC));
+    std::string strMillion(1000000, 'a');
+    for (int nEngine = 0; nEngine < NUM_SHA256_ENGINES; nEngine++)
+    {
+        if (!SHA256EngineSupported(nEngine))
+            continue;
+        BOOST_CHECK_MESSAGE(SHA256EngineSelfTest(nEngine), SHA256EngineName(nEngine));
+        BOOST_CHECK(SHA256EngineInit(SHA256EngineName(nEngine)));
+
+        // FIPS 180-2 vectors, spanning one, two and many blocks
+        BOOST_CHECK_EQUAL(SHA256Hex(""), "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+        BOOST_CHECK_EQUAL(SHA256Hex("abc"), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+        BOOST_CHECK_EQUAL(SHA256Hex("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"),
+                          "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+        BOOST_CHECK_EQUAL(SHA256Hex(strMillion), "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+
+        // Writes split at every offset give the same hash as one write
+        std::string strData = strMillion.substr(0, 150);
+        std::string strExpected = SHA256Hex(strData);
+        for (unsigned int i = 0; i <= strData.size(); i++)
+        {
+            unsigned char hash[CSHA256::OUTPUT_SIZE];
+            CSHA256 ctx;
+            ctx.Write((const unsigned char*)strData.data(), i);
+            ctx.Write((const unsigned char*)strData.data() + i, strData.size() - i);
+            ctx.Finalize(hash);
+            BOOST_CHECK_EQUAL(HexStr(hash, hash + sizeof(hash)), strExpected);
+        }
+    }
+    BOOST_CHECK(SHA256EngineInit("auto"));
+}
+
+BOOST_AUTO_TEST_CASE(sha256_double_hash_batches)
+{
+    // Counts below, at and past the widths of the multi-way paths
+    for (int nEngine = 0; nEngine < NUM_SHA256_ENGINES; nEngine++)
+    {
+        if (!SHA256EngineSupported(nEngine))
+            continue;
+        BOOST_CHECK(SHA256EngineInit(SHA256EngineName(nEngine)));
+        for (unsigned int nCount = 0; nCount <= 19; nCount++)
+        {
+            std::vector<uint256> vIn(2 * nCount), vOut(nCount);
+            for (unsigned int i = 0; i < vIn.size(); i++)
+                vIn[i] = GetRandHash();
+            if (nCount > 0)
+                SHA256D64((unsigned char*)&vOut[0], (const unsigned char*)&vIn[0], nCount);
+            for (unsigned int i = 0; i < nCount; i++)
+                BOOST_CHECK_MESSAGE(vOut[i] == Hash(BEGIN(vIn[2*i]), END(vIn[2*i]), BEGIN(vIn[2*i+1]), END(vIn[2*i+1])),
+                                    SHA256EngineName(nEngine));
+        }
+    }
+    BOOST_CHECK(SHA256EngineInit("auto"));
+}
+
+BOOST_AUTO_TEST_CASE(sha256_merkle_tree)
+{
+    // Merkle roots computed pair by pair, for odd and even level sizes
+    for (unsigned int nTx = 1; nTx <= 20; nTx++)
+    {
+        CBlock block;
+        for (unsigned int i = 0; i < nTx; i++)
+        {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout.n = i;
+            tx.vout.resize(1);
+            tx.vout[0].nValue = i;
+            block.vtx.push_back(tx);
+        }
+
+        std::vector<uint256> vLevel;
+        for (unsigned int i = 0; i < nTx; i++)
+            vLevel.push_back(block.vtx[i].GetHash());
+        while (vLevel.size() > 1)
+        {
+            std::vector<uint256> vNext;
+            for (unsigned int i = 0; i < vLevel.size(); i += 2)
+            {
+                unsigned int i2 = std::min(i + 1, (unsigned int)vLevel.size() - 1);
+                vNext.push_back(Hash(BEGIN(vLevel[i]), END(vLevel[i]), BEGIN(vLevel[i2]), END(vLevel[i2])));
+            }
+            vLevel.swap(vNext);
+        }
+        BOOST_CHECK(block.BuildMerkleTree() == vLevel[0]);
+
+        // Only the path of a changed coinbase is hashed again
+        CMutableTransaction coinbase(block.vtx[0]);
+        coinbase.vout[0].nValue = 1000;
+        block.vtx[0] = coinbase;
+        CBlock blockRebuilt(block);
+        uint256 hashRoot = block.UpdateMerkleTreeCoinbase();
+        BOOST_CHECK(hashRoot == blockRebuilt.BuildMerkleTree());
+        BOOST_CHECK(CBlock::CheckMerkleBranch(block.vtx[0].GetHash(), block.GetMerkleBranch(0), 0) == hashRoot);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sha256_merkle_tree_mutated)
+{
+    CBlock block;
+    for (unsigned int i = 0; i < 6; i++)
+    {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.n = i;
+        tx.vout.resize(1);
+        block.vtx.push_back(tx);
+    }
+    bool fMutated = true;
+    uint256 hashRoot = block.BuildMerkleTree(&fMutated);
+    BOOST_CHECK(!fMutated);
+
+    // Six transactions leave an odd pair one level up: repeating the last
+    // two keeps the root, and pairs equal hashes at that level
+    block.vtx.push_back(block.vtx[4]);
+    block.vtx.push_back(block.vtx[5]);
+    BOOST_CHECK(block.BuildMerkleTree(&fMutated) == hashRoot);
+    BOOST_CHECK(fMutated);
+
+    // Repeating an odd last transaction pairs equal txids
+    block.vtx.resize(5);
+    hashRoot = block.BuildMerkleTree(&fMutated);
+    BOOST_CHECK(!fMutated);
+    block.vtx.push_back(block.vtx[4]);
+    BOOST_CHECK(block.BuildMerkleTree(&fMutated) == hashRoot);
+    BOOST_CHECK(fMutated);
+}
+
+BOOST_AUTO_TEST_CASE(sha256_engine_init)
+{
+    BOOST_CHECK(!SHA256EngineInit("nosuchengine"));
+    BOOST_CHECK(SHA256EngineInit("generic"));
+    BOOST_CHECK(SHA256EngineActive() == SHA256_ENGINE_GENERIC);
+    BOOST_CHECK(SHA256EngineInit("auto"));
+    BOOST_CHECK(SHA256EngineSupported(SHA256EngineActive()));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -28,7 +28,7 @@ uint256 static SignatureHashOld(CScript scriptCode, const CTransaction& txTo, un
         printf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
         return 1;
     }
-    CTransaction txTmp(txTo);
+    CMutableTransaction txTmp(txTo);
 
     // In case concatenating two scripts ends up with two codeseparators,
     // or an extra one at the end, this prevents all those possible incompatibilities.
@@ -90,7 +90,7 @@ void static RandomScript(CScript &script) {
         script << oplist[insecure_rand() % (sizeof(oplist)/sizeof(oplist[0]))];
 }
 
-void static RandomTransaction(CTransaction &tx, bool fSingle) {
+void static RandomTransaction(CMutableTransaction &tx, bool fSingle) {
     tx.nVersion = insecure_rand();
     tx.vin.clear();
     tx.vout.clear();
@@ -130,7 +130,7 @@ BOOST_AUTO_TEST_CASE(sighash_test)
     #endif
     for (int i=0; i<nRandomTests; i++) {
         int nHashType = insecure_rand();
-        CTransaction txTo;
+        CMutableTransaction txTo;
         RandomTransaction(txTo, (nHashType & 0x1f) == SIGHASH_SINGLE);
         CScript scriptCode;
         RandomScript(scriptCode);
@@ -161,6 +161,35 @@ BOOST_AUTO_TEST_CASE(sighash_test)
     #endif
 }
 
+BOOST_AUTO_TEST_CASE(sighash_cache)
+{
+    seed_insecure_rand(false);
+
+    for (int i=0; i<5000; i++) {
+        int nHashType = (insecure_rand() % 2) ? SIGHASH_ALL : insecure_rand();
+        CMutableTransaction txMut;
+        RandomTransaction(txMut, (nHashType & 0x1f) == SIGHASH_SINGLE);
+        const CTransaction txTo(txMut);
+        CScript scriptCode;
+        RandomScript(scriptCode);
+        CSignatureHashCache cache(txTo);
+
+        // The cache covers SIGHASH_ALL only, for every input
+        bool fAll = !(nHashType & SIGHASH_ANYONECANPAY) && (nHashType & 0x1f) != SIGHASH_NONE && (nHashType & 0x1f) != SIGHASH_SINGLE;
+        for (unsigned int nIn = 0; nIn < txTo.vin.size(); nIn++) {
+            uint256 sh;
+            BOOST_CHECK_EQUAL(cache.SignatureHash(scriptCode, txTo, nIn, nHashType, sh), fAll);
+            if (fAll)
+                BOOST_CHECK(sh == SignatureHash(scriptCode, txTo, nIn, nHashType));
+        }
+
+        // Not for another transaction
+        CTransaction txOther(txTo);
+        uint256 sh;
+        BOOST_CHECK(!cache.SignatureHash(scriptCode, txOther, 0, SIGHASH_ALL, sh));
+    }
+}
+
 // Goal: check that SignatureHash generates correct hash
 BOOST_AUTO_TEST_CASE(sighash_from_data)
 {
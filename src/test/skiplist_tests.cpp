@@ -0,0 +1,87 @@
+// Copyright (c) 2014 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "util.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+#define SKIPLIST_LENGTH 300000
+
+BOOST_AUTO_TEST_SUITE(skiplist_tests)
+
+BOOST_AUTO_TEST_CASE(skiplist_test)
+{
+    std::vector<CBlockIndex> vIndex(SKIPLIST_LENGTH);
+
+    for (int i=0; i<SKIPLIST_LENGTH; i++) {
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = (i == 0) ? NULL : &vIndex[i - 1];
+        vIndex[i].BuildSkip();
+    }
+
+    for (int i=0; i<SKIPLIST_LENGTH; i++) {
+        if (i > 0) {
+            BOOST_CHECK(vIndex[i].pskip == &vIndex[vIndex[i].pskip->nHeight]);
+            BOOST_CHECK(vIndex[i].pskip->nHeight < i);
+        } else {
+            BOOST_CHECK(vIndex[i].pskip == NULL);
+        }
+    }
+
+    for (int i=0; i < 1000; i++) {
+        int from = insecure_rand() % (SKIPLIST_LENGTH - 1);
+        int to = insecure_rand() % (from + 1);
+
+        BOOST_CHECK(vIndex[SKIPLIST_LENGTH - 1].GetAncestor(from) == &vIndex[from]);
+        BOOST_CHECK(vIndex[from].GetAncestor(to) == &vIndex[to]);
+        BOOST_CHECK(vIndex[from].GetAncestor(0) == &vIndex[0]);
+    }
+
+    BOOST_CHECK(vIndex[10].GetAncestor(11) == NULL);
+    BOOST_CHECK(vIndex[10].GetAncestor(-1) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(findfork_test)
+{
+    // A main chain of 1000 blocks and a branch of 50 blocks off each of a few heights
+    std::vector<CBlockIndex> vMain(1000);
+    for (unsigned int i = 0; i < vMain.size(); i++) {
+        vMain[i].nHeight = i;
+        vMain[i].pprev = (i == 0) ? NULL : &vMain[i - 1];
+        vMain[i].BuildSkip();
+    }
+    CChain chain;
+    chain.SetTip(&vMain[899]);
+
+    int nForks[] = {0, 1, 17, 500, 898, 899, 950};
+    BOOST_FOREACH(int nFork, nForks) {
+        std::vector<CBlockIndex> vBranch(50);
+        for (unsigned int i = 0; i < vBranch.size(); i++) {
+            vBranch[i].nHeight = nFork + 1 + i;
+            vBranch[i].pprev = (i == 0) ? &vMain[nFork] : &vBranch[i - 1];
+            vBranch[i].BuildSkip();
+        }
+        // Blocks past the tip of the chain fork where the chain ends
+        CBlockIndex* pindexExpected = &vMain[std::min(nFork, chain.Height())];
+        BOOST_CHECK(chain.FindFork(&vBranch.back()) == pindexExpected);
+        BOOST_CHECK(chain.FindFork(&vBranch.front()) == pindexExpected);
+    }
+
+    BOOST_CHECK(chain.FindFork(&vMain[0]) == &vMain[0]);
+    BOOST_CHECK(chain.FindFork(&vMain[899]) == &vMain[899]);
+    BOOST_CHECK(chain.FindFork(&vMain[999]) == &vMain[899]);
+
+    // No common block with a chain of another genesis
+    CBlockIndex other;
+    other.nHeight = 0;
+    BOOST_CHECK(chain.FindFork(&other) == NULL);
+    BOOST_CHECK(CChain().FindFork(&vMain[10]) == NULL);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
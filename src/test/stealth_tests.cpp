@@ -0,0 +1,59 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "stealthaddress.h"
+
+#include <string.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(stealth_tests)
+
+BOOST_AUTO_TEST_CASE(stealth_scan_key)
+{
+    for (int i = 0; i < 16; i++)
+    {
+        ec_secret sScan, sSpend, sEphem;
+        BOOST_CHECK(GenerateRandomSecret(sScan) == 0);
+        BOOST_CHECK(GenerateRandomSecret(sSpend) == 0);
+        BOOST_CHECK(GenerateRandomSecret(sEphem) == 0);
+
+        CStealthAddress sxAddr;
+        sxAddr.scan_secret.assign(&sScan.e[0], &sScan.e[0] + ec_secret_size);
+        BOOST_CHECK(SecretToPublicKey(sScan, sxAddr.scan_pubkey) == 0);
+        BOOST_CHECK(SecretToPublicKey(sSpend, sxAddr.spend_pubkey) == 0);
+
+        // What the sender derives from the ephemeral secret, the recipient
+        // derives from the ephemeral public key
+        ec_point pkEphem, pkSent, pkFound, pkScanned;
+        ec_secret sSharedSent, sSharedFound, sSharedScanned;
+        BOOST_CHECK(SecretToPublicKey(sEphem, pkEphem) == 0);
+        BOOST_CHECK(StealthSecret(sEphem, sxAddr.scan_pubkey, sxAddr.spend_pubkey, sSharedSent, pkSent) == 0);
+        BOOST_CHECK(StealthSecret(sScan, pkEphem, sxAddr.spend_pubkey, sSharedFound, pkFound) == 0);
+
+        CStealthScanKey scankey(sxAddr);
+        BOOST_CHECK(scankey.IsValid());
+        BOOST_CHECK(scankey.StealthSecret(pkEphem, sSharedScanned, pkScanned) == 0);
+
+        BOOST_CHECK(pkSent == pkFound);
+        BOOST_CHECK(pkScanned == pkFound);
+        BOOST_CHECK(memcmp(&sSharedScanned.e[0], &sSharedFound.e[0], ec_secret_size) == 0);
+        BOOST_CHECK(memcmp(&sSharedSent.e[0], &sSharedFound.e[0], ec_secret_size) == 0);
+
+        // Not a point of the curve
+        ec_point pkBad(pkEphem);
+        pkBad[0] = 0x05;
+        BOOST_CHECK(scankey.StealthSecret(pkBad, sSharedScanned, pkScanned) != 0);
+    }
+
+    // Without the scan secret the address is not owned
+    CStealthAddress sxWatch;
+    ec_secret sSpend;
+    BOOST_CHECK(GenerateRandomSecret(sSpend) == 0);
+    BOOST_CHECK(SecretToPublicKey(sSpend, sxWatch.spend_pubkey) == 0);
+    CStealthScanKey watchkey(sxWatch);
+    BOOST_CHECK(!watchkey.IsValid());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,88 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "sync.h"
+
+#include "util.h"
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(sync_tests)
+
+static CLockSiteStats FindLockSite(const std::string& strName)
+{
+    std::vector<CLockSiteStats> vStats = GetLockProfile();
+    for (unsigned int i = 0; i < vStats.size(); i++)
+        if (vStats[i].strName == strName)
+            return vStats[i];
+    return CLockSiteStats();
+}
+
+static void HoldLock(CCriticalSection* pcs, CSemaphore* psemLocked)
+{
+    LOCK(*pcs);
+    psemLocked->post();
+    MilliSleep(50);
+}
+
+BOOST_AUTO_TEST_CASE(lock_profile)
+{
+    bool fLockProfileSaved = fLockProfile;
+    ResetLockProfile();
+
+    // Nothing recorded while disabled
+    CCriticalSection cs_profiled;
+    fLockProfile = false;
+    {
+        LOCK(cs_profiled);
+    }
+    BOOST_CHECK_EQUAL(FindLockSite("cs_profiled").nLocks, 0U);
+
+    fLockProfile = true;
+    for (int i = 0; i < 3; i++) {
+        LOCK(cs_profiled);
+    }
+    {
+        TRY_LOCK(cs_profiled, lockProfiled);
+        bool fLocked = lockProfiled;
+        BOOST_CHECK(fLocked);
+    }
+    CLockSiteStats stats = FindLockSite("cs_profiled");
+    BOOST_CHECK_EQUAL(stats.nLocks, 3U);
+    BOOST_CHECK_EQUAL(stats.nContended, 0U);
+    BOOST_CHECK_EQUAL(stats.strFile, std::string(__FILE__));
+    BOOST_CHECK_EQUAL(stats.vWaitHistogram[0], 3U);
+    uint64_t nHolds = 0;
+    for (unsigned int i = 0; i < LOCKPROFILE_BUCKETS; i++)
+        nHolds += stats.vHoldHistogram[i];
+    BOOST_CHECK_EQUAL(nHolds, 3U);
+
+    // Waiting for another thread counts as contention
+    CCriticalSection cs_contended;
+    CSemaphore semLocked(0);
+    boost::thread thread(boost::bind(&HoldLock, &cs_contended, &semLocked));
+    semLocked.wait();
+    {
+        LOCK(cs_contended);
+    }
+    thread.join();
+    std::vector<CLockSiteStats> vStats = GetLockProfile();
+    uint64_t nContended = 0;
+    for (unsigned int i = 0; i < vStats.size(); i++) {
+        if (vStats[i].strName == "cs_contended" && vStats[i].nContended > 0) {
+            nContended += vStats[i].nContended;
+            BOOST_CHECK(vStats[i].nMaxWaitMicros > 0);
+            BOOST_CHECK_EQUAL(vStats[i].nWaitMicros, vStats[i].nMaxWaitMicros);
+        }
+    }
+    BOOST_CHECK_EQUAL(nContended, 1U);
+
+    ResetLockProfile();
+    BOOST_CHECK_EQUAL(FindLockSite("cs_profiled").nLocks, 0U);
+    fLockProfile = fLockProfileSaved;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -602,6 +602,11 @@ BOOST_AUTO_TEST_CASE( methods ) // GetHex SetHex begin() end() size() GetLow64 G
         BOOST_CHECK((R1L>>(256-i)).getdouble() == (double)(R1L64part >> (64-i)));
         BOOST_CHECK((R1S>>(160-i)).getdouble() == (double)(R1S64part >> (64-i)));
     }
+
+    // odd number of digits, and digits beyond the width
+    BOOST_CHECK(uint256("0xabc") == 0xabc);
+    BOOST_CHECK(uint160(std::string(" f")) == 0xf);
+    BOOST_CHECK(uint160("1" + R1S.ToString()) == R1S);
 }
 
 BOOST_AUTO_TEST_CASE( getmaxcoverage ) // some more tests just to get 100% coverage
@@ -633,5 +638,131 @@ BOOST_AUTO_TEST_CASE( getmaxcoverage ) // some more tests just to get 100% cover
     CHECKBITWISEOPERATOR(R1,~R2,&)
 }
 
+BOOST_AUTO_TEST_CASE( multiplyDivide ) // *= /= with 32-bit operands, bits()
+{
+    uint256 num = R1L >> 40;
+    uint256 prod = num;
+    prod *= 0x9c524adb;
+    prod /= 0x9c524adb;
+    BOOST_CHECK(prod == num);
+
+    prod = num;
+    prod *= 256;
+    BOOST_CHECK(prod == (num << 8));
+    prod /= 65536;
+    BOOST_CHECK(prod == (num >> 8));
+
+    prod = ~uint256(0);
+    prod /= 1;
+    BOOST_CHECK(prod == ~uint256(0));
+    prod *= 2;
+    BOOST_CHECK(prod == (~uint256(0) << 1));
+
+    BOOST_CHECK_EQUAL(uint256(0).bits(), 0U);
+    BOOST_CHECK_EQUAL(uint256(1).bits(), 1U);
+    BOOST_CHECK_EQUAL(uint256(0x80000000).bits(), 32U);
+    BOOST_CHECK_EQUAL((~uint256(0) >> 20).bits(), 236U);
+
+    // full width division
+    BOOST_CHECK(R1L / uint256(1) == R1L);
+    BOOST_CHECK(R1L / R1L == 1);
+    BOOST_CHECK(num / (R1L >> 100) == (uint64_t)1 << 60);
+    BOOST_CHECK(uint256(1000) / uint256(7) == 142);
+    BOOST_CHECK(uint256(7) / uint256(1000) == 0);
+    // block work at the proof of work limit, 2^256 / (target+1)
+    uint256 target = ~uint256(0) >> 20;
+    BOOST_CHECK(~target / (target + 1) + 1 == (uint64_t)1 << 20);
+}
+
+BOOST_AUTO_TEST_CASE( compact ) // SetCompact GetCompact, mirroring bignum_SetCompact
+{
+    uint256 num;
+    bool fNegative;
+    bool fOverflow;
+    num.SetCompact(0, &fNegative, &fOverflow);
+    BOOST_CHECK_EQUAL(num.GetHex(), "0000000000000000000000000000000000000000000000000000000000000000");
+    BOOST_CHECK_EQUAL(num.GetCompact(), 0U);
+    BOOST_CHECK_EQUAL(fNegative, false);
+    BOOST_CHECK_EQUAL(fOverflow, false);
+
+    num.SetCompact(0x00123456, &fNegative, &fOverflow);
+    BOOST_CHECK(num == 0);
+    BOOST_CHECK_EQUAL(num.GetCompact(), 0U);
+
+    num.SetCompact(0x01003456, &fNegative, &fOverflow);
+    BOOST_CHECK(num == 0);
+    BOOST_CHECK_EQUAL(num.GetCompact(), 0U);
+
+    num.SetCompact(0x04000000, &fNegative, &fOverflow);
+    BOOST_CHECK(num == 0);
+    BOOST_CHECK_EQUAL(num.GetCompact(), 0U);
+    BOOST_CHECK_EQUAL(fNegative, false);
+
+    num.SetCompact(0x04800000, &fNegative, &fOverflow);
+    BOOST_CHECK(num == 0);
+    BOOST_CHECK_EQUAL(num.GetCompact(), 0U);
+    BOOST_CHECK_EQUAL(fNegative, false);
+
+    num.SetCompact(0x01123456, &fNegative, &fOverflow);
+    BOOST_CHECK(num == 0x12);
+    BOOST_CHECK_EQUAL(num.GetCompact(), 0x01120000U);
+
+    // Make sure that we don't generate compacts with the 0x00800000 bit set
+    num = 0x80;
+    BOOST_CHECK_EQUAL(num.GetCompact(), 0x02008000U);
+
+    num.SetCompact(0x01fedcba, &fNegative, &fOverflow);
+    BOOST_CHECK(num == 0x7e);
+    BOOST_CHECK_EQUAL(num.GetCompact(true), 0x01fe0000U);
+    BOOST_CHECK_EQUAL(fNegative, true);
+
+    num.SetCompact(0x02123456, &fNegative, &fOverflow);
+    BOOST_CHECK(num == 0x1234);
+    BOOST_CHECK_EQUAL(num.GetCompact(), 0x02123400U);
+
+    num.SetCompact(0x03123456, &fNegative, &fOverflow);
+    BOOST_CHECK(num == 0x123456);
+    BOOST_CHECK_EQUAL(num.GetCompact(), 0x03123456U);
+
+    num.SetCompact(0x04923456, &fNegative, &fOverflow);
+    BOOST_CHECK(num == 0x12345600);
+    BOOST_CHECK_EQUAL(num.GetCompact(true), 0x04923456U);
+    BOOST_CHECK_EQUAL(fNegative, true);
+
+    num.SetCompact(0x05009234, &fNegative, &fOverflow);
+    BOOST_CHECK(num == 0x92340000);
+    BOOST_CHECK_EQUAL(num.GetCompact(), 0x05009234U);
+
+    num.SetCompact(0x20123456, &fNegative, &fOverflow);
+    BOOST_CHECK_EQUAL(num.GetHex(), "1234560000000000000000000000000000000000000000000000000000000000");
+    BOOST_CHECK_EQUAL(num.GetCompact(), 0x20123456U);
+    BOOST_CHECK_EQUAL(fOverflow, false);
+
+    num.SetCompact(0xff123456, &fNegative, &fOverflow);
+    BOOST_CHECK_EQUAL(fNegative, false);
+    BOOST_CHECK_EQUAL(fOverflow, true);
+
+    // The proof-of-work limit round-trips
+    num = ~uint256(0) >> 20;
+    BOOST_CHECK_EQUAL(num.GetCompact(), 0x1e0fffffU);
+}
+
+BOOST_AUTO_TEST_CASE( saltedHash )
+{
+    // Deterministic for a given salt
+    BOOST_CHECK_EQUAL(R1L.GetHash(R2L), R1L.GetHash(R2L));
+    BOOST_CHECK_EQUAL(ZeroL.GetHash(ZeroL), ZeroL.GetHash(uint256(0)));
+
+    // Depends on both the key and the salt
+    BOOST_CHECK(R1L.GetHash(ZeroL) != R2L.GetHash(ZeroL));
+    BOOST_CHECK(R1L.GetHash(ZeroL) != R1L.GetHash(R2L));
+
+    // Keys sharing their low bits must not share the hash
+    uint256 a = R1L, b = R1L;
+    b ^= OneL << 255;
+    BOOST_CHECK(a.GetLow64() == b.GetLow64());
+    BOOST_CHECK(a.GetHash(R2L) != b.GetHash(R2L));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
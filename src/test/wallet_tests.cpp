@@ -31,16 +31,18 @@ static vector<COutput> vCoins;
 static void add_coin(int64_t nValue, int nAge = 6*24, bool fIsFromMe = false, int nInput=0)
 {
     static int nextLockTime = 0;
-    CTransaction tx;
+    CMutableTransaction tx;
     tx.nLockTime = nextLockTime++;        // so all transactions get different hashes
     tx.vout.resize(nInput+1);
     tx.vout[nInput].nValue = nValue;
+    if (fIsFromMe) {
+        // IsFromMe() returns (GetDebit() > 0), and GetDebit() is 0 if vin.empty(),
+        // so stop vin being empty, and cache a non-zero Debit to fake out IsFromMe()
+        tx.vin.resize(1);
+    }
     CWalletTx* wtx = new CWalletTx(&wallet, tx);
     if (fIsFromMe)
     {
-        // IsFromMe() returns (GetDebit() > 0), and GetDebit() is 0 if vin.empty(),
-        // so stop vin being empty, and cache a non-zero Debit to fake out IsFromMe()
-        wtx->vin.resize(1);
         wtx->fDebitCached = true;
         wtx->nDebitCached = 1;
     }
@@ -303,4 +305,35 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+BOOST_AUTO_TEST_CASE(coin_selection_exact_match)
+{
+    CoinSet setCoinsRet;
+    int64_t nValueRet;
+
+    LOCK(wallet.cs_wallet);
+
+    for (int i = 0; i < RUN_TESTS; i++)
+    {
+        empty_wallet();
+
+        // 31 cents only comes out exactly with the single 1 cent coin, which
+        // a random subset rarely picks among twenty 2 cent coins
+        for (int j = 0; j < 20; j++)
+            add_coin(2 * CENT);
+        add_coin(1 * CENT);
+        add_coin(1 * COIN);
+
+        BOOST_CHECK( wallet.SelectCoinsMinConf(31 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, 31 * CENT);
+        BOOST_CHECK_EQUAL(setCoinsRet.size(), 16U);
+
+        // no exact match for 30.5 cents: the approximation avoids sub-cent
+        // change, still without the bigger coin
+        BOOST_CHECK( wallet.SelectCoinsMinConf(30.5 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK_GE(nValueRet, 31.5 * CENT);
+        BOOST_CHECK_LT(nValueRet, 1 * COIN);
+    }
+    empty_wallet();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,112 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "db.h"
+#include "wallet.h"
+#include "walletdb.h"
+
+#include <list>
+#include <string>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(walletstore_tests)
+
+static CAccount MakeAccount()
+{
+    CAccount account;
+    account.vchPubKey = CPubKey(ParseHex("0279be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798"));
+    return account;
+}
+
+BOOST_AUTO_TEST_CASE(walletstore_records)
+{
+    string strFile = "walletstore_records.dat";
+    BOOST_CHECK(bitdb.OpenStore(strFile));
+    BOOST_CHECK(bitdb.IsStore(strFile));
+
+    CAccount account = MakeAccount();
+    CAccount read;
+    {
+        CWalletDB walletdb(strFile);
+        int nVersion;
+        BOOST_CHECK(walletdb.ReadVersion(nVersion));
+        BOOST_CHECK_EQUAL(nVersion, CLIENT_VERSION);
+
+        BOOST_CHECK(walletdb.WriteAccount("a", account));
+        BOOST_CHECK(walletdb.ReadAccount("a", read));
+        BOOST_CHECK(read.vchPubKey == account.vchPubKey);
+
+        // A transaction is seen by its own reads, and is gone when aborted
+        BOOST_CHECK(walletdb.TxnBegin());
+        BOOST_CHECK(walletdb.WriteAccount("b", account));
+        BOOST_CHECK(walletdb.ReadAccount("b", read));
+        BOOST_CHECK(walletdb.TxnAbort());
+        BOOST_CHECK(!walletdb.ReadAccount("b", read));
+
+        BOOST_CHECK(walletdb.TxnBegin());
+        BOOST_CHECK(walletdb.WriteAccount("b", account));
+        BOOST_CHECK(walletdb.TxnCommit());
+    }
+
+    // Handles of a batch share its transaction
+    {
+        CDBBatch batch(strFile.c_str());
+        CWalletDB walletdb(strFile);
+        BOOST_CHECK(walletdb.WriteAccount("c", account));
+        CWalletDB walletdb2(strFile);
+        BOOST_CHECK(walletdb2.ReadAccount("c", read));
+    }
+    CWalletDB walletdb(strFile);
+    BOOST_CHECK(walletdb.ReadAccount("b", read));
+    BOOST_CHECK(walletdb.ReadAccount("c", read));
+    BOOST_CHECK(read.vchPubKey == account.vchPubKey);
+}
+
+BOOST_AUTO_TEST_CASE(walletstore_cursor)
+{
+    string strFile = "walletstore_cursor.dat";
+    BOOST_CHECK(bitdb.OpenStore(strFile));
+
+    CWalletDB walletdb(strFile);
+    CAccountingEntry ae;
+    ae.nTime = 1333333333;
+    ae.strOtherAccount = "x";
+    for (int i = 0; i < 3; i++)
+    {
+        ae.strAccount = (i == 1 ? "b" : "a");
+        ae.nCreditDebit = i + 1;
+        BOOST_CHECK(walletdb.WriteAccountingEntry(ae));
+    }
+    BOOST_CHECK(walletdb.WriteAccount("a", MakeAccount()));
+
+    // Positioned on the first entry of the account, and stopped after it
+    list<CAccountingEntry> entries;
+    walletdb.ListAccountCreditDebit("a", entries);
+    BOOST_CHECK_EQUAL(entries.size(), 2U);
+    BOOST_CHECK_EQUAL(walletdb.GetAccountCreditDebit("a"), 4);
+    entries.clear();
+    walletdb.ListAccountCreditDebit("*", entries);
+    BOOST_CHECK_EQUAL(entries.size(), 3U);
+
+    // A rewrite drops the skipped records
+    BOOST_CHECK(CDB::Rewrite(strFile, "\x07" "acentry"));
+    entries.clear();
+    walletdb.ListAccountCreditDebit("*", entries);
+    BOOST_CHECK(entries.empty());
+    CAccount read;
+    BOOST_CHECK(walletdb.ReadAccount("a", read));
+
+    // Copied into the store of another file
+    string strCopy = "walletstore_copy.dat";
+    BOOST_CHECK(CDB::CopyToStore(strFile, CDBEnv::StorePath(strCopy)));
+    BOOST_CHECK(bitdb.OpenStore(strCopy));
+    CWalletDB walletdbCopy(strCopy);
+    BOOST_CHECK(walletdbCopy.ReadAccount("a", read));
+    BOOST_CHECK(read.vchPubKey.IsValid());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -5,67 +5,495 @@
 
 #include "txdb.h"
 
+#include "addressindex.h"
+#include "blockfilter.h"
 #include "core.h"
+#include "indexbuild.h"
+#include "ui_interface.h"
 #include "uint256.h"
+#include "workpool.h"
 
 #include <stdint.h>
 
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
 using namespace std;
 
-void static BatchWriteCoins(CLevelDBBatch &batch, const uint256 &hash, const CCoins &coins) {
-    if (coins.IsPruned())
-        batch.Erase(make_pair('c', hash));
-    else
-        batch.Write(make_pair('c', hash), coins);
+namespace {
+
+/** Database key of a single unspent output: 'C', the txid and VARINT(n).
+ *  All outputs of a transaction are adjacent in the database. */
+class CCoinKey
+{
+public:
+    uint256 hash;
+    unsigned int n;
+
+    CCoinKey() : hash(0), n(0) {}
+    CCoinKey(const COutPoint &outpoint) : hash(outpoint.hash), n(outpoint.n) {}
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(hash);
+        READWRITE(VARINT(n));
+    )
+};
+
+/** Per-transaction coins record of chainstates written before the
+ *  per-output layout ('c' + txid). Only needed to upgrade them.
+ *
+ * Serialized format:
+ * - VARINT(nVersion)
+ * - VARINT(nCode)
+ * - unspentness bitvector, for vout[2] and further; least significant byte first
+ * - the non-spent CTxOuts (via CTxOutCompressor)
+ * - VARINT(nHeight)
+ *
+ * The nCode value consists of:
+ * - bit 1: IsCoinBase()
+ * - bit 2: vout[0] is not spent
+ * - bit 4: vout[1] is not spent
+ * - The higher bits encode N, the number of non-zero bytes in the following bitvector.
+ *   - In case both bit 2 and bit 4 are unset, they encode N-1, as there must be at
+ *     least one non-spent output).
+ */
+class CLegacyCoins
+{
+public:
+    bool fCoinBase;
+    std::vector<CTxOut> vout;
+    unsigned int nHeight;
+    int nVersion;
+
+    CLegacyCoins() : fCoinBase(false), vout(0), nHeight(0), nVersion(0) { }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        unsigned int nCode = 0;
+        // version
+        ::Unserialize(s, VARINT(this->nVersion), nType, nVersion);
+        // header code
+        ::Unserialize(s, VARINT(nCode), nType, nVersion);
+        fCoinBase = nCode & 1;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = nCode & 2;
+        vAvail[1] = nCode & 4;
+        unsigned int nMaskCode = (nCode / 8) + ((nCode & 6) != 0 ? 0 : 1);
+        // spentness bitmask
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail, nType, nVersion);
+            for (unsigned int p = 0; p < 8; p++) {
+                bool f = (chAvail & (1 << p)) != 0;
+                vAvail.push_back(f);
+            }
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        // txouts themself
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])), nType, nVersion);
+        }
+        // coinbase height
+        ::Unserialize(s, VARINT(nHeight), nType, nVersion);
+    }
+};
+
+}
+
+/** Scan the coin records whose txid starts with nStart, nStart + nStride, ...
+ *  (in serialized byte order). Run by the threads of CCoinsViewDB::ScanStats. */
+void static ScanCoinsRange(CLevelDBWrapper *pdb, const leveldb::Snapshot *psnapshot, unsigned int nStart, unsigned int nStride,
+                           CCoinsTotals *ptotals, uint64_t *pnTransactions, bool *pfOk) {
+    leveldb::Iterator *pcursor = pdb->NewIterator(psnapshot);
+    try {
+        for (unsigned int nByte = nStart; nByte < 256; nByte += nStride) {
+            CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+            ssKeySet << 'C' << (unsigned char)nByte;
+            pcursor->Seek(ssKeySet.str());
+            uint256 prevhash = 0;
+            bool fFirst = true;
+            while (pcursor->Valid()) {
+                leveldb::Slice slKey = pcursor->key();
+                if (slKey.size() < 2 || slKey[0] != 'C' || (unsigned char)slKey[1] != nByte)
+                    break;
+                CSpanReader ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+                char chType;
+                CCoinKey key;
+                ssKey >> chType >> key;
+                leveldb::Slice slValue = pcursor->value();
+                CSpanReader ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                CCoin coin;
+                ssValue >> coin;
+                // Outputs of one transaction are adjacent
+                if (fFirst || key.hash != prevhash) {
+                    (*pnTransactions)++;
+                    prevhash = key.hash;
+                    fFirst = false;
+                }
+                ptotals->Add(COutPoint(key.hash, key.n), coin);
+                pcursor->Next();
+            }
+        }
+    } catch (std::exception &e) {
+        *pfOk = error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    delete pcursor;
 }
 
 void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
     batch.Write('B', hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db("chainstate", GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
 }
 
-bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) {
-    return db.Read(make_pair('c', txid), coins);
+bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, CCoin &coin) {
+    return db.Read(make_pair('C', CCoinKey(outpoint)), coin);
 }
 
-bool CCoinsViewDB::SetCoins(const uint256 &txid, const CCoins &coins) {
-    CLevelDBBatch batch;
-    BatchWriteCoins(batch, txid, coins);
-    return db.WriteBatch(batch);
+bool CCoinsViewDB::HaveCoin(const COutPoint &outpoint) {
+    return db.Exists(make_pair('C', CCoinKey(outpoint)));
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256 &txid) {
-    return db.Exists(make_pair('c', txid));
+uint256 CCoinsViewDB::GetBestBlock() {
+    return GetBestBlock(NULL);
 }
 
-uint256 CCoinsViewDB::GetBestBlock() {
+bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, CCoin &coin, const leveldb::Snapshot *psnapshot) {
+    return db.Read(make_pair('C', CCoinKey(outpoint)), coin, psnapshot);
+}
+
+uint256 CCoinsViewDB::GetBestBlock(const leveldb::Snapshot *psnapshot) {
     uint256 hashBestChain;
-    if (!db.Read('B', hashBestChain))
+    if (!db.Read('B', hashBestChain, psnapshot))
         return uint256(0);
     return hashBestChain;
 }
 
+CCoinsViewDBSnapshot::CCoinsViewDBSnapshot(CCoinsViewDB &dbIn) : db(dbIn), psnapshot(dbIn.GetSnapshot()) { }
+
+CCoinsViewDBSnapshot::~CCoinsViewDBSnapshot() {
+    db.ReleaseSnapshot(psnapshot);
+}
+
+bool CCoinsViewDBSnapshot::GetCoin(const COutPoint &outpoint, CCoin &coin) {
+    return db.GetCoin(outpoint, coin, psnapshot);
+}
+
+bool CCoinsViewDBSnapshot::HaveCoin(const COutPoint &outpoint) {
+    CCoin coin;
+    return GetCoin(outpoint, coin);
+}
+
+uint256 CCoinsViewDBSnapshot::GetBestBlock() {
+    return db.GetBestBlock(psnapshot);
+}
+
 bool CCoinsViewDB::SetBestBlock(const uint256 &hashBlock) {
     CLevelDBBatch batch;
     BatchWriteHashBestChain(batch, hashBlock);
     return db.WriteBatch(batch);
 }
 
-bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock) {
-    LogPrint("coindb", "Committing %u changed transactions to coin database...\n", (unsigned int)mapCoins.size());
-
+bool CCoinsViewDB::BatchWrite(const CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsTotals &totalsDelta) {
     CLevelDBBatch batch;
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        BatchWriteCoins(batch, it->first, it->second);
+    size_t changed = 0;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            continue;
+        // Created and spent again before reaching us: nothing to erase.
+        if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coin.IsSpent())
+            continue;
+        if (it->second.coin.IsSpent())
+            batch.Erase(make_pair('C', CCoinKey(it->first)));
+        else
+            batch.Write(make_pair('C', CCoinKey(it->first)), it->second.coin);
+        changed++;
+    }
     if (hashBlock != uint256(0))
         BatchWriteHashBestChain(batch, hashBlock);
 
+    // The totals are committed atomically with the coins they describe.
+    CCoinsTotals totals;
+    db.Read('S', totals); // a new database has none yet
+    totals += totalsDelta;
+    batch.Write('S', totals);
+
+    LogPrint("coindb", "Committing %u changed outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)mapCoins.size());
+
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+bool CCoinsViewDB::Upgrade() {
+    if (!UpgradeRecords())
+        return false;
+
+    CCoinsTotals totals;
+    if (db.Read('S', totals))
+        return true;
+
+    LogPrintf("Computing the totals of the unspent output set...\n");
+    uiInterface.InitMessage(_("Upgrading chainstate database..."));
+    CCoinsStats stats;
+    if (!ScanStats(stats))
+        return false;
+    totals.nOutputs = stats.nTransactionOutputs;
+    totals.nAmount = stats.nTotalAmount;
+    totals.nSerializedSize = stats.nSerializedSize;
+    totals.hashSet = stats.hashSet;
+    return db.Write('S', totals, true);
+}
+
+bool CCoinsViewDB::UpgradeRecords() {
+    leveldb::Iterator *pcursor = db.NewIterator();
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('c', uint256(0));
+    pcursor->Seek(ssKeySet.str());
+    if (!pcursor->Valid() || pcursor->key()[0] != 'c') {
+        delete pcursor;
+        return true;
+    }
+
+    LogPrintf("Upgrading chainstate database to per-output records...\n");
+    uiInterface.InitMessage(_("Upgrading chainstate database..."));
+
+    // Every batch moves a set of transactions over completely, so an
+    // interrupted upgrade simply resumes at the next start.
+    CLevelDBBatch batch;
+    size_t nBatch = 0;
+    uint64_t nTransactions = 0, nOutputs = 0;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CSpanReader ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType;
+            if (chType != 'c')
+                break;
+            uint256 txhash;
+            ssKey >> txhash;
+            leveldb::Slice slValue = pcursor->value();
+            CSpanReader ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CLegacyCoins coins;
+            ssValue >> coins;
+            for (unsigned int i = 0; i < coins.vout.size(); i++) {
+                if (coins.vout[i].IsNull() || coins.vout[i].scriptPubKey.IsUnspendable())
+                    continue;
+                batch.Write(make_pair('C', CCoinKey(COutPoint(txhash, i))), CCoin(coins.vout[i], coins.nHeight, coins.fCoinBase));
+                nOutputs++;
+                nBatch++;
+            }
+            batch.Erase(make_pair('c', txhash));
+            nTransactions++;
+            nBatch++;
+            if (nBatch >= 10000) {
+                if (!db.WriteBatch(batch)) {
+                    delete pcursor;
+                    return false;
+                }
+                batch = CLevelDBBatch();
+                nBatch = 0;
+            }
+            pcursor->Next();
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    delete pcursor;
+    if (!db.WriteBatch(batch, true))
+        return false;
+    LogPrintf("Upgraded %u transactions into %u unspent outputs\n", (unsigned int)nTransactions, (unsigned int)nOutputs);
+    return true;
+}
+
+CCoinsViewAsyncDB::CCoinsViewAsyncDB(CCoinsView &baseIn, const boost::function<bool()> &fnPrepareIn) :
+    CCoinsViewBacked(baseIn), hashQueued(0), fQueued(false), fRunning(false), fFailed(false), fnPrepare(fnPrepareIn) { }
+
+bool CCoinsViewAsyncDB::GetCoin(const COutPoint &outpoint, CCoin &coin) {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fQueued) {
+            CCoinsMap::const_iterator it = mapQueued.find(outpoint);
+            if (it != mapQueued.end()) {
+                if (it->second.coin.IsSpent())
+                    return false;
+                coin = it->second.coin;
+                return true;
+            }
+        }
+    }
+    // Not part of the queued batch, so the base view is up to date for it.
+    return base->GetCoin(outpoint, coin);
+}
+
+bool CCoinsViewAsyncDB::HaveCoin(const COutPoint &outpoint) {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fQueued) {
+            CCoinsMap::const_iterator it = mapQueued.find(outpoint);
+            if (it != mapQueued.end())
+                return !it->second.coin.IsSpent();
+        }
+    }
+    return base->HaveCoin(outpoint);
+}
+
+uint256 CCoinsViewAsyncDB::GetBestBlock() {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fQueued && hashQueued != uint256(0))
+            return hashQueued;
+    }
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewAsyncDB::SetBestBlock(const uint256 &hashBlock) {
+    if (!Sync())
+        return false;
+    return base->SetBestBlock(hashBlock);
+}
+
+bool CCoinsViewAsyncDB::GetStats(CCoinsStats &statsOut) {
+    if (!Sync())
+        return false;
+    return base->GetStats(statsOut);
+}
+
+bool CCoinsViewAsyncDB::Write(const CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsTotals &totalsDelta) {
+    int64_t nStart = GetTimeMicros();
+    if (fnPrepare && !fnPrepare())
+        return false;
+    if (!base->BatchWrite(mapCoins, hashBlock, totalsDelta))
+        return false;
+    int64_t nTime = GetTimeMicros() - nStart;
+    LogPrint("coindb", "Flushed %u changed outputs to the coin database in %.2fms\n", (unsigned int)mapCoins.size(), nTime * 0.001);
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    stats.nFlushes++;
+    stats.nEntries += mapCoins.size();
+    stats.nLastMicros = nTime;
+    stats.nMaxMicros = std::max(stats.nMaxMicros, nTime);
+    stats.nTotalMicros += nTime;
+    return true;
+}
+
+bool CCoinsViewAsyncDB::Sync() {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (fQueued && !fFailed)
+        condWritten.wait(lock);
+    return !fFailed;
+}
+
+bool CCoinsViewAsyncDB::WaitQueue(boost::unique_lock<boost::mutex> &lock) {
+    // Only one batch is in flight at a time; this also keeps lookups simple,
+    // as an entry is never both queued and in a batch being written.
+    if (fQueued && !fFailed) {
+        int64_t nStart = GetTimeMicros();
+        while (fQueued && !fFailed)
+            condWritten.wait(lock);
+        stats.nWaitMicros += GetTimeMicros() - nStart;
+    }
+    return !fFailed;
+}
+
+bool CCoinsViewAsyncDB::BatchWrite(const CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsTotals &totalsDelta) {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (!WaitQueue(lock))
+        return false;
+    if (!fRunning) {
+        lock.unlock();
+        return Write(mapCoins, hashBlock, totalsDelta);
+    }
+
+    // Only keep what the base view will actually apply.
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            continue;
+        if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coin.IsSpent())
+            continue;
+        mapQueued.insert(*it);
+    }
+    hashQueued = hashBlock;
+    totalsQueued = totalsDelta;
+    fQueued = true;
+    condQueued.notify_one();
+    return true;
+}
+
+bool CCoinsViewAsyncDB::BatchMove(CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsTotals &totalsDelta) {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (!WaitQueue(lock))
+        return false;
+    if (!fRunning) {
+        lock.unlock();
+        return Write(mapCoins, hashBlock, totalsDelta);
+    }
+
+    // The queue is empty here: take the whole map, and drop what the base
+    // view would not apply.
+    mapQueued.swap(mapCoins);
+    for (CCoinsMap::iterator it = mapQueued.begin(); it != mapQueued.end(); ) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY) ||
+            ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coin.IsSpent()))
+            it = mapQueued.erase(it);
+        else
+            it++;
+    }
+    hashQueued = hashBlock;
+    totalsQueued = totalsDelta;
+    fQueued = true;
+    condQueued.notify_one();
+    return true;
+}
+
+void CCoinsViewAsyncDB::ThreadFlush() {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    fRunning = true;
+    try {
+        while (true) {
+            while (!fQueued || fFailed)
+                condQueued.wait(lock);
+
+            // The queued batch is not modified while fQueued is set, so it
+            // can be written without holding the lock.
+            lock.unlock();
+            bool fOk = Write(mapQueued, hashQueued, totalsQueued);
+            lock.lock();
+
+            if (!fOk) {
+                // Keep the batch, so lookups keep seeing the changes that
+                // never made it to disk.
+                LogPrintf("CCoinsViewAsyncDB::ThreadFlush() : failed to write to the coin database\n");
+                fFailed = true;
+            } else {
+                mapQueued.clear();
+                hashQueued = 0;
+                totalsQueued = CCoinsTotals();
+                fQueued = false;
+            }
+            condWritten.notify_all();
+        }
+    } catch (boost::thread_interrupted) {
+        // Interruption only happens while waiting, so nothing is left queued.
+        fRunning = false;
+        throw;
+    }
+}
+
+CCoinsFlushStats CCoinsViewAsyncDB::GetFlushStats() const {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    CCoinsFlushStats ret = stats;
+    ret.fPending = fQueued;
+    return ret;
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper("blockindex", GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
 }
 
 bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
@@ -73,6 +501,14 @@ bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
     return Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
 }
 
+bool CBlockTreeDB::WriteBlockIndexes(const std::vector<CBlockIndex*>& vIndex)
+{
+    CLevelDBBatch batch;
+    BOOST_FOREACH(CBlockIndex* pindex, vIndex)
+        batch.Write(make_pair('b', pindex->GetBlockHash()), CDiskBlockIndex(pindex));
+    return WriteBatch(batch);
+}
+
 bool CBlockTreeDB::WriteBestInvalidWork(const CBigNum& bnBestInvalidWork)
 {
     // Obsolete; only written for backward compatibility.
@@ -108,53 +544,81 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
 }
 
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
-    leveldb::Iterator *pcursor = db.NewIterator();
-    pcursor->SeekToFirst();
-
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    CCoinsTotals totals;
+    if (!db.Read('S', totals))
+        return error("%s : unspent output set totals missing", __func__);
     stats.hashBlock = GetBestBlock();
-    ss << stats.hashBlock;
-    int64_t nTotalAmount = 0;
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        try {
+    stats.SetTotals(totals);
+    return true;
+}
+
+bool CCoinsViewDB::ForEachCoin(const leveldb::Snapshot *psnapshot, const boost::function<bool(const COutPoint&, const CCoin&)> &fn) {
+    leveldb::Iterator *pcursor = db.NewIterator(psnapshot);
+    bool fOk = true;
+    try {
+        pcursor->Seek(std::string(1, 'C'));
+        while (pcursor->Valid()) {
             leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            if (slKey.size() < 1 || slKey[0] != 'C')
+                break;
+            CSpanReader ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
             char chType;
-            ssKey >> chType;
-            if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
-            }
+            CCoinKey key;
+            ssKey >> chType >> key;
+            leveldb::Slice slValue = pcursor->value();
+            CSpanReader ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CCoin coin;
+            ssValue >> coin;
+            if (!fn(COutPoint(key.hash, key.n), coin))
+                break;
             pcursor->Next();
+        }
+    } catch (std::exception &e) {
+        fOk = error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    delete pcursor;
+    return fOk;
+}
+
+bool CCoinsViewDB::ScanStats(CCoinsStats &stats, const leveldb::Snapshot *psnapshot) {
+    int nThreads = std::max(1, std::min(16, (int)boost::thread::hardware_concurrency()));
+    std::vector<CCoinsTotals> vTotals(nThreads);
+    std::vector<uint64_t> vTransactions(nThreads, 0);
+    bool fOk = true;
+
+    boost::thread_group threads;
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&ScanCoinsRange, &db, psnapshot, i, nThreads, &vTotals[i], &vTransactions[i], &fOk));
+
+    // In the meantime, look up the best block as of the same snapshot.
+    uint256 hashBestChain = 0;
+    leveldb::Iterator *pcursor = db.NewIterator(psnapshot);
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << 'B';
+    pcursor->Seek(ssKeySet.str());
+    if (pcursor->Valid() && pcursor->key() == ssKeySet.str()) {
+        try {
+            leveldb::Slice slValue = pcursor->value();
+            CSpanReader ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> hashBestChain;
         } catch (std::exception &e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            fOk = error("%s : Deserialize error - %s", __func__, e.what());
         }
     }
     delete pcursor;
-    stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
-    stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
+
+    threads.join_all();
+    if (!fOk)
+        return false;
+
+    CCoinsTotals totals;
+    stats.nTransactions = 0;
+    for (int i = 0; i < nThreads; i++) {
+        totals += vTotals[i];
+        stats.nTransactions += vTransactions[i];
+    }
+    stats.hashBlock = hashBestChain;
+    stats.SetTotals(totals);
     return true;
 }
 
@@ -162,13 +626,123 @@ bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
     return Read(make_pair('t', txid), pos);
 }
 
-bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >&vect) {
+bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >&vect, const CAddressIndexUpdate &addressUpdate, const CIndexBuildState *pbuildState) {
     CLevelDBBatch batch;
     for (std::vector<std::pair<uint256,CDiskTxPos> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
         batch.Write(make_pair('t', it->first), it->second);
+    // Writes go before erases: an output created and spent by the blocks of
+    // the update is gone at the end
+    for (std::vector<std::pair<CAddressIndexKey, int64_t> >::const_iterator it = addressUpdate.vHistory.begin(); it != addressUpdate.vHistory.end(); it++)
+        batch.Write(make_pair('a', it->first), it->second);
+    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it = addressUpdate.vUnspent.begin(); it != addressUpdate.vUnspent.end(); it++)
+        batch.Write(make_pair('u', it->first), it->second);
+    for (std::vector<std::pair<COutPoint, CSpentIndexValue> >::const_iterator it = addressUpdate.vSpent.begin(); it != addressUpdate.vSpent.end(); it++)
+        batch.Write(make_pair('p', it->first), it->second);
+    BOOST_FOREACH(const CAddressIndexKey &key, addressUpdate.vHistoryErased)
+        batch.Erase(make_pair('a', key));
+    BOOST_FOREACH(const CAddressUnspentKey &key, addressUpdate.vUnspentErased)
+        batch.Erase(make_pair('u', key));
+    BOOST_FOREACH(const COutPoint &outpoint, addressUpdate.vSpentErased)
+        batch.Erase(make_pair('p', outpoint));
+    if (pbuildState)
+        batch.Write('i', *pbuildState);
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::ReadIndexBuild(CIndexBuildState &state) {
+    return Read('i', state);
+}
+
+bool CBlockTreeDB::WriteIndexBuild(const CIndexBuildState &state) {
+    return Write('i', state);
+}
+
+bool CBlockTreeDB::ReadSpentIndex(const COutPoint &outpoint, CSpentIndexValue &value) {
+    return Read(make_pair('p', outpoint), value);
+}
+
+bool CBlockTreeDB::ReadAddressIndex(char chType, const uint160 &hashAddress, int nStart, int nEnd, std::vector<std::pair<CAddressIndexKey, int64_t> > &vEntries) {
+    // The entries of an address are contiguous and sorted by height
+    CAddressIndexKey keyStart;
+    keyStart.chType = chType;
+    keyStart.hashAddress = hashAddress;
+    keyStart.nHeight = std::max(nStart, 0);
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('a', keyStart);
+
+    leveldb::Iterator *pcursor = NewIterator();
+    bool fOk = true;
+    for (pcursor->Seek(ssKeySet.str()); pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CSpanReader ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chKey;
+            ssKey >> chKey;
+            if (chKey != 'a')
+                break;
+            CAddressIndexKey key;
+            ssKey >> key;
+            if (key.chType != chType || key.hashAddress != hashAddress || (nEnd > 0 && key.nHeight > (uint32_t)nEnd))
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CSpanReader ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            int64_t nValue;
+            ssValue >> nValue;
+            vEntries.push_back(make_pair(key, nValue));
+        } catch (std::exception &e) {
+            fOk = error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            break;
+        }
+    }
+    delete pcursor;
+    return fOk;
+}
+
+bool CBlockTreeDB::ReadAddressUnspent(char chType, const uint160 &hashAddress, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vUnspent) {
+    CAddressUnspentKey keyStart;
+    keyStart.chType = chType;
+    keyStart.hashAddress = hashAddress;
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('u', keyStart);
+
+    leveldb::Iterator *pcursor = NewIterator();
+    bool fOk = true;
+    for (pcursor->Seek(ssKeySet.str()); pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CSpanReader ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chKey;
+            ssKey >> chKey;
+            if (chKey != 'u')
+                break;
+            CAddressUnspentKey key;
+            ssKey >> key;
+            if (key.chType != chType || key.hashAddress != hashAddress)
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CSpanReader ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAddressUnspentValue value;
+            ssValue >> value;
+            vUnspent.push_back(make_pair(key, value));
+        } catch (std::exception &e) {
+            fOk = error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            break;
+        }
+    }
+    delete pcursor;
+    return fOk;
+}
+
+bool CBlockTreeDB::ReadBlockFilter(const uint256 &hash, CBlockFilterIndexEntry &entry) {
+    return Read(make_pair('g', hash), entry);
+}
+
+bool CBlockTreeDB::WriteBlockFilter(const uint256 &hash, const CBlockFilterIndexEntry &entry) {
+    return Write(make_pair('g', hash), entry);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair('F', name), fValue ? '1' : '0');
 }
@@ -181,6 +755,59 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+bool CBlockTreeDB::ReadBlockFileRecompressed(int nFile, bool &fRecompressed) {
+    fRecompressed = false;
+    ReadFlag(strprintf("recompressed%05u", nFile), fRecompressed);
+    return true;
+}
+
+bool CBlockTreeDB::WriteBlockFileRecompressed(int nFile, const CBlockFileInfo *pinfo, const std::vector<CBlockIndex*> &vIndex, const std::vector<std::pair<uint256, CDiskTxPos> > &vTxPos) {
+    CLevelDBBatch batch;
+    BOOST_FOREACH(CBlockIndex* pindex, vIndex)
+        batch.Write(make_pair('b', pindex->GetBlockHash()), CDiskBlockIndex(pindex));
+    for (std::vector<std::pair<uint256, CDiskTxPos> >::const_iterator it = vTxPos.begin(); it != vTxPos.end(); it++)
+        batch.Write(make_pair('t', it->first), it->second);
+    if (pinfo)
+        batch.Write(make_pair('f', nFile), *pinfo);
+    batch.Write(std::make_pair('F', strprintf("recompressed%05u", nFile)), '1');
+    return WriteBatch(batch);
+}
+
+/** Block index entries read from the database, in cursor order */
+struct CBlockIndexLoadBatch
+{
+    std::vector<std::string> vValue;
+    std::vector<CDiskBlockIndex> vIndex;
+    std::vector<uint256> vHash;
+    std::vector<char> vState; // 0 = not deserialized, 1 = failed CheckIndex, 2 = ok
+};
+
+// Number of block index entries decoded together while loading
+static const unsigned int BLOCK_INDEX_LOAD_BATCH = 50000;
+
+/** Deserialize and hash the entries [nBegin, nEnd) of a batch. Run on the
+ *  threads of a CWorkPool by LoadBlockIndexGuts. */
+void static DecodeBlockIndexRange(CBlockIndexLoadBatch *pbatch, unsigned int nBegin, unsigned int nEnd)
+{
+    for (unsigned int i = nBegin; i < nEnd; i++) {
+        const std::string &strValue = pbatch->vValue[i];
+        try {
+            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            // Versions that do not know BLOCK_HAVE_WORK keep the flag when
+            // they rewrite an entry, but not the work; it then reads as zero
+            ssValue << uint256(0);
+            ssValue >> pbatch->vIndex[i];
+        } catch (std::exception &e) {
+            pbatch->vState[i] = 0;
+            continue;
+        }
+        CDiskBlockIndex &diskindex = pbatch->vIndex[i];
+        pbatch->vHash[i] = diskindex.GetBlockHash();
+        diskindex.phashBlock = &pbatch->vHash[i];
+        pbatch->vState[i] = diskindex.CheckIndex() ? 2 : 1;
+    }
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
     leveldb::Iterator *pcursor = NewIterator();
@@ -189,45 +816,62 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
     ssKeySet << make_pair('b', uint256(0));
     pcursor->Seek(ssKeySet.str());
 
+    // Deserializing the entries and hashing their headers is spread over
+    // several threads; linking them into mapBlockIndex is done in order
+    int nThreads = std::max(nScriptCheckThreads, 1);
+    CWorkPool pool(TASK_VALIDATION);
+
     // Load mapBlockIndex
-    while (pcursor->Valid()) {
+    while (true) {
         boost::this_thread::interruption_point();
-        try {
+        CBlockIndexLoadBatch batch;
+        // The key starts with the serialized type character
+        while (pcursor->Valid() && batch.vValue.size() < BLOCK_INDEX_LOAD_BATCH) {
             leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'b') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
-
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nTx            = diskindex.nTx;
-
-                if (!pindexNew->CheckIndex())
-                    return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString());
-
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
+            if (slKey.empty() || slKey[0] != 'b')
+                break;
+            batch.vValue.push_back(pcursor->value().ToString());
+            pcursor->Next();
+        }
+        unsigned int nCount = batch.vValue.size();
+        if (nCount == 0)
+            break;
+        batch.vIndex.resize(nCount);
+        batch.vHash.resize(nCount);
+        batch.vState.resize(nCount, 0);
+        pool.ForEachRange(nCount, nThreads, boost::bind(&DecodeBlockIndexRange, &batch, _1, _2));
+
+        for (unsigned int i = 0; i < nCount; i++) {
+            const CDiskBlockIndex &diskindex = batch.vIndex[i];
+            if (batch.vState[i] == 0) {
+                delete pcursor;
+                return error("%s : Deserialize or I/O error", __func__);
             }
-        } catch (std::exception &e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+            if (batch.vState[i] == 1) {
+                delete pcursor;
+                return error("LoadBlockIndex() : CheckIndex failed: %s", diskindex.ToString());
+            }
+
+            // Construct block index object
+            CBlockIndex* pindexNew = InsertBlockIndex(batch.vHash[i]);
+            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nDataPos       = diskindex.nDataPos;
+            pindexNew->nUndoPos       = diskindex.nUndoPos;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            pindexNew->nStatus        = diskindex.nStatus;
+            pindexNew->nTx            = diskindex.nTx;
+            pindexNew->nChainWork     = diskindex.nChainWork;
+            if (pindexNew->nChainWork == 0)
+                pindexNew->nStatus &= ~BLOCK_HAVE_WORK;
         }
+        if (nCount < BLOCK_INDEX_LOAD_BATCH)
+            break;
     }
     delete pcursor;
 
@@ -9,13 +9,26 @@
 #include "leveldbwrapper.h"
 #include "main.h"
 
+class CAddressIndexKey;
+class CAddressIndexUpdate;
+class CAddressUnspentKey;
+class CAddressUnspentValue;
+class COutPoint;
+class CSpentIndexValue;
+class CBlockFilterIndexEntry;
+class CIndexBuildState;
+
 #include <map>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
 class CBigNum;
-class CCoins;
+class CCoin;
 class uint256;
 
 // -dbcache default (MiB)
@@ -33,13 +46,124 @@ protected:
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
-    bool GetCoins(const uint256 &txid, CCoins &coins);
-    bool SetCoins(const uint256 &txid, const CCoins &coins);
-    bool HaveCoins(const uint256 &txid);
+    bool GetCoin(const COutPoint &outpoint, CCoin &coin);
+    bool HaveCoin(const COutPoint &outpoint);
     uint256 GetBestBlock();
     bool SetBestBlock(const uint256 &hashBlock);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock);
+    bool BatchWrite(const CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsTotals &totalsDelta);
     bool GetStats(CCoinsStats &stats);
+
+    // Compute the statistics from the coin records themselves instead of the
+    // stored totals, as of a snapshot (or the current state if NULL). Also
+    // counts the transactions. The records are split over several threads.
+    bool ScanStats(CCoinsStats &stats, const leveldb::Snapshot *psnapshot = NULL);
+
+    const leveldb::Snapshot *GetSnapshot() { return db.GetSnapshot(); }
+    void ReleaseSnapshot(const leveldb::Snapshot *psnapshot) { db.ReleaseSnapshot(psnapshot); }
+
+    // Lookups as of a snapshot
+    bool GetCoin(const COutPoint &outpoint, CCoin &coin, const leveldb::Snapshot *psnapshot);
+    uint256 GetBestBlock(const leveldb::Snapshot *psnapshot);
+
+    // Call fn on every unspent output as of the snapshot, in database order
+    // (the outputs of a transaction are adjacent), until it returns false
+    bool ForEachCoin(const leveldb::Snapshot *psnapshot, const boost::function<bool(const COutPoint&, const CCoin&)> &fn);
+
+    // Convert a chainstate in the old per-transaction layout to per-output
+    // records, and compute the totals of the set if they are not stored yet
+    bool Upgrade();
+
+    CLevelDBStats GetDBStats() { return db.GetDBStats(); }
+
+private:
+    bool UpgradeRecords();
+};
+
+/** Read-only CCoinsView of the coin database as of a snapshot, which stays
+ *  consistent while the node goes on writing to the database. The snapshot
+ *  is released with the view.
+ */
+class CCoinsViewDBSnapshot : public CCoinsView
+{
+private:
+    CCoinsViewDB &db;
+    const leveldb::Snapshot *psnapshot;
+
+public:
+    CCoinsViewDBSnapshot(CCoinsViewDB &dbIn);
+    ~CCoinsViewDBSnapshot();
+
+    bool GetCoin(const COutPoint &outpoint, CCoin &coin);
+    bool HaveCoin(const COutPoint &outpoint);
+    uint256 GetBestBlock();
+};
+
+/** Latency statistics of the chainstate writes done by CCoinsViewAsyncDB */
+struct CCoinsFlushStats
+{
+    uint64_t nFlushes;       // number of batches written
+    uint64_t nEntries;       // total number of changed outputs written
+    int64_t nLastMicros;     // duration of the last write
+    int64_t nMaxMicros;      // duration of the slowest write
+    int64_t nTotalMicros;    // total time spent writing
+    int64_t nWaitMicros;     // total time callers were blocked by a write in progress
+    bool fPending;           // whether a batch is queued or being written
+
+    CCoinsFlushStats() : nFlushes(0), nEntries(0), nLastMicros(0), nMaxMicros(0), nTotalMicros(0), nWaitMicros(0), fPending(false) {}
+};
+
+/** CCoinsView that hands batches to a background thread for writing to its
+ *  base view, so connecting blocks does not wait for the database.
+ *
+ *  A queued batch stays visible to lookups until it has been written. The
+ *  base view commits the coins together with the best block marker, so after
+ *  a crash the database is at the last block whose batch completed. Without
+ *  a running flusher thread, batches are written synchronously.
+ */
+class CCoinsViewAsyncDB : public CCoinsViewBacked
+{
+private:
+    mutable boost::mutex mutex;
+    boost::condition_variable condQueued;  // a batch was queued
+    boost::condition_variable condWritten; // the queued batch was written
+
+    // The batch being written; only modified while no write is in progress.
+    CCoinsMap mapQueued;
+    uint256 hashQueued;
+    CCoinsTotals totalsQueued;
+    bool fQueued;
+
+    bool fRunning; // whether a flusher thread services this view
+    bool fFailed;  // whether a write failed; no further batches are accepted
+
+    // Called before every write, to make the data referenced by it durable.
+    boost::function<bool()> fnPrepare;
+
+    CCoinsFlushStats stats;
+
+    bool Write(const CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsTotals &totalsDelta);
+
+    // Wait until no batch is queued; false if a write failed
+    bool WaitQueue(boost::unique_lock<boost::mutex> &lock);
+
+public:
+    CCoinsViewAsyncDB(CCoinsView &baseIn, const boost::function<bool()> &fnPrepareIn);
+
+    bool GetCoin(const COutPoint &outpoint, CCoin &coin);
+    bool HaveCoin(const COutPoint &outpoint);
+    uint256 GetBestBlock();
+    bool SetBestBlock(const uint256 &hashBlock);
+    bool BatchWrite(const CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsTotals &totalsDelta);
+    bool BatchMove(CCoinsMap &mapCoins, const uint256 &hashBlock, const CCoinsTotals &totalsDelta);
+    bool GetStats(CCoinsStats &stats);
+
+    // Wait until a queued batch (if any) has been written to the base view
+    bool Sync();
+
+    // Body of the flusher thread; runs until interrupted
+    void ThreadFlush();
+
+    CCoinsFlushStats GetFlushStats() const;
 };
 
 /** Access to the block database (blocks/index/) */
@@ -52,6 +176,7 @@ private:
     void operator=(const CBlockTreeDB&);
 public:
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
+    bool WriteBlockIndexes(const std::vector<CBlockIndex*>& vIndex);
     bool WriteBestInvalidWork(const CBigNum& bnBestInvalidWork);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
     bool WriteBlockFileInfo(int nFile, const CBlockFileInfo &fileinfo);
@@ -60,9 +185,24 @@ public:
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool &fReindex);
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
-    bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    // Writes the transaction, address and spent indexes of blocks in one
+    // batch, with the progress of the background index build if given
+    bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list, const CAddressIndexUpdate &addressUpdate, const CIndexBuildState *pbuildState = NULL);
+    bool ReadIndexBuild(CIndexBuildState &state);
+    bool WriteIndexBuild(const CIndexBuildState &state);
+    // The history of an address from height nStart on, and up to nEnd unless 0
+    bool ReadAddressIndex(char chType, const uint160 &hashAddress, int nStart, int nEnd, std::vector<std::pair<CAddressIndexKey, int64_t> > &vEntries);
+    bool ReadAddressUnspent(char chType, const uint160 &hashAddress, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vUnspent);
+    bool ReadSpentIndex(const COutPoint &outpoint, CSpentIndexValue &value);
+    bool ReadBlockFilter(const uint256 &hash, CBlockFilterIndexEntry &entry);
+    bool WriteBlockFilter(const uint256 &hash, const CBlockFilterIndexEntry &entry);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
+    // Whether a block file was rewritten with compressed records
+    bool ReadBlockFileRecompressed(int nFile, bool &fRecompressed);
+    // Mark a block file as rewritten, in one batch with the block index and
+    // transaction index entries and the file info for the new file (if any)
+    bool WriteBlockFileRecompressed(int nFile, const CBlockFileInfo *pinfo, const std::vector<CBlockIndex*> &vIndex, const std::vector<std::pair<uint256, CDiskTxPos> > &vTxPos);
     bool LoadBlockIndexGuts();
 };
 
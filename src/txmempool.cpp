@@ -6,19 +6,72 @@
 #include "core.h"
 #include "txmempool.h"
 
+#include "core_memusage.h"
+#include "memusage.h"
+#include "util.h"
+
+#include <math.h>
+
 using namespace std;
 
+CTxidHasher::CTxidHasher() : salt(GetRandHash()) {}
+
 CTxMemPoolEntry::CTxMemPoolEntry()
 {
     nHeight = MEMPOOL_HEIGHT;
+    nScriptFlags = 0;
+    nSigOps = 0;
+    nP2SHSigOps = -1;
+    nCountWithAncestors = 0;
+    nSizeWithAncestors = 0;
+    nFeesWithAncestors = 0;
+    nSigOpsWithAncestors = 0;
+    nCountWithDescendants = 0;
+    nSizeWithDescendants = 0;
+    nFeesWithDescendants = 0;
+    nUsageSize = 0;
+    dIndexPriority = 0;
+    nSequence = 0;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, int64_t _nFee,
                                  int64_t _nTime, double _dPriority,
                                  unsigned int _nHeight):
-    tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight)
+    tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight), nScriptFlags(0)
 {
     nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    // The same count as GetLegacySigOpCount
+    nSigOps = 0;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nSigOps += txin.scriptSig.GetSigOpCount(false);
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nSigOps += txout.scriptPubKey.GetSigOpCount(false);
+    nP2SHSigOps = -1;
+    Init();
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, int64_t _nFee,
+                                 int64_t _nTime, double _dPriority,
+                                 unsigned int _nHeight, size_t _nTxSize,
+                                 unsigned int _nSigOps, unsigned int _nP2SHSigOps):
+    tx(_tx), nFee(_nFee), nTxSize(_nTxSize), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight), nScriptFlags(0),
+    nSigOps(_nSigOps), nP2SHSigOps(_nP2SHSigOps)
+{
+    Init();
+}
+
+void CTxMemPoolEntry::Init()
+{
+    nUsageSize = RecursiveDynamicUsage(tx);
+    nCountWithAncestors = 1;
+    nSizeWithAncestors = nTxSize;
+    nFeesWithAncestors = nFee;
+    nSigOpsWithAncestors = nSigOps;
+    nCountWithDescendants = 1;
+    nSizeWithDescendants = nTxSize;
+    nFeesWithDescendants = nFee;
+    dIndexPriority = dPriority;
+    nSequence = 0;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -41,19 +94,159 @@ CTxMemPool::CTxMemPool()
     // accepting transactions becomes O(N^2) where N is the number
     // of transactions in the pool
     fSanityCheck = false;
+    nTransactionsUpdated = 0;
+    nPriorityHeight = 0;
+    nAdded = 0;
+    nRemoved = 0;
+    nTotalTxSize = 0;
+    cachedInnerUsage = 0;
+    dRollingMinimumFeeRate = 0;
+    nLastRollingFeeUpdate = GetTime();
 }
 
-void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
+// The in-pool ancestors of tx: the transactions it spends from, and theirs.
+void CTxMemPool::CalculateAncestors(const CTransaction &tx, std::set<uint256> &setAncestors) const
 {
-    LOCK(cs);
+    std::vector<const CTransaction*> vStack(1, &tx);
+    while (!vStack.empty()) {
+        const CTransaction *ptx = vStack.back();
+        vStack.pop_back();
+        BOOST_FOREACH(const CTxIn &txin, ptx->vin) {
+            CTxMemPoolMap::const_iterator it = mapTx.find(txin.prevout.hash);
+            if (it != mapTx.end() && setAncestors.insert(it->first).second)
+                vStack.push_back(&it->second.GetTx());
+        }
+    }
+}
 
-    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hashTx, 0));
+// The in-pool descendants of a transaction: those spending from it, and theirs.
+void CTxMemPool::CalculateDescendants(const uint256 &hash, std::set<uint256> &setDescendants) const
+{
+    std::vector<uint256> vStack(1, hash);
+    while (!vStack.empty()) {
+        uint256 hashTx = vStack.back();
+        vStack.pop_back();
+        CTxMemPoolMap::const_iterator itTx = mapTx.find(hashTx);
+        if (itTx == mapTx.end())
+            continue;
+        for (unsigned int i = 0; i < itTx->second.GetTx().vout.size(); i++) {
+            CNextTxMap::const_iterator it = mapNextTx.find(COutPoint(hashTx, i));
+            if (it == mapNextTx.end())
+                continue;
+            uint256 hashSpender = it->second.ptx->GetHash();
+            if (setDescendants.insert(hashSpender).second)
+                vStack.push_back(hashSpender);
+        }
+    }
+}
 
-    // iterate over all COutPoints in mapNextTx whose hash equals the provided hashTx
-    while (it != mapNextTx.end() && it->first.hash == hashTx) {
-        coins.Spend(it->first.n); // and remove those outputs from coins
-        it++;
+// Recompute the ancestor totals of an entry, and its place in the indexes.
+void CTxMemPool::UpdateAncestorState(const uint256 &hash, CTxMemPoolEntry &entry)
+{
+    RemoveFromIndexes(hash, entry);
+    std::set<uint256> setAncestors;
+    CalculateAncestors(entry.GetTx(), setAncestors);
+    entry.nCountWithAncestors = 1;
+    entry.nSizeWithAncestors = entry.GetTxSize();
+    entry.nFeesWithAncestors = entry.GetFee();
+    entry.nSigOpsWithAncestors = entry.GetSigOps();
+    BOOST_FOREACH(const uint256 &hashAncestor, setAncestors) {
+        const CTxMemPoolEntry &ancestor = mapTx[hashAncestor];
+        entry.nCountWithAncestors++;
+        entry.nSizeWithAncestors += ancestor.GetTxSize();
+        entry.nFeesWithAncestors += ancestor.GetFee();
+        entry.nSigOpsWithAncestors += ancestor.GetSigOps();
     }
+    AddToIndexes(hash, entry);
+}
+
+// Recompute the descendant totals of an entry, and its place in the indexes.
+void CTxMemPool::UpdateDescendantState(const uint256 &hash, CTxMemPoolEntry &entry)
+{
+    RemoveFromIndexes(hash, entry);
+    std::set<uint256> setDescendants;
+    CalculateDescendants(hash, setDescendants);
+    entry.nCountWithDescendants = 1;
+    entry.nSizeWithDescendants = entry.GetTxSize();
+    entry.nFeesWithDescendants = entry.GetFee();
+    BOOST_FOREACH(const uint256 &hashDescendant, setDescendants) {
+        const CTxMemPoolEntry &descendant = mapTx[hashDescendant];
+        entry.nCountWithDescendants++;
+        entry.nSizeWithDescendants += descendant.GetTxSize();
+        entry.nFeesWithDescendants += descendant.GetFee();
+    }
+    AddToIndexes(hash, entry);
+}
+
+// Add one transaction to, or take it out of, an entry's ancestor totals.
+void CTxMemPool::UpdateAncestorTotals(const uint256 &hash, CTxMemPoolEntry &entry, const CTxMemPoolEntry &ancestor, bool fAdd)
+{
+    RemoveFromIndexes(hash, entry);
+    if (fAdd) {
+        entry.nCountWithAncestors++;
+        entry.nSizeWithAncestors += ancestor.GetTxSize();
+        entry.nFeesWithAncestors += ancestor.GetFee();
+        entry.nSigOpsWithAncestors += ancestor.GetSigOps();
+    } else {
+        entry.nCountWithAncestors--;
+        entry.nSizeWithAncestors -= ancestor.GetTxSize();
+        entry.nFeesWithAncestors -= ancestor.GetFee();
+        entry.nSigOpsWithAncestors -= ancestor.GetSigOps();
+    }
+    AddToIndexes(hash, entry);
+}
+
+// Add one transaction to, or take it out of, an entry's descendant totals.
+void CTxMemPool::UpdateDescendantTotals(const uint256 &hash, CTxMemPoolEntry &entry, const CTxMemPoolEntry &descendant, bool fAdd)
+{
+    RemoveFromIndexes(hash, entry);
+    if (fAdd) {
+        entry.nCountWithDescendants++;
+        entry.nSizeWithDescendants += descendant.GetTxSize();
+        entry.nFeesWithDescendants += descendant.GetFee();
+    } else {
+        entry.nCountWithDescendants--;
+        entry.nSizeWithDescendants -= descendant.GetTxSize();
+        entry.nFeesWithDescendants -= descendant.GetFee();
+    }
+    AddToIndexes(hash, entry);
+}
+
+void CTxMemPool::AddToIndexes(const uint256 &hash, CTxMemPoolEntry &entry)
+{
+    // Transactions that entered the pool at a later height than the index
+    // get the priority they entered with.
+    entry.dIndexPriority = entry.GetPriority(std::max(nPriorityHeight, entry.GetHeight()));
+    setByPriority.insert(CTxMemPoolIndexKey(entry.dIndexPriority, entry.GetFeeRate(), hash));
+    setByAncestorFeeRate.insert(CTxMemPoolIndexKey(entry.GetAncestorFeeRate(), entry.GetFeeRate(), hash));
+    setByDescendantScore.insert(CTxMemPoolIndexKey(entry.GetDescendantScore(), entry.GetFeeRate(), hash));
+}
+
+void CTxMemPool::RemoveFromIndexes(const uint256 &hash, const CTxMemPoolEntry &entry)
+{
+    setByPriority.erase(CTxMemPoolIndexKey(entry.dIndexPriority, entry.GetFeeRate(), hash));
+    setByAncestorFeeRate.erase(CTxMemPoolIndexKey(entry.GetAncestorFeeRate(), entry.GetFeeRate(), hash));
+    setByDescendantScore.erase(CTxMemPoolIndexKey(entry.GetDescendantScore(), entry.GetFeeRate(), hash));
+}
+
+void CTxMemPool::SetPriorityHeight(unsigned int nHeight)
+{
+    LOCK(cs);
+    if (nHeight == nPriorityHeight)
+        return;
+    nPriorityHeight = nHeight;
+    setByPriority.clear();
+    for (CTxMemPoolMap::iterator it = mapTx.begin(); it != mapTx.end(); ++it) {
+        CTxMemPoolEntry &entry = it->second;
+        entry.dIndexPriority = entry.GetPriority(std::max(nPriorityHeight, entry.GetHeight()));
+        setByPriority.insert(CTxMemPoolIndexKey(entry.dIndexPriority, entry.GetFeeRate(), it->first));
+    }
+}
+
+bool CTxMemPool::isSpent(const COutPoint& outpoint)
+{
+    LOCK(cs);
+    return mapNextTx.count(outpoint) != 0;
 }
 
 unsigned int CTxMemPool::GetTransactionsUpdated() const
@@ -68,6 +261,158 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
+uint64_t CTxMemPool::GetAdded() const
+{
+    LOCK(cs);
+    return nAdded;
+}
+
+uint64_t CTxMemPool::GetRemoved() const
+{
+    LOCK(cs);
+    return nRemoved;
+}
+
+uint64_t CTxMemPool::GetTotalTxSize() const
+{
+    LOCK(cs);
+    return nTotalTxSize;
+}
+
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    return memusage::DynamicUsage(mapTx) + memusage::DynamicUsage(mapNextTx) +
+        memusage::DynamicUsage(setByPriority) + memusage::DynamicUsage(setByAncestorFeeRate) +
+        memusage::DynamicUsage(setByDescendantScore) + cachedInnerUsage;
+}
+
+boost::shared_ptr<const CTxMemPoolSnapshot> CTxMemPool::RefreshSnapshot() const
+{
+    AssertLockHeld(cs);
+    {
+        LOCK(cs_snapshot);
+        if (psnapshot && psnapshot->nTransactionsUpdated == nTransactionsUpdated)
+            return psnapshot;
+    }
+    boost::shared_ptr<CTxMemPoolSnapshot> pnew(new CTxMemPoolSnapshot());
+    pnew->nTransactionsUpdated = nTransactionsUpdated;
+    pnew->nTotalTxSize = nTotalTxSize;
+    pnew->nUsage = DynamicMemoryUsage();
+    for (CTxMemPoolMap::const_iterator it = mapTx.begin(); it != mapTx.end(); ++it) {
+        const CTxMemPoolEntry &entry = it->second;
+        CTxMemPoolSnapshot::Entry &snap = pnew->mapEntries[it->first];
+        snap.nTxSize = entry.GetTxSize();
+        snap.nFee = entry.GetFee();
+        snap.nTime = entry.GetTime();
+        snap.nHeight = entry.GetHeight();
+        snap.dPriority = entry.GetPriority(entry.GetHeight());
+        snap.nValueIn = entry.GetTx().GetValueOut() + entry.GetFee();
+        BOOST_FOREACH(const CTxIn &txin, entry.GetTx().vin)
+            if (mapTx.count(txin.prevout.hash) && std::find(snap.vDepends.begin(), snap.vDepends.end(), txin.prevout.hash) == snap.vDepends.end())
+                snap.vDepends.push_back(txin.prevout.hash);
+        std::sort(snap.vDepends.begin(), snap.vDepends.end());
+    }
+    LOCK(cs_snapshot);
+    psnapshot = pnew;
+    return psnapshot;
+}
+
+boost::shared_ptr<const CTxMemPoolSnapshot> CTxMemPool::GetSnapshot() const
+{
+    {
+        TRY_LOCK(cs, lockPool);
+        if (lockPool)
+            return RefreshSnapshot();
+    }
+    {
+        LOCK(cs_snapshot);
+        if (psnapshot)
+            return psnapshot;
+    }
+    // There is none yet
+    LOCK(cs);
+    return RefreshSnapshot();
+}
+
+void CTxMemPool::TrimToSize(size_t nSizeLimit)
+{
+    LOCK(cs);
+    unsigned int nEvicted = 0;
+    while (!setByDescendantScore.empty() && DynamicMemoryUsage() > nSizeLimit) {
+        const CTxMemPoolEntry &entry = mapTx[setByDescendantScore.begin()->hash];
+        // Whatever replaces the package has to pay more than it did, by at
+        // least the relay fee for its own bandwidth.
+        double dFeeRate = entry.GetDescendantFeeRate() + CTransaction::nMinRelayTxFee;
+        if (dFeeRate > dRollingMinimumFeeRate) {
+            dRollingMinimumFeeRate = dFeeRate;
+            nLastRollingFeeUpdate = GetTime();
+        }
+        CTransaction tx = entry.GetTx();
+        std::list<CTransaction> removed;
+        remove(tx, removed, true);
+        nEvicted += removed.size();
+    }
+    if (nEvicted)
+        LogPrint("mempool", "TrimToSize : evicted %u transactions, minimum fee rate now %.0f per kB\n", nEvicted, dRollingMinimumFeeRate);
+}
+
+double CTxMemPool::GetMinFee(size_t nSizeLimit) const
+{
+    LOCK(cs);
+    if (dRollingMinimumFeeRate == 0)
+        return 0;
+    int64_t nNow = GetTime();
+    if (nNow > nLastRollingFeeUpdate + 10) {
+        double dHalfLife = ROLLING_FEE_HALFLIFE;
+        size_t nUsage = DynamicMemoryUsage();
+        if (nUsage < nSizeLimit / 4)
+            dHalfLife /= 4;
+        else if (nUsage < nSizeLimit / 2)
+            dHalfLife /= 2;
+        dRollingMinimumFeeRate /= pow(2.0, (nNow - nLastRollingFeeUpdate) / dHalfLife);
+        nLastRollingFeeUpdate = nNow;
+        // Below half the relay fee it no longer matters
+        if (dRollingMinimumFeeRate < CTransaction::nMinRelayTxFee / 2) {
+            dRollingMinimumFeeRate = 0;
+            return 0;
+        }
+    }
+    return std::max(dRollingMinimumFeeRate, (double)CTransaction::nMinRelayTxFee);
+}
+
+
+bool CTxMemPool::CheckPackageLimits(const CTransaction &tx, size_t nTxSize,
+                                    unsigned int nAncestorCount, size_t nAncestorSize,
+                                    unsigned int nDescendantCount, size_t nDescendantSize,
+                                    std::string &strReason) const
+{
+    LOCK(cs);
+    std::set<uint256> setAncestors;
+    CalculateAncestors(tx, setAncestors);
+    if (setAncestors.size() + 1 > nAncestorCount) {
+        strReason = strprintf("too many unconfirmed ancestors [limit: %u]", nAncestorCount);
+        return false;
+    }
+    size_t nSizeWithAncestors = nTxSize;
+    BOOST_FOREACH(const uint256 &hashAncestor, setAncestors) {
+        const CTxMemPoolEntry &ancestor = mapTx.find(hashAncestor)->second;
+        nSizeWithAncestors += ancestor.GetTxSize();
+        if (ancestor.GetCountWithDescendants() + 1 > nDescendantCount) {
+            strReason = strprintf("too many descendants for tx %s [limit: %u]", hashAncestor.ToString(), nDescendantCount);
+            return false;
+        }
+        if (ancestor.GetSizeWithDescendants() + nTxSize > nDescendantSize) {
+            strReason = strprintf("exceeds descendant size limit for tx %s [limit: %u]", hashAncestor.ToString(), nDescendantSize);
+            return false;
+        }
+    }
+    if (nSizeWithAncestors > nAncestorSize) {
+        strReason = strprintf("exceeds ancestor size limit [limit: %u]", nAncestorSize);
+        return false;
+    }
+    return true;
+}
 
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry)
 {
@@ -76,10 +421,49 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry)
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = entry;
-        const CTransaction& tx = mapTx[hash].GetTx();
+        CTxMemPoolMap::iterator it = mapTx.find(hash);
+        bool fReplaced = it != mapTx.end();
+        if (fReplaced) {
+            // Replaced
+            RemoveFromIndexes(hash, it->second);
+            nTotalTxSize -= it->second.GetTxSize();
+            cachedInnerUsage -= it->second.DynamicMemoryUsage();
+            nRemoved++;
+        }
+        CTxMemPoolEntry &entryNew = mapTx[hash];
+        entryNew = entry;
+        entryNew.nSequence = nAdded++;
+        nTotalTxSize += entryNew.GetTxSize();
+        cachedInnerUsage += entryNew.DynamicMemoryUsage();
+        const CTransaction& tx = entryNew.GetTx();
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+        std::set<uint256> setDescendants;
+        CalculateDescendants(hash, setDescendants);
+        if (setDescendants.empty() && !fReplaced) {
+            // The usual case: the transaction is new at the end of its chain,
+            // and each of its ancestors gains it as a descendant.
+            entryNew.nCountWithDescendants = 1;
+            entryNew.nSizeWithDescendants = entryNew.GetTxSize();
+            entryNew.nFeesWithDescendants = entryNew.GetFee();
+            UpdateAncestorState(hash, entryNew);
+            std::set<uint256> setAncestors;
+            CalculateAncestors(tx, setAncestors);
+            BOOST_FOREACH(const uint256 &hashAncestor, setAncestors)
+                UpdateDescendantTotals(hashAncestor, mapTx[hashAncestor], entryNew, true);
+        } else {
+            // Transactions spending this one are already in the pool when it
+            // returns from a disconnected block; it is their ancestor now,
+            // and theirs may be the ancestors' descendants again.
+            UpdateAncestorState(hash, entryNew);
+            BOOST_FOREACH(const uint256 &hashDescendant, setDescendants)
+                UpdateAncestorState(hashDescendant, mapTx[hashDescendant]);
+            UpdateDescendantState(hash, entryNew);
+            std::set<uint256> setAncestors;
+            CalculateAncestors(tx, setAncestors);
+            BOOST_FOREACH(const uint256 &hashAncestor, setAncestors)
+                UpdateDescendantState(hashAncestor, mapTx[hashAncestor]);
+        }
         nTransactionsUpdated++;
     }
     return true;
@@ -94,18 +478,45 @@ void CTxMemPool::remove(const CTransaction &tx, std::list<CTransaction>& removed
         uint256 hash = tx.GetHash();
         if (fRecursive) {
             for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+                CNextTxMap::iterator it = mapNextTx.find(COutPoint(hash, i));
                 if (it == mapNextTx.end())
                     continue;
                 remove(*it->second.ptx, removed, true);
             }
         }
-        if (mapTx.count(hash))
+        CTxMemPoolMap::iterator itTx = mapTx.find(hash);
+        if (itTx != mapTx.end())
         {
             removed.push_front(tx);
+            // Left behind when a block confirms the transaction
+            std::set<uint256> setDescendants;
+            CalculateDescendants(hash, setDescendants);
+            // ... or evicted, which leaves its ancestors with less to offer
+            std::set<uint256> setAncestors;
+            CalculateAncestors(tx, setAncestors);
+            // A block confirms the ancestors first; eviction and conflicts
+            // remove the descendants first. Either way the others only lose
+            // this one transaction from their totals.
+            bool fIncremental = setAncestors.empty() || setDescendants.empty();
+            if (fIncremental) {
+                BOOST_FOREACH(const uint256 &hashDescendant, setDescendants)
+                    UpdateAncestorTotals(hashDescendant, mapTx[hashDescendant], itTx->second, false);
+                BOOST_FOREACH(const uint256 &hashAncestor, setAncestors)
+                    UpdateDescendantTotals(hashAncestor, mapTx[hashAncestor], itTx->second, false);
+            }
+            RemoveFromIndexes(hash, itTx->second);
+            nTotalTxSize -= itTx->second.GetTxSize();
+            cachedInnerUsage -= itTx->second.DynamicMemoryUsage();
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
+            mapTx.erase(itTx);
+            nRemoved++;
+            if (!fIncremental) {
+                BOOST_FOREACH(const uint256 &hashDescendant, setDescendants)
+                    UpdateAncestorState(hashDescendant, mapTx[hashDescendant]);
+                BOOST_FOREACH(const uint256 &hashAncestor, setAncestors)
+                    UpdateDescendantState(hashAncestor, mapTx[hashAncestor]);
+            }
             nTransactionsUpdated++;
         }
     }
@@ -117,7 +528,7 @@ void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>
     list<CTransaction> result;
     LOCK(cs);
     BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-        std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(txin.prevout);
+        CNextTxMap::iterator it = mapNextTx.find(txin.prevout);
         if (it != mapNextTx.end()) {
             const CTransaction &txConflict = *it->second.ptx;
             if (txConflict != tx)
@@ -133,6 +544,12 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    setByPriority.clear();
+    setByAncestorFeeRate.clear();
+    setByDescendantScore.clear();
+    nTotalTxSize = 0;
+    cachedInnerUsage = 0;
+    nRemoved++;
     ++nTransactionsUpdated;
 }
 
@@ -144,36 +561,77 @@ void CTxMemPool::check(CCoinsViewCache *pcoins) const
     LogPrint("mempool", "Checking mempool with %u transactions and %u inputs\n", (unsigned int)mapTx.size(), (unsigned int)mapNextTx.size());
 
     LOCK(cs);
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+    uint64_t nTotalTxSize = 0;
+    size_t nInnerUsage = 0;
+    for (CTxMemPoolMap::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         unsigned int i = 0;
         const CTransaction& tx = it->second.GetTx();
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
             // Check that every mempool transaction's inputs refer to available coins, or other mempool tx's.
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            CTxMemPoolMap::const_iterator it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end()) {
                 const CTransaction& tx2 = it2->second.GetTx();
                 assert(tx2.vout.size() > txin.prevout.n && !tx2.vout[txin.prevout.n].IsNull());
             } else {
-                CCoins &coins = pcoins->GetCoins(txin.prevout.hash);
-                assert(coins.IsAvailable(txin.prevout.n));
+                const CCoin &coin = pcoins->AccessCoin(txin.prevout);
+                assert(!coin.IsSpent());
             }
             // Check whether its inputs are marked in mapNextTx.
-            std::map<COutPoint, CInPoint>::const_iterator it3 = mapNextTx.find(txin.prevout);
+            CNextTxMap::const_iterator it3 = mapNextTx.find(txin.prevout);
             assert(it3 != mapNextTx.end());
             assert(it3->second.ptx == &tx);
             assert(it3->second.n == i);
             i++;
         }
+        // Check the ancestor totals and the index entries.
+        const CTxMemPoolEntry &entry = it->second;
+        std::set<uint256> setAncestors;
+        CalculateAncestors(tx, setAncestors);
+        size_t nSizeWithAncestors = entry.GetTxSize();
+        int64_t nFeesWithAncestors = entry.GetFee();
+        unsigned int nSigOpsWithAncestors = entry.GetSigOps();
+        BOOST_FOREACH(const uint256 &hashAncestor, setAncestors) {
+            const CTxMemPoolEntry &ancestor = mapTx.find(hashAncestor)->second;
+            nSizeWithAncestors += ancestor.GetTxSize();
+            nFeesWithAncestors += ancestor.GetFee();
+            nSigOpsWithAncestors += ancestor.GetSigOps();
+        }
+        assert(entry.GetCountWithAncestors() == setAncestors.size() + 1);
+        assert(entry.GetSizeWithAncestors() == nSizeWithAncestors);
+        assert(entry.GetFeesWithAncestors() == nFeesWithAncestors);
+        assert(entry.GetSigOpsWithAncestors() == nSigOpsWithAncestors);
+        std::set<uint256> setDescendants;
+        CalculateDescendants(it->first, setDescendants);
+        size_t nSizeWithDescendants = entry.GetTxSize();
+        int64_t nFeesWithDescendants = entry.GetFee();
+        BOOST_FOREACH(const uint256 &hashDescendant, setDescendants) {
+            const CTxMemPoolEntry &descendant = mapTx.find(hashDescendant)->second;
+            nSizeWithDescendants += descendant.GetTxSize();
+            nFeesWithDescendants += descendant.GetFee();
+        }
+        assert(entry.GetCountWithDescendants() == setDescendants.size() + 1);
+        assert(entry.GetSizeWithDescendants() == nSizeWithDescendants);
+        assert(entry.GetFeesWithDescendants() == nFeesWithDescendants);
+        nTotalTxSize += entry.GetTxSize();
+        nInnerUsage += entry.DynamicMemoryUsage();
+        assert(setByPriority.count(CTxMemPoolIndexKey(entry.dIndexPriority, entry.GetFeeRate(), it->first)));
+        assert(setByAncestorFeeRate.count(CTxMemPoolIndexKey(entry.GetAncestorFeeRate(), entry.GetFeeRate(), it->first)));
+        assert(setByDescendantScore.count(CTxMemPoolIndexKey(entry.GetDescendantScore(), entry.GetFeeRate(), it->first)));
     }
-    for (std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
+    for (CNextTxMap::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
         uint256 hash = it->second.ptx->GetHash();
-        map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(hash);
+        CTxMemPoolMap::const_iterator it2 = mapTx.find(hash);
         const CTransaction& tx = it2->second.GetTx();
         assert(it2 != mapTx.end());
         assert(&tx == it->second.ptx);
         assert(tx.vin.size() > it->second.n);
         assert(it->first == it->second.ptx->vin[it->second.n].prevout);
     }
+    assert(setByPriority.size() == mapTx.size());
+    assert(setByAncestorFeeRate.size() == mapTx.size());
+    assert(setByDescendantScore.size() == mapTx.size());
+    assert(nTotalTxSize == this->nTotalTxSize);
+    assert(nInnerUsage == cachedInnerUsage);
 }
 
 void CTxMemPool::queryHashes(vector<uint256>& vtxid)
@@ -182,33 +640,54 @@ void CTxMemPool::queryHashes(vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+    for (CTxMemPoolMap::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
         vtxid.push_back((*mi).first);
+    // In txid order, as before mapTx was a hash table
+    std::sort(vtxid.begin(), vtxid.end());
 }
 
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
+    CTxMemPoolMap::const_iterator i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
     result = i->second.GetTx();
     return true;
 }
 
+bool CTxMemPool::lookupSigOps(const uint256& hash, unsigned int& nSigOps, int& nP2SHSigOps) const
+{
+    LOCK(cs);
+    CTxMemPoolMap::const_iterator i = mapTx.find(hash);
+    if (i == mapTx.end()) return false;
+    nSigOps = i->second.GetSigOps();
+    nP2SHSigOps = i->second.GetP2SHSigOps();
+    return true;
+}
+
+bool CTxMemPool::hasValidScripts(const uint256& hash, unsigned int flags) const
+{
+    LOCK(cs);
+    CTxMemPoolMap::const_iterator i = mapTx.find(hash);
+    if (i == mapTx.end()) return false;
+    unsigned int nScriptFlags = i->second.GetScriptFlags();
+    return nScriptFlags != 0 && (nScriptFlags & flags) == flags;
+}
+
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView &baseIn, CTxMemPool &mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) { }
 
-bool CCoinsViewMemPool::GetCoins(const uint256 &txid, CCoins &coins) {
-    if (base->GetCoins(txid, coins))
+bool CCoinsViewMemPool::GetCoin(const COutPoint &outpoint, CCoin &coin) {
+    if (base->GetCoin(outpoint, coin))
         return true;
     CTransaction tx;
-    if (mempool.lookup(txid, tx)) {
-        coins = CCoins(tx, MEMPOOL_HEIGHT);
+    if (mempool.lookup(outpoint.hash, tx) && outpoint.n < tx.vout.size()) {
+        coin = CCoin(tx.vout[outpoint.n], MEMPOOL_HEIGHT, false);
         return true;
     }
     return false;
 }
 
-bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) {
-    return mempool.exists(txid) || base->HaveCoins(txid);
+bool CCoinsViewMemPool::HaveCoin(const COutPoint &outpoint) {
+    CCoin coin;
+    return GetCoin(outpoint, coin);
 }
-
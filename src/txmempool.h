@@ -6,13 +6,19 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include <list>
+#include <set>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
 
 #include "coins.h"
 #include "core.h"
 #include "sync.h"
 
-/** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
+/** Fake height value used in CCoin to signify they are only in the memory pool (since 0.8) */
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
+/** Half-life, in seconds, of the minimum fee rate set by evicting transactions from a full pool */
+static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
 
 /*
  * CTxMemPool stores these:
@@ -26,10 +32,33 @@ private:
     int64_t nTime; // Local time when entering the mempool
     double dPriority; // Priority when entering the mempool
     unsigned int nHeight; // Chain height when entering the mempool
+    unsigned int nScriptFlags; // Script verification flags the inputs were checked with, 0 if not checked
+    unsigned int nSigOps; // Legacy sigop count
+    int nP2SHSigOps; // Sigops of pay-to-script-hash inputs, -1 if not counted
+    size_t nUsageSize; // Memory allocated by the transaction's inputs, outputs and scripts
+
+    // Maintained by CTxMemPool: the totals for this transaction and its
+    // ancestors, and for it and its descendants in the pool, and the
+    // priority it is indexed by.
+    unsigned int nCountWithAncestors;
+    size_t nSizeWithAncestors;
+    int64_t nFeesWithAncestors;
+    unsigned int nSigOpsWithAncestors;
+    unsigned int nCountWithDescendants;
+    size_t nSizeWithDescendants;
+    int64_t nFeesWithDescendants;
+    double dIndexPriority;
+    uint64_t nSequence; // Number of transactions added to the pool before this one
+
+    friend class CTxMemPool;
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, int64_t _nFee,
                     int64_t _nTime, double _dPriority, unsigned int _nHeight);
+    // With the size and sigop counts already worked out by AnalyzeTransaction
+    CTxMemPoolEntry(const CTransaction& _tx, int64_t _nFee,
+                    int64_t _nTime, double _dPriority, unsigned int _nHeight,
+                    size_t _nTxSize, unsigned int _nSigOps, unsigned int _nP2SHSigOps);
     CTxMemPoolEntry();
     CTxMemPoolEntry(const CTxMemPoolEntry& other);
 
@@ -39,6 +68,91 @@ public:
     size_t GetTxSize() const { return nTxSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
+    unsigned int GetScriptFlags() const { return nScriptFlags; }
+    void SetScriptFlags(unsigned int flags) { nScriptFlags = flags; }
+    unsigned int GetSigOps() const { return nSigOps; }
+    int GetP2SHSigOps() const { return nP2SHSigOps; }
+    double GetFeeRate() const { return nFee * 1000.0 / nTxSize; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
+
+    unsigned int GetCountWithAncestors() const { return nCountWithAncestors; }
+    size_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    int64_t GetFeesWithAncestors() const { return nFeesWithAncestors; }
+    unsigned int GetSigOpsWithAncestors() const { return nSigOpsWithAncestors; }
+    double GetAncestorFeeRate() const { return nFeesWithAncestors * 1000.0 / nSizeWithAncestors; }
+    unsigned int GetCountWithDescendants() const { return nCountWithDescendants; }
+    size_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    int64_t GetFeesWithDescendants() const { return nFeesWithDescendants; }
+    double GetDescendantFeeRate() const { return nFeesWithDescendants * 1000.0 / nSizeWithDescendants; }
+    // What evicting the transaction and its descendants would save: a parent
+    // is worth keeping when either it or its descendants pay well.
+    double GetDescendantScore() const { return std::max(GetFeeRate(), GetDescendantFeeRate()); }
+    uint64_t GetSequence() const { return nSequence; }
+
+private:
+    void Init();
+};
+
+/** Position of a transaction in one of CTxMemPool's orderings: by score, then
+ *  by a second score, then by txid. */
+struct CTxMemPoolIndexKey
+{
+    double dScore;
+    double dTieBreak;
+    uint256 hash;
+
+    CTxMemPoolIndexKey(double dScoreIn, double dTieBreakIn, const uint256 &hashIn) :
+        dScore(dScoreIn), dTieBreak(dTieBreakIn), hash(hashIn) {}
+
+    friend bool operator<(const CTxMemPoolIndexKey &a, const CTxMemPoolIndexKey &b) {
+        if (a.dScore != b.dScore)
+            return a.dScore < b.dScore;
+        if (a.dTieBreak != b.dTieBreak)
+            return a.dTieBreak < b.dTieBreak;
+        return a.hash < b.hash;
+    }
+};
+
+class CTxidHasher
+{
+private:
+    uint256 salt;
+
+public:
+    CTxidHasher();
+
+    size_t operator()(const uint256& hash) const {
+        return hash.GetHash(salt);
+    }
+};
+
+typedef boost::unordered_map<uint256, CTxMemPoolEntry, CTxidHasher> CTxMemPoolMap;
+typedef boost::unordered_map<COutPoint, CInPoint, COutPointHasher> CNextTxMap;
+
+/** A copy of what the RPC calls show of the pool, taken at one moment. It
+ *  is never modified, so it can be read without any lock. */
+class CTxMemPoolSnapshot
+{
+public:
+    struct Entry
+    {
+        size_t nTxSize;
+        int64_t nFee;
+        int64_t nTime;
+        unsigned int nHeight;
+        double dPriority;
+        int64_t nValueIn;
+        std::vector<uint256> vDepends; // Parents in the pool
+
+        double GetPriority(unsigned int nCurrentHeight) const {
+            return dPriority + ((double)(nCurrentHeight - nHeight) * nValueIn) / nTxSize;
+        }
+    };
+
+    unsigned int nTransactionsUpdated; // Of the pool when this was taken
+    std::map<uint256, Entry> mapEntries;
+    uint64_t nTotalTxSize;
+    size_t nUsage;
 };
 
 /*
@@ -56,11 +170,49 @@ class CTxMemPool
 private:
     bool fSanityCheck; // Normally false, true if -checkmempool or -regtest
     unsigned int nTransactionsUpdated;
+    unsigned int nPriorityHeight; // Height the priorities in setByPriority are computed at
+    uint64_t nAdded;       // Transactions added so far
+    uint64_t nRemoved;     // Transactions removed so far
+    uint64_t nTotalTxSize; // Serialized size of the transactions in the pool
+    size_t cachedInnerUsage; // Memory allocated by the entries in the pool
+
+    // Fee rate (satoshis per kB) a transaction has to beat since the pool
+    // last had to evict some, decaying from the time of nLastRollingFeeUpdate.
+    mutable double dRollingMinimumFeeRate;
+    mutable int64_t nLastRollingFeeUpdate;
+
+    // The last snapshot. Replaced with cs held, read with cs_snapshot only.
+    mutable CCriticalSection cs_snapshot;
+    mutable boost::shared_ptr<const CTxMemPoolSnapshot> psnapshot;
+    boost::shared_ptr<const CTxMemPoolSnapshot> RefreshSnapshot() const;
+
+    void CalculateAncestors(const CTransaction &tx, std::set<uint256> &setAncestors) const;
+    void CalculateDescendants(const uint256 &hash, std::set<uint256> &setDescendants) const;
+    void UpdateAncestorState(const uint256 &hash, CTxMemPoolEntry &entry);
+    void UpdateDescendantState(const uint256 &hash, CTxMemPoolEntry &entry);
+    void UpdateAncestorTotals(const uint256 &hash, CTxMemPoolEntry &entry, const CTxMemPoolEntry &ancestor, bool fAdd);
+    void UpdateDescendantTotals(const uint256 &hash, CTxMemPoolEntry &entry, const CTxMemPoolEntry &descendant, bool fAdd);
+    void AddToIndexes(const uint256 &hash, CTxMemPoolEntry &entry);
+    void RemoveFromIndexes(const uint256 &hash, const CTxMemPoolEntry &entry);
 
 public:
     mutable CCriticalSection cs;
-    std::map<uint256, CTxMemPoolEntry> mapTx;
-    std::map<COutPoint, CInPoint> mapNextTx;
+    // Unordered, with salted hashes; the indexes below give the orderings.
+    CTxMemPoolMap mapTx;
+    CNextTxMap mapNextTx;
+
+    /*
+     * Orderings of mapTx for block creation, kept up to date by addUnchecked
+     * and remove: by priority at nPriorityHeight (ties by fee rate), and by
+     * the fee rate of the transaction together with its ancestors in the pool
+     * (ties by its own fee rate). For a transaction without unconfirmed
+     * parents the latter is simply its fee rate. Highest last.
+     * setByDescendantScore orders by GetDescendantScore (ties by fee rate),
+     * lowest first: the packages TrimToSize evicts first.
+     */
+    std::set<CTxMemPoolIndexKey> setByPriority;
+    std::set<CTxMemPoolIndexKey> setByAncestorFeeRate;
+    std::set<CTxMemPoolIndexKey> setByDescendantScore;
 
     CTxMemPool();
 
@@ -73,15 +225,68 @@ public:
     void check(CCoinsViewCache *pcoins) const;
     void setSanityCheck(bool _fSanityCheck) { fSanityCheck = _fSanityCheck; }
 
+    /*
+     * Whether tx, of nTxSize bytes, can join the pool without it having more
+     * than nAncestorCount transactions or nAncestorSize bytes together with
+     * its ancestors in the pool, or any of those more than nDescendantCount
+     * or nDescendantSize together with their descendants. strReason says
+     * which limit it would exceed.
+     */
+    bool CheckPackageLimits(const CTransaction &tx, size_t nTxSize,
+                            unsigned int nAncestorCount, size_t nAncestorSize,
+                            unsigned int nDescendantCount, size_t nDescendantSize,
+                            std::string &strReason) const;
+
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry);
     void remove(const CTransaction &tx, std::list<CTransaction>& removed, bool fRecursive = false);
     void removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
-    void pruneSpent(const uint256& hash, CCoins &coins);
+    bool isSpent(const COutPoint& outpoint);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
 
+    /*
+     * Recompute setByPriority for the given height, if it was computed for
+     * another one. Priorities grow with the age of the inputs at different
+     * rates, so the ordering only holds for one height.
+     */
+    void SetPriorityHeight(unsigned int nHeight);
+
+    /*
+     * Counters of the transactions added to and removed from the pool.
+     * Entries with a sequence number of at least a previous GetAdded() have
+     * arrived since; unless GetRemoved() changed too, nothing else did.
+     */
+    uint64_t GetAdded() const;
+    uint64_t GetRemoved() const;
+
+    /*
+     * Evict the transactions with the lowest descendant score, together with
+     * their descendants, until the pool uses at most nSizeLimit bytes. The
+     * minimum fee rate is raised above that of what was evicted.
+     */
+    void TrimToSize(size_t nSizeLimit);
+
+    /*
+     * The fee rate (satoshis per kB) a transaction needs to enter a pool
+     * limited to nSizeLimit bytes, 0 when it has not been full recently.
+     * It halves every ROLLING_FEE_HALFLIFE, faster while the pool is far
+     * below its limit.
+     */
+    double GetMinFee(size_t nSizeLimit) const;
+
+    /*
+     * A snapshot of the pool, rebuilt if the pool changed since the last
+     * one. While someone else holds the pool's lock (block creation, for
+     * one) the last snapshot is returned as it is instead of waiting.
+     */
+    boost::shared_ptr<const CTxMemPoolSnapshot> GetSnapshot() const;
+
+    // Memory used by the pool, its indexes and the transactions in it
+    size_t DynamicMemoryUsage() const;
+    uint64_t GetTotalTxSize() const;
+
     unsigned long size()
     {
         LOCK(cs);
@@ -95,6 +300,20 @@ public:
     }
 
     bool lookup(uint256 hash, CTransaction& result) const;
+
+    /*
+     * Whether the scripts of a transaction in the pool were verified under
+     * (at least) the given flags when it was accepted. The spent outputs
+     * are fixed by the txid, so the result holds in any chain state.
+     */
+    bool hasValidScripts(const uint256& hash, unsigned int flags) const;
+
+    /*
+     * The sigop counts of a transaction in the pool, as they were when it was
+     * accepted; like the scripts, they depend only on the txid. nP2SHSigOps
+     * is -1 if it was not counted.
+     */
+    bool lookupSigOps(const uint256& hash, unsigned int& nSigOps, int& nP2SHSigOps) const;
 };
 
 /** CCoinsView that brings transactions from a memorypool into view.
@@ -106,8 +325,8 @@ protected:
 
 public:
     CCoinsViewMemPool(CCoinsView &baseIn, CTxMemPool &mempoolIn);
-    bool GetCoins(const uint256 &txid, CCoins &coins);
-    bool HaveCoins(const uint256 &txid);
+    bool GetCoin(const COutPoint &outpoint, CCoin &coin);
+    bool HaveCoin(const COutPoint &outpoint);
 };
 
 #endif /* BITCOIN_TXMEMPOOL_H */
@@ -0,0 +1,301 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txoutset.h"
+
+#include "chainparams.h"
+#include "hash.h"
+#include "init.h"
+#include "main.h"
+#include "txdb.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "workpool.h"
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+
+using namespace std;
+
+namespace {
+
+/** Serializes to a file and hashes the bytes written on the way */
+class CHashedFileWriter
+{
+private:
+    FILE *file;
+    CHashWriter hasher;
+
+public:
+    int nType;
+    int nVersion;
+
+    CHashedFileWriter(FILE *fileIn, int nTypeIn, int nVersionIn) : file(fileIn), hasher(nTypeIn, nVersionIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    CHashedFileWriter& write(const char *pch, size_t nSize)
+    {
+        if (fwrite(pch, 1, nSize, file) != nSize)
+            throw std::ios_base::failure("CHashedFileWriter::write : write failed");
+        hasher.write(pch, nSize);
+        return (*this);
+    }
+
+    template<typename T>
+    CHashedFileWriter& operator<<(const T& obj)
+    {
+        ::Serialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+
+    uint256 GetHash() { return hasher.GetHash(); }
+};
+
+/** Writes the coins passed by CCoinsViewDB::ForEachCoin, grouped by transaction */
+class CSnapshotCoinWriter
+{
+private:
+    CHashedFileWriter &writer;
+    uint256 hashTx;
+    vector<pair<unsigned int, CCoin> > vOutputs;
+
+public:
+    uint64_t nTransactions;
+    int64_t nOutputs;
+
+    CSnapshotCoinWriter(CHashedFileWriter &writerIn) : writer(writerIn), hashTx(0), nTransactions(0), nOutputs(0) {}
+
+    void Flush()
+    {
+        if (vOutputs.empty())
+            return;
+        writer << hashTx << VARINT(vOutputs.size());
+        for (unsigned int i = 0; i < vOutputs.size(); i++)
+            writer << VARINT(vOutputs[i].first) << vOutputs[i].second;
+        vOutputs.clear();
+        nTransactions++;
+    }
+
+    bool Add(const COutPoint &outpoint, const CCoin &coin)
+    {
+        if (outpoint.hash != hashTx)
+            Flush();
+        hashTx = outpoint.hash;
+        vOutputs.push_back(make_pair(outpoint.n, coin));
+        nOutputs++;
+        return true;
+    }
+};
+
+// Check the proof of work of the headers in [nBegin, nEnd); run on the threads of a CWorkPool
+void CheckSnapshotHeaders(const vector<CBlockHeader> *pvHeaders, vector<char> *pvValid, unsigned int nBegin, unsigned int nEnd)
+{
+    for (unsigned int i = nBegin; i < nEnd; i++) {
+        const CBlockHeader &header = (*pvHeaders)[i];
+        (*pvValid)[i] = CheckProofOfWork(header.GetPoWHash(header.GetAlgo()), header.nBits, header.GetAlgo());
+    }
+}
+
+// The double SHA256 of a snapshot file up to its trailing hash must match it
+bool CheckSnapshotFileHash(const boost::filesystem::path &path)
+{
+    uint64_t nSize = boost::filesystem::file_size(path);
+    if (nSize < sizeof(uint256))
+        return error("%s : %s is too short", __func__, path.string());
+    FILE *file = fopen(path.string().c_str(), "rb");
+    if (!file)
+        return error("%s : failed to open %s", __func__, path.string());
+
+    CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+    vector<char> vBuf(1 << 20);
+    uint64_t nLeft = nSize - sizeof(uint256);
+    while (nLeft > 0) {
+        size_t nRead = fread(&vBuf[0], 1, std::min((uint64_t)vBuf.size(), nLeft), file);
+        if (nRead == 0)
+            break;
+        hasher.write(&vBuf[0], nRead);
+        nLeft -= nRead;
+    }
+    uint256 hashExpected;
+    bool fRead = nLeft == 0 && fread((char*)&hashExpected, 1, sizeof(hashExpected), file) == sizeof(hashExpected);
+    fclose(file);
+    if (!fRead)
+        return error("%s : failed to read %s", __func__, path.string());
+    if (hasher.GetHash() != hashExpected)
+        return error("%s : checksum mismatch, %s is corrupted", __func__, path.string());
+    return true;
+}
+
+} // anon namespace
+
+bool DumpTxOutSet(const boost::filesystem::path &path, CTxOutSetSnapshotHeader &header, uint64_t &nTransactions, uint256 &hashFile)
+{
+    vector<pair<CBlockHeader, unsigned int> > vHeaders;
+    const leveldb::Snapshot *psnapshot = NULL;
+    {
+        LOCK(cs_main);
+        // Get the database to exactly the state of the tip, then read a
+        // snapshot of it without holding up block processing
+        if (!pcoinsTip->Flush(true) || (pcoinsAsync && !pcoinsAsync->Sync()))
+            return error("DumpTxOutSet() : failed to write the coin database");
+        CCoinsStats stats;
+        if (!pcoinsdbview->GetStats(stats))
+            return false;
+        BlockMap::iterator mi = mapBlockIndex.find(stats.hashBlock);
+        if (mi == mapBlockIndex.end() || !chainActive.Contains(mi->second))
+            return error("DumpTxOutSet() : best block of the coin database not in the active chain");
+        header.hashBlock = stats.hashBlock;
+        header.nHeight = mi->second->nHeight;
+        header.totals.nOutputs = stats.nTransactionOutputs;
+        header.totals.nAmount = stats.nTotalAmount;
+        header.totals.nSerializedSize = stats.nSerializedSize;
+        header.totals.hashSet = stats.hashSet;
+        vHeaders.reserve(header.nHeight);
+        for (CBlockIndex *pindex = mi->second; pindex->pprev; pindex = pindex->pprev)
+            vHeaders.push_back(make_pair(pindex->GetBlockHeader(), pindex->nTx));
+        psnapshot = pcoinsdbview->GetSnapshot();
+    }
+
+    // Written under a temporary name, so that a file by the final name is complete
+    boost::filesystem::path pathTmp = path.string() + ".incomplete";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file) {
+        pcoinsdbview->ReleaseSnapshot(psnapshot);
+        return error("DumpTxOutSet() : failed to create %s", pathTmp.string());
+    }
+
+    bool fOk = true;
+    CHashedFileWriter writer(file, SER_DISK, CLIENT_VERSION);
+    CSnapshotCoinWriter coinwriter(writer);
+    try {
+        writer << FLATDATA(Params().MessageStart()) << header;
+        for (vector<pair<CBlockHeader, unsigned int> >::reverse_iterator it = vHeaders.rbegin(); it != vHeaders.rend(); ++it)
+            writer << it->first << VARINT(it->second);
+        fOk = pcoinsdbview->ForEachCoin(psnapshot, boost::bind(&CSnapshotCoinWriter::Add, &coinwriter, _1, _2));
+        coinwriter.Flush();
+        if (fOk && coinwriter.nOutputs != header.totals.nOutputs)
+            fOk = error("DumpTxOutSet() : read %d outputs, the totals have %d", coinwriter.nOutputs, header.totals.nOutputs);
+        hashFile = writer.GetHash();
+        if (fwrite((const char*)&hashFile, 1, sizeof(hashFile), file) != sizeof(hashFile))
+            fOk = error("DumpTxOutSet() : write failed");
+    } catch (std::exception &e) {
+        fOk = error("DumpTxOutSet() : %s", e.what());
+    }
+    pcoinsdbview->ReleaseSnapshot(psnapshot);
+
+    FileCommit(file);
+    fclose(file);
+    if (!fOk || !RenameOver(pathTmp, path)) {
+        boost::filesystem::remove(pathTmp);
+        return error("DumpTxOutSet() : failed to write %s", path.string());
+    }
+    nTransactions = coinwriter.nTransactions;
+    LogPrintf("DumpTxOutSet(): wrote %d outputs of %u transactions as of block %s (height %d) to %s\n",
+        header.totals.nOutputs, nTransactions, header.hashBlock.ToString(), header.nHeight, path.string());
+    return true;
+}
+
+bool LoadTxOutSet(const boost::filesystem::path &path)
+{
+    {
+        LOCK(cs_main);
+        if (chainActive.Height() != 0)
+            return error("LoadTxOutSet() : the chain state is not empty");
+    }
+
+    // Nothing is written before the whole file is known to be intact
+    if (!CheckSnapshotFileHash(path))
+        return false;
+
+    CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("LoadTxOutSet() : failed to open %s", path.string());
+
+    try {
+        char pchMessageStart[MESSAGE_START_SIZE];
+        CTxOutSetSnapshotHeader header;
+        filein >> FLATDATA(pchMessageStart) >> header;
+        if (memcmp(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+            return error("LoadTxOutSet() : %s is a snapshot of another network", path.string());
+        if (header.nVersion != TXOUTSET_SNAPSHOT_VERSION)
+            return error("LoadTxOutSet() : unknown snapshot version %d", header.nVersion);
+        LogPrintf("LoadTxOutSet(): loading %d outputs as of block %s (height %d)\n",
+            header.totals.nOutputs, header.hashBlock.ToString(), header.nHeight);
+
+        // The block headers, whose proof of work is checked on several
+        // threads before they are linked in order
+        int nThreads = std::max(nScriptCheckThreads, 1);
+        CWorkPool pool(TASK_BACKGROUND);
+        CBlockIndex *pindexLast = NULL;
+        for (int nLoaded = 0; nLoaded < header.nHeight; ) {
+            int nBatch = std::min(header.nHeight - nLoaded, TXOUTSET_HEADER_BATCH);
+            vector<CBlockHeader> vHeaders(nBatch);
+            vector<unsigned int> vTx(nBatch);
+            for (int i = 0; i < nBatch; i++)
+                filein >> vHeaders[i] >> VARINT(vTx[i]);
+            vector<char> vValid(nBatch, 0);
+            pool.ForEachRange(nBatch, nThreads, boost::bind(&CheckSnapshotHeaders, &vHeaders, &vValid, _1, _2));
+
+            LOCK(cs_main);
+            vector<CBlockIndex*> vIndex;
+            for (int i = 0; i < nBatch; i++) {
+                if (!vValid[i])
+                    return error("LoadTxOutSet() : proof of work failed at height %d", nLoaded + i + 1);
+                CValidationState state;
+                if (!AddSnapshotBlockIndex(vHeaders[i], vTx[i], state, &pindexLast))
+                    return false;
+                vIndex.push_back(pindexLast);
+            }
+            if (!pblocktree->WriteBlockIndexes(vIndex))
+                return error("LoadTxOutSet() : failed to write the block index");
+            nLoaded += nBatch;
+            if (ShutdownRequested())
+                return false;
+        }
+        if (!pindexLast || pindexLast->GetBlockHash() != header.hashBlock)
+            return error("LoadTxOutSet() : the headers do not lead to block %s", header.hashBlock.ToString());
+        uiInterface.InitMessage(_("Loading coin snapshot..."));
+
+        // The coins, in large batches. The best block goes with the last
+        // one, so that the set is only used once it is complete.
+        CCoinsMap mapCoins;
+        CCoinsTotals totals, delta;
+        while (totals.nOutputs + delta.nOutputs < header.totals.nOutputs) {
+            uint256 hashTx;
+            unsigned int nOutputs;
+            filein >> hashTx >> VARINT(nOutputs);
+            for (unsigned int i = 0; i < nOutputs; i++) {
+                unsigned int n;
+                filein >> VARINT(n);
+                COutPoint outpoint(hashTx, n);
+                CCoinsCacheEntry &entry = mapCoins[outpoint];
+                filein >> entry.coin;
+                entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+                delta.Add(outpoint, entry.coin);
+            }
+            if (mapCoins.size() >= TXOUTSET_COIN_BATCH) {
+                if (!pcoinsdbview->BatchWrite(mapCoins, uint256(0), delta))
+                    return error("LoadTxOutSet() : failed to write the coin database");
+                totals += delta;
+                delta = CCoinsTotals();
+                mapCoins.clear();
+                if (ShutdownRequested())
+                    return false;
+            }
+        }
+        totals += delta;
+        if (!(totals == header.totals))
+            return error("LoadTxOutSet() : the outputs do not match the totals of the snapshot");
+        if (!pcoinsdbview->BatchWrite(mapCoins, header.hashBlock, delta))
+            return error("LoadTxOutSet() : failed to write the coin database");
+
+        // There is no block data below the snapshot, as after pruning
+        LOCK(cs_main);
+        fHavePruned = true;
+        pblocktree->WriteFlag("prunedblockfiles", true);
+    } catch (std::exception &e) {
+        return error("LoadTxOutSet() : deserialize or I/O error - %s", e.what());
+    }
+    LogPrintf("LoadTxOutSet(): loaded %s\n", path.string());
+    return true;
+}
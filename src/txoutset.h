@@ -0,0 +1,58 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_TXOUTSET_H
+#define BITCOIN_TXOUTSET_H
+
+#include "coins.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <boost/filesystem/path.hpp>
+
+static const int TXOUTSET_SNAPSHOT_VERSION = 1;
+// Number of block headers whose proof of work is checked in one batch
+static const int TXOUTSET_HEADER_BATCH = 2000;
+// Number of outputs written to the coin database in one batch
+static const unsigned int TXOUTSET_COIN_BATCH = 100000;
+
+/** Header of a snapshot of the unspent output set (dumptxoutset, -loadtxoutset).
+ *
+ * Serialized format of the file:
+ * - the message start of the network
+ * - this header
+ * - the headers of the blocks 1 to nHeight, each followed by VARINT(nTx)
+ * - the outputs in database order, grouped by transaction: the txid,
+ *   VARINT(number of outputs), then VARINT(n) and the CCoin of each output
+ * - the double SHA256 of everything before it
+ */
+class CTxOutSetSnapshotHeader
+{
+public:
+    int nVersion;
+    uint256 hashBlock;   // block the set is as of
+    int nHeight;
+    CCoinsTotals totals; // of the whole set, checked again after loading it
+
+    CTxOutSetSnapshotHeader() : nVersion(TXOUTSET_SNAPSHOT_VERSION), hashBlock(0), nHeight(0) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(this->nVersion);
+        nVersion = this->nVersion;
+        READWRITE(hashBlock);
+        READWRITE(nHeight);
+        READWRITE(totals);
+    )
+};
+
+// Write the unspent output set as of the active tip to a snapshot file. The
+// coins are read from a database snapshot, without holding cs_main.
+bool DumpTxOutSet(const boost::filesystem::path &path, CTxOutSetSnapshotHeader &header, uint64_t &nTransactions, uint256 &hashFile);
+
+// Load a snapshot file into a chain state that has only the genesis block
+// connected: index entries without block data for its headers, and its
+// coins. The block index has to be loaded again afterwards.
+bool LoadTxOutSet(const boost::filesystem::path &path);
+
+#endif // BITCOIN_TXOUTSET_H
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_UINT256_H
 #define BITCOIN_UINT256_H
 
+#include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string>
@@ -178,6 +179,74 @@ public:
         return *this;
     }
 
+    base_uint& operator*=(uint32_t b32)
+    {
+        uint64_t carry = 0;
+        for (int i = 0; i < WIDTH; i++)
+        {
+            uint64_t n = carry + (uint64_t)b32 * pn[i];
+            pn[i] = n & 0xffffffff;
+            carry = n >> 32;
+        }
+        return *this;
+    }
+
+    base_uint& operator/=(uint32_t b32)
+    {
+        assert(b32 != 0);
+        uint64_t rem = 0;
+        for (int i = WIDTH - 1; i >= 0; i--)
+        {
+            uint64_t n = (rem << 32) | pn[i];
+            pn[i] = (uint32_t)(n / b32);
+            rem = n % b32;
+        }
+        return *this;
+    }
+
+    // Long division, one quotient bit per step from the highest
+    base_uint& operator/=(const base_uint& b)
+    {
+        base_uint div = b;
+        base_uint num = *this;
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = 0;
+        int num_bits = num.bits();
+        int div_bits = div.bits();
+        assert(div_bits != 0);
+        if (div_bits > num_bits)
+            return *this;
+        int shift = num_bits - div_bits;
+        div <<= shift;
+        while (shift >= 0)
+        {
+            if (num >= div)
+            {
+                num -= div;
+                pn[shift / 32] |= (1U << (shift & 31));
+            }
+            div >>= 1;
+            shift--;
+        }
+        return *this;
+    }
+
+    // Position of the highest set bit plus one, or zero if the value is zero
+    unsigned int bits() const
+    {
+        for (int pos = WIDTH - 1; pos >= 0; pos--)
+        {
+            if (pn[pos])
+            {
+                for (int nbits = 31; nbits > 0; nbits--)
+                    if (pn[pos] & 1U << nbits)
+                        return 32 * pos + nbits + 1;
+                return 32 * pos + 1;
+            }
+        }
+        return 0;
+    }
+
 
     base_uint& operator++()
     {
@@ -214,60 +283,51 @@ public:
     }
 
 
-    friend inline bool operator<(const base_uint& a, const base_uint& b)
+    /** Order of two numbers as -1, 0 or 1, comparing two limbs at a time
+        from the most significant; WIDTH is a constant, so the compiler
+        unrolls the loop. */
+    int CompareTo(const base_uint& b) const
     {
-        for (int i = base_uint::WIDTH-1; i >= 0; i--)
+        int i = WIDTH - 1;
+        if (WIDTH % 2)
         {
-            if (a.pn[i] < b.pn[i])
-                return true;
-            else if (a.pn[i] > b.pn[i])
-                return false;
+            if (pn[i] != b.pn[i])
+                return pn[i] < b.pn[i] ? -1 : 1;
+            i--;
+        }
+        for (; i > 0; i -= 2)
+        {
+            uint64_t x = (uint64_t)pn[i] << 32 | pn[i-1];
+            uint64_t y = (uint64_t)b.pn[i] << 32 | b.pn[i-1];
+            if (x != y)
+                return x < y ? -1 : 1;
         }
-        return false;
+        return 0;
+    }
+
+    friend inline bool operator<(const base_uint& a, const base_uint& b)
+    {
+        return a.CompareTo(b) < 0;
     }
 
     friend inline bool operator<=(const base_uint& a, const base_uint& b)
     {
-        for (int i = base_uint::WIDTH-1; i >= 0; i--)
-        {
-            if (a.pn[i] < b.pn[i])
-                return true;
-            else if (a.pn[i] > b.pn[i])
-                return false;
-        }
-        return true;
+        return a.CompareTo(b) <= 0;
     }
 
     friend inline bool operator>(const base_uint& a, const base_uint& b)
     {
-        for (int i = base_uint::WIDTH-1; i >= 0; i--)
-        {
-            if (a.pn[i] > b.pn[i])
-                return true;
-            else if (a.pn[i] < b.pn[i])
-                return false;
-        }
-        return false;
+        return a.CompareTo(b) > 0;
     }
 
     friend inline bool operator>=(const base_uint& a, const base_uint& b)
     {
-        for (int i = base_uint::WIDTH-1; i >= 0; i--)
-        {
-            if (a.pn[i] > b.pn[i])
-                return true;
-            else if (a.pn[i] < b.pn[i])
-                return false;
-        }
-        return true;
+        return a.CompareTo(b) >= 0;
     }
 
     friend inline bool operator==(const base_uint& a, const base_uint& b)
     {
-        for (int i = 0; i < base_uint::WIDTH; i++)
-            if (a.pn[i] != b.pn[i])
-                return false;
-        return true;
+        return memcmp(a.pn, b.pn, sizeof(a.pn)) == 0;
     }
 
     friend inline bool operator==(const base_uint& a, uint64_t b)
@@ -296,10 +356,17 @@ public:
 
     std::string GetHex() const
     {
-        char psz[sizeof(pn)*2 + 1];
-        for (unsigned int i = 0; i < sizeof(pn); i++)
-            sprintf(psz + i*2, "%02x", ((unsigned char*)pn)[sizeof(pn) - i - 1]);
-        return std::string(psz, psz + sizeof(pn)*2);
+        static const char hexmap[16] = { '0', '1', '2', '3', '4', '5', '6', '7',
+                                         '8', '9', 'a', 'b', 'c', 'd', 'e', 'f' };
+        char psz[sizeof(pn)*2];
+        const unsigned char* p = (const unsigned char*)pn + sizeof(pn);
+        for (unsigned int i = 0; i < sizeof(pn)*2; i += 2)
+        {
+            unsigned char c = *--p;
+            psz[i] = hexmap[c >> 4];
+            psz[i + 1] = hexmap[c & 15];
+        }
+        return std::string(psz, sizeof(psz));
     }
 
     void SetHex(const char* psz)
@@ -318,18 +385,17 @@ public:
         const char* pbegin = psz;
         while (::HexDigit(*psz) != -1)
             psz++;
-        psz--;
+        // whole bytes from the end, two digits at a time
+        unsigned int nDigits = psz - pbegin;
         unsigned char* p1 = (unsigned char*)pn;
         unsigned char* pend = p1 + WIDTH * 4;
-        while (psz >= pbegin && p1 < pend)
+        while (nDigits >= 2 && p1 < pend)
         {
-            *p1 = ::HexDigit(*psz--);
-            if (psz >= pbegin)
-            {
-                *p1 |= ((unsigned char)::HexDigit(*psz--) << 4);
-                p1++;
-            }
+            nDigits -= 2;
+            *p1++ = ((unsigned char)::HexDigit(pbegin[nDigits]) << 4) | (unsigned char)::HexDigit(pbegin[nDigits + 1]);
         }
+        if (nDigits == 1 && p1 < pend)
+            *p1 = ::HexDigit(pbegin[0]);
     }
 
     void SetHex(const std::string& str)
@@ -529,6 +595,28 @@ inline const uint160 operator-(const uint160& a, const uint160& b)           { r
 // uint256
 //
 
+// Mixing steps of Bob Jenkins' lookup3 hash, used by uint256::GetHash
+static inline void HashMix(uint32_t& a, uint32_t& b, uint32_t& c)
+{
+    a -= c; a ^= ((c << 4) | (c >> 28)); c += b;
+    b -= a; b ^= ((a << 6) | (a >> 26)); a += c;
+    c -= b; c ^= ((b << 8) | (b >> 24)); b += a;
+    a -= c; a ^= ((c << 16) | (c >> 16)); c += b;
+    b -= a; b ^= ((a << 19) | (a >> 13)); a += c;
+    c -= b; c ^= ((b << 4) | (b >> 28)); b += a;
+}
+
+static inline void HashFinal(uint32_t& a, uint32_t& b, uint32_t& c)
+{
+    c ^= b; c -= ((b << 14) | (b >> 18));
+    a ^= c; a -= ((c << 11) | (c >> 21));
+    b ^= a; b -= ((a << 25) | (a >> 7));
+    c ^= b; c -= ((b << 16) | (b >> 16));
+    a ^= c; a -= ((c << 4) | (c >> 28));
+    b ^= a; b -= ((a << 14) | (a >> 18));
+    c ^= b; c -= ((b << 24) | (b >> 8));
+}
+
 /** 256-bit unsigned integer */
 class uint256 : public base_uint256
 {
@@ -583,6 +671,82 @@ public:
         else
             *this = 0;
     }
+
+    // The "compact" format is a representation of a whole number N using an
+    // unsigned 32bit number similar to a floating point format, matching
+    // CBigNum::SetCompact/GetCompact without the OpenSSL allocations.
+    // The most significant 8 bits are the unsigned exponent of base 256,
+    // the lower 23 bits are the mantissa and bit 24 (0x800000) is the sign.
+    uint256& SetCompact(uint32_t nCompact, bool* pfNegative = NULL, bool* pfOverflow = NULL)
+    {
+        int nSize = nCompact >> 24;
+        uint32_t nWord = nCompact & 0x007fffff;
+        if (nSize <= 3)
+        {
+            nWord >>= 8 * (3 - nSize);
+            *this = nWord;
+        }
+        else
+        {
+            *this = nWord;
+            *this <<= 8 * (nSize - 3);
+        }
+        if (pfNegative)
+            *pfNegative = nWord != 0 && (nCompact & 0x00800000) != 0;
+        if (pfOverflow)
+            *pfOverflow = nWord != 0 && ((nSize > 34) ||
+                                         (nWord > 0xff && nSize > 33) ||
+                                         (nWord > 0xffff && nSize > 32));
+        return *this;
+    }
+
+    uint32_t GetCompact(bool fNegative = false) const
+    {
+        int nSize = (bits() + 7) / 8;
+        uint32_t nCompact = 0;
+        if (nSize <= 3)
+            nCompact = GetLow64() << 8 * (3 - nSize);
+        else
+        {
+            uint256 bn = *this;
+            bn >>= 8 * (nSize - 3);
+            nCompact = bn.GetLow64();
+        }
+        // The 0x00800000 bit denotes the sign, so if it is already set
+        // divide the mantissa by 256 and increase the exponent
+        if (nCompact & 0x00800000)
+        {
+            nCompact >>= 8;
+            nSize++;
+        }
+        nCompact |= nSize << 24;
+        nCompact |= (fNegative && (nCompact & 0x007fffff) ? 0x00800000 : 0);
+        return nCompact;
+    }
+
+    // Cheap keyed hash for in-memory hash tables. Txids are already uniformly
+    // distributed, but a secret salt keeps peers from grinding hashes that all
+    // land in the same bucket. nExtra is mixed in as well (e.g. an output index).
+    uint64_t GetHash(const uint256& salt, uint32_t nExtra = 0) const
+    {
+        uint32_t a, b, c;
+        a = b = c = 0xdeadbeef + (WIDTH << 2);
+
+        a += pn[0] ^ salt.pn[0];
+        b += pn[1] ^ salt.pn[1];
+        c += pn[2] ^ salt.pn[2];
+        HashMix(a, b, c);
+        a += pn[3] ^ salt.pn[3];
+        b += pn[4] ^ salt.pn[4];
+        c += pn[5] ^ salt.pn[5];
+        HashMix(a, b, c);
+        a += pn[6] ^ salt.pn[6];
+        b += pn[7] ^ salt.pn[7];
+        c += nExtra;
+        HashFinal(a, b, c);
+
+        return ((((uint64_t)b) << 32) | c);
+    }
 };
 
 inline bool operator==(const uint256& a, uint64_t b)                          { return (base_uint256)a == b; }
@@ -597,6 +761,9 @@ inline const uint256 operator&(const base_uint256& a, const base_uint256& b) { r
 inline const uint256 operator|(const base_uint256& a, const base_uint256& b) { return uint256(a) |= b; }
 inline const uint256 operator+(const base_uint256& a, const base_uint256& b) { return uint256(a) += b; }
 inline const uint256 operator-(const base_uint256& a, const base_uint256& b) { return uint256(a) -= b; }
+inline const uint256 operator*(const base_uint256& a, uint32_t b)            { return uint256(a) *= b; }
+inline const uint256 operator/(const base_uint256& a, uint32_t b)            { return uint256(a) /= b; }
+inline const uint256 operator/(const base_uint256& a, const base_uint256& b) { return uint256(a) /= b; }
 
 inline bool operator<(const base_uint256& a, const uint256& b)          { return (base_uint256)a <  (base_uint256)b; }
 inline bool operator<=(const base_uint256& a, const uint256& b)         { return (base_uint256)a <= (base_uint256)b; }
@@ -14,6 +14,8 @@
 
 #include <stdarg.h>
 
+#include <deque>
+
 #include <boost/date_time/posix_time/posix_time.hpp>
 
 #ifndef WIN32
@@ -73,6 +75,10 @@
 #include <openssl/crypto.h>
 #include <openssl/rand.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+
 // Work around clang compilation problem in Boost 1.46:
 // /usr/include/boost/program_options/detail/config_file.hpp:163:17: error: call to function 'to_internal' that is neither visible in the template definition nor found by argument-dependent lookup
 // See also: http://stackoverflow.com/questions/10020179/compilation-fail-in-boost-librairies-program-options
@@ -224,6 +230,21 @@ static boost::once_flag debugPrintInitFlag = BOOST_ONCE_INIT;
 // in a thread-safe manner the first time it is called:
 static FILE* fileout = NULL;
 static boost::mutex* mutexDebugLog = NULL;
+static boost::condition_variable* condDebugLog = NULL;
+
+// Messages are queued for a writer thread while it runs, and written
+// directly before it starts and after it stops. Protected by mutexDebugLog.
+static boost::thread* pthreadDebugLog = NULL;
+static bool fDebugLogWriterRunning = false;
+static bool fDebugLogWriterStop = false;
+static std::deque<std::string>* pvDebugLogQueue = NULL;
+static size_t nDebugLogQueueBytes = 0;
+static uint64_t nDebugLogDropped = 0;
+static bool fStartedNewLine = true;
+
+// Beyond this the writer cannot keep up with the disk, and messages are dropped
+static const size_t MAX_DEBUG_LOG_QUEUE_BYTES = 16 * 1024 * 1024;
+static const size_t DEBUG_LOG_BUFFER_SIZE = 64 * 1024;
 
 static void DebugPrintInit()
 {
@@ -232,11 +253,97 @@ static void DebugPrintInit()
 
     boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
     fileout = fopen(pathDebug.string().c_str(), "a");
-    if (fileout) setbuf(fileout, NULL); // unbuffered
+    if (fileout) setvbuf(fileout, NULL, _IOFBF, DEBUG_LOG_BUFFER_SIZE);
 
     mutexDebugLog = new boost::mutex();
+    condDebugLog = new boost::condition_variable();
+    pvDebugLogQueue = new std::deque<std::string>();
+}
+
+// Requires mutexDebugLog.
+static void ReopenDebugLogIfRequested()
+{
+    if (fReopenDebugLog) {
+        fReopenDebugLog = false;
+        boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
+        if (freopen(pathDebug.string().c_str(),"a",fileout) != NULL)
+            setvbuf(fileout, NULL, _IOFBF, DEBUG_LOG_BUFFER_SIZE);
+    }
+}
+
+static void ThreadDebugLogWriter()
+{
+    std::deque<std::string> vWrite;
+    while (true) {
+        uint64_t nDropped;
+        {
+            boost::unique_lock<boost::mutex> lock(*mutexDebugLog);
+            while (pvDebugLogQueue->empty() && !fDebugLogWriterStop)
+                condDebugLog->wait(lock);
+            if (pvDebugLogQueue->empty()) {
+                fDebugLogWriterRunning = false;
+                break;
+            }
+            vWrite.swap(*pvDebugLogQueue);
+            nDebugLogQueueBytes = 0;
+            nDropped = nDebugLogDropped;
+            nDebugLogDropped = 0;
+            ReopenDebugLogIfRequested();
+        }
+
+        // Only this thread writes to the file while it runs
+        BOOST_FOREACH(const std::string& str, vWrite)
+            fwrite(str.data(), 1, str.size(), fileout);
+        if (nDropped > 0)
+            fprintf(fileout, "%lu log messages dropped, the log writer could not keep up\n", (unsigned long)nDropped);
+        fflush(fileout);
+        vWrite.clear();
+    }
 }
 
+void StartDebugLogWriter()
+{
+    if (fPrintToConsole || !fPrintToDebugLog)
+        return;
+    boost::call_once(&DebugPrintInit, debugPrintInitFlag);
+    if (fileout == NULL)
+        return;
+
+    boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
+    if (pthreadDebugLog)
+        return;
+    fDebugLogWriterStop = false;
+    fDebugLogWriterRunning = true;
+    pthreadDebugLog = new boost::thread(&ThreadDebugLogWriter);
+}
+
+void StopDebugLogWriter()
+{
+    boost::thread* pthread;
+    {
+        if (mutexDebugLog == NULL)
+            return;
+        boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
+        pthread = pthreadDebugLog;
+        if (!pthread)
+            return;
+        fDebugLogWriterStop = true;
+        condDebugLog->notify_one();
+    }
+    // Writes what is still queued before exiting
+    pthread->join();
+    boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
+    delete pthreadDebugLog;
+    pthreadDebugLog = NULL;
+}
+
+// -debug categories, looked up without allocating
+struct CLogCategories
+{
+    bool fAll;
+    std::vector<std::string> vCategories;
+};
+
 bool LogAcceptCategory(const char* category)
 {
     if (category != NULL)
@@ -248,26 +355,32 @@ bool LogAcceptCategory(const char* category)
         // This helps prevent issues debugging global destructors,
         // where mapMultiArgs might be deleted before another
         // global destructor calls LogPrint()
-        static boost::thread_specific_ptr<set<string> > ptrCategory;
+        static boost::thread_specific_ptr<CLogCategories> ptrCategory;
         if (ptrCategory.get() == NULL)
         {
             const vector<string>& categories = mapMultiArgs["-debug"];
-            ptrCategory.reset(new set<string>(categories.begin(), categories.end()));
+            CLogCategories* pcategories = new CLogCategories();
+            pcategories->fAll = find(categories.begin(), categories.end(), string("")) != categories.end();
+            pcategories->vCategories = categories;
+            ptrCategory.reset(pcategories);
             // thread_specific_ptr automatically deletes the set when the thread ends.
         }
-        const set<string>& setCategories = *ptrCategory.get();
+        const CLogCategories& categories = *ptrCategory.get();
 
         // if not debugging everything and not debugging specific category, LogPrint does nothing.
-        if (setCategories.count(string("")) == 0 &&
-            setCategories.count(string(category)) == 0)
-            return false;
+        if (categories.fAll)
+            return true;
+        BOOST_FOREACH(const std::string& strCategory, categories.vCategories)
+            if (strCategory == category)
+                return true;
+        return false;
     }
     return true;
 }
 
 int LogPrintStr(const std::string &str)
 {
-    int ret = 0; // Returns total number of characters written
+    int ret = 0; // Returns total number of characters written or queued
     if (fPrintToConsole)
     {
         // print to console
@@ -275,36 +388,101 @@ int LogPrintStr(const std::string &str)
     }
     else if (fPrintToDebugLog)
     {
-        static bool fStartedNewLine = true;
         boost::call_once(&DebugPrintInit, debugPrintInitFlag);
 
         if (fileout == NULL)
             return ret;
 
-        boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
+        // Debug print useful for profiling. Formatted before taking the
+        // lock, although only used at the start of a line.
+        std::string strTimestamp;
+        if (fLogTimestamps)
+            strTimestamp = DateTimeStrFormat("%Y-%m-%d %H:%M:%S ", GetTime());
 
-        // reopen the log file, if requested
-        if (fReopenDebugLog) {
-            fReopenDebugLog = false;
-            boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
-            if (freopen(pathDebug.string().c_str(),"a",fileout) != NULL)
-                setbuf(fileout, NULL); // unbuffered
-        }
+        boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
 
-        // Debug print useful for profiling
-        if (fLogTimestamps && fStartedNewLine)
-            ret += fprintf(fileout, "%s ", DateTimeStrFormat("%Y-%m-%d %H:%M:%S", GetTime()).c_str());
-        if (!str.empty() && str[str.size()-1] == '\n')
-            fStartedNewLine = true;
+        std::string strLine;
+        if (fStartedNewLine)
+            strLine = strTimestamp + str;
         else
-            fStartedNewLine = false;
+            strLine = str;
+        fStartedNewLine = !str.empty() && str[str.size()-1] == '\n';
+        ret = strLine.size();
+
+        if (fDebugLogWriterRunning) {
+            if (nDebugLogQueueBytes + strLine.size() > MAX_DEBUG_LOG_QUEUE_BYTES) {
+                nDebugLogDropped++;
+                return 0;
+            }
+            nDebugLogQueueBytes += strLine.size();
+            pvDebugLogQueue->push_back(std::string());
+            pvDebugLogQueue->back().swap(strLine);
+            condDebugLog->notify_one();
+            return ret;
+        }
 
-        ret = fwrite(str.data(), 1, str.size(), fileout);
+        // No writer thread: before startup completes, and after shutdown
+        ReopenDebugLogIfRequested();
+        fwrite(strLine.data(), 1, strLine.size(), fileout);
+        fflush(fileout);
     }
 
     return ret;
 }
 
+int64_t nLogRateLimit = DEFAULT_LOG_RATE_LIMIT * 1024;
+
+// Bytes logged in the current window by each place in the code
+struct CLogRateLimitSite
+{
+    int64_t nWindowStart;
+    uint64_t nBytes;
+    uint64_t nSuppressed;
+    uint64_t nSuppressedBytes;
+
+    CLogRateLimitSite() : nWindowStart(0), nBytes(0), nSuppressed(0), nSuppressedBytes(0) {}
+};
+
+static const int64_t LOG_RATE_LIMIT_WINDOW = 60 * 60;
+
+int LogPrintStrLimited(const char* pszSite, const std::string &str)
+{
+    if (nLogRateLimit <= 0 || pszSite == NULL)
+        return LogPrintStr(str);
+
+    // Allocated once and never freed, for logging from global destructors
+    static boost::mutex* pmutexSites = new boost::mutex();
+    static std::map<const char*, CLogRateLimitSite>* pmapSites = new std::map<const char*, CLogRateLimitSite>();
+
+    std::string strNote;
+    {
+        boost::mutex::scoped_lock lock(*pmutexSites);
+        CLogRateLimitSite& site = (*pmapSites)[pszSite];
+        int64_t nNow = GetTime();
+        if (nNow - site.nWindowStart >= LOG_RATE_LIMIT_WINDOW || nNow < site.nWindowStart) {
+            if (site.nSuppressed > 0)
+                strNote = strprintf("Resuming logging of \"%s\": %u messages (%u bytes) were suppressed\n",
+                                    SanitizeString(std::string(pszSite).substr(0, 40)), site.nSuppressed, site.nSuppressedBytes);
+            site = CLogRateLimitSite();
+            site.nWindowStart = nNow;
+        }
+        if (site.nSuppressed > 0 || site.nBytes + str.size() > (uint64_t)nLogRateLimit) {
+            if (site.nSuppressed == 0)
+                strNote = strprintf("Excessive logging of \"%s\", suppressing it for up to %d minutes (see -logratelimit)\n",
+                                    SanitizeString(std::string(pszSite).substr(0, 40)), (site.nWindowStart + LOG_RATE_LIMIT_WINDOW - nNow + 59) / 60);
+            site.nSuppressed++;
+            site.nSuppressedBytes += str.size();
+            if (!strNote.empty())
+                LogPrintStr(strNote);
+            return 0;
+        }
+        site.nBytes += str.size();
+    }
+    if (!strNote.empty())
+        LogPrintStr(strNote);
+    return LogPrintStr(str);
+}
+
 string FormatMoney(int64_t n, bool fPlus)
 {
     // Note: not using straight sprintf here because we do NOT want
@@ -1450,6 +1628,26 @@ void RenameThread(const char* name)
 #endif
 }
 
+bool CPUHasAVX2()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    // The OS has to save the upper halves of the ymm registers
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+        return false;
+    unsigned int xcr0_lo, xcr0_hi;
+    __asm__ ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) != 6 || __get_cpuid_max(0, NULL) < 7)
+        return false;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & bit_AVX2) != 0;
+#else
+    return false;
+#endif
+}
+
 void SetupEnvironment()
 {
     #ifndef WIN32
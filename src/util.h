@@ -112,6 +112,17 @@ void SetupEnvironment();
 bool LogAcceptCategory(const char* category);
 /* Send a string to the log output */
 int LogPrintStr(const std::string &str);
+/* Send a string to the log output, unless the code at pszSite (its format
+ * string) has logged more than -logratelimit in the last hour */
+int LogPrintStrLimited(const char* pszSite, const std::string &str);
+/* Write debug.log from a background thread, which is drained and stopped
+ * by StopDebugLogWriter(). Messages are written directly without one. */
+void StartDebugLogWriter();
+void StopDebugLogWriter();
+
+/** Default for -logratelimit, in KiB per hour for each place that logs */
+static const int64_t DEFAULT_LOG_RATE_LIMIT = 1024;
+extern int64_t nLogRateLimit;
 
 #define strprintf tfm::format
 #define LogPrintf(...) LogPrint(NULL, __VA_ARGS__)
@@ -125,13 +136,14 @@ int LogPrintStr(const std::string &str);
     static inline int LogPrint(const char* category, const char* format, TINYFORMAT_VARARGS(n))  \
     {                                                                         \
         if(!LogAcceptCategory(category)) return 0;                            \
-        return LogPrintStr(tfm::format(format, TINYFORMAT_PASSARGS(n))); \
+        if(category) return LogPrintStr(tfm::format(format, TINYFORMAT_PASSARGS(n))); \
+        return LogPrintStrLimited(format, tfm::format(format, TINYFORMAT_PASSARGS(n))); \
     }                                                                         \
     /*   Log error and return false */                                        \
     template<TINYFORMAT_ARGTYPES(n)>                                          \
     static inline bool error(const char* format, TINYFORMAT_VARARGS(n))                     \
     {                                                                         \
-        LogPrintStr("ERROR: " + tfm::format(format, TINYFORMAT_PASSARGS(n)) + "\n"); \
+        LogPrintStrLimited(format, "ERROR: " + tfm::format(format, TINYFORMAT_PASSARGS(n)) + "\n"); \
         return false;                                                         \
     }
 
@@ -143,11 +155,12 @@ TINYFORMAT_FOREACH_ARGNUM(MAKE_ERROR_AND_LOG_FUNC)
 static inline int LogPrint(const char* category, const char* format)
 {
     if(!LogAcceptCategory(category)) return 0;
-    return LogPrintStr(format);
+    if(category) return LogPrintStr(format);
+    return LogPrintStrLimited(format, format);
 }
 static inline bool error(const char* format)
 {
-    LogPrintStr(std::string("ERROR: ") + format + "\n");
+    LogPrintStrLimited(format, std::string("ERROR: ") + format + "\n");
     return false;
 }
 
@@ -505,6 +518,8 @@ inline void SetThreadPriority(int nPriority)
 #endif
 
 void RenameThread(const char* name);
+/** Whether both the CPU and the OS (saving ymm state) support AVX2 */
+bool CPUHasAVX2();
 
 inline uint32_t ByteReverse(uint32_t value)
 {
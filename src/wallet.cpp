@@ -8,7 +8,9 @@
 #include "base58.h"
 #include "checkpoints.h"
 #include "coincontrol.h"
+#include "core_memusage.h"
 #include "net.h"
+#include "workpool.h"
 
 #include <boost/algorithm/string/replace.hpp>
 #include <openssl/rand.h>
@@ -42,24 +44,51 @@ const CWalletTx* CWallet::GetWalletTx(const uint256& hash) const
     return &(it->second);
 }
 
+// Path of the i-th key of the HD chain
+static std::string HDKeypath(uint32_t nChild)
+{
+    return strprintf("m/0'/0'/%u'", nChild);
+}
+
 CPubKey CWallet::GenerateNewKey()
 {
     AssertLockHeld(cs_wallet); // mapKeyMetadata
+    if (IsHDEnabled())
+    {
+        std::vector<CKey> vKeys(1);
+        CHDChain chain = hdChain;
+        if (!DeriveHDKeys(chain.masterKeyID, chain.nExternalChainCounter, vKeys))
+            throw std::runtime_error("CWallet::GenerateNewKey() : deriving HD key failed");
+        chain.nExternalChainCounter++;
+        if (!SetHDChain(chain, false))
+            throw std::runtime_error("CWallet::GenerateNewKey() : writing HD chain failed");
+        return AddGeneratedKey(vKeys[0], HDKeypath(chain.nExternalChainCounter - 1), chain.masterKeyID);
+    }
+
     bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
 
     RandAddSeedPerfmon();
     CKey secret;
     secret.MakeNewKey(fCompressed);
+    return AddGeneratedKey(secret);
+}
+
+CPubKey CWallet::AddGeneratedKey(const CKey& secret, const std::string& hdKeypath, const CKeyID& hdMasterKeyID)
+{
+    AssertLockHeld(cs_wallet); // mapKeyMetadata
 
     // Compressed public keys were introduced in version 0.6.0
-    if (fCompressed)
+    if (secret.IsCompressed())
         SetMinVersion(FEATURE_COMPRPUBKEY);
 
     CPubKey pubkey = secret.GetPubKey();
 
     // Create new metadata
     int64_t nCreationTime = GetTime();
-    mapKeyMetadata[pubkey.GetID()] = CKeyMetadata(nCreationTime);
+    CKeyMetadata& meta = mapKeyMetadata[pubkey.GetID()];
+    meta = CKeyMetadata(nCreationTime);
+    meta.hdKeypath = hdKeypath;
+    meta.hdMasterKeyID = hdMasterKeyID;
     if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
         nTimeFirstKey = nCreationTime;
 
@@ -68,6 +97,51 @@ CPubKey CWallet::GenerateNewKey()
     return pubkey;
 }
 
+bool CWallet::DeriveHDKeys(const CKeyID& masterKeyID, uint32_t nChild, std::vector<CKey>& vKeys) const
+{
+    if (nChild >= BIP32_HARDENED_KEY_LIMIT || vKeys.size() > BIP32_HARDENED_KEY_LIMIT - nChild)
+        return false;
+
+    CKey seed;
+    if (!GetKey(masterKeyID, seed))
+        return false;
+
+    // Every step is hardened, so CKey::Derive is used rather than
+    // CExtKey::Derive, which also computes the public key of each parent for
+    // its fingerprint. A key then costs one HMAC-SHA512 and one addition.
+    CExtKey masterKey;
+    masterKey.SetMaster(seed.begin(), seed.size());
+    CKey accountKey, chainKey;
+    unsigned char ccAccount[32], ccChain[32], ccChild[32];
+    if (!masterKey.key.Derive(accountKey, ccAccount, BIP32_HARDENED_KEY_LIMIT, masterKey.vchChainCode) ||
+        !accountKey.Derive(chainKey, ccChain, BIP32_HARDENED_KEY_LIMIT, ccAccount))
+        return false;
+    for (unsigned int i = 0; i < vKeys.size(); i++)
+        if (!chainKey.Derive(vKeys[i], ccChild, (nChild + i) | BIP32_HARDENED_KEY_LIMIT, ccChain))
+            return false;
+    return true;
+}
+
+bool CWallet::SetHDMasterKey(const CKey& key)
+{
+    LOCK(cs_wallet);
+
+    // The seed is kept, and encrypted, like any other key of the wallet
+    CHDChain chain;
+    chain.masterKeyID = key.GetPubKey().GetID();
+    AddGeneratedKey(key, "m", chain.masterKeyID);
+    return SetHDChain(chain, false);
+}
+
+bool CWallet::SetHDChain(const CHDChain& chain, bool memonly)
+{
+    LOCK(cs_wallet);
+    if (!memonly && fFileBacked && !CWalletDB(strWalletFile).WriteHDChain(chain))
+        return false;
+    hdChain = chain;
+    return true;
+}
+
 bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
 {
     AssertLockHeld(cs_wallet); // mapKeyMetadata
@@ -125,7 +199,7 @@ bool CWallet::AddCScript(const CScript& redeemScript)
         return false;
     if (!fFileBacked)
         return true;
-    return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
+    return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript.begin(), redeemScript.end()), redeemScript);
 }
 
 bool CWallet::Lock()
@@ -157,6 +231,22 @@ bool CWallet::Lock()
     return true;
 }
 
+bool CWallet::AddWatchOnly(const CScript &dest)
+{
+    if (!CCryptoKeyStore::AddWatchOnly(dest))
+        return false;
+    // The outputs of a watch-only script may be anywhere in the chain
+    nTimeFirstKey = 1;
+    if (!fFileBacked)
+        return true;
+    return CWalletDB(strWalletFile).WriteWatchOnly(dest);
+}
+
+bool CWallet::LoadWatchOnly(const CScript &dest)
+{
+    return CCryptoKeyStore::AddWatchOnly(dest);
+}
+
 bool CWallet::LoadCScript(const CScript& redeemScript)
 {
     /* A sanity check was added in pull #3843 to avoid adding redeemScripts
@@ -187,12 +277,35 @@ bool CWallet::Unlock(const SecureString& strWalletPassphrase)
             if (!crypter.Decrypt(pMasterKey.second.vchCryptedKey, vMasterKey))
                 continue; // try another master key
             if (CCryptoKeyStore::Unlock(vMasterKey))
+            {
+                UnlockStealthAddresses(vMasterKey);
                 return true;
+            }
         }
     }
     return false;
 }
 
+bool CWallet::GetKey(const CKeyID &address, CKey& keyOut) const
+{
+    if (CCryptoKeyStore::GetKey(address, keyOut))
+        return true;
+
+    // Derived without cs_wallet, as the inputs of a transaction are signed
+    // by threads of their own
+    CStealthPendingKey pending;
+    {
+        LOCK(cs_KeyStore);
+        if (IsLocked())
+            return false;
+        std::map<CKeyID, CStealthPendingKey>::const_iterator mi = mapStealthPendingKeys.find(address);
+        if (mi == mapStealthPendingKeys.end())
+            return false;
+        pending = mi->second;
+    }
+    return pending.Derive(keyOut);
+}
+
 bool CWallet::ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase, const SecureString& strNewWalletPassphrase)
 {
     bool fWasLocked = IsLocked();
@@ -365,6 +478,11 @@ void CWallet::AddToSpends(const COutPoint& outpoint, const uint256& wtxid)
 {
     mapTxSpends.insert(make_pair(outpoint, wtxid));
 
+    // The available credit of the transaction spent from changes
+    std::map<uint256, CWalletTx>::iterator mit = mapWallet.find(outpoint.hash);
+    if (mit != mapWallet.end())
+        mit->second.MarkDirty();
+
     pair<TxSpends::iterator, TxSpends::iterator> range;
     range = mapTxSpends.equal_range(outpoint);
     SyncMetaData(range);
@@ -475,40 +593,92 @@ int64_t CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
     return nRet;
 }
 
-CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount)
+void CWallet::IndexWalletTx(CWalletTx& wtx)
 {
-    AssertLockHeld(cs_wallet); // mapWallet
-    CWalletDB walletdb(strWalletFile);
+    AssertLockHeld(cs_wallet);
+    wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
+    if (wtx.hashBlock != 0)
+        mapTxByBlock.insert(make_pair(wtx.hashBlock, &wtx));
+}
+
+void CWallet::UnindexWalletTx(const uint256& hash)
+{
+    AssertLockHeld(cs_wallet);
+    map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+    if (mi == mapWallet.end())
+        return;
+    const CWalletTx* pwtx = &mi->second;
+
+    pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(pwtx->nOrderPos);
+    for (TxItems::iterator it = range.first; it != range.second; ++it)
+        if (it->second.first == pwtx)
+        {
+            wtxOrdered.erase(it);
+            break;
+        }
 
-    // First: get all CWalletTx and CAccountingEntry into a sorted-by-order multimap.
-    TxItems txOrdered;
+    typedef multimap<uint256, const CWalletTx*>::iterator TxByBlockIter;
+    pair<TxByBlockIter, TxByBlockIter> rangeBlock = mapTxByBlock.equal_range(pwtx->hashBlock);
+    for (TxByBlockIter it = rangeBlock.first; it != rangeBlock.second; ++it)
+        if (it->second == pwtx)
+        {
+            mapTxByBlock.erase(it);
+            break;
+        }
+}
+
+void CWallet::LoadAccountingEntry(const CAccountingEntry& acentry)
+{
+    AssertLockHeld(cs_wallet);
+    laccentries.push_back(acentry);
+    CAccountingEntry& entry = laccentries.back();
+    wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+}
+
+void CWallet::GetTransactionsBelowDepth(int nDepth, std::map<uint256, const CWalletTx*>& mapTx) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    mapTx.clear();
 
-    // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-    // would make this much faster for applications that do this a lot.
-    for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    // Those at one confirmation or more are in the last nDepth - 1 blocks
+    for (int nHeight = std::max(chainActive.Height() - nDepth + 2, 0); nHeight <= chainActive.Height(); nHeight++)
     {
-        CWalletTx* wtx = &((*it).second);
-        txOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+        typedef multimap<uint256, const CWalletTx*>::const_iterator TxByBlockIter;
+        pair<TxByBlockIter, TxByBlockIter> range = mapTxByBlock.equal_range(chainActive[nHeight]->GetBlockHash());
+        for (TxByBlockIter it = range.first; it != range.second; ++it)
+            if (it->second->GetDepthInMainChain() < nDepth)
+                mapTx[it->second->GetHash()] = it->second;
     }
-    acentries.clear();
-    walletdb.ListAccountCreditDebit(strAccount, acentries);
-    BOOST_FOREACH(CAccountingEntry& entry, acentries)
+
+    // ... and the others are all unsettled
+    UpdateBalanceCache();
+    BOOST_FOREACH(const uint256& hash, setBalanceUnsettled)
     {
-        txOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end() && mi->second.GetDepthInMainChain() < nDepth)
+            mapTx[hash] = &mi->second;
     }
-
-    return txOrdered;
 }
 
 void CWallet::MarkDirty()
 {
     {
         LOCK(cs_wallet);
+        fBalanceCacheValid = false;
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
     }
 }
 
+void CWallet::MarkBalanceDirty(const CWalletTx* pwtx) const
+{
+    LOCK(cs_wallet);
+    // Only worth hashing when the totals are not rebuilt anyway
+    if (fBalanceCacheValid)
+        setBalanceDirty.insert(pwtx->GetHash());
+}
+
 bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
 {
     uint256 hash = wtxIn.GetHash();
@@ -542,9 +712,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
                     {
                         // Tolerate times up to the last timestamp in the wallet not more than 5 minutes into the future
                         int64_t latestTolerated = latestNow + 300;
-                        std::list<CAccountingEntry> acentries;
-                        TxItems txOrdered = OrderedTxItems(acentries);
-                        for (TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+                        for (TxItems::reverse_iterator it = wtxOrdered.rbegin(); it != wtxOrdered.rend(); ++it)
                         {
                             CWalletTx *const pwtx = (*it).second.first;
                             if (pwtx == &wtx)
@@ -578,6 +746,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
                              wtxIn.hashBlock.ToString());
             }
             AddToSpends(hash);
+            IndexWalletTx(wtx);
         }
 
         bool fUpdated = false;
@@ -586,7 +755,9 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
             // Merge
             if (wtxIn.hashBlock != 0 && wtxIn.hashBlock != wtx.hashBlock)
             {
+                UnindexWalletTx(hash);
                 wtx.hashBlock = wtxIn.hashBlock;
+                IndexWalletTx(wtx);
                 fUpdated = true;
             }
             if (wtxIn.nIndex != -1 && (wtxIn.vMerkleBranch != wtx.vMerkleBranch || wtxIn.nIndex != wtx.nIndex))
@@ -642,7 +813,7 @@ bool CWallet::AddToWalletIfInvolvingMe(const uint256 &hash, const CTransaction&
         mapValue_t mapNarr;
         FindStealthTransactions(tx, mapNarr);
 
-        if (fExisted || IsMine(tx) || IsFromMe(tx))
+        if (fExisted || IsMine(tx) || IsFromMe(tx) || IsFromWatchOnly(tx))
         {
             CWalletTx wtx(this,tx);
             // Get merkle branch if transaction was found in a block
@@ -656,6 +827,16 @@ bool CWallet::AddToWalletIfInvolvingMe(const uint256 &hash, const CTransaction&
 
 void CWallet::SyncTransaction(const uint256 &hash, const CTransaction& tx, const CBlock* pblock)
 {
+    // Most transactions are not ours: find that out, stealth payments
+    // included, without holding up validation on cs_main
+    {
+        LOCK(cs_wallet);
+        mapValue_t mapNarr;
+        FindStealthTransactions(tx, mapNarr);
+        if (!mapWallet.count(hash) && !IsMine(tx) && !IsFromMe(tx) && !IsFromWatchOnly(tx))
+            return;
+    }
+
     LOCK2(cs_main, cs_wallet);
     if (!AddToWalletIfInvolvingMe(hash, tx, pblock, true))
         return; // Not one of ours
@@ -676,8 +857,12 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         return;
     {
         LOCK(cs_wallet);
+        UnindexWalletTx(hash);
         if (mapWallet.erase(hash))
+        {
+            fBalanceCacheValid = false;
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return;
 }
@@ -699,6 +884,21 @@ bool CWallet::IsMine(const CTxIn &txin) const
     return false;
 }
 
+bool CWallet::IsFromWatchOnly(const CTransaction& tx) const
+{
+    if (!HaveWatchOnly())
+        return false;
+    LOCK(cs_wallet);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(txin.prevout.hash);
+        if (mi != mapWallet.end() && txin.prevout.n < mi->second.vout.size() &&
+            IsWatchOnly(mi->second.vout[txin.prevout.n]))
+            return true;
+    }
+    return false;
+}
+
 int64_t CWallet::GetDebit(const CTxIn &txin) const
 {
     {
@@ -880,51 +1080,289 @@ bool CWalletTx::WriteToDisk()
 // exist in the wallet will be updated.
 //int ret = 0;
 
+namespace {
+
+// The ephemeral public key of a stealth payment, in an OP_RETURN output
+bool GetStealthEphemKey(const CTxOut& txout, std::vector<uint8_t>& vchEphemPK)
+{
+    opcodetype opCode;
+    CScript::const_iterator it = txout.scriptPubKey.begin();
+    return txout.scriptPubKey.GetOp(it, opCode, vchEphemPK) && opCode == OP_RETURN &&
+           txout.scriptPubKey.GetOp(it, opCode, vchEphemPK) && vchEphemPK.size() == 33;
+}
+
+typedef std::vector<boost::shared_ptr<const CStealthScanKey> > StealthScanKeys;
+
+// Stealth payments and narrations are in OP_RETURN outputs, which most
+// transactions do not have; told from the first byte of each script
+bool HasOpReturnOutput(const CTransaction& tx)
+{
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        if (!txout.scriptPubKey.empty() && txout.scriptPubKey[0] == OP_RETURN)
+            return true;
+    return false;
+}
+
+// The keys that outputs of tx other than txoutSkip pay to, and which the
+// keystore does not have yet
+void GetStealthCandidates(const CKeyStore& keystore, const CTransaction& tx, const CTxOut& txoutSkip, std::set<CKeyID>& setCandidates)
+{
+    setCandidates.clear();
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+    {
+        if (&txout == &txoutSkip)
+            continue;
+        CTxDestination address;
+        if (!ExtractDestination(txout.scriptPubKey, address) || address.type() != typeid(CKeyID))
+            continue;
+        CKeyID ckidMatch = boost::get<CKeyID>(address);
+        if (!keystore.HaveKey(ckidMatch)) // no point checking if already have key
+            setCandidates.insert(ckidMatch);
+    }
+}
+
+/** The key that an ephemeral key derives for one stealth address */
+struct CStealthDerivation
+{
+    bool fDerived;
+    ec_secret sShared;
+    CPubKey pubkey;
+
+    CStealthDerivation() : fDerived(false) {}
+};
+
+void DeriveStealthKeys(const StealthScanKeys* pvScanKeys, const ec_point* pvchEphemPK,
+                       std::vector<CStealthDerivation>* pvDerived, unsigned int nBegin, unsigned int nEnd)
+{
+    for (unsigned int i = nBegin; i < nEnd; i++)
+    {
+        CStealthDerivation& derived = (*pvDerived)[i];
+        ec_point pkExtracted;
+        derived.fDerived = false;
+        if ((*pvScanKeys)[i]->StealthSecret(*pvchEphemPK, derived.sShared, pkExtracted) != 0)
+        {
+            LogPrintf("StealthSecret failed.\n");
+            continue;
+        }
+        derived.pubkey = CPubKey(pkExtracted);
+        derived.fDerived = derived.pubkey.IsValid();
+    }
+}
+
+// Each scan key costs an EC multiplication by the ephemeral key, spread over
+// threads when there are many addresses
+void DeriveStealthKeysParallel(const StealthScanKeys& vScanKeys, const ec_point& vchEphemPK, std::vector<CStealthDerivation>& vDerived)
+{
+    vDerived.assign(vScanKeys.size(), CStealthDerivation());
+    if (nScriptCheckThreads == 0 || vScanKeys.size() < PARALLEL_STEALTH_MIN_ADDRESSES)
+    {
+        DeriveStealthKeys(&vScanKeys, &vchEphemPK, &vDerived, 0, vScanKeys.size());
+        return;
+    }
+    CWorkPool pool(TASK_RELAY);
+    pool.ForEachRange(vScanKeys.size(), nScriptCheckThreads, boost::bind(DeriveStealthKeys, &vScanKeys, &vchEphemPK, &vDerived, _1, _2));
+}
+
+/** Whether FindStealthTransactions would find a new key in tx for one of
+ *  the stealth addresses; the same test, without its side effects. Also
+ *  counts the stealth outputs of tx. */
+bool MatchStealthOutputs(const CKeyStore& keystore, const StealthScanKeys& vScanKeys,
+                         const CTransaction& tx, unsigned int& nStealthOutputs)
+{
+    bool fMatch = false;
+    nStealthOutputs = 0;
+    if (!HasOpReturnOutput(tx))
+        return false;
+
+    std::vector<uint8_t> vchEphemPK;
+    std::set<CKeyID> setCandidates;
+    std::vector<CStealthDerivation> vDerived;
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+    {
+        if (!GetStealthEphemKey(txout, vchEphemPK))
+            continue;
+        nStealthOutputs++;
+        if (fMatch)
+            continue;
+
+        GetStealthCandidates(keystore, tx, txout, setCandidates);
+        if (setCandidates.empty())
+            continue;
+        vDerived.assign(vScanKeys.size(), CStealthDerivation());
+        DeriveStealthKeys(&vScanKeys, &vchEphemPK, &vDerived, 0, vScanKeys.size());
+        BOOST_FOREACH(const CStealthDerivation& derived, vDerived)
+            if (derived.fDerived && setCandidates.count(derived.pubkey.GetID()))
+            {
+                fMatch = true;
+                break;
+            }
+    }
+    return fMatch;
+}
+
+/** A block of a rescan, matched against the wallet by a worker */
+struct CRescanBlock
+{
+    CBlockIndex* pindex;
+    unsigned int nGeneration; // of the wallet keys, when it was submitted
+    CBlock block;
+    std::vector<uint256> vHashes;
+    std::vector<char> vCandidate;  // per transaction: pays to a key of the wallet
+    std::vector<char> vStealth;    // per transaction: gives a new stealth key
+    unsigned int nStealthOutputs;  // in the transactions that are neither
+    bool fRead;
+    bool fDone;
+
+    CRescanBlock(CBlockIndex* pindexIn, unsigned int nGenerationIn) :
+        pindex(pindexIn), nGeneration(nGenerationIn), nStealthOutputs(0), fRead(false), fDone(false) {}
+};
+
+void MatchRescanBlock(CWorkPool* pool, const CWallet* pwallet, const StealthScanKeys* pvScanKeys, CRescanBlock* pscan)
+{
+    try {
+        pscan->fRead = ReadBlockFromDisk(pscan->block, pscan->pindex);
+        if (pscan->fRead)
+        {
+            const std::vector<CTransaction>& vtx = pscan->block.vtx;
+            pscan->vHashes.resize(vtx.size());
+            pscan->vCandidate.resize(vtx.size());
+            pscan->vStealth.resize(vtx.size());
+            for (unsigned int i = 0; i < vtx.size(); i++)
+            {
+                unsigned int nStealthOutputs;
+                pscan->vHashes[i] = vtx[i].GetHash();
+                pscan->vStealth[i] = MatchStealthOutputs(*pwallet, *pvScanKeys, vtx[i], nStealthOutputs);
+                pscan->vCandidate[i] = pscan->vStealth[i] || pwallet->IsMine(vtx[i]);
+                if (!pscan->vCandidate[i])
+                    pscan->nStealthOutputs += nStealthOutputs;
+            }
+        }
+    } catch (std::exception& e) {
+        LogPrintf("%s : %s\n", __func__, e.what());
+        pscan->fRead = false;
+    }
+    pool->MarkDone(pscan->fDone);
+}
+
+}
+
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
     int64_t nNow = GetTime();
-	
+    unsigned int nBlocks = 0;
+
     CBlockIndex* pindex = pindexStart;
+    StealthScanKeys vScanKeys;
+    double dProgressStart, dProgressTip;
     {
         LOCK2(cs_main, cs_wallet);
-		
+
         // no need to read and scan block, if block was created before
         // our wallet birthday (as adjusted for block time variability)
         while (pindex && nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200)))
             pindex = chainActive.Next(pindex);
-        
-		ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-		
-        double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
-        while (pindex)
+
+        // The workers match with the scan keys of the owned stealth
+        // addresses, which stay valid without the lock
+        GetStealthScanKeys(vScanKeys);
+
+        ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
+        dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
+        dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
+    }
+
+    // Blocks are read and matched against the keys by a pool of threads, and
+    // the transactions they find added to the wallet in chain order. The
+    // locks are taken for the commit of each block only, so the node keeps
+    // connecting blocks and serving RPC during a long rescan.
+    int nThreads = std::max(nScriptCheckThreads, 1);
+    unsigned int nMaxQueued = 4 * nThreads + 8;
+    // Stealth payments add keys as they are committed; blocks matched before
+    // the last of those are matched again
+    unsigned int nGeneration = 0;
+    std::deque<CRescanBlock> queueBlocks;
+    {
+        // Declared after what its jobs refer to, so it is destroyed first
+        CWorkPool pool(TASK_BACKGROUND);
+        CBlockIndex* pindexNext = pindex;
+        while (true)
         {
-			
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
-
-           	CBlock block;
-			try {
-				ReadBlockFromDisk(block, pindex);
-
-				BOOST_FOREACH(CTransaction& tx, block.vtx)
-				{
-					if (AddToWalletIfInvolvingMe(tx.GetHash(), tx, &block, true))
-						ret++;
-				}
-				pindex = chainActive.Next(pindex);
-				if (GetTime() >= nNow + 60) {
-					nNow = GetTime();
-					LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
-				}
-			}
-			catch (...){
-			}
+            while (pindexNext && queueBlocks.size() < nMaxQueued)
+            {
+                queueBlocks.push_back(CRescanBlock(pindexNext, nGeneration));
+                pool.Submit(boost::bind(&MatchRescanBlock, &pool, this, &vScanKeys, &queueBlocks.back()));
+                LOCK(cs_main);
+                pindexNext = chainActive.Next(pindexNext);
+            }
+            if (queueBlocks.empty())
+                break;
+
+            pool.WaitDone(queueBlocks.front().fDone);
+            {
+                LOCK2(cs_main, cs_wallet);
+                // The blocks matched by then are committed together, in one
+                // database transaction
+                CDBBatch batch(fFileBacked ? strWalletFile.c_str() : NULL);
+                do {
+                    CRescanBlock& scan = queueBlocks.front();
+                    if (!chainActive.Contains(scan.pindex))
+                    {
+                        // Reorganized away while the locks were released: go on
+                        // from the fork, once no job refers to the queue
+                        const CBlockIndex* pindexFork = scan.pindex;
+                        while (pindexFork && !chainActive.Contains(pindexFork))
+                            pindexFork = pindexFork->pprev;
+                        BOOST_FOREACH(const CRescanBlock& queued, queueBlocks)
+                            pool.WaitDone(queued.fDone);
+                        queueBlocks.clear();
+                        pindexNext = pindexFork ? chainActive.Next(pindexFork) : chainActive.Genesis();
+                        break;
+                    }
+
+                    if (!scan.fRead)
+                        LogPrintf("ScanForWalletTransactions() : failed to read block %s\n", scan.pindex->GetBlockHash().ToString());
+                    try {
+                        const std::vector<CTransaction>& vtx = scan.block.vtx;
+                        for (unsigned int i = 0; scan.fRead && i < vtx.size(); i++)
+                        {
+                            const CTransaction& tx = vtx[i];
+                            bool fStealth = scan.vStealth[i], fCandidate = scan.vCandidate[i];
+                            if (scan.nGeneration != nGeneration && !fCandidate)
+                            {
+                                unsigned int nStealthOutputs;
+                                fStealth = MatchStealthOutputs(*this, vScanKeys, tx, nStealthOutputs);
+                                fCandidate = fStealth || IsMine(tx);
+                            }
+                            // Spends of the wallet depend on what was added before
+                            if (!fCandidate && !mapWallet.count(scan.vHashes[i]) && !IsFromMe(tx) && !IsFromWatchOnly(tx))
+                                continue;
+                            if (AddToWalletIfInvolvingMe(scan.vHashes[i], tx, &scan.block, fUpdate))
+                                ret++;
+                            if (fStealth)
+                                nGeneration++;
+                        }
+                        nStealth += scan.nStealthOutputs;
+                    } catch (std::exception& e) {
+                        LogPrintf("ScanForWalletTransactions() : %s\n", e.what());
+                    }
+
+                    nBlocks++;
+                    pindex = scan.pindex;
+                    if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+                        ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+                    if (GetTime() >= nNow + 60) {
+                        nNow = GetTime();
+                        LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
+                    }
+                    queueBlocks.pop_front();
+                } while (!queueBlocks.empty() && pool.IsDone(queueBlocks.front().fDone));
+            }
         }
-		
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     }
+
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+    LogPrint("wallet", "ScanForWalletTransactions() : scanned %u blocks, %d transactions added or updated\n", nBlocks, ret);
     return ret;
 }
 
@@ -972,6 +1410,28 @@ set<uint256> CWalletTx::GetConflicts() const
     return result;
 }
 
+size_t CWallet::DynamicMemoryUsage() const
+{
+    LOCK(cs_wallet);
+    size_t nUsage = memusage::DynamicUsage(mapWallet) + memusage::DynamicUsage(mapTxSpends) +
+        memusage::DynamicUsage(setBalanceUnsettled) + memusage::DynamicUsage(setBalanceSpendable) +
+        memusage::DynamicUsage(setBalanceDirty) + memusage::DynamicUsage(mapRequestCount) +
+        memusage::DynamicUsage(mapAddressBook) + memusage::DynamicUsage(setKeyPool) +
+        memusage::DynamicUsage(mapKeyMetadata);
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    {
+        const CWalletTx& wtx = it->second;
+        nUsage += RecursiveDynamicUsage(wtx) + memusage::DynamicUsage(wtx.vMerkleBranch) +
+            memusage::DynamicUsage(wtx.mapValue);
+    }
+    {
+        LOCK(cs_KeyStore);
+        nUsage += memusage::DynamicUsage(mapKeys) + memusage::DynamicUsage(mapCryptedKeys) +
+            memusage::DynamicUsage(mapScripts) + memusage::DynamicUsage(setWatchOnly);
+    }
+    return nUsage;
+}
+
 void CWallet::ResendWalletTransactions()
 {
     // Do this infrequently and randomly to avoid giving away
@@ -988,25 +1448,32 @@ void CWallet::ResendWalletTransactions()
         return;
     nLastResend = GetTime();
 
-    // Rebroadcast any of our txes that aren't in a block yet
-    LogPrintf("ResendWalletTransactions()\n");
+    // Rebroadcast any of our txes that aren't in a block yet. They are all
+    // unsettled, so only those are looked at rather than all of mapWallet.
     {
         LOCK(cs_wallet);
+        UpdateBalanceCache();
         // Sort them in chronological order
-        multimap<unsigned int, CWalletTx*> mapSorted;
-        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+        vector<pair<unsigned int, const CWalletTx*> > vSorted;
+        BOOST_FOREACH(const uint256& hash, setBalanceUnsettled)
         {
-            CWalletTx& wtx = item.second;
+            const CWalletTx& wtx = mapWallet.find(hash)->second;
             // Don't rebroadcast until it's had plenty of time that
             // it should have gotten in already by now.
-            if (nTimeBestReceived - (int64_t)wtx.nTimeReceived > 5 * 60)
-                mapSorted.insert(make_pair(wtx.nTimeReceived, &wtx));
-        }
-        BOOST_FOREACH(PAIRTYPE(const unsigned int, CWalletTx*)& item, mapSorted)
-        {
-            CWalletTx& wtx = *item.second;
-            wtx.RelayWalletTransaction();
+            if (nTimeBestReceived - (int64_t)wtx.nTimeReceived > 5 * 60 &&
+                !wtx.IsCoinBase() && wtx.GetDepthInMainChain() == 0)
+                vSorted.push_back(make_pair(wtx.nTimeReceived, &wtx));
         }
+        sort(vSorted.begin(), vSorted.end());
+        LogPrintf("ResendWalletTransactions() : relaying %u transactions\n", vSorted.size());
+
+        // Announced to each peer together
+        vector<const CTransaction*> vpTx;
+        vpTx.reserve(vSorted.size());
+        for (unsigned int i = 0; i < vSorted.size(); i++)
+            vpTx.push_back(vSorted[i].second);
+        if (!vpTx.empty())
+            RelayTransactions(vpTx);
     }
 }
 
@@ -1021,14 +1488,89 @@ void CWallet::ResendWalletTransactions()
 //
 
 
+void CWallet::ClassifyForBalance(const uint256& hash, const CWalletTx& wtx) const
+{
+    if (wtx.fBalanceSettled)
+    {
+        nBalanceSettled -= wtx.nBalanceSettledCredit;
+        wtx.fBalanceSettled = false;
+    }
+    // Trusted, neither unconfirmed nor immature, and staying so as the chain
+    // grows
+    if (IsFinalTx(wtx) && wtx.GetDepthInMainChain() >= 1 && wtx.GetBlocksToMaturity() == 0)
+    {
+        wtx.nBalanceSettledCredit = wtx.GetAvailableCredit();
+        wtx.fBalanceSettled = true;
+        nBalanceSettled += wtx.nBalanceSettledCredit;
+        setBalanceUnsettled.erase(hash);
+        if (wtx.nBalanceSettledCredit > 0)
+            setBalanceSpendable.insert(hash);
+        else
+            setBalanceSpendable.erase(hash);
+    }
+    else
+    {
+        setBalanceUnsettled.insert(hash);
+        setBalanceSpendable.erase(hash);
+    }
+}
+
+void CWallet::UpdateBalanceCache() const
+{
+    AssertLockHeld(cs_wallet);
+
+    // Blocks may be connected while the cache is updated. Transactions are
+    // checked against the chain as it is then, so a reorganization after
+    // reading the tip still invalidates the cache at the next update.
+    const CBlockIndex* pindexTip;
+    {
+        LOCK(cs_chainview);
+        pindexTip = chainActive.Tip();
+    }
+    // Settled transactions only change state when blocks are disconnected
+    if (fBalanceCacheValid && pindexBalanceTip && (!pindexTip ||
+        pindexTip->nHeight < pindexBalanceTip->nHeight || pindexTip->GetAncestor(pindexBalanceTip->nHeight) != pindexBalanceTip))
+        fBalanceCacheValid = false;
+
+    if (!fBalanceCacheValid)
+    {
+        nBalanceSettled = 0;
+        setBalanceUnsettled.clear();
+        setBalanceSpendable.clear();
+        setBalanceDirty.clear();
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        {
+            it->second.fBalanceSettled = false;
+            ClassifyForBalance(it->first, it->second);
+        }
+        fBalanceCacheValid = true;
+        pindexBalanceTip = pindexTip;
+        return;
+    }
+
+    std::set<uint256> setChanged;
+    setChanged.swap(setBalanceDirty);
+    if (pindexTip != pindexBalanceTip)
+        setChanged.insert(setBalanceUnsettled.begin(), setBalanceUnsettled.end());
+    BOOST_FOREACH(const uint256& hash, setChanged)
+    {
+        map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+        if (it != mapWallet.end())
+            ClassifyForBalance(hash, it->second);
+    }
+    pindexBalanceTip = pindexTip;
+}
+
 int64_t CWallet::GetBalance() const
 {
     int64_t nTotal = 0;
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        LOCK(cs_wallet);
+        UpdateBalanceCache();
+        nTotal = nBalanceSettled;
+        BOOST_FOREACH(const uint256& hash, setBalanceUnsettled)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find(hash)->second;
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableCredit();
         }
@@ -1037,14 +1579,39 @@ int64_t CWallet::GetBalance() const
     return nTotal;
 }
 
-int64_t CWallet::GetUnconfirmedBalance() const
+int64_t CWallet::GetWatchOnlyBalance(int nMinDepth) const
 {
     int64_t nTotal = 0;
+    if (!HaveWatchOnly())
+        return 0;
     {
-        LOCK2(cs_main, cs_wallet);
+        LOCK(cs_wallet);
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx& wtx = it->second;
+            if (!IsFinalTx(wtx) || wtx.GetBlocksToMaturity() > 0)
+                continue;
+            int nDepth = wtx.GetDepthInMainChain();
+            if (nDepth < 0 || nDepth < nMinDepth)
+                continue;
+            for (unsigned int i = 0; i < wtx.vout.size(); i++)
+                if (IsWatchOnly(wtx.vout[i]) && !IsSpent(it->first, i))
+                    nTotal += wtx.vout[i].nValue;
+        }
+    }
+    return nTotal;
+}
+
+// Settled transactions are neither unconfirmed nor immature
+int64_t CWallet::GetUnconfirmedBalance() const
+{
+    int64_t nTotal = 0;
+    {
+        LOCK(cs_wallet);
+        UpdateBalanceCache();
+        BOOST_FOREACH(const uint256& hash, setBalanceUnsettled)
+        {
+            const CWalletTx* pcoin = &mapWallet.find(hash)->second;
             if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
                 nTotal += pcoin->GetAvailableCredit();
         }
@@ -1056,52 +1623,109 @@ int64_t CWallet::GetImmatureBalance() const
 {
     int64_t nTotal = 0;
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        LOCK(cs_wallet);
+        UpdateBalanceCache();
+        BOOST_FOREACH(const uint256& hash, setBalanceUnsettled)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find(hash)->second;
             nTotal += pcoin->GetImmatureCredit();
         }
     }
     return nTotal;
 }
 
-// populate vCoins with vector of spendable COutputs
-void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl) const
+void CWallet::AvailableCoinsFrom(const set<uint256>& setHashes, vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl) const
 {
-    vCoins.clear();
-
+    BOOST_FOREACH(const uint256& wtxid, setHashes)
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+        const CWalletTx* pcoin = &mapWallet.find(wtxid)->second;
 
-            if (!IsFinalTx(*pcoin))
-                continue;
+        if (!IsFinalTx(*pcoin))
+            continue;
 
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
+        if (fOnlyConfirmed && !pcoin->IsTrusted())
+            continue;
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+            continue;
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < 0)
-                continue;
+        int nDepth = pcoin->GetDepthInMainChain();
+        if (nDepth < 0)
+            continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                if (!(IsSpent(wtxid, i)) && IsMine(pcoin->vout[i]) &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
-                        vCoins.push_back(COutput(pcoin, i, nDepth));
-            }
+        for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
+            if (!IsSpent(wtxid, i) && IsMine(pcoin->vout[i]) &&
+                !IsLockedCoin(wtxid, i) && pcoin->vout[i].nValue > 0 &&
+                (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(wtxid, i)))
+                    vCoins.push_back(COutput(pcoin, i, nDepth));
+        }
+    }
+}
+
+// populate vCoins with vector of spendable COutputs
+void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl) const
+{
+    vCoins.clear();
+
+    {
+        LOCK(cs_wallet);
+        // Settled transactions without available credit have nothing to spend
+        UpdateBalanceCache();
+        vCoins.reserve(setBalanceSpendable.size());
+        AvailableCoinsFrom(setBalanceSpendable, vCoins, fOnlyConfirmed, coinControl);
+        AvailableCoinsFrom(setBalanceUnsettled, vCoins, fOnlyConfirmed, coinControl);
+    }
+}
+
+// Depth-first search for a subset of vValue, sorted by decreasing value,
+// adding up to exactly nTargetValue so that no change is needed. Each coin
+// is first included then excluded; a branch is cut once it overshoots or
+// the coins left cannot make up the difference. Gives up after
+// COIN_SELECTION_EXACT_MAX_TRIES steps or COIN_SELECTION_EXACT_MAX_MICROS.
+static bool SelectCoinsExact(const vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >& vValue, int64_t nTargetValue,
+                             vector<char>& vfBest)
+{
+    unsigned int nCoins = vValue.size();
+    vector<int64_t> vRemaining(nCoins + 1, 0);
+    for (unsigned int i = nCoins; i > 0; i--)
+        vRemaining[i - 1] = vRemaining[i] + vValue[i - 1].first;
+
+    vector<char> vfIncluded(nCoins, false);
+    int64_t nTotal = 0;
+    int64_t nDeadline = GetTimeMicros() + COIN_SELECTION_EXACT_MAX_MICROS;
+    unsigned int i = 0;
+    for (int nTries = 0; nTries < COIN_SELECTION_EXACT_MAX_TRIES; nTries++)
+    {
+        if (nTotal == nTargetValue)
+        {
+            vfBest = vfIncluded;
+            return true;
+        }
+        if (nTries % 1000 == 999 && GetTimeMicros() > nDeadline)
+            break;
+
+        if (i < nCoins && nTotal < nTargetValue && nTotal + vRemaining[i] >= nTargetValue)
+        {
+            nTotal += vValue[i].first;
+            vfIncluded[i++] = true;
+            continue;
         }
+
+        // Back to the last coin included, and exclude it instead. The coins
+        // of the same value that follow it would only repeat that branch.
+        do {
+            if (i == 0)
+                return false;
+        } while (!vfIncluded[--i]);
+        vfIncluded[i] = false;
+        nTotal -= vValue[i].first;
+        for (i++; i < nCoins && vValue[i].first == vValue[i - 1].first; i++);
     }
+    LogPrint("selectcoins", "SelectCoinsExact() : no exact match within the search limits\n");
+    return false;
 }
 
-static void ApproximateBestSubset(vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >vValue, int64_t nTotalLower, int64_t nTargetValue,
+static void ApproximateBestSubset(const vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >& vValue, int64_t nTotalLower, int64_t nTargetValue,
                                   vector<char>& vfBest, int64_t& nBest, int iterations = 1000)
 {
     vector<char> vfIncluded;
@@ -1147,7 +1771,7 @@ static void ApproximateBestSubset(vector<pair<int64_t, pair<const CWalletTx*,uns
     }
 }
 
-bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
+bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const
 {
     setCoinsRet.clear();
@@ -1160,10 +1784,15 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, int nConfMine, int nConfT
     vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > > vValue;
     int64_t nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+    // Visit the candidates in random order, without copying them
+    vector<unsigned int> vOrder(vCoins.size());
+    for (unsigned int i = 0; i < vOrder.size(); i++)
+        vOrder[i] = i;
+    random_shuffle(vOrder.begin(), vOrder.end(), GetRandInt);
 
-    BOOST_FOREACH(COutput output, vCoins)
+    BOOST_FOREACH(unsigned int nIndex, vOrder)
     {
+        const COutput& output = vCoins[nIndex];
         const CWalletTx *pcoin = output.tx;
 
         if (output.nDepth < (pcoin->IsFromMe() ? nConfMine : nConfTheirs))
@@ -1210,14 +1839,18 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, int nConfMine, int nConfT
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
+    // Solve subset sum exactly if the search is cheap enough, otherwise by
+    // stochastic approximation
     sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
     vector<char> vfBest;
-    int64_t nBest;
+    int64_t nBest = nTargetValue;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+    if (!SelectCoinsExact(vValue, nTargetValue, vfBest))
+    {
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
+        if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
+            ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+    }
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
@@ -1269,6 +1902,47 @@ bool CWallet::SelectCoins(int64_t nTargetValue, set<pair<const CWalletTx*,unsign
 
 
 
+namespace {
+
+bool SignInput(const CKeyStore& keystore, const std::vector<const CWalletTx*>& vFrom, const CTransaction& txUnsigned,
+               CMutableTransaction& tx, const CSignatureHashCache& sighashcache, unsigned int nIn)
+{
+    const CTxOut& txout = vFrom[nIn]->vout[txUnsigned.vin[nIn].prevout.n];
+    return SignSignature(keystore, txout.scriptPubKey, txUnsigned, nIn, tx.vin[nIn].scriptSig, SIGHASH_ALL, &sighashcache);
+}
+
+void SignInputRange(const CKeyStore* keystore, const std::vector<const CWalletTx*>* pvFrom, const CTransaction* ptxUnsigned,
+                    CMutableTransaction* ptx, const CSignatureHashCache* psighashcache, std::vector<char>* pvSigned,
+                    unsigned int nBegin, unsigned int nEnd)
+{
+    for (unsigned int nIn = nBegin; nIn < nEnd; nIn++)
+        (*pvSigned)[nIn] = SignInput(*keystore, *pvFrom, *ptxUnsigned, *ptx, *psighashcache, nIn);
+}
+
+// Sign all inputs of tx, spending the outputs of vFrom in order. The
+// signature hashes leave out all scriptSigs, so every input is signed
+// against one unsigned copy of tx and only writes its own scriptSig.
+bool SignTransaction(const CKeyStore& keystore, const std::vector<const CWalletTx*>& vFrom, CMutableTransaction& tx)
+{
+    const CTransaction txUnsigned(tx);
+    CSignatureHashCache sighashcache(txUnsigned);
+    unsigned int nInputs = tx.vin.size();
+    if (nScriptCheckThreads == 0 || nInputs < PARALLEL_SIGN_MIN_INPUTS)
+    {
+        for (unsigned int nIn = 0; nIn < nInputs; nIn++)
+            if (!SignInput(keystore, vFrom, txUnsigned, tx, sighashcache, nIn))
+                return false;
+        return true;
+    }
+
+    std::vector<char> vSigned(nInputs, false);
+    CWorkPool pool(TASK_RPC);
+    pool.ForEachRange(nInputs, nScriptCheckThreads, boost::bind(SignInputRange, &keystore, &vFrom, &txUnsigned, &tx, &sighashcache, &vSigned, _1, _2));
+    return std::find(vSigned.begin(), vSigned.end(), false) == vSigned.end();
+}
+
+}
+
 bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
                                 CWalletTx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, std::string& strFailReason, const CCoinControl* coinControl)
 {
@@ -1293,15 +1967,19 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
     {
         LOCK2(cs_main, cs_wallet);
         {
+            // Coins selected on an earlier pass are kept as long as they
+            // cover the higher fee
+            set<pair<const CWalletTx*,unsigned int> > setCoins;
+            int64_t nValueIn = 0;
+            double dPriorityIn = 0;
+
             nFeeRet = nTransactionFee;
             while (true)
             {
-                wtxNew.vin.clear();
-                wtxNew.vout.clear();
+                CMutableTransaction txNew;
                 wtxNew.fFromMe = true;
 
                 int64_t nTotalValue = nValue + nFeeRet;
-                double dPriority = 0;
                 // vouts to the payees
 				
 				
@@ -1345,26 +2023,31 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
 			}
 			nFeeRet += nMinFee;
 		    }
-                    wtxNew.vout.push_back(txout);
+                    txNew.vout.push_back(txout);
 					
                 }
 
                 // Choose coins to use
-                set<pair<const CWalletTx*,unsigned int> > setCoins;
-                int64_t nValueIn = 0;
-                if (!SelectCoins(nTotalValue, setCoins, nValueIn, coinControl))
-                {
-                    strFailReason = _("Insufficient funds");
-                    return false;
-                }
-                BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+                if (setCoins.empty() || nValueIn < nTotalValue)
                 {
-                    int64_t nCredit = pcoin.first->vout[pcoin.second].nValue;
-                    //The priority after the next block (depth+1) is used instead of the current,
-                    //reflecting an assumption the user would accept a bit more delay for
-                    //a chance at a free transaction.
-                    dPriority += (double)nCredit * (pcoin.first->GetDepthInMainChain()+1);
+                    setCoins.clear();
+                    nValueIn = 0;
+                    dPriorityIn = 0;
+                    if (!SelectCoins(nTotalValue, setCoins, nValueIn, coinControl))
+                    {
+                        strFailReason = _("Insufficient funds");
+                        return false;
+                    }
+                    BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
+                    {
+                        int64_t nCredit = pcoin.first->vout[pcoin.second].nValue;
+                        //The priority after the next block (depth+1) is used instead of the current,
+                        //reflecting an assumption the user would accept a bit more delay for
+                        //a chance at a free transaction.
+                        dPriorityIn += (double)nCredit * (pcoin.first->GetDepthInMainChain()+1);
+                    }
                 }
+                double dPriority = dPriorityIn;
 
                 int64_t nChange = nValueIn - nValue - nFeeRet;
                 // The following if statement should be removed once enough miners
@@ -1418,25 +2101,32 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
                     else
                     {
                         // Insert change txn at random position:
-                        vector<CTxOut>::iterator position = wtxNew.vout.begin()+GetRandInt(wtxNew.vout.size()+1);
-                        wtxNew.vout.insert(position, newTxOut);
+                        vector<CTxOut>::iterator position = txNew.vout.begin()+GetRandInt(txNew.vout.size()+1);
+                        txNew.vout.insert(position, newTxOut);
                     }
                 }
                 else
                     reservekey.ReturnKey();
 
                 // Fill vin
+                vector<const CWalletTx*> vFrom;
+                vFrom.reserve(setCoins.size());
+                txNew.vin.reserve(setCoins.size());
                 BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
-                    wtxNew.vin.push_back(CTxIn(coin.first->GetHash(),coin.second));
+                {
+                    txNew.vin.push_back(CTxIn(coin.first->GetHash(),coin.second));
+                    vFrom.push_back(coin.first);
+                }
 
                 // Sign
-                int nIn = 0;
-                BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
-                    if (!SignSignature(*this, *coin.first, wtxNew, nIn++))
-                    {
-                        strFailReason = _("Signing transaction failed");
-                        return false;
-                    }
+                if (!SignTransaction(*this, vFrom, txNew))
+                {
+                    strFailReason = _("Signing transaction failed");
+                    return false;
+                }
+
+                // Embed the constructed transaction data in wtxNew.
+                *static_cast<CTransaction*>(&wtxNew) = CTransaction(txNew);
 
                 // Limit size
                 unsigned int nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
@@ -1487,10 +2177,9 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
         LOCK2(cs_main, cs_wallet);
         LogPrintf("CommitTransaction:\n%s", wtxNew.ToString());
         {
-            // This is only to keep the database open to defeat the auto-flush for the
-            // duration of this scope.  This is the only place where this optimization
-            // maybe makes sense; please don't do it anywhere else.
-            CWalletDB* pwalletdb = fFileBacked ? new CWalletDB(strWalletFile,"r") : NULL;
+            // The key, the transaction and the coins it spends are written
+            // in one database transaction
+            CDBBatch batch(fFileBacked ? strWalletFile.c_str() : NULL);
 
             // Take key pair from key pool so it won't be used again
             reservekey.KeepKey();
@@ -1507,9 +2196,6 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 coin.BindWallet(this);
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
-
-            if (fFileBacked)
-                delete pwalletdb;
         }
 
         // Track how many getdata requests our transaction gets
@@ -1627,24 +2313,64 @@ bool CWallet::AddStealthAddress(CStealthAddress& sxAddr)
    return rv;
 }
 
-bool CWallet::UnlockStealthAddresses(const CKeyingMaterial& vMasterKeyIn)
+bool CStealthPendingKey::Derive(CKey& keyOut) const
 {
-   // -- decrypt spend_secret of Stealth Addresses
-   std::set<CStealthAddress>::iterator it;
-   for (it = stealthAddresses.begin(); it != stealthAddresses.end(); ++it)
+   ec_secret sScanCopy = sScan;
+   ec_secret sSpendCopy = sSpend;
+   ec_point pkEphemCopy = pkEphem;
+   ec_secret sSpendR;
+   if (StealthSecretSpend(sScanCopy, pkEphemCopy, sSpendCopy, sSpendR) != 0)
    {
-       if (it->scan_secret.size() < 32)
-           continue; // Stealth Address is not owned
+       LogPrintf("StealthSecretSpend() failed.\n");
+       return false;
+   };
 
-       // -- CStealthAddress are only sorted on spend_pubkey
-       CStealthAddress &sxAddr = const_cast<CStealthAddress&>(*it);
+   try {
+       keyOut.Set(&sSpendR.e[0], &sSpendR.e[ec_secret_size], true);
+   } catch (std::exception& e) {
+       LogPrintf("ckey.SetSecret() threw: %s.\n", e.what());
+       return false;
+   };
+
+   if (!keyOut.IsValid())
+   {
+       LogPrintf("Reconstructed key is invalid.\n");
+       return false;
+   };
+
+   CPubKey cpkT = keyOut.GetPubKey();
+   if (!cpkT.IsValid())
+   {
+       LogPrintf("cpkT is invalid.\n");
+       return false;
+   };
+
+   if (cpkT != pubkey)
+   {
+       LogPrintf("Error: Generated secret does not match.\n");
+       if (fDebug)
+           LogPrintf("cpkT   %s\n", HexStr(cpkT.Raw()).c_str());
+       return false;
+   };
+   return true;
+}
+
+namespace {
+
+// Each address only has its own spend secret written by its range
+void DecryptStealthSecrets(const CKeyingMaterial* pvMasterKey, const std::vector<CStealthAddress*>* pvAddresses,
+                           unsigned int nBegin, unsigned int nEnd)
+{
+   for (unsigned int i = nBegin; i < nEnd; i++)
+   {
+       CStealthAddress &sxAddr = *(*pvAddresses)[i];
 
        if (fDebug)
            LogPrintf("Decrypting stealth key %s\n", sxAddr.Encoded().c_str());
 
        CSecret vchSecret;
        uint256 iv = Hash(sxAddr.spend_pubkey.begin(), sxAddr.spend_pubkey.end());
-       if(!DecryptSecret(vMasterKeyIn, sxAddr.spend_secret, iv, vchSecret)
+       if(!DecryptSecret(*pvMasterKey, sxAddr.spend_secret, iv, vchSecret)
            || vchSecret.size() != 32)
        {
            LogPrintf("Error: Failed decrypting stealth key %s\n", sxAddr.Encoded().c_str());
@@ -1665,119 +2391,136 @@ bool CWallet::UnlockStealthAddresses(const CKeyingMaterial& vMasterKeyIn)
        sxAddr.spend_secret.resize(32);
        memcpy(&sxAddr.spend_secret[0], &vchSecret[0], 32);
    };
+}
 
-   CryptedKeyMap::iterator mi = mapCryptedKeys.begin();
-   for (; mi != mapCryptedKeys.end(); ++mi)
-   {
-       CPubKey &pubKey = (*mi).second.first;
-       std::vector<unsigned char> &vchCryptedSecret = (*mi).second.second;
-       if (vchCryptedSecret.size() != 0)
-           continue;
-
-       CKeyID ckid = pubKey.GetID();
-       CBitcoinAddress addr(ckid);
- 		 
-       StealthKeyMetaMap::iterator mi = mapStealthKeyMeta.find(ckid);
-       if (mi == mapStealthKeyMeta.end())
-       {
-           LogPrintf("Error: No metadata found to add secret for %s\n", addr.ToString().c_str());
-           continue;
-       };
+void DeriveStealthPendingKeys(const std::vector<CStealthPendingKey>* pvPending, std::vector<CKey>* pvKeys,
+                              std::vector<char>* pvDerived, unsigned int nBegin, unsigned int nEnd)
+{
+   for (unsigned int i = nBegin; i < nEnd; i++)
+       (*pvDerived)[i] = (*pvPending)[i].Derive((*pvKeys)[i]);
+}
 
-       CStealthKeyMetadata& sxKeyMeta = mi->second;
+}
 
-       CStealthAddress sxFind;
-       sxFind.scan_pubkey = sxKeyMeta.pkScan.Raw();
+bool CWallet::UnlockStealthAddresses(const CKeyingMaterial& vMasterKeyIn)
+{
+   AssertLockHeld(cs_wallet);
 
-       std::set<CStealthAddress>::iterator si = stealthAddresses.find(sxFind);
-       if (si == stealthAddresses.end())
-       {
-           LogPrintf("No stealth key found to add secret for %s\n", addr.ToString().c_str());
-           continue;
-       };
+   // -- decrypt spend_secret of Stealth Addresses
+   std::vector<CStealthAddress*> vEncrypted;
+   std::set<CStealthAddress>::iterator it;
+   for (it = stealthAddresses.begin(); it != stealthAddresses.end(); ++it)
+   {
+       if (it->scan_secret.size() < 32)
+           continue; // Stealth Address is not owned
+       if (it->spend_secret.size() == ec_secret_size)
+           continue; // decrypted by an earlier unlock
 
-       if (fDebug)
-           LogPrintf("Expanding secret for %s\n", addr.ToString().c_str());
+       // -- CStealthAddress are only sorted on spend_pubkey
+       vEncrypted.push_back(&const_cast<CStealthAddress&>(*it));
+   };
 
-       ec_secret sSpendR;
-       ec_secret sSpend;
-       ec_secret sScan;
+   if (nScriptCheckThreads == 0 || vEncrypted.size() < PARALLEL_STEALTH_MIN_ADDRESSES)
+       DecryptStealthSecrets(&vMasterKeyIn, &vEncrypted, 0, vEncrypted.size());
+   else
+   {
+       CWorkPool pool(TASK_RPC);
+       pool.ForEachRange(vEncrypted.size(), nScriptCheckThreads, boost::bind(DecryptStealthSecrets, &vMasterKeyIn, &vEncrypted, _1, _2));
+   }
 
-       if (si->spend_secret.size() != ec_secret_size
-           || si->scan_secret.size() != ec_secret_size)
+   // -- the keys of stealth payments received while locked
+   std::vector<CKeyID> vPendingIDs;
+   std::vector<CStealthPendingKey> vPending;
+   {
+       LOCK(cs_KeyStore);
+       CryptedKeyMap::iterator mi = mapCryptedKeys.begin();
+       for (; mi != mapCryptedKeys.end(); ++mi)
        {
-           LogPrintf("Stealth Address has no secret key for %s\n", addr.ToString().c_str());
-           continue;
-       }
-       memcpy(&sScan.e[0], &si->scan_secret[0], ec_secret_size);
-       memcpy(&sSpend.e[0], &si->spend_secret[0], ec_secret_size);
+           CPubKey &pubKey = (*mi).second.first;
+           std::vector<unsigned char> &vchCryptedSecret = (*mi).second.second;
+           if (vchCryptedSecret.size() != 0)
+               continue;
 
-       ec_point pkEphem = sxKeyMeta.pkEphem.Raw();
-       if (StealthSecretSpend(sScan, pkEphem, sSpend, sSpendR) != 0)
-       {
-           LogPrintf("StealthSecretSpend() failed.\n");
-           continue;
-       };
+           CKeyID ckid = pubKey.GetID();
+           CBitcoinAddress addr(ckid);
 
-       ec_point pkTestSpendR;
-       if (SecretToPublicKey(sSpendR, pkTestSpendR) != 0)
-       {
-           LogPrintf("SecretToPublicKey() failed.\n");
-           continue;
-       };
+           StealthKeyMetaMap::iterator mi = mapStealthKeyMeta.find(ckid);
+           if (mi == mapStealthKeyMeta.end())
+           {
+               LogPrintf("Error: No metadata found to add secret for %s\n", addr.ToString().c_str());
+               continue;
+           };
 
-       CSecret vchSecret;
-       vchSecret.resize(ec_secret_size);
+           CStealthKeyMetadata& sxKeyMeta = mi->second;
 
-       memcpy(&vchSecret[0], &sSpendR.e[0], ec_secret_size);
-       CKey ckey;
+           CStealthAddress sxFind;
+           sxFind.scan_pubkey = sxKeyMeta.pkScan.Raw();
 
-       try {
-           ckey.Set(vchSecret.begin(), vchSecret.end(), true);
-       } catch (std::exception& e) {
-           LogPrintf("ckey.SetSecret() threw: %s.\n", e.what());
-           continue;
-       };
+           std::set<CStealthAddress>::iterator si = stealthAddresses.find(sxFind);
+           if (si == stealthAddresses.end())
+           {
+               LogPrintf("No stealth key found to add secret for %s\n", addr.ToString().c_str());
+               continue;
+           };
 
-       CPubKey cpkT = ckey.GetPubKey();
+           if (si->spend_secret.size() != ec_secret_size
+               || si->scan_secret.size() != ec_secret_size)
+           {
+               LogPrintf("Stealth Address has no secret key for %s\n", addr.ToString().c_str());
+               continue;
+           }
 
-       if (!cpkT.IsValid())
-       {
-           LogPrintf("cpkT is invalid.\n");
-           continue;
+           CStealthPendingKey pending;
+           pending.pubkey = pubKey;
+           memcpy(&pending.sScan.e[0], &si->scan_secret[0], ec_secret_size);
+           memcpy(&pending.sSpend.e[0], &si->spend_secret[0], ec_secret_size);
+           pending.pkEphem = sxKeyMeta.pkEphem.Raw();
+           vPendingIDs.push_back(ckid);
+           vPending.push_back(pending);
        };
 
-       if (cpkT != pubKey)
+       // -- with -lazyunlock the keys are derived by GetKey when first used
+       mapStealthPendingKeys.clear();
+       if (GetBoolArg("-lazyunlock", false))
        {
-           LogPrintf("Error: Generated secret does not match.\n");
-           if (fDebug)
-           {
-               LogPrintf("cpkT   %s\n", HexStr(cpkT.Raw()).c_str());
-               // LogPrintf("pubKey %s\n", HexStr(pubKey.Raw()).c_str());
-           };
-           continue;
-       };
+           for (unsigned int i = 0; i < vPending.size(); i++)
+               mapStealthPendingKeys[vPendingIDs[i]] = vPending[i];
+           if (!vPending.empty())
+               LogPrintf("UnlockStealthAddresses() : %u stealth keys left to derive when used\n", vPending.size());
+           return true;
+       }
+   }
 
-       if (!ckey.IsValid())
-       {
-           LogPrintf("Reconstructed key is invalid.\n");
+   // -- each key costs two EC multiplications, spread over threads when
+   //    there are many of them
+   std::vector<CKey> vKeys(vPending.size());
+   std::vector<char> vDerived(vPending.size(), false);
+   if (nScriptCheckThreads == 0 || vPending.size() < PARALLEL_STEALTH_MIN_KEYS)
+       DeriveStealthPendingKeys(&vPending, &vKeys, &vDerived, 0, vPending.size());
+   else
+   {
+       CWorkPool pool(TASK_RPC);
+       pool.ForEachRange(vPending.size(), nScriptCheckThreads, boost::bind(DeriveStealthPendingKeys, &vPending, &vKeys, &vDerived, _1, _2));
+   }
+
+   // -- the derived keys are written in one database transaction
+   CDBBatch batch(fFileBacked ? strWalletFile.c_str() : NULL);
+   for (unsigned int i = 0; i < vPending.size(); i++)
+   {
+       if (!vDerived[i])
            continue;
-       };
 
+       CBitcoinAddress addr(vPendingIDs[i]);
        if (fDebug)
-       {
-           CKeyID keyID = cpkT.GetID();
-           CBitcoinAddress coinAddress(keyID);
-           LogPrintf("Adding secret to key %s.\n", coinAddress.ToString().c_str());
-       };
+           LogPrintf("Adding secret to key %s.\n", addr.ToString().c_str());
 
-       if (!AddKey(ckey))
+       if (!AddKeyPubKey(vKeys[i], vPending[i].pubkey))
        {
            LogPrintf("AddKey failed.\n");
            continue;
        };
 
-       if (!CWalletDB(strWalletFile).EraseStealthKeyMeta(ckid))
+       if (!CWalletDB(strWalletFile).EraseStealthKeyMeta(vPendingIDs[i]))
            LogPrintf("EraseStealthKeyMeta failed for %s\n", addr.ToString().c_str());
    };
    return true;
@@ -2014,6 +2757,28 @@ bool CWallet::SendStealthMoneyToDestination(CStealthAddress& sxAddress, int64_t
    return true;
 }
 
+void CWallet::GetStealthScanKeys(std::vector<boost::shared_ptr<const CStealthScanKey> >& vScanKeys, std::vector<const CStealthAddress*>* pvOwned) const
+{
+    LOCK(cs_wallet);
+    vScanKeys.clear();
+    if (pvOwned)
+        pvOwned->clear();
+    BOOST_FOREACH(const CStealthAddress& sxAddr, stealthAddresses)
+    {
+        if (sxAddr.scan_secret.size() != ec_secret_size)
+            continue; // Stealth Address is not owned
+
+        boost::shared_ptr<const CStealthScanKey>& pscankey = mapStealthScanKeys[sxAddr.scan_pubkey];
+        if (!pscankey)
+            pscankey.reset(new CStealthScanKey(sxAddr));
+        if (!pscankey->IsValid())
+            continue;
+        vScanKeys.push_back(pscankey);
+        if (pvOwned)
+            pvOwned->push_back(&sxAddr);
+    }
+}
+
 bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNarr)
 {
    if (fDebug)
@@ -2021,20 +2786,28 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
 
    // mapNarr.clear();
 
+   if (!HasOpReturnOutput(tx))
+       return true;
+
    LOCK(cs_wallet);
    ec_secret sSpendR;
    ec_secret sSpend;
-   ec_secret sScan;
    ec_secret sShared;
 
-   ec_point pkExtracted;
-
    std::vector<uint8_t> vchEphemPK;
    std::vector<uint8_t> vchDataB;
    std::vector<uint8_t> vchENarr;
    opcodetype opCode;
    char cbuf[256];
 
+   // Each ephemeral key is tried against all owned addresses at once, for
+   // the keys paid to by the other outputs
+   std::set<CKeyID> setCandidates;
+   std::vector<const CStealthAddress*> vOwned;
+   StealthScanKeys vScanKeys;
+   std::vector<CStealthDerivation> vDerived;
+   bool fScanKeysLoaded = false;
+
    int32_t nOutputIdOuter = -1;
    BOOST_FOREACH(const CTxOut& txout, tx.vout)
    {
@@ -2074,170 +2847,141 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
            continue;
        }
 
-       int32_t nOutputId = -1;
        nStealth++;
-       BOOST_FOREACH(const CTxOut& txoutB, tx.vout)
-       {
-           nOutputId++;
-
-           if (&txoutB == &txout)
-               continue;
+       GetStealthCandidates(*this, tx, txout, setCandidates);
+       if (setCandidates.empty())
+           continue;
 
-           bool txnMatch = false; // only 1 txn will match an ephem pk
-           //LogPrintf("txoutB scriptPubKey %s\n",  txoutB.scriptPubKey.ToString().c_str());
+       if (!fScanKeysLoaded)
+       {
+           GetStealthScanKeys(vScanKeys, &vOwned);
+           fScanKeysLoaded = true;
+       };
+       DeriveStealthKeysParallel(vScanKeys, vchEphemPK, vDerived);
 
-           CTxDestination address;
-           if (!ExtractDestination(txoutB.scriptPubKey, address))
+       // only 1 txn will match an ephem pk
+       for (unsigned int nAddr = 0; nAddr < vOwned.size(); nAddr++)
+       {
+           const CStealthAddress* it = vOwned[nAddr];
+           if (!vDerived[nAddr].fDerived)
                continue;
 
-           if (address.type() != typeid(CKeyID))
+           CPubKey cpkE = vDerived[nAddr].pubkey;
+           if (!setCandidates.count(cpkE.GetID()))
                continue;
+           memcpy(&sShared.e[0], &vDerived[nAddr].sShared.e[0], ec_secret_size);
 
-           CKeyID ckidMatch = boost::get<CKeyID>(address);
-
-           if (HaveKey(ckidMatch)) // no point checking if already have key
-               continue;
+           if (fDebug)
+               LogPrintf("Found stealth txn to address %s\n", it->Encoded().c_str());
 
-           std::set<CStealthAddress>::iterator it;
-           for (it = stealthAddresses.begin(); it != stealthAddresses.end(); ++it)
+           if (IsLocked())
            {
-               if (it->scan_secret.size() != ec_secret_size)
-                   continue; // Stealth Address is not owned
+               if (fDebug)
+                   LogPrintf("Wallet is locked, adding key without secret.\n");
+
+               // -- add key without secret
+               std::vector<uint8_t> vchEmpty;
+               AddCryptedKey(cpkE, vchEmpty);
+               CKeyID keyId = cpkE.GetID();
+               CBitcoinAddress coinAddress(keyId);
+               std::string sLabel = it->Encoded();
+               std::string sPurpose;
+               SetAddressBook(keyId, sLabel, sPurpose);
+
+               CPubKey cpkEphem(vchEphemPK);
+               CPubKey cpkScan(it->scan_pubkey);
+               CStealthKeyMetadata lockedSkMeta(cpkEphem, cpkScan);
+
+               if (!CWalletDB(strWalletFile).WriteStealthKeyMeta(keyId, lockedSkMeta))
+                   LogPrintf("WriteStealthKeyMeta failed for %s\n", coinAddress.ToString().c_str());
+
+               mapStealthKeyMeta[keyId] = lockedSkMeta;
+               nFoundStealth++;
+           } else
+           {
+               if (it->spend_secret.size() != ec_secret_size)
+                   continue;
+               memcpy(&sSpend.e[0], &it->spend_secret[0], ec_secret_size);
 
-               //LogPrintf("it->Encodeded() %s\n",  it->Encoded().c_str());
-               memcpy(&sScan.e[0], &it->scan_secret[0], ec_secret_size);
 
-               if (StealthSecret(sScan, vchEphemPK, it->spend_pubkey, sShared, pkExtracted) != 0)
+               if (StealthSharedToSecretSpend(sShared, sSpend, sSpendR) != 0)
                {
-                   LogPrintf("StealthSecret failed.\n");
+                   LogPrintf("StealthSharedToSecretSpend() failed.\n");
                    continue;
                };
-               //LogPrintf("pkExtracted %"PRIszu": %s\n", pkExtracted.size(), HexStr(pkExtracted).c_str());
-
-               CPubKey cpkE(pkExtracted);
-
-               if (!cpkE.IsValid())
-                   continue;
-               CKeyID ckidE = cpkE.GetID();
-
-               if (ckidMatch != ckidE)
-                   continue;
-
-               if (fDebug)
-                   LogPrintf("Found stealth txn to address %s\n", it->Encoded().c_str());
 
-               if (IsLocked())
+               ec_point pkTestSpendR;
+               if (SecretToPublicKey(sSpendR, pkTestSpendR) != 0)
                {
-                   if (fDebug)
-                       LogPrintf("Wallet is locked, adding key without secret.\n");
-
-                   // -- add key without secret
-                   std::vector<uint8_t> vchEmpty;
-                   AddCryptedKey(cpkE, vchEmpty);
-                   CKeyID keyId = cpkE.GetID();
-                   CBitcoinAddress coinAddress(keyId);
-                   std::string sLabel = it->Encoded();
-                   std::string sPurpose;
-                   SetAddressBook(keyId, sLabel, sPurpose);
-
-                   CPubKey cpkEphem(vchEphemPK);
-                   CPubKey cpkScan(it->scan_pubkey);
-                   CStealthKeyMetadata lockedSkMeta(cpkEphem, cpkScan);
-
-                   if (!CWalletDB(strWalletFile).WriteStealthKeyMeta(keyId, lockedSkMeta))
-                       LogPrintf("WriteStealthKeyMeta failed for %s\n", coinAddress.ToString().c_str());
-
-                   mapStealthKeyMeta[keyId] = lockedSkMeta;
-                   nFoundStealth++;
-               } else
-               {
-                   if (it->spend_secret.size() != ec_secret_size)
-                       continue;
-                   memcpy(&sSpend.e[0], &it->spend_secret[0], ec_secret_size);
-
-
-                   if (StealthSharedToSecretSpend(sShared, sSpend, sSpendR) != 0)
-                   {
-                       LogPrintf("StealthSharedToSecretSpend() failed.\n");
-                       continue;
-                   };
-
-                   ec_point pkTestSpendR;
-                   if (SecretToPublicKey(sSpendR, pkTestSpendR) != 0)
-                   {
-                       LogPrintf("SecretToPublicKey() failed.\n");
-                       continue;
-                   };
-
-                   CSecret vchSecret;
-                   vchSecret.resize(ec_secret_size);
+                   LogPrintf("SecretToPublicKey() failed.\n");
+                   continue;
+               };
 
-                   memcpy(&vchSecret[0], &sSpendR.e[0], ec_secret_size);
-                   CKey ckey;
+               CSecret vchSecret;
+               vchSecret.resize(ec_secret_size);
 
-                   try {
-                       ckey.Set(vchSecret.begin(), vchSecret.end(), true);
-                   } catch (std::exception& e) {
-                       LogPrintf("ckey.SetSecret() threw: %s.\n", e.what());
-                       continue;
-                   };
+               memcpy(&vchSecret[0], &sSpendR.e[0], ec_secret_size);
+               CKey ckey;
 
-                   CPubKey cpkT = ckey.GetPubKey();
-                   if (!cpkT.IsValid())
-                   {
-                       LogPrintf("cpkT is invalid.\n");
-                       continue;
-                   };
+               try {
+                   ckey.Set(vchSecret.begin(), vchSecret.end(), true);
+               } catch (std::exception& e) {
+                   LogPrintf("ckey.SetSecret() threw: %s.\n", e.what());
+                   continue;
+               };
 
-                   if (!ckey.IsValid())
-                   {
-                       LogPrintf("Reconstructed key is invalid.\n");
-                       continue;
-                   };
+               CPubKey cpkT = ckey.GetPubKey();
+               if (!cpkT.IsValid())
+               {
+                   LogPrintf("cpkT is invalid.\n");
+                   continue;
+               };
 
-                   CKeyID keyID = cpkT.GetID();
-                   if (fDebug)
-                   {
-                       CBitcoinAddress coinAddress(keyID);
-                       LogPrintf("Adding key %s.\n", coinAddress.ToString().c_str());
-                   };
+               if (!ckey.IsValid())
+               {
+                   LogPrintf("Reconstructed key is invalid.\n");
+                   continue;
+               };
 
-                   if (!AddKey(ckey))
-                   {
-                       LogPrintf("AddKey failed.\n");
-                       continue;
-                   };
-
-                   std::string sLabel = it->Encoded();
-                   std::string sPurpose;
-                   SetAddressBook(keyID, sLabel, sPurpose);
-                   nFoundStealth++;
+               CKeyID keyID = cpkT.GetID();
+               if (fDebug)
+               {
+                   CBitcoinAddress coinAddress(keyID);
+                   LogPrintf("Adding key %s.\n", coinAddress.ToString().c_str());
                };
 
-               if (txout.scriptPubKey.GetOp(itTxA, opCode, vchENarr)
-                   && opCode == OP_RETURN
-                   && txout.scriptPubKey.GetOp(itTxA, opCode, vchENarr)
-                   && vchENarr.size() > 0)
+               if (!AddKey(ckey))
                {
-                   //SecMsgCrypter crypter;
-                   //crypter.SetKey(&sShared.e[0], &vchEphemPK[0]);
-                   //std::vector<uint8_t> vchNarr;
-                   //if (!crypter.Decrypt(&vchENarr[0], vchENarr.size(), vchNarr))
-                   //{
-                   //    LogPrintf("Decrypt narration failed.\n");
-                   //    continue;
-                   //};
-                   //std::string sNarr = std::string(vchNarr.begin(), vchNarr.end());
-
-                   //snprintf(cbuf, sizeof(cbuf), "n_%d", nOutputId);
-                   //mapNarr[cbuf] = sNarr;
+                   LogPrintf("AddKey failed.\n");
+                   continue;
                };
 
-               txnMatch = true;
-               break;
+               std::string sLabel = it->Encoded();
+               std::string sPurpose;
+               SetAddressBook(keyID, sLabel, sPurpose);
+               nFoundStealth++;
            };
-           if (txnMatch)
-               break;
+
+           if (txout.scriptPubKey.GetOp(itTxA, opCode, vchENarr)
+               && opCode == OP_RETURN
+               && txout.scriptPubKey.GetOp(itTxA, opCode, vchENarr)
+               && vchENarr.size() > 0)
+           {
+               //SecMsgCrypter crypter;
+               //crypter.SetKey(&sShared.e[0], &vchEphemPK[0]);
+               //std::vector<uint8_t> vchNarr;
+               //if (!crypter.Decrypt(&vchENarr[0], vchENarr.size(), vchNarr))
+               //{
+               //    LogPrintf("Decrypt narration failed.\n");
+               //    continue;
+               //};
+               //std::string sNarr = std::string(vchNarr.begin(), vchNarr.end());
+
+               //snprintf(cbuf, sizeof(cbuf), "n_%d", nOutputId);
+               //mapNarr[cbuf] = sNarr;
+           };
+
+           break;
        };
    };
 
@@ -2314,6 +3058,20 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
 
+    // The activity log is built once the order of the transactions is final
+    {
+        LOCK(cs_wallet);
+        wtxOrdered.clear();
+        mapTxByBlock.clear();
+        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            IndexWalletTx(it->second);
+        std::list<CAccountingEntry> acentries;
+        CWalletDB(strWalletFile).ListAccountCreditDebit("*", acentries);
+        laccentries.clear();
+        BOOST_FOREACH(const CAccountingEntry& entry, acentries)
+            LoadAccountingEntry(entry);
+    }
+
     uiInterface.LoadWallet(this);
 
     return DB_LOAD_OK;
@@ -2408,6 +3166,7 @@ bool CWallet::NewKeyPool()
 {
     {
         LOCK(cs_wallet);
+        CDBBatch batch(fFileBacked ? strWalletFile.c_str() : NULL);
         CWalletDB walletdb(strWalletFile);
         BOOST_FOREACH(int64_t nIndex, setKeyPool)
             walletdb.ErasePool(nIndex);
@@ -2430,35 +3189,144 @@ bool CWallet::NewKeyPool()
 
 bool CWallet::TopUpKeyPool(unsigned int kpSize)
 {
+    // Top up key pool
+    unsigned int nTargetSize;
+    if (kpSize > 0)
+        nTargetSize = kpSize;
+    else
+        nTargetSize = max(GetArg("-keypool", 100), (int64_t) 0);
+
+    unsigned int nMissing;
+    bool fCompressed;
+    CKeyID hdMasterKeyID;
+    uint32_t nHDChild = 0;
     {
         LOCK(cs_wallet);
 
         if (IsLocked())
             return false;
+        if (setKeyPool.size() >= nTargetSize + 1)
+            return true;
+        nMissing = nTargetSize + 1 - setKeyPool.size();
+        fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
 
-        CWalletDB walletdb(strWalletFile);
+        // HD keys are numbered now, so that concurrent top ups derive
+        // different ones. The numbers of keys dropped below are skipped.
+        if (IsHDEnabled())
+        {
+            hdMasterKeyID = hdChain.masterKeyID;
+            nHDChild = hdChain.nExternalChainCounter;
+            hdChain.nExternalChainCounter += nMissing;
+        }
+    }
 
-        // Top up key pool
-        unsigned int nTargetSize;
-        if (kpSize > 0)
-            nTargetSize = kpSize;
-        else
-            nTargetSize = max(GetArg("-keypool", 100), (int64_t) 0);
+    // The keys are generated without cs_wallet unless the caller holds it
+    vector<CKey> vKeys(nMissing);
+    if (hdMasterKeyID != 0)
+    {
+        if (!DeriveHDKeys(hdMasterKeyID, nHDChild, vKeys))
+            return false;
+    }
+    else
+    {
+        RandAddSeedPerfmon();
+        BOOST_FOREACH(CKey& key, vKeys)
+            key.MakeNewKey(fCompressed);
+    }
 
-        while (setKeyPool.size() < (nTargetSize + 1))
+    {
+        LOCK(cs_wallet);
+
+        // The wallet may have been locked, or given a new seed, meanwhile
+        if (IsLocked() || hdMasterKeyID != hdChain.masterKeyID)
+            return false;
+
+        // The new keys and their pool entries are written in one database
+        // transaction
+        CDBBatch batch(fFileBacked ? strWalletFile.c_str() : NULL);
+        CWalletDB walletdb(strWalletFile);
+
+        // Keys left over from a concurrent top up are dropped
+        for (unsigned int i = 0; i < vKeys.size() && setKeyPool.size() < (nTargetSize + 1); i++)
         {
             int64_t nEnd = 1;
             if (!setKeyPool.empty())
                 nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
+            CPubKey pubkey;
+            if (hdMasterKeyID != 0)
+                pubkey = AddGeneratedKey(vKeys[i], HDKeypath(nHDChild + i), hdMasterKeyID);
+            else
+                pubkey = AddGeneratedKey(vKeys[i]);
+            if (!walletdb.WritePool(nEnd, CKeyPool(pubkey)))
                 throw runtime_error("TopUpKeyPool() : writing generated key failed");
             setKeyPool.insert(nEnd);
             LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
         }
+        if (hdMasterKeyID != 0 && !walletdb.WriteHDChain(hdChain))
+            throw runtime_error("TopUpKeyPool() : writing HD chain failed");
     }
     return true;
 }
 
+bool CWallet::HasKeyPoolRefillThread()
+{
+    boost::unique_lock<boost::mutex> lock(mutexKeyPoolRefill);
+    return fKeyPoolRefillThread;
+}
+
+bool CWallet::RequestKeyPoolRefill()
+{
+    boost::unique_lock<boost::mutex> lock(mutexKeyPoolRefill);
+    if (!fKeyPoolRefillThread)
+        return false;
+    fKeyPoolRefillRequested = true;
+    condKeyPoolRefill.notify_one();
+    return true;
+}
+
+void CWallet::RunKeyPoolRefill()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexKeyPoolRefill);
+        fKeyPoolRefillThread = true;
+        fKeyPoolRefillRequested = true;
+    }
+    try
+    {
+        while (true)
+        {
+            {
+                boost::unique_lock<boost::mutex> lock(mutexKeyPoolRefill);
+                while (!fKeyPoolRefillRequested)
+                    condKeyPoolRefill.wait(lock);
+                fKeyPoolRefillRequested = false;
+            }
+            try
+            {
+                TopUpKeyPool();
+            }
+            catch (std::runtime_error& e)
+            {
+                // Keys are generated in the foreground again once the pool ran dry
+                LogPrintf("RunKeyPoolRefill() : %s\n", e.what());
+            }
+        }
+    }
+    catch (boost::thread_interrupted)
+    {
+        boost::unique_lock<boost::mutex> lock(mutexKeyPoolRefill);
+        fKeyPoolRefillThread = false;
+        throw;
+    }
+}
+
+void ThreadKeyPoolRefill(CWallet* pwallet)
+{
+    // Make this thread recognisable as the key pool refilling thread
+    RenameThread("bitcoin-keypool");
+    pwallet->RunKeyPoolRefill();
+}
+
 void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
 {
     nIndex = -1;
@@ -2467,7 +3335,20 @@ void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
         LOCK(cs_wallet);
 
         if (!IsLocked())
-            TopUpKeyPool();
+        {
+            // With ThreadKeyPoolRefill running, keys are only generated here
+            // when the pool ran dry
+            if (!HasKeyPoolRefillThread())
+                TopUpKeyPool();
+            else
+            {
+                unsigned int nLowWatermark = max(GetArg("-keypool", 100), (int64_t) 0) * KEYPOOL_LOW_WATERMARK_PERCENT / 100;
+                if (setKeyPool.size() <= nLowWatermark)
+                    RequestKeyPoolRefill();
+                if (setKeyPool.empty())
+                    TopUpKeyPool(1);
+            }
+        }
 
         // Get the oldest key
         if(setKeyPool.empty())
@@ -2832,7 +3713,7 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64_t> &mapKeyBirth) const {
     for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); it++) {
         // iterate over all wallet transactions...
         const CWalletTx &wtx = (*it).second;
-        std::map<uint256, CBlockIndex*>::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
+        BlockMap::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
         if (blit != mapBlockIndex.end() && chainActive.Contains(blit->second)) {
             // ... which are already in a block
             int nHeight = blit->second->nHeight;
@@ -24,6 +24,9 @@
 #include <utility>
 #include <vector>
 
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+
 // Settings
 extern int64_t nTransactionFee;
 extern bool bSpendZeroConfChange;
@@ -32,16 +35,50 @@ extern bool bSpendZeroConfChange;
 static const int64_t DEFAULT_TRANSACTION_FEE = 0;
 // -paytxfee will warn if called with a higher fee than this amount (in satoshis) per KB
 static const int nHighTransactionFeeWarning = 0.01 * COIN;
+// Time and node limits of the exact-match search of coin selection, after
+// which it falls back to the stochastic approximation
+static const int64_t COIN_SELECTION_EXACT_MAX_MICROS = 20000;
+static const int COIN_SELECTION_EXACT_MAX_TRIES = 100000;
+// Wallet records read at a time while loading, whose transactions and keys
+// are decoded by several threads
+static const unsigned int WALLET_LOAD_BATCH_RECORDS = 1000;
+// Ephemeral keys are matched against the stealth addresses by several
+// threads from this many owned addresses on
+static const unsigned int PARALLEL_STEALTH_MIN_ADDRESSES = 16;
+// Keys of stealth payments are derived by several threads on unlock from
+// this many keys on
+static const unsigned int PARALLEL_STEALTH_MIN_KEYS = 16;
+// The key pool is refilled in the background once it is down to this
+// percentage of its size
+static const unsigned int KEYPOOL_LOW_WATERMARK_PERCENT = 75;
+// -usehd default, for new wallets
+static const bool DEFAULT_USE_HD_WALLET = true;
 
 class CAccountingEntry;
 class CCoinControl;
 class COutput;
 class CReserveKey;
 class CScript;
+class CWallet;
 class CWalletTx;
 
 typedef std::map<CKeyID, CStealthKeyMetadata> StealthKeyMetaMap;
 
+void ThreadKeyPoolRefill(CWallet* pwallet);
+
+/** A key of a stealth payment received while the wallet was locked, with
+ *  the secrets of its stealth address to derive its secret from */
+class CStealthPendingKey
+{
+public:
+    CPubKey pubkey;
+    ec_secret sScan;
+    ec_secret sSpend;
+    ec_point pkEphem;
+
+    bool Derive(CKey& keyOut) const;
+};
+
 /** (client) version numbers for particular wallet features */
 enum WalletFeature
 {
@@ -121,13 +158,54 @@ private:
     // Used to keep track of spent outpoints, and
     // detect and report conflicts (double-spends or
     // mutated transactions where the mutant gets mined).
-    typedef std::multimap<COutPoint, uint256> TxSpends;
+    // Hashed, as it is looked up for outputs far more often than walked.
+    typedef boost::unordered_multimap<COutPoint, uint256, COutPointHasher> TxSpends;
     TxSpends mapTxSpends;
     void AddToSpends(const COutPoint& outpoint, const uint256& wtxid);
     void AddToSpends(const uint256& wtxid);
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    // Balance totals, kept up to date so GetBalance and friends do not sum
+    // all of mapWallet. A transaction is settled once it is confirmed,
+    // final and mature: it then counts towards the balance by its
+    // available credit alone, which only changes when the transaction is
+    // marked dirty. The others are looked at on each call. Rebuilt from
+    // scratch after a reorganization or CWallet::MarkDirty().
+    // AvailableCoins only looks at the unsettled transactions and at the
+    // settled ones with available credit left, in setBalanceSpendable.
+    mutable bool fBalanceCacheValid;
+    mutable const CBlockIndex* pindexBalanceTip;
+    mutable int64_t nBalanceSettled;
+    mutable std::set<uint256> setBalanceUnsettled;
+    mutable std::set<uint256> setBalanceSpendable;
+    mutable std::set<uint256> setBalanceDirty;
+    void ClassifyForBalance(const uint256& hash, const CWalletTx& wtx) const;
+    void UpdateBalanceCache() const;
+    // Decoded scan keys of the owned stealth addresses, by scan public key
+    mutable std::map<ec_point, boost::shared_ptr<const CStealthScanKey> > mapStealthScanKeys;
+
+    void AvailableCoinsFrom(const std::set<uint256>& setHashes, std::vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl) const;
+
+    // Refills of the key pool requested from ThreadKeyPoolRefill, which
+    // generates the keys without holding cs_wallet
+    boost::mutex mutexKeyPoolRefill;
+    boost::condition_variable condKeyPoolRefill;
+    bool fKeyPoolRefillRequested;
+    bool fKeyPoolRefillThread;
+    bool HasKeyPoolRefillThread();
+    CPubKey AddGeneratedKey(const CKey& secret, const std::string& hdKeypath = "", const CKeyID& hdMasterKeyID = CKeyID());
+
+    // The BIP32 chain new keys are derived from, if the wallet has one
+    CHDChain hdChain;
+    // Derive the keys m/0'/0'/i' of the chain for i from nChild on. Only
+    // needs cs_KeyStore, to read the seed.
+    bool DeriveHDKeys(const CKeyID& masterKeyID, uint32_t nChild, std::vector<CKey>& vKeys) const;
+
+    // With -lazyunlock, the stealth keys left pending by UnlockStealthAddresses,
+    // derived by GetKey when first used. Guarded by cs_KeyStore.
+    std::map<CKeyID, CStealthPendingKey> mapStealthPendingKeys;
+
 public:
     /// Main wallet lock.
     /// This lock protects all the fields added by CWallet
@@ -171,6 +249,11 @@ public:
         nNextResend = 0;
         nLastResend = 0;
         nTimeFirstKey = 0;
+        fBalanceCacheValid = false;
+        pindexBalanceTip = NULL;
+        nBalanceSettled = 0;
+        fKeyPoolRefillRequested = false;
+        fKeyPoolRefillThread = false;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -192,7 +275,7 @@ public:
     bool CanSupportFeature(enum WalletFeature wf) { AssertLockHeld(cs_wallet); return nWalletMaxVersion >= wf; }
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl = NULL) const;
-    bool SelectCoinsMinConf(int64_t nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
+    bool SelectCoinsMinConf(int64_t nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
 
     bool IsSpent(const uint256& hash, unsigned int n) const;
 
@@ -214,12 +297,19 @@ public:
 
     bool LoadMinVersion(int nVersion) { AssertLockHeld(cs_wallet); nWalletVersion = nVersion; nWalletMaxVersion = std::max(nWalletMaxVersion, nVersion); return true; }
 
+    // Also derives the pending stealth keys of -lazyunlock
+    bool GetKey(const CKeyID &address, CKey& keyOut) const;
+
     // Adds an encrypted key to the store, and saves it to disk.
     bool AddCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret);
     // Adds an encrypted key to the store, without saving it to disk (used by LoadWallet)
     bool LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret);
     bool AddCScript(const CScript& redeemScript);
     bool LoadCScript(const CScript& redeemScript);
+    // Adds a watch-only script to the store, and saves it to disk.
+    bool AddWatchOnly(const CScript &dest);
+    // Adds a watch-only script to the store, without saving it to disk (used by LoadWallet)
+    bool LoadWatchOnly(const CScript &dest);
 
     /// Adds a destination data tuple to the store, and saves it to disk
     bool AddDestData(const CTxDestination &dest, const std::string &key, const std::string &value);
@@ -245,23 +335,43 @@ public:
     typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
     typedef std::multimap<int64_t, TxPair > TxItems;
 
-    /** Get the wallet's activity log
-        @return multimap of ordered transactions and accounting entries
-        @warning Returned pointers are *only* valid within the scope of passed acentries
-     */
-    TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
+    // The wallet's activity log: the transactions and accounting entries by
+    // nOrderPos, and the transactions by the block they are in. Kept up to
+    // date from LoadWallet on, so that listtransactions is paged and
+    // listsinceblock only looks at the recent blocks.
+    TxItems wtxOrdered;
+    std::list<CAccountingEntry> laccentries;
+    std::multimap<uint256, const CWalletTx*> mapTxByBlock;
+    void IndexWalletTx(CWalletTx& wtx);
+    void UnindexWalletTx(const uint256& hash);
+    // Adds an accounting entry written to disk to the activity log
+    void LoadAccountingEntry(const CAccountingEntry& acentry);
+
+    // The transactions at less than nDepth confirmations, by hash
+    void GetTransactionsBelowDepth(int nDepth, std::map<uint256, const CWalletTx*>& mapTx) const;
 
     void MarkDirty();
+    // A transaction whose credit may have changed, for the balance totals
+    void MarkBalanceDirty(const CWalletTx* pwtx) const;
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet=false);
     void SyncTransaction(const uint256 &hash, const CTransaction& tx, const CBlock* pblock);
     bool AddToWalletIfInvolvingMe(const uint256 &hash, const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256 &hash);
+    // Call without cs_main and cs_wallet held: the scan takes them for each
+    // block it adds, and callers holding them keep the node waiting for the
+    // whole scan
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
+    // Approximate heap memory of the transactions, keys and address book
+    size_t DynamicMemoryUsage() const;
+    void AddMemoryUsage(size_t &nUsage) { nUsage += DynamicMemoryUsage(); }
     int64_t GetBalance() const;
     int64_t GetUnconfirmedBalance() const;
     int64_t GetImmatureBalance() const;
+    // Unspent outputs of the watch-only scripts, in final transactions at
+    // least nMinDepth deep. Not part of the balances above.
+    int64_t GetWatchOnlyBalance(int nMinDepth = 1) const;
     bool CreateTransaction(const std::vector<std::pair<CScript, int64_t> >& vecSend,
                            CWalletTx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, std::string& strFailReason, const CCoinControl *coinControl = NULL);
     bool CreateTransaction(CScript scriptPubKey, int64_t nValue,
@@ -276,11 +386,17 @@ public:
     string SendStealthMoney(CScript scriptPubKey, int64_t nValue, std::vector<uint8_t>& P, std::vector<uint8_t>& narr, std::string& sNarr, CWalletTx& wtxNew, bool fAskFee);
     bool SendStealthMoneyToDestination(CStealthAddress& sxAddress, int64_t nValue, std::string& sNarr, CWalletTx& wtxNew, std::string& sError, bool fAskFee = false);
     bool FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNarr);
+    // The scan keys of the stealth addresses with a scan secret, and the
+    // addresses themselves if pvOwned is given
+    void GetStealthScanKeys(std::vector<boost::shared_ptr<const CStealthScanKey> >& vScanKeys, std::vector<const CStealthAddress*>* pvOwned = NULL) const;
 
     std::string SendMoney(CScript scriptPubKey, int64_t nValue, CWalletTx& wtxNew);
     std::string SendMoneyToDestination(const CTxDestination &address, int64_t nValue, CWalletTx& wtxNew);
     bool NewKeyPool();
     bool TopUpKeyPool(unsigned int kpSize = 0);
+    // Wake up ThreadKeyPoolRefill; false if it is not running
+    bool RequestKeyPoolRefill();
+    void RunKeyPoolRefill();
     int64_t AddReserveKey(const CKeyPool& keypool);
     void ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool);
     void KeepKey(int64_t nIndex);
@@ -300,6 +416,13 @@ public:
     {
         return ::IsMine(*this, txout.scriptPubKey);
     }
+    // Pays a script the wallet watches without holding its keys
+    bool IsWatchOnly(const CTxOut& txout) const
+    {
+        return HaveWatchOnly(txout.scriptPubKey);
+    }
+    // Spends an output of a watch-only script
+    bool IsFromWatchOnly(const CTransaction& tx) const;
     int64_t GetCredit(const CTxOut& txout) const
     {
         if (!MoneyRange(txout.nValue))
@@ -313,10 +436,11 @@ public:
             throw std::runtime_error("CWallet::GetChange() : value out of range");
         return (IsChange(txout) ? txout.nValue : 0);
     }
+    // Pays the wallet, or a script it watches
     bool IsMine(const CTransaction& tx) const
     {
         BOOST_FOREACH(const CTxOut& txout, tx.vout)
-            if (IsMine(txout))
+            if (IsMine(txout) || IsWatchOnly(txout))
                 return true;
         return false;
     }
@@ -386,6 +510,14 @@ public:
 
     bool SetDefaultKey(const CPubKey &vchPubKey);
 
+    // Derive new keys from the seed key, which is added to the wallet. The
+    // wallet can then be restored from a backup of the seed alone.
+    bool SetHDMasterKey(const CKey& key);
+    // Set the HD chain, and write it to the wallet unless memonly
+    bool SetHDChain(const CHDChain& chain, bool memonly);
+    const CHDChain& GetHDChain() const { return hdChain; }
+    bool IsHDEnabled() const { return hdChain.masterKeyID != 0; }
+
     // signify that a particular wallet feature is now used. this may change nWalletVersion and nWalletMaxVersion if those are lower
     bool SetMinVersion(enum WalletFeature, CWalletDB* pwalletdbIn = NULL, bool fExplicit = false);
 
@@ -486,11 +618,15 @@ public:
     mutable bool fImmatureCreditCached;
     mutable bool fAvailableCreditCached;
     mutable bool fChangeCached;
+    mutable bool fSpentCached;
     mutable int64_t nDebitCached;
     mutable int64_t nCreditCached;
     mutable int64_t nImmatureCreditCached;
     mutable int64_t nAvailableCreditCached;
     mutable int64_t nChangeCached;
+    mutable std::vector<bool> vfSpentCached; // IsSpent of each output
+    mutable bool fBalanceSettled;         // counted in the wallet's settled balance
+    mutable int64_t nBalanceSettledCredit; // as what
 
     CWalletTx()
     {
@@ -527,11 +663,14 @@ public:
         fImmatureCreditCached = false;
         fAvailableCreditCached = false;
         fChangeCached = false;
+        fSpentCached = false;
         nDebitCached = 0;
         nCreditCached = 0;
         nImmatureCreditCached = 0;
         nAvailableCreditCached = 0;
         nChangeCached = 0;
+        fBalanceSettled = false;
+        nBalanceSettledCredit = 0;
         nOrderPos = -1;
     }
 
@@ -585,6 +724,9 @@ public:
         fAvailableCreditCached = false;
         fDebitCached = false;
         fChangeCached = false;
+        fSpentCached = false;
+        if (pwallet)
+            pwallet->MarkBalanceDirty(this);
     }
 
     void BindWallet(CWallet *pwalletIn)
@@ -632,6 +774,26 @@ public:
         return 0;
     }
 
+    // CWallet::IsSpent of output n, cached for every output until the
+    // transaction is marked dirty: adding a spend of it, or a change in a
+    // spender's conflicted state, does that. A spender dropping out of the
+    // mempool does not, so like the cached credits this may lag; coin
+    // selection asks CWallet::IsSpent instead
+    bool IsSpent(unsigned int n) const
+    {
+        if (pwallet == 0)
+            return false;
+        if (!fSpentCached)
+        {
+            uint256 hashTx = GetHash();
+            vfSpentCached.resize(vout.size());
+            for (unsigned int i = 0; i < vout.size(); i++)
+                vfSpentCached[i] = pwallet->IsSpent(hashTx, i);
+            fSpentCached = true;
+        }
+        return vfSpentCached[n];
+    }
+
     int64_t GetAvailableCredit(bool fUseCache=true) const
     {
         if (pwallet == 0)
@@ -643,12 +805,13 @@ public:
 
         if (fUseCache && fAvailableCreditCached)
             return nAvailableCreditCached;
+        if (!fUseCache)
+            fSpentCached = false;
 
         int64_t nCredit = 0;
-        uint256 hashTx = GetHash();
         for (unsigned int i = 0; i < vout.size(); i++)
         {
-            if (!pwallet->IsSpent(hashTx, i))
+            if (!IsSpent(i))
             {
                 const CTxOut &txout = vout[i];
                 nCredit += pwallet->GetCredit(txout);
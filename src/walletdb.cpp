@@ -6,11 +6,14 @@
 #include "walletdb.h"
 
 #include "base58.h"
+#include "metrics.h"
 #include "protocol.h"
 #include "serialize.h"
 #include "sync.h"
 #include "wallet.h"
+#include "workpool.h"
 
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
 
@@ -159,6 +162,18 @@ bool CWalletDB::WriteDefaultKey(const CPubKey& vchPubKey)
     return Write(std::string("defaultkey"), vchPubKey);
 }
 
+bool CWalletDB::WriteWatchOnly(const CScript& dest)
+{
+    nWalletDBUpdated++;
+    return Write(std::make_pair(std::string("watchs"), dest), '1');
+}
+
+bool CWalletDB::WriteHDChain(const CHDChain& chain)
+{
+    nWalletDBUpdated++;
+    return Write(std::string("hdchain"), chain);
+}
+
 bool CWalletDB::ReadPool(int64_t nPool, CKeyPool& keypool)
 {
     return Read(std::make_pair(std::string("pool"), nPool), keypool);
@@ -218,7 +233,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
 {
     bool fAllAccounts = (strAccount == "*");
 
-    Dbc* pcursor = GetCursor();
+    CDBCursor* pcursor = GetCursor();
     if (!pcursor)
         throw runtime_error("CWalletDB::ListAccountCreditDebit() : cannot create DB cursor");
     unsigned int fFlags = DB_SET_RANGE;
@@ -235,7 +250,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
             break;
         else if (ret != 0)
         {
-            pcursor->close();
+            delete pcursor;
             throw runtime_error("CWalletDB::ListAccountCreditDebit() : error scanning DB");
         }
 
@@ -254,7 +269,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
         entries.push_back(acentry);
     }
 
-    pcursor->close();
+    delete pcursor;
 }
 
 
@@ -348,6 +363,124 @@ public:
     }
 };
 
+// The transaction of a "tx" record and the key of a "key" or "wkey" record
+// are decoded and checked without the wallet, so that LoadWallet can do it
+// for many records in parallel; most of the time spent loading a wallet
+// goes there. ssKey is past the type of the record.
+static bool DecodeTx(CDataStream& ssKey, CDataStream& ssValue, uint256& hash, CWalletTx& wtx,
+                     bool& fUpgraded, string& strErr)
+{
+    ssKey >> hash;
+    ssValue >> wtx;
+    CValidationState state;
+    if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+        return false;
+
+    // Undo serialize changes in 31600
+    fUpgraded = false;
+    if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+    {
+        if (!ssValue.empty())
+        {
+            char fTmp;
+            char fUnused;
+            ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+            strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                               wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = fTmp;
+        }
+        else
+        {
+            strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = 0;
+        }
+        fUpgraded = true;
+    }
+    return true;
+}
+
+static void LoadDecodedTx(CWallet* pwallet, const uint256& hash, const CWalletTx& wtx, bool fUpgraded, CWalletScanState& wss)
+{
+    if (fUpgraded)
+        wss.vWalletUpgrade.push_back(hash);
+
+    if (wtx.nOrderPos == -1)
+        wss.fAnyUnordered = true;
+
+    pwallet->AddToWallet(wtx, true);
+}
+
+static bool DecodeKey(const string& strType, CDataStream& ssKey, CDataStream& ssValue, CPubKey& vchPubKey, CKey& key,
+                      string& strErr)
+{
+    ssKey >> vchPubKey;
+    if (!vchPubKey.IsValid())
+    {
+        strErr = "Error reading wallet database: CPubKey corrupt";
+        return false;
+    }
+    CPrivKey pkey;
+    uint256 hash = 0;
+
+    if (strType == "key")
+        ssValue >> pkey;
+    else {
+        CWalletKey wkey;
+        ssValue >> wkey;
+        pkey = wkey.vchPrivKey;
+    }
+
+    // Old wallets store keys as "key" [pubkey] => [privkey]
+    // ... which was slow for wallets with lots of keys, because the public key is re-derived from the private key
+    // using EC operations as a checksum.
+    // Newer wallets store keys as "key"[pubkey] => [privkey][hash(pubkey,privkey)], which is much faster while
+    // remaining backwards-compatible.
+    try
+    {
+        ssValue >> hash;
+    }
+    catch(...){}
+
+    bool fSkipCheck = false;
+
+    if (hash != 0)
+    {
+        // hash pubkey/privkey to accelerate wallet load
+        std::vector<unsigned char> vchKey;
+        vchKey.reserve(vchPubKey.size() + pkey.size());
+        vchKey.insert(vchKey.end(), vchPubKey.begin(), vchPubKey.end());
+        vchKey.insert(vchKey.end(), pkey.begin(), pkey.end());
+
+        if (Hash(vchKey.begin(), vchKey.end()) != hash)
+        {
+            strErr = "Error reading wallet database: CPubKey/CPrivKey corrupt";
+            return false;
+        }
+
+        fSkipCheck = true;
+    }
+
+    if (!key.Load(pkey, vchPubKey, fSkipCheck))
+    {
+        strErr = "Error reading wallet database: CPrivKey corrupt";
+        return false;
+    }
+    return true;
+}
+
+static bool LoadDecodedKey(CWallet* pwallet, const string& strType, const CPubKey& vchPubKey, const CKey& key,
+                           CWalletScanState& wss, string& strErr)
+{
+    if (strType == "key")
+        wss.nKeys++;
+    if (!pwallet->LoadKey(key, vchPubKey))
+    {
+        strErr = "Error reading wallet database: LoadKey failed";
+        return false;
+    }
+    return true;
+}
+
 bool
 ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
              CWalletScanState &wss, string& strType, string& strErr)
@@ -372,44 +505,11 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         else if (strType == "tx")
         {
             uint256 hash;
-            ssKey >> hash;
             CWalletTx wtx;
-            ssValue >> wtx;
-            CValidationState state;
-            if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+            bool fUpgraded;
+            if (!DecodeTx(ssKey, ssValue, hash, wtx, fUpgraded, strErr))
                 return false;
-
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-            {
-                if (!ssValue.empty())
-                {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                                       wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                }
-                else
-                {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
-                wss.vWalletUpgrade.push_back(hash);
-            }
-
-            if (wtx.nOrderPos == -1)
-                wss.fAnyUnordered = true;
-
-            pwallet->AddToWallet(wtx, true);
-            //// debug print
-            //LogPrintf("LoadWallet  %s\n", wtx.GetHash().ToString());
-            //LogPrintf(" %12d  %s  %s  %s\n",
-            //    wtx.vout[0].nValue,
-            //    DateTimeStrFormat("%Y-%m-%d %H:%M:%S", wtx.GetBlockTime()),
-            //    wtx.hashBlock.ToString(),
-            //    wtx.mapValue["message"]);
+            LoadDecodedTx(pwallet, hash, wtx, fUpgraded, wss);
         }
         else if (strType == "acentry")
         {
@@ -431,66 +531,11 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         else if (strType == "key" || strType == "wkey")
         {
             CPubKey vchPubKey;
-            ssKey >> vchPubKey;
-            if (!vchPubKey.IsValid())
-            {
-                strErr = "Error reading wallet database: CPubKey corrupt";
-                return false;
-            }
             CKey key;
-            CPrivKey pkey;
-            uint256 hash = 0;
-
-            if (strType == "key")
-            {
-                wss.nKeys++;
-                ssValue >> pkey;
-            } else {
-                CWalletKey wkey;
-                ssValue >> wkey;
-                pkey = wkey.vchPrivKey;
-            }
-
-            // Old wallets store keys as "key" [pubkey] => [privkey]
-            // ... which was slow for wallets with lots of keys, because the public key is re-derived from the private key
-            // using EC operations as a checksum.
-            // Newer wallets store keys as "key"[pubkey] => [privkey][hash(pubkey,privkey)], which is much faster while
-            // remaining backwards-compatible.
-            try
-            {
-                ssValue >> hash;
-            }
-            catch(...){}
-
-            bool fSkipCheck = false;
-
-            if (hash != 0)
-            {
-                // hash pubkey/privkey to accelerate wallet load
-                std::vector<unsigned char> vchKey;
-                vchKey.reserve(vchPubKey.size() + pkey.size());
-                vchKey.insert(vchKey.end(), vchPubKey.begin(), vchPubKey.end());
-                vchKey.insert(vchKey.end(), pkey.begin(), pkey.end());
-
-                if (Hash(vchKey.begin(), vchKey.end()) != hash)
-                {
-                    strErr = "Error reading wallet database: CPubKey/CPrivKey corrupt";
-                    return false;
-                }
-
-                fSkipCheck = true;
-            }
-
-            if (!key.Load(pkey, vchPubKey, fSkipCheck))
-            {
-                strErr = "Error reading wallet database: CPrivKey corrupt";
+            if (!DecodeKey(strType, ssKey, ssValue, vchPubKey, key, strErr))
                 return false;
-            }
-            if (!pwallet->LoadKey(key, vchPubKey))
-            {
-                strErr = "Error reading wallet database: LoadKey failed";
+            if (!LoadDecodedKey(pwallet, strType, vchPubKey, key, wss, strErr))
                 return false;
-            }
         }
         else if (strType == "mkey")
         {
@@ -574,6 +619,21 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
                 return false;
             }
         }
+        else if (strType == "watchs")
+        {
+            CScript script;
+            ssKey >> script;
+            char fYes;
+            ssValue >> fYes;
+            if (fYes == '1')
+                pwallet->LoadWatchOnly(script);
+        }
+        else if (strType == "hdchain")
+        {
+            CHDChain chain;
+            ssValue >> chain;
+            pwallet->SetHDChain(chain, true);
+        }
         else if (strType == "orderposnext")
         {
             ssValue >> pwallet->nOrderPosNext;
@@ -625,6 +685,64 @@ static bool IsKeyType(string strType)
             strType == "mkey" || strType == "ckey");
 }
 
+/** A record read by LoadWallet, with its transaction or key once decoded */
+class CWalletRecord
+{
+public:
+    CDataStream ssKey;
+    CDataStream ssValue;
+    bool fDecoded;
+    bool fValid;
+    string strType;
+    string strErr;
+
+    uint256 hash;       // "tx"
+    CWalletTx wtx;
+    bool fUpgraded;
+    CPubKey vchPubKey;  // "key", "wkey"
+    CKey key;
+
+    CWalletRecord() : ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION),
+                      fDecoded(false), fValid(false), fUpgraded(false) {}
+};
+
+static void DecodeRecords(vector<CWalletRecord>* pvRecords, unsigned int nBegin, unsigned int nEnd)
+{
+    for (unsigned int i = nBegin; i < nEnd; i++)
+    {
+        CWalletRecord& rec = (*pvRecords)[i];
+        try {
+            // The key is left for ReadKeyValue if the record is not decoded
+            CDataStream ssKey(rec.ssKey);
+            ssKey >> rec.strType;
+            if (rec.strType == "tx")
+                rec.fValid = DecodeTx(ssKey, rec.ssValue, rec.hash, rec.wtx, rec.fUpgraded, rec.strErr);
+            else if (rec.strType == "key" || rec.strType == "wkey")
+                rec.fValid = DecodeKey(rec.strType, ssKey, rec.ssValue, rec.vchPubKey, rec.key, rec.strErr);
+            else
+                continue;
+        } catch (...) {
+            rec.fValid = false;
+        }
+        rec.fDecoded = true;
+    }
+}
+
+static bool LoadDecodedRecord(CWallet* pwallet, const CWalletRecord& rec, CWalletScanState& wss,
+                              string& strType, string& strErr)
+{
+    strType = rec.strType;
+    strErr = rec.strErr;
+    if (!rec.fValid)
+        return false;
+    if (strType == "tx")
+    {
+        LoadDecodedTx(pwallet, rec.hash, rec.wtx, rec.fUpgraded, wss);
+        return true;
+    }
+    return LoadDecodedKey(pwallet, strType, rec.vchPubKey, rec.key, wss, strErr);
+}
+
 DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
@@ -643,48 +761,72 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             LogPrintf("Error getting wallet database cursor\n");
             return DB_CORRUPT;
         }
 
-        while (true)
+        // Records are read in batches, whose transactions and keys are
+        // decoded by the pool before the batch is loaded in order
+        CWorkPool pool(TASK_BACKGROUND);
+        vector<CWalletRecord> vRecords;
+        vRecords.reserve(WALLET_LOAD_BATCH_RECORDS);
+        bool fLast = false;
+        while (!fLast)
         {
-            // Read next record
-            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
-            if (ret == DB_NOTFOUND)
-                break;
-            else if (ret != 0)
+            // Read next records
+            vRecords.clear();
+            while (vRecords.size() < WALLET_LOAD_BATCH_RECORDS)
             {
-                LogPrintf("Error reading next record from wallet database\n");
-                return DB_CORRUPT;
+                vRecords.push_back(CWalletRecord());
+                CWalletRecord& rec = vRecords.back();
+                int ret = ReadAtCursor(pcursor, rec.ssKey, rec.ssValue);
+                if (ret == DB_NOTFOUND)
+                {
+                    vRecords.pop_back();
+                    fLast = true;
+                    break;
+                }
+                else if (ret != 0)
+                {
+                    LogPrintf("Error reading next record from wallet database\n");
+                    return DB_CORRUPT;
+                }
             }
 
-            // Try to be tolerant of single corrupt records:
-            string strType, strErr;
-            if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr))
+            if (nScriptCheckThreads == 0)
+                DecodeRecords(&vRecords, 0, vRecords.size());
+            else
+                pool.ForEachRange(vRecords.size(), nScriptCheckThreads, boost::bind(DecodeRecords, &vRecords, _1, _2));
+
+            BOOST_FOREACH(CWalletRecord& rec, vRecords)
             {
-                // losing keys is considered a catastrophic error, anything else
-                // we assume the user can live with:
-                if (IsKeyType(strType))
-                    result = DB_CORRUPT;
-                else
+                // Try to be tolerant of single corrupt records:
+                string strType, strErr;
+                bool fReadOK = rec.fDecoded ? LoadDecodedRecord(pwallet, rec, wss, strType, strErr) :
+                                              ReadKeyValue(pwallet, rec.ssKey, rec.ssValue, wss, strType, strErr);
+                if (!fReadOK)
                 {
-                    // Leave other errors alone, if we try to fix them we might make things worse.
-                    fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
-                    if (strType == "tx")
-                        // Rescan if there is a bad transaction record:
-                        SoftSetBoolArg("-rescan", true);
+                    // losing keys is considered a catastrophic error, anything else
+                    // we assume the user can live with:
+                    if (IsKeyType(strType))
+                        result = DB_CORRUPT;
+                    else
+                    {
+                        // Leave other errors alone, if we try to fix them we might make things worse.
+                        fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
+                        if (strType == "tx")
+                            // Rescan if there is a bad transaction record:
+                            SoftSetBoolArg("-rescan", true);
+                    }
                 }
+                if (!strErr.empty())
+                    LogPrintf("%s\n", strErr);
             }
-            if (!strErr.empty())
-                LogPrintf("%s\n", strErr);
         }
-        pcursor->close();
+        delete pcursor;
     }
     catch (boost::thread_interrupted) {
         throw;
@@ -744,7 +886,7 @@ DBErrors CWalletDB::FindWalletTx(CWallet* pwallet, vector<uint256>& vTxHash)
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             LogPrintf("Error getting wallet database cursor\n");
@@ -774,7 +916,7 @@ DBErrors CWalletDB::FindWalletTx(CWallet* pwallet, vector<uint256>& vTxHash)
                 vTxHash.push_back(hash);
             }
         }
-        pcursor->close();
+        delete pcursor;
     }
     catch (boost::thread_interrupted) {
         throw;
@@ -797,9 +939,12 @@ DBErrors CWalletDB::ZapWalletTx(CWallet* pwallet)
     if (err != DB_LOAD_OK)
         return err;
 
-    // erase each wallet TX
+    // erase each wallet TX, in one database transaction through a handle
+    // opened within it
+    CDBBatch batch(strFile.c_str());
+    CWalletDB walletdb(strFile);
     BOOST_FOREACH (uint256& hash, vTxHash) {
-        if (!EraseTx(hash))
+        if (!walletdb.EraseTx(hash))
             return DB_CORRUPT;
     }
 
@@ -817,6 +962,9 @@ void ThreadFlushWalletDB(const string& strFile)
     fOneThread = true;
     if (!GetBoolArg("-flushwallet", true))
         return;
+    // The writes to a store are synced by the handles that make them
+    if (bitdb.IsStore(strFile))
+        return;
 
     unsigned int nLastSeen = nWalletDBUpdated;
     unsigned int nLastFlushed = nWalletDBUpdated;
@@ -833,35 +981,36 @@ void ThreadFlushWalletDB(const string& strFile)
 
         if (nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= 2)
         {
-            TRY_LOCK(bitdb.cs_db,lockDb);
-            if (lockDb)
+            // Decide on a copy of the use counts, so that wallet handles
+            // can be opened while the environment is checkpointed
+            map<string, int> mapFileUseCount;
             {
-                // Don't do this if any databases are in use
-                int nRefCount = 0;
-                map<string, int>::iterator mi = bitdb.mapFileUseCount.begin();
-                while (mi != bitdb.mapFileUseCount.end())
-                {
-                    nRefCount += (*mi).second;
-                    mi++;
-                }
-
-                if (nRefCount == 0)
-                {
-                    boost::this_thread::interruption_point();
-                    map<string, int>::iterator mi = bitdb.mapFileUseCount.find(strFile);
-                    if (mi != bitdb.mapFileUseCount.end())
-                    {
-                        LogPrint("db", "Flushing wallet.dat\n");
-                        nLastFlushed = nWalletDBUpdated;
-                        int64_t nStart = GetTimeMillis();
+                TRY_LOCK(bitdb.cs_db,lockDb);
+                if (!lockDb)
+                    continue;
+                mapFileUseCount = bitdb.mapFileUseCount;
+            }
 
-                        // Flush wallet.dat so it's self contained
-                        bitdb.CloseDb(strFile);
-                        bitdb.CheckpointLSN(strFile);
+            // Don't do this if any databases are in use
+            int nRefCount = 0;
+            for (map<string, int>::iterator mi = mapFileUseCount.begin(); mi != mapFileUseCount.end(); mi++)
+                nRefCount += (*mi).second;
 
-                        bitdb.mapFileUseCount.erase(mi++);
-                        LogPrint("db", "Flushed wallet.dat %dms\n", GetTimeMillis() - nStart);
-                    }
+            if (nRefCount == 0 && mapFileUseCount.count(strFile))
+            {
+                boost::this_thread::interruption_point();
+                LogPrint("db", "Flushing %s\n", strFile);
+                unsigned int nUpdated = nWalletDBUpdated;
+                int64_t nCheckpointMicros = 0;
+                int64_t nDetachMicros = 0;
+
+                // Flush wallet.dat so it's self contained
+                if (bitdb.FlushFile(strFile, nCheckpointMicros, nDetachMicros))
+                {
+                    nLastFlushed = nUpdated;
+                    RecordWalletFlushMetrics(nCheckpointMicros, nDetachMicros);
+                    LogPrint("db", "Flushed %s: checkpoint %dms, detach %dms\n", strFile,
+                             nCheckpointMicros / 1000, nDetachMicros / 1000);
                 }
             }
         }
@@ -872,6 +1021,17 @@ bool BackupWallet(const CWallet& wallet, const string& strDest)
 {
     if (!wallet.fFileBacked)
         return false;
+
+    // A store is backed up as a new store, written from a consistent view
+    // of its records while it stays in use
+    if (bitdb.IsStore(wallet.strWalletFile))
+    {
+        filesystem::path pathDest(strDest);
+        if (filesystem::is_directory(pathDest) && !filesystem::exists(pathDest / "CURRENT"))
+            pathDest /= wallet.strWalletFile + ".ldb";
+        return CDB::CopyToStore(wallet.strWalletFile, pathDest);
+    }
+
     while (true)
     {
         {
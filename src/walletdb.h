@@ -37,12 +37,47 @@ enum DBErrors
     DB_NEED_REWRITE
 };
 
-class CKeyMetadata
+/** The seed of the BIP32 chain the wallet derives its keys from, and how
+ * many keys it derived so far */
+class CHDChain
 {
 public:
     static const int CURRENT_VERSION=1;
     int nVersion;
+    uint32_t nExternalChainCounter;
+    CKeyID masterKeyID; // ID of the seed key, kept in the keystore
+
+    CHDChain()
+    {
+        SetNull();
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(this->nVersion);
+        nVersion = this->nVersion;
+        READWRITE(nExternalChainCounter);
+        READWRITE(masterKeyID);
+    )
+
+    void SetNull()
+    {
+        nVersion = CHDChain::CURRENT_VERSION;
+        nExternalChainCounter = 0;
+        masterKeyID = CKeyID();
+    }
+};
+
+class CKeyMetadata
+{
+public:
+    static const int VERSION_BASIC=1;
+    static const int VERSION_WITH_HDDATA=10;
+    static const int CURRENT_VERSION=VERSION_WITH_HDDATA;
+    int nVersion;
     int64_t nCreateTime; // 0 means unknown
+    std::string hdKeypath; // BIP32 path of a derived key, "m" for the seed
+    CKeyID hdMasterKeyID; // ID of the seed it was derived from
 
     CKeyMetadata()
     {
@@ -50,7 +85,7 @@ public:
     }
     CKeyMetadata(int64_t nCreateTime_)
     {
-        nVersion = CKeyMetadata::CURRENT_VERSION;
+        SetNull();
         nCreateTime = nCreateTime_;
     }
 
@@ -59,12 +94,19 @@ public:
         READWRITE(this->nVersion);
         nVersion = this->nVersion;
         READWRITE(nCreateTime);
+        if (this->nVersion >= VERSION_WITH_HDDATA)
+        {
+            READWRITE(hdKeypath);
+            READWRITE(hdMasterKeyID);
+        }
     )
 
     void SetNull()
     {
         nVersion = CKeyMetadata::CURRENT_VERSION;
         nCreateTime = 0;
+        hdKeypath.clear();
+        hdMasterKeyID = CKeyID();
     }
 };
 
@@ -117,6 +159,8 @@ public:
 
     bool WriteCScript(const uint160& hash, const CScript& redeemScript);
 
+    bool WriteWatchOnly(const CScript& dest);
+
     bool WriteStealthKeyMeta(const CKeyID& keyId, const CStealthKeyMetadata& sxKeyMeta);
     bool EraseStealthKeyMeta(const CKeyID& keyId);
     bool WriteStealthAddress(const CStealthAddress& sxAddr);
@@ -129,6 +173,8 @@ public:
 
     bool WriteDefaultKey(const CPubKey& vchPubKey);
 
+    bool WriteHDChain(const CHDChain& chain);
+
     bool ReadPool(int64_t nPool, CKeyPool& keypool);
     bool WritePool(int64_t nPool, const CKeyPool& keypool);
     bool ErasePool(int64_t nPool);
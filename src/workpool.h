@@ -0,0 +1,104 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_WORKPOOL_H
+#define BITCOIN_WORKPOOL_H
+
+#include "scheduler.h"
+
+#include <algorithm>
+#include <deque>
+
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+/** The jobs of a pipeline (block import, wallet rescan), run by the threads
+ *  of the shared CTaskScheduler at one priority. Also tracks the completion
+ *  of those jobs, as the pipeline waits for them in order: each job sets its
+ *  own done flag through MarkDone. A thread waiting for a job runs the
+ *  pool's queued jobs itself meanwhile. */
+class CWorkPool
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condDone;
+    int nPriority;
+    // Jobs submitted so far, to wake waiters that can run them
+    unsigned int nSubmitted;
+
+public:
+    explicit CWorkPool(int nPriorityIn) : nPriority(nPriorityIn), nSubmitted(0) {}
+
+    // Jobs that did not start are dropped; running ones are waited for.
+    ~CWorkPool()
+    {
+        taskScheduler.Cancel(this);
+    }
+
+    void Submit(const boost::function<void()> &job)
+    {
+        taskScheduler.Submit(job, nPriority, this);
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nSubmitted++;
+        condDone.notify_all();
+    }
+
+    void MarkDone(bool &fDone)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fDone = true;
+        condDone.notify_all();
+    }
+
+    bool IsDone(const bool &fDone)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return fDone;
+    }
+
+    void WaitDone(const bool &fDone)
+    {
+        while (true)
+        {
+            unsigned int nSubmittedBefore;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                if (fDone)
+                    return;
+                nSubmittedBefore = nSubmitted;
+            }
+            if (taskScheduler.RunQueued(this))
+                continue;
+            // The rest are running; sleep until one is done or a job is added
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (!fDone && nSubmitted == nSubmittedBefore)
+                condDone.wait(lock);
+        }
+    }
+
+    // Run fn(nBegin, nEnd) on nRanges consecutive ranges covering
+    // [0, nCount), and wait for all of them
+    void ForEachRange(unsigned int nCount, unsigned int nRanges, const boost::function<void(unsigned int, unsigned int)> &fn)
+    {
+        nRanges = std::max(1U, std::min(nRanges, nCount));
+        unsigned int nPerRange = (nCount + nRanges - 1) / nRanges;
+        std::deque<bool> vDone;
+        for (unsigned int nBegin = 0; nBegin < nCount; nBegin += nPerRange)
+        {
+            vDone.push_back(false);
+            Submit(boost::bind(&CWorkPool::RunRange, this, fn, nBegin, std::min(nBegin + nPerRange, nCount), &vDone.back()));
+        }
+        for (unsigned int i = 0; i < vDone.size(); i++)
+            WaitDone(vDone[i]);
+    }
+
+private:
+    void RunRange(const boost::function<void(unsigned int, unsigned int)> &fn, unsigned int nBegin, unsigned int nEnd, bool *pfDone)
+    {
+        fn(nBegin, nEnd);
+        MarkDone(*pfDone);
+    }
+};
+
+#endif // BITCOIN_WORKPOOL_H